@@ -0,0 +1,98 @@
+#ifndef __V4V_H__
+#define __V4V_H__
+
+#include <mini-os/types.h>
+#include <mini-os/wait.h>
+#include <xen/v4v.h>
+
+/*
+ * Interdomain messages through the hypervisor's v4v rings, without grant
+ * mappings. The domain has one v4v event channel, on which xen signals
+ * all of its rings: waiters sleep on v4v_waitq and look at their ring
+ * again when woken.
+ */
+struct v4v_ring_handle {
+    v4v_ring_t *ring;
+    uint32_t len;       /* bytes of ring->ring[] */
+    uint32_t align;     /* message alignment, 1 for a stream ring */
+    int order;          /* of the pages the ring is in */
+    uint32_t npage;
+    v4v_pfn_t *pfns;
+};
+
+extern struct wait_queue_head v4v_waitq;
+
+#ifdef CONFIG_V4V
+/* Bind the v4v event channel. Returns 0 or -errno (-ENOSYS without v4v) */
+int init_v4v(void);
+void fini_v4v(void);
+#else
+static inline int init_v4v(void)
+{
+    return 0;
+}
+static inline void fini_v4v(void)
+{
+}
+#endif
+
+/* The domain's v4v info, valid once init_v4v() returned 0. */
+const v4v_info_t *v4v_info(void);
+
+/*
+ * Register a ring of len bytes for port. partner is the only domain that
+ * may send to it, or V4V_DOMID_ANY. flags are V4V_RING_F_*; a stream ring
+ * (V4V_RING_F_STREAM) needs a partner. Returns NULL on failure.
+ */
+struct v4v_ring_handle *v4v_register_ring(uint32_t port, domid_t partner,
+                                          uint32_t len, uint32_t flags);
+void v4v_unregister_ring(struct v4v_ring_handle *h);
+
+/*
+ * Only let the nsrc senders in src send to h, see V4VOP_ring_sources. An
+ * nsrc of 0 lets anyone send again. Returns 0 or -errno.
+ */
+int v4v_ring_sources(struct v4v_ring_handle *h, const v4v_addr_t *src,
+                     uint32_t nsrc);
+
+/*
+ * Send niov buffers as one message of message_type from src->port to dst.
+ * Returns the bytes sent, -EAGAIN if dst has no room for it yet (v4v_waitq
+ * is woken once it has), or another -errno. To a stream ring only what
+ * fits is sent, check the return value.
+ */
+int v4v_sendv(const v4v_addr_t *src, const v4v_addr_t *dst,
+              const v4v_iov_t *iov, uint32_t niov, uint32_t message_type);
+int v4v_send(const v4v_addr_t *src, const v4v_addr_t *dst,
+             const void *buf, uint32_t len, uint32_t message_type);
+
+/*
+ * Send nent messages described by ent[] in one hypercall, see
+ * V4VOP_sendv_batch. Returns the number sent or -errno, with each
+ * ent[i].status set.
+ */
+int v4v_sendv_batch(v4v_send_batch_ent_t *ent, const v4v_iov_t *iov,
+                    uint32_t nent);
+
+/*
+ * Ask xen whether dst has room for space_required bytes, see V4VOP_notify.
+ * Returns 1 if it has, 0 if not (v4v_waitq is woken once it has), or
+ * -errno, -ENOENT if there is no such ring.
+ */
+int v4v_notify_space(const v4v_addr_t *dst, uint32_t space_required);
+
+/* Bytes waiting in the ring, 0 if none. */
+uint32_t v4v_data_ready(struct v4v_ring_handle *h);
+
+/*
+ * Take the next message off a datagram ring, copying up to size bytes of
+ * it to buf. Returns the full length of the message, 0 if the ring is
+ * empty, or -EBADMSG if the ring is corrupt.
+ */
+int v4v_recv(struct v4v_ring_handle *h, void *buf, uint32_t size,
+             v4v_addr_t *source, uint32_t *message_type);
+
+/* Take up to size bytes off a stream ring. Returns how many, 0 if none. */
+int v4v_stream_read(struct v4v_ring_handle *h, void *buf, uint32_t size);
+
+#endif /* __V4V_H__ */
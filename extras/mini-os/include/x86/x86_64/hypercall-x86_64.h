@@ -331,6 +331,13 @@ HYPERVISOR_domctl(
 	return _hypercall1(int, domctl, op);
 }
 
+static inline int
+HYPERVISOR_v4v_op(
+	int cmd, void *arg1, void *arg2, uint32_t arg3, uint32_t arg4)
+{
+	return _hypercall5(int, v4v_op, cmd, arg1, arg2, arg3, arg4);
+}
+
 #endif /* __HYPERCALL_X86_64_H__ */
 
 /*
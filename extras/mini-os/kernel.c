@@ -42,6 +42,7 @@
 #include <mini-os/blkfront.h>
 #include <mini-os/fbfront.h>
 #include <mini-os/pcifront.h>
+#include <mini-os/v4v.h>
 #include <mini-os/xmalloc.h>
 #include <fcntl.h>
 #include <xen/features.h>
@@ -140,6 +141,9 @@ void start_kernel(void)
     /* Init scheduler. */
     init_sched();
  
+    /* Init v4v */
+    init_v4v();
+
     /* Init XenBus */
     init_xenbus();
 
@@ -0,0 +1,347 @@
+/*
+ * v4v.c
+ *
+ * Rings registered with the hypervisor's v4v, the v4v event channel, and
+ * sending and receiving through them. Rings are read in place, messages
+ * are sent by hypercall: no grants are set up with the other end.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <mini-os/os.h>
+#include <mini-os/lib.h>
+#include <mini-os/mm.h>
+#include <mini-os/events.h>
+#include <mini-os/xmalloc.h>
+#include <mini-os/v4v.h>
+#include <errno.h>
+
+#ifdef V4V_DEBUG
+#define DEBUG(_f, _a...) \
+    printk("MINI_OS(file=v4v.c, line=%d) " _f , __LINE__, ## _a)
+#else
+#define DEBUG(_f, _a...)    ((void)0)
+#endif
+
+#define RING_ROUNDUP(_h, _x) (((_x) + (_h)->align - 1) & ~((_h)->align - 1))
+
+DECLARE_WAIT_QUEUE_HEAD(v4v_waitq);
+
+static v4v_info_t info;
+static int bound;
+
+static void v4v_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
+{
+    wake_up(&v4v_waitq);
+}
+
+int init_v4v(void)
+{
+    int ret;
+
+    if (bound) {
+        unmask_evtchn(info.evtchn);
+        return 0;
+    }
+
+    ret = HYPERVISOR_v4v_op(V4VOP_info, &info, NULL, 0, 0);
+    if (ret < 0) {
+        printk("v4v: no v4v in this hypervisor (%d)\n", ret);
+        return ret;
+    }
+    if (info.ring_magic != V4V_RING_MAGIC) {
+        printk("v4v: unexpected ring magic %lx\n",
+               (unsigned long)info.ring_magic);
+        return -ENOSYS;
+    }
+
+    bind_evtchn(info.evtchn, v4v_handler, NULL);
+    unmask_evtchn(info.evtchn);
+    bound = 1;
+    printk("v4v initialised on port %u\n", info.evtchn);
+    return 0;
+}
+
+/*
+ * The port is v4v's, closing it with unbind_evtchn() would leave the
+ * domain without one: it is only masked, until init_v4v() again.
+ */
+void fini_v4v(void)
+{
+    if (bound)
+        mask_evtchn(info.evtchn);
+}
+
+const v4v_info_t *v4v_info(void)
+{
+    return &info;
+}
+
+struct v4v_ring_handle *v4v_register_ring(uint32_t port, domid_t partner,
+                                          uint32_t len, uint32_t flags)
+{
+    struct v4v_ring_handle *h;
+    unsigned long va;
+    uint32_t i;
+    int ret;
+
+    if (!len || ((flags & V4V_RING_F_STREAM) && partner == V4V_DOMID_ANY))
+        return NULL;
+
+    h = xmalloc(struct v4v_ring_handle);
+    if (!h)
+        return NULL;
+    memset(h, 0, sizeof(*h));
+    h->len = len;
+    h->align = (flags & V4V_RING_F_STREAM) ? 1 : V4V_RING_MSG_ALIGN(flags);
+    if (len % h->align)
+        goto fail;
+
+    h->order = get_order(sizeof(v4v_ring_t) + len);
+    h->npage = 1U << h->order;
+    va = alloc_pages(h->order);
+    if (!va)
+        goto fail;
+    memset((void *)va, 0, h->npage * PAGE_SIZE);
+    h->ring = (v4v_ring_t *)va;
+
+    h->pfns = xmalloc_array(v4v_pfn_t, h->npage);
+    if (!h->pfns)
+        goto fail_pages;
+    for (i = 0; i < h->npage; i++)
+        h->pfns[i] = virt_to_mfn(va + i * PAGE_SIZE);
+
+    h->ring->magic = V4V_RING_MAGIC;
+    h->ring->id.addr.port = port;
+    h->ring->id.addr.domain = DOMID_SELF;
+    h->ring->id.partner = partner;
+    h->ring->len = len;
+    h->ring->flags = flags;
+
+    ret = HYPERVISOR_v4v_op(V4VOP_register_ring, h->ring, h->pfns,
+                            h->npage, 0);
+    if (ret < 0) {
+        printk("v4v: registering ring %u for %u failed (%d)\n",
+               port, partner, ret);
+        goto fail_pfns;
+    }
+    DEBUG("ring %u for %u: %u bytes at %p\n", port, partner, len, h->ring);
+    return h;
+
+fail_pfns:
+    xfree(h->pfns);
+fail_pages:
+    free_pages(h->ring, h->order);
+fail:
+    xfree(h);
+    return NULL;
+}
+
+void v4v_unregister_ring(struct v4v_ring_handle *h)
+{
+    int ret;
+
+    ret = HYPERVISOR_v4v_op(V4VOP_unregister_ring, h->ring, NULL, 0, 0);
+    if (ret < 0)
+        printk("v4v: unregistering ring %u failed (%d)\n",
+               h->ring->id.addr.port, ret);
+    xfree(h->pfns);
+    free_pages(h->ring, h->order);
+    xfree(h);
+}
+
+int v4v_ring_sources(struct v4v_ring_handle *h, const v4v_addr_t *src,
+                     uint32_t nsrc)
+{
+    return HYPERVISOR_v4v_op(V4VOP_ring_sources, h->ring, (void *)src,
+                             nsrc, 0);
+}
+
+int v4v_sendv(const v4v_addr_t *src, const v4v_addr_t *dst,
+              const v4v_iov_t *iov, uint32_t niov, uint32_t message_type)
+{
+    v4v_send_addr_t addr;
+
+    addr.src = *src;
+    addr.dst = *dst;
+    return HYPERVISOR_v4v_op(V4VOP_sendv, &addr, (void *)iov, niov,
+                             message_type);
+}
+
+int v4v_send(const v4v_addr_t *src, const v4v_addr_t *dst,
+             const void *buf, uint32_t len, uint32_t message_type)
+{
+    v4v_iov_t iov;
+
+    iov.iov_base = (uintptr_t)buf;
+    iov.iov_len = len;
+    iov.pad = 0;
+    return v4v_sendv(src, dst, &iov, 1, message_type);
+}
+
+int v4v_sendv_batch(v4v_send_batch_ent_t *ent, const v4v_iov_t *iov,
+                    uint32_t nent)
+{
+    return HYPERVISOR_v4v_op(V4VOP_sendv_batch, ent, (void *)iov, nent, 0);
+}
+
+int v4v_notify_space(const v4v_addr_t *dst, uint32_t space_required)
+{
+    struct {
+        v4v_ring_data_t hdr;
+        v4v_ring_data_ent_t ent;
+    } data;
+    int ret;
+
+    memset(&data, 0, sizeof(data));
+    data.hdr.magic = V4V_RING_DATA_MAGIC;
+    data.hdr.nent = 1;
+    data.ent.ring = *dst;
+    data.ent.space_required = space_required;
+
+    ret = HYPERVISOR_v4v_op(V4VOP_notify, &data, NULL, 0, 0);
+    if (ret < 0)
+        return ret;
+    if (!(data.ent.flags & V4V_RING_DATA_F_EXISTS))
+        return -ENOENT;
+    return !!(data.ent.flags & V4V_RING_DATA_F_SUFFICIENT);
+}
+
+static inline uint32_t ring_tx_ptr(struct v4v_ring_handle *h)
+{
+    return *(volatile uint32_t *)&h->ring->tx_ptr;
+}
+
+static inline uint32_t ring_wrap(struct v4v_ring_handle *h, uint32_t ptr)
+{
+    return (ptr >= h->len) ? (ptr - h->len) : ptr;
+}
+
+static inline uint32_t ring_used(struct v4v_ring_handle *h, uint32_t rx_ptr,
+                                 uint32_t tx_ptr)
+{
+    return (tx_ptr >= rx_ptr) ? (tx_ptr - rx_ptr)
+                              : (tx_ptr + h->len - rx_ptr);
+}
+
+/* copy len bytes of the ring at ptr, which may wrap, to buf */
+static void ring_copy(struct v4v_ring_handle *h, void *buf, uint32_t ptr,
+                      uint32_t len)
+{
+    uint32_t chunk = h->len - ptr;
+
+    if (chunk >= len) {
+        memcpy(buf, &h->ring->ring[ptr], len);
+        return;
+    }
+    memcpy(buf, &h->ring->ring[ptr], chunk);
+    memcpy((uint8_t *)buf + chunk, h->ring->ring, len - chunk);
+}
+
+/*
+ * Give the space up to rx_ptr back. Xen doesn't see rx_ptr move, senders
+ * waiting for room are only woken by V4VOP_notify: once the ring was
+ * half full, or once it is drained, is often enough.
+ */
+static void ring_consume(struct v4v_ring_handle *h, uint32_t used,
+                         uint32_t rx_ptr)
+{
+    /* done reading before giving the space back */
+    mb();
+    *(volatile uint32_t *)&h->ring->rx_ptr = rx_ptr;
+
+    if ((used > h->len / 2) || (rx_ptr == ring_tx_ptr(h)))
+        HYPERVISOR_v4v_op(V4VOP_notify, NULL, &h->ring->id, 0, 0);
+}
+
+uint32_t v4v_data_ready(struct v4v_ring_handle *h)
+{
+    uint32_t rx_ptr = h->ring->rx_ptr;
+
+    if (rx_ptr >= h->len)
+        return 0;
+    return ring_used(h, rx_ptr, ring_tx_ptr(h));
+}
+
+int v4v_recv(struct v4v_ring_handle *h, void *buf, uint32_t size,
+             v4v_addr_t *source, uint32_t *message_type)
+{
+    struct v4v_ring_message_header mh;
+    uint32_t rx_ptr, tx_ptr, avail, ptr, len, next;
+
+    for (;;) {
+        rx_ptr = h->ring->rx_ptr;
+        tx_ptr = ring_tx_ptr(h);
+        if (rx_ptr == tx_ptr)
+            return 0;
+        /* read tx_ptr before the messages */
+        rmb();
+
+        if ((rx_ptr >= h->len) || (RING_ROUNDUP(h, rx_ptr) != rx_ptr) ||
+            (tx_ptr >= h->len))
+            return -EBADMSG;
+
+        avail = ring_used(h, rx_ptr, tx_ptr);
+        if (avail < sizeof(mh))
+            return -EBADMSG;
+        ring_copy(h, &mh, rx_ptr, sizeof(mh));
+        if ((mh.len < sizeof(mh)) || (RING_ROUNDUP(h, mh.len) > avail))
+            return -EBADMSG;
+
+        next = ring_wrap(h, rx_ptr + RING_ROUNDUP(h, mh.len));
+        if (!(mh.flags & V4V_MSG_F_DISCARD))
+            break;
+        ring_consume(h, avail, next);
+    }
+
+    ptr = ring_wrap(h, rx_ptr + sizeof(mh));
+    len = mh.len - sizeof(mh);
+    if (mh.flags & V4V_MSG_F_TSTAMP) {
+        if (len < sizeof(uint64_t))
+            return -EBADMSG;
+        ptr = ring_wrap(h, ptr + sizeof(uint64_t));
+        len -= sizeof(uint64_t);
+    }
+
+    ring_copy(h, buf, ptr, (size < len) ? size : len);
+    if (source)
+        *source = mh.source;
+    if (message_type)
+        *message_type = mh.message_type;
+
+    ring_consume(h, avail, next);
+    return len;
+}
+
+int v4v_stream_read(struct v4v_ring_handle *h, void *buf, uint32_t size)
+{
+    uint32_t rx_ptr, tx_ptr, avail, len;
+
+    rx_ptr = h->ring->rx_ptr;
+    tx_ptr = ring_tx_ptr(h);
+    if (rx_ptr == tx_ptr || rx_ptr >= h->len || tx_ptr >= h->len)
+        return 0;
+    rmb();
+
+    avail = ring_used(h, rx_ptr, tx_ptr);
+    len = (size < avail) ? size : avail;
+    ring_copy(h, buf, rx_ptr, len);
+    ring_consume(h, avail, ring_wrap(h, rx_ptr + len));
+    return len;
+}
@@ -28,6 +28,9 @@
 #include <xen/io/xs_wire.h>
 #include <mini-os/spinlock.h>
 #include <mini-os/xmalloc.h>
+#ifdef CONFIG_XENBUS_V4V
+#include <mini-os/v4v.h>
+#endif
 
 #define min(x,y) ({                       \
         typeof(x) tmpx = (x);                 \
@@ -192,6 +195,28 @@ char *xenbus_wait_for_state_change(const char* path, XenbusState *state, xenbus_
 }
 
 
+/* Hand a watch event to the queue of the watch it is for. */
+static void xenbus_queue_event(struct xenbus_event *event)
+{
+    xenbus_event_queue *events = NULL;
+    struct watch *watch;
+
+    for (watch = watches; watch; watch = watch->next)
+        if (!strcmp(watch->token, event->token)) {
+            events = watch->events;
+            break;
+        }
+
+    if (events) {
+        event->next = *events;
+        *events = event;
+        wake_up(&xenbus_watch_queue);
+    } else {
+        printk("unexpected watch token %s\n", event->token);
+        free(event);
+    }
+}
+
 static void xenbus_thread_func(void *ign)
 {
     struct xsd_sockmsg msg;
@@ -225,9 +250,7 @@ static void xenbus_thread_func(void *ign)
             if(msg.type == XS_WATCH_EVENT)
             {
 		struct xenbus_event *event = malloc(sizeof(*event) + msg.len);
-                xenbus_event_queue *events = NULL;
 		char *data = (char*)event + sizeof(*event);
-                struct watch *watch;
 
                 memcpy_from_ring(xenstore_buf->rsp,
 		    data,
@@ -239,20 +262,7 @@ static void xenbus_thread_func(void *ign)
 
                 xenstore_buf->rsp_cons += msg.len + sizeof(msg);
 
-                for (watch = watches; watch; watch = watch->next)
-                    if (!strcmp(watch->token, event->token)) {
-                        events = watch->events;
-                        break;
-                    }
-
-                if (events) {
-                    event->next = *events;
-                    *events = event;
-                    wake_up(&xenbus_watch_queue);
-                } else {
-                    printk("unexpected watch token %s\n", event->token);
-                    free(event);
-                }
+                xenbus_queue_event(event);
             }
 
             else
@@ -325,6 +335,137 @@ static int allocate_xenbus_id(void)
     return o_probe;
 }
 
+#ifdef CONFIG_XENBUS_V4V
+/*
+ * xenstore over v4v, if the store offers it: the domain's v4v-xenstore
+ * key then holds "<domid>:<port>" of the store's v4v ring. Requests are
+ * sent to it as datagrams, and the replies come back on a stream ring of
+ * ours on the same port, partnered with the store. This saves the store
+ * mapping and polling our page. Requests sent over the page before the
+ * switch are answered there, and watches set then fire there, so the
+ * page keeps being read from as well.
+ */
+#define XB_V4V_RING_LEN (2 * PAGE_SIZE - sizeof(v4v_ring_t))
+
+static struct v4v_ring_handle *xb_v4v_ring;
+static v4v_addr_t xb_v4v_store;
+static int xb_v4v_up;
+
+static void xb_v4v_read(void *buf, uint32_t len)
+{
+    uint32_t got = 0;
+
+    while (got < len) {
+        wait_event(v4v_waitq, v4v_data_ready(xb_v4v_ring));
+        got += v4v_stream_read(xb_v4v_ring, (char *)buf + got, len - got);
+    }
+}
+
+static void xenbus_v4v_thread_func(void *ign)
+{
+    struct xsd_sockmsg msg, *rep;
+
+    for (;;) {
+        xb_v4v_read(&msg, sizeof(msg));
+        if (msg.len > XENSTORE_PAYLOAD_MAX ||
+            (msg.type != XS_WATCH_EVENT && msg.req_id >= NR_REQS)) {
+            /* out of step with the store, new requests use the page */
+            printk("xenbus: bad v4v message type %d id %d len %d\n",
+                   msg.type, msg.req_id, msg.len);
+            xb_v4v_up = 0;
+            return;
+        }
+
+        if (msg.type == XS_WATCH_EVENT) {
+            struct xenbus_event *event = malloc(sizeof(*event) + msg.len + 1);
+            char *data = (char *)event + sizeof(*event);
+
+            xb_v4v_read(data, msg.len);
+            data[msg.len] = 0;
+            event->path = data;
+            event->token = event->path + strlen(event->path) + 1;
+            xenbus_queue_event(event);
+        } else {
+            rep = malloc(sizeof(msg) + msg.len);
+            memcpy(rep, &msg, sizeof(msg));
+            xb_v4v_read(rep + 1, msg.len);
+            req_info[msg.req_id].reply = rep;
+            wake_up(&req_info[msg.req_id].waitq);
+        }
+    }
+}
+
+/*
+ * Send a request over v4v, as one datagram: requests from several
+ * threads can't mix. Returns -1 if it couldn't be sent, for the caller
+ * to use the page instead.
+ */
+static int xb_v4v_write(struct xsd_sockmsg *m, const struct write_req *req,
+                        int nr_reqs)
+{
+    v4v_addr_t src = { .port = xb_v4v_store.port, .domain = DOMID_SELF };
+    v4v_iov_t *iov = malloc(sizeof(*iov) * (nr_reqs + 1));
+    int r, ret;
+
+    iov[0].iov_base = (uintptr_t)m;
+    iov[0].iov_len = sizeof(*m);
+    iov[0].pad = 0;
+    for (r = 0; r < nr_reqs; r++) {
+        iov[r + 1].iov_base = (uintptr_t)req[r].data;
+        iov[r + 1].iov_len = req[r].len;
+        iov[r + 1].pad = 0;
+    }
+
+    for (;;) {
+        ret = v4v_sendv(&src, &xb_v4v_store, iov, nr_reqs + 1,
+                        V4V_MESSAGE_DGRAM);
+        if (ret != -EAGAIN)
+            break;
+        wait_event(v4v_waitq, v4v_notify_space(&xb_v4v_store,
+                   sizeof(*m) + m->len) != 0);
+    }
+    free(iov);
+
+    if (ret < 0) {
+        printk("xenbus: v4v send failed (%d), back to the page\n", ret);
+        xb_v4v_up = 0;
+        return -1;
+    }
+    return 0;
+}
+
+static void xenbus_v4v_setup(void *ign)
+{
+    char *val, *msg;
+    unsigned int domid, port;
+
+    msg = xenbus_read(XBT_NIL, "v4v-xenstore", &val);
+    if (msg) {
+        /* not offered */
+        free(msg);
+        return;
+    }
+    if (sscanf(val, "%u:%u", &domid, &port) != 2) {
+        printk("xenbus: bad v4v-xenstore %s\n", val);
+        free(val);
+        return;
+    }
+    free(val);
+
+    if (init_v4v())
+        return;
+    xb_v4v_ring = v4v_register_ring(port, domid, XB_V4V_RING_LEN,
+                                    V4V_RING_F_STREAM);
+    if (!xb_v4v_ring)
+        return;
+    xb_v4v_store.port = port;
+    xb_v4v_store.domain = domid;
+    create_thread("xenstore-v4v", xenbus_v4v_thread_func, NULL);
+    xb_v4v_up = 1;
+    printk("xenbus using v4v to domain %u port %u\n", domid, port);
+}
+#endif
+
 /* Initialise xenbus. */
 void init_xenbus(void)
 {
@@ -339,6 +480,9 @@ void init_xenbus(void)
     unmask_evtchn(start_info.store_evtchn);
     printk("xenbus initialised on irq %d mfn %#lx\n",
 	   err, start_info.store_mfn);
+#ifdef CONFIG_XENBUS_V4V
+    create_thread("xenstore-v4v-setup", xenbus_v4v_setup, NULL);
+#endif
 }
 
 void fini_xenbus(void)
@@ -370,6 +514,11 @@ static void xb_write(int type, int req_id, xenbus_transaction_t trans_id,
 
     cur_req = &header_req;
 
+#ifdef CONFIG_XENBUS_V4V
+    if (xb_v4v_up && !xb_v4v_write(&m, req, nr_reqs))
+        return;
+#endif
+
     BUG_ON(len > XENSTORE_RING_SIZE);
     /* Wait for the ring to drain to the point where we can send the
        message. */
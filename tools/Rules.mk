@@ -16,6 +16,7 @@ XEN_XENSTORE       = $(XEN_ROOT)/tools/xenstore
 XEN_LIBXENSTAT     = $(XEN_ROOT)/tools/xenstat/libxenstat/src
 XEN_BLKTAP2        = $(XEN_ROOT)/tools/blktap2
 XEN_LIBVCHAN       = $(XEN_ROOT)/tools/libvchan
+XEN_LIBV4V         = $(XEN_ROOT)/tools/libv4v
 
 CFLAGS_xeninclude = -I$(XEN_INCLUDE)
 
@@ -54,6 +55,10 @@ CFLAGS_libxenvchan = -I$(XEN_LIBVCHAN)
 LDLIBS_libxenvchan = $(SHLIB_libxenctrl) $(SHLIB_libxenstore) -L$(XEN_LIBVCHAN) -lxenvchan
 SHLIB_libxenvchan  = -Wl,-rpath-link=$(XEN_LIBVCHAN)
 
+CFLAGS_libxenv4v = -I$(XEN_LIBV4V)
+LDLIBS_libxenv4v = $(SHLIB_libxenctrl) -L$(XEN_LIBV4V) -lxenv4v
+SHLIB_libxenv4v  = -Wl,-rpath-link=$(XEN_LIBV4V)
+
 ifeq ($(CONFIG_Linux),y)
 LIBXL_BLKTAP ?= y
 else
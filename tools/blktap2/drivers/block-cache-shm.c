@@ -0,0 +1,505 @@
+/*
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * the host cache is one posix shared memory segment, laid out as
+ *
+ *   header | hash buckets | slots | page data
+ *
+ * each slot holds one page of one image, chained from its hash bucket.
+ * the buckets are covered by a set of striped mutexes, so that lookups
+ * from different tapdisks mostly do not contend; a lookup takes only the
+ * lock of its bucket.  eviction is by clock: a hit sets the slot's
+ * reference bit, and the hand, under the clock lock, takes the first
+ * slot it finds with the bit clear, clearing the bits it passes over.
+ * the clock lock is always taken before any bucket lock.
+ *
+ * the mutexes are robust, so a tapdisk dying with one held does not wedge
+ * the others.  a slot is filled before it is linked and unlinked before
+ * it is reused, so whatever such a tapdisk was doing leaves the chains
+ * intact.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tapdisk.h"
+#include "block-cache-shm.h"
+
+#define SHM_CACHE_MAGIC                 0x73686d63 /* "shmc" */
+#define SHM_CACHE_VERSION               1
+#define SHM_CACHE_LOCKS                 64
+#define SHM_CACHE_OPEN_RETRIES          100 /* 10ms apiece */
+
+struct shm_cache_slot {
+	shm_cache_id_t                  id;
+	uint64_t                        page;
+	uint32_t                        next;      /* slot + 1, 0 ends chain */
+	uint8_t                         ref;
+	uint8_t                         valid;
+};
+
+struct shm_cache_hdr {
+	uint32_t                        magic;
+	uint32_t                        version;
+	uint64_t                        size;
+	uint32_t                        slots;
+	uint32_t                        buckets;   /* a power of two */
+	uint64_t                        bucket_off;
+	uint64_t                        slot_off;
+	uint64_t                        data_off;
+
+	pthread_mutex_t                 clock_lock;
+	uint32_t                        hand;
+
+	pthread_mutex_t                 locks[SHM_CACHE_LOCKS];
+};
+
+static struct {
+	int                             users;
+	size_t                          size;
+	struct shm_cache_hdr           *hdr;
+	uint32_t                       *buckets;
+	struct shm_cache_slot          *slots;
+	char                           *data;
+} shm_cache;
+
+int
+shm_cache_get_id(const char *path, shm_cache_id_t *id)
+{
+	struct stat st;
+
+	if (stat(path, &st))
+		return -errno;
+
+	memset(id, 0, sizeof(*id));
+	id->dev   = st.st_dev;
+	id->ino   = st.st_ino;
+	id->size  = st.st_size;
+	id->mtime = st.st_mtime;
+
+	return 0;
+}
+
+static inline uint32_t
+shm_cache_hash(const shm_cache_id_t *id, uint64_t page)
+{
+	uint64_t h;
+
+	h  = id->ino * 0x9e3779b97f4a7c15ULL;
+	h ^= id->dev + (h << 6) + (h >> 2);
+	h ^= page * 0xc2b2ae3d27d4eb4fULL;
+	h ^= h >> 29;
+
+	return (uint32_t)h & (shm_cache.hdr->buckets - 1);
+}
+
+static inline pthread_mutex_t *
+shm_cache_bucket_lock(uint32_t bucket)
+{
+	return &shm_cache.hdr->locks[bucket & (SHM_CACHE_LOCKS - 1)];
+}
+
+static inline char *
+shm_cache_slot_data(uint32_t slot)
+{
+	return shm_cache.data + ((size_t)slot << SHM_CACHE_PAGE_SHIFT);
+}
+
+static int
+shm_cache_lock(pthread_mutex_t *lock)
+{
+	int err;
+
+	err = pthread_mutex_lock(lock);
+	if (err == EOWNERDEAD) {
+		/* the chains are kept consistent at every step */
+		pthread_mutex_consistent(lock);
+		err = 0;
+	}
+
+	return -err;
+}
+
+static inline void
+shm_cache_unlock(pthread_mutex_t *lock)
+{
+	pthread_mutex_unlock(lock);
+}
+
+static int
+shm_cache_init_lock(pthread_mutex_t *lock)
+{
+	int err;
+	pthread_mutexattr_t attr;
+
+	err = pthread_mutexattr_init(&attr);
+	if (err)
+		return -err;
+
+	err = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	if (!err)
+		err = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	if (!err)
+		err = pthread_mutex_init(lock, &attr);
+
+	pthread_mutexattr_destroy(&attr);
+	return -err;
+}
+
+static inline uint64_t
+shm_cache_align(uint64_t off, uint64_t align)
+{
+	return (off + align - 1) & ~(align - 1);
+}
+
+/* where the buckets, slots and data of a cache of @slots pages go */
+static uint64_t
+shm_cache_layout(struct shm_cache_hdr *hdr, uint32_t slots)
+{
+	uint32_t buckets;
+
+	for (buckets = 1; (buckets << 1) <= slots; buckets <<= 1)
+		;
+
+	hdr->slots      = slots;
+	hdr->buckets    = buckets;
+	hdr->bucket_off = shm_cache_align(sizeof(*hdr), 64);
+	hdr->slot_off   = shm_cache_align(hdr->bucket_off +
+					  buckets * sizeof(uint32_t), 64);
+	hdr->data_off   = shm_cache_align(hdr->slot_off +
+					  slots * sizeof(struct shm_cache_slot),
+					  SHM_CACHE_PAGE_SIZE);
+
+	return hdr->data_off + ((uint64_t)slots << SHM_CACHE_PAGE_SHIFT);
+}
+
+static int
+shm_cache_format(struct shm_cache_hdr *hdr, size_t size)
+{
+	int i, err;
+	uint32_t slots;
+
+	slots = size / (SHM_CACHE_PAGE_SIZE +
+			sizeof(struct shm_cache_slot) + sizeof(uint32_t));
+	while (slots && shm_cache_layout(hdr, slots) > size)
+		slots--;
+	if (!slots)
+		return -EINVAL;
+
+	hdr->size = size;
+	hdr->hand = 0;
+
+	err = shm_cache_init_lock(&hdr->clock_lock);
+	for (i = 0; !err && i < SHM_CACHE_LOCKS; i++)
+		err = shm_cache_init_lock(&hdr->locks[i]);
+	if (err)
+		return err;
+
+	/* the segment is created zeroed: all buckets and slots are empty */
+	hdr->version = SHM_CACHE_VERSION;
+	__sync_synchronize();
+	hdr->magic   = SHM_CACHE_MAGIC;
+
+	return 0;
+}
+
+static size_t
+shm_cache_configured_size(void)
+{
+	char *env, *end;
+	unsigned long mb;
+
+	mb  = SHM_CACHE_DEFAULT_MB;
+	env = getenv(SHM_CACHE_SIZE_ENV);
+	if (env) {
+		mb = strtoul(env, &end, 0);
+		if (*end)
+			mb = SHM_CACHE_DEFAULT_MB;
+	}
+
+	return (size_t)mb << 20;
+}
+
+int
+shm_cache_open(void)
+{
+	int fd, err, i, created;
+	size_t size;
+	struct stat st;
+	struct shm_cache_hdr *hdr;
+
+	if (shm_cache.users) {
+		shm_cache.users++;
+		return 0;
+	}
+
+	size = shm_cache_configured_size();
+	if (!size)
+		return -ENOENT;
+
+	created = 1;
+	fd = shm_open(SHM_CACHE_NAME, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd == -1 && errno == EEXIST) {
+		created = 0;
+		fd = shm_open(SHM_CACHE_NAME, O_RDWR, 0600);
+	}
+	if (fd == -1)
+		return -errno;
+
+	if (created) {
+		if (ftruncate(fd, size)) {
+			err = -errno;
+			shm_unlink(SHM_CACHE_NAME);
+			goto out;
+		}
+	} else {
+		/* the first tapdisk may still be sizing it */
+		for (i = 0; i < SHM_CACHE_OPEN_RETRIES; i++) {
+			if (fstat(fd, &st)) {
+				err = -errno;
+				goto out;
+			}
+			if (st.st_size >= sizeof(*hdr))
+				break;
+			usleep(10000);
+		}
+		if (st.st_size < sizeof(*hdr)) {
+			err = -ETIMEDOUT;
+			goto out;
+		}
+		size = st.st_size;
+	}
+
+	hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		err = -errno;
+		if (created)
+			shm_unlink(SHM_CACHE_NAME);
+		goto out;
+	}
+
+	if (created) {
+		err = shm_cache_format(hdr, size);
+		if (err) {
+			shm_unlink(SHM_CACHE_NAME);
+			goto fail;
+		}
+	} else {
+		for (i = 0; i < SHM_CACHE_OPEN_RETRIES; i++) {
+			if (hdr->magic == SHM_CACHE_MAGIC)
+				break;
+			usleep(10000);
+		}
+		__sync_synchronize();
+
+		err = -EINVAL;
+		if (hdr->magic != SHM_CACHE_MAGIC ||
+		    hdr->version != SHM_CACHE_VERSION ||
+		    hdr->size != size)
+			goto fail;
+	}
+
+	shm_cache.size    = size;
+	shm_cache.hdr     = hdr;
+	shm_cache.buckets = (uint32_t *)((char *)hdr + hdr->bucket_off);
+	shm_cache.slots   = (struct shm_cache_slot *)
+		((char *)hdr + hdr->slot_off);
+	shm_cache.data    = (char *)hdr + hdr->data_off;
+	shm_cache.users   = 1;
+
+	DPRINTF("%s host block cache %s: %u pages\n",
+		created ? "created" : "attached to", SHM_CACHE_NAME,
+		hdr->slots);
+
+	err = 0;
+	goto out;
+
+fail:
+	munmap(hdr, size);
+out:
+	close(fd);
+	return err;
+}
+
+void
+shm_cache_close(void)
+{
+	if (!shm_cache.users || --shm_cache.users)
+		return;
+
+	/* the cache outlives us, for the next tapdisk to use */
+	munmap(shm_cache.hdr, shm_cache.size);
+	memset(&shm_cache, 0, sizeof(shm_cache));
+}
+
+static inline int
+shm_cache_slot_matches(struct shm_cache_slot *slot,
+		       const shm_cache_id_t *id, uint64_t page)
+{
+	return (slot->valid && slot->page == page &&
+		!memcmp(&slot->id, id, sizeof(*id)));
+}
+
+/* call with the bucket's lock held */
+static uint32_t
+shm_cache_find(uint32_t bucket, const shm_cache_id_t *id, uint64_t page)
+{
+	uint32_t n;
+
+	for (n = shm_cache.buckets[bucket]; n; n = shm_cache.slots[n - 1].next)
+		if (shm_cache_slot_matches(&shm_cache.slots[n - 1], id, page))
+			return n;
+
+	return 0;
+}
+
+int
+shm_cache_lookup(const shm_cache_id_t *id, uint64_t page, char *buf)
+{
+	uint32_t bucket, n;
+	pthread_mutex_t *lock;
+
+	if (!shm_cache.users)
+		return 0;
+
+	bucket = shm_cache_hash(id, page);
+	lock   = shm_cache_bucket_lock(bucket);
+	if (shm_cache_lock(lock))
+		return 0;
+
+	n = shm_cache_find(bucket, id, page);
+	if (n) {
+		shm_cache.slots[n - 1].ref = 1;
+		memcpy(buf, shm_cache_slot_data(n - 1), SHM_CACHE_PAGE_SIZE);
+	}
+
+	shm_cache_unlock(lock);
+	return !!n;
+}
+
+/* take a slot out of its chain; call with the clock lock held */
+static void
+shm_cache_unlink(uint32_t victim)
+{
+	uint32_t bucket, *np;
+	pthread_mutex_t *lock;
+	struct shm_cache_slot *slot;
+
+	slot = &shm_cache.slots[victim];
+	if (!slot->valid)
+		return;
+
+	bucket = shm_cache_hash(&slot->id, slot->page);
+	lock   = shm_cache_bucket_lock(bucket);
+	if (shm_cache_lock(lock))
+		return;
+
+	for (np = &shm_cache.buckets[bucket]; *np;
+	     np = &shm_cache.slots[*np - 1].next)
+		if (*np == victim + 1) {
+			*np = slot->next;
+			break;
+		}
+
+	slot->valid = 0;
+	slot->next  = 0;
+	shm_cache_unlock(lock);
+}
+
+/* call with the clock lock held */
+static uint32_t
+shm_cache_evict(void)
+{
+	uint32_t i, victim;
+	struct shm_cache_hdr *hdr = shm_cache.hdr;
+
+	/* two sweeps clear every bit, so this always finds one */
+	for (i = 0; i < 2 * hdr->slots; i++) {
+		victim = hdr->hand;
+		if (++hdr->hand >= hdr->slots)
+			hdr->hand = 0;
+
+		if (!shm_cache.slots[victim].ref)
+			break;
+		shm_cache.slots[victim].ref = 0;
+	}
+
+	shm_cache_unlink(victim);
+	return victim;
+}
+
+void
+shm_cache_insert(const shm_cache_id_t *id, uint64_t page, const char *buf)
+{
+	uint32_t bucket, victim;
+	pthread_mutex_t *lock;
+	struct shm_cache_slot *slot;
+
+	if (!shm_cache.users)
+		return;
+
+	if (shm_cache_lock(&shm_cache.hdr->clock_lock))
+		return;
+
+	bucket = shm_cache_hash(id, page);
+	lock   = shm_cache_bucket_lock(bucket);
+
+	/* another tapdisk may have read it, saving us the eviction */
+	if (shm_cache_lock(lock))
+		goto out;
+	victim = shm_cache_find(bucket, id, page);
+	shm_cache_unlock(lock);
+	if (victim)
+		goto out;
+
+	/* no one else can pick the victim, nor find it, until it is linked */
+	victim = shm_cache_evict();
+	slot   = &shm_cache.slots[victim];
+
+	memcpy(shm_cache_slot_data(victim), buf, SHM_CACHE_PAGE_SIZE);
+	slot->id    = *id;
+	slot->page  = page;
+	slot->ref   = 0;
+
+	if (shm_cache_lock(lock))
+		goto out;
+	slot->valid = 1;
+	slot->next  = shm_cache.buckets[bucket];
+	shm_cache.buckets[bucket] = victim + 1;
+	shm_cache_unlock(lock);
+
+out:
+	shm_cache_unlock(&shm_cache.hdr->clock_lock);
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _BLOCK_CACHE_SHM_H_
+#define _BLOCK_CACHE_SHM_H_
+
+#include <stdint.h>
+
+/*
+ * a read cache of image pages shared by all tapdisks on the host, for
+ * read-only parents that many vbds have in common.
+ */
+
+#define SHM_CACHE_NAME                  "/tapdisk-block-cache"
+#define SHM_CACHE_SIZE_ENV              "TAPDISK_SHARED_CACHE_MB"
+#define SHM_CACHE_DEFAULT_MB            256
+
+#define SHM_CACHE_PAGE_SHIFT            12
+#define SHM_CACHE_PAGE_SIZE             (1 << SHM_CACHE_PAGE_SHIFT)
+#define SHM_CACHE_PAGE_SECS             (SHM_CACHE_PAGE_SIZE >> 9)
+
+/* identifies an image file across processes, and changes if it does */
+typedef struct shm_cache_id {
+	uint64_t                        dev;
+	uint64_t                        ino;
+	uint64_t                        size;
+	uint64_t                        mtime;
+} shm_cache_id_t;
+
+int shm_cache_get_id(const char *path, shm_cache_id_t *id);
+
+/* map the host cache, creating it if this is the first tapdisk */
+int shm_cache_open(void);
+void shm_cache_close(void);
+
+/* page @page of image @id: returns 1 and copies it to @buf if cached */
+int shm_cache_lookup(const shm_cache_id_t *id, uint64_t page, char *buf);
+void shm_cache_insert(const shm_cache_id_t *id, uint64_t page,
+		      const char *buf);
+
+#endif
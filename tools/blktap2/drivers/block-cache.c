@@ -36,6 +36,7 @@
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
 #include "tapdisk-interface.h"
+#include "block-cache-shm.h"
 
 #ifdef DEBUG
 #define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
@@ -57,6 +58,7 @@
 #define BLOCK_CACHE_MAX_SIZE            (10 << 20) /* 100MB cache */
 #define BLOCK_CACHE_REQUESTS            (TAPDISK_DATA_REQUESTS << 3)
 #define BLOCK_CACHE_PAGE_IDLETIME       60
+#define BLOCK_CACHE_SHARED_MAX_SECS     (128 << 1) /* 128K requests */
 
 typedef struct radix_tree               radix_tree_t;
 typedef struct radix_tree_node          radix_tree_node_t;
@@ -115,6 +117,7 @@ struct block_cache_stats {
 	uint64_t                        hits;
 	uint64_t                        misses;
 	uint64_t                        prunes;
+	uint64_t                        shared_hits;
 };
 
 struct block_cache {
@@ -123,6 +126,13 @@ struct block_cache {
 
 	uint64_t                        sectors;
 
+	/*
+	 * with the host cache, pages are kept there rather than in the
+	 * tree, so that each tapdisk reading the image finds them.
+	 */
+	int                             shared;
+	shm_cache_id_t                  shared_id;
+
 	block_cache_request_t           requests[BLOCK_CACHE_REQUESTS];
 	block_cache_request_t          *request_free_list[BLOCK_CACHE_REQUESTS];
 	int                             requests_free;
@@ -561,6 +571,15 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 	if (mlockall(MCL_CURRENT | MCL_FUTURE))
 		DPRINTF("mlockall failed: %d\n", -errno);
 
+	if (!shm_cache_get_id(cache->name, &cache->shared_id)) {
+		err = shm_cache_open();
+		if (!err)
+			cache->shared = 1;
+		else if (err != -ENOENT)
+			DPRINTF("%s: no host block cache: %d\n",
+				cache->name, err);
+	}
+
 	return 0;
 
 fail:
@@ -582,6 +601,8 @@ block_cache_close(td_driver_t *driver)
 
 	tapdisk_server_unregister_event(cache->timeout_id);
 	radix_tree_free(tree);
+	if (cache->shared)
+		shm_cache_close();
 	free(cache->name);
 
 	return 0;
@@ -624,6 +645,31 @@ block_cache_hit(block_cache_t *cache, td_request_t treq, char *iov[])
 	td_complete_request(treq, 0);
 }
 
+/* copy the request out, and keep the whole pages it read for the host */
+static void
+block_cache_populate_shared(block_cache_t *cache, block_cache_request_t *breq)
+{
+	uint64_t sec, end;
+	off_t off;
+
+	memcpy(breq->treq.buf, breq->buf,
+	       breq->treq.secs << RADIX_TREE_NODE_SHIFT);
+
+	sec = breq->treq.sec;
+	end = sec + breq->treq.secs;
+
+	if (sec % SHM_CACHE_PAGE_SECS)
+		sec += SHM_CACHE_PAGE_SECS - sec % SHM_CACHE_PAGE_SECS;
+
+	for (; sec + SHM_CACHE_PAGE_SECS <= end; sec += SHM_CACHE_PAGE_SECS) {
+		off = (sec - breq->treq.sec) << RADIX_TREE_NODE_SHIFT;
+		DBG("%s: populating host page 0x%08llx\n",
+		    cache->name, sec / SHM_CACHE_PAGE_SECS);
+		shm_cache_insert(&cache->shared_id,
+				 sec / SHM_CACHE_PAGE_SECS, breq->buf + off);
+	}
+}
+
 static void
 block_cache_populate_cache(td_request_t clone, int err)
 {
@@ -646,6 +692,12 @@ block_cache_populate_cache(td_request_t clone, int err)
 		goto out;
 	}
 
+	if (cache->shared) {
+		block_cache_populate_shared(cache, breq);
+		free(breq->buf);
+		goto out;
+	}
+
 	for (i = 0; i < breq->treq.secs; i++) {
 		off_t off = i << RADIX_TREE_NODE_SHIFT;
 		DBG("%s: populating sec 0x%08llx\n",
@@ -680,7 +732,8 @@ block_cache_miss(block_cache_t *cache, td_request_t treq)
 
 	cache->stats.misses += treq.secs;
 
-	if (radix_tree_size(tree) + size >= BLOCK_CACHE_MAX_SIZE)
+	if (!cache->shared &&
+	    radix_tree_size(tree) + size >= BLOCK_CACHE_MAX_SIZE)
 		goto out;
 
 	breq = block_cache_get_request(cache);
@@ -706,6 +759,41 @@ out:
 	td_forward_request(clone);
 }
 
+/*
+ * serve a read from the host cache: every page it touches must be there,
+ * so that nothing needs to be merged with a read from the image.
+ */
+static void
+block_cache_shared_read(block_cache_t *cache, td_request_t treq)
+{
+	char page[SHM_CACHE_PAGE_SIZE];
+	uint64_t sec, end, pg, first, last;
+	off_t off, len;
+
+	sec = treq.sec;
+	end = treq.sec + treq.secs;
+
+	for (; sec < end; sec = (pg + 1) * SHM_CACHE_PAGE_SECS) {
+		pg    = sec / SHM_CACHE_PAGE_SECS;
+		first = sec - pg * SHM_CACHE_PAGE_SECS;
+		last  = end - pg * SHM_CACHE_PAGE_SECS;
+		if (last > SHM_CACHE_PAGE_SECS)
+			last = SHM_CACHE_PAGE_SECS;
+
+		if (!shm_cache_lookup(&cache->shared_id, pg, page))
+			return block_cache_miss(cache, treq);
+
+		off = (sec - treq.sec) << RADIX_TREE_NODE_SHIFT;
+		len = (last - first) << RADIX_TREE_NODE_SHIFT;
+		memcpy(treq.buf + off,
+		       page + (first << RADIX_TREE_NODE_SHIFT), len);
+	}
+
+	cache->stats.hits        += treq.secs;
+	cache->stats.shared_hits += treq.secs;
+	td_complete_request(treq, 0);
+}
+
 static void
 block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 {
@@ -719,6 +807,12 @@ block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 
 	cache->stats.reads += treq.secs;
 
+	if (cache->shared) {
+		if (treq.secs > BLOCK_CACHE_SHARED_MAX_SECS)
+			return td_forward_request(treq);
+		return block_cache_shared_read(cache, treq);
+	}
+
 	if (treq.secs > BLOCK_CACHE_NODES_PER_PAGE)
 		return td_forward_request(treq);
 
@@ -771,6 +865,9 @@ block_cache_debug(td_driver_t *driver)
 	WARN("BLOCK CACHE %s\n", cache->name);
 	WARN("reads: %"PRIu64", hits: %"PRIu64", misses: %"PRIu64", prunes: %"PRIu64"\n",
 	     stats->reads, stats->hits, stats->misses, stats->prunes);
+	if (cache->shared)
+		WARN("host cache %s, hits: %"PRIu64"\n",
+		     SHM_CACHE_NAME, stats->shared_hits);
 }
 
 struct tap_disk tapdisk_block_cache = {
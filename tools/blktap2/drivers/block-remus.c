@@ -29,6 +29,11 @@
  * After a commit request, the client must wait for a competion message:
  * 4. completion
  *    "done"      4
+ *
+ * The primary does not wait for the writes to reach the backup: they are
+ * queued and sent as the socket takes them, and passed to the underlying
+ * device straight away. The commit request goes down the same queue, so
+ * its single completion covers all the writes of the checkpoint.
  */
 
 /* due to architectural choices in tapdisk, block-buffer is forced to
@@ -65,6 +70,9 @@
 /* connect retry timeout (seconds) */
 #define REMUS_CONNRETRY_TIMEOUT 10
 
+/* replication data queued on the primary before writes block */
+#define REMUS_SENDQ_MAX (32 << 20)
+
 #define RPRINTF(_f, _a...) syslog (LOG_DEBUG, "remus: " _f, ## _a)
 
 enum tdremus_mode {
@@ -169,6 +177,14 @@ struct tdremus_state {
 	poll_fd_t server_fd;    /* server listen port */
 	poll_fd_t stream_fd;     /* replication channel */
 
+	/* primary: replication data not yet taken by stream_fd */
+	struct {
+		char *buf;
+		size_t size;
+		size_t start, end;
+		event_id_t id;      /* write event while not empty, else -1 */
+	} sendq;
+
 	/* queue write requests, batch-replicate at submit */
 	struct req_ring write_ring;
 
@@ -729,8 +745,18 @@ static int mwrite(int fd, void* buf, size_t len)
 }
 
 
+static void sendq_reset(struct tdremus_state *s)
+{
+	if (s->sendq.id >= 0)
+		tapdisk_server_unregister_event(s->sendq.id);
+	s->sendq.id = -1;
+	s->sendq.start = s->sendq.end = 0;
+}
+
 static void inline close_stream_fd(struct tdremus_state *s)
 {
+	sendq_reset(s);
+
 	/* XXX: -2 is magic. replace with macro perhaps? */
 	tapdisk_server_unregister_event(s->stream_fd.id);
 	close(s->stream_fd.fd);
@@ -828,6 +854,111 @@ static int primary_blocking_connect(struct tdremus_state *state)
 	return 0;
 }
 
+/* write what the socket takes without blocking. -1 if it is broken */
+static int sendq_push(struct tdremus_state *s)
+{
+	ssize_t rc;
+
+	while (s->sendq.start < s->sendq.end) {
+		rc = write(s->stream_fd.fd, s->sendq.buf + s->sendq.start,
+			   s->sendq.end - s->sendq.start);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0 && errno == EAGAIN)
+			break;
+		if (rc <= 0) {
+			RPRINTF("error during write: %s\n", strerror(errno));
+			return -1;
+		}
+		s->sendq.start += rc;
+	}
+	if (s->sendq.start == s->sendq.end)
+		s->sendq.start = s->sendq.end = 0;
+
+	return 0;
+}
+
+static void remus_sendq_event(event_id_t id, char mode, void *private)
+{
+	struct tdremus_state *s = (struct tdremus_state *)private;
+
+	if (sendq_push(s) < 0) {
+		RPRINTF("replication failed, switching to unprotected mode\n");
+		switch_mode(s->tdremus_driver, mode_unprotected);
+		return;
+	}
+
+	if (s->sendq.start == s->sendq.end) {
+		tapdisk_server_unregister_event(s->sendq.id);
+		s->sendq.id = -1;
+	}
+}
+
+/*
+ * Queue len bytes for the backup. Past REMUS_SENDQ_MAX the queue is
+ * written out, blocking, before anything more is taken.
+ */
+static int sendq_append(struct tdremus_state *s, void *buf, size_t len)
+{
+	size_t size;
+	char *nbuf;
+
+	if (s->sendq.end + len > s->sendq.size && s->sendq.start) {
+		memmove(s->sendq.buf, s->sendq.buf + s->sendq.start,
+			s->sendq.end - s->sendq.start);
+		s->sendq.end -= s->sendq.start;
+		s->sendq.start = 0;
+	}
+
+	if (s->sendq.end + len > REMUS_SENDQ_MAX) {
+		if (mwrite(s->stream_fd.fd, s->sendq.buf, s->sendq.end) < 0)
+			return -1;
+		s->sendq.end = 0;
+		if (len > REMUS_SENDQ_MAX)
+			return mwrite(s->stream_fd.fd, buf, len);
+	}
+
+	if (s->sendq.end + len > s->sendq.size) {
+		size = s->sendq.size ? s->sendq.size : 1 << 20;
+		while (size < s->sendq.end + len)
+			size *= 2;
+		if (!(nbuf = realloc(s->sendq.buf, size))) {
+			RPRINTF("error growing the replication queue\n");
+			return -1;
+		}
+		s->sendq.buf = nbuf;
+		s->sendq.size = size;
+	}
+
+	memcpy(s->sendq.buf + s->sendq.end, buf, len);
+	s->sendq.end += len;
+
+	return 0;
+}
+
+/* start sending what was queued, the rest goes when the socket has room */
+static int sendq_kick(struct tdremus_state *s)
+{
+	event_id_t id;
+
+	if (sendq_push(s) < 0)
+		return -1;
+
+	if (s->sendq.start == s->sendq.end || s->sendq.id >= 0)
+		return 0;
+
+	if ((id = tapdisk_server_register_event(SCHEDULER_POLL_WRITE_FD,
+						s->stream_fd.fd, 0,
+						remus_sendq_event, s)) < 0) {
+		RPRINTF("error registering replication write event: %s\n",
+			strerror(id));
+		return -1;
+	}
+	s->sendq.id = id;
+
+	return 0;
+}
+
 /* on read, just pass request through */
 static void primary_queue_read(td_driver_t *driver, td_request_t treq)
 {
@@ -835,12 +966,10 @@ static void primary_queue_read(td_driver_t *driver, td_request_t treq)
 	td_forward_request(treq);
 }
 
-/* TODO:
- * The primary uses mwrite() to write the contents of a write request to the
- * backup. This effectively blocks until all data has been copied into a system
- * buffer or a timeout has occured. We may wish to instead use tapdisk's
- * nonblocking i/o interface, tapdisk_server_register_event(), to set timeouts
- * and write data in an asynchronous fashion.
+/*
+ * The write request is queued for the backup and its sending started,
+ * without waiting for it to be taken: the request goes to the underlying
+ * device at once.
  */
 static void primary_queue_write(td_driver_t *driver, td_request_t treq)
 {
@@ -861,12 +990,15 @@ static void primary_queue_write(td_driver_t *driver, td_request_t treq)
 	*sectors = treq.secs;
 	*sector = treq.sec;
 
-	if (mwrite(s->stream_fd.fd, TDREMUS_WRITE, strlen(TDREMUS_WRITE)) < 0)
+	if (s->stream_fd.fd < 0)
 		goto fail;
-	if (mwrite(s->stream_fd.fd, header, sizeof(header)) < 0)
+	if (sendq_append(s, TDREMUS_WRITE, strlen(TDREMUS_WRITE)) < 0)
 		goto fail;
-
-	if (mwrite(s->stream_fd.fd, treq.buf, treq.secs * driver->info.sector_size) < 0)
+	if (sendq_append(s, header, sizeof(header)) < 0)
+		goto fail;
+	if (sendq_append(s, treq.buf, treq.secs * driver->info.sector_size) < 0)
+		goto fail;
+	if (sendq_kick(s) < 0)
 		goto fail;
 
 	td_forward_request(treq);
@@ -891,7 +1023,8 @@ static int client_flush(td_driver_t *driver)
 		/* connection not yet established, nothing to flush */
 		return 0;
 
-	if (mwrite(s->stream_fd.fd, TDREMUS_COMMIT, strlen(TDREMUS_COMMIT)) < 0) {
+	if (sendq_append(s, TDREMUS_COMMIT, strlen(TDREMUS_COMMIT)) < 0 ||
+	    sendq_kick(s) < 0) {
 		RPRINTF("error flushing output");
 		close_stream_fd(s);
 		return -1;
@@ -1649,6 +1782,7 @@ static int tdremus_open(td_driver_t *driver, const char *name,
 	memset(s, 0, sizeof(*s));
 	s->server_fd.fd = -1;
 	s->stream_fd.fd = -1;
+	s->sendq.id = -1;
 	s->ctl_fd.fd = -1;
 	s->msg_fd.fd = -1;
 
@@ -1702,6 +1836,8 @@ static int tdremus_close(td_driver_t *driver)
 	}
 	if (s->stream_fd.fd >= 0)
 		close_stream_fd(s);
+	free(s->sendq.buf);
+	s->sendq.buf = NULL;
 
 	ctl_close(driver);
 
@@ -109,7 +109,8 @@ unsigned int SPB;
 #endif
 
 /******VHD DEFINES******/
-#define VHD_CACHE_SIZE               32
+#define VHD_CACHE_SIZE               32    /* bitmaps cached, at least */
+#define VHD_CACHE_MAX                1024  /* and at most, by default */
 
 #define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
 #define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
@@ -195,8 +196,10 @@ struct vhd_bat_state {
 
 struct vhd_bitmap {
 	u32                       blk;
-	u64                       seqno;       /* lru sequence number */
 	vhd_flag_t                status;
+	struct vhd_bitmap        *hnext;       /* next in hash bucket */
+	struct vhd_bitmap        *lru_prev;    /* lru list of cached bitmaps, */
+	struct vhd_bitmap        *lru_next;    /* most recently used first */
 
 	char                     *map;         /* map should only be modified
 					        * in finish_bitmap_write */
@@ -227,13 +230,16 @@ struct vhd_state {
 
 	struct vhd_bat_state      bat;
 
-	u64                       bm_lru;      /* lru sequence number */
 	u32                       bm_secs;     /* size of bitmap, in sectors */
-	struct vhd_bitmap        *bitmap[VHD_CACHE_SIZE];
+	int                       bm_cache_size;
+	u32                       bm_hash_mask;
+	struct vhd_bitmap       **bm_hash;     /* cached bitmaps, by block */
+	struct vhd_bitmap        *bm_lru_head;
+	struct vhd_bitmap        *bm_lru_tail;
 
 	int                       bm_free_count;
-	struct vhd_bitmap        *bitmap_free[VHD_CACHE_SIZE];
-	struct vhd_bitmap         bitmap_list[VHD_CACHE_SIZE];
+	struct vhd_bitmap       **bitmap_free;
+	struct vhd_bitmap        *bitmap_list;
 
 	int                       vreq_free_count;
 	struct vhd_request       *vreq_free[VHD_REQS_DATA];
@@ -456,29 +462,79 @@ vhd_free_bitmap_cache(struct vhd_state *s)
 	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap_list + i;
-		free(bm->map);
-		free(bm->shadow);
-		s->bitmap_free[i] = NULL;
+	if (s->bitmap_list) {
+		for (i = 0; i < s->bm_cache_size; i++) {
+			bm = s->bitmap_list + i;
+			free(bm->map);
+			free(bm->shadow);
+		}
 	}
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	free(s->bitmap_list);
+	free(s->bitmap_free);
+	free(s->bm_hash);
+	s->bitmap_list   = NULL;
+	s->bitmap_free   = NULL;
+	s->bm_hash       = NULL;
+	s->bm_lru_head   = NULL;
+	s->bm_lru_tail   = NULL;
+	s->bm_free_count = 0;
+}
+
+/*
+ * one bitmap for each block, so that a fragmented vhd does not keep
+ * rereading them, up to VHD_CACHE_MAX unless TAPDISK_VHD_BITMAP_CACHE
+ * says otherwise.  each costs two bitmaps' worth of memory.
+ */
+static int
+vhd_bitmap_cache_size(struct vhd_state *s)
+{
+	char *env, *end;
+	long size;
+
+	size = s->bat.bat.entries;
+	if (size > VHD_CACHE_MAX)
+		size = VHD_CACHE_MAX;
+
+	env = getenv("TAPDISK_VHD_BITMAP_CACHE");
+	if (env) {
+		size = strtol(env, &end, 0);
+		if (*end || size < 0 || size > (1 << 20))
+			size = VHD_CACHE_MAX;
+	}
+
+	if (size < VHD_CACHE_SIZE)
+		size = VHD_CACHE_SIZE;
+
+	return size;
 }
 
 static int
 vhd_initialize_bitmap_cache(struct vhd_state *s)
 {
 	int i, err, map_size;
+	u32 buckets;
 	struct vhd_bitmap *bm;
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	s->bm_cache_size = vhd_bitmap_cache_size(s);
+	for (buckets = 1; buckets < s->bm_cache_size; buckets <<= 1)
+		;
+	s->bm_hash_mask  = buckets - 1;
 
-	s->bm_lru        = 0;
+	s->bitmap_list = calloc(s->bm_cache_size, sizeof(struct vhd_bitmap));
+	s->bitmap_free = calloc(s->bm_cache_size, sizeof(struct vhd_bitmap *));
+	s->bm_hash     = calloc(buckets, sizeof(struct vhd_bitmap *));
+	if (!s->bitmap_list || !s->bitmap_free || !s->bm_hash) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	s->bm_lru_head   = NULL;
+	s->bm_lru_tail   = NULL;
+	s->bm_free_count = 0;
 	map_size         = vhd_sectors_to_bytes(s->bm_secs);
-	s->bm_free_count = VHD_CACHE_SIZE;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	for (i = 0; i < s->bm_cache_size; i++) {
 		bm = s->bitmap_list + i;
 
 		err = posix_memalign((void **)&bm->map, 512, map_size);
@@ -495,7 +551,7 @@ vhd_initialize_bitmap_cache(struct vhd_state *s)
 
 		memset(bm->map, 0, map_size);
 		memset(bm->shadow, 0, map_size);
-		s->bitmap_free[i] = bm;
+		s->bitmap_free[s->bm_free_count++] = bm;
 	}
 
 	return 0;
@@ -958,7 +1014,6 @@ static inline void
 init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	bm->blk    = 0;
-	bm->seqno  = 0;
 	bm->status = 0;
 	init_tx(&bm->tx);
 	clear_req_list(&bm->queue);
@@ -968,21 +1023,45 @@ init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 	init_vhd_request(s, &bm->req);
 }
 
+static inline struct vhd_bitmap **
+bitmap_bucket(struct vhd_state *s, uint32_t block)
+{
+	return &s->bm_hash[(block * 2654435761U) & s->bm_hash_mask];
+}
+
 static inline struct vhd_bitmap *
 get_bitmap(struct vhd_state *s, uint32_t block)
 {
-	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->blk == block)
+	for (bm = *bitmap_bucket(s, block); bm; bm = bm->hnext)
+		if (bm->blk == block)
 			return bm;
-	}
 
 	return NULL;
 }
 
+static void
+unlink_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	struct vhd_bitmap **pp;
+
+	for (pp = bitmap_bucket(s, bm->blk); *pp != bm; pp = &(*pp)->hnext)
+		ASSERT(*pp);
+	*pp = bm->hnext;
+	bm->hnext = NULL;
+
+	if (bm->lru_prev)
+		bm->lru_prev->lru_next = bm->lru_next;
+	else
+		s->bm_lru_head = bm->lru_next;
+	if (bm->lru_next)
+		bm->lru_next->lru_prev = bm->lru_prev;
+	else
+		s->bm_lru_tail = bm->lru_prev;
+	bm->lru_prev = bm->lru_next = NULL;
+}
+
 static inline void
 lock_bitmap(struct vhd_bitmap *bm)
 {
@@ -1033,21 +1112,14 @@ bitmap_full(struct vhd_state *s, struct vhd_bitmap *bm)
 static struct vhd_bitmap *
 remove_lru_bitmap(struct vhd_state *s)
 {
-	int i, idx = 0;
-	u64 seq = s->bm_lru;
-	struct vhd_bitmap *bm, *lru = NULL;
+	struct vhd_bitmap *lru;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->seqno < seq && !bitmap_locked(bm)) {
-			idx = i;
-			lru = bm;
-			seq = lru->seqno;
-		}
-	}
+	for (lru = s->bm_lru_tail; lru; lru = lru->lru_prev)
+		if (!bitmap_locked(lru))
+			break;
 
 	if (lru) {
-		s->bitmap[idx] = NULL;
+		unlink_bitmap(s, lru);
 		ASSERT(!bitmap_in_use(lru));
 	}
 
@@ -1076,62 +1148,52 @@ alloc_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap **bitmap, uint32_t blk)
 	return 0;
 }
 
-static inline uint64_t
-__bitmap_lru_seqno(struct vhd_state *s)
-{
-	int i;
-	struct vhd_bitmap *bm;
-
-	if (s->bm_lru == 0xffffffff) {
-		s->bm_lru = 0;
-		for (i = 0; i < VHD_CACHE_SIZE; i++) {
-			bm = s->bitmap[i];
-			if (bm) {
-				bm->seqno >>= 1;
-				if (bm->seqno > s->bm_lru)
-					s->bm_lru = bm->seqno;
-			}
-		}
-	}
-
-	return ++s->bm_lru;
-}
-
 static inline void
 touch_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	bm->seqno = __bitmap_lru_seqno(s);
+	if (s->bm_lru_head == bm)
+		return;
+
+	/* unlink from the lru list... */
+	bm->lru_prev->lru_next = bm->lru_next;
+	if (bm->lru_next)
+		bm->lru_next->lru_prev = bm->lru_prev;
+	else
+		s->bm_lru_tail = bm->lru_prev;
+
+	/* ...and put it back at the head */
+	bm->lru_prev = NULL;
+	bm->lru_next = s->bm_lru_head;
+	s->bm_lru_head->lru_prev = bm;
+	s->bm_lru_head = bm;
 }
 
 static inline void
 install_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		if (!s->bitmap[i]) {
-			touch_bitmap(s, bm);
-			s->bitmap[i] = bm;
-			return;
-		}
-	}
+	struct vhd_bitmap **bucket = bitmap_bucket(s, bm->blk);
+
+	ASSERT(!get_bitmap(s, bm->blk));
+
+	bm->hnext = *bucket;
+	*bucket   = bm;
 
-	ASSERT(0);
+	bm->lru_prev = NULL;
+	bm->lru_next = s->bm_lru_head;
+	if (s->bm_lru_head)
+		s->bm_lru_head->lru_prev = bm;
+	else
+		s->bm_lru_tail = bm;
+	s->bm_lru_head = bm;
 }
 
 static inline void
 free_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-
-	for (i = 0; i < VHD_CACHE_SIZE; i++)
-		if (s->bitmap[i] == bm)
-			break;
-
 	ASSERT(!bitmap_locked(bm));
 	ASSERT(!bitmap_in_use(bm));
-	ASSERT(i < VHD_CACHE_SIZE);
 
-	s->bitmap[i] = NULL;
+	unlink_bitmap(s, bm);
 	s->bitmap_free[s->bm_free_count++] = bm;
 }
 
@@ -2240,6 +2302,7 @@ void
 vhd_debug(td_driver_t *driver)
 {
 	int i;
+	struct vhd_bitmap *bm;
 	struct vhd_state *s = (struct vhd_state *)driver->data;
 
 	DBG(TLOG_WARN, "%s: QUEUED: 0x%08"PRIx64", COMPLETED: 0x%08"PRIx64", "
@@ -2262,15 +2325,11 @@ vhd_debug(td_driver_t *driver)
 	}
 
 	DBG(TLOG_WARN, "BITMAP CACHE:\n");
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	for (bm = s->bm_lru_head, i = 0; bm; bm = bm->lru_next, i++) {
 		int qnum = 0, wnum = 0, rnum = 0;
-		struct vhd_bitmap *bm = s->bitmap[i];
 		struct vhd_transaction *tx;
 		struct vhd_request *r;
 
-		if (!bm)
-			continue;
-
 		tx = &bm->tx;
 		r = bm->queue.head;
 		while (r) {
@@ -221,6 +221,15 @@ scheduler_set_max_timeout(scheduler_t *s, int timeout)
 		s->max_timeout = MIN(s->max_timeout, timeout);
 }
 
+/* A timeout of less than a second, for the next wait only */
+void
+scheduler_set_max_timeout_usec(scheduler_t *s, long usec)
+{
+	if (usec >= 0 && usec < 1000000 &&
+	    (s->max_timeout_usec < 0 || usec < s->max_timeout_usec))
+		s->max_timeout_usec = usec;
+}
+
 int
 scheduler_wait_for_events(scheduler_t *s)
 {
@@ -231,6 +240,10 @@ scheduler_wait_for_events(scheduler_t *s)
 
 	tv.tv_sec  = s->timeout;
 	tv.tv_usec = 0;
+	if (s->max_timeout_usec >= 0 && s->timeout > 0) {
+		tv.tv_sec  = 0;
+		tv.tv_usec = s->max_timeout_usec;
+	}
 
 	DBG("timeout: %d, max_timeout: %d\n",
 	    s->timeout, s->max_timeout);
@@ -238,9 +251,10 @@ scheduler_wait_for_events(scheduler_t *s)
 	ret = select(s->max_fd + 1, &s->read_fds,
 		     &s->write_fds, &s->except_fds, &tv);
 
-	s->restart     = 0;
-	s->timeout     = SCHEDULER_MAX_TIMEOUT;
-	s->max_timeout = SCHEDULER_MAX_TIMEOUT;
+	s->restart          = 0;
+	s->timeout          = SCHEDULER_MAX_TIMEOUT;
+	s->max_timeout      = SCHEDULER_MAX_TIMEOUT;
+	s->max_timeout_usec = -1;
 
 	if (ret < 0)
 		return ret;
@@ -256,6 +270,7 @@ scheduler_initialize(scheduler_t *s)
 	memset(s, 0, sizeof(scheduler_t));
 
 	s->uuid = 1;
+	s->max_timeout_usec = -1;
 
 	FD_ZERO(&s->read_fds);
 	FD_ZERO(&s->write_fds);
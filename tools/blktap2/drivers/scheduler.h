@@ -52,6 +52,7 @@ typedef struct scheduler {
 	int                          timeout;
 	int                          restart;
 	int                          max_timeout;
+	long                         max_timeout_usec;
 } scheduler_t;
 
 void scheduler_initialize(scheduler_t *);
@@ -60,6 +61,7 @@ event_id_t scheduler_register_event(scheduler_t *, char mode,
 				    event_cb_t cb, void *private);
 void scheduler_unregister_event(scheduler_t *,  event_id_t);
 void scheduler_set_max_timeout(scheduler_t *, int);
+void scheduler_set_max_timeout_usec(scheduler_t *, long);
 int scheduler_wait_for_events(scheduler_t *);
 
 #endif
@@ -55,6 +55,14 @@
  */
 #define REQUEST_ASYNC_FD ((io_context_t)1)
 
+/*
+ * While the disk is busy anyway, submitting a sequential stream may be
+ * held back for a while, to merge what follows into the iocbs queued.
+ * The while adapts: it doubles when more came in, halves when not.
+ */
+#define TAPDISK_QUEUE_PLUG_MIN_USEC   10
+#define TAPDISK_QUEUE_PLUG_MAX_USEC  200
+
 static inline void
 queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 {
@@ -157,6 +165,20 @@ cancel_tiocbs(struct tqueue *queue, int err)
 	return queued;
 }
 
+static inline void
+note_submitted(struct tqueue *queue)
+{
+	struct iocb *io;
+
+	if (!queue->queued)
+		return;
+
+	io = queue->iocbs[queue->queued - 1];
+	queue->last_fd     = io->aio_fildes;
+	queue->last_opcode = io->aio_lio_opcode;
+	queue->last_end    = io->u.c.offset + io->u.c.nbytes;
+}
+
 static int
 fail_tiocbs(struct tqueue *queue, int succeeded, int total, int err)
 {
@@ -234,6 +256,7 @@ tapdisk_rwio_submit(struct tqueue *queue)
 	if (!queue->queued)
 		return 0;
 
+	note_submitted(queue);
 	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
 	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
 
@@ -514,6 +537,7 @@ tapdisk_lio_submit(struct tqueue *queue)
 	if (!queue->queued)
 		return 0;
 
+	note_submitted(queue);
 	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
 	merged    = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
 	tapdisk_lio_set_eventfd(queue, merged, queue->iocbs);
@@ -612,8 +636,10 @@ tapdisk_init_queue(struct tqueue *queue, int size,
 
 	memset(queue, 0, sizeof(struct tqueue));
 
-	queue->size   = size;
-	queue->filter = filter;
+	queue->size      = size;
+	queue->filter    = filter;
+	queue->last_fd   = -1;
+	queue->plug_usec = TAPDISK_QUEUE_PLUG_MAX_USEC;
 
 	if (!size)
 		return 0;
@@ -657,9 +683,11 @@ tapdisk_debug_queue(struct tqueue *queue)
 
 	WARN("TAPDISK QUEUE:\n");
 	WARN("size: %d, tio: %s, queued: %d, iocbs_pending: %d, "
-	     "tiocbs_pending: %d, tiocbs_deferred: %d, deferrals: %"PRIx64"\n",
+	     "tiocbs_pending: %d, tiocbs_deferred: %d, deferrals: %"PRIx64", "
+	     "plugs: %"PRIu64", plug_usec: %ld\n",
 	     queue->size, queue->tio->name, queue->queued, queue->iocbs_pending,
-	     queue->tiocbs_pending, queue->tiocbs_deferred, queue->deferrals);
+	     queue->tiocbs_pending, queue->tiocbs_deferred, queue->deferrals,
+	     queue->plugs, queue->plug_usec);
 
 	if (tiocb) {
 		WARN("deferred:\n");
@@ -700,6 +728,71 @@ tapdisk_queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 }
 
 
+static inline int
+iocb_follows(const struct iocb *io, int fd, short opcode, long long end)
+{
+	return io->aio_fildes == fd && io->aio_lio_opcode == opcode &&
+		io->u.c.offset == end;
+}
+
+/*
+ * Returns the microseconds to hold back submitting the queued iocbs for,
+ * or 0 to submit them now.  They are held back while iocbs submitted
+ * before are outstanding, and the last one queued continues a
+ * sequential stream, but for no longer than plug_usec in all.
+ */
+long
+tapdisk_queue_plug(struct tqueue *queue)
+{
+	const struct iocb *io, *prev;
+	struct timeval now;
+	long usec;
+	int sequential;
+
+	if (!queue->queued || !queue->iocbs_pending ||
+	    tapdisk_queue_full(queue) || deferred_tiocbs(queue))
+		goto unplug;
+
+	io = queue->iocbs[queue->queued - 1];
+	if (queue->queued > 1) {
+		prev = queue->iocbs[queue->queued - 2];
+		sequential = iocb_follows(io, prev->aio_fildes,
+					  prev->aio_lio_opcode,
+					  prev->u.c.offset + prev->u.c.nbytes);
+	} else
+		sequential = iocb_follows(io, queue->last_fd,
+					  queue->last_opcode, queue->last_end);
+	if (!sequential)
+		goto unplug;
+
+	gettimeofday(&now, NULL);
+	if (!queue->plugged) {
+		queue->plugged     = 1;
+		queue->plug_queued = queue->queued;
+		queue->plug_start  = now;
+		queue->plugs++;
+	}
+
+	usec = (now.tv_sec - queue->plug_start.tv_sec) * 1000000L +
+		now.tv_usec - queue->plug_start.tv_usec;
+	if (usec >= 0 && usec < queue->plug_usec)
+		return queue->plug_usec - usec;
+
+unplug:
+	if (queue->plugged) {
+		if (queue->queued > queue->plug_queued)
+			queue->plug_usec *= 2;
+		else
+			queue->plug_usec /= 2;
+		if (queue->plug_usec > TAPDISK_QUEUE_PLUG_MAX_USEC)
+			queue->plug_usec = TAPDISK_QUEUE_PLUG_MAX_USEC;
+		if (queue->plug_usec < TAPDISK_QUEUE_PLUG_MIN_USEC)
+			queue->plug_usec = TAPDISK_QUEUE_PLUG_MIN_USEC;
+		queue->plugged = 0;
+	}
+	return 0;
+}
+
 /*
  * fail_tiocbs may queue more tiocbs
  */
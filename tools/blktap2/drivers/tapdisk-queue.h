@@ -30,6 +30,7 @@
 #define TAPDISK_QUEUE_H
 
 #include <libaio.h>
+#include <sys/time.h>
 
 #include "io-optimize.h"
 #include "scheduler.h"
@@ -82,6 +83,18 @@ struct tqueue {
 	struct tfilter       *filter;
 
 	uint64_t              deferrals;
+
+	/* where the last iocb submitted ended, to spot sequential streams */
+	int                   last_fd;
+	short                 last_opcode;
+	long long             last_end;
+
+	/* submission held back to merge more, see tapdisk_queue_plug */
+	int                   plugged;
+	int                   plug_queued;
+	long                  plug_usec;
+	struct timeval        plug_start;
+	uint64_t              plugs;
 };
 
 struct tio {
@@ -115,6 +128,7 @@ int tapdisk_init_queue(struct tqueue *, int size, int drv, struct tfilter *);
 void tapdisk_free_queue(struct tqueue *);
 void tapdisk_debug_queue(struct tqueue *);
 void tapdisk_queue_tiocb(struct tqueue *, struct tiocb *);
+long tapdisk_queue_plug(struct tqueue *);
 int tapdisk_submit_tiocbs(struct tqueue *);
 int tapdisk_submit_all_tiocbs(struct tqueue *);
 int tapdisk_cancel_tiocbs(struct tqueue *);
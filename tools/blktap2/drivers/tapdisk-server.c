@@ -174,6 +174,13 @@ tapdisk_server_check_progress(void)
 static void
 tapdisk_server_submit_tiocbs(void)
 {
+	long usec = tapdisk_queue_plug(&server.aio_queue);
+
+	if (usec > 0) {
+		scheduler_set_max_timeout_usec(&server.scheduler, usec);
+		return;
+	}
+
 	tapdisk_submit_all_tiocbs(&server.aio_queue);
 }
 
@@ -27,8 +27,10 @@
  */
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sched.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
@@ -150,6 +152,51 @@ tapdisk_get_image_size(int fd, uint64_t *_sectors, uint32_t *_sector_size)
 
 #ifdef __linux__
 
+/*
+ * Run on the cpus of a list like "0-3,6", e.g. the ones taking the
+ * interrupts of the guest's disk.
+ */
+int
+tapdisk_set_affinity(const char *cpus)
+{
+	cpu_set_t set;
+	unsigned long first, last;
+	const char *p = cpus;
+	char *end;
+
+	CPU_ZERO(&set);
+
+	for (;;) {
+		first = strtoul(p, &end, 10);
+		if (end == p)
+			return -EINVAL;
+		last = first;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtoul(p, &end, 10);
+			if (end == p || last < first)
+				return -EINVAL;
+		}
+		if (last >= CPU_SETSIZE)
+			return -EINVAL;
+		for (; first <= last; first++)
+			CPU_SET(first, &set);
+
+		if (!*end)
+			break;
+		if (*end != ',')
+			return -EINVAL;
+		p = end + 1;
+	}
+
+	if (sched_setaffinity(0, sizeof(set), &set)) {
+		EPRINTF("sched_setaffinity(%s) failed: %d\n", cpus, errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
 int tapdisk_linux_version(void)
 {
 	struct utsname uts;
@@ -169,6 +216,12 @@ int tapdisk_linux_version(void)
 
 #else
 
+int
+tapdisk_set_affinity(const char *cpus)
+{
+	return -ENOSYS;
+}
+
 int tapdisk_linux_version(void)
 {
 	return -ENOSYS;
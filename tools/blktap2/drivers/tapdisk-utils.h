@@ -35,6 +35,7 @@
 void tapdisk_start_logging(const char *);
 void tapdisk_stop_logging(void);
 int tapdisk_set_resource_limits(void);
+int tapdisk_set_affinity(const char *);
 int tapdisk_namedup(char **, const char *);
 int tapdisk_get_image_size(int, uint64_t *, uint32_t *);
 int tapdisk_linux_version(void);
@@ -42,7 +42,7 @@
 static void
 usage(const char *app, int err)
 {
-	fprintf(stderr, "usage: %s [-D] <-u uuid> <-c control socket>\n", app);
+	fprintf(stderr, "usage: %s [-D] [-a cpus] <-u uuid> <-c control socket>\n", app);
 	exit(err);
 }
 
@@ -50,16 +50,23 @@ int
 main(int argc, char *argv[])
 {
 	char *control;
+	const char *cpus;
 	int c, err, nodaemon;
 
 	control  = NULL;
 	nodaemon = 0;
 
-	while ((c = getopt(argc, argv, "s:Dh")) != -1) {
+	/* tap-ctl spawns tapdisk2 without arguments */
+	cpus     = getenv("TAPDISK2_AFFINITY");
+
+	while ((c = getopt(argc, argv, "s:a:Dh")) != -1) {
 		switch (c) {
 		case 'D':
 			nodaemon = 1;
 			break;
+		case 'a':
+			cpus = optarg;
+			break;
 		case 'h':
 			usage(argv[0], 0);
 			break;
@@ -87,6 +94,14 @@ main(int argc, char *argv[])
 
 	tapdisk_start_logging("tapdisk2");
 
+	if (cpus && *cpus) {
+		err = tapdisk_set_affinity(cpus);
+		if (err) {
+			DPRINTF("failed to set affinity to %s: %d\n", cpus, err);
+			goto out;
+		}
+	}
+
 	err = tapdisk_server_init();
 	if (err) {
 		DPRINTF("failed to initialize server: %d\n", err);
@@ -28,39 +28,120 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #include "libvhd.h"
 
+#define COALESCE_THREADS          4
+#define COALESCE_MAX_THREADS      64
+#define COALESCE_RANGE            64    /* blocks a thread takes at once */
+#define COALESCE_CHECKPOINT       1024  /* blocks between progress saves */
+#define COALESCE_PROGRESS_COOKIE  "vcoalesc"
+#define COALESCE_PROGRESS_SUFFIX  ".coalesce"
+
+/*
+ * the child is only read, so copying a block to the parent again is
+ * harmless: a coalesce that was interrupted can go over the blocks that
+ * were not yet recorded as done, once the parent writes of the ones that
+ * were are known to be on disk.  the record of them is the child's uuid
+ * and a bitmap of the BAT, in <child>.coalesce.
+ */
+typedef struct vhd_coalesce_progress {
+	char                 cookie[8];
+	vhd_uuid_t           uuid;
+	uint32_t             entries;
+	uint32_t             pad;
+} vhd_coalesce_progress_t;
+
+typedef struct vhd_coalesce {
+	const char          *name;
+	vhd_context_t       *vhd;         /* child, for the BAT */
+	vhd_context_t       *parent;      /* if the parent is a vhd */
+	int                  parent_fd;   /* if the parent is raw */
+	int                  progress;
+	uint64_t             bandwidth;   /* bytes a second, 0 for no limit */
+
+	pthread_mutex_t      lock;
+	pthread_mutex_t      parent_lock; /* writes may allocate parent blocks */
+	uint32_t             next;        /* next block to hand out */
+	uint32_t             copied;
+	uint32_t             total;
+	uint32_t             unsaved;
+	char                *done;
+	char                *progress_file;
+	int                  err;
+
+	struct timeval       start;
+	uint64_t             written;
+	time_t               reported;
+} vhd_coalesce_t;
+
+#define coalesce_done(co, blk) \
+	((co)->done[(blk) >> 3] & (1 << ((blk) & 7)))
+#define coalesce_set_done(co, blk) \
+	((co)->done[(blk) >> 3] |= (1 << ((blk) & 7)))
+
 static int
 __raw_io_write(int fd, char* buf, uint64_t sec, uint32_t secs)
 {
-	off_t off;
-	size_t ret;
+	ssize_t ret;
 
 	errno = 0;
-	off = lseek(fd, vhd_sectors_to_bytes(sec), SEEK_SET);
-	if (off == (off_t)-1) {
-		printf("raw parent: seek(0x%08"PRIx64") failed: %d\n",
-		       vhd_sectors_to_bytes(sec), -errno);
-		return -errno;
-	}
-
-	ret = write(fd, buf, vhd_sectors_to_bytes(secs));
+	ret = pwrite(fd, buf, vhd_sectors_to_bytes(secs),
+		     vhd_sectors_to_bytes(sec));
 	if (ret == vhd_sectors_to_bytes(secs))
 		return 0;
 
-	printf("raw parent: write of 0x%"PRIx64" returned %zd, errno: %d\n",
-	       vhd_sectors_to_bytes(secs), ret, -errno);
+	printf("raw parent: write of 0x%"PRIx64" at 0x%08"PRIx64" returned "
+	       "%zd, errno: %d\n", vhd_sectors_to_bytes(secs),
+	       vhd_sectors_to_bytes(sec), ret, -errno);
 	return (errno ? -errno : -EIO);
 }
 
-/*
- * Use 'parent' if the parent is VHD, and 'parent_fd' if the parent is raw
- */
+static void
+vhd_coalesce_throttle(vhd_coalesce_t *co, uint64_t bytes)
+{
+	struct timeval now;
+	uint64_t due, elapsed;
+
+	if (!co->bandwidth)
+		return;
+
+	pthread_mutex_lock(&co->lock);
+	co->written += bytes;
+	due = co->written * 1000000 / co->bandwidth;
+	pthread_mutex_unlock(&co->lock);
+
+	gettimeofday(&now, NULL);
+	elapsed = (now.tv_sec - co->start.tv_sec) * 1000000ULL +
+		now.tv_usec - co->start.tv_usec;
+	if (due > elapsed)
+		usleep(due - elapsed);
+}
+
+static int
+vhd_coalesce_write(vhd_coalesce_t *co, char *buf, uint64_t sec, uint32_t secs)
+{
+	int err;
+
+	vhd_coalesce_throttle(co, vhd_sectors_to_bytes(secs));
+
+	if (!co->parent)
+		return __raw_io_write(co->parent_fd, buf, sec, secs);
+
+	pthread_mutex_lock(&co->parent_lock);
+	err = vhd_io_write(co->parent, buf, sec, secs);
+	pthread_mutex_unlock(&co->parent_lock);
+
+	return err;
+}
+
 static int
-vhd_util_coalesce_block(vhd_context_t *vhd, vhd_context_t *parent,
-		int parent_fd, uint64_t block)
+vhd_util_coalesce_block(vhd_context_t *vhd, vhd_coalesce_t *co,
+			uint64_t block)
 {
 	int i, err;
 	char *buf, *map;
@@ -82,10 +163,7 @@ vhd_util_coalesce_block(vhd_context_t *vhd, vhd_context_t *parent,
 		goto done;
 
 	if (vhd_has_batmap(vhd) && vhd_batmap_test(vhd, &vhd->batmap, block)) {
-		if (parent->file)
-			err = vhd_io_write(parent, buf, sec, vhd->spb);
-		else
-			err = __raw_io_write(parent_fd, buf, sec, vhd->spb);
+		err = vhd_coalesce_write(co, buf, sec, vhd->spb);
 		goto done;
 	}
 
@@ -101,14 +179,8 @@ vhd_util_coalesce_block(vhd_context_t *vhd, vhd_context_t *parent,
 			if (!vhd_bitmap_test(vhd, map, i + secs))
 				break;
 
-		if (parent->file)
-			err = vhd_io_write(parent,
-					   buf + vhd_sectors_to_bytes(i),
-					   sec + i, secs);
-		else
-			err = __raw_io_write(parent_fd,
-					     buf + vhd_sectors_to_bytes(i),
-					     sec + i, secs);
+		err = vhd_coalesce_write(co, buf + vhd_sectors_to_bytes(i),
+					 sec + i, secs);
 		if (err)
 			goto done;
 
@@ -123,28 +195,293 @@ done:
 	return err;
 }
 
+static int
+vhd_coalesce_save_progress(vhd_coalesce_t *co)
+{
+	int fd, err;
+	char *tmp;
+	size_t size;
+	vhd_coalesce_progress_t hdr;
+
+	/* nothing is recorded as done before it is on disk */
+	err = fsync(co->parent ? co->parent->fd : co->parent_fd);
+	if (err)
+		return -errno;
+
+	if (asprintf(&tmp, "%s.tmp", co->progress_file) == -1)
+		return -ENOMEM;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.cookie, COALESCE_PROGRESS_COOKIE, sizeof(hdr.cookie));
+	memcpy(&hdr.uuid, &co->vhd->footer.uuid, sizeof(hdr.uuid));
+	hdr.entries = co->vhd->bat.entries;
+	size        = (hdr.entries + 7) >> 3;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		err = -errno;
+		goto out;
+	}
+
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    write(fd, co->done, size) != size || fsync(fd)) {
+		err = (errno ? -errno : -EIO);
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+
+	close(fd);
+	err = (rename(tmp, co->progress_file) ? -errno : 0);
+
+out:
+	free(tmp);
+	return err;
+}
+
+static int
+vhd_coalesce_load_progress(vhd_coalesce_t *co)
+{
+	int fd, err;
+	size_t size;
+	vhd_coalesce_progress_t hdr;
+
+	fd = open(co->progress_file, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		return -errno;
+	}
+
+	err  = -EINVAL;
+	size = (co->vhd->bat.entries + 7) >> 3;
+
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		goto out;
+	if (memcmp(hdr.cookie, COALESCE_PROGRESS_COOKIE, sizeof(hdr.cookie)) ||
+	    memcmp(&hdr.uuid, &co->vhd->footer.uuid, sizeof(hdr.uuid)) ||
+	    hdr.entries != co->vhd->bat.entries) {
+		printf("%s does not belong to %s\n",
+		       co->progress_file, co->name);
+		goto out;
+	}
+	if (read(fd, co->done, size) != size)
+		goto out;
+
+	err = 0;
+
+out:
+	close(fd);
+	return err;
+}
+
+static void
+vhd_coalesce_report(vhd_coalesce_t *co, int force)
+{
+	time_t now;
+
+	if (!co->progress)
+		return;
+
+	now = time(NULL);
+	if (!force && now == co->reported)
+		return;
+
+	co->reported = now;
+	fprintf(stderr, "coalesce: %u/%u blocks (%u%%)\n",
+		co->copied, co->total,
+		co->total ? (unsigned int)(100ULL * co->copied / co->total) : 100);
+}
+
+/* mark @block done; call with co->lock held */
+static int
+vhd_coalesce_block_done(vhd_coalesce_t *co, uint32_t block)
+{
+	coalesce_set_done(co, block);
+	co->copied++;
+	vhd_coalesce_report(co, 0);
+
+	if (++co->unsaved < COALESCE_CHECKPOINT)
+		return 0;
+
+	co->unsaved = 0;
+	return vhd_coalesce_save_progress(co);
+}
+
+/*
+ * each thread reads the child through a context of its own, so that
+ * their reads are independent, and takes ranges of the BAT in turn.
+ */
+static void *
+vhd_coalesce_thread(void *arg)
+{
+	int err;
+	uint32_t blk, end;
+	vhd_context_t vhd;
+	vhd_coalesce_t *co = arg;
+
+	err = vhd_open(&vhd, co->name, VHD_OPEN_RDONLY);
+	if (err)
+		goto out;
+
+	err = vhd_get_bat(&vhd);
+	if (err)
+		goto close;
+
+	if (vhd_has_batmap(&vhd)) {
+		err = vhd_get_batmap(&vhd);
+		if (err)
+			goto close;
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&co->lock);
+		blk = co->next;
+		end = blk + COALESCE_RANGE;
+		if (end > vhd.bat.entries)
+			end = vhd.bat.entries;
+		co->next = end;
+		err = co->err;
+		pthread_mutex_unlock(&co->lock);
+
+		if (err || blk >= end)
+			break;
+
+		for (; blk < end; blk++) {
+			if (vhd.bat.bat[blk] == DD_BLK_UNUSED ||
+			    coalesce_done(co, blk))
+				continue;
+
+			err = vhd_util_coalesce_block(&vhd, co, blk);
+
+			pthread_mutex_lock(&co->lock);
+			if (!err)
+				err = vhd_coalesce_block_done(co, blk);
+			if (err && !co->err)
+				co->err = err;
+			pthread_mutex_unlock(&co->lock);
+
+			if (err)
+				goto close;
+		}
+	}
+
+	err = 0;
+
+close:
+	vhd_close(&vhd);
+out:
+	if (err) {
+		pthread_mutex_lock(&co->lock);
+		if (!co->err)
+			co->err = err;
+		pthread_mutex_unlock(&co->lock);
+	}
+	return NULL;
+}
+
+static int
+vhd_coalesce_run(vhd_coalesce_t *co, int threads, int resume)
+{
+	int i, err, started;
+	uint32_t blk;
+	pthread_t tids[COALESCE_MAX_THREADS];
+
+	err = -ENOMEM;
+	co->done = calloc(1, (co->vhd->bat.entries + 7) >> 3);
+	if (!co->done)
+		return err;
+
+	if (asprintf(&co->progress_file, "%s%s",
+		     co->name, COALESCE_PROGRESS_SUFFIX) == -1) {
+		co->progress_file = NULL;
+		return err;
+	}
+
+	if (resume) {
+		err = vhd_coalesce_load_progress(co);
+		if (err)
+			return err;
+	}
+
+	for (blk = 0; blk < co->vhd->bat.entries; blk++) {
+		if (co->vhd->bat.bat[blk] == DD_BLK_UNUSED)
+			continue;
+		co->total++;
+		if (coalesce_done(co, blk))
+			co->copied++;
+	}
+
+	pthread_mutex_init(&co->lock, NULL);
+	pthread_mutex_init(&co->parent_lock, NULL);
+	gettimeofday(&co->start, NULL);
+
+	for (started = 0; started < threads; started++) {
+		err = -pthread_create(&tids[started], NULL,
+				      vhd_coalesce_thread, co);
+		if (err) {
+			co->err = err;
+			break;
+		}
+	}
+
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	err = co->err;
+	if (err) {
+		/* keep what was done for -r */
+		if (vhd_coalesce_save_progress(co))
+			unlink(co->progress_file);
+	} else {
+		vhd_coalesce_report(co, 1);
+		unlink(co->progress_file);
+	}
+
+	pthread_mutex_destroy(&co->lock);
+	pthread_mutex_destroy(&co->parent_lock);
+	return err;
+}
+
 int
 vhd_util_coalesce(int argc, char **argv)
 {
-	int err, c;
-	uint64_t i;
+	int err, c, threads, resume;
 	char *name, *pname;
 	vhd_context_t vhd, parent;
+	vhd_coalesce_t co;
 	int parent_fd = -1;
 
-	name  = NULL;
-	pname = NULL;
+	name    = NULL;
+	pname   = NULL;
+	threads = COALESCE_THREADS;
+	resume  = 0;
 	parent.file = NULL;
+	memset(&co, 0, sizeof(co));
 
 	if (!argc || !argv)
 		goto usage;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "n:h")) != -1) {
+	while ((c = getopt(argc, argv, "n:t:b:prh")) != -1) {
 		switch (c) {
 		case 'n':
 			name = optarg;
 			break;
+		case 't':
+			threads = atoi(optarg);
+			if (threads < 1 || threads > COALESCE_MAX_THREADS)
+				goto usage;
+			break;
+		case 'b':
+			co.bandwidth = strtoull(optarg, NULL, 10) << 20;
+			break;
+		case 'p':
+			co.progress = 1;
+			break;
+		case 'r':
+			resume = 1;
+			break;
 		case 'h':
 		default:
 			goto usage;
@@ -189,21 +526,18 @@ vhd_util_coalesce(int argc, char **argv)
 	if (err)
 		goto done;
 
-	if (vhd_has_batmap(&vhd)) {
-		err = vhd_get_batmap(&vhd);
-		if (err)
-			goto done;
-	}
-
-	for (i = 0; i < vhd.bat.entries; i++) {
-		err = vhd_util_coalesce_block(&vhd, &parent, parent_fd, i);
-		if (err)
-			goto done;
-	}
+	co.name      = name;
+	co.vhd       = &vhd;
+	co.parent    = (parent.file ? &parent : NULL);
+	co.parent_fd = parent_fd;
 
-	err = 0;
+	err = vhd_coalesce_run(&co, threads, resume);
+	if (err)
+		printf("error coalescing %s: %d\n", name, err);
 
  done:
+	free(co.done);
+	free(co.progress_file);
 	free(pname);
 	vhd_close(&vhd);
 	if (parent.file)
@@ -213,6 +547,7 @@ vhd_util_coalesce(int argc, char **argv)
 	return err;
 
 usage:
-	printf("options: <-n name> [-h help]\n");
+	printf("options: <-n name> [-t threads] [-b bandwidth limit, MB/s] "
+	       "[-p progress] [-r resume] [-h help]\n");
 	return -EINVAL;
 }
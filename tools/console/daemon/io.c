@@ -35,6 +35,7 @@
 #include <termios.h>
 #include <stdarg.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <assert.h>
 #include <sys/types.h>
@@ -42,6 +43,7 @@
 #include <util.h>
 #elif defined(__linux__)
 #include <pty.h>
+#include <sys/epoll.h>
 #elif defined(__sun__)
 #include <stropts.h>
 #elif defined(__FreeBSD__)
@@ -55,10 +57,18 @@
 /* Each 10 bits takes ~ 3 digits, plus one, plus one for nul terminator. */
 #define MAX_STRLEN(x) ((sizeof(x) * CHAR_BIT + CHAR_BIT-1) / 10 * 3 + 2)
 
-/* How many events are allowed in each time period */
-#define RATE_LIMIT_ALLOWANCE 30
-/* Duration of each time period in ms */
-#define RATE_LIMIT_PERIOD 200
+/*
+ * Draining a domain's ring is rate limited by a token bucket: it fills
+ * with RATE_LIMIT_RATE bytes a ms, up to RATE_LIMIT_BURST, and each byte
+ * taken off the ring costs one. A domain out of tokens keeps its event
+ * channel masked, and is drained again once it has RATE_LIMIT_QUANTUM.
+ */
+#define RATE_LIMIT_RATE 128
+#define RATE_LIMIT_BURST (64 * 1024)
+#define RATE_LIMIT_QUANTUM 1024
+
+/* Most chunks written to a log with one writev() */
+#define LOG_IOV_MAX 64
 
 extern int log_reload;
 extern int log_guest;
@@ -74,11 +84,30 @@ static int log_hv_fd = -1;
 
 static xc_gnttab *xcg_handle = NULL;
 
+/*
+ * An fd the main loop waits on. Each pass of the loop says which events
+ * it wants with watch_fd(), none to leave the fd out of the pass, and
+ * finds what happened with fd_revents() after wait_fds().
+ */
+struct watch {
+	int fd;
+	short events;	/* wanted, 0 if not waited on */
+	short revents;	/* seen by the last wait_fds() */
+};
+
+#ifdef __linux__
+/* Most epoll events taken per wait, the rest are seen by the next one */
+#define MAX_EPOLL_EVENTS 128
+
+static int epoll_fd = -1;
+#else
 static struct pollfd  *fds;
+static struct watch **fd_watches;
 static unsigned int current_array_size;
 static unsigned int nr_fds;
 
 #define ROUNDUP(_x,_w) (((unsigned long)(_x)+(1UL<<(_w))-1) & ~((1UL<<(_w))-1))
+#endif
 
 struct buffer {
 	char *data;
@@ -91,7 +120,7 @@ struct buffer {
 struct domain {
 	int domid;
 	int master_fd;
-	int master_pollfd_idx;
+	struct watch tty_watch;
 	int slave_fd;
 	int log_fd;
 	bool is_dead;
@@ -103,10 +132,11 @@ struct domain {
 	evtchn_port_or_error_t local_port;
 	evtchn_port_or_error_t remote_port;
 	xc_evtchn *xce_handle;
-	int xce_pollfd_idx;
+	struct watch ring_watch;
 	struct xencons_interface *interface;
-	int event_count;
-	long long next_period;
+	long long tokens;	/* bytes of ring that may be drained */
+	long long last_refill;	/* ms */
+	bool ring_pending;	/* event taken, ring not drained yet */
 };
 
 static struct domain *dom_head;
@@ -126,6 +156,32 @@ static int write_all(int fd, const char* buf, size_t len)
 	return 0;
 }
 
+static int writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt) {
+		ssize_t ret = writev(fd, iov, iovcnt);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		while (iovcnt && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * The lines and their timestamps go out in as few writev() calls as
+ * possible, rather than in a write() each.
+ */
 static int write_with_timestamp(int fd, const char *data, size_t sz,
 				int *needts)
 {
@@ -134,6 +190,8 @@ static int write_with_timestamp(int fd, const char *data, size_t sz,
 	const struct tm *tmnow = localtime(&now);
 	size_t tslen = strftime(ts, sizeof(ts), "[%Y-%m-%d %H:%M:%S] ", tmnow);
 	const char *last_byte = data + sz - 1;
+	struct iovec iov[LOG_IOV_MAX];
+	int iovcnt = 0;
 
 	while (data <= last_byte) {
 		const char *nl = memchr(data, '\n', last_byte + 1 - data);
@@ -141,9 +199,17 @@ static int write_with_timestamp(int fd, const char *data, size_t sz,
 		if (!found_nl)
 			nl = last_byte;
 
-		if ((*needts && write_all(fd, ts, tslen))
-		    || write_all(fd, data, nl + 1 - data))
-			return -1;
+		if (iovcnt > LOG_IOV_MAX - 2) {
+			if (writev_all(fd, iov, iovcnt))
+				return -1;
+			iovcnt = 0;
+		}
+		if (*needts) {
+			iov[iovcnt].iov_base = ts;
+			iov[iovcnt++].iov_len = tslen;
+		}
+		iov[iovcnt].iov_base = (char *)data;
+		iov[iovcnt++].iov_len = nl + 1 - data;
 
 		*needts = found_nl;
 		data = nl + 1;
@@ -154,22 +220,34 @@ static int write_with_timestamp(int fd, const char *data, size_t sz,
 		}
 	}
 
-	return 0;
+	return iovcnt ? writev_all(fd, iov, iovcnt) : 0;
 }
 
-static void buffer_append(struct domain *dom)
+/*
+ * Take as much of the ring as the domain has tokens for. Returns whether
+ * the ring was drained.
+ */
+static bool buffer_append(struct domain *dom)
 {
 	struct buffer *buffer = &dom->buffer;
-	XENCONS_RING_IDX cons, prod, size;
+	XENCONS_RING_IDX cons, prod, size, avail;
 	struct xencons_interface *intf = dom->interface;
 
 	cons = intf->out_cons;
 	prod = intf->out_prod;
 	xen_mb();
 
-	size = prod - cons;
-	if ((size == 0) || (size > sizeof(intf->out)))
-		return;
+	avail = prod - cons;
+	if ((avail == 0) || (avail > sizeof(intf->out)))
+		return true;
+
+	size = avail;
+	if (size > dom->tokens)
+		size = dom->tokens;
+	if (size == 0)
+		return false;
+	prod = cons + size;
+	dom->tokens -= size;
 
 	if ((buffer->capacity - buffer->size) < size) {
 		buffer->capacity += (size + 1024);
@@ -232,6 +310,8 @@ static void buffer_append(struct domain *dom)
 			buffer->size = buffer->max_capacity / 2 + over;
 		}
 	}
+
+	return size == avail;
 }
 
 static bool buffer_empty(struct buffer *buffer)
@@ -239,6 +319,13 @@ static bool buffer_empty(struct buffer *buffer)
 	return buffer->size == 0;
 }
 
+/* Whether the ring must wait for the tty to take some of the buffer. */
+static bool buffer_full(struct buffer *buffer)
+{
+	return !discard_overflowed_data && buffer->max_capacity &&
+		buffer->size >= buffer->max_capacity;
+}
+
 static void buffer_advance(struct buffer *buffer, size_t len)
 {
 	buffer->consumed += len;
@@ -253,6 +340,140 @@ static void buffer_advance(struct buffer *buffer, size_t len)
 	}
 }
 
+#ifdef __linux__
+/*
+ * The epoll set keeps what it was told on earlier passes, so only a
+ * change of fd or events costs a syscall. epoll takes the same bits as
+ * poll for the events used here.
+ */
+static void unwatch_fd(struct watch *w)
+{
+	struct epoll_event ev = { 0 };
+
+	if (w->events)
+		(void)epoll_ctl(epoll_fd, EPOLL_CTL_DEL, w->fd, &ev);
+	w->events = 0;
+	w->revents = 0;
+}
+
+static void watch_fd(struct watch *w, int fd, short events)
+{
+	struct epoll_event ev = { 0 };
+	int op;
+
+	if (fd == -1)
+		events = 0;
+	if (w->events && w->fd != fd)
+		unwatch_fd(w);
+	if (events == w->events)
+		return;
+
+	if (!events) {
+		unwatch_fd(w);
+		return;
+	}
+
+	op = w->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	ev.events = events;
+	ev.data.ptr = w;
+	if (epoll_ctl(epoll_fd, op, fd, &ev) == -1) {
+		dolog(LOG_ERR, "Failed to watch fd %d: %d (%s)",
+		      fd, errno, strerror(errno));
+		return;
+	}
+	w->fd = fd;
+	w->events = events;
+}
+
+static int wait_fds(int timeout)
+{
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	int i, ret;
+
+	ret = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, timeout);
+	for (i = 0; i < ret; i++)
+		((struct watch *)events[i].data.ptr)->revents =
+			events[i].events;
+
+	return ret;
+}
+#else
+static void unwatch_fd(struct watch *w)
+{
+	w->events = 0;
+	w->revents = 0;
+}
+
+static void watch_fd(struct watch *w, int fd, short events)
+{
+	if (fd == -1)
+		events = 0;
+	w->fd = fd;
+	w->events = events;
+	if (!events)
+		return;
+
+	if (current_array_size < nr_fds + 1) {
+		struct pollfd  *new_fds = NULL;
+		struct watch **new_watches = NULL;
+		unsigned long newsize;
+
+		/* Round up to 2^8 boundary, in practice this just
+		 * make newsize larger than current_array_size.
+		 */
+		newsize = ROUNDUP(nr_fds + 1, 8);
+
+		new_fds = realloc(fds, sizeof(struct pollfd)*newsize);
+		if (!new_fds)
+			goto fail;
+		fds = new_fds;
+		new_watches = realloc(fd_watches,
+				      sizeof(struct watch *)*newsize);
+		if (!new_watches)
+			goto fail;
+		fd_watches = new_watches;
+
+		memset(&fds[0] + current_array_size, 0,
+		       sizeof(struct pollfd) * (newsize-current_array_size));
+		current_array_size = newsize;
+	}
+
+	fds[nr_fds].fd = fd;
+	fds[nr_fds].events = events;
+	fds[nr_fds].revents = 0;
+	fd_watches[nr_fds] = w;
+	nr_fds++;
+	return;
+fail:
+	dolog(LOG_ERR, "realloc failed, ignoring fd %d\n", fd);
+	w->events = 0;
+}
+
+/* The fds are given again on every pass. */
+static int wait_fds(int timeout)
+{
+	unsigned int i;
+	int ret;
+
+	ret = poll(fds, nr_fds, timeout);
+	if (ret > 0)
+		for (i = 0; i < nr_fds; i++)
+			fd_watches[i]->revents = fds[i].revents;
+	nr_fds = 0;
+
+	return ret;
+}
+#endif
+
+/* What the last wait_fds() saw on w, only once. */
+static short fd_revents(struct watch *w)
+{
+	short revents = w->revents;
+
+	w->revents = 0;
+	return revents;
+}
+
 static bool domain_is_valid(int domid)
 {
 	bool ret;
@@ -338,6 +559,7 @@ static int create_domain_log(struct domain *dom)
 static void domain_close_tty(struct domain *dom)
 {
 	if (dom->master_fd != -1) {
+		unwatch_fd(&dom->tty_watch);
 		close(dom->master_fd);
 		dom->master_fd = -1;
 	}
@@ -516,6 +738,16 @@ static int xs_gather(struct xs_handle *xs, const char *dir, ...)
 	return ret;
 }
 
+static void domain_close_evtchn(struct domain *dom)
+{
+	if (dom->xce_handle == NULL)
+		return;
+	unwatch_fd(&dom->ring_watch);
+	xc_evtchn_close(dom->xce_handle);
+	dom->xce_handle = NULL;
+	dom->ring_pending = false;
+}
+
 static void domain_unmap_interface(struct domain *dom)
 {
 	if (dom->interface == NULL)
@@ -584,8 +816,7 @@ static int domain_create_ring(struct domain *dom)
 
 	dom->local_port = -1;
 	dom->remote_port = -1;
-	if (dom->xce_handle != NULL)
-		xc_evtchn_close(dom->xce_handle);
+	domain_close_evtchn(dom);
 
 	/* Opening evtchn independently for each console is a bit
 	 * wasteful, but that's how the code is structured... */
@@ -600,8 +831,7 @@ static int domain_create_ring(struct domain *dom)
 
 	if (rc == -1) {
 		err = errno;
-		xc_evtchn_close(dom->xce_handle);
-		dom->xce_handle = NULL;
+		domain_close_evtchn(dom);
 		goto out;
 	}
 	dom->local_port = rc;
@@ -610,8 +840,7 @@ static int domain_create_ring(struct domain *dom)
 	if (dom->master_fd == -1) {
 		if (!domain_create_tty(dom)) {
 			err = errno;
-			xc_evtchn_close(dom->xce_handle);
-			dom->xce_handle = NULL;
+			domain_close_evtchn(dom);
 			dom->local_port = -1;
 			dom->remote_port = -1;
 			goto out;
@@ -675,12 +904,11 @@ static struct domain *create_domain(int domid)
 	strcat(dom->conspath, "/console");
 
 	dom->master_fd = -1;
-	dom->master_pollfd_idx = -1;
 	dom->slave_fd = -1;
 	dom->log_fd = -1;
-	dom->xce_pollfd_idx = -1;
 
-	dom->next_period = ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000) + RATE_LIMIT_PERIOD;
+	dom->last_refill = ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+	dom->tokens = RATE_LIMIT_BURST;
 
 	dom->ring_ref = -1;
 	dom->local_port = -1;
@@ -749,9 +977,7 @@ static void shutdown_domain(struct domain *d)
 	d->is_dead = true;
 	watch_domain(d, false);
 	domain_unmap_interface(d);
-	if (d->xce_handle != NULL)
-		xc_evtchn_close(d->xce_handle);
-	d->xce_handle = NULL;
+	domain_close_evtchn(d);
 }
 
 static unsigned enum_pass = 0;
@@ -865,22 +1091,42 @@ static void handle_tty_write(struct domain *dom)
 	}
 }
 
-static void handle_ring_read(struct domain *dom)
+static void domain_refill_tokens(struct domain *dom, long long now)
 {
-	evtchn_port_or_error_t port;
+	long long elapsed = now - dom->last_refill;
 
-	if (dom->is_dead)
+	if (elapsed <= 0)
 		return;
+	dom->last_refill = now;
+	dom->tokens += elapsed * RATE_LIMIT_RATE;
+	if (dom->tokens > RATE_LIMIT_BURST)
+		dom->tokens = RATE_LIMIT_BURST;
+}
 
-	if ((port = xc_evtchn_pending(dom->xce_handle)) == -1)
-		return;
+/*
+ * The event channel stays masked from the event being taken until the
+ * ring has been drained, which may take several passes of a domain
+ * short of tokens. Each pass drains a domain at most once, so one
+ * spamming guest cannot hold up the others.
+ */
+static void domain_drain_ring(struct domain *dom)
+{
+	if (buffer_append(dom)) {
+		dom->ring_pending = false;
+		(void)xc_evtchn_unmask(dom->xce_handle, dom->local_port);
+	}
+}
 
-	dom->event_count++;
+static void handle_ring_read(struct domain *dom)
+{
+	if (dom->is_dead)
+		return;
 
-	buffer_append(dom);
+	if (xc_evtchn_pending(dom->xce_handle) == -1)
+		return;
 
-	if (dom->event_count < RATE_LIMIT_ALLOWANCE)
-		(void)xc_evtchn_unmask(dom->xce_handle, port);
+	dom->ring_pending = true;
+	domain_drain_ring(dom);
 }
 
 static void handle_xs(void)
@@ -952,55 +1198,23 @@ static void handle_log_reload(void)
 	}
 }
 
-/* Returns index inside fds array if succees, -1 if fail */
-static int set_fds(int fd, short events)
-{
-	int ret;
-	if (current_array_size < nr_fds + 1) {
-		struct pollfd  *new_fds = NULL;
-		unsigned long newsize;
-
-		/* Round up to 2^8 boundary, in practice this just
-		 * make newsize larger than current_array_size.
-		 */
-		newsize = ROUNDUP(nr_fds + 1, 8);
-
-		new_fds = realloc(fds, sizeof(struct pollfd)*newsize);
-		if (!new_fds)
-			goto fail;
-		fds = new_fds;
-
-		memset(&fds[0] + current_array_size, 0,
-		       sizeof(struct pollfd) * (newsize-current_array_size));
-		current_array_size = newsize;
-	}
-
-	fds[nr_fds].fd = fd;
-	fds[nr_fds].events = events;
-	ret = nr_fds;
-	nr_fds++;
-
-	return ret;
-fail:
-	dolog(LOG_ERR, "realloc failed, ignoring fd %d\n", fd);
-	return -1;
-}
-
-static void reset_fds(void)
-{
-	nr_fds = 0;
-	if (fds)
-		memset(fds, 0, sizeof(struct pollfd) * current_array_size);
-}
-
 void handle_io(void)
 {
 	int ret;
 	evtchn_port_or_error_t log_hv_evtchn = -1;
-	int xce_pollfd_idx = -1;
-	int xs_pollfd_idx = -1;
+	struct watch xce_watch = { 0 };
+	struct watch xs_watch = { 0 };
 	xc_evtchn *xce_handle = NULL;
 
+#ifdef __linux__
+	epoll_fd = epoll_create(MAX_EPOLL_EVENTS);
+	if (epoll_fd == -1) {
+		dolog(LOG_ERR, "Failed to create epoll set: %d (%s)",
+		      errno, strerror(errno));
+		return;
+	}
+#endif
+
 	if (log_hv) {
 		xce_handle = xc_evtchn_open(NULL, 0);
 		if (xce_handle == NULL) {
@@ -1029,58 +1243,47 @@ void handle_io(void)
 
 	for (;;) {
 		struct domain *d, *n;
-		int poll_timeout; /* timeout in milliseconds */
+		int poll_timeout = -1; /* timeout in milliseconds */
 		struct timespec ts;
 		long long now, next_timeout = 0;
+		short revents;
 
-		reset_fds();
-
-		xs_pollfd_idx = set_fds(xs_fileno(xs), POLLIN|POLLPRI);
+		watch_fd(&xs_watch, xs_fileno(xs), POLLIN|POLLPRI);
 
 		if (log_hv)
-			xce_pollfd_idx = set_fds(xc_evtchn_fd(xce_handle),
-						 POLLIN|POLLPRI);
+			watch_fd(&xce_watch, xc_evtchn_fd(xce_handle),
+				 POLLIN|POLLPRI);
 
 		if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
-			return;
+			break;
 		now = ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
 
-		/* Re-calculate any event counter allowances & unblock
-		   domains with new allowance */
 		for (d = dom_head; d; d = d->next) {
-			/* CS 16257:955ee4fa1345 introduces a 5ms fuzz
-			 * for select(), it is not clear poll() has
-			 * similar behavior (returning a couple of ms
-			 * sooner than requested) as well. Just leave
-			 * the fuzz here. Remove it with a separate
-			 * patch if necessary */
-			if ((now+5) > d->next_period) {
-				d->next_period = now + RATE_LIMIT_PERIOD;
-				if (d->event_count >= RATE_LIMIT_ALLOWANCE) {
-					(void)xc_evtchn_unmask(d->xce_handle, d->local_port);
-				}
-				d->event_count = 0;
+			short events = 0;
+
+			/* A throttled domain is woken once it has earned
+			   a quantum of tokens */
+			if (d->ring_pending && d->xce_handle != NULL &&
+			    !buffer_full(&d->buffer)) {
+				long long wake = d->last_refill;
+
+				if (d->tokens < RATE_LIMIT_QUANTUM)
+					wake += (RATE_LIMIT_QUANTUM - d->tokens +
+						 RATE_LIMIT_RATE - 1) /
+						RATE_LIMIT_RATE;
+				if (!next_timeout || wake < next_timeout)
+					next_timeout = wake;
 			}
-		}
 
-		for (d = dom_head; d; d = d->next) {
-			if (d->event_count >= RATE_LIMIT_ALLOWANCE) {
-				/* Determine if we're going to be the next time slice to expire */
-				if (!next_timeout ||
-				    d->next_period < next_timeout)
-					next_timeout = d->next_period;
-			} else if (d->xce_handle != NULL) {
-				if (discard_overflowed_data ||
-				    !d->buffer.max_capacity ||
-				    d->buffer.size < d->buffer.max_capacity) {
-					int evtchn_fd = xc_evtchn_fd(d->xce_handle);
-					d->xce_pollfd_idx = set_fds(evtchn_fd,
-								    POLLIN|POLLPRI);
-				}
-			}
+			if (d->xce_handle != NULL && !d->ring_pending &&
+			    !buffer_full(&d->buffer))
+				watch_fd(&d->ring_watch,
+					 xc_evtchn_fd(d->xce_handle),
+					 POLLIN|POLLPRI);
+			else
+				unwatch_fd(&d->ring_watch);
 
 			if (d->master_fd != -1) {
-				short events = 0;
 				if (!d->is_dead && ring_free_bytes(d))
 					events |= POLLIN;
 
@@ -1088,22 +1291,21 @@ void handle_io(void)
 					events |= POLLOUT;
 
 				if (events)
-					d->master_pollfd_idx =
-						set_fds(d->master_fd,
-							events|POLLPRI);
+					events |= POLLPRI;
 			}
+			watch_fd(&d->tty_watch, d->master_fd, events);
 		}
 
 		/* If any domain has been rate limited, we need to work
 		   out what timeout to supply to poll */
 		if (next_timeout) {
 			long long duration = (next_timeout - now);
-			if (duration <= 0) /* sanity check */
-				duration = 1;
+			if (duration < 0)
+				duration = 0;
 			poll_timeout = (int)duration;
 		}
 
-		ret = poll(fds, nr_fds, next_timeout ? poll_timeout : -1);
+		ret = wait_fds(poll_timeout);
 
 		if (log_reload) {
 			handle_log_reload();
@@ -1120,62 +1322,60 @@ void handle_io(void)
 			break;
 		}
 
-		if (log_hv && xce_pollfd_idx != -1) {
-			if (fds[xce_pollfd_idx].revents & ~(POLLIN|POLLOUT|POLLPRI)) {
+		if (log_hv) {
+			revents = fd_revents(&xce_watch);
+			if (revents & ~(POLLIN|POLLOUT|POLLPRI)) {
 				dolog(LOG_ERR,
 				      "Failure in poll xce_handle: %d (%s)",
 				      errno, strerror(errno));
 				break;
-			} else if (fds[xce_pollfd_idx].revents & POLLIN)
+			} else if (revents & POLLIN)
 				handle_hv_logs(xce_handle);
-
-			xce_pollfd_idx = -1;
 		}
 
-		if (ret <= 0)
-			continue;
-
-		if (xs_pollfd_idx != -1) {
-			if (fds[xs_pollfd_idx].revents & ~(POLLIN|POLLOUT|POLLPRI)) {
-				dolog(LOG_ERR,
-				      "Failure in poll xs_handle: %d (%s)",
-				      errno, strerror(errno));
-				break;
-			} else if (fds[xs_pollfd_idx].revents & POLLIN)
-				handle_xs();
+		revents = fd_revents(&xs_watch);
+		if (revents & ~(POLLIN|POLLOUT|POLLPRI)) {
+			dolog(LOG_ERR,
+			      "Failure in poll xs_handle: %d (%s)",
+			      errno, strerror(errno));
+			break;
+		} else if (revents & POLLIN)
+			handle_xs();
 
-			xs_pollfd_idx = -1;
-		}
+		if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+			break;
+		now = ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
 
 		for (d = dom_head; d; d = n) {
 			n = d->next;
-			if (d->event_count < RATE_LIMIT_ALLOWANCE) {
-				if (d->xce_handle != NULL &&
-				    d->xce_pollfd_idx != -1 &&
-				    !(fds[d->xce_pollfd_idx].revents &
-				      ~(POLLIN|POLLOUT|POLLPRI)) &&
-				      (fds[d->xce_pollfd_idx].revents &
-				       POLLIN))
-				    handle_ring_read(d);
+
+			domain_refill_tokens(d, now);
+
+			revents = fd_revents(&d->ring_watch);
+			if (d->xce_handle != NULL) {
+				if (!(revents & ~(POLLIN|POLLOUT|POLLPRI)) &&
+				    (revents & POLLIN))
+					handle_ring_read(d);
+				else if (d->ring_pending && !d->is_dead &&
+					 d->tokens >= RATE_LIMIT_QUANTUM &&
+					 !buffer_full(&d->buffer))
+					domain_drain_ring(d);
 			}
 
-			if (d->master_fd != -1 && d->master_pollfd_idx != -1) {
-				if (fds[d->master_pollfd_idx].revents &
-				    ~(POLLIN|POLLOUT|POLLPRI))
+			revents = fd_revents(&d->tty_watch);
+			if (d->master_fd != -1 && revents) {
+				if (revents & ~(POLLIN|POLLOUT|POLLPRI))
 					domain_handle_broken_tty(d,
 						   domain_is_valid(d->domid));
 				else {
-					if (fds[d->master_pollfd_idx].revents &
-					    POLLIN)
+					if (revents & POLLIN)
 						handle_tty_read(d);
-					if (fds[d->master_pollfd_idx].revents &
-					    POLLOUT)
+					if ((revents & POLLOUT) &&
+					    d->master_fd != -1)
 						handle_tty_write(d);
 				}
 			}
 
-			d->xce_pollfd_idx = d->master_pollfd_idx = -1;
-
 			if (d->last_seen != enum_pass)
 				shutdown_domain(d);
 
@@ -1184,8 +1384,13 @@ void handle_io(void)
 		}
 	}
 
+#ifndef __linux__
 	free(fds);
+	fds = NULL;
+	free(fd_watches);
+	fd_watches = NULL;
 	current_array_size = 0;
+#endif
 
  out:
 	if (log_hv_fd != -1) {
@@ -1201,6 +1406,10 @@ void handle_io(void)
 		xcg_handle = NULL;
 	}
 	log_hv_evtchn = -1;
+#ifdef __linux__
+	close(epoll_fd);
+	epoll_fd = -1;
+#endif
 }
 
 /*
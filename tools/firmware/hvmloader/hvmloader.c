@@ -26,6 +26,7 @@
 #include "pci_regs.h"
 #include "apic_regs.h"
 #include "acpi/acpi2_0.h"
+#include "vnuma.h"
 #include <xen/version.h>
 #include <xen/hvm/params.h>
 
@@ -263,6 +264,8 @@ int main(void)
 
     xenbus_setup();
 
+    init_vnuma_info();
+
     bios = detect_bios();
     printf("System requested %s\n", bios->name);
 
@@ -0,0 +1,69 @@
+/*
+ * vnuma.c: obtain the guest's virtual NUMA topology from Xen.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place - Suite 330, Boston, MA 02111-1307 USA.
+ */
+
+#include "config.h"
+#include "util.h"
+#include "hypercall.h"
+#include "vnuma.h"
+#include <errno.h>
+
+unsigned int nr_vnodes, nr_vmemranges;
+unsigned int *vcpu_to_vnode, *vdistance;
+xen_vmemrange_t *vmemrange;
+
+void init_vnuma_info(void)
+{
+    int rc;
+    struct xen_vnuma_topology_info vnuma_topo = { .domid = DOMID_SELF };
+
+    /* With no room for the arrays, Xen only tells how large they are. */
+    rc = hypercall_memory_op(XENMEM_get_vnumainfo, &vnuma_topo);
+    if ( rc != -ENOBUFS )
+        return;
+
+    vcpu_to_vnode = scratch_alloc(sizeof(*vcpu_to_vnode) *
+                                  vnuma_topo.nr_vcpus, 0);
+    vdistance = scratch_alloc(sizeof(uint32_t) * vnuma_topo.nr_vnodes *
+                              vnuma_topo.nr_vnodes, 0);
+    vmemrange = scratch_alloc(sizeof(xen_vmemrange_t) *
+                              vnuma_topo.nr_vmemranges, 0);
+
+    set_xen_guest_handle(vnuma_topo.vdistance.h, vdistance);
+    set_xen_guest_handle(vnuma_topo.vcpu_to_vnode.h, vcpu_to_vnode);
+    set_xen_guest_handle(vnuma_topo.vmemrange.h, vmemrange);
+
+    rc = hypercall_memory_op(XENMEM_get_vnumainfo, &vnuma_topo);
+    if ( rc < 0 )
+    {
+        printf("Failed to retrieve vNUMA information, rc = %d\n", rc);
+        return;
+    }
+
+    nr_vnodes = vnuma_topo.nr_vnodes;
+    nr_vmemranges = vnuma_topo.nr_vmemranges;
+    printf("vNUMA: %u nodes, %u memory ranges\n", nr_vnodes, nr_vmemranges);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -52,6 +52,14 @@ fsi_t *fsi_open_fsimage(const char *path, uint64_t off, const char *options)
 	fsi->f_off = off;
 	fsi->f_data = NULL;
 	fsi->f_bootstring = NULL;
+	fsi->f_rabuf = NULL;
+	fsi->f_raoff = 0;
+	fsi->f_ralen = 0;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	/* Kernels and ramdisks are read front to back, often from a file. */
+	(void) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
 
 	pthread_mutex_lock(&fsi_lock);
 	err = find_plugin(fsi, path, options);
@@ -75,6 +83,7 @@ void fsi_close_fsimage(fsi_t *fsi)
 	pthread_mutex_lock(&fsi_lock);
         fsi->f_plugin->fp_ops->fpo_umount(fsi);
         (void) close(fsi->f_fd);
+	free(fsi->f_rabuf);
 	free(fsi);
 	pthread_mutex_unlock(&fsi_lock);
 }
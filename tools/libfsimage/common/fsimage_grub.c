@@ -154,6 +154,40 @@ fsig_log2 (unsigned long word)
 }
 #endif
 
+/*
+ * The grub filesystem code reads a block at a time, so copying out a
+ * kernel costs a pread (or three) per block.  Serve small reads from a
+ * sector-aligned window of FSIG_RA_SIZE bytes instead.
+ */
+#define	FSIG_RA_SIZE	(128 * 1024)
+
+static int
+fsig_ra_read(fsi_t *fsi, off_t off, unsigned int bufsize, char *buf)
+{
+	off_t start;
+	ssize_t ret;
+
+	if (fsi->f_ralen == 0 || off < fsi->f_raoff ||
+	    off + bufsize > fsi->f_raoff + fsi->f_ralen) {
+		if (fsi->f_rabuf == NULL &&
+		    (fsi->f_rabuf = malloc(FSIG_RA_SIZE)) == NULL)
+			return (0);
+		start = off & ~(off_t)(SECTOR_SIZE - 1);
+		ret = pread(fsi->f_fd, fsi->f_rabuf, FSIG_RA_SIZE, start);
+		if (ret <= 0) {
+			fsi->f_ralen = 0;
+			return (0);
+		}
+		fsi->f_raoff = start;
+		fsi->f_ralen = ret;
+		if (off + bufsize > fsi->f_raoff + fsi->f_ralen)
+			return (0);
+	}
+
+	memcpy(buf, fsi->f_rabuf + (off - fsi->f_raoff), bufsize);
+	return (1);
+}
+
 int
 fsig_devread(fsi_file_t *ffi, unsigned int sector, unsigned int offset,
     unsigned int bufsize, char *buf)
@@ -165,6 +199,10 @@ fsig_devread(fsi_file_t *ffi, unsigned int sector, unsigned int offset,
 
 	off = ffi->ff_fsi->f_off + ((off_t)sector * SECTOR_SIZE) + offset;
 
+	if (bufsize <= FSIG_RA_SIZE - SECTOR_SIZE &&
+	    fsig_ra_read(ffi->ff_fsi, off, bufsize, buf))
+		return (1);
+
 	/*
 	 * Make reads from a raw disk sector-aligned. This is a requirement
 	 * for NetBSD. Split the read up into to three parts to meet this
@@ -47,6 +47,9 @@ struct fsi {
 	void *f_data;
 	fsi_plugin_t *f_plugin;
 	char *f_bootstring;
+	char *f_rabuf;		/* readahead window, see fsig_devread() */
+	uint64_t f_raoff;
+	size_t f_ralen;
 };
 
 struct fsi_file {
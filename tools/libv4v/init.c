@@ -0,0 +1,239 @@
+/*
+ * init.c
+ *
+ * Setup and teardown of a libxenv4v handle: the ring's memory, its
+ * event channel and its registration with xen.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "libxenv4v_private.h"
+
+void *libxenv4v_buffer_alloc(size_t size)
+{
+    void *p;
+    int saved_errno;
+
+    size = LIBXENV4V_PAGE_ROUND(size);
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( p == MAP_FAILED )
+        return NULL;
+
+    /* a child writing to it would move it under xen's feet */
+    if ( mlock(p, size) || madvise(p, size, MADV_DONTFORK) )
+    {
+        saved_errno = errno;
+        munmap(p, size);
+        errno = saved_errno;
+        return NULL;
+    }
+    memset(p, 0, size);
+
+    return p;
+}
+
+void libxenv4v_buffer_free(void *p, size_t size)
+{
+    if ( !p )
+        return;
+    size = LIBXENV4V_PAGE_ROUND(size);
+    munlock(p, size);
+    munmap(p, size);
+}
+
+/* frame numbers of the npage pages at p, see libxenv4v.h */
+static int ring_pfns(void *p, uint32_t npage, v4v_pfn_t *pfns)
+{
+    unsigned long va = (unsigned long)p;
+    uint64_t ent;
+    uint32_t i;
+    int fd, ret = 0;
+
+    fd = open("/proc/self/pagemap", O_RDONLY);
+    if ( fd < 0 )
+        return -errno;
+
+    for ( i = 0; i < npage; i++, va += XC_PAGE_SIZE )
+    {
+        if ( pread(fd, &ent, sizeof(ent),
+                   (va >> XC_PAGE_SHIFT) * sizeof(ent)) != sizeof(ent) )
+        {
+            ret = -EIO;
+            break;
+        }
+        /* present, and a frame number the kernel let us see */
+        if ( !(ent & (1ULL << 63)) || !(ent & ((1ULL << 55) - 1)) )
+        {
+            ret = -EPERM;
+            break;
+        }
+        pfns[i] = ent & ((1ULL << 55) - 1);
+    }
+
+    close(fd);
+    return ret;
+}
+
+/*
+ * A port of our own bound to another of our ports: xen signals the
+ * ring on the first, and the second is what the event channel device
+ * reports.
+ */
+static int ring_evtchn(struct libxenv4v *v4v)
+{
+    int port;
+
+    v4v->xce = xc_evtchn_open(NULL, 0);
+    if ( !v4v->xce )
+        return -1;
+
+    port = xc_evtchn_bind_unbound_port(v4v->xce, DOMID_SELF);
+    if ( port < 0 )
+        return -1;
+    v4v->ring_port = port;
+
+    port = xc_evtchn_bind_interdomain(v4v->xce, DOMID_SELF, v4v->ring_port);
+    if ( port < 0 )
+        return -1;
+    v4v->local_port = port;
+
+    return 0;
+}
+
+struct libxenv4v *libxenv4v_open(xentoollog_logger *logger, uint32_t port,
+                                 domid_t partner, uint32_t len,
+                                 uint32_t flags)
+{
+    struct libxenv4v *v4v;
+    v4v_ring_t *r;
+    int ret, saved_errno;
+
+    if ( flags & V4V_RING_F_STREAM )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if ( !len || (len % V4V_RING_MSG_ALIGN(flags)) )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    v4v = calloc(1, sizeof(*v4v));
+    if ( !v4v )
+        return NULL;
+
+    v4v->len = len;
+    v4v->align = V4V_RING_MSG_ALIGN(flags);
+    v4v->npage = (sizeof(v4v_ring_t) + len + XC_PAGE_SIZE - 1) >>
+                 XC_PAGE_SHIFT;
+
+    v4v->xch = xc_interface_open(logger, NULL, 0);
+    if ( !v4v->xch )
+        goto fail;
+
+    if ( ring_evtchn(v4v) )
+        goto fail;
+
+    v4v->scratch = libxenv4v_buffer_alloc(sizeof(*v4v->scratch));
+    v4v->ring = libxenv4v_buffer_alloc((size_t)v4v->npage << XC_PAGE_SHIFT);
+    v4v->pfns = libxenv4v_buffer_alloc(v4v->npage * sizeof(v4v_pfn_t));
+    if ( !v4v->scratch || !v4v->ring || !v4v->pfns )
+        goto fail;
+
+    if ( (ret = ring_pfns(v4v->ring, v4v->npage, v4v->pfns)) )
+    {
+        errno = -ret;
+        goto fail;
+    }
+
+    r = v4v->ring;
+    r->magic = V4V_RING_MAGIC;
+    r->id.addr.port = port;
+    r->id.addr.domain = V4V_DOMID_ANY;
+    r->id.partner = partner;
+    r->len = len;
+    r->flags = flags;
+    r->evtchn = v4v->ring_port;
+
+    if ( xc_v4v_op(v4v->xch, V4VOP_register_ring, r, v4v->pfns,
+                   v4v->npage, 0) < 0 )
+    {
+        r->magic = 0;
+        goto fail;
+    }
+
+    /* xen filled in our domain id, and the shard */
+    v4v->id = r->id;
+
+    return v4v;
+
+fail:
+    saved_errno = errno;
+    libxenv4v_close(v4v);
+    errno = saved_errno;
+    return NULL;
+}
+
+void libxenv4v_close(struct libxenv4v *v4v)
+{
+    if ( !v4v )
+        return;
+
+    if ( v4v->ring && v4v->ring->magic )
+        xc_v4v_op(v4v->xch, V4VOP_unregister_ring, v4v->ring, NULL, 0, 0);
+
+    libxenv4v_buffer_free(v4v->ring, (size_t)v4v->npage << XC_PAGE_SHIFT);
+    libxenv4v_buffer_free(v4v->pfns, v4v->npage * sizeof(v4v_pfn_t));
+    libxenv4v_buffer_free(v4v->scratch, sizeof(*v4v->scratch));
+
+    if ( v4v->xce )
+    {
+        if ( v4v->local_port )
+            xc_evtchn_unbind(v4v->xce, v4v->local_port);
+        if ( v4v->ring_port )
+            xc_evtchn_unbind(v4v->xce, v4v->ring_port);
+        xc_evtchn_close(v4v->xce);
+    }
+    if ( v4v->xch )
+        xc_interface_close(v4v->xch);
+
+    free(v4v);
+}
+
+int libxenv4v_fd_for_select(struct libxenv4v *v4v)
+{
+    return xc_evtchn_fd(v4v->xce);
+}
+
+int libxenv4v_wait(struct libxenv4v *v4v)
+{
+    int port = xc_evtchn_pending(v4v->xce);
+
+    if ( port < 0 )
+        return -1;
+
+    return xc_evtchn_unmask(v4v->xce, port);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,350 @@
+/*
+ * io.c
+ *
+ * Receiving from the ring of a libxenv4v handle, which is read in
+ * place, and sending through xen.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "libxenv4v_private.h"
+
+#define RING_ROUNDUP(_v4v, _x)                                          \
+    (((_x) + (_v4v)->align - 1) & ~((_v4v)->align - 1))
+
+static inline uint32_t ring_tx_ptr(struct libxenv4v *v4v)
+{
+    return *(volatile uint32_t *)&v4v->ring->tx_ptr;
+}
+
+static inline uint32_t ring_wrap(struct libxenv4v *v4v, uint32_t ptr)
+{
+    return (ptr >= v4v->len) ? (ptr - v4v->len) : ptr;
+}
+
+static inline uint32_t ring_used(struct libxenv4v *v4v, uint32_t rx_ptr,
+                                 uint32_t tx_ptr)
+{
+    return (tx_ptr >= rx_ptr) ? (tx_ptr - rx_ptr)
+                              : (tx_ptr + v4v->len - rx_ptr);
+}
+
+/* copy len bytes of the ring at ptr, which may wrap, to buf */
+static void ring_copy(struct libxenv4v *v4v, void *buf, uint32_t ptr,
+                      uint32_t len)
+{
+    uint32_t chunk = v4v->len - ptr;
+
+    if ( chunk >= len )
+    {
+        memcpy(buf, &v4v->ring->ring[ptr], len);
+        return;
+    }
+    memcpy(buf, &v4v->ring->ring[ptr], chunk);
+    memcpy((uint8_t *)buf + chunk, v4v->ring->ring, len - chunk);
+}
+
+static void ring_set_rx_ptr(struct libxenv4v *v4v, uint32_t rx_ptr)
+{
+    /* done reading before giving the space back */
+    xen_mb();
+    *(volatile uint32_t *)&v4v->ring->rx_ptr = rx_ptr;
+}
+
+uint32_t libxenv4v_data_ready(struct libxenv4v *v4v)
+{
+    uint32_t rx_ptr = v4v->ring->rx_ptr;
+
+    if ( rx_ptr >= v4v->len )
+        return 0;
+
+    return ring_used(v4v, rx_ptr, ring_tx_ptr(v4v));
+}
+
+/*
+ * Describe the message at rx_ptr, of the messages up to tx_ptr, in msg
+ * and set *next to the message after it.
+ * @return 1, 0 if there is none, -1 with errno EBADMSG if it is corrupt
+ */
+static int ring_parse(struct libxenv4v *v4v, uint32_t rx_ptr, uint32_t tx_ptr,
+                      struct libxenv4v_msg *msg, uint32_t *next)
+{
+    struct v4v_ring_message_header mh;
+    uint32_t avail, ptr, len;
+
+    if ( rx_ptr == tx_ptr )
+        return 0;
+
+    if ( (rx_ptr >= v4v->len) || (RING_ROUNDUP(v4v, rx_ptr) != rx_ptr) ||
+         (tx_ptr >= v4v->len) )
+        goto bad;
+
+    avail = ring_used(v4v, rx_ptr, tx_ptr);
+    if ( avail < sizeof(mh) )
+        goto bad;
+
+    /* the header can straddle the end of the ring as well */
+    ring_copy(v4v, &mh, rx_ptr, sizeof(mh));
+    if ( (mh.len < sizeof(mh)) || (RING_ROUNDUP(v4v, mh.len) > avail) )
+        goto bad;
+
+    *next = ring_wrap(v4v, rx_ptr + RING_ROUNDUP(v4v, mh.len));
+    msg->flags = mh.flags;
+    if ( mh.flags & V4V_MSG_F_DISCARD )
+        return 1;
+
+    ptr = ring_wrap(v4v, rx_ptr + sizeof(mh));
+    len = mh.len - sizeof(mh);
+
+    msg->stamp = 0;
+    if ( mh.flags & V4V_MSG_F_TSTAMP )
+    {
+        if ( len < sizeof(msg->stamp) )
+            goto bad;
+        ring_copy(v4v, &msg->stamp, ptr, sizeof(msg->stamp));
+        ptr = ring_wrap(v4v, ptr + sizeof(msg->stamp));
+        len -= sizeof(msg->stamp);
+    }
+
+    msg->source = mh.source;
+    msg->message_type = mh.message_type;
+    msg->len = len;
+    msg->seg[0] = &v4v->ring->ring[ptr];
+    msg->seg_len[0] = len;
+    msg->seg[1] = NULL;
+    msg->seg_len[1] = 0;
+    if ( len > (v4v->len - ptr) )
+    {
+        msg->seg_len[0] = v4v->len - ptr;
+        msg->seg[1] = v4v->ring->ring;
+        msg->seg_len[1] = len - msg->seg_len[0];
+    }
+
+    return 1;
+
+bad:
+    errno = EBADMSG;
+    return -1;
+}
+
+int libxenv4v_peek(struct libxenv4v *v4v, struct libxenv4v_msg *msg)
+{
+    uint32_t rx_ptr, tx_ptr;
+    int ret;
+
+    for ( ; ; )
+    {
+        rx_ptr = v4v->ring->rx_ptr;
+        tx_ptr = ring_tx_ptr(v4v);
+        /* read tx_ptr before the messages */
+        xen_rmb();
+
+        ret = ring_parse(v4v, rx_ptr, tx_ptr, msg, &v4v->next_rx_ptr);
+        if ( ret <= 0 )
+            return ret;
+        if ( !(msg->flags & V4V_MSG_F_DISCARD) )
+            break;
+
+        ring_set_rx_ptr(v4v, v4v->next_rx_ptr);
+    }
+
+    v4v->peeked = 1;
+    return 1;
+}
+
+int libxenv4v_peek_batch(struct libxenv4v *v4v, struct libxenv4v_msg *msg,
+                         unsigned int nmsg)
+{
+    uint32_t rx_ptr = v4v->ring->rx_ptr, tx_ptr = ring_tx_ptr(v4v), next;
+    unsigned int n = 0;
+    int ret;
+
+    /* read tx_ptr before the messages */
+    xen_rmb();
+
+    while ( n < nmsg )
+    {
+        ret = ring_parse(v4v, rx_ptr, tx_ptr, &msg[n], &next);
+        if ( ret < 0 )
+        {
+            /* hand out what came before it, the caller finds it next time */
+            if ( n || (rx_ptr != v4v->ring->rx_ptr) )
+                break;
+            return -1;
+        }
+        if ( ret == 0 )
+            break;
+        rx_ptr = next;
+        if ( !(msg[n].flags & V4V_MSG_F_DISCARD) )
+            n++;
+    }
+
+    v4v->next_rx_ptr = rx_ptr;
+    v4v->peeked = (rx_ptr != v4v->ring->rx_ptr);
+    return n;
+}
+
+void libxenv4v_consume(struct libxenv4v *v4v)
+{
+    uint32_t used;
+
+    if ( !v4v->peeked )
+        return;
+    v4v->peeked = 0;
+
+    used = ring_used(v4v, v4v->ring->rx_ptr, ring_tx_ptr(v4v));
+    ring_set_rx_ptr(v4v, v4v->next_rx_ptr);
+
+    /*
+     * Xen doesn't see rx_ptr move, the senders waiting for room are only
+     * woken up by V4VOP_notify. Once the ring was half full, or once it
+     * is drained so that anything that fits fits, is often enough.
+     */
+    if ( (used > (v4v->len / 2)) || (v4v->next_rx_ptr == ring_tx_ptr(v4v)) )
+    {
+        v4v->scratch->ring_id = v4v->id;
+        xc_v4v_op(v4v->xch, V4VOP_notify, NULL, &v4v->scratch->ring_id, 0, 0);
+    }
+}
+
+ssize_t libxenv4v_recv(struct libxenv4v *v4v, void *buf, size_t size,
+                       v4v_addr_t *source, uint32_t *message_type)
+{
+    struct libxenv4v_msg msg;
+    size_t chunk;
+    int ret;
+
+    ret = libxenv4v_peek(v4v, &msg);
+    if ( ret <= 0 )
+        return ret;
+
+    chunk = (size < msg.seg_len[0]) ? size : msg.seg_len[0];
+    memcpy(buf, msg.seg[0], chunk);
+    size -= chunk;
+    if ( size && msg.seg_len[1] )
+        memcpy((uint8_t *)buf + chunk, msg.seg[1],
+               (size < msg.seg_len[1]) ? size : msg.seg_len[1]);
+
+    if ( source )
+        *source = msg.source;
+    if ( message_type )
+        *message_type = msg.message_type;
+
+    libxenv4v_consume(v4v);
+    return msg.len;
+}
+
+ssize_t libxenv4v_sendv(struct libxenv4v *v4v, const v4v_addr_t *dst,
+                        uint32_t message_type, const v4v_iov_t *iov,
+                        uint32_t niov)
+{
+    struct libxenv4v_scratch *s = v4v->scratch;
+
+    if ( niov > V4V_MAXIOV )
+    {
+        errno = E2BIG;
+        return -1;
+    }
+
+    s->addr.src = v4v->id.addr;
+    s->addr.dst = *dst;
+    memcpy(s->iov, iov, niov * sizeof(*iov));
+
+    return xc_v4v_op(v4v->xch, V4VOP_sendv, &s->addr, s->iov, niov,
+                     message_type);
+}
+
+ssize_t libxenv4v_send(struct libxenv4v *v4v, const v4v_addr_t *dst,
+                       uint32_t message_type, const void *buf, size_t len)
+{
+    v4v_iov_t iov;
+
+    if ( len > UINT32_MAX )
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    iov.iov_base = (unsigned long)buf;
+    iov.iov_len = len;
+    iov.pad = 0;
+
+    return libxenv4v_sendv(v4v, dst, message_type, &iov, 1);
+}
+
+int libxenv4v_notify(struct libxenv4v *v4v, v4v_ring_data_ent_t *ent,
+                     uint32_t nent)
+{
+    struct libxenv4v_scratch *s = v4v->scratch;
+    int ret;
+
+    if ( nent > LIBXENV4V_NOTIFY_MAX )
+    {
+        errno = E2BIG;
+        return -1;
+    }
+
+    s->notify.magic = V4V_RING_DATA_MAGIC;
+    s->notify.nent = nent;
+    memcpy(s->notify_ent, ent, nent * sizeof(*ent));
+
+    ret = xc_v4v_op(v4v->xch, V4VOP_notify, &s->notify, NULL, 0, 0);
+    if ( ret < 0 )
+        return ret;
+
+    memcpy(ent, s->notify_ent, nent * sizeof(*ent));
+    return 0;
+}
+
+int libxenv4v_send_batch(struct libxenv4v *v4v, v4v_send_batch_ent_t *ent,
+                         uint32_t nent, const v4v_iov_t *iov, uint32_t niov)
+{
+    struct libxenv4v_scratch *s = v4v->scratch;
+    uint32_t i;
+    long ret;
+
+    if ( (nent > V4V_SENDV_BATCH_MAX) || (niov > V4V_MAXIOV) )
+    {
+        errno = E2BIG;
+        return -1;
+    }
+
+    for ( i = 0; i < nent; i++ )
+    {
+        if ( (ent[i].iov_start > niov) ||
+             ((ent[i].niov & ~V4V_SENDV_F_MASK) > (niov - ent[i].iov_start)) )
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        s->ent[i] = ent[i];
+        if ( s->ent[i].addr.src.port == V4V_PORT_ANY )
+            s->ent[i].addr.src.port = v4v->id.addr.port;
+    }
+    memcpy(s->iov, iov, niov * sizeof(*iov));
+
+    ret = xc_v4v_op(v4v->xch, V4VOP_sendv_batch, s->ent, s->iov, nent, 0);
+    if ( ret < 0 )
+        return ret;
+
+    for ( i = 0; i < nent; i++ )
+        ent[i].status = s->ent[i].status;
+
+    return ret;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,183 @@
+/*
+ * libxenv4v.h
+ *
+ * Userspace access to v4v rings, in the spirit of libxenvchan: a handle
+ * owns one datagram ring of the calling domain, registered with xen,
+ * and the event channel xen signals it on.
+ *
+ * The ring is read directly rather than with V4VOP_recvv. A received
+ * message is handed out in place by libxenv4v_peek() and its space
+ * given back by libxenv4v_consume(), so that a caller which only looks
+ * at the data never copies it. Sends go through V4VOP_sendv, or
+ * V4VOP_sendv_batch for up to V4V_SENDV_BATCH_MAX messages in one
+ * hypercall.
+ *
+ * The ring is registered with the frame numbers /proc/self/pagemap
+ * gives, which are what xen wants from a domain with a translated
+ * physmap: this only works in an HVM or PVH guest, and needs the
+ * privileges to read pagemap.
+ *
+ * Xen reads the data of a send straight from the caller's memory while
+ * the hypercall runs, it should be in memory which can't be paged out,
+ * such as that of libxenv4v_buffer_alloc().
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#ifndef LIBXENV4V_H
+#define LIBXENV4V_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <xenctrl.h>
+#include <xen/v4v.h>
+
+struct libxenv4v_scratch;
+
+struct libxenv4v {
+    xc_interface *xch;
+    xc_evtchn *xce;
+    /* the port xen signals and the one it fires, which xce reports */
+    evtchn_port_t ring_port, local_port;
+    v4v_ring_t *ring;
+    v4v_pfn_t *pfns;
+    uint32_t npage;
+    /* copies of what was registered, the ring header is ours to scribble */
+    uint32_t len;
+    uint32_t align;
+    v4v_ring_id_t id;
+    /* where rx_ptr goes once the messages peeked at are consumed */
+    uint32_t next_rx_ptr;
+    int peeked;
+    /* locked hypercall arguments */
+    struct libxenv4v_scratch *scratch;
+};
+
+/**
+ * A message of the ring, as libxenv4v_peek() found it. The data is
+ * len bytes, the first seg_len[0] at seg[0] and the rest, if the
+ * message wraps around the end of the ring, at seg[1]. Both point into
+ * the ring and are only valid until the message is consumed. stamp is
+ * the time xen queued the message at for a ring registered with
+ * V4V_RING_F_TIMESTAMP, 0 otherwise.
+ */
+struct libxenv4v_msg {
+    v4v_addr_t source;
+    uint32_t message_type;
+    uint32_t flags;
+    uint32_t len;
+    uint64_t stamp;
+    const void *seg[2];
+    uint32_t seg_len[2];
+};
+
+/**
+ * Allocate and register a ring
+ * @param logger Logger for libxc errors, may be NULL
+ * @param port The port of the ring
+ * @param partner The only domain allowed to send to it, or V4V_DOMID_ANY
+ * @param len The size of the ring, in bytes
+ * @param flags V4V_RING_F_* to register the ring with. Flags which make
+ *        it anything but a ring of datagrams are refused.
+ * @return The handle, or NULL with errno set
+ */
+struct libxenv4v *libxenv4v_open(xentoollog_logger *logger, uint32_t port,
+                                 domid_t partner, uint32_t len,
+                                 uint32_t flags);
+/**
+ * Unregister the ring and free the handle. The messages still queued
+ * are lost.
+ */
+void libxenv4v_close(struct libxenv4v *v4v);
+
+/**
+ * The event file descriptor of the handle. It becomes readable when xen
+ * signals the ring, after which libxenv4v_wait() won't block. It can be
+ * added to select(), poll() or an epoll set, edge or level triggered.
+ */
+int libxenv4v_fd_for_select(struct libxenv4v *v4v);
+/**
+ * Acknowledge the signal of the ring, blocking until there is one.
+ * @return 0, or -1 with errno set
+ */
+int libxenv4v_wait(struct libxenv4v *v4v);
+
+/**
+ * Zero-copy receive: describe the message at the head of the ring in
+ * msg without consuming it. Messages xen failed to copy in are skipped.
+ * @return 1 if there is a message, 0 if the ring is empty, -1 with
+ *         errno EBADMSG if the ring is corrupt
+ */
+int libxenv4v_peek(struct libxenv4v *v4v, struct libxenv4v_msg *msg);
+/**
+ * Zero-copy receive of up to nmsg messages from the head of the ring,
+ * as libxenv4v_peek() would find them one after the other, to process
+ * them as a batch. They are all consumed at once by libxenv4v_consume().
+ * @return the number of messages, 0 if the ring is empty, -1 with errno
+ *         EBADMSG if the first one is corrupt
+ */
+int libxenv4v_peek_batch(struct libxenv4v *v4v, struct libxenv4v_msg *msg,
+                         unsigned int nmsg);
+/**
+ * Give the space of the messages peeked at back to xen, waking up the
+ * senders waiting for it if the ring was filling up.
+ */
+void libxenv4v_consume(struct libxenv4v *v4v);
+/**
+ * Copying receive: peek, copy the data to buf, truncated to size, and
+ * consume.
+ * @return the length of the message, 0 if the ring is empty, -1 with
+ *         errno set
+ */
+ssize_t libxenv4v_recv(struct libxenv4v *v4v, void *buf, size_t size,
+                       v4v_addr_t *source, uint32_t *message_type);
+/** Amount of data queued in the ring, in bytes, headers included */
+uint32_t libxenv4v_data_ready(struct libxenv4v *v4v);
+
+/**
+ * Send the niov iovs to dst as one message from the handle's port.
+ * @return the length sent, or -1 with errno set: EAGAIN if there is no
+ *         room in the destination ring, xen then signals the handle once
+ *         there is.
+ */
+ssize_t libxenv4v_sendv(struct libxenv4v *v4v, const v4v_addr_t *dst,
+                        uint32_t message_type, const v4v_iov_t *iov,
+                        uint32_t niov);
+/** libxenv4v_sendv() of a single buffer */
+ssize_t libxenv4v_send(struct libxenv4v *v4v, const v4v_addr_t *dst,
+                       uint32_t message_type, const void *buf, size_t len);
+/**
+ * Send nent messages (at most V4V_SENDV_BATCH_MAX) in one hypercall.
+ * ent[i].addr.src.port is the handle's port if left V4V_PORT_ANY, the
+ * iovs of message i are iov[ent[i].iov_start], ... and its result is
+ * written to ent[i].status, as libxenv4v_sendv() would have returned it.
+ * Destinations are signalled once per batch. The batch can't be made of
+ * more than V4V_MAXIOV iovs in all.
+ * @return the number of messages sent, or -1 with errno set if the
+ *         batch couldn't be processed
+ */
+int libxenv4v_send_batch(struct libxenv4v *v4v, v4v_send_batch_ent_t *ent,
+                         uint32_t nent, const v4v_iov_t *iov, uint32_t niov);
+
+#define LIBXENV4V_NOTIFY_MAX    64
+
+/**
+ * Ask whether the rings of ent[i].ring (at most LIBXENV4V_NOTIFY_MAX of
+ * them) have room for ent[i].space_required bytes, with V4VOP_notify.
+ * Xen sets V4V_RING_DATA_F_SUFFICIENT in ent[i].flags of those that do,
+ * and signals the handle once the others do.
+ * @return 0, or -1 with errno set
+ */
+int libxenv4v_notify(struct libxenv4v *v4v, v4v_ring_data_ent_t *ent,
+                     uint32_t nent);
+
+/** Locked, zeroed memory for the data of sends, NULL with errno set */
+void *libxenv4v_buffer_alloc(size_t size);
+void libxenv4v_buffer_free(void *p, size_t size);
+
+#endif /* LIBXENV4V_H */
@@ -0,0 +1,31 @@
+/*
+ * libxenv4v_private.h
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#ifndef LIBXENV4V_PRIVATE_H
+#define LIBXENV4V_PRIVATE_H
+
+#include <libxenv4v.h>
+
+#define LIBXENV4V_PAGE_ROUND(_x)                                        \
+    (((_x) + XC_PAGE_SIZE - 1) & XC_PAGE_MASK)
+
+/*
+ * What xen reads or writes during a hypercall of the library, kept in
+ * locked memory so that the hypercall can't fault on it.
+ */
+struct libxenv4v_scratch {
+    v4v_send_addr_t addr;
+    v4v_ring_id_t ring_id;
+    v4v_send_batch_ent_t ent[V4V_SENDV_BATCH_MAX];
+    v4v_iov_t iov[V4V_MAXIOV];
+    v4v_ring_data_t notify;
+    v4v_ring_data_ent_t notify_ent[LIBXENV4V_NOTIFY_MAX];
+};
+
+#endif /* LIBXENV4V_PRIVATE_H */
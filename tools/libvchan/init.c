@@ -63,7 +63,8 @@
 #define LARGE_RING_OFFSET 2048
 
 // if you go over this size, you'll have too many grants to fit in the shared page.
-#define MAX_RING_SHIFT 20
+// Only one of the rings can be this large, see ring_layout_ok().
+#define MAX_RING_SHIFT 21
 #define MAX_RING_SIZE (1 << MAX_RING_SHIFT)
 
 #ifndef offsetof
@@ -72,6 +73,55 @@
 
 #define max(a,b) ((a > b) ? a : b)
 
+static int ring_pages(int order)
+{
+	return order >= PAGE_SHIFT ? 1 << (order - PAGE_SHIFT) : 0;
+}
+
+/* Offset of the grant list's end in the shared page */
+static size_t grants_end(int left_order, int right_order)
+{
+	return offsetof(struct vchan_interface, grants) +
+		(ring_pages(left_order) + ring_pages(right_order)) * sizeof(uint32_t);
+}
+
+/* Offset of the first in-page ring, which the grant list must stop short of */
+static size_t ring_page_limit(int left_order, int right_order)
+{
+	if (left_order == SMALL_RING_SHIFT || right_order == SMALL_RING_SHIFT)
+		return SMALL_RING_OFFSET;
+	if (left_order == LARGE_RING_SHIFT || right_order == LARGE_RING_SHIFT)
+		return LARGE_RING_OFFSET;
+	return PAGE_SIZE;
+}
+
+/* Whether the grants, and optionally the notify thresholds, fit */
+static int ring_layout_ok(int left_order, int right_order, int with_threshold)
+{
+	size_t end = grants_end(left_order, right_order);
+	if (with_threshold)
+		end += sizeof(struct vchan_notify_threshold);
+	return end <= ring_page_limit(left_order, right_order);
+}
+
+/* The largest ring there is room for beside one of other_order */
+static int max_order(int other_order)
+{
+	int rv = MAX_RING_SHIFT;
+	while (!ring_layout_ok(rv, other_order, 1))
+		rv--;
+	return rv;
+}
+
+/* The notify thresholds follow the grant list, when there is room */
+static void init_threshold(struct libxenvchan *ctrl, int left_order, int right_order)
+{
+	if (ring_layout_ok(left_order, right_order, 1))
+		ctrl->threshold = ((void*)ctrl->ring) + grants_end(left_order, right_order);
+	else
+		ctrl->threshold = NULL;
+}
+
 static int init_gnt_srv(struct libxenvchan *ctrl, int domain)
 {
 	int pages_left = ctrl->read.order >= PAGE_SHIFT ? 1 << (ctrl->read.order - PAGE_SHIFT) : 0;
@@ -96,6 +146,7 @@ static int init_gnt_srv(struct libxenvchan *ctrl, int domain)
 	ctrl->ring->cli_live = 2;
 	ctrl->ring->srv_live = 1;
 	ctrl->ring->cli_notify = VCHAN_NOTIFY_WRITE;
+	init_threshold(ctrl, ctrl->read.order, ctrl->write.order);
 
 	switch (ctrl->read.order) {
 	case SMALL_RING_SHIFT:
@@ -160,6 +211,9 @@ static int init_gnt_cli(struct libxenvchan *ctrl, int domain, uint32_t ring_ref)
 		goto out_unmap_ring;
 	if (ctrl->read.order == ctrl->write.order && ctrl->read.order < PAGE_SHIFT)
 		goto out_unmap_ring;
+	if (!ring_layout_ok(ctrl->write.order, ctrl->read.order, 0))
+		goto out_unmap_ring;
+	init_threshold(ctrl, ctrl->write.order, ctrl->read.order);
 
 	grants = ctrl->ring->grants;
 
@@ -298,7 +352,9 @@ struct libxenvchan *libxenvchan_server_init(xentoollog_logger *logger, int domai
 {
 	struct libxenvchan *ctrl;
 	int ring_ref;
-	if (left_min > MAX_RING_SIZE || right_min > MAX_RING_SIZE)
+	if (left_min > MAX_RING_SIZE && left_min != LIBXENVCHAN_MAX_RING)
+		return 0;
+	if (right_min > MAX_RING_SIZE && right_min != LIBXENVCHAN_MAX_RING)
 		return 0;
 
 	ctrl = malloc(sizeof(*ctrl));
@@ -309,9 +365,10 @@ struct libxenvchan *libxenvchan_server_init(xentoollog_logger *logger, int domai
 	ctrl->event = NULL;
 	ctrl->is_server = 1;
 	ctrl->server_persist = 0;
+	ctrl->threshold = NULL;
 
-	ctrl->read.order = min_order(left_min);
-	ctrl->write.order = min_order(right_min);
+	ctrl->read.order = left_min == LIBXENVCHAN_MAX_RING ? PAGE_SHIFT : min_order(left_min);
+	ctrl->write.order = right_min == LIBXENVCHAN_MAX_RING ? PAGE_SHIFT : min_order(right_min);
 
 	// if we can avoid allocating extra pages by using in-page rings, do so
 	if (left_min <= MAX_SMALL_RING && right_min <= MAX_LARGE_RING) {
@@ -326,6 +383,16 @@ struct libxenvchan *libxenvchan_server_init(xentoollog_logger *logger, int domai
 		ctrl->write.order = LARGE_RING_SHIFT;
 	}
 
+	// the largest rings asked for: the write ring gets first pick
+	if (right_min == LIBXENVCHAN_MAX_RING)
+		ctrl->write.order = max_order(ctrl->read.order);
+	if (left_min == LIBXENVCHAN_MAX_RING)
+		ctrl->read.order = max_order(ctrl->write.order);
+	if (!ring_layout_ok(ctrl->read.order, ctrl->write.order, 0)) {
+		free(ctrl);
+		return 0;
+	}
+
 	ctrl->gntshr = xc_gntshr_open(logger, 0);
 	if (!ctrl->gntshr)
 		goto out;
@@ -389,6 +456,7 @@ struct libxenvchan *libxenvchan_client_init(xentoollog_logger *logger, int domai
 	ctrl->gnttab = NULL;
 	ctrl->write.order = ctrl->read.order = 0;
 	ctrl->is_server = 0;
+	ctrl->threshold = NULL;
 
 	xs = xs_daemon_open();
 	if (!xs)
@@ -92,18 +92,59 @@ static inline uint32_t rd_ring_size(struct libxenvchan *ctrl)
 	return (1 << ctrl->read.order);
 }
 
-static inline void request_notify(struct libxenvchan *ctrl, uint8_t bit)
+/* The threshold for the notifications of the client (cli) or the server */
+static inline uint32_t* notify_threshold(struct libxenvchan *ctrl, int cli, uint8_t bit)
+{
+	struct vchan_notify_threshold *t = ctrl->threshold;
+	if (cli)
+		return bit == VCHAN_NOTIFY_WRITE ? &t->cli_write : &t->cli_read;
+	else
+		return bit == VCHAN_NOTIFY_WRITE ? &t->srv_write : &t->srv_read;
+}
+
+/**
+ * Ask the other side to notify once $want bytes of data (or of space, for
+ * VCHAN_NOTIFY_READ) are there, rather than on its next update.
+ */
+static inline void request_notify(struct libxenvchan *ctrl, uint8_t bit, uint32_t want)
 {
 	uint8_t *notify = ctrl->is_server ? &ctrl->ring->cli_notify : &ctrl->ring->srv_notify;
-	__sync_or_and_fetch(notify, bit);
+	if (ctrl->threshold)
+		*notify_threshold(ctrl, ctrl->is_server, bit) = want;
+	__sync_or_and_fetch(notify, bit); /* post the threshold /before/ the bit */
 	xen_mb(); /* post the request /before/ caller re-reads any indexes */
 }
 
+/**
+ * Whether our update leaves less than the other side asked to be notified
+ * for: the data ready in the write ring, or the space in the read ring.
+ */
+static inline int below_threshold(struct libxenvchan *ctrl, uint8_t bit)
+{
+	uint32_t want, size, level;
+	if (!ctrl->threshold)
+		return 0;
+	want = *notify_threshold(ctrl, !ctrl->is_server, bit);
+	if (bit == VCHAN_NOTIFY_WRITE) {
+		size = wr_ring_size(ctrl);
+		level = wr_prod(ctrl) - wr_cons(ctrl);
+	} else {
+		size = rd_ring_size(ctrl);
+		level = size - (rd_prod(ctrl) - rd_cons(ctrl));
+	}
+	if (want > size)
+		want = size;
+	return level < want;
+}
+
 static inline int send_notify(struct libxenvchan *ctrl, uint8_t bit)
 {
 	uint8_t *notify, prev;
 	xen_mb(); /* caller updates indexes /before/ we decode to notify */
 	notify = ctrl->is_server ? &ctrl->ring->srv_notify : &ctrl->ring->cli_notify;
+	/* leave the bit for the update that gets the other side what it asked for */
+	if (below_threshold(ctrl, bit))
+		return 0;
 	prev = __sync_fetch_and_and(notify, ~bit);
 	if (prev & bit)
 		return xc_evtchn_notify(ctrl->event, ctrl->event_port);
@@ -128,13 +169,13 @@ static inline int raw_get_data_ready(struct libxenvchan *ctrl)
 /**
  * Get the amount of buffer space available and enable notifications if needed.
  */
-static inline int fast_get_data_ready(struct libxenvchan *ctrl, size_t request)
+static inline int fast_get_data_ready(struct libxenvchan *ctrl, size_t request, uint32_t want)
 {
 	int ready = raw_get_data_ready(ctrl);
 	if (ready >= request)
 		return ready;
-	/* We plan to consume all data; please tell us if you send more */
-	request_notify(ctrl, VCHAN_NOTIFY_WRITE);
+	/* We plan to consume all data; please tell us once you sent $want */
+	request_notify(ctrl, VCHAN_NOTIFY_WRITE, want);
 	/*
 	 * If the writer moved rd_prod after our read but before request, we
 	 * will not get notified even though the actual amount of data ready is
@@ -148,7 +189,7 @@ int libxenvchan_data_ready(struct libxenvchan *ctrl)
 	/* Since this value is being used outside libxenvchan, request notification
 	 * when it changes
 	 */
-	request_notify(ctrl, VCHAN_NOTIFY_WRITE);
+	request_notify(ctrl, VCHAN_NOTIFY_WRITE, 0);
 	return raw_get_data_ready(ctrl);
 }
 
@@ -169,13 +210,13 @@ static inline int raw_get_buffer_space(struct libxenvchan *ctrl)
 /**
  * Get the amount of buffer space available and enable notifications if needed.
  */
-static inline int fast_get_buffer_space(struct libxenvchan *ctrl, size_t request)
+static inline int fast_get_buffer_space(struct libxenvchan *ctrl, size_t request, uint32_t want)
 {
 	int ready = raw_get_buffer_space(ctrl);
 	if (ready >= request)
 		return ready;
-	/* We plan to fill the buffer; please tell us when you've read it */
-	request_notify(ctrl, VCHAN_NOTIFY_READ);
+	/* We plan to fill the buffer; please tell us once $want is free */
+	request_notify(ctrl, VCHAN_NOTIFY_READ, want);
 	/*
 	 * If the reader moved wr_cons after our read but before request, we
 	 * will not get notified even though the actual amount of buffer space
@@ -184,12 +225,24 @@ static inline int fast_get_buffer_space(struct libxenvchan *ctrl, size_t request
 	return raw_get_buffer_space(ctrl);
 }
 
+/**
+ * The space a blocking writer waits for: up to half the ring, so that it is
+ * not woken to write a few bytes at a time while the reader catches up.
+ */
+static inline uint32_t write_want(struct libxenvchan *ctrl, size_t size)
+{
+	size_t half = wr_ring_size(ctrl) / 2;
+	if (!ctrl->blocking)
+		return 0;
+	return size < half ? size : half;
+}
+
 int libxenvchan_buffer_space(struct libxenvchan *ctrl)
 {
 	/* Since this value is being used outside libxenvchan, request notification
 	 * when it changes
 	 */
-	request_notify(ctrl, VCHAN_NOTIFY_READ);
+	request_notify(ctrl, VCHAN_NOTIFY_READ, 0);
 	return raw_get_buffer_space(ctrl);
 }
 
@@ -236,7 +289,7 @@ int libxenvchan_send(struct libxenvchan *ctrl, const void *data, size_t size)
 	while (1) {
 		if (!libxenvchan_is_open(ctrl))
 			return -1;
-		avail = fast_get_buffer_space(ctrl, size);
+		avail = fast_get_buffer_space(ctrl, size, size);
 		if (size <= avail)
 			return do_send(ctrl, data, size);
 		if (!ctrl->blocking)
@@ -256,7 +309,7 @@ int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size)
 	if (ctrl->blocking) {
 		size_t pos = 0;
 		while (1) {
-			avail = fast_get_buffer_space(ctrl, size - pos);
+			avail = fast_get_buffer_space(ctrl, size - pos, write_want(ctrl, size - pos));
 			if (pos + avail > size)
 				avail = size - pos;
 			if (avail)
@@ -269,7 +322,7 @@ int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size)
 				return -1;
 		}
 	} else {
-		avail = fast_get_buffer_space(ctrl, size);
+		avail = fast_get_buffer_space(ctrl, size, 0);
 		if (size > avail)
 			size = avail;
 		if (size == 0)
@@ -310,7 +363,7 @@ static int do_recv(struct libxenvchan *ctrl, void *data, size_t size)
 int libxenvchan_recv(struct libxenvchan *ctrl, void *data, size_t size)
 {
 	while (1) {
-		int avail = fast_get_data_ready(ctrl, size);
+		int avail = fast_get_data_ready(ctrl, size, size);
 		if (size <= avail)
 			return do_recv(ctrl, data, size);
 		if (!libxenvchan_is_open(ctrl))
@@ -327,7 +380,7 @@ int libxenvchan_recv(struct libxenvchan *ctrl, void *data, size_t size)
 int libxenvchan_read(struct libxenvchan *ctrl, void *data, size_t size)
 {
 	while (1) {
-		int avail = fast_get_data_ready(ctrl, size);
+		int avail = fast_get_data_ready(ctrl, size, 0);
 		if (avail && size > avail)
 			size = avail;
 		if (avail)
@@ -341,6 +394,192 @@ int libxenvchan_read(struct libxenvchan *ctrl, void *data, size_t size)
 	}
 }
 
+/**
+ * The up to two contiguous pieces of ring that size bytes from idx cover:
+ * returns how many of seg[] were filled in.
+ */
+static int ring_segments(void *ring, uint32_t ring_size, uint32_t idx,
+			 size_t size, struct iovec seg[2])
+{
+	uint32_t real_idx = idx & (ring_size - 1);
+	size_t avail_contig = ring_size - real_idx;
+
+	if (size == 0)
+		return 0;
+	seg[0].iov_base = ring + real_idx;
+	if (avail_contig >= size) {
+		seg[0].iov_len = size;
+		return 1;
+	}
+	seg[0].iov_len = avail_contig;
+	seg[1].iov_base = ring;
+	seg[1].iov_len = size - avail_contig;
+	return 2;
+}
+
+static size_t iov_length(const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+	int i;
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+/**
+ * Copy size bytes from src, starting src_off bytes in, to the start of dst.
+ * Both must be large enough.
+ */
+static void iov_copy(const struct iovec *dst, const struct iovec *src,
+		     size_t src_off, size_t size)
+{
+	size_t dst_off = 0, chunk;
+
+	while (src_off >= src->iov_len) {
+		src_off -= src->iov_len;
+		src++;
+	}
+	while (size) {
+		chunk = dst->iov_len - dst_off;
+		if (chunk > src->iov_len - src_off)
+			chunk = src->iov_len - src_off;
+		if (chunk > size)
+			chunk = size;
+		memcpy(dst->iov_base + dst_off, src->iov_base + src_off, chunk);
+		size -= chunk;
+		dst_off += chunk;
+		src_off += chunk;
+		if (dst_off == dst->iov_len) {
+			dst++;
+			dst_off = 0;
+		}
+		if (src_off == src->iov_len) {
+			src++;
+			src_off = 0;
+		}
+	}
+}
+
+/**
+ * Wait, if blocking, until some data is ready: returns how much, 0 if
+ * nonblocking and there is none, or -1 on error or once the other side
+ * closed and all it sent has been read.
+ */
+static int wait_data_ready(struct libxenvchan *ctrl, size_t size)
+{
+	while (1) {
+		int avail = fast_get_data_ready(ctrl, size, 0);
+		if (avail)
+			return avail;
+		if (!libxenvchan_is_open(ctrl))
+			return -1;
+		if (!ctrl->blocking)
+			return 0;
+		if (libxenvchan_wait(ctrl))
+			return -1;
+	}
+}
+
+int libxenvchan_peek(struct libxenvchan *ctrl, struct iovec seg[2], int *nseg)
+{
+	int avail = wait_data_ready(ctrl, 1);
+	*nseg = 0;
+	if (avail <= 0)
+		return avail;
+	xen_rmb(); /* data read must happen /after/ rd_cons read */
+	*nseg = ring_segments(ctrl->read.buffer, rd_ring_size(ctrl),
+			      rd_cons(ctrl), avail, seg);
+	return avail;
+}
+
+int libxenvchan_consume(struct libxenvchan *ctrl, size_t size)
+{
+	if (size > raw_get_data_ready(ctrl))
+		return -1;
+	xen_mb(); /* consume /then/ notify */
+	rd_cons(ctrl) += size;
+	if (send_notify(ctrl, VCHAN_NOTIFY_READ))
+		return -1;
+	return size;
+}
+
+int libxenvchan_readv(struct libxenvchan *ctrl, const struct iovec *iov, int iovcnt)
+{
+	struct iovec seg[2];
+	size_t size = iov_length(iov, iovcnt);
+	int avail;
+
+	if (size == 0)
+		return 0;
+	avail = wait_data_ready(ctrl, size);
+	if (avail <= 0)
+		return avail;
+	if (size > avail)
+		size = avail;
+	xen_rmb(); /* data read must happen /after/ rd_cons read */
+	ring_segments(ctrl->read.buffer, rd_ring_size(ctrl), rd_cons(ctrl),
+		      size, seg);
+	iov_copy(iov, seg, 0, size);
+	return libxenvchan_consume(ctrl, size);
+}
+
+int libxenvchan_reserve(struct libxenvchan *ctrl, size_t size,
+			struct iovec seg[2], int *nseg)
+{
+	int avail;
+	*nseg = 0;
+	while (1) {
+		if (!libxenvchan_is_open(ctrl))
+			return -1;
+		avail = fast_get_buffer_space(ctrl, size, write_want(ctrl, size));
+		if (avail)
+			break;
+		if (!ctrl->blocking || size == 0)
+			return 0;
+		if (libxenvchan_wait(ctrl))
+			return -1;
+	}
+	if (size > avail)
+		size = avail;
+	xen_mb(); /* read indexes /then/ write data */
+	*nseg = ring_segments(wr_ring(ctrl), wr_ring_size(ctrl), wr_prod(ctrl),
+			      size, seg);
+	return size;
+}
+
+int libxenvchan_commit(struct libxenvchan *ctrl, size_t size)
+{
+	if (size > raw_get_buffer_space(ctrl))
+		return -1;
+	xen_wmb(); /* write data /then/ notify */
+	wr_prod(ctrl) += size;
+	if (send_notify(ctrl, VCHAN_NOTIFY_WRITE))
+		return -1;
+	return size;
+}
+
+int libxenvchan_writev(struct libxenvchan *ctrl, const struct iovec *iov, int iovcnt)
+{
+	struct iovec seg[2];
+	size_t size = iov_length(iov, iovcnt), pos = 0;
+	int avail, nseg;
+
+	while (pos < size) {
+		avail = libxenvchan_reserve(ctrl, size - pos, seg, &nseg);
+		if (avail < 0)
+			return -1;
+		if (avail == 0)
+			break;
+		iov_copy(seg, iov, pos, avail);
+		if (libxenvchan_commit(ctrl, avail) < 0)
+			return -1;
+		pos += avail;
+		if (!ctrl->blocking)
+			break;
+	}
+	return pos;
+}
+
 int libxenvchan_is_open(struct libxenvchan* ctrl)
 {
 	if (ctrl->is_server)
@@ -43,6 +43,7 @@
  *  compile time, so the macros in ring.h cannot be used to access the rings.
  */
 
+#include <sys/uio.h>
 #include <xen/io/libxenvchan.h>
 #include <xen/sys/evtchn.h>
 #include <xenctrl.h>
@@ -82,8 +83,17 @@ struct libxenvchan {
 	int blocking:1;
 	/* communication rings */
 	struct libxenvchan_ring read, write;
+	/* notify thresholds in the shared page, NULL if there is no room for them */
+	struct vchan_notify_threshold *threshold;
 };
 
+/**
+ * Pass as the minimum size of a ring to libxenvchan_server_init() for the
+ * largest ring the shared page has room to grant (up to 2MB for one ring, 1MB
+ * for the other). Rings above 1MB need a client of this version or later.
+ */
+#define LIBXENVCHAN_MAX_RING ((size_t)-1)
+
 /**
  * Set up a vchan, including granting pages
  * @param logger Logger for libxc errors
@@ -146,6 +156,51 @@ int libxenvchan_send(struct libxenvchan *ctrl, const void *data, size_t size);
  *         the vchan is nonblocking)
  */
 int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size);
+/**
+ * Stream-based receive into several buffers, filled in order: reads as much
+ * data as possible, like libxenvchan_read().
+ * @return -1 on error, otherwise the amount of data read
+ */
+int libxenvchan_readv(struct libxenvchan *ctrl, const struct iovec *iov, int iovcnt);
+/**
+ * Stream-based send from several buffers, taken in order: sends as much data
+ * as possible, like libxenvchan_write().
+ * @return -1 on error, otherwise the amount of data sent
+ */
+int libxenvchan_writev(struct libxenvchan *ctrl, const struct iovec *iov, int iovcnt);
+/**
+ * Zero-copy receive: point seg[] at the data ready in the read ring, which
+ * wraps at most once, without consuming it. Blocks like libxenvchan_read().
+ * The data stays valid until it is given back with libxenvchan_consume().
+ * @param ctrl The vchan control structure
+ * @param seg Filled in with up to two pieces of the ring, in order
+ * @param nseg Set to the number of pieces filled in
+ * @return -1 on error, otherwise the amount of data ready (which may be zero
+ *         if the vchan is nonblocking)
+ */
+int libxenvchan_peek(struct libxenvchan *ctrl, struct iovec seg[2], int *nseg);
+/**
+ * Give back the first $size bytes of the data returned by libxenvchan_peek()
+ * @return -1 on error or if fewer than $size bytes are ready, or $size
+ */
+int libxenvchan_consume(struct libxenvchan *ctrl, size_t size);
+/**
+ * Zero-copy send: point seg[] at up to $size bytes of free space in the
+ * write ring, for the caller to fill in. Blocks until there is some space
+ * if the vchan is blocking. Nothing is sent until libxenvchan_commit().
+ * @param ctrl The vchan control structure
+ * @param size The most space wanted
+ * @param seg Filled in with up to two pieces of the ring, in order
+ * @param nseg Set to the number of pieces filled in
+ * @return -1 on error, otherwise the amount of space reserved (which may be
+ *         zero if the vchan is nonblocking)
+ */
+int libxenvchan_reserve(struct libxenvchan *ctrl, size_t size, struct iovec seg[2], int *nseg);
+/**
+ * Send the first $size bytes of the space returned by libxenvchan_reserve()
+ * @return -1 on error or if there is less than $size bytes of space, or $size
+ */
+int libxenvchan_commit(struct libxenvchan *ctrl, size_t size);
 /**
  * Waits for reads or writes to unblock, or for a close
  */
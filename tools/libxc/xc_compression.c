@@ -466,10 +466,18 @@ void xc_compression_free_context(xc_interface *xch, comp_ctx *ctx)
 
 comp_ctx *xc_compression_create_context(xc_interface *xch,
                                         unsigned long p2m_size)
+{
+    return xc_compression_create_context_size(xch, p2m_size,
+                                              DELTA_CACHE_SIZE);
+}
+
+comp_ctx *xc_compression_create_context_size(xc_interface *xch,
+                                             unsigned long p2m_size,
+                                             unsigned long cache_size)
 {
     unsigned long i;
     comp_ctx *ctx = NULL;
-    unsigned long num_cache_pages = DELTA_CACHE_SIZE/XC_PAGE_SIZE;
+    unsigned long num_cache_pages = NRPAGES(cache_size) ?: 1;
 
     ctx = (comp_ctx *)malloc(sizeof(comp_ctx));
     if (!ctx)
@@ -486,7 +494,8 @@ comp_ctx *xc_compression_create_context(xc_interface *xch,
         goto error;
     }
 
-    ctx->cache_base = xc_memalign(xch, XC_PAGE_SIZE, DELTA_CACHE_SIZE);
+    ctx->cache_base = xc_memalign(xch, XC_PAGE_SIZE,
+                                  num_cache_pages * XC_PAGE_SIZE);
     if (!ctx->cache_base)
     {
         ERROR("Failed to allocate delta cache\n");
@@ -67,7 +67,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 
-/* number of pages to write at a time */
+/* number of pages to write between discarding them from the cache */
 #define DUMP_INCREMENT (4 * 1024)
 
 /* string table */
@@ -417,6 +417,291 @@ elfnote_dump_format_version(xc_interface *xch,
     return dump_rtn(xch, args, (char*)&format_version, sizeof(format_version));
 }
 
+/*
+ * Guest pages are mapped and copied a batch at a time by worker threads,
+ * each with a batch of its own, while the calling thread hands out the
+ * frames and writes the batches out in order. Without workers (MiniOS,
+ * or if none could be started) the calling thread fills the batches.
+ */
+#define DUMP_BATCH_PAGES 1024
+#define DUMP_MAX_WORKERS 4
+
+enum dump_batch_state {
+    DUMP_BATCH_FREE,
+    DUMP_BATCH_QUEUED,          /* frames filled in, for the worker */
+    DUMP_BATCH_DONE,            /* pages copied, for the writer */
+};
+
+struct dump_batch {
+    enum dump_batch_state state;
+    unsigned int nr;            /* frames */
+    unsigned int nr_mapped;     /* of which mapped, moved to the front */
+    uint64_t pfn[DUMP_BATCH_PAGES];
+    xen_pfn_t gmfn[DUMP_BATCH_PAGES];
+    int err[DUMP_BATCH_PAGES];
+    char *pages;
+};
+
+struct dump_pipeline;
+
+struct dump_worker {
+    struct dump_pipeline *pipe;
+    struct dump_batch *batch;
+#ifndef __MINIOS__
+    pthread_t thread;
+#endif
+};
+
+struct dump_pipeline {
+    xc_interface *xch;
+    uint32_t domid;
+    unsigned int nr_batches;    /* in use: one per worker, or one */
+    unsigned int nr_alloc;
+    unsigned int nr_workers;
+    unsigned int head;          /* oldest batch not yet written */
+    unsigned int nr_pending;    /* batches handed out, not yet written */
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct dump_batch *batches;
+    struct dump_worker workers[DUMP_MAX_WORKERS];
+};
+
+/*
+ * Map the batch's frames with one call and copy those which could be
+ * mapped. Frames which could not are left out of the dump.
+ */
+static void dump_batch_fill(xc_interface *xch, uint32_t domid,
+                            struct dump_batch *batch)
+{
+    unsigned int k, n = 0;
+    char *vaddr;
+
+    batch->nr_mapped = 0;
+    if ( batch->nr == 0 )
+        return;
+
+    vaddr = xc_map_foreign_bulk(xch, domid, PROT_READ, batch->gmfn,
+                                batch->err, batch->nr);
+    if ( vaddr == NULL )
+        return;
+
+    for ( k = 0; k < batch->nr; k++ )
+    {
+        if ( batch->err[k] )
+            continue;
+        memcpy(batch->pages + (size_t)n * PAGE_SIZE,
+               vaddr + (size_t)k * PAGE_SIZE, PAGE_SIZE);
+        batch->pfn[n] = batch->pfn[k];
+        batch->gmfn[n] = batch->gmfn[k];
+        n++;
+    }
+    munmap(vaddr, (size_t)batch->nr * PAGE_SIZE);
+    batch->nr_mapped = n;
+}
+
+#ifndef __MINIOS__
+static void *dump_worker_thread(void *arg)
+{
+    struct dump_worker *worker = arg;
+    struct dump_pipeline *pipe = worker->pipe;
+    struct dump_batch *batch = worker->batch;
+
+    pthread_mutex_lock(&pipe->lock);
+    for ( ;; )
+    {
+        while ( batch->state != DUMP_BATCH_QUEUED && !pipe->stop )
+            pthread_cond_wait(&pipe->cond, &pipe->lock);
+        if ( batch->state != DUMP_BATCH_QUEUED )
+            break;
+        pthread_mutex_unlock(&pipe->lock);
+
+        dump_batch_fill(pipe->xch, pipe->domid, batch);
+
+        pthread_mutex_lock(&pipe->lock);
+        batch->state = DUMP_BATCH_DONE;
+        pthread_cond_broadcast(&pipe->cond);
+    }
+    pthread_mutex_unlock(&pipe->lock);
+
+    return NULL;
+}
+#endif
+
+static void dump_pipeline_fini(struct dump_pipeline *pipe)
+{
+    unsigned int w, b;
+
+    if ( pipe->batches == NULL )
+        return;
+
+#ifndef __MINIOS__
+    pthread_mutex_lock(&pipe->lock);
+    pipe->stop = 1;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+    for ( w = 0; w < pipe->nr_workers; w++ )
+        pthread_join(pipe->workers[w].thread, NULL);
+#else
+    (void)w;
+#endif
+    pthread_cond_destroy(&pipe->cond);
+    pthread_mutex_destroy(&pipe->lock);
+
+    for ( b = 0; b < pipe->nr_alloc; b++ )
+        free(pipe->batches[b].pages);
+    free(pipe->batches);
+    pipe->batches = NULL;
+}
+
+static int dump_pipeline_init(struct dump_pipeline *pipe, xc_interface *xch,
+                              uint32_t domid)
+{
+    unsigned int nr = 1, b;
+#ifndef __MINIOS__
+    unsigned int w;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if ( cpus > 1 )
+        nr = cpus < DUMP_MAX_WORKERS ? cpus : DUMP_MAX_WORKERS;
+#endif
+
+    memset(pipe, 0, sizeof(*pipe));
+    pipe->xch = xch;
+    pipe->domid = domid;
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->cond, NULL);
+
+    pipe->batches = calloc(nr, sizeof(*pipe->batches));
+    if ( pipe->batches == NULL )
+        goto err;
+    pipe->nr_alloc = nr;
+    for ( b = 0; b < nr; b++ )
+    {
+        pipe->batches[b].pages = malloc(DUMP_BATCH_PAGES * PAGE_SIZE);
+        if ( pipe->batches[b].pages == NULL )
+            goto err;
+    }
+
+#ifndef __MINIOS__
+    for ( w = 0; nr > 1 && w < nr; w++ )
+    {
+        pipe->workers[w].pipe = pipe;
+        pipe->workers[w].batch = &pipe->batches[w];
+        if ( pthread_create(&pipe->workers[w].thread, NULL,
+                            dump_worker_thread, &pipe->workers[w]) )
+            break;
+        pipe->nr_workers++;
+    }
+#endif
+    pipe->nr_batches = pipe->nr_workers ? pipe->nr_workers : 1;
+
+    return 0;
+
+ err:
+    PERROR("Could not allocate dump batches");
+    dump_pipeline_fini(pipe);
+    return -1;
+}
+
+/* The batch being filled with frames */
+static struct dump_batch *dump_pipeline_cur(struct dump_pipeline *pipe)
+{
+    return &pipe->batches[(pipe->head + pipe->nr_pending) % pipe->nr_batches];
+}
+
+/* Hand the batch being filled over to its worker, or fill it now */
+static void dump_pipeline_submit(struct dump_pipeline *pipe)
+{
+    struct dump_batch *batch = dump_pipeline_cur(pipe);
+
+    pipe->nr_pending++;
+    if ( pipe->nr_workers == 0 )
+    {
+        dump_batch_fill(pipe->xch, pipe->domid, batch);
+        batch->state = DUMP_BATCH_DONE;
+        return;
+    }
+
+    pthread_mutex_lock(&pipe->lock);
+    batch->state = DUMP_BATCH_QUEUED;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+/* The oldest batch handed out, once its pages are copied */
+static struct dump_batch *dump_pipeline_wait(struct dump_pipeline *pipe)
+{
+    struct dump_batch *batch = &pipe->batches[pipe->head];
+
+    if ( pipe->nr_workers )
+    {
+        pthread_mutex_lock(&pipe->lock);
+        while ( batch->state != DUMP_BATCH_DONE )
+            pthread_cond_wait(&pipe->cond, &pipe->lock);
+        pthread_mutex_unlock(&pipe->lock);
+    }
+    return batch;
+}
+
+/* The oldest batch has been written out: reuse it */
+static void dump_pipeline_release(struct dump_pipeline *pipe)
+{
+    struct dump_batch *batch = &pipe->batches[pipe->head];
+
+    if ( pipe->nr_workers )
+        pthread_mutex_lock(&pipe->lock);
+    batch->nr = batch->nr_mapped = 0;
+    batch->state = DUMP_BATCH_FREE;
+    if ( pipe->nr_workers )
+        pthread_mutex_unlock(&pipe->lock);
+    pipe->head = (pipe->head + 1) % pipe->nr_batches;
+    pipe->nr_pending--;
+}
+
+/*
+ * Write out the oldest batch handed out: its pages, and their entries of
+ * the p2m or pfn table from *j on. *full is set once nr_pages have been
+ * written, after which batches are only waited for.
+ */
+static int dump_pipeline_write(xc_interface *xch, struct dump_pipeline *pipe,
+                               void *args, dumpcore_rtn_t dump_rtn,
+                               struct xen_dumpcore_p2m *p2m_array,
+                               uint64_t *pfn_array, unsigned long *j,
+                               unsigned long nr_pages, int *full)
+{
+    struct dump_batch *batch = dump_pipeline_wait(pipe);
+    unsigned int k, n = *full ? 0 : batch->nr_mapped;
+    int sts = 0;
+
+    if ( n > nr_pages - *j )
+    {
+        /*
+         * When live dump-mode (-L option) is specified,
+         * guest domain may increase memory.
+         */
+        IPRINTF("exceeded nr_pages (%ld) losing pages", nr_pages);
+        n = nr_pages - *j;
+        *full = 1;
+    }
+
+    for ( k = 0; k < n; k++, (*j)++ )
+    {
+        if ( p2m_array != NULL )
+        {
+            p2m_array[*j].pfn = batch->pfn[k];
+            p2m_array[*j].gmfn = batch->gmfn[k];
+        }
+        else
+            pfn_array[*j] = batch->pfn[k];
+    }
+    if ( n )
+        sts = dump_rtn(xch, args, batch->pages, n * PAGE_SIZE);
+
+    dump_pipeline_release(pipe);
+    return sts;
+}
+
 int
 xc_domain_dumpcore_via_callback(xc_interface *xch,
                                 uint32_t domid,
@@ -429,7 +714,9 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
     struct domain_info_context *dinfo = &_dinfo;
 
     int nr_vcpus = 0;
-    char *dump_mem, *dump_mem_start = NULL;
+    struct dump_pipeline pipe = { .batches = NULL };
+    struct dump_batch *batch;
+    int full = 0;
     vcpu_guest_context_any_t *ctxt = NULL;
     struct xc_core_arch_context arch_ctxt;
     char dummy[PAGE_SIZE];
@@ -467,11 +754,8 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
     }
 
     xc_core_arch_context_init(&arch_ctxt);
-    if ( (dump_mem_start = malloc(DUMP_INCREMENT*PAGE_SIZE)) == NULL )
-    {
-        PERROR("Could not allocate dump_mem");
+    if ( dump_pipeline_init(&pipe, xch, domid) )
         goto out;
-    }
 
     if ( xc_domain_getinfo(xch, domid, 1, &info) != 1 )
     {
@@ -778,7 +1062,6 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
 
     /* dump pages: .xen_pages */
     j = 0;
-    dump_mem = dump_mem_start;
     for ( map_idx = 0; map_idx < nr_memory_map; map_idx++ )
     {
         uint64_t pfn_start;
@@ -789,17 +1072,6 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
         for ( i = pfn_start; i < pfn_end; i++ )
         {
             uint64_t gmfn;
-            void *vaddr;
-            
-            if ( j >= nr_pages )
-            {
-                /*
-                 * When live dump-mode (-L option) is specified,
-                 * guest domain may increase memory.
-                 */
-                IPRINTF("exceeded nr_pages (%ld) losing pages", nr_pages);
-                goto copy_done;
-            }
 
             if ( !auto_translated_physmap )
             {
@@ -818,9 +1090,6 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
                     if ( gmfn == (uint32_t)INVALID_P2M_ENTRY )
                        continue;
                 }
-
-                p2m_array[j].pfn = i;
-                p2m_array[j].gmfn = gmfn;
             }
             else
             {
@@ -828,42 +1097,45 @@ xc_domain_dumpcore_via_callback(xc_interface *xch,
                     continue;
 
                 gmfn = i;
-                pfn_array[j] = i;
             }
 
-            vaddr = xc_map_foreign_range(
-                xch, domid, PAGE_SIZE, PROT_READ, gmfn);
-            if ( vaddr == NULL )
+            batch = dump_pipeline_cur(&pipe);
+            batch->pfn[batch->nr] = i;
+            batch->gmfn[batch->nr] = gmfn;
+            if ( ++batch->nr < DUMP_BATCH_PAGES )
                 continue;
-            memcpy(dump_mem, vaddr, PAGE_SIZE);
-            munmap(vaddr, PAGE_SIZE);
-            dump_mem += PAGE_SIZE;
-            if ( (j + 1) % DUMP_INCREMENT == 0 )
-            {
-                sts = dump_rtn(
-                    xch, args, dump_mem_start, dump_mem - dump_mem_start);
-                if ( sts != 0 )
-                    goto out;
-                dump_mem = dump_mem_start;
-            }
 
-            j++;
+            dump_pipeline_submit(&pipe);
+            if ( pipe.nr_pending < pipe.nr_batches )
+                continue;
+
+            sts = dump_pipeline_write(xch, &pipe, args, dump_rtn, p2m_array,
+                                      pfn_array, &j, nr_pages, &full);
+            if ( sts != 0 )
+                goto out;
+            if ( full )
+                goto copy_done;
         }
     }
+    if ( dump_pipeline_cur(&pipe)->nr )
+        dump_pipeline_submit(&pipe);
 
 copy_done:
-    sts = dump_rtn(xch, args, dump_mem_start, dump_mem - dump_mem_start);
-    if ( sts != 0 )
-        goto out;
+    while ( pipe.nr_pending )
+    {
+        sts = dump_pipeline_write(xch, &pipe, args, dump_rtn, p2m_array,
+                                  pfn_array, &j, nr_pages, &full);
+        if ( sts != 0 )
+            goto out;
+    }
     if ( j < nr_pages )
     {
         /* When live dump-mode (-L option) is specified,
          * guest domain may reduce memory. pad with zero pages.
          */
         IPRINTF("j (%ld) != nr_pages (%ld)", j, nr_pages);
-        memset(dump_mem_start, 0, PAGE_SIZE);
         for (; j < nr_pages; j++) {
-            sts = dump_rtn(xch, args, dump_mem_start, PAGE_SIZE);
+            sts = dump_rtn(xch, args, dummy, PAGE_SIZE);
             if ( sts != 0 )
                 goto out;
             if ( !auto_translated_physmap )
@@ -908,8 +1180,7 @@ out:
         xc_core_strtab_free(strtab);
     if ( ctxt != NULL )
         free(ctxt);
-    if ( dump_mem_start != NULL )
-        free(dump_mem_start);
+    dump_pipeline_fini(&pipe);
     if ( live_shinfo != NULL )
         munmap(live_shinfo, PAGE_SIZE);
     xc_core_arch_context_free(&arch_ctxt);
@@ -920,25 +1191,70 @@ out:
 /* Callback args for writing to a local dump file. */
 struct dump_args {
     int     fd;
+    unsigned long written;      /* since the cache was last discarded */
 };
 
-/* Callback routine for writing to a local dump file. */
+static int page_is_zero(const char *page)
+{
+    const unsigned long *p = (const unsigned long *)page;
+    unsigned int i;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); i++ )
+        if ( p[i] )
+            return 0;
+    return 1;
+}
+
+/*
+ * Callback routine for writing to a local dump file. The file is new, so
+ * whole zero pages are skipped over and left as holes: most of an idle
+ * guest's memory is neither read back from nor written to the disk.
+ */
 static int local_file_dump(xc_interface *xch,
                            void *args, char *buffer, unsigned int length)
 {
     struct dump_args *da = args;
+    unsigned int done = 0, run;
 
-    if ( write_exact(da->fd, buffer, length) == -1 )
+    while ( done < length )
     {
-        PERROR("Failed to write buffer");
-        return -errno;
+        for ( run = 0; length - done - run >= PAGE_SIZE &&
+                  page_is_zero(buffer + done + run); run += PAGE_SIZE )
+            ;
+        if ( run )
+        {
+            if ( lseek(da->fd, run, SEEK_CUR) == (off_t)-1 )
+            {
+                PERROR("Failed to seek over zero pages");
+                return -errno;
+            }
+            done += run;
+            continue;
+        }
+
+        /* pages up to the next zero one, or what is left of a page */
+        if ( length - done < PAGE_SIZE )
+            run = length - done;
+        else
+            for ( run = PAGE_SIZE; length - done - run >= PAGE_SIZE &&
+                      !page_is_zero(buffer + done + run); run += PAGE_SIZE )
+                ;
+
+        if ( write_exact(da->fd, buffer + done, run) == -1 )
+        {
+            PERROR("Failed to write buffer");
+            return -errno;
+        }
+        done += run;
     }
 
-    if ( length >= (DUMP_INCREMENT * PAGE_SIZE) )
+    da->written += length;
+    if ( da->written >= (DUMP_INCREMENT * PAGE_SIZE) )
     {
         // Now dumping pages -- make sure we discard clean pages from
         // the cache after each write
         discard_file_cache(xch, da->fd, 0 /* no flush */);
+        da->written = 0;
     }
 
     return 0;
@@ -949,7 +1265,8 @@ xc_domain_dumpcore(xc_interface *xch,
                    uint32_t domid,
                    const char *corename)
 {
-    struct dump_args da;
+    struct dump_args da = { .written = 0 };
+    off_t end;
     int sts;
 
     if ( (da.fd = open(corename, O_CREAT|O_RDWR|O_TRUNC, S_IWUSR|S_IRUSR)) < 0 )
@@ -961,6 +1278,14 @@ xc_domain_dumpcore(xc_interface *xch,
     sts = xc_domain_dumpcore_via_callback(
         xch, domid, &da, &local_file_dump);
 
+    /* a hole at the end of the file is only there once it is extended */
+    end = lseek(da.fd, 0, SEEK_CUR);
+    if ( sts == 0 && (end == (off_t)-1 || ftruncate(da.fd, end)) )
+    {
+        PERROR("Could not set the size of corefile %s", corename);
+        sts = -errno;
+    }
+
     /* flush and discard any remaining portion of the file from cache */
     discard_file_cache(xch, da.fd, 1/* flush first*/);
 
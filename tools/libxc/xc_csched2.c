@@ -61,3 +61,24 @@ xc_sched_credit2_domain_get(
 
     return err;
 }
+
+int
+xc_sched_credit2_domain_cosched(
+    xc_interface *xch,
+    uint32_t domid,
+    int enable)
+{
+    struct xen_domctl_sched_credit2 sdom;
+    int err;
+
+    err = xc_sched_credit2_domain_get(xch, domid, &sdom);
+    if ( err )
+        return err;
+
+    if ( enable )
+        sdom.flags |= XEN_SCHED_CREDIT2_COSCHED;
+    else
+        sdom.flags &= ~XEN_SCHED_CREDIT2_COSCHED;
+
+    return xc_sched_credit2_domain_set(xch, domid, &sdom);
+}
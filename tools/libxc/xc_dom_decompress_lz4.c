@@ -33,8 +33,109 @@ static inline uint_fast32_t le32_to_cpup(const unsigned char *buf)
 
 #include "../../xen/common/lz4/decompress.c"
 
+#include <pthread.h>
+#include <unistd.h>
+
 #define ARCHIVE_MAGICNUMBER 0x184C2102
 
+/*
+ * The chunks of the legacy format are compressed independently, and all
+ * but the last hold LZ4_CHUNK_SIZE bytes, so each can be decompressed to
+ * its place in the output by a thread of its own.  An image with chunks
+ * of other sizes is decompressed in order.
+ */
+#define LZ4_CHUNK_SIZE (8 << 20)
+#define LZ4_MAX_THREADS 8
+
+struct lz4_chunk {
+	const unsigned char *inp;
+	size_t len;
+};
+
+struct lz4_worker {
+	pthread_t thread;
+	const struct lz4_chunk *chunks;
+	unsigned int nr_chunks, first, stride;
+	unsigned char *output;
+	size_t out_len;
+	int failed;
+};
+
+static void *lz4_worker_fn(void *arg)
+{
+	struct lz4_worker *w = arg;
+	unsigned int i;
+	size_t off, dest_len;
+
+	for (i = w->first; i < w->nr_chunks; i += w->stride) {
+		off = (size_t)i * LZ4_CHUNK_SIZE;
+		dest_len = w->out_len - off;
+		if (i < w->nr_chunks - 1 && dest_len > LZ4_CHUNK_SIZE)
+			dest_len = LZ4_CHUNK_SIZE;
+		if (lz4_decompress_unknownoutputsize(w->chunks[i].inp,
+				w->chunks[i].len, w->output + off, &dest_len) < 0 ||
+		    (i < w->nr_chunks - 1 && dest_len != LZ4_CHUNK_SIZE)) {
+			w->failed = 1;
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/* Returns 0 if all chunks were decompressed, -1 to do it in order */
+static int lz4_decode_parallel(const struct lz4_chunk *chunks,
+		unsigned int nr_chunks, unsigned char *output, size_t out_len)
+{
+	struct lz4_worker workers[LZ4_MAX_THREADS];
+	unsigned int i, nr_workers, started = 0;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int rc = 0;
+
+	if (nr_chunks < 2 ||
+	    (size_t)(nr_chunks - 1) * LZ4_CHUNK_SIZE >= out_len)
+		return -1;
+
+	nr_workers = nr_chunks;
+	if (cpus > 0 && nr_workers > cpus)
+		nr_workers = cpus;
+	if (nr_workers > LZ4_MAX_THREADS)
+		nr_workers = LZ4_MAX_THREADS;
+	if (nr_workers < 2)
+		return -1;
+
+	for (i = 0; i < nr_workers; i++) {
+		workers[i].chunks = chunks;
+		workers[i].nr_chunks = nr_chunks;
+		workers[i].first = i;
+		workers[i].stride = nr_workers;
+		workers[i].output = output;
+		workers[i].out_len = out_len;
+		workers[i].failed = 0;
+	}
+
+	/* This thread takes the first share */
+	for (i = 1; i < nr_workers; i++) {
+		if (pthread_create(&workers[i].thread, NULL, lz4_worker_fn,
+				&workers[i]))
+			break;
+		started++;
+	}
+	/* What no thread was started for is done here, in stride */
+	for (; i < nr_workers; i++)
+		lz4_worker_fn(&workers[i]);
+	lz4_worker_fn(&workers[0]);
+
+	for (i = 1; i <= started; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	for (i = 0; i < nr_workers; i++)
+		if (workers[i].failed)
+			rc = -1;
+
+	return rc;
+}
+
 int xc_try_lz4_decode(
 	struct xc_dom_image *dom, void **blob, size_t *psize)
 {
@@ -42,6 +143,8 @@ int xc_try_lz4_decode(
 	unsigned char *inp = *blob, *output, *outp;
 	ssize_t size = *psize - 4;
 	size_t out_len, dest_len, chunksize;
+	struct lz4_chunk *chunks = NULL, *new_chunks;
+	unsigned int i, nr_chunks = 0, max_chunks = 0;
 	const char *msg;
 
 	if (size < 4) {
@@ -60,7 +163,6 @@ int xc_try_lz4_decode(
 		msg = "Could not allocate output buffer";
 		goto exit_0;
 	}
-	outp = output;
 
 	chunksize = get_unaligned_le32(inp);
 	if (chunksize == ARCHIVE_MAGICNUMBER) {
@@ -71,6 +173,7 @@ int xc_try_lz4_decode(
 		goto exit_2;
 	}
 
+	/* Find the chunks */
 	for (;;) {
 		if (size < 4) {
 			msg = "missing data";
@@ -89,24 +192,23 @@ int xc_try_lz4_decode(
 			goto exit_2;
 		}
 
-		dest_len = out_len - (outp - output);
-		ret = lz4_decompress_unknownoutputsize(inp, chunksize, outp,
-				&dest_len);
-		if (ret < 0) {
-			msg = "decoding failed";
-			goto exit_2;
+		if (nr_chunks == max_chunks) {
+			max_chunks = max_chunks ? max_chunks * 2 : 16;
+			new_chunks = realloc(chunks,
+					max_chunks * sizeof(*chunks));
+			if (!new_chunks) {
+				msg = "Could not allocate chunk list";
+				goto exit_2;
+			}
+			chunks = new_chunks;
 		}
+		chunks[nr_chunks].inp = inp;
+		chunks[nr_chunks].len = chunksize;
+		nr_chunks++;
 
-		ret = -1;
-		outp += dest_len;
 		size -= chunksize;
-
 		if (size == 0)
-		{
-			*blob = output;
-			*psize = out_len;
-			return 0;
-		}
+			break;
 
 		if (size < 0) {
 			msg = "data corrupted";
@@ -116,7 +218,31 @@ int xc_try_lz4_decode(
 		inp += chunksize;
 	}
 
+	if (lz4_decode_parallel(chunks, nr_chunks, output, out_len) == 0)
+		goto done;
+
+	outp = output;
+	for (i = 0; i < nr_chunks; i++) {
+		dest_len = out_len - (outp - output);
+		ret = lz4_decompress_unknownoutputsize(chunks[i].inp,
+				chunks[i].len, outp, &dest_len);
+		if (ret < 0) {
+			msg = "decoding failed";
+			goto exit_2;
+		}
+
+		ret = -1;
+		outp += dest_len;
+	}
+
+done:
+	free(chunks);
+	*blob = output;
+	*psize = out_len;
+	return 0;
+
 exit_2:
+	free(chunks);
 	free(output);
 exit_0:
 	DOMPRINTF("LZ4 decompression error: %s\n", msg);
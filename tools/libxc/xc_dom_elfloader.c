@@ -25,6 +25,10 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <inttypes.h>
+#include <unistd.h>
+#ifndef __MINIOS__
+#include <pthread.h>
+#endif
 
 #include "xg_private.h"
 #include "xc_dom.h"
@@ -383,6 +387,138 @@ out:
     return rc;
 }
 
+/*
+ * Large kernels are copied in by several threads, each taking a slice
+ * of every segment.  The segments are all checked against the source
+ * and destination before any is handed out, so the copies themselves
+ * need no further checks.
+ */
+#define ELF_LOAD_MAX_WORKERS  4
+#define ELF_LOAD_MAX_SEGMENTS 16
+#define ELF_LOAD_MIN_PARALLEL (8UL << 20)
+
+#ifndef __MINIOS__
+struct elf_load_job {
+    struct elf_segment seg[ELF_LOAD_MAX_SEGMENTS];
+    unsigned int nr_segs;
+    unsigned int nr_slices;
+};
+
+struct elf_load_worker {
+    struct elf_load_job *job;
+    unsigned int slice;
+    pthread_t thread;
+};
+
+static void elf_load_slice(struct elf_load_job *job, unsigned int slice)
+{
+    unsigned int s;
+    uint64_t chunk, start, end, mid;
+
+    for ( s = 0; s < job->nr_segs; s++ )
+    {
+        struct elf_segment *seg = &job->seg[s];
+
+        chunk = (seg->memsz + job->nr_slices - 1) / job->nr_slices;
+        chunk = (chunk + XC_PAGE_SIZE - 1) & ~(uint64_t)(XC_PAGE_SIZE - 1);
+        start = chunk * slice;
+        if ( start >= seg->memsz )
+            continue;
+        end = start + chunk < seg->memsz ? start + chunk : seg->memsz;
+        mid = end < seg->filesz ? end : seg->filesz;
+
+        /* Source and destination are separate mappings: memcpy is fine. */
+        if ( start < mid )
+            memcpy(ELF_UNSAFE_PTR(seg->dest + start),
+                   ELF_UNSAFE_PTR(seg->src + start), mid - start);
+        if ( start > mid )
+            mid = start;
+        if ( mid < end )
+            memset(ELF_UNSAFE_PTR(seg->dest + mid), 0, end - mid);
+    }
+}
+
+static void *elf_load_worker_thread(void *arg)
+{
+    struct elf_load_worker *worker = arg;
+
+    elf_load_slice(worker->job, worker->slice);
+    return NULL;
+}
+#endif
+
+/*
+ * Returns 1 if the segments were loaded, 0 if the caller should use
+ * elf_load_binary() instead: the image is small, one thread is all
+ * there is, or the segments are unusual enough that libelf's own
+ * checks and error reporting should deal with them.
+ */
+static int xc_dom_load_elf_parallel(struct xc_dom_image *dom,
+                                    struct elf_binary *elf)
+{
+#ifndef __MINIOS__
+    struct elf_load_job job;
+    struct elf_load_worker workers[ELF_LOAD_MAX_WORKERS];
+    struct elf_load_cursor cur;
+    struct elf_segment seg;
+    unsigned int s, w, started = 0;
+    uint64_t total = 0;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if ( cpus <= 1 )
+        return 0;
+
+    job.nr_segs = 0;
+    job.nr_slices = cpus < ELF_LOAD_MAX_WORKERS ? cpus : ELF_LOAD_MAX_WORKERS;
+
+    elf_load_start(elf, &cur);
+    while ( elf_load_next(elf, &cur, &seg) )
+    {
+        if ( job.nr_segs == ELF_LOAD_MAX_SEGMENTS ||
+             seg.filesz > seg.memsz ||
+             seg.memsz > SIZE_MAX ||
+             !elf_ptrval_in_range(seg.src, seg.filesz,
+                                  elf->image_base, elf->size) ||
+             !elf_ptrval_in_range(seg.dest, seg.memsz,
+                                  elf->dest_base, elf->dest_size) )
+            return 0;
+        /* Later segments overwrite earlier ones: keep that ordering. */
+        for ( s = 0; s < job.nr_segs; s++ )
+            if ( seg.dest < job.seg[s].dest + job.seg[s].memsz &&
+                 job.seg[s].dest < seg.dest + seg.memsz )
+                return 0;
+        job.seg[job.nr_segs++] = seg;
+        total += seg.memsz;
+    }
+    if ( elf_check_broken(elf) || total < ELF_LOAD_MIN_PARALLEL )
+        return 0;
+
+    DOMPRINTF("%s: %u segments, 0x%" PRIx64 " bytes, %u threads",
+              __FUNCTION__, job.nr_segs, total, job.nr_slices);
+
+    for ( w = 1; w < job.nr_slices; w++ )
+    {
+        workers[w].job = &job;
+        workers[w].slice = w;
+        if ( pthread_create(&workers[w].thread, NULL,
+                            elf_load_worker_thread, &workers[w]) )
+            break;
+        started++;
+    }
+    /* Slices without a thread of their own are copied here. */
+    elf_load_slice(&job, 0);
+    for ( w = started + 1; w < job.nr_slices; w++ )
+        elf_load_slice(&job, w);
+    for ( w = 1; w <= started; w++ )
+        pthread_join(workers[w].thread, NULL);
+
+    elf_load_bsdsyms(elf);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
 static elf_errorstatus xc_dom_load_elf_kernel(struct xc_dom_image *dom)
 {
     struct elf_binary *elf = dom->private_loader;
@@ -398,7 +534,7 @@ static elf_errorstatus xc_dom_load_elf_kernel(struct xc_dom_image *dom)
     }
     elf->dest_size = pages * XC_DOM_PAGE_SIZE(dom);
 
-    rc = elf_load_binary(elf);
+    rc = xc_dom_load_elf_parallel(dom, elf) ? 0 : elf_load_binary(elf);
     if ( rc < 0 )
     {
         DOMPRINTF("%s: failed to load elf binary", __FUNCTION__);
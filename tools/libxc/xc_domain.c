@@ -252,6 +252,59 @@ int xc_vcpu_setaffinity(xc_interface *xch,
     return ret;
 }
 
+int xc_vcpu_setaffinity_bulk(xc_interface *xch,
+                             uint32_t domid,
+                             int first_vcpu,
+                             int nr_vcpus,
+                             xc_cpumap_t cpumap_hard,
+                             xc_cpumap_t cpumap_soft,
+                             uint32_t flags)
+{
+    DECLARE_DOMCTL;
+    DECLARE_HYPERCALL_BOUNCE(cpumap_hard, 0, XC_HYPERCALL_BUFFER_BOUNCE_IN);
+    DECLARE_HYPERCALL_BOUNCE(cpumap_soft, 0, XC_HYPERCALL_BUFFER_BOUNCE_IN);
+    int ret = -1;
+    int cpusize;
+
+    cpusize = xc_get_cpumap_size(xch);
+    if (cpusize <= 0)
+    {
+        PERROR("Could not get number of cpus");
+        return -1;
+    }
+
+    HYPERCALL_BOUNCE_SET_SIZE(cpumap_hard, cpusize);
+    HYPERCALL_BOUNCE_SET_SIZE(cpumap_soft, cpusize);
+
+    if ( xc_hypercall_bounce_pre(xch, cpumap_hard) ||
+         xc_hypercall_bounce_pre(xch, cpumap_soft) )
+    {
+        PERROR("Could not allocate hcall buffers for DOMCTL_setvcpuaffinity_bulk");
+        goto out;
+    }
+
+    domctl.cmd = XEN_DOMCTL_setvcpuaffinity_bulk;
+    domctl.domain = (domid_t)domid;
+    domctl.u.vcpuaffinity_bulk.first_vcpu = first_vcpu;
+    domctl.u.vcpuaffinity_bulk.nr_vcpus = nr_vcpus;
+    domctl.u.vcpuaffinity_bulk.flags = flags;
+
+    set_xen_guest_handle(domctl.u.vcpuaffinity_bulk.cpumap_hard.bitmap,
+                         cpumap_hard);
+    domctl.u.vcpuaffinity_bulk.cpumap_hard.nr_bits = cpusize * 8;
+    set_xen_guest_handle(domctl.u.vcpuaffinity_bulk.cpumap_soft.bitmap,
+                         cpumap_soft);
+    domctl.u.vcpuaffinity_bulk.cpumap_soft.nr_bits = cpusize * 8;
+
+    ret = do_domctl(xch, &domctl);
+
+ out:
+    xc_hypercall_bounce_post(xch, cpumap_hard);
+    xc_hypercall_bounce_post(xch, cpumap_soft);
+
+    return ret;
+}
+
 
 int xc_vcpu_getaffinity(xc_interface *xch,
                         uint32_t domid,
@@ -597,6 +650,43 @@ int xc_shadow_control(xc_interface *xch,
     return (rc == 0) ? domctl.u.shadow_op.pages : rc;
 }
 
+int xc_domain_log_dirty_extents(xc_interface *xch, uint32_t domid,
+                                uint32_t flags, uint64_t *start_pfn,
+                                xc_dirty_extent_t *extents,
+                                unsigned int *nr_extents,
+                                xc_shadow_op_stats_t *stats)
+{
+    int rc;
+    DECLARE_DOMCTL;
+    DECLARE_HYPERCALL_BOUNCE(extents, *nr_extents * sizeof(*extents),
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( xc_hypercall_bounce_pre(xch, extents) )
+        return -1;
+
+    domctl.cmd = XEN_DOMCTL_log_dirty_extents;
+    domctl.domain = (domid_t)domid;
+    domctl.u.log_dirty_extents.flags = flags;
+    domctl.u.log_dirty_extents.nr_extents = *nr_extents;
+    domctl.u.log_dirty_extents.start_pfn = *start_pfn;
+    set_xen_guest_handle(domctl.u.log_dirty_extents.extents, extents);
+
+    rc = do_domctl(xch, &domctl);
+
+    xc_hypercall_bounce_post(xch, extents);
+
+    if ( !rc )
+    {
+        if ( stats && !*start_pfn )
+            memcpy(stats, &domctl.u.log_dirty_extents.stats,
+                   sizeof(xc_shadow_op_stats_t));
+        *start_pfn = domctl.u.log_dirty_extents.start_pfn;
+        *nr_extents = domctl.u.log_dirty_extents.nr_extents;
+    }
+
+    return rc;
+}
+
 int xc_domain_setmaxmem(xc_interface *xch,
                         uint32_t domid,
                         unsigned int max_memkb)
@@ -977,6 +1067,33 @@ int xc_domain_populate_physmap_exact(xc_interface *xch,
     return err;
 }
 
+int xc_domain_populate_physmap_range(xc_interface *xch,
+                                     uint32_t domid,
+                                     xen_pfn_t first_gfn,
+                                     unsigned long nr_pages,
+                                     unsigned int *max_order,
+                                     unsigned int mem_flags,
+                                     unsigned long *nr_done)
+{
+    int err;
+    struct xen_populate_physmap_range range = {
+        .domid     = domid,
+        .mem_flags = mem_flags,
+        .first_gfn = first_gfn,
+        .nr_pages  = nr_pages,
+        .nr_done   = 0,
+        .max_order = *max_order
+    };
+
+    err = do_memory_op(xch, XENMEM_populate_physmap_range, &range,
+                       sizeof(range));
+
+    *nr_done = range.nr_done;
+    *max_order = range.max_order;
+
+    return err;
+}
+
 int xc_domain_memory_exchange_pages(xc_interface *xch,
                                     int domid,
                                     unsigned long nr_in_extents,
@@ -1447,6 +1564,62 @@ int xc_hvm_unmap_io_range_from_ioreq_server(xc_interface *xch, domid_t domid,
     return rc;
 }
 
+int xc_hvm_map_posted_ports_to_ioreq_server(xc_interface *xch, domid_t domid,
+                                            ioservid_t id, uint16_t start,
+                                            uint16_t end)
+{
+    DECLARE_HYPERCALL;
+    DECLARE_HYPERCALL_BUFFER(xen_hvm_io_range_t, arg);
+    int rc;
+
+    arg = xc_hypercall_buffer_alloc(xch, arg, sizeof(*arg));
+    if ( arg == NULL )
+        return -1;
+
+    hypercall.op     = __HYPERVISOR_hvm_op;
+    hypercall.arg[0] = HVMOP_map_io_range_to_ioreq_server;
+    hypercall.arg[1] = HYPERCALL_BUFFER_AS_ARG(arg);
+
+    arg->domid = domid;
+    arg->id = id;
+    arg->type = HVMOP_IO_RANGE_POSTED;
+    arg->start = start;
+    arg->end = end;
+
+    rc = do_xen_hypercall(xch, &hypercall);
+
+    xc_hypercall_buffer_free(xch, arg);
+    return rc;
+}
+
+int xc_hvm_unmap_posted_ports_from_ioreq_server(xc_interface *xch,
+                                                domid_t domid, ioservid_t id,
+                                                uint16_t start, uint16_t end)
+{
+    DECLARE_HYPERCALL;
+    DECLARE_HYPERCALL_BUFFER(xen_hvm_io_range_t, arg);
+    int rc;
+
+    arg = xc_hypercall_buffer_alloc(xch, arg, sizeof(*arg));
+    if ( arg == NULL )
+        return -1;
+
+    hypercall.op     = __HYPERVISOR_hvm_op;
+    hypercall.arg[0] = HVMOP_unmap_io_range_from_ioreq_server;
+    hypercall.arg[1] = HYPERCALL_BUFFER_AS_ARG(arg);
+
+    arg->domid = domid;
+    arg->id = id;
+    arg->type = HVMOP_IO_RANGE_POSTED;
+    arg->start = start;
+    arg->end = end;
+
+    rc = do_xen_hypercall(xch, &hypercall);
+
+    xc_hypercall_buffer_free(xch, arg);
+    return rc;
+}
+
 int xc_hvm_map_pcidev_to_ioreq_server(xc_interface *xch, domid_t domid,
                                       ioservid_t id, uint16_t segment,
                                       uint8_t bus, uint8_t device,
@@ -2123,6 +2296,224 @@ int xc_domain_set_max_evtchn(xc_interface *xch, uint32_t domid,
     return do_domctl(xch, &domctl);
 }
 
+int xc_domain_p2m_coalesce(xc_interface *xch, uint32_t domid,
+                           uint64_t *nr_2mb, uint64_t *nr_1gb)
+{
+    int rc;
+    DECLARE_DOMCTL;
+
+    domctl.cmd = XEN_DOMCTL_p2m_coalesce;
+    domctl.domain = domid;
+    domctl.u.p2m_coalesce.next_gfn = 0;
+    domctl.u.p2m_coalesce.nr_2mb = 0;
+    domctl.u.p2m_coalesce.nr_1gb = 0;
+    rc = do_domctl(xch, &domctl);
+
+    if ( nr_2mb )
+        *nr_2mb = domctl.u.p2m_coalesce.nr_2mb;
+    if ( nr_1gb )
+        *nr_1gb = domctl.u.p2m_coalesce.nr_1gb;
+
+    return rc;
+}
+
+int xc_domain_set_latency_hint(xc_interface *xch, uint32_t domid,
+                               int sensitive)
+{
+    DECLARE_DOMCTL;
+
+    domctl.cmd = XEN_DOMCTL_set_latency_hint;
+    domctl.domain = domid;
+    domctl.u.latency_hint.flags = sensitive ? XEN_DOMCTL_LATENCY_SENSITIVE : 0;
+
+    return do_domctl(xch, &domctl);
+}
+
+int xc_domain_setvnuma(xc_interface *xch, uint32_t domid,
+                       uint32_t nr_vnodes, uint32_t nr_vmemranges,
+                       uint32_t nr_vcpus, xen_vmemrange_t *vmemrange,
+                       unsigned int *vdistance, unsigned int *vcpu_to_vnode,
+                       unsigned int *vnode_to_pnode)
+{
+    DECLARE_DOMCTL;
+    DECLARE_HYPERCALL_BOUNCE(vmemrange, nr_vmemranges * sizeof(*vmemrange),
+                             XC_HYPERCALL_BUFFER_BOUNCE_IN);
+    DECLARE_HYPERCALL_BOUNCE(vdistance,
+                             nr_vnodes * nr_vnodes * sizeof(*vdistance),
+                             XC_HYPERCALL_BUFFER_BOUNCE_IN);
+    DECLARE_HYPERCALL_BOUNCE(vcpu_to_vnode, nr_vcpus * sizeof(*vcpu_to_vnode),
+                             XC_HYPERCALL_BUFFER_BOUNCE_IN);
+    DECLARE_HYPERCALL_BOUNCE(vnode_to_pnode,
+                             nr_vnodes * sizeof(*vnode_to_pnode),
+                             XC_HYPERCALL_BUFFER_BOUNCE_IN);
+    int rc = -1;
+
+    if ( xc_hypercall_bounce_pre(xch, vmemrange) ||
+         xc_hypercall_bounce_pre(xch, vdistance) ||
+         xc_hypercall_bounce_pre(xch, vcpu_to_vnode) ||
+         xc_hypercall_bounce_pre(xch, vnode_to_pnode) )
+    {
+        PERROR("Could not bounce the vNUMA topology");
+        goto out;
+    }
+
+    domctl.cmd = XEN_DOMCTL_setvnumainfo;
+    domctl.domain = domid;
+    domctl.u.vnuma.nr_vnodes = nr_vnodes;
+    domctl.u.vnuma.nr_vmemranges = nr_vmemranges;
+    domctl.u.vnuma.nr_vcpus = nr_vcpus;
+    domctl.u.vnuma.pad = 0;
+    set_xen_guest_handle(domctl.u.vnuma.vmemrange, vmemrange);
+    set_xen_guest_handle(domctl.u.vnuma.vdistance, vdistance);
+    set_xen_guest_handle(domctl.u.vnuma.vcpu_to_vnode, vcpu_to_vnode);
+    set_xen_guest_handle(domctl.u.vnuma.vnode_to_pnode, vnode_to_pnode);
+    rc = do_domctl(xch, &domctl);
+
+ out:
+    xc_hypercall_bounce_post(xch, vnode_to_pnode);
+    xc_hypercall_bounce_post(xch, vcpu_to_vnode);
+    xc_hypercall_bounce_post(xch, vdistance);
+    xc_hypercall_bounce_post(xch, vmemrange);
+    return rc;
+}
+
+int xc_v4v_set_quota(xc_interface *xch, uint32_t domid,
+                     uint32_t max_rings, uint64_t max_pages)
+{
+    DECLARE_DOMCTL;
+
+    domctl.cmd = XEN_DOMCTL_v4v_set_quota;
+    domctl.domain = domid;
+    domctl.u.v4v_set_quota.max_rings = max_rings;
+    domctl.u.v4v_set_quota.max_pages = max_pages;
+    return do_domctl(xch, &domctl);
+}
+
+/* Second half of xc_v4v_rings_save(), into arrays of the counted size */
+static int xc_v4v_rings_get(xc_interface *xch, uint32_t domid,
+                            xen_domctl_v4v_ring_t *rings, uint32_t nr_rings,
+                            uint64_t *pfns, uint32_t nr_pfns)
+{
+    DECLARE_DOMCTL;
+    DECLARE_HYPERCALL_BOUNCE(rings, nr_rings * sizeof(*rings),
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+    DECLARE_HYPERCALL_BOUNCE(pfns, nr_pfns * sizeof(*pfns),
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+    int rc = -1;
+
+    if ( xc_hypercall_bounce_pre(xch, rings) )
+        return -1;
+    if ( xc_hypercall_bounce_pre(xch, pfns) )
+        goto out;
+
+    domctl.cmd = XEN_DOMCTL_v4v_rings;
+    domctl.domain = domid;
+    domctl.u.v4v_rings.op = XEN_DOMCTL_V4V_RINGS_SAVE;
+    domctl.u.v4v_rings.nr_rings = nr_rings;
+    domctl.u.v4v_rings.nr_pfns = nr_pfns;
+    set_xen_guest_handle(domctl.u.v4v_rings.rings, rings);
+    set_xen_guest_handle(domctl.u.v4v_rings.pfns, pfns);
+    rc = do_domctl(xch, &domctl);
+
+    xc_hypercall_bounce_post(xch, pfns);
+ out:
+    xc_hypercall_bounce_post(xch, rings);
+    return rc;
+}
+
+int xc_v4v_rings_save(xc_interface *xch, uint32_t domid,
+                      xen_domctl_v4v_ring_t **rings, uint32_t *nr_rings,
+                      uint64_t **pfns, uint32_t *nr_pfns)
+{
+    DECLARE_DOMCTL;
+    int rc;
+
+    *rings = NULL;
+    *pfns = NULL;
+    *nr_rings = *nr_pfns = 0;
+
+    /* Stops the rings and counts them, they can't change after this. */
+    domctl.cmd = XEN_DOMCTL_v4v_rings;
+    domctl.domain = domid;
+    domctl.u.v4v_rings.op = XEN_DOMCTL_V4V_RINGS_SAVE;
+    domctl.u.v4v_rings.nr_rings = 0;
+    domctl.u.v4v_rings.nr_pfns = 0;
+    set_xen_guest_handle(domctl.u.v4v_rings.rings, HYPERCALL_BUFFER_NULL);
+    set_xen_guest_handle(domctl.u.v4v_rings.pfns, HYPERCALL_BUFFER_NULL);
+    if ( (rc = do_domctl(xch, &domctl)) != 0 )
+        return rc;
+
+    if ( !domctl.u.v4v_rings.nr_rings )
+        return 0;
+
+    *rings = malloc(domctl.u.v4v_rings.nr_rings * sizeof(**rings));
+    *pfns = malloc(domctl.u.v4v_rings.nr_pfns * sizeof(**pfns));
+    if ( !*rings || !*pfns )
+    {
+        PERROR("Could not allocate the v4v rings");
+        rc = -1;
+    }
+    else
+        rc = xc_v4v_rings_get(xch, domid,
+                              *rings, domctl.u.v4v_rings.nr_rings,
+                              *pfns, domctl.u.v4v_rings.nr_pfns);
+
+    if ( rc )
+    {
+        free(*rings);
+        free(*pfns);
+        *rings = NULL;
+        *pfns = NULL;
+        return rc;
+    }
+
+    *nr_rings = domctl.u.v4v_rings.nr_rings;
+    *nr_pfns = domctl.u.v4v_rings.nr_pfns;
+    return 0;
+}
+
+int xc_v4v_rings_thaw(xc_interface *xch, uint32_t domid)
+{
+    DECLARE_DOMCTL;
+
+    domctl.cmd = XEN_DOMCTL_v4v_rings;
+    domctl.domain = domid;
+    domctl.u.v4v_rings.op = XEN_DOMCTL_V4V_RINGS_THAW;
+    return do_domctl(xch, &domctl);
+}
+
+int xc_v4v_rings_restore(xc_interface *xch, uint32_t domid,
+                         xen_domctl_v4v_ring_t *rings, uint32_t nr_rings,
+                         uint64_t *pfns, uint32_t nr_pfns)
+{
+    DECLARE_DOMCTL;
+    DECLARE_HYPERCALL_BOUNCE(rings, nr_rings * sizeof(*rings),
+                             XC_HYPERCALL_BUFFER_BOUNCE_IN);
+    DECLARE_HYPERCALL_BOUNCE(pfns, nr_pfns * sizeof(*pfns),
+                             XC_HYPERCALL_BUFFER_BOUNCE_IN);
+    int rc = -1;
+
+    if ( xc_hypercall_bounce_pre(xch, rings) )
+        return -1;
+    if ( xc_hypercall_bounce_pre(xch, pfns) )
+        goto out;
+
+    domctl.cmd = XEN_DOMCTL_v4v_rings;
+    domctl.domain = domid;
+    domctl.u.v4v_rings.op = XEN_DOMCTL_V4V_RINGS_RESTORE;
+    domctl.u.v4v_rings.nr_rings = nr_rings;
+    domctl.u.v4v_rings.nr_pfns = nr_pfns;
+    domctl.u.v4v_rings.done = 0;
+    set_xen_guest_handle(domctl.u.v4v_rings.rings, rings);
+    set_xen_guest_handle(domctl.u.v4v_rings.pfns, pfns);
+    rc = do_domctl(xch, &domctl);
+
+    xc_hypercall_bounce_post(xch, pfns);
+ out:
+    xc_hypercall_bounce_post(xch, rings);
+    return rc;
+}
+
 /*
  * Local variables:
  * mode: C
@@ -39,6 +39,10 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <inttypes.h>
+#ifndef __MINIOS__
+#include <poll.h>
+#include <pthread.h>
+#endif
 
 #include "xg_private.h"
 #include "xg_save_restore.h"
@@ -61,12 +65,218 @@ struct restore_ctx {
     int completed; /* Set when a consistent image is available */
     int last_checkpoint; /* Set when we should commit to the current checkpoint when it completes. */
     int compressing; /* Set when sender signals that pages would be sent compressed (for Remus) */
+    struct readahead *ra; /* Reader of the stream ahead of the restore */
     struct domain_info_context dinfo;
 };
 
 #define HEARTBEAT_MS 1000
 
 #ifndef __MINIOS__
+/*
+ * Until the image is complete, the stream is read ahead into a ring by a
+ * reader thread, which receives the next batches, and then the tail,
+ * while the main thread installs the pages already read.  The reader is
+ * stopped once the image is complete, before the stream is switched to
+ * the heartbeat of the checkpoints: what it read past the image is
+ * handed out first, then the stream is read as before.
+ */
+#define READAHEAD_SIZE (8UL << 20)
+
+struct readahead {
+    /* -1 once the reader is stopped */
+    int fd;
+    pthread_t reader;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* Closing wake[1] gets the reader out of poll() to stop it */
+    int wake[2];
+    char *buf;
+    /* Free running, prod - cons bytes are buffered */
+    unsigned long prod, cons;
+    /* errno of a failed read, -1 at the end of the stream */
+    int error;
+    int quit;
+};
+
+static void *readahead_reader(void *arg)
+{
+    struct readahead *ra = arg;
+    struct pollfd pfd[2];
+    unsigned long off, len;
+    ssize_t rc;
+
+    pfd[0].fd = ra->fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = ra->wake[0];
+    pfd[1].events = POLLIN;
+
+    pthread_mutex_lock(&ra->lock);
+    for ( ; ; )
+    {
+        while ( !ra->quit && !ra->error &&
+                ra->prod - ra->cons == READAHEAD_SIZE )
+            pthread_cond_wait(&ra->cond, &ra->lock);
+        if ( ra->quit || ra->error )
+            break;
+
+        off = ra->prod % READAHEAD_SIZE;
+        len = READAHEAD_SIZE - (ra->prod - ra->cons);
+        if ( len > READAHEAD_SIZE - off )
+            len = READAHEAD_SIZE - off;
+        pthread_mutex_unlock(&ra->lock);
+
+        rc = poll(pfd, 2, -1);
+        if ( rc > 0 && pfd[1].revents )
+        {
+            pthread_mutex_lock(&ra->lock);
+            break;
+        }
+        if ( rc > 0 )
+            rc = read(ra->fd, ra->buf + off, len);
+
+        pthread_mutex_lock(&ra->lock);
+        if ( rc > 0 && pfd[0].revents )
+            ra->prod += rc;
+        else if ( rc == 0 && pfd[0].revents )
+            ra->error = -1;
+        else if ( rc < 0 && errno != EINTR && errno != EAGAIN )
+            ra->error = errno;
+        pthread_cond_broadcast(&ra->cond);
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    return NULL;
+}
+
+/* Start reading fd ahead, the restore reads it directly if that fails */
+static void readahead_start(xc_interface *xch, struct restore_ctx *ctx,
+                            int fd)
+{
+    struct readahead *ra = calloc(1, sizeof(*ra));
+
+    if ( !ra )
+        return;
+
+    ra->fd = fd;
+    ra->buf = malloc(READAHEAD_SIZE);
+    if ( !ra->buf || pipe(ra->wake) )
+    {
+        free(ra->buf);
+        free(ra);
+        return;
+    }
+
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+    if ( pthread_create(&ra->reader, NULL, readahead_reader, ra) )
+    {
+        DPRINTF("no reader thread, restoring without read-ahead\n");
+        pthread_cond_destroy(&ra->cond);
+        pthread_mutex_destroy(&ra->lock);
+        close(ra->wake[0]);
+        close(ra->wake[1]);
+        free(ra->buf);
+        free(ra);
+        return;
+    }
+
+    ctx->ra = ra;
+}
+
+/* Stop reading ahead, what was read is still handed out */
+static void readahead_stop(struct readahead *ra)
+{
+    if ( !ra || ra->fd < 0 )
+        return;
+
+    pthread_mutex_lock(&ra->lock);
+    ra->quit = 1;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+    close(ra->wake[1]);
+    pthread_join(ra->reader, NULL);
+
+    close(ra->wake[0]);
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->lock);
+    ra->fd = -1;
+}
+
+static void readahead_free(struct restore_ctx *ctx)
+{
+    readahead_stop(ctx->ra);
+    if ( ctx->ra )
+        free(ctx->ra->buf);
+    free(ctx->ra);
+    ctx->ra = NULL;
+}
+
+/*
+ * Copy up to size bytes of what was read ahead to buf, waiting for them
+ * while the reader runs.  Less than size are returned at the end of the
+ * stream or on an error, with ra->error set, or once the reader was
+ * stopped and all it read handed out, after which the read-ahead is
+ * gone.
+ */
+static size_t readahead_read(struct restore_ctx *ctx, void *buf, size_t size)
+{
+    struct readahead *ra = ctx->ra;
+    unsigned long off, len;
+    size_t offset = 0;
+    int stopped = (ra->fd < 0);
+
+    if ( !stopped )
+        pthread_mutex_lock(&ra->lock);
+    while ( offset < size )
+    {
+        while ( !stopped && ra->prod == ra->cons && !ra->error )
+            pthread_cond_wait(&ra->cond, &ra->lock);
+        if ( ra->prod == ra->cons )
+            break;
+
+        off = ra->cons % READAHEAD_SIZE;
+        len = ra->prod - ra->cons;
+        if ( len > READAHEAD_SIZE - off )
+            len = READAHEAD_SIZE - off;
+        if ( len > size - offset )
+            len = size - offset;
+        memcpy((char *)buf + offset, ra->buf + off, len);
+        ra->cons += len;
+        offset += len;
+        if ( !stopped )
+            pthread_cond_broadcast(&ra->cond);
+    }
+    if ( !stopped )
+        pthread_mutex_unlock(&ra->lock);
+    else if ( ra->prod == ra->cons )
+        readahead_free(ctx);
+
+    return offset;
+}
+
+/* read() of the stream, through the read-ahead while there is one */
+static ssize_t rdsome(struct restore_ctx *ctx, int fd, void *buf,
+                      size_t size)
+{
+    size_t len;
+
+    if ( !ctx->ra )
+        return read(fd, buf, size);
+
+    len = readahead_read(ctx, buf, size);
+    if ( len )
+        return len;
+    if ( !ctx->ra )
+        return read(fd, buf, size);
+
+    if ( ctx->ra->error > 0 )
+    {
+        errno = ctx->ra->error;
+        return -1;
+    }
+    return 0;
+}
+
 static ssize_t rdexact(xc_interface *xch, struct restore_ctx *ctx,
                        int fd, void* buf, size_t size)
 {
@@ -75,6 +285,23 @@ static ssize_t rdexact(xc_interface *xch, struct restore_ctx *ctx,
     struct timeval tv;
     fd_set rfds;
 
+    if ( ctx->ra )
+    {
+        offset = readahead_read(ctx, buf, size);
+        if ( offset < size && ctx->ra )
+        {
+            if ( ctx->ra->error < 0 )
+            {
+                ERROR("0-length read");
+                errno = 0;
+            }
+            else
+                errno = ctx->ra->error;
+            ERROR("%s failed (read errno: %d)", __func__, errno);
+            return -1;
+        }
+    }
+
     while ( offset < size )
     {
         if ( ctx->completed ) {
@@ -112,8 +339,13 @@ static ssize_t rdexact(xc_interface *xch, struct restore_ctx *ctx,
 }
 
 #define RDEXACT(fd,buf,size) rdexact(xch, ctx, fd, buf, size)
+#define RDSOME(fd,buf,size) rdsome(ctx, fd, buf, size)
 #else
 #define RDEXACT read_exact
+#define RDSOME read
+#define readahead_start(xch, ctx, fd) ((void)0)
+#define readahead_stop(ra) ((void)0)
+#define readahead_free(ctx) ((void)0)
 #endif
 
 #define SUPERPAGE_PFN_SHIFT  9
@@ -419,7 +651,7 @@ static int compat_buffer_qemu(xc_interface *xch, struct restore_ctx *ctx,
         return -1;
     }
 
-    while( (rc = read(fd, qbuf+dlen, blen-dlen)) > 0 ) {
+    while( (rc = RDSOME(fd, qbuf+dlen, blen-dlen)) > 0 ) {
         DPRINTF("Read %d bytes of QEMU data\n", rc);
         dlen += rc;
 
@@ -715,6 +947,13 @@ struct toolstack_data_t {
     uint32_t len;
 };
 
+struct v4v_rings_data_t {
+    xen_domctl_v4v_ring_t *rings;
+    uint32_t nr_rings;
+    uint64_t *pfns;
+    uint32_t nr_pfns;
+};
+
 typedef struct {
     void* pages;
     /* pages is of length nr_physpages, pfn_types is of length nr_pages */
@@ -723,6 +962,8 @@ typedef struct {
     /* checkpoint compression state */
     int compressing;
     unsigned long compbuf_pos, compbuf_size;
+    /* The batch is delta compressed (XC_SAVE_ID_DELTA_PAGES) */
+    int delta;
 
     /* Types of the pfns in the current region */
     unsigned long* pfn_types;
@@ -745,6 +986,7 @@ typedef struct {
     uint64_t nr_ioreq_server_pages;
 
     struct toolstack_data_t tdata;
+    struct v4v_rings_data_t v4v;
 } pagebuf_t;
 
 static int pagebuf_init(pagebuf_t* buf)
@@ -753,12 +995,20 @@ static int pagebuf_init(pagebuf_t* buf)
     return 0;
 }
 
+static void v4v_rings_data_free(struct v4v_rings_data_t *v4v)
+{
+    free(v4v->rings);
+    free(v4v->pfns);
+    memset(v4v, 0, sizeof(*v4v));
+}
+
 static void pagebuf_free(pagebuf_t* buf)
 {
     if (buf->tdata.data != NULL) {
         free(buf->tdata.data);
         buf->tdata.data = NULL;
     }
+    v4v_rings_data_free(&buf->v4v);
     if (buf->pages) {
         free(buf->pages);
         buf->pages = NULL;
@@ -772,7 +1022,7 @@ static void pagebuf_free(pagebuf_t* buf)
 static int pagebuf_get_one(xc_interface *xch, struct restore_ctx *ctx,
                            pagebuf_t* buf, int fd, uint32_t dom)
 {
-    int count, countpages, oldcount, i;
+    int count, countpages, oldcount, i, rc;
     void* ptmp;
     unsigned long compbuf_size;
 
@@ -948,6 +1198,36 @@ static int pagebuf_get_one(xc_interface *xch, struct restore_ctx *ctx,
             return pagebuf_get_one(xch, ctx, buf, fd, dom);
         }
 
+    case XC_SAVE_ID_V4V_RINGS:
+        {
+            struct v4v_rings_data_t *v4v = &buf->v4v;
+
+            v4v_rings_data_free(v4v);
+            if ( RDEXACT(fd, &v4v->nr_rings, sizeof(v4v->nr_rings)) ||
+                 RDEXACT(fd, &v4v->nr_pfns, sizeof(v4v->nr_pfns)) )
+            {
+                PERROR("error read the v4v ring counts");
+                return -1;
+            }
+            v4v->rings = malloc(v4v->nr_rings * sizeof(*v4v->rings));
+            v4v->pfns = malloc(v4v->nr_pfns * sizeof(*v4v->pfns));
+            if ( (v4v->nr_rings && v4v->rings == NULL) ||
+                 (v4v->nr_pfns && v4v->pfns == NULL) )
+            {
+                PERROR("error memory allocation");
+                v4v_rings_data_free(v4v);
+                return -1;
+            }
+            if ( RDEXACT(fd, v4v->rings, v4v->nr_rings * sizeof(*v4v->rings)) ||
+                 RDEXACT(fd, v4v->pfns, v4v->nr_pfns * sizeof(*v4v->pfns)) )
+            {
+                PERROR("error read the v4v rings");
+                v4v_rings_data_free(v4v);
+                return -1;
+            }
+            return pagebuf_get_one(xch, ctx, buf, fd, dom);
+        }
+
     case XC_SAVE_ID_ENABLE_COMPRESSION:
         /* We cannot set compression flag directly in pagebuf structure,
          * since this pagebuf still has uncompressed pages that are yet to
@@ -958,6 +1238,17 @@ static int pagebuf_get_one(xc_interface *xch, struct restore_ctx *ctx,
         // DPRINTF("compression flag received");
         return pagebuf_get_one(xch, ctx, buf, fd, dom);
 
+    case XC_SAVE_ID_DELTA_PAGES:
+        /* Only ahead of a batch of the live rounds, see xg_save_restore.h */
+        if ( buf->compressing || ctx->completed )
+        {
+            ERROR("Delta compressed batch in a checkpoint");
+            errno = EINVAL;
+            return -1;
+        }
+        buf->delta = 1;
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+
     case XC_SAVE_ID_COMPRESSED_DATA:
 
         /* read the length of compressed chunk coming in */
@@ -1063,6 +1354,19 @@ static int pagebuf_get_one(xc_interface *xch, struct restore_ctx *ctx,
     if (buf->compressing)
         return pagebuf_get_one(xch, ctx, buf, fd, dom);
 
+    /* The pages of a delta compressed batch come in the next chunk */
+    if (buf->delta)
+    {
+        rc = pagebuf_get_one(xch, ctx, buf, fd, dom);
+        if ( rc > 0 && buf->compbuf_size == 0 )
+        {
+            ERROR("Delta compressed batch without its pages");
+            errno = EINVAL;
+            return -1;
+        }
+        return rc < 0 ? rc : count;
+    }
+
     oldcount = buf->nr_physpages;
     buf->nr_physpages += countpages;
     if (!buf->pages) {
@@ -1092,6 +1396,7 @@ static int pagebuf_get(xc_interface *xch, struct restore_ctx *ctx,
 
     buf->nr_physpages = buf->nr_pages = 0;
     buf->compbuf_pos = buf->compbuf_size = 0;
+    buf->delta = 0;
 
     do {
         rc = pagebuf_get_one(xch, ctx, buf, fd, dom);
@@ -1103,6 +1408,42 @@ static int pagebuf_get(xc_interface *xch, struct restore_ctx *ctx,
     return rc;
 }
 
+/*
+ * Register the rings the domain had on the other side, once its memory is
+ * all in place: xen reads the ring headers back from it.
+ */
+static int restore_v4v_rings(xc_interface *xch, uint32_t dom,
+                             struct restore_ctx *ctx,
+                             struct v4v_rings_data_t *v4v)
+{
+    struct domain_info_context *dinfo = &ctx->dinfo;
+    uint32_t i;
+
+    if ( !v4v->nr_rings )
+        return 0;
+
+    /* A PV guest gives its rings as mfns, the save side sent pfns */
+    for ( i = 0; !ctx->hvm && i < v4v->nr_pfns; i++ )
+    {
+        if ( v4v->pfns[i] >= dinfo->p2m_size ||
+             ctx->p2m[v4v->pfns[i]] == INVALID_P2M_ENTRY )
+        {
+            ERROR("v4v ring pfn %"PRIx64" is not in the p2m", v4v->pfns[i]);
+            return -1;
+        }
+        v4v->pfns[i] = ctx->p2m[v4v->pfns[i]];
+    }
+
+    if ( xc_v4v_rings_restore(xch, dom, v4v->rings, v4v->nr_rings,
+                              v4v->pfns, v4v->nr_pfns) )
+    {
+        PERROR("error restoring the v4v rings");
+        return -1;
+    }
+
+    return 0;
+}
+
 static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
                        xen_pfn_t* region_mfn, unsigned long* pfn_type, int pae_extended_cr3,
                        struct xc_mmu* mmu,
@@ -1331,8 +1672,8 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
         /* In verify mode, we use a copy; otherwise we work in place */
         page = pagebuf->verify ? (void *)buf : (region_base + i*PAGE_SIZE);
 
-        /* Remus - page decompression */
-        if (pagebuf->compressing)
+        /* Remus - page decompression, or a delta compressed batch */
+        if (pagebuf->compressing || pagebuf->delta)
         {
             if (xc_compression_uncompress_page(xch, pagebuf->pages,
                                                pagebuf->compbuf_size,
@@ -1481,6 +1822,7 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     pagebuf_t pagebuf;
     tailbuf_t tailbuf, tmptail;
     struct toolstack_data_t tdata, tdatatmp;
+    struct v4v_rings_data_t v4v, v4vtmp;
     void* vcpup;
     uint64_t console_pfn = 0;
 
@@ -1496,6 +1838,7 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     memset(&tailbuf, 0, sizeof(tailbuf));
     tailbuf.ishvm = hvm;
     memset(&tdata, 0, sizeof(tdata));
+    memset(&v4v, 0, sizeof(v4v));
 
     memset(ctx, 0, sizeof(*ctx));
 
@@ -1517,6 +1860,8 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
         goto out;
     }
 
+    readahead_start(xch, ctx, io_fd);
+
     if ( RDEXACT(io_fd, &dinfo->p2m_size, sizeof(unsigned long)) )
     {
         PERROR("read: p2m_size");
@@ -1628,6 +1973,7 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
         if ( !ctx->completed ) {
             pagebuf.nr_physpages = pagebuf.nr_pages = 0;
             pagebuf.compbuf_pos = pagebuf.compbuf_size = 0;
+            pagebuf.delta = 0;
             if ( pagebuf_get_one(xch, ctx, &pagebuf, io_fd, dom) < 0 ) {
                 PERROR("Error when reading batch");
                 goto out;
@@ -1715,6 +2061,7 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
             goto out;
         }
 
+        readahead_stop(ctx->ra);
         ctx->completed = 1;
 
         /*
@@ -1773,6 +2120,10 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     tdata = pagebuf.tdata;
     pagebuf.tdata = tdatatmp;
 
+    v4vtmp = v4v;
+    v4v = pagebuf.v4v;
+    pagebuf.v4v = v4vtmp;
+
     if ( ctx->last_checkpoint )
     {
         // DPRINTF("Last checkpoint, finishing\n");
@@ -2255,6 +2606,9 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
         goto out;
     }
 
+    if ( restore_v4v_rings(xch, dom, ctx, &v4v) )
+        goto out;
+
     DPRINTF("Domain ready to be built.\n");
     rc = 0;
     goto out;
@@ -2341,6 +2695,9 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
         goto out;
     }
 
+    if ( restore_v4v_rings(xch, dom, ctx, &v4v) )
+        goto out;
+
     /* HVM success! */
     rc = 0;
 
@@ -2355,6 +2712,8 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     free(ctx->p2m_batch);
     pagebuf_free(&pagebuf);
     tailbuf_free(&tailbuf);
+    v4v_rings_data_free(&v4v);
+    readahead_free(ctx);
 
     /* discard cache for save file  */
     discard_file_cache(xch, io_fd, 1 /*flush*/);
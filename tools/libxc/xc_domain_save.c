@@ -25,7 +25,11 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include "xc_private.h"
 #include "xc_bitops.h"
@@ -59,12 +63,23 @@ struct save_ctx {
 struct outbuf {
     void* buf;
     size_t size;
+    size_t max;             /* may grow up to this rather than be flushed */
     size_t pos;
     int write_count;
 };
 
 #define OUTBUF_SIZE (16384 * 1024)
 
+/*
+ * The checkpoints of a suspended domain are copied into the output
+ * buffer, which grows to hold all of one, rather than written out while
+ * the domain waits: they are sent once it has been resumed.
+ */
+#define OUTBUF_CHECKPOINT_MAX (1024UL << 20)
+
+/* A delta compressed batch, no page takes more than a page and 9 bytes */
+#define DELTA_BUF_SIZE (MAX_BATCH_SIZE * (PAGE_SIZE + 16))
+
 /* grep fodder: machine_to_phys */
 
 #define mfn_to_pfn(_mfn)  (ctx->live_m2p[(_mfn)])
@@ -135,6 +150,27 @@ static int outbuf_init(xc_interface *xch, struct outbuf* ob, size_t size)
         return -1;
     }
 
+    ob->size = size;
+    ob->max = size;
+
+    return 0;
+}
+
+static int outbuf_grow(struct outbuf *ob, size_t len)
+{
+    size_t size = ob->size;
+    void *buf;
+
+    while ( size < ob->max && size - ob->pos < len )
+        size *= 2;
+    if ( size > ob->max )
+        size = ob->max;
+    if ( size - ob->pos < len )
+        return -1;
+
+    if ( !(buf = realloc(ob->buf, size)) )
+        return -1;
+    ob->buf = buf;
     ob->size = size;
 
     return 0;
@@ -199,6 +235,9 @@ static inline int outbuf_hardwrite(xc_interface *xch,
     if ( !outbuf_write(xch, ob, buf, len) )
         return 0;
 
+    if ( len > ob->size - ob->pos && !outbuf_grow(ob, len) )
+        return outbuf_write(xch, ob, buf, len);
+
     if ( outbuf_flush(xch, ob, fd) < 0 )
         return -1;
 
@@ -277,6 +316,281 @@ static int write_compressed(xc_interface *xch, comp_ctx *compress_ctx,
     return 0;
 }
 
+/*
+ * Pipelined write out of the pages: while a batch is written to the
+ * stream, by a writer thread which also unmaps it afterwards, the next
+ * ones are picked and mapped.  Batches are written in the order they
+ * were queued in, the stream is the same as without the pipeline.
+ *
+ * The pipeline is only used for the rounds before the last one, which
+ * goes through the output buffer; it must be drained before anything
+ * else is written to the stream.
+ */
+#define SAVE_PIPE_DEPTH 4
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+struct save_job {
+    struct save_job *next;
+    /* The mapped batch, unmapped once written */
+    void *region;
+    size_t region_len;
+    /* What to write: the batch header, then runs of pages */
+    struct iovec iov[MAX_BATCH_SIZE + 2];
+    unsigned int niov;
+    size_t len;
+    /* Copies of what doesn't stay put until written */
+    char hdr[sizeof(unsigned int) + MAX_BATCH_SIZE * sizeof(unsigned long)];
+    size_t hdr_used;
+    char *pages;
+    unsigned int pages_used;
+};
+
+struct save_pipe {
+    xc_interface *xch;
+    int fd;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct save_job jobs[SAVE_PIPE_DEPTH];
+    struct save_job *free, *queue, **queue_tail;
+    /* jobs queued or being written */
+    unsigned int pending;
+    /* errno of the first failed write, nothing is written after it */
+    int error;
+    int quit;
+    size_t write_count;
+};
+
+static int save_job_write(struct save_pipe *pipe, struct save_job *job)
+{
+    unsigned int i = 0, n;
+    ssize_t rc;
+
+    while ( i < job->niov )
+    {
+        n = job->niov - i;
+        if ( n > IOV_MAX )
+            n = IOV_MAX;
+
+        rc = writev(pipe->fd, &job->iov[i], n);
+        if ( rc < 0 )
+        {
+            if ( errno == EINTR || errno == EAGAIN )
+                continue;
+            return -1;
+        }
+
+        /* Skip what was written, which may end in the middle of an iov. */
+        for ( ; i < job->niov && (size_t)rc >= job->iov[i].iov_len; i++ )
+            rc -= job->iov[i].iov_len;
+        if ( rc )
+        {
+            job->iov[i].iov_base = (char *)job->iov[i].iov_base + rc;
+            job->iov[i].iov_len -= rc;
+        }
+    }
+
+    pipe->write_count += job->len;
+    if ( pipe->write_count >= (MAX_PAGECACHE_USAGE * PAGE_SIZE) )
+    {
+        /* Time to discard cache - dont care if this fails */
+        discard_file_cache(pipe->xch, pipe->fd, 0 /* no flush */);
+        pipe->write_count = 0;
+    }
+
+    return 0;
+}
+
+static void *save_pipe_writer(void *arg)
+{
+    struct save_pipe *pipe = arg;
+    struct save_job *job;
+    int error;
+
+    pthread_mutex_lock(&pipe->lock);
+    for ( ; ; )
+    {
+        while ( !pipe->queue && !pipe->quit )
+            pthread_cond_wait(&pipe->cond, &pipe->lock);
+        if ( !pipe->queue )
+            break;
+
+        job = pipe->queue;
+        pipe->queue = job->next;
+        if ( !pipe->queue )
+            pipe->queue_tail = &pipe->queue;
+        error = pipe->error;
+        pthread_mutex_unlock(&pipe->lock);
+
+        if ( !error && save_job_write(pipe, job) )
+            error = errno;
+        munmap(job->region, job->region_len);
+
+        pthread_mutex_lock(&pipe->lock);
+        if ( error && !pipe->error )
+            pipe->error = error;
+        job->next = pipe->free;
+        pipe->free = job;
+        pipe->pending--;
+        pthread_cond_broadcast(&pipe->cond);
+    }
+    pthread_mutex_unlock(&pipe->lock);
+
+    return NULL;
+}
+
+/* NULL if the writer can't be started: the pages are then written inline */
+static struct save_pipe *save_pipe_create(xc_interface *xch, int fd)
+{
+    struct save_pipe *pipe = calloc(1, sizeof(*pipe));
+    unsigned int i;
+
+    if ( !pipe )
+        return NULL;
+
+    pipe->xch = xch;
+    pipe->fd = fd;
+    pipe->queue_tail = &pipe->queue;
+    for ( i = 0; i < SAVE_PIPE_DEPTH; i++ )
+    {
+        pipe->jobs[i].next = pipe->free;
+        pipe->free = &pipe->jobs[i];
+    }
+
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->cond, NULL);
+    if ( pthread_create(&pipe->writer, NULL, save_pipe_writer, pipe) )
+    {
+        DPRINTF("no writer thread, saving without a pipeline\n");
+        pthread_cond_destroy(&pipe->cond);
+        pthread_mutex_destroy(&pipe->lock);
+        free(pipe);
+        return NULL;
+    }
+
+    return pipe;
+}
+
+/* A job to fill in for the next batch, once one was written out */
+static struct save_job *save_pipe_get(struct save_pipe *pipe)
+{
+    struct save_job *job;
+
+    pthread_mutex_lock(&pipe->lock);
+    while ( !pipe->free )
+        pthread_cond_wait(&pipe->cond, &pipe->lock);
+    job = pipe->free;
+    pipe->free = job->next;
+    pthread_mutex_unlock(&pipe->lock);
+
+    job->next = NULL;
+    job->niov = 0;
+    job->len = 0;
+    job->hdr_used = 0;
+    job->pages_used = 0;
+
+    return job;
+}
+
+/*
+ * Queue len bytes at buf for writing.  The mapped batch stays put until
+ * written, anything else is copied to the job first: the batch header
+ * to hdr, a canonicalised pagetable to pages.
+ */
+#define SAVE_JOB_MAPPED 0
+#define SAVE_JOB_HDR    1
+#define SAVE_JOB_PAGE   2
+
+static int save_job_add(struct save_job *job, void *buf, size_t len,
+                        int copy)
+{
+    if ( copy == SAVE_JOB_PAGE )
+    {
+        if ( !job->pages &&
+             !(job->pages = malloc(MAX_BATCH_SIZE * PAGE_SIZE)) )
+            return -1;
+        memcpy(job->pages + job->pages_used * PAGE_SIZE, buf, PAGE_SIZE);
+        buf = job->pages + job->pages_used++ * PAGE_SIZE;
+    }
+    else if ( copy == SAVE_JOB_HDR )
+    {
+        if ( len > sizeof(job->hdr) - job->hdr_used )
+        {
+            errno = ERANGE;
+            return -1;
+        }
+        memcpy(job->hdr + job->hdr_used, buf, len);
+        buf = job->hdr + job->hdr_used;
+        job->hdr_used += len;
+    }
+
+    job->iov[job->niov].iov_base = buf;
+    job->iov[job->niov].iov_len = len;
+    job->niov++;
+    job->len += len;
+
+    return 0;
+}
+
+/* Hand the job and the batch it maps over to the writer. */
+static int save_pipe_put(struct save_pipe *pipe, struct save_job *job,
+                         void *region, size_t region_len)
+{
+    int error;
+
+    job->region = region;
+    job->region_len = region_len;
+
+    pthread_mutex_lock(&pipe->lock);
+    *pipe->queue_tail = job;
+    pipe->queue_tail = &job->next;
+    pipe->pending++;
+    error = pipe->error;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+
+    errno = error;
+    return error ? -1 : 0;
+}
+
+/* Wait for everything queued to be written. */
+static int save_pipe_drain(struct save_pipe *pipe)
+{
+    int error;
+
+    pthread_mutex_lock(&pipe->lock);
+    while ( pipe->pending )
+        pthread_cond_wait(&pipe->cond, &pipe->lock);
+    error = pipe->error;
+    pthread_mutex_unlock(&pipe->lock);
+
+    errno = error;
+    return error ? -1 : 0;
+}
+
+static void save_pipe_destroy(struct save_pipe *pipe)
+{
+    unsigned int i;
+
+    if ( !pipe )
+        return;
+
+    pthread_mutex_lock(&pipe->lock);
+    pipe->quit = 1;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+    pthread_join(pipe->writer, NULL);
+
+    for ( i = 0; i < SAVE_PIPE_DEPTH; i++ )
+        free(pipe->jobs[i].pages);
+    pthread_cond_destroy(&pipe->cond);
+    pthread_mutex_destroy(&pipe->lock);
+    free(pipe);
+}
+
 struct time_stats {
     struct timeval wall;
     long long d0_cpu, d1_cpu;
@@ -357,6 +671,53 @@ static int analysis_phase(xc_interface *xch, uint32_t domid, struct save_ctx *ct
     return -1;
 }
 
+#define DIRTY_EXTENTS_BATCH 256
+
+/*
+ * XEN_DOMCTL_SHADOW_OP_CLEAN into to_send, from the runs of dirty pages
+ * rather than a copy of the whole bitmap, which for a large guest is
+ * mostly zeroes.  Falls back to the copy with a hypervisor without
+ * XEN_DOMCTL_log_dirty_extents.
+ */
+static int clean_dirty_bitmap(xc_interface *xch, uint32_t dom,
+                              struct save_ctx *ctx,
+                              xc_hypercall_buffer_t *to_send_buf,
+                              xc_shadow_op_stats_t *stats)
+{
+    struct domain_info_context *dinfo = &ctx->dinfo;
+    unsigned long *to_send = to_send_buf->hbuf;
+    xc_dirty_extent_t ext[DIRTY_EXTENTS_BATCH];
+    uint64_t pfn = 0, n, end;
+    unsigned int i, nr;
+
+    bitmap_clear(to_send, dinfo->p2m_size);
+
+    do {
+        nr = DIRTY_EXTENTS_BATCH;
+        if ( xc_domain_log_dirty_extents(xch, dom, XEN_DOMCTL_LOG_DIRTY_CLEAN,
+                                         &pfn, ext, &nr, stats) )
+        {
+            if ( pfn == 0 && errno == ENOSYS )
+                return (xc_shadow_control(xch, dom, XEN_DOMCTL_SHADOW_OP_CLEAN,
+                                          to_send_buf, dinfo->p2m_size,
+                                          NULL, 0, stats) ==
+                        dinfo->p2m_size) ? 0 : -1;
+            return -1;
+        }
+
+        for ( i = 0; i < nr; i++ )
+        {
+            end = ext[i].first_pfn + ext[i].nr_pfns;
+            if ( end > dinfo->p2m_size )
+                end = dinfo->p2m_size;
+            for ( n = ext[i].first_pfn; n < end; n++ )
+                set_bit(n, to_send);
+        }
+    } while ( pfn != XEN_DOMCTL_LOG_DIRTY_END );
+
+    return 0;
+}
+
 static int suspend_and_state(int (*suspend)(void*), void* data,
                              xc_interface *xch, int io_fd, int dom,
                              xc_dominfo_t *info)
@@ -800,6 +1161,59 @@ static int save_tsc_info(xc_interface *xch, uint32_t dom, int io_fd)
     return 0;
 }
 
+/*
+ * must be done AFTER suspend_and_state(), stops the domain's v4v rings
+ * and marks their pages dirty so that the last pass sends them. *frozen
+ * is set once the rings may need a thaw if the save does not complete.
+ */
+static int save_v4v_rings(xc_interface *xch, uint32_t dom, int io_fd,
+                          struct save_ctx *ctx, int hvm, int *frozen)
+{
+    struct domain_info_context *dinfo = &ctx->dinfo;
+    int marker = XC_SAVE_ID_V4V_RINGS;
+    xen_domctl_v4v_ring_t *rings;
+    uint32_t nr_rings, nr_pfns, i;
+    uint64_t *pfns;
+    int rc = -1;
+
+    if ( xc_v4v_rings_save(xch, dom, &rings, &nr_rings, &pfns, &nr_pfns) )
+    {
+        /* Xen without v4v, or a domain which never used it */
+        if ( errno == ENODEV || errno == ENOSYS )
+            return 0;
+        PERROR("Error when stopping the v4v rings");
+        return -1;
+    }
+    *frozen = 1;
+
+    if ( !nr_rings )
+        return 0;
+
+    /* A PV guest gives its rings as mfns, which won't mean a thing there */
+    for ( i = 0; !hvm && i < nr_pfns; i++ )
+    {
+        if ( !MFN_IS_IN_PSEUDOPHYS_MAP(pfns[i]) )
+        {
+            ERROR("v4v ring frame %"PRIx64" is not in the p2m", pfns[i]);
+            goto out;
+        }
+        pfns[i] = mfn_to_pfn(pfns[i]);
+    }
+
+    if ( write_exact(io_fd, &marker, sizeof(marker)) ||
+         write_exact(io_fd, &nr_rings, sizeof(nr_rings)) ||
+         write_exact(io_fd, &nr_pfns, sizeof(nr_pfns)) ||
+         write_exact(io_fd, rings, nr_rings * sizeof(*rings)) ||
+         write_exact(io_fd, pfns, nr_pfns * sizeof(*pfns)) )
+        goto out;
+
+    rc = 0;
+ out:
+    free(rings);
+    free(pfns);
+    return rc;
+}
+
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iters,
                    uint32_t max_factor, uint32_t flags,
                    struct save_callbacks* callbacks, int hvm)
@@ -814,6 +1228,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     int race = 0, sent_last_iter, skip_this_iter = 0;
     unsigned int sent_this_iter = 0;
     int tmem_saved = 0;
+    int v4v_frozen = 0;
 
     /* The new domain's shared-info frame number. */
     unsigned long shared_info_frame;
@@ -835,6 +1250,10 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     /* base of the region in which domain memory is mapped */
     unsigned char *region_base = NULL;
 
+    /* Writer of the batches of the live rounds, and the batch to write */
+    struct save_pipe *pipe = NULL;
+    struct save_job *job = NULL;
+
     /* A copy of the CPU eXtended States of the guest. */
     DECLARE_HYPERCALL_BUFFER(void, buffer);
 
@@ -892,6 +1311,11 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
      */
     int compressing = 0;
 
+    /* Delta compression of the live rounds, and the batch compressed */
+    comp_ctx *delta_ctx = NULL;
+    char *delta_buf = NULL;
+    comp_ctx *batch_ctx;
+
     int completed = 0;
 
     DPRINTF("%s: starting save of domid %u", __func__, dom);
@@ -904,6 +1328,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     }
 
     outbuf_init(xch, &ob_pagebuf, OUTBUF_SIZE);
+    if ( callbacks->checkpoint )
+        ob_pagebuf.max = OUTBUF_CHECKPOINT_MAX;
 
     memset(ctx, 0, sizeof(*ctx));
 
@@ -1002,6 +1428,23 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         outbuf_init(xch, &ob_tailbuf, OUTBUF_SIZE/4);
     }
 
+    if ( live && (flags & XCFLAGS_LIVE_COMPRESS) )
+    {
+        unsigned long cache_size = XCFLAGS_DELTA_CACHE(flags) ?
+            XCFLAGS_DELTA_CACHE(flags) * (16UL << 20) : (32UL << 20);
+
+        delta_ctx = xc_compression_create_context_size(xch, dinfo->p2m_size,
+                                                       cache_size);
+        delta_buf = malloc(DELTA_BUF_SIZE);
+        if ( !delta_ctx || !delta_buf )
+        {
+            ERROR("Failed to create delta compression context");
+            goto out;
+        }
+        DPRINTF("Delta compressing the live rounds, %lu MB cache\n",
+                cache_size >> 20);
+    }
+
     last_iter = !live;
 
     /* pretend we sent all the pages last iteration */
@@ -1111,10 +1554,26 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         goto out;
     }
 
+    if ( !live && save_v4v_rings(xch, dom, io_fd, ctx, hvm, &v4v_frozen) < 0 )
+    {
+        PERROR("Error when writing to state file (v4v)");
+        goto out;
+    }
+
+    if ( live )
+        pipe = save_pipe_create(xch, io_fd);
+
   copypages:
 #define wrexact(fd, buf, len) write_buffer(xch, last_iter, ob, (fd), (buf), (len))
 #define wruncached(fd, live, buf, len) write_uncached(xch, last_iter, ob, (fd), (buf), (len))
 #define wrcompressed(fd) write_compressed(xch, compress_ctx, last_iter, ob, (fd))
+/* Through the pipeline, when the batch goes through it */
+#define wrbatch(fd, buf, len)                                           \
+    (job ? save_job_add(job, (buf), (len), SAVE_JOB_HDR)                \
+         : wrexact((fd), (buf), (len)))
+#define wrpages(fd, live, buf, len, copy)                               \
+    (job ? (save_job_add(job, (buf), (len), (copy)) ? -1 : (int)(len))  \
+         : wruncached((fd), (live), (buf), (len)))
 
     ob = &ob_pagebuf; /* Holds pfn_types, pages/compressed pages */
     /* Now write out each data page, canonicalising page tables as we go... */
@@ -1334,7 +1793,34 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                 continue; /* bail on this batch: no valid pages */
             }
 
-            if ( wrexact(io_fd, &batch, sizeof(unsigned int)) )
+            /*
+             * Only the live rounds are delta compressed, the pages of the
+             * checkpoints are compressed with the ones they were sent with.
+             */
+            batch_ctx = compressing ? compress_ctx :
+                        !last_iter ? delta_ctx : NULL;
+
+            /*
+             * The last round goes through ob, and compression keeps the
+             * pages until the checkpoint is complete: only the live
+             * rounds are pipelined.  A delta compressed batch is written
+             * out from delta_buf, which the next batch reuses.
+             */
+            job = (pipe && !last_iter && !batch_ctx) ? save_pipe_get(pipe)
+                                                     : NULL;
+
+            if ( batch_ctx && batch_ctx == delta_ctx )
+            {
+                int marker = XC_SAVE_ID_DELTA_PAGES;
+
+                if ( wrexact(io_fd, &marker, sizeof(marker)) )
+                {
+                    PERROR("Error when writing delta marker");
+                    goto out;
+                }
+            }
+
+            if ( wrbatch(io_fd, &batch, sizeof(unsigned int)) )
             {
                 PERROR("Error when writing to state file (2)");
                 goto out;
@@ -1343,7 +1829,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
             if ( sizeof(unsigned long) < sizeof(*pfn_type) )
                 for ( j = 0; j < batch; j++ )
                     ((unsigned long *)pfn_type)[j] = pfn_type[j];
-            if ( wrexact(io_fd, pfn_type, sizeof(unsigned long)*batch) )
+            if ( wrbatch(io_fd, pfn_type, sizeof(unsigned long)*batch) )
             {
                 PERROR("Error when writing to state file (3)");
                 goto out;
@@ -1366,11 +1852,12 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                 {
                     /* If the page is not a normal data page, write out any
                        run of pages we may have previously acumulated */
-                    if ( !compressing && run )
+                    if ( !batch_ctx && run )
                     {
-                        if ( wruncached(io_fd, live,
-                                       (char*)region_base+(PAGE_SIZE*(j-run)), 
-                                       PAGE_SIZE*run) != PAGE_SIZE*run )
+                        if ( wrpages(io_fd, live,
+                                     (char*)region_base+(PAGE_SIZE*(j-run)),
+                                     PAGE_SIZE*run, SAVE_JOB_MAPPED) !=
+                             PAGE_SIZE*run )
                         {
                             PERROR("Error when writing to state file (4a)"
                                   " (errno %d)", errno);
@@ -1405,11 +1892,11 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                         goto out;
                     }
 
-                    if (compressing)
+                    if (batch_ctx)
                     {
                         int c_err;
                         /* Mark pagetable page to be sent uncompressed */
-                        c_err = xc_compression_add_page(xch, compress_ctx, page,
+                        c_err = xc_compression_add_page(xch, batch_ctx, page,
                                                         pfn, 1 /* raw page */);
                         if (c_err == -2) /* OOB PFN */
                         {
@@ -1438,8 +1925,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                             }
                         }
                     }
-                    else if ( wruncached(io_fd, live, page,
-                                         PAGE_SIZE) != PAGE_SIZE )
+                    else if ( wrpages(io_fd, live, page, PAGE_SIZE,
+                                      SAVE_JOB_PAGE) != PAGE_SIZE )
                     {
                         PERROR("Error when writing to state file (4b)"
                               " (errno %d)", errno);
@@ -1449,13 +1936,13 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                 else
                 {
                     /* We have a normal page: accumulate it for writing. */
-                    if (compressing)
+                    if (batch_ctx)
                     {
                         int c_err;
                         /* For checkpoint compression, accumulate the page in the
                          * page buffer, to be compressed later.
                          */
-                        c_err = xc_compression_add_page(xch, compress_ctx, spage,
+                        c_err = xc_compression_add_page(xch, batch_ctx, spage,
                                                         pfn, 0 /* not raw page */);
 
                         if (c_err == -2) /* OOB PFN */
@@ -1483,9 +1970,9 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
             if ( run )
             {
                 /* write out the last accumulated run of pages */
-                if ( wruncached(io_fd, live,
-                               (char*)region_base+(PAGE_SIZE*(j-run)), 
-                               PAGE_SIZE*run) != PAGE_SIZE*run )
+                if ( wrpages(io_fd, live,
+                             (char*)region_base+(PAGE_SIZE*(j-run)),
+                             PAGE_SIZE*run, SAVE_JOB_MAPPED) != PAGE_SIZE*run )
                 {
                     PERROR("Error when writing to state file (4c)"
                           " (errno %d)", errno);
@@ -1493,14 +1980,59 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                 }                        
             }
 
+            /*
+             * The batch fits in the page buffer of the context, delta_buf
+             * has room for all of it to be sent full pages.
+             */
+            if ( batch_ctx && batch_ctx == delta_ctx )
+            {
+                unsigned long delta_len = 0;
+                int marker = XC_SAVE_ID_COMPRESSED_DATA, c_err;
+
+                c_err = xc_compression_compress_pages(xch, delta_ctx,
+                                                      delta_buf,
+                                                      DELTA_BUF_SIZE,
+                                                      &delta_len);
+                xc_compression_reset_pagebuf(xch, delta_ctx);
+                if ( c_err < 0 )
+                {
+                    ERROR("Error when delta compressing batch");
+                    goto out;
+                }
+
+                if ( c_err > 0 &&
+                     (wrexact(io_fd, &marker, sizeof(marker)) ||
+                      wrexact(io_fd, &delta_len, sizeof(delta_len)) ||
+                      wruncached(io_fd, live, delta_buf, delta_len) !=
+                      delta_len) )
+                {
+                    PERROR("Error when writing to state file (4e)"
+                           " (errno %d)", errno);
+                    goto out;
+                }
+            }
+
             sent_this_iter += batch;
 
-            munmap(region_base, batch*PAGE_SIZE);
+            if ( !job )
+                munmap(region_base, batch*PAGE_SIZE);
+            else if ( save_pipe_put(pipe, job, region_base,
+                                    batch*PAGE_SIZE) )
+            {
+                PERROR("Error when writing to state file (4d)");
+                goto out;
+            }
 
         } /* end of this while loop for this iteration */
 
       skip:
 
+        if ( pipe && save_pipe_drain(pipe) )
+        {
+            PERROR("Error when writing to state file (4d)");
+            goto out;
+        }
+
         xc_report_progress_step(xch, dinfo->p2m_size, dinfo->p2m_size);
 
         total_sent += sent_this_iter;
@@ -1564,12 +2096,18 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                     goto out;
                 }
 
+                if ( save_v4v_rings(xch, dom, io_fd, ctx, hvm,
+                                    &v4v_frozen) < 0 )
+                {
+                    PERROR("Error when writing to state file (v4v)");
+                    goto out;
+                }
+
 
             }
 
-            if ( xc_shadow_control(xch, dom,
-                                   XEN_DOMCTL_SHADOW_OP_CLEAN, HYPERCALL_BUFFER(to_send),
-                                   dinfo->p2m_size, NULL, 0, &shadow_stats) != dinfo->p2m_size )
+            if ( clean_dirty_bitmap(xch, dom, ctx, HYPERCALL_BUFFER(to_send),
+                                    &shadow_stats) )
             {
                 PERROR("Error flushing shadow PT");
                 goto out;
@@ -2078,6 +2616,17 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
  out_rc:
     completed = 1;
 
+    /* Nothing else may be written while batches still are */
+    if ( pipe && save_pipe_drain(pipe) && !rc )
+        rc = errno;
+
+    /* The domain keeps running if the save failed or it is checkpointed */
+    if ( v4v_frozen && (rc || callbacks->checkpoint) )
+    {
+        xc_v4v_rings_thaw(xch, dom);
+        v4v_frozen = 0;
+    }
+
     if ( !rc && callbacks->postcopy )
         callbacks->postcopy(callbacks->data);
 
@@ -2129,9 +2678,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         DPRINTF("SUSPEND shinfo %08lx\n", info.shared_info_frame);
         print_stats(xch, dom, 0, &time_stats, &shadow_stats, 1);
 
-        if ( xc_shadow_control(xch, dom,
-                               XEN_DOMCTL_SHADOW_OP_CLEAN, HYPERCALL_BUFFER(to_send),
-                               dinfo->p2m_size, NULL, 0, &shadow_stats) != dinfo->p2m_size )
+        if ( clean_dirty_bitmap(xch, dom, ctx, HYPERCALL_BUFFER(to_send),
+                                &shadow_stats) )
         {
             PERROR("Error flushing shadow PT");
         }
@@ -2154,6 +2702,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
     if (compress_ctx)
         xc_compression_free_context(xch, compress_ctx);
+    xc_compression_free_context(xch, delta_ctx);
+    free(delta_buf);
 
     if ( live_shinfo )
         munmap(live_shinfo, PAGE_SIZE);
@@ -2167,6 +2717,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     xc_hypercall_buffer_free_pages(xch, to_send, NRPAGES(bitmap_size(dinfo->p2m_size)));
     xc_hypercall_buffer_free_pages(xch, to_skip, NRPAGES(bitmap_size(dinfo->p2m_size)));
 
+    save_pipe_destroy(pipe);
+
     free(pfn_type);
     free(pfn_batch);
     free(pfn_err);
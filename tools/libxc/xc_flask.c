@@ -395,6 +395,45 @@ int xc_flask_avc_cachestats(xc_interface *xch, char *buf, int size)
     return 0;
 }
 
+int xc_flask_avc_histogram(xc_interface *xch, char *buf, int size)
+{
+    static const char *const names[] = { "hit", "miss", "reclaim" };
+    int err, n;
+    int i = 0, t;
+    DECLARE_FLASK_OP;
+
+    n = snprintf(buf, size, "cpu type 0 1 2-3 4-7 8+\n");
+    buf += n;
+    size -= n;
+
+    op.cmd = FLASK_AVC_HISTOGRAM;
+    while ( size > 0 )
+    {
+        for ( t = FLASK_AVC_HIST_HIT; t <= FLASK_AVC_HIST_RECLAIM && size > 0;
+              t++ )
+        {
+            op.u.avc_histogram.cpu = i;
+            op.u.avc_histogram.type = t;
+            err = xc_flask_op(xch, &op);
+            if ( err && errno == ENOENT )
+                return 0;
+            if ( err )
+                return err;
+            n = snprintf(buf, size, "%d %s %u %u %u %u %u\n", i, names[t],
+                         op.u.avc_histogram.buckets[0],
+                         op.u.avc_histogram.buckets[1],
+                         op.u.avc_histogram.buckets[2],
+                         op.u.avc_histogram.buckets[3],
+                         op.u.avc_histogram.buckets[4]);
+            buf += n;
+            size -= n;
+        }
+        i++;
+    }
+
+    return 0;
+}
+
 int xc_flask_policyvers(xc_interface *xch)
 {
     DECLARE_FLASK_OP;
@@ -18,6 +18,7 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <limits.h>
 #include "xc_private.h"
 
 void *xc_map_foreign_pages(xc_interface *xch, uint32_t dom, int prot,
@@ -80,6 +81,40 @@ void *xc_map_foreign_bulk(xc_interface *xch, uint32_t dom, int prot,
                                                 dom, prot, arr, err, num);
 }
 
+void *xc_map_foreign_scatter(xc_interface *xch, uint32_t dom, int prot,
+                             const xc_gfn_range_t *ranges, unsigned int nr_ranges,
+                             int *err)
+{
+    xen_pfn_t *arr;
+    unsigned int i, j, num = 0;
+    void *res;
+
+    for (i = 0; i < nr_ranges; i++) {
+        if (ranges[i].nr > UINT_MAX / 2 - num) {
+            errno = EINVAL;
+            return NULL;
+        }
+        num += ranges[i].nr;
+    }
+    if (num == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    arr = malloc(num * sizeof(*arr));
+    if (!arr)
+        return NULL;
+
+    for (i = 0, num = 0; i < nr_ranges; i++)
+        for (j = 0; j < ranges[i].nr; j++)
+            arr[num++] = ranges[i].gfn + j;
+
+    res = xc_map_foreign_bulk(xch, dom, prot, arr, err, num);
+
+    free(arr);
+    return res;
+}
+
 /* stub for all not yet converted OSes */
 void *xc_map_foreign_bulk_compat(xc_interface *xch, xc_osdep_handle h,
                                  uint32_t dom, int prot,
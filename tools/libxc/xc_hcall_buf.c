@@ -31,6 +31,21 @@ xc_hypercall_buffer_t XC__HYPERCALL_BUFFER_NAME(HYPERCALL_BUFFER_NULL) = {
 
 pthread_mutex_t hypercall_buffer_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+ * Each thread keeps a few buffers of each order for itself, so that the
+ * common cases take neither the lock nor an mmap/mlock. The pools are
+ * also on a list in the xc_interface, for xc_interface_close() to free
+ * those of threads that are still running.
+ */
+#define HYPERCALL_BUFFER_POOL_SIZE 2
+
+struct xc_hypercall_buffer_pool {
+    xc_interface *xch;
+    struct xc_hypercall_buffer_pool *next;
+    int nr[HYPERCALL_BUFFER_CACHE_ORDERS];
+    void *bufs[HYPERCALL_BUFFER_CACHE_ORDERS][HYPERCALL_BUFFER_POOL_SIZE];
+};
+
 static void hypercall_buffer_cache_lock(xc_interface *xch)
 {
     if ( xch->flags & XC_OPENFLAG_NON_REENTRANT )
@@ -45,29 +60,147 @@ static void hypercall_buffer_cache_unlock(xc_interface *xch)
     pthread_mutex_unlock(&hypercall_buffer_cache_mutex);
 }
 
+/* The smallest order of pages holding nr_pages */
+static int hypercall_buffer_order(int nr_pages)
+{
+    int order = 0;
+
+    while ( (1 << order) < nr_pages )
+        order++;
+    return order;
+}
+
+/* What to allocate for nr_pages: a whole cacheable order, if it is one */
+static int hypercall_buffer_alloc_nr(int nr_pages)
+{
+    int order = hypercall_buffer_order(nr_pages);
+
+    return order > HYPERCALL_BUFFER_CACHE_MAX_ORDER ? nr_pages : 1 << order;
+}
+
+/* Return the buffers of a pool, to the shared cache where there is room */
+static void hypercall_buffer_pool_drain(xc_interface *xch,
+                                        struct xc_hypercall_buffer_pool *pool)
+{
+    int order;
+    void *p;
+
+    for ( order = 0; order < HYPERCALL_BUFFER_CACHE_ORDERS; order++ )
+    {
+        while ( pool->nr[order] > 0 )
+        {
+            p = pool->bufs[order][--pool->nr[order]];
+            if ( xch->hypercall_buffer_cache_nr[order] < HYPERCALL_BUFFER_CACHE_SIZE )
+                xch->hypercall_buffer_cache[order][xch->hypercall_buffer_cache_nr[order]++] = p;
+            else
+                xch->ops->u.privcmd.free_hypercall_buffer(xch, xch->ops_handle,
+                                                          p, 1 << order);
+        }
+    }
+}
+
+/* pthread key destructor: the thread is exiting */
+static void hypercall_buffer_pool_destroy(void *arg)
+{
+    struct xc_hypercall_buffer_pool *pool = arg, **pp;
+    xc_interface *xch = pool->xch;
+
+    hypercall_buffer_cache_lock(xch);
+
+    for ( pp = &xch->hypercall_buffer_pools; *pp; pp = &(*pp)->next )
+    {
+        if ( *pp == pool )
+        {
+            *pp = pool->next;
+            break;
+        }
+    }
+    hypercall_buffer_pool_drain(xch, pool);
+
+    hypercall_buffer_cache_unlock(xch);
+
+    free(pool);
+}
+
+/* The calling thread's pool, set up if create and there is none yet */
+static struct xc_hypercall_buffer_pool *hypercall_buffer_pool(xc_interface *xch,
+                                                              int create)
+{
+    struct xc_hypercall_buffer_pool *pool;
+
+    if ( !xch->hypercall_buffer_pool_key_valid )
+        return NULL;
+
+    pool = pthread_getspecific(xch->hypercall_buffer_pool_key);
+    if ( pool || !create )
+        return pool;
+
+    pool = calloc(1, sizeof(*pool));
+    if ( pool == NULL )
+        return NULL;
+    pool->xch = xch;
+    if ( pthread_setspecific(xch->hypercall_buffer_pool_key, pool) )
+    {
+        free(pool);
+        return NULL;
+    }
+
+    hypercall_buffer_cache_lock(xch);
+    pool->next = xch->hypercall_buffer_pools;
+    xch->hypercall_buffer_pools = pool;
+    hypercall_buffer_cache_unlock(xch);
+
+    return pool;
+}
+
+void xc__hypercall_buffer_cache_init(xc_interface *xch)
+{
+    /* A single thread has nothing to gain from pools over the cache. */
+    if ( xch->flags & XC_OPENFLAG_NON_REENTRANT )
+        return;
+
+    if ( pthread_key_create(&xch->hypercall_buffer_pool_key,
+                            hypercall_buffer_pool_destroy) == 0 )
+        xch->hypercall_buffer_pool_key_valid = 1;
+}
+
 static void *hypercall_buffer_cache_alloc(xc_interface *xch, int nr_pages)
 {
+    struct xc_hypercall_buffer_pool *pool;
+    int order = hypercall_buffer_order(nr_pages);
+    int current, maximum;
     void *p = NULL;
 
-    hypercall_buffer_cache_lock(xch);
+    __sync_fetch_and_add(&xch->hypercall_buffer_total_allocations, 1);
+    current = __sync_add_and_fetch(&xch->hypercall_buffer_current_allocations, 1);
+    while ( (maximum = xch->hypercall_buffer_maximum_allocations) < current &&
+            !__sync_bool_compare_and_swap(&xch->hypercall_buffer_maximum_allocations,
+                                          maximum, current) )
+        ;
 
-    xch->hypercall_buffer_total_allocations++;
-    xch->hypercall_buffer_current_allocations++;
-    if ( xch->hypercall_buffer_current_allocations > xch->hypercall_buffer_maximum_allocations )
-        xch->hypercall_buffer_maximum_allocations = xch->hypercall_buffer_current_allocations;
+    if ( order > HYPERCALL_BUFFER_CACHE_MAX_ORDER )
+    {
+        __sync_fetch_and_add(&xch->hypercall_buffer_cache_toobig, 1);
+        return NULL;
+    }
 
-    if ( nr_pages > 1 )
+    pool = hypercall_buffer_pool(xch, 0);
+    if ( pool && pool->nr[order] > 0 )
     {
-        xch->hypercall_buffer_cache_toobig++;
+        __sync_fetch_and_add(&xch->hypercall_buffer_pool_hits, 1);
+        return pool->bufs[order][--pool->nr[order]];
     }
-    else if ( xch->hypercall_buffer_cache_nr > 0 )
+
+    hypercall_buffer_cache_lock(xch);
+
+    if ( xch->hypercall_buffer_cache_nr[order] > 0 )
     {
-        p = xch->hypercall_buffer_cache[--xch->hypercall_buffer_cache_nr];
-        xch->hypercall_buffer_cache_hits++;
+        p = xch->hypercall_buffer_cache[order][--xch->hypercall_buffer_cache_nr[order]];
+        __sync_fetch_and_add(&xch->hypercall_buffer_cache_hits, 1);
     }
     else
     {
-        xch->hypercall_buffer_cache_misses++;
+        __sync_fetch_and_add(&xch->hypercall_buffer_cache_misses, 1);
     }
 
     hypercall_buffer_cache_unlock(xch);
@@ -77,16 +210,28 @@ static void *hypercall_buffer_cache_alloc(xc_interface *xch, int nr_pages)
 
 static int hypercall_buffer_cache_free(xc_interface *xch, void *p, int nr_pages)
 {
+    struct xc_hypercall_buffer_pool *pool;
+    int order = hypercall_buffer_order(nr_pages);
     int rc = 0;
 
-    hypercall_buffer_cache_lock(xch);
+    __sync_fetch_and_add(&xch->hypercall_buffer_total_releases, 1);
+    __sync_fetch_and_sub(&xch->hypercall_buffer_current_allocations, 1);
 
-    xch->hypercall_buffer_total_releases++;
-    xch->hypercall_buffer_current_allocations--;
+    if ( order > HYPERCALL_BUFFER_CACHE_MAX_ORDER )
+        return 0;
 
-    if ( nr_pages == 1 && xch->hypercall_buffer_cache_nr < HYPERCALL_BUFFER_CACHE_SIZE )
+    pool = hypercall_buffer_pool(xch, 1);
+    if ( pool && pool->nr[order] < HYPERCALL_BUFFER_POOL_SIZE )
     {
-        xch->hypercall_buffer_cache[xch->hypercall_buffer_cache_nr++] = p;
+        pool->bufs[order][pool->nr[order]++] = p;
+        return 1;
+    }
+
+    hypercall_buffer_cache_lock(xch);
+
+    if ( xch->hypercall_buffer_cache_nr[order] < HYPERCALL_BUFFER_CACHE_SIZE )
+    {
+        xch->hypercall_buffer_cache[order][xch->hypercall_buffer_cache_nr[order]++] = p;
         rc = 1;
     }
 
@@ -97,38 +242,95 @@ static int hypercall_buffer_cache_free(xc_interface *xch, void *p, int nr_pages)
 
 void xc__hypercall_buffer_cache_release(xc_interface *xch)
 {
+    struct xc_hypercall_buffer_pool *pool;
+    int order, cached = 0;
     void *p;
 
+    /* After this no thread exiting will look at its pool. */
+    if ( xch->hypercall_buffer_pool_key_valid )
+    {
+        pthread_key_delete(xch->hypercall_buffer_pool_key);
+        xch->hypercall_buffer_pool_key_valid = 0;
+    }
+
     hypercall_buffer_cache_lock(xch);
 
+    for ( order = 0; order < HYPERCALL_BUFFER_CACHE_ORDERS; order++ )
+        cached += xch->hypercall_buffer_cache_nr[order];
+
     DBGPRINTF("hypercall buffer: total allocations:%d total releases:%d",
               xch->hypercall_buffer_total_allocations,
               xch->hypercall_buffer_total_releases);
     DBGPRINTF("hypercall buffer: current allocations:%d maximum allocations:%d",
               xch->hypercall_buffer_current_allocations,
               xch->hypercall_buffer_maximum_allocations);
-    DBGPRINTF("hypercall buffer: cache current size:%d",
-              xch->hypercall_buffer_cache_nr);
-    DBGPRINTF("hypercall buffer: cache hits:%d misses:%d toobig:%d",
+    DBGPRINTF("hypercall buffer: cache current size:%d", cached);
+    DBGPRINTF("hypercall buffer: pool hits:%d cache hits:%d misses:%d toobig:%d",
+              xch->hypercall_buffer_pool_hits,
               xch->hypercall_buffer_cache_hits,
               xch->hypercall_buffer_cache_misses,
               xch->hypercall_buffer_cache_toobig);
 
-    while ( xch->hypercall_buffer_cache_nr > 0 )
+    while ( (pool = xch->hypercall_buffer_pools) != NULL )
     {
-        p = xch->hypercall_buffer_cache[--xch->hypercall_buffer_cache_nr];
-        xch->ops->u.privcmd.free_hypercall_buffer(xch, xch->ops_handle, p, 1);
+        xch->hypercall_buffer_pools = pool->next;
+        hypercall_buffer_pool_drain(xch, pool);
+        free(pool);
+    }
+
+    for ( order = 0; order < HYPERCALL_BUFFER_CACHE_ORDERS; order++ )
+    {
+        while ( xch->hypercall_buffer_cache_nr[order] > 0 )
+        {
+            p = xch->hypercall_buffer_cache[order][--xch->hypercall_buffer_cache_nr[order]];
+            xch->ops->u.privcmd.free_hypercall_buffer(xch, xch->ops_handle,
+                                                      p, 1 << order);
+        }
     }
 
     hypercall_buffer_cache_unlock(xch);
 }
 
+int xc_hypercall_buffer_stats(xc_interface *xch, xc_hypercall_buffer_stats_t *stats)
+{
+    struct xc_hypercall_buffer_pool *pool;
+    int order;
+
+    memset(stats, 0, sizeof(*stats));
+
+    hypercall_buffer_cache_lock(xch);
+
+    stats->total_allocations = xch->hypercall_buffer_total_allocations;
+    stats->total_releases = xch->hypercall_buffer_total_releases;
+    stats->current_allocations = xch->hypercall_buffer_current_allocations;
+    stats->maximum_allocations = xch->hypercall_buffer_maximum_allocations;
+    stats->pool_hits = xch->hypercall_buffer_pool_hits;
+    stats->cache_hits = xch->hypercall_buffer_cache_hits;
+    stats->cache_misses = xch->hypercall_buffer_cache_misses;
+    stats->cache_toobig = xch->hypercall_buffer_cache_toobig;
+
+    /* Other threads' pools change under us: this is only a snapshot. */
+    for ( order = 0; order < HYPERCALL_BUFFER_CACHE_ORDERS; order++ )
+    {
+        stats->cached_pages += xch->hypercall_buffer_cache_nr[order] << order;
+        for ( pool = xch->hypercall_buffer_pools; pool; pool = pool->next )
+            stats->pooled_pages += pool->nr[order] << order;
+    }
+    for ( pool = xch->hypercall_buffer_pools; pool; pool = pool->next )
+        stats->pools++;
+
+    hypercall_buffer_cache_unlock(xch);
+
+    return 0;
+}
+
 void *xc__hypercall_buffer_alloc_pages(xc_interface *xch, xc_hypercall_buffer_t *b, int nr_pages)
 {
     void *p = hypercall_buffer_cache_alloc(xch, nr_pages);
 
     if ( !p )
-        p = xch->ops->u.privcmd.alloc_hypercall_buffer(xch, xch->ops_handle, nr_pages);
+        p = xch->ops->u.privcmd.alloc_hypercall_buffer(xch, xch->ops_handle,
+                                                       hypercall_buffer_alloc_nr(nr_pages));
 
     if (!p)
         return NULL;
@@ -146,7 +348,8 @@ void xc__hypercall_buffer_free_pages(xc_interface *xch, xc_hypercall_buffer_t *b
         return;
 
     if ( !hypercall_buffer_cache_free(xch, b->hbuf, nr_pages) )
-        xch->ops->u.privcmd.free_hypercall_buffer(xch, xch->ops_handle, b->hbuf, nr_pages);
+        xch->ops->u.privcmd.free_hypercall_buffer(xch, xch->ops_handle, b->hbuf,
+                                                  hypercall_buffer_alloc_nr(nr_pages));
 }
 
 struct allocation_header {
@@ -239,6 +239,127 @@ static int check_mmio_hole(uint64_t start, uint64_t memsize,
         return 1;
 }
 
+/*
+ * Populate the frames page_array[cur_pages] to page_array[nr_pages - 1]
+ * with XENMEM_populate_physmap_range, one run of contiguous frames after
+ * the other. Xen picks 1GB, 2MB or 4kB extents as it goes; the calls are
+ * kept to 1GB, or to as many pages as 32 extents of the order xen fell
+ * back to but no less than 8MB, so that dom0 stays responsive.
+ */
+static int populate_physmap_bulk(xc_interface *xch, uint32_t dom,
+                                 const xen_pfn_t *page_array,
+                                 unsigned long cur_pages,
+                                 unsigned long nr_pages,
+                                 unsigned int *max_order,
+                                 unsigned int mem_flags)
+{
+    unsigned long run, count, done;
+
+    while ( cur_pages < nr_pages )
+    {
+        for ( run = 1; cur_pages + run < nr_pages; run++ )
+            if ( page_array[cur_pages + run] != page_array[cur_pages] + run )
+                break;
+
+        while ( run )
+        {
+            count = 32UL << *max_order;
+            if ( count > SUPERPAGE_1GB_NR_PFNS )
+                count = SUPERPAGE_1GB_NR_PFNS;
+            if ( count < SUPERPAGE_2MB_NR_PFNS * 4 )
+                count = SUPERPAGE_2MB_NR_PFNS * 4;
+            if ( count > run )
+                count = run;
+
+            if ( xc_domain_populate_physmap_range(xch, dom,
+                                                  page_array[cur_pages],
+                                                  count, max_order,
+                                                  mem_flags, &done) )
+                return -1;
+
+            cur_pages += count;
+            run -= count;
+        }
+    }
+
+    return 0;
+}
+
+/* The XENMEMF_* of the vnode page_array[cur_pages] is in, and its end */
+static unsigned int vnode_memflags(const struct xc_hvm_build_args *args,
+                                   unsigned long cur_pages,
+                                   unsigned long *end_pages)
+{
+    unsigned long end = 0;
+    unsigned int i;
+
+    for ( i = 0; i < args->nr_vnodes; i++ )
+    {
+        end += args->vnode_size[i] >> PAGE_SHIFT;
+        if ( cur_pages < end )
+            break;
+    }
+    *end_pages = end;
+
+    if ( args->vnode_to_pnode[i] == ~0U )
+        return 0;
+    return XENMEMF_exact_node(args->vnode_to_pnode[i]);
+}
+
+/*
+ * Give the domain the vNUMA topology of args: the memory ranges of each
+ * vnode are the frames of its pages, cut in two where the MMIO hole is.
+ */
+static int setup_vnuma(xc_interface *xch, uint32_t dom,
+                       const struct xc_hvm_build_args *args,
+                       const xen_pfn_t *page_array, unsigned long nr_pages)
+{
+    xen_vmemrange_t *ranges;
+    unsigned long start = 0, end, i;
+    unsigned int k, nr_ranges = 0;
+    int rc;
+
+    ranges = calloc(args->nr_vnodes * 2, sizeof(*ranges));
+    if ( ranges == NULL )
+    {
+        PERROR("Could not allocate the vNUMA memory ranges");
+        return -1;
+    }
+
+    for ( k = 0; k < args->nr_vnodes; k++, start = end )
+    {
+        end = start + (args->vnode_size[k] >> PAGE_SHIFT);
+
+        ranges[nr_ranges].start = (uint64_t)page_array[start] << PAGE_SHIFT;
+        ranges[nr_ranges].nid = k;
+        for ( i = start + 1; i < end; i++ )
+        {
+            if ( page_array[i] == page_array[i - 1] + 1 )
+                continue;
+            ranges[nr_ranges].end = (uint64_t)(page_array[i - 1] + 1)
+                                    << PAGE_SHIFT;
+            nr_ranges++;
+            ranges[nr_ranges].start = (uint64_t)page_array[i] << PAGE_SHIFT;
+            ranges[nr_ranges].nid = k;
+        }
+        ranges[nr_ranges].end = (uint64_t)(page_array[end - 1] + 1)
+                                << PAGE_SHIFT;
+        nr_ranges++;
+
+        DPRINTF("  VNODE %u: %lu pages on node %d\n", k, end - start,
+                (int)args->vnode_to_pnode[k]);
+    }
+
+    rc = xc_domain_setvnuma(xch, dom, args->nr_vnodes, nr_ranges,
+                            args->nr_vcpus, ranges, args->vdistance,
+                            args->vcpu_to_vnode, args->vnode_to_pnode);
+    if ( rc )
+        PERROR("Could not set the vNUMA topology");
+
+    free(ranges);
+    return rc;
+}
+
 static int setup_guest(xc_interface *xch,
                        uint32_t dom, struct xc_hvm_build_args *args,
                        char *image, unsigned long image_size)
@@ -259,6 +380,10 @@ static int setup_guest(xc_interface *xch,
     unsigned long stat_normal_pages = 0, stat_2mb_pages = 0, 
         stat_1gb_pages = 0;
     int pod_mode = 0;
+    unsigned int memflags;
+    unsigned long node_end;
+    unsigned int bulk_order = SUPERPAGE_1GB_SHIFT, node_order;
+    int bulk = 0;
     int claim_enabled = args->claim_enabled;
     xen_pfn_t special_array[NR_SPECIAL_PAGES];
     xen_pfn_t ioreq_server_array[NR_IOREQ_SERVER_PAGES];
@@ -266,6 +391,25 @@ static int setup_guest(xc_interface *xch,
     if ( nr_pages > target_pages )
         pod_mode = XENMEMF_populate_on_demand;
 
+    if ( args->nr_vnodes )
+    {
+        uint64_t total = 0;
+
+        for ( i = 0; i < args->nr_vnodes; i++ )
+        {
+            if ( args->vnode_size[i] & ~PAGE_MASK ||
+                 args->vnode_size[i] < (2ull << 20) )
+                break;
+            total += args->vnode_size[i];
+        }
+        if ( i < args->nr_vnodes || total != args->mem_size || pod_mode )
+        {
+            ERROR("Invalid vNUMA memory layout");
+            errno = EINVAL;
+            goto error_out;
+        }
+    }
+
     memset(&elf, 0, sizeof(elf));
     if ( elf_init(&elf, image, image_size) != 0 )
         goto error_out;
@@ -348,17 +492,55 @@ static int setup_guest(xc_interface *xch,
      * Under 2MB mode, we allocate pages in batches of no more than 8MB to 
      * ensure that we can be preempted and hence dom0 remains responsive.
      */
+    memflags = pod_mode |
+               (args->nr_vnodes ? vnode_memflags(args, 0, &node_end) : 0);
     rc = xc_domain_populate_physmap_exact(
-        xch, dom, 0xa0, 0, pod_mode, &page_array[0x00]);
+        xch, dom, 0xa0, 0, memflags, &page_array[0x00]);
     cur_pages = 0xc0;
     stat_normal_pages = 0xc0;
 
+    /*
+     * Let xen pick the extents if it can, this takes a fraction of the
+     * hypercalls the loop below makes.
+     */
+    if ( (rc == 0) && !pod_mode )
+    {
+        /* Each vnode from the top order, one running short of it or not */
+        for ( i = cur_pages; (rc == 0) && (i < nr_pages); i = node_end )
+        {
+            node_end = nr_pages;
+            memflags = args->nr_vnodes ? vnode_memflags(args, i, &node_end)
+                                       : 0;
+            node_order = SUPERPAGE_1GB_SHIFT;
+            rc = populate_physmap_bulk(xch, dom, page_array, i, node_end,
+                                       &node_order, memflags);
+            if ( node_order < bulk_order )
+                bulk_order = node_order;
+        }
+        if ( rc == 0 )
+        {
+            DPRINTF("PHYSICAL MEMORY ALLOCATION: in bulk, extents of order <= %u\n",
+                    bulk_order);
+            cur_pages = nr_pages;
+            bulk = 1;
+        }
+        else if ( errno == ENOSYS )
+            rc = 0;
+    }
+
     while ( (rc == 0) && (nr_pages > cur_pages) )
     {
-        /* Clip count to maximum 1GB extent. */
+        /* Clip count to maximum 1GB extent, and to the end of the vnode. */
         unsigned long count = nr_pages - cur_pages;
         unsigned long max_pages = SUPERPAGE_1GB_NR_PFNS;
 
+        memflags = pod_mode;
+        if ( args->nr_vnodes )
+        {
+            memflags |= vnode_memflags(args, cur_pages, &node_end);
+            count = node_end - cur_pages;
+        }
+
         if ( count > max_pages )
             count = max_pages;
 
@@ -389,7 +571,7 @@ static int setup_guest(xc_interface *xch,
                 sp_extents[i] = page_array[cur_pages+(i<<SUPERPAGE_1GB_SHIFT)];
 
             done = xc_domain_populate_physmap(xch, dom, nr_extents, SUPERPAGE_1GB_SHIFT,
-                                              pod_mode, sp_extents);
+                                              memflags, sp_extents);
 
             if ( done > 0 )
             {
@@ -426,7 +608,7 @@ static int setup_guest(xc_interface *xch,
                     sp_extents[i] = page_array[cur_pages+(i<<SUPERPAGE_2MB_SHIFT)];
 
                 done = xc_domain_populate_physmap(xch, dom, nr_extents, SUPERPAGE_2MB_SHIFT,
-                                                  pod_mode, sp_extents);
+                                                  memflags, sp_extents);
 
                 if ( done > 0 )
                 {
@@ -442,7 +624,7 @@ static int setup_guest(xc_interface *xch,
         if ( count != 0 )
         {
             rc = xc_domain_populate_physmap_exact(
-                xch, dom, count, 0, pod_mode, &page_array[cur_pages]);
+                xch, dom, count, 0, memflags, &page_array[cur_pages]);
             cur_pages += count;
             stat_normal_pages += count;
         }
@@ -454,10 +636,17 @@ static int setup_guest(xc_interface *xch,
         goto error_out;
     }
 
-    DPRINTF("PHYSICAL MEMORY ALLOCATION:\n");
-    DPRINTF("  4KB PAGES: 0x%016lx\n", stat_normal_pages);
-    DPRINTF("  2MB PAGES: 0x%016lx\n", stat_2mb_pages);
-    DPRINTF("  1GB PAGES: 0x%016lx\n", stat_1gb_pages);
+    if ( !bulk )
+    {
+        DPRINTF("PHYSICAL MEMORY ALLOCATION:\n");
+        DPRINTF("  4KB PAGES: 0x%016lx\n", stat_normal_pages);
+        DPRINTF("  2MB PAGES: 0x%016lx\n", stat_2mb_pages);
+        DPRINTF("  1GB PAGES: 0x%016lx\n", stat_1gb_pages);
+    }
+
+    if ( args->nr_vnodes &&
+         setup_vnuma(xch, dom, args, page_array, nr_pages) != 0 )
+        goto error_out;
     
     if ( loadelfimage(xch, &elf, dom, page_array) != 0 )
         goto error_out;
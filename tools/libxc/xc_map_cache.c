@@ -0,0 +1,298 @@
+/******************************************************************************
+ * xc_map_cache.c
+ *
+ * A cache of foreign mappings, so that frames mapped over and over are
+ * only mapped once.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "xc_private.h"
+
+#define MAP_CACHE_HASH_SIZE 64
+
+struct map_cache_entry {
+    uint32_t dom;
+    int prot;
+    xen_pfn_t gfn;
+    unsigned int nr;
+    void *addr;
+
+    int refs;
+    int stale;              /* unmap at the last put, never hand out again */
+
+    struct map_cache_entry *hash_next;
+    /* Least recently used at the tail */
+    struct map_cache_entry *lru_prev, *lru_next;
+};
+
+struct xc_map_cache {
+    unsigned int max_entries;
+    unsigned int nr_entries;
+    unsigned int nr_pages;
+    unsigned long hits, misses, evictions;
+
+    struct map_cache_entry *hash[MAP_CACHE_HASH_SIZE];
+    struct map_cache_entry *lru_head, *lru_tail;
+};
+
+static unsigned int map_cache_hash(uint32_t dom, xen_pfn_t gfn)
+{
+    return (dom * 31 + (unsigned int)gfn) % MAP_CACHE_HASH_SIZE;
+}
+
+static void lru_unlink(xc_map_cache_t *cache, struct map_cache_entry *e)
+{
+    if ( e->lru_prev )
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        cache->lru_head = e->lru_next;
+    if ( e->lru_next )
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        cache->lru_tail = e->lru_prev;
+}
+
+static void lru_push(xc_map_cache_t *cache, struct map_cache_entry *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = cache->lru_head;
+    if ( cache->lru_head )
+        cache->lru_head->lru_prev = e;
+    else
+        cache->lru_tail = e;
+    cache->lru_head = e;
+}
+
+static void map_cache_remove(xc_map_cache_t *cache, struct map_cache_entry *e)
+{
+    struct map_cache_entry **pp;
+
+    for ( pp = &cache->hash[map_cache_hash(e->dom, e->gfn)]; *pp;
+          pp = &(*pp)->hash_next )
+    {
+        if ( *pp == e )
+        {
+            *pp = e->hash_next;
+            break;
+        }
+    }
+    lru_unlink(cache, e);
+    cache->nr_entries--;
+    cache->nr_pages -= e->nr;
+
+    munmap(e->addr, (size_t)e->nr << XC_PAGE_SHIFT);
+    free(e);
+}
+
+/* Make room for one more entry, if there is an unused one to drop */
+static void map_cache_evict(xc_map_cache_t *cache)
+{
+    struct map_cache_entry *e, *prev;
+
+    for ( e = cache->lru_tail;
+          e && cache->nr_entries >= cache->max_entries;
+          e = prev )
+    {
+        prev = e->lru_prev;
+        if ( e->refs )
+            continue;
+        map_cache_remove(cache, e);
+        cache->evictions++;
+    }
+}
+
+xc_map_cache_t *xc_map_cache_create(xc_interface *xch, unsigned int max_entries)
+{
+    xc_map_cache_t *cache;
+
+    if ( max_entries == 0 )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    cache = calloc(1, sizeof(*cache));
+    if ( cache == NULL )
+    {
+        PERROR("Could not allocate foreign mapping cache");
+        return NULL;
+    }
+    cache->max_entries = max_entries;
+
+    return cache;
+}
+
+void xc_map_cache_destroy(xc_interface *xch, xc_map_cache_t *cache)
+{
+    if ( cache == NULL )
+        return;
+
+    while ( cache->lru_head )
+        map_cache_remove(cache, cache->lru_head);
+    free(cache);
+}
+
+void *xc_map_cache_get(xc_interface *xch, xc_map_cache_t *cache, uint32_t dom,
+                       int prot, xen_pfn_t gfn, unsigned int nr)
+{
+    struct map_cache_entry *e;
+    unsigned int h = map_cache_hash(dom, gfn);
+    xen_pfn_t *arr;
+    unsigned int i;
+
+    if ( nr == 0 )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    for ( e = cache->hash[h]; e; e = e->hash_next )
+    {
+        if ( e->dom == dom && e->gfn == gfn && e->nr >= nr &&
+             (e->prot & prot) == prot && !e->stale )
+        {
+            cache->hits++;
+            e->refs++;
+            lru_unlink(cache, e);
+            lru_push(cache, e);
+            return e->addr;
+        }
+    }
+
+    cache->misses++;
+
+    e = calloc(1, sizeof(*e));
+    arr = malloc(nr * sizeof(*arr));
+    if ( e == NULL || arr == NULL )
+    {
+        PERROR("Could not allocate foreign mapping cache entry");
+        goto err;
+    }
+    for ( i = 0; i < nr; i++ )
+        arr[i] = gfn + i;
+
+    e->addr = xc_map_foreign_pages(xch, dom, prot, arr, nr);
+    if ( e->addr == NULL )
+        goto err;
+    free(arr);
+
+    e->dom = dom;
+    e->prot = prot;
+    e->gfn = gfn;
+    e->nr = nr;
+    e->refs = 1;
+
+    map_cache_evict(cache);
+
+    e->hash_next = cache->hash[h];
+    cache->hash[h] = e;
+    lru_push(cache, e);
+    cache->nr_entries++;
+    cache->nr_pages += nr;
+
+    return e->addr;
+
+ err:
+    free(arr);
+    free(e);
+    return NULL;
+}
+
+void xc_map_cache_put(xc_interface *xch, xc_map_cache_t *cache, void *addr)
+{
+    struct map_cache_entry *e;
+
+    for ( e = cache->lru_head; e; e = e->lru_next )
+        if ( e->addr == addr )
+            break;
+
+    if ( e == NULL || e->refs == 0 )
+    {
+        ERROR("Foreign mapping %p is not in use from the cache", addr);
+        return;
+    }
+
+    if ( --e->refs )
+        return;
+
+    if ( e->stale )
+        map_cache_remove(cache, e);
+    else if ( cache->nr_entries > cache->max_entries )
+        map_cache_evict(cache);
+}
+
+void xc_map_cache_invalidate(xc_interface *xch, xc_map_cache_t *cache, uint32_t dom)
+{
+    struct map_cache_entry *e, *next;
+
+    for ( e = cache->lru_head; e; e = next )
+    {
+        next = e->lru_next;
+        if ( e->dom != dom )
+            continue;
+        if ( e->refs )
+            e->stale = 1;
+        else
+            map_cache_remove(cache, e);
+    }
+}
+
+int xc_map_cache_prune(xc_interface *xch, xc_map_cache_t *cache)
+{
+    struct map_cache_entry *e;
+    xc_dominfo_t info;
+    uint32_t dom;
+    int rc;
+
+ again:
+    for ( e = cache->lru_head; e; e = e->lru_next )
+    {
+        if ( e->stale )
+            continue;
+
+        dom = e->dom;
+        rc = xc_domain_getinfo(xch, dom, 1, &info);
+        if ( rc < 0 )
+            return -1;
+        if ( rc == 1 && info.domid == dom && !info.dying )
+            continue;
+
+        /* May free e and others after it: start again. */
+        xc_map_cache_invalidate(xch, cache, dom);
+        goto again;
+    }
+
+    return 0;
+}
+
+void xc_map_cache_stats(xc_map_cache_t *cache, xc_map_cache_stats_t *stats)
+{
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+    stats->entries = cache->nr_entries;
+    stats->pages = cache->nr_pages;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -29,6 +29,13 @@ void *xc_mem_access_enable(xc_interface *xch, domid_t domain_id, uint32_t *port)
     return xc_mem_event_enable(xch, domain_id, HVM_PARAM_ACCESS_RING_PFN, port);
 }
 
+int xc_mem_access_enable_vcpus(xc_interface *xch, domid_t domain_id,
+                               unsigned int nr_vcpus, void **rings,
+                               uint32_t *port)
+{
+    return xc_mem_event_enable_vcpus(xch, domain_id, nr_vcpus, rings, port);
+}
+
 int xc_mem_access_disable(xc_interface *xch, domid_t domain_id)
 {
     return xc_mem_event_control(xch, domain_id,
@@ -56,12 +56,51 @@ int xc_mem_event_memop(xc_interface *xch, domid_t domain_id,
     return do_memory_op(xch, mode, &meo, sizeof(meo));
 }
 
+/*
+ * Map the page at *ring_pfn, populating it first if the domain has none
+ * there.  *ring_pfn is updated to the pfn populated.
+ */
+static void *mem_event_map_ring(xc_interface *xch, domid_t domain_id,
+                                xen_pfn_t *ring_pfn)
+{
+    xen_pfn_t mmap_pfn = *ring_pfn;
+    void *ring_page;
+
+    ring_page = xc_map_foreign_batch(xch, domain_id, PROT_READ | PROT_WRITE,
+                                     &mmap_pfn, 1);
+    if ( !(mmap_pfn & XEN_DOMCTL_PFINFO_XTAB) )
+        return ring_page;
+
+    /* Map failed, populate ring page */
+    if ( ring_page )
+        munmap(ring_page, XC_PAGE_SIZE);
+    if ( xc_domain_populate_physmap_exact(xch, domain_id, 1, 0, 0,
+                                          ring_pfn) != 0 )
+    {
+        PERROR("Failed to populate ring pfn\n");
+        return NULL;
+    }
+
+    mmap_pfn = *ring_pfn;
+    ring_page = xc_map_foreign_batch(xch, domain_id, PROT_READ | PROT_WRITE,
+                                     &mmap_pfn, 1);
+    if ( mmap_pfn & XEN_DOMCTL_PFINFO_XTAB )
+    {
+        PERROR("Could not map the ring page\n");
+        if ( ring_page )
+            munmap(ring_page, XC_PAGE_SIZE);
+        return NULL;
+    }
+
+    return ring_page;
+}
+
 void *xc_mem_event_enable(xc_interface *xch, domid_t domain_id, int param,
                           uint32_t *port)
 {
     void *ring_page = NULL;
     uint64_t pfn;
-    xen_pfn_t ring_pfn, mmap_pfn;
+    xen_pfn_t ring_pfn;
     unsigned int op, mode;
     int rc1, rc2, saved_errno;
 
@@ -88,28 +127,11 @@ void *xc_mem_event_enable(xc_interface *xch, domid_t domain_id, int param,
     }
 
     ring_pfn = pfn;
-    mmap_pfn = pfn;
-    ring_page = xc_map_foreign_batch(xch, domain_id, PROT_READ | PROT_WRITE,
-                                     &mmap_pfn, 1);
-    if ( mmap_pfn & XEN_DOMCTL_PFINFO_XTAB )
+    ring_page = mem_event_map_ring(xch, domain_id, &ring_pfn);
+    if ( !ring_page )
     {
-        /* Map failed, populate ring page */
-        rc1 = xc_domain_populate_physmap_exact(xch, domain_id, 1, 0, 0,
-                                              &ring_pfn);
-        if ( rc1 != 0 )
-        {
-            PERROR("Failed to populate ring pfn\n");
-            goto out;
-        }
-
-        mmap_pfn = ring_pfn;
-        ring_page = xc_map_foreign_batch(xch, domain_id, PROT_READ | PROT_WRITE,
-                                         &mmap_pfn, 1);
-        if ( mmap_pfn & XEN_DOMCTL_PFINFO_XTAB )
-        {
-            PERROR("Could not map the ring page\n");
-            goto out;
-        }
+        rc1 = -1;
+        goto out;
     }
 
     switch ( param )
@@ -173,3 +195,102 @@ void *xc_mem_event_enable(xc_interface *xch, domid_t domain_id, int param,
 
     return ring_page;
 }
+
+int xc_mem_event_enable_vcpus(xc_interface *xch, domid_t domain_id,
+                              unsigned int nr_vcpus, void **rings,
+                              uint32_t *port)
+{
+    DECLARE_DOMCTL;
+    uint64_t pfn;
+    xen_pfn_t ring_pfn;
+    unsigned int i, enabled = 0;
+    int rc1, rc2, saved_errno;
+
+    if ( !port || !rings )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(rings, 0, nr_vcpus * sizeof(*rings));
+
+    /* Pause the domain for ring page setup */
+    rc1 = xc_domain_pause(xch, domain_id);
+    if ( rc1 != 0 )
+    {
+        PERROR("Unable to pause domain\n");
+        return -1;
+    }
+
+    /* Get the pfn of the ring page */
+    rc1 = xc_hvm_param_get(xch, domain_id, HVM_PARAM_ACCESS_RING_PFN, &pfn);
+    if ( rc1 != 0 )
+    {
+        PERROR("Failed to get pfn of ring page\n");
+        goto out;
+    }
+
+    /*
+     * Each ring in turn is populated at the pfn of the ring page, and
+     * removed from the physmap again once xen has it.
+     */
+    for ( i = 0; i < nr_vcpus; i++ )
+    {
+        ring_pfn = pfn;
+        rings[i] = mem_event_map_ring(xch, domain_id, &ring_pfn);
+        if ( !rings[i] )
+        {
+            rc1 = -1;
+            goto out;
+        }
+
+        domctl.cmd = XEN_DOMCTL_mem_event_op;
+        domctl.domain = domain_id;
+        domctl.u.mem_event_op.op = XEN_DOMCTL_MEM_EVENT_OP_ACCESS_ENABLE_VCPU;
+        domctl.u.mem_event_op.mode = XEN_DOMCTL_MEM_EVENT_OP_ACCESS;
+        domctl.u.mem_event_op.vcpu = i;
+        rc1 = do_domctl(xch, &domctl);
+        if ( rc1 != 0 )
+        {
+            PERROR("Failed to enable the mem_event ring of vcpu %u\n", i);
+            goto out;
+        }
+        *port = domctl.u.mem_event_op.port;
+        enabled++;
+
+        /* The next ring needs the pfn free */
+        rc1 = xc_domain_decrease_reservation_exact(xch, domain_id, 1, 0,
+                                                   &ring_pfn);
+        if ( rc1 != 0 )
+        {
+            PERROR("Failed to remove ring page from guest physmap");
+            goto out;
+        }
+    }
+
+ out:
+    saved_errno = errno;
+
+    if ( rc1 != 0 )
+    {
+        /* Tear down the rings set up so far */
+        if ( enabled )
+            xc_mem_event_control(xch, domain_id,
+                                 XEN_DOMCTL_MEM_EVENT_OP_ACCESS_DISABLE,
+                                 XEN_DOMCTL_MEM_EVENT_OP_ACCESS, NULL);
+        for ( i = 0; i < nr_vcpus; i++ )
+            if ( rings[i] )
+                munmap(rings[i], XC_PAGE_SIZE);
+        memset(rings, 0, nr_vcpus * sizeof(*rings));
+    }
+
+    rc2 = xc_domain_unpause(xch, domain_id);
+    if ( rc2 != 0 )
+    {
+        if ( rc1 == 0 )
+            saved_errno = errno;
+        PERROR("Unable to unpause domain");
+    }
+
+    errno = saved_errno;
+    return (rc1 || rc2) ? -1 : 0;
+}
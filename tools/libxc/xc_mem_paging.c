@@ -71,6 +71,15 @@ int xc_mem_paging_prep(xc_interface *xch, domid_t domain_id, unsigned long gfn)
                                 gfn, NULL);
 }
 
+int xc_mem_paging_absent(xc_interface *xch, domid_t domain_id,
+                         unsigned long gfn)
+{
+    return xc_mem_event_memop(xch, domain_id,
+                                XENMEM_paging_op_absent,
+                                XENMEM_paging_op,
+                                gfn, NULL);
+}
+
 int xc_mem_paging_load(xc_interface *xch, domid_t domain_id, 
                                 unsigned long gfn, void *buffer)
 {
@@ -21,9 +21,11 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <inttypes.h>
 #include "xc_private.h"
 #include <xen/memory.h>
 #include <xen/grant_table.h>
+#include <xen/hvm/params.h>
 
 int xc_memshr_control(xc_interface *xch,
                       domid_t domid,
@@ -161,6 +163,228 @@ int xc_memshr_share_grefs(xc_interface *xch,
     return xc_memshr_memop(xch, source_domain, &mso);
 }
 
+int xc_memshr_share_batch(xc_interface *xch,
+                          domid_t source_domain,
+                          xen_mem_sharing_batch_entry_t *entries,
+                          uint32_t nr)
+{
+    int rc;
+    xen_mem_sharing_op_t mso;
+    DECLARE_HYPERCALL_BOUNCE(entries, nr * sizeof(*entries),
+                             XC_HYPERCALL_BUFFER_BOUNCE_BOTH);
+
+    if ( xc_hypercall_bounce_pre(xch, entries) )
+    {
+        PERROR("Could not bounce buffer for sharing batch");
+        return -1;
+    }
+
+    memset(&mso, 0, sizeof(mso));
+
+    mso.op = XENMEM_sharing_op_share_batch;
+    mso.u.share_batch.nr = nr;
+    set_xen_guest_handle(mso.u.share_batch.entries, entries);
+
+    rc = xc_memshr_memop(xch, source_domain, &mso);
+
+    xc_hypercall_bounce_post(xch, entries);
+
+    return rc;
+}
+
+/* The HVM params a clone takes over from its template */
+static const uint32_t clone_params[] = {
+    HVM_PARAM_IDENT_PT, HVM_PARAM_VM86_TSS,
+    HVM_PARAM_IOREQ_PFN, HVM_PARAM_BUFIOREQ_PFN,
+    HVM_PARAM_STORE_PFN, HVM_PARAM_CONSOLE_PFN,
+    HVM_PARAM_PAGING_RING_PFN, HVM_PARAM_ACCESS_RING_PFN,
+    HVM_PARAM_SHARING_RING_PFN,
+    HVM_PARAM_IOREQ_SERVER_PFN, HVM_PARAM_NR_IOREQ_SERVER_PAGES,
+    HVM_PARAM_PAE_ENABLED, HVM_PARAM_VIRIDIAN, HVM_PARAM_TIMER_MODE,
+    HVM_PARAM_HPET_ENABLED, HVM_PARAM_VPT_ALIGN, HVM_PARAM_NESTEDHVM,
+    HVM_PARAM_ACPI_IOPORTS_LOCATION, HVM_PARAM_VM_GENERATION_ID_ADDR,
+};
+
+/* The pages of the I/O rings, which the clone starts with empty */
+static const uint32_t clone_ring_params[] = {
+    HVM_PARAM_IOREQ_PFN, HVM_PARAM_BUFIOREQ_PFN,
+    HVM_PARAM_STORE_PFN, HVM_PARAM_CONSOLE_PFN,
+};
+
+#define CLONE_BATCH 1024
+
+/* Give the clone a copy of its own of a page which cannot be shared */
+static int clone_copy_page(xc_interface *xch, domid_t template_domid,
+                           domid_t clone_domid, xen_pfn_t gfn)
+{
+    void *src, *dst;
+    int rc = -1;
+
+    /* Not a RAM page of the template: leave a hole */
+    src = xc_map_foreign_range(xch, template_domid, XC_PAGE_SIZE,
+                               PROT_READ, gfn);
+    if ( !src )
+        return 0;
+
+    if ( xc_domain_populate_physmap_exact(xch, clone_domid, 1, 0, 0, &gfn) )
+    {
+        PERROR("Could not populate gfn %"PRI_xen_pfn" of the clone", gfn);
+        goto out;
+    }
+
+    dst = xc_map_foreign_range(xch, clone_domid, XC_PAGE_SIZE,
+                               PROT_READ | PROT_WRITE, gfn);
+    if ( !dst )
+    {
+        PERROR("Could not map gfn %"PRI_xen_pfn" of the clone", gfn);
+        goto out;
+    }
+    memcpy(dst, src, XC_PAGE_SIZE);
+    munmap(dst, XC_PAGE_SIZE);
+    rc = 0;
+
+ out:
+    munmap(src, XC_PAGE_SIZE);
+    return rc;
+}
+
+int xc_memshr_clone_domain(xc_interface *xch,
+                           domid_t template_domid,
+                           domid_t clone_domid)
+{
+    xc_dominfo_t info;
+    xen_mem_sharing_batch_entry_t *entries = NULL;
+    uint8_t *hvm_buf = NULL;
+    int hvm_size, max_gpfn, copied = 0, rc = -1;
+    unsigned long gfn;
+    unsigned int i, nr;
+    uint64_t val;
+
+    if ( xc_domain_getinfo(xch, template_domid, 1, &info) != 1 ||
+         info.domid != template_domid )
+    {
+        PERROR("Could not get info of the template domain %u",
+               template_domid);
+        return -1;
+    }
+    if ( !info.hvm || !info.paused )
+    {
+        ERROR("Template domain %u is not a paused HVM guest", template_domid);
+        errno = EINVAL;
+        return -1;
+    }
+
+    max_gpfn = xc_domain_maximum_gpfn(xch, template_domid);
+    if ( max_gpfn < 0 )
+    {
+        PERROR("Could not get the maximum gpfn of domain %u", template_domid);
+        return -1;
+    }
+
+    entries = malloc(CLONE_BATCH * sizeof(*entries));
+    if ( !entries )
+    {
+        PERROR("Could not allocate sharing batch");
+        return -1;
+    }
+
+    /* Holes of the template and what cannot be shared are missed out */
+    for ( gfn = 0; gfn <= max_gpfn; gfn += nr )
+    {
+        nr = max_gpfn + 1 - gfn;
+        if ( nr > CLONE_BATCH )
+            nr = CLONE_BATCH;
+
+        memset(entries, 0, nr * sizeof(*entries));
+        for ( i = 0; i < nr; i++ )
+        {
+            entries[i].source_gfn = gfn + i;
+            entries[i].client_gfn = gfn + i;
+            entries[i].client_domain = clone_domid;
+            entries[i].flags = XENMEM_SHARING_BATCH_ADD_PHYSMAP;
+        }
+
+        if ( xc_memshr_share_batch(xch, template_domid, entries, nr) )
+        {
+            PERROR("Could not share the memory of domain %u from gfn %lx",
+                   template_domid, gfn);
+            goto out;
+        }
+
+        for ( i = 0; i < nr; i++ )
+        {
+            if ( !entries[i].rc )
+                continue;
+            if ( clone_copy_page(xch, template_domid, clone_domid, gfn + i) )
+                goto out;
+            copied++;
+        }
+    }
+    DPRINTF("Cloned domain %u into %u, %d pages copied",
+            template_domid, clone_domid, copied);
+
+    for ( i = 0; i < sizeof(clone_params) / sizeof(clone_params[0]); i++ )
+    {
+        if ( xc_hvm_param_get(xch, template_domid, clone_params[i], &val) )
+        {
+            PERROR("Could not get HVM param %u of domain %u",
+                   clone_params[i], template_domid);
+            goto out;
+        }
+        if ( val && xc_hvm_param_set(xch, clone_domid, clone_params[i], val) )
+        {
+            PERROR("Could not set HVM param %u of the clone", clone_params[i]);
+            goto out;
+        }
+    }
+
+    for ( i = 0; i < sizeof(clone_ring_params) / sizeof(clone_ring_params[0]);
+          i++ )
+    {
+        if ( xc_hvm_param_get(xch, clone_domid, clone_ring_params[i], &val) )
+            goto out;
+        if ( val && xc_clear_domain_page(xch, clone_domid, val) )
+        {
+            PERROR("Could not clear the ring at %"PRIx64" of the clone", val);
+            goto out;
+        }
+    }
+
+    /* The vcpus and devices, as they are in the template */
+    hvm_size = xc_domain_hvm_getcontext(xch, template_domid, NULL, 0);
+    if ( hvm_size <= 0 )
+    {
+        PERROR("Could not get the HVM context size of domain %u",
+               template_domid);
+        goto out;
+    }
+    hvm_buf = malloc(hvm_size);
+    if ( !hvm_buf )
+    {
+        PERROR("Could not allocate HVM context buffer");
+        goto out;
+    }
+    hvm_size = xc_domain_hvm_getcontext(xch, template_domid, hvm_buf,
+                                        hvm_size);
+    if ( hvm_size <= 0 )
+    {
+        PERROR("Could not get the HVM context of domain %u", template_domid);
+        goto out;
+    }
+    if ( xc_domain_hvm_setcontext(xch, clone_domid, hvm_buf, hvm_size) )
+    {
+        PERROR("Could not set the HVM context of the clone");
+        goto out;
+    }
+
+    rc = 0;
+
+ out:
+    free(hvm_buf);
+    free(entries);
+    return rc;
+}
+
 int xc_memshr_add_to_physmap(xc_interface *xch,
                     domid_t source_domain,
                     unsigned long source_gfn,
@@ -222,6 +446,37 @@ int xc_memshr_debug_gref(xc_interface *xch,
     return xc_memshr_memop(xch, domid, &mso);
 }
 
+int xc_memshr_hash_range(xc_interface *xch,
+                         domid_t domid,
+                         unsigned long first_gfn,
+                         uint32_t nr,
+                         uint64_t *hashes)
+{
+    int rc;
+    xen_mem_sharing_op_t mso;
+    DECLARE_HYPERCALL_BOUNCE(hashes, nr * sizeof(*hashes),
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( xc_hypercall_bounce_pre(xch, hashes) )
+    {
+        PERROR("Could not bounce buffer for sharing hashes");
+        return -1;
+    }
+
+    memset(&mso, 0, sizeof(mso));
+
+    mso.op = XENMEM_sharing_op_hash;
+    mso.u.hash.first_gfn = first_gfn;
+    mso.u.hash.nr = nr;
+    set_xen_guest_handle(mso.u.hash.hashes, hashes);
+
+    rc = xc_memshr_memop(xch, domid, &mso);
+
+    xc_hypercall_bounce_post(xch, hashes);
+
+    return rc;
+}
+
 int xc_memshr_audit(xc_interface *xch)
 {
     xen_mem_sharing_op_t mso;
@@ -213,6 +213,131 @@ int xc_numainfo(xc_interface *xch,
     return 0;
 }
 
+int xc_v4v_domstats(xc_interface *xch, uint32_t domid,
+                    xc_v4v_domstats_t *stats)
+{
+    int ret;
+    DECLARE_SYSCTL;
+
+    sysctl.cmd = XEN_SYSCTL_v4v_domstats;
+    sysctl.u.v4v_domstats.domid = domid;
+
+    if ( (ret = do_sysctl(xch, &sysctl)) != 0 )
+        return ret;
+
+    memcpy(stats, &sysctl.u.v4v_domstats, sizeof(*stats));
+
+    return 0;
+}
+
+int xc_gnttab_domstats(xc_interface *xch, uint32_t domid,
+                       xc_gnttab_domstats_t *stats)
+{
+    int ret;
+    DECLARE_SYSCTL;
+
+    sysctl.cmd = XEN_SYSCTL_gnttab_domstats;
+    sysctl.u.gnttab_domstats.domid = domid;
+
+    if ( (ret = do_sysctl(xch, &sysctl)) != 0 )
+        return ret;
+
+    memcpy(stats, &sysctl.u.gnttab_domstats, sizeof(*stats));
+
+    return 0;
+}
+
+int xc_evtchn_hotports(xc_interface *xch, uint32_t domid, uint32_t *nr_ports,
+                       uint64_t *interval_ns, xc_evtchn_hotport_t *ports)
+{
+    int ret;
+    DECLARE_SYSCTL;
+    DECLARE_HYPERCALL_BOUNCE(ports, *nr_ports * sizeof(*ports),
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( xc_hypercall_bounce_pre(xch, ports) )
+        return -1;
+
+    sysctl.cmd = XEN_SYSCTL_evtchn_hotports;
+    sysctl.u.evtchn_hotports.domid = domid;
+    sysctl.u.evtchn_hotports.nr_ports = *nr_ports;
+    set_xen_guest_handle(sysctl.u.evtchn_hotports.ports, ports);
+
+    if ( (ret = do_sysctl(xch, &sysctl)) == 0 )
+    {
+        *nr_ports = sysctl.u.evtchn_hotports.nr_ports;
+        if ( interval_ns )
+            *interval_ns = sysctl.u.evtchn_hotports.interval_ns;
+    }
+
+    xc_hypercall_bounce_post(xch, ports);
+
+    return ret;
+}
+
+int xc_sched_vcpustats(xc_interface *xch, uint32_t domid, uint32_t *nr_vcpus,
+                       xc_sched_vcpustat_t *stats)
+{
+    int ret;
+    DECLARE_SYSCTL;
+    DECLARE_HYPERCALL_BOUNCE(stats, *nr_vcpus * sizeof(*stats),
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( xc_hypercall_bounce_pre(xch, stats) )
+        return -1;
+
+    sysctl.cmd = XEN_SYSCTL_sched_vcpustats;
+    sysctl.u.sched_vcpustats.domid = domid;
+    sysctl.u.sched_vcpustats.nr_vcpus = *nr_vcpus;
+    set_xen_guest_handle(sysctl.u.sched_vcpustats.stats, stats);
+
+    if ( (ret = do_sysctl(xch, &sysctl)) == 0 )
+        *nr_vcpus = sysctl.u.sched_vcpustats.nr_vcpus;
+
+    xc_hypercall_bounce_post(xch, stats);
+
+    return ret;
+}
+
+int xc_domstats(xc_interface *xch, uint32_t first_domain,
+                unsigned int max_domains, xc_domstats_t *stats)
+{
+    int ret;
+    DECLARE_SYSCTL;
+    DECLARE_HYPERCALL_BOUNCE(stats, max_domains * sizeof(*stats),
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( xc_hypercall_bounce_pre(xch, stats) )
+        return -1;
+
+    sysctl.cmd = XEN_SYSCTL_domstats;
+    sysctl.u.domstats.first_domain = first_domain;
+    sysctl.u.domstats.max_domains = max_domains;
+    set_xen_guest_handle(sysctl.u.domstats.buffer, stats);
+
+    if ( (ret = do_sysctl(xch, &sysctl)) == 0 )
+        ret = sysctl.u.domstats.num_domains;
+
+    xc_hypercall_bounce_post(xch, stats);
+
+    return ret;
+}
+
+long xc_v4v_op(xc_interface *xch, int cmd, void *arg1, void *arg2,
+               uint32_t arg3, uint32_t arg4)
+{
+    DECLARE_HYPERCALL;
+
+    hypercall.op = __HYPERVISOR_v4v_op;
+    hypercall.arg[0] = cmd;
+    hypercall.arg[1] = (unsigned long)arg1;
+    hypercall.arg[2] = (unsigned long)arg2;
+    hypercall.arg[3] = arg3;
+    hypercall.arg[4] = arg4;
+
+    return do_xen_hypercall(xch, &hypercall);
+}
+
 
 int xc_sched_id(xc_interface *xch,
                 int *sched_id)
@@ -347,10 +472,32 @@ int xc_lockprof_query(xc_interface *xch,
     rc = do_sysctl(xch, &sysctl);
 
     *n_elems = sysctl.u.lockprof_op.nr_elem;
+    *time = sysctl.u.lockprof_op.time;
 
     return rc;
 }
 
+static int xc_lockprof_cmd(xc_interface *xch, uint32_t cmd)
+{
+    DECLARE_SYSCTL;
+
+    sysctl.cmd = XEN_SYSCTL_lockprof_op;
+    sysctl.u.lockprof_op.cmd = cmd;
+    set_xen_guest_handle(sysctl.u.lockprof_op.data, HYPERCALL_BUFFER_NULL);
+
+    return do_sysctl(xch, &sysctl);
+}
+
+int xc_lockprof_stop(xc_interface *xch)
+{
+    return xc_lockprof_cmd(xch, XEN_SYSCTL_LOCKPROF_stop);
+}
+
+int xc_lockprof_start(xc_interface *xch)
+{
+    return xc_lockprof_cmd(xch, XEN_SYSCTL_LOCKPROF_start);
+}
+
 int xc_getcpuinfo(xc_interface *xch, int max_cpus,
                   xc_cpuinfo_t *info, int *nr_cpus)
 {
@@ -534,6 +681,44 @@ out:
     return rc;
 }
 
+int xc_hvm_track_dirty_stdvga(
+    xc_interface *xch, domid_t dom, int enable,
+    uint32_t *dirty, void *vram)
+{
+    DECLARE_HYPERCALL;
+    DECLARE_HYPERCALL_BOUNCE(vram, vram ? XC_HVM_STDVGA_VRAM_SIZE : 0,
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+    DECLARE_HYPERCALL_BUFFER(struct xen_hvm_track_dirty_stdvga, arg);
+    int rc;
+
+    arg = xc_hypercall_buffer_alloc(xch, arg, sizeof(*arg));
+    if ( arg == NULL || xc_hypercall_bounce_pre(xch, vram) )
+    {
+        PERROR("Could not bounce memory for xc_hvm_track_dirty_stdvga hypercall");
+        rc = -1;
+        goto out;
+    }
+
+    hypercall.op     = __HYPERVISOR_hvm_op;
+    hypercall.arg[0] = HVMOP_track_dirty_stdvga;
+    hypercall.arg[1] = HYPERCALL_BUFFER_AS_ARG(arg);
+
+    arg->domid  = dom;
+    arg->enable = !!enable;
+    arg->pad    = 0;
+    arg->dirty  = 0;
+    set_xen_guest_handle(arg->vram, vram);
+
+    rc = do_xen_hypercall(xch, &hypercall);
+    if ( rc == 0 && dirty )
+        *dirty = arg->dirty;
+
+out:
+    xc_hypercall_buffer_free(xch, arg);
+    xc_hypercall_bounce_post(xch, vram);
+    return rc;
+}
+
 int xc_hvm_modified_memory(
     xc_interface *xch, domid_t dom, uint64_t first_pfn, uint64_t nr)
 {
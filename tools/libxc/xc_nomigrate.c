@@ -41,6 +41,14 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     return -1;
 }
 
+int xc_domain_postcopy_send(xc_interface *xch, int io_fd, uint32_t dom,
+                            const xen_pfn_t *pfns, unsigned long nr,
+                            int (*ready)(void *data), void *data)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
 /*
  * Local variables:
  * mode: C
@@ -444,3 +444,35 @@ int xc_disable_turbo(xc_interface *xch, int cpuid)
     sysctl.u.pm_op.cpuid = cpuid;
     return do_sysctl(xch, &sysctl);
 }
+
+int xc_get_core_parking(xc_interface *xch, xc_core_parking_t *info)
+{
+    DECLARE_SYSCTL;
+    int rc;
+
+    if ( !xch || !info )
+        return -EINVAL;
+
+    sysctl.cmd = XEN_SYSCTL_pm_op;
+    sysctl.u.pm_op.cmd = XEN_SYSCTL_pm_op_get_core_parking;
+    sysctl.u.pm_op.cpuid = 0;
+    rc = do_sysctl(xch, &sysctl);
+    if ( !rc )
+        *info = sysctl.u.pm_op.u.get_core_parking;
+
+    return rc;
+}
+
+int xc_set_core_parking_policy(xc_interface *xch, uint32_t policy)
+{
+    DECLARE_SYSCTL;
+
+    if ( !xch )
+        return -EINVAL;
+
+    sysctl.cmd = XEN_SYSCTL_pm_op;
+    sysctl.u.pm_op.cmd = XEN_SYSCTL_pm_op_set_core_parking_policy;
+    sysctl.u.pm_op.cpuid = 0;
+    sysctl.u.pm_op.u.set_core_parking_policy = policy;
+    return do_sysctl(xch, &sysctl);
+}
@@ -0,0 +1,200 @@
+/******************************************************************************
+ * xc_postcopy.c
+ *
+ * Sending the pages of a domain after it, to the pager of its destination.
+ * See xenguest.h for the stream.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "xc_private.h"
+#include "xc_bitops.h"
+#include "xenguest.h"
+
+/* Pages mapped at a time for the background part of the stream */
+#define POSTCOPY_BATCH 64
+
+struct postcopy_ctx {
+    xc_interface *xch;
+    int fd;
+    uint32_t dom;
+    /* The pfns still to send */
+    unsigned long *todo;
+    unsigned long max_pfn;
+};
+
+static int postcopy_send_pages(struct postcopy_ctx *ctx, xen_pfn_t *pfns,
+                               unsigned int nr)
+{
+    xc_interface *xch = ctx->xch;
+    int err[POSTCOPY_BATCH];
+    uint64_t pfn;
+    char *region;
+    unsigned int i;
+    int rc = -1;
+
+    region = xc_map_foreign_bulk(xch, ctx->dom, PROT_READ, pfns, err, nr);
+    if ( !region )
+    {
+        PERROR("Failed to map %u pages at %#"PRIx64, nr, (uint64_t)pfns[0]);
+        return -1;
+    }
+
+    for ( i = 0; i < nr; i++ )
+    {
+        /* The pager would be waiting for it forever */
+        if ( err[i] )
+        {
+            errno = -err[i];
+            PERROR("Failed to map pfn %#"PRIx64, (uint64_t)pfns[i]);
+            goto out;
+        }
+
+        pfn = pfns[i];
+        if ( write_exact(ctx->fd, &pfn, sizeof(pfn)) ||
+             write_exact(ctx->fd, region + i * PAGE_SIZE, PAGE_SIZE) )
+        {
+            PERROR("Failed to send pfn %#"PRIx64, pfn);
+            goto out;
+        }
+    }
+
+    rc = 0;
+
+ out:
+    munmap(region, nr * PAGE_SIZE);
+    return rc;
+}
+
+/* Send the pages the pager asked for so far first */
+static int postcopy_send_demanded(struct postcopy_ctx *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct pollfd pfd = { .fd = ctx->fd, .events = POLLIN };
+    uint64_t pfn;
+    xen_pfn_t gfn;
+
+    while ( poll(&pfd, 1, 0) > 0 )
+    {
+        if ( read_exact(ctx->fd, &pfn, sizeof(pfn)) )
+        {
+            PERROR("Failed to read post-copy request");
+            return -1;
+        }
+
+        /* Asked for again on the way, or not ours to send */
+        if ( pfn > ctx->max_pfn || !test_bit(pfn, ctx->todo) )
+            continue;
+
+        clear_bit(pfn, ctx->todo);
+        gfn = pfn;
+        if ( postcopy_send_pages(ctx, &gfn, 1) )
+            return -1;
+    }
+
+    return 0;
+}
+
+int xc_domain_postcopy_send(xc_interface *xch, int io_fd, uint32_t dom,
+                            const xen_pfn_t *pfns, unsigned long nr,
+                            int (*ready)(void *data), void *data)
+{
+    struct postcopy_ctx ctx = { .xch = xch, .fd = io_fd, .dom = dom };
+    xen_pfn_t batch[POSTCOPY_BATCH];
+    unsigned long i, j;
+    unsigned int n;
+    uint64_t val;
+    int rc = -1;
+
+    for ( i = 0; i < nr; i++ )
+        if ( pfns[i] > ctx.max_pfn )
+            ctx.max_pfn = pfns[i];
+
+    ctx.todo = bitmap_alloc(ctx.max_pfn + 1);
+    if ( !ctx.todo )
+    {
+        PERROR("Failed to allocate post-copy bitmap");
+        return -1;
+    }
+
+    val = nr;
+    if ( write_exact(io_fd, &val, sizeof(val)) )
+        goto send_fail;
+    for ( i = 0; i < nr; i++ )
+    {
+        set_bit(pfns[i], ctx.todo);
+        val = pfns[i];
+        if ( write_exact(io_fd, &val, sizeof(val)) )
+            goto send_fail;
+    }
+
+    if ( read_exact(io_fd, &val, sizeof(val)) || val != XC_POSTCOPY_END )
+    {
+        PERROR("Pager failed to page the pfns out");
+        goto out;
+    }
+
+    if ( ready && ready(data) )
+    {
+        ERROR("Failed to start the domain at the destination");
+        goto out;
+    }
+
+    for ( i = 0; i < nr; )
+    {
+        if ( postcopy_send_demanded(&ctx) )
+            goto out;
+
+        /* The next pfns not sent yet, in the order of the list */
+        for ( n = 0, j = i; j < nr && n < POSTCOPY_BATCH; j++ )
+            if ( test_bit(pfns[j], ctx.todo) )
+            {
+                clear_bit(pfns[j], ctx.todo);
+                batch[n++] = pfns[j];
+            }
+        i = j;
+
+        if ( n && postcopy_send_pages(&ctx, batch, n) )
+            goto out;
+    }
+
+    val = XC_POSTCOPY_END;
+    if ( write_exact(io_fd, &val, sizeof(val)) )
+        goto send_fail;
+
+    rc = 0;
+    goto out;
+
+ send_fail:
+    PERROR("Failed to write post-copy stream");
+ out:
+    free(ctx.todo);
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
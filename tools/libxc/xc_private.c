@@ -142,12 +142,16 @@ static struct xc_interface_core *xc_interface_open_common(xentoollog_logger *log
     xch->error_handler   = logger;           xch->error_handler_tofree   = 0;
     xch->dombuild_logger = dombuild_logger;  xch->dombuild_logger_tofree = 0;
 
-    xch->hypercall_buffer_cache_nr = 0;
+    memset(xch->hypercall_buffer_cache_nr, 0,
+           sizeof(xch->hypercall_buffer_cache_nr));
+    xch->hypercall_buffer_pool_key_valid = 0;
+    xch->hypercall_buffer_pools = NULL;
 
     xch->hypercall_buffer_total_allocations = 0;
     xch->hypercall_buffer_total_releases = 0;
     xch->hypercall_buffer_current_allocations = 0;
     xch->hypercall_buffer_maximum_allocations = 0;
+    xch->hypercall_buffer_pool_hits = 0;
     xch->hypercall_buffer_cache_hits = 0;
     xch->hypercall_buffer_cache_misses = 0;
     xch->hypercall_buffer_cache_toobig = 0;
@@ -186,6 +190,9 @@ static struct xc_interface_core *xc_interface_open_common(xentoollog_logger *log
         xch->ops_handle = xch->ops->open(xch);
         if (xch->ops_handle == XC_OSDEP_OPEN_ERROR)
             goto err_put_iface;
+
+        if ( type == XC_OSDEP_PRIVCMD )
+            xc__hypercall_buffer_cache_init(xch);
     }
 
     return xch;
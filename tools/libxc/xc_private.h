@@ -28,6 +28,7 @@
 #include <sys/stat.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
+#include <pthread.h>
 
 #include "xenctrl.h"
 #include "xenctrlosdep.h"
@@ -83,22 +84,30 @@ struct xc_interface_core {
     const char *currently_progress_reporting;
 
     /*
-     * A simple cache of unused, single page, hypercall buffers
+     * Caches of unused hypercall buffers of 2^order pages, order up to
+     * HYPERCALL_BUFFER_CACHE_MAX_ORDER. Each thread first uses a pool of
+     * its own (see xc_hcall_buf.c), then this cache shared by them all.
      *
-     * Protected by a global lock.
+     * The shared cache and the list of pools are protected by a global lock.
      */
 #define HYPERCALL_BUFFER_CACHE_SIZE 4
-    int hypercall_buffer_cache_nr;
-    void *hypercall_buffer_cache[HYPERCALL_BUFFER_CACHE_SIZE];
+#define HYPERCALL_BUFFER_CACHE_MAX_ORDER 3
+#define HYPERCALL_BUFFER_CACHE_ORDERS (HYPERCALL_BUFFER_CACHE_MAX_ORDER + 1)
+    int hypercall_buffer_cache_nr[HYPERCALL_BUFFER_CACHE_ORDERS];
+    void *hypercall_buffer_cache[HYPERCALL_BUFFER_CACHE_ORDERS][HYPERCALL_BUFFER_CACHE_SIZE];
+    int hypercall_buffer_pool_key_valid;
+    pthread_key_t hypercall_buffer_pool_key;
+    struct xc_hypercall_buffer_pool *hypercall_buffer_pools;
 
     /*
-     * Hypercall buffer statistics. All protected by the global
-     * hypercall_buffer_cache lock.
+     * Hypercall buffer statistics. Updated atomically, so that the
+     * per-thread pools need not take the lock.
      */
     int hypercall_buffer_total_allocations;
     int hypercall_buffer_total_releases;
     int hypercall_buffer_current_allocations;
     int hypercall_buffer_maximum_allocations;
+    int hypercall_buffer_pool_hits;
     int hypercall_buffer_cache_hits;
     int hypercall_buffer_cache_misses;
     int hypercall_buffer_cache_toobig;
@@ -203,8 +212,9 @@ void xc__hypercall_bounce_post(xc_interface *xch, xc_hypercall_buffer_t *bounce)
 #define xc_hypercall_bounce_post(_xch, _name) xc__hypercall_bounce_post(_xch, HYPERCALL_BUFFER(_name))
 
 /*
- * Release hypercall buffer cache
+ * Set up and release hypercall buffer cache
  */
+void xc__hypercall_buffer_cache_init(xc_interface *xch);
 void xc__hypercall_buffer_cache_release(xc_interface *xch);
 
 /*
@@ -382,5 +392,12 @@ int xc_mem_event_memop(xc_interface *xch, domid_t domain_id,
  */
 void *xc_mem_event_enable(xc_interface *xch, domid_t domain_id, int param,
                           uint32_t *port);
+/*
+ * Enables one mem_access ring per vCPU, for vCPUs 0 to nr_vcpus - 1, and
+ * maps them in rings[].  Returns 0, or -1 with none set up.
+ */
+int xc_mem_event_enable_vcpus(xc_interface *xch, domid_t domain_id,
+                              unsigned int nr_vcpus, void **rings,
+                              uint32_t *port);
 
 #endif /* __XC_PRIVATE_H__ */
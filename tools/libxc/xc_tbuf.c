@@ -52,6 +52,32 @@ int xc_tbuf_set_size(xc_interface *xch, unsigned long size)
     return xc_sysctl(xch, &sysctl);
 }
 
+int xc_tbuf_set_highwater(xc_interface *xch, unsigned int percent)
+{
+    DECLARE_SYSCTL;
+
+    sysctl.cmd = XEN_SYSCTL_tbuf_op;
+    sysctl.interface_version = XEN_SYSCTL_INTERFACE_VERSION;
+    sysctl.u.tbuf_op.cmd  = XEN_SYSCTL_TBUFOP_set_highwater;
+    sysctl.u.tbuf_op.size = percent;
+
+    return xc_sysctl(xch, &sysctl);
+}
+
+int xc_tbuf_set_sample(xc_interface *xch, uint32_t class_mask,
+                       unsigned int ratio)
+{
+    DECLARE_SYSCTL;
+
+    sysctl.cmd = XEN_SYSCTL_tbuf_op;
+    sysctl.interface_version = XEN_SYSCTL_INTERFACE_VERSION;
+    sysctl.u.tbuf_op.cmd  = XEN_SYSCTL_TBUFOP_set_sample;
+    sysctl.u.tbuf_op.evt_mask = class_mask;
+    sysctl.u.tbuf_op.size = ratio;
+
+    return xc_sysctl(xch, &sysctl);
+}
+
 int xc_tbuf_get_size(xc_interface *xch, unsigned long *size)
 {
     struct t_info *t_info;
@@ -376,6 +376,30 @@ void *xc__hypercall_buffer_array_get(xc_interface *xch, xc_hypercall_buffer_arra
     xc__hypercall_buffer_array_get(_xch, _array, _index, HYPERCALL_BUFFER(_name))
 void xc_hypercall_buffer_array_destroy(xc_interface *xc, xc_hypercall_buffer_array_t *array);
 
+/*
+ * Hypercall buffer allocation statistics, for tuning and debugging.
+ *
+ * Buffers of up to 8 pages are kept for reuse: first in a small pool
+ * per thread (pool_hits), then in a cache shared by the threads of the
+ * xc_interface (cache_hits). Misses and larger buffers (cache_toobig)
+ * are allocated and locked down afresh.
+ */
+typedef struct xc_hypercall_buffer_stats {
+    int total_allocations;
+    int total_releases;
+    int current_allocations;
+    int maximum_allocations;
+    int pool_hits;
+    int cache_hits;
+    int cache_misses;
+    int cache_toobig;
+    int cached_pages;       /* in the shared cache */
+    int pooled_pages;       /* in the thread pools */
+    int pools;              /* threads with a pool */
+} xc_hypercall_buffer_stats_t;
+
+int xc_hypercall_buffer_stats(xc_interface *xch, xc_hypercall_buffer_stats_t *stats);
+
 /*
  * CPUMAP handling
  */
@@ -649,6 +673,27 @@ int xc_vcpu_setaffinity(xc_interface *xch,
                         xc_cpumap_t cpumap_soft_inout,
                         uint32_t flags);
 
+/**
+ * This function sets the same hard and/or soft CPU affinity for vcpus
+ * first_vcpu to first_vcpu + nr_vcpus - 1, in a single domctl. Unlike
+ * xc_vcpu_setaffinity(), the effective affinity is not reported back.
+ *
+ * @param xch a handle to an open hypervisor interface.
+ * @param domid the id of the domain to which the vcpus belong
+ * @param first_vcpu the first vcpu id to set
+ * @param nr_vcpus the number of vcpus to set
+ * @param cpumap_hard specifies the hard affinity
+ * @param cpumap_soft specifies the soft affinity
+ * @param flags what we want to set
+ */
+int xc_vcpu_setaffinity_bulk(xc_interface *xch,
+                             uint32_t domid,
+                             int first_vcpu,
+                             int nr_vcpus,
+                             xc_cpumap_t cpumap_hard,
+                             xc_cpumap_t cpumap_soft,
+                             uint32_t flags);
+
 /**
  * This function retrieves hard and soft CPU affinity of a vcpu,
  * depending on what flags are set.
@@ -842,6 +887,27 @@ int xc_shadow_control(xc_interface *xch,
                       uint32_t mode,
                       xc_shadow_op_stats_t *stats);
 
+typedef xen_domctl_dirty_extent_t xc_dirty_extent_t;
+/**
+ * The dirty pages of a domain in log-dirty mode, as runs of pfns, from
+ * *start_pfn on: see XEN_DOMCTL_log_dirty_extents.
+ *
+ * @param xch a handle to an open hypervisor interface
+ * @param domid the domain id
+ * @param flags XEN_DOMCTL_LOG_DIRTY_CLEAN to clean the pages reported
+ * @param start_pfn where to start, set to where to go on from, or to
+ *        XEN_DOMCTL_LOG_DIRTY_END
+ * @param extents the runs of dirty pages
+ * @param nr_extents the size of extents, set to the number of runs
+ * @param stats set to the counts when *start_pfn is 0, may be NULL
+ * @return 0 on success, -1 with errno set on failure
+ */
+int xc_domain_log_dirty_extents(xc_interface *xch, uint32_t domid,
+                                uint32_t flags, uint64_t *start_pfn,
+                                xc_dirty_extent_t *extents,
+                                unsigned int *nr_extents,
+                                xc_shadow_op_stats_t *stats);
+
 int xc_sedf_domain_set(xc_interface *xch,
                        uint32_t domid,
                        uint64_t period, uint64_t slice,
@@ -874,6 +940,22 @@ int xc_sched_credit2_domain_set(xc_interface *xch,
 int xc_sched_credit2_domain_get(xc_interface *xch,
                                uint32_t domid,
                                struct xen_domctl_sched_credit2 *sdom);
+/*
+ * Have the vcpus of domid only share cores with each other
+ * (XEN_SCHED_CREDIT2_COSCHED), or stop it. The other parameters of the
+ * domain are left as they are.
+ */
+int xc_sched_credit2_domain_cosched(xc_interface *xch,
+                                    uint32_t domid,
+                                    int enable);
+
+/* Period and budget of the vcpus of domid, in microseconds */
+int xc_sched_rtds_domain_set(xc_interface *xch,
+                             uint32_t domid,
+                             struct xen_domctl_sched_rtds *sdom);
+int xc_sched_rtds_domain_get(xc_interface *xch,
+                             uint32_t domid,
+                             struct xen_domctl_sched_rtds *sdom);
 
 int
 xc_sched_arinc653_schedule_set(
@@ -971,6 +1053,103 @@ int xc_domain_set_virq_handler(xc_interface *xch, uint32_t domid, int virq);
 int xc_domain_set_max_evtchn(xc_interface *xch, uint32_t domid,
                              uint32_t max_port);
 
+/**
+ * Put back the p2m superpages of an HVM domain which were split but map
+ * contiguous memory uniformly again, e.g. after live migration or
+ * mem_access were used on it.
+ *
+ * @param xch a handle to an open hypervisor interface
+ * @param domid the domain id
+ * @param nr_2mb set to the number of 2MB superpages made, may be NULL
+ * @param nr_1gb set to the number of 1GB superpages made, may be NULL
+ */
+int xc_domain_p2m_coalesce(xc_interface *xch, uint32_t domid,
+                           uint64_t *nr_2mb, uint64_t *nr_1gb);
+
+/**
+ * Mark a domain latency sensitive, or not: wakeups of its vcpus then raise
+ * the frequency of the pcpu right away, under the ondemand governor.
+ *
+ * @param xch a handle to an open hypervisor interface
+ * @param domid the domain id
+ * @param sensitive non-zero for latency sensitive
+ */
+int xc_domain_set_latency_hint(xc_interface *xch, uint32_t domid,
+                               int sensitive);
+
+/**
+ * Set the virtual NUMA topology a domain sees with XENMEM_get_vnumainfo.
+ *
+ * @param xch a handle to an open hypervisor interface
+ * @param domid the domain id
+ * @param nr_vnodes number of virtual nodes
+ * @param nr_vmemranges number of memory ranges in vmemrange
+ * @param nr_vcpus number of vcpus, the domain's max_vcpus
+ * @param vmemrange the memory ranges of the virtual nodes
+ * @param vdistance nr_vnodes * nr_vnodes distances between them
+ * @param vcpu_to_vnode the virtual node of each vcpu
+ * @param vnode_to_pnode the physical node of each virtual one
+ */
+int xc_domain_setvnuma(xc_interface *xch, uint32_t domid,
+                       uint32_t nr_vnodes, uint32_t nr_vmemranges,
+                       uint32_t nr_vcpus, xen_vmemrange_t *vmemrange,
+                       unsigned int *vdistance, unsigned int *vcpu_to_vnode,
+                       unsigned int *vnode_to_pnode);
+
+/**
+ * Limit the number of v4v rings a domain may register and the number of
+ * its pages they may pin, XEN_DOMCTL_V4V_NO_QUOTA for no limit. This
+ * does not affect rings that are already registered.
+ *
+ * @param xch a handle to an open hypervisor interface
+ * @param domid the domain id
+ * @param max_rings maximum number of rings
+ * @param max_pages maximum number of pages pinned by the rings
+ */
+int xc_v4v_set_quota(xc_interface *xch, uint32_t domid,
+                     uint32_t max_rings, uint64_t max_pages);
+
+/**
+ * Stop the v4v rings of a domain taking messages and get them for its
+ * save, see XEN_DOMCTL_v4v_rings. *rings and *pfns are allocated and
+ * to be freed by the caller, NULL if there are no rings. Fails with
+ * ENODEV if the domain doesn't do v4v.
+ *
+ * @param xch a handle to an open hypervisor interface
+ * @param domid the domain id
+ * @param rings where to put the rings
+ * @param nr_rings where to put their number
+ * @param pfns where to put their frames
+ * @param nr_pfns where to put their number
+ */
+int xc_v4v_rings_save(xc_interface *xch, uint32_t domid,
+                      xen_domctl_v4v_ring_t **rings, uint32_t *nr_rings,
+                      uint64_t **pfns, uint32_t *nr_pfns);
+
+/**
+ * Let the v4v rings stopped by xc_v4v_rings_save() take messages again,
+ * for a domain that runs on after a failed save.
+ *
+ * @param xch a handle to an open hypervisor interface
+ * @param domid the domain id
+ */
+int xc_v4v_rings_thaw(xc_interface *xch, uint32_t domid);
+
+/**
+ * Register the v4v rings saved by xc_v4v_rings_save() for a restored
+ * domain, whose memory is restored already.
+ *
+ * @param xch a handle to an open hypervisor interface
+ * @param domid the domain id
+ * @param rings the rings
+ * @param nr_rings their number
+ * @param pfns their frames, as the domain sees them now
+ * @param nr_pfns their number
+ */
+int xc_v4v_rings_restore(xc_interface *xch, uint32_t domid,
+                         xen_domctl_v4v_ring_t *rings, uint32_t nr_rings,
+                         uint64_t *pfns, uint32_t nr_pfns);
+
 /*
  * CPUPOOL MANAGEMENT FUNCTIONS
  */
@@ -1226,6 +1405,58 @@ int xc_physinfo(xc_interface *xch, xc_physinfo_t *info);
 int xc_topologyinfo(xc_interface *xch, xc_topologyinfo_t *info);
 int xc_numainfo(xc_interface *xch, xc_numainfo_t *info);
 
+typedef xen_sysctl_v4v_domstats_t xc_v4v_domstats_t;
+
+/* v4v counters of domid, fails with ENODEV if it doesn't do v4v */
+int xc_v4v_domstats(xc_interface *xch, uint32_t domid,
+                    xc_v4v_domstats_t *stats);
+
+typedef xen_sysctl_gnttab_domstats_t xc_gnttab_domstats_t;
+
+/* grant table counters of domid */
+int xc_gnttab_domstats(xc_interface *xch, uint32_t domid,
+                       xc_gnttab_domstats_t *stats);
+
+typedef xen_sysctl_evtchn_hotport_t xc_evtchn_hotport_t;
+
+/*
+ * The busiest event channels of domid since the previous call for it,
+ * busiest first. *nr_ports is the size of ports on entry and how many
+ * were filled on return, *interval_ns the length of that interval.
+ * Fails with ENOSYS unless xen was built with evtchn_stats=y.
+ */
+int xc_evtchn_hotports(xc_interface *xch, uint32_t domid, uint32_t *nr_ports,
+                       uint64_t *interval_ns, xc_evtchn_hotport_t *ports);
+
+typedef xen_sysctl_sched_vcpustat_t xc_sched_vcpustat_t;
+
+/*
+ * Scheduling latency counters of the vcpus of domid. *nr_vcpus is the
+ * size of stats on entry and the number of vcpus of domid on return,
+ * of which the first ones, as many as fit, were filled.
+ */
+int xc_sched_vcpustats(xc_interface *xch, uint32_t domid, uint32_t *nr_vcpus,
+                       xc_sched_vcpustat_t *stats);
+
+typedef xen_sysctl_domstats_ent_t xc_domstats_t;
+
+/*
+ * The domain info and v4v, grant table and scheduling counters of up to
+ * max_domains domains from first_domain on, in one hypercall. Returns
+ * how many were filled, or -1 with errno set.
+ */
+int xc_domstats(xc_interface *xch, uint32_t first_domain,
+                unsigned int max_domains, xc_domstats_t *stats);
+
+/*
+ * Issue V4VOP_* cmd for the calling domain, see xen/v4v.h. Nothing is
+ * bounced: arg1, arg2 and whatever they point to (iovs, rings) must be
+ * in memory that stays mapped, locked memory or hypercall buffers.
+ * Returns what the hypercall returned, or -1 with errno set.
+ */
+long xc_v4v_op(xc_interface *xch, int cmd, void *arg1, void *arg2,
+               uint32_t arg3, uint32_t arg4);
+
 int xc_sched_id(xc_interface *xch,
                 int *sched_id);
 
@@ -1339,6 +1570,24 @@ int xc_domain_populate_physmap_exact(xc_interface *xch,
                                      unsigned int mem_flags,
                                      xen_pfn_t *extent_start);
 
+/**
+ * Populate the nr_pages frames of a translated domain from first_gfn,
+ * with extents of at most *max_order and smaller ones where those can't
+ * be allocated, in one hypercall. *max_order is lowered to the largest
+ * order the allocation of which didn't fail.
+ *
+ * @parm nr_done set to the number of frames populated, also on failure
+ * @return 0 on success, -1 with errno set: ENOMEM if memory ran out,
+ *         ENOSYS if xen doesn't have XENMEM_populate_physmap_range
+ */
+int xc_domain_populate_physmap_range(xc_interface *xch,
+                                     uint32_t domid,
+                                     xen_pfn_t first_gfn,
+                                     unsigned long nr_pages,
+                                     unsigned int *max_order,
+                                     unsigned int mem_flags,
+                                     unsigned long *nr_done);
+
 int xc_domain_claim_pages(xc_interface *xch,
                                uint32_t domid,
                                unsigned long nr_pages);
@@ -1409,6 +1658,9 @@ int xc_lockprof_query(xc_interface *xch,
                       uint32_t *n_elems,
                       uint64_t *time,
                       xc_hypercall_buffer_t *data);
+/* Pause and resume the profiling, keeping the data gathered so far. */
+int xc_lockprof_stop(xc_interface *xch);
+int xc_lockprof_start(xc_interface *xch);
 
 void *xc_memalign(xc_interface *xch, size_t alignment, size_t size);
 
@@ -1448,6 +1700,58 @@ void *xc_map_foreign_batch(xc_interface *xch, uint32_t dom, int prot,
 void *xc_map_foreign_bulk(xc_interface *xch, uint32_t dom, int prot,
                           const xen_pfn_t *arr, int *err, unsigned int num);
 
+/**
+ * Like xc_map_foreign_bulk(), for pages given as runs of contiguous gfns:
+ * maps the runs one after the other into a single range of addresses,
+ * with one hypercall. @err has one field per page mapped, in the same
+ * order. Unmap with munmap() of the total number of pages.
+ */
+typedef struct xc_gfn_range {
+    xen_pfn_t gfn;
+    unsigned int nr;
+} xc_gfn_range_t;
+
+void *xc_map_foreign_scatter(xc_interface *xch, uint32_t dom, int prot,
+                             const xc_gfn_range_t *ranges, unsigned int nr_ranges,
+                             int *err);
+
+/*
+ * Cache of foreign mappings, for callers which map the same frames of a
+ * domain over and over (statistics, tracing, save/restore).
+ *
+ * xc_map_cache_get() returns a mapping of @nr pages from @gfn, reusing
+ * one made for the same domain and first gfn, at least as many pages and
+ * the same or more access. Each get must be matched by an
+ * xc_map_cache_put() of the address it returned, after which the mapping
+ * stays cached until it is the least recently used and room is needed.
+ * All of the pages must map, else get fails.
+ *
+ * Mappings of a domain which is going away must be dropped:
+ * xc_map_cache_invalidate() for one domain (e.g. on @releaseDomain), or
+ * xc_map_cache_prune() for all the domains which have died. Mappings in
+ * use are unmapped at their last put.
+ *
+ * A cache is not thread safe, use one per thread.
+ */
+typedef struct xc_map_cache xc_map_cache_t;
+
+typedef struct xc_map_cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned int entries;
+    unsigned int pages;
+} xc_map_cache_stats_t;
+
+xc_map_cache_t *xc_map_cache_create(xc_interface *xch, unsigned int max_entries);
+void xc_map_cache_destroy(xc_interface *xch, xc_map_cache_t *cache);
+void *xc_map_cache_get(xc_interface *xch, xc_map_cache_t *cache, uint32_t dom,
+                       int prot, xen_pfn_t gfn, unsigned int nr);
+void xc_map_cache_put(xc_interface *xch, xc_map_cache_t *cache, void *addr);
+void xc_map_cache_invalidate(xc_interface *xch, xc_map_cache_t *cache, uint32_t dom);
+int xc_map_cache_prune(xc_interface *xch, xc_map_cache_t *cache);
+void xc_map_cache_stats(xc_map_cache_t *cache, xc_map_cache_stats_t *stats);
+
 /**
  * Translates a virtual address in the context of a given domain and
  * vcpu returning the GFN containing the address (that is, an MFN for 
@@ -1550,6 +1854,31 @@ int xc_tbuf_set_size(xc_interface *xch, unsigned long size);
  */
 int xc_tbuf_get_size(xc_interface *xch, unsigned long *size);
 
+/**
+ * This function sets how full a trace buffer gets before VIRQ_TBUF is
+ * sent, 50 percent unless set.  A consumer writing out at a high event
+ * rate wants to hear earlier, so that it has the rest of the buffer to
+ * catch up in.
+ *
+ * @parm xch a handle to an open hypervisor interface
+ * @parm percent the high water mark in percent of the buffer, 1 to 100
+ * @return 0 on success, -1 on failure.
+ */
+int xc_tbuf_set_highwater(xc_interface *xch, unsigned int percent);
+
+/**
+ * This function has Xen record only 1 in ratio of the events of each
+ * class in class_mask, so that hot events can stay traced at a cost a
+ * production host can take.  A ratio of 0 or 1 records all of them.
+ *
+ * @parm xch a handle to an open hypervisor interface
+ * @parm class_mask TRC_* class bits, e.g. TRC_HVM | TRC_SCHED
+ * @parm ratio record one event of every ratio
+ * @return 0 on success, -1 on failure.
+ */
+int xc_tbuf_set_sample(xc_interface *xch, uint32_t class_mask,
+                       unsigned int ratio);
+
 int xc_tbuf_set_cpu_mask(xc_interface *xch, uint32_t mask);
 
 int xc_tbuf_set_evt_mask(xc_interface *xch, uint32_t mask);
@@ -1800,6 +2129,19 @@ int xc_hvm_track_dirty_vram(
     uint64_t first_pfn, uint64_t nr,
     unsigned long *bitmap);
 
+/*
+ * Let Xen map the legacy VGA window straight onto its VRAM copy while the
+ * guest uses a chain-4 mode (HAP guests only), and collect the 4kB VRAM pages
+ * written since the previous call into *dirty.  If vram is not NULL it must
+ * hold XC_HVM_STDVGA_VRAM_SIZE bytes and receives the contents of the dirty
+ * pages at their VRAM offsets.  Call with enable == 0 to go back to trapping;
+ * that call returns the final set of dirty pages.
+ */
+#define XC_HVM_STDVGA_VRAM_SIZE 0x20000
+int xc_hvm_track_dirty_stdvga(
+    xc_interface *xch, domid_t dom, int enable,
+    uint32_t *dirty, void *vram);
+
 /*
  * Notify that some pages got modified by the Device Model
  */
@@ -1957,6 +2299,40 @@ int xc_hvm_unmap_io_range_from_ioreq_server(xc_interface *xch,
                                             uint64_t start,
                                             uint64_t end);
 
+/**
+ * This function registers a range of I/O ports whose writes are posted:
+ * they are queued on the buffered ioreq ring of the IOREQ Server rather
+ * than waited for.  The server must handle buffered ioreqs.
+ *
+ * @parm xch a handle to an open hypervisor interface.
+ * @parm domid the domain id to be serviced
+ * @parm id the IOREQ Server id.
+ * @parm start first port of the range
+ * @parm end last port of the range (inclusive).
+ * @return 0 on success, -1 on failure.
+ */
+int xc_hvm_map_posted_ports_to_ioreq_server(xc_interface *xch,
+                                            domid_t domid,
+                                            ioservid_t id,
+                                            uint16_t start,
+                                            uint16_t end);
+
+/**
+ * This function deregisters a range of posted I/O ports.
+ *
+ * @parm xch a handle to an open hypervisor interface.
+ * @parm domid the domain id to be serviced
+ * @parm id the IOREQ Server id.
+ * @parm start first port of the range
+ * @parm end last port of the range (inclusive).
+ * @return 0 on success, -1 on failure.
+ */
+int xc_hvm_unmap_posted_ports_from_ioreq_server(xc_interface *xch,
+                                                domid_t domid,
+                                                ioservid_t id,
+                                                uint16_t start,
+                                                uint16_t end);
+
 /**
  * This function registers a PCI device for config space emulation.
  *
@@ -2216,6 +2592,11 @@ int xc_set_cpuidle_max_cstate(xc_interface *xch, uint32_t value);
 
 int xc_enable_turbo(xc_interface *xch, int cpuid);
 int xc_disable_turbo(xc_interface *xch, int cpuid);
+
+typedef struct xen_get_core_parking xc_core_parking_t;
+int xc_get_core_parking(xc_interface *xch, xc_core_parking_t *info);
+/* policy is XEN_CORE_PARKING_POLICY_* */
+int xc_set_core_parking_policy(xc_interface *xch, uint32_t policy);
 /**
  * tmem operations
  */
@@ -2251,6 +2632,9 @@ int xc_mem_paging_evict(xc_interface *xch, domid_t domain_id, unsigned long gfn)
 int xc_mem_paging_prep(xc_interface *xch, domid_t domain_id, unsigned long gfn);
 int xc_mem_paging_load(xc_interface *xch, domid_t domain_id, 
                         unsigned long gfn, void *buffer);
+/* Page out a gfn the domain has no page for, see xc_domain_postcopy_send() */
+int xc_mem_paging_absent(xc_interface *xch, domid_t domain_id,
+                         unsigned long gfn);
 
 /** 
  * Access tracking operations.
@@ -2263,6 +2647,17 @@ int xc_mem_paging_load(xc_interface *xch, domid_t domain_id,
  * Caller has to unmap this page when done.
  */
 void *xc_mem_access_enable(xc_interface *xch, domid_t domain_id, uint32_t *port);
+/*
+ * Enables mem_access with one ring per vCPU instead, so that the vCPUs
+ * don't wait on each other for ring slots: the events of vCPU i go on
+ * rings[i], and all the rings signal *port.  rings[] has an entry for each
+ * of the nr_vcpus vCPUs of the domain, the caller has to unmap them when
+ * done.  xc_mem_access_disable() and xc_mem_access_resume() act on all the
+ * rings.
+ */
+int xc_mem_access_enable_vcpus(xc_interface *xch, domid_t domain_id,
+                               unsigned int nr_vcpus, void **rings,
+                               uint32_t *port);
 int xc_mem_access_disable(xc_interface *xch, domid_t domain_id);
 int xc_mem_access_resume(xc_interface *xch, domid_t domain_id);
 
@@ -2419,6 +2814,31 @@ int xc_memshr_share_grefs(xc_interface *xch,
                     grant_ref_t client_gref,
                     uint64_t client_handle);
 
+/* Shares nr (source, client) pairs of gfns at once, the source gfns being
+ * of source_domain.  An entry with a zero handle has its gfn nominated
+ * first, and gets the handle back.  The result of each pair, as of
+ * xc_memshr_nominate_gfn() and xc_memshr_share_gfns() but as a negative
+ * value, is in the rc of its entry; the call only fails if the entries
+ * cannot be accessed.
+ */
+int xc_memshr_share_batch(xc_interface *xch,
+                          domid_t source_domain,
+                          xen_mem_sharing_batch_entry_t *entries,
+                          uint32_t nr);
+
+/* Clones the paused HVM domain template_domid into clone_domid, a new HVM
+ * domain with the same number of vcpus and maximum memory but no memory
+ * yet: its memory is the template's, shared copy-on-write, but for the
+ * pages which cannot be shared, which are copied, and the I/O rings,
+ * which start empty; its vcpu and device state and HVM params are the
+ * template's.  Sharing has to be enabled on both domains.  The clone is
+ * left paused, for the toolstack to connect its event channels and
+ * device model.
+ */
+int xc_memshr_clone_domain(xc_interface *xch,
+                           domid_t template_domid,
+                           domid_t clone_domid);
+
 /* Allows to add to the guest physmap of the client domain a shared frame
  * directly.
  *
@@ -2449,6 +2869,19 @@ int xc_memshr_debug_gref(xc_interface *xch,
                          domid_t domid,
                          grant_ref_t gref);
 
+/* Fingerprints of the pages of nr gfns from first_gfn, to find the ones to
+ * nominate and share: the pages of two gfns with the same hash are likely
+ * but not certain to be the same, and have to be compared before sharing.
+ * Hashes of gfns without a RAM page are XENMEM_SHARING_HASH_INVALID.
+ *
+ * May fail with ENODEV if sharing is not enabled for the domain.
+ */
+int xc_memshr_hash_range(xc_interface *xch,
+                         domid_t domid,
+                         unsigned long first_gfn,
+                         uint32_t nr,
+                         uint64_t *hashes);
+
 /* Audits the share subsystem. 
  * 
  * Returns ENOSYS if not supported (may not be compiled into the hypervisor). 
@@ -2518,6 +2951,7 @@ int xc_flask_access(xc_interface *xc_handle, const char *scon, const char *tcon,
                   uint32_t *auditallow, uint32_t *auditdeny,
                   uint32_t *seqno);
 int xc_flask_avc_cachestats(xc_interface *xc_handle, char *buf, int size);
+int xc_flask_avc_histogram(xc_interface *xc_handle, char *buf, int size);
 int xc_flask_policyvers(xc_interface *xc_handle);
 int xc_flask_avc_hashstats(xc_interface *xc_handle, char *buf, int size);
 int xc_flask_getavc_threshold(xc_interface *xc_handle);
@@ -2535,6 +2969,10 @@ void xc_elf_set_logfile(xc_interface *xch, struct elf_binary *elf,
 typedef struct compression_ctx comp_ctx;
 comp_ctx *xc_compression_create_context(xc_interface *xch,
 					unsigned long p2m_size);
+/* As above, with a cache of cache_size bytes of pages rather than 32MB */
+comp_ctx *xc_compression_create_context_size(xc_interface *xch,
+                                             unsigned long p2m_size,
+                                             unsigned long cache_size);
 void xc_compression_free_context(xc_interface *xch, comp_ctx *ctx);
 
 /**
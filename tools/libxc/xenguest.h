@@ -28,6 +28,14 @@
 #define XCFLAGS_HVM       (1 << 2)
 #define XCFLAGS_STDVGA    (1 << 3)
 #define XCFLAGS_CHECKPOINT_COMPRESS    (1 << 4)
+/*
+ * The live rounds send the pages they send again as deltas against the
+ * copy sent before, kept in a cache of XCFLAGS_DELTA_CACHE(flags) times
+ * 16MB of pages (32MB for 0).  Needs a receiver which knows of it.
+ */
+#define XCFLAGS_LIVE_COMPRESS          (1 << 5)
+#define XCFLAGS_DELTA_CACHE_SHIFT      8
+#define XCFLAGS_DELTA_CACHE(flags)     (((flags) >> XCFLAGS_DELTA_CACHE_SHIFT) & 0xff)
 
 #define X86_64_B_SIZE   64 
 #define X86_32_B_SIZE   32
@@ -133,6 +141,42 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
  */
 #define XC_DEVICE_MODEL_RESTORE_FILE "/var/lib/xen/qemu-resume"
 
+/*
+ * Post-copy: the pages a domain was started without at the destination
+ * are sent after it, by xc_domain_postcopy_send() at the source, to the
+ * pager of the destination (xenpaging --postcopy).  The stream is made
+ * of 64-bit words, in the byte order of the hosts:
+ *
+ *  - the number of pfns, then the pfns: they are paged out at the
+ *    destination, which the pager acknowledges by writing back
+ *    XC_POSTCOPY_END.  The domain must not run before;
+ *  - records of a pfn followed by its page, in any order, until a pfn
+ *    of XC_POSTCOPY_END.
+ *
+ * The pager asks for the pages the domain faults on by writing their
+ * pfns back, which are sent next; the others are sent in the background
+ * in the meantime.
+ */
+#define XC_POSTCOPY_END (~0ULL)
+
+/**
+ * Send the nr pages at pfns of HVM domain dom, paused, to the pager of
+ * the post-copy stream io_fd, which must be a connection both ways.
+ *
+ * @parm xch a handle to an open hypervisor interface
+ * @parm io_fd the post-copy stream
+ * @parm dom the id of the domain
+ * @parm pfns the pfns to send
+ * @parm nr the number of pfns
+ * @parm ready called once the pager has paged the pfns out, from when
+ *       the domain can be unpaused at the destination; may be NULL
+ * @parm data passed to ready
+ * @return 0 on success, -1 on failure
+ */
+int xc_domain_postcopy_send(xc_interface *xch, int io_fd, uint32_t dom,
+                            const xen_pfn_t *pfns, unsigned long nr,
+                            int (*ready)(void *data), void *data);
+
 /**
  * This function will create a domain for a paravirtualized Linux
  * using file names pointing to kernel and ramdisk
@@ -230,6 +274,21 @@ struct xc_hvm_build_args {
     struct xc_hvm_firmware_module smbios_module;
     /* Whether to use claim hypercall (1 - enable, 0 - disable). */
     int claim_enabled;
+
+    /*
+     * Virtual NUMA, for nr_vnodes > 0: vnode i has the next vnode_size[i]
+     * bytes of memory, from the bottom up and the MMIO hole not counted,
+     * allocated on physical node vnode_to_pnode[i] (~0U for any).  The
+     * sizes must add up to mem_size, and PoD is not supported.  The
+     * domain's topology is then set with vdistance (nr_vnodes * nr_vnodes)
+     * and vcpu_to_vnode (nr_vcpus, the domain's max_vcpus).
+     */
+    unsigned int nr_vnodes;
+    const uint64_t *vnode_size;
+    unsigned int *vnode_to_pnode;
+    unsigned int *vdistance;
+    unsigned int nr_vcpus;
+    unsigned int *vcpu_to_vnode;
 };
 
 /**
@@ -203,6 +203,21 @@
  *   always holds true until the end of BODY PHASE:
  *    num(PFN entries +ve chunks) >= num(pages received in compressed form)
  *
+ * Delta compression of the live rounds (XCFLAGS_LIVE_COMPRESS):
+ *     Pages sent again by a later round are then usually sent as a delta
+ *   against the copy the receiver already has, in the compressed format
+ *   above.  Each batch of Format A gets a XC_SAVE_ID_DELTA_PAGES marker
+ *   ahead of it, and its pages follow in the one XC_SAVE_ID_COMPRESSED_DATA
+ *   chunk rather than raw; a batch without any page to send has no data
+ *   chunk.  The last round is sent in plain Format A.
+ *
+ *     XC_SAVE_ID_DELTA_PAGES      TAG
+ *     +1024                       +ve chunk
+ *     unsigned long[1024]         PFN array
+ *     XC_SAVE_ID_COMPRESSED_DATA  TAG
+ *      N                          Length of compressed data
+ *      N bytes of DATA            Decompresses to the pages of the batch
+ *
  * TAIL PHASE
  * ----------
  *
@@ -262,6 +277,8 @@
 /* These are a pair; it is an error for one to exist without the other */
 #define XC_SAVE_ID_HVM_IOREQ_SERVER_PFN -19
 #define XC_SAVE_ID_HVM_NR_IOREQ_SERVER_PAGES -20
+#define XC_SAVE_ID_V4V_RINGS          -21 /* v4v rings to re-register */
+#define XC_SAVE_ID_DELTA_PAGES        -22 /* Next batch is delta compressed */
 
 /*
 ** We process save/restore/migrate in batches of pages; the below
@@ -4692,6 +4692,54 @@ err:
     return NULL;
 }
 
+libxl_sched_vcpustats *libxl_list_sched_vcpustats(libxl_ctx *ctx,
+                                                  uint32_t domid,
+                                                  int *nb_vcpu)
+{
+    GC_INIT(ctx);
+    libxl_sched_vcpustats *ret = NULL, *ptr;
+    xc_domaininfo_t domaininfo;
+    xc_sched_vcpustat_t *stats;
+    uint32_t i, nr_vcpus;
+
+    if (xc_domain_getinfolist(ctx->xch, domid, 1, &domaininfo) != 1 ||
+        domaininfo.domain != domid) {
+        LOGE(ERROR, "getting infolist");
+        goto out;
+    }
+
+    nr_vcpus = domaininfo.max_vcpu_id + 1;
+    stats = libxl__calloc(gc, nr_vcpus, sizeof(*stats));
+    if (xc_sched_vcpustats(ctx->xch, domid, &nr_vcpus, stats)) {
+        LOGE(ERROR, "getting vcpu scheduling stats");
+        goto out;
+    }
+    if (nr_vcpus > domaininfo.max_vcpu_id + 1)
+        nr_vcpus = domaininfo.max_vcpu_id + 1;
+
+    ret = ptr = libxl__calloc(NOGC, nr_vcpus, sizeof(*ret));
+    for (i = 0; i < nr_vcpus; i++, ptr++) {
+        libxl_sched_vcpustats_init(ptr);
+        ptr->vcpuid = stats[i].vcpu_id;
+        ptr->wakeups = stats[i].wakeups;
+        ptr->preemptions = stats[i].preemptions;
+        ptr->migrations = stats[i].migrations;
+        ptr->waits = stats[i].waits;
+        ptr->wait_ns = stats[i].wait_ns;
+        ptr->wait_max_ns = stats[i].wait_max_ns;
+        ptr->num_wait_hist = XEN_SYSCTL_SCHED_WAIT_BUCKETS;
+        ptr->wait_hist = libxl__calloc(NOGC, ptr->num_wait_hist,
+                                       sizeof(*ptr->wait_hist));
+        memcpy(ptr->wait_hist, stats[i].wait_hist,
+               ptr->num_wait_hist * sizeof(*ptr->wait_hist));
+    }
+    *nb_vcpu = nr_vcpus;
+
+ out:
+    GC_FREE;
+    return ret;
+}
+
 int libxl_set_vcpuaffinity(libxl_ctx *ctx, uint32_t domid, uint32_t vcpuid,
                            const libxl_bitmap *cpumap_hard,
                            const libxl_bitmap *cpumap_soft)
@@ -4775,7 +4823,24 @@ int libxl_set_vcpuaffinity_all(libxl_ctx *ctx, uint32_t domid,
                                const libxl_bitmap *cpumap_soft)
 {
     GC_INIT(ctx);
-    int i, rc = 0;
+    int i, rc = 0, flags = 0;
+
+    if (cpumap_hard)
+        flags |= XEN_VCPUAFFINITY_HARD;
+    if (cpumap_soft)
+        flags |= XEN_VCPUAFFINITY_SOFT;
+
+    /*
+     * One domctl for all the vcpus. If that fails, go through them one by
+     * one, which tells which vcpus are the problem.
+     */
+    if (flags && max_vcpus &&
+        !xc_vcpu_setaffinity_bulk(ctx->xch, domid, 0, max_vcpus,
+                                  cpumap_hard ? cpumap_hard->map : NULL,
+                                  cpumap_soft ? cpumap_soft->map : NULL,
+                                  flags))
+        goto out;
+    LOGE(DEBUG, "setting affinity of all vcpus at once");
 
     for (i = 0; i < max_vcpus; i++) {
         if (libxl_set_vcpuaffinity(ctx, domid, i, cpumap_hard, cpumap_soft)) {
@@ -4784,6 +4849,7 @@ int libxl_set_vcpuaffinity_all(libxl_ctx *ctx, uint32_t domid,
         }
     }
 
+ out:
     GC_FREE;
     return rc;
 }
@@ -5154,6 +5220,56 @@ static int sched_sedf_domain_set(libxl__gc *gc, uint32_t domid,
     return 0;
 }
 
+static int sched_rtds_domain_get(libxl__gc *gc, uint32_t domid,
+                                 libxl_domain_sched_params *scinfo)
+{
+    struct xen_domctl_sched_rtds sdom;
+    int rc;
+
+    rc = xc_sched_rtds_domain_get(CTX->xch, domid, &sdom);
+    if (rc != 0) {
+        LOGE(ERROR, "getting domain sched rtds");
+        return ERROR_FAIL;
+    }
+
+    libxl_domain_sched_params_init(scinfo);
+    scinfo->sched = LIBXL_SCHEDULER_RTDS;
+    scinfo->period = sdom.period;
+    scinfo->budget = sdom.budget;
+
+    return 0;
+}
+
+static int sched_rtds_domain_set(libxl__gc *gc, uint32_t domid,
+                                 const libxl_domain_sched_params *scinfo)
+{
+    struct xen_domctl_sched_rtds sdom;
+    int rc;
+
+    rc = xc_sched_rtds_domain_get(CTX->xch, domid, &sdom);
+    if (rc != 0) {
+        LOGE(ERROR, "getting domain sched rtds");
+        return ERROR_FAIL;
+    }
+
+    if (scinfo->period != LIBXL_DOMAIN_SCHED_PARAM_PERIOD_DEFAULT)
+        sdom.period = scinfo->period;
+    if (scinfo->budget != LIBXL_DOMAIN_SCHED_PARAM_BUDGET_DEFAULT)
+        sdom.budget = scinfo->budget;
+    if (sdom.budget > sdom.period) {
+        LOG(ERROR, "Budget out of range, it may not be more than the period");
+        return ERROR_INVAL;
+    }
+
+    rc = xc_sched_rtds_domain_set(CTX->xch, domid, &sdom);
+    if ( rc < 0 ) {
+        LOGE(ERROR, "setting domain sched rtds");
+        return ERROR_FAIL;
+    }
+
+    return 0;
+}
+
 int libxl_domain_sched_params_set(libxl_ctx *ctx, uint32_t domid,
                                   const libxl_domain_sched_params *scinfo)
 {
@@ -5177,6 +5293,9 @@ int libxl_domain_sched_params_set(libxl_ctx *ctx, uint32_t domid,
     case LIBXL_SCHEDULER_ARINC653:
         ret=sched_arinc653_domain_set(gc, domid, scinfo);
         break;
+    case LIBXL_SCHEDULER_RTDS:
+        ret=sched_rtds_domain_set(gc, domid, scinfo);
+        break;
     default:
         LOG(ERROR, "Unknown scheduler");
         ret=ERROR_INVAL;
@@ -5207,6 +5326,9 @@ int libxl_domain_sched_params_get(libxl_ctx *ctx, uint32_t domid,
     case LIBXL_SCHEDULER_CREDIT2:
         ret=sched_credit2_domain_get(gc, domid, scinfo);
         break;
+    case LIBXL_SCHEDULER_RTDS:
+        ret=sched_rtds_domain_get(gc, domid, scinfo);
+        break;
     default:
         LOG(ERROR, "Unknown scheduler");
         ret=ERROR_INVAL;
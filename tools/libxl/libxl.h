@@ -103,6 +103,29 @@
  */
 #define LIBXL_HAVE_BUILDINFO_EVENT_CHANNELS 1
 
+/*
+ * The libxl_domain_build_info has the v4v_max_rings and
+ * v4v_max_ring_memkb fields.
+ */
+#define LIBXL_HAVE_BUILDINFO_V4V_QUOTA 1
+
+/*
+ * libxl_list_sched_vcpustats() and libxl_sched_vcpustats are available.
+ */
+#define LIBXL_HAVE_SCHED_VCPUSTATS 1
+
+/*
+ * LIBXL_HAVE_SCHED_RTDS indicates that the RTDS real-time scheduler is
+ * available, with the period and budget fields of
+ * libxl_domain_sched_params, both in microseconds for it.
+ */
+#define LIBXL_HAVE_SCHED_RTDS 1
+
+/*
+ * The libxl_domain_build_info has the u.hvm.vpt_merge field.
+ */
+#define LIBXL_HAVE_BUILDINFO_HVM_VPT_MERGE 1
+
 /*
  * libxl_domain_build_info has the u.hvm.ms_vm_genid field.
  */
@@ -579,6 +602,16 @@ typedef struct libxl__ctx libxl_ctx;
  */
 #define LIBXL_HAVE_CPUPOOL_NAME 1
 
+/*
+ * LIBXL_HAVE_VNUMA_AUTO
+ *
+ * If this is defined, libxl_domain_build_info has a vnuma_auto field.
+ * When set, an HVM guest placed over several NUMA nodes is given one
+ * virtual NUMA node per physical node, exposed through SRAT and SLIT,
+ * with its vcpus' soft affinity set to the cpus of their node.
+ */
+#define LIBXL_HAVE_VNUMA_AUTO 1
+
 typedef uint8_t libxl_mac[6];
 #define LIBXL_MAC_FMT "%02hhx:%02hhx:%02hhx:%02hhx:%02hhx:%02hhx"
 #define LIBXL_MAC_FMTLEN ((2*6)+5) /* 6 hex bytes plus 5 colons */
@@ -958,6 +991,12 @@ libxl_vcpuinfo *libxl_list_vcpu(libxl_ctx *ctx, uint32_t domid,
                                 int *nb_vcpu, int *nr_cpus_out);
 void libxl_vcpuinfo_list_free(libxl_vcpuinfo *, int nr_vcpus);
 
+/* Scheduling latency of the vcpus of domid, since they were created */
+libxl_sched_vcpustats *libxl_list_sched_vcpustats(libxl_ctx *ctx,
+                                                  uint32_t domid,
+                                                  int *nb_vcpu);
+void libxl_sched_vcpustats_list_free(libxl_sched_vcpustats *, int nr_vcpus);
+
 void libxl_device_vtpm_list_free(libxl_device_vtpm*, int nr_vtpms);
 void libxl_vtpminfo_list_free(libxl_vtpminfo *, int nr_vtpms);
 
@@ -1240,6 +1279,7 @@ int libxl_sched_credit_params_set(libxl_ctx *ctx, uint32_t poolid,
 #define LIBXL_DOMAIN_SCHED_PARAM_SLICE_DEFAULT     -1
 #define LIBXL_DOMAIN_SCHED_PARAM_LATENCY_DEFAULT   -1
 #define LIBXL_DOMAIN_SCHED_PARAM_EXTRATIME_DEFAULT -1
+#define LIBXL_DOMAIN_SCHED_PARAM_BUDGET_DEFAULT    -1
 
 int libxl_domain_sched_params_get(libxl_ctx *ctx, uint32_t domid,
                                   libxl_domain_sched_params *params);
@@ -188,6 +188,7 @@ int libxl__domain_build_info_setdefault(libxl__gc *gc,
         return ERROR_FAIL;
 
     libxl_defbool_setdefault(&b_info->numa_placement, true);
+    libxl_defbool_setdefault(&b_info->vnuma_auto, false);
 
     if (b_info->max_memkb == LIBXL_MEMKB_DEFAULT)
         b_info->max_memkb = 32 * 1024;
@@ -276,6 +277,7 @@ int libxl__domain_build_info_setdefault(libxl__gc *gc,
         libxl_defbool_setdefault(&b_info->u.hvm.viridian,           false);
         libxl_defbool_setdefault(&b_info->u.hvm.hpet,               true);
         libxl_defbool_setdefault(&b_info->u.hvm.vpt_align,          true);
+        libxl_defbool_setdefault(&b_info->u.hvm.vpt_merge,          false);
         libxl_defbool_setdefault(&b_info->u.hvm.nested_hvm,         false);
         libxl_defbool_setdefault(&b_info->u.hvm.usb,                false);
         libxl_defbool_setdefault(&b_info->u.hvm.xen_platform_pci,   true);
@@ -672,8 +674,6 @@ static void domcreate_bootloader_done(libxl__egc *egc,
 static void domcreate_launch_dm(libxl__egc *egc, libxl__multidev *aodevs,
                                 int ret);
 
-static void domcreate_attach_vtpms(libxl__egc *egc, libxl__multidev *multidev,
-                                   int ret);
 static void domcreate_attach_pci(libxl__egc *egc, libxl__multidev *aodevs,
                                  int ret);
 
@@ -802,6 +802,7 @@ static void initiate_domain_create(libxl__egc *egc,
 
     dcs->guest_domid = domid;
     dcs->dmss.dm.guest_domid = 0; /* means we haven't spawned */
+    LOG_MILESTONE(domid, "made");
 
     ret = libxl__domain_build_info_setdefault(gc, &d_config->b_info);
     if (ret) goto error_out;
@@ -909,6 +910,8 @@ static void domcreate_bootloader_done(libxl__egc *egc,
      */
     state->pv_cmdline = bl->cmdline;
 
+    LOG_MILESTONE(domid, "build");
+
     /* We might be going to call libxl__spawn_local_dm, or _spawn_stub_dm.
      * Fill in any field required by either, including both relevant
      * callbacks (_spawn_stub_dm will overwrite our trespass if needed). */
@@ -1060,6 +1063,17 @@ out:
     domcreate_rebuild_done(egc, dcs, ret);
 }
 
+/*
+ * The nics of an HVM guest are plugged in once its device model is up,
+ * with its vtpms.  Those of a PV guest need nothing from the device
+ * model, so they are added along with the disks and all their hotplug
+ * scripts run at once.
+ */
+static bool nics_before_dm(libxl_domain_config *d_config)
+{
+    return d_config->c_info.type == LIBXL_DOMAIN_TYPE_PV;
+}
+
 static void domcreate_rebuild_done(libxl__egc *egc,
                                    libxl__domain_create_state *dcs,
                                    int ret)
@@ -1079,9 +1093,14 @@ static void domcreate_rebuild_done(libxl__egc *egc,
 
     store_libxl_entry(gc, domid, &d_config->b_info);
 
+    LOG_MILESTONE(domid, "devices");
     libxl__multidev_begin(ao, &dcs->multidev);
     dcs->multidev.callback = domcreate_launch_dm;
     libxl__add_disks(egc, ao, domid, d_config, &dcs->multidev);
+    if (nics_before_dm(d_config)) {
+        libxl__add_nics(egc, ao, domid, d_config, &dcs->multidev);
+        libxl__add_vtpms(egc, ao, domid, d_config, &dcs->multidev);
+    }
     libxl__multidev_prepared(egc, &dcs->multidev, 0);
 
     return;
@@ -1104,10 +1123,12 @@ static void domcreate_launch_dm(libxl__egc *egc, libxl__multidev *multidev,
     libxl__domain_build_state *const state = &dcs->build_state;
 
     if (ret) {
-        LOG(ERROR, "unable to add disk devices");
+        LOG(ERROR, "unable to add devices");
         goto error_out;
     }
 
+    LOG_MILESTONE(domid, "devicemodel");
+
     for (i = 0; i < d_config->b_info.num_ioports; i++) {
         libxl_ioport_range *io = &d_config->b_info.ioports[i];
 
@@ -1240,6 +1261,8 @@ static void domcreate_devmodel_started(libxl__egc *egc,
         goto error_out;
     }
 
+    LOG_MILESTONE(domid, "dm-up");
+
     if (dcs->dmss.dm.guest_domid) {
         if (d_config->b_info.device_model_version
             == LIBXL_DEVICE_MODEL_VERSION_QEMU_XEN) {
@@ -1247,17 +1270,18 @@ static void domcreate_devmodel_started(libxl__egc *egc,
         }
     }
 
-    /* Plug nic interfaces */
-    if (d_config->num_nics > 0) {
-        /* Attach nics */
+    /* Plug nic interfaces and vtpm devices, all at once */
+    if (!nics_before_dm(d_config) &&
+        (d_config->num_nics > 0 || d_config->num_vtpms > 0)) {
         libxl__multidev_begin(ao, &dcs->multidev);
-        dcs->multidev.callback = domcreate_attach_vtpms;
+        dcs->multidev.callback = domcreate_attach_pci;
         libxl__add_nics(egc, ao, domid, d_config, &dcs->multidev);
+        libxl__add_vtpms(egc, ao, domid, d_config, &dcs->multidev);
         libxl__multidev_prepared(egc, &dcs->multidev, 0);
         return;
     }
 
-    domcreate_attach_vtpms(egc, &dcs->multidev, 0);
+    domcreate_attach_pci(egc, &dcs->multidev, 0);
     return;
 
 error_out:
@@ -1265,39 +1289,6 @@ error_out:
     domcreate_complete(egc, dcs, ret);
 }
 
-static void domcreate_attach_vtpms(libxl__egc *egc,
-                                   libxl__multidev *multidev,
-                                   int ret)
-{
-   libxl__domain_create_state *dcs = CONTAINER_OF(multidev, *dcs, multidev);
-   STATE_AO_GC(dcs->ao);
-   int domid = dcs->guest_domid;
-
-   libxl_domain_config* const d_config = dcs->guest_config;
-
-   if(ret) {
-       LOG(ERROR, "unable to add nic devices");
-       goto error_out;
-   }
-
-    /* Plug vtpm devices */
-   if (d_config->num_vtpms > 0) {
-       /* Attach vtpms */
-       libxl__multidev_begin(ao, &dcs->multidev);
-       dcs->multidev.callback = domcreate_attach_pci;
-       libxl__add_vtpms(egc, ao, domid, d_config, &dcs->multidev);
-       libxl__multidev_prepared(egc, &dcs->multidev, 0);
-       return;
-   }
-
-   domcreate_attach_pci(egc, multidev, 0);
-   return;
-
-error_out:
-   assert(ret);
-   domcreate_complete(egc, dcs, ret);
-}
-
 static void domcreate_attach_pci(libxl__egc *egc, libxl__multidev *multidev,
                                  int ret)
 {
@@ -1311,7 +1302,7 @@ static void domcreate_attach_pci(libxl__egc *egc, libxl__multidev *multidev,
     libxl_domain_config *const d_config = dcs->guest_config;
 
     if (ret) {
-        LOG(ERROR, "unable to add vtpm devices");
+        LOG(ERROR, "unable to add nic or vtpm devices");
         goto error_out;
     }
 
@@ -1363,6 +1354,8 @@ static void domcreate_complete(libxl__egc *egc,
             return;
         }
         dcs->guest_domid = -1;
+    } else {
+        LOG_MILESTONE(dcs->guest_domid, "complete");
     }
     dcs->callback(egc, dcs, rc, dcs->guest_domid);
 }
@@ -223,6 +223,8 @@ static void hvm_set_conf_params(xc_interface *handle, uint32_t domid,
     xc_hvm_param_set(handle, domid, HVM_PARAM_TIMER_MODE, timer_mode(info));
     xc_hvm_param_set(handle, domid, HVM_PARAM_VPT_ALIGN,
                     libxl_defbool_val(info->u.hvm.vpt_align));
+    xc_hvm_param_set(handle, domid, HVM_PARAM_VPT_MERGE,
+                    libxl_defbool_val(info->u.hvm.vpt_merge));
     xc_hvm_param_set(handle, domid, HVM_PARAM_NESTEDHVM,
                     libxl_defbool_val(info->u.hvm.nested_hvm));
 }
@@ -335,6 +337,21 @@ int libxl__build_post(libxl__gc *gc, uint32_t domid,
         return ERROR_FAIL;
     }
 
+    if (info->v4v_max_rings || info->v4v_max_ring_memkb != LIBXL_MEMKB_DEFAULT) {
+        uint32_t max_rings = info->v4v_max_rings ?: XEN_DOMCTL_V4V_NO_QUOTA;
+        uint64_t max_pages = XEN_DOMCTL_V4V_NO_QUOTA;
+
+        if (info->v4v_max_ring_memkb != LIBXL_MEMKB_DEFAULT)
+            max_pages = info->v4v_max_ring_memkb >> (XC_PAGE_SHIFT - 10);
+
+        rc = xc_v4v_set_quota(ctx->xch, domid, max_rings, max_pages);
+        if (rc) {
+            LOG(ERROR, "Failed to set v4v quota to %u rings %"PRIu64" pages (%d)",
+                max_rings, max_pages, rc);
+            return ERROR_FAIL;
+        }
+    }
+
     libxl_cpuid_apply_policy(ctx, domid);
     if (info->cpuid != NULL)
         libxl_cpuid_set(ctx, domid, info->cpuid);
@@ -373,6 +390,7 @@ int libxl__build_post(libxl__gc *gc, uint32_t domid,
         return ERROR_FAIL;
     }
 
+    LOG_MILESTONE(domid, "xenstore");
     vm_path = xs_read(ctx->xsh, XBT_NULL, GCSPRINTF("%s/vm", dom_path), NULL);
 retry_transaction:
     t = xs_transaction_start(ctx->xsh);
@@ -385,6 +403,7 @@ retry_transaction:
         if (errno == EAGAIN)
             goto retry_transaction;
     xs_introduce_domain(ctx->xsh, domid, state->store_mfn, state->store_port);
+    LOG_MILESTONE(domid, "introduced");
     free(vm_path);
     return 0;
 }
@@ -468,10 +487,12 @@ int libxl__build_pv(libxl__gc *gc, uint32_t domid,
         LOGE(ERROR, "xc_dom_mem_init failed");
         goto out;
     }
+    LOG_MILESTONE(domid, "populate");
     if ( (ret = xc_dom_boot_mem_init(dom)) != 0 ) {
         LOGE(ERROR, "xc_dom_boot_mem_init failed");
         goto out;
     }
+    LOG_MILESTONE(domid, "populated");
     if ( (ret = libxl__arch_domain_finalise_hw_description(gc, info, dom)) != 0 ) {
         LOGE(ERROR, "libxl__arch_domain_finalise_hw_description failed");
         goto out;
@@ -661,6 +682,110 @@ out:
     return rc;
 }
 
+/*
+ * With vnuma_auto, a guest NUMA placement spread over several nodes gets
+ * one virtual node per physical one: its memory split evenly between them,
+ * its vcpus in contiguous blocks, each softly affine to its node's cpus.
+ * Returns 0, with args->nr_vnodes left 0, when there is nothing to do.
+ */
+static int hvm_build_vnuma(libxl__gc *gc, uint32_t domid,
+                           libxl_domain_build_info *info,
+                           struct xc_hvm_build_args *args)
+{
+    libxl_ctx *ctx = libxl__gc_owner(gc);
+    libxl_numainfo *ninfo = NULL;
+    libxl_bitmap cpumap;
+    uint64_t *vnode_size, chunk;
+    unsigned int nr, i, j, n;
+    int nr_nodes = 0, rc;
+
+    libxl_bitmap_init(&cpumap);
+
+    if (!libxl_defbool_val(info->vnuma_auto) || !info->nodemap.size)
+        return 0;
+    nr = libxl_bitmap_count_set(&info->nodemap);
+    if (nr <= 1)
+        return 0;
+
+    if (args->mem_target < args->mem_size) {
+        LOG(WARN, "vNUMA is not supported with populate-on-demand, "
+                  "not exposing a NUMA topology");
+        return 0;
+    }
+    if (nr > info->max_vcpus) {
+        LOG(WARN, "%u nodes for %d vcpus, not exposing a NUMA topology",
+            nr, info->max_vcpus);
+        return 0;
+    }
+    /* Superpage sized vnodes, the last one taking what is left over */
+    chunk = (args->mem_size / nr) & ~((2ULL << 20) - 1);
+    if (!chunk) {
+        LOG(WARN, "too little memory for %u nodes, "
+                  "not exposing a NUMA topology", nr);
+        return 0;
+    }
+
+    ninfo = libxl_get_numainfo(ctx, &nr_nodes);
+    if (ninfo == NULL)
+        return ERROR_FAIL;
+
+    vnode_size = libxl__calloc(gc, nr, sizeof(*vnode_size));
+    args->vnode_to_pnode = libxl__calloc(gc, nr,
+                                         sizeof(*args->vnode_to_pnode));
+    args->vdistance = libxl__calloc(gc, nr * nr, sizeof(*args->vdistance));
+    args->vcpu_to_vnode = libxl__calloc(gc, info->max_vcpus,
+                                        sizeof(*args->vcpu_to_vnode));
+
+    n = 0;
+    libxl_for_each_set_bit(i, info->nodemap) {
+        args->vnode_to_pnode[n] = i;
+        vnode_size[n] = chunk;
+        n++;
+    }
+    vnode_size[nr - 1] = args->mem_size - chunk * (nr - 1);
+
+    for (i = 0; i < nr; i++) {
+        unsigned int p = args->vnode_to_pnode[i];
+
+        for (j = 0; j < nr; j++) {
+            unsigned int q = args->vnode_to_pnode[j];
+
+            if (p < nr_nodes && q < ninfo[p].num_dists)
+                args->vdistance[i * nr + j] = ninfo[p].dists[q];
+            else
+                args->vdistance[i * nr + j] = (i == j) ? 10 : 20;
+        }
+    }
+
+    rc = libxl_cpu_bitmap_alloc(ctx, &cpumap, 0);
+    if (rc)
+        goto out;
+    for (i = 0; i < info->max_vcpus; i++) {
+        n = i * nr / info->max_vcpus;
+        args->vcpu_to_vnode[i] = n;
+
+        rc = libxl_node_to_cpumap(ctx, args->vnode_to_pnode[n], &cpumap);
+        if (rc)
+            goto out;
+        if (libxl_set_vcpuaffinity(ctx, domid, i, NULL, &cpumap)) {
+            LOG(ERROR, "setting soft affinity failed on vcpu `%u'", i);
+            rc = ERROR_FAIL;
+            goto out;
+        }
+    }
+
+    args->nr_vnodes = nr;
+    args->vnode_size = vnode_size;
+    args->nr_vcpus = info->max_vcpus;
+    LOG(DEBUG, "exposing %u virtual NUMA nodes", nr);
+    rc = 0;
+
+ out:
+    libxl_bitmap_dispose(&cpumap);
+    libxl_numainfo_list_free(ninfo, nr_nodes);
+    return rc;
+}
+
 int libxl__build_hvm(libxl__gc *gc, uint32_t domid,
               libxl_domain_build_info *info,
               libxl__domain_build_state *state)
@@ -683,11 +808,18 @@ int libxl__build_hvm(libxl__gc *gc, uint32_t domid,
         goto out;
     }
 
+    if (hvm_build_vnuma(gc, domid, info, &args)) {
+        LOG(ERROR, "setting up the virtual NUMA topology failed");
+        goto out;
+    }
+
+    LOG_MILESTONE(domid, "populate");
     ret = xc_hvm_build(ctx->xch, domid, &args);
     if (ret) {
         LOGEV(ERROR, ret, "hvm building failed");
         goto out;
     }
+    LOG_MILESTONE(domid, "populated");
 
     ret = hvm_build_set_params(ctx->xch, domid, info, state->store_port,
                                &state->store_mfn, state->console_port,
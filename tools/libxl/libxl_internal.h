@@ -2949,6 +2949,13 @@ _hidden const char *libxl__device_model_savefile(libxl__gc *gc, uint32_t domid);
 #define LOGE(l,f, ...)    LIBXL__LOG_ERRNO(CTX,XTL_##l,(f),##__VA_ARGS__)
 #define LOGEV(l,e,f, ...) LIBXL__LOG_ERRNOVAL(CTX,XTL_##l,(e),(f),##__VA_ARGS__)
 
+/*
+ * Points reached during domain creation, logged at DEBUG for tools
+ * which time them (xl boot-bench).  The message format is fixed.
+ */
+#define LOG_MILESTONE(domid, what) \
+    LOG(DEBUG, "create milestone dom%u %s", (uint32_t)(domid), (what))
+
 
 /* Locking functions.  See comment for "lock" member of libxl__ctx. */
 
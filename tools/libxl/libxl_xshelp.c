@@ -47,22 +47,32 @@ int libxl__xs_writev_perms(libxl__gc *gc, xs_transaction_t t,
                            unsigned int num_perms)
 {
     libxl_ctx *ctx = libxl__gc_owner(gc);
+    struct xs_batch *b;
     char *path;
-    int i;
+    int i, rc = 0;
 
     if (!kvs)
         return 0;
 
+    /* One round trip to xenstored for all of them */
+    b = xs_batch_start(ctx->xsh);
+    if (!b)
+        return -1;
+
     for (i = 0; kvs[i] != NULL; i += 2) {
         path = libxl__sprintf(gc, "%s/%s", dir, kvs[i]);
         if (path && kvs[i + 1]) {
             int length = strlen(kvs[i + 1]);
-            xs_write(ctx->xsh, t, path, kvs[i + 1], length);
+            xs_batch_write(b, t, path, kvs[i + 1], length);
             if (perms)
-                xs_set_permissions(ctx->xsh, t, path, perms, num_perms);
+                xs_batch_set_permissions(b, t, path, perms, num_perms);
         }
     }
-    return 0;
+
+    if (!xs_batch_send(b))
+        rc = -1;
+    xs_batch_free(b);
+    return rc;
 }
 
 int libxl__xs_writev(libxl__gc *gc, xs_transaction_t t,
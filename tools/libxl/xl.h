@@ -16,6 +16,7 @@
 #define XL_H
 
 #include <assert.h>
+#include <stdint.h>
 
 #include "_paths.h"
 #include "xentoollog.h"
@@ -48,6 +49,22 @@ int main_restore(int argc, char **argv);
 int main_migrate_receive(int argc, char **argv);
 int main_save(int argc, char **argv);
 int main_migrate(int argc, char **argv);
+
+/* xl_streams.c: migration data over parallel TCP streams */
+#define MIGRATE_STREAMS_MAX   16
+#define MIGRATE_STREAMS_TOKEN 16
+struct migrate_streams;
+int migrate_streams_listen(uint16_t *port, uint8_t *token);
+struct migrate_streams *migrate_streams_accept(int listen_fd,
+                                               unsigned int nr,
+                                               const uint8_t *token,
+                                               int *data_fd);
+struct migrate_streams *migrate_streams_connect(const char *host,
+                                                uint16_t port,
+                                                const uint8_t *token,
+                                                unsigned int nr,
+                                                int *data_fd);
+int migrate_streams_finish(struct migrate_streams *ms);
 #endif
 int main_dump_core(int argc, char **argv);
 int main_pause(int argc, char **argv);
@@ -67,6 +84,8 @@ int main_memset(int argc, char **argv);
 int main_sched_credit(int argc, char **argv);
 int main_sched_credit2(int argc, char **argv);
 int main_sched_sedf(int argc, char **argv);
+int main_sched_rtds(int argc, char **argv);
+int main_sched_stats(int argc, char **argv);
 int main_domid(int argc, char **argv);
 int main_domname(int argc, char **argv);
 int main_rename(int argc, char **argv);
@@ -110,6 +129,7 @@ int main_loadpolicy(int argc, char **argv);
 int main_remus(int argc, char **argv);
 #endif
 int main_devd(int argc, char **argv);
+int main_boot_bench(int argc, char **argv);
 
 void help(const char *command);
 
@@ -97,6 +97,12 @@ static const char migrate_receiver_ready[]=
     "domain received, ready to unpause";
 static const char migrate_permission_to_go[]=
     "domain is yours, you are cleared to unpause";
+static const char migrate_streams_offer[]=
+    "xl migration receiver streams on";
+  /* followed by the port, 2 bytes in network byte order, and the
+   * MIGRATE_STREAMS_TOKEN bytes of the token to connect them with.
+   * Only sent if migrate-receive was given --streams.
+   */
 static const char migrate_report[]=
     "my copy unpause results are as follows";
   /* followed by one byte:
@@ -151,6 +157,7 @@ struct domain_create {
     const char *extra_config; /* extra config string */
     const char *restore_file;
     int migrate_fd; /* -1 means none */
+    struct migrate_streams *migrate_streams; /* feeding migrate_fd, or NULL */
     char **migration_domname_r; /* from malloc */
 };
 
@@ -777,6 +784,8 @@ static void parse_config_data(const char *config_source,
         b_info->sched_params.period = l;
     if (!xlu_cfg_get_long (config, "slice", &l, 0))
         b_info->sched_params.slice = l;
+    if (!xlu_cfg_get_long (config, "budget", &l, 0))
+        b_info->sched_params.budget = l;
     if (!xlu_cfg_get_long (config, "latency", &l, 0))
         b_info->sched_params.latency = l;
     if (!xlu_cfg_get_long (config, "extratime", &l, 0))
@@ -841,6 +850,8 @@ static void parse_config_data(const char *config_source,
         libxl_defbool_set(&b_info->numa_placement, false);
     }
 
+    xlu_cfg_get_defbool(config, "vnuma_auto", &b_info->vnuma_auto, 0);
+
     if (!xlu_cfg_get_long (config, "memory", &l, 0)) {
         b_info->max_memkb = l * 1024;
         b_info->target_memkb = b_info->max_memkb;
@@ -928,6 +939,12 @@ static void parse_config_data(const char *config_source,
     if (!xlu_cfg_get_long(config, "max_event_channels", &l, 0))
         b_info->event_channels = l;
 
+    if (!xlu_cfg_get_long(config, "v4v_max_rings", &l, 0))
+        b_info->v4v_max_rings = l;
+
+    if (!xlu_cfg_get_long(config, "v4v_max_ring_mem", &l, 0))
+        b_info->v4v_max_ring_memkb = l * 1024;
+
     xlu_cfg_get_defbool(config, "driver_domain", &c_info->driver_domain, 0);
 
     switch(b_info->type) {
@@ -954,6 +971,7 @@ static void parse_config_data(const char *config_source,
         xlu_cfg_get_defbool(config, "viridian", &b_info->u.hvm.viridian, 0);
         xlu_cfg_get_defbool(config, "hpet", &b_info->u.hvm.hpet, 0);
         xlu_cfg_get_defbool(config, "vpt_align", &b_info->u.hvm.vpt_align, 0);
+        xlu_cfg_get_defbool(config, "vpt_merge", &b_info->u.hvm.vpt_merge, 0);
 
         if (!xlu_cfg_get_long(config, "timer_mode", &l, 1)) {
             const char *s = libxl_timer_mode_to_string(l);
@@ -2184,6 +2202,17 @@ start:
     if ( ret )
         goto error_out;
 
+    if (dom_info->migrate_streams) {
+        /* All the data was taken, the streams must have ended cleanly */
+        ret = migrate_streams_finish(dom_info->migrate_streams);
+        dom_info->migrate_streams = NULL;
+        if (ret) {
+            fprintf(stderr, "migration streams did not end cleanly\n");
+            ret = ERROR_FAIL;
+            goto error_out;
+        }
+    }
+
     ret = libxl_userdata_store(ctx, domid, "xl",
                                     config_data, config_len);
     if (ret) {
@@ -3513,11 +3542,44 @@ static void migration_child_report(int recv_fd) {
     }
 }
 
+/*
+ * Connect the nr_streams streams the receiver offers after its banner.
+ * The domain data is then written to *data_fd, the handshake stays on
+ * send_fd and recv_fd.
+ */
+static struct migrate_streams *migrate_streams_begin(int recv_fd,
+                                                     const char *host,
+                                                     unsigned int nr_streams,
+                                                     const char *rune,
+                                                     int *data_fd)
+{
+    struct migrate_streams *ms;
+    uint8_t offer[2 + MIGRATE_STREAMS_TOKEN];
+    uint16_t port;
+
+    if (migrate_read_fixedmessage(recv_fd, migrate_streams_offer,
+                                  sizeof(migrate_streams_offer),
+                                  "streams offer", rune) ||
+        libxl_read_exactly(ctx, recv_fd, offer, sizeof(offer),
+                           "migration receiver stream", "streams port"))
+        return NULL;
+
+    port = (offer[0] << 8) | offer[1];
+    ms = migrate_streams_connect(host, port, offer + 2, nr_streams, data_fd);
+    if (ms)
+        fprintf(stderr, "migration sender: Sending on %u streams to %s"
+                " port %u.\n", nr_streams, host, port);
+    return ms;
+}
+
 static void migrate_do_preamble(int send_fd, int recv_fd, pid_t child,
                                 uint8_t *config_data, int config_len,
-                                const char *rune)
+                                const char *rune, const char *streams_host,
+                                unsigned int nr_streams,
+                                struct migrate_streams **ms_r, int *data_fd)
 {
     int rc = 0;
+    int fd = send_fd;
 
     if (send_fd < 0 || recv_fd < 0) {
         fprintf(stderr, "migrate_do_preamble: invalid file descriptors\n");
@@ -3533,17 +3595,31 @@ static void migrate_do_preamble(int send_fd, int recv_fd, pid_t child,
         exit(-rc);
     }
 
-    save_domain_core_writeconfig(send_fd, "migration stream",
+    if (nr_streams) {
+        *ms_r = migrate_streams_begin(recv_fd, streams_host, nr_streams,
+                                      rune, &fd);
+        if (!*ms_r) {
+            close(send_fd);
+            migration_child_report(recv_fd);
+            exit(1);
+        }
+    }
+    if (data_fd)
+        *data_fd = fd;
+
+    save_domain_core_writeconfig(fd, "migration stream",
                                  config_data, config_len);
 
 }
 
 static void migrate_domain(uint32_t domid, const char *rune, int debug,
-                           const char *override_config_file)
+                           const char *override_config_file,
+                           const char *streams_host, unsigned int nr_streams)
 {
     pid_t child = -1;
     int rc;
-    int send_fd = -1, recv_fd = -1;
+    int send_fd = -1, recv_fd = -1, data_fd = -1;
+    struct migrate_streams *ms = NULL;
     char *away_domname;
     char rc_buf;
     uint8_t *config_data;
@@ -3561,13 +3637,22 @@ static void migrate_domain(uint32_t domid, const char *rune, int debug,
     child = create_migration_child(rune, &send_fd, &recv_fd);
 
     migrate_do_preamble(send_fd, recv_fd, child, config_data, config_len,
-                        rune);
+                        rune, streams_host, nr_streams, &ms, &data_fd);
 
     xtl_stdiostream_adjust_flags(logger, XTL_STDIOSTREAM_HIDE_PROGRESS, 0);
 
     if (debug)
         flags |= LIBXL_SUSPEND_DEBUG;
-    rc = libxl_domain_suspend(ctx, domid, send_fd, flags, NULL);
+    rc = libxl_domain_suspend(ctx, domid, data_fd, flags, NULL);
+    if (ms) {
+        /* The end of the data, then wait for the streams to be sent */
+        close(data_fd);
+        if (migrate_streams_finish(ms) && !rc) {
+            fprintf(stderr, "migration sender: sending on the streams"
+                    " failed\n");
+            rc = ERROR_FAIL;
+        }
+    }
     if (rc) {
         fprintf(stderr, "migration sender: libxl_domain_suspend failed"
                 " (rc=%d)\n", rc);
@@ -3679,7 +3764,8 @@ static void migrate_domain(uint32_t domid, const char *rune, int debug,
 }
 
 static void migrate_receive(int debug, int daemonize, int monitor,
-                            int send_fd, int recv_fd, int remus)
+                            int send_fd, int recv_fd, int remus,
+                            unsigned int nr_streams)
 {
     uint32_t domid;
     int rc, rc2;
@@ -3698,11 +3784,39 @@ static void migrate_receive(int debug, int daemonize, int monitor,
                      "migration ack stream", "banner") );
 
     memset(&dom_info, 0, sizeof(dom_info));
+    dom_info.migrate_fd = recv_fd;
+
+    if (nr_streams) {
+        uint8_t offer[2 + MIGRATE_STREAMS_TOKEN];
+        uint16_t port;
+        int listen_fd;
+
+        listen_fd = migrate_streams_listen(&port, offer + 2);
+        if (listen_fd < 0)
+            exit(1);
+        offer[0] = port >> 8;
+        offer[1] = port;
+        CHK_ERRNOVAL(libxl_write_exactly(
+                         ctx, send_fd, migrate_streams_offer,
+                         sizeof(migrate_streams_offer),
+                         "migration ack stream", "streams offer") );
+        CHK_ERRNOVAL(libxl_write_exactly(
+                         ctx, send_fd, offer, sizeof(offer),
+                         "migration ack stream", "streams port") );
+
+        dom_info.migrate_streams =
+            migrate_streams_accept(listen_fd, nr_streams, offer + 2,
+                                   &dom_info.migrate_fd);
+        if (!dom_info.migrate_streams)
+            exit(1);
+        fprintf(stderr, "migration target: Receiving on %u streams.\n",
+                nr_streams);
+    }
+
     dom_info.debug = debug;
     dom_info.daemonize = daemonize;
     dom_info.monitor = monitor;
     dom_info.paused = 1;
-    dom_info.migrate_fd = recv_fd;
     dom_info.migration_domname_r = &migration_domname;
     dom_info.checkpointed_stream = remus;
 
@@ -3887,9 +4001,14 @@ int main_restore(int argc, char **argv)
 int main_migrate_receive(int argc, char **argv)
 {
     int debug = 0, daemonize = 1, monitor = 1, remus = 0;
-    int opt;
+    int opt, nr_streams = 0;
+    static struct option opts[] = {
+        {"streams", 1, 0, 0x100},
+        COMMON_LONG_OPTS,
+        {0, 0, 0, 0}
+    };
 
-    SWITCH_FOREACH_OPT(opt, "Fedr", NULL, "migrate-receive", 0) {
+    SWITCH_FOREACH_OPT(opt, "Fedr", opts, "migrate-receive", 0) {
     case 'F':
         daemonize = 0;
         break;
@@ -3903,15 +4022,19 @@ int main_migrate_receive(int argc, char **argv)
     case 'r':
         remus = 1;
         break;
+    case 0x100:
+        nr_streams = strtol(optarg, NULL, 10);
+        break;
     }
 
-    if (argc-optind != 0) {
+    if (argc-optind != 0 || nr_streams < 0 ||
+        nr_streams > MIGRATE_STREAMS_MAX || (remus && nr_streams)) {
         help("migrate-receive");
         return 2;
     }
     migrate_receive(debug, daemonize, monitor,
                     STDOUT_FILENO, STDIN_FILENO,
-                    remus);
+                    remus, nr_streams);
 
     return 0;
 }
@@ -3953,11 +4076,15 @@ int main_migrate(int argc, char **argv)
     uint32_t domid;
     const char *config_filename = NULL;
     const char *ssh_command = "ssh";
+    const char *streams_host = NULL;
     char *rune = NULL;
     char *host;
-    int opt, daemonize = 1, monitor = 1, debug = 0;
+    char streams_buf[32] = "";
+    int opt, daemonize = 1, monitor = 1, debug = 0, nr_streams = 0;
     static struct option opts[] = {
         {"debug", 0, 0, 0x100},
+        {"streams", 1, 0, 0x101},
+        {"streams-host", 1, 0, 0x102},
         COMMON_LONG_OPTS,
         {0, 0, 0, 0}
     };
@@ -3979,11 +4106,36 @@ int main_migrate(int argc, char **argv)
     case 0x100:
         debug = 1;
         break;
+    case 0x101:
+        nr_streams = strtol(optarg, NULL, 10);
+        if (nr_streams < 1 || nr_streams > MIGRATE_STREAMS_MAX) {
+            fprintf(stderr, "The number of streams must be from 1 to %d.\n",
+                    MIGRATE_STREAMS_MAX);
+            return 2;
+        }
+        break;
+    case 0x102:
+        streams_host = optarg;
+        break;
     }
 
     domid = find_domain(argv[optind]);
     host = argv[optind + 1];
 
+    if (nr_streams) {
+        /* The streams go to the ssh host, without the user */
+        if (!streams_host && ssh_command[0]) {
+            streams_host = strchr(host, '@');
+            streams_host = streams_host ? streams_host + 1 : host;
+        }
+        if (!streams_host) {
+            fprintf(stderr, "--streams-host is needed without ssh.\n");
+            return 2;
+        }
+        snprintf(streams_buf, sizeof(streams_buf), " --streams=%d",
+                 nr_streams);
+    }
+
     bool pass_tty_arg = progress_use_cr || (isatty(2) > 0);
 
     if (!ssh_command[0]) {
@@ -4000,16 +4152,18 @@ int main_migrate(int argc, char **argv)
         } else {
             verbose_len = (minmsglevel_default - minmsglevel) + 2;
         }
-        if (asprintf(&rune, "exec %s %s xl%s%.*s migrate-receive%s%s",
+        if (asprintf(&rune, "exec %s %s xl%s%.*s migrate-receive%s%s%s",
                      ssh_command, host,
                      pass_tty_arg ? " -t" : "",
                      verbose_len, verbose_buf,
                      daemonize ? "" : " -e",
-                     debug ? " -d" : "") < 0)
+                     debug ? " -d" : "",
+                     streams_buf) < 0)
             return 1;
     }
 
-    migrate_domain(domid, rune, debug, config_filename);
+    migrate_domain(domid, rune, debug, config_filename,
+                   streams_host, nr_streams);
     return 0;
 }
 #endif
@@ -4606,13 +4760,9 @@ static int vcpupin(uint32_t domid, const char *vcpu, char *cpu)
             fprintf(stderr, "libxl_list_vcpu failed.\n");
             goto out;
         }
-        for (i = 0; i < nb_vcpu; i++) {
-            if (libxl_set_vcpuaffinity(ctx, domid, vcpuinfo[i].vcpuid,
-                                       &cpumap, NULL)) {
-                fprintf(stderr, "libxl_set_vcpuaffinity failed"
-                                " on vcpu `%u'.\n", vcpuinfo[i].vcpuid);
-            }
-        }
+        /* vcpus are listed by id, from 0 onwards */
+        if (libxl_set_vcpuaffinity_all(ctx, domid, nb_vcpu, &cpumap, NULL))
+            fprintf(stderr, "libxl_set_vcpuaffinity_all failed.\n");
         libxl_vcpuinfo_list_free(vcpuinfo, nb_vcpu);
     }
 
@@ -5098,6 +5248,31 @@ static int sched_sedf_domain_output(
     return 0;
 }
 
+static int sched_rtds_domain_output(
+    int domid)
+{
+    char *domname;
+    libxl_domain_sched_params scinfo;
+    int rc;
+
+    if (domid < 0) {
+        printf("%-33s %4s %9s %9s\n", "Name", "ID", "Period", "Budget");
+        return 0;
+    }
+    rc = sched_domain_get(LIBXL_SCHEDULER_RTDS, domid, &scinfo);
+    if (rc)
+        return rc;
+    domname = libxl_domid_to_name(ctx, domid);
+    printf("%-33s %4d %9d %9d\n",
+        domname,
+        domid,
+        scinfo.period,
+        scinfo.budget);
+    free(domname);
+    libxl_domain_sched_params_dispose(&scinfo);
+    return 0;
+}
+
 static int sched_default_pool_output(uint32_t poolid)
 {
     char *poolname;
@@ -5465,6 +5640,156 @@ int main_sched_sedf(int argc, char **argv)
     return 0;
 }
 
+int main_sched_rtds(int argc, char **argv)
+{
+    const char *dom = NULL;
+    const char *cpupool = NULL;
+    int period = 0, opt_p = 0;
+    int budget = 0, opt_b = 0;
+    int opt, rc;
+    static struct option opts[] = {
+        {"domain", 1, 0, 'd'},
+        {"period", 1, 0, 'p'},
+        {"budget", 1, 0, 'b'},
+        {"cpupool", 1, 0, 'c'},
+        COMMON_LONG_OPTS,
+        {0, 0, 0, 0}
+    };
+
+    SWITCH_FOREACH_OPT(opt, "d:p:b:c:h", opts, "sched-rtds", 0) {
+    case 'd':
+        dom = optarg;
+        break;
+    case 'p':
+        period = strtol(optarg, NULL, 10);
+        opt_p = 1;
+        break;
+    case 'b':
+        budget = strtol(optarg, NULL, 10);
+        opt_b = 1;
+        break;
+    case 'c':
+        cpupool = optarg;
+        break;
+    }
+
+    if (cpupool && (dom || opt_p || opt_b)) {
+        fprintf(stderr, "Specifying a cpupool is not allowed with other "
+                "options.\n");
+        return 1;
+    }
+    if (!dom && (opt_p || opt_b)) {
+        fprintf(stderr, "Must specify a domain.\n");
+        return 1;
+    }
+
+    if (!dom) { /* list all domain's rtds scheduler info */
+        return -sched_domain_output(LIBXL_SCHEDULER_RTDS,
+                                    sched_rtds_domain_output,
+                                    sched_default_pool_output,
+                                    cpupool);
+    } else {
+        uint32_t domid = find_domain(dom);
+
+        if (!opt_p && !opt_b) { /* output rtds scheduler info */
+            sched_rtds_domain_output(-1);
+            return -sched_rtds_domain_output(domid);
+        } else { /* set rtds scheduler paramaters */
+            libxl_domain_sched_params scinfo;
+            libxl_domain_sched_params_init(&scinfo);
+            scinfo.sched = LIBXL_SCHEDULER_RTDS;
+            if (opt_p)
+                scinfo.period = period;
+            if (opt_b)
+                scinfo.budget = budget;
+            rc = sched_domain_set(domid, &scinfo);
+            libxl_domain_sched_params_dispose(&scinfo);
+            if (rc)
+                return -rc;
+        }
+    }
+
+    return 0;
+}
+
+static void print_domain_sched_stats(uint32_t domid, int buckets)
+{
+    libxl_sched_vcpustats *stats;
+    char *domname;
+    int i, j, nb_vcpu;
+
+    stats = libxl_list_sched_vcpustats(ctx, domid, &nb_vcpu);
+    if (!stats) {
+        fprintf(stderr, "libxl_list_sched_vcpustats failed.\n");
+        return;
+    }
+
+    domname = libxl_domid_to_name(ctx, domid);
+    for (i = 0; i < nb_vcpu; i++) {
+        libxl_sched_vcpustats *s = &stats[i];
+
+        printf("%-32s %5u %5u %10"PRIu64" %10"PRIu64" %10"PRIu64
+               " %10"PRIu64" %9"PRIu64" %9"PRIu64"\n",
+               domname, domid, s->vcpuid, s->wakeups, s->preemptions,
+               s->migrations, s->waits,
+               s->waits ? s->wait_ns / s->waits / 1000 : 0,
+               s->wait_max_ns / 1000);
+        if (!buckets)
+            continue;
+        /* bucket j holds the waits under 2^(10+j)ns, the last one the rest */
+        for (j = 0; j < s->num_wait_hist; j++) {
+            if (!s->wait_hist[j])
+                continue;
+            if (j < s->num_wait_hist - 1)
+                printf("%44s < %10"PRIu64" ns %10"PRIu64"\n", "",
+                       UINT64_C(1) << (10 + j), s->wait_hist[j]);
+            else
+                printf("%44s >= %9"PRIu64" ns %10"PRIu64"\n", "",
+                       UINT64_C(1) << (9 + j), s->wait_hist[j]);
+        }
+    }
+    free(domname);
+
+    libxl_sched_vcpustats_list_free(stats, nb_vcpu);
+}
+
+int main_sched_stats(int argc, char **argv)
+{
+    libxl_dominfo *dominfo;
+    int opt, i, nb_domain, buckets = 0;
+    static struct option opts[] = {
+        {"buckets", 0, 0, 'b'},
+        COMMON_LONG_OPTS,
+        {0, 0, 0, 0}
+    };
+
+    SWITCH_FOREACH_OPT(opt, "b", opts, "sched-stats", 0) {
+    case 'b':
+        buckets = 1;
+        break;
+    }
+
+    printf("%-32s %5s %5s %10s %10s %10s %10s %9s %9s\n",
+           "Name", "ID", "VCPU", "Wakeups", "Preempt", "Migrate", "Waits",
+           "Avg(us)", "Max(us)");
+    if (optind >= argc) {
+        if (!(dominfo = libxl_list_domain(ctx, &nb_domain))) {
+            fprintf(stderr, "libxl_list_domain failed.\n");
+            return 1;
+        }
+
+        for (i = 0; i < nb_domain; i++)
+            print_domain_sched_stats(dominfo[i].domid, buckets);
+
+        libxl_dominfo_list_free(dominfo, nb_domain);
+    } else {
+        for (i = optind; i < argc; i++)
+            print_domain_sched_stats(find_domain(argv[i]), buckets);
+    }
+
+    return 0;
+}
+
 int main_domid(int argc, char **argv)
 {
     uint32_t domid;
@@ -7225,7 +7550,7 @@ int main_remus(int argc, char **argv)
         child = create_migration_child(rune, &send_fd, &recv_fd);
 
         migrate_do_preamble(send_fd, recv_fd, child, config_data, config_len,
-                            rune);
+                            rune, NULL, 0, NULL, NULL);
 
         if (ssh_command[0])
             free(rune);
@@ -7277,6 +7602,286 @@ out:
     return ret;
 }
 
+/*
+ * boot-bench: create a number of domains from one config file at once,
+ * as after a host reboot, and time each of them through the milestones
+ * libxl logs on the way (LOG_MILESTONE).
+ */
+static const char *const bench_milestones[] = {
+    "made", "build", "populate", "populated", "xenstore", "introduced",
+    "devices", "devicemodel", "dm-up", "complete", "unpaused",
+};
+#define BENCH_NR_MILESTONES \
+    (sizeof(bench_milestones) / sizeof(bench_milestones[0]))
+
+struct bench_domain {
+    uint32_t domid;
+    int rc, done;
+    /* ms since the start, < 0 if not reached */
+    double at[BENCH_NR_MILESTONES];
+};
+
+static struct bench_domain *bench_doms;
+static int bench_nr_doms;
+/* The one libxl_domain_create_new is called for, which makes it at once */
+static int bench_creating = -1;
+static struct timespec bench_start;
+
+static double bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec - bench_start.tv_sec) * 1000.0 +
+           (ts.tv_nsec - bench_start.tv_nsec) / 1000000.0;
+}
+
+static void bench_milestone(uint32_t domid, const char *what)
+{
+    int i, m;
+
+    for (m = 0; m < BENCH_NR_MILESTONES; m++)
+        if (!strcmp(bench_milestones[m], what))
+            break;
+    if (m == BENCH_NR_MILESTONES)
+        return;
+
+    /* The domid is only known once the domain is made: take it then */
+    if (!m && bench_creating >= 0) {
+        bench_doms[bench_creating].domid = domid;
+        bench_doms[bench_creating].at[m] = bench_now();
+        return;
+    }
+
+    for (i = 0; i < bench_nr_doms; i++)
+        if (bench_doms[i].domid == domid && !bench_doms[i].done) {
+            if (bench_doms[i].at[m] < 0)
+                bench_doms[i].at[m] = bench_now();
+            return;
+        }
+}
+
+/* Picks the milestones out of libxl's log, and passes everything on */
+static void bench_vmessage(xentoollog_logger *lg, xentoollog_level level,
+                           int errnoval, const char *context,
+                           const char *format, va_list al)
+{
+    char msg[512], what[32];
+    const char *p;
+    unsigned int domid;
+    va_list copy;
+
+    va_copy(copy, al);
+    vsnprintf(msg, sizeof(msg), format, copy);
+    va_end(copy);
+
+    if ((p = strstr(msg, "create milestone dom")) &&
+        sscanf(p, "create milestone dom%u %31s", &domid, what) == 2)
+        bench_milestone(domid, what);
+
+    xtl_log((xentoollog_logger *)logger, level, errnoval, context, "%s", msg);
+}
+
+static void bench_progress(xentoollog_logger *lg, const char *context,
+                           const char *doing_what, int percent,
+                           unsigned long done, unsigned long total)
+{
+}
+
+static void bench_destroy(xentoollog_logger *lg)
+{
+}
+
+static void bench_print(void)
+{
+    double min, max, sum;
+    int i, m, n;
+
+    printf("%-8s %5s", "Domain", "rc");
+    for (m = 0; m < BENCH_NR_MILESTONES; m++)
+        printf(" %11s", bench_milestones[m]);
+    printf("\n");
+
+    for (i = 0; i < bench_nr_doms; i++) {
+        printf("%-8d %5d", bench_doms[i].domid == INVALID_DOMID ?
+               -1 : (int)bench_doms[i].domid, bench_doms[i].rc);
+        for (m = 0; m < BENCH_NR_MILESTONES; m++)
+            if (bench_doms[i].at[m] < 0)
+                printf(" %11s", "-");
+            else
+                printf(" %11.1f", bench_doms[i].at[m]);
+        printf("\n");
+    }
+
+    printf("\n%-12s %9s %9s %9s %5s\n", "Phase (ms)", "min", "avg", "max",
+           "n");
+    for (m = 1; m < BENCH_NR_MILESTONES; m++) {
+        min = max = sum = 0;
+        n = 0;
+        for (i = 0; i < bench_nr_doms; i++) {
+            int prev;
+            double d;
+
+            /* The time since the last milestone this domain reached */
+            if (bench_doms[i].at[m] < 0)
+                continue;
+            for (prev = m - 1; prev >= 0; prev--)
+                if (bench_doms[i].at[prev] >= 0)
+                    break;
+            if (prev < 0)
+                continue;
+            d = bench_doms[i].at[m] - bench_doms[i].at[prev];
+            if (!n || d < min)
+                min = d;
+            if (!n || d > max)
+                max = d;
+            sum += d;
+            n++;
+        }
+        if (n)
+            printf("%-12s %9.1f %9.1f %9.1f %5d\n", bench_milestones[m],
+                   min, sum / n, max, n);
+    }
+}
+
+int main_boot_bench(int argc, char **argv)
+{
+    const char *filename;
+    void *config_data = NULL;
+    int config_len = 0;
+    int i, m, nr = 1, paused = 0, destroy = 0, left, opt, rc, ret = 1;
+    libxl_domain_config *d_configs = NULL;
+    libxl_asyncop_how how;
+    libxl_event *event;
+    libxl_ctx *bctx = NULL;
+    xentoollog_logger bench_logger = {
+        .vmessage = bench_vmessage,
+        .progress = bench_progress,
+        .destroy = bench_destroy,
+    };
+    char *name;
+
+    SWITCH_FOREACH_OPT(opt, "n:pd", NULL, "boot-bench", 1) {
+    case 'n':
+        nr = atoi(optarg);
+        break;
+    case 'p':
+        paused = 1;
+        break;
+    case 'd':
+        destroy = 1;
+        break;
+    }
+
+    if (nr <= 0) {
+        fprintf(stderr, "invalid number of domains\n");
+        return 1;
+    }
+    filename = argv[optind];
+
+    if (libxl_read_file_contents(ctx, filename, &config_data, &config_len)) {
+        fprintf(stderr, "Failed to read config file: %s: %s\n",
+                filename, strerror(errno));
+        return 1;
+    }
+
+    /* A context of its own, to see the log of the creations */
+    if (libxl_ctx_alloc(&bctx, LIBXL_VERSION, 0, &bench_logger)) {
+        fprintf(stderr, "cannot init boot-bench context\n");
+        goto out;
+    }
+
+    bench_doms = xmalloc(nr * sizeof(*bench_doms));
+    d_configs = xmalloc(nr * sizeof(*d_configs));
+    bench_nr_doms = nr;
+
+    for (i = 0; i < nr; i++) {
+        libxl_domain_config_init(&d_configs[i]);
+        parse_config_data(filename, config_data, config_len, &d_configs[i]);
+        if (asprintf(&name, "%s-%d", d_configs[i].c_info.name, i) < 0) {
+            perror("asprintf");
+            exit(1);
+        }
+        free(d_configs[i].c_info.name);
+        d_configs[i].c_info.name = name;
+
+        bench_doms[i].domid = INVALID_DOMID;
+        bench_doms[i].rc = ERROR_FAIL;
+        bench_doms[i].done = 0;
+        for (m = 0; m < BENCH_NR_MILESTONES; m++)
+            bench_doms[i].at[m] = -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &bench_start);
+
+    left = 0;
+    for (i = 0; i < nr; i++) {
+        how.callback = NULL;
+        how.u.for_event = i;
+        bench_creating = i;
+        rc = libxl_domain_create_new(bctx, &d_configs[i],
+                                     &bench_doms[i].domid, &how, NULL);
+        bench_creating = -1;
+        if (rc) {
+            fprintf(stderr, "failed to start creating %s: %d\n",
+                    d_configs[i].c_info.name, rc);
+            bench_doms[i].rc = rc;
+            bench_doms[i].done = 1;
+            continue;
+        }
+        left++;
+    }
+
+    while (left) {
+        rc = libxl_event_wait(bctx, &event, LIBXL_EVENTMASK_ALL, 0, 0);
+        if (rc) {
+            fprintf(stderr, "failed to wait for the creations: %d\n", rc);
+            goto out;
+        }
+        if (event->type == LIBXL_EVENT_TYPE_OPERATION_COMPLETE) {
+            i = event->for_user;
+            bench_doms[i].rc = event->u.operation_complete.rc;
+            if (!bench_doms[i].rc && !paused &&
+                !libxl_domain_unpause(bctx, bench_doms[i].domid))
+                bench_doms[i].at[BENCH_NR_MILESTONES - 1] = bench_now();
+            bench_doms[i].done = 1;
+            left--;
+        }
+        libxl_event_free(bctx, event);
+    }
+
+    for (i = 0; i < nr; i++) {
+        if (bench_doms[i].rc)
+            continue;
+        libxl_userdata_store(ctx, bench_doms[i].domid, "xl",
+                             config_data, config_len);
+    }
+
+    bench_print();
+
+    if (destroy)
+        for (i = 0; i < nr; i++)
+            if (!bench_doms[i].rc)
+                libxl_domain_destroy(ctx, bench_doms[i].domid, 0);
+
+    ret = 0;
+    for (i = 0; i < nr; i++)
+        if (bench_doms[i].rc)
+            ret = 1;
+
+ out:
+    if (bctx)
+        libxl_ctx_free(bctx);
+    if (d_configs)
+        for (i = 0; i < nr; i++)
+            libxl_domain_config_dispose(&d_configs[i]);
+    free(d_configs);
+    free(bench_doms);
+    bench_doms = NULL;
+    free(config_data);
+    return ret;
+}
+
 /*
  * Local variables:
  * mode: C
@@ -160,7 +160,11 @@ struct cmd_spec cmd_table[] = {
       "                migrate-receive [-d -e]\n"
       "-e              Do not wait in the background (on <host>) for the death\n"
       "                of the domain.\n"
-      "--debug         Print huge (!) amount of debug during the migration process."
+      "--debug         Print huge (!) amount of debug during the migration process.\n"
+      "--streams=N     Send the domain over N parallel TCP streams, the\n"
+      "                handshake staying on ssh.\n"
+      "--streams-host=HOST\n"
+      "                Connect the streams to HOST rather than to <host>."
     },
     { "restore",
       &main_restore, 0, 1,
@@ -277,6 +281,21 @@ struct cmd_spec cmd_table[] = {
       "                               --period/--slice)\n"
       "-c CPUPOOL, --cpupool=CPUPOOL  Restrict output to CPUPOOL"
     },
+    { "sched-rtds",
+      &main_sched_rtds, 0, 1,
+      "Get/set rtds scheduler parameters",
+      "[-d <Domain> [-p[=PERIOD]] [-b[=BUDGET]]] [-c CPUPOOL]",
+      "-d DOMAIN, --domain=DOMAIN     Domain to modify\n"
+      "-p PERIOD, --period=PERIOD     Period (us)\n"
+      "-b BUDGET, --budget=BUDGET     Budget (us) in each period\n"
+      "-c CPUPOOL, --cpupool=CPUPOOL  Restrict output to CPUPOOL"
+    },
+    { "sched-stats",
+      &main_sched_stats, 0, 0,
+      "List the scheduling latency of the VCPUs of all/some domains",
+      "[-b] [Domain, ...]",
+      "-b, --buckets                  Show the histogram of the waits"
+    },
     { "domid",
       &main_domid, 0, 0,
       "Convert a domain name to domain id",
@@ -500,6 +519,14 @@ struct cmd_spec cmd_table[] = {
       "[options]",
       "-F                      Run in the foreground",
     },
+    { "boot-bench",
+      &main_boot_bench, 0, 1,
+      "Create domains from <ConfigFile> all at once and time their creation",
+      "<ConfigFile> [options]",
+      "-n N                    Create N domains, named <name>-0 to <name>-N-1.\n"
+      "-p                      Leave the domains paused.\n"
+      "-d                      Destroy the domains afterwards.",
+    },
 };
 
 int cmdtable_len = sizeof(cmd_table)/sizeof(struct cmd_spec);
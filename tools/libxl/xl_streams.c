@@ -0,0 +1,724 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+/*
+ * Migration data over parallel TCP streams.
+ *
+ * The sender's data (the xl header, config and libxl stream) is written
+ * into a pipe, cut into chunks, and chunk k goes down stream k % nr, each
+ * stream having a thread and a socket of its own.  The receiver has one
+ * thread per stream reading chunks ahead and checking them, and a relay
+ * thread taking them in turn from stream k % nr into the pipe the domain
+ * is restored from: no reordering is needed beyond that round robin.
+ *
+ * Every chunk carries its sequence number and a CRC32 of its data.  The
+ * streams are authenticated by a token the receiver handed out over the
+ * migration control channel (ssh), but are not encrypted.
+ */
+
+#include "libxl_osdeps.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "libxl.h"
+#include "xl.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define STREAMS_CHUNK_SIZE   (256 << 10)
+#define STREAMS_DEPTH        4          /* chunks read ahead per stream */
+#define STREAMS_MAGIC        0x584d4331 /* "XMC1" */
+#define STREAMS_ACCEPT_MS    60000
+
+struct streams_hello {
+    uint8_t token[MIGRATE_STREAMS_TOKEN];
+    uint32_t index;                     /* network byte order */
+    uint32_t nr;
+};
+
+/* A len of 0 ends the stream, seq is then the number of chunks sent */
+struct chunk_header {
+    uint32_t magic;                     /* all network byte order */
+    uint32_t len;
+    uint32_t seq_hi, seq_lo;
+    uint32_t crc;
+};
+
+struct chunk {
+    uint8_t *data;
+    uint32_t len;
+    uint64_t seq;
+};
+
+struct stream {
+    struct migrate_streams *ms;
+    unsigned int index;
+    int sock;
+    pthread_t thread;
+    int started;
+    /* Filled chunks are ring[head] to ring[head + count - 1] */
+    struct chunk ring[STREAMS_DEPTH];
+    unsigned int head, count;
+    int done;
+};
+
+struct migrate_streams {
+    int sending;
+    unsigned int nr;
+    struct stream *streams;
+    int fd;                             /* our end of the data pipe */
+    pthread_t relay;
+    int relay_started;
+    uint64_t total;                     /* chunks, once known */
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int error;                          /* errno of the first failure */
+};
+
+static uint32_t crc_table[256];
+
+static void crc_init(void)
+{
+    uint32_t c;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (j = 0; j < 8; j++)
+            c = (c & 1) ? (c >> 1) ^ 0xedb88320 : (c >> 1);
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t chunk_crc32(const uint8_t *p, size_t len)
+{
+    uint32_t c = ~0U;
+
+    while (len--)
+        c = crc_table[(c ^ *p++) & 0xff] ^ (c >> 8);
+    return ~c;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+    ssize_t r;
+
+    while (len) {
+        r = read(fd, buf, len);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (r == 0) {
+            errno = EPIPE;
+            return -1;
+        }
+        buf = (uint8_t *)buf + r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len, int sock)
+{
+    ssize_t r;
+
+    while (len) {
+        r = sock ? send(fd, buf, len, MSG_NOSIGNAL) : write(fd, buf, len);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf = (const uint8_t *)buf + r;
+        len -= r;
+    }
+    return 0;
+}
+
+/* The first failure stops everything: sockets are shut down to unblock */
+static void streams_fail(struct migrate_streams *ms, int error,
+                         const char *fmt, ...)
+{
+    unsigned int i;
+    va_list ap;
+
+    pthread_mutex_lock(&ms->lock);
+    if (ms->error) {
+        pthread_mutex_unlock(&ms->lock);
+        return;
+    }
+    ms->error = error ? error : EIO;
+    pthread_cond_broadcast(&ms->cond);
+    pthread_mutex_unlock(&ms->lock);
+
+    fprintf(stderr, "migration streams: ");
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, ": %s\n", strerror(ms->error));
+
+    for (i = 0; i < ms->nr; i++)
+        if (ms->streams[i].sock >= 0)
+            shutdown(ms->streams[i].sock, SHUT_RDWR);
+}
+
+/* Wait for a free slot of s; NULL once something failed */
+static struct chunk *stream_slot(struct stream *s)
+{
+    struct migrate_streams *ms = s->ms;
+    struct chunk *c = NULL;
+
+    pthread_mutex_lock(&ms->lock);
+    while (s->count == STREAMS_DEPTH && !ms->error)
+        pthread_cond_wait(&ms->cond, &ms->lock);
+    if (!ms->error)
+        c = &s->ring[(s->head + s->count) % STREAMS_DEPTH];
+    pthread_mutex_unlock(&ms->lock);
+
+    return c;
+}
+
+static void stream_fill(struct stream *s)
+{
+    pthread_mutex_lock(&s->ms->lock);
+    s->count++;
+    pthread_cond_broadcast(&s->ms->cond);
+    pthread_mutex_unlock(&s->ms->lock);
+}
+
+/*
+ * Wait for the next filled chunk of s.  NULL once something failed, or
+ * once s is done and has nothing left: *done is then set.
+ */
+static struct chunk *stream_next(struct stream *s, int *done)
+{
+    struct migrate_streams *ms = s->ms;
+    struct chunk *c = NULL;
+
+    pthread_mutex_lock(&ms->lock);
+    while (!s->count && !s->done && !ms->error)
+        pthread_cond_wait(&ms->cond, &ms->lock);
+    *done = !ms->error && !s->count;
+    if (!ms->error && s->count)
+        c = &s->ring[s->head];
+    pthread_mutex_unlock(&ms->lock);
+
+    return c;
+}
+
+static void stream_consume(struct stream *s)
+{
+    pthread_mutex_lock(&s->ms->lock);
+    s->head = (s->head + 1) % STREAMS_DEPTH;
+    s->count--;
+    pthread_cond_broadcast(&s->ms->cond);
+    pthread_mutex_unlock(&s->ms->lock);
+}
+
+static void header_set(struct chunk_header *h, uint32_t len, uint64_t seq,
+                       uint32_t crc)
+{
+    h->magic = htonl(STREAMS_MAGIC);
+    h->len = htonl(len);
+    h->seq_hi = htonl(seq >> 32);
+    h->seq_lo = htonl((uint32_t)seq);
+    h->crc = htonl(crc);
+}
+
+/* Sender: write the chunks of one stream to its socket */
+static void *send_stream_thread(void *arg)
+{
+    struct stream *s = arg;
+    struct migrate_streams *ms = s->ms;
+    struct chunk_header h;
+    struct chunk *c;
+    int done;
+
+    while ((c = stream_next(s, &done))) {
+        header_set(&h, c->len, c->seq, chunk_crc32(c->data, c->len));
+        if (write_all(s->sock, &h, sizeof(h), 1) ||
+            write_all(s->sock, c->data, c->len, 1)) {
+            streams_fail(ms, errno, "sending chunk %"PRIu64" on stream %u",
+                         c->seq, s->index);
+            return NULL;
+        }
+        stream_consume(s);
+    }
+
+    if (done) {
+        header_set(&h, 0, ms->total, 0);
+        if (write_all(s->sock, &h, sizeof(h), 1))
+            streams_fail(ms, errno, "ending stream %u", s->index);
+    }
+    return NULL;
+}
+
+/* Sender: cut what is written into the pipe into chunks for the streams */
+static void *send_relay_thread(void *arg)
+{
+    struct migrate_streams *ms = arg;
+    struct stream *s;
+    struct chunk *c;
+    uint64_t seq;
+    size_t got;
+    ssize_t r = 0;
+    unsigned int i;
+
+    for (seq = 0; ; seq++) {
+        s = &ms->streams[seq % ms->nr];
+        c = stream_slot(s);
+        if (!c)
+            break;
+
+        for (got = 0; got < STREAMS_CHUNK_SIZE; got += r) {
+            r = read(ms->fd, c->data + got, STREAMS_CHUNK_SIZE - got);
+            if (r < 0 && errno == EINTR) {
+                r = 0;
+                continue;
+            }
+            if (r <= 0)
+                break;
+        }
+        if (r < 0) {
+            streams_fail(ms, errno, "reading the migration data");
+            break;
+        }
+        if (got) {
+            c->len = got;
+            c->seq = seq;
+            stream_fill(s);
+        }
+        if (got < STREAMS_CHUNK_SIZE) {
+            /* End of the data: every stream sends its end marker */
+            pthread_mutex_lock(&ms->lock);
+            ms->total = got ? seq + 1 : seq;
+            for (i = 0; i < ms->nr; i++)
+                ms->streams[i].done = 1;
+            pthread_cond_broadcast(&ms->cond);
+            pthread_mutex_unlock(&ms->lock);
+            break;
+        }
+    }
+
+    /* Anyone still writing to the pipe gets an error rather than hanging */
+    close(ms->fd);
+    ms->fd = -1;
+    return NULL;
+}
+
+/* Receiver: read and check the chunks of one stream ahead of the relay */
+static void *recv_stream_thread(void *arg)
+{
+    struct stream *s = arg;
+    struct migrate_streams *ms = s->ms;
+    struct chunk_header h;
+    struct chunk *c;
+    uint64_t seq, expect = s->index;
+    uint32_t len;
+
+    while ((c = stream_slot(s))) {
+        if (read_all(s->sock, &h, sizeof(h))) {
+            streams_fail(ms, errno, "receiving on stream %u", s->index);
+            break;
+        }
+        len = ntohl(h.len);
+        seq = ((uint64_t)ntohl(h.seq_hi) << 32) | ntohl(h.seq_lo);
+        if (ntohl(h.magic) != STREAMS_MAGIC || len > STREAMS_CHUNK_SIZE ||
+            (len && seq != expect)) {
+            streams_fail(ms, EPROTO, "bad chunk header on stream %u",
+                         s->index);
+            break;
+        }
+
+        if (!len) {
+            pthread_mutex_lock(&ms->lock);
+            s->done = 1;
+            ms->total = seq;
+            pthread_cond_broadcast(&ms->cond);
+            pthread_mutex_unlock(&ms->lock);
+            break;
+        }
+
+        if (read_all(s->sock, c->data, len)) {
+            streams_fail(ms, errno, "receiving chunk %"PRIu64" on stream %u",
+                         seq, s->index);
+            break;
+        }
+        if (chunk_crc32(c->data, len) != ntohl(h.crc)) {
+            streams_fail(ms, EBADMSG, "chunk %"PRIu64" on stream %u",
+                         seq, s->index);
+            break;
+        }
+        c->len = len;
+        c->seq = seq;
+        expect += ms->nr;
+        stream_fill(s);
+    }
+    return NULL;
+}
+
+/* Receiver: write the chunks into the pipe in order */
+static void *recv_relay_thread(void *arg)
+{
+    struct migrate_streams *ms = arg;
+    struct stream *s;
+    struct chunk *c;
+    uint64_t seq;
+    int done;
+
+    for (seq = 0; ; seq++) {
+        s = &ms->streams[seq % ms->nr];
+        c = stream_next(s, &done);
+        if (!c) {
+            if (done && seq != ms->total)
+                streams_fail(ms, EPROTO, "stream %u ended at chunk %"PRIu64
+                             " of %"PRIu64, s->index, seq, ms->total);
+            break;
+        }
+        if (write_all(ms->fd, c->data, c->len, 0)) {
+            streams_fail(ms, errno, "writing the migration data");
+            break;
+        }
+        stream_consume(s);
+    }
+
+    close(ms->fd);
+    ms->fd = -1;
+    return NULL;
+}
+
+static struct migrate_streams *streams_alloc(unsigned int nr, int sending)
+{
+    struct migrate_streams *ms;
+    unsigned int i, j;
+
+    ms = calloc(1, sizeof(*ms));
+    if (!ms)
+        return NULL;
+    ms->streams = calloc(nr, sizeof(*ms->streams));
+    if (!ms->streams) {
+        free(ms);
+        return NULL;
+    }
+    ms->sending = sending;
+    ms->nr = nr;
+    ms->fd = -1;
+    pthread_mutex_init(&ms->lock, NULL);
+    pthread_cond_init(&ms->cond, NULL);
+
+    for (i = 0; i < nr; i++) {
+        ms->streams[i].ms = ms;
+        ms->streams[i].index = i;
+        ms->streams[i].sock = -1;
+        for (j = 0; j < STREAMS_DEPTH; j++) {
+            ms->streams[i].ring[j].data = malloc(STREAMS_CHUNK_SIZE);
+            if (!ms->streams[i].ring[j].data) {
+                migrate_streams_finish(ms);
+                return NULL;
+            }
+        }
+    }
+
+    crc_init();
+    return ms;
+}
+
+/*
+ * Start the threads, with the pipe whose other end is returned in
+ * *data_fd.  On failure everything is freed.
+ */
+static int streams_start(struct migrate_streams *ms, int *data_fd)
+{
+    int fds[2];
+    unsigned int i;
+
+    if (pipe(fds)) {
+        perror("migration streams: pipe");
+        goto fail;
+    }
+    ms->fd = ms->sending ? fds[0] : fds[1];
+    *data_fd = ms->sending ? fds[1] : fds[0];
+    fcntl(ms->fd, F_SETFD, FD_CLOEXEC);
+
+    for (i = 0; i < ms->nr; i++) {
+        if (pthread_create(&ms->streams[i].thread, NULL,
+                           ms->sending ? send_stream_thread
+                                       : recv_stream_thread,
+                           &ms->streams[i]))
+            goto fail_threads;
+        ms->streams[i].started = 1;
+    }
+    if (pthread_create(&ms->relay, NULL,
+                       ms->sending ? send_relay_thread : recv_relay_thread,
+                       ms))
+        goto fail_threads;
+    ms->relay_started = 1;
+
+    return 0;
+
+ fail_threads:
+    fprintf(stderr, "migration streams: cannot start the threads\n");
+    streams_fail(ms, EAGAIN, "starting");
+    close(*data_fd);
+    *data_fd = -1;
+ fail:
+    migrate_streams_finish(ms);
+    return -1;
+}
+
+int migrate_streams_listen(uint16_t *port, uint8_t *token)
+{
+    struct sockaddr_in6 sin6;
+    struct sockaddr_in sin;
+    socklen_t len;
+    int fd, off = 0, ufd;
+
+    ufd = open("/dev/urandom", O_RDONLY);
+    if (ufd < 0 || read_all(ufd, token, MIGRATE_STREAMS_TOKEN)) {
+        perror("migration streams: /dev/urandom");
+        if (ufd >= 0)
+            close(ufd);
+        return -1;
+    }
+    close(ufd);
+
+    /* Anywhere, v4 too if we have v6, on a port of the kernel's choice */
+    fd = socket(AF_INET6, SOCK_STREAM, 0);
+    if (fd >= 0) {
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        memset(&sin6, 0, sizeof(sin6));
+        sin6.sin6_family = AF_INET6;
+        sin6.sin6_addr = in6addr_any;
+        if (bind(fd, (struct sockaddr *)&sin6, sizeof(sin6))) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd < 0) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+            goto fail;
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)))
+            goto fail;
+    }
+
+    if (listen(fd, MIGRATE_STREAMS_MAX))
+        goto fail;
+    len = sizeof(sin6);
+    if (getsockname(fd, (struct sockaddr *)&sin6, &len))
+        goto fail;
+    /* sin_port and sin6_port are at the same place */
+    *port = ntohs(sin6.sin6_port);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    return fd;
+
+ fail:
+    perror("migration streams: listening");
+    if (fd >= 0)
+        close(fd);
+    return -1;
+}
+
+struct migrate_streams *migrate_streams_accept(int listen_fd,
+                                               unsigned int nr,
+                                               const uint8_t *token,
+                                               int *data_fd)
+{
+    struct migrate_streams *ms;
+    struct streams_hello hello;
+    struct pollfd pfd;
+    unsigned int have = 0, index;
+    int sock, r;
+
+    ms = streams_alloc(nr, 0);
+    if (!ms) {
+        close(listen_fd);
+        return NULL;
+    }
+
+    while (have < nr) {
+        pfd.fd = listen_fd;
+        pfd.events = POLLIN;
+        r = poll(&pfd, 1, STREAMS_ACCEPT_MS);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            fprintf(stderr, "migration streams: %u of %u connected, %s\n",
+                    have, nr, r ? strerror(errno) : "timed out");
+            goto fail;
+        }
+
+        sock = accept(listen_fd, NULL, NULL);
+        if (sock < 0)
+            continue;
+        fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+        /* Anything but a sender with the token is dropped */
+        pfd.fd = sock;
+        if (poll(&pfd, 1, STREAMS_ACCEPT_MS) <= 0 ||
+            read_all(sock, &hello, sizeof(hello)) ||
+            memcmp(hello.token, token, MIGRATE_STREAMS_TOKEN) ||
+            ntohl(hello.nr) != nr ||
+            (index = ntohl(hello.index)) >= nr ||
+            ms->streams[index].sock >= 0) {
+            fprintf(stderr, "migration streams: dropping a connection\n");
+            close(sock);
+            continue;
+        }
+        ms->streams[index].sock = sock;
+        have++;
+    }
+    close(listen_fd);
+
+    if (streams_start(ms, data_fd))
+        return NULL;
+    return ms;
+
+ fail:
+    close(listen_fd);
+    migrate_streams_finish(ms);
+    return NULL;
+}
+
+static int streams_connect_one(const char *host, uint16_t port)
+{
+    struct addrinfo hints, *res, *ai;
+    char portstr[8];
+    int sock = -1, rc;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(portstr, sizeof(portstr), "%u", port);
+
+    rc = getaddrinfo(host, portstr, &hints, &res);
+    if (rc) {
+        fprintf(stderr, "migration streams: %s: %s\n", host,
+                gai_strerror(rc));
+        return -1;
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock < 0)
+            continue;
+        if (!connect(sock, ai->ai_addr, ai->ai_addrlen))
+            break;
+        close(sock);
+        sock = -1;
+    }
+    if (sock < 0)
+        fprintf(stderr, "migration streams: connecting to %s port %u: %s\n",
+                host, port, strerror(errno));
+    freeaddrinfo(res);
+
+    return sock;
+}
+
+struct migrate_streams *migrate_streams_connect(const char *host,
+                                                uint16_t port,
+                                                const uint8_t *token,
+                                                unsigned int nr,
+                                                int *data_fd)
+{
+    struct migrate_streams *ms;
+    struct streams_hello hello;
+    unsigned int i;
+    int sock;
+
+    ms = streams_alloc(nr, 1);
+    if (!ms)
+        return NULL;
+
+    memcpy(hello.token, token, MIGRATE_STREAMS_TOKEN);
+    hello.nr = htonl(nr);
+    for (i = 0; i < nr; i++) {
+        sock = streams_connect_one(host, port);
+        if (sock < 0)
+            goto fail;
+        ms->streams[i].sock = sock;
+        fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+        hello.index = htonl(i);
+        if (write_all(sock, &hello, sizeof(hello), 1)) {
+            perror("migration streams: sending the token");
+            goto fail;
+        }
+    }
+
+    if (streams_start(ms, data_fd))
+        return NULL;
+    return ms;
+
+ fail:
+    migrate_streams_finish(ms);
+    return NULL;
+}
+
+int migrate_streams_finish(struct migrate_streams *ms)
+{
+    unsigned int i, j;
+    int error;
+
+    if (ms->relay_started)
+        pthread_join(ms->relay, NULL);
+    for (i = 0; i < ms->nr; i++) {
+        struct stream *s = &ms->streams[i];
+
+        if (s->started)
+            pthread_join(s->thread, NULL);
+        if (s->sock >= 0)
+            close(s->sock);
+        for (j = 0; j < STREAMS_DEPTH; j++)
+            free(s->ring[j].data);
+    }
+    if (ms->fd >= 0)
+        close(ms->fd);
+
+    error = ms->error;
+    pthread_cond_destroy(&ms->cond);
+    pthread_mutex_destroy(&ms->lock);
+    free(ms->streams);
+    free(ms);
+
+    return error ? -1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -29,22 +29,32 @@
 
 #include "bidir-hash.h"
 
-static const uint32_t hash_sizes[] = {53, 97, 193, 389, 769, 1543, 3079, 6151,
-    12289, 24593, 49157, 98317, 196613, 393241, 786433, 1572869, 3145739,
-    6291469, 12582917, 25165843, 50331653, 100663319, 201326611, 402653189,
-    805306457, 1610612741};
-static const uint16_t hash_sizes_len =
-            sizeof(hash_sizes)/sizeof(hash_sizes[0]);
 static const float hash_max_load_fact = 0.65;
 static const float hash_min_load_fact = 0.10;
 
-/* How many buckets will be covered by a single rw lock */
-#define BUCKETS_PER_LOCK    64
-#define nr_locks(_nr_buckets)   (1 + (_nr_buckets) / BUCKETS_PER_LOCK)
+/*
+ * Both tables are linear hashes: they grow and shrink one bucket at a
+ * time, by splitting or merging a single bucket with its buddy, and only
+ * the stripes of those two buckets are locked while that happens.
+ * Buckets live in segments of doubling size, so growing never moves
+ * existing buckets: segment 0 holds the first HASH_SEG0_BUCKETS buckets,
+ * and segment n > 0 the HASH_SEG0_BUCKETS << (n - 1) after those.
+ */
+#define HASH_SEG0_BUCKETS   64
+#define HASH_MAX_SEGS       26
+#define HASH_MAX_BUCKETS    (1U << 31)
+
+/* Most buckets split or merged by a single insert or remove */
+#define HASH_RESIZE_BATCH   8
 
+/* Bucket rw locks are striped, by bucket index, scaled with the CPU count */
+#define HASH_MIN_STRIPES        16
+#define HASH_MAX_STRIPES        4096
+#define HASH_STRIPES_PER_CPU    8
 
-#define HASH_LOCK                                                              \
-    pthread_rwlock_t hash_lock
+
+#define RESIZE_LOCK                                                            \
+    pthread_mutex_t resize_lock
 
 #define BUCKET_LOCK                                                            \
     pthread_rwlock_t bucket_lock
@@ -68,22 +78,30 @@ struct bucket_lock
     BUCKET_LOCK;
 };
 
+struct hash_tab
+{
+    uint32_t nr_buckets;                  /* # buckets in use (writes under
+                                           * the stripe locks of the bucket
+                                           * split or merged)
+                                           */
+    struct bucket_lock *lock_tab;         /* bucket stripe locks          */
+    struct bucket *segs[HASH_MAX_SEGS];   /* bucket segments              */
+};
+
 struct __hash
 {
     int lock_alive;
-    HASH_LOCK;                            /* protects:
-                                           * *_tab, tab_size, size_idx, *_load
-                                           * (all writes with wrlock)
+    RESIZE_LOCK;                          /* serialises resizes, and keeps
+                                           * them off during iteration
                                            */
     uint32_t nr_ent;                      /* # entries held in hashtables */
-    struct bucket *key_tab;               /* forward mapping hashtable    */
-    struct bucket *value_tab;             /* backward mapping hashtable   */
-    struct bucket_lock *key_lock_tab;     /* key table bucket locks       */
-    struct bucket_lock *value_lock_tab;   /* value table bucket locks     */
-    uint32_t tab_size;                    /* # buckets is hashtables      */
-    uint16_t size_idx;                    /* table size index             */
-    uint32_t max_load;                    /* # entries before rehash      */
-    uint32_t min_load;                    /* # entries before rehash      */
+    struct hash_tab key_tab;              /* forward mapping hashtable    */
+    struct hash_tab value_tab;            /* backward mapping hashtable   */
+    uint32_t nr_stripes;                  /* # locks in each lock_tab     */
+    uint32_t min_buckets;                 /* # buckets never shrunk below */
+    uint32_t max_buckets;                 /* # buckets never grown above  */
+    uint32_t max_load;                    /* # entries before growing     */
+    uint32_t min_load;                    /* # entries before shrinking   */
 };
 
 struct __hash *__hash_init   (struct __hash *h, uint32_t min_size);
@@ -183,20 +201,30 @@ static inline void atomic_dec(uint32_t *v)
 
 #ifdef BIDIR_USE_STDMALLOC
 
+static unsigned long get_shm_baddr(void *hdr)
+{
+    /* Pointers are local addresses already */
+    return 0;
+}
+
 static void* alloc_entry(struct __hash *h, int size)
 {
     return malloc(size);
 }
 
-static void alloc_buckets(struct __hash *h,
-                          int nr_buckets,
-                          struct bucket **bucket_tab,
-                          struct bucket_lock **bucket_locks_tab)
+static struct bucket* alloc_segment(struct __hash *h,
+                                    int tab,
+                                    uint32_t first,
+                                    uint32_t nr_buckets)
+{
+    return (struct bucket*)malloc(nr_buckets * sizeof(struct bucket));
+}
+
+static struct bucket_lock* alloc_locks(struct __hash *h,
+                                       int tab,
+                                       uint32_t nr_locks)
 {
-    *bucket_tab = (struct bucket*)
-        malloc(nr_buckets * sizeof(struct bucket));
-    *bucket_locks_tab = (struct bucket_lock*)
-        malloc(nr_locks(nr_buckets) * sizeof(struct bucket_lock));
+    return (struct bucket_lock*)malloc(nr_locks * sizeof(struct bucket_lock));
 }
 
 static void free_entry(struct __hash *h, void *p)
@@ -204,12 +232,14 @@ static void free_entry(struct __hash *h, void *p)
     free(p);
 }
 
-static void free_buckets(struct __hash *h,
-                         struct bucket *buckets,
-                         struct bucket_lock *bucket_locks)
+static void free_segment(struct __hash *h, struct bucket *segment)
 {
-    free(buckets);
-    free(bucket_locks);
+    free(segment);
+}
+
+static void free_locks(struct __hash *h, struct bucket_lock *locks)
+{
+    free(locks);
 }
 
 static int max_entries(struct __hash *h)
@@ -218,18 +248,23 @@ static int max_entries(struct __hash *h)
     return -1;
 }
 
+static uint32_t max_buckets(struct __hash *h)
+{
+    return HASH_MAX_BUCKETS;
+}
+
 #else
 
 /*****************************************************************************/
 /** Memory allocator for shared memory region **/
 /*****************************************************************************/
-#define SHM_TABLE_SLOTS 4
+/* One bucket table, and one set of stripe locks, for each direction */
+#define SHM_TABLE_SLOTS 2
 
 struct shm_hdr
 {
     int             hash_allocated;
     pthread_mutex_t mutex;
-    int             free_tab_slots[SHM_TABLE_SLOTS];
 
     unsigned long   freelist_offset;
                     
@@ -238,7 +273,9 @@ struct shm_hdr
                     
     unsigned long   tabs_offset;
     unsigned long   max_tab_size;
-    unsigned long   max_lock_tab_size;
+
+    unsigned long   locks_offset;
+    unsigned long   nr_stripes;
 
     struct __hash   hash;
 };
@@ -272,24 +309,15 @@ static struct bucket* get_shm_tab(struct shm_hdr *hdr, int i)
 {
     unsigned long shm_baddr = (unsigned long)hdr;
     return ((struct bucket *)
-               ((shm_baddr + hdr->tabs_offset) +
-                 i * (hdr->max_tab_size + hdr->max_lock_tab_size)));
+               (shm_baddr + hdr->tabs_offset + i * hdr->max_tab_size));
 }
 
 static struct bucket_lock* get_shm_lock_tab(struct shm_hdr *hdr, int i)
 {
     unsigned long shm_baddr = (unsigned long)hdr;
     return ((struct bucket_lock *)
-               ((shm_baddr + hdr->tabs_offset) +
-                 i * (hdr->max_tab_size + hdr->max_lock_tab_size) +
-                 hdr->max_tab_size));
-}
-
-static int get_shm_slot(struct shm_hdr *hdr, void *p)
-{
-    unsigned long shm_baddr = (unsigned long)hdr;
-    return ((unsigned long)p - (shm_baddr + hdr->tabs_offset)) /
-              (hdr->max_tab_size + hdr->max_lock_tab_size);
+               (shm_baddr + hdr->locks_offset +
+                 i * hdr->nr_stripes * sizeof(struct bucket_lock)));
 }
 
 /* Shared memory allocator locks */
@@ -347,6 +375,8 @@ static uint32_t shm_get_from_freelist(struct shm_hdr *hdr)
 
 #define SHM_ALLOC_MAIN(_n)
 
+static uint32_t hash_nr_stripes(void);
+
 static unsigned long shm_init_offsets(
                                     struct shm_hdr *hdr, int nr_entries)
 {
@@ -360,13 +390,17 @@ static unsigned long shm_init_offsets(
     hdr->tabs_offset = hdr->entries_offset +
         nr_entries * sizeof(struct hash_entry);
     /* We want to allocate table 1.5 larger than the number of entries
-       we want to hold in it */
+       we want to hold in it. Tables grow in place, so there is no need
+       for room to rehash into */
     hdr->max_tab_size =
         (nr_entries * 3 / 2) * sizeof(struct bucket);
-    hdr->max_lock_tab_size =
-        nr_locks(hdr->max_tab_size) * sizeof(struct bucket_lock);
 
-    return hdr->tabs_offset + (hdr->max_tab_size + hdr->max_lock_tab_size) * 4;
+    hdr->locks_offset = hdr->tabs_offset +
+        hdr->max_tab_size * SHM_TABLE_SLOTS;
+    hdr->nr_stripes = hash_nr_stripes();
+
+    return hdr->locks_offset +
+        hdr->nr_stripes * sizeof(struct bucket_lock) * SHM_TABLE_SLOTS;
 }
 
 struct __hash* __shm_hash_init(unsigned long shm_baddr, unsigned long shm_size)
@@ -388,8 +422,6 @@ struct __hash* __shm_hash_init(unsigned long shm_baddr, unsigned long shm_size)
         return NULL;
     for(i=0; i<hdr->nr_entries; i++)
         shm_add_to_freelist(hdr, i);
-    for(i=0; i<SHM_TABLE_SLOTS; i++)
-        hdr->free_tab_slots[i] = 1;
 
     shm_mutex_lock(hdr);
     assert(!hdr->hash_allocated);
@@ -418,35 +450,33 @@ static void* alloc_entry(struct __hash *h, int size)
     return (get_shm_entries(hdr) + slot);
 }
 
-static void alloc_buckets(struct __hash *h,
-                          int nr_buckets,
-                          struct bucket **buckets_tab,
-                          struct bucket_lock **bucket_locks_tab)
+static struct bucket* alloc_segment(struct __hash *h,
+                                    int tab,
+                                    uint32_t first,
+                                    uint32_t nr_buckets)
 {
     struct shm_hdr *hdr = get_shm_hdr(h);
-    int free_slot;
 
-    *buckets_tab = NULL;
-    *bucket_locks_tab = NULL;
+    /* Segments are laid out back to back in the table slot; the last one
+       may be cut short, max_buckets() stops growth before its end */
+    assert(tab < SHM_TABLE_SLOTS);
+    if(first * sizeof(struct bucket) >= hdr->max_tab_size)
+        return NULL;
 
-    if(((nr_buckets * sizeof(struct bucket)) > hdr->max_tab_size) ||
-       ((nr_locks(nr_buckets) * sizeof(struct bucket_lock)) >
-                                                hdr->max_lock_tab_size))
-        return;
+    return get_shm_tab(hdr, tab) + first;
+}
 
-    shm_mutex_lock(hdr);
-    for(free_slot=0; free_slot<SHM_TABLE_SLOTS; free_slot++)
-        if(hdr->free_tab_slots[free_slot])
-            break;
-    if(free_slot == SHM_TABLE_SLOTS)
-    {
-        shm_mutex_unlock(hdr);
-        return;
-    }
-    hdr->free_tab_slots[free_slot] = 0;
-    shm_mutex_unlock(hdr);
-    *buckets_tab      = get_shm_tab(hdr, free_slot);
-    *bucket_locks_tab = get_shm_lock_tab(hdr, free_slot);
+static struct bucket_lock* alloc_locks(struct __hash *h,
+                                       int tab,
+                                       uint32_t nr_locks)
+{
+    struct shm_hdr *hdr = get_shm_hdr(h);
+
+    assert(tab < SHM_TABLE_SLOTS);
+    if(nr_locks != hdr->nr_stripes)
+        return NULL;
+
+    return get_shm_lock_tab(hdr, tab);
 }
 
 static void free_entry(struct __hash *h, void *p)
@@ -459,25 +489,13 @@ static void free_entry(struct __hash *h, void *p)
     shm_add_to_freelist(hdr, slot);
 }
 
-static void free_buckets(struct __hash *h,
-                         struct bucket *buckets,
-                         struct bucket_lock *bucket_locks)
+static void free_segment(struct __hash *h, struct bucket *segment)
 {
-    struct shm_hdr *hdr = get_shm_hdr(h);
-    int slot;
+    /* Table slots are carved out of the region once, nothing to do */
+}
 
-    if(!buckets || !bucket_locks)
-    {
-        assert(!buckets && !bucket_locks);
-        return;
-    }
-    slot = get_shm_slot(hdr, buckets);
-    assert(slot < SHM_TABLE_SLOTS);
-    assert((char *)bucket_locks == (char *)buckets + hdr->max_tab_size);
-    shm_mutex_lock(hdr);
-    assert(hdr->free_tab_slots[slot] == 0);
-    hdr->free_tab_slots[slot] = 1;
-    shm_mutex_unlock(hdr);
+static void free_locks(struct __hash *h, struct bucket_lock *locks)
+{
 }
 
 static int max_entries(struct __hash *h)
@@ -487,6 +505,13 @@ static int max_entries(struct __hash *h)
     return hdr->nr_entries;
 }
 
+static uint32_t max_buckets(struct __hash *h)
+{
+    struct shm_hdr *hdr = get_shm_hdr(h);
+
+    return hdr->max_tab_size / sizeof(struct bucket);
+}
+
 #endif /* !BIDIR_USE_STDMALLOC */
 
 
@@ -502,66 +527,47 @@ static int max_entries(struct __hash *h)
             get_shm_baddr(_h)))
 
 
-#define HASH_LOCK_INIT(_h) ({                                                  \
+#define RESIZE_LOCK_INIT(_h) ({                                                \
     int _ret;                                                                  \
-    pthread_rwlockattr_t _attr;                                                \
+    pthread_mutexattr_t _attr;                                                 \
                                                                                \
-    h->lock_alive = 1;                                                         \
-    _ret = pthread_rwlockattr_init(&_attr);                                    \
+    (_h)->lock_alive = 1;                                                      \
+    _ret = pthread_mutexattr_init(&_attr);                                     \
     if(_ret == 0)                                                              \
-        _ret = pthread_rwlockattr_setpshared(&_attr,                           \
-                                             PTHREAD_PROCESS_SHARED);          \
+        _ret = pthread_mutexattr_setpshared(&_attr, PTHREAD_PROCESS_SHARED);   \
     if(_ret == 0)                                                              \
-        _ret = pthread_rwlock_init(&(_h)->hash_lock, &_attr);                  \
+        _ret = pthread_mutex_init(&(_h)->resize_lock, &_attr);                 \
     if(_ret == 0)                                                              \
-        _ret = pthread_rwlockattr_destroy(&_attr);                             \
+        _ret = pthread_mutexattr_destroy(&_attr);                              \
                                                                                \
     _ret;                                                                      \
 })
 
-#define HASH_LOCK_RDLOCK(_h) ({                                                \
+#define RESIZE_LOCK_LOCK(_h) ({                                                \
     int _ret;                                                                  \
                                                                                \
-    if(!_h->lock_alive) _ret = ENOLCK;                                         \
+    if(!(_h)->lock_alive) _ret = ENOLCK;                                       \
     else                                                                       \
     {                                                                          \
         struct timespec _ts;                                                   \
         /* 10s timeout, long but ~matches disk spin-up times */                \
         _ts.tv_sec = time(NULL) + 10;                                          \
         _ts.tv_nsec = 0;                                                       \
-        _ret = pthread_rwlock_timedrdlock(&(_h)->hash_lock, &_ts);             \
-        if(_ret == ETIMEDOUT) _h->lock_alive = 0;                              \
+        _ret = pthread_mutex_timedlock(&(_h)->resize_lock, &_ts);              \
+        if(_ret == ETIMEDOUT) (_h)->lock_alive = 0;                            \
     }                                                                          \
     _ret;                                                                      \
 })
 
-#define HASH_LOCK_RDUNLOCK(_h)                                                 \
-    pthread_rwlock_unlock(&(_h)->hash_lock)
-
-#define HASH_LOCK_WRLOCK(_h) ({                                                \
-    int _ret;                                                                  \
-                                                                               \
-    if(!_h->lock_alive) _ret = ENOLCK;                                         \
-    else                                                                       \
-    {                                                                          \
-        struct timespec _ts;                                                   \
-        _ts.tv_sec = time(NULL) + 10;                                          \
-        _ts.tv_nsec = 0UL;                                                     \
-        _ret = pthread_rwlock_timedwrlock(&(_h)->hash_lock, &_ts);             \
-        if(_ret == ETIMEDOUT) _h->lock_alive = 0;                              \
-    }                                                                          \
-    _ret;                                                                      \
-})
-
-#define HASH_LOCK_TRYWRLOCK(_h) ({                                             \
-    int _ret = (_h->lock_alive ?                                               \
-                    pthread_rwlock_trywrlock(&(_h)->hash_lock) :               \
+#define RESIZE_LOCK_TRYLOCK(_h) ({                                             \
+    int _ret = ((_h)->lock_alive ?                                             \
+                    pthread_mutex_trylock(&(_h)->resize_lock) :                \
                     ENOLCK);                                                   \
     _ret;                                                                      \
 })
 
-#define HASH_LOCK_WRUNLOCK(_h)                                                 \
-    pthread_rwlock_unlock(&(_h)->hash_lock)
+#define RESIZE_LOCK_UNLOCK(_h)                                                 \
+    pthread_mutex_unlock(&(_h)->resize_lock)
 
 
 #define BUCKET_LOCK_INIT(_h, _b) ({                                            \
@@ -580,11 +586,13 @@ static int max_entries(struct __hash *h)
     _ret;                                                                      \
 })
 
+/* Stripe lock covering bucket _idx (nr_stripes is a power of two) */
+#define BUCKET_STRIPE(_h, _idx)     ((_idx) & ((_h)->nr_stripes - 1))
 
 #define BUCKET_LOCK_RDLOCK(_h, _lock_tab, _idx) ({                             \
     int _ret;                                                                  \
     struct timespec _ts;                                                       \
-    struct bucket_lock *_lock = &(_lock_tab)[(_idx) / BUCKETS_PER_LOCK];       \
+    struct bucket_lock *_lock = &(_lock_tab)[BUCKET_STRIPE(_h, _idx)];         \
                                                                                \
     _ts.tv_sec = time(NULL) + 10;                                              \
     _ts.tv_nsec = 0;                                                           \
@@ -595,14 +603,14 @@ static int max_entries(struct __hash *h)
 
 
 #define BUCKET_LOCK_RDUNLOCK(_h, _lock_tab, _idx) ({                           \
-    struct bucket_lock *_lock = &(_lock_tab)[(_idx) / BUCKETS_PER_LOCK];       \
+    struct bucket_lock *_lock = &(_lock_tab)[BUCKET_STRIPE(_h, _idx)];         \
     pthread_rwlock_unlock(&(_lock)->bucket_lock);                              \
 })
 
 #define BUCKET_LOCK_WRLOCK(_h, _lock_tab, _idx) ({                             \
     int _ret;                                                                  \
     struct timespec _ts;                                                       \
-    struct bucket_lock *_lock = &(_lock_tab)[(_idx) / BUCKETS_PER_LOCK];       \
+    struct bucket_lock *_lock = &(_lock_tab)[BUCKET_STRIPE(_h, _idx)];         \
                                                                                \
     _ts.tv_sec = time(NULL) + 10;                                              \
     _ts.tv_nsec = 0;                                                           \
@@ -612,7 +620,7 @@ static int max_entries(struct __hash *h)
 })
 
 #define BUCKET_LOCK_WRUNLOCK(_h, _lock_tab, _idx) ({                           \
-    struct bucket_lock *_lock = &(_lock_tab)[(_idx) / BUCKETS_PER_LOCK];       \
+    struct bucket_lock *_lock = &(_lock_tab)[BUCKET_STRIPE(_h, _idx)];         \
     pthread_rwlock_unlock(&(_lock)->bucket_lock);                              \
 })
 
@@ -620,8 +628,8 @@ static int max_entries(struct __hash *h)
     int _ret;                                                                  \
     pthread_rwlock_t *_l1, *_l2;                                               \
     struct timespec _ts;                                                       \
-    struct bucket_lock *_bl1 = &(_blt1)[(_idx1) / BUCKETS_PER_LOCK];           \
-    struct bucket_lock *_bl2 = &(_blt2)[(_idx2) / BUCKETS_PER_LOCK];           \
+    struct bucket_lock *_bl1 = &(_blt1)[BUCKET_STRIPE(_h, _idx1)];             \
+    struct bucket_lock *_bl2 = &(_blt2)[BUCKET_STRIPE(_h, _idx2)];             \
                                                                                \
     assert((_bl1) != (_bl2));                                                  \
     if((_bl1) < (_bl2))                                                        \
@@ -640,7 +648,11 @@ static int max_entries(struct __hash *h)
     _ts.tv_sec = time(NULL) + 10;                                              \
     _ts.tv_nsec = 0;                                                           \
     if(_ret == 0)                                                              \
+    {                                                                          \
         _ret = pthread_rwlock_timedwrlock(_l2, &_ts);                          \
+        if(_ret != 0)                                                          \
+            pthread_rwlock_unlock(_l1);                                        \
+    }                                                                          \
     if(_ret == ETIMEDOUT) (_h)->lock_alive = 0;                                \
                                                                                \
     _ret;                                                                      \
@@ -648,8 +660,8 @@ static int max_entries(struct __hash *h)
 
 #define TWO_BUCKETS_LOCK_WRUNLOCK(_h, _blt1, _idx1, _blt2, _idx2) ({           \
     int _ret;                                                                  \
-    struct bucket_lock *_bl1 = &(_blt1)[(_idx1) / BUCKETS_PER_LOCK];           \
-    struct bucket_lock *_bl2 = &(_blt2)[(_idx2) / BUCKETS_PER_LOCK];           \
+    struct bucket_lock *_bl1 = &(_blt1)[BUCKET_STRIPE(_h, _idx1)];             \
+    struct bucket_lock *_bl2 = &(_blt2)[BUCKET_STRIPE(_h, _idx2)];             \
                                                                                \
     _ret = pthread_rwlock_unlock(&(_bl1)->bucket_lock);                        \
     if(_ret == 0)                                                              \
@@ -658,83 +670,339 @@ static int max_entries(struct __hash *h)
     _ret;                                                                      \
 })
 
+/* Both buckets of a split or merge, in one table; they may share a stripe */
+#define SPLIT_BUCKETS_LOCK_WRLOCK(_h, _blt, _idx1, _idx2) ({                   \
+    int _ret;                                                                  \
+    uint32_t _s1 = BUCKET_STRIPE(_h, _idx1);                                   \
+    uint32_t _s2 = BUCKET_STRIPE(_h, _idx2);                                   \
+                                                                               \
+    _ret = BUCKET_LOCK_WRLOCK(_h, _blt, (_s1 < _s2) ? _s1 : _s2);              \
+    if(_ret == 0 && _s1 != _s2)                                                \
+    {                                                                          \
+        _ret = BUCKET_LOCK_WRLOCK(_h, _blt, (_s1 < _s2) ? _s2 : _s1);          \
+        if(_ret != 0)                                                          \
+            BUCKET_LOCK_WRUNLOCK(_h, _blt, (_s1 < _s2) ? _s1 : _s2);           \
+    }                                                                          \
+                                                                               \
+    _ret;                                                                      \
+})
+
+#define SPLIT_BUCKETS_LOCK_WRUNLOCK(_h, _blt, _idx1, _idx2) ({                 \
+    BUCKET_LOCK_WRUNLOCK(_h, _blt, _idx1);                                     \
+    if(BUCKET_STRIPE(_h, _idx1) != BUCKET_STRIPE(_h, _idx2))                   \
+        BUCKET_LOCK_WRUNLOCK(_h, _blt, _idx2);                                 \
+})
+
+
+
+static uint32_t hash_nr_stripes(void)
+{
+    long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t nr = HASH_MIN_STRIPES;
+
+    while((nr < HASH_MAX_STRIPES) && (nr < nr_cpus * HASH_STRIPES_PER_CPU))
+        nr <<= 1;
+
+    return nr;
+}
+
+/* Smallest 2^n - 1 covering the indices of nr_buckets buckets */
+static uint32_t hash_mask(uint32_t nr_buckets)
+{
+    return (nr_buckets <= 1) ? 0 :
+                (0xffffffffU >> __builtin_clz(nr_buckets - 1));
+}
+
+static uint32_t hash_to_idx(uint32_t nr_buckets, uint32_t hash)
+{
+    uint32_t mask = hash_mask(nr_buckets), idx;
+
+    /* The key hashes are weak, mix the bits before masking them */
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bU;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35U;
+    hash ^= hash >> 16;
+
+    idx = hash & mask;
+    /* Buckets past nr_buckets have not been split off their buddy yet */
+    if(idx >= nr_buckets)
+        idx &= (mask >> 1);
+
+    return idx;
+}
+
+/* Segment holding bucket idx, and the first bucket and size of it */
+static uint32_t seg_of(uint32_t idx, uint32_t *first, uint32_t *size)
+{
+    uint32_t seg;
+
+    if(idx < HASH_SEG0_BUCKETS)
+    {
+        *first = 0;
+        *size = HASH_SEG0_BUCKETS;
+        return 0;
+    }
+    seg = 32 - __builtin_clz(idx / HASH_SEG0_BUCKETS);
+    *first = *size = HASH_SEG0_BUCKETS << (seg - 1);
+
+    return seg;
+}
+
+static struct bucket* get_bucket(struct __hash *h,
+                                 struct hash_tab *t,
+                                 uint32_t idx)
+{
+    uint32_t seg, first, size;
+
+    seg = seg_of(idx, &first, &size);
+
+    return C2L(h, t->segs[seg]) + (idx - first);
+}
+
+static struct hash_entry** entry_next(struct hash_entry *e, int value)
+{
+    return (value ? &e->value_next : &e->key_next);
+}
+
+static uint32_t entry_hash(struct hash_entry *e, int value)
+{
+    return (value ? __value_hash(e->value) : __key_hash(e->key));
+}
+
+/*
+ * Lock the bucket the hash falls in. The bucket count is read again under
+ * the stripe lock: splits and merges hold the stripes of both buckets
+ * they touch, so once it maps to the same bucket the index is stable
+ * until the lock is dropped.
+ */
+static int bucket_lock_hash(struct __hash *h,
+                            struct hash_tab *t,
+                            uint32_t hash,
+                            int write,
+                            uint32_t *idxp)
+{
+    struct bucket_lock *blt = C2L(h, t->lock_tab);
+    uint32_t idx;
+    int ret;
 
+    for(;;)
+    {
+        idx = hash_to_idx(t->nr_buckets, hash);
+        ret = (write ? BUCKET_LOCK_WRLOCK(h, blt, idx) :
+                       BUCKET_LOCK_RDLOCK(h, blt, idx));
+        if(ret != 0)
+            return ret;
+        if(hash_to_idx(t->nr_buckets, hash) == idx)
+            break;
+        if(write)
+            BUCKET_LOCK_WRUNLOCK(h, blt, idx);
+        else
+            BUCKET_LOCK_RDUNLOCK(h, blt, idx);
+    }
+    *idxp = idx;
 
+    return 0;
+}
 
-static uint32_t hash_to_idx(struct __hash *h, uint32_t hash)
+/* As above, for the key table bucket and the value table bucket of an entry */
+static int two_buckets_lock_hash(struct __hash *h,
+                                 struct hash_tab *t1, uint32_t hash1,
+                                 struct hash_tab *t2, uint32_t hash2,
+                                 uint32_t *idx1p, uint32_t *idx2p)
 {
-    return (hash % h->tab_size);
+    struct bucket_lock *blt1 = C2L(h, t1->lock_tab);
+    struct bucket_lock *blt2 = C2L(h, t2->lock_tab);
+    uint32_t idx1, idx2;
+    int ret;
+
+    for(;;)
+    {
+        idx1 = hash_to_idx(t1->nr_buckets, hash1);
+        idx2 = hash_to_idx(t2->nr_buckets, hash2);
+        ret = TWO_BUCKETS_LOCK_WRLOCK(h, blt1, idx1, blt2, idx2);
+        if(ret != 0)
+            return ret;
+        if((hash_to_idx(t1->nr_buckets, hash1) == idx1) &&
+           (hash_to_idx(t2->nr_buckets, hash2) == idx2))
+            break;
+        TWO_BUCKETS_LOCK_WRUNLOCK(h, blt1, idx1, blt2, idx2);
+    }
+    *idx1p = idx1;
+    *idx2p = idx2;
+
+    return 0;
+}
+
+/* Make sure the segment holding bucket idx is there */
+static int tab_extend(struct __hash *h,
+                      struct hash_tab *t,
+                      int value,
+                      uint32_t idx)
+{
+    uint32_t seg, first, size;
+    struct bucket *b;
+
+    seg = seg_of(idx, &first, &size);
+    if(t->segs[seg] != NULL)
+        return 0;
+    b = alloc_segment(h, value, first, size);
+    if(!b)
+        return -ENOMEM;
+    if(size > h->max_buckets - first)
+        size = h->max_buckets - first;
+    memset(b, 0, size * sizeof(struct bucket));
+    /* Published to lookups by the bucket count, written under stripe locks */
+    t->segs[seg] = L2C(h, b);
+
+    return 0;
 }
 
-static void alloc_tab(struct __hash *h,
-                      int size,
-                      struct bucket **buckets_tab,
-                      struct bucket_lock **bucket_locks_tab)
+static void tab_free(struct __hash *h, struct hash_tab *t)
 {
     int i;
 
-    alloc_buckets(h, size, buckets_tab, bucket_locks_tab);
-    if(!(*buckets_tab) || !(*bucket_locks_tab))
-        goto error_out;
-    memset(*buckets_tab, 0, size * sizeof(struct bucket));
-    memset(*bucket_locks_tab, 0, nr_locks(size) * sizeof(struct bucket_lock));
-    for(i=0; i<nr_locks(size); i++)
-        if(BUCKET_LOCK_INIT(h, *bucket_locks_tab + i) != 0)
-            goto error_out;
-
-    return;
-error_out:
-    free_buckets(h, *buckets_tab, *bucket_locks_tab);
-    *buckets_tab = NULL;
-    *bucket_locks_tab = NULL;
-    return;
+    for(i=0; i < HASH_MAX_SEGS; i++)
+        if(t->segs[i] != NULL)
+            free_segment(h, C2L(h, t->segs[i]));
+    if(t->lock_tab != NULL)
+        free_locks(h, C2L(h, t->lock_tab));
+    memset(t, 0, sizeof(struct hash_tab));
+}
+
+static int tab_init(struct __hash *h,
+                    struct hash_tab *t,
+                    int value,
+                    uint32_t nr_buckets)
+{
+    struct bucket_lock *bucket_locks;
+    uint32_t i;
+
+    memset(t, 0, sizeof(struct hash_tab));
+    bucket_locks = alloc_locks(h, value, h->nr_stripes);
+    if(!bucket_locks)
+        return -ENOMEM;
+    t->lock_tab = L2C(h, bucket_locks);
+    memset(bucket_locks, 0, h->nr_stripes * sizeof(struct bucket_lock));
+    for(i=0; i < h->nr_stripes; i++)
+        if(BUCKET_LOCK_INIT(h, bucket_locks + i) != 0)
+            return -ENOLCK;
+    for(i=0; i < nr_buckets; i += HASH_SEG0_BUCKETS)
+        if(tab_extend(h, t, value, i) != 0)
+            return -ENOMEM;
+    t->nr_buckets = nr_buckets;
+
+    return 0;
+}
+
+/* Add bucket nr_buckets, taking its entries from its buddy */
+static int tab_split(struct __hash *h, struct hash_tab *t, int value)
+{
+    uint32_t nr = t->nr_buckets, src, dst = nr;
+    struct bucket_lock *blt = C2L(h, t->lock_tab);
+    struct bucket *bs, *bd;
+    struct hash_entry *e, **pe, **pn;
+
+    src = dst & (hash_mask(nr + 1) >> 1);
+    if(SPLIT_BUCKETS_LOCK_WRLOCK(h, blt, src, dst) != 0)
+        return -ENOLCK;
+    t->nr_buckets = nr + 1;
+    bs = get_bucket(h, t, src);
+    bd = get_bucket(h, t, dst);
+    pe = &bs->hash_entry;
+    while(*pe != NULL)
+    {
+        e = C2L(h, *pe);
+        pn = entry_next(e, value);
+        if(hash_to_idx(nr + 1, entry_hash(e, value)) == dst)
+        {
+            *pe = *pn;
+            *pn = bd->hash_entry;
+            bd->hash_entry = L2C(h, e);
+        }
+        else
+            pe = pn;
+    }
+    SPLIT_BUCKETS_LOCK_WRUNLOCK(h, blt, src, dst);
+
+    return 0;
+}
+
+/* Remove the last bucket, handing its entries back to its buddy */
+static int tab_merge(struct __hash *h, struct hash_tab *t, int value)
+{
+    uint32_t nr = t->nr_buckets, src = nr - 1, dst;
+    struct bucket_lock *blt = C2L(h, t->lock_tab);
+    struct bucket *bs, *bd;
+    struct hash_entry *e, **pe;
+
+    dst = src & (hash_mask(nr) >> 1);
+    if(SPLIT_BUCKETS_LOCK_WRLOCK(h, blt, src, dst) != 0)
+        return -ENOLCK;
+    t->nr_buckets = nr - 1;
+    bs = get_bucket(h, t, src);
+    bd = get_bucket(h, t, dst);
+    if(bs->hash_entry != NULL)
+    {
+        pe = &bs->hash_entry;
+        while(*pe != NULL)
+        {
+            e = C2L(h, *pe);
+            pe = entry_next(e, value);
+        }
+        *pe = bd->hash_entry;
+        bd->hash_entry = bs->hash_entry;
+        bs->hash_entry = NULL;
+    }
+    SPLIT_BUCKETS_LOCK_WRUNLOCK(h, blt, src, dst);
+
+    return 0;
+}
+
+static void hash_set_loads(struct __hash *h)
+{
+    uint32_t size = h->key_tab.nr_buckets;
+
+    h->max_load = (uint32_t)ceilf(hash_max_load_fact * size);
+    h->min_load = (size > h->min_buckets) ?
+                        (uint32_t)ceilf(hash_min_load_fact * size) : 0;
 }
 
 
 struct __hash *__hash_init(struct __hash *h, uint32_t min_size)
 {
     uint32_t size;
-    uint16_t size_idx;
-    struct bucket *buckets;
-    struct bucket_lock *bucket_locks;
-
-    /* Sanity check on args */
-    if (min_size > hash_sizes[hash_sizes_len-1]) return NULL;
-    /* Find least size greater than init_size */
-    for(size_idx = 0; size_idx < hash_sizes_len; size_idx++)
-            if(hash_sizes[size_idx] >= min_size)
-                break;
-    size = hash_sizes[size_idx];
 
     if(!h) return NULL;
-    alloc_tab(h, size, &buckets, &bucket_locks);
-    if(!buckets || !bucket_locks) goto alloc_fail;
-    h->key_tab         = L2C(h, buckets);
-    h->key_lock_tab    = L2C(h, bucket_locks);
-    alloc_tab(h, size, &buckets, &bucket_locks);
-    if(!buckets || !bucket_locks) goto alloc_fail;
-    h->value_tab       = L2C(h, buckets);
-    h->value_lock_tab  = L2C(h, bucket_locks);
+    /* Sanity check on args */
+    if(min_size > HASH_MAX_BUCKETS) return NULL;
+    size = (min_size < HASH_SEG0_BUCKETS) ? HASH_SEG0_BUCKETS : min_size;
+
+    memset(&h->key_tab, 0, sizeof(struct hash_tab));
+    memset(&h->value_tab, 0, sizeof(struct hash_tab));
+    h->nr_stripes = hash_nr_stripes();
+    h->min_buckets = size;
+    h->max_buckets = max_buckets(h);
+    if(size > h->max_buckets) return NULL;
+
+    if(tab_init(h, &h->key_tab, 0, size) != 0) goto alloc_fail;
+    if(tab_init(h, &h->value_tab, 1, size) != 0) goto alloc_fail;
     /* Init all h variables */
-    if(HASH_LOCK_INIT(h) != 0) goto alloc_fail;
+    if(RESIZE_LOCK_INIT(h) != 0) goto alloc_fail;
     h->nr_ent = 0;
-    h->tab_size = size;
-    h->size_idx = size_idx;
-    h->max_load = (uint32_t)ceilf(hash_max_load_fact * size);
-    h->min_load = (uint32_t)ceilf(hash_min_load_fact * size);
+    hash_set_loads(h);
 
     return h;
 
 alloc_fail:
-    if(h->key_tab || h->key_lock_tab)
-        free_buckets(h, C2L(h, h->key_tab), C2L(h, h->key_lock_tab));
+    tab_free(h, &h->key_tab);
+    tab_free(h, &h->value_tab);
     return NULL;
 }
 
 #undef __prim
 #undef __prim_t
 #undef __prim_tab
-#undef __prim_lock_tab
 #undef __prim_hash
 #undef __prim_cmp
 #undef __prim_next
@@ -744,7 +1012,6 @@ alloc_fail:
 #define __prim             key
 #define __prim_t         __k_t
 #define __prim_tab         key_tab
-#define __prim_lock_tab    key_lock_tab
 #define __prim_hash      __key_hash
 #define __prim_cmp       __key_cmp
 #define __prim_next        key_next
@@ -757,11 +1024,11 @@ int __key_lookup(struct __hash *h, __prim_t k, __sec_t *vp)
     struct bucket_lock *blt;
     uint32_t idx;
 
-    if(HASH_LOCK_RDLOCK(h) != 0) return -ENOLCK;
-    idx = hash_to_idx(h, __prim_hash(k));
-    b = C2L(h, &h->__prim_tab[idx]);
-    blt = C2L(h, h->__prim_lock_tab);
-    if(BUCKET_LOCK_RDLOCK(h, blt, idx) != 0) return -ENOLCK;
+    if(!h->lock_alive) return -ENOLCK;
+    if(bucket_lock_hash(h, &h->__prim_tab, __prim_hash(k), 0, &idx) != 0)
+        return -ENOLCK;
+    b = get_bucket(h, &h->__prim_tab, idx);
+    blt = C2L(h, h->__prim_tab.lock_tab);
     entry = b->hash_entry;
     while(entry != NULL)
     {
@@ -771,13 +1038,11 @@ int __key_lookup(struct __hash *h, __prim_t k, __sec_t *vp)
             /* Unlock here */
             *vp = entry->__sec;
             BUCKET_LOCK_RDUNLOCK(h, blt, idx);
-            HASH_LOCK_RDUNLOCK(h);
             return 1;
         }
         entry = entry->__prim_next;
     }
     BUCKET_LOCK_RDUNLOCK(h, blt, idx);
-    HASH_LOCK_RDUNLOCK(h);
     return 0;
 }
 
@@ -785,7 +1050,6 @@ int __key_lookup(struct __hash *h, __prim_t k, __sec_t *vp)
 #undef __prim
 #undef __prim_t
 #undef __prim_tab
-#undef __prim_lock_tab
 #undef __prim_hash
 #undef __prim_cmp
 #undef __prim_next
@@ -795,7 +1059,6 @@ int __key_lookup(struct __hash *h, __prim_t k, __sec_t *vp)
 #define __prim             value
 #define __prim_t         __v_t
 #define __prim_tab         value_tab
-#define __prim_lock_tab    value_lock_tab
 #define __prim_hash      __value_hash
 #define __prim_cmp       __value_cmp
 #define __prim_next        value_next
@@ -808,11 +1071,11 @@ int __value_lookup(struct __hash *h, __prim_t k, __sec_t *vp)
     struct bucket_lock *blt;
     uint32_t idx;
 
-    if(HASH_LOCK_RDLOCK(h) != 0) return -ENOLCK;
-    idx = hash_to_idx(h, __prim_hash(k));
-    b = C2L(h, &h->__prim_tab[idx]);
-    blt = C2L(h, h->__prim_lock_tab);
-    if(BUCKET_LOCK_RDLOCK(h, blt, idx) != 0) return -ENOLCK;
+    if(!h->lock_alive) return -ENOLCK;
+    if(bucket_lock_hash(h, &h->__prim_tab, __prim_hash(k), 0, &idx) != 0)
+        return -ENOLCK;
+    b = get_bucket(h, &h->__prim_tab, idx);
+    blt = C2L(h, h->__prim_tab.lock_tab);
     entry = b->hash_entry;
     while(entry != NULL)
     {
@@ -822,13 +1085,11 @@ int __value_lookup(struct __hash *h, __prim_t k, __sec_t *vp)
             /* Unlock here */
             *vp = entry->__sec;
             BUCKET_LOCK_RDUNLOCK(h, blt, idx);
-            HASH_LOCK_RDUNLOCK(h);
             return 1;
         }
         entry = entry->__prim_next;
     }
     BUCKET_LOCK_RDUNLOCK(h, blt, idx);
-    HASH_LOCK_RDUNLOCK(h);
     return 0;
 }
 
@@ -844,31 +1105,30 @@ int __insert(struct __hash *h, __k_t k, __v_t v)
                     alloc_entry(h, sizeof(struct hash_entry));
     if(!entry) return 0;
 
-    if(HASH_LOCK_RDLOCK(h) != 0) return -ENOLCK;
+    if(!h->lock_alive) goto lock_fail;
     /* Read from nr_ent is atomic(TODO check), no need for fancy accessors */
     if(h->nr_ent+1 > h->max_load)
     {
-        /* Resize needs the write lock, drop read lock temporarily */
-        HASH_LOCK_RDUNLOCK(h);
+        /* Grows by a few buckets at most, and not at all if another
+         * thread is at it already */
         hash_resize(h);
-        if(HASH_LOCK_RDLOCK(h) != 0) return -ENOLCK;
     }
 
     /* Init the entry */
     entry->key = k;
     entry->value = v;
 
-    /* Work out the indicies */
-    k_idx = hash_to_idx(h, __key_hash(k));
-    v_idx = hash_to_idx(h, __value_hash(v));
+    /* Work out the indicies, and lock the buckets */
+    if(two_buckets_lock_hash(h, &h->key_tab, __key_hash(k),
+                                &h->value_tab, __value_hash(v),
+                                &k_idx, &v_idx) != 0)
+        goto lock_fail;
 
     /* Insert */
-    bk   = C2L(h, &h->key_tab[k_idx]);
-    bv   = C2L(h, &h->value_tab[v_idx]);
-    bltk = C2L(h, h->key_lock_tab);
-    bltv = C2L(h, h->value_lock_tab);
-    if(TWO_BUCKETS_LOCK_WRLOCK(h, bltk, k_idx, bltv, v_idx) != 0)
-        return -ENOLCK;
+    bk   = get_bucket(h, &h->key_tab, k_idx);
+    bv   = get_bucket(h, &h->value_tab, v_idx);
+    bltk = C2L(h, h->key_tab.lock_tab);
+    bltv = C2L(h, h->value_tab.lock_tab);
     entry->key_next = bk->hash_entry;
     bk->hash_entry = L2C(h, entry);
     entry->value_next = bv->hash_entry;
@@ -878,37 +1138,35 @@ int __insert(struct __hash *h, __k_t k, __v_t v)
     /* Book keeping */
     atomic_inc(&h->nr_ent);
 
-    HASH_LOCK_RDUNLOCK(h);
-
     return 1;
+
+lock_fail:
+    free_entry(h, entry);
+    return -ENOLCK;
 }
 
 
 #undef __prim
 #undef __prim_t
 #undef __prim_tab
-#undef __prim_lock_tab
 #undef __prim_hash
 #undef __prim_cmp
 #undef __prim_next
 #undef __sec
 #undef __sec_t
 #undef __sec_tab
-#undef __sec_lock_tab
 #undef __sec_hash
 #undef __sec_next
 
 #define __prim             key
 #define __prim_t         __k_t
 #define __prim_tab         key_tab
-#define __prim_lock_tab    key_lock_tab
 #define __prim_hash      __key_hash
 #define __prim_cmp       __key_cmp
 #define __prim_next        key_next
 #define __sec              value
 #define __sec_t          __v_t
 #define __sec_tab          value_tab
-#define __sec_lock_tab     value_lock_tab
 #define __sec_hash       __value_hash
 #define __sec_next         value_next
 
@@ -917,17 +1175,17 @@ int __key_remove(struct __hash *h, __prim_t k, __sec_t *vp)
     struct hash_entry *e, *es, **pek, **pev;
     struct bucket *bk, *bv;
     struct bucket_lock *bltk, *bltv;
-    uint32_t old_kidx, kidx, vidx, min_load, nr_ent;
+    uint32_t kidx, vidx, min_load, nr_ent;
     __prim_t ks;
     __sec_t vs;
 
-    if(HASH_LOCK_RDLOCK(h) != 0) return -ENOLCK;
+    if(!h->lock_alive) return -ENOLCK;
 
 again:
-    old_kidx = kidx = hash_to_idx(h, __prim_hash(k));
-    bk = C2L(h, &h->__prim_tab[kidx]);
-    bltk = C2L(h, h->__prim_lock_tab);
-    if(BUCKET_LOCK_RDLOCK(h, bltk, kidx) != 0) return -ENOLCK;
+    if(bucket_lock_hash(h, &h->__prim_tab, __prim_hash(k), 0, &kidx) != 0)
+        return -ENOLCK;
+    bk = get_bucket(h, &h->__prim_tab, kidx);
+    bltk = C2L(h, h->__prim_tab.lock_tab);
     pek = &(bk->hash_entry);
     e = *pek;
     while(e != NULL)
@@ -942,7 +1200,6 @@ again:
     }
 
     BUCKET_LOCK_RDUNLOCK(h, bltk, kidx);
-    HASH_LOCK_RDUNLOCK(h);
 
     return 0;
 
@@ -953,17 +1210,17 @@ found:
     es = e;
     ks = e->__prim;
     vs = e->__sec;
-    kidx = hash_to_idx(h, __prim_hash(ks));
-    /* Being paranoid: check if kidx has not changed, so that we unlock the
-     * right bucket */
-    assert(old_kidx == kidx);
-    vidx = hash_to_idx(h, __sec_hash(vs));
-    bk   = C2L(h, &h->__prim_tab[kidx]);
-    bv   = C2L(h, &h->__sec_tab[vidx]);
-    bltk = C2L(h, h->__prim_lock_tab);
-    bltv = C2L(h, h->__sec_lock_tab);
     BUCKET_LOCK_RDUNLOCK(h, bltk, kidx);
-    if(TWO_BUCKETS_LOCK_WRLOCK(h, bltk, kidx, bltv, vidx) != 0) return -ENOLCK;
+    /* The buckets are looked up again: the table may have been resized
+     * while no locks were held */
+    if(two_buckets_lock_hash(h, &h->__prim_tab, __prim_hash(ks),
+                                &h->__sec_tab, __sec_hash(vs),
+                                &kidx, &vidx) != 0)
+        return -ENOLCK;
+    bk   = get_bucket(h, &h->__prim_tab, kidx);
+    bv   = get_bucket(h, &h->__sec_tab, vidx);
+    bltk = C2L(h, h->__prim_tab.lock_tab);
+    bltv = C2L(h, h->__sec_tab.lock_tab);
     pek = &(bk->hash_entry);
     pev = &(bv->hash_entry);
 
@@ -1012,11 +1269,9 @@ found_again:
 
             atomic_dec(&h->nr_ent);
             nr_ent = h->nr_ent;
-            /* read min_load still under the hash lock! */
             min_load = h->min_load;
 
             TWO_BUCKETS_LOCK_WRUNLOCK(h, bltk, kidx, bltv, vidx);
-            HASH_LOCK_RDUNLOCK(h);
 
             if(nr_ent < min_load)
                 hash_resize(h);
@@ -1036,28 +1291,24 @@ found_again:
 #undef __prim
 #undef __prim_t
 #undef __prim_tab
-#undef __prim_lock_tab
 #undef __prim_hash
 #undef __prim_cmp
 #undef __prim_next
 #undef __sec
 #undef __sec_t
 #undef __sec_tab
-#undef __sec_lock_tab
 #undef __sec_hash
 #undef __sec_next
 
 #define __prim             value
 #define __prim_t         __v_t
 #define __prim_tab         value_tab
-#define __prim_lock_tab    value_lock_tab
 #define __prim_hash      __value_hash
 #define __prim_cmp       __value_cmp
 #define __prim_next        value_next
 #define __sec              key
 #define __sec_t          __k_t
 #define __sec_tab          key_tab
-#define __sec_lock_tab     key_lock_tab
 #define __sec_hash       __key_hash
 #define __sec_next         key_next
 
@@ -1066,17 +1317,17 @@ int __value_remove(struct __hash *h, __prim_t k, __sec_t *vp)
     struct hash_entry *e, *es, **pek, **pev;
     struct bucket *bk, *bv;
     struct bucket_lock *bltk, *bltv;
-    uint32_t old_kidx, kidx, vidx, min_load, nr_ent;
+    uint32_t kidx, vidx, min_load, nr_ent;
     __prim_t ks;
     __sec_t vs;
 
-    if(HASH_LOCK_RDLOCK(h) != 0) return -ENOLCK;
+    if(!h->lock_alive) return -ENOLCK;
 
 again:
-    old_kidx = kidx = hash_to_idx(h, __prim_hash(k));
-    bk = C2L(h, &h->__prim_tab[kidx]);
-    bltk = C2L(h, h->__prim_lock_tab);
-    if(BUCKET_LOCK_RDLOCK(h, bltk, kidx) != 0) return -ENOLCK;
+    if(bucket_lock_hash(h, &h->__prim_tab, __prim_hash(k), 0, &kidx) != 0)
+        return -ENOLCK;
+    bk = get_bucket(h, &h->__prim_tab, kidx);
+    bltk = C2L(h, h->__prim_tab.lock_tab);
     pek = &(bk->hash_entry);
     e = *pek;
     while(e != NULL)
@@ -1091,7 +1342,6 @@ again:
     }
 
     BUCKET_LOCK_RDUNLOCK(h, bltk, kidx);
-    HASH_LOCK_RDUNLOCK(h);
 
     return 0;
 
@@ -1102,17 +1352,17 @@ found:
     es = e;
     ks = e->__prim;
     vs = e->__sec;
-    kidx = hash_to_idx(h, __prim_hash(ks));
-    /* Being paranoid: check if kidx has not changed, so that we unlock the
-     * right bucket */
-    assert(old_kidx == kidx);
-    vidx = hash_to_idx(h, __sec_hash(vs));
-    bk   = C2L(h, &h->__prim_tab[kidx]);
-    bv   = C2L(h, &h->__sec_tab[vidx]);
-    bltk = C2L(h, h->__prim_lock_tab);
-    bltv = C2L(h, h->__sec_lock_tab);
     BUCKET_LOCK_RDUNLOCK(h, bltk, kidx);
-    if(TWO_BUCKETS_LOCK_WRLOCK(h, bltk, kidx, bltv, vidx) != 0) return -ENOLCK;
+    /* The buckets are looked up again: the table may have been resized
+     * while no locks were held */
+    if(two_buckets_lock_hash(h, &h->__prim_tab, __prim_hash(ks),
+                                &h->__sec_tab, __sec_hash(vs),
+                                &kidx, &vidx) != 0)
+        return -ENOLCK;
+    bk   = get_bucket(h, &h->__prim_tab, kidx);
+    bv   = get_bucket(h, &h->__sec_tab, vidx);
+    bltk = C2L(h, h->__prim_tab.lock_tab);
+    bltv = C2L(h, h->__sec_tab.lock_tab);
     pek = &(bk->hash_entry);
     pev = &(bv->hash_entry);
 
@@ -1161,11 +1411,9 @@ found_again:
 
             atomic_dec(&h->nr_ent);
             nr_ent = h->nr_ent;
-            /* read min_load still under the hash lock! */
             min_load = h->min_load;
 
             TWO_BUCKETS_LOCK_WRUNLOCK(h, bltk, kidx, bltv, vidx);
-            HASH_LOCK_RDUNLOCK(h);
 
             if(nr_ent < min_load)
                 hash_resize(h);
@@ -1189,14 +1437,29 @@ int __hash_destroy(struct __hash *h,
 {
     struct hash_entry *e, *n;
     struct bucket *b;
+    struct bucket_lock *blt1, *blt2;
     int i;
 
-    if(HASH_LOCK_WRLOCK(h) != 0) return -ENOLCK;
+    if(RESIZE_LOCK_LOCK(h) != 0) return -ENOLCK;
+
+    /* Wait out operations in progress, and stop new ones. Lock tables are
+       taken in address order, like TWO_BUCKETS_LOCK_WRLOCK() does */
+    blt1 = C2L(h, h->key_tab.lock_tab);
+    blt2 = C2L(h, h->value_tab.lock_tab);
+    if(blt2 < blt1)
+    {
+        blt1 = C2L(h, h->value_tab.lock_tab);
+        blt2 = C2L(h, h->key_tab.lock_tab);
+    }
+    for(i=0; i < h->nr_stripes; i++)
+        BUCKET_LOCK_WRLOCK(h, blt1, i);
+    for(i=0; i < h->nr_stripes; i++)
+        BUCKET_LOCK_WRLOCK(h, blt2, i);
+    h->lock_alive = 0;
 
-    /* No need to lock individual buckets, with hash write lock  */
-    for(i=0; i < h->tab_size; i++)
+    for(i=0; i < h->key_tab.nr_buckets; i++)
     {
-        b = C2L(h, &h->key_tab[i]);
+        b = get_bucket(h, &h->key_tab, i);
         e = b->hash_entry;
         while(e != NULL)
         {
@@ -1208,100 +1471,81 @@ int __hash_destroy(struct __hash *h,
             e = n;
         }
     }
-    free_buckets(h, C2L(h, h->key_tab), C2L(h, h->key_lock_tab));
-    free_buckets(h, C2L(h, h->value_tab), C2L(h, h->value_lock_tab));
 
-    HASH_LOCK_WRUNLOCK(h);
-    h->lock_alive = 0;
+    for(i=0; i < h->nr_stripes; i++)
+    {
+        BUCKET_LOCK_WRUNLOCK(h, blt1, i);
+        BUCKET_LOCK_WRUNLOCK(h, blt2, i);
+    }
+    tab_free(h, &h->key_tab);
+    tab_free(h, &h->value_tab);
+
+    RESIZE_LOCK_UNLOCK(h);
 
     return 0;
 }
 
-static void hash_resize(struct __hash *h)
+static int hash_grow(struct __hash *h)
 {
-    int new_size_idx, i, lock_ret;
-    uint32_t size, old_size, kidx, vidx;
-    struct bucket *t1, *t2, *b;
-    struct bucket_lock *l1, *l2;
-    struct hash_entry *e, *n;
+    uint32_t size = h->key_tab.nr_buckets;
+
+    if((size >= h->max_buckets) ||
+       (tab_extend(h, &h->key_tab, 0, size) != 0) ||
+       (tab_extend(h, &h->value_tab, 1, size) != 0))
+        goto alloc_fail;
+    if((tab_split(h, &h->key_tab, 0) != 0) ||
+       (tab_split(h, &h->value_tab, 1) != 0))
+        return -ENOLCK;
+    hash_set_loads(h);
+
+    return 0;
+
+alloc_fail:
+    /* If we failed to grow, raise max load. This will stop us from
+     * retrying too frequently */
+    h->max_load = (h->max_load + 2 * size) / 2 + 1;
+    return -ENOMEM;
+}
 
-    /* We may fail to allocate the lock, if the resize is triggered while
-       we are iterating (under read lock) */
-    lock_ret = HASH_LOCK_TRYWRLOCK(h);
-    if(lock_ret != 0) return;
-
-    new_size_idx = h->size_idx;
-    /* Work out the new size */
-    if(h->nr_ent >= h->max_load)
-        new_size_idx = h->size_idx+1;
-    if(h->nr_ent < h->min_load)
-        new_size_idx = h->size_idx-1;
-    if((new_size_idx == h->size_idx) ||
-       (new_size_idx >= hash_sizes_len) ||
-       (new_size_idx < 0))
+static int hash_shrink(struct __hash *h)
+{
+    if(h->key_tab.nr_buckets <= h->min_buckets)
     {
-        HASH_LOCK_WRUNLOCK(h);
-        return;
+        h->min_load = 0;
+        return -ENOSPC;
     }
+    /* Segments are kept, for the table to grow back into */
+    if((tab_merge(h, &h->key_tab, 0) != 0) ||
+       (tab_merge(h, &h->value_tab, 1) != 0))
+        return -ENOLCK;
+    hash_set_loads(h);
 
-    size = hash_sizes[new_size_idx];
+    return 0;
+}
 
-    /* Allocate the new sizes */
-    t1 = t2 = NULL;
-    l1 = l2 = NULL;
-    alloc_tab(h, size, &t1, &l1);
-    if(!t1 || !l1) goto alloc_fail;
-    alloc_tab(h, size, &t2, &l2);
-    if(!t2 || !l2) goto alloc_fail;
+static void hash_resize(struct __hash *h)
+{
+    int i, ret;
 
-    old_size = h->tab_size;
-    h->tab_size = size;
-    h->size_idx = new_size_idx;
-    h->max_load = (uint32_t)ceilf(hash_max_load_fact * size);
-    h->min_load = (uint32_t)ceilf(hash_min_load_fact * size);
+    /* We may fail to allocate the lock, if another thread is resizing, or
+       the resize is triggered while we are iterating */
+    if(RESIZE_LOCK_TRYLOCK(h) != 0) return;
 
-    /* Move the entries */
-    for(i=0; i < old_size; i++)
+    /* Only a few buckets at a time: no one waits for the whole table */
+    for(i=0; i < HASH_RESIZE_BATCH; i++)
     {
-        b = C2L(h, &h->key_tab[i]);
-        e = b->hash_entry;
-        while(e != NULL)
-        {
-            e = C2L(h, e);
-            n = e->key_next;
-            kidx =hash_to_idx(h, __key_hash(e->key));
-            vidx =hash_to_idx(h, __value_hash(e->value));
-            /* Move to the correct bucket */
-            e->key_next = t1[kidx].hash_entry;
-            t1[kidx].hash_entry = L2C(h, e);
-            e->value_next = t2[vidx].hash_entry;
-            t2[vidx].hash_entry = L2C(h, e);
-            e = n;
-        }
+        if(h->nr_ent >= h->max_load)
+            ret = hash_grow(h);
+        else
+        if(h->nr_ent < h->min_load)
+            ret = hash_shrink(h);
+        else
+            break;
+        if(ret != 0)
+            break;
     }
-    free_buckets(h, C2L(h, h->key_tab), C2L(h, h->key_lock_tab));
-    free_buckets(h, C2L(h, h->value_tab), C2L(h, h->value_lock_tab));
-    h->key_tab         = L2C(h, t1);
-    h->key_lock_tab    = L2C(h, l1);
-    h->value_tab       = L2C(h, t2);
-    h->value_lock_tab  = L2C(h, l2);
-
-    HASH_LOCK_WRUNLOCK(h);
-
-    return;
 
-alloc_fail:
-    /* If we failed to resize, adjust max/min load. This will stop us from
-     * retrying resize too frequently */ 
-    if(new_size_idx > h->size_idx)
-        h->max_load = (h->max_load + 2 * h->tab_size) / 2 + 1;
-    else 
-    if (new_size_idx < h->size_idx)
-        h->min_load = h->min_load / 2;
-    HASH_LOCK_WRUNLOCK(h);
-    if(t1 || l1) free_buckets(h, t1, l1);
-    if(t2 || l2) free_buckets(h, t2, l2);
-    return;
+    RESIZE_LOCK_UNLOCK(h);
 }
 
 int __hash_iterator(struct __hash *h,
@@ -1313,13 +1557,18 @@ int __hash_iterator(struct __hash *h,
     struct bucket_lock *blt;
     int i, brk_early;
 
-    if(HASH_LOCK_RDLOCK(h) != 0) return -ENOLCK;
+    /* Keeps the buckets where they are, lookups and updates carry on */
+    if(RESIZE_LOCK_LOCK(h) != 0) return -ENOLCK;
 
-    for(i=0; i < h->tab_size; i++)
+    blt = C2L(h, h->key_tab.lock_tab);
+    for(i=0; i < h->key_tab.nr_buckets; i++)
     {
-        b = C2L(h, &h->key_tab[i]);
-        blt = C2L(h, h->key_lock_tab);
-        if(BUCKET_LOCK_RDLOCK(h, blt, i) != 0) return -ENOLCK;
+        b = get_bucket(h, &h->key_tab, i);
+        if(BUCKET_LOCK_RDLOCK(h, blt, i) != 0)
+        {
+            RESIZE_LOCK_UNLOCK(h);
+            return -ENOLCK;
+        }
         e = b->hash_entry;
         while(e != NULL)
         {
@@ -1336,7 +1585,7 @@ int __hash_iterator(struct __hash *h,
         BUCKET_LOCK_RDUNLOCK(h, blt, i);
     }
 out:
-    HASH_LOCK_RDUNLOCK(h);
+    RESIZE_LOCK_UNLOCK(h);
     return 0;
 }
 
@@ -1349,7 +1598,7 @@ void __hash_sizes(struct __hash *h,
 {
     if(nr_ent     != NULL) *nr_ent     = h->nr_ent;
     if(max_nr_ent != NULL) *max_nr_ent = max_entries(h); 
-    if(tab_size   != NULL) *tab_size   = h->tab_size;
+    if(tab_size   != NULL) *tab_size   = h->key_tab.nr_buckets;
     if(max_load   != NULL) *max_load   = h->max_load;
     if(min_load   != NULL) *min_load   = h->min_load;
 }
@@ -373,14 +373,27 @@ static void dump_viridian_domain(void)
     printf("    VIRIDIAN_DOMAIN: hypercall gpa 0x%llx, guest_os_id 0x%llx\n",
            (unsigned long long) p.hypercall_gpa,
            (unsigned long long) p.guest_os_id);           
+    printf("                     reference_tsc 0x%llx\n",
+           (unsigned long long) p.reference_tsc);
 }
 
 static void dump_viridian_vcpu(void)
 {
     HVM_SAVE_TYPE(VIRIDIAN_VCPU) p;
+    int i;
     READ(p);
     printf("    VIRIDIAN_VCPU: apic_assist 0x%llx\n",
            (unsigned long long) p.apic_assist);           
+    printf("                   scontrol 0x%llx, siefp 0x%llx, simp 0x%llx\n",
+           (unsigned long long) p.scontrol, (unsigned long long) p.siefp,
+           (unsigned long long) p.simp);
+    for ( i = 0 ; i < 16 ; i++ )
+        printf("                   sint%.2i 0x%llx\n", i,
+               (unsigned long long) p.sint[i]);
+    for ( i = 0 ; i < 4 ; i++ )
+        printf("                   stimer%i config 0x%llx count 0x%llx\n", i,
+               (unsigned long long) p.stimer_config[i],
+               (unsigned long long) p.stimer_count[i]);
 }
 
 static void dump_vmce_vcpu(void)
@@ -18,6 +18,27 @@
 #include <string.h>
 #include <inttypes.h>
 
+/* The non-empty buckets of the wait histogram, see LOCKPROF_HIST_N */
+static void print_hist(const xc_lockprof_data_t *data)
+{
+    unsigned int i;
+
+    printf("%-50s  waits:", "");
+    for ( i = 0; i < LOCKPROF_HIST_N; i++ )
+    {
+        if ( !data->block_hist[i] )
+            continue;
+        if ( i == LOCKPROF_HIST_N - 1 )
+            printf(" >=%uus:%"PRIu64, (256u << (i - 1)) / 1000,
+                   data->block_hist[i]);
+        else if ( (256u << i) < 1000 )
+            printf(" <%uns:%"PRIu64, 256u << i, data->block_hist[i]);
+        else
+            printf(" <%uus:%"PRIu64, (256u << i) / 1000, data->block_hist[i]);
+    }
+    printf("\n");
+}
+
 int main(int argc, char *argv[])
 {
     xc_interface      *xc_handle;
@@ -27,11 +48,15 @@ int main(int argc, char *argv[])
     char               name[60];
     DECLARE_HYPERCALL_BUFFER(xc_lockprof_data_t, data);
 
-    if ( (argc > 2) || ((argc == 2) && (strcmp(argv[1], "-r") != 0)) )
+    if ( (argc > 2) ||
+         ((argc == 2) && strcmp(argv[1], "-r") && strcmp(argv[1], "-p") &&
+          strcmp(argv[1], "-c")) )
     {
-        printf("%s: [-r]\n", argv[0]);
+        printf("%s: [-r|-p|-c]\n", argv[0]);
         printf("no args: print lock profile data\n");
         printf("    -r : reset profile data\n");
+        printf("    -p : pause profiling\n");
+        printf("    -c : continue profiling\n");
         return 1;
     }
 
@@ -44,9 +69,23 @@ int main(int argc, char *argv[])
 
     if ( argc > 1 )
     {
-        if ( xc_lockprof_reset(xc_handle) != 0 )
+        int rc;
+
+        switch ( argv[1][1] )
+        {
+        case 'p':
+            rc = xc_lockprof_stop(xc_handle);
+            break;
+        case 'c':
+            rc = xc_lockprof_start(xc_handle);
+            break;
+        default:
+            rc = xc_lockprof_reset(xc_handle);
+            break;
+        }
+        if ( rc != 0 )
         {
-            fprintf(stderr, "Error reseting profile data: %d (%s)\n",
+            fprintf(stderr, "Error controlling profiling: %d (%s)\n",
                     errno, strerror(errno));
             return 1;
         }
@@ -106,8 +145,14 @@ int main(int argc, char *argv[])
         sl += l;
         sb += b;
         printf("%-50s: lock:%12"PRId64"(%20.9fs), "
-               "block:%12"PRId64"(%20.9fs)\n",
-               name, data[j].lock_cnt, l, data[j].block_cnt, b);
+               "block:%12"PRId64"(%20.9fs)%s\n",
+               name, data[j].lock_cnt, l, data[j].block_cnt, b,
+               (data[j].flags & LOCKPROF_FLAG_RW) ? " rw" : "");
+        if ( data[j].block_cnt )
+            print_hist(&data[j]);
+        if ( data[j].hold_max )
+            printf("%-50s  longest hold: %.9fs at %#"PRIx64"\n", "",
+                   (double)data[j].hold_max / 1E+09, data[j].hold_max_site);
     }
     l = (double)time / 1E+09;
     printf("total profiling time: %20.9fs\n", l);
@@ -68,6 +68,10 @@ void show_help(void)
             "                                     output after CTRL-C or SIGINT or several seconds.\n"
             " enable-turbo-mode     [cpuid]       enable Turbo Mode for processors that support it.\n"
             " disable-turbo-mode    [cpuid]       disable Turbo Mode for processors that support it.\n"
+            " get-core-parking                    get core parking policy, parked cpus and\n"
+            "                                     the cpus that may be parked\n"
+            " set-core-parking-policy <policy>    set core parking policy\n"
+            "                                     as power/performance/topology\n"
             );
 }
 /* wrapper function */
@@ -1134,6 +1138,82 @@ void disable_turbo_mode(int argc, char *argv[])
                 errno, strerror(errno));
 }
 
+static const char *const core_parking_policies[] = {
+    [XEN_CORE_PARKING_POLICY_POWER]       = "power",
+    [XEN_CORE_PARKING_POLICY_PERFORMANCE] = "performance",
+    [XEN_CORE_PARKING_POLICY_TOPOLOGY]    = "topology",
+};
+
+void get_core_parking_func(int argc, char *argv[])
+{
+    xc_core_parking_t info;
+    xc_cpupoolinfo_t *pool;
+    int i, first = 1;
+
+    if ( argc )
+        fprintf(stderr, "Ignoring argument(s)\n");
+
+    if ( xc_get_core_parking(xc_handle, &info) )
+    {
+        fprintf(stderr, "failed to get core parking (%d - %s)\n",
+                errno, strerror(errno));
+        exit(errno);
+    }
+
+    printf("policy               : %s\n",
+           info.policy < ARRAY_SIZE(core_parking_policies) ?
+           core_parking_policies[info.policy] : "none");
+    printf("parked cpus          : %u\n", info.idle_nums);
+    printf("requested            : %u\n", info.requested);
+
+    /* Only cpus of cpupool0 are parked, and never cpu 0. */
+    pool = xc_cpupool_getinfo(xc_handle, 0);
+    if ( pool == NULL || pool->cpupool_id != 0 )
+    {
+        fprintf(stderr, "failed to get cpupool0 (%d - %s)\n",
+                errno, strerror(errno));
+        if ( pool )
+            xc_cpupool_infofree(xc_handle, pool);
+        return;
+    }
+    printf("may be parked        :");
+    for ( i = 1; i < max_cpu_nr; i++ )
+    {
+        if ( !(pool->cpumap[i / 8] & (1 << (i % 8))) )
+            continue;
+        printf("%s CPU%d", first ? "" : ",", i);
+        first = 0;
+    }
+    printf("%s\n", first ? " none" : "");
+    xc_cpupool_infofree(xc_handle, pool);
+}
+
+void set_core_parking_policy_func(int argc, char *argv[])
+{
+    uint32_t policy;
+
+    if ( argc != 1 )
+    {
+        fprintf(stderr, "Missing or invalid argument(s)\n");
+        exit(EINVAL);
+    }
+
+    for ( policy = 0; policy < ARRAY_SIZE(core_parking_policies); policy++ )
+        if ( !strcasecmp(argv[0], core_parking_policies[policy]) )
+            break;
+    if ( policy == ARRAY_SIZE(core_parking_policies) )
+    {
+        fprintf(stderr, "Invalid core parking policy %s\n", argv[0]);
+        exit(EINVAL);
+    }
+
+    if ( !xc_set_core_parking_policy(xc_handle, policy) )
+        printf("set core parking policy to %s succeeded\n", argv[0]);
+    else
+        fprintf(stderr, "set core parking policy to %s failed (%d - %s)\n",
+                argv[0], errno, strerror(errno));
+}
+
 struct {
     const char *name;
     void (*function)(int argc, char *argv[]);
@@ -1156,6 +1236,8 @@ struct {
     { "set-max-cstate", set_max_cstate_func},
     { "enable-turbo-mode", enable_turbo_mode },
     { "disable-turbo-mode", disable_turbo_mode },
+    { "get-core-parking", get_core_parking_func },
+    { "set-core-parking-policy", set_core_parking_policy_func },
 };
 
 int main(int argc, char *argv[])
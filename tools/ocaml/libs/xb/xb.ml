@@ -102,6 +102,30 @@ let output con =
 	(* after sending one packet, partial is empty *)
 	con.partial_out = ""
 
+(* like output, but gather queued packets into a single write of up to
+   max bytes, so a burst of packets costs one ring update and one
+   notification. sent is called on each packet taken off the queue. *)
+let output_batch con max sent =
+	if String.length con.partial_out = 0 && Queue.length con.pkt_out > 0 then (
+		let buf = Buffer.create max in
+		let rec gather () =
+			if Queue.length con.pkt_out > 0 then (
+				let pkt = Queue.peek con.pkt_out in
+				let _, _, _, data = Packet.unpack pkt in
+				let len = Partial.header_size () + String.length data in
+				if Buffer.length buf = 0 || Buffer.length buf + len <= max then (
+					ignore (Queue.pop con.pkt_out);
+					sent pkt;
+					Buffer.add_string buf (Packet.to_string pkt);
+					gather ()
+				)
+			)
+			in
+		gather ();
+		con.partial_out <- Buffer.contents buf
+	);
+	output con
+
 let input con =
 	let newpacket = ref false in
 	let to_read =
@@ -19,6 +19,7 @@ exception End_of_file
 open Stdext
 
 let xenstore_payload_max = 4096 (* xen/include/public/io/xs_wire.h *)
+let xenstore_ring_size = 1024 (* xen/include/public/io/xs_wire.h *)
 
 type watch = {
 	con: t;
@@ -38,6 +39,9 @@ and t = {
 	anonid: int;
 	mutable stat_nb_ops: int;
 	mutable perm: Perms.Connection.t;
+	(* watch events not yet queued, each at most once *)
+	watchevents: string Queue.t;
+	watchevents_set: (string, unit) Hashtbl.t;
 }
 
 let mark_as_bad con =
@@ -95,6 +99,8 @@ let create xbcon dom =
 	anonid = id;
 	stat_nb_ops = 0;
 	perm = make_perm dom;
+	watchevents = Queue.create ();
+	watchevents_set = Hashtbl.create 8;
 	}
 	in 
 	Logging.new_connection ~tid:Transaction.none ~con:(get_domstr con);
@@ -118,12 +124,33 @@ let is_backend_mmap con = match con.xb.Xenbus.Xb.backend with
 	| Xenbus.Xb.Xenmmap _ -> true
 	| _ -> false
 
-let send_reply con tid rid ty data =
+let queue_reply con tid rid ty data =
 	if (String.length data) > xenstore_payload_max && (is_backend_mmap con) then
 		Xenbus.Xb.queue con.xb (Xenbus.Xb.Packet.create tid rid Xenbus.Xb.Op.Error "E2BIG\000")
 	else
 		Xenbus.Xb.queue con.xb (Xenbus.Xb.Packet.create tid rid ty data)
 
+(* watch events are held back until the next reply or the next output, so
+   that the same event fired several times in between is only sent once. *)
+let queue_watchevent con data =
+	if not (Hashtbl.mem con.watchevents_set data) then (
+		Hashtbl.add con.watchevents_set data ();
+		Queue.push data con.watchevents
+	)
+
+let flush_watchevents con =
+	if not (Queue.is_empty con.watchevents) then (
+		Queue.iter (fun data ->
+			queue_reply con Transaction.none 0 Xenbus.Xb.Op.Watchevent data
+		) con.watchevents;
+		Queue.clear con.watchevents;
+		Hashtbl.clear con.watchevents_set
+	)
+
+let send_reply con tid rid ty data =
+	flush_watchevents con;
+	queue_reply con tid rid ty data
+
 let send_error con tid rid err = send_reply con tid rid Xenbus.Xb.Op.Error (err ^ "\000")
 let send_ack con tid rid ty = send_reply con tid rid ty "OK\000"
 
@@ -180,7 +207,7 @@ let list_watches con =
 
 let fire_single_watch watch =
 	let data = Utils.join_by_null [watch.path; watch.token; ""] in
-	send_reply watch.con Transaction.none 0 Xenbus.Xb.Op.Watchevent data
+	queue_watchevent watch.con data
 
 let fire_watch watch path =
 	let new_path =
@@ -193,7 +220,7 @@ let fire_watch watch path =
 			path
 	in
 	let data = Utils.join_by_null [ new_path; watch.token; "" ] in
-	send_reply watch.con Transaction.none 0 Xenbus.Xb.Op.Watchevent data
+	queue_watchevent watch.con data
 
 let find_next_tid con =
 	let ret = con.next_tid in con.next_tid <- con.next_tid + 1; ret
@@ -222,10 +249,13 @@ let has_input con = Xenbus.Xb.has_in_packet con.xb
 let pop_in con = Xenbus.Xb.get_in_packet con.xb
 let has_more_input con = Xenbus.Xb.has_more_input con.xb
 
-let has_output con = Xenbus.Xb.has_output con.xb
+let has_output con =
+	not (Queue.is_empty con.watchevents) || Xenbus.Xb.has_output con.xb
 let has_new_output con = Xenbus.Xb.has_new_output con.xb
 let peek_output con = Xenbus.Xb.peek_output con.xb
-let do_output con = Xenbus.Xb.output con.xb
+let do_output con sent =
+	flush_watchevents con;
+	Xenbus.Xb.output_batch con.xb xenstore_ring_size sent
 
 let incr_ops con = con.stat_nb_ops <- con.stat_nb_ops + 1
 
@@ -398,15 +398,14 @@ let do_input store cons doms con =
 
 let do_output store cons doms con =
 	if Connection.has_output con then (
-		if Connection.has_new_output con then (
-			let packet = Connection.peek_output con in
+		let sent packet =
 			let tid, rid, ty, data = Xenbus.Xb.Packet.unpack packet in
 			(* As we don't log IO, do not call an unnecessary sanitize_data 
 			   info "[%s] <- %s \"%s\""
 			         (Connection.get_domstr con)
 			         (Xenbus.Xb.Op.to_string ty) (sanitize_data data);*)
-			write_answer_log ~ty ~tid ~con ~data;
-		);
-		ignore (Connection.do_output con)
+			write_answer_log ~ty ~tid ~con ~data
+			in
+		ignore (Connection.do_output con sent)
 	)
 
@@ -372,9 +372,9 @@ let dump_buffer store = dump_store_buf store.root
 
 
 (* modifying functions with quota udpate *)
-let set_node store path node orig_quota mod_quota =
-	let root = Path.set_node store.root path node in
-	store.root <- root;
+let set_nodes store nodes orig_quota mod_quota =
+	store.root <- List.fold_left (fun root (path, node) ->
+		Path.set_node root path node) store.root nodes;
 	Quota.merge orig_quota mod_quota store.quota
 
 let write store perm path value =
@@ -33,39 +33,54 @@ let check_parents_perms_identical root1 root2 path =
 	) false hierarch in
 	(not permdiff)
 
-let get_lowest path1 path2 =
-	match path2 with
-	| None       -> Some path1
-	| Some path2 -> Some (Store.Path.get_common_prefix path1 path2)
-
-let test_coalesce oldroot currentroot optpath =
-	match optpath with
-	| None      -> true
-	| Some path ->
-		let oldnode = Store.Path.get_node oldroot path
-		and currentnode = Store.Path.get_node currentroot path in
-		
-		match oldnode, currentnode with
-		| (Some oldnode), (Some currentnode) ->
-			if oldnode == currentnode then (
-				check_parents_perms_identical oldroot currentroot path
-			) else (
-				false
-			)
-		| None, None -> (
-			(* ok then it doesn't exists in the old version and the current version,
-			   just sneak it in as a child of the parent node if it exists, or else fail *)
-			let pnode = Store.Path.get_node currentroot (Store.Path.get_parent path) in
-			match pnode with
-			| None       -> false (* ok it doesn't exists, just bail out. *)
-			| Some pnode -> true
-			)
-		| _ ->
+(* a transaction remembers the subtrees it has read and written, so that it
+   can still commit if others have only modified other subtrees meanwhile.
+   Past max_paths of either, they are folded into their common prefix. *)
+let max_paths = 16
+
+let rec is_prefix p1 p2 =
+	match p1, p2 with
+	| [], _                -> true
+	| h1 :: t1, h2 :: t2   -> h1 = h2 && is_prefix t1 t2
+	| _, []                -> false
+
+let add_path paths path =
+	if List.exists (fun p -> is_prefix p path) paths then
+		paths
+	else
+		let paths = path :: List.filter (fun p -> not (is_prefix path p)) paths in
+		if List.length paths > max_paths then
+			[ List.fold_left Store.Path.get_common_prefix path paths ]
+		else
+			paths
+
+let test_coalesce oldroot currentroot path =
+	let oldnode = Store.Path.get_node oldroot path
+	and currentnode = Store.Path.get_node currentroot path in
+
+	match oldnode, currentnode with
+	| (Some oldnode), (Some currentnode) ->
+		if oldnode == currentnode then (
+			check_parents_perms_identical oldroot currentroot path
+		) else (
 			false
+		)
+	| None, None -> (
+		(* ok then it doesn't exists in the old version and the current version,
+		   just sneak it in as a child of the parent node if it exists and
+		   nobody has changed its permissions, or else fail *)
+		let parent = Store.Path.get_parent path in
+		let pnode = Store.Path.get_node currentroot parent in
+		match pnode with
+		| None       -> false (* ok it doesn't exists, just bail out. *)
+		| Some pnode -> check_parents_perms_identical oldroot currentroot parent
+		)
+	| _ ->
+		false
 
-let can_coalesce oldroot currentroot path =
+let can_coalesce oldroot currentroot paths =
 	if !do_coalesce then
-		try test_coalesce oldroot currentroot path with _ -> false
+		try List.for_all (test_coalesce oldroot currentroot) paths with _ -> false
 	else
 		false
 
@@ -76,8 +91,8 @@ type t = {
 	store: Store.t;
 	quota: Quota.t;
 	mutable ops: (Xenbus.Xb.Op.operation * Store.Path.t) list;
-	mutable read_lowpath: Store.Path.t option;
-	mutable write_lowpath: Store.Path.t option;
+	mutable read_paths: Store.Path.t list;
+	mutable write_paths: Store.Path.t list;
 }
 
 let make id store =
@@ -87,8 +102,8 @@ let make id store =
 		store = if id = none then store else Store.copy store;
 		quota = Quota.copy store.Store.quota;
 		ops = [];
-		read_lowpath = None;
-		write_lowpath = None;
+		read_paths = [];
+		write_paths = [];
 	}
 
 let get_id t = match t.ty with No -> none | Full (id, _, _) -> id
@@ -96,48 +111,47 @@ let get_store t = t.store
 let get_ops t = t.ops
 
 let add_wop t ty path = t.ops <- (ty, path) :: t.ops
-let set_read_lowpath t path = t.read_lowpath <- get_lowest path t.read_lowpath
-let set_write_lowpath t path = t.write_lowpath <- get_lowest path t.write_lowpath
+let add_read_path t path = t.read_paths <- add_path t.read_paths path
+let add_write_path t path = t.write_paths <- add_path t.write_paths path
 
 let path_exists t path = Store.path_exists t.store path
 
+(* a node created by the transaction is recorded itself, not its parent:
+   on commit it only has to still be missing, with the parent still there *)
 let write t perm path value =
-	let path_exists = path_exists t path in
 	Store.write t.store perm path value;
-	if path_exists
-	then set_write_lowpath t path
-	else set_write_lowpath t (Store.Path.get_parent path);
+	add_write_path t path;
 	add_wop t Xenbus.Xb.Op.Write path
 
 let mkdir ?(with_watch=true) t perm path =
 	Store.mkdir t.store perm path;
-	set_write_lowpath t path;
+	add_write_path t path;
 	if with_watch then
 		add_wop t Xenbus.Xb.Op.Mkdir path
 
 let setperms t perm path perms =
 	Store.setperms t.store perm path perms;
-	set_write_lowpath t path;
+	add_write_path t path;
 	add_wop t Xenbus.Xb.Op.Setperms path
 
 let rm t perm path =
 	Store.rm t.store perm path;
-	set_write_lowpath t (Store.Path.get_parent path);
+	add_write_path t (Store.Path.get_parent path);
 	add_wop t Xenbus.Xb.Op.Rm path
 
 let ls t perm path =	
 	let r = Store.ls t.store perm path in
-	set_read_lowpath t path;
+	add_read_path t path;
 	r
 
 let read t perm path =
 	let r = Store.read t.store perm path in
-	set_read_lowpath t path;
+	add_read_path t path;
 	r
 
 let getperms t perm path =
 	let r = Store.getperms t.store perm path in
-	set_read_lowpath t path;
+	add_read_path t path;
 	r
 
 let commit ~con t =
@@ -150,19 +164,22 @@ let commit ~con t =
 		let commit_partial oldroot cstore store =
 			(* get the lowest path of the query and verify that it hasn't
 			   been modified by others transactions. *)
-			if can_coalesce oldroot (Store.get_root cstore) t.read_lowpath
-			&& can_coalesce oldroot (Store.get_root cstore) t.write_lowpath then (
-				maybe (fun p ->
-					let n = Store.get_node store p in
-
-					(* it has to be in the store, otherwise it means bugs
-					   in the lowpath registration. we don't need to handle none. *)
-					maybe (fun n -> Store.set_node cstore p n t.quota store.Store.quota) n;
+			if can_coalesce oldroot (Store.get_root cstore) t.read_paths
+			&& can_coalesce oldroot (Store.get_root cstore) t.write_paths then (
+				(* none of the paths is below another, so they can be moved
+				   over in any order. *)
+				let nodes = List.fold_left (fun acc p ->
 					Logging.write_coalesce ~tid:(get_id t) ~con (Store.Path.to_string p);
-				) t.write_lowpath;
-				maybe (fun p ->
+					(* it has to be in the store, otherwise it means bugs
+					   in the path registration. we don't need to handle none. *)
+					match Store.get_node store p with
+					| Some n -> (p, n) :: acc
+					| None   -> acc
+				) [] t.write_paths in
+				Store.set_nodes cstore nodes t.quota store.Store.quota;
+				List.iter (fun p ->
 					Logging.read_coalesce ~tid:(get_id t) ~con (Store.Path.to_string p)
-					) t.read_lowpath;
+					) t.read_paths;
 				has_coalesced := true;
 				Store.incr_transaction_coalesce cstore;
 				true
@@ -1623,16 +1623,25 @@ static PyObject *pyxc_sched_credit2_domain_set(XcObject *self,
 {
     uint32_t domid;
     uint16_t weight;
-    static char *kwd_list[] = { "domid", "weight", NULL };
-    static char kwd_type[] = "I|H";
+    int cosched;
+    static char *kwd_list[] = { "domid", "weight", "cosched", NULL };
+    static char kwd_type[] = "I|Hi";
     struct xen_domctl_sched_credit2 sdom;
 
     weight = 0;
+    cosched = -1;
     if( !PyArg_ParseTupleAndKeywords(args, kwds, kwd_type, kwd_list,
-                                     &domid, &weight) )
+                                     &domid, &weight, &cosched) )
         return NULL;
 
+    if ( xc_sched_credit2_domain_get(self->xc_handle, domid, &sdom) != 0 )
+        return pyxc_error_to_exception(self->xc_handle);
+
     sdom.weight = weight;
+    if ( cosched == 0 )
+        sdom.flags &= ~XEN_SCHED_CREDIT2_COSCHED;
+    else if ( cosched > 0 )
+        sdom.flags |= XEN_SCHED_CREDIT2_COSCHED;
 
     if ( xc_sched_credit2_domain_set(self->xc_handle, domid, &sdom) != 0 )
         return pyxc_error_to_exception(self->xc_handle);
@@ -1652,8 +1661,9 @@ static PyObject *pyxc_sched_credit2_domain_get(XcObject *self, PyObject *args)
     if ( xc_sched_credit2_domain_get(self->xc_handle, domid, &sdom) != 0 )
         return pyxc_error_to_exception(self->xc_handle);
 
-    return Py_BuildValue("{s:H}",
-                         "weight",  sdom.weight);
+    return Py_BuildValue("{s:H,s:i}",
+                         "weight",  sdom.weight,
+                         "cosched", !!(sdom.flags & XEN_SCHED_CREDIT2_COSCHED));
 }
 
 static PyObject *pyxc_domain_setmaxmem(XcObject *self, PyObject *args)
@@ -2588,6 +2598,7 @@ static PyMethodDef pyxc_methods[] = {
       "SMP credit2 scheduler.\n"
       " domid     [int]:   domain id to set\n"
       " weight    [short]: domain's scheduling weight\n"
+      " cosched   [int]:   only share cores between the domain's vcpus\n"
       "Returns: [int] 0 on success; -1 on error.\n" },
 
     { "sched_credit2_domain_get",
@@ -2597,7 +2608,8 @@ static PyMethodDef pyxc_methods[] = {
       "SMP credit2 scheduler.\n"
       " domid     [int]:   domain id to get\n"
       "Returns:   [dict]\n"
-      " weight    [short]: domain's scheduling weight\n"},
+      " weight    [short]: domain's scheduling weight\n"
+      " cosched   [int]:   only share cores between the domain's vcpus\n"},
 
     { "evtchn_alloc_unbound", 
       (PyCFunction)pyxc_evtchn_alloc_unbound,
@@ -27,6 +27,8 @@ static int usage(const char* prog)
     printf("  add-to-physmap <domid> <gfn> <source> <source-gfn> <source-handle>\n");
     printf("                          - Populate a page in a domain with a shared page.\n");
     printf("  debug-gfn <domid> <gfn> - Debug a particular domain and gfn.\n");
+    printf("  hash <domid> <gfn> <nr> - Print the fingerprints of nr pages from gfn.\n");
+    printf("  clone <domid>           - Clone a paused HVM domain, printing the new domid.\n");
     printf("  audit                   - Audit the sharing subsytem in Xen.\n");
     return 1;
 }
@@ -161,6 +163,59 @@ int main(int argc, const char** argv)
         gfn = strtol(argv[3], NULL, 0);
         R(xc_memshr_debug_gfn(xch, domid, gfn));
     }
+    else if( !strcasecmp(cmd, "hash") )
+    {
+        domid_t domid;
+        unsigned long gfn;
+        uint32_t i, nr;
+        uint64_t *hashes;
+
+        if( argc != 5 )
+            return usage(argv[0]);
+
+        domid = strtol(argv[2], NULL, 0);
+        gfn = strtol(argv[3], NULL, 0);
+        nr = strtol(argv[4], NULL, 0);
+        hashes = malloc(nr * sizeof(*hashes));
+        if( !hashes )
+        {
+            printf("error allocating %u hashes\n", nr);
+            return 1;
+        }
+        R(xc_memshr_hash_range(xch, domid, gfn, nr, hashes));
+        for( i = 0; i < nr; i++ )
+            if( hashes[i] != XENMEM_SHARING_HASH_INVALID )
+                printf("0x%lx 0x%016llx\n", gfn + i,
+                       (unsigned long long) hashes[i]);
+        free(hashes);
+    }
+    else if( !strcasecmp(cmd, "clone") )
+    {
+        domid_t domid;
+        uint32_t clone;
+        xc_dominfo_t info;
+        xen_domain_handle_t handle = { 0 };
+
+        if( argc != 3 )
+            return usage(argv[0]);
+
+        domid = strtol(argv[2], NULL, 0);
+        if( xc_domain_getinfo(xch, domid, 1, &info) != 1 ||
+            info.domid != domid )
+        {
+            printf("error getting info of domain %u\n", domid);
+            return 1;
+        }
+        R(xc_domain_create(xch, info.ssidref, handle,
+                           XEN_DOMCTL_CDF_hvm_guest | XEN_DOMCTL_CDF_hap,
+                           &clone));
+        R(xc_domain_max_vcpus(xch, clone, info.max_vcpu_id + 1));
+        R(xc_domain_setmaxmem(xch, clone, info.max_memkb));
+        R(xc_memshr_control(xch, domid, 1));
+        R(xc_memshr_control(xch, clone, 1));
+        R(xc_memshr_clone_domain(xch, domid, clone));
+        printf("%u\n", clone);
+    }
     else if( !strcasecmp(cmd, "audit") )
     {
         int rc = xc_memshr_audit(xch);
@@ -0,0 +1,659 @@
+/*
+ * v4v-bench.c
+ *
+ * Microbenchmarks of the v4v send path: one-way throughput and ping-pong
+ * latency between two rings of the calling domain, for a matrix of
+ * message sizes, iov counts, concurrent senders and v4vtables rules.
+ * Results are written to stdout as CSV, one line per case.
+ *
+ * The rings live in locked memory of this process and are consumed by
+ * reading them directly, as a driver would, so that what is measured is
+ * V4VOP_sendv. They are registered with the frame numbers
+ * /proc/self/pagemap gives, which are what xen wants from a domain with
+ * a translated physmap (HVM or PVH), so this is meant to run as root in
+ * such a guest.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "xc_private.h"
+#include <xen/v4v.h>
+
+#define BENCH_PORT_RX       0x4b000     /* ring the senders send to */
+#define BENCH_PORT_ECHO     0x4b001     /* ring the echoes come back to */
+#define BENCH_PORT_TX       0x4c000     /* + sender index */
+#define BENCH_PORT_RULE     0x4d000     /* + rule index, never used */
+
+#define BENCH_MIN_SIZE      16
+#define BENCH_MAX_BYTES     (256UL << 20) /* per case */
+#define BENCH_MIN_COUNT     16
+
+#define BENCH_ROUNDUP(_x)                                               \
+    (((_x) + V4V_RING_MSG_ALIGN(0) - 1) & ~(V4V_RING_MSG_ALIGN(0) - 1))
+
+static unsigned long opt_count = 10000;
+static size_t opt_max_size = 1UL << 20;
+static unsigned int opt_max_iov = 64;
+static unsigned int opt_max_senders = 4;
+static unsigned int opt_rules = 64;
+static uint32_t opt_ring_len = 4UL << 20;
+static int opt_throughput = 1, opt_latency = 1, opt_polling = 0;
+
+struct bench_ring
+{
+    v4v_ring_t *ring;
+    v4v_pfn_t *pfns;
+    size_t npage;
+};
+
+/* one side sending size bytes in niov iovs to dst */
+struct bench_sender
+{
+    pthread_t thread;
+    xc_interface *xch;
+    v4v_send_addr_t *addr;
+    v4v_iov_t *iov;
+    uint8_t *buf;
+    size_t size;
+    unsigned int niov;
+    unsigned long count;
+    unsigned long eagain;
+    int err;
+};
+
+struct bench_case
+{
+    const char *test;
+    size_t size;
+    unsigned int niov;
+    unsigned int nsender;
+    unsigned int nrule;
+    unsigned long count;
+};
+
+static struct bench_ring rx_ring, echo_ring;
+static domid_t self;
+static pthread_barrier_t start_barrier;
+static volatile int failed;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long v4v_op(xc_interface *xch, int cmd, void *arg1, void *arg2,
+                   uint32_t arg3, uint32_t arg4)
+{
+    DECLARE_HYPERCALL;
+    long ret;
+
+    hypercall.op = __HYPERVISOR_v4v_op;
+    hypercall.arg[0] = cmd;
+    hypercall.arg[1] = (unsigned long)arg1;
+    hypercall.arg[2] = (unsigned long)arg2;
+    hypercall.arg[3] = arg3;
+    hypercall.arg[4] = arg4;
+
+    ret = do_xen_hypercall(xch, &hypercall);
+    return (ret < 0) ? -errno : ret;
+}
+
+/* locked, faulted in memory, which xen can use for the whole run */
+static void *bench_alloc(size_t size)
+{
+    void *p;
+
+    size = (size + XC_PAGE_SIZE - 1) & XC_PAGE_MASK;
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( p == MAP_FAILED )
+        return NULL;
+
+    if ( mlock(p, size) )
+    {
+        munmap(p, size);
+        return NULL;
+    }
+    memset(p, 0, size);
+
+    return p;
+}
+
+static void bench_free(void *p, size_t size)
+{
+    if ( !p )
+        return;
+    size = (size + XC_PAGE_SIZE - 1) & XC_PAGE_MASK;
+    munlock(p, size);
+    munmap(p, size);
+}
+
+/* frame numbers of the npage pages at p */
+static int bench_pfns(void *p, size_t npage, v4v_pfn_t *pfns)
+{
+    unsigned long va = (unsigned long)p;
+    uint64_t ent;
+    size_t i;
+    int fd, ret = 0;
+
+    fd = open("/proc/self/pagemap", O_RDONLY);
+    if ( fd < 0 )
+        return -errno;
+
+    for ( i = 0; i < npage; i++, va += XC_PAGE_SIZE )
+    {
+        if ( pread(fd, &ent, sizeof(ent),
+                   (va >> XC_PAGE_SHIFT) * sizeof(ent)) != sizeof(ent) )
+        {
+            ret = -EIO;
+            break;
+        }
+        /* present, and a frame number the kernel let us see */
+        if ( !(ent & (1ULL << 63)) || !(ent & ((1ULL << 55) - 1)) )
+        {
+            ret = -EPERM;
+            break;
+        }
+        pfns[i] = ent & ((1ULL << 55) - 1);
+    }
+
+    close(fd);
+    return ret;
+}
+
+static int ring_register(xc_interface *xch, struct bench_ring *r,
+                         uint32_t port)
+{
+    long ret;
+
+    r->npage = (sizeof(v4v_ring_t) + opt_ring_len + XC_PAGE_SIZE - 1) >>
+               XC_PAGE_SHIFT;
+    r->ring = bench_alloc(r->npage << XC_PAGE_SHIFT);
+    r->pfns = bench_alloc(r->npage * sizeof(v4v_pfn_t));
+    if ( !r->ring || !r->pfns )
+        return -ENOMEM;
+
+    if ( (ret = bench_pfns(r->ring, r->npage, r->pfns)) )
+        return ret;
+
+    r->ring->magic = V4V_RING_MAGIC;
+    r->ring->id.addr.port = port;
+    r->ring->id.addr.domain = V4V_DOMID_ANY;
+    r->ring->id.partner = V4V_DOMID_ANY;
+    r->ring->len = opt_ring_len;
+    if ( opt_polling )
+        r->ring->flags = V4V_RING_F_POLLING;
+
+    ret = v4v_op(xch, V4VOP_register_ring, r->ring, r->pfns, r->npage, 0);
+    if ( ret )
+        return ret;
+
+    /* xen filled in our domain id */
+    self = r->ring->id.addr.domain;
+    return 0;
+}
+
+static void ring_unregister(xc_interface *xch, struct bench_ring *r)
+{
+    if ( r->ring && r->ring->magic )
+        v4v_op(xch, V4VOP_unregister_ring, r->ring, NULL, 0, 0);
+    bench_free(r->ring, r->npage << XC_PAGE_SHIFT);
+    bench_free(r->pfns, r->npage * sizeof(v4v_pfn_t));
+    memset(r, 0, sizeof(*r));
+}
+
+/* consume every message in r, returns how many there were */
+static unsigned long ring_drain(v4v_ring_t *r)
+{
+    uint32_t rx = r->rx_ptr;
+    uint32_t tx = *(volatile uint32_t *)&r->tx_ptr;
+    unsigned long n = 0;
+
+    xen_rmb();
+    while ( rx != tx )
+    {
+        struct v4v_ring_message_header *mh = (void *)&r->ring[rx];
+
+        rx += BENCH_ROUNDUP(mh->len);
+        if ( rx >= r->len )
+            rx -= r->len;
+        n++;
+    }
+
+    if ( n )
+    {
+        /* done reading before giving the space back */
+        xen_mb();
+        *(volatile uint32_t *)&r->rx_ptr = rx;
+    }
+
+    return n;
+}
+
+static int sender_init(struct bench_sender *s, unsigned int idx,
+                       uint32_t dst_port, const struct bench_case *c)
+{
+    size_t chunk = c->size / c->niov;
+    unsigned int i;
+
+    memset(s, 0, sizeof(*s));
+    s->size = c->size;
+    s->niov = c->niov;
+    s->count = c->count;
+    s->xch = xc_interface_open(NULL, NULL, 0);
+    s->addr = bench_alloc(sizeof(*s->addr));
+    s->iov = bench_alloc(c->niov * sizeof(*s->iov));
+    s->buf = bench_alloc(c->size);
+    if ( !s->xch || !s->addr || !s->iov || !s->buf )
+        return -ENOMEM;
+
+    s->addr->src.port = BENCH_PORT_TX + idx;
+    s->addr->src.domain = self;
+    s->addr->dst.port = dst_port;
+    s->addr->dst.domain = self;
+
+    for ( i = 0; i < c->niov; i++ )
+    {
+        s->iov[i].iov_base = (unsigned long)(s->buf + i * chunk);
+        s->iov[i].iov_len = (i == c->niov - 1) ?
+                            c->size - i * chunk : chunk;
+    }
+    memset(s->buf, idx, c->size);
+
+    return 0;
+}
+
+static void sender_fini(struct bench_sender *s)
+{
+    if ( s->xch )
+        xc_interface_close(s->xch);
+    bench_free(s->addr, sizeof(*s->addr));
+    bench_free(s->iov, s->niov * sizeof(*s->iov));
+    bench_free(s->buf, s->size);
+}
+
+/* send one message, spinning while the ring is full */
+static int sender_send(struct bench_sender *s)
+{
+    long ret;
+
+    while ( !failed )
+    {
+        ret = v4v_op(s->xch, V4VOP_sendv, s->addr, s->iov, s->niov,
+                     V4V_MESSAGE_DGRAM);
+        if ( ret >= 0 )
+            return 0;
+        if ( ret != -EAGAIN )
+        {
+            s->err = -ret;
+            failed = 1;
+            return ret;
+        }
+        s->eagain++;
+        sched_yield();
+    }
+
+    return -EINTR;
+}
+
+static void *throughput_sender(void *arg)
+{
+    struct bench_sender *s = arg;
+    unsigned long i;
+
+    pthread_barrier_wait(&start_barrier);
+    for ( i = 0; i < s->count; i++ )
+        if ( sender_send(s) )
+            break;
+
+    return NULL;
+}
+
+/* sends each message that comes into rx_ring back to echo_ring */
+static void *latency_echo(void *arg)
+{
+    struct bench_sender *s = arg;
+    unsigned long done = 0;
+
+    pthread_barrier_wait(&start_barrier);
+    while ( (done < s->count) && !failed )
+    {
+        unsigned long n = ring_drain(rx_ring.ring);
+
+        for ( ; n; n--, done++ )
+            if ( sender_send(s) )
+                break;
+    }
+
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void print_header(void)
+{
+    printf("test,size,niov,senders,rules,messages,eagain,seconds,"
+           "msgs_per_s,mbytes_per_s,rtt_avg_us,rtt_p50_us,rtt_p99_us,"
+           "rtt_max_us\n");
+}
+
+static void print_result(const struct bench_case *c, unsigned long eagain,
+                         double secs, const double *rtt)
+{
+    unsigned long msgs = c->count * c->nsender;
+
+    printf("%s,%zu,%u,%u,%u,%lu,%lu,%.6f,%.0f,%.2f,", c->test, c->size,
+           c->niov, c->nsender, c->nrule, msgs, eagain, secs, msgs / secs,
+           (double)msgs * c->size / secs / 1e6);
+    if ( rtt )
+        printf("%.2f,%.2f,%.2f,%.2f\n", secs / c->count * 1e6,
+               rtt[c->count / 2] * 1e6, rtt[c->count * 99 / 100] * 1e6,
+               rtt[c->count - 1] * 1e6);
+    else
+        printf(",,,\n");
+    fflush(stdout);
+}
+
+static int run_throughput(struct bench_case *c)
+{
+    struct bench_sender *s;
+    unsigned long got = 0, total = c->count * c->nsender, eagain = 0;
+    unsigned int i, started = 0;
+    double t0, t1;
+    int ret = 0;
+
+    s = calloc(c->nsender, sizeof(*s));
+    if ( !s )
+        return -ENOMEM;
+
+    failed = 0;
+    pthread_barrier_init(&start_barrier, NULL, c->nsender + 1);
+    for ( i = 0; i < c->nsender; i++ )
+    {
+        if ( (ret = sender_init(&s[i], i, BENCH_PORT_RX, c)) ||
+             (ret = -pthread_create(&s[i].thread, NULL, throughput_sender,
+                                    &s[i])) )
+        {
+            failed = 1;
+            break;
+        }
+        started++;
+    }
+
+    /* senders that did start are waiting for us */
+    if ( started < c->nsender )
+    {
+        pthread_barrier_destroy(&start_barrier);
+        pthread_barrier_init(&start_barrier, NULL, started + 1);
+    }
+    pthread_barrier_wait(&start_barrier);
+
+    t0 = now();
+    while ( (got < total) && !failed )
+        got += ring_drain(rx_ring.ring);
+    t1 = now();
+
+    for ( i = 0; i < started; i++ )
+        pthread_join(s[i].thread, NULL);
+    ring_drain(rx_ring.ring);
+
+    for ( i = 0; i < c->nsender; i++ )
+    {
+        if ( s[i].err && !ret )
+            ret = -s[i].err;
+        eagain += s[i].eagain;
+        sender_fini(&s[i]);
+    }
+    pthread_barrier_destroy(&start_barrier);
+    free(s);
+
+    if ( !ret && !failed )
+        print_result(c, eagain, t1 - t0, NULL);
+
+    return ret;
+}
+
+static int run_latency(struct bench_case *c)
+{
+    struct bench_sender ping, echo;
+    double *rtt, t0, t1, start;
+    unsigned long i;
+    int ret;
+
+    rtt = calloc(c->count, sizeof(*rtt));
+    if ( !rtt )
+        return -ENOMEM;
+
+    failed = 0;
+    memset(&echo, 0, sizeof(echo));
+    if ( (ret = sender_init(&ping, 0, BENCH_PORT_RX, c)) ||
+         (ret = sender_init(&echo, 1, BENCH_PORT_ECHO, c)) )
+        goto out;
+
+    pthread_barrier_init(&start_barrier, NULL, 2);
+    if ( (ret = -pthread_create(&echo.thread, NULL, latency_echo, &echo)) )
+    {
+        pthread_barrier_destroy(&start_barrier);
+        goto out;
+    }
+    pthread_barrier_wait(&start_barrier);
+
+    start = now();
+    for ( i = 0; (i < c->count) && !failed; i++ )
+    {
+        t0 = now();
+        if ( sender_send(&ping) )
+            break;
+        while ( !ring_drain(echo_ring.ring) && !failed )
+            ;
+        t1 = now();
+        rtt[i] = t1 - t0;
+    }
+    t1 = now();
+
+    failed |= (i < c->count);
+    pthread_join(echo.thread, NULL);
+    pthread_barrier_destroy(&start_barrier);
+    ring_drain(rx_ring.ring);
+    ring_drain(echo_ring.ring);
+
+    ret = ping.err ? -ping.err : echo.err ? -echo.err : 0;
+    if ( !ret && !failed )
+    {
+        qsort(rtt, c->count, sizeof(*rtt), cmp_double);
+        print_result(c, ping.eagain + echo.eagain, t1 - start, rtt);
+    }
+
+ out:
+    sender_fini(&ping);
+    sender_fini(&echo);
+    free(rtt);
+    return ret;
+}
+
+/*
+ * Rules that never match our traffic, but which every send from a source
+ * without a cached verdict walks.
+ */
+static int rules_load(xc_interface *xch, v4vtables_rule_t *rule,
+                      unsigned int nrule, int add)
+{
+    unsigned int i;
+    long ret = 0;
+
+    for ( i = 0; i < nrule; i++ )
+    {
+        rule->src.domain = V4V_DOMID_ANY;
+        rule->src.port = V4V_PORT_ANY;
+        rule->dst.domain = V4V_DOMID_ANY;
+        rule->dst.port = BENCH_PORT_RULE + i;
+        rule->accept = 0;
+
+        if ( add )
+            ret = v4v_op(xch, V4VOP_tables_add, rule, NULL, 1, 0);
+        else
+            ret = v4v_op(xch, V4VOP_tables_del, rule, NULL, (uint32_t)-1, 0);
+        if ( ret )
+            break;
+    }
+
+    return ret;
+}
+
+static unsigned long case_count(size_t size)
+{
+    unsigned long count = opt_count;
+
+    if ( count * size > BENCH_MAX_BYTES )
+        count = BENCH_MAX_BYTES / size;
+    return (count < BENCH_MIN_COUNT) ? BENCH_MIN_COUNT : count;
+}
+
+static int run_matrix(xc_interface *xch, unsigned int nrule)
+{
+    struct bench_case c;
+    int ret = 0;
+
+    c.nrule = nrule;
+    for ( c.size = BENCH_MIN_SIZE; c.size <= opt_max_size; c.size *= 4 )
+    {
+        /* a message must leave room in the ring for the next one */
+        if ( BENCH_ROUNDUP(c.size + sizeof(struct v4v_ring_message_header))
+             * 2 > opt_ring_len )
+        {
+            fprintf(stderr, "%zu byte messages don't fit a %"PRIu32
+                    " byte ring, skipped\n", c.size, opt_ring_len);
+            break;
+        }
+
+        c.count = case_count(c.size);
+        for ( c.niov = 1; (c.niov <= opt_max_iov) && (c.niov <= c.size) &&
+                          (c.niov <= V4V_MAXIOV); c.niov *= 4 )
+        {
+            c.test = "throughput";
+            for ( c.nsender = 1; opt_throughput &&
+                                 (c.nsender <= opt_max_senders);
+                  c.nsender *= 2 )
+                if ( (ret = run_throughput(&c)) )
+                    goto out;
+
+            c.test = "latency";
+            c.nsender = 1;
+            if ( opt_latency && (ret = run_latency(&c)) )
+                goto out;
+        }
+    }
+
+ out:
+    if ( ret )
+        fprintf(stderr, "%s size %zu niov %u senders %u rules %u: %s\n",
+                c.test, c.size, c.niov, c.nsender, c.nrule, strerror(-ret));
+    return ret;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -n COUNT    messages per sender and case (default %lu)\n"
+            "  -S SIZE     largest message size, from 16 by 4x (default %zu)\n"
+            "  -I NIOV     most iovs per message, from 1 by 4x (default %u)\n"
+            "  -N SENDERS  most concurrent senders, from 1 by 2x (default %u)\n"
+            "  -R RULES    v4vtables rules for the second pass, 0 for none "
+            "(default %u)\n"
+            "  -r LEN      ring size in bytes (default %"PRIu32")\n"
+            "  -t / -l     throughput / latency cases only\n"
+            "  -p          receiver busy-polls, no events (V4V_RING_F_POLLING)\n",
+            prog, opt_count, opt_max_size, opt_max_iov, opt_max_senders,
+            opt_rules, opt_ring_len);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    xc_interface *xch;
+    v4vtables_rule_t *rule = NULL;
+    int opt, ret;
+
+    while ( (opt = getopt(argc, argv, "n:S:I:N:R:r:tlph")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'n': opt_count = strtoul(optarg, NULL, 0); break;
+        case 'S': opt_max_size = strtoul(optarg, NULL, 0); break;
+        case 'I': opt_max_iov = strtoul(optarg, NULL, 0); break;
+        case 'N': opt_max_senders = strtoul(optarg, NULL, 0); break;
+        case 'R': opt_rules = strtoul(optarg, NULL, 0); break;
+        case 'r': opt_ring_len = strtoul(optarg, NULL, 0); break;
+        case 't': opt_latency = 0; opt_throughput = 1; break;
+        case 'l': opt_throughput = 0; opt_latency = 1; break;
+        case 'p': opt_polling = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+
+    if ( !opt_count || !opt_max_senders || !opt_max_iov ||
+         (opt_ring_len & (V4V_RING_MSG_ALIGN(0) - 1)) )
+        usage(argv[0]);
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    if ( !xch )
+    {
+        fprintf(stderr, "can't open the hypervisor interface\n");
+        return 1;
+    }
+
+    if ( (ret = ring_register(xch, &rx_ring, BENCH_PORT_RX)) ||
+         (ret = ring_register(xch, &echo_ring, BENCH_PORT_ECHO)) )
+    {
+        fprintf(stderr, "can't register the rings: %s\n", strerror(-ret));
+        goto out;
+    }
+
+    print_header();
+    if ( (ret = run_matrix(xch, 0)) || !opt_rules )
+        goto out;
+
+    rule = bench_alloc(sizeof(*rule));
+    if ( !rule )
+    {
+        ret = -ENOMEM;
+        goto out;
+    }
+    if ( (ret = rules_load(xch, rule, opt_rules, 1)) )
+        fprintf(stderr, "can't add the v4vtables rules: %s\n",
+                strerror(-ret));
+    else
+        ret = run_matrix(xch, opt_rules);
+    rules_load(xch, rule, opt_rules, 0);
+    bench_free(rule, sizeof(*rule));
+
+ out:
+    ring_unregister(xch, &echo_ring);
+    ring_unregister(xch, &rx_ring);
+    xc_interface_close(xch);
+    return ret ? 1 : 0;
+}
@@ -163,6 +163,91 @@ static struct x86_emulate_ops emulops = {
     .get_fpu    = get_fpu,
 };
 
+static inline uint64_t rdtsc(void)
+{
+    uint32_t lo, hi;
+
+    asm volatile ( "rdtsc" : "=a" (lo), "=d" (hi) );
+
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* Instruction classes timed by -b, as an MMIO or PIO exit sees them. */
+static const struct {
+    const char *name;
+    uint8_t insn[12];
+    unsigned int len;
+} bench_insns[] = {
+    { "movl %ecx,(%eax)",          { 0x89, 0x08 }, 2 },
+    { "movl (%eax),%ecx",          { 0x8b, 0x08 }, 2 },
+    { "movl $imm,4(%eax,%ebx)",    { 0xc7, 0x44, 0x18, 0x04,
+                                     0x78, 0x56, 0x34, 0x12 }, 8 },
+    { "movzwl 0x10(%eax),%ecx",    { 0x0f, 0xb7, 0x48, 0x10 }, 4 },
+    { "addl %ecx,%eax",            { 0x01, 0xc8 }, 2 },
+    { "addl %ecx,(%eax)",          { 0x01, 0x08 }, 2 },
+    { "xchgl %ecx,(%eax)",         { 0x87, 0x08 }, 2 },
+    { "lock cmpxchgl %ecx,(%eax)", { 0xf0, 0x0f, 0xb1, 0x08 }, 4 },
+    { "rep movsw (1 rep)",         { 0xf3, 0x66, 0xa5 }, 3 },
+    { "pushl %eax; popl %ecx",     { 0x50, 0x59 }, 2 },
+};
+
+/*
+ * Cycles per x86_emulate() call for each class: decode and execute, the
+ * two cannot be timed apart. Registers are reset before every call.
+ */
+static int bench(struct x86_emulate_ctxt *ctxt, char *instr, void *mem,
+                 unsigned int iters)
+{
+    struct cpu_user_regs *regs = ctxt->regs;
+    unsigned int i, j, n;
+    uint64_t t, best;
+    int rc;
+
+    printf("%-30s %10s\n", "instruction", "cycles");
+    for ( i = 0; i < sizeof(bench_insns) / sizeof(bench_insns[0]); i++ )
+    {
+        memcpy(instr, bench_insns[i].insn, bench_insns[i].len);
+        n = (bench_insns[i].insn[0] == 0x50) ? 2 : 1;
+        best = ~0ULL;
+        /* The best of a few runs, to leave interrupts and the like out. */
+        for ( j = 0; j < 8; j++ )
+        {
+            unsigned int k;
+
+            t = rdtsc();
+            for ( k = 0; k < iters; k++ )
+            {
+                unsigned int m;
+
+                regs->eflags = 0x200;
+                regs->eip    = (unsigned long)instr;
+                regs->eax    = (unsigned long)mem;
+                regs->ebx    = 0;
+                regs->ecx    = 1;
+                regs->esi    = (unsigned long)mem;
+                regs->edi    = (unsigned long)mem + 8;
+                regs->esp    = (unsigned long)mem + 0x100;
+                for ( m = 0; m < n; m++ )
+                {
+                    rc = x86_emulate(ctxt, &emulops);
+                    if ( rc != X86EMUL_OKAY )
+                    {
+                        printf("%s: failed (%d)\n", bench_insns[i].name, rc);
+                        return 1;
+                    }
+                }
+            }
+            t = rdtsc() - t;
+            if ( t < best )
+                best = t;
+        }
+        printf("%-30s %10.1f\n", bench_insns[i].name,
+               (double)best / ((uint64_t)iters * n));
+    }
+
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     struct x86_emulate_ctxt ctxt;
@@ -200,6 +285,10 @@ int main(int argc, char **argv)
     if ( !stack_exec )
         printf("Warning: Stack could not be made executable (%d).\n", errno);
 
+    if ( argc > 1 && !strcmp(argv[1], "-b") )
+        return bench(&ctxt, instr, res,
+                     (argc > 2) ? strtoul(argv[2], NULL, 0) ?: 1 : 100000);
+
     printf("%-40s", "Testing addl %%ecx,(%%eax)...");
     instr[0] = 0x01; instr[1] = 0x08;
     regs.eflags = 0x200;
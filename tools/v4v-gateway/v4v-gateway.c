@@ -0,0 +1,670 @@
+/*
+ * v4v-gateway.c
+ *
+ * Bridge TCP or UNIX stream sockets to v4v datagram endpoints of guests.
+ *
+ * Each mapping listens on a socket and forwards every connection made to
+ * it to a (domain, port) v4v endpoint. A connection is a flow with a
+ * ring of its own, registered at a port of ours which only the guest may
+ * send to: what the guest sends to that port goes back to the client, so
+ * the guest service tells clients apart by their source port.
+ *
+ * Bytes read from the client are sent as datagrams of at most -m bytes,
+ * one hypercall each so the guest gets them in order. The other way the
+ * flow's ring is drained a batch at a time: the messages are peeked at
+ * in place and written to the client with one writev(), and their space
+ * given back once the client took them.
+ *
+ * Neither side is buffered beyond that, a slow end pushes back on the
+ * other one: while the guest ring has no room for the flow the client
+ * socket isn't read (a V4VOP_notify space request has xen signal the
+ * flow's ring once there is room), and while the client doesn't keep up
+ * the flow's ring isn't drained and the guest gets -EAGAIN.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <libxenv4v.h>
+
+/* messages drained from a flow's ring per writev() */
+#define GW_BATCH        32
+#define GW_MAX_EVENTS   64
+
+enum gw_ev_type {
+    GW_EV_LISTEN,
+    GW_EV_SOCK,
+    GW_EV_RING,
+};
+
+struct gw_map;
+struct gw_flow;
+
+/* what epoll_event.data.ptr points at */
+struct gw_ev {
+    enum gw_ev_type type;
+    struct gw_map *map;
+    struct gw_flow *flow;
+};
+
+struct gw_map {
+    const char *spec;
+    int listen_fd;
+    v4v_addr_t dst;
+    struct gw_ev ev;
+    struct gw_map *next;
+};
+
+struct gw_flow {
+    struct gw_map *map;
+    int fd;
+    struct libxenv4v *v4v;
+    struct gw_ev sock_ev, ring_ev;
+    /* the socket events asked for, EPOLLIN unless blocked on the guest */
+    uint32_t events;
+
+    /* read from the client, waiting for room in the guest ring */
+    uint8_t *out;
+    uint32_t out_len;
+
+    /* peeked at in the flow's ring, done bytes of it written out */
+    struct libxenv4v_msg msg[GW_BATCH];
+    unsigned int nmsg;
+    size_t done;
+
+    struct gw_flow *prev, *next;
+};
+
+static int epfd = -1;
+static struct gw_map *maps;
+static struct gw_flow *flows;
+static unsigned int nflow;
+
+static uint32_t opt_ring_len = 256 * 1024;
+static uint32_t opt_msg_max = 16 * 1024;
+static uint32_t opt_base_port = 0x47570000;
+static unsigned int opt_max_flows = 1024;
+static int opt_foreground;
+
+static uint32_t next_port;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-f] [-r ring_len] [-m msg_max] [-b base_port]\n"
+            "          [-n max_flows] MAP...\n"
+            "MAP is LISTEN=DOMID:PORT, LISTEN one of\n"
+            "  tcp:[ADDR:]PORT   a TCP port, on ADDR (or [ADDR]) if given\n"
+            "  unix:PATH         a UNIX stream socket\n"
+            "Connections to LISTEN are forwarded to the v4v port PORT of\n"
+            "domain DOMID.\n", prog);
+    exit(2);
+}
+
+static int set_nonblock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    if ( flags < 0 )
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int ev_add(int fd, uint32_t events, struct gw_ev *ev)
+{
+    struct epoll_event e;
+
+    memset(&e, 0, sizeof(e));
+    e.events = events;
+    e.data.ptr = ev;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &e);
+}
+
+static void flow_sock_events(struct gw_flow *f, uint32_t events)
+{
+    struct epoll_event e;
+
+    if ( events == f->events )
+        return;
+
+    memset(&e, 0, sizeof(e));
+    e.events = events;
+    e.data.ptr = &f->sock_ev;
+    if ( epoll_ctl(epfd, EPOLL_CTL_MOD, f->fd, &e) )
+        syslog(LOG_ERR, "%s: epoll_ctl: %m", f->map->spec);
+    else
+        f->events = events;
+}
+
+static void flow_close(struct gw_flow *f)
+{
+    if ( f->prev )
+        f->prev->next = f->next;
+    else
+        flows = f->next;
+    if ( f->next )
+        f->next->prev = f->prev;
+    nflow--;
+
+    /* closing the fds takes them out of the epoll set */
+    close(f->fd);
+    libxenv4v_close(f->v4v);
+    libxenv4v_buffer_free(f->out, opt_msg_max);
+    free(f);
+}
+
+/*
+ * Send what was read from the client to the guest. On -EAGAIN ask xen
+ * whether there is room for it now, in case the guest made some since,
+ * and have the flow's ring signalled otherwise.
+ * @return 1 if sent, 0 if still waiting for room, -1 to close the flow
+ */
+static int flow_flush_out(struct gw_flow *f)
+{
+    v4v_ring_data_ent_t ent;
+
+    while ( f->out_len )
+    {
+        if ( libxenv4v_send(f->v4v, &f->map->dst, V4V_MESSAGE_DGRAM,
+                            f->out, f->out_len) >= 0 )
+        {
+            f->out_len = 0;
+            break;
+        }
+        if ( errno != EAGAIN )
+        {
+            syslog(LOG_WARNING, "%s: send to guest: %m", f->map->spec);
+            return -1;
+        }
+
+        memset(&ent, 0, sizeof(ent));
+        ent.ring = f->map->dst;
+        ent.space_required = f->out_len;
+        if ( libxenv4v_notify(f->v4v, &ent, 1) )
+            return -1;
+        if ( !(ent.flags & V4V_RING_DATA_F_SUFFICIENT) )
+            return 0;
+    }
+
+    return 1;
+}
+
+/* client to guest, until the client or the guest ring runs dry */
+static int flow_sock_in(struct gw_flow *f)
+{
+    ssize_t n;
+    int ret;
+
+    for ( ; ; )
+    {
+        ret = flow_flush_out(f);
+        if ( ret < 0 )
+            return ret;
+        if ( ret == 0 )
+        {
+            /* stop reading until the guest makes room */
+            flow_sock_events(f, f->events & ~EPOLLIN);
+            return 0;
+        }
+
+        n = read(f->fd, f->out, opt_msg_max);
+        if ( n == 0 )
+            return -1;
+        if ( n < 0 )
+            return ((errno == EAGAIN) || (errno == EINTR)) ? 0 : -1;
+        f->out_len = n;
+    }
+}
+
+/* guest to client, until the ring is empty or the client full */
+static int flow_ring_out(struct gw_flow *f)
+{
+    struct iovec iov[2 * GW_BATCH];
+    unsigned int i, niov;
+    size_t total, skip;
+    ssize_t n;
+    int ret;
+
+    for ( ; ; )
+    {
+        if ( !f->nmsg )
+        {
+            ret = libxenv4v_peek_batch(f->v4v, f->msg, GW_BATCH);
+            if ( ret < 0 )
+            {
+                syslog(LOG_WARNING, "%s: ring of port %#x: %m",
+                       f->map->spec, f->v4v->id.addr.port);
+                return -1;
+            }
+            if ( ret == 0 )
+            {
+                /* the space of skipped messages goes back too */
+                libxenv4v_consume(f->v4v);
+                break;
+            }
+            f->nmsg = ret;
+            f->done = 0;
+        }
+
+        niov = 0;
+        total = 0;
+        skip = f->done;
+        for ( i = 0; i < f->nmsg; i++ )
+        {
+            const struct libxenv4v_msg *m = &f->msg[i];
+            unsigned int s;
+
+            /* only the guest endpoint speaks for the flow */
+            if ( (m->source.domain != f->map->dst.domain) ||
+                 (m->source.port != f->map->dst.port) )
+                continue;
+
+            for ( s = 0; s < 2; s++ )
+            {
+                size_t len = m->seg_len[s];
+
+                total += len;
+                if ( skip >= len )
+                {
+                    skip -= len;
+                    continue;
+                }
+                iov[niov].iov_base = (uint8_t *)m->seg[s] + skip;
+                iov[niov].iov_len = len - skip;
+                niov++;
+                skip = 0;
+            }
+        }
+
+        if ( niov )
+        {
+            n = writev(f->fd, iov, niov);
+            if ( n < 0 )
+            {
+                if ( (errno != EAGAIN) && (errno != EINTR) )
+                    return -1;
+                n = 0;
+            }
+            f->done += n;
+            if ( f->done < total )
+            {
+                /* carry on once the client took some */
+                flow_sock_events(f, f->events | EPOLLOUT);
+                return 0;
+            }
+        }
+
+        libxenv4v_consume(f->v4v);
+        f->nmsg = 0;
+    }
+
+    flow_sock_events(f, f->events & ~EPOLLOUT);
+    return 0;
+}
+
+/* the flow's ring was signalled: messages, or room in the guest ring */
+static int flow_ring_event(struct gw_flow *f)
+{
+    int ret;
+
+    if ( libxenv4v_wait(f->v4v) )
+        return -1;
+
+    if ( !(f->events & EPOLLIN) )
+    {
+        ret = flow_flush_out(f);
+        if ( ret < 0 )
+            return ret;
+        if ( ret > 0 )
+        {
+            flow_sock_events(f, f->events | EPOLLIN);
+            if ( flow_sock_in(f) < 0 )
+                return -1;
+        }
+    }
+
+    return flow_ring_out(f);
+}
+
+static void map_accept(struct gw_map *m)
+{
+    struct gw_flow *f;
+    unsigned int tries;
+    int fd;
+
+    for ( ; ; )
+    {
+        fd = accept(m->listen_fd, NULL, NULL);
+        if ( fd < 0 )
+        {
+            if ( (errno != EAGAIN) && (errno != EINTR) )
+                syslog(LOG_WARNING, "%s: accept: %m", m->spec);
+            return;
+        }
+
+        if ( (nflow >= opt_max_flows) || set_nonblock(fd) )
+            goto fail;
+
+        f = calloc(1, sizeof(*f));
+        if ( !f )
+            goto fail;
+        f->map = m;
+        f->fd = fd;
+        f->sock_ev.type = GW_EV_SOCK;
+        f->sock_ev.flow = f;
+        f->ring_ev.type = GW_EV_RING;
+        f->ring_ev.flow = f;
+
+        f->out = libxenv4v_buffer_alloc(opt_msg_max);
+        if ( !f->out )
+            goto fail_flow;
+
+        /* a port of ours nobody else uses */
+        for ( tries = 0; !f->v4v && (tries < opt_max_flows); tries++ )
+        {
+            f->v4v = libxenv4v_open(NULL, next_port, m->dst.domain,
+                                    opt_ring_len, 0);
+            if ( ++next_port == opt_base_port + opt_max_flows )
+                next_port = opt_base_port;
+            if ( !f->v4v && (errno != EEXIST) )
+                break;
+        }
+        if ( !f->v4v )
+        {
+            syslog(LOG_ERR, "%s: ring for a new flow: %m", m->spec);
+            goto fail_flow;
+        }
+
+        f->events = EPOLLIN;
+        if ( ev_add(fd, f->events, &f->sock_ev) ||
+             ev_add(libxenv4v_fd_for_select(f->v4v), EPOLLIN, &f->ring_ev) )
+        {
+            syslog(LOG_ERR, "%s: epoll_ctl: %m", m->spec);
+            goto fail_flow;
+        }
+
+        f->next = flows;
+        if ( flows )
+            flows->prev = f;
+        flows = f;
+        nflow++;
+        continue;
+
+    fail_flow:
+        libxenv4v_close(f->v4v);
+        libxenv4v_buffer_free(f->out, opt_msg_max);
+        free(f);
+    fail:
+        close(fd);
+    }
+}
+
+static int map_listen(struct gw_map *m, char *where)
+{
+    struct addrinfo hints, *ai = NULL;
+    struct sockaddr_un sun;
+    char *host = NULL, *port, *end;
+    int one = 1, fd = -1, ret;
+
+    if ( !strncmp(where, "unix:", 5) )
+    {
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if ( strlen(where + 5) >= sizeof(sun.sun_path) )
+        {
+            fprintf(stderr, "%s: path too long\n", m->spec);
+            return -1;
+        }
+        strcpy(sun.sun_path, where + 5);
+        unlink(sun.sun_path);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if ( (fd < 0) ||
+             bind(fd, (struct sockaddr *)&sun, sizeof(sun)) )
+            goto fail;
+    }
+    else if ( !strncmp(where, "tcp:", 4) )
+    {
+        port = strrchr(where + 4, ':');
+        if ( port )
+        {
+            *port++ = '\0';
+            host = where + 4;
+            if ( (host[0] == '[') && ((end = strchr(host, ']')) != NULL) )
+            {
+                host++;
+                *end = '\0';
+            }
+        }
+        else
+            port = where + 4;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        ret = getaddrinfo(host, port, &hints, &ai);
+        if ( ret )
+        {
+            fprintf(stderr, "%s: %s\n", m->spec, gai_strerror(ret));
+            return -1;
+        }
+
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if ( (fd < 0) ||
+             setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+             bind(fd, ai->ai_addr, ai->ai_addrlen) )
+            goto fail;
+        freeaddrinfo(ai);
+        ai = NULL;
+    }
+    else
+    {
+        fprintf(stderr, "%s: unknown socket type\n", m->spec);
+        return -1;
+    }
+
+    if ( listen(fd, SOMAXCONN) || set_nonblock(fd) )
+        goto fail;
+
+    m->listen_fd = fd;
+    m->ev.type = GW_EV_LISTEN;
+    m->ev.map = m;
+    return 0;
+
+fail:
+    perror(m->spec);
+    if ( ai )
+        freeaddrinfo(ai);
+    if ( fd >= 0 )
+        close(fd);
+    return -1;
+}
+
+static int map_parse(const char *spec)
+{
+    struct gw_map *m;
+    char *where, *dst, *port, *end;
+    unsigned long val;
+
+    m = calloc(1, sizeof(*m));
+    where = strdup(spec);
+    if ( !m || !where )
+    {
+        perror("map");
+        return -1;
+    }
+    m->spec = spec;
+    m->listen_fd = -1;
+
+    dst = strrchr(where, '=');
+    if ( !dst || !(port = strchr(dst, ':')) )
+        goto bad;
+    *dst++ = '\0';
+    *port++ = '\0';
+
+    val = strtoul(dst, &end, 0);
+    if ( !*dst || *end || (val >= DOMID_FIRST_RESERVED) )
+        goto bad;
+    m->dst.domain = val;
+    val = strtoul(port, &end, 0);
+    if ( !*port || *end || (val > UINT32_MAX) || (val == V4V_PORT_ANY) )
+        goto bad;
+    m->dst.port = val;
+
+    if ( map_listen(m, where) )
+        return -1;
+    free(where);
+
+    m->next = maps;
+    maps = m;
+    return 0;
+
+bad:
+    fprintf(stderr, "%s: expected LISTEN=DOMID:PORT\n", spec);
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    struct epoll_event ev[GW_MAX_EVENTS];
+    struct gw_map *m;
+    struct gw_ev *e;
+    int i, j, n, opt;
+
+    while ( (opt = getopt(argc, argv, "fr:m:b:n:h")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'f':
+            opt_foreground = 1;
+            break;
+        case 'r':
+            opt_ring_len = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            opt_msg_max = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            opt_base_port = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            opt_max_flows = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if ( (optind == argc) || !opt_msg_max || !opt_max_flows ||
+         !opt_ring_len || (opt_ring_len % V4V_RING_MSG_ALIGN(0)) ||
+         (opt_base_port == V4V_PORT_ANY) )
+        usage(argv[0]);
+    next_port = opt_base_port;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if ( epfd < 0 )
+    {
+        perror("epoll_create1");
+        return 1;
+    }
+
+    for ( i = optind; i < argc; i++ )
+        if ( map_parse(argv[i]) )
+            return 1;
+
+    if ( !opt_foreground && daemon(0, 0) )
+    {
+        perror("daemon");
+        return 1;
+    }
+    openlog("v4v-gateway", opt_foreground ? LOG_PERROR : 0, LOG_DAEMON);
+
+    for ( m = maps; m; m = m->next )
+    {
+        if ( ev_add(m->listen_fd, EPOLLIN, &m->ev) )
+        {
+            syslog(LOG_ERR, "%s: epoll_ctl: %m", m->spec);
+            return 1;
+        }
+        syslog(LOG_INFO, "%s: forwarding to domain %u port %#x", m->spec,
+               m->dst.domain, m->dst.port);
+    }
+
+    for ( ; ; )
+    {
+        n = epoll_wait(epfd, ev, GW_MAX_EVENTS, -1);
+        if ( n < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            syslog(LOG_ERR, "epoll_wait: %m");
+            return 1;
+        }
+
+        for ( i = 0; i < n; i++ )
+        {
+            e = ev[i].data.ptr;
+            if ( !e )
+                continue;
+            switch ( e->type )
+            {
+            case GW_EV_LISTEN:
+                map_accept(e->map);
+                break;
+            case GW_EV_SOCK:
+                if ( (ev[i].events & (EPOLLERR | EPOLLHUP)) ||
+                     ((ev[i].events & EPOLLOUT) &&
+                      (flow_ring_out(e->flow) < 0)) ||
+                     ((ev[i].events & EPOLLIN) &&
+                      (flow_sock_in(e->flow) < 0)) )
+                    goto close;
+                break;
+            case GW_EV_RING:
+                if ( flow_ring_event(e->flow) < 0 )
+                    goto close;
+                break;
+            }
+            continue;
+
+        close:
+            /* the flow's other events of this round must not be handled */
+            for ( j = i + 1; j < n; j++ )
+                if ( ev[j].data.ptr &&
+                     (((struct gw_ev *)ev[j].data.ptr)->flow == e->flow) )
+                    ev[j].data.ptr = NULL;
+            flow_close(e->flow);
+        }
+    }
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
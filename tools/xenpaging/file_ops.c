@@ -61,6 +61,50 @@ int write_page(int fd, void *page, int i)
     return file_op(fd, page, i, &my_write);
 }
 
+/*
+ * Page i of pages to or from slot slots[i], with one call for each run of
+ * consecutive slots.
+ */
+static int file_op_pages(int fd, void *pages, const int *slots, int nr,
+                         ssize_t (*fn)(int, void *, size_t, off_t))
+{
+    size_t total, len;
+    ssize_t bytes;
+    int i, run;
+
+    for ( i = 0; i < nr; i += run )
+    {
+        for ( run = 1; i + run < nr && slots[i + run] == slots[i] + run; run++ )
+            ;
+
+        len = (size_t)run << PAGE_SHIFT;
+        for ( total = 0; total < len; total += bytes )
+        {
+            bytes = fn(fd, pages + ((size_t)i << PAGE_SHIFT) + total,
+                       len - total, ((off_t)slots[i] << PAGE_SHIFT) + total);
+            if ( bytes <= 0 )
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+static ssize_t my_pwrite(int fd, void *buf, size_t count, off_t offset)
+{
+    return pwrite(fd, buf, count, offset);
+}
+
+int read_pages(int fd, void *pages, const int *slots, int nr)
+{
+    return file_op_pages(fd, pages, slots, nr, &pread);
+}
+
+int write_pages(int fd, void *pages, const int *slots, int nr)
+{
+    return file_op_pages(fd, pages, slots, nr, &my_pwrite);
+}
+
 
 /*
  * Local variables:
@@ -27,6 +27,8 @@
 
 int read_page(int fd, void *page, int i);
 int write_page(int fd, void *page, int i);
+int read_pages(int fd, void *pages, const int *slots, int nr);
+int write_pages(int fd, void *pages, const int *slots, int nr);
 
 
 #endif
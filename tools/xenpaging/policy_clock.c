@@ -0,0 +1,181 @@
+/******************************************************************************
+ *
+ * Xen domain paging CLOCK policy, build with POLICY=clock.
+ *
+ * The gfns are swept by a clock hand as with the default policy, but a
+ * gfn gets a second chance for every time it was found in use: each gfn
+ * has an age, which the hand decays, and only a gfn of age 0 is paged
+ * out.  The only accesses the pager sees are the faults on paged out
+ * gfns, so these set the age: a gfn faulted back in soon after it was
+ * paged out is part of the working set, and gets the most chances
+ * (the "A1out" queue of 2Q, as a distance in page-outs).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include "xc_bitops.h"
+#include "policy.h"
+
+
+#define DEFAULT_MRU_SIZE (1024 * 16)
+
+/* Age of a gfn faulted in within mru_size page-outs, and of any other */
+#define AGE_HOT  3
+#define AGE_WARM 1
+
+
+static unsigned char *age;
+static unsigned int *paged_out_at;
+static unsigned int nr_paged_out;
+static unsigned int mru_size;
+static unsigned long *bitmap;
+static unsigned long *unconsumed;
+static unsigned int unconsumed_cleared;
+static unsigned long current_gfn;
+static unsigned long max_pages;
+
+
+int policy_init(struct xenpaging *paging)
+{
+    int rc = -ENOMEM;
+
+    max_pages = paging->max_pages;
+
+    /* Allocate bitmap for pages not to page out */
+    bitmap = bitmap_alloc(max_pages);
+    if ( !bitmap )
+        goto out;
+    /* Allocate bitmap to track unusable pages */
+    unconsumed = bitmap_alloc(max_pages);
+    if ( !unconsumed )
+        goto out;
+
+    age = calloc(max_pages, sizeof(*age));
+    paged_out_at = calloc(max_pages, sizeof(*paged_out_at));
+    if ( !age || !paged_out_at )
+        goto out;
+
+    /* The reuse distance within which a gfn is hot */
+    if ( paging->policy_mru_size > 0 )
+        mru_size = paging->policy_mru_size;
+    else
+        mru_size = paging->policy_mru_size = DEFAULT_MRU_SIZE;
+
+    /* Don't page out page 0 */
+    set_bit(0, bitmap);
+
+    /* Start in the middle to avoid paging during BIOS startup */
+    current_gfn = max_pages / 2;
+
+    rc = 0;
+ out:
+    return rc;
+}
+
+unsigned long policy_choose_victim(struct xenpaging *paging)
+{
+    xc_interface *xch = paging->xc_handle;
+    unsigned long i;
+
+    /* One iteration over all possible gfns for each chance a gfn has */
+    for ( i = 0; i < max_pages * (AGE_HOT + 1); i++ )
+    {
+        /* Try next gfn */
+        current_gfn++;
+
+        /* Restart on wrap */
+        if ( current_gfn >= max_pages )
+            current_gfn = 0;
+
+        /* gfn busy */
+        if ( test_bit(current_gfn, bitmap) )
+            continue;
+
+        /* gfn already tested */
+        if ( test_bit(current_gfn, unconsumed) )
+            continue;
+
+        /* gfn in use, give it another chance */
+        if ( age[current_gfn] )
+        {
+            age[current_gfn]--;
+            continue;
+        }
+
+        /* gfn found */
+        break;
+    }
+
+    /* Could not nominate any gfn */
+    if ( i >= max_pages * (AGE_HOT + 1) )
+    {
+        /* No more pages, wait in poll */
+        paging->use_poll_timeout = 1;
+        /* Count wrap arounds */
+        unconsumed_cleared++;
+        /* Force retry every few seconds (depends on poll() timeout) */
+        if ( unconsumed_cleared > 123)
+        {
+            /* Force retry of unconsumed gfns on next call */
+            bitmap_clear(unconsumed, max_pages);
+            unconsumed_cleared = 0;
+            DPRINTF("clearing unconsumed, current_gfn %lx", current_gfn);
+        }
+        return INVALID_MFN;
+    }
+
+    set_bit(current_gfn, unconsumed);
+    return current_gfn;
+}
+
+void policy_notify_paged_out(unsigned long gfn)
+{
+    set_bit(gfn, bitmap);
+    clear_bit(gfn, unconsumed);
+    paged_out_at[gfn] = nr_paged_out++;
+}
+
+void policy_notify_paged_in(unsigned long gfn)
+{
+    /* Unsigned, so that the distance survives nr_paged_out wrapping */
+    unsigned int distance = nr_paged_out - paged_out_at[gfn];
+
+    clear_bit(gfn, bitmap);
+    age[gfn] = (distance < mru_size) ? AGE_HOT : AGE_WARM;
+}
+
+void policy_notify_paged_in_nomru(unsigned long gfn)
+{
+    clear_bit(gfn, bitmap);
+    age[gfn] = 0;
+}
+
+void policy_notify_dropped(unsigned long gfn)
+{
+    clear_bit(gfn, bitmap);
+    age[gfn] = 0;
+}
+
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
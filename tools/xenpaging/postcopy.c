@@ -0,0 +1,277 @@
+/******************************************************************************
+ * tools/xenpaging/postcopy.c
+ *
+ * Receiving the pages a domain was started without from the source of a
+ * post-copy migration, see xenguest.h for the stream.  They are paged out
+ * until they arrive, a vcpu faulting on one of them waits for it and has
+ * it sent first.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <xc_private.h>
+#include <xenguest.h>
+
+#include "xc_bitops.h"
+#include "xenpaging.h"
+
+/* Page out gfn, whether the domain has a (stale) page for it or not */
+static int postcopy_page_out(struct xenpaging *paging, unsigned long gfn)
+{
+    xc_interface *xch = paging->xc_handle;
+    domid_t domid = paging->mem_event.domain_id;
+
+    if ( !xc_mem_paging_absent(xch, domid, gfn) )
+        return 0;
+    if ( errno != EBUSY )
+        return -1;
+
+    if ( xc_mem_paging_nominate(xch, domid, gfn) ||
+         xc_mem_paging_evict(xch, domid, gfn) )
+        return -1;
+
+    return 0;
+}
+
+int postcopy_init(struct xenpaging *paging)
+{
+    xc_interface *xch = paging->xc_handle;
+    uint64_t nr, gfn, i, *gfns = NULL;
+    int rc = -1;
+
+    if ( read_exact(paging->postcopy_fd, &nr, sizeof(nr)) )
+    {
+        PERROR("Error reading post-copy pfn count");
+        return -1;
+    }
+
+    gfns = malloc(nr * sizeof(*gfns));
+    if ( nr && !gfns )
+    {
+        PERROR("Error allocating %"PRIu64" post-copy pfns", nr);
+        return -1;
+    }
+    if ( read_exact(paging->postcopy_fd, gfns, nr * sizeof(*gfns)) )
+    {
+        PERROR("Error reading post-copy pfns");
+        goto out;
+    }
+
+    for ( i = 0; i < nr; i++ )
+        if ( gfns[i] > paging->postcopy_max_gfn )
+            paging->postcopy_max_gfn = gfns[i];
+
+    paging->postcopy_bitmap = bitmap_alloc(paging->postcopy_max_gfn + 1);
+    if ( !paging->postcopy_bitmap )
+    {
+        PERROR("Error allocating post-copy bitmap");
+        goto out;
+    }
+
+    for ( i = 0; i < nr; i++ )
+    {
+        gfn = gfns[i];
+        if ( test_bit(gfn, paging->postcopy_bitmap) )
+            continue;
+
+        if ( postcopy_page_out(paging, gfn) )
+        {
+            PERROR("Error paging out post-copy gfn %"PRIx64, gfn);
+            goto out;
+        }
+        set_bit(gfn, paging->postcopy_bitmap);
+        paging->postcopy_pending++;
+    }
+
+    /* The domain can run from now on */
+    gfn = XC_POSTCOPY_END;
+    if ( write_exact(paging->postcopy_fd, &gfn, sizeof(gfn)) )
+    {
+        PERROR("Error acknowledging post-copy pfns");
+        goto out;
+    }
+
+    DPRINTF("post-copy of %lu pages\n", paging->postcopy_pending);
+    rc = 0;
+
+ out:
+    free(gfns);
+    return rc;
+}
+
+void postcopy_teardown(struct xenpaging *paging)
+{
+    if ( paging->postcopy_fd >= 0 )
+        close(paging->postcopy_fd);
+    paging->postcopy_fd = -1;
+    free(paging->postcopy_bitmap);
+    paging->postcopy_bitmap = NULL;
+    free(paging->postcopy_waiting);
+    paging->postcopy_waiting = NULL;
+    paging->postcopy_nr_waiting = paging->postcopy_max_waiting = 0;
+}
+
+int postcopy_absent(struct xenpaging *paging, unsigned long gfn)
+{
+    return paging->postcopy_bitmap && gfn <= paging->postcopy_max_gfn &&
+           test_bit(gfn, paging->postcopy_bitmap);
+}
+
+/*
+ * A request for an absent gfn: ask the source for it, the response waits
+ * for the page to arrive.
+ */
+int postcopy_request(struct xenpaging *paging, mem_event_request_t *req)
+{
+    xc_interface *xch = paging->xc_handle;
+    mem_event_response_t *rsp;
+    uint64_t gfn = req->gfn;
+    int i, asked = 0;
+
+    /* The guest gave it up, the page is dropped when it arrives */
+    if ( req->flags & MEM_EVENT_FLAG_DROP_PAGE )
+    {
+        mem_event_response_t drop = {
+            .gfn = req->gfn,
+            .vcpu_id = req->vcpu_id,
+            .flags = req->flags,
+        };
+
+        clear_bit(gfn, paging->postcopy_bitmap);
+        paging->postcopy_pending--;
+        return xenpaging_resume_page(paging, &drop, 0);
+    }
+
+    for ( i = 0; i < paging->postcopy_nr_waiting; i++ )
+        if ( paging->postcopy_waiting[i].gfn == gfn )
+            asked = 1;
+
+    if ( paging->postcopy_nr_waiting == paging->postcopy_max_waiting )
+    {
+        int max = paging->postcopy_max_waiting * 2 ?: 16;
+
+        rsp = realloc(paging->postcopy_waiting, max * sizeof(*rsp));
+        if ( !rsp )
+        {
+            PERROR("Error queueing vcpu %d for gfn %"PRIx64,
+                   req->vcpu_id, gfn);
+            return -1;
+        }
+        paging->postcopy_waiting = rsp;
+        paging->postcopy_max_waiting = max;
+    }
+
+    rsp = &paging->postcopy_waiting[paging->postcopy_nr_waiting++];
+    memset(rsp, 0, sizeof(*rsp));
+    rsp->gfn = req->gfn;
+    rsp->vcpu_id = req->vcpu_id;
+    rsp->flags = req->flags;
+
+    if ( !asked && write_exact(paging->postcopy_fd, &gfn, sizeof(gfn)) )
+    {
+        PERROR("Error asking for post-copy gfn %"PRIx64, gfn);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Resume the vcpus waiting for gfn */
+static int postcopy_wake(struct xenpaging *paging, unsigned long gfn)
+{
+    int i, rc = 0;
+
+    for ( i = 0; i < paging->postcopy_nr_waiting; )
+    {
+        if ( paging->postcopy_waiting[i].gfn != gfn )
+        {
+            i++;
+            continue;
+        }
+
+        if ( xenpaging_resume_page(paging, &paging->postcopy_waiting[i], 0) < 0 )
+            rc = -1;
+        paging->postcopy_waiting[i] =
+            paging->postcopy_waiting[--paging->postcopy_nr_waiting];
+    }
+
+    return rc;
+}
+
+/* Receive and load the next page of the stream */
+int postcopy_receive(struct xenpaging *paging)
+{
+    xc_interface *xch = paging->xc_handle;
+    uint64_t gfn;
+    int rc;
+
+    if ( read_exact(paging->postcopy_fd, &gfn, sizeof(gfn)) )
+    {
+        PERROR("Error reading post-copy stream");
+        return -1;
+    }
+
+    if ( gfn == XC_POSTCOPY_END )
+    {
+        if ( paging->postcopy_pending )
+        {
+            ERROR("Post-copy stream ended %lu pages short",
+                  paging->postcopy_pending);
+            return -1;
+        }
+        DPRINTF("post-copy complete\n");
+        postcopy_teardown(paging);
+        return 0;
+    }
+
+    if ( read_exact(paging->postcopy_fd, paging->paging_buffer, PAGE_SIZE) )
+    {
+        PERROR("Error reading post-copy gfn %"PRIx64, gfn);
+        return -1;
+    }
+
+    /* Dropped by the guest, or sent twice */
+    if ( !postcopy_absent(paging, gfn) )
+        return 0;
+
+    while ( (rc = xc_mem_paging_load(xch, paging->mem_event.domain_id, gfn,
+                                     paging->paging_buffer)) < 0 &&
+            errno == ENOMEM )
+        sleep(1);
+    if ( rc < 0 )
+    {
+        PERROR("Error loading post-copy gfn %"PRIx64, gfn);
+        return -1;
+    }
+
+    clear_bit(gfn, paging->postcopy_bitmap);
+    paging->postcopy_pending--;
+
+    return postcopy_wake(paging, gfn);
+}
+
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -77,7 +77,8 @@ static int xenpaging_wait_for_event_or_timeout(struct xenpaging *paging)
     xc_evtchn *xce = paging->mem_event.xce_handle;
     char **vec, *val;
     unsigned int num;
-    struct pollfd fd[2];
+    struct pollfd fd[3];
+    int nfds = 2;
     int port;
     int rc;
     int timeout;
@@ -87,10 +88,17 @@ static int xenpaging_wait_for_event_or_timeout(struct xenpaging *paging)
     fd[0].events = POLLIN | POLLERR;
     fd[1].fd = xs_fileno(paging->xs_handle);
     fd[1].events = POLLIN | POLLERR;
+    /* and for the pages of a post-copy migration */
+    if ( paging->postcopy_fd >= 0 )
+    {
+        fd[2].fd = paging->postcopy_fd;
+        fd[2].events = POLLIN | POLLERR;
+        nfds++;
+    }
 
     /* No timeout while page-out is still in progress */
     timeout = paging->use_poll_timeout ? 100 : 0;
-    rc = poll(fd, 2, timeout);
+    rc = poll(fd, nfds, timeout);
     if ( rc < 0 )
     {
         if (errno == EINTR)
@@ -161,6 +169,14 @@ static int xenpaging_wait_for_event_or_timeout(struct xenpaging *paging)
             PERROR("Failed to unmask event channel port");
         }
     }
+
+    if ( rc > 0 && nfds > 2 && fd[2].revents )
+    {
+        rc = postcopy_receive(paging);
+        if ( rc < 0 )
+            goto err;
+        rc = 1;
+    }
 err:
     return rc;
 }
@@ -185,12 +201,12 @@ static void *init_page(void)
     void *buffer;
 
     /* Allocated page memory */
-    errno = posix_memalign(&buffer, PAGE_SIZE, PAGE_SIZE);
+    errno = posix_memalign(&buffer, PAGE_SIZE, XENPAGING_BUFFER_SIZE);
     if ( errno != 0 )
         return NULL;
 
     /* Lock buffer in memory so it can't be paged out */
-    if ( mlock(buffer, PAGE_SIZE) < 0 )
+    if ( mlock(buffer, XENPAGING_BUFFER_SIZE) < 0 )
     {
         free(buffer);
         buffer = NULL;
@@ -210,6 +226,8 @@ static void usage(void)
     printf(" -f <file>      --pagefile=<file>        pagefile to use. This option is required.\n");
     printf(" -m <max_memkb> --max_memkb=<max_memkb>  maximum amount of memory to handle.\n");
     printf(" -r <num>       --mru_size=<num>         number of paged-in pages to keep in memory.\n");
+    printf(" -p <fd>        --postcopy=<fd>          receive the pages of a post-copy migration on fd.\n");
+    printf(" -z <MiB>       --zpool=<MiB>            keep up to MiB of compressed pages in memory.\n");
     printf(" -v             --verbose                enable debug output.\n");
     printf(" -h             --help                   this output.\n");
 }
@@ -217,13 +235,15 @@ static void usage(void)
 static int xenpaging_getopts(struct xenpaging *paging, int argc, char *argv[])
 {
     int ch;
-    static const char sopts[] = "hvd:f:m:r:";
+    static const char sopts[] = "hvd:f:m:r:p:z:";
     static const struct option lopts[] = {
         {"help", 0, NULL, 'h'},
         {"verbose", 0, NULL, 'v'},
         {"domain", 1, NULL, 'd'},
         {"pagefile", 1, NULL, 'f'},
         {"mru_size", 1, NULL, 'm'},
+        {"postcopy", 1, NULL, 'p'},
+        {"zpool", 1, NULL, 'z'},
         { }
     };
 
@@ -246,6 +266,12 @@ static int xenpaging_getopts(struct xenpaging *paging, int argc, char *argv[])
         case 'v':
             paging->debug = 1;
             break;
+        case 'p':
+            paging->postcopy_fd = atoi(optarg);
+            break;
+        case 'z':
+            paging->zpool_size = (size_t)atoi(optarg) << 20;
+            break;
         case 'h':
         case '?':
             usage();
@@ -288,6 +314,8 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
     if ( !paging )
         goto err;
 
+    paging->postcopy_fd = -1;
+
     /* Get cmdline options and domain_id */
     if ( xenpaging_getopts(paging, argc, argv) )
         goto err;
@@ -467,6 +495,12 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
         goto err;
     }
 
+    if ( zpool_init(paging) )
+    {
+        PERROR("Error allocating compressed pool");
+        goto err;
+    }
+
     paging->paging_buffer = init_page();
     if ( !paging->paging_buffer )
     {
@@ -493,7 +527,7 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
             xc_interface_close(xch);
         if ( paging->paging_buffer )
         {
-            munlock(paging->paging_buffer, PAGE_SIZE);
+            munlock(paging->paging_buffer, XENPAGING_BUFFER_SIZE);
             free(paging->paging_buffer);
         }
 
@@ -504,6 +538,7 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
 
         free(dom_path);
         free(watch_target_tot_pages);
+        zpool_teardown(paging);
         free(paging->free_slot_stack);
         free(paging->slot_to_gfn);
         free(paging->gfn_to_slot);
@@ -592,86 +627,146 @@ static void put_response(struct mem_event *mem_event, mem_event_response_t *rsp)
     RING_PUSH_RESPONSES(back_ring);
 }
 
-/* Evict a given gfn
+/* Evict up to nr gfns chosen by the policy, to the given slots.
+ * The gfns are nominated first, then copied to the paging file in one
+ * go, then evicted.  *nr is set to the number of gfns tried: fewer than
+ * asked for when the policy had no more, or on a signal.
  * Returns < 0 on fatal error
- * Returns 0 on successful evict
- * Returns > 0 if gfn can not be evicted
+ * Returns the number of gfns evicted otherwise, the slots not used are
+ * left as they were in slot_to_gfn
  */
-static int xenpaging_evict_page(struct xenpaging *paging, unsigned long gfn, int slot)
+static int xenpaging_evict_pages(struct xenpaging *paging, int *slots, int *nr)
 {
     xc_interface *xch = paging->xc_handle;
-    void *page;
-    xen_pfn_t victim = gfn;
-    int ret;
-
-    DECLARE_DOMCTL;
+    domid_t domid = paging->mem_event.domain_id;
+    xen_pfn_t gfns[XENPAGING_IO_BATCH];
+    int err[XENPAGING_IO_BATCH];
+    static int num_paged_out;
+    unsigned long gfn;
+    void *pages;
+    int i, j, n, slot, ret;
 
-    /* Nominate page */
-    ret = xc_mem_paging_nominate(xch, paging->mem_event.domain_id, gfn);
-    if ( ret < 0 )
+    /* Nominate a gfn for each slot */
+    for ( n = 0; n < *nr; )
     {
-        /* unpageable gfn is indicated by EBUSY */
-        if ( errno == EBUSY )
-            ret = 1;
-        else
+        gfn = policy_choose_victim(paging);
+        if ( gfn == INVALID_MFN )
+        {
+            /* If the number did not change after last flush command then
+             * the command did not reach qemu yet, or qemu still processes
+             * the command, or qemu has nothing to release.
+             * Right now there is no need to issue the command again.
+             */
+            if ( num_paged_out != paging->num_paged_out )
+            {
+                DPRINTF("Flushing qemu cache\n");
+                xenpaging_mem_paging_flush_ioemu_cache(paging);
+                num_paged_out = paging->num_paged_out;
+            }
+            break;
+        }
+
+        if ( interrupted )
+            break;
+
+        ret = xc_mem_paging_nominate(xch, domid, gfn);
+        if ( ret < 0 )
+        {
+            /* unpageable gfn is indicated by EBUSY */
+            if ( errno == EBUSY )
+                continue;
             PERROR("Error nominating page %lx", gfn);
-        goto out;
+            return -1;
+        }
+
+        gfns[n++] = gfn;
     }
+    *nr = n;
+
+    if ( !n )
+        return 0;
 
-    /* Map page */
-    page = xc_map_foreign_pages(xch, paging->mem_event.domain_id, PROT_READ, &victim, 1);
-    if ( page == NULL )
+    /* Map pages */
+    pages = xc_map_foreign_bulk(xch, domid, PROT_READ, gfns, err, n);
+    if ( pages == NULL )
     {
-        PERROR("Error mapping page %lx", gfn);
-        ret = -1;
-        goto out;
+        PERROR("Error mapping %d pages at %lx", n, (unsigned long)gfns[0]);
+        return -1;
     }
+    for ( i = 0; i < n; i++ )
+        if ( err[i] )
+        {
+            errno = -err[i];
+            PERROR("Error mapping page %lx", (unsigned long)gfns[i]);
+            munmap(pages, n * PAGE_SIZE);
+            return -1;
+        }
 
-    /* Copy page */
-    ret = write_page(paging->fd, page, slot);
-    if ( ret < 0 )
+    /* Copy pages, to the compressed pool or else runs of them to the file */
+    for ( i = ret = 0; i < n && ret >= 0; i = j )
     {
-        PERROR("Error copying page %lx", gfn);
-        munmap(page, PAGE_SIZE);
-        ret = -1;
-        goto out;
+        for ( j = i; j < n; j++ )
+        {
+            ret = zpool_store(paging, gfns[j], slots[j],
+                              pages + j * PAGE_SIZE);
+            if ( ret )
+                break;
+        }
+        if ( ret >= 0 && j > i )
+            ret = write_pages(paging->fd, pages + i * PAGE_SIZE,
+                              slots + i, j - i);
+        j++;
     }
 
-    /* Release page */
-    munmap(page, PAGE_SIZE);
+    /* Release pages */
+    munmap(pages, n * PAGE_SIZE);
 
-    /* Tell Xen to evict page */
-    ret = xc_mem_paging_evict(xch, paging->mem_event.domain_id, gfn);
     if ( ret < 0 )
     {
-        /* A gfn in use is indicated by EBUSY */
-        if ( errno == EBUSY )
-        {
-                ret = 1;
-                DPRINTF("Nominated page %lx busy", gfn);
-        } else
-            PERROR("Error evicting page %lx", gfn);
-        goto out;
+        PERROR("Error copying %d pages at %lx", n, (unsigned long)gfns[0]);
+        return -1;
     }
 
-    DPRINTF("evict_page > gfn %lx pageslot %d\n", gfn, slot);
-    /* Notify policy of page being paged out */
-    policy_notify_paged_out(gfn);
+    /* Tell Xen to evict the pages, the ones used since stay */
+    for ( i = ret = 0; i < n; i++ )
+    {
+        gfn = gfns[i];
+        slot = slots[i];
 
-    /* Update index */
-    paging->slot_to_gfn[slot] = gfn;
-    paging->gfn_to_slot[gfn] = slot;
+        if ( xc_mem_paging_evict(xch, domid, gfn) < 0 )
+        {
+            /* A gfn in use is indicated by EBUSY */
+            if ( errno != EBUSY )
+            {
+                PERROR("Error evicting page %lx", gfn);
+                return -1;
+            }
+            DPRINTF("Nominated page %lx busy", gfn);
+            zpool_drop(paging, gfn);
+            continue;
+        }
 
-    /* Record number of evicted pages */
-    paging->num_paged_out++;
+        DPRINTF("evict_page > gfn %lx pageslot %d\n", gfn, slot);
+        /* Notify policy of page being paged out */
+        policy_notify_paged_out(gfn);
 
-    ret = 0;
+        /* Update index */
+        paging->slot_to_gfn[slot] = gfn;
+        paging->gfn_to_slot[gfn] = slot;
+
+        /* Record number of evicted pages */
+        paging->num_paged_out++;
+
+        if ( test_and_set_bit(gfn, paging->bitmap) )
+            ERROR("Page %lx has been evicted before", gfn);
+
+        ret++;
+    }
 
- out:
     return ret;
 }
 
-static int xenpaging_resume_page(struct xenpaging *paging, mem_event_response_t *rsp, int notify_policy)
+int xenpaging_resume_page(struct xenpaging *paging, mem_event_response_t *rsp, int notify_policy)
 {
     /* Put the page info on the ring */
     put_response(&paging->mem_event, rsp);
@@ -704,8 +799,12 @@ static int xenpaging_populate_page(struct xenpaging *paging, unsigned long gfn,
 
     DPRINTF("populate_page < gfn %lx pageslot %d\n", gfn, i);
 
-    /* Read page */
-    ret = read_page(paging->fd, paging->paging_buffer, i);
+    /* Read page, from the compressed pool if it is still there */
+    ret = zpool_load(paging, gfn, paging->paging_buffer);
+    if ( ret == 0 )
+        ret = read_page(paging->fd, paging->paging_buffer, i);
+    else if ( ret > 0 )
+        ret = 0;
     if ( ret != 0 )
     {
         PERROR("Error reading page");
@@ -758,99 +857,128 @@ static void resume_pages(struct xenpaging *paging, int num_pages)
         page_in_trigger();
 }
 
-/* Evict one gfn and write it to the given slot
+/* Evict a batch of pages and write them to a free slot in the paging file
  * Returns < 0 on fatal error
- * Returns 0 on successful evict
- * Returns > 0 if no gfn can be evicted
+ * Returns 0 if no gfn can be evicted
+ * Returns > 0 on successful evict
  */
-static int evict_victim(struct xenpaging *paging, int slot)
+static int evict_pages(struct xenpaging *paging, int num_pages)
 {
-    xc_interface *xch = paging->xc_handle;
-    unsigned long gfn;
-    static int num_paged_out;
-    int ret;
+    int slots[XENPAGING_IO_BATCH], stacked[XENPAGING_IO_BATCH];
+    int i, rc, n, tried, slot = 0, num = 0;
 
-    do
+    while ( num < num_pages )
     {
-        gfn = policy_choose_victim(paging);
-        if ( gfn == INVALID_MFN )
+        /* Reuse known free slots, then scan all slots for remainders.
+         * The slots of the batch are marked allocated until it is done. */
+        for ( n = 0; n < XENPAGING_IO_BATCH && n < num_pages - num; n++ )
         {
-            /* If the number did not change after last flush command then
-             * the command did not reach qemu yet, or qemu still processes
-             * the command, or qemu has nothing to release.
-             * Right now there is no need to issue the command again.
-             */
-            if ( num_paged_out != paging->num_paged_out )
+            stacked[n] = paging->stack_count > 0;
+            if ( stacked[n] )
+                slots[n] = paging->free_slot_stack[--paging->stack_count];
+            else
             {
-                DPRINTF("Flushing qemu cache\n");
-                xenpaging_mem_paging_flush_ioemu_cache(paging);
-                num_paged_out = paging->num_paged_out;
+                /* Slot is allocated */
+                while ( slot < paging->max_pages && paging->slot_to_gfn[slot] )
+                    slot++;
+                if ( slot >= paging->max_pages )
+                    break;
+                slots[n] = slot++;
             }
-            ret = ENOSPC;
-            goto out;
+            paging->slot_to_gfn[slots[n]] = INVALID_MFN;
         }
 
-        if ( interrupted )
+        if ( !n )
+            break;
+
+        tried = n;
+        rc = xenpaging_evict_pages(paging, slots, &tried);
+
+        /* Free the slots left over again */
+        for ( i = 0; i < n; i++ )
         {
-            ret = EINTR;
-            goto out;
+            if ( paging->slot_to_gfn[slots[i]] != INVALID_MFN )
+                continue;
+            paging->slot_to_gfn[slots[i]] = 0;
+            if ( stacked[i] )
+                paging->free_slot_stack[paging->stack_count++] = slots[i];
         }
 
-        ret = xenpaging_evict_page(paging, gfn, slot);
-        if ( ret < 0 )
-            goto out;
-    }
-    while ( ret );
+        if ( rc < 0 )
+            return -1;
 
-    if ( test_and_set_bit(gfn, paging->bitmap) )
-        ERROR("Page %lx has been evicted before", gfn);
+        num += rc;
 
-    ret = 0;
+        /* No more gfns, or interrupted */
+        if ( tried < n )
+            break;
+    }
 
- out:
-    return ret;
+    return num;
 }
 
-/* Evict a batch of pages and write them to a free slot in the paging file
- * Returns < 0 on fatal error
- * Returns 0 if no gfn can be evicted
- * Returns > 0 on successful evict
+/*
+ * Page in the paged out neighbours of gfn, which was just paged in, so that
+ * a burst of faults over a range has them in memory once it gets to them.
+ * Errors only leave the pages paged out.
  */
-static int evict_pages(struct xenpaging *paging, int num_pages)
+static void readahead_pages(struct xenpaging *paging, unsigned long gfn)
 {
     xc_interface *xch = paging->xc_handle;
-    int rc, slot, num = 0;
+    unsigned long gfns[XENPAGING_READAHEAD];
+    int slots[XENPAGING_READAHEAD];
+    void *page;
+    int i, j, n, rc;
 
-    /* Reuse known free slots */
-    while ( paging->stack_count > 0 && num < num_pages )
+    for ( n = 0, gfn++; n < XENPAGING_READAHEAD && gfn < paging->max_pages;
+          gfn++ )
     {
-        slot = paging->free_slot_stack[--paging->stack_count];
-        rc = evict_victim(paging, slot);
-        if ( rc )
+        if ( !test_bit(gfn, paging->bitmap) )
+            break;
+        gfns[n] = gfn;
+        slots[n] = paging->gfn_to_slot[gfn];
+        n++;
+    }
+
+    if ( !n )
+        return;
+
+    /* The pages in the compressed pool, then runs of the others */
+    for ( i = 0; i < n; i = j )
+    {
+        for ( j = i; j < n; j++ )
         {
-            num = rc < 0 ? -1 : num;
-            return num;
+            page = paging->paging_buffer + j * PAGE_SIZE;
+            rc = zpool_load(paging, gfns[j], page);
+            if ( rc < 0 )
+                return;
+            if ( rc )
+                break;
         }
-        num++;
+        if ( j > i && read_pages(paging->fd, paging->paging_buffer + i * PAGE_SIZE,
+                                 slots + i, j - i) )
+            return;
+        j++;
     }
 
-    /* Scan all slots slots for remainders */
-    for ( slot = 0; slot < paging->max_pages && num < num_pages; slot++ )
+    for ( i = 0; i < n; i++ )
     {
-        /* Slot is allocated */
-        if ( paging->slot_to_gfn[slot] )
-            continue;
-
-        rc = evict_victim(paging, slot);
-        if ( rc )
-        {
-            num = rc < 0 ? -1 : num;
+        page = paging->paging_buffer + i * PAGE_SIZE;
+        if ( xc_mem_paging_load(xch, paging->mem_event.domain_id, gfns[i],
+                                page) < 0 )
             break;
-        }
 
-        num++;
+        DPRINTF("readahead_page < gfn %lx pageslot %d\n", gfns[i], slots[i]);
+        clear_bit(gfns[i], paging->bitmap);
+        policy_notify_paged_in_nomru(gfns[i]);
+        paging->num_paged_out--;
+
+        /* Clear this pagefile slot */
+        paging->slot_to_gfn[slots[i]] = 0;
+
+        /* Record this free slot */
+        paging->free_slot_stack[paging->stack_count++] = slots[i];
     }
-    return num;
 }
 
 int main(int argc, char *argv[])
@@ -885,6 +1013,14 @@ int main(int argc, char *argv[])
     sigaction(SIGINT,  &act, NULL);
     sigaction(SIGALRM, &act, NULL);
 
+    /* Page out what a post-copy migration still has to send */
+    if ( paging->postcopy_fd >= 0 && postcopy_init(paging) )
+    {
+        ERROR("Error starting post-copy");
+        rc = 1;
+        goto out;
+    }
+
     /* listen for page-in events to stop pager */
     create_page_in_thread(paging);
 
@@ -910,6 +1046,14 @@ int main(int argc, char *argv[])
 
             get_request(&paging->mem_event, &req);
 
+            /* The page is still at the source of a post-copy migration */
+            if ( postcopy_absent(paging, req.gfn) )
+            {
+                if ( postcopy_request(paging, &req) < 0 )
+                    goto out;
+                continue;
+            }
+
             if ( req.gfn > paging->max_pages )
             {
                 ERROR("Requested gfn %"PRIx64" higher than max_pages %x\n", req.gfn, paging->max_pages);
@@ -934,6 +1078,7 @@ int main(int argc, char *argv[])
                     DPRINTF("drop_page ^ gfn %"PRIx64" pageslot %d\n", req.gfn, slot);
                     /* Notify policy of page being dropped */
                     policy_notify_dropped(req.gfn);
+                    zpool_drop(paging, req.gfn);
                 }
                 else
                 {
@@ -961,6 +1106,10 @@ int main(int argc, char *argv[])
 
                 /* Record this free slot */
                 paging->free_slot_stack[paging->stack_count++] = slot;
+
+                /* Its vcpu runs again, bring in what it may touch next */
+                if ( !(req.flags & MEM_EVENT_FLAG_DROP_PAGE) )
+                    readahead_pages(paging, req.gfn);
             }
             else
             {
@@ -992,7 +1141,7 @@ int main(int argc, char *argv[])
         if ( interrupted == SIGTERM || interrupted == SIGINT )
         {
             /* If no more pages to process, exit loop. */
-            if ( !paging->num_paged_out )
+            if ( !paging->num_paged_out && paging->postcopy_fd < 0 )
                 break;
             
             /* One more round if there are still pages to process. */
@@ -1065,6 +1214,8 @@ int main(int argc, char *argv[])
  out:
     close(paging->fd);
     unlink_pagefile();
+    postcopy_teardown(paging);
+    zpool_teardown(paging);
 
     /* Tear down domain paging */
     xenpaging_teardown(paging);
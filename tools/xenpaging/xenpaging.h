@@ -30,6 +30,11 @@
 #include <xen/mem_event.h>
 
 #define XENPAGING_PAGEIN_QUEUE_SIZE 64
+/* Pages evicted at once, and neighbours paged in with a faulting gfn */
+#define XENPAGING_IO_BATCH 32
+#define XENPAGING_READAHEAD 8
+/* paging_buffer, for a page-in and its readahead */
+#define XENPAGING_BUFFER_SIZE (XENPAGING_READAHEAD * PAGE_SIZE)
 
 struct mem_event {
     domid_t domain_id;
@@ -63,11 +68,45 @@ struct xenpaging {
     int stack_count;
     int *free_slot_stack;
     unsigned long pagein_queue[XENPAGING_PAGEIN_QUEUE_SIZE];
+
+    /* post-copy stream, -1 without one or once complete */
+    int postcopy_fd;
+    /* gfns still at the source */
+    unsigned long *postcopy_bitmap;
+    unsigned long postcopy_max_gfn;
+    unsigned long postcopy_pending;
+    /* vcpus waiting for a gfn still at the source */
+    mem_event_response_t *postcopy_waiting;
+    int postcopy_nr_waiting, postcopy_max_waiting;
+
+    /* compressed pages in front of the pagefile, by gfn, none if size 0 */
+    size_t zpool_size, zpool_used;
+    struct zpool_page **zpool_map;
+    struct zpool_page *zpool_head, *zpool_tail;
+    int zpool_nr;
 };
 
 extern void create_page_in_thread(struct xenpaging *paging);
 extern void page_in_trigger(void);
 
+extern int xenpaging_resume_page(struct xenpaging *paging,
+                                 mem_event_response_t *rsp,
+                                 int notify_policy);
+
+extern int postcopy_init(struct xenpaging *paging);
+extern void postcopy_teardown(struct xenpaging *paging);
+extern int postcopy_absent(struct xenpaging *paging, unsigned long gfn);
+extern int postcopy_request(struct xenpaging *paging,
+                            mem_event_request_t *req);
+extern int postcopy_receive(struct xenpaging *paging);
+
+extern int zpool_init(struct xenpaging *paging);
+extern void zpool_teardown(struct xenpaging *paging);
+extern int zpool_store(struct xenpaging *paging, unsigned long gfn, int slot,
+                       const void *page);
+extern int zpool_load(struct xenpaging *paging, unsigned long gfn, void *page);
+extern void zpool_drop(struct xenpaging *paging, unsigned long gfn);
+
 #endif // __XEN_PAGING_H__
 
 
@@ -0,0 +1,355 @@
+/******************************************************************************
+ * tools/xenpaging/zpool.c
+ *
+ * A pool of compressed pages in front of the pagefile.  Evicted pages are
+ * kept LZ4 compressed in memory while the pool has room, so that paging
+ * them in again does not have to wait for the disk; once it is full the
+ * least recently stored pages are written back to their slots in the
+ * pagefile.  Every page still has its slot, the pool only holds its data
+ * until then.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <xc_private.h>
+
+#include "file_ops.h"
+#include "xenpaging.h"
+
+/* The decompressor is shared with the hypervisor, as in libxc */
+#define CONFIG_HAVE_EFFICIENT_UNALIGNED_ACCESS
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define likely(a) a
+#define unlikely(a) a
+
+static inline uint_fast16_t le16_to_cpup(const unsigned char *buf)
+{
+    return buf[0] | (buf[1] << 8);
+}
+
+static inline uint_fast32_t le32_to_cpup(const unsigned char *buf)
+{
+    return le16_to_cpup(buf) | ((uint32_t)le16_to_cpup(buf + 2) << 16);
+}
+
+#include "../../xen/include/xen/lz4.h"
+#include "../../xen/common/decompress.h"
+#include "../../xen/common/lz4/decompress.c"
+
+/* Pages compressing worse than this are written to the pagefile */
+#define ZPOOL_MAX_LEN (PAGE_SIZE * 3 / 4)
+
+struct zpool_page {
+    /* LRU list, most recently stored first */
+    struct zpool_page *prev, *next;
+    unsigned long gfn;
+    int slot;
+    unsigned int len;
+    unsigned char data[];
+};
+
+static unsigned char zpool_buf[ZPOOL_MAX_LEN];
+static void *zpool_page_buf;
+
+
+/*
+ * LZ4 block compression of a page, greedy with a single hash table entry
+ * per position.  The format rules the decompressor relies on are kept:
+ * no match starts in the last 12 bytes and the last 5 are literals.
+ */
+#define LZ4_HASH_LOG    12
+#define LZ4_MIN_MATCH   4
+#define LZ4_MFLIMIT     12
+#define LZ4_LASTLITERALS 5
+
+static inline uint32_t lz4_read32(const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline unsigned int lz4_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+/* The bytes after a token nibble of 15 */
+static int lz4_put_length(unsigned char *dst, int *op, int max,
+                          unsigned int len)
+{
+    for ( ; len >= 255; len -= 255 )
+    {
+        if ( *op >= max )
+            return -1;
+        dst[(*op)++] = 255;
+    }
+    if ( *op >= max )
+        return -1;
+    dst[(*op)++] = len;
+    return 0;
+}
+
+/* A sequence: literals, then a match unless mlen is 0 */
+static int lz4_put_sequence(unsigned char *dst, int *op, int max,
+                            const unsigned char *lit, unsigned int llen,
+                            unsigned int offset, unsigned int mlen)
+{
+    unsigned int ml = mlen ? mlen - LZ4_MIN_MATCH : 0;
+
+    if ( *op >= max )
+        return -1;
+    dst[(*op)++] = ((llen < RUN_MASK ? llen : RUN_MASK) << ML_BITS) |
+                   (ml < ML_MASK ? ml : ML_MASK);
+
+    if ( llen >= RUN_MASK && lz4_put_length(dst, op, max, llen - RUN_MASK) )
+        return -1;
+    if ( *op + llen > max )
+        return -1;
+    memcpy(dst + *op, lit, llen);
+    *op += llen;
+
+    if ( !mlen )
+        return 0;
+
+    if ( *op + 2 > max )
+        return -1;
+    dst[(*op)++] = offset & 0xff;
+    dst[(*op)++] = offset >> 8;
+    if ( ml >= ML_MASK && lz4_put_length(dst, op, max, ml - ML_MASK) )
+        return -1;
+
+    return 0;
+}
+
+/* Returns the compressed length, or -1 if it would exceed max */
+static int lz4_compress_page(const unsigned char *src, unsigned char *dst,
+                             int max)
+{
+    /* Positions plus one, 0 is none yet */
+    uint16_t table[1 << LZ4_HASH_LOG];
+    const int mflimit = PAGE_SIZE - LZ4_MFLIMIT;
+    const int matchlimit = PAGE_SIZE - LZ4_LASTLITERALS;
+    int ip = 0, anchor = 0, op = 0, ref, mlen;
+    unsigned int h;
+    uint32_t seq;
+
+    memset(table, 0, sizeof(table));
+
+    while ( ip < mflimit )
+    {
+        seq = lz4_read32(src + ip);
+        h = lz4_hash(seq);
+        ref = table[h] - 1;
+        table[h] = ip + 1;
+
+        if ( ref < 0 || lz4_read32(src + ref) != seq )
+        {
+            ip++;
+            continue;
+        }
+
+        for ( mlen = LZ4_MIN_MATCH;
+              ip + mlen < matchlimit && src[ref + mlen] == src[ip + mlen];
+              mlen++ )
+            ;
+
+        if ( lz4_put_sequence(dst, &op, max, src + anchor, ip - anchor,
+                              ip - ref, mlen) )
+            return -1;
+
+        ip += mlen;
+        anchor = ip;
+    }
+
+    if ( lz4_put_sequence(dst, &op, max, src + anchor, PAGE_SIZE - anchor,
+                          0, 0) )
+        return -1;
+
+    return op;
+}
+
+
+static void zpool_unlink(struct xenpaging *paging, struct zpool_page *zp)
+{
+    if ( zp->prev )
+        zp->prev->next = zp->next;
+    else
+        paging->zpool_head = zp->next;
+    if ( zp->next )
+        zp->next->prev = zp->prev;
+    else
+        paging->zpool_tail = zp->prev;
+
+    paging->zpool_map[zp->gfn] = NULL;
+    paging->zpool_used -= sizeof(*zp) + zp->len;
+    paging->zpool_nr--;
+    free(zp);
+}
+
+static int zpool_decompress(struct zpool_page *zp, void *page)
+{
+    size_t len = PAGE_SIZE;
+
+    if ( lz4_decompress_unknownoutputsize(zp->data, zp->len, page, &len) ||
+         len != PAGE_SIZE )
+        return -1;
+    return 0;
+}
+
+/* Write the least recently stored page back to its slot */
+static int zpool_writeback(struct xenpaging *paging)
+{
+    xc_interface *xch = paging->xc_handle;
+    struct zpool_page *zp = paging->zpool_tail;
+
+    if ( zpool_decompress(zp, zpool_page_buf) )
+    {
+        ERROR("Error decompressing gfn %lx", zp->gfn);
+        return -1;
+    }
+    if ( write_page(paging->fd, zpool_page_buf, zp->slot) )
+    {
+        PERROR("Error writing back gfn %lx to pageslot %d", zp->gfn, zp->slot);
+        return -1;
+    }
+
+    DPRINTF("zpool_writeback > gfn %lx pageslot %d\n", zp->gfn, zp->slot);
+    zpool_unlink(paging, zp);
+    return 0;
+}
+
+int zpool_init(struct xenpaging *paging)
+{
+    if ( !paging->zpool_size )
+        return 0;
+
+    paging->zpool_map = calloc(paging->max_pages,
+                               sizeof(*paging->zpool_map));
+    zpool_page_buf = malloc(PAGE_SIZE);
+    if ( !paging->zpool_map || !zpool_page_buf )
+        return -1;
+
+    return 0;
+}
+
+void zpool_teardown(struct xenpaging *paging)
+{
+    while ( paging->zpool_tail )
+        zpool_unlink(paging, paging->zpool_tail);
+    free(paging->zpool_map);
+    paging->zpool_map = NULL;
+    free(zpool_page_buf);
+    zpool_page_buf = NULL;
+}
+
+/*
+ * Keep gfn, to go to slot, compressed in the pool, making room by writing
+ * older pages back.
+ * Returns 1 if it is in the pool, 0 if it has to be written to its slot,
+ * < 0 if a write back failed.
+ */
+int zpool_store(struct xenpaging *paging, unsigned long gfn, int slot,
+                const void *page)
+{
+    struct zpool_page *zp;
+    int len;
+
+    if ( !paging->zpool_map )
+        return 0;
+
+    len = lz4_compress_page(page, zpool_buf, sizeof(zpool_buf));
+    if ( len < 0 || sizeof(*zp) + len > paging->zpool_size )
+        return 0;
+
+    while ( paging->zpool_used + sizeof(*zp) + len > paging->zpool_size )
+        if ( zpool_writeback(paging) )
+            return -1;
+
+    zp = malloc(sizeof(*zp) + len);
+    if ( !zp )
+        return 0;
+
+    zp->gfn = gfn;
+    zp->slot = slot;
+    zp->len = len;
+    memcpy(zp->data, zpool_buf, len);
+
+    zp->prev = NULL;
+    zp->next = paging->zpool_head;
+    if ( zp->next )
+        zp->next->prev = zp;
+    else
+        paging->zpool_tail = zp;
+    paging->zpool_head = zp;
+
+    paging->zpool_map[gfn] = zp;
+    paging->zpool_used += sizeof(*zp) + len;
+    paging->zpool_nr++;
+
+    return 1;
+}
+
+/*
+ * Page gfn in from the pool, which no longer holds it then.
+ * Returns 1 if it was in the pool, 0 if it has to be read from its slot,
+ * < 0 on a corrupted page.
+ */
+int zpool_load(struct xenpaging *paging, unsigned long gfn, void *page)
+{
+    xc_interface *xch = paging->xc_handle;
+    struct zpool_page *zp;
+
+    if ( !paging->zpool_map || !(zp = paging->zpool_map[gfn]) )
+        return 0;
+
+    if ( zpool_decompress(zp, page) )
+    {
+        ERROR("Error decompressing gfn %lx", gfn);
+        return -1;
+    }
+
+    DPRINTF("zpool_load < gfn %lx\n", gfn);
+    zpool_unlink(paging, zp);
+    return 1;
+}
+
+/* Forget gfn, dropped by the guest or not evicted after all */
+void zpool_drop(struct xenpaging *paging, unsigned long gfn)
+{
+    if ( paging->zpool_map && paging->zpool_map[gfn] )
+        zpool_unlink(paging, paging->zpool_map[gfn]);
+}
+
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -24,6 +24,10 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "xenstat_priv.h"
 
@@ -60,7 +64,81 @@ static void xenstat_free_xen_version(xenstat_node * node);
 static void xenstat_free_vbds(xenstat_node * node);
 static void xenstat_uninit_vcpus(xenstat_handle * handle);
 static void xenstat_uninit_xen_version(xenstat_handle * handle);
+/*
+ * Scheduling latency functions
+ */
+
+xenstat_sched *xenstat_domain_sched(xenstat_domain * domain)
+{
+	return &domain->sched_stats;
+}
+
+/* Get the number of times vcpus became runnable from blocked or offline */
+unsigned long long xenstat_sched_wakeups(xenstat_sched *sched)
+{
+	return sched->wakeups;
+}
+
+/* Get the number of times vcpus were descheduled while runnable */
+unsigned long long xenstat_sched_preemptions(xenstat_sched *sched)
+{
+	return sched->preemptions;
+}
+
+/* Get the number of times vcpus moved to another pcpu */
+unsigned long long xenstat_sched_migrations(xenstat_sched *sched)
+{
+	return sched->migrations;
+}
+
+/* Get the number of times vcpus went from runnable to running */
+unsigned long long xenstat_sched_waits(xenstat_sched *sched)
+{
+	return sched->waits;
+}
+
+/* Get the time (ns) vcpus spent runnable before running */
+unsigned long long xenstat_sched_wait_ns(xenstat_sched *sched)
+{
+	return sched->wait_ns;
+}
+
+/* Get the longest time (ns) a vcpu was runnable before running */
+unsigned long long xenstat_sched_wait_max_ns(xenstat_sched *sched)
+{
+	return sched->wait_max_ns;
+}
+
+/* Get the number of buckets of the wait histogram */
+unsigned int xenstat_sched_wait_buckets(xenstat_sched *sched)
+{
+	return XEN_SYSCTL_SCHED_WAIT_BUCKETS;
+}
+
+/* Get the number of waits in a bucket of the wait histogram */
+unsigned long long xenstat_sched_wait_hist(xenstat_sched *sched,
+					   unsigned int bucket)
+{
+	if (bucket >= XEN_SYSCTL_SCHED_WAIT_BUCKETS)
+		return 0;
+	return sched->wait_hist[bucket];
+}
+
+/* Get the smallest wait (ns) that falls past the bucket */
+unsigned long long xenstat_sched_wait_bucket_limit(xenstat_sched *sched,
+						   unsigned int bucket)
+{
+	if (bucket >= XEN_SYSCTL_SCHED_WAIT_BUCKETS - 1)
+		return ~0ULL;
+	return 1ULL << (bucket + 10);
+}
+
 static char *xenstat_get_domain_name(xenstat_handle * handle, unsigned int domain_id);
+static char *xenstat_cached_domain_name(xenstat_handle *handle,
+					unsigned int *cursor,
+					const xc_domaininfo_t *info);
+static void xenstat_cache_domain_names(xenstat_node *node);
+static void xenstat_unexport(xenstat_handle *handle);
 static void xenstat_prune_domain(xenstat_node *node, unsigned int entry);
 
 static xenstat_collector collectors[] = {
@@ -86,6 +164,7 @@ xenstat_handle *xenstat_init(void)
 	handle = (xenstat_handle *) calloc(1, sizeof(xenstat_handle));
 	if (handle == NULL)
 		return NULL;
+	handle->export_fd = -1;
 
 #if defined(PAGESIZE)
 	handle->page_size = PAGESIZE;
@@ -124,6 +203,10 @@ void xenstat_uninit(xenstat_handle * handle)
 	if (handle) {
 		for (i = 0; i < NUM_COLLECTORS; i++)
 			collectors[i].uninit(handle);
+		xenstat_unexport(handle);
+		for (i = 0; i < handle->num_names; i++)
+			free(handle->names[i].name);
+		free(handle->names);
 		xc_interface_close(handle->xc_handle);
 		xs_daemon_close(handle->xshandle);
 		free(handle->priv);
@@ -158,14 +241,133 @@ void domain_get_tmem_stats(xenstat_handle * handle, xenstat_domain * domain)
 	domain->tmem_stats.succ_pers_gets = parse(buffer,"Gp");
 }
 
+static void domain_set_v4v_stats(xenstat_domain *domain,
+				 const xc_v4v_domstats_t *stats)
+{
+	domain->v4v_stats.rings = stats->nr_rings;
+	domain->v4v_stats.pending = stats->nr_pending;
+	domain->v4v_stats.max_fill = stats->max_fill;
+	domain->v4v_stats.ring_bytes = stats->ring_bytes;
+	domain->v4v_stats.ring_used = stats->ring_used;
+	domain->v4v_stats.tx_messages = stats->tx_messages;
+	domain->v4v_stats.tx_bytes = stats->tx_bytes;
+	domain->v4v_stats.tx_eagain = stats->tx_eagain;
+	domain->v4v_stats.rx_messages = stats->rx_messages;
+	domain->v4v_stats.rx_bytes = stats->rx_bytes;
+	domain->v4v_stats.rx_eagain = stats->rx_eagain;
+	domain->v4v_stats.pinned_bytes = stats->nr_pages * XC_PAGE_SIZE;
+	if (stats->max_pages != XEN_DOMCTL_V4V_NO_QUOTA)
+		domain->v4v_stats.max_pinned_bytes =
+			stats->max_pages * XC_PAGE_SIZE;
+	if (stats->max_rings != XEN_DOMCTL_V4V_NO_QUOTA)
+		domain->v4v_stats.max_rings = stats->max_rings;
+}
+
+void domain_get_v4v_stats(xenstat_handle * handle, xenstat_domain * domain)
+{
+	xc_v4v_domstats_t stats;
+
+	/* Left zeroed for domains that don't do v4v */
+	if (xc_v4v_domstats(handle->xc_handle, domain->id, &stats) == 0)
+		domain_set_v4v_stats(domain, &stats);
+}
+
+static void domain_set_gnttab_stats(xenstat_domain *domain,
+				    const xc_gnttab_domstats_t *stats)
+{
+	domain->gnttab_stats.grant_frames = stats->nr_grant_frames;
+	domain->gnttab_stats.max_grant_frames = stats->max_grant_frames;
+	domain->gnttab_stats.maptrack_frames = stats->maptrack_frames;
+	domain->gnttab_stats.max_maptrack_frames = stats->max_maptrack_frames;
+	domain->gnttab_stats.maptrack_in_use = stats->maptrack_in_use;
+	domain->gnttab_stats.map_ops = stats->map_ops;
+	domain->gnttab_stats.unmap_ops = stats->unmap_ops;
+	domain->gnttab_stats.copy_ops = stats->copy_ops;
+	domain->gnttab_stats.copy_bytes = stats->copy_bytes;
+	domain->gnttab_stats.lock_contended = stats->lock_contended;
+	domain->gnttab_stats.lock_wait_ns = stats->lock_wait_ns;
+	domain->gnttab_stats.maptrack_steals = stats->maptrack_steals;
+}
+
+void domain_get_gnttab_stats(xenstat_handle * handle, xenstat_domain * domain)
+{
+	xc_gnttab_domstats_t stats;
+
+	if (xc_gnttab_domstats(handle->xc_handle, domain->id, &stats) == 0)
+		domain_set_gnttab_stats(domain, &stats);
+}
+
+static void domain_add_sched_stats(xenstat_domain *domain,
+				   const xc_sched_vcpustat_t *stats)
+{
+	unsigned int j;
+
+	domain->sched_stats.wakeups += stats->wakeups;
+	domain->sched_stats.preemptions += stats->preemptions;
+	domain->sched_stats.migrations += stats->migrations;
+	domain->sched_stats.waits += stats->waits;
+	domain->sched_stats.wait_ns += stats->wait_ns;
+	if (stats->wait_max_ns > domain->sched_stats.wait_max_ns)
+		domain->sched_stats.wait_max_ns = stats->wait_max_ns;
+	for (j = 0; j < XEN_SYSCTL_SCHED_WAIT_BUCKETS; j++)
+		domain->sched_stats.wait_hist[j] += stats->wait_hist[j];
+}
+
+void domain_get_sched_stats(xenstat_handle * handle, xenstat_domain * domain)
+{
+	xc_sched_vcpustat_t *stats;
+	uint32_t i, nr_vcpus = domain->num_vcpus;
+
+	stats = calloc(nr_vcpus, sizeof(*stats));
+	if (stats == NULL)
+		return;
+	if (xc_sched_vcpustats(handle->xc_handle, domain->id, &nr_vcpus,
+			       stats) < 0)
+		goto out;
+	if (nr_vcpus > domain->num_vcpus)
+		nr_vcpus = domain->num_vcpus;
+
+	for (i = 0; i < nr_vcpus; i++)
+		domain_add_sched_stats(domain, &stats[i]);
+ out:
+	free(stats);
+}
+
+static void xenstat_fill_domain(xenstat_handle *handle,
+				xenstat_domain *domain,
+				const xc_domaininfo_t *info)
+{
+	memcpy(domain->uuid, info->handle, sizeof(domain->uuid));
+	domain->state = info->flags;
+	domain->cpu_ns = info->cpu_time;
+	domain->num_vcpus = (info->max_vcpu_id+1);
+	domain->vcpus = NULL;
+	domain->cur_mem = ((unsigned long long)info->tot_pages)
+	    * handle->page_size;
+	domain->max_mem = info->max_pages == UINT_MAX
+	    ? (unsigned long long)-1
+	    : (unsigned long long)(info->max_pages * handle->page_size);
+	domain->ssid = info->ssidref;
+	domain->num_networks = 0;
+	domain->networks = NULL;
+	domain->num_vbds = 0;
+	domain->vbds = NULL;
+}
+
+/*
+ * The domains are got DOMAIN_CHUNK_SIZE at a time, with all of their
+ * counters in the same hypercall unless xen is too old for
+ * XEN_SYSCTL_domstats. tmem is only asked about if the node has it.
+ */
 xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 {
 #define DOMAIN_CHUNK_SIZE 256
 	xenstat_node *node;
 	xc_physinfo_t physinfo = { 0 };
 	xc_domaininfo_t domaininfo[DOMAIN_CHUNK_SIZE];
+	xc_domstats_t *stats = NULL;
 	int new_domains;
-	unsigned int i;
+	unsigned int i, first_domain = 0, name_cursor = 0;
 
 	/* Create the node */
 	node = (xenstat_node *) calloc(1, sizeof(xenstat_node));
@@ -200,14 +402,32 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 		return NULL;
 	}
 
+	if (!handle->no_domstats) {
+		stats = malloc(DOMAIN_CHUNK_SIZE * sizeof(*stats));
+		if (stats == NULL)
+			goto err;
+	}
+
 	node->num_domains = 0;
 	do {
 		xenstat_domain *domain, *tmp;
-
-		new_domains = xc_domain_getinfolist(handle->xc_handle,
-						    node->num_domains, 
-						    DOMAIN_CHUNK_SIZE, 
-						    domaininfo);
+		const xc_domaininfo_t *info = NULL;
+
+		if (!handle->no_domstats) {
+			new_domains = xc_domstats(handle->xc_handle,
+						  first_domain,
+						  DOMAIN_CHUNK_SIZE, stats);
+			if (new_domains < 0 && errno == ENOSYS) {
+				handle->no_domstats = 1;
+				free(stats);
+				stats = NULL;
+			}
+		}
+		if (handle->no_domstats)
+			new_domains = xc_domain_getinfolist(handle->xc_handle,
+							    first_domain,
+							    DOMAIN_CHUNK_SIZE,
+							    domaininfo);
 		if (new_domains < 0)
 			goto err;
 
@@ -225,13 +445,20 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 		memset(domain, 0, new_domains * sizeof(xenstat_domain));
 
 		for (i = 0; i < new_domains; i++) {
-			/* Fill in domain using domaininfo[i] */
-			domain->id = domaininfo[i].domain;
-			domain->name = xenstat_get_domain_name(handle, 
-							       domain->id);
+			info = stats ? &stats[i].info : &domaininfo[i];
+
+			/* Fill in domain using info */
+			domain->id = info->domain;
+			domain->name = xenstat_cached_domain_name(handle,
+								  &name_cursor,
+								  info);
+			if (domain->name == NULL)
+				domain->name = xenstat_get_domain_name(handle,
+								domain->id);
 			if (domain->name == NULL) {
 				if (errno == ENOMEM) {
 					/* fatal error */
+					free(stats);
 					xenstat_free_node(node);
 					return NULL;
 				}
@@ -242,30 +469,32 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 					continue;
 				}
 			}
-			domain->state = domaininfo[i].flags;
-			domain->cpu_ns = domaininfo[i].cpu_time;
-			domain->num_vcpus = (domaininfo[i].max_vcpu_id+1);
-			domain->vcpus = NULL;
-			domain->cur_mem =
-			    ((unsigned long long)domaininfo[i].tot_pages)
-			    * handle->page_size;
-			domain->max_mem =
-			    domaininfo[i].max_pages == UINT_MAX
-			    ? (unsigned long long)-1
-			    : (unsigned long long)(domaininfo[i].max_pages
-						   * handle->page_size);
-			domain->ssid = domaininfo[i].ssidref;
-			domain->num_networks = 0;
-			domain->networks = NULL;
-			domain->num_vbds = 0;
-			domain->vbds = NULL;
-			domain_get_tmem_stats(handle,domain);
+			xenstat_fill_domain(handle, domain, info);
+			if (node->freeable_mb >= 0)
+				domain_get_tmem_stats(handle,domain);
+			if (stats) {
+				if (stats[i].flags & XEN_SYSCTL_DOMSTATS_V4V)
+					domain_set_v4v_stats(domain,
+							     &stats[i].v4v);
+				if (stats[i].flags & XEN_SYSCTL_DOMSTATS_GNTTAB)
+					domain_set_gnttab_stats(domain,
+								&stats[i].gnttab);
+				domain_add_sched_stats(domain, &stats[i].sched);
+			} else {
+				domain_get_v4v_stats(handle,domain);
+				domain_get_gnttab_stats(handle,domain);
+				domain_get_sched_stats(handle,domain);
+			}
 
 			domain++;
 			node->num_domains++;
 		}
+		if (info)
+			first_domain = info->domain + 1;
 	} while (new_domains == DOMAIN_CHUNK_SIZE);
 
+	free(stats);
+	xenstat_cache_domain_names(node);
 
 	/* Run all the extra data collectors requested */
 	node->flags = 0;
@@ -281,6 +510,9 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 
 	return node;
 err:
+	free(stats);
+	for (i = 0; i < node->num_domains; i++)
+		free(node->domains[i].name);
 	free(node->domains);
 	free(node);
 	return NULL;
@@ -740,6 +972,180 @@ unsigned long long xenstat_tmem_succ_pers_gets(xenstat_tmem *tmem)
 	return tmem->succ_pers_gets;
 }
 
+/*
+ * V4V functions
+ */
+
+xenstat_v4v *xenstat_domain_v4v(xenstat_domain * domain)
+{
+	return &domain->v4v_stats;
+}
+
+/* Get the number of rings */
+unsigned int xenstat_v4v_rings(xenstat_v4v *v4v)
+{
+	return v4v->rings;
+}
+
+/* Get the number of senders waiting for space */
+unsigned int xenstat_v4v_pending(xenstat_v4v *v4v)
+{
+	return v4v->pending;
+}
+
+/* Get how full (in %) the fullest ring is */
+unsigned int xenstat_v4v_max_fill(xenstat_v4v *v4v)
+{
+	return v4v->max_fill;
+}
+
+/* Get the total size of the rings */
+unsigned long long xenstat_v4v_ring_bytes(xenstat_v4v *v4v)
+{
+	return v4v->ring_bytes;
+}
+
+/* Get the number of bytes queued in the rings */
+unsigned long long xenstat_v4v_ring_used(xenstat_v4v *v4v)
+{
+	return v4v->ring_used;
+}
+
+/* Get the number of messages sent */
+unsigned long long xenstat_v4v_tx_messages(xenstat_v4v *v4v)
+{
+	return v4v->tx_messages;
+}
+
+/* Get the number of bytes sent */
+unsigned long long xenstat_v4v_tx_bytes(xenstat_v4v *v4v)
+{
+	return v4v->tx_bytes;
+}
+
+/* Get the number of sends to full rings */
+unsigned long long xenstat_v4v_tx_eagain(xenstat_v4v *v4v)
+{
+	return v4v->tx_eagain;
+}
+
+/* Get the number of messages received */
+unsigned long long xenstat_v4v_rx_messages(xenstat_v4v *v4v)
+{
+	return v4v->rx_messages;
+}
+
+/* Get the number of bytes received */
+unsigned long long xenstat_v4v_rx_bytes(xenstat_v4v *v4v)
+{
+	return v4v->rx_bytes;
+}
+
+/* Get the number of sends refused by a full ring */
+unsigned long long xenstat_v4v_rx_eagain(xenstat_v4v *v4v)
+{
+	return v4v->rx_eagain;
+}
+
+/* Get the guest memory pinned by the rings */
+unsigned long long xenstat_v4v_pinned_bytes(xenstat_v4v *v4v)
+{
+	return v4v->pinned_bytes;
+}
+
+/* Get the quota on pinned memory */
+unsigned long long xenstat_v4v_max_pinned_bytes(xenstat_v4v *v4v)
+{
+	return v4v->max_pinned_bytes;
+}
+
+/* Get the quota on rings */
+unsigned int xenstat_v4v_max_rings(xenstat_v4v *v4v)
+{
+	return v4v->max_rings;
+}
+
+/*
+ * Grant table functions
+ */
+
+xenstat_gnttab *xenstat_domain_gnttab(xenstat_domain * domain)
+{
+	return &domain->gnttab_stats;
+}
+
+/* Get the number of grant table frames */
+unsigned int xenstat_gnttab_grant_frames(xenstat_gnttab *gnttab)
+{
+	return gnttab->grant_frames;
+}
+
+/* Get the limit on grant table frames */
+unsigned int xenstat_gnttab_max_grant_frames(xenstat_gnttab *gnttab)
+{
+	return gnttab->max_grant_frames;
+}
+
+/* Get the number of maptrack frames */
+unsigned int xenstat_gnttab_maptrack_frames(xenstat_gnttab *gnttab)
+{
+	return gnttab->maptrack_frames;
+}
+
+/* Get the limit on maptrack frames */
+unsigned int xenstat_gnttab_max_maptrack_frames(xenstat_gnttab *gnttab)
+{
+	return gnttab->max_maptrack_frames;
+}
+
+/* Get the number of maptrack entries in use */
+unsigned int xenstat_gnttab_maptrack_in_use(xenstat_gnttab *gnttab)
+{
+	return gnttab->maptrack_in_use;
+}
+
+/* Get the number of maps issued */
+unsigned long long xenstat_gnttab_map_ops(xenstat_gnttab *gnttab)
+{
+	return gnttab->map_ops;
+}
+
+/* Get the number of unmaps issued */
+unsigned long long xenstat_gnttab_unmap_ops(xenstat_gnttab *gnttab)
+{
+	return gnttab->unmap_ops;
+}
+
+/* Get the number of copies issued */
+unsigned long long xenstat_gnttab_copy_ops(xenstat_gnttab *gnttab)
+{
+	return gnttab->copy_ops;
+}
+
+/* Get the number of bytes copied */
+unsigned long long xenstat_gnttab_copy_bytes(xenstat_gnttab *gnttab)
+{
+	return gnttab->copy_bytes;
+}
+
+/* Get the number of waits for a grant lock */
+unsigned long long xenstat_gnttab_lock_contended(xenstat_gnttab *gnttab)
+{
+	return gnttab->lock_contended;
+}
+
+/* Get the time (ns) spent waiting for grant locks */
+unsigned long long xenstat_gnttab_lock_wait_ns(xenstat_gnttab *gnttab)
+{
+	return gnttab->lock_wait_ns;
+}
+
+/* Get the number of maptrack entries taken from another vcpu */
+unsigned long long xenstat_gnttab_maptrack_steals(xenstat_gnttab *gnttab)
+{
+	return gnttab->maptrack_steals;
+}
+
 
 static char *xenstat_get_domain_name(xenstat_handle *handle, unsigned int domain_id)
 {
@@ -750,6 +1156,195 @@ static char *xenstat_get_domain_name(xenstat_handle *handle, unsigned int domain
 	return xs_read(handle->xshandle, XBT_NULL, path, NULL);
 }
 
+/*
+ * A domain keeps the name read from xenstore by the previous node while
+ * it has the same uuid and isn't dying. Every XENSTAT_NAME_REFRESH nodes
+ * all the names are read again, which is how long a rename can take to
+ * be seen.
+ */
+#define XENSTAT_NAME_REFRESH 16
+
+/* Domains come in domid order, *cursor walks the cache along with them */
+static char *xenstat_cached_domain_name(xenstat_handle *handle,
+					unsigned int *cursor,
+					const xc_domaininfo_t *info)
+{
+	struct xenstat_name *n;
+
+	while (*cursor < handle->num_names &&
+	       handle->names[*cursor].domid < info->domain)
+		(*cursor)++;
+
+	if (handle->names_age == 0 || (info->flags & XEN_DOMINF_dying) ||
+	    *cursor == handle->num_names)
+		return NULL;
+
+	n = &handle->names[*cursor];
+	if (n->domid != info->domain ||
+	    memcmp(n->uuid, info->handle, sizeof(n->uuid)))
+		return NULL;
+
+	return strdup(n->name);
+}
+
+static void xenstat_cache_domain_names(xenstat_node *node)
+{
+	xenstat_handle *handle = node->handle;
+	struct xenstat_name *names;
+	unsigned int i, age = handle->names_age;
+
+	for (i = 0; i < handle->num_names; i++)
+		free(handle->names[i].name);
+	free(handle->names);
+	handle->names = NULL;
+	handle->num_names = 0;
+	handle->names_age = 0;
+
+	names = calloc(node->num_domains ? node->num_domains : 1,
+		       sizeof(*names));
+	if (names == NULL)
+		return;
+
+	for (i = 0; i < node->num_domains; i++) {
+		names[i].domid = node->domains[i].id;
+		memcpy(names[i].uuid, node->domains[i].uuid,
+		       sizeof(names[i].uuid));
+		names[i].name = strdup(node->domains[i].name);
+		if (names[i].name == NULL) {
+			while (i--)
+				free(names[i].name);
+			free(names);
+			return;
+		}
+	}
+
+	handle->names = names;
+	handle->num_names = node->num_domains;
+	handle->names_age = (age + 1) % XENSTAT_NAME_REFRESH;
+}
+
+/* By how many domains the exported object grows at a time */
+#define XENSTAT_EXPORT_CHUNK 64
+
+static void xenstat_unexport(xenstat_handle *handle)
+{
+	if (handle->export != NULL)
+		munmap(handle->export, handle->export->size);
+	handle->export = NULL;
+	if (handle->export_fd != -1)
+		close(handle->export_fd);
+	handle->export_fd = -1;
+	free(handle->export_name);
+	handle->export_name = NULL;
+}
+
+static int xenstat_export_map(xenstat_handle *handle, const char *name,
+			      unsigned int num_domains)
+{
+	struct stat st;
+	size_t size;
+	void *map;
+
+	if (handle->export_name && strcmp(handle->export_name, name))
+		xenstat_unexport(handle);
+
+	if (handle->export_fd == -1) {
+		handle->export_fd = shm_open(name, O_RDWR|O_CREAT, 0644);
+		if (handle->export_fd == -1)
+			return -1;
+		handle->export_name = strdup(name);
+		if (handle->export_name == NULL)
+			goto err;
+	}
+
+	if (handle->export != NULL &&
+	    handle->export->size >= sizeof(xenstat_export) +
+	    num_domains * sizeof(xenstat_export_domain))
+		return 0;
+
+	/* Never shrink it under the feet of readers */
+	if (fstat(handle->export_fd, &st) == -1)
+		goto err;
+	size = sizeof(xenstat_export) +
+		(num_domains + XENSTAT_EXPORT_CHUNK) *
+		sizeof(xenstat_export_domain);
+	if (size < (size_t)st.st_size)
+		size = st.st_size;
+	if (size > (size_t)st.st_size && ftruncate(handle->export_fd, size) == -1)
+		goto err;
+
+	map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED,
+		   handle->export_fd, 0);
+	if (map == MAP_FAILED)
+		goto err;
+	if (handle->export != NULL)
+		munmap(handle->export, handle->export->size);
+	handle->export = map;
+	handle->export->magic = XENSTAT_EXPORT_MAGIC;
+	handle->export->size = size;
+	/* A writer may have died half way through */
+	if (handle->export->seq & 1)
+		handle->export->seq++;
+
+	return 0;
+ err:
+	xenstat_unexport(handle);
+	return -1;
+}
+
+int xenstat_node_export(xenstat_node *node, const char *name)
+{
+	xenstat_handle *handle = node->handle;
+	xenstat_export *export;
+	struct timespec ts;
+	unsigned int i, j;
+
+	if (xenstat_export_map(handle, name, node->num_domains) == -1)
+		return -1;
+	export = handle->export;
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	export->seq++;
+	xen_wmb();
+
+	export->num_domains = node->num_domains;
+	export->num_cpus = node->num_cpus;
+	export->time_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	export->cpu_hz = node->cpu_hz;
+	export->tot_mem = node->tot_mem;
+	export->free_mem = node->free_mem;
+
+	for (i = 0; i < node->num_domains; i++) {
+		xenstat_domain *domain = &node->domains[i];
+		xenstat_export_domain *ent = &export->domains[i];
+
+		memset(ent, 0, sizeof(*ent));
+		ent->domid = domain->id;
+		ent->state = domain->state;
+		ent->num_vcpus = domain->num_vcpus;
+		ent->ssid = domain->ssid;
+		strncpy(ent->name, domain->name, sizeof(ent->name) - 1);
+		ent->cpu_ns = domain->cpu_ns;
+		ent->cur_mem = domain->cur_mem;
+		ent->max_mem = domain->max_mem;
+		for (j = 0; j < domain->num_networks; j++) {
+			ent->net_rx_bytes += domain->networks[j].rbytes;
+			ent->net_tx_bytes += domain->networks[j].tbytes;
+		}
+		ent->v4v_rx_bytes = domain->v4v_stats.rx_bytes;
+		ent->v4v_tx_bytes = domain->v4v_stats.tx_bytes;
+		ent->gnttab_map_ops = domain->gnttab_stats.map_ops;
+		ent->gnttab_copy_bytes = domain->gnttab_stats.copy_bytes;
+		ent->sched_waits = domain->sched_stats.waits;
+		ent->sched_wait_ns = domain->sched_stats.wait_ns;
+	}
+
+	xen_wmb();
+	export->seq++;
+
+	return 0;
+}
+
 /* Remove specified entry from list of domains */
 static void xenstat_prune_domain(xenstat_node *node, unsigned int entry)
 {
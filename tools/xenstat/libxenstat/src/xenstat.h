@@ -20,6 +20,8 @@
 #ifndef XENSTAT_H
 #define XENSTAT_H
 
+#include <stdint.h>
+
 /* Opaque handles */
 typedef struct xenstat_handle xenstat_handle;
 typedef struct xenstat_domain xenstat_domain;
@@ -28,6 +30,9 @@ typedef struct xenstat_vcpu xenstat_vcpu;
 typedef struct xenstat_network xenstat_network;
 typedef struct xenstat_vbd xenstat_vbd;
 typedef struct xenstat_tmem xenstat_tmem;
+typedef struct xenstat_v4v xenstat_v4v;
+typedef struct xenstat_gnttab xenstat_gnttab;
+typedef struct xenstat_sched xenstat_sched;
 
 /* Initialize the xenstat library.  Returns a handle to be used with
  * subsequent calls to the xenstat library, or NULL if an error occurs. */
@@ -49,6 +54,57 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags);
 /* Free the information */
 void xenstat_free_node(xenstat_node * node);
 
+/*
+ * A node as exported by xenstat_node_export() to a POSIX shared memory
+ * object, for monitoring agents to read without any hypercall of their
+ * own. seq is odd while the snapshot is being written: a reader copies
+ * what it needs between two reads of seq, and tries again unless they
+ * are equal and even. The object only grows, size is how big it is; a
+ * reader whose mapping is short of domains[num_domains] maps it again.
+ * net_*_bytes are summed over the vifs of the domain, and left 0 unless
+ * the node was collected with XENSTAT_NETWORK.
+ */
+#define XENSTAT_EXPORT_MAGIC 0x58534531	/* "XSE1" */
+#define XENSTAT_EXPORT_NAME_LEN 64
+
+typedef struct xenstat_export_domain {
+	uint32_t domid;
+	uint32_t state;			/* XEN_DOMINF_* */
+	uint32_t num_vcpus;
+	uint32_t ssid;
+	char name[XENSTAT_EXPORT_NAME_LEN];	/* truncated, NUL terminated */
+	uint64_t cpu_ns;
+	uint64_t cur_mem;
+	uint64_t max_mem;
+	uint64_t net_rx_bytes;
+	uint64_t net_tx_bytes;
+	uint64_t v4v_rx_bytes;
+	uint64_t v4v_tx_bytes;
+	uint64_t gnttab_map_ops;
+	uint64_t gnttab_copy_bytes;
+	uint64_t sched_waits;
+	uint64_t sched_wait_ns;
+} xenstat_export_domain;
+
+typedef struct xenstat_export {
+	uint32_t magic;			/* XENSTAT_EXPORT_MAGIC */
+	volatile uint32_t seq;
+	uint32_t num_domains;
+	uint32_t num_cpus;
+	uint64_t size;
+	uint64_t time_ns;		/* CLOCK_REALTIME, when written */
+	uint64_t cpu_hz;
+	uint64_t tot_mem;
+	uint64_t free_mem;
+	xenstat_export_domain domains[];
+} xenstat_export;
+
+/* Write node to the shared memory object name (see shm_open), creating it
+ * if it doesn't exist. The object is kept mapped by the handle for the
+ * next calls, and left in place by xenstat_uninit(). Returns 0, or -1 with
+ * errno set. */
+int xenstat_node_export(xenstat_node * node, const char *name);
+
 /*
  * Node functions - extract information from a xenstat_node
  */
@@ -136,6 +192,15 @@ xenstat_vbd *xenstat_domain_vbd(xenstat_domain * domain,
 /* Get the tmem information for a given domain */
 xenstat_tmem *xenstat_domain_tmem(xenstat_domain * domain);
 
+/* Get the v4v information for a given domain */
+xenstat_v4v *xenstat_domain_v4v(xenstat_domain * domain);
+
+/* Get the grant table information for a given domain */
+xenstat_gnttab *xenstat_domain_gnttab(xenstat_domain * domain);
+
+/* Get the scheduling latency information for a given domain */
+xenstat_sched *xenstat_domain_sched(xenstat_domain * domain);
+
 /*
  * VCPU functions - extract information from a xenstat_vcpu
  */
@@ -201,4 +266,86 @@ unsigned long long xenstat_tmem_succ_eph_gets(xenstat_tmem *tmem);
 unsigned long long xenstat_tmem_succ_pers_puts(xenstat_tmem *tmem);
 unsigned long long xenstat_tmem_succ_pers_gets(xenstat_tmem *tmem);
 
+/*
+ * V4V functions - extract v4v information
+ */
+
+/* Get the number of rings, and of senders waiting for space in them */
+unsigned int xenstat_v4v_rings(xenstat_v4v *v4v);
+unsigned int xenstat_v4v_pending(xenstat_v4v *v4v);
+
+/* Get how full (in %) the fullest ring is */
+unsigned int xenstat_v4v_max_fill(xenstat_v4v *v4v);
+
+/* Get the total size of the rings, and how much is queued in them */
+unsigned long long xenstat_v4v_ring_bytes(xenstat_v4v *v4v);
+unsigned long long xenstat_v4v_ring_used(xenstat_v4v *v4v);
+
+/* Get the number of messages/bytes sent, and of sends to full rings */
+unsigned long long xenstat_v4v_tx_messages(xenstat_v4v *v4v);
+unsigned long long xenstat_v4v_tx_bytes(xenstat_v4v *v4v);
+unsigned long long xenstat_v4v_tx_eagain(xenstat_v4v *v4v);
+
+/* Get the same for what other domains sent to its rings */
+unsigned long long xenstat_v4v_rx_messages(xenstat_v4v *v4v);
+unsigned long long xenstat_v4v_rx_bytes(xenstat_v4v *v4v);
+unsigned long long xenstat_v4v_rx_eagain(xenstat_v4v *v4v);
+
+/* Get the guest memory the rings pin, and the quotas on it and on the
+ * number of rings, 0 if there is none */
+unsigned long long xenstat_v4v_pinned_bytes(xenstat_v4v *v4v);
+unsigned long long xenstat_v4v_max_pinned_bytes(xenstat_v4v *v4v);
+unsigned int xenstat_v4v_max_rings(xenstat_v4v *v4v);
+
+/*
+ * Grant table functions - extract grant table information
+ */
+
+/* Get the size of the grant table, and its limit, in frames */
+unsigned int xenstat_gnttab_grant_frames(xenstat_gnttab *gnttab);
+unsigned int xenstat_gnttab_max_grant_frames(xenstat_gnttab *gnttab);
+
+/* Get the size of the maptrack table, its limit, and the entries in use */
+unsigned int xenstat_gnttab_maptrack_frames(xenstat_gnttab *gnttab);
+unsigned int xenstat_gnttab_max_maptrack_frames(xenstat_gnttab *gnttab);
+unsigned int xenstat_gnttab_maptrack_in_use(xenstat_gnttab *gnttab);
+
+/* Get the number of maps, unmaps and copies issued, and the bytes copied */
+unsigned long long xenstat_gnttab_map_ops(xenstat_gnttab *gnttab);
+unsigned long long xenstat_gnttab_unmap_ops(xenstat_gnttab *gnttab);
+unsigned long long xenstat_gnttab_copy_ops(xenstat_gnttab *gnttab);
+unsigned long long xenstat_gnttab_copy_bytes(xenstat_gnttab *gnttab);
+
+/* Get how many times these waited for a grant lock, and for how long (ns) */
+unsigned long long xenstat_gnttab_lock_contended(xenstat_gnttab *gnttab);
+unsigned long long xenstat_gnttab_lock_wait_ns(xenstat_gnttab *gnttab);
+
+/* Get the number of free maptrack entries taken from another vcpu */
+unsigned long long xenstat_gnttab_maptrack_steals(xenstat_gnttab *gnttab);
+
+/*
+ * Scheduling latency functions - extract the scheduling latency of the
+ * vcpus of a domain, summed over them
+ */
+
+/* Get the number of wakeups, preemptions and migrations of the vcpus */
+unsigned long long xenstat_sched_wakeups(xenstat_sched *sched);
+unsigned long long xenstat_sched_preemptions(xenstat_sched *sched);
+unsigned long long xenstat_sched_migrations(xenstat_sched *sched);
+
+/* Get how many times vcpus waited to run, for how long (ns) in all and at
+ * most */
+unsigned long long xenstat_sched_waits(xenstat_sched *sched);
+unsigned long long xenstat_sched_wait_ns(xenstat_sched *sched);
+unsigned long long xenstat_sched_wait_max_ns(xenstat_sched *sched);
+
+/* Get the histogram of the waits: the number of buckets, the number of
+ * waits in a bucket, and the wait (ns) past which they fall in the next
+ * bucket */
+unsigned int xenstat_sched_wait_buckets(xenstat_sched *sched);
+unsigned long long xenstat_sched_wait_hist(xenstat_sched *sched,
+					   unsigned int bucket);
+unsigned long long xenstat_sched_wait_bucket_limit(xenstat_sched *sched,
+						   unsigned int bucket);
+
 #endif /* XENSTAT_H */
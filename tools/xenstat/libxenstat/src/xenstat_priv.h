@@ -32,12 +32,26 @@
 #define SHORT_ASC_LEN 5                 /* length of 65535 */
 #define VERSION_SIZE (2 * SHORT_ASC_LEN + 1 + sizeof(xen_extraversion_t) + 1)
 
+/* Domain names as last read from xenstore */
+struct xenstat_name {
+	unsigned int domid;
+	xen_domain_handle_t uuid;
+	char *name;
+};
+
 struct xenstat_handle {
 	xc_interface *xc_handle;
 	struct xs_handle *xshandle; /* xenstore handle */
 	int page_size;
 	void *priv;
 	char xen_version[VERSION_SIZE]; /* xen version running on this node */
+	int no_domstats;		/* xen has no XEN_SYSCTL_domstats */
+	struct xenstat_name *names;	/* sorted by domid */
+	unsigned int num_names;
+	unsigned int names_age;		/* nodes got since they were read */
+	char *export_name;		/* see xenstat_node_export() */
+	int export_fd;
+	xenstat_export *export;
 };
 
 struct xenstat_node {
@@ -59,8 +73,56 @@ struct xenstat_tmem {
 	unsigned long long succ_pers_gets;
 };
 
+struct xenstat_v4v {
+	unsigned int rings;
+	unsigned int pending;
+	unsigned int max_fill;
+	unsigned long long ring_bytes;
+	unsigned long long ring_used;
+	/* Sent by the domain */
+	unsigned long long tx_messages;
+	unsigned long long tx_bytes;
+	unsigned long long tx_eagain;
+	/* Sent to its rings */
+	unsigned long long rx_messages;
+	unsigned long long rx_bytes;
+	unsigned long long rx_eagain;
+	/* Memory pinned by its rings, and the quota, 0 for none */
+	unsigned long long pinned_bytes;
+	unsigned long long max_pinned_bytes;
+	unsigned int max_rings;
+};
+
+struct xenstat_gnttab {
+	unsigned int grant_frames;
+	unsigned int max_grant_frames;
+	unsigned int maptrack_frames;
+	unsigned int max_maptrack_frames;
+	unsigned int maptrack_in_use;
+	/* Issued by the domain */
+	unsigned long long map_ops;
+	unsigned long long unmap_ops;
+	unsigned long long copy_ops;
+	unsigned long long copy_bytes;
+	unsigned long long lock_contended;
+	unsigned long long lock_wait_ns;
+	unsigned long long maptrack_steals;
+};
+
+struct xenstat_sched {
+	/* Summed over the vcpus of the domain */
+	unsigned long long wakeups;
+	unsigned long long preemptions;
+	unsigned long long migrations;
+	unsigned long long waits;
+	unsigned long long wait_ns;
+	unsigned long long wait_max_ns;
+	unsigned long long wait_hist[XEN_SYSCTL_SCHED_WAIT_BUCKETS];
+};
+
 struct xenstat_domain {
 	unsigned int id;
+	xen_domain_handle_t uuid;
 	char *name;
 	unsigned int state;
 	unsigned long long cpu_ns;
@@ -74,6 +136,9 @@ struct xenstat_domain {
 	unsigned int num_vbds;
 	xenstat_vbd *vbds;
 	xenstat_tmem tmem_stats;
+	xenstat_v4v v4v_stats;
+	xenstat_gnttab gnttab_stats;
+	xenstat_sched sched_stats;
 };
 
 struct xenstat_vcpu {
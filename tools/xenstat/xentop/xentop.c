@@ -210,8 +210,12 @@ int show_vcpus = 0;
 int show_networks = 0;
 int show_vbds = 0;
 int show_tmem = 0;
+int show_v4v = 0;
+int show_gnttab = 0;
+int show_sched = 0;
 int repeat_header = 0;
 int show_full_name = 0;
+const char *export_name = NULL;
 #define PROMPT_VAL_LEN 80
 char *prompt = NULL;
 char prompt_val[PROMPT_VAL_LEN];
@@ -236,11 +240,15 @@ static void usage(const char *program)
 	       "-d, --delay=SECONDS  seconds between updates (default 3)\n"
 	       "-n, --networks       output vif network data\n"
 	       "-x, --vbds           output vbd block device data\n"
+	       "-4, --v4v            output v4v ring data\n"
+	       "-g, --gnttab         output grant table data\n"
+	       "-l, --latency        output vcpu scheduling latency data\n"
 	       "-r, --repeat-header  repeat table header before each domain\n"
 	       "-v, --vcpus          output vcpu data\n"
 	       "-b, --batch	     output in batch mode, no user input accepted\n"
 	       "-i, --iterations     number of iterations before exiting\n"
 	       "-f, --full-name      output the full domain name (not truncated)\n"
+	       "-e, --export=NAME    also export each update to shared memory NAME\n"
 	       "\n" XENTOP_BUGSTO,
 	       program);
 	return;
@@ -365,6 +373,15 @@ static int handle_key(int ch)
 		case 't': case 'T':
 			show_tmem ^= 1;
 			break;
+		case '4':
+			show_v4v ^= 1;
+			break;
+		case 'g': case 'G':
+			show_gnttab ^= 1;
+			break;
+		case 'l': case 'L':
+			show_sched ^= 1;
+			break;
 		case 'r': case 'R':
 			repeat_header ^= 1;
 			break;
@@ -908,6 +925,22 @@ void do_bottom_line(void)
 		attr_addstr(show_tmem ? COLOR_PAIR(1) : 0, "mem");
 		addstr("  ");
 
+		/* v4v */
+		attr_addstr(show_v4v ? COLOR_PAIR(1) : 0, "v");
+		addch(A_REVERSE | '4');
+		attr_addstr(show_v4v ? COLOR_PAIR(1) : 0, "v");
+		addstr("  ");
+
+		/* grant tables */
+		addch(A_REVERSE | 'G');
+		attr_addstr(show_gnttab ? COLOR_PAIR(1) : 0, "nttab");
+		addstr("  ");
+
+		/* scheduling latency */
+		addch(A_REVERSE | 'L');
+		attr_addstr(show_sched ? COLOR_PAIR(1) : 0, "atency");
+		addstr("  ");
+
 
 		/* vcpus */
 		addch(A_REVERSE | 'V');
@@ -1054,6 +1087,91 @@ void do_tmem(xenstat_domain *domain)
 
 }
 
+/* Output all v4v information */
+void do_v4v(xenstat_domain *domain)
+{
+	xenstat_v4v *v4v = xenstat_domain_v4v(domain);
+
+	if (!xenstat_v4v_rings(v4v) && !xenstat_v4v_tx_messages(v4v))
+		return;
+
+	print("V4V:   Rings: %4u   Used(k): %8llu/%8llu   Max fill: %3u%%   "
+	      "Pending: %4u\n",
+	      xenstat_v4v_rings(v4v),
+	      xenstat_v4v_ring_used(v4v) / 1024,
+	      xenstat_v4v_ring_bytes(v4v) / 1024,
+	      xenstat_v4v_max_fill(v4v),
+	      xenstat_v4v_pending(v4v));
+	print("       TX: %8llu msgs %10llu bytes %8llu EAGAIN   "
+	      "RX: %8llu msgs %10llu bytes %8llu EAGAIN\n",
+	      xenstat_v4v_tx_messages(v4v),
+	      xenstat_v4v_tx_bytes(v4v),
+	      xenstat_v4v_tx_eagain(v4v),
+	      xenstat_v4v_rx_messages(v4v),
+	      xenstat_v4v_rx_bytes(v4v),
+	      xenstat_v4v_rx_eagain(v4v));
+	print("       Pinned(k): %8llu", xenstat_v4v_pinned_bytes(v4v) / 1024);
+	if (xenstat_v4v_max_pinned_bytes(v4v))
+		print("/%8llu", xenstat_v4v_max_pinned_bytes(v4v) / 1024);
+	if (xenstat_v4v_max_rings(v4v))
+		print("   Max rings: %4u", xenstat_v4v_max_rings(v4v));
+	print("\n");
+}
+
+/* Output all grant table information */
+void do_gnttab(xenstat_domain *domain)
+{
+	xenstat_gnttab *gnttab = xenstat_domain_gnttab(domain);
+
+	print("Gnttab: Frames: %4u/%4u   Maptrack: %6u used %4u/%4u frames   "
+	      "Steals: %8llu\n",
+	      xenstat_gnttab_grant_frames(gnttab),
+	      xenstat_gnttab_max_grant_frames(gnttab),
+	      xenstat_gnttab_maptrack_in_use(gnttab),
+	      xenstat_gnttab_maptrack_frames(gnttab),
+	      xenstat_gnttab_max_maptrack_frames(gnttab),
+	      xenstat_gnttab_maptrack_steals(gnttab));
+	print("        Map: %10llu   Unmap: %10llu   Copy: %10llu %12llu bytes   "
+	      "Lock waits: %8llu %8llu us\n",
+	      xenstat_gnttab_map_ops(gnttab),
+	      xenstat_gnttab_unmap_ops(gnttab),
+	      xenstat_gnttab_copy_ops(gnttab),
+	      xenstat_gnttab_copy_bytes(gnttab),
+	      xenstat_gnttab_lock_contended(gnttab),
+	      xenstat_gnttab_lock_wait_ns(gnttab) / 1000);
+}
+
+/* Output all scheduling latency information */
+void do_sched(xenstat_domain *domain)
+{
+	xenstat_sched *sched = xenstat_domain_sched(domain);
+	unsigned long long waits = xenstat_sched_waits(sched);
+	unsigned long long seen = 0;
+	unsigned int i, last = xenstat_sched_wait_buckets(sched) - 1;
+
+	print("Sched: Wakeups: %10llu   Preempt: %10llu   Migrate: %10llu\n",
+	      xenstat_sched_wakeups(sched),
+	      xenstat_sched_preemptions(sched),
+	      xenstat_sched_migrations(sched));
+	print("       Waits: %10llu   Avg: %8llu us   Max: %8llu us   ",
+	      waits,
+	      waits ? xenstat_sched_wait_ns(sched) / waits / 1000 : 0,
+	      xenstat_sched_wait_max_ns(sched) / 1000);
+
+	/* The bucket the 99th percentile of the waits falls in */
+	for (i = 0; i < last; i++) {
+		seen += xenstat_sched_wait_hist(sched, i);
+		if (seen * 100 >= waits * 99)
+			break;
+	}
+	if (i < last)
+		print("99%%: < %llu us\n",
+		      xenstat_sched_wait_bucket_limit(sched, i) / 1000);
+	else
+		print("99%%: >= %llu us\n",
+		      xenstat_sched_wait_bucket_limit(sched, last - 1) / 1000);
+}
+
 static void top(void)
 {
 	xenstat_domain **domains;
@@ -1066,6 +1184,8 @@ static void top(void)
 	cur_node = xenstat_get_node(xhandle, XENSTAT_ALL);
 	if (cur_node == NULL)
 		fail("Failed to retrieve statistics from libxenstat\n");
+	if (export_name && xenstat_node_export(cur_node, export_name) < 0)
+		fail("Failed to export statistics to shared memory\n");
 
 	/* dump summary top information */
 	if (!batch)
@@ -1102,6 +1222,12 @@ static void top(void)
 			do_vbd(domains[i]);
 		if (show_tmem)
 			do_tmem(domains[i]);
+		if (show_v4v)
+			do_v4v(domains[i]);
+		if (show_gnttab)
+			do_gnttab(domains[i]);
+		if (show_sched)
+			do_sched(domains[i]);
 	}
 
 	if (!batch)
@@ -1127,15 +1253,19 @@ int main(int argc, char **argv)
 		{ "version",       no_argument,       NULL, 'V' },
 		{ "networks",      no_argument,       NULL, 'n' },
 		{ "vbds",          no_argument,       NULL, 'x' },
+		{ "v4v",           no_argument,       NULL, '4' },
+		{ "gnttab",        no_argument,       NULL, 'g' },
+		{ "latency",       no_argument,       NULL, 'l' },
 		{ "repeat-header", no_argument,       NULL, 'r' },
 		{ "vcpus",         no_argument,       NULL, 'v' },
 		{ "delay",         required_argument, NULL, 'd' },
 		{ "batch",	   no_argument,	      NULL, 'b' },
 		{ "iterations",	   required_argument, NULL, 'i' },
 		{ "full-name",     no_argument,       NULL, 'f' },
+		{ "export",        required_argument, NULL, 'e' },
 		{ 0, 0, 0, 0 },
 	};
-	const char *sopts = "hVnxrvd:bi:f";
+	const char *sopts = "hVnx4glrvd:bi:fe:";
 
 	if (atexit(cleanup) != 0)
 		fail("Failed to install cleanup handler.\n");
@@ -1177,9 +1307,21 @@ int main(int argc, char **argv)
 		case 'f':
 			show_full_name = 1;
 			break;
+		case 'e':
+			export_name = optarg;
+			break;
 		case 't':
 			show_tmem = 1;
 			break;
+		case '4':
+			show_v4v = 1;
+			break;
+		case 'g':
+			show_gnttab = 1;
+			break;
+		case 'l':
+			show_sched = 1;
+			break;
 		}
 	}
 
@@ -244,6 +244,43 @@ char *xs_debug_command(struct xs_handle *h, const char *cmd,
 		       void *data, unsigned int len);
 
 int xs_suspend_evtchn_port(int domid);
+
+/* Pipelined requests.
+ * A batch collects requests, each added one returning its index in the
+ * batch (or -1), without waiting for anything.  xs_batch_send() then
+ * sends them all at once and reads all the replies, so that a batch costs
+ * one round trip to the daemon instead of one per request.  Requests are
+ * carried out in order, as if made one after the other.
+ */
+struct xs_batch;
+
+struct xs_batch *xs_batch_start(struct xs_handle *h);
+int xs_batch_read(struct xs_batch *b, xs_transaction_t t, const char *path);
+int xs_batch_write(struct xs_batch *b, xs_transaction_t t,
+		   const char *path, const void *data, unsigned int len);
+int xs_batch_mkdir(struct xs_batch *b, xs_transaction_t t, const char *path);
+int xs_batch_rm(struct xs_batch *b, xs_transaction_t t, const char *path);
+int xs_batch_set_permissions(struct xs_batch *b, xs_transaction_t t,
+			     const char *path, struct xs_permissions *perms,
+			     unsigned int num_perms);
+
+/* Send the batch and wait for the replies.
+ * Returns false if talking to the daemon failed; each request can still
+ * have failed on its own if it returns true.
+ */
+bool xs_batch_send(struct xs_batch *b);
+
+/* Whether request req of a sent batch succeeded, with errno set if not. */
+bool xs_batch_ok(struct xs_batch *b, int req);
+
+/* Take the reply to request req of a sent batch, nul terminated, as
+ * xs_read() returns it.  Call free() after use.  NULL on failure.
+ */
+void *xs_batch_reply(struct xs_batch *b, int req, unsigned int *len);
+
+/* Free the batch, and the replies that were not taken. */
+void xs_batch_free(struct xs_batch *b);
+
 #endif /* XENSTORE_H */
 
 /*
@@ -49,6 +49,7 @@
 #include "xenstored_watch.h"
 #include "xenstored_transaction.h"
 #include "xenstored_domain.h"
+#include "xenstored_store.h"
 #include "xenctrl.h"
 #include "tdb.h"
 
@@ -56,6 +57,7 @@
 
 extern xc_evtchn *xce_handle; /* in xenstored_domain.c */
 static int xce_pollfd_idx = -1;
+static int v4v_pollfd_idx = -1;
 static struct pollfd *fds;
 static unsigned int current_array_size;
 static unsigned int nr_fds;
@@ -70,41 +72,18 @@ static bool remove_local = true;
 static int reopen_log_pipe[2];
 static int reopen_log_pipe0_pollfd_idx = -1;
 static char *tracefile = NULL;
-static TDB_CONTEXT *tdb_ctx = NULL;
 
-static void corrupt(struct connection *conn, const char *fmt, ...);
 static void check_store(void);
 
-#define log(...)							\
-	do {								\
-		char *s = talloc_asprintf(NULL, __VA_ARGS__);		\
-		trace("%s\n", s);					\
-		syslog(LOG_ERR, "%s",  s);				\
-		talloc_free(s);						\
-	} while (0)
-
-
 int quota_nb_entry_per_domain = 1000;
 int quota_nb_watch_per_domain = 128;
 int quota_max_entry_size = 2048; /* 2K */
 int quota_max_transaction = 10;
 
-TDB_CONTEXT *tdb_context(struct connection *conn)
+/* conn = NULL used in manual_node at setup. */
+static struct transaction *conn_transaction(struct connection *conn)
 {
-	/* conn = NULL used in manual_node at setup. */
-	if (!conn || !conn->transaction)
-		return tdb_ctx;
-	return tdb_transaction_context(conn->transaction);
-}
-
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb)
-{
-	if (!(tdb_ctx->flags & TDB_INTERNAL))
-		if (rename(newname, xs_daemon_tdb()) != 0)
-			return false;
-	tdb_close(tdb_ctx);
-	tdb_ctx = talloc_steal(talloc_autofree_context(), newtdb);
-	return true;
+	return conn ? conn->transaction : NULL;
 }
 
 static char *sockmsg_string(enum xsd_sockmsg_type type)
@@ -360,6 +339,8 @@ static void initialize_fds(int sock, int *p_sock_pollfd_idx,
 	if (xce_handle != NULL)
 		xce_pollfd_idx = set_fd(xc_evtchn_fd(xce_handle),
 					POLLIN|POLLPRI);
+	if (domain_v4v_fd() != -1)
+		v4v_pollfd_idx = set_fd(domain_v4v_fd(), POLLIN|POLLPRI);
 
 	list_for_each_entry(conn, &connections, list) {
 		if (conn->domain) {
@@ -398,26 +379,17 @@ static struct node *read_node(struct connection *conn, const char *name)
 	TDB_DATA key, data;
 	uint32_t *p;
 	struct node *node;
-	TDB_CONTEXT * context = tdb_context(conn);
 
 	key.dptr = (void *)name;
 	key.dsize = strlen(name);
-	data = tdb_fetch(context, key);
-
-	if (data.dptr == NULL) {
-		if (tdb_error(context) == TDB_ERR_NOEXIST)
-			errno = ENOENT;
-		else {
-			log("TDB error on read: %s", tdb_errorstr(context));
-			errno = EIO;
-		}
+	data = transaction_fetch(conn_transaction(conn), key);
+	if (data.dptr == NULL)
 		return NULL;
-	}
 
 	node = talloc(name, struct node);
 	node->name = talloc_strdup(node, name);
 	node->parent = NULL;
-	node->tdb = tdb_context(conn);
+	node->trans = conn_transaction(conn);
 	talloc_steal(node, data.dptr);
 
 	/* Datalen, childlen, number of permissions */
@@ -440,7 +412,7 @@ static bool write_node(struct connection *conn, const struct node *node)
 {
 	/*
 	 * conn will be null when this is called from manual_node.
-	 * tdb_context copes with this.
+	 * conn_transaction copes with this.
 	 */
 
 	TDB_DATA key, data;
@@ -469,7 +441,7 @@ static bool write_node(struct connection *conn, const struct node *node)
 	memcpy(p, node->children, node->childlen);
 
 	/* TDB should set errno, but doesn't even set ecode AFAICT. */
-	if (tdb_store(tdb_context(conn), key, data, TDB_REPLACE) != 0) {
+	if (transaction_store(conn_transaction(conn), key, data) != 0) {
 		corrupt(conn, "Write of %s failed", key.dptr);
 		goto error;
 	}
@@ -791,7 +763,7 @@ static void delete_node_single(struct connection *conn, struct node *node)
 	key.dptr = (void *)node->name;
 	key.dsize = strlen(node->name);
 
-	if (tdb_delete(tdb_context(conn), key) != 0) {
+	if (transaction_delete(conn_transaction(conn), key) != 0) {
 		corrupt(conn, "Could not delete '%s'", node->name);
 		return;
 	}
@@ -832,7 +804,7 @@ static struct node *construct_node(struct connection *conn, const char *name)
 
 	/* Allocate node */
 	node = talloc(name, struct node);
-	node->tdb = tdb_context(conn);
+	node->trans = conn_transaction(conn);
 	node->name = talloc_strdup(node, name);
 
 	/* Inherit permissions, except unprivileged domains own what they create */
@@ -861,7 +833,7 @@ static int destroy_node(void *_node)
 	key.dptr = (void *)node->name;
 	key.dsize = strlen(node->name);
 
-	tdb_delete(node->tdb, key);
+	transaction_delete(node->trans, key);
 	return 0;
 }
 
@@ -1055,6 +1027,27 @@ static void internal_rm(const char *name)
 }
 
 
+/* Write a node on behalf of the daemon, rather than of a connection. */
+bool internal_write(const char *name, const char *value)
+{
+	char *tname = talloc_strdup(NULL, name);
+	char *data = talloc_strdup(tname, value);
+	struct node *node = read_node(NULL, tname);
+	bool ret;
+
+	if (node) {
+		node->data = data;
+		node->datalen = strlen(data);
+		ret = write_node(NULL, node);
+	} else
+		ret = create_node(NULL, tname, data, strlen(data)) != NULL;
+	if (ret)
+		fire_watches(NULL, tname, false);
+	talloc_free(node);
+	talloc_free(tname);
+	return ret;
+}
+
 static void do_rm(struct connection *conn, const char *name)
 {
 	struct node *node;
@@ -1448,6 +1441,8 @@ static void accept_connection(int sock, bool canwrite)
 #endif
 
 static int tdb_flags;
+static bool memory_db;
+static const char *journal_file;
 
 /* We create initial nodes manually. */
 static void manual_node(const char *name, const char *child)
@@ -1473,10 +1468,7 @@ static void setup_structure(void)
 	char *tdbname;
 	tdbname = talloc_strdup(talloc_autofree_context(), xs_daemon_tdb());
 
-	if (!(tdb_flags & TDB_INTERNAL))
-		tdb_ctx = tdb_open(tdbname, 0, tdb_flags, O_RDWR, 0);
-
-	if (tdb_ctx) {
+	if (store_open(tdbname, tdb_flags, memory_db, journal_file)) {
 		/* XXX When we make xenstored able to restart, this will have
 		   to become cleverer, checking for existing domains and not
 		   removing the corresponding entries, but for now xenstored
@@ -1505,11 +1497,6 @@ static void setup_structure(void)
 		talloc_free(tlocal);
 	}
 	else {
-		tdb_ctx = tdb_open(tdbname, 7919, tdb_flags, O_RDWR|O_CREAT,
-				   0640);
-		if (!tdb_ctx)
-			barf_perror("Could not create tdb file %s", tdbname);
-
 		manual_node("/", "tool");
 		manual_node("/tool", "xenstored");
 		manual_node("/tool/xenstored", NULL);
@@ -1636,8 +1623,7 @@ static void check_store_(const char *name, struct hashtable *reachable)
 /**
  * Helper to clean_store below.
  */
-static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
-			void *private)
+static int clean_store_(TDB_DATA key, TDB_DATA val, void *private)
 {
 	struct hashtable *reachable = private;
 	char * name = talloc_strndup(NULL, key.dptr, key.dsize);
@@ -1645,7 +1631,7 @@ static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
 	if (!hashtable_search(reachable, name)) {
 		log("clean_store: '%s' is orphaned!", name);
 		if (recovery) {
-			tdb_delete(tdb, key);
+			store_delete(key);
 		}
 	}
 
@@ -1661,7 +1647,7 @@ static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
  */
 static void clean_store(struct hashtable *reachable)
 {
-	tdb_traverse(tdb_ctx, &clean_store_, reachable);
+	store_traverse(&clean_store_, reachable);
 }
 
 
@@ -1683,7 +1669,7 @@ static void check_store(void)
 
 
 /* Something is horribly wrong: check the store. */
-static void corrupt(struct connection *conn, const char *fmt, ...)
+void corrupt(struct connection *conn, const char *fmt, ...)
 {
 	va_list arglist;
 	char *str;
@@ -1785,7 +1771,12 @@ static void usage(void)
 "  --no-recovery       to request that no recovery should be attempted when\n"
 "                      the store is corrupted (debug only),\n"
 "  --internal-db       store database in memory, not on disk\n"
+"  --memory-db         keep the store in a hash table in memory, not in tdb,\n"
+"  --journal <file>    with --memory-db, giving a file the changes to the\n"
+"                      store are written to in batches, and reloaded from\n"
+"                      on start-up,\n"
 "  --preserve-local    to request that /local is preserved on start-up,\n"
+"  --v4v               to offer domains a v4v connection, besides their page,\n"
 "  --verbose           to request verbose execution.\n");
 }
 
@@ -1806,8 +1797,11 @@ static struct option options[] = {
 	{ "no-recovery", 0, NULL, 'R' },
 	{ "preserve-local", 0, NULL, 'L' },
 	{ "internal-db", 0, NULL, 'I' },
+	{ "memory-db", 0, NULL, 'M' },
+	{ "journal", 1, NULL, 'J' },
 	{ "verbose", 0, NULL, 'V' },
 	{ "watch-nb", 1, NULL, 'W' },
+	{ "v4v", 0, NULL, 'X' },
 	{ NULL, 0, NULL, 0 } };
 
 extern void dump_conn(struct connection *conn); 
@@ -1822,10 +1816,11 @@ int main(int argc, char *argv[])
 	bool dofork = true;
 	bool outputpid = false;
 	bool no_domain_init = false;
+	bool v4v = false;
 	const char *pidfile = NULL;
 	int timeout;
 
-	while ((opt = getopt_long(argc, argv, "DE:F:HNPS:t:T:RLVW:", options,
+	while ((opt = getopt_long(argc, argv, "DE:F:HNPS:t:T:RLIMJ:VW:Xe:m:p:", options,
 				  NULL)) != -1) {
 		switch (opt) {
 		case 'D':
@@ -1864,12 +1859,21 @@ int main(int argc, char *argv[])
 		case 'I':
 			tdb_flags = TDB_INTERNAL|TDB_NOLOCK;
 			break;
+		case 'M':
+			memory_db = true;
+			break;
+		case 'J':
+			journal_file = optarg;
+			break;
 		case 'V':
 			verbose = true;
 			break;
 		case 'W':
 			quota_nb_watch_per_domain = strtol(optarg, NULL, 10);
 			break;
+		case 'X':
+			v4v = true;
+			break;
 		case 'e':
 			dom0_event = strtol(optarg, NULL, 10);
 			break;
@@ -1883,6 +1887,8 @@ int main(int argc, char *argv[])
 	}
 	if (optind != argc)
 		barf("%s: No arguments desired", argv[0]);
+	if (journal_file && !memory_db)
+		barf("%s: --journal needs --memory-db", argv[0]);
 
 	reopen_log();
 
@@ -1912,8 +1918,11 @@ int main(int argc, char *argv[])
 	setup_structure();
 
 	/* Listen to hypervisor. */
-	if (!no_domain_init)
+	if (!no_domain_init) {
 		domain_init();
+		if (v4v)
+			domain_v4v_init();
+	}
 
 	/* Restore existing connections. */
 	restore_existing_connections();
@@ -1992,6 +2001,16 @@ int main(int argc, char *argv[])
 			}
 		}
 
+		if (v4v_pollfd_idx != -1) {
+			if (fds[v4v_pollfd_idx].revents & ~POLLIN) {
+				barf_perror("v4v poll failed");
+				break;
+			} else if (fds[v4v_pollfd_idx].revents & POLLIN) {
+				domain_v4v_handle();
+				v4v_pollfd_idx = -1;
+			}
+		}
+
 		next = list_entry(connections.next, typeof(*conn), list);
 		if (&next->list != &connections)
 			talloc_increase_ref_count(next);
@@ -2044,6 +2063,11 @@ int main(int argc, char *argv[])
 			}
 		}
 
+		/* Send the v4v replies and journal the changes of this round
+		   in one go. */
+		domain_v4v_flush();
+		store_sync();
+
 		initialize_fds(*sock, &sock_pollfd_idx, *ro_sock,
 			       &ro_sock_pollfd_idx, &timeout);
 	}
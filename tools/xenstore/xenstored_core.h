@@ -27,6 +27,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <errno.h>
+#include <syslog.h>
 #include "xenstore_lib.h"
 #include "list.h"
 #include "tdb.h"
@@ -101,8 +102,8 @@ extern struct list_head connections;
 struct node {
 	const char *name;
 
-	/* Database I came from */
-	TDB_CONTEXT *tdb;
+	/* Transaction I came from, NULL for the store itself */
+	struct transaction *trans;
 
 	/* Parent (optional) */
 	struct node *parent;
@@ -147,18 +148,18 @@ struct node *get_node(struct connection *conn,
 		      const char *name,
 		      enum xs_perm_type perm);
 
-/* Get TDB context for this connection */
-TDB_CONTEXT *tdb_context(struct connection *conn);
+/* Something is horribly wrong: check the store. */
+void corrupt(struct connection *conn, const char *fmt, ...);
 
 /* Destructor for tdbs: required for transaction code */
 int destroy_tdb(void *_tdb);
 
-/* Replace the tdb: required for transaction code */
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb);
-
 struct connection *new_connection(connwritefn_t *write, connreadfn_t *read);
 
 
+/* Write a node on behalf of the daemon: true if that worked. */
+bool internal_write(const char *name, const char *value);
+
 /* Is this a valid node name? */
 bool is_valid_nodename(const char *node);
 
@@ -167,6 +168,16 @@ void trace_create(const void *data, const char *type);
 void trace_destroy(const void *data, const char *type);
 void trace_watch_timeout(const struct connection *conn, const char *node, const char *token);
 void trace(const char *fmt, ...);
+
+/* Log to the trace file and syslog. */
+#define log(...)							\
+	do {								\
+		char *s = talloc_asprintf(NULL, __VA_ARGS__);		\
+		trace("%s\n", s);					\
+		syslog(LOG_ERR, "%s",  s);				\
+		talloc_free(s);						\
+	} while (0)
+
 void dtrace_io(const struct connection *conn, const struct buffered_data *data, int out);
 
 extern int event_fd;
@@ -32,6 +32,9 @@
 
 #include <xenctrl.h>
 #include <xen/grant_table.h>
+#ifdef XENSTORED_V4V
+#include <libxenv4v.h>
+#endif
 
 static xc_interface **xc_handle;
 xc_gnttab **xcg_handle;
@@ -74,10 +77,20 @@ struct domain
 
 	/* number of watch for this domain */
 	int nbwatch;
+
+	/* Its v4v connection, if it has set one up. */
+	struct domain_v4v *v4v;
 };
 
 static LIST_HEAD(domains);
 
+static bool is_v4v_conn(struct connection *conn);
+static bool domain_v4v_can_read(struct connection *conn);
+static bool domain_v4v_can_write(struct connection *conn);
+static void domain_v4v_advertise(struct domain *domain);
+static void domain_v4v_reset(struct domain *domain);
+static void domain_v4v_set_target(struct domain *domain);
+
 static bool check_indexes(XENSTORE_RING_IDX cons, XENSTORE_RING_IDX prod)
 {
 	return ((prod - cons) <= XENSTORE_RING_SIZE);
@@ -253,6 +266,9 @@ void handle_event(void)
 bool domain_can_read(struct connection *conn)
 {
 	struct xenstore_domain_interface *intf = conn->domain->interface;
+
+	if (is_v4v_conn(conn))
+		return domain_v4v_can_read(conn);
 	return (intf->req_cons != intf->req_prod);
 }
 
@@ -264,6 +280,9 @@ bool domain_is_unprivileged(struct connection *conn)
 bool domain_can_write(struct connection *conn)
 {
 	struct xenstore_domain_interface *intf = conn->domain->interface;
+
+	if (is_v4v_conn(conn))
+		return domain_v4v_can_write(conn);
 	return ((intf->rsp_prod - intf->rsp_cons) != XENSTORE_RING_SIZE);
 }
 
@@ -300,6 +319,7 @@ static struct domain *new_domain(void *context, unsigned int domid,
 	domain->remote_port = port;
 	domain->nbentry = 0;
 	domain->nbwatch = 0;
+	domain->v4v = NULL;
 
 	return domain;
 }
@@ -335,6 +355,8 @@ static void domain_conn_reset(struct domain *domain)
 
 	domain->interface->req_cons = domain->interface->req_prod = 0;
 	domain->interface->rsp_cons = domain->interface->rsp_prod = 0;
+
+	domain_v4v_reset(domain);
 }
 
 /* domid, mfn, evtchn, path */
@@ -403,6 +425,7 @@ void do_introduce(struct connection *conn, struct buffered_data *in)
 	}
 
 	domain_conn_reset(domain);
+	domain_v4v_advertise(domain);
 
 	send_ack(conn, XS_INTRODUCE);
 }
@@ -448,6 +471,7 @@ void do_set_target(struct connection *conn, struct buffered_data *in)
 
         talloc_reference(domain->conn, tdomain->conn);
         domain->conn->target = tdomain->conn;
+	domain_v4v_set_target(domain);
 
 	send_ack(conn, XS_SET_TARGET);
 }
@@ -657,6 +681,355 @@ void domain_init(void)
 	virq_port = rc;
 }
 
+#ifdef XENSTORED_V4V
+/*
+ * xenstore over v4v.  A domain sends its requests as datagrams of one or
+ * more whole messages to a single ring of ours, large and shared by all
+ * domains, and gets the replies in a stream ring of its own on the same
+ * port, with us as its partner.  Our ring is advertised to a domain in
+ * <domain path>/v4v-xenstore, as "<our domid>:<port>", when it is
+ * introduced.  A domain which uses it gets a second connection, with its
+ * own watches and transactions, next to that of its page, which keeps
+ * working as before.
+ *
+ * The replies written to the v4v connections during a round of the main
+ * loop go out in one V4VOP_sendv_batch at its end, which signals each
+ * domain once, where the page takes an event per chunk written.
+ */
+#define V4V_XS_PORT		0x7873
+#define V4V_XS_RING_LEN		(1024 * 1024)
+/* Replies written but not sent yet, at most, per domain. */
+#define V4V_XS_OUT_LEN		(8 * 4096)
+/* Requests received but not read yet, at most, per domain. */
+#define V4V_XS_IN_MAX		(64 * 1024)
+
+struct domain_v4v
+{
+	struct domain *domain;
+	struct connection *conn;
+
+	/* Requests received, from in_cons on. */
+	char *in;
+	unsigned int in_len, in_cons;
+
+	/* Replies written, in locked memory for xen to read. */
+	char *out;
+	unsigned int out_len;
+};
+
+static struct libxenv4v *xs_v4v;
+
+static bool is_v4v_conn(struct connection *conn)
+{
+	return conn->domain->v4v && conn->domain->v4v->conn == conn;
+}
+
+static bool domain_v4v_can_read(struct connection *conn)
+{
+	struct domain_v4v *v4v = conn->domain->v4v;
+
+	return v4v->in_cons != v4v->in_len;
+}
+
+static bool domain_v4v_can_write(struct connection *conn)
+{
+	return conn->domain->v4v->out_len != V4V_XS_OUT_LEN;
+}
+
+static int writechn_v4v(struct connection *conn,
+			const void *data, unsigned int len)
+{
+	struct domain_v4v *v4v = conn->domain->v4v;
+
+	if (len > V4V_XS_OUT_LEN - v4v->out_len)
+		len = V4V_XS_OUT_LEN - v4v->out_len;
+	memcpy(v4v->out + v4v->out_len, data, len);
+	v4v->out_len += len;
+
+	return len;
+}
+
+static int readchn_v4v(struct connection *conn, void *data, unsigned int len)
+{
+	struct domain_v4v *v4v = conn->domain->v4v;
+
+	if (len > v4v->in_len - v4v->in_cons)
+		len = v4v->in_len - v4v->in_cons;
+	memcpy(data, v4v->in + v4v->in_cons, len);
+	v4v->in_cons += len;
+	if (v4v->in_cons == v4v->in_len)
+		v4v->in_cons = v4v->in_len = 0;
+
+	return len;
+}
+
+static int destroy_domain_v4v(void *_v4v)
+{
+	struct domain_v4v *v4v = _v4v;
+
+	libxenv4v_buffer_free(v4v->out, V4V_XS_OUT_LEN);
+	v4v->domain->v4v = NULL;
+	return 0;
+}
+
+static struct domain_v4v *new_domain_v4v(struct domain *domain)
+{
+	struct connection *conn;
+	struct domain_v4v *v4v;
+
+	conn = new_connection(writechn_v4v, readchn_v4v);
+	if (!conn)
+		return NULL;
+	conn->domain = domain;
+	conn->id = domain->domid;
+	/* It goes with the domain, or on its own if it misbehaves. */
+	talloc_steal(domain, conn);
+
+	v4v = talloc_zero(conn, struct domain_v4v);
+	if (!v4v)
+		goto fail;
+	v4v->out = libxenv4v_buffer_alloc(V4V_XS_OUT_LEN);
+	if (!v4v->out)
+		goto fail;
+	v4v->domain = domain;
+	v4v->conn = conn;
+	talloc_set_destructor(v4v, destroy_domain_v4v);
+	domain->v4v = v4v;
+
+	domain_v4v_set_target(domain);
+
+	return v4v;
+
+fail:
+	talloc_free(conn);
+	return NULL;
+}
+
+/* The target of the page connection is that of the v4v one too. */
+static void domain_v4v_set_target(struct domain *domain)
+{
+	struct connection *conn;
+
+	if (!domain->v4v || !domain->conn || !domain->conn->target)
+		return;
+	conn = domain->v4v->conn;
+	if (conn->target == domain->conn->target)
+		return;
+	if (conn->target)
+		talloc_unlink(conn, conn->target);
+	talloc_reference(conn, domain->conn->target);
+	conn->target = domain->conn->target;
+}
+
+static void domain_v4v_advertise(struct domain *domain)
+{
+	char *path, *value;
+
+	if (!xs_v4v)
+		return;
+
+	path = talloc_asprintf(NULL, "%s/v4v-xenstore", domain->path);
+	value = talloc_asprintf(path, "%u:%u", xs_v4v->id.addr.domain,
+				V4V_XS_PORT);
+	if (!internal_write(path, value))
+		eprintf("> Advertising v4v to domain %u failed\n",
+			domain->domid);
+	talloc_free(path);
+}
+
+/* A domain introduced again starts afresh, over its page. */
+static void domain_v4v_reset(struct domain *domain)
+{
+	if (domain->v4v)
+		talloc_free(domain->v4v->conn);
+}
+
+/* Queue the data of a request datagram for the connection of its domain. */
+static void domain_v4v_receive(struct libxenv4v_msg *msg)
+{
+	struct domain *domain;
+	struct domain_v4v *v4v;
+	char *in;
+
+	if (msg->source.port != V4V_XS_PORT ||
+	    msg->message_type != V4V_MESSAGE_DGRAM || !msg->len)
+		return;
+	domain = find_domain_by_domid(msg->source.domain);
+	if (!domain)
+		return;
+
+	v4v = domain->v4v ? domain->v4v : new_domain_v4v(domain);
+	if (!v4v)
+		return;
+
+	if (v4v->in_cons) {
+		memmove(v4v->in, v4v->in + v4v->in_cons,
+			v4v->in_len - v4v->in_cons);
+		v4v->in_len -= v4v->in_cons;
+		v4v->in_cons = 0;
+	}
+	if (v4v->in_len + msg->len > V4V_XS_IN_MAX) {
+		/* It doesn't wait for replies: drop it, as handle_input
+		   drops a connection out of step. */
+		eprintf("> Domain %u floods its v4v connection\n",
+			domain->domid);
+		talloc_free(v4v->conn);
+		return;
+	}
+
+	in = talloc_realloc(v4v, v4v->in, char, v4v->in_len + msg->len);
+	if (!in)
+		return;
+	memcpy(in + v4v->in_len, msg->seg[0], msg->seg_len[0]);
+	if (msg->seg_len[1])
+		memcpy(in + v4v->in_len + msg->seg_len[0], msg->seg[1],
+		       msg->seg_len[1]);
+	v4v->in = in;
+	v4v->in_len += msg->len;
+}
+
+void domain_v4v_handle(void)
+{
+	struct libxenv4v_msg msg;
+	int ret;
+
+	if (libxenv4v_wait(xs_v4v) == -1)
+		barf_perror("Failed to read from v4v event fd");
+
+	while ((ret = libxenv4v_peek(xs_v4v, &msg)) == 1) {
+		domain_v4v_receive(&msg);
+		libxenv4v_consume(xs_v4v);
+	}
+	if (ret == -1)
+		barf_perror("v4v ring corrupted");
+}
+
+static void domain_v4v_send(struct domain_v4v **v4v,
+			    v4v_send_batch_ent_t *ent, v4v_iov_t *iov,
+			    unsigned int n)
+{
+	unsigned int i;
+	int sent;
+
+	if (libxenv4v_send_batch(xs_v4v, ent, n, iov, n) == -1) {
+		/* Try again next round. */
+		eprintf("> Sending v4v replies failed (%s)\n",
+			strerror(errno));
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		sent = (int)ent[i].status;
+		/* With no room xen signals us once there is. */
+		if (sent == -EAGAIN)
+			continue;
+		if (sent < 0) {
+			eprintf("> Domain %u: v4v send failed (%d)\n",
+				v4v[i]->domain->domid, sent);
+			talloc_free(v4v[i]->conn);
+			continue;
+		}
+		memmove(v4v[i]->out, v4v[i]->out + sent,
+			v4v[i]->out_len - sent);
+		v4v[i]->out_len -= sent;
+	}
+}
+
+void domain_v4v_flush(void)
+{
+	struct domain_v4v *v4v[V4V_SENDV_BATCH_MAX];
+	v4v_send_batch_ent_t ent[V4V_SENDV_BATCH_MAX];
+	v4v_iov_t iov[V4V_SENDV_BATCH_MAX];
+	struct domain *domain;
+	unsigned int n = 0;
+
+	if (!xs_v4v)
+		return;
+
+	list_for_each_entry(domain, &domains, list) {
+		if (!domain->v4v || !domain->v4v->out_len)
+			continue;
+
+		memset(&ent[n], 0, sizeof(ent[n]));
+		ent[n].addr.src.port = V4V_PORT_ANY;
+		ent[n].addr.dst.port = V4V_XS_PORT;
+		ent[n].addr.dst.domain = domain->domid;
+		ent[n].message_type = V4V_MESSAGE_STREAM;
+		ent[n].iov_start = n;
+		ent[n].niov = 1;
+		iov[n].iov_base = (unsigned long)domain->v4v->out;
+		iov[n].iov_len = domain->v4v->out_len;
+		iov[n].pad = 0;
+		v4v[n] = domain->v4v;
+		if (++n == V4V_SENDV_BATCH_MAX) {
+			domain_v4v_send(v4v, ent, iov, n);
+			n = 0;
+		}
+	}
+	if (n)
+		domain_v4v_send(v4v, ent, iov, n);
+}
+
+void domain_v4v_init(void)
+{
+	xs_v4v = libxenv4v_open(NULL, V4V_XS_PORT, V4V_DOMID_ANY,
+				V4V_XS_RING_LEN, 0);
+	if (!xs_v4v)
+		xprintf("WARNING: no v4v (%s), domains use their page only\n",
+			strerror(errno));
+}
+
+int domain_v4v_fd(void)
+{
+	return xs_v4v ? libxenv4v_fd_for_select(xs_v4v) : -1;
+}
+#else
+static bool is_v4v_conn(struct connection *conn)
+{
+	return false;
+}
+
+static bool domain_v4v_can_read(struct connection *conn)
+{
+	return false;
+}
+
+static bool domain_v4v_can_write(struct connection *conn)
+{
+	return false;
+}
+
+static void domain_v4v_advertise(struct domain *domain)
+{
+}
+
+static void domain_v4v_reset(struct domain *domain)
+{
+}
+
+static void domain_v4v_set_target(struct domain *domain)
+{
+}
+
+void domain_v4v_init(void)
+{
+	xprintf("WARNING: xenstored built without v4v\n");
+}
+
+int domain_v4v_fd(void)
+{
+	return -1;
+}
+
+void domain_v4v_handle(void)
+{
+}
+
+void domain_v4v_flush(void)
+{
+}
+#endif
+
 void domain_entry_inc(struct connection *conn, struct node *node)
 {
 	struct domain *d;
@@ -45,6 +45,13 @@ void do_reset_watches(struct connection *conn);
 
 void domain_init(void);
 
+/* xenstore over v4v, for the domains which ask for it, see
+   xenstored_domain.c.  domain_v4v_fd() is -1 if there is none. */
+void domain_v4v_init(void);
+int domain_v4v_fd(void);
+void domain_v4v_handle(void);
+void domain_v4v_flush(void);
+
 /* Returns the implicit path of a connection (only domains have this) */
 const char *get_implicit_path(const struct connection *conn);
 
@@ -0,0 +1,459 @@
+/*
+    The store of the Xen Store Daemon: node records, by name.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "talloc.h"
+#include "utils.h"
+#include "xenstore_lib.h"
+#include "xenstored_core.h"
+#include "xenstored_store.h"
+
+/* The store is either a tdb... */
+static TDB_CONTEXT *tdb_ctx = NULL;
+
+/*
+ * ... or a hash table in memory, of the records as they would be in the
+ * tdb, so that nodes are read and written the same way for both.  This
+ * saves the hashing, locking and free list of tdb on every access, which
+ * is most of the work of xenstored when domains are started in parallel.
+ */
+struct store_entry {
+	struct store_entry *next;
+	unsigned int hash;
+	TDB_DATA key;
+	TDB_DATA data;
+};
+
+static bool in_memory;
+static void *store_ctx;
+static struct store_entry **table;
+static unsigned int table_size, table_count;
+
+/*
+ * The changes to the memory store can be kept in a journal: a record per
+ * write or delete, appended in batches by store_sync(), and replayed when
+ * the store is opened.  Once the file is JOURNAL_SLACK times the size of
+ * the records it holds, it is rewritten with just those.
+ */
+struct journal_record {
+	uint32_t keylen;
+	uint32_t datalen;
+};
+#define JOURNAL_DELETE	0xffffffffU
+#define JOURNAL_SLACK	4
+#define JOURNAL_MIN_COMPACT (1024 * 1024)
+
+static int journal_fd = -1;
+static char *journal_name;
+static char *journal_buf;
+static size_t journal_len, journal_max;
+/* The size of the file, and of the records in the store */
+static size_t journal_size, live_size;
+
+static size_t record_size(TDB_DATA key, TDB_DATA data)
+{
+	return sizeof(struct journal_record) + key.dsize + data.dsize;
+}
+
+static unsigned int hash_key(TDB_DATA key)
+{
+	unsigned int hash = 5381;
+	size_t i;
+
+	for (i = 0; i < key.dsize; i++)
+		hash = ((hash << 5) + hash) + (unsigned char)key.dptr[i];
+	return hash;
+}
+
+/* The link to the entry of key, or to where it would go. */
+static struct store_entry **find_entry(TDB_DATA key, unsigned int hash)
+{
+	struct store_entry **e;
+
+	for (e = &table[hash % table_size]; *e; e = &(*e)->next)
+		if ((*e)->hash == hash && (*e)->key.dsize == key.dsize &&
+		    !memcmp((*e)->key.dptr, key.dptr, key.dsize))
+			break;
+	return e;
+}
+
+static void grow_table(void)
+{
+	unsigned int i, size = table_size * 2;
+	struct store_entry **t, *e, *next;
+
+	t = talloc_zero_array(store_ctx, struct store_entry *, size);
+	if (!t)
+		return;
+
+	for (i = 0; i < table_size; i++)
+		for (e = table[i]; e; e = next) {
+			next = e->next;
+			e->next = t[e->hash % size];
+			t[e->hash % size] = e;
+		}
+
+	talloc_free(table);
+	table = t;
+	table_size = size;
+}
+
+static int journal_append(TDB_DATA key, TDB_DATA data, bool delete)
+{
+	struct journal_record rec = {
+		.keylen = key.dsize,
+		.datalen = delete ? JOURNAL_DELETE : data.dsize,
+	};
+	size_t len = record_size(key, delete ? tdb_null : data);
+	char *p;
+
+	if (journal_fd < 0)
+		return 0;
+
+	if (journal_len + len > journal_max) {
+		size_t max = (journal_len + len) * 2;
+
+		p = talloc_realloc_size(store_ctx, journal_buf, max);
+		if (!p) {
+			errno = ENOMEM;
+			return -1;
+		}
+		journal_buf = p;
+		journal_max = max;
+	}
+
+	p = journal_buf + journal_len;
+	memcpy(p, &rec, sizeof(rec));
+	memcpy(p + sizeof(rec), key.dptr, key.dsize);
+	if (!delete)
+		memcpy(p + sizeof(rec) + key.dsize, data.dptr, data.dsize);
+	journal_len += len;
+
+	return 0;
+}
+
+static int mem_write(TDB_DATA key, TDB_DATA data)
+{
+	unsigned int hash = hash_key(key);
+	struct store_entry **link = find_entry(key, hash), *e = *link;
+	void *p;
+
+	if (e) {
+		p = talloc_memdup(e, data.dptr, data.dsize);
+		if (!p)
+			goto nomem;
+		live_size -= record_size(e->key, e->data);
+		talloc_free(e->data.dptr);
+	} else {
+		e = talloc(store_ctx, struct store_entry);
+		if (!e)
+			goto nomem;
+		e->key.dptr = talloc_memdup(e, key.dptr, key.dsize);
+		p = talloc_memdup(e, data.dptr, data.dsize);
+		if (!e->key.dptr || !p) {
+			talloc_free(e);
+			goto nomem;
+		}
+		e->key.dsize = key.dsize;
+		e->hash = hash;
+		e->next = NULL;
+		*link = e;
+		if (++table_count > table_size * 2)
+			grow_table();
+	}
+	e->data.dptr = p;
+	e->data.dsize = data.dsize;
+	live_size += record_size(e->key, e->data);
+
+	return 0;
+ nomem:
+	errno = ENOMEM;
+	return -1;
+}
+
+static int mem_delete(TDB_DATA key)
+{
+	struct store_entry **link = find_entry(key, hash_key(key)), *e = *link;
+
+	if (!e) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	*link = e->next;
+	table_count--;
+	live_size -= record_size(e->key, e->data);
+	talloc_free(e);
+
+	return 0;
+}
+
+TDB_DATA store_fetch(TDB_DATA key)
+{
+	struct store_entry *e;
+	TDB_DATA data;
+
+	if (in_memory) {
+		e = *find_entry(key, hash_key(key));
+		if (!e) {
+			errno = ENOENT;
+			return tdb_null;
+		}
+		/* The caller owns it, and may talloc_steal() it */
+		data.dptr = talloc_memdup(NULL, e->data.dptr, e->data.dsize);
+		data.dsize = e->data.dsize;
+		if (!data.dptr)
+			errno = ENOMEM;
+		return data;
+	}
+
+	data = tdb_fetch(tdb_ctx, key);
+	if (data.dptr == NULL) {
+		if (tdb_error(tdb_ctx) == TDB_ERR_NOEXIST)
+			errno = ENOENT;
+		else {
+			log("TDB error on read: %s", tdb_errorstr(tdb_ctx));
+			errno = EIO;
+		}
+	}
+	return data;
+}
+
+int store_write(TDB_DATA key, TDB_DATA data)
+{
+	if (!in_memory)
+		return tdb_store(tdb_ctx, key, data, TDB_REPLACE);
+
+	if (mem_write(key, data) != 0)
+		return -1;
+	return journal_append(key, data, false);
+}
+
+int store_delete(TDB_DATA key)
+{
+	if (!in_memory) {
+		if (tdb_delete(tdb_ctx, key) == 0)
+			return 0;
+		errno = tdb_error(tdb_ctx) == TDB_ERR_NOEXIST ? ENOENT : EIO;
+		return -1;
+	}
+
+	if (mem_delete(key) != 0)
+		return -1;
+	return journal_append(key, tdb_null, true);
+}
+
+struct traverse_args {
+	store_traverse_fn *fn;
+	void *private;
+};
+
+static int traverse_tdb(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA data,
+			void *private)
+{
+	struct traverse_args *args = private;
+
+	return args->fn(key, data, args->private);
+}
+
+void store_traverse(store_traverse_fn *fn, void *private)
+{
+	struct traverse_args args = { fn, private };
+	struct store_entry *e, *next;
+	unsigned int i;
+
+	if (!in_memory) {
+		tdb_traverse(tdb_ctx, traverse_tdb, &args);
+		return;
+	}
+
+	for (i = 0; i < table_size; i++)
+		for (e = table[i]; e; e = next) {
+			next = e->next;
+			if (fn(e->key, e->data, private))
+				return;
+		}
+}
+
+/* Write the whole store to a new journal, in place of the old. */
+static void journal_compact(void)
+{
+	char *tmpname = talloc_asprintf(NULL, "%s.new", journal_name);
+	struct store_entry *e;
+	unsigned int i;
+	int fd;
+
+	fd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC, 0640);
+	if (fd < 0)
+		goto fail;
+
+	journal_len = 0;
+	for (i = 0; i < table_size; i++)
+		for (e = table[i]; e; e = e->next) {
+			if (journal_append(e->key, e->data, false) != 0)
+				goto fail;
+			if (journal_len >= JOURNAL_MIN_COMPACT) {
+				if (!xs_write_all(fd, journal_buf,
+						  journal_len))
+					goto fail;
+				journal_len = 0;
+			}
+		}
+	if (!xs_write_all(fd, journal_buf, journal_len) || fsync(fd) != 0 ||
+	    rename(tmpname, journal_name) != 0)
+		goto fail;
+
+	close(journal_fd);
+	journal_fd = fd;
+	journal_len = 0;
+	journal_size = live_size;
+	talloc_free(tmpname);
+	return;
+
+ fail:
+	/* Keep appending to the old one */
+	log("journal: compacting %s failed: %s", journal_name,
+	    strerror(errno));
+	if (fd >= 0) {
+		close(fd);
+		unlink(tmpname);
+	}
+	journal_len = 0;
+	talloc_free(tmpname);
+}
+
+void store_sync(void)
+{
+	if (journal_fd < 0 || journal_len == 0)
+		return;
+
+	if (!xs_write_all(journal_fd, journal_buf, journal_len) ||
+	    fdatasync(journal_fd) != 0)
+		barf_perror("Could not write journal %s", journal_name);
+	journal_size += journal_len;
+	journal_len = 0;
+
+	if (journal_size >= JOURNAL_MIN_COMPACT &&
+	    journal_size > live_size * JOURNAL_SLACK)
+		journal_compact();
+}
+
+/* Apply the journal to the (empty) memory store.  Returns false if none. */
+static bool journal_replay(void)
+{
+	struct journal_record rec;
+	TDB_DATA key, data;
+	struct stat st;
+	char *buf;
+	size_t off;
+	ssize_t len;
+	bool ok = true;
+
+	if (fstat(journal_fd, &st) != 0)
+		barf_perror("Could not stat journal %s", journal_name);
+	if (st.st_size == 0)
+		return false;
+
+	buf = talloc_size(NULL, st.st_size);
+	if (!buf)
+		barf("Could not allocate %lu bytes for journal %s",
+		     (unsigned long)st.st_size, journal_name);
+	for (off = 0; off < st.st_size; off += len) {
+		len = read(journal_fd, buf + off, st.st_size - off);
+		if (len <= 0 && !(len < 0 && errno == EINTR))
+			barf_perror("Could not read journal %s", journal_name);
+		if (len < 0)
+			len = 0;
+	}
+
+	for (off = 0; ok && off + sizeof(rec) <= st.st_size; ) {
+		memcpy(&rec, buf + off, sizeof(rec));
+		off += sizeof(rec);
+
+		key.dptr = buf + off;
+		key.dsize = rec.keylen;
+		data.dptr = key.dptr + key.dsize;
+		data.dsize = rec.datalen == JOURNAL_DELETE ? 0 : rec.datalen;
+		if (key.dsize + data.dsize > st.st_size - off) {
+			ok = false;
+			break;
+		}
+		off += key.dsize + data.dsize;
+
+		if (rec.datalen == JOURNAL_DELETE)
+			mem_delete(key);
+		else
+			ok = mem_write(key, data) == 0;
+	}
+
+	/* A batch cut short by a crash: the store is checked after this */
+	if (!ok || off != st.st_size)
+		log("journal: %s is truncated or corrupt at %lu bytes",
+		    journal_name, (unsigned long)off);
+
+	talloc_free(buf);
+	return true;
+}
+
+bool store_open(const char *tdbname, int tdb_flags, bool memory,
+		const char *journal)
+{
+	if (!memory) {
+		if (!(tdb_flags & TDB_INTERNAL))
+			tdb_ctx = tdb_open(tdbname, 0, tdb_flags, O_RDWR, 0);
+		if (tdb_ctx)
+			return true;
+
+		tdb_ctx = tdb_open(tdbname, 7919, tdb_flags, O_RDWR|O_CREAT,
+				   0640);
+		if (!tdb_ctx)
+			barf_perror("Could not create tdb file %s", tdbname);
+		return false;
+	}
+
+	in_memory = true;
+	store_ctx = talloc_named_const(talloc_autofree_context(), 0, "store");
+	table_size = 1024;
+	table = talloc_zero_array(store_ctx, struct store_entry *, table_size);
+	if (!table)
+		barf("Could not allocate the store");
+
+	if (!journal)
+		return false;
+
+	journal_name = talloc_strdup(store_ctx, journal);
+	journal_fd = open(journal, O_RDWR|O_CREAT|O_APPEND, 0640);
+	if (journal_fd < 0)
+		barf_perror("Could not open journal %s", journal);
+
+	if (!journal_replay())
+		return false;
+
+	/* Start again from just what was replayed */
+	journal_compact();
+	return true;
+}
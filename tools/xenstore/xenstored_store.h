@@ -0,0 +1,47 @@
+/*
+    The store of the Xen Store Daemon: node records, by name.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#ifndef _XENSTORED_STORE_H
+#define _XENSTORED_STORE_H
+
+#include <stdbool.h>
+#include "tdb.h"
+
+/*
+ * Open the store: the tdb file tdbname, opened with tdb_flags, or, if
+ * memory is set, a hash table in memory, kept in the journal file if that
+ * is not NULL.  Returns true if there is a store from before to check,
+ * false if it is new and empty.
+ */
+bool store_open(const char *tdbname, int tdb_flags, bool memory,
+		const char *journal);
+
+/* Read a record: if it fails, NULL dptr and errno set.  Talloc'd. */
+TDB_DATA store_fetch(TDB_DATA key);
+
+/* Write and delete records: if they fail, -1 and errno set. */
+int store_write(TDB_DATA key, TDB_DATA data);
+int store_delete(TDB_DATA key);
+
+/* Call fn for each record, which may delete it.  Stops if fn returns != 0. */
+typedef int store_traverse_fn(TDB_DATA key, TDB_DATA data, void *private);
+void store_traverse(store_traverse_fn *fn, void *private);
+
+/* Write the journal entries of the changes made since the last call. */
+void store_sync(void);
+
+#endif /* _XENSTORED_STORE_H */
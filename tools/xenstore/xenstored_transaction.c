@@ -26,6 +26,8 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include "talloc.h"
@@ -33,6 +35,7 @@
 #include "xenstored_transaction.h"
 #include "xenstored_watch.h"
 #include "xenstored_domain.h"
+#include "xenstored_store.h"
 #include "xenstore_lib.h"
 #include "utils.h"
 
@@ -71,9 +74,11 @@ struct transaction
 	/* Generation when transaction started. */
 	unsigned int generation;
 
-	/* TDB to work on, and filename */
+	/* The nodes written or deleted (TOMBSTONE) by the transaction. */
 	TDB_CONTEXT *tdb;
-	char *tdb_name;
+
+	/* The nodes it accessed, as they were in the store (or TOMBSTONE). */
+	TDB_CONTEXT *accessed;
 
 	/* List of changed nodes. */
 	struct list_head changes;
@@ -85,10 +90,125 @@ struct transaction
 extern int quota_max_transaction;
 static unsigned int generation;
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans)
+/*
+ * A transaction doesn't copy the store: what it writes goes to trans->tdb,
+ * a node it deletes gets a tombstone there, and the first time it touches
+ * a node, the node as it is in the store (or a tombstone, if there isn't
+ * one) is kept in trans->accessed.  It can commit if none of those nodes
+ * changed since, so its cost is in the nodes it touches.
+ *
+ * A node record can't be a single byte, see write_node.
+ */
+static char tombstone_byte;
+static const TDB_DATA tombstone = { (void *)&tombstone_byte, 1 };
+
+static bool is_tombstone(TDB_DATA data)
 {
-	return trans->tdb;
+	return data.dsize == tombstone.dsize &&
+	       !memcmp(data.dptr, tombstone.dptr, tombstone.dsize);
+}
+
+/* Keep the node as it is in the store, the first time trans touches it. */
+static int note_access(struct transaction *trans, TDB_DATA key)
+{
+	TDB_DATA data;
+	int ret;
+
+	if (tdb_exists(trans->accessed, key))
+		return 0;
+
+	data = store_fetch(key);
+	if (data.dptr == NULL && errno != ENOENT)
+		return -1;
+
+	ret = tdb_store(trans->accessed, key, data.dptr ? data : tombstone,
+			TDB_INSERT);
+	talloc_free(data.dptr);
+	if (ret != 0)
+		errno = ENOMEM;
+	return ret;
+}
+
+TDB_DATA transaction_fetch(struct transaction *trans, TDB_DATA key)
+{
+	TDB_DATA data;
+
+	if (!trans)
+		return store_fetch(key);
+
+	data = tdb_fetch(trans->tdb, key);
+	if (data.dptr) {
+		if (!is_tombstone(data))
+			return data;
+		talloc_free(data.dptr);
+		data.dptr = NULL;
+		errno = ENOENT;
+		return data;
+	}
+
+	data.dptr = NULL;
+	if (note_access(trans, key) != 0)
+		return data;
+	return store_fetch(key);
+}
+
+int transaction_store(struct transaction *trans, TDB_DATA key, TDB_DATA data)
+{
+	if (!trans)
+		return store_write(key, data);
+
+	if (note_access(trans, key) != 0)
+		return -1;
+	return tdb_store(trans->tdb, key, data, TDB_REPLACE);
+}
+
+int transaction_delete(struct transaction *trans, TDB_DATA key)
+{
+	if (!trans)
+		return store_delete(key);
+
+	if (note_access(trans, key) != 0)
+		return -1;
+	return tdb_store(trans->tdb, key, tombstone, TDB_REPLACE);
+}
+
+/* tdb_traverse callback: stops at a node that changed in the store. */
+static int check_unchanged(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA old,
+			   void *private)
+{
+	bool *conflict = private;
+	TDB_DATA data = store_fetch(key);
+	bool same;
+
+	if (data.dptr == NULL)
+		same = errno == ENOENT && is_tombstone(old);
+	else
+		same = data.dsize == old.dsize &&
+		       !memcmp(data.dptr, old.dptr, old.dsize);
+	talloc_free(data.dptr);
+
+	if (!same)
+		*conflict = true;
+	return *conflict;
+}
+
+/* tdb_traverse callback: writes the changes of the transaction. */
+static int apply_change(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA data,
+			void *private)
+{
+	int ret;
+
+	if (is_tombstone(data)) {
+		ret = store_delete(key);
+		if (ret != 0 && errno == ENOENT)
+			ret = 0;
+	} else
+		ret = store_write(key, data);
+
+	if (ret != 0)
+		corrupt(NULL, "Commit of %.*s failed", (int)key.dsize,
+			(char *)key.dptr);
+	return 0;
 }
 
 /* Callers get a change node (which can fail) and only commit after they've
@@ -120,7 +240,8 @@ static int destroy_transaction(void *_transaction)
 	trace_destroy(trans, "transaction");
 	if (trans->tdb)
 		tdb_close(trans->tdb);
-	unlink(trans->tdb_name);
+	if (trans->accessed)
+		tdb_close(trans->accessed);
 	return 0;
 }
 
@@ -159,15 +280,17 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 	INIT_LIST_HEAD(&trans->changes);
 	INIT_LIST_HEAD(&trans->changed_domains);
 	trans->generation = generation;
-	trans->tdb_name = talloc_asprintf(trans, "%s.%p",
-					  xs_daemon_tdb(), trans);
-	trans->tdb = tdb_copy(tdb_context(conn), trans->tdb_name);
-	if (!trans->tdb) {
-		send_error(conn, errno);
+	trans->tdb = tdb_open(talloc_strdup(trans, "transaction"), 0,
+			      TDB_INTERNAL|TDB_NOLOCK, O_RDWR|O_CREAT, 0);
+	trans->accessed = trans->tdb ?
+		tdb_open(talloc_strdup(trans, "accessed"), 0,
+			 TDB_INTERNAL|TDB_NOLOCK, O_RDWR|O_CREAT, 0) : NULL;
+	if (!trans->accessed) {
+		if (trans->tdb)
+			tdb_close(trans->tdb);
+		send_error(conn, ENOMEM);
 		return;
 	}
-	/* Make it close if we go away. */
-	talloc_steal(trans, trans->tdb);
 
 	/* Pick an unused transaction identifier. */
 	do {
@@ -190,6 +313,7 @@ void do_transaction_end(struct connection *conn, const char *arg)
 	struct changed_node *i;
 	struct changed_domain *d;
 	struct transaction *trans;
+	bool conflict = false;
 
 	if (!arg || (!streq(arg, "T") && !streq(arg, "F"))) {
 		send_error(conn, EINVAL);
@@ -209,17 +333,15 @@ void do_transaction_end(struct connection *conn, const char *arg)
 	talloc_steal(arg, trans);
 
 	if (streq(arg, "T")) {
-		/* FIXME: Merge, rather failing on any change. */
-		if (trans->generation != generation) {
+		/* Only the nodes the transaction touched have to be as they
+		 * were, if the store changed at all. */
+		if (trans->generation != generation &&
+		    (tdb_traverse(trans->accessed, check_unchanged,
+				  &conflict) < 0 || conflict)) {
 			send_error(conn, EAGAIN);
 			return;
 		}
-		if (!replace_tdb(trans->tdb_name, trans->tdb)) {
-			send_error(conn, errno);
-			return;
-		}
-		/* Don't close this: we won! */
-		trans->tdb = NULL;
+		tdb_traverse(trans->tdb, apply_change, NULL);
 
 		/* fix domain entry for each changed domain */
 		list_for_each_entry(d, &trans->changed_domains, list)
@@ -35,8 +35,14 @@ void transaction_entry_dec(struct transaction *trans, unsigned int domid);
 void add_change_node(struct transaction *trans, const char *node,
                      bool recurse);
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans);
+/*
+ * Read, write and delete node records, as seen by trans, or in the store
+ * itself if trans is NULL.  Fetch returns NULL dptr and sets errno if it
+ * fails.
+ */
+TDB_DATA transaction_fetch(struct transaction *trans, TDB_DATA key);
+int transaction_store(struct transaction *trans, TDB_DATA key, TDB_DATA data);
+int transaction_delete(struct transaction *trans, TDB_DATA key);
 
 void conn_delete_all_transactions(struct connection *conn);
 
@@ -26,6 +26,7 @@
 #include <assert.h>
 #include "talloc.h"
 #include "list.h"
+#include "hashtable.h"
 #include "xenstored_watch.h"
 #include "xenstore_lib.h"
 #include "utils.h"
@@ -46,8 +47,165 @@ struct watch
 
 	char *token;
 	char *node;
+
+	/* Watches on the same path, and where that is in the trie */
+	struct list_head trie_list;
+	struct watch_node *trie;
+	struct connection *conn;
+};
+
+/*
+ * The watches by the path they watch: a trie of path components, so that
+ * an event visits only the watches on its node and its ancestors (and, if
+ * it recurses, its descendants) instead of every watch of every
+ * connection.  Watches on "/" see all events, "@" ones included, which
+ * have a trie of their own so that they are not taken for a node "/@...".
+ */
+struct watch_node
+{
+	struct watch_node *parent;
+
+	/* Path component: the key this node has in its parent's index. */
+	char *name;
+
+	/* Child nodes, and the index of them by name. */
+	struct list_head children;
+	struct list_head sibling;
+	struct hashtable *index;
+
+	/* The watches on this path. */
+	struct list_head watches;
 };
 
+static struct watch_node *watch_root, *event_root;
+
+static unsigned int hash_name(void *k)
+{
+	char *str = k;
+	unsigned int hash = 5381;
+	char c;
+
+	while ((c = *str++))
+		hash = ((hash << 5) + hash) + (unsigned int)c;
+
+	return hash;
+}
+
+static int names_equal(void *key1, void *key2)
+{
+	return 0 == strcmp((char *)key1, (char *)key2);
+}
+
+static struct watch_node *new_watch_node(void *ctx, struct watch_node *parent)
+{
+	struct watch_node *node = talloc(ctx, struct watch_node);
+
+	if (!node)
+		return NULL;
+	node->parent = parent;
+	node->name = NULL;
+	node->index = NULL;
+	INIT_LIST_HEAD(&node->children);
+	INIT_LIST_HEAD(&node->sibling);
+	INIT_LIST_HEAD(&node->watches);
+	return node;
+}
+
+static struct watch_node *child_watch_node(struct watch_node *node,
+					   char *name)
+{
+	return node->index ? hashtable_search(node->index, name) : NULL;
+}
+
+/* The first component of the path: NULL for "/", nul terminated in place. */
+static char *first_component(char *path, char **next)
+{
+	char *slash;
+
+	if (*path == '/')
+		path++;
+	if (*path == '\0')
+		return NULL;
+
+	slash = strchr(path, '/');
+	if (slash) {
+		*slash = '\0';
+		*next = slash + 1;
+	} else
+		*next = path + strlen(path);
+	return path;
+}
+
+/* Drop the nodes that no longer lead to any watch, from node up. */
+static void put_watch_node(struct watch_node *node)
+{
+	struct watch_node *parent;
+
+	while (node->parent && list_empty(&node->watches) &&
+	       list_empty(&node->children)) {
+		parent = node->parent;
+		list_del(&node->sibling);
+		hashtable_remove(parent->index, node->name);
+		talloc_free(node);
+
+		if (list_empty(&parent->children)) {
+			hashtable_destroy(parent->index, 0);
+			parent->index = NULL;
+		}
+		node = parent;
+	}
+}
+
+/* Where the watches on path go, created if need be.  NULL if out of memory. */
+static struct watch_node *get_watch_node(const char *path)
+{
+	char *copy, *name, *next;
+	struct watch_node *node, *child;
+	char *key;
+
+	if (!watch_root) {
+		watch_root = new_watch_node(talloc_autofree_context(), NULL);
+		event_root = new_watch_node(talloc_autofree_context(), NULL);
+		if (!watch_root || !event_root)
+			return NULL;
+	}
+
+	copy = talloc_strdup(NULL, path);
+	if (!copy)
+		return NULL;
+	node = copy[0] == '@' ? event_root : watch_root;
+
+	for (name = first_component(copy, &next); name;
+	     name = first_component(next, &next)) {
+		child = child_watch_node(node, name);
+		if (child) {
+			node = child;
+			continue;
+		}
+
+		if (!node->index)
+			node->index = create_hashtable(16, hash_name,
+						       names_equal);
+		child = new_watch_node(node, node);
+		key = strdup(name);
+		if (!node->index || !child || !key ||
+		    !hashtable_insert(node->index, key, child)) {
+			free(key);
+			talloc_free(child);
+			put_watch_node(node);
+			node = NULL;
+			break;
+		}
+		child->name = key;
+		list_add_tail(&child->sibling, &node->children);
+		node = child;
+	}
+
+	talloc_free(copy);
+	return node;
+}
+
+
 static void add_event(struct connection *conn,
 		      struct watch *watch,
 		      const char *name)
@@ -86,28 +244,66 @@ static void add_event(struct connection *conn,
 	talloc_free(data);
 }
 
-void fire_watches(struct connection *conn, const char *name, bool recurse)
+static void fire_watch_node(struct watch_node *node, const char *name)
+{
+	struct watch *watch;
+
+	list_for_each_entry(watch, &node->watches, trie_list)
+		add_event(watch->conn, watch, name);
+}
+
+/* All the watches below node see their own path go. */
+static void fire_watch_children(struct watch_node *node)
 {
-	struct connection *i;
+	struct watch_node *child;
 	struct watch *watch;
 
+	list_for_each_entry(child, &node->children, sibling) {
+		list_for_each_entry(watch, &child->watches, trie_list)
+			add_event(watch->conn, watch, watch->node);
+		fire_watch_children(child);
+	}
+}
+
+void fire_watches(struct connection *conn, const char *name, bool recurse)
+{
+	struct watch_node *node;
+	char *copy, *comp, *next;
+
 	/* During transactions, don't fire watches. */
 	if (conn && conn->transaction)
 		return;
 
-	/* Create an event for each watch. */
-	list_for_each_entry(i, &connections, list) {
-		list_for_each_entry(watch, &i->watches, list) {
-			if (is_child(name, watch->node))
-				add_event(i, watch, name);
-			else if (recurse && is_child(watch->node, name))
-				add_event(i, watch, watch->node);
-		}
+	if (!watch_root)
+		return;
+
+	/* Create an event for each watch on name or above it. */
+	fire_watch_node(watch_root, name);
+
+	copy = talloc_strdup(NULL, name);
+	node = copy[0] == '@' ? event_root : watch_root;
+	for (comp = first_component(copy, &next); comp && node;
+	     comp = first_component(next, &next)) {
+		node = child_watch_node(node, comp);
+		if (node)
+			fire_watch_node(node, name);
+	}
+	talloc_free(copy);
+
+	/* And, if all of it goes, for each watch below it. */
+	if (recurse && node) {
+		fire_watch_children(node);
+		if (node == watch_root)
+			fire_watch_children(event_root);
 	}
 }
 
 static int destroy_watch(void *_watch)
 {
+	struct watch *watch = _watch;
+
+	list_del(&watch->trie_list);
+	put_watch_node(watch->trie);
 	trace_destroy(_watch, "watch");
 	return 0;
 }
@@ -154,6 +350,13 @@ void do_watch(struct connection *conn, struct buffered_data *in)
 	}
 
 	watch = talloc(conn, struct watch);
+	watch->trie = get_watch_node(vec[0]);
+	if (!watch->trie) {
+		talloc_free(watch);
+		send_error(conn, ENOMEM);
+		return;
+	}
+	watch->conn = conn;
 	watch->node = talloc_strdup(watch, vec[0]);
 	watch->token = talloc_strdup(watch, vec[1]);
 	if (relative)
@@ -165,6 +368,7 @@ void do_watch(struct connection *conn, struct buffered_data *in)
 
 	domain_watch_inc(conn);
 	list_add_tail(&watch->list, &conn->watches);
+	list_add_tail(&watch->trie_list, &watch->trie->watches);
 	trace_create(watch, "watch");
 	talloc_set_destructor(watch, destroy_watch);
 	send_ack(conn, XS_WATCH);
@@ -71,9 +71,9 @@ struct xs_handle {
 	bool unwatch_filter;
 
 	/*
-         * A list of replies. Currently only one will ever be outstanding
-         * because we serialise requests. The requester can wait on the
-         * conditional variable for its response.
+         * A list of replies. Requests are serialised, so they are all for
+         * the holder of the request lock: one, or those of a batch. The
+         * requester can wait on the conditional variable for them.
          */
 	struct list_head reply_list;
 	pthread_mutex_t reply_mutex;
@@ -421,7 +421,8 @@ static int get_error(const char *errorstring)
 
 /* Adds extra nul terminator, because we generally (always?) hold strings. */
 static void *read_reply(
-	struct xs_handle *h, enum xsd_sockmsg_type *type, unsigned int *len)
+	struct xs_handle *h, enum xsd_sockmsg_type *type, unsigned int *len,
+	uint32_t *req_id)
 {
 	struct xs_stored_msg *msg;
 	char *body;
@@ -445,12 +446,13 @@ static void *read_reply(
 	}
 	msg = list_top(&h->reply_list, struct xs_stored_msg, list);
 	list_del(&msg->list);
-	assert(list_empty(&h->reply_list));
 	mutex_unlock(&h->reply_mutex);
 
 	*type = msg->hdr.type;
 	if (len)
 		*len = msg->hdr.len;
+	if (req_id)
+		*req_id = msg->hdr.req_id;
 	body = msg->body;
 
 	free(msg);
@@ -497,7 +499,7 @@ static void *xs_talkv(struct xs_handle *h, xs_transaction_t t,
 		if (!xs_write_all(h->fd, iovec[i].iov_base, iovec[i].iov_len))
 			goto fail;
 
-	ret = read_reply(h, &msg.type, len);
+	ret = read_reply(h, &msg.type, len, NULL);
 	if (!ret)
 		goto fail;
 
@@ -1125,6 +1127,269 @@ char *xs_debug_command(struct xs_handle *h, const char *cmd,
 			ARRAY_SIZE(iov), NULL);
 }
 
+struct xs_batch_req {
+	enum xsd_sockmsg_type type;
+	void *reply;
+	unsigned int len;
+	int err;
+};
+
+struct xs_batch {
+	struct xs_handle *h;
+
+	/* The requests as they are sent, headers and payloads. */
+	char *buf;
+	unsigned int buf_len, buf_max;
+
+	struct xs_batch_req *reqs;
+	unsigned int nr, max;
+	bool sent;
+};
+
+struct xs_batch *xs_batch_start(struct xs_handle *h)
+{
+	struct xs_batch *b = calloc(1, sizeof(*b));
+
+	if (b)
+		b->h = h;
+	return b;
+}
+
+void xs_batch_free(struct xs_batch *b)
+{
+	unsigned int i;
+
+	if (!b)
+		return;
+	for (i = 0; i < b->nr; i++)
+		free(b->reqs[i].reply);
+	free(b->reqs);
+	free(b->buf);
+	free(b);
+}
+
+/* Queue a request: req_id is its index, plus one. */
+static int xs_batch_add(struct xs_batch *b, xs_transaction_t t,
+			enum xsd_sockmsg_type type,
+			const struct iovec *iovec, unsigned int num_vecs)
+{
+	struct xsd_sockmsg msg;
+	unsigned int i, size;
+	void *p;
+
+	if (b->sent) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	msg.tx_id = t;
+	msg.req_id = b->nr + 1;
+	msg.type = type;
+	msg.len = 0;
+	for (i = 0; i < num_vecs; i++)
+		msg.len += iovec[i].iov_len;
+
+	if (msg.len > XENSTORE_PAYLOAD_MAX) {
+		errno = E2BIG;
+		return -1;
+	}
+
+	size = b->buf_len + sizeof(msg) + msg.len;
+	if (size > b->buf_max) {
+		p = realloc(b->buf, size * 2);
+		if (!p)
+			return -1;
+		b->buf = p;
+		b->buf_max = size * 2;
+	}
+	if (b->nr == b->max) {
+		p = realloc(b->reqs, (b->max * 2 ?: 16) * sizeof(*b->reqs));
+		if (!p)
+			return -1;
+		b->reqs = p;
+		b->max = b->max * 2 ?: 16;
+	}
+
+	memcpy(b->buf + b->buf_len, &msg, sizeof(msg));
+	b->buf_len += sizeof(msg);
+	for (i = 0; i < num_vecs; i++) {
+		memcpy(b->buf + b->buf_len, iovec[i].iov_base,
+		       iovec[i].iov_len);
+		b->buf_len += iovec[i].iov_len;
+	}
+
+	b->reqs[b->nr].type = type;
+	b->reqs[b->nr].reply = NULL;
+	b->reqs[b->nr].len = 0;
+	b->reqs[b->nr].err = 0;
+	return b->nr++;
+}
+
+static int xs_batch_single(struct xs_batch *b, xs_transaction_t t,
+			   enum xsd_sockmsg_type type, const char *string)
+{
+	struct iovec iovec;
+
+	iovec.iov_base = (void *)string;
+	iovec.iov_len = strlen(string) + 1;
+	return xs_batch_add(b, t, type, &iovec, 1);
+}
+
+int xs_batch_read(struct xs_batch *b, xs_transaction_t t, const char *path)
+{
+	return xs_batch_single(b, t, XS_READ, path);
+}
+
+int xs_batch_write(struct xs_batch *b, xs_transaction_t t,
+		   const char *path, const void *data, unsigned int len)
+{
+	struct iovec iovec[2];
+
+	iovec[0].iov_base = (void *)path;
+	iovec[0].iov_len = strlen(path) + 1;
+	iovec[1].iov_base = (void *)data;
+	iovec[1].iov_len = len;
+
+	return xs_batch_add(b, t, XS_WRITE, iovec, ARRAY_SIZE(iovec));
+}
+
+int xs_batch_mkdir(struct xs_batch *b, xs_transaction_t t, const char *path)
+{
+	return xs_batch_single(b, t, XS_MKDIR, path);
+}
+
+int xs_batch_rm(struct xs_batch *b, xs_transaction_t t, const char *path)
+{
+	return xs_batch_single(b, t, XS_RM, path);
+}
+
+int xs_batch_set_permissions(struct xs_batch *b, xs_transaction_t t,
+			     const char *path, struct xs_permissions *perms,
+			     unsigned int num_perms)
+{
+	char buffer[num_perms][MAX_STRLEN(unsigned int)+1];
+	struct iovec iov[1+num_perms];
+	unsigned int i;
+
+	iov[0].iov_base = (void *)path;
+	iov[0].iov_len = strlen(path) + 1;
+
+	for (i = 0; i < num_perms; i++) {
+		if (!xs_perm_to_string(&perms[i], buffer[i], sizeof(buffer[i])))
+			return -1;
+		iov[i+1].iov_base = buffer[i];
+		iov[i+1].iov_len = strlen(buffer[i]) + 1;
+	}
+
+	return xs_batch_add(b, t, XS_SET_PERMS, iov, 1+num_perms);
+}
+
+bool xs_batch_send(struct xs_batch *b)
+{
+	struct xs_handle *h = b->h;
+	struct xs_batch_req *req;
+	enum xsd_sockmsg_type type;
+	struct sigaction ignorepipe, oldact;
+	uint32_t req_id;
+	unsigned int i, len;
+	void *reply;
+	int saved_errno;
+
+	if (b->sent) {
+		errno = EINVAL;
+		return false;
+	}
+	b->sent = true;
+	if (!b->nr)
+		return true;
+
+	ignorepipe.sa_handler = SIG_IGN;
+	sigemptyset(&ignorepipe.sa_mask);
+	ignorepipe.sa_flags = 0;
+	sigaction(SIGPIPE, &ignorepipe, &oldact);
+
+	mutex_lock(&h->request_mutex);
+
+	if (!xs_write_all(h->fd, b->buf, b->buf_len))
+		goto fail;
+
+	/* Replies may come in any order, req_id says whose they are. */
+	for (i = 0; i < b->nr; i++) {
+		reply = read_reply(h, &type, &len, &req_id);
+		if (!reply)
+			goto fail;
+
+		req = req_id - 1 < b->nr ? &b->reqs[req_id - 1] : NULL;
+		if (!req || req->reply || req->err ||
+		    (type != req->type && type != XS_ERROR)) {
+			free(reply);
+			errno = EBADF;
+			goto fail;
+		}
+
+		if (type == XS_ERROR) {
+			req->err = get_error(reply);
+			free(reply);
+		} else {
+			req->reply = reply;
+			req->len = len;
+		}
+	}
+
+	mutex_unlock(&h->request_mutex);
+	sigaction(SIGPIPE, &oldact, NULL);
+
+	free(b->buf);
+	b->buf = NULL;
+	b->buf_len = b->buf_max = 0;
+	return true;
+
+fail:
+	/* We're in a bad state, so close fd. */
+	saved_errno = errno;
+	for (i = 0; i < b->nr; i++)
+		if (!b->reqs[i].reply && !b->reqs[i].err)
+			b->reqs[i].err = saved_errno;
+	mutex_unlock(&h->request_mutex);
+	sigaction(SIGPIPE, &oldact, NULL);
+	close(h->fd);
+	h->fd = -1;
+	errno = saved_errno;
+	return false;
+}
+
+bool xs_batch_ok(struct xs_batch *b, int req)
+{
+	if (!b->sent || req < 0 || req >= b->nr) {
+		errno = EINVAL;
+		return false;
+	}
+	if (b->reqs[req].err) {
+		errno = b->reqs[req].err;
+		return false;
+	}
+	return true;
+}
+
+void *xs_batch_reply(struct xs_batch *b, int req, unsigned int *len)
+{
+	void *reply;
+
+	if (!xs_batch_ok(b, req))
+		return NULL;
+
+	reply = b->reqs[req].reply;
+	if (!reply) {
+		/* Taken already */
+		errno = EINVAL;
+		return NULL;
+	}
+	if (len)
+		*len = b->reqs[req].len;
+	b->reqs[req].reply = NULL;
+	return reply;
+}
+
 static int read_message(struct xs_handle *h, int nonblocking)
 {
 	/* IMPORTANT: It is forbidden to call this function without
@@ -1187,14 +1452,6 @@ static int read_message(struct xs_handle *h, int nonblocking)
 		cleanup_pop(1);
 	} else {
 		mutex_lock(&h->reply_mutex);
-
-		/* There should only ever be one response pending! */
-		if (!list_empty(&h->reply_list)) {
-			mutex_unlock(&h->reply_mutex);
-			saved_errno = EEXIST;
-			goto error_freebody;
-		}
-
 		list_add_tail(&msg->list, &h->reply_list);
 		condvar_signal(&h->reply_condvar);
 
@@ -0,0 +1,947 @@
+/******************************************************************************
+ * tools/xentrace/analyze.c
+ *
+ * Off-line analysis of xentrace output.  The windows the trace file is
+ * made of are indexed per CPU, then the per-CPU record streams are merged
+ * in TSC order with a heap, so that events on different CPUs (a wake up
+ * on one and the vcpu running on another) are seen the order they
+ * happened in.  Records can be printed according to a file of format
+ * rules, as xentrace_format does, and/or be summed up in reports.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <xen/xen.h>
+#include <xen/trace.h>
+
+/* The record xentrace writes in front of every window, see xentrace.c */
+#define CPU_CHANGE_HEADER                                           \
+    (TRC_TRACE_CPU_CHANGE | (2 << TRACE_EXTRA_SHIFT))
+
+/* Not in xen/trace.h, xentrace_format knows it by number */
+#define TRC_TRACE_IRQ (TRC_GEN + 4)
+
+#define RUNSTATE_running  0
+#define RUNSTATE_runnable 1
+
+#define REPORT_SCHED  (1u << 0)
+#define REPORT_VMEXIT (1u << 1)
+#define REPORT_V4V    (1u << 2)
+#define REPORT_GRANT  (1u << 3)
+#define REPORT_ALL    (REPORT_SCHED | REPORT_VMEXIT | REPORT_V4V | REPORT_GRANT)
+
+struct record {
+    unsigned int cpu;
+    uint32_t event;
+    int has_tsc;
+    uint64_t tsc;
+    unsigned int extra;
+    uint32_t d[TRACE_EXTRA_MAX];
+};
+
+struct window {
+    const unsigned char *start;
+    uint32_t size;
+};
+
+struct pcpu {
+    unsigned int cpu;
+    struct window *win;
+    unsigned int nr_win, max_win;
+    /* Cursor: the next record is at off in win[w] */
+    unsigned int w;
+    uint32_t off;
+    /* TSC of the next record, or of the last one that had one */
+    uint64_t tsc;
+    uint64_t last_tsc;
+    unsigned long nr_records;
+    /* The VM exit this CPU is handling, if any */
+    int in_exit;
+    uint32_t exit_reason;
+    uint64_t exit_tsc;
+};
+
+struct stat_entry {
+    uint64_t key;
+    int valid;
+    uint64_t count, total, max, errors;
+    /* sched: waiting since */
+    int pending;
+    uint64_t since;
+};
+
+struct stat_table {
+    struct stat_entry *e;
+    size_t size, used;
+};
+
+struct format_rule {
+    uint32_t event;
+    char *fmt;
+};
+
+static struct {
+    unsigned int reports;
+    unsigned long mhz;
+    const char *defs_file;
+    const char *trace_file;
+} opts;
+
+static struct pcpu *pcpus;
+static unsigned int nr_pcpus;
+
+static struct pcpu **heap;
+static unsigned int heap_len;
+
+static struct format_rule *rules;
+static unsigned int nr_rules;
+
+static struct stat_table sched_tab, vmexit_tab, v4v_tab, grant_tab;
+static unsigned long nr_records, lost_records;
+
+static struct {
+    uint64_t count, tot_cycles, max_cycles;
+} irq_measure[256];
+
+static void *xmalloc(size_t size)
+{
+    void *p = malloc(size);
+
+    if ( !p )
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static void *xrealloc(void *p, size_t size)
+{
+    p = realloc(p, size);
+    if ( !p )
+    {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/***** Tables of statistics, by a 64 bit key *****/
+
+static uint64_t stat_hash(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static struct stat_entry *stat_get(struct stat_table *t, uint64_t key)
+{
+    size_t i;
+
+    if ( (t->used + 1) * 2 > t->size )
+    {
+        struct stat_table n = { .size = t->size ? t->size * 2 : 64 };
+
+        n.e = calloc(n.size, sizeof(*n.e));
+        if ( !n.e )
+        {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        for ( i = 0; i < t->size; i++ )
+            if ( t->e[i].valid )
+                *stat_get(&n, t->e[i].key) = t->e[i];
+        free(t->e);
+        *t = n;
+    }
+
+    for ( i = stat_hash(key) & (t->size - 1); t->e[i].valid;
+          i = (i + 1) & (t->size - 1) )
+        if ( t->e[i].key == key )
+            return &t->e[i];
+
+    t->e[i].valid = 1;
+    t->e[i].key = key;
+    t->used++;
+    return &t->e[i];
+}
+
+static void stat_add(struct stat_entry *e, uint64_t val)
+{
+    e->count++;
+    e->total += val;
+    if ( val > e->max )
+        e->max = val;
+}
+
+static int stat_cmp(const void *a, const void *b)
+{
+    const struct stat_entry *x = *(struct stat_entry * const *)a;
+    const struct stat_entry *y = *(struct stat_entry * const *)b;
+
+    if ( x->count != y->count )
+        return x->count < y->count ? 1 : -1;
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+/* The entries that were counted, most often first; free() the result */
+static struct stat_entry **stat_sorted(struct stat_table *t, size_t *nr)
+{
+    struct stat_entry **v = xmalloc((t->used + 1) * sizeof(*v));
+    size_t i;
+
+    for ( i = *nr = 0; i < t->size; i++ )
+        if ( t->e[i].valid && t->e[i].count )
+            v[(*nr)++] = &t->e[i];
+    qsort(v, *nr, sizeof(*v), stat_cmp);
+    return v;
+}
+
+/* Cycles, or microseconds given the TSC frequency */
+static void print_time(uint64_t cycles)
+{
+    if ( opts.mhz )
+        printf(" %12.3f", (double)cycles / opts.mhz);
+    else
+        printf(" %12"PRIu64, cycles);
+}
+
+/***** Reading the trace *****/
+
+static const unsigned char *load_trace(int fd, size_t *len)
+{
+    struct stat st;
+    unsigned char *buf = NULL;
+    size_t size = 0, max = 0;
+    ssize_t n;
+
+    if ( fstat(fd, &st) == 0 && S_ISREG(st.st_mode) )
+    {
+        *len = st.st_size;
+        if ( !*len )
+            return NULL;
+        buf = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if ( buf == MAP_FAILED )
+        {
+            perror("mmap trace");
+            exit(EXIT_FAILURE);
+        }
+        madvise(buf, *len, MADV_SEQUENTIAL);
+        return buf;
+    }
+
+    /* A pipe */
+    for ( ; ; )
+    {
+        if ( size == max )
+        {
+            max = max ? max * 2 : (1 << 20);
+            buf = xrealloc(buf, max);
+        }
+        n = read(fd, buf + size, max - size);
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n < 0 )
+        {
+            perror("read trace");
+            exit(EXIT_FAILURE);
+        }
+        if ( n == 0 )
+            break;
+        size += n;
+    }
+
+    *len = size;
+    return buf;
+}
+
+static struct pcpu *get_pcpu(unsigned int cpu)
+{
+    if ( cpu >= nr_pcpus )
+    {
+        pcpus = xrealloc(pcpus, (cpu + 1) * sizeof(*pcpus));
+        memset(pcpus + nr_pcpus, 0, (cpu + 1 - nr_pcpus) * sizeof(*pcpus));
+        for ( ; nr_pcpus <= cpu; nr_pcpus++ )
+            pcpus[nr_pcpus].cpu = nr_pcpus;
+    }
+    return &pcpus[cpu];
+}
+
+/* Find the windows of each CPU in the trace */
+static void index_trace(const unsigned char *buf, size_t len)
+{
+    size_t pos = 0;
+    uint32_t w[3];
+    struct pcpu *pc;
+
+    while ( pos + sizeof(w) <= len )
+    {
+        memcpy(w, buf + pos, sizeof(w));
+        if ( w[0] != CPU_CHANGE_HEADER )
+        {
+            fprintf(stderr, "No cpu change record at offset %zu, "
+                    "not xentrace output?\n", pos);
+            exit(EXIT_FAILURE);
+        }
+        pos += sizeof(w);
+        if ( w[2] > len - pos )
+        {
+            fprintf(stderr, "Trace truncated in a window of cpu %u\n", w[1]);
+            w[2] = len - pos;
+        }
+
+        pc = get_pcpu(w[1]);
+        if ( pc->nr_win == pc->max_win )
+        {
+            pc->max_win = pc->max_win ? pc->max_win * 2 : 64;
+            pc->win = xrealloc(pc->win, pc->max_win * sizeof(*pc->win));
+        }
+        pc->win[pc->nr_win].start = buf + pos;
+        pc->win[pc->nr_win++].size = w[2];
+        pos += w[2];
+    }
+}
+
+/*
+ * Move the cursor of pc to a whole record, skipping to the next window at
+ * the end of one; returns NULL when there are none left.
+ */
+static const unsigned char *pcpu_peek(struct pcpu *pc, uint32_t *hdr,
+                                      uint32_t *rec_len)
+{
+    const unsigned char *p;
+
+    for ( ; pc->w < pc->nr_win; pc->w++, pc->off = 0 )
+    {
+        const struct window *win = &pc->win[pc->w];
+
+        if ( pc->off + sizeof(*hdr) > win->size )
+            continue;
+        p = win->start + pc->off;
+        memcpy(hdr, p, sizeof(*hdr));
+        *rec_len = sizeof(*hdr) + TRC_HD_EXTRA(*hdr) * sizeof(uint32_t) +
+                   (TRC_HD_INCLUDES_CYCLE_COUNT(*hdr) ? sizeof(uint64_t) : 0);
+        if ( pc->off + *rec_len > win->size )
+        {
+            fprintf(stderr, "Partial record at the end of a window "
+                    "of cpu %u\n", pc->cpu);
+            continue;
+        }
+        return p;
+    }
+
+    return NULL;
+}
+
+/* Set pc->tsc for its next record, returns 0 if it has none */
+static int pcpu_prime(struct pcpu *pc)
+{
+    const unsigned char *p;
+    uint32_t hdr, len, tsc[2];
+
+    p = pcpu_peek(pc, &hdr, &len);
+    if ( !p )
+        return 0;
+    if ( TRC_HD_INCLUDES_CYCLE_COUNT(hdr) )
+    {
+        memcpy(tsc, p + sizeof(hdr), sizeof(tsc));
+        pc->tsc = ((uint64_t)tsc[1] << 32) | tsc[0];
+    }
+    return 1;
+}
+
+static void pcpu_read(struct pcpu *pc, struct record *rec)
+{
+    const unsigned char *p;
+    uint32_t hdr, len;
+
+    p = pcpu_peek(pc, &hdr, &len);
+    pc->off += len;
+    p += sizeof(hdr);
+
+    rec->cpu = pc->cpu;
+    rec->event = TRC_HD_TO_EVENT(hdr);
+    rec->has_tsc = TRC_HD_INCLUDES_CYCLE_COUNT(hdr);
+    if ( rec->has_tsc )
+        p += sizeof(uint64_t);
+    rec->tsc = pc->tsc;
+    rec->extra = TRC_HD_EXTRA(hdr);
+    memset(rec->d, 0, sizeof(rec->d));
+    memcpy(rec->d, p, rec->extra * sizeof(uint32_t));
+    pc->nr_records++;
+}
+
+/***** The k-way merge *****/
+
+static int heap_less(const struct pcpu *a, const struct pcpu *b)
+{
+    if ( a->tsc != b->tsc )
+        return a->tsc < b->tsc;
+    return a->cpu < b->cpu;
+}
+
+static void heap_down(unsigned int i)
+{
+    struct pcpu *pc = heap[i];
+    unsigned int c;
+
+    while ( (c = 2 * i + 1) < heap_len )
+    {
+        if ( c + 1 < heap_len && heap_less(heap[c + 1], heap[c]) )
+            c++;
+        if ( !heap_less(heap[c], pc) )
+            break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = pc;
+}
+
+static void heap_init(void)
+{
+    unsigned int i;
+
+    heap = xmalloc((nr_pcpus + 1) * sizeof(*heap));
+    for ( i = 0; i < nr_pcpus; i++ )
+        if ( pcpu_prime(&pcpus[i]) )
+            heap[heap_len++] = &pcpus[i];
+    for ( i = heap_len / 2; i-- > 0; )
+        heap_down(i);
+}
+
+/* The next record in TSC order, returns 0 at the end of the trace */
+static int next_record(struct record *rec)
+{
+    if ( !heap_len )
+        return 0;
+
+    pcpu_read(heap[0], rec);
+    if ( !pcpu_prime(heap[0]) )
+        heap[0] = heap[--heap_len];
+    if ( heap_len )
+        heap_down(0);
+    return 1;
+}
+
+/***** Formatted output, as xentrace_format *****/
+
+static int rule_cmp(const void *a, const void *b)
+{
+    const struct format_rule *x = a, *y = b;
+
+    return x->event < y->event ? -1 : x->event > y->event;
+}
+
+static void read_defs(const char *file)
+{
+    FILE *f = fopen(file, "r");
+    char line[1024], *p, *end;
+    unsigned int max = 0;
+    unsigned long event;
+
+    if ( !f )
+    {
+        perror(file);
+        exit(EXIT_FAILURE);
+    }
+
+    while ( fgets(line, sizeof(line), f) )
+    {
+        if ( line[0] == '#' || line[0] == '\n' )
+            continue;
+
+        line[strcspn(line, "\n")] = '\0';
+        event = strtoul(line, &end, 0);
+        p = end + strspn(end, " \t");
+        if ( end == line || p == end || !*p )
+        {
+            fprintf(stderr, "Bad format file: %s\n", line);
+            exit(EXIT_FAILURE);
+        }
+
+        if ( nr_rules == max )
+        {
+            max = max ? max * 2 : 256;
+            rules = xrealloc(rules, max * sizeof(*rules));
+        }
+        rules[nr_rules].event = event;
+        rules[nr_rules++].fmt = strdup(p);
+    }
+    fclose(f);
+
+    qsort(rules, nr_rules, sizeof(*rules), rule_cmp);
+}
+
+static const struct format_rule *find_rule(uint32_t event)
+{
+    struct format_rule key = { .event = event };
+
+    return bsearch(&key, rules, nr_rules, sizeof(*rules), rule_cmp);
+}
+
+/* Python style: %(key)[flags][width][.precision]conversion */
+static void print_rule(const char *fmt, const struct record *rec,
+                       long long reltsc)
+{
+    char spec[32], key[16];
+    const char *p, *q;
+    long long val;
+    double dval;
+    int is_double;
+    size_t n;
+
+    for ( p = fmt; *p; p++ )
+    {
+        if ( *p != '%' )
+        {
+            putchar(*p);
+            continue;
+        }
+        if ( p[1] == '%' )
+        {
+            putchar('%');
+            p++;
+            continue;
+        }
+        if ( p[1] != '(' || !(q = strchr(p + 2, ')')) ||
+             (n = q - p - 2) >= sizeof(key) )
+            goto bad;
+
+        memcpy(key, p + 2, n);
+        key[n] = '\0';
+        is_double = 0;
+        if ( !strcmp(key, "cpu") )
+            val = rec->cpu;
+        else if ( !strcmp(key, "event") )
+            val = rec->event;
+        else if ( !strcmp(key, "reltsc") )
+            val = reltsc;
+        else if ( !strcmp(key, "tsc") )
+        {
+            val = rec->has_tsc ? rec->tsc : 0;
+            if ( opts.mhz )
+            {
+                dval = (double)val / (opts.mhz * 1000000.0);
+                is_double = 1;
+            }
+        }
+        else if ( key[0] >= '1' && key[0] <= '7' && !key[1] )
+            val = rec->d[key[0] - '1'];
+        else
+            goto bad;
+
+        spec[0] = '%';
+        n = strspn(q + 1, "-+ #0123456789.");
+        if ( n > sizeof(spec) - 5 || !q[1 + n] )
+            goto bad;
+        memcpy(spec + 1, q + 1, n);
+        p = q + 1 + n;
+
+        switch ( *p )
+        {
+        case 'd': case 'i': case 'u': case 's': case 'r':
+        case 'o': case 'x': case 'X':
+            strcpy(spec + 1 + n, "ll");
+            spec[3 + n] = strchr("disr", *p) ? 'd' : *p;
+            spec[4 + n] = '\0';
+            printf(spec, is_double ? (long long)dval : val);
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+            spec[1 + n] = *p;
+            spec[2 + n] = '\0';
+            printf(spec, is_double ? dval : (double)val);
+            break;
+        default:
+            goto bad;
+        }
+    }
+    putchar('\n');
+    return;
+
+ bad:
+    /* As xentrace_format does when a rule doesn't fit the record */
+    printf("%s\n", fmt);
+    printf("{cpu: %u, tsc: %"PRIu64", event: %#x, reltsc: %lld, "
+           "1: %u, 2: %u, 3: %u, 4: %u, 5: %u, 6: %u, 7: %u}\n",
+           rec->cpu, rec->has_tsc ? rec->tsc : 0, rec->event, reltsc,
+           rec->d[0], rec->d[1], rec->d[2], rec->d[3], rec->d[4],
+           rec->d[5], rec->d[6]);
+}
+
+static void format_record(struct record *rec)
+{
+    struct pcpu *pc = &pcpus[rec->cpu];
+    const struct format_rule *rule;
+    long long reltsc = 0;
+
+    if ( rec->event == TRC_TRACE_IRQ )
+    {
+        /* IN - d1:vector, d2:tsc_in, d3:tsc_out
+         * OUT - d1:vector, d2:count, d3:tot_cycles, d4:max_cycles */
+        uint32_t diff = rec->d[2] - rec->d[1];
+        unsigned int vec = rec->d[0] & 0xff;
+
+        irq_measure[vec].count++;
+        irq_measure[vec].tot_cycles += diff;
+        if ( irq_measure[vec].max_cycles < diff )
+            irq_measure[vec].max_cycles = diff;
+        rec->d[1] = irq_measure[vec].count;
+        rec->d[2] = irq_measure[vec].tot_cycles;
+        rec->d[3] = irq_measure[vec].max_cycles;
+    }
+
+    if ( rec->event == TRC_PV_HYPERCALL_V2 ||
+         rec->event == TRC_PV_HYPERCALL_SUBCALL )
+        /* Mask off the argument present bits. */
+        rec->d[0] &= ~TRC_PV_HYPERCALL_V2_ARG_MASK;
+
+    if ( rec->has_tsc )
+    {
+        if ( pc->last_tsc )
+            reltsc = rec->tsc - pc->last_tsc;
+        pc->last_tsc = rec->tsc;
+    }
+
+    rule = find_rule(rec->event);
+    if ( !rule )
+        rule = find_rule(0);
+    if ( rule )
+        print_rule(rule->fmt, rec, reltsc);
+}
+
+/***** Reports *****/
+
+static void account_record(const struct record *rec)
+{
+    struct pcpu *pc = &pcpus[rec->cpu];
+    struct stat_entry *e;
+    uint32_t event = rec->event;
+
+    if ( event == TRC_LOST_RECORDS )
+    {
+        lost_records += rec->d[0];
+        return;
+    }
+
+    if ( (opts.reports & REPORT_SCHED) &&
+         (event & ~0x330) == TRC_SCHED_RUNSTATE_CHANGE && rec->has_tsc )
+    {
+        /* old state in bits 8-9, new state in bits 4-5 */
+        unsigned int old = (event >> 8) & 3, new = (event >> 4) & 3;
+
+        e = stat_get(&sched_tab, rec->d[0]);
+        if ( new == RUNSTATE_runnable )
+        {
+            e->pending = 1;
+            e->since = rec->tsc;
+        }
+        else
+        {
+            if ( old == RUNSTATE_runnable && new == RUNSTATE_running &&
+                 e->pending )
+                stat_add(e, rec->tsc - e->since);
+            e->pending = 0;
+        }
+        return;
+    }
+
+    if ( opts.reports & REPORT_VMEXIT )
+    {
+        switch ( event & ~TRC_HVM_NESTEDFLAG )
+        {
+        case TRC_HVM_VMEXIT:
+        case TRC_HVM_VMEXIT64:
+            e = stat_get(&vmexit_tab, rec->d[0]);
+            e->count++;
+            pc->in_exit = rec->has_tsc;
+            pc->exit_reason = rec->d[0];
+            pc->exit_tsc = rec->tsc;
+            return;
+        case TRC_HVM_VMENTRY:
+            if ( pc->in_exit && rec->has_tsc )
+            {
+                uint64_t t = rec->tsc - pc->exit_tsc;
+
+                e = stat_get(&vmexit_tab, pc->exit_reason);
+                e->total += t;
+                if ( t > e->max )
+                    e->max = t;
+            }
+            pc->in_exit = 0;
+            return;
+        }
+    }
+
+    if ( (opts.reports & REPORT_V4V) && event == TRC_V4V_SENDV )
+    {
+        /* src:dst dom, src port, dst port, length, result */
+        e = stat_get(&v4v_tab, ((uint64_t)rec->d[0] << 32) | rec->d[2]);
+        if ( (int32_t)rec->d[4] < 0 )
+        {
+            e->errors++;
+            e->count++;
+        }
+        else
+            stat_add(e, rec->d[3]);
+        return;
+    }
+
+    if ( (opts.reports & REPORT_GRANT) &&
+         event >= TRC_MEM_PAGE_GRANT_MAP &&
+         event <= TRC_MEM_PAGE_GRANT_TRANSFER )
+    {
+        e = stat_get(&grant_tab, ((uint64_t)(event - TRC_MEM) << 32) |
+                                 rec->d[0]);
+        e->count++;
+        return;
+    }
+}
+
+static void report_sched(void)
+{
+    struct stat_entry **v;
+    size_t i, nr;
+
+    v = stat_sorted(&sched_tab, &nr);
+    printf("\nScheduling latency, runnable to running (%s):\n"
+           "%-12s %10s %12s %12s\n", opts.mhz ? "us" : "cycles",
+           "dom:vcpu", "count", "average", "max");
+    for ( i = 0; i < nr; i++ )
+    {
+        printf("d%-5u v%-4u %10"PRIu64, (unsigned int)(v[i]->key >> 16),
+               (unsigned int)(v[i]->key & 0xffff), v[i]->count);
+        print_time(v[i]->total / v[i]->count);
+        print_time(v[i]->max);
+        printf("\n");
+    }
+    free(v);
+}
+
+static void report_vmexit(void)
+{
+    struct stat_entry **v;
+    size_t i, nr;
+
+    v = stat_sorted(&vmexit_tab, &nr);
+    printf("\nVM exits by reason, time to the next VM entry (%s):\n"
+           "%-12s %10s %12s %12s %12s\n", opts.mhz ? "us" : "cycles",
+           "reason", "count", "total", "average", "max");
+    for ( i = 0; i < nr; i++ )
+    {
+        printf("%#-12"PRIx64" %10"PRIu64, v[i]->key, v[i]->count);
+        print_time(v[i]->total);
+        print_time(v[i]->total / v[i]->count);
+        print_time(v[i]->max);
+        printf("\n");
+    }
+    free(v);
+}
+
+static void report_v4v(void)
+{
+    struct stat_entry **v;
+    size_t i, nr;
+
+    v = stat_sorted(&v4v_tab, &nr);
+    printf("\nv4v flows:\n%-6s %-6s %-10s %10s %14s %10s %8s\n",
+           "src", "dst", "dst port", "messages", "bytes", "max", "errors");
+    for ( i = 0; i < nr; i++ )
+        printf("d%-5u d%-5u %#-10x %10"PRIu64" %14"PRIu64" %10"PRIu64
+               " %8"PRIu64"\n",
+               (unsigned int)(v[i]->key >> 48),
+               (unsigned int)(v[i]->key >> 32) & 0xffff,
+               (unsigned int)v[i]->key, v[i]->count, v[i]->total,
+               v[i]->max, v[i]->errors);
+    free(v);
+}
+
+static void report_grant(void)
+{
+    static const char *const names[] = {
+        [TRC_MEM_PAGE_GRANT_MAP - TRC_MEM] = "map",
+        [TRC_MEM_PAGE_GRANT_UNMAP - TRC_MEM] = "unmap",
+        [TRC_MEM_PAGE_GRANT_TRANSFER - TRC_MEM] = "transfer",
+    };
+    struct stat_entry **v;
+    size_t i, nr;
+
+    v = stat_sorted(&grant_tab, &nr);
+    printf("\nGrant operations:\n%-10s %-6s %10s\n", "op", "domain", "count");
+    for ( i = 0; i < nr; i++ )
+        printf("%-10s d%-5u %10"PRIu64"\n", names[v[i]->key >> 32],
+               (unsigned int)v[i]->key, v[i]->count);
+    free(v);
+}
+
+static void report(void)
+{
+    unsigned int i;
+
+    printf("\n%lu records on %u cpus:", nr_records, nr_pcpus);
+    for ( i = 0; i < nr_pcpus; i++ )
+        if ( pcpus[i].nr_records )
+            printf(" cpu%u %lu", i, pcpus[i].nr_records);
+    printf("\n");
+    if ( lost_records )
+        printf("%lu records were lost, the reports are incomplete\n",
+               lost_records);
+
+    if ( opts.reports & REPORT_SCHED )
+        report_sched();
+    if ( opts.reports & REPORT_VMEXIT )
+        report_vmexit();
+    if ( opts.reports & REPORT_V4V )
+        report_v4v();
+    if ( opts.reports & REPORT_GRANT )
+        report_grant();
+}
+
+/***** Command line handling *****/
+
+static void usage(void)
+{
+    fprintf(stderr,
+"Usage: xentrace_analyze [OPTION...] [trace file]\n"
+"Analyze the output of xentrace, from standard input if no file is given.\n"
+"\n"
+"  -f, --format=DEFS     Print the records in TSC order according to the\n"
+"                        rules in DEFS, as xentrace_format does\n"
+"  -r, --report=LIST     Print the reports in the comma separated LIST:\n"
+"                        sched, vmexit, v4v, grant or all (the default\n"
+"                        without -f)\n"
+"  -c, --cpu-mhz=MHZ     TSC frequency, to print times in seconds (-f)\n"
+"                        and microseconds (-r) rather than cycles\n"
+"  -h, --help            Show this message\n");
+    exit(EXIT_FAILURE);
+}
+
+static void parse_reports(char *arg)
+{
+    char *tok;
+
+    for ( tok = strtok(arg, ","); tok; tok = strtok(NULL, ",") )
+    {
+        if ( !strcmp(tok, "sched") )
+            opts.reports |= REPORT_SCHED;
+        else if ( !strcmp(tok, "vmexit") )
+            opts.reports |= REPORT_VMEXIT;
+        else if ( !strcmp(tok, "v4v") )
+            opts.reports |= REPORT_V4V;
+        else if ( !strcmp(tok, "grant") )
+            opts.reports |= REPORT_GRANT;
+        else if ( !strcmp(tok, "all") )
+            opts.reports |= REPORT_ALL;
+        else
+        {
+            fprintf(stderr, "Unknown report %s\n\n", tok);
+            usage();
+        }
+    }
+}
+
+static void parse_args(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        { "format",  required_argument, 0, 'f' },
+        { "report",  required_argument, 0, 'r' },
+        { "cpu-mhz", required_argument, 0, 'c' },
+        { "help",    no_argument,       0, 'h' },
+        { 0, 0, 0, 0 }
+    };
+    char *end;
+    int option;
+
+    while ( (option = getopt_long(argc, argv, "f:r:c:h",
+                                  long_options, NULL)) != -1 )
+    {
+        switch ( option )
+        {
+        case 'f':
+            opts.defs_file = optarg;
+            break;
+        case 'r':
+            parse_reports(optarg);
+            break;
+        case 'c':
+            opts.mhz = strtoul(optarg, &end, 0);
+            if ( end == optarg || *end )
+                usage();
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if ( optind < argc - 1 )
+        usage();
+    if ( optind == argc - 1 )
+        opts.trace_file = argv[optind];
+
+    if ( !opts.defs_file && !opts.reports )
+        opts.reports = REPORT_ALL;
+}
+
+int main(int argc, char **argv)
+{
+    static char outbuf[1 << 16];
+    const unsigned char *buf;
+    struct record rec;
+    size_t len;
+    int fd = 0;
+
+    parse_args(argc, argv);
+
+    if ( opts.defs_file )
+        read_defs(opts.defs_file);
+
+    if ( opts.trace_file )
+    {
+        fd = open(opts.trace_file, O_RDONLY);
+        if ( fd < 0 )
+        {
+            perror(opts.trace_file);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    buf = load_trace(fd, &len);
+    index_trace(buf, len);
+    heap_init();
+
+    setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+
+    while ( next_record(&rec) )
+    {
+        nr_records++;
+        if ( opts.defs_file )
+            format_record(&rec);
+        if ( opts.reports )
+            account_record(&rec);
+    }
+
+    if ( opts.reports )
+        report();
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
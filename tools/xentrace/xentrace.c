@@ -24,6 +24,7 @@
 #include <getopt.h>
 #include <assert.h>
 #include <sys/poll.h>
+#include <sys/uio.h>
 #include <sys/statvfs.h>
 
 #include <xen/xen.h>
@@ -57,6 +58,13 @@ typedef struct settings_st {
     unsigned long disk_rsvd;
     unsigned long timeout;
     unsigned long memory_buffer;
+    unsigned long highwater;
+#define MAX_SAMPLES 8
+    struct {
+        uint32_t class_mask;
+        unsigned long ratio;
+    } samples[MAX_SAMPLES];
+    unsigned int nr_samples;
     uint8_t discard:1,
         disable_tracing:1,
         start_disabled:1;
@@ -330,22 +338,26 @@ fail:
 }
 
 /**
- * write_buffer - write a section of the trace buffer
+ * write_buffer - write a window of the trace buffer
  * @cpu      - source buffer CPU ID
  * @start
- * @size     - size of write (may be less than total window size)
- * @total_size - total size of the window (0 on 2nd write of wrapped windows)
- * @out      - output stream
+ * @size     - size of the window up to the end of the buffer
+ * @wrap_size - size of the rest of the window, from the start of the
+ *              buffer at @wrap (0 if the window does not wrap)
  *
  * Outputs the trace buffer to a filestream, prepending the CPU and size
- * of the buffer write.
+ * of the buffer write.  The record and both parts of the window go out
+ * in a single writev() straight from the mapped trace pages.
  */
 static void write_buffer(unsigned int cpu, unsigned char *start, int size,
-                         int total_size)
+                         unsigned char *wrap, int wrap_size)
 {
     struct statvfs stat;
-    size_t written = 0;
-    
+    struct cpu_change_record rec;
+    struct iovec iov[3];
+    int iovcnt = 0, total_size = size + wrap_size;
+    ssize_t written = 0;
+
     if ( opts.memory_buffer == 0 && opts.disk_rsvd != 0 )
     {
         unsigned long long freespace;
@@ -359,10 +371,7 @@ static void write_buffer(unsigned int cpu, unsigned char *start, int size,
 
         freespace = stat.f_frsize * (unsigned long long)stat.f_bfree;
 
-        if ( total_size )
-            freespace -= total_size;
-        else
-            freespace -= size;
+        freespace -= total_size;
 
         freespace >>= 20; /* Convert to MB */
 
@@ -373,46 +382,52 @@ static void write_buffer(unsigned int cpu, unsigned char *start, int size,
         }
     }
 
-    /* Write a CPU_BUF record on each buffer "window" written.  Wrapped
-     * windows may involve two writes, so only write the record on the
-     * first write. */
-    if ( total_size != 0 )
+    /* Write a CPU_BUF record on each buffer "window" written. */
+    if ( opts.memory_buffer )
     {
-        if ( opts.memory_buffer )
-        {
-            membuf_reserve_window(cpu, total_size);
-        }
-        else
-        {
-            struct cpu_change_record rec;
-
-            rec.header = CPU_CHANGE_HEADER;
-            rec.data.cpu = cpu;
-            rec.data.window_size = total_size;
-
-            written = write(outfd, &rec, sizeof(rec));
-            if ( written != sizeof(rec) )
-            {
-                fprintf(stderr, "Cannot write cpu change (write returned %zd)\n",
-                        written);
-                goto fail;
-            }
-        }
+        membuf_reserve_window(cpu, total_size);
+        membuf_write(start, size);
+        if ( wrap_size )
+            membuf_write(wrap, wrap_size);
+        return;
     }
 
-    if ( opts.memory_buffer )
+    rec.header = CPU_CHANGE_HEADER;
+    rec.data.cpu = cpu;
+    rec.data.window_size = total_size;
+
+    iov[iovcnt].iov_base = &rec;
+    iov[iovcnt++].iov_len = sizeof(rec);
+    iov[iovcnt].iov_base = start;
+    iov[iovcnt++].iov_len = size;
+    if ( wrap_size )
     {
-        membuf_write(start, size);
+        iov[iovcnt].iov_base = wrap;
+        iov[iovcnt++].iov_len = wrap_size;
     }
-    else
+
+    for ( ; ; )
     {
-        written = write(outfd, start, size);
-        if ( written != size )
+        written = writev(outfd, iov, iovcnt);
+        if ( written < 0 && errno == EINTR )
+            continue;
+        if ( written <= 0 )
         {
-            fprintf(stderr, "Write failed! (size %d, returned %zd)\n",
-                    size, written);
+            fprintf(stderr, "Write failed! (size %zu, returned %zd)\n",
+                    sizeof(rec) + total_size, written);
             goto fail;
         }
+
+        /* Carry on after a short write */
+        while ( iovcnt && written >= (ssize_t)iov[0].iov_len )
+        {
+            written -= iov[0].iov_len;
+            memmove(iov, iov + 1, --iovcnt * sizeof(*iov));
+        }
+        if ( !iovcnt )
+            break;
+        iov[0].iov_base = (char *)iov[0].iov_base + written;
+        iov[0].iov_len -= written;
     }
 
     return;
@@ -707,7 +722,7 @@ static int monitor_tbufs(void)
                 /* If window does not wrap, write in one big chunk */
                 write_buffer(i, data[i]+start_offset,
                              window_size,
-                             window_size);
+                             NULL, 0);
             }
             else
             {
@@ -717,10 +732,7 @@ static int monitor_tbufs(void)
                  */
                 write_buffer(i, data[i] + start_offset,
                              data_size - start_offset,
-                             window_size);
-                write_buffer(i, data[i],
-                             end_offset,
-                             0);
+                             data[i], end_offset);
             }
 
             xen_mb(); /* read buffer, then update cons. */
@@ -802,6 +814,15 @@ static void usage(void)
 "  -r  --reserve-disk-space=n Before writing trace records to disk, check to see\n" \
 "                          that after the write there will be at least n space\n" \
 "                          left on the disk.\n" \
+"  -w  --watermark=p       Have Xen notify xentrace when a trace buffer is p\n" \
+"                          percent full (default 50).  At high event rates\n" \
+"                          a lower mark, with a larger -S and -s, leaves\n" \
+"                          more of the buffer to catch up in before records\n" \
+"                          are lost.\n" \
+"  -p  --sample=m:n        Record only 1 in n of the events of the classes\n" \
+"                          in mask m (e.g. 0x0008f000 for TRC_HVM), so\n" \
+"                          that hot events can stay traced.  May be given\n" \
+"                          more than once.\n" \
 "\n" \
 "This tool is used to capture trace buffer data from Xen. The\n" \
 "data is output in a binary format, in the following order:\n" \
@@ -906,6 +927,21 @@ static int parse_evtmask(char *arg)
     return 0;
 }
 
+static void parse_sample(char *arg)
+{
+    char *ratio = strchr(arg, ':');
+
+    if ( !ratio || opts.nr_samples == MAX_SAMPLES )
+    {
+        fprintf(stderr, "Invalid sample: %s\n\n", arg);
+        usage();
+    }
+    *ratio++ = '\0';
+    opts.samples[opts.nr_samples].class_mask = argtol(arg, 0);
+    opts.samples[opts.nr_samples].ratio = argtol(ratio, 0);
+    opts.nr_samples++;
+}
+
 /* parse command line arguments */
 static void parse_args(int argc, char **argv)
 {
@@ -919,6 +955,8 @@ static void parse_args(int argc, char **argv)
         { "reserve-disk-space", required_argument, 0, 'r' },
         { "time-interval",  required_argument, 0, 'T' },
         { "memory-buffer",  required_argument, 0, 'M' },
+        { "watermark",      required_argument, 0, 'w' },
+        { "sample",         required_argument, 0, 'p' },
         { "discard-buffers", no_argument,      0, 'D' },
         { "dont-disable-tracing", no_argument, 0, 'x' },
         { "start-disabled", no_argument,       0, 'X' },
@@ -927,7 +965,7 @@ static void parse_args(int argc, char **argv)
         { 0, 0, 0, 0 }
     };
 
-    while ( (option = getopt_long(argc, argv, "t:s:c:e:S:r:T:M:DxX?V",
+    while ( (option = getopt_long(argc, argv, "t:s:c:e:S:r:T:M:w:p:DxX?V",
                     long_options, NULL)) != -1) 
     {
         switch ( option )
@@ -977,6 +1015,19 @@ static void parse_args(int argc, char **argv)
             opts.memory_buffer = sargtol(optarg, 0);
             break;
 
+        case 'w': /* VIRQ_TBUF high water mark (given in percent) */
+            opts.highwater = argtol(optarg, 0);
+            if ( opts.highwater == 0 || opts.highwater > 100 )
+            {
+                fprintf(stderr, "Watermark must be 1 to 100 percent\n\n");
+                usage();
+            }
+            break;
+
+        case 'p': /* Record 1 in n events of some classes */
+            parse_sample(optarg);
+            break;
+
         default:
             usage();
         }
@@ -997,6 +1048,7 @@ static void parse_args(int argc, char **argv)
 int main(int argc, char **argv)
 {
     int ret;
+    unsigned int i;
     struct sigaction act;
 
     opts.outfile = 0;
@@ -1023,6 +1075,21 @@ int main(int argc, char **argv)
     if ( opts.cpu_mask != 0 )
         set_mask(opts.cpu_mask, 1);
 
+    if ( opts.highwater != 0 &&
+         xc_tbuf_set_highwater(xc_handle, opts.highwater) != 0 )
+    {
+        perror("Couldn't set trace buffer watermark");
+        exit(EXIT_FAILURE);
+    }
+
+    for ( i = 0; i < opts.nr_samples; i++ )
+        if ( xc_tbuf_set_sample(xc_handle, opts.samples[i].class_mask,
+                                opts.samples[i].ratio) != 0 )
+        {
+            perror("Couldn't set trace sampling");
+            exit(EXIT_FAILURE);
+        }
+
     if ( opts.timeout != 0 ) 
         alarm(opts.timeout);
 
@@ -79,8 +79,12 @@ void restore_rest_processor_state(void)
         do_set_segment_base(SEGBASE_GS_USER_SEL, saved_segs[3]);
     }
 
-    if ( cpu_has_xsave && !set_xcr0(saved_xcr0) )
-        BUG();
+    if ( cpu_has_xsave )
+    {
+        invalidate_xcr0();
+        if ( !set_xcr0(saved_xcr0) )
+            BUG();
+    }
 
     /* Maybe load the debug registers. */
     BUG_ON(!is_pv_vcpu(curr));
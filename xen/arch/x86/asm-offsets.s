@@ -0,0 +1,856 @@
+	.file	"asm-offsets.c"
+	.text
+.Ltext0:
+	.cfi_sections	.debug_frame
+	.file 0 "/root/repo/xen/arch/x86" "x86_64/asm-offsets.c"
+	.globl	__dummy__
+	.hidden	__dummy__
+	.type	__dummy__, @function
+__dummy__:
+.LFB409:
+	.file 1 "x86_64/asm-offsets.c"
+	.loc 1 26 1 view -0
+	.cfi_startproc
+	.loc 1 27 5 view .LVU1
+#APP
+# 27 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_r15 $0 /* offsetof(struct cpu_user_regs, r15) */<=="
+# 0 "" 2
+	.loc 1 27 49 view .LVU2
+	.loc 1 28 5 view .LVU3
+# 28 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_r14 $8 /* offsetof(struct cpu_user_regs, r14) */<=="
+# 0 "" 2
+	.loc 1 28 49 view .LVU4
+	.loc 1 29 5 view .LVU5
+# 29 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_r13 $16 /* offsetof(struct cpu_user_regs, r13) */<=="
+# 0 "" 2
+	.loc 1 29 49 view .LVU6
+	.loc 1 30 5 view .LVU7
+# 30 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_r12 $24 /* offsetof(struct cpu_user_regs, r12) */<=="
+# 0 "" 2
+	.loc 1 30 49 view .LVU8
+	.loc 1 31 5 view .LVU9
+# 31 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_rbp $32 /* offsetof(struct cpu_user_regs, rbp) */<=="
+# 0 "" 2
+	.loc 1 31 49 view .LVU10
+	.loc 1 32 5 view .LVU11
+# 32 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_rbx $40 /* offsetof(struct cpu_user_regs, rbx) */<=="
+# 0 "" 2
+	.loc 1 32 49 view .LVU12
+	.loc 1 33 5 view .LVU13
+# 33 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_r11 $48 /* offsetof(struct cpu_user_regs, r11) */<=="
+# 0 "" 2
+	.loc 1 33 49 view .LVU14
+	.loc 1 34 5 view .LVU15
+# 34 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_r10 $56 /* offsetof(struct cpu_user_regs, r10) */<=="
+# 0 "" 2
+	.loc 1 34 49 view .LVU16
+	.loc 1 35 5 view .LVU17
+# 35 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_r9 $64 /* offsetof(struct cpu_user_regs, r9) */<=="
+# 0 "" 2
+	.loc 1 35 47 view .LVU18
+	.loc 1 36 5 view .LVU19
+# 36 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_r8 $72 /* offsetof(struct cpu_user_regs, r8) */<=="
+# 0 "" 2
+	.loc 1 36 47 view .LVU20
+	.loc 1 37 5 view .LVU21
+# 37 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_rax $80 /* offsetof(struct cpu_user_regs, rax) */<=="
+# 0 "" 2
+	.loc 1 37 49 view .LVU22
+	.loc 1 38 5 view .LVU23
+# 38 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_rcx $88 /* offsetof(struct cpu_user_regs, rcx) */<=="
+# 0 "" 2
+	.loc 1 38 49 view .LVU24
+	.loc 1 39 5 view .LVU25
+# 39 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_rdx $96 /* offsetof(struct cpu_user_regs, rdx) */<=="
+# 0 "" 2
+	.loc 1 39 49 view .LVU26
+	.loc 1 40 5 view .LVU27
+# 40 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_rsi $104 /* offsetof(struct cpu_user_regs, rsi) */<=="
+# 0 "" 2
+	.loc 1 40 49 view .LVU28
+	.loc 1 41 5 view .LVU29
+# 41 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_rdi $112 /* offsetof(struct cpu_user_regs, rdi) */<=="
+# 0 "" 2
+	.loc 1 41 49 view .LVU30
+	.loc 1 42 5 view .LVU31
+# 42 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_error_code $120 /* offsetof(struct cpu_user_regs, error_code) */<=="
+# 0 "" 2
+	.loc 1 42 63 view .LVU32
+	.loc 1 43 5 view .LVU33
+# 43 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_entry_vector $124 /* offsetof(struct cpu_user_regs, entry_vector) */<=="
+# 0 "" 2
+	.loc 1 43 67 view .LVU34
+	.loc 1 44 5 view .LVU35
+# 44 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_saved_upcall_mask $140 /* offsetof(struct cpu_user_regs, saved_upcall_mask) */<=="
+# 0 "" 2
+	.loc 1 44 77 view .LVU36
+	.loc 1 45 5 view .LVU37
+# 45 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_rip $128 /* offsetof(struct cpu_user_regs, rip) */<=="
+# 0 "" 2
+	.loc 1 45 49 view .LVU38
+	.loc 1 46 5 view .LVU39
+# 46 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_cs $136 /* offsetof(struct cpu_user_regs, cs) */<=="
+# 0 "" 2
+	.loc 1 46 47 view .LVU40
+	.loc 1 47 5 view .LVU41
+# 47 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_eflags $144 /* offsetof(struct cpu_user_regs, eflags) */<=="
+# 0 "" 2
+	.loc 1 47 55 view .LVU42
+	.loc 1 48 5 view .LVU43
+# 48 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_rsp $152 /* offsetof(struct cpu_user_regs, rsp) */<=="
+# 0 "" 2
+	.loc 1 48 49 view .LVU44
+	.loc 1 49 5 view .LVU45
+# 49 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_ss $160 /* offsetof(struct cpu_user_regs, ss) */<=="
+# 0 "" 2
+	.loc 1 49 47 view .LVU46
+	.loc 1 50 5 view .LVU47
+# 50 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_ds $176 /* offsetof(struct cpu_user_regs, ds) */<=="
+# 0 "" 2
+	.loc 1 50 47 view .LVU48
+	.loc 1 51 5 view .LVU49
+# 51 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_es $168 /* offsetof(struct cpu_user_regs, es) */<=="
+# 0 "" 2
+	.loc 1 51 47 view .LVU50
+	.loc 1 52 5 view .LVU51
+# 52 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_fs $184 /* offsetof(struct cpu_user_regs, fs) */<=="
+# 0 "" 2
+	.loc 1 52 47 view .LVU52
+	.loc 1 53 5 view .LVU53
+# 53 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_gs $192 /* offsetof(struct cpu_user_regs, gs) */<=="
+# 0 "" 2
+	.loc 1 53 47 view .LVU54
+	.loc 1 54 5 view .LVU55
+# 54 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_kernel_sizeof $168 /* offsetof(struct cpu_user_regs, es) */<=="
+# 0 "" 2
+	.loc 1 54 58 view .LVU56
+	.loc 1 55 5 view .LVU57
+# 55 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define UREGS_user_sizeof $200 /* sizeof(struct cpu_user_regs) */<=="
+# 0 "" 2
+	.loc 1 56 5 view .LVU58
+# 56 "x86_64/asm-offsets.c" 1
+	
+.ascii"==><=="
+# 0 "" 2
+	.loc 1 58 5 view .LVU59
+# 58 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define irq_caps_offset $288 /* offsetof(struct domain, irq_caps) */<=="
+# 0 "" 2
+	.loc 1 58 53 view .LVU60
+	.loc 1 59 5 view .LVU61
+# 59 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define next_in_list_offset $112 /* offsetof(struct domain, next_in_list) */<=="
+# 0 "" 2
+	.loc 1 59 61 view .LVU62
+	.loc 1 60 5 view .LVU63
+# 60 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_processor $4 /* offsetof(struct vcpu, processor) */<=="
+# 0 "" 2
+	.loc 1 60 51 view .LVU64
+	.loc 1 61 5 view .LVU65
+# 61 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_domain $16 /* offsetof(struct vcpu, domain) */<=="
+# 0 "" 2
+	.loc 1 61 45 view .LVU66
+	.loc 1 62 5 view .LVU67
+# 62 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_vcpu_info $8 /* offsetof(struct vcpu, vcpu_info) */<=="
+# 0 "" 2
+	.loc 1 62 51 view .LVU68
+	.loc 1 63 5 view .LVU69
+# 63 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_trap_bounce $1648 /* offsetof(struct vcpu, arch.pv_vcpu.trap_bounce) */<=="
+# 0 "" 2
+	.loc 1 63 68 view .LVU70
+	.loc 1 64 5 view .LVU71
+# 64 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_int80_bounce $1664 /* offsetof(struct vcpu, arch.pv_vcpu.int80_bounce) */<=="
+# 0 "" 2
+	.loc 1 64 70 view .LVU72
+	.loc 1 65 5 view .LVU73
+# 65 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_thread_flags $1176 /* offsetof(struct vcpu, arch.flags) */<=="
+# 0 "" 2
+	.loc 1 65 55 view .LVU74
+	.loc 1 66 5 view .LVU75
+# 66 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_event_addr $1568 /* offsetof(struct vcpu, arch.pv_vcpu.event_callback_eip) */<=="
+# 0 "" 2
+	.loc 1 66 74 view .LVU76
+	.loc 1 67 5 view .LVU77
+# 67 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_event_sel $1584 /* offsetof(struct vcpu, arch.pv_vcpu.event_callback_cs) */<=="
+# 0 "" 2
+	.loc 1 67 72 view .LVU78
+	.loc 1 68 5 view .LVU79
+# 68 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_failsafe_addr $1576 /* offsetof(struct vcpu, arch.pv_vcpu.failsafe_callback_eip) */<=="
+# 0 "" 2
+	.loc 1 69 47 view .LVU80
+	.loc 1 70 5 view .LVU81
+# 70 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_failsafe_sel $1588 /* offsetof(struct vcpu, arch.pv_vcpu.failsafe_callback_cs) */<=="
+# 0 "" 2
+	.loc 1 71 46 view .LVU82
+	.loc 1 72 5 view .LVU83
+# 72 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_syscall_addr $1584 /* offsetof(struct vcpu, arch.pv_vcpu.syscall_callback_eip) */<=="
+# 0 "" 2
+	.loc 1 73 46 view .LVU84
+	.loc 1 74 5 view .LVU85
+# 74 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_syscall32_addr $1600 /* offsetof(struct vcpu, arch.pv_vcpu.syscall32_callback_eip) */<=="
+# 0 "" 2
+	.loc 1 75 48 view .LVU86
+	.loc 1 76 5 view .LVU87
+# 76 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_syscall32_sel $1616 /* offsetof(struct vcpu, arch.pv_vcpu.syscall32_callback_cs) */<=="
+# 0 "" 2
+	.loc 1 77 47 view .LVU88
+	.loc 1 78 5 view .LVU89
+# 78 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_syscall32_disables_events $1620 /* offsetof(struct vcpu, arch.pv_vcpu.syscall32_disables_events) */<=="
+# 0 "" 2
+	.loc 1 79 51 view .LVU90
+	.loc 1 80 5 view .LVU91
+# 80 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_sysenter_addr $1608 /* offsetof(struct vcpu, arch.pv_vcpu.sysenter_callback_eip) */<=="
+# 0 "" 2
+	.loc 1 81 47 view .LVU92
+	.loc 1 82 5 view .LVU93
+# 82 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_sysenter_sel $1618 /* offsetof(struct vcpu, arch.pv_vcpu.sysenter_callback_cs) */<=="
+# 0 "" 2
+	.loc 1 83 46 view .LVU94
+	.loc 1 84 5 view .LVU95
+# 84 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_sysenter_disables_events $1621 /* offsetof(struct vcpu, arch.pv_vcpu.sysenter_disables_events) */<=="
+# 0 "" 2
+	.loc 1 85 50 view .LVU96
+	.loc 1 86 5 view .LVU97
+# 86 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_trap_ctxt $1352 /* offsetof(struct vcpu, arch.pv_vcpu.trap_ctxt) */<=="
+# 0 "" 2
+	.loc 1 86 64 view .LVU98
+	.loc 1 87 5 view .LVU99
+# 87 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_kernel_sp $1496 /* offsetof(struct vcpu, arch.pv_vcpu.kernel_sp) */<=="
+# 0 "" 2
+	.loc 1 87 64 view .LVU100
+	.loc 1 88 5 view .LVU101
+# 88 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_kernel_ss $1488 /* offsetof(struct vcpu, arch.pv_vcpu.kernel_ss) */<=="
+# 0 "" 2
+	.loc 1 88 64 view .LVU102
+	.loc 1 89 5 view .LVU103
+# 89 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_guest_context_flags $904 /* offsetof(struct vcpu, arch.vgc_flags) */<=="
+# 0 "" 2
+	.loc 1 89 66 view .LVU104
+	.loc 1 90 5 view .LVU105
+# 90 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_nmi_pending $269 /* offsetof(struct vcpu, async_exception_state[(1)-1].pending) */<=="
+# 0 "" 2
+	.loc 1 90 55 view .LVU106
+	.loc 1 91 5 view .LVU107
+# 91 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_mce_pending $271 /* offsetof(struct vcpu, async_exception_state[(2)-1].pending) */<=="
+# 0 "" 2
+	.loc 1 91 55 view .LVU108
+	.loc 1 92 5 view .LVU109
+# 92 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_nmi_old_mask $270 /* offsetof(struct vcpu, async_exception_state[(1)-1].old_mask) */<=="
+# 0 "" 2
+	.loc 1 92 63 view .LVU110
+	.loc 1 93 5 view .LVU111
+# 93 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_mce_old_mask $272 /* offsetof(struct vcpu, async_exception_state[(2)-1].old_mask) */<=="
+# 0 "" 2
+	.loc 1 93 63 view .LVU112
+	.loc 1 94 5 view .LVU113
+# 94 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_async_exception_mask $273 /* offsetof(struct vcpu, async_exception_mask) */<=="
+# 0 "" 2
+	.loc 1 94 73 view .LVU114
+	.loc 1 95 5 view .LVU115
+# 95 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_TRAP_NMI $1 /* VCPU_TRAP_NMI */<=="
+# 0 "" 2
+	.loc 1 96 5 view .LVU116
+# 96 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_TRAP_MCE $2 /* VCPU_TRAP_MCE */<=="
+# 0 "" 2
+	.loc 1 97 5 view .LVU117
+# 97 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define _VGCF_failsafe_disables_events $3 /* _VGCF_failsafe_disables_events */<=="
+# 0 "" 2
+	.loc 1 98 5 view .LVU118
+# 98 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define _VGCF_syscall_disables_events $4 /* _VGCF_syscall_disables_events */<=="
+# 0 "" 2
+	.loc 1 99 5 view .LVU119
+# 99 "x86_64/asm-offsets.c" 1
+	
+.ascii"==><=="
+# 0 "" 2
+	.loc 1 101 5 view .LVU120
+# 101 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_svm_vmcb_pa $1800 /* offsetof(struct vcpu, arch.hvm_vcpu.u.svm.vmcb_pa) */<=="
+# 0 "" 2
+	.loc 1 101 64 view .LVU121
+	.loc 1 102 5 view .LVU122
+# 102 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_svm_vmcb $1792 /* offsetof(struct vcpu, arch.hvm_vcpu.u.svm.vmcb) */<=="
+# 0 "" 2
+	.loc 1 102 58 view .LVU123
+	.loc 1 103 5 view .LVU124
+# 103 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_svm_vmcb_in_sync $1820 /* offsetof(struct vcpu, arch.hvm_vcpu.u.svm.vmcb_in_sync) */<=="
+# 0 "" 2
+	.loc 1 103 74 view .LVU125
+	.loc 1 104 5 view .LVU126
+# 104 "x86_64/asm-offsets.c" 1
+	
+.ascii"==><=="
+# 0 "" 2
+	.loc 1 106 5 view .LVU127
+# 106 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_vmx_launched $1836 /* offsetof(struct vcpu, arch.hvm_vcpu.u.vmx.launched) */<=="
+# 0 "" 2
+	.loc 1 106 66 view .LVU128
+	.loc 1 107 5 view .LVU129
+# 107 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_vmx_realmode $2057 /* offsetof(struct vcpu, arch.hvm_vcpu.u.vmx.vmx_realmode) */<=="
+# 0 "" 2
+	.loc 1 107 70 view .LVU130
+	.loc 1 108 5 view .LVU131
+# 108 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_vmx_emulate $2058 /* offsetof(struct vcpu, arch.hvm_vcpu.u.vmx.vmx_emulate) */<=="
+# 0 "" 2
+	.loc 1 108 68 view .LVU132
+	.loc 1 109 5 view .LVU133
+# 109 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_vm86_seg_mask $2060 /* offsetof(struct vcpu, arch.hvm_vcpu.u.vmx.vm86_segment_mask) */<=="
+# 0 "" 2
+	.loc 1 109 76 view .LVU134
+	.loc 1 110 5 view .LVU135
+# 110 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_hvm_guest_cr2 $1232 /* offsetof(struct vcpu, arch.hvm_vcpu.guest_cr[2]) */<=="
+# 0 "" 2
+	.loc 1 110 71 view .LVU136
+	.loc 1 111 5 view .LVU137
+# 111 "x86_64/asm-offsets.c" 1
+	
+.ascii"==><=="
+# 0 "" 2
+	.loc 1 113 5 view .LVU138
+# 113 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_nhvm_guestmode $2280 /* offsetof(struct vcpu, arch.hvm_vcpu.nvcpu.nv_guestmode) */<=="
+# 0 "" 2
+	.loc 1 113 79 view .LVU139
+	.loc 1 114 5 view .LVU140
+# 114 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_nhvm_p2m $2512 /* offsetof(struct vcpu, arch.hvm_vcpu.nvcpu.nv_p2m) */<=="
+# 0 "" 2
+	.loc 1 114 67 view .LVU141
+	.loc 1 115 5 view .LVU142
+# 115 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPU_nsvm_hap_enabled $2468 /* offsetof(struct vcpu, arch.hvm_vcpu.nvcpu.u.nsvm.ns_hap_enabled) */<=="
+# 0 "" 2
+	.loc 1 115 90 view .LVU143
+	.loc 1 116 5 view .LVU144
+# 116 "x86_64/asm-offsets.c" 1
+	
+.ascii"==><=="
+# 0 "" 2
+	.loc 1 118 5 view .LVU145
+# 118 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define DOMAIN_is_32bit_pv $3116 /* offsetof(struct domain, arch.is_32bit_pv) */<=="
+# 0 "" 2
+	.loc 1 118 64 view .LVU146
+	.loc 1 119 5 view .LVU147
+# 119 "x86_64/asm-offsets.c" 1
+	
+.ascii"==><=="
+# 0 "" 2
+	.loc 1 121 5 view .LVU148
+# 121 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VMCB_rax $1528 /* offsetof(struct vmcb_struct, rax) */<=="
+# 0 "" 2
+	.loc 1 121 46 view .LVU149
+	.loc 1 122 5 view .LVU150
+# 122 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VMCB_rip $1400 /* offsetof(struct vmcb_struct, rip) */<=="
+# 0 "" 2
+	.loc 1 122 46 view .LVU151
+	.loc 1 123 5 view .LVU152
+# 123 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VMCB_rsp $1496 /* offsetof(struct vmcb_struct, rsp) */<=="
+# 0 "" 2
+	.loc 1 123 46 view .LVU153
+	.loc 1 124 5 view .LVU154
+# 124 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VMCB_rflags $1392 /* offsetof(struct vmcb_struct, rflags) */<=="
+# 0 "" 2
+	.loc 1 124 52 view .LVU155
+	.loc 1 125 5 view .LVU156
+# 125 "x86_64/asm-offsets.c" 1
+	
+.ascii"==><=="
+# 0 "" 2
+	.loc 1 127 5 view .LVU157
+# 127 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPUINFO_upcall_pending $0 /* offsetof(struct vcpu_info, evtchn_upcall_pending) */<=="
+# 0 "" 2
+	.loc 1 127 77 view .LVU158
+	.loc 1 128 5 view .LVU159
+# 128 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define VCPUINFO_upcall_mask $1 /* offsetof(struct vcpu_info, evtchn_upcall_mask) */<=="
+# 0 "" 2
+	.loc 1 128 71 view .LVU160
+	.loc 1 129 5 view .LVU161
+# 129 "x86_64/asm-offsets.c" 1
+	
+.ascii"==><=="
+# 0 "" 2
+	.loc 1 131 5 view .LVU162
+# 131 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define COMPAT_VCPUINFO_upcall_pending $0 /* offsetof(struct compat_vcpu_info, evtchn_upcall_pending) */<=="
+# 0 "" 2
+	.loc 1 131 91 view .LVU163
+	.loc 1 132 5 view .LVU164
+# 132 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define COMPAT_VCPUINFO_upcall_mask $1 /* offsetof(struct compat_vcpu_info, evtchn_upcall_mask) */<=="
+# 0 "" 2
+	.loc 1 132 85 view .LVU165
+	.loc 1 133 5 view .LVU166
+# 133 "x86_64/asm-offsets.c" 1
+	
+.ascii"==><=="
+# 0 "" 2
+	.loc 1 135 5 view .LVU167
+# 135 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define CPUINFO_guest_cpu_user_regs $0 /* offsetof(struct cpu_info, guest_cpu_user_regs) */<=="
+# 0 "" 2
+	.loc 1 135 78 view .LVU168
+	.loc 1 136 5 view .LVU169
+# 136 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define CPUINFO_processor_id $200 /* offsetof(struct cpu_info, processor_id) */<=="
+# 0 "" 2
+	.loc 1 136 64 view .LVU170
+	.loc 1 137 5 view .LVU171
+# 137 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define CPUINFO_current_vcpu $208 /* offsetof(struct cpu_info, current_vcpu) */<=="
+# 0 "" 2
+	.loc 1 137 64 view .LVU172
+	.loc 1 138 5 view .LVU173
+# 138 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define CPUINFO_sizeof $232 /* sizeof(struct cpu_info) */<=="
+# 0 "" 2
+	.loc 1 139 5 view .LVU174
+# 139 "x86_64/asm-offsets.c" 1
+	
+.ascii"==><=="
+# 0 "" 2
+	.loc 1 141 5 view .LVU175
+# 141 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define TRAPINFO_eip $8 /* offsetof(struct trap_info, address) */<=="
+# 0 "" 2
+	.loc 1 141 52 view .LVU176
+	.loc 1 142 5 view .LVU177
+# 142 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define TRAPINFO_cs $2 /* offsetof(struct trap_info, cs) */<=="
+# 0 "" 2
+	.loc 1 142 46 view .LVU178
+	.loc 1 143 5 view .LVU179
+# 143 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define TRAPINFO_flags $1 /* offsetof(struct trap_info, flags) */<=="
+# 0 "" 2
+	.loc 1 143 52 view .LVU180
+	.loc 1 144 5 view .LVU181
+# 144 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define TRAPINFO_sizeof $16 /* sizeof(struct trap_info) */<=="
+# 0 "" 2
+	.loc 1 145 5 view .LVU182
+# 145 "x86_64/asm-offsets.c" 1
+	
+.ascii"==><=="
+# 0 "" 2
+	.loc 1 147 5 view .LVU183
+# 147 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define TRAPBOUNCE_error_code $0 /* offsetof(struct trap_bounce, error_code) */<=="
+# 0 "" 2
+	.loc 1 147 66 view .LVU184
+	.loc 1 148 5 view .LVU185
+# 148 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define TRAPBOUNCE_flags $4 /* offsetof(struct trap_bounce, flags) */<=="
+# 0 "" 2
+	.loc 1 148 56 view .LVU186
+	.loc 1 149 5 view .LVU187
+# 149 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define TRAPBOUNCE_cs $6 /* offsetof(struct trap_bounce, cs) */<=="
+# 0 "" 2
+	.loc 1 149 50 view .LVU188
+	.loc 1 150 5 view .LVU189
+# 150 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define TRAPBOUNCE_eip $8 /* offsetof(struct trap_bounce, eip) */<=="
+# 0 "" 2
+	.loc 1 150 52 view .LVU190
+	.loc 1 151 5 view .LVU191
+# 151 "x86_64/asm-offsets.c" 1
+	
+.ascii"==><=="
+# 0 "" 2
+	.loc 1 159 5 view .LVU192
+# 159 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define IRQSTAT_shift $7 /* LOG_2(sizeof(irq_cpustat_t)) */<=="
+# 0 "" 2
+	.loc 1 160 5 view .LVU193
+# 160 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define IRQSTAT_softirq_pending $0 /* offsetof(irq_cpustat_t, __softirq_pending) */<=="
+# 0 "" 2
+	.loc 1 160 70 view .LVU194
+	.loc 1 161 5 view .LVU195
+# 161 "x86_64/asm-offsets.c" 1
+	
+.ascii"==><=="
+# 0 "" 2
+	.loc 1 163 5 view .LVU196
+# 163 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define CPUINFO_features $12 /* offsetof(struct cpuinfo_x86, x86_capability) */<=="
+# 0 "" 2
+	.loc 1 163 65 view .LVU197
+	.loc 1 164 5 view .LVU198
+# 164 "x86_64/asm-offsets.c" 1
+	
+.ascii"==><=="
+# 0 "" 2
+	.loc 1 166 5 view .LVU199
+# 166 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define MB_flags $0 /* offsetof(multiboot_info_t, flags) */<=="
+# 0 "" 2
+	.loc 1 166 46 view .LVU200
+	.loc 1 167 5 view .LVU201
+# 167 "x86_64/asm-offsets.c" 1
+	
+.ascii"==>#define MB_cmdline $16 /* offsetof(multiboot_info_t, cmdline) */<=="
+# 0 "" 2
+	.loc 1 167 50 view .LVU202
+	.loc 1 168 1 is_stmt 0 view .LVU203
+#NO_APP
+	ret
+	.cfi_endproc
+.LFE409:
+	.size	__dummy__, .-__dummy__
+.Letext0:
+	.section	.debug_info,"",@progbits
+.Ldebug_info0:
+	.long	0x92
+	.value	0x5
+	.byte	0x1
+	.byte	0x8
+	.long	.Ldebug_abbrev0
+	.uleb128 0x2
+	.long	.LASF12
+	.byte	0xc
+	.long	.LASF0
+	.long	.LASF1
+	.quad	.Ltext0
+	.quad	.Letext0-.Ltext0
+	.long	.Ldebug_line0
+	.uleb128 0x1
+	.byte	0x8
+	.byte	0x7
+	.long	.LASF2
+	.uleb128 0x1
+	.byte	0x1
+	.byte	0x6
+	.long	.LASF3
+	.uleb128 0x1
+	.byte	0x4
+	.byte	0x7
+	.long	.LASF4
+	.uleb128 0x1
+	.byte	0x1
+	.byte	0x8
+	.long	.LASF5
+	.uleb128 0x1
+	.byte	0x2
+	.byte	0x7
+	.long	.LASF6
+	.uleb128 0x1
+	.byte	0x1
+	.byte	0x6
+	.long	.LASF7
+	.uleb128 0x1
+	.byte	0x2
+	.byte	0x5
+	.long	.LASF8
+	.uleb128 0x3
+	.byte	0x4
+	.byte	0x5
+	.string	"int"
+	.uleb128 0x1
+	.byte	0x8
+	.byte	0x5
+	.long	.LASF9
+	.uleb128 0x1
+	.byte	0x8
+	.byte	0x7
+	.long	.LASF10
+	.uleb128 0x1
+	.byte	0x8
+	.byte	0x5
+	.long	.LASF11
+	.uleb128 0x4
+	.long	.LASF13
+	.byte	0x1
+	.byte	0x19
+	.byte	0x6
+	.quad	.LFB409
+	.quad	.LFE409-.LFB409
+	.uleb128 0x1
+	.byte	0x9c
+	.byte	0
+	.section	.debug_abbrev,"",@progbits
+.Ldebug_abbrev0:
+	.uleb128 0x1
+	.uleb128 0x24
+	.byte	0
+	.uleb128 0xb
+	.uleb128 0xb
+	.uleb128 0x3e
+	.uleb128 0xb
+	.uleb128 0x3
+	.uleb128 0xe
+	.byte	0
+	.byte	0
+	.uleb128 0x2
+	.uleb128 0x11
+	.byte	0x1
+	.uleb128 0x25
+	.uleb128 0xe
+	.uleb128 0x13
+	.uleb128 0xb
+	.uleb128 0x3
+	.uleb128 0x1f
+	.uleb128 0x1b
+	.uleb128 0x1f
+	.uleb128 0x11
+	.uleb128 0x1
+	.uleb128 0x12
+	.uleb128 0x7
+	.uleb128 0x10
+	.uleb128 0x17
+	.byte	0
+	.byte	0
+	.uleb128 0x3
+	.uleb128 0x24
+	.byte	0
+	.uleb128 0xb
+	.uleb128 0xb
+	.uleb128 0x3e
+	.uleb128 0xb
+	.uleb128 0x3
+	.uleb128 0x8
+	.byte	0
+	.byte	0
+	.uleb128 0x4
+	.uleb128 0x2e
+	.byte	0
+	.uleb128 0x3f
+	.uleb128 0x19
+	.uleb128 0x3
+	.uleb128 0xe
+	.uleb128 0x3a
+	.uleb128 0xb
+	.uleb128 0x3b
+	.uleb128 0xb
+	.uleb128 0x39
+	.uleb128 0xb
+	.uleb128 0x27
+	.uleb128 0x19
+	.uleb128 0x11
+	.uleb128 0x1
+	.uleb128 0x12
+	.uleb128 0x7
+	.uleb128 0x40
+	.uleb128 0x18
+	.uleb128 0x7a
+	.uleb128 0x19
+	.byte	0
+	.byte	0
+	.byte	0
+	.section	.debug_aranges,"",@progbits
+	.long	0x2c
+	.value	0x2
+	.long	.Ldebug_info0
+	.byte	0x8
+	.byte	0
+	.value	0
+	.value	0
+	.quad	.Ltext0
+	.quad	.Letext0-.Ltext0
+	.quad	0
+	.quad	0
+	.section	.debug_line,"",@progbits
+.Ldebug_line0:
+	.section	.debug_str,"MS",@progbits,1
+.LASF13:
+	.string	"__dummy__"
+.LASF4:
+	.string	"unsigned int"
+.LASF2:
+	.string	"long unsigned int"
+.LASF7:
+	.string	"signed char"
+.LASF6:
+	.string	"short unsigned int"
+.LASF8:
+	.string	"short int"
+.LASF12:
+	.ascii	"GNU C99 12.2.0 -m64 -m"
+	.string	"soft-float -mno-red-zone -mno-sse -mtune=generic -march=x86-64 -g -g -O1 -std=gnu99 -fno-strict-aliasing -fno-stack-protector -fno-exceptions -fpic -fno-asynchronous-unwind-tables -fno-builtin -fno-common -fno-optimize-sibling-calls -fno-omit-frame-pointer"
+.LASF5:
+	.string	"unsigned char"
+.LASF9:
+	.string	"long int"
+.LASF10:
+	.string	"long long unsigned int"
+.LASF3:
+	.string	"char"
+.LASF11:
+	.string	"long long int"
+	.section	.debug_line_str,"MS",@progbits,1
+.LASF0:
+	.string	"x86_64/asm-offsets.c"
+.LASF1:
+	.string	"/root/repo/xen/arch/x86"
+	.ident	"GCC: (Debian 12.2.0-14+deb12u1) 12.2.0"
+	.section	.note.GNU-stack,"",@progbits
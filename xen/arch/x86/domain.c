@@ -58,6 +58,7 @@
 #include <asm/mce.h>
 #include <asm/amd.h>
 #include <xen/numa.h>
+#include <xen/sched-if.h>
 #include <xen/iommu.h>
 #include <compat/vcpu.h>
 
@@ -116,7 +117,9 @@ static void idle_loop(void)
     {
         if ( cpu_is_offline(smp_processor_id()) )
             play_dead();
-        (*pm_idle)();
+        /* Only sleep once there are no freed pages left to scrub. */
+        if ( !scrub_free_pages() )
+            (*pm_idle)();
         do_tasklet();
         do_softirq();
     }
@@ -1414,7 +1417,7 @@ static void __context_switch(void)
         {
             u64 xcr0 = n->arch.xcr0 ?: XSTATE_FP_SSE;
 
-            if ( xcr0 != get_xcr0() && !set_xcr0(xcr0) )
+            if ( !set_xcr0(xcr0) )
                 BUG();
         }
         vcpu_restore_fpu_eager(n);
@@ -1782,10 +1785,156 @@ int hypercall_xlat_continuation(unsigned int *id, unsigned int mask, ...)
     return rc;
 }
 
+/*
+ * Pages needing nothing but their references dropped -- neither pinned nor
+ * page tables, that is most of a large domain -- are handed by
+ * relinquish_memory() in batches to tasklets on idle cpus, of the batch's
+ * node where there is one.  The pages stay on relmem_list meanwhile, where
+ * free_domheap_pages() expects them.  relmem_workers=0 keeps it all on the
+ * cpu running the hypercall.
+ */
+#define RELMEM_MAX_WORKERS 8
+#define RELMEM_BATCH       512
+
+static unsigned int __read_mostly opt_relmem_workers = RELMEM_MAX_WORKERS;
+integer_param("relmem_workers", opt_relmem_workers);
+
+struct relmem_worker {
+    struct domain *domain;
+    struct tasklet tasklet;
+    bool_t busy;
+    unsigned int nr;
+    struct page_info *pages[RELMEM_BATCH];
+};
+
+static bool_t relmem_simple_page(const struct page_info *page)
+{
+    unsigned long type = page->u.inuse.type_info;
+
+    if ( type & PGT_pinned )
+        return 0;
+
+    switch ( type & PGT_type_mask )
+    {
+    case PGT_l1_page_table:
+    case PGT_l2_page_table:
+    case PGT_l3_page_table:
+    case PGT_l4_page_table:
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Drop the allocation reference, and the one relinquish_memory() took. */
+static void relmem_put_page(struct page_info *page)
+{
+    clear_superpage_mark(page);
+
+    if ( test_and_clear_bit(_PGC_allocated, &page->count_info) )
+        put_page(page);
+    put_page(page);
+}
+
+static void relmem_worker_fn(unsigned long data)
+{
+    struct relmem_worker *w = (struct relmem_worker *)data;
+    struct domain *d = w->domain;
+    unsigned int i;
+
+    for ( i = 0; i < w->nr; i++ )
+        relmem_put_page(w->pages[i]);
+    w->nr = 0;
+
+    smp_wmb();
+    w->busy = 0;
+    atomic_dec(&d->arch.relmem_inflight);
+}
+
+static struct relmem_worker *relmem_get_worker(struct domain *d)
+{
+    struct relmem_worker *w = d->arch.relmem_workers;
+    unsigned int i, nr = min_t(unsigned int, opt_relmem_workers,
+                               RELMEM_MAX_WORKERS);
+
+    if ( !nr || num_online_cpus() == 1 )
+        return NULL;
+
+    if ( !w )
+    {
+        w = xzalloc_array(struct relmem_worker, nr);
+        if ( !w )
+            return NULL;
+        for ( i = 0; i < nr; i++ )
+        {
+            w[i].domain = d;
+            tasklet_init(&w[i].tasklet, relmem_worker_fn, (unsigned long)&w[i]);
+        }
+        d->arch.relmem_workers = w;
+        d->arch.relmem_nr_workers = nr;
+    }
+
+    for ( i = 0; i < d->arch.relmem_nr_workers; i++ )
+        if ( !w[i].busy )
+            return &w[i];
+
+    return NULL;
+}
+
+/* An idle cpu other than this one, preferably one of node. */
+static int relmem_pick_cpu(unsigned int node)
+{
+    unsigned int cpu, self = smp_processor_id();
+
+    for_each_cpu ( cpu, &node_to_cpumask(node) )
+        if ( cpu != self && cpu_online(cpu) && is_idle_vcpu(curr_on_cpu(cpu)) )
+            return cpu;
+
+    for_each_online_cpu ( cpu )
+        if ( cpu != self && is_idle_vcpu(curr_on_cpu(cpu)) )
+            return cpu;
+
+    return -1;
+}
+
+/* Called with page_alloc_lock held, which is dropped around the dispatch. */
+static void relmem_dispatch(struct domain *d, struct relmem_worker *w)
+{
+    int cpu;
+
+    if ( !w->nr )
+        return;
+
+    cpu = relmem_pick_cpu(phys_to_nid(page_to_maddr(w->pages[0])));
+    w->busy = 1;
+    atomic_inc(&d->arch.relmem_inflight);
+
+    spin_unlock_recursive(&d->page_alloc_lock);
+    if ( cpu >= 0 )
+        tasklet_schedule_on_cpu(&w->tasklet, cpu);
+    else
+        relmem_worker_fn((unsigned long)w);
+    spin_lock_recursive(&d->page_alloc_lock);
+}
+
+static void relmem_free_workers(struct domain *d)
+{
+    unsigned int i;
+
+    if ( !d->arch.relmem_workers )
+        return;
+
+    for ( i = 0; i < d->arch.relmem_nr_workers; i++ )
+        tasklet_kill(&d->arch.relmem_workers[i].tasklet);
+    xfree(d->arch.relmem_workers);
+    d->arch.relmem_workers = NULL;
+}
+
 static int relinquish_memory(
     struct domain *d, struct page_list_head *list, unsigned long type)
 {
     struct page_info  *page;
+    struct relmem_worker *w = NULL;
     unsigned long     x, y;
     int               ret = 0;
 
@@ -1802,6 +1951,25 @@ static int relinquish_memory(
             continue;
         }
 
+        if ( list == &d->page_list && relmem_simple_page(page) &&
+             (w || (w = relmem_get_worker(d)) != NULL) )
+        {
+            page_list_add_tail(page, &d->arch.relmem_list);
+            w->pages[w->nr++] = page;
+            if ( w->nr == RELMEM_BATCH )
+            {
+                relmem_dispatch(d, w);
+                w = NULL;
+            }
+
+            if ( hypercall_preempt_check() )
+            {
+                ret = -ERESTART;
+                goto out;
+            }
+            continue;
+        }
+
         if ( test_and_clear_bit(_PGT_pinned, &page->u.inuse.type_info) )
             ret = put_page_and_type_preemptible(page);
         switch ( ret )
@@ -1886,10 +2054,24 @@ static int relinquish_memory(
         }
     }
 
+    /* Wait for the batches given to other cpus before the next pass. */
+    if ( w )
+    {
+        relmem_dispatch(d, w);
+        w = NULL;
+    }
+    if ( atomic_read(&d->arch.relmem_inflight) )
+    {
+        ret = -ERESTART;
+        goto out;
+    }
+
     /* list is empty at this point. */
     page_list_move(list, &d->arch.relmem_list);
 
  out:
+    if ( w )
+        relmem_dispatch(d, w);
     spin_unlock_recursive(&d->page_alloc_lock);
     return ret;
 }
@@ -1985,6 +2167,7 @@ int domain_relinquish_resources(struct domain *d)
         ret = relinquish_memory(d, &d->page_list, PGT_l2_page_table);
         if ( ret )
             return ret;
+        relmem_free_workers(d);
         d->arch.relmem = RELMEM_done;
         /* fallthrough */
 
@@ -2014,6 +2197,8 @@ void arch_dump_vcpu_info(struct vcpu *v)
 
     if ( is_hvm_vcpu(v) )
         vpmu_dump(v);
+    else
+        mapcache_dump_vcpu(v);
 }
 
 void domain_cpuid(
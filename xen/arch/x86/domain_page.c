@@ -52,6 +52,32 @@ void __init mapcache_override_current(struct vcpu *v)
     override = v;
 }
 
+#ifdef PERF_COUNTERS
+#define mapcache_stat(vcache, s) ((vcache)->stats.s++)
+#else
+#define mapcache_stat(vcache, s) ((void)0)
+#endif
+
+/*
+ * An entry of the hash keeps its mapping while no one uses it, for the
+ * next map of the same mfn to take again as it is: no PTE write, and no
+ * TLB flush. The other entry of its set is the one to replace.
+ */
+static inline void maphash_touch(struct mapcache_vcpu *vcache,
+                                 unsigned int i)
+{
+    if ( i & 1 )
+        vcache->hash_mru |= 1u << (i / 2);
+    else
+        vcache->hash_mru &= ~(1u << (i / 2));
+}
+
+static inline unsigned int maphash_lru(const struct mapcache_vcpu *vcache,
+                                       unsigned int set)
+{
+    return set + !(vcache->hash_mru & (1u << (set / 2)));
+}
+
 #define mapcache_l2_entry(e) ((e) >> PAGETABLE_ORDER)
 #define MAPCACHE_L2_ENTRIES (mapcache_l2_entry(MAPCACHE_ENTRIES - 1) + 1)
 #define MAPCACHE_L1ENT(idx) \
@@ -84,17 +110,25 @@ void *map_domain_page(unsigned long mfn)
 
     local_irq_save(flags);
 
-    hashent = &vcache->hash[MAPHASH_HASHFN(mfn)];
-    if ( hashent->mfn == mfn )
+    for ( i = MAPHASH_HASHFN(mfn); i < MAPHASH_HASHFN(mfn) + 2; i++ )
     {
-        idx = hashent->idx;
-        ASSERT(idx < dcache->entries);
-        hashent->refcnt++;
-        ASSERT(hashent->refcnt);
-        ASSERT(l1e_get_pfn(MAPCACHE_L1ENT(idx)) == mfn);
-        goto out;
+        hashent = &vcache->hash[i];
+        if ( hashent->mfn == mfn )
+        {
+            idx = hashent->idx;
+            ASSERT(idx < dcache->entries);
+            hashent->refcnt++;
+            ASSERT(hashent->refcnt);
+            ASSERT(l1e_get_pfn(MAPCACHE_L1ENT(idx)) == mfn);
+            maphash_touch(vcache, i);
+            perfc_incr(domain_page_hash_hit);
+            mapcache_stat(vcache, hits);
+            goto out;
+        }
     }
 
+    mapcache_stat(vcache, misses);
+
     spin_lock(&dcache->lock);
 
     /* Has some other CPU caused a wrap? We must flush if so. */
@@ -104,6 +138,7 @@ void *map_domain_page(unsigned long mfn)
         if ( NEED_FLUSH(this_cpu(tlbflush_time), dcache->tlbflush_timestamp) )
         {
             perfc_incr(domain_page_tlb_flush);
+            mapcache_stat(vcache, flushes);
             flush_tlb_local();
         }
     }
@@ -146,6 +181,7 @@ void *map_domain_page(unsigned long mfn)
 
         /* /Second/, flush TLBs. */
         perfc_incr(domain_page_tlb_flush);
+        mapcache_stat(vcache, flushes);
         flush_tlb_local();
         vcache->shadow_epoch = ++dcache->epoch;
         dcache->tlbflush_timestamp = tlbflush_current_time();
@@ -166,11 +202,12 @@ void *map_domain_page(unsigned long mfn)
 
 void unmap_domain_page(const void *ptr)
 {
-    unsigned int idx;
+    unsigned int idx, i, set;
     struct vcpu *v;
     struct mapcache_domain *dcache;
+    struct mapcache_vcpu *vcache;
     unsigned long va = (unsigned long)ptr, mfn, flags;
-    struct vcpu_maphash_entry *hashent;
+    struct vcpu_maphash_entry *hashent = NULL;
 
     if ( va >= DIRECTMAP_VIRT_START )
         return;
@@ -186,17 +223,43 @@ void unmap_domain_page(const void *ptr)
 
     idx = PFN_DOWN(va - MAPCACHE_VIRT_START);
     mfn = l1e_get_pfn(MAPCACHE_L1ENT(idx));
-    hashent = &v->arch.pv_vcpu.mapcache.hash[MAPHASH_HASHFN(mfn)];
+    vcache = &v->arch.pv_vcpu.mapcache;
+    set = MAPHASH_HASHFN(mfn);
 
     local_irq_save(flags);
 
-    if ( hashent->idx == idx )
+    for ( i = set; i < set + 2; i++ )
+        if ( vcache->hash[i].idx == idx )
+        {
+            hashent = &vcache->hash[i];
+            ASSERT(hashent->mfn == mfn);
+            ASSERT(hashent->refcnt);
+            hashent->refcnt--;
+            maphash_touch(vcache, i);
+            goto out;
+        }
+
+    /*
+     * Keep the mapping in the set: in place of an unused entry of the
+     * same mfn, else in an empty entry, else in the least recently used
+     * of those no one uses.
+     */
+    for ( i = set; i < set + 2; i++ )
     {
-        ASSERT(hashent->mfn == mfn);
-        ASSERT(hashent->refcnt);
-        hashent->refcnt--;
+        struct vcpu_maphash_entry *ent = &vcache->hash[i];
+
+        if ( ent->refcnt )
+            continue;
+        if ( ent->mfn == mfn || ent->idx == MAPHASHENT_NOTINUSE )
+        {
+            hashent = ent;
+            break;
+        }
+        if ( !hashent || i == maphash_lru(vcache, set) )
+            hashent = ent;
     }
-    else if ( !hashent->refcnt )
+
+    if ( hashent )
     {
         if ( hashent->idx != MAPHASHENT_NOTINUSE )
         {
@@ -206,11 +269,13 @@ void unmap_domain_page(const void *ptr)
             l1e_write(&MAPCACHE_L1ENT(hashent->idx), l1e_empty());
             /* /Second/, mark as garbage. */
             set_bit(hashent->idx, dcache->garbage);
+            perfc_incr(domain_page_hash_evict);
         }
 
         /* Add newly-freed mapping to the maphash. */
         hashent->mfn = mfn;
         hashent->idx = idx;
+        maphash_touch(vcache, hashent - vcache->hash);
     }
     else
     {
@@ -220,6 +285,7 @@ void unmap_domain_page(const void *ptr)
         set_bit(idx, dcache->garbage);
     }
 
+ out:
     local_irq_restore(flags);
 }
 
@@ -309,6 +375,7 @@ int mapcache_vcpu_init(struct vcpu *v)
         hashent->mfn = ~0UL; /* never valid to map */
         hashent->idx = MAPHASHENT_NOTINUSE;
     }
+    v->arch.pv_vcpu.mapcache.hash_mru = 0;
 
     return 0;
 }
@@ -337,6 +404,19 @@ void unmap_domain_page_global(const void *ptr)
     vunmap(ptr);
 }
 
+void mapcache_dump_vcpu(struct vcpu *v)
+{
+#ifdef PERF_COUNTERS
+    const struct mapcache_vcpu *vcache = &v->arch.pv_vcpu.mapcache;
+
+    if ( !is_pv_vcpu(v) || !v->domain->arch.pv_domain.mapcache.inuse )
+        return;
+
+    printk("    mapcache: %lu hits, %lu misses, %lu TLB flushes\n",
+           vcache->stats.hits, vcache->stats.misses, vcache->stats.flushes);
+#endif
+}
+
 /* Translate a map-domain-page'd address to the underlying MFN */
 unsigned long domain_page_map_to_mfn(const void *ptr)
 {
@@ -1239,6 +1239,27 @@ long arch_do_domctl(
     break;
 #endif /* P2M_AUDIT */
 
+    case XEN_DOMCTL_log_dirty_extents:
+        ret = -EINVAL;
+        if ( d == current->domain || !paging_mode_log_dirty(d) )
+            break;
+
+        ret = paging_log_dirty_extents(d, &domctl->u.log_dirty_extents);
+        copyback = 1;
+        break;
+
+    case XEN_DOMCTL_p2m_coalesce:
+        ret = -EINVAL;
+        if ( d == current->domain || !is_hvm_domain(d) )
+            break;
+
+        ret = p2m_coalesce(d, &domctl->u.p2m_coalesce);
+        if ( ret == -ERESTART )
+            ret = hypercall_create_continuation(
+                __HYPERVISOR_domctl, "h", u_domctl);
+        copyback = 1;
+        break;
+
     case XEN_DOMCTL_set_access_required:
     {
         struct p2m_domain* p2m;
@@ -19,6 +19,7 @@
 #include <asm/xstate.h>
 #include <asm/hvm/emulate.h>
 #include <asm/hvm/hvm.h>
+#include <asm/hvm/nestedhvm.h>
 #include <asm/hvm/trace.h>
 #include <asm/hvm/support.h>
 
@@ -108,6 +109,12 @@ static int hvmemul_do_io(
 
     vio = &curr->arch.hvm_vcpu.hvm_io;
 
+    if ( is_mmio )
+    {
+        vio->mmio_accesses++;
+        vio->mmio_access_pa = addr;
+    }
+
     if ( is_mmio && !p.data_is_ptr )
     {
         /* Part of a multi-cycle read or write? */
@@ -223,6 +230,11 @@ static int hvmemul_do_io(
             rc = X86EMUL_OKAY;
             vio->io_state = HVMIO_none;
         }
+        else if ( hvm_posted_io_send(&p) )
+        {
+            rc = X86EMUL_OKAY;
+            vio->io_state = HVMIO_none;
+        }
         else
         {
             rc = X86EMUL_RETRY;
@@ -1138,6 +1150,230 @@ static const struct x86_emulate_ops hvm_emulate_ops = {
     .invlpg        = hvmemul_invlpg
 };
 
+/*
+ * Decode a MOV between memory and a register or immediate, of the forms
+ * compilers emit for device register accesses.  Returns 0 for anything
+ * else, which is left to the emulator.
+ */
+static int hvmemul_decode_mov(const uint8_t *insn, unsigned int bytes,
+                              bool_t long_mode, struct hvm_mmio_insn *m)
+{
+    unsigned int i, rex = 0, op_bytes = 4, imm_bytes = 0;
+    uint8_t op, modrm, mod, rm;
+
+    /* Segment overrides do not matter, the address is known already. */
+    for ( i = 0; i < bytes; i++ )
+    {
+        switch ( insn[i] )
+        {
+        case 0x66:
+            op_bytes = 2;
+            continue;
+        case 0x26: case 0x2e: case 0x36: case 0x3e: case 0x64: case 0x65:
+            continue;
+        }
+        break;
+    }
+    if ( long_mode && i < bytes && (insn[i] & 0xf0) == 0x40 )
+        rex = insn[i++];
+    if ( i + 2 > bytes )
+        return 0;
+
+    op = insn[i++];
+    modrm = insn[i++];
+    mod = modrm >> 6;
+    rm = modrm & 7;
+    if ( mod == 3 )
+        return 0;
+    if ( rex & 8 )
+        op_bytes = 8;
+
+    m->flags = long_mode ? HVM_MMIO_INSN_LONG : 0;
+    m->reg = ((rex & 4) << 1) | ((modrm >> 3) & 7);
+    switch ( op )
+    {
+    case 0x88: /* mov r8,m8 */
+        m->flags |= HVM_MMIO_INSN_WRITE;
+        /* fall through */
+    case 0x8a: /* mov m8,r8 */
+        m->bytes = 1;
+        break;
+    case 0x89: /* mov r,m */
+        m->flags |= HVM_MMIO_INSN_WRITE;
+        /* fall through */
+    case 0x8b: /* mov m,r */
+        m->bytes = op_bytes;
+        break;
+    case 0xc6: /* mov imm8,m8 */
+        m->flags |= HVM_MMIO_INSN_WRITE | HVM_MMIO_INSN_IMM;
+        m->bytes = imm_bytes = 1;
+        break;
+    case 0xc7: /* mov imm,m */
+        m->flags |= HVM_MMIO_INSN_WRITE | HVM_MMIO_INSN_IMM;
+        m->bytes = op_bytes;
+        imm_bytes = (op_bytes == 2) ? 2 : 4;
+        break;
+    default:
+        return 0;
+    }
+    if ( imm_bytes && m->reg )
+        return 0;
+    if ( m->bytes == 1 && !rex && !imm_bytes )
+        m->flags |= HVM_MMIO_INSN_HIGH8;
+
+    /* SIB and displacement */
+    if ( rm == 4 )
+    {
+        if ( i >= bytes )
+            return 0;
+        if ( mod == 0 && (insn[i] & 7) == 5 )
+            i += 4;
+        i++;
+    }
+    else if ( mod == 0 && rm == 5 )
+        i += 4;
+    if ( mod == 1 )
+        i += 1;
+    else if ( mod == 2 )
+        i += 4;
+
+    if ( i + imm_bytes > bytes )
+        return 0;
+    m->imm = 0;
+    memcpy(&m->imm, &insn[i], imm_bytes);
+    i += imm_bytes;
+
+    m->len = i;
+    memcpy(m->insn, insn, i);
+
+    return 1;
+}
+
+/* Remember the MMIO move just emulated, for hvm_emulate_one_cached() */
+static void hvmemul_cache_insn(struct hvm_emulate_ctxt *hvmemul_ctxt)
+{
+    struct vcpu *curr = current;
+    struct hvm_vcpu_io *vio = &curr->arch.hvm_vcpu.hvm_io;
+    unsigned int addr_size = hvmemul_ctxt->ctxt.addr_size;
+    unsigned long len = hvmemul_ctxt->ctxt.regs->eip -
+                        hvmemul_ctxt->insn_buf_eip;
+    struct hvm_mmio_insn m;
+
+    if ( addr_size == 16 || hvmemul_ctxt->ctxt.retire.byte ||
+         !hvmemul_decode_mov(hvmemul_ctxt->insn_buf,
+                             hvmemul_ctxt->insn_buf_bytes,
+                             addr_size == 64, &m) ||
+         m.len != len ||
+         (vio->mmio_gpa & ~PAGE_MASK) + m.bytes > PAGE_SIZE )
+        return;
+
+    m.cr3 = curr->arch.hvm_vcpu.guest_cr[3];
+    m.rip = hvmemul_ctxt->insn_buf_eip;
+    m.gpa = vio->mmio_gpa;
+    vio->mmio_insn_cache[vio->mmio_insn_next++ % HVM_MMIO_INSN_CACHE] = m;
+}
+
+/*
+ * Repeat an MMIO move emulated before from the same instruction, address
+ * space and MMIO page, without decoding it again: a loop over the
+ * registers of a device, through one instruction, keeps hitting.  The
+ * instruction is still compared with what is at rip, for code that has
+ * changed since.  X86EMUL_UNHANDLEABLE means it is not one, for
+ * hvm_emulate_one().
+ */
+int hvm_emulate_one_cached(
+    struct hvm_emulate_ctxt *hvmemul_ctxt, paddr_t gpa)
+{
+    struct cpu_user_regs *regs = hvmemul_ctxt->ctxt.regs;
+    struct vcpu *curr = current;
+    struct hvm_vcpu_io *vio = &curr->arch.hvm_vcpu.hvm_io;
+    struct segment_register *cs = &hvmemul_ctxt->seg_reg[x86_seg_cs];
+    unsigned long cr3 = curr->arch.hvm_vcpu.guest_cr[3];
+    unsigned long addr, data = 0, reps = 1;
+    bool_t long_mode = hvm_long_mode_enabled(curr) && cs->attr.fields.l;
+    uint32_t pfec = PFEC_page_present;
+    struct hvm_mmio_insn *m;
+    uint8_t insn[16];
+    void *reg;
+    unsigned int i;
+    int rc;
+
+    if ( (!long_mode && !cs->attr.fields.db) ||
+         nestedhvm_vcpu_in_guestmode(curr) ||
+         (regs->eflags & X86_EFLAGS_TF) || vio->mmio_retry ||
+         vio->mmio_insn_bytes || vio->mmio_large_read_bytes ||
+         vio->mmio_large_write_bytes )
+        return X86EMUL_UNHANDLEABLE;
+
+    for ( i = 0; i < HVM_MMIO_INSN_CACHE; i++ )
+    {
+        m = &vio->mmio_insn_cache[i];
+        if ( m->len && m->rip == regs->eip && m->cr3 == cr3 &&
+             !((m->gpa ^ gpa) & PAGE_MASK) &&
+             !(m->flags & HVM_MMIO_INSN_LONG) == !long_mode )
+            break;
+    }
+    if ( i == HVM_MMIO_INSN_CACHE ||
+         (gpa & ~PAGE_MASK) + m->bytes > PAGE_SIZE )
+        return X86EMUL_UNHANDLEABLE;
+
+    if ( hvmemul_ctxt->seg_reg[x86_seg_ss].attr.fields.dpl == 3 )
+        pfec |= PFEC_user_mode;
+    if ( hvm_get_insn_bytes(curr, insn) < m->len &&
+         (!hvm_virtual_to_linear_addr(x86_seg_cs, cs, regs->eip, m->len,
+                                      hvm_access_insn_fetch,
+                                      long_mode ? 64 : 32, &addr) ||
+          hvm_fetch_from_guest_virt_nofault(insn, addr, m->len,
+                                            pfec) != HVMCOPY_okay) )
+        return X86EMUL_UNHANDLEABLE;
+    if ( memcmp(insn, m->insn, m->len) )
+    {
+        m->len = 0;
+        return X86EMUL_UNHANDLEABLE;
+    }
+
+    reg = decode_register(m->reg, regs, m->flags & HVM_MMIO_INSN_HIGH8);
+    if ( m->flags & HVM_MMIO_INSN_WRITE )
+    {
+        if ( m->flags & HVM_MMIO_INSN_IMM )
+            data = (m->bytes == 8) ? (long)(int32_t)m->imm : m->imm;
+        else
+            memcpy(&data, reg, m->bytes);
+        rc = hvmemul_do_mmio(gpa, &reps, m->bytes, 0, IOREQ_WRITE, 0, &data);
+    }
+    else
+    {
+        rc = hvmemul_do_mmio(gpa, &reps, m->bytes, 0, IOREQ_READ, 0, &data);
+        if ( rc == X86EMUL_OKAY )
+        {
+            /* 32-bit destinations are zero extended. */
+            if ( m->bytes == 4 )
+                *(unsigned long *)reg = data;
+            else
+                memcpy(reg, &data, m->bytes);
+        }
+    }
+
+    if ( rc != X86EMUL_RETRY )
+        vio->mmio_large_read_bytes = vio->mmio_large_write_bytes = 0;
+    if ( rc != X86EMUL_OKAY )
+        return rc;
+
+    regs->eip += m->len;
+    if ( !long_mode )
+        regs->eip = (uint32_t)regs->eip;
+
+    if ( hvmemul_ctxt->intr_shadow &
+         (HVM_INTR_SHADOW_MOV_SS | HVM_INTR_SHADOW_STI) )
+    {
+        hvmemul_ctxt->intr_shadow &=
+            ~(HVM_INTR_SHADOW_MOV_SS | HVM_INTR_SHADOW_STI);
+        hvm_funcs.set_interrupt_shadow(curr, hvmemul_ctxt->intr_shadow);
+    }
+
+    return X86EMUL_OKAY;
+}
+
 int hvm_emulate_one(
     struct hvm_emulate_ctxt *hvmemul_ctxt)
 {
@@ -1190,6 +1426,7 @@ int hvm_emulate_one(
     hvmemul_ctxt->exn_pending = 0;
     vio->mmio_retrying = vio->mmio_retry;
     vio->mmio_retry = 0;
+    vio->mmio_accesses = 0;
 
     rc = x86_emulate(&hvmemul_ctxt->ctxt, &hvm_emulate_ops);
 
@@ -1210,6 +1447,10 @@ int hvm_emulate_one(
     if ( rc != X86EMUL_OKAY )
         return rc;
 
+    if ( vio->mmio_gpa_valid && vio->mmio_accesses == 1 &&
+         vio->mmio_access_pa == vio->mmio_gpa )
+        hvmemul_cache_insn(hvmemul_ctxt);
+
     new_intr_shadow = hvmemul_ctxt->intr_shadow;
 
     /* MOV-SS instruction toggles MOV-SS shadow, else we just clear it. */
@@ -85,6 +85,43 @@ static inline uint64_t hpet_read_maincounter(HPETState *h, uint64_t guest_time)
         return h->hpet.mc64;
 }
 
+/*
+ * The main counter is read without h->lock: it only depends on whether
+ * the counter is enabled, and then on mc_offset, or else on mc64. Those
+ * are only changed under the lock and between hpet_mc_write_begin() and
+ * _end(), and the reader retries if they changed under its feet.
+ */
+static inline void hpet_mc_write_begin(HPETState *h)
+{
+    ASSERT(spin_is_locked(&h->lock));
+    h->mc_seq++;
+    smp_wmb();
+}
+
+static inline void hpet_mc_write_end(HPETState *h)
+{
+    smp_wmb();
+    h->mc_seq++;
+}
+
+static uint64_t hpet_read_maincounter_lockless(HPETState *h)
+{
+    uint32_t seq;
+    uint64_t val;
+
+    do {
+        seq = read_atomic(&h->mc_seq);
+        smp_rmb();
+        if ( hpet_enabled(h) )
+            val = guest_time_hpet(h) + h->mc_offset;
+        else
+            val = h->hpet.mc64;
+        smp_rmb();
+    } while ( unlikely((seq & 1) || seq != read_atomic(&h->mc_seq)) );
+
+    return val;
+}
+
 static uint64_t hpet_get_comparator(HPETState *h, unsigned int tn,
                                     uint64_t guest_time)
 {
@@ -179,16 +216,20 @@ static int hpet_read(
         goto out;
     }
 
-    spin_lock(&h->lock);
-
-    val = hpet_read64(h, addr, guest_time_hpet(h));
+    /* Polled by guests on all their vcpus: keep it off the lock. */
+    if ( (addr & ~7) == HPET_COUNTER )
+        val = hpet_read_maincounter_lockless(h);
+    else
+    {
+        spin_lock(&h->lock);
+        val = hpet_read64(h, addr, guest_time_hpet(h));
+        spin_unlock(&h->lock);
+    }
 
     result = val;
     if ( length != 8 )
         result = (val >> ((addr & 7) * 8)) & ((1ULL << (length * 8)) - 1);
 
-    spin_unlock(&h->lock);
-
  out:
     *pval = result;
     return X86EMUL_OKAY;
@@ -317,6 +358,7 @@ static int hpet_write(
     switch ( addr & ~7 )
     {
     case HPET_CFG:
+        hpet_mc_write_begin(h);
         h->hpet.config = hpet_fixup_reg(new_val, old_val, 0x3);
 
         if ( !(old_val & HPET_CFG_ENABLE) && (new_val & HPET_CFG_ENABLE) )
@@ -341,10 +383,13 @@ static int hpet_write(
                 if ( timer_enabled(h, i) )
                     set_stop_timer(i);
         }
+        hpet_mc_write_end(h);
         break;
 
     case HPET_COUNTER:
+        hpet_mc_write_begin(h);
         h->hpet.mc64 = new_val;
+        hpet_mc_write_end(h);
         if ( hpet_enabled(h) )
         {
             gdprintk(XENLOG_WARNING,
@@ -570,6 +615,8 @@ static int hpet_load(struct domain *d, hvm_domain_context_t *h)
     rec = (struct hvm_hw_hpet *)&h->data[h->cur];
     h->cur += HVM_SAVE_LENGTH(HPET);
 
+    hpet_mc_write_begin(hp);
+
 #define C(x) hp->hpet.x = rec->x
     C(capability);
     C(config);
@@ -597,6 +644,8 @@ static int hpet_load(struct domain *d, hvm_domain_context_t *h)
     guest_time = guest_time_hpet(hp);
     hp->mc_offset = hp->hpet.mc64 - guest_time;
 
+    hpet_mc_write_end(hp);
+
     /* restart all timers */
 
     if ( hpet_enabled(hp) )
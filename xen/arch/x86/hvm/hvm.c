@@ -329,6 +329,7 @@ void hvm_migrate_timers(struct vcpu *v)
 
     rtc_migrate_timers(v);
     pt_migrate(v);
+    viridian_migrate_timers(v);
 }
 
 static int hvm_migrate_pirq(struct domain *d, struct hvm_pirq_dpci *pirq_dpci,
@@ -853,6 +854,7 @@ static int hvm_ioreq_server_alloc_rangesets(struct hvm_ioreq_server *s,
                       (i == HVMOP_IO_RANGE_PORT) ? "port" :
                       (i == HVMOP_IO_RANGE_MEMORY) ? "memory" :
                       (i == HVMOP_IO_RANGE_PCI) ? "pci" :
+                      (i == HVMOP_IO_RANGE_POSTED) ? "posted" :
                       "");
         if ( rc )
             goto fail;
@@ -1038,6 +1040,7 @@ static int hvm_create_ioreq_server(struct domain *d, domid_t domid,
 
     list_add(&s->list_entry,
              &d->arch.hvm_domain.ioreq_server.list);
+    d->arch.hvm_domain.ioreq_server.generation++;
 
     if ( is_default )
     {
@@ -1084,6 +1087,7 @@ static int hvm_destroy_ioreq_server(struct domain *d, ioservid_t id)
         domain_pause(d);
 
         list_del(&s->list_entry);
+        d->arch.hvm_domain.ioreq_server.generation++;
         
         hvm_ioreq_server_deinit(s, 0);
 
@@ -1160,6 +1164,16 @@ static int hvm_map_io_range_to_ioreq_server(struct domain *d, ioservid_t id,
 
             switch ( type )
             {
+            case HVMOP_IO_RANGE_POSTED:
+                /* Some other port range may not overlap it either */
+                rc = -EEXIST;
+                if ( rangeset_overlaps_range(s->range[HVMOP_IO_RANGE_PORT],
+                                             start, end) )
+                    goto out;
+                rc = -EINVAL;
+                if ( !s->bufioreq.va )
+                    goto out;
+                /* fall through */
             case HVMOP_IO_RANGE_PORT:
             case HVMOP_IO_RANGE_MEMORY:
             case HVMOP_IO_RANGE_PCI:
@@ -1176,14 +1190,19 @@ static int hvm_map_io_range_to_ioreq_server(struct domain *d, ioservid_t id,
                 break;
 
             rc = -EEXIST;
-            if ( rangeset_overlaps_range(r, start, end) )
+            if ( rangeset_overlaps_range(r, start, end) ||
+                 (type == HVMOP_IO_RANGE_PORT &&
+                  rangeset_overlaps_range(s->range[HVMOP_IO_RANGE_POSTED],
+                                          start, end)) )
                 break;
 
             rc = rangeset_add_range(r, start, end);
+            d->arch.hvm_domain.ioreq_server.generation++;
             break;
         }
     }
 
+ out:
     spin_unlock(&d->arch.hvm_domain.ioreq_server.lock);
 
     return rc;
@@ -1214,6 +1233,7 @@ static int hvm_unmap_io_range_from_ioreq_server(struct domain *d, ioservid_t id,
             case HVMOP_IO_RANGE_PORT:
             case HVMOP_IO_RANGE_MEMORY:
             case HVMOP_IO_RANGE_PCI:
+            case HVMOP_IO_RANGE_POSTED:
                 r = s->range[type];
                 break;
 
@@ -1231,6 +1251,7 @@ static int hvm_unmap_io_range_from_ioreq_server(struct domain *d, ioservid_t id,
                 break;
 
             rc = rangeset_remove_range(r, start, end);
+            d->arch.hvm_domain.ioreq_server.generation++;
             break;
         }
     }
@@ -1268,6 +1289,7 @@ static int hvm_set_ioreq_server_state(struct domain *d, ioservid_t id,
             hvm_ioreq_server_enable(s, 0);
         else
             hvm_ioreq_server_disable(s, 0);
+        d->arch.hvm_domain.ioreq_server.generation++;
 
         domain_unpause(d);
 
@@ -1348,6 +1370,7 @@ static void hvm_destroy_all_ioreq_servers(struct domain *d)
         }
 
         list_del(&s->list_entry);
+        d->arch.hvm_domain.ioreq_server.generation++;
         
         hvm_ioreq_server_deinit(s, is_default);
 
@@ -1477,6 +1500,7 @@ int hvm_domain_initialise(struct domain *d)
     if ( !d->arch.hvm_domain.params || !d->arch.hvm_domain.io_handler )
         goto fail1;
     d->arch.hvm_domain.io_handler->num_slot = 0;
+    d->arch.hvm_domain.io_handler->num_mmio = 0;
 
     if ( is_pvh_domain(d) )
     {
@@ -1535,6 +1559,8 @@ void hvm_domain_relinquish_resources(struct domain *d)
 
     msixtbl_pt_cleanup(d);
 
+    stdvga_relinquish(d);
+
     /* Stop all asynchronous timer actions. */
     rtc_deinit(d);
     if ( d->vcpu != NULL && d->vcpu[0] != NULL )
@@ -2251,6 +2277,10 @@ int hvm_vcpu_initialise(struct vcpu *v)
     if ( (rc = hvm_funcs.vcpu_initialise(v)) != 0 ) /* teardown: hvm_funcs.vcpu_destroy */
         goto fail3;
 
+    /* HVM_PARAM_VIRIDIAN may be set later: always ready for it. */
+    if ( (rc = viridian_vcpu_init(v)) != 0 ) /* teardown: viridian_vcpu_deinit */
+        goto fail4;
+
     softirq_tasklet_init(
         &v->arch.hvm_vcpu.assert_evtchn_irq_tasklet,
         (void(*)(unsigned long))hvm_assert_evtchn_irq,
@@ -2299,6 +2329,7 @@ int hvm_vcpu_initialise(struct vcpu *v)
  fail5:
     free_compat_arg_xlat(v);
  fail4:
+    viridian_vcpu_deinit(v);
     hvm_funcs.vcpu_destroy(v);
  fail3:
     vlapic_destroy(v);
@@ -2324,6 +2355,7 @@ void hvm_vcpu_destroy(struct vcpu *v)
     if ( is_hvm_vcpu(v) )
         vlapic_destroy(v);
 
+    viridian_vcpu_deinit(v);
     hvm_funcs.vcpu_destroy(v);
 }
 
@@ -2362,7 +2394,8 @@ static struct hvm_ioreq_server *hvm_select_ioreq_server(struct domain *d,
     struct hvm_ioreq_server *s;
     uint32_t cf8;
     uint8_t type;
-    uint64_t addr;
+    uint64_t addr, end;
+    struct hvm_ioreq_server_hit *hit;
 
     if ( list_empty(&d->arch.hvm_domain.ioreq_server.list) )
         return NULL;
@@ -2398,6 +2431,29 @@ static struct hvm_ioreq_server *hvm_select_ioreq_server(struct domain *d,
         addr = p->addr;
     }
 
+    switch ( type )
+    {
+    case IOREQ_TYPE_PIO:
+        end = addr + p->size - 1;
+        break;
+    case IOREQ_TYPE_COPY:
+        end = addr + (p->size * p->count) - 1;
+        break;
+    default:
+        end = addr;
+        break;
+    }
+
+    /* The same access as last time, typically a device register */
+    hit = &current->arch.hvm_vcpu.hvm_io.ioreq_server_hit;
+    if ( hit->server &&
+         hit->generation == d->arch.hvm_domain.ioreq_server.generation &&
+         hit->type == type && hit->addr == addr && hit->end == end )
+    {
+        s = hit->server;
+        goto found;
+    }
+
     list_for_each_entry ( s,
                           &d->arch.hvm_domain.ioreq_server.list,
                           list_entry )
@@ -2417,33 +2473,46 @@ static struct hvm_ioreq_server *hvm_select_ioreq_server(struct domain *d,
 
         switch ( type )
         {
-            unsigned long end;
-
         case IOREQ_TYPE_PIO:
-            end = addr + p->size - 1;
-            if ( rangeset_contains_range(r, addr, end) )
-                return s;
+            if ( rangeset_contains_range(r, addr, end) ||
+                 rangeset_contains_range(s->range[HVMOP_IO_RANGE_POSTED],
+                                         addr, end) )
+                goto cache;
 
             break;
         case IOREQ_TYPE_COPY:
-            end = addr + (p->size * p->count) - 1;
             if ( rangeset_contains_range(r, addr, end) )
-                return s;
+                goto cache;
 
             break;
         case IOREQ_TYPE_PCI_CONFIG:
             if ( rangeset_contains_singleton(r, addr >> 32) )
-            {
-                p->type = type;
-                p->addr = addr;
-                return s;
-            }
+                goto cache;
 
             break;
         }
     }
 
-    return d->arch.hvm_domain.default_ioreq_server;
+    s = d->arch.hvm_domain.default_ioreq_server;
+    if ( !s )
+        return NULL;
+
+ cache:
+    hit->server = s;
+    hit->generation = d->arch.hvm_domain.ioreq_server.generation;
+    hit->type = type;
+    hit->addr = addr;
+    hit->end = end;
+
+ found:
+    if ( type == IOREQ_TYPE_PCI_CONFIG &&
+         s != d->arch.hvm_domain.default_ioreq_server )
+    {
+        p->type = type;
+        p->addr = addr;
+    }
+
+    return s;
 
 #undef CF8_ADDR_ENABLED
 #undef CF8_ADDR_HI
@@ -2451,10 +2520,9 @@ static struct hvm_ioreq_server *hvm_select_ioreq_server(struct domain *d,
 #undef CF8_BDF
 }
 
-int hvm_buffered_io_send(ioreq_t *p)
+static int hvm_send_buffered_ioreq(struct hvm_ioreq_server *s, ioreq_t *p)
 {
     struct domain *d = current->domain;
-    struct hvm_ioreq_server *s = hvm_select_ioreq_server(d, p);
     struct hvm_ioreq_page *iorp;
     buffered_iopage_t *pg;
     buf_ioreq_t bp = { .data = p->data,
@@ -2535,6 +2603,35 @@ int hvm_buffered_io_send(ioreq_t *p)
     return 1;
 }
 
+int hvm_buffered_io_send(ioreq_t *p)
+{
+    return hvm_send_buffered_ioreq(hvm_select_ioreq_server(current->domain, p),
+                                   p);
+}
+
+/*
+ * Queue a port write for the server which mapped the port as posted, so
+ * that the vcpu does not wait for it.  Returns 0 for anything else, or if
+ * the ring is full, to be sent synchronously.
+ */
+bool_t hvm_posted_io_send(ioreq_t *p)
+{
+    struct domain *d = current->domain;
+    struct hvm_ioreq_server *s;
+
+    if ( p->type != IOREQ_TYPE_PIO || p->dir != IOREQ_WRITE ||
+         p->data_is_ptr || p->count != 1 )
+        return 0;
+
+    s = hvm_select_ioreq_server(d, p);
+    if ( !s || s == d->arch.hvm_domain.default_ioreq_server ||
+         !rangeset_contains_range(s->range[HVMOP_IO_RANGE_POSTED], p->addr,
+                                  p->addr + p->size - 1) )
+        return 0;
+
+    return hvm_send_buffered_ioreq(s, p);
+}
+
 bool_t hvm_has_dm(struct domain *d)
 {
     return !list_empty(&d->arch.hvm_domain.ioreq_server.list);
@@ -2816,7 +2913,7 @@ int hvm_hap_nested_page_fault(paddr_t gpa,
         if ( unlikely(is_pvh_vcpu(v)) )
             goto out;
 
-        if ( !handle_mmio() )
+        if ( !handle_mmio_with_gpa(gpa) )
             hvm_inject_hw_exception(TRAP_gp_fault, 0);
         rc = 1;
         goto out;
@@ -3221,6 +3318,8 @@ int hvm_set_cr3(unsigned long value)
     struct page_info *page;
     unsigned long old;
 
+    hvm_gtlb_flush(v);
+
     if ( hvm_paging_enabled(v) && !paging_mode_hap(v->domain) &&
          (value != v->arch.hvm_vcpu.guest_cr[3]) )
     {
@@ -3816,6 +3915,64 @@ void hvm_task_switch(
     hvm_unmap_entry(nptss_desc);
 }
 
+void hvm_gtlb_flush(struct vcpu *v)
+{
+    v->arch.hvm_vcpu.gtlb_nr = 0;
+    v->arch.hvm_vcpu.gtlb_next = 0;
+}
+
+void hvm_gtlb_invlpg(struct vcpu *v, unsigned long va)
+{
+    struct hvm_vcpu *hvm = &v->arch.hvm_vcpu;
+    unsigned int i;
+
+    for ( i = 0; i < hvm->gtlb_nr; i++ )
+        if ( hvm->gtlb[i].vpn == (va >> PAGE_SHIFT) )
+            hvm->gtlb[i].vpn = INVALID_GFN;
+}
+
+/*
+ * paging_gva_to_gfn() for a hypercall's copies: the guest is not running
+ * meanwhile, so a walk made for the same page and access holds until the
+ * hypercall returns. The p2m is still looked up by the caller each time.
+ */
+static unsigned long hvm_gtlb_gva_to_gfn(
+    struct vcpu *v, unsigned long addr, uint32_t *pfec)
+{
+    struct hvm_vcpu *hvm = &v->arch.hvm_vcpu;
+    unsigned long vpn = addr >> PAGE_SHIFT, gfn;
+    uint32_t access = *pfec;
+    unsigned int i;
+
+    if ( !hvm->gtlb_active || nestedhvm_vcpu_in_guestmode(v) )
+        return paging_gva_to_gfn(v, addr, pfec);
+
+    for ( i = 0; i < hvm->gtlb_nr; i++ )
+        if ( hvm->gtlb[i].vpn == vpn && hvm->gtlb[i].pfec == access )
+        {
+            perfc_incr(hvm_gtlb_hit);
+            return hvm->gtlb[i].gfn;
+        }
+
+    gfn = paging_gva_to_gfn(v, addr, pfec);
+    if ( gfn == INVALID_GFN )
+        return gfn;
+
+    perfc_incr(hvm_gtlb_miss);
+    if ( hvm->gtlb_nr < HVM_GTLB_ENTRIES )
+        i = hvm->gtlb_nr++;
+    else
+    {
+        i = hvm->gtlb_next;
+        hvm->gtlb_next = (i + 1) % HVM_GTLB_ENTRIES;
+    }
+    hvm->gtlb[i].vpn = vpn;
+    hvm->gtlb[i].gfn = gfn;
+    hvm->gtlb[i].pfec = access;
+
+    return gfn;
+}
+
 #define HVMCOPY_from_guest (0u<<0)
 #define HVMCOPY_to_guest   (1u<<0)
 #define HVMCOPY_no_fault   (0u<<1)
@@ -3854,7 +4011,7 @@ static enum hvm_copy_result __hvm_copy(
 
         if ( flags & HVMCOPY_virt )
         {
-            gfn = paging_gva_to_gfn(curr, addr, &pfec);
+            gfn = hvm_gtlb_gva_to_gfn(curr, addr, &pfec);
             if ( gfn == INVALID_GFN )
             {
                 if ( pfec == PFEC_page_paged )
@@ -3963,7 +4120,7 @@ static enum hvm_copy_result __hvm_clear(paddr_t addr, int size)
     {
         count = min_t(int, PAGE_SIZE - (addr & ~PAGE_MASK), todo);
 
-        gfn = paging_gva_to_gfn(curr, addr, &pfec);
+        gfn = hvm_gtlb_gva_to_gfn(curr, addr, &pfec);
         if ( gfn == INVALID_GFN )
         {
             if ( pfec == PFEC_page_paged )
@@ -4808,6 +4965,7 @@ int hvm_do_hypercall(struct cpu_user_regs *regs)
     }
 
     curr->arch.hvm_vcpu.hcall_preempted = 0;
+    curr->arch.hvm_vcpu.gtlb_active = 1;
 
     if ( mode == 8 )
     {
@@ -4843,6 +5001,9 @@ int hvm_do_hypercall(struct cpu_user_regs *regs)
                                                (uint32_t)regs->ebp);
     }
 
+    curr->arch.hvm_vcpu.gtlb_active = 0;
+    hvm_gtlb_flush(curr);
+
     HVM_DBG_LOG(DBG_LEVEL_HCALL, "hcall%u -> %lx",
                 eax, (unsigned long)regs->eax);
 
@@ -5379,6 +5540,41 @@ static int hvmop_set_ioreq_server_state(
     return rc;
 }
 
+static int hvmop_track_dirty_stdvga(
+    XEN_GUEST_HANDLE_PARAM(xen_hvm_track_dirty_stdvga_t) uop)
+{
+    xen_hvm_track_dirty_stdvga_t op;
+    struct domain *d;
+    int rc;
+
+    if ( copy_from_guest(&op, uop, 1) )
+        return -EFAULT;
+
+    rc = rcu_lock_remote_domain_by_id(op.domid, &d);
+    if ( rc != 0 )
+        return rc;
+
+    rc = -EINVAL;
+    if ( !is_hvm_domain(d) )
+        goto out;
+
+    rc = xsm_hvm_control(XSM_DM_PRIV, d, HVMOP_track_dirty_stdvga);
+    if ( rc != 0 )
+        goto out;
+
+    rc = -ESRCH;
+    if ( d->is_dying )
+        goto out;
+
+    rc = stdvga_track_dirty(d, !!op.enable, &op.dirty, op.vram);
+    if ( rc == 0 && __copy_to_guest(uop, &op, 1) )
+        rc = -EFAULT;
+
+ out:
+    rcu_unlock_domain(d);
+    return rc;
+}
+
 static int hvmop_destroy_ioreq_server(
     XEN_GUEST_HANDLE_PARAM(xen_hvm_destroy_ioreq_server_t) uop)
 {
@@ -5448,6 +5644,11 @@ long do_hvm_op(unsigned long op, XEN_GUEST_HANDLE_PARAM(void) arg)
         rc = hvmop_destroy_ioreq_server(
             guest_handle_cast(arg, xen_hvm_destroy_ioreq_server_t));
         break;
+
+    case HVMOP_track_dirty_stdvga:
+        rc = hvmop_track_dirty_stdvga(
+            guest_handle_cast(arg, xen_hvm_track_dirty_stdvga_t));
+        break;
     
     case HVMOP_set_param:
     case HVMOP_get_param:
@@ -5496,6 +5697,10 @@ long do_hvm_op(unsigned long op, XEN_GUEST_HANDLE_PARAM(void) arg)
                 if ( a.value > 1 )
                     rc = -EINVAL;
                 break;
+            case HVM_PARAM_VPT_MERGE:
+                if ( a.value > 1 )
+                    rc = -EINVAL;
+                break;
             case HVM_PARAM_IDENT_PT:
                 /* Not reflexive, as we must domain_pause(). */
                 rc = -EPERM;
@@ -6093,6 +6298,7 @@ static int hvm_memory_event_traps(long p, uint32_t reason,
 {
     struct vcpu* v = current;
     struct domain *d = v->domain;
+    struct mem_event_domain *med = mem_access_ring(d);
     mem_event_request_t req = { .reason = reason };
     int rc;
 
@@ -6102,7 +6308,7 @@ static int hvm_memory_event_traps(long p, uint32_t reason,
     if ( (p & HVMPME_onchangeonly) && (value == old) )
         return 1;
 
-    rc = mem_event_claim_slot(d, &d->mem_event->access);
+    rc = mem_event_claim_slot(d, med);
     if ( rc == -ENOSYS )
     {
         /* If there was no ring to handle the event, then
@@ -6131,7 +6337,7 @@ static int hvm_memory_event_traps(long p, uint32_t reason,
         req.gla = old;
     }
     
-    mem_event_put_request(d, &d->mem_event->access, &req);
+    mem_event_put_request(d, med, &req);
     
     return 1;
 }
@@ -166,7 +166,9 @@ static int hvm_mmio_access(struct vcpu *v,
 int hvm_mmio_intercept(ioreq_t *p)
 {
     struct vcpu *v = current;
-    int i;
+    const struct hvm_io_handler *handler = v->domain->arch.hvm_domain.io_handler;
+    const struct hvm_mmio_range *range;
+    int i, num;
 
     for ( i = 0; i < HVM_MMIO_HANDLER_NR; i++ )
         if ( hvm_mmio_handlers[i]->check_handler(v, p->addr) )
@@ -175,9 +177,56 @@ int hvm_mmio_intercept(ioreq_t *p)
                 hvm_mmio_handlers[i]->read_handler,
                 hvm_mmio_handlers[i]->write_handler);
 
+    num = handler->num_mmio;
+    smp_rmb();
+    for ( i = 0; i < num; i++ )
+    {
+        range = &handler->mmio_list[i];
+        if ( (p->addr >= range->addr) &&
+             ((p->addr + p->size) <= (range->addr + range->size)) )
+            return hvm_mmio_access(v, p, range->read, range->write);
+    }
+
     return X86EMUL_UNHANDLEABLE;
 }
 
+/*
+ * Have the accesses of d to [addr, addr + size) handled in Xen, like those
+ * to the emulated platform devices, rather than by the device model: for
+ * simple registers of a device emulated elsewhere, such as doorbells, that
+ * do not need the round trip.  Ranges can be added while the domain runs,
+ * but not removed.
+ */
+int register_mmio_handler(
+    struct domain *d, unsigned long addr, unsigned long size,
+    hvm_mmio_read_t read, hvm_mmio_write_t write)
+{
+    static DEFINE_SPINLOCK(lock);
+    struct hvm_io_handler *handler = d->arch.hvm_domain.io_handler;
+    struct hvm_mmio_range *range;
+    int rc = 0;
+
+    spin_lock(&lock);
+
+    if ( handler->num_mmio >= MAX_MMIO_HANDLER )
+    {
+        rc = -ENOSPC;
+        goto out;
+    }
+
+    range = &handler->mmio_list[handler->num_mmio];
+    range->addr = addr;
+    range->size = size;
+    range->read = read;
+    range->write = write;
+    smp_wmb();
+    handler->num_mmio++;
+
+ out:
+    spin_unlock(&lock);
+    return rc;
+}
+
 static int process_portio_intercept(portio_action_t action, ioreq_t *p)
 {
     struct hvm_vcpu_io *vio = &current->arch.hvm_vcpu.hvm_io;
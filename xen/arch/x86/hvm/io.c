@@ -88,14 +88,21 @@ int handle_mmio(void)
 
     hvm_emulate_prepare(&ctxt, guest_cpu_user_regs());
 
-    rc = hvm_emulate_one(&ctxt);
+    rc = X86EMUL_UNHANDLEABLE;
+    if ( vio->mmio_gpa_valid )
+        rc = hvm_emulate_one_cached(&ctxt, vio->mmio_gpa);
+    if ( rc == X86EMUL_UNHANDLEABLE )
+        rc = hvm_emulate_one(&ctxt);
 
     if ( rc != X86EMUL_RETRY )
         vio->io_state = HVMIO_none;
     if ( vio->io_state == HVMIO_awaiting_completion )
         vio->io_state = HVMIO_handle_mmio_awaiting_completion;
     else
+    {
         vio->mmio_gva = 0;
+        vio->mmio_gpa_valid = 0;
+    }
 
     switch ( rc )
     {
@@ -132,6 +139,16 @@ int handle_mmio_with_translation(unsigned long gva, unsigned long gpfn)
     return handle_mmio();
 }
 
+/* An MMIO exit which gave the guest physical address of the access */
+int handle_mmio_with_gpa(paddr_t gpa)
+{
+    struct hvm_vcpu_io *vio = &current->arch.hvm_vcpu.hvm_io;
+
+    vio->mmio_gpa = gpa;
+    vio->mmio_gpa_valid = 1;
+    return handle_mmio();
+}
+
 int handle_pio(uint16_t port, unsigned int size, int dir)
 {
     struct vcpu *curr = current;
@@ -34,6 +34,7 @@
 #include <asm/hvm/support.h>
 #include <xen/numa.h>
 #include <xen/paging.h>
+#include <xen/guest_access.h>
 
 #define VGA_MEM_BASE 0xa0000
 #define VGA_MEM_SIZE 0x20000
@@ -172,16 +173,267 @@ static void stdvga_out(uint32_t port, uint32_t bytes, uint32_t val)
     }
 }
 
+/*
+ * In chain-4 mode with all planes enabled for writing, window offset a is
+ * VRAM byte a for both reads and writes, so there is nothing to emulate.
+ * When the device model allows it, the window is then mapped onto the low
+ * vram pages as log-dirty RAM: reads never exit and writes fault once per
+ * page until the device model collects them.  Planar and odd/even modes, and
+ * anything that makes us stop caching, trap every access again.
+ */
+#define STDVGA_DIRECT_PAGES (VGA_MEM_SIZE >> PAGE_SHIFT)
+
+static void stdvga_direct_window(
+    struct hvm_hw_stdvga *s, unsigned int *first, unsigned int *nr)
+{
+    *first = *nr = 0;
+
+    if ( !s->direct || !s->stdvga || !s->cache ||
+         !(s->sr[4] & 0x08) || ((s->sr[2] & 0x0f) != 0x0f) )
+        return;
+
+    /* Same windows as stdvga_mem_offset(). */
+    switch ( (s->gr[6] >> 2) & 3 )
+    {
+    case 0:
+        *nr = 32;
+        break;
+    case 1:
+        *nr = 16;
+        break;
+    case 2:
+        *first = 16;
+        *nr = 8;
+        break;
+    default:
+    case 3:
+        *first = 24;
+        *nr = 8;
+        break;
+    }
+}
+
+/*
+ * Only pages the domain owns can sit in its p2m as RAM, so the low vram
+ * pages are swapped for domain pages the first time they get mapped.  They
+ * count against the domain's allocation, and hold an extra reference so that
+ * the guest freeing the gfn cannot take them away from us.
+ */
+static int stdvga_direct_own(struct domain *d, struct hvm_hw_stdvga *s)
+{
+    struct page_info *pg[STDVGA_DIRECT_PAGES], *old;
+    unsigned int i;
+    void *src, *dst;
+
+    for ( i = 0; i < ARRAY_SIZE(pg); i++ )
+    {
+        pg[i] = alloc_domheap_page(d, MEMF_node(domain_to_node(d)));
+        if ( pg[i] == NULL )
+            break;
+        if ( !get_page(pg[i], d) )
+        {
+            if ( test_and_clear_bit(_PGC_allocated, &pg[i]->count_info) )
+                put_page(pg[i]);
+            break;
+        }
+    }
+
+    if ( i < ARRAY_SIZE(pg) )
+    {
+        while ( i-- )
+        {
+            put_page(pg[i]);
+            if ( test_and_clear_bit(_PGC_allocated, &pg[i]->count_info) )
+                put_page(pg[i]);
+        }
+        return -ENOMEM;
+    }
+
+    spin_lock(&s->lock);
+    for ( i = 0; i < ARRAY_SIZE(pg); i++ )
+    {
+        old = s->vram_page[i];
+        dst = __map_domain_page(pg[i]);
+        src = __map_domain_page(old);
+        copy_page(dst, src);
+        unmap_domain_page(src);
+        unmap_domain_page(dst);
+        set_gpfn_from_mfn(page_to_mfn(pg[i]), INVALID_M2P_ENTRY);
+        s->vram_page[i] = pg[i];
+        pg[i] = old;
+    }
+    s->direct_owned = 1;
+    spin_unlock(&s->lock);
+
+    for ( i = 0; i < ARRAY_SIZE(pg); i++ )
+        free_domheap_page(pg[i]);
+
+    return 0;
+}
+
+/* Collect writes into the mapped window; if @unmap, also remove it. */
+static void stdvga_direct_collect(
+    struct domain *d, struct hvm_hw_stdvga *s, bool_t unmap)
+{
+    unsigned long gfn;
+    unsigned int i;
+    p2m_type_t t;
+    mfn_t mfn;
+
+    ASSERT(spin_is_locked(&s->direct_lock));
+
+    for ( i = 0; i < s->direct_nr; i++ )
+    {
+        gfn = (VGA_MEM_BASE >> PAGE_SHIFT) + s->direct_first + i;
+        mfn = get_gfn_query(d, gfn, &t);
+        /* Skip anything the guest put there in our place. */
+        if ( mfn_x(mfn) == page_to_mfn(s->vram_page[i]) )
+        {
+            if ( unmap )
+            {
+                if ( t == p2m_ram_rw )
+                    s->direct_dirty |= 1u << i;
+                guest_physmap_remove_page(d, gfn, mfn_x(mfn), 0);
+            }
+            else if ( !p2m_change_type_one(d, gfn, p2m_ram_rw,
+                                           p2m_ram_logdirty) )
+                s->direct_dirty |= 1u << i;
+        }
+        put_gfn(d, gfn);
+    }
+
+    if ( unmap )
+        s->direct_first = s->direct_nr = 0;
+}
+
+/* Bring the direct mapping in line with the current VGA state. */
+static int stdvga_direct_update(struct domain *d, struct hvm_hw_stdvga *s)
+{
+    unsigned int first, nr, i;
+    int rc = 0;
+
+    ASSERT(spin_is_locked(&s->direct_lock));
+
+    spin_lock(&s->lock);
+    stdvga_direct_window(s, &first, &nr);
+    spin_unlock(&s->lock);
+
+    if ( first == s->direct_first && nr == s->direct_nr )
+        return 0;
+
+    stdvga_direct_collect(d, s, 1);
+    if ( nr == 0 )
+        return 0;
+
+    if ( !s->direct_owned )
+        rc = stdvga_direct_own(d, s);
+
+    for ( i = 0; !rc && i < nr; i++ )
+    {
+        rc = guest_physmap_add_entry(d, (VGA_MEM_BASE >> PAGE_SHIFT) + first + i,
+                                     page_to_mfn(s->vram_page[i]), 0,
+                                     p2m_ram_logdirty);
+        if ( rc == 0 )
+        {
+            s->direct_first = first;
+            s->direct_nr = i + 1;
+        }
+    }
+
+    if ( rc )
+    {
+        gdprintk(XENLOG_WARNING, "cannot map vga window (%d), trapping\n", rc);
+        stdvga_direct_collect(d, s, 1);
+        spin_lock(&s->lock);
+        s->direct = 0;
+        spin_unlock(&s->lock);
+    }
+
+    return rc;
+}
+
+static void stdvga_direct_sync(struct domain *d, struct hvm_hw_stdvga *s)
+{
+    if ( !s->direct && !s->direct_nr )
+        return;
+
+    spin_lock(&s->direct_lock);
+    stdvga_direct_update(d, s);
+    spin_unlock(&s->direct_lock);
+}
+
+int stdvga_track_dirty(struct domain *d, bool_t enable, uint32_t *dirty,
+                       XEN_GUEST_HANDLE_64(uint8) vram)
+{
+    struct hvm_hw_stdvga *s = &d->arch.hvm_domain.stdvga;
+    unsigned int i;
+    uint32_t bits;
+    void *p;
+    int rc;
+
+    if ( !hap_enabled(d) )
+        return -EOPNOTSUPP;
+
+    /* stdvga_init() could not allocate the vram copy. */
+    if ( s->vram_page[ARRAY_SIZE(s->vram_page) - 1] == NULL )
+        return -ENODEV;
+
+    spin_lock(&s->direct_lock);
+
+    spin_lock(&s->lock);
+    s->direct = enable;
+    spin_unlock(&s->lock);
+
+    rc = stdvga_direct_update(d, s);
+    if ( rc )
+    {
+        spin_unlock(&s->direct_lock);
+        return rc;
+    }
+
+    stdvga_direct_collect(d, s, 0);
+    bits = s->direct_dirty;
+    s->direct_dirty = 0;
+
+    spin_unlock(&s->direct_lock);
+
+    /*
+     * The pages were write-protected again above, so a guest write racing
+     * with the copy will show up in the next call.
+     */
+    for ( i = 0; !guest_handle_is_null(vram) && i < STDVGA_DIRECT_PAGES; i++ )
+    {
+        if ( !(bits & (1u << i)) )
+            continue;
+        p = __map_domain_page(s->vram_page[i]);
+        rc = copy_to_guest_offset(vram, i << PAGE_SHIFT, (uint8_t *)p,
+                                  PAGE_SIZE) ? -EFAULT : 0;
+        unmap_domain_page(p);
+        if ( rc )
+        {
+            spin_lock(&s->direct_lock);
+            s->direct_dirty |= bits;
+            spin_unlock(&s->direct_lock);
+            return rc;
+        }
+    }
+
+    *dirty = bits;
+    return 0;
+}
+
 static int stdvga_intercept_pio(
     int dir, uint32_t port, uint32_t bytes, uint32_t *val)
 {
-    struct hvm_hw_stdvga *s = &current->domain->arch.hvm_domain.stdvga;
+    struct domain *d = current->domain;
+    struct hvm_hw_stdvga *s = &d->arch.hvm_domain.stdvga;
 
     if ( dir == IOREQ_WRITE )
     {
         spin_lock(&s->lock);
         stdvga_out(port, bytes, *val);
         spin_unlock(&s->lock);
+        stdvga_direct_sync(d, s);
     }
 
     return X86EMUL_UNHANDLEABLE; /* propagate to external ioemu */
@@ -584,6 +836,9 @@ static int stdvga_intercept_mmio(ioreq_t *p)
 
     spin_unlock(&s->lock);
 
+    if ( !s->cache )
+        stdvga_direct_sync(d, s);
+
     return rc ? X86EMUL_OKAY : X86EMUL_UNHANDLEABLE;
 }
 
@@ -596,6 +851,7 @@ void stdvga_init(struct domain *d)
 
     memset(s, 0, sizeof(*s));
     spin_lock_init(&s->lock);
+    spin_lock_init(&s->direct_lock);
     
     for ( i = 0; i != ARRAY_SIZE(s->vram_page); i++ )
     {
@@ -620,6 +876,26 @@ void stdvga_init(struct domain *d)
     }
 }
 
+void stdvga_relinquish(struct domain *d)
+{
+    struct hvm_hw_stdvga *s = &d->arch.hvm_domain.stdvga;
+    int i;
+
+    if ( !s->direct_owned )
+        return;
+
+    /*
+     * relinquish_memory() has dropped the allocation references already;
+     * dropping ours frees the pages and lets the domain go.
+     */
+    for ( i = 0; i != STDVGA_DIRECT_PAGES; i++ )
+    {
+        put_page(s->vram_page[i]);
+        s->vram_page[i] = NULL;
+    }
+    s->direct_owned = 0;
+}
+
 void stdvga_deinit(struct domain *d)
 {
     struct hvm_hw_stdvga *s = &d->arch.hvm_domain.stdvga;
@@ -2148,6 +2148,7 @@ static void svm_invlpg_intercept(unsigned long vaddr)
 {
     struct vcpu *curr = current;
     HVMTRACE_LONG_2D(INVLPG, 0, TRC_PAR_LONG(vaddr));
+    hvm_gtlb_invlpg(curr, vaddr);
     paging_invlpg(curr, vaddr);
     svm_asid_g_invlpg(curr, vaddr);
 }
@@ -9,10 +9,13 @@
 #include <xen/perfc.h>
 #include <xen/hypercall.h>
 #include <xen/domain_page.h>
+#include <xen/event.h>
 #include <asm/paging.h>
+#include <asm/time.h>
 #include <asm/p2m.h>
 #include <asm/apic.h>
 #include <asm/hvm/support.h>
+#include <asm/hvm/vlapic.h>
 #include <public/sched.h>
 #include <public/hvm/hvm_op.h>
 
@@ -21,12 +24,22 @@
 #define VIRIDIAN_MSR_HYPERCALL                  0x40000001
 #define VIRIDIAN_MSR_VP_INDEX                   0x40000002
 #define VIRIDIAN_MSR_TIME_REF_COUNT             0x40000020
+#define VIRIDIAN_MSR_REFERENCE_TSC              0x40000021
 #define VIRIDIAN_MSR_TSC_FREQUENCY              0x40000022
 #define VIRIDIAN_MSR_APIC_FREQUENCY             0x40000023
 #define VIRIDIAN_MSR_EOI                        0x40000070
 #define VIRIDIAN_MSR_ICR                        0x40000071
 #define VIRIDIAN_MSR_TPR                        0x40000072
 #define VIRIDIAN_MSR_APIC_ASSIST                0x40000073
+#define VIRIDIAN_MSR_SCONTROL                   0x40000080
+#define VIRIDIAN_MSR_SVERSION                   0x40000081
+#define VIRIDIAN_MSR_SIEFP                      0x40000082
+#define VIRIDIAN_MSR_SIMP                       0x40000083
+#define VIRIDIAN_MSR_EOM                        0x40000084
+#define VIRIDIAN_MSR_SINT0                      0x40000090
+#define VIRIDIAN_MSR_SINT15                     0x4000009F
+#define VIRIDIAN_MSR_STIMER0_CONFIG             0x400000B0
+#define VIRIDIAN_MSR_STIMER3_COUNT              0x400000B7
 
 /* Viridian Hypercall Status Codes. */
 #define HV_STATUS_SUCCESS                       0x0000
@@ -37,14 +50,49 @@
 
 /* Viridian CPUID 4000003, Viridian MSR availability. */
 #define CPUID3A_MSR_REF_COUNT   (1 << 1)
+#define CPUID3A_MSR_SYNIC       (1 << 2)
+#define CPUID3A_MSR_SYNTIMER    (1 << 3)
 #define CPUID3A_MSR_APIC_ACCESS (1 << 4)
 #define CPUID3A_MSR_HYPERCALL   (1 << 5)
 #define CPUID3A_MSR_VP_INDEX    (1 << 6)
+#define CPUID3A_MSR_REFERENCE_TSC (1 << 9)
 #define CPUID3A_MSR_FREQ        (1 << 11)
+#define CPUID3D_DIRECT_STIMER   (1 << 19)
 
 /* Viridian CPUID 4000004, Implementation Recommendations. */
 #define CPUID4A_MSR_BASED_APIC  (1 << 3)
 #define CPUID4A_RELAX_TIMER_INT (1 << 5)
+#define CPUID4A_DEPRECATE_AUTOEOI (1 << 9)
+
+/* SynIC message types and flags. */
+#define HVMSG_NONE              0x00000000
+#define HVMSG_TIMER_EXPIRED     0x80000010
+#define HVMSG_FLAG_PENDING      (1 << 0)
+
+/* A slot of the SynIC message page: there is one per SINT. */
+struct viridian_message {
+    uint32_t type;
+    uint8_t  payload_size;
+    uint8_t  flags;
+    uint16_t reserved;
+    uint64_t origin;
+    union {
+        uint64_t raw[30];
+        struct {
+            uint32_t index;
+            uint32_t reserved;
+            uint64_t expiration;
+            uint64_t delivery;
+        } timer;
+    } payload;
+};
+
+struct viridian_reference_tsc {
+    uint32_t sequence;
+    uint32_t reserved1;
+    uint64_t scale;
+    int64_t  offset;
+};
 
 /* Viridian CPUID 4000006, Implementation HW features detected and in use. */
 #define CPUID6A_APIC_OVERLAY    (1 << 0)
@@ -88,10 +136,15 @@ int cpuid_viridian_leaves(unsigned int leaf, unsigned int *eax,
         break;
     case 3:
         /* Which hypervisor MSRs are available to the guest */
-        *eax = (CPUID3A_MSR_APIC_ACCESS |
-                CPUID3A_MSR_HYPERCALL   |
-                CPUID3A_MSR_VP_INDEX    |
+        *eax = (CPUID3A_MSR_REF_COUNT     |
+                CPUID3A_MSR_SYNIC         |
+                CPUID3A_MSR_SYNTIMER      |
+                CPUID3A_MSR_APIC_ACCESS   |
+                CPUID3A_MSR_HYPERCALL     |
+                CPUID3A_MSR_VP_INDEX      |
+                CPUID3A_MSR_REFERENCE_TSC |
                 CPUID3A_MSR_FREQ);
+        *edx = CPUID3D_DIRECT_STIMER;
         break;
     case 4:
         /* Recommended hypercall usage. */
@@ -101,6 +154,9 @@ int cpuid_viridian_leaves(unsigned int leaf, unsigned int *eax,
         *eax = CPUID4A_RELAX_TIMER_INT;
         if ( !cpu_has_vmx_apic_reg_virt )
             *eax |= CPUID4A_MSR_BASED_APIC;
+        /* With virtual interrupt delivery the ISR isn't ours to clear. */
+        if ( vlapic_virtual_intr_delivery_enabled() )
+            *eax |= CPUID4A_DEPRECATE_AUTOEOI;
         *ebx = 2047; /* long spin count */
         break;
     case 6:
@@ -221,6 +277,321 @@ static void initialize_apic_assist(struct vcpu *v)
     put_page_and_type(page);
 }
 
+/*
+ * Map the guest frame gmfn writable, as the overlay pages above are.
+ * Returns NULL, with a warning, if it is no such frame.
+ */
+static void *map_overlay_page(struct domain *d, unsigned long gmfn,
+                              struct page_info **ppage)
+{
+    struct page_info *page = get_page_from_gfn(d, gmfn, NULL, P2M_ALLOC);
+
+    if ( !page || !get_page_type(page, PGT_writable_page) )
+    {
+        if ( page )
+            put_page(page);
+        gdprintk(XENLOG_WARNING, "Bad GMFN %lx (MFN %lx)\n", gmfn,
+                 page ? page_to_mfn(page) : INVALID_MFN);
+        return NULL;
+    }
+
+    *ppage = page;
+    return __map_domain_page(page);
+}
+
+static void unmap_overlay_page(void *p, struct page_info *page)
+{
+    unmap_domain_page(p);
+    put_page_and_type(page);
+}
+
+/*
+ * The partition reference time counts 100ns units. It is derived from the
+ * guest TSC exactly as the guest does from the reference TSC page,
+ * ((tsc * scale) >> 64), so that the MSR and the page always agree.
+ */
+static uint64_t reference_tsc_scale(const struct domain *d)
+{
+    uint64_t khz = d->arch.tsc_khz ?: cpu_khz, scale, rem;
+
+    /* (10000 << 64) / khz: no TSC runs as slow as 10MHz, so no overflow. */
+    asm ( "divq %4" : "=a" (scale), "=d" (rem)
+                    : "0" (0ul), "1" (10000ul), "rm" (khz) );
+    return scale;
+}
+
+static uint64_t time_ref_count(struct vcpu *v)
+{
+    uint64_t tsc = hvm_get_guest_tsc(v), hi, lo;
+
+    asm ( "mulq %3" : "=a" (lo), "=d" (hi)
+                    : "0" (tsc), "rm" (reference_tsc_scale(v->domain)) );
+    return hi;
+}
+
+/*
+ * The page is only valid if the guest TSC is: invariant and synchronised
+ * across cpus, and not emulated. A sequence of 0 tells the guest to fall
+ * back to the TIME_REF_COUNT MSR (0xFFFFFFFF would by the specification,
+ * but Server 2012 only understands 0).
+ */
+static void update_reference_tsc(struct domain *d)
+{
+    unsigned long gmfn = d->arch.hvm_domain.viridian.reference_tsc.fields.pfn;
+    struct viridian_reference_tsc *p;
+    struct page_info *page;
+    uint32_t seq;
+
+    p = map_overlay_page(d, gmfn, &page);
+    if ( p == NULL )
+        return;
+
+    if ( !host_tsc_is_safe() || d->arch.vtsc )
+    {
+        p->sequence = 0;
+        unmap_overlay_page(p, page);
+        return;
+    }
+
+    p->sequence = 0;
+    wmb();
+    p->scale = reference_tsc_scale(d);
+    p->offset = 0;
+    wmb();
+    seq = p->sequence + 1;
+    if ( seq == 0xFFFFFFFF || seq == 0 )
+        seq = 1;
+    p->sequence = seq;
+
+    unmap_overlay_page(p, page);
+}
+
+/*
+ * Synthetic timers. The Xen timer only marks the stimer expired and kicks
+ * the vcpu: all else is done in the vcpu's own context, from
+ * viridian_poll_timers() on its way to checking for interrupts.
+ */
+static void stimer_expire(void *data)
+{
+    struct viridian_stimer *st = data;
+
+    set_bit(st->index, &st->v->arch.hvm_vcpu.viridian.synic->stimer_pending);
+    vcpu_kick(st->v);
+}
+
+static void stimer_stop(struct viridian_stimer *st)
+{
+    stop_timer(&st->timer);
+    clear_bit(st->index, &st->v->arch.hvm_vcpu.viridian.synic->stimer_pending);
+}
+
+static void stimer_start(struct viridian_stimer *st, uint64_t now)
+{
+    if ( st->config.fields.periodic )
+    {
+        /* Pick up missed periods, don't try to catch up with them. */
+        if ( !st->expiration || now >= st->expiration + st->count )
+            st->expiration = now + st->count;
+        else
+            st->expiration += st->count;
+    }
+    else
+        st->expiration = st->count;
+
+    set_timer(&st->timer, NOW() + ((st->expiration > now)
+                                   ? (st->expiration - now) * 100 : 0));
+}
+
+static void stimer_reset(struct viridian_stimer *st)
+{
+    stimer_stop(st);
+    st->expiration = 0;
+    if ( st->config.fields.enabled && st->count )
+        stimer_start(st, time_ref_count(st->v));
+}
+
+/*
+ * Post the expiry message of st in its SINT's slot and raise the SINT.
+ * Returns 0 if the slot is still busy: the guest will write EOM once
+ * it freed it, when delivery will be tried again.
+ */
+static bool_t stimer_deliver_msg(struct viridian_stimer *st, uint64_t now)
+{
+    struct vcpu *v = st->v;
+    struct viridian_synic *vs = v->arch.hvm_vcpu.viridian.synic;
+    unsigned int sintx = st->config.fields.sintx;
+    struct viridian_message *msg;
+    struct page_info *page;
+
+    if ( !(vs->scontrol & 1) || !vs->simp.fields.enabled )
+        return 1;
+
+    msg = map_overlay_page(v->domain, vs->simp.fields.pfn, &page);
+    if ( msg == NULL )
+        return 1;
+    msg += sintx;
+
+    if ( msg->type != HVMSG_NONE )
+    {
+        msg->flags |= HVMSG_FLAG_PENDING;
+        unmap_overlay_page(msg, page);
+        return 0;
+    }
+
+    msg->payload_size = sizeof(msg->payload.timer);
+    msg->flags = 0;
+    msg->origin = 0;
+    msg->payload.timer.index = st->index;
+    msg->payload.timer.reserved = 0;
+    msg->payload.timer.expiration = st->expired;
+    msg->payload.timer.delivery = now;
+    wmb();
+    msg->type = HVMSG_TIMER_EXPIRED;
+    unmap_overlay_page(msg, page);
+
+    if ( !vs->sint[sintx].fields.mask )
+        vlapic_set_irq(vcpu_vlapic(v), vs->sint[sintx].fields.vector, 0);
+
+    return 1;
+}
+
+void viridian_poll_timers(struct vcpu *v)
+{
+    struct viridian_synic *vs = v->arch.hvm_vcpu.viridian.synic;
+    struct viridian_stimer *st;
+    unsigned int i;
+    uint64_t now;
+
+    if ( v != current || !vs->stimer_pending )
+        return;
+
+    now = time_ref_count(v);
+    for ( i = 0; i < VIRIDIAN_STIMER_COUNT; i++ )
+    {
+        if ( !test_and_clear_bit(i, &vs->stimer_pending) )
+            continue;
+        st = &vs->stimer[i];
+
+        /* Expired afresh, rather than again after EOM? */
+        if ( !test_and_clear_bit(i, &vs->stimer_msg_pending) )
+        {
+            if ( !st->config.fields.enabled )
+                continue;
+            perfc_incr(mshv_stimer_expired);
+            st->expired = st->expiration;
+            if ( st->config.fields.periodic )
+                stimer_start(st, now);
+            else
+                st->config.fields.enabled = 0;
+        }
+
+        if ( st->config.fields.direct_mode )
+            vlapic_set_irq(vcpu_vlapic(v), st->config.fields.vector, 0);
+        else if ( !stimer_deliver_msg(st, now) )
+            set_bit(i, &vs->stimer_msg_pending);
+    }
+}
+
+/* The guest freed a message slot: retry the deliveries waiting for one. */
+static void synic_eom(struct vcpu *v)
+{
+    struct viridian_synic *vs = v->arch.hvm_vcpu.viridian.synic;
+    unsigned int i;
+
+    for ( i = 0; i < VIRIDIAN_STIMER_COUNT; i++ )
+        if ( test_bit(i, &vs->stimer_msg_pending) )
+            set_bit(i, &vs->stimer_pending);
+}
+
+bool_t viridian_sint_auto_eoi(struct vcpu *v, uint8_t vector)
+{
+    struct viridian_synic *vs = v->arch.hvm_vcpu.viridian.synic;
+    unsigned int i;
+
+    if ( !is_viridian_domain(v->domain) || !(vs->scontrol & 1) )
+        return 0;
+
+    for ( i = 0; i < VIRIDIAN_SINT_COUNT; i++ )
+        if ( vs->sint[i].fields.auto_eoi && !vs->sint[i].fields.mask &&
+             vs->sint[i].fields.vector == vector )
+            return 1;
+
+    return 0;
+}
+
+int viridian_vcpu_init(struct vcpu *v)
+{
+    struct viridian_synic *vs = xzalloc(struct viridian_synic);
+    unsigned int i;
+
+    if ( vs == NULL )
+        return -ENOMEM;
+    v->arch.hvm_vcpu.viridian.synic = vs;
+
+    for ( i = 0; i < VIRIDIAN_SINT_COUNT; i++ )
+        vs->sint[i].fields.mask = 1;
+
+    for ( i = 0; i < VIRIDIAN_STIMER_COUNT; i++ )
+    {
+        vs->stimer[i].v = v;
+        vs->stimer[i].index = i;
+        init_timer(&vs->stimer[i].timer, stimer_expire, &vs->stimer[i],
+                   v->processor);
+    }
+
+    return 0;
+}
+
+void viridian_vcpu_deinit(struct vcpu *v)
+{
+    struct viridian_synic *vs = v->arch.hvm_vcpu.viridian.synic;
+    unsigned int i;
+
+    if ( vs == NULL )
+        return;
+
+    for ( i = 0; i < VIRIDIAN_STIMER_COUNT; i++ )
+        kill_timer(&vs->stimer[i].timer);
+    xfree(vs);
+    v->arch.hvm_vcpu.viridian.synic = NULL;
+}
+
+void viridian_migrate_timers(struct vcpu *v)
+{
+    unsigned int i;
+
+    for ( i = 0; i < VIRIDIAN_STIMER_COUNT; i++ )
+        migrate_timer(&v->arch.hvm_vcpu.viridian.synic->stimer[i].timer,
+                      v->processor);
+}
+
+static void wrmsr_stimer(struct vcpu *v, uint32_t idx, uint64_t val)
+{
+    struct viridian_stimer *st =
+        &v->arch.hvm_vcpu.viridian.synic->stimer[(idx - VIRIDIAN_MSR_STIMER0_CONFIG) / 2];
+
+    if ( !((idx - VIRIDIAN_MSR_STIMER0_CONFIG) & 1) )
+    {
+        st->config.raw = val;
+        st->config.fields.reserved_zero1 = 0;
+        st->config.fields.reserved_zero2 = 0;
+        /* Messages can't go to SINT0, nor vectors below 16 anywhere. */
+        if ( st->config.fields.direct_mode ? st->config.fields.vector < 16
+                                           : !st->config.fields.sintx )
+            st->config.fields.enabled = 0;
+    }
+    else
+    {
+        st->count = val;
+        if ( !val )
+            st->config.fields.enabled = 0;
+        else if ( st->config.fields.auto_enable )
+            st->config.fields.enabled = 1;
+    }
+
+    stimer_reset(st);
+}
+
 int wrmsr_viridian_regs(uint32_t idx, uint64_t val)
 {
     struct vcpu *v = current;
@@ -279,6 +650,43 @@ int wrmsr_viridian_regs(uint32_t idx, uint64_t val)
             initialize_apic_assist(v);
         break;
 
+    case VIRIDIAN_MSR_REFERENCE_TSC:
+        perfc_incr(mshv_wrmsr_reference_tsc);
+        d->arch.hvm_domain.viridian.reference_tsc.raw = val;
+        if ( d->arch.hvm_domain.viridian.reference_tsc.fields.enabled )
+            update_reference_tsc(d);
+        break;
+
+    case VIRIDIAN_MSR_SCONTROL:
+        perfc_incr(mshv_wrmsr_synic);
+        v->arch.hvm_vcpu.viridian.synic->scontrol = val;
+        break;
+
+    case VIRIDIAN_MSR_SIEFP:
+        perfc_incr(mshv_wrmsr_synic);
+        v->arch.hvm_vcpu.viridian.synic->siefp.raw = val;
+        break;
+
+    case VIRIDIAN_MSR_SIMP:
+        perfc_incr(mshv_wrmsr_synic);
+        v->arch.hvm_vcpu.viridian.synic->simp.raw = val;
+        break;
+
+    case VIRIDIAN_MSR_EOM:
+        perfc_incr(mshv_wrmsr_synic);
+        synic_eom(v);
+        break;
+
+    case VIRIDIAN_MSR_SINT0 ... VIRIDIAN_MSR_SINT15:
+        perfc_incr(mshv_wrmsr_synic);
+        v->arch.hvm_vcpu.viridian.synic->sint[idx - VIRIDIAN_MSR_SINT0].raw = val;
+        break;
+
+    case VIRIDIAN_MSR_STIMER0_CONFIG ... VIRIDIAN_MSR_STIMER3_COUNT:
+        perfc_incr(mshv_wrmsr_stimer);
+        wrmsr_stimer(v, idx, val);
+        break;
+
     default:
         return 0;
     }
@@ -337,6 +745,57 @@ int rdmsr_viridian_regs(uint32_t idx, uint64_t *val)
         *val = v->arch.hvm_vcpu.viridian.apic_assist.raw;
         break;
 
+    case VIRIDIAN_MSR_TIME_REF_COUNT:
+        perfc_incr(mshv_rdmsr_time_ref_count);
+        *val = time_ref_count(v);
+        break;
+
+    case VIRIDIAN_MSR_REFERENCE_TSC:
+        perfc_incr(mshv_rdmsr_reference_tsc);
+        *val = d->arch.hvm_domain.viridian.reference_tsc.raw;
+        break;
+
+    case VIRIDIAN_MSR_SCONTROL:
+        perfc_incr(mshv_rdmsr_synic);
+        *val = v->arch.hvm_vcpu.viridian.synic->scontrol;
+        break;
+
+    case VIRIDIAN_MSR_SVERSION:
+        perfc_incr(mshv_rdmsr_synic);
+        *val = 1;
+        break;
+
+    case VIRIDIAN_MSR_SIEFP:
+        perfc_incr(mshv_rdmsr_synic);
+        *val = v->arch.hvm_vcpu.viridian.synic->siefp.raw;
+        break;
+
+    case VIRIDIAN_MSR_SIMP:
+        perfc_incr(mshv_rdmsr_synic);
+        *val = v->arch.hvm_vcpu.viridian.synic->simp.raw;
+        break;
+
+    case VIRIDIAN_MSR_EOM:
+        perfc_incr(mshv_rdmsr_synic);
+        *val = 0;
+        break;
+
+    case VIRIDIAN_MSR_SINT0 ... VIRIDIAN_MSR_SINT15:
+        perfc_incr(mshv_rdmsr_synic);
+        *val = v->arch.hvm_vcpu.viridian.synic->sint[idx - VIRIDIAN_MSR_SINT0].raw;
+        break;
+
+    case VIRIDIAN_MSR_STIMER0_CONFIG ... VIRIDIAN_MSR_STIMER3_COUNT:
+    {
+        struct viridian_stimer *st = &v->arch.hvm_vcpu.viridian.synic->stimer[
+            (idx - VIRIDIAN_MSR_STIMER0_CONFIG) / 2];
+
+        perfc_incr(mshv_rdmsr_stimer);
+        *val = ((idx - VIRIDIAN_MSR_STIMER0_CONFIG) & 1) ? st->count
+                                                         : st->config.raw;
+        break;
+    }
+
     default:
         return 0;
     }
@@ -426,6 +885,7 @@ static int viridian_save_domain_ctxt(struct domain *d, hvm_domain_context_t *h)
 
     ctxt.hypercall_gpa = d->arch.hvm_domain.viridian.hypercall_gpa.raw;
     ctxt.guest_os_id   = d->arch.hvm_domain.viridian.guest_os_id.raw;
+    ctxt.reference_tsc = d->arch.hvm_domain.viridian.reference_tsc.raw;
 
     return (hvm_save_entry(VIRIDIAN_DOMAIN, 0, h, &ctxt) != 0);
 }
@@ -434,11 +894,16 @@ static int viridian_load_domain_ctxt(struct domain *d, hvm_domain_context_t *h)
 {
     struct hvm_viridian_domain_context ctxt;
 
-    if ( hvm_load_entry(VIRIDIAN_DOMAIN, h, &ctxt) != 0 )
+    if ( hvm_load_entry_zeroextend(VIRIDIAN_DOMAIN, h, &ctxt) != 0 )
         return -EINVAL;
 
     d->arch.hvm_domain.viridian.hypercall_gpa.raw = ctxt.hypercall_gpa;
     d->arch.hvm_domain.viridian.guest_os_id.raw   = ctxt.guest_os_id;
+    d->arch.hvm_domain.viridian.reference_tsc.raw = ctxt.reference_tsc;
+
+    /* The scale depends on this host's TSC, which may not be as valid. */
+    if ( d->arch.hvm_domain.viridian.reference_tsc.fields.enabled )
+        update_reference_tsc(d);
 
     return 0;
 }
@@ -454,9 +919,21 @@ static int viridian_save_vcpu_ctxt(struct domain *d, hvm_domain_context_t *h)
         return 0;
 
     for_each_vcpu( d, v ) {
+        struct viridian_synic *vs = v->arch.hvm_vcpu.viridian.synic;
         struct hvm_viridian_vcpu_context ctxt;
+        unsigned int i;
 
         ctxt.apic_assist = v->arch.hvm_vcpu.viridian.apic_assist.raw;
+        ctxt.scontrol = vs->scontrol;
+        ctxt.siefp = vs->siefp.raw;
+        ctxt.simp = vs->simp.raw;
+        for ( i = 0; i < VIRIDIAN_SINT_COUNT; i++ )
+            ctxt.sint[i] = vs->sint[i].raw;
+        for ( i = 0; i < VIRIDIAN_STIMER_COUNT; i++ )
+        {
+            ctxt.stimer_config[i] = vs->stimer[i].config.raw;
+            ctxt.stimer_count[i] = vs->stimer[i].count;
+        }
 
         if ( hvm_save_entry(VIRIDIAN_VCPU, v->vcpu_id, h, &ctxt) != 0 )
             return 1;
@@ -469,7 +946,9 @@ static int viridian_load_vcpu_ctxt(struct domain *d, hvm_domain_context_t *h)
 {
     int vcpuid;
     struct vcpu *v;
+    struct viridian_synic *vs;
     struct hvm_viridian_vcpu_context ctxt;
+    unsigned int i;
 
     vcpuid = hvm_load_instance(h);
     if ( vcpuid >= d->max_vcpus || (v = d->vcpu[vcpuid]) == NULL )
@@ -479,10 +958,23 @@ static int viridian_load_vcpu_ctxt(struct domain *d, hvm_domain_context_t *h)
         return -EINVAL;
     }
 
-    if ( hvm_load_entry(VIRIDIAN_VCPU, h, &ctxt) != 0 )
+    if ( hvm_load_entry_zeroextend(VIRIDIAN_VCPU, h, &ctxt) != 0 )
         return -EINVAL;
 
     v->arch.hvm_vcpu.viridian.apic_assist.raw = ctxt.apic_assist;
+    vs = v->arch.hvm_vcpu.viridian.synic;
+    vs->scontrol = ctxt.scontrol;
+    vs->siefp.raw = ctxt.siefp;
+    vs->simp.raw = ctxt.simp;
+    /* A zero SINT, as from streams from before the SynIC, is masked. */
+    for ( i = 0; i < VIRIDIAN_SINT_COUNT; i++ )
+        vs->sint[i].raw = ctxt.sint[i] ?: (1ul << 16);
+    for ( i = 0; i < VIRIDIAN_STIMER_COUNT; i++ )
+    {
+        vs->stimer[i].config.raw = ctxt.stimer_config[i];
+        vs->stimer[i].count = ctxt.stimer_count[i];
+        stimer_reset(&vs->stimer[i]);
+    }
 
     return 0;
 }
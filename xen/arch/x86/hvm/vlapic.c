@@ -91,13 +91,22 @@ static const unsigned int vlapic_lvt_mask[VLAPIC_LVT_NUM] =
 static int vlapic_find_highest_vector(const void *bitmap)
 {
     const uint32_t *word = bitmap;
-    unsigned int word_offset = NR_VECTORS / 32;
+    unsigned int i, summary = 0;
 
-    /* Work backwards through the bitmap (first 32-bit word in every four). */
-    while ( (word_offset != 0) && (word[(--word_offset)*4] == 0) )
-        continue;
+    /*
+     * One bit per non-zero 32-bit word (the first in every four), so that
+     * finding the highest one takes a single branch rather than one per
+     * word.  The summary can't be kept up to date incrementally instead:
+     * with virtual interrupt delivery the processor updates IRR and ISR.
+     */
+    for ( i = 0; i < NR_VECTORS / 32; i++ )
+        summary |= (word[i * 4] != 0) << i;
+
+    if ( !summary )
+        return -1;
 
-    return (fls(word[word_offset*4]) - 1) + (word_offset * 32);
+    i = fls(summary) - 1;
+    return (fls(word[i * 4]) - 1) + (i * 32);
 }
 
 
@@ -1077,7 +1086,9 @@ int vlapic_ack_pending_irq(struct vcpu *v, int vector, bool_t force_ack)
 
     if ( force_ack || !vlapic_virtual_intr_delivery_enabled() )
     {
-        vlapic_set_vector(vector, &vlapic->regs->data[APIC_ISR]);
+        /* An auto-EOI synthetic interrupt is never in service. */
+        if ( !viridian_sint_auto_eoi(v, vector) )
+            vlapic_set_vector(vector, &vlapic->regs->data[APIC_ISR]);
         vlapic_clear_irr(vector, vlapic);
     }
 
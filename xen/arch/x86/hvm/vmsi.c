@@ -164,16 +164,36 @@ struct msixtbl_entry
 
 static DEFINE_RCU_READ_LOCK(msixtbl_rcu_lock);
 
+/*
+ * Called for every MMIO access of the domain: most are outside of all the
+ * tables, and the others tend to be to the table last accessed.
+ */
 static struct msixtbl_entry *msixtbl_find_entry(
     struct vcpu *v, unsigned long addr)
 {
     struct msixtbl_entry *entry;
-    struct domain *d = v->domain;
+    struct hvm_domain *hd = &v->domain->arch.hvm_domain;
+    unsigned int gen = read_atomic(&hd->msixtbl_gen);
 
-    list_for_each_entry( entry, &d->arch.hvm_domain.msixtbl_list, list )
+    /* Entries seen below were in the list at gen. */
+    smp_rmb();
+
+    if ( addr < hd->msixtbl_start || addr >= hd->msixtbl_end )
+        return NULL;
+
+    entry = v->arch.hvm_vcpu.hvm_io.msixtbl_last;
+    if ( entry && v->arch.hvm_vcpu.hvm_io.msixtbl_gen == gen &&
+         addr >= entry->gtable && addr < entry->gtable + entry->table_len )
+        return entry;
+
+    list_for_each_entry( entry, &hd->msixtbl_list, list )
         if ( addr >= entry->gtable &&
              addr < entry->gtable + entry->table_len )
+        {
+            v->arch.hvm_vcpu.hvm_io.msixtbl_last = entry;
+            v->arch.hvm_vcpu.hvm_io.msixtbl_gen = gen;
             return entry;
+        }
 
     return NULL;
 }
@@ -389,6 +409,21 @@ static void add_msixtbl_entry(struct domain *d,
     entry->pdev = pdev;
     entry->gtable = (unsigned long) gtable;
 
+    /* Readers may find the entry as soon as it is in the list. */
+    if ( list_empty(&d->arch.hvm_domain.msixtbl_list) )
+    {
+        d->arch.hvm_domain.msixtbl_start = entry->gtable;
+        d->arch.hvm_domain.msixtbl_end = entry->gtable + len;
+    }
+    else
+    {
+        d->arch.hvm_domain.msixtbl_start =
+            min(d->arch.hvm_domain.msixtbl_start, entry->gtable);
+        d->arch.hvm_domain.msixtbl_end =
+            max(d->arch.hvm_domain.msixtbl_end, entry->gtable + len);
+    }
+    smp_wmb();
+
     list_add_rcu(&entry->list, &d->arch.hvm_domain.msixtbl_list);
 }
 
@@ -401,10 +436,29 @@ static void free_msixtbl_entry(struct rcu_head *rcu)
     xfree(entry);
 }
 
-static void del_msixtbl_entry(struct msixtbl_entry *entry)
+static void del_msixtbl_entry(struct domain *d, struct msixtbl_entry *entry)
 {
+    struct hvm_domain *hd = &d->arch.hvm_domain;
+    struct msixtbl_entry *e;
+    unsigned long start = ~0UL, end = 0;
+
     list_del_rcu(&entry->list);
     call_rcu(&entry->rcu, free_msixtbl_entry);
+
+    /*
+     * A vCPU's last entry is only used while its generation is current:
+     * the list must no longer hold the entry when the new one is seen.
+     */
+    smp_wmb();
+    write_atomic(&hd->msixtbl_gen, hd->msixtbl_gen + 1);
+
+    list_for_each_entry( e, &hd->msixtbl_list, list )
+    {
+        start = min(start, e->gtable);
+        end = max(end, e->gtable + e->table_len);
+    }
+    hd->msixtbl_start = start;
+    hd->msixtbl_end = end;
 }
 
 int msixtbl_pt_register(struct domain *d, struct pirq *pirq, uint64_t gtable)
@@ -501,7 +555,7 @@ out:
 
 found:
     if ( !atomic_dec_and_test(&entry->refcnt) )
-        del_msixtbl_entry(entry);
+        del_msixtbl_entry(d, entry);
 
     spin_unlock(&d->arch.hvm_domain.msixtbl_list_lock);
     spin_unlock_irq(&irq_desc->lock);
@@ -518,7 +572,7 @@ void msixtbl_pt_cleanup(struct domain *d)
 
     list_for_each_entry_safe( entry, temp,
                               &d->arch.hvm_domain.msixtbl_list, list )
-        del_msixtbl_entry(entry);
+        del_msixtbl_entry(d, entry);
 
     spin_unlock(&d->arch.hvm_domain.msixtbl_list_lock);
     local_irq_restore(flags);
@@ -116,6 +116,15 @@ static int vmx_vcpu_initialise(struct vcpu *v)
         return rc;
     }
 
+    /* A vcpu brought up while the domain is in log-dirty mode logs too. */
+    if ( vmx_domain_pml_enabled(v->domain) &&
+         (rc = vmx_vcpu_enable_pml(v)) != 0 )
+    {
+        dprintk(XENLOG_ERR, "%pv: Failed to enable PML.\n", v);
+        vmx_destroy_vmcs(v);
+        return rc;
+    }
+
     vpmu_initialise(v);
 
     vmx_install_vlapic_mapping(v);
@@ -129,6 +138,8 @@ static int vmx_vcpu_initialise(struct vcpu *v)
 
 static void vmx_vcpu_destroy(struct vcpu *v)
 {
+    /* The domain may still be in log-dirty mode, as for 'xl destroy'. */
+    vmx_vcpu_disable_pml(v);
     vmx_destroy_vmcs(v);
     vpmu_destroy(v);
     passive_domain_destroy(v);
@@ -1609,9 +1620,17 @@ static void __vmx_deliver_posted_interrupt(struct vcpu *v)
     {
         unsigned int cpu = v->processor;
 
-        if ( !test_and_set_bit(VCPU_KICK_SOFTIRQ, &softirq_pending(cpu))
-             && (cpu != smp_processor_id()) )
+        /*
+         * A notification reaching the vcpu in non-root mode is consumed by
+         * the processor without a VM exit, so nothing would clear a kick
+         * softirq raised here: it must not gate the next notification.
+         * Should the vcpu be in root mode instead, the notification
+         * handler raises the softirq, syncing PIR before the next entry.
+         */
+        if ( cpu != smp_processor_id() )
             send_IPI_mask(cpumask_of(cpu), posted_intr_vector);
+        else if ( !softirq_pending(cpu) )
+            raise_softirq(VCPU_KICK_SOFTIRQ);
     }
 }
 
@@ -1638,6 +1657,19 @@ static void vmx_deliver_posted_intr(struct vcpu *v, u8 vector)
     vcpu_kick(v);
 }
 
+/* A posted interrupt notification taken outside the guest */
+static void pi_notification_interrupt(struct cpu_user_regs *regs)
+{
+    ack_APIC_irq();
+    this_cpu(irq_count)++;
+
+    /*
+     * The vcpu may have been between vmx_intr_assist() and VM entry, with
+     * its PIR already synced: have it go round again.
+     */
+    raise_softirq(VCPU_KICK_SOFTIRQ);
+}
+
 static void vmx_sync_pir_to_irr(struct vcpu *v)
 {
     struct vlapic *vlapic = vcpu_vlapic(v);
@@ -1778,7 +1810,8 @@ const struct hvm_function_table * __init start_vmx(void)
     }
 
     if ( cpu_has_vmx_posted_intr_processing )
-        alloc_direct_apic_vector(&posted_intr_vector, event_check_interrupt);
+        alloc_direct_apic_vector(&posted_intr_vector,
+                                 pi_notification_interrupt);
     else
     {
         vmx_function_table.deliver_posted_intr = NULL;
@@ -1906,6 +1939,7 @@ static void vmx_invlpg_intercept(unsigned long vaddr)
 {
     struct vcpu *curr = current;
     HVMTRACE_LONG_2D(INVLPG, /*invlpga=*/ 0, TRC_PAR_LONG(vaddr));
+    hvm_gtlb_invlpg(curr, vaddr);
     if ( paging_invlpg(curr, vaddr) && cpu_has_vmx_vpid )
         vpid_sync_vcpu_gva(curr, vaddr);
 }
@@ -3080,6 +3114,10 @@ void vmx_vmexit_handler(struct cpu_user_regs *regs)
             hvm_inject_hw_exception(TRAP_gp_fault, 0);
         break;
 
+    case EXIT_REASON_PML_FULL:
+        vmx_vcpu_flush_pml_buffer(v);
+        break;
+
     case EXIT_REASON_ACCESS_GDTR_OR_IDTR:
     case EXIT_REASON_ACCESS_LDTR_OR_TR:
     case EXIT_REASON_VMX_PREEMPTION_TIMER_EXPIRED:
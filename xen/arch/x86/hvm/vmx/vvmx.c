@@ -1792,18 +1792,34 @@ int nvmx_handle_invept(struct cpu_user_regs *regs)
     {
     case INVEPT_SINGLE_CONTEXT:
     {
-        struct p2m_domain *p2m = p2m_get_nestedp2m(current, eptp);
+        /* Only what was made from L1 EPT entries that changed need go. */
+        struct p2m_domain *p2m = p2m_find_nestedp2m(current->domain, eptp);
         if ( p2m )
         {
-            p2m_flush(current, p2m);
+            if ( !nestedp2m_revalidate(p2m) )
+                p2m_flush(current, p2m);
             ept_sync_domain(p2m);
         }
         break;
     }
     case INVEPT_ALL_CONTEXT:
-        p2m_flush_nestedp2m(current->domain);
+    {
+        struct domain *d = current->domain;
+        int i;
+
+        for ( i = 0; i < MAX_NESTEDP2M; i++ )
+        {
+            struct p2m_domain *p2m = d->arch.nested_p2m[i];
+
+            if ( p2m->np2m_base == P2M_BASE_EADDR )
+                continue;
+            if ( !nestedp2m_revalidate(p2m) )
+                p2m_flush(current, p2m);
+            ept_sync_domain(p2m);
+        }
         __invept(INVEPT_ALL_CONTEXT, 0, 0);
         break;
+    }
     default:
         vmreturn(regs, VMFAIL_INVALID);
         return X86EMUL_OKAY;
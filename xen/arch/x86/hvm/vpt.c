@@ -17,6 +17,7 @@
  * Place - Suite 330, Boston, MA 02111-1307 USA.
  */
 
+#include <xen/init.h>
 #include <xen/time.h>
 #include <asm/hvm/support.h>
 #include <asm/hvm/vpt.h>
@@ -27,11 +28,19 @@
 #define mode_is(d, name) \
     ((d)->arch.hvm_domain.params[HVM_PARAM_TIMER_MODE] == HVMPTM_##name)
 
+/*
+ * Round the expiry of periodic timers up to a multiple of this many
+ * microseconds, so that the vpts of all the guests on a pcpu, whatever
+ * their phase, fire together from one timer interrupt. Only applies to
+ * periods of at least twice the slack.
+ */
+static unsigned int __read_mostly opt_vpt_slack;
+integer_param("vpt_slack", opt_vpt_slack);
+
 void hvm_init_guest_time(struct domain *d)
 {
     struct pl_time *pl = &d->arch.hvm_domain.pl_time;
 
-    spin_lock_init(&pl->pl_time_lock);
     pl->stime_offset = -(u64)get_s_time();
     pl->last_guest_time = 0;
 }
@@ -44,17 +53,22 @@ u64 hvm_get_guest_time_fixed(struct vcpu *v, u64 at_tsc)
     /* Called from device models shared with PV guests. Be careful. */
     ASSERT(is_hvm_vcpu(v));
 
-    spin_lock(&pl->pl_time_lock);
     now = get_s_time_fixed(at_tsc) + pl->stime_offset;
 
+    /*
+     * Lock free, as every emulated timer read of every vcpu of the domain
+     * comes here: never go back past, nor repeat, what's been returned.
+     */
     if ( !at_tsc )
     {
-        if ( (int64_t)(now - pl->last_guest_time) > 0 )
-            pl->last_guest_time = now;
-        else
-            now = ++pl->last_guest_time;
+        uint64_t last, next;
+
+        do {
+            last = read_atomic(&pl->last_guest_time);
+            next = ((int64_t)(now - last) > 0) ? now : last + 1;
+        } while ( cmpxchg(&pl->last_guest_time, last, next) != last );
+        now = next;
     }
-    spin_unlock(&pl->pl_time_lock);
 
     return now + v->arch.hvm_vcpu.stime_offset;
 }
@@ -135,6 +149,82 @@ static void pt_unlock(struct periodic_time *pt)
     spin_unlock(&pt->vcpu->arch.hvm_vcpu.tm_lock);
 }
 
+static s_time_t pt_expiry(struct periodic_time *pt)
+{
+    uint64_t slack = opt_vpt_slack * 1000ULL;
+
+    if ( pt->one_shot || !slack || (pt->period < 2 * slack) )
+        return pt->scheduled;
+
+    return align_timer(pt->scheduled, slack);
+}
+
+static bool_t pt_is_pit(struct periodic_time *pt)
+{
+    return pt == &pt->vcpu->domain->arch.vpit.pt0;
+}
+
+/*
+ * With HVM_PARAM_VPT_MERGE, the PIT's timer delivers the ticks of the RTC
+ * when both are periodic on the same vcpu and the PIT ticks at least as
+ * often: the RTC tick goes with the PIT tick nearest to it. The RTC's own
+ * timer stays off until it is merged no more.
+ */
+static struct periodic_time *pt_merge_partner(struct periodic_time *pt)
+{
+    struct domain *d = pt->vcpu->domain;
+    struct periodic_time *pit = &d->arch.vpit.pt0;
+
+    if ( !d->arch.hvm_domain.params[HVM_PARAM_VPT_MERGE] ||
+         (pt != &d->arch.hvm_domain.pl_time.vrtc.pt) || pt->one_shot )
+        return NULL;
+
+    if ( (pit->vcpu != pt->vcpu) || !pit->on_list || pit->one_shot ||
+         (pit->period > pt->period) )
+        return NULL;
+
+    return pit;
+}
+
+/* Arm the timer of pt for its next tick, called with pt locked. */
+static void pt_arm(struct periodic_time *pt)
+{
+    pt->merged = (pt_merge_partner(pt) != NULL);
+    if ( pt->merged )
+        stop_timer(&pt->timer);
+    else
+        set_timer(&pt->timer, pt_expiry(pt));
+}
+
+/* The RTC merged with pit goes back to its own timer. */
+static void pt_unmerge(struct periodic_time *pit)
+{
+    struct periodic_time *rtc =
+        &pit->vcpu->domain->arch.hvm_domain.pl_time.vrtc.pt;
+
+    if ( !rtc->merged || (rtc->vcpu != pit->vcpu) )
+        return;
+
+    rtc->merged = 0;
+    set_timer(&rtc->timer, pt_expiry(rtc));
+}
+
+/* The PIT's timer fired, tick the RTC merged with it if it is due. */
+static void pt_merged_tick(struct periodic_time *pit)
+{
+    struct periodic_time *rtc =
+        &pit->vcpu->domain->arch.hvm_domain.pl_time.vrtc.pt;
+
+    if ( !rtc->merged || (rtc->vcpu != pit->vcpu) || !rtc->on_list ||
+         (rtc->scheduled > (NOW() + (s_time_t)(pit->period / 2))) )
+        return;
+
+    rtc->merged = 0;
+    rtc->pending_intr_nr++;
+    rtc->scheduled += rtc->period;
+    rtc->do_not_freeze = 0;
+}
+
 static void pt_process_missed_ticks(struct periodic_time *pt)
 {
     s_time_t missed_ticks, now = NOW();
@@ -205,7 +295,7 @@ void pt_restore_timer(struct vcpu *v)
         if ( pt->pending_intr_nr == 0 )
         {
             pt_process_missed_ticks(pt);
-            set_timer(&pt->timer, pt->scheduled);
+            pt_arm(pt);
         }
     }
 
@@ -224,6 +314,9 @@ static void pt_timer_fn(void *data)
     pt->scheduled += pt->period;
     pt->do_not_freeze = 0;
 
+    if ( pt_is_pit(pt) )
+        pt_merged_tick(pt);
+
     vcpu_kick(pt->vcpu);
 
     pt_unlock(pt);
@@ -250,6 +343,8 @@ int pt_update_irq(struct vcpu *v)
                 /* suspend timer emulation */
                 list_del(&pt->list);
                 pt->on_list = 0;
+                if ( pt_is_pit(pt) )
+                    pt_unmerge(pt);
             }
             else
             {
@@ -344,7 +439,7 @@ void pt_intr_post(struct vcpu *v, struct hvm_intack intack)
         pt->last_plt_gtime = hvm_get_guest_time(v);
         pt_process_missed_ticks(pt);
         pt->pending_intr_nr = 0; /* 'collapse' all missed ticks */
-        set_timer(&pt->timer, pt->scheduled);
+        pt_arm(pt);
     }
     else
     {
@@ -353,7 +448,7 @@ void pt_intr_post(struct vcpu *v, struct hvm_intack intack)
         {
             pt_process_missed_ticks(pt);
             if ( pt->pending_intr_nr == 0 )
-                set_timer(&pt->timer, pt->scheduled);
+                pt_arm(pt);
         }
     }
 
@@ -396,6 +491,7 @@ void create_periodic_time(
     pt->pending_intr_nr = 0;
     pt->do_not_freeze = 0;
     pt->irq_issued = 0;
+    pt->merged = 0;
 
     /* Periodic timer must be at least 0.1ms. */
     if ( (period < 100000) && period )
@@ -438,7 +534,7 @@ void create_periodic_time(
     list_add(&pt->list, &v->arch.hvm_vcpu.tm_list);
 
     init_timer(&pt->timer, pt_timer_fn, pt, v->processor);
-    set_timer(&pt->timer, pt->scheduled);
+    pt_arm(pt);
 
     spin_unlock(&v->arch.hvm_vcpu.tm_lock);
 }
@@ -454,6 +550,9 @@ void destroy_periodic_time(struct periodic_time *pt)
         list_del(&pt->list);
     pt->on_list = 0;
     pt->pending_intr_nr = 0;
+    pt->merged = 0;
+    if ( pt_is_pit(pt) )
+        pt_unmerge(pt);
     pt_unlock(pt);
 
     /*
@@ -487,6 +586,9 @@ static void pt_adjust_vcpu(struct periodic_time *pt, struct vcpu *v)
         list_add(&pt->list, &v->arch.hvm_vcpu.tm_list);
 
         migrate_timer(&pt->timer, v->processor);
+        /* merged or not, as the PIT on the new vcpu allows */
+        if ( pt->merged )
+            pt_arm(pt);
     }
     spin_unlock(&v->arch.hvm_vcpu.tm_lock);
 }
@@ -7,6 +7,7 @@
 
 #include <xen/config.h>
 #include <xen/init.h>
+#include <xen/cpu.h>
 #include <xen/delay.h>
 #include <xen/errno.h>
 #include <xen/event.h>
@@ -341,6 +342,8 @@ int arch_init_one_irq_desc(struct irq_desc *desc)
 
     desc->arch.vector = IRQ_VECTOR_UNASSIGNED;
     desc->arch.old_vector = IRQ_VECTOR_UNASSIGNED;
+    desc->arch.balance_home = -1;
+    desc->arch.balance_cpu = -1;
 
     return 0;
 }
@@ -766,7 +769,19 @@ void pirq_set_affinity(struct domain *d, int pirq, const cpumask_t *mask)
 
     if ( !desc )
         return;
-    irq_set_affinity(desc, mask);
+
+    /*
+     * The owner's vCPU is still where it was when irq_balance moved the
+     * interrupt to one of its neighbours: leave it there.  Otherwise follow
+     * the vCPU, and let balancing start again from its new CPU.
+     */
+    if ( desc->arch.balance_cpu < 0 ||
+         desc->arch.balance_home != cpumask_first(mask) )
+    {
+        desc->arch.balance_home = cpumask_first(mask);
+        desc->arch.balance_cpu = -1;
+        irq_set_affinity(desc, mask);
+    }
     spin_unlock_irqrestore(&desc->lock, flags);
 }
 
@@ -851,6 +866,7 @@ void do_IRQ(struct cpu_user_regs *regs)
     desc = irq_to_desc(irq);
 
     spin_lock(&desc->lock);
+    desc->arch.balance_count++;
     desc->handler->ack(desc);
 
     if ( likely(desc->status & IRQ_GUEST) )
@@ -949,6 +965,168 @@ static int __init irq_ratelimit_init(void)
 }
 __initcall(irq_ratelimit_init);
 
+/*
+ * irq_balance: every this many ms, move the busiest interrupt off any CPU
+ * taking well above its share, set 0 to disable.
+ */
+static unsigned int __read_mostly irq_balance_period;
+integer_param("irq_balance", irq_balance_period);
+
+/* CPUs taking fewer than this many interrupts a second are never offloaded */
+#define IRQ_BALANCE_MIN_RATE 1000
+/* Rounds a moved interrupt stays put, so that two CPUs don't trade it */
+#define IRQ_BALANCE_HOLD     8
+
+static struct timer irq_balance_timer;
+
+static int irq_balance_pick(const cpumask_t *mask, unsigned int src,
+                            const unsigned int *load, unsigned int rate,
+                            int best)
+{
+    unsigned int cpu;
+
+    for_each_cpu ( cpu, mask )
+    {
+        if ( cpu == src || !cpu_online(cpu) )
+            continue;
+        /* Only worth it if the target ends up less loaded than the source. */
+        if ( load[src] - load[cpu] <= rate )
+            continue;
+        if ( best < 0 || load[cpu] < load[best] )
+            best = cpu;
+    }
+
+    return best;
+}
+
+/*
+ * Stay close to the CPU the owner asked for (a guest's interrupt follows
+ * its vCPU, and the handler runs where the vCPU is): first its SMT
+ * siblings, which share its caches, then the rest of its node.
+ */
+static int irq_balance_target(const struct irq_desc *desc, unsigned int src,
+                              const unsigned int *load, unsigned int rate)
+{
+    unsigned int home = desc->arch.balance_home >= 0 ?
+                        desc->arch.balance_home : src;
+    int best;
+
+    best = irq_balance_pick(per_cpu(cpu_sibling_mask, home), src, load,
+                            rate, -1);
+    if ( best < 0 )
+        best = irq_balance_pick(&node_to_cpumask(cpu_to_node(home)), src,
+                                load, rate, -1);
+
+    return best;
+}
+
+static void irq_balance_fn(void *unused)
+{
+    /* Only ever run from this timer, so one copy will do. */
+    static unsigned int load[NR_CPUS], hot_rate[NR_CPUS];
+    static int hot_irq[NR_CPUS];
+    unsigned int cpu, irq, nr_cpus = 0, thresh, min;
+    unsigned long total = 0, flags;
+    struct irq_desc *desc;
+
+    /* Balancing can be switched off at run time by the platform quirk. */
+    if ( opt_noirqbalance )
+        return;
+
+    if ( !get_cpu_maps() )
+        goto out;
+
+    for_each_online_cpu ( cpu )
+    {
+        load[cpu] = hot_rate[cpu] = 0;
+        hot_irq[cpu] = -1;
+        nr_cpus++;
+    }
+
+    for ( irq = 0; irq < nr_irqs; irq++ )
+    {
+        unsigned int rate;
+
+        desc = irq_to_desc(irq);
+        spin_lock_irqsave(&desc->lock, flags);
+
+        rate = desc->arch.balance_count - desc->arch.balance_seen;
+        desc->arch.balance_seen = desc->arch.balance_count;
+        if ( desc->arch.balance_hold )
+            desc->arch.balance_hold--;
+
+        cpu = cpumask_first(desc->arch.cpu_mask);
+        if ( !rate || cpu >= nr_cpu_ids || !cpu_online(cpu) )
+        {
+            spin_unlock_irqrestore(&desc->lock, flags);
+            continue;
+        }
+
+        load[cpu] += rate;
+        total += rate;
+
+        if ( desc->action && desc->handler->set_affinity &&
+             !desc->arch.balance_hold &&
+             !(desc->status & (IRQ_DISABLED | IRQ_PER_CPU |
+                               IRQ_MOVE_PENDING)) &&
+             rate > hot_rate[cpu] )
+        {
+            hot_rate[cpu] = rate;
+            hot_irq[cpu] = irq;
+        }
+
+        spin_unlock_irqrestore(&desc->lock, flags);
+    }
+
+    min = IRQ_BALANCE_MIN_RATE * irq_balance_period / 1000;
+    thresh = total / nr_cpus;
+    thresh += thresh / 4;
+    if ( thresh < min )
+        thresh = min;
+
+    for_each_online_cpu ( cpu )
+    {
+        int target;
+
+        if ( hot_irq[cpu] < 0 || load[cpu] <= thresh )
+            continue;
+
+        desc = irq_to_desc(hot_irq[cpu]);
+        spin_lock_irqsave(&desc->lock, flags);
+
+        /* It may have been rebound, or moved, since the first pass. */
+        if ( desc->action && !(desc->status & IRQ_MOVE_PENDING) &&
+             cpumask_first(desc->arch.cpu_mask) == cpu &&
+             (target = irq_balance_target(desc, cpu, load,
+                                          hot_rate[cpu])) >= 0 )
+        {
+            irq_set_affinity(desc, cpumask_of(target));
+            desc->arch.balance_cpu = target;
+            desc->arch.balance_hold = IRQ_BALANCE_HOLD;
+            load[cpu] -= hot_rate[cpu];
+            load[target] += hot_rate[cpu];
+        }
+
+        spin_unlock_irqrestore(&desc->lock, flags);
+    }
+
+    put_cpu_maps();
+
+ out:
+    set_timer(&irq_balance_timer, NOW() + MILLISECS(irq_balance_period));
+}
+
+static int __init irq_balance_init(void)
+{
+    if ( !irq_balance_period || opt_noirqbalance )
+        return 0;
+
+    init_timer(&irq_balance_timer, irq_balance_fn, NULL, 0);
+    set_timer(&irq_balance_timer, NOW() + MILLISECS(irq_balance_period));
+    return 0;
+}
+__initcall(irq_balance_init);
+
 int __init request_irq(unsigned int irq, unsigned int irqflags,
         void (*handler)(int, void *, struct cpu_user_regs *),
         const char * devname, void *dev_id)
@@ -1612,7 +1790,11 @@ int pirq_guest_bind(struct vcpu *v, struct pirq *pirq, int will_share)
 
         /* Attempt to bind the interrupt target to the correct CPU. */
         if ( !opt_noirqbalance && (desc->handler->set_affinity != NULL) )
+        {
             desc->handler->set_affinity(desc, cpumask_of(v->processor));
+            desc->arch.balance_home = v->processor;
+            desc->arch.balance_cpu = -1;
+        }
     }
     else if ( !will_share || !action->shareable )
     {
@@ -1747,6 +1929,8 @@ static irq_guest_action_t *__pirq_guest_unbind(
 
     desc->action = NULL;
     desc->status &= ~(IRQ_GUEST|IRQ_INPROGRESS);
+    desc->arch.balance_home = -1;
+    desc->arch.balance_cpu = -1;
     desc->handler->shutdown(desc);
 
     /* Caller frees the old guest descriptor block. */
@@ -31,6 +31,7 @@
 #include <xen/smp.h>
 #include <xen/softirq.h>
 #include <xen/spinlock.h>
+#include <xen/stop_machine.h>
 #include <xen/tasklet.h>
 #include <xen/guest_access.h>
 #include <xen/earlycpio.h>
@@ -303,6 +304,124 @@ static long do_microcode_update(void *_info)
     return error;
 }
 
+/*
+ * With ucode_parallel a late update parses the blob once, on the cpu the
+ * hypercall runs on, and loads the patch it found into all the other
+ * cores at once in a single rendezvous, from the first thread of each:
+ * the threads of a core share its microcode. Intel only, AMD needs
+ * cpu_request_microcode() on each cpu to refresh its OSVW state. A mix
+ * of processors is still updated cpu by cpu.
+ */
+static bool_t __read_mostly opt_ucode_parallel;
+boolean_param("ucode_parallel", opt_ucode_parallel);
+
+/* apply_microcode() runs in the rendezvous, see microcode.h */
+bool_t microcode_rendezvous;
+
+static struct {
+    cpumask_t load;             /* first thread of the cores to load */
+    unsigned int nr_load;
+    atomic_t loaded;
+    int error;
+} rendezvous;
+
+static void collect_cpu_info_ipi(void *data)
+{
+    unsigned int cpu = smp_processor_id();
+
+    if ( microcode_ops->collect_cpu_info(cpu,
+                                         &per_cpu(ucode_cpu_info, cpu).cpu_sig) )
+        cpumask_set_cpu(cpu, data);
+}
+
+static int do_microcode_rendezvous(void *unused)
+{
+    unsigned int cpu = smp_processor_id();
+    int error;
+
+    if ( cpumask_test_cpu(cpu, &rendezvous.load) )
+    {
+        error = microcode_ops->apply_microcode(cpu);
+        if ( error )
+            rendezvous.error = error;
+        atomic_inc(&rendezvous.loaded);
+        return 0;
+    }
+
+    /* the other threads pick up the new revision once all cores are done */
+    while ( atomic_read(&rendezvous.loaded) != rendezvous.nr_load )
+        cpu_relax();
+    microcode_ops->collect_cpu_info(cpu, &per_cpu(ucode_cpu_info, cpu).cpu_sig);
+
+    return 0;
+}
+
+/* Returns 1 if the processors are to be updated cpu by cpu instead. */
+static long microcode_update_parallel(struct microcode_info *info)
+{
+    unsigned int cpu = smp_processor_id(), cpu2;
+    struct ucode_cpu_info *uci = &per_cpu(ucode_cpu_info, cpu), *uci2;
+    int error = 0;
+
+    cpumask_clear(&rendezvous.load);
+    on_selected_cpus(&cpu_online_map, collect_cpu_info_ipi,
+                     &rendezvous.load, 1);
+    if ( !cpumask_empty(&rendezvous.load) )
+        return -EIO;
+
+    for_each_online_cpu ( cpu2 )
+    {
+        uci2 = &per_cpu(ucode_cpu_info, cpu2);
+        if ( (uci2->cpu_sig.sig != uci->cpu_sig.sig) ||
+             (uci2->cpu_sig.pf != uci->cpu_sig.pf) )
+            return 1;
+    }
+
+    /* our own core, and the patch to give the others */
+    error = microcode_update_cpu(info->buffer, info->buffer_size);
+    if ( error || !uci->mc.mc_valid )
+        return error;
+
+    spin_lock(&microcode_mutex);
+
+    rendezvous.nr_load = 0;
+    rendezvous.error = 0;
+    atomic_set(&rendezvous.loaded, 0);
+    for_each_online_cpu ( cpu2 )
+    {
+        if ( cpumask_test_cpu(cpu2, per_cpu(cpu_sibling_mask, cpu)) ||
+             (cpu2 != cpumask_first(per_cpu(cpu_sibling_mask, cpu2))) )
+            continue;
+
+        /* copies the patch to cpu2 if it is newer than what cpu2 runs */
+        error = microcode_ops->microcode_resume_match(cpu2, uci->mc.mc_valid);
+        if ( error < 0 )
+            break;
+        if ( error )
+        {
+            cpumask_set_cpu(cpu2, &rendezvous.load);
+            rendezvous.nr_load++;
+        }
+        error = 0;
+    }
+
+    spin_unlock(&microcode_mutex);
+
+    if ( error )
+        return error;
+
+    microcode_rendezvous = 1;
+    error = stop_machine_run(do_microcode_rendezvous, NULL, NR_CPUS);
+    microcode_rendezvous = 0;
+    if ( !error )
+        error = rendezvous.error;
+
+    printk(XENLOG_INFO "microcode: %u other cores updated to revision %#x%s\n",
+           rendezvous.nr_load, uci->cpu_sig.rev, error ? " (with errors)" : "");
+
+    return error;
+}
+
 int microcode_update(XEN_GUEST_HANDLE_PARAM(const_void) buf, unsigned long len)
 {
     int ret;
@@ -339,6 +458,16 @@ int microcode_update(XEN_GUEST_HANDLE_PARAM(const_void) buf, unsigned long len)
         }
     }
 
+    if ( opt_ucode_parallel && (boot_cpu_data.x86_vendor == X86_VENDOR_INTEL) )
+    {
+        ret = microcode_update_parallel(info);
+        if ( ret <= 0 )
+        {
+            xfree(info);
+            return ret;
+        }
+    }
+
     return continue_hypercall_on_cpu(info->cpu, do_microcode_update, info);
 }
 
@@ -279,7 +279,7 @@ static int get_matching_microcode(const void *mc, int cpu)
 
 static int apply_microcode(int cpu)
 {
-    unsigned long flags;
+    unsigned long flags = 0;
     uint64_t msr_content;
     unsigned int val[2];
     int cpu_num = raw_smp_processor_id();
@@ -292,7 +292,8 @@ static int apply_microcode(int cpu)
         return -EINVAL;
 
     /* serialize access to the physical write to MSR 0x79 */
-    spin_lock_irqsave(&microcode_update_lock, flags);
+    if ( !microcode_rendezvous )
+        spin_lock_irqsave(&microcode_update_lock, flags);
 
     /* write microcode via MSR 0x79 */
     wrmsrl(MSR_IA32_UCODE_WRITE, (unsigned long)uci->mc.mc_intel->bits);
@@ -305,19 +306,21 @@ static int apply_microcode(int cpu)
     rdmsrl(MSR_IA32_UCODE_REV, msr_content);
     val[1] = (uint32_t)(msr_content >> 32);
 
-    spin_unlock_irqrestore(&microcode_update_lock, flags);
+    if ( !microcode_rendezvous )
+        spin_unlock_irqrestore(&microcode_update_lock, flags);
     if ( val[1] != uci->mc.mc_intel->hdr.rev )
     {
         printk(KERN_ERR "microcode: CPU%d update from revision "
                "%#x to %#x failed\n", cpu_num, uci->cpu_sig.rev, val[1]);
         return -EIO;
     }
-    printk(KERN_INFO "microcode: CPU%d updated from revision "
-           "%#x to %#x, date = %04x-%02x-%02x \n",
-           cpu_num, uci->cpu_sig.rev, val[1],
-           uci->mc.mc_intel->hdr.date & 0xffff,
-           uci->mc.mc_intel->hdr.date >> 24,
-           (uci->mc.mc_intel->hdr.date >> 16) & 0xff);
+    if ( !microcode_rendezvous )
+        printk(KERN_INFO "microcode: CPU%d updated from revision "
+               "%#x to %#x, date = %04x-%02x-%02x \n",
+               cpu_num, uci->cpu_sig.rev, val[1],
+               uci->mc.mc_intel->hdr.date & 0xffff,
+               uci->mc.mc_intel->hdr.date >> 24,
+               (uci->mc.mc_intel->hdr.date >> 16) & 0xff);
     uci->cpu_sig.rev = val[1];
 
     return 0;
@@ -3410,6 +3410,89 @@ long do_mmuext_op(
     return rc;
 }
 
+/*
+ * Update one entry of an L1 table, which the caller has locked.  Shared by
+ * the normal and the table-run paths of do_mmu_update().
+ */
+static int mmu_update_l1e(l1_pgentry_t *pl1e, intpte_t val, unsigned long mfn,
+                          int preserve_ad, struct vcpu *v,
+                          struct domain *pg_owner)
+{
+    l1_pgentry_t l1e = l1e_from_intpte(val);
+    p2m_type_t l1e_p2mt = p2m_ram_rw;
+    struct page_info *target = NULL;
+    p2m_query_t q = (l1e_get_flags(l1e) & _PAGE_RW) ?
+                        P2M_UNSHARE : P2M_ALLOC;
+    int rc;
+
+    if ( paging_mode_translate(pg_owner) )
+        target = get_page_from_gfn(pg_owner, l1e_get_pfn(l1e),
+                                   &l1e_p2mt, q);
+
+    if ( p2m_is_paged(l1e_p2mt) )
+    {
+        if ( target )
+            put_page(target);
+        p2m_mem_paging_populate(pg_owner, l1e_get_pfn(l1e));
+        return -ENOENT;
+    }
+    else if ( p2m_ram_paging_in == l1e_p2mt && !target )
+        return -ENOENT;
+    /* If we tried to unshare and failed */
+    else if ( (q & P2M_UNSHARE) && p2m_is_shared(l1e_p2mt) )
+    {
+        /* We could not have obtained a page ref. */
+        ASSERT(target == NULL);
+        /* And mem_sharing_notify has already been called. */
+        return -ENOMEM;
+    }
+
+    rc = mod_l1_entry(pl1e, l1e, mfn, preserve_ad, v, pg_owner);
+    if ( target )
+        put_page(target);
+
+    return rc;
+}
+
+static uint32_t mmu_update_xsm_needs(intpte_t val)
+{
+    uint32_t needs = XSM_MMU_NORMAL_UPDATE;
+
+    if ( get_pte_flags(val) & _PAGE_PRESENT )
+    {
+        needs |= XSM_MMU_UPDATE_READ;
+        if ( get_pte_flags(val) & _PAGE_RW )
+            needs |= XSM_MMU_UPDATE_WRITE;
+    }
+
+    return needs;
+}
+
+/*
+ * Batches from fork() and exec() are mostly runs of updates to the same L1
+ * table.  Keep the table referenced, locked and mapped from one request to
+ * the next instead of looking it up again for every entry.  The per-entry
+ * reference on each target frame belongs to the new mapping itself, so that
+ * part cannot be shared across the run.
+ */
+struct mmu_update_run {
+    struct page_info *page;     /* locked L1 table, NULL if none */
+    unsigned long gmfn;
+    void *va;                   /* mapping of the whole table */
+};
+
+static void mmu_update_end_run(struct mmu_update_run *run,
+                               struct domain_mmap_cache *cache)
+{
+    if ( run->page == NULL )
+        return;
+
+    page_unlock(run->page);
+    unmap_domain_page_with_cache(run->va, cache);
+    put_page(run->page);
+    run->page = NULL;
+}
+
 long do_mmu_update(
     XEN_GUEST_HANDLE_PARAM(mmu_update_t) ureqs,
     unsigned int count,
@@ -3424,6 +3507,7 @@ long do_mmu_update(
     struct vcpu *curr = current, *v = curr;
     struct domain *d = v->domain, *pt_owner = d, *pg_owner;
     struct domain_mmap_cache mapcache;
+    struct mmu_update_run run = { .page = NULL };
     uint32_t xsm_needed = 0;
     uint32_t xsm_checked = 0;
     int rc = put_old_guest_table(curr);
@@ -3497,6 +3581,27 @@ long do_mmu_update(
 
         cmd = req.ptr & (sizeof(l1_pgentry_t)-1);
 
+        if ( run.page != NULL )
+        {
+            if ( (cmd == MMU_NORMAL_PT_UPDATE ||
+                  cmd == MMU_PT_UPDATE_PRESERVE_AD) &&
+                 (req.ptr >> PAGE_SHIFT) == run.gmfn &&
+                 xsm_checked == (xsm_needed | mmu_update_xsm_needs(req.val)) )
+            {
+                perfc_incr(mmu_update_l1_run);
+                va = (void *)((unsigned long)run.va +
+                              ((req.ptr - cmd) & ~PAGE_MASK));
+                rc = mmu_update_l1e(va, req.val, page_to_mfn(run.page),
+                                    cmd == MMU_PT_UPDATE_PRESERVE_AD, v,
+                                    pg_owner);
+                if ( unlikely(rc) )
+                    break;
+                guest_handle_add_offset(ureqs, 1);
+                continue;
+            }
+            mmu_update_end_run(&run, &mapcache);
+        }
+
         switch ( cmd )
         {
             /*
@@ -3509,13 +3614,7 @@ long do_mmu_update(
         {
             p2m_type_t p2mt;
 
-            xsm_needed |= XSM_MMU_NORMAL_UPDATE;
-            if ( get_pte_flags(req.val) & _PAGE_PRESENT )
-            {
-                xsm_needed |= XSM_MMU_UPDATE_READ;
-                if ( get_pte_flags(req.val) & _PAGE_RW )
-                    xsm_needed |= XSM_MMU_UPDATE_WRITE;
-            }
+            xsm_needed |= mmu_update_xsm_needs(req.val);
             if ( xsm_needed != xsm_checked )
             {
                 rc = xsm_mmu_update(XSM_TARGET, d, pt_owner, pg_owner, xsm_needed);
@@ -3553,47 +3652,17 @@ long do_mmu_update(
                 switch ( page->u.inuse.type_info & PGT_type_mask )
                 {
                 case PGT_l1_page_table:
-                {
-                    l1_pgentry_t l1e = l1e_from_intpte(req.val);
-                    p2m_type_t l1e_p2mt = p2m_ram_rw;
-                    struct page_info *target = NULL;
-                    p2m_query_t q = (l1e_get_flags(l1e) & _PAGE_RW) ?
-                                        P2M_UNSHARE : P2M_ALLOC;
-
-                    if ( paging_mode_translate(pg_owner) )
-                        target = get_page_from_gfn(pg_owner, l1e_get_pfn(l1e),
-                                                   &l1e_p2mt, q);
-
-                    if ( p2m_is_paged(l1e_p2mt) )
-                    {
-                        if ( target )
-                            put_page(target);
-                        p2m_mem_paging_populate(pg_owner, l1e_get_pfn(l1e));
-                        rc = -ENOENT;
-                        break;
-                    }
-                    else if ( p2m_ram_paging_in == l1e_p2mt && !target )
-                    {
-                        rc = -ENOENT;
-                        break;
-                    }
-                    /* If we tried to unshare and failed */
-                    else if ( (q & P2M_UNSHARE) && p2m_is_shared(l1e_p2mt) )
+                    rc = mmu_update_l1e(va, req.val, mfn,
+                                        cmd == MMU_PT_UPDATE_PRESERVE_AD, v,
+                                        pg_owner);
+                    /* Hold on to the table for the entries that follow. */
+                    if ( rc == 0 && !paging_mode_translate(pt_owner) )
                     {
-                        /* We could not have obtained a page ref. */
-                        ASSERT(target == NULL);
-                        /* And mem_sharing_notify has already been called. */
-                        rc = -ENOMEM;
-                        break;
+                        run.page = page;
+                        run.gmfn = gmfn;
+                        run.va = (void *)((unsigned long)va & PAGE_MASK);
                     }
-
-                    rc = mod_l1_entry(va, l1e, mfn,
-                                      cmd == MMU_PT_UPDATE_PRESERVE_AD, v,
-                                      pg_owner);
-                    if ( target )
-                        put_page(target);
-                }
-                break;
+                    break;
                 case PGT_l2_page_table:
                     rc = mod_l2_entry(va, l2e_from_intpte(req.val), mfn,
                                       cmd == MMU_PT_UPDATE_PRESERVE_AD, v);
@@ -3612,7 +3681,8 @@ long do_mmu_update(
                         rc = 0;
                     break;
                 }
-                page_unlock(page);
+                if ( run.page != page )
+                    page_unlock(page);
                 if ( rc == -EINTR )
                     rc = -ERESTART;
             }
@@ -3624,8 +3694,11 @@ long do_mmu_update(
                 put_page_type(page);
             }
 
-            unmap_domain_page_with_cache(va, &mapcache);
-            put_page(page);
+            if ( run.page != page )
+            {
+                unmap_domain_page_with_cache(va, &mapcache);
+                put_page(page);
+            }
         }
         break;
 
@@ -3676,6 +3749,8 @@ long do_mmu_update(
         guest_handle_add_offset(ureqs, 1);
     }
 
+    mmu_update_end_run(&run, &mapcache);
+
     if ( rc == -ERESTART )
     {
         ASSERT(i < count);
@@ -4541,7 +4616,7 @@ int xenmem_add_to_physmap_one(
                 mfn = virt_to_mfn(d->shared_info);
             break;
         case XENMAPSPACE_grant_table:
-            spin_lock(&d->grant_table->lock);
+            write_lock(&d->grant_table->lock);
 
             if ( d->grant_table->gt_version == 0 )
                 d->grant_table->gt_version = 1;
@@ -4563,7 +4638,7 @@ int xenmem_add_to_physmap_one(
                     mfn = virt_to_mfn(d->grant_table->shared_raw[idx]);
             }
 
-            spin_unlock(&d->grant_table->lock);
+            write_unlock(&d->grant_table->lock);
             break;
         case XENMAPSPACE_gmfn_range:
         case XENMAPSPACE_gmfn:
@@ -168,8 +168,10 @@ nept_walk_tables(struct vcpu *v, unsigned long l2ga, ept_walk_t *gw)
     gfn_t base_gfn = _gfn(nhvm_vcpu_p2m_base(v) >> PAGE_SHIFT);
     mfn_t lxmfn;
     ept_entry_t *lxp = NULL;
+    struct nestedvcpu *nv = &vcpu_nestedhvm(v);
 
     memset(gw, 0, sizeof(*gw));
+    nv->nv_walk_levels = 0;
 
     for (lvl = 4; lvl > 0; lvl--)
     {
@@ -180,6 +182,11 @@ nept_walk_tables(struct vcpu *v, unsigned long l2ga, ept_walk_t *gw)
         unmap_domain_page(lxp);
         put_page(mfn_to_page(mfn_x(lxmfn)));
 
+        nv->nv_walk[4 - lvl].gfn = gfn_x(base_gfn);
+        nv->nv_walk[4 - lvl].idx = ept_lvl_table_offset(l2ga, lvl);
+        nv->nv_walk[4 - lvl].entry = gw->lxe[lvl].epte;
+        nv->nv_walk_levels = 5 - lvl;
+
         if ( nept_non_present_check(gw->lxe[lvl]) )
             goto non_present;
 
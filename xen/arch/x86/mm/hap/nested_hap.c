@@ -95,13 +95,313 @@ nestedp2m_write_p2m_entry(struct p2m_domain *p2m, unsigned long gfn,
     paging_unlock(d);
 }
 
+/********************************************/
+/*      NESTED P2M SOURCE TRACKING          */
+/********************************************/
+/*
+ * Each nested p2m remembers which L1 p2m table pages its entries were made
+ * from: a copy of the upper level tables, of which there are few, and a
+ * hash of the leaf ones.  When the L1 guest flushes its TLB for the nested
+ * p2m (INVEPT), only the L2 ranges under entries that have changed since
+ * need dropping, and the rest of the nested p2m stays warm.  Changes that
+ * L1 doesn't flush for may be missed, as they may by hardware.
+ */
+
+#define NP2M_ENTRIES (PAGE_SIZE / sizeof(uint64_t))
+/* Whether an L1 p2m entry maps anything: EPT's read, write or execute */
+#define np2m_entry_present(e) ((e) & 7)
+
+static uint64_t np2m_hash_table(const uint64_t *table)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    unsigned int i;
+
+    for ( i = 0; i < NP2M_ENTRIES; i++ )
+        h = (h ^ table[i]) * 0x100000001b3ULL;
+
+    return h;
+}
+
+/* Map the L1 table at gfn; NULL if it isn't there to be read. */
+static const uint64_t *np2m_map_table(struct domain *d, unsigned long gfn,
+                                      struct page_info **page)
+{
+    p2m_type_t p2mt;
+
+    *page = get_page_from_gfn(d, gfn, &p2mt, P2M_ALLOC);
+    if ( !*page )
+        return NULL;
+    if ( !p2m_is_ram(p2mt) )
+    {
+        put_page(*page);
+        return NULL;
+    }
+
+    return __map_domain_page(*page);
+}
+
+static void np2m_unmap_table(const uint64_t *table, struct page_info *page)
+{
+    if ( !table )
+        return;
+    unmap_domain_page(table);
+    put_page(page);
+}
+
+/* The slot for gfn, or the free one it would go in; NULL if full. */
+static struct np2m_src *np2m_src_slot(struct p2m_domain *p2m,
+                                      unsigned long gfn)
+{
+    unsigned int i, s = (gfn ^ (gfn >> 9)) & (NP2M_SRC_SLOTS - 1);
+    struct np2m_src *src;
+
+    for ( i = 0; i < NP2M_SRC_SLOTS; i++ )
+    {
+        src = &p2m->np2m_src[(s + i) & (NP2M_SRC_SLOTS - 1)];
+        if ( !src->level )
+            return src;
+        smp_rmb();
+        if ( src->gfn == gfn )
+            return src;
+    }
+
+    return NULL;
+}
+
+void nestedp2m_forget_sources(struct p2m_domain *p2m)
+{
+    unsigned int i;
+
+    if ( p2m->np2m_src && p2m->np2m_src_nr )
+    {
+        for ( i = 0; i < NP2M_SRC_SLOTS; i++ )
+            xfree(p2m->np2m_src[i].copy);
+        memset(p2m->np2m_src, 0, NP2M_SRC_SLOTS * sizeof(*p2m->np2m_src));
+    }
+    p2m->np2m_src_nr = 0;
+    p2m->np2m_src_lost = 0;
+}
+
+/* Work out, before taking any lock, which tables the L1 walk for L2_gpa
+ * read that p2m doesn't know about yet, and what they hold.  Returns how
+ * many, or -1 if the walk can't be accounted for. */
+static int
+nestedhap_walk_sources(struct vcpu *v, struct p2m_domain *p2m,
+                       paddr_t L2_gpa, struct np2m_src *srcs)
+{
+    struct nestedvcpu *nv = &vcpu_nestedhvm(v);
+    struct np2m_src *src, *known;
+    struct page_info *page;
+    const uint64_t *table;
+    unsigned int i, level;
+    int nr = 0;
+    bool_t same;
+
+    if ( !nv->nv_walk_levels )
+        return -1;
+
+    for ( i = 0; i < nv->nv_walk_levels; i++ )
+    {
+        src = &srcs[nr];
+        level = 4 - i;
+        src->gfn = nv->nv_walk[i].gfn;
+        src->base = (L2_gpa >> PAGE_SHIFT) & ~((1UL << (9 * level)) - 1);
+        src->level = level;
+        src->hash = 0;
+        src->copy = NULL;
+
+        /* Unlocked peek: if we get it wrong we just read it again. */
+        known = p2m->np2m_src ? np2m_src_slot(p2m, src->gfn) : NULL;
+        if ( known && known->level == level && known->base == src->base )
+            continue;
+
+        table = np2m_map_table(v->domain, src->gfn, &page);
+        if ( !table )
+            goto fail;
+        if ( level > 1 )
+        {
+            src->copy = xmalloc_array(uint64_t, NP2M_ENTRIES);
+            if ( src->copy )
+                memcpy(src->copy, table, PAGE_SIZE);
+            same = src->copy &&
+                   src->copy[nv->nv_walk[i].idx] == nv->nv_walk[i].entry;
+        }
+        else
+        {
+            /* The hash must be of contents that agree with the walk. */
+            src->hash = np2m_hash_table(table);
+            same = table[nv->nv_walk[i].idx] == nv->nv_walk[i].entry &&
+                   src->hash == np2m_hash_table(table);
+        }
+        np2m_unmap_table(table, page);
+        nr++;
+        if ( !same )
+            goto fail;
+    }
+
+    return nr;
+
+ fail:
+    while ( nr-- )
+        xfree(srcs[nr].copy);
+    return -1;
+}
+
+/* Under the p2m lock, now that entries made from srcs are in: record them.
+ * Copies taken over are cleared from srcs; the caller frees the rest. */
+static void
+nestedhap_add_sources(struct p2m_domain *p2m, struct np2m_src *srcs, int nr)
+{
+    struct np2m_src *src;
+    int i;
+
+    ASSERT(p2m_locked_by_me(p2m));
+
+    if ( nr < 0 )
+        goto lost;
+
+    if ( nr && !p2m->np2m_src )
+    {
+        p2m->np2m_src = xzalloc_array(struct np2m_src, NP2M_SRC_SLOTS);
+        if ( !p2m->np2m_src )
+            goto lost;
+    }
+
+    for ( i = 0; i < nr; i++ )
+    {
+        src = np2m_src_slot(p2m, srcs[i].gfn);
+        if ( !src )
+            goto lost;
+        if ( src->level )
+        {
+            /* Keep the older contents: if they differ, a flush drops more.
+             * A table used in more than one place is beyond us, though. */
+            if ( src->level != srcs[i].level || src->base != srcs[i].base )
+                goto lost;
+            continue;
+        }
+        src->gfn = srcs[i].gfn;
+        src->base = srcs[i].base;
+        src->hash = srcs[i].hash;
+        src->copy = srcs[i].copy;
+        srcs[i].copy = NULL;
+        smp_wmb();
+        src->level = srcs[i].level;
+        p2m->np2m_src_nr++;
+    }
+    return;
+
+ lost:
+    p2m->np2m_src_lost = 1;
+}
+
+/* Drop what p2m maps at [base, base + 2^order) */
+static bool_t np2m_drop(struct p2m_domain *p2m, unsigned long base,
+                        unsigned int order)
+{
+    /* Beyond a 1G entry, flushing the lot is cheaper */
+    if ( order > PAGE_ORDER_1G )
+        return 0;
+    perfc_incr(np2m_revalidate_drop);
+    return !p2m_set_entry(p2m, base, _mfn(INVALID_MFN), order, p2m_invalid,
+                          p2m->default_access);
+}
+
+/* Under the p2m lock: drop what was made from src if table, its current
+ * contents, differs. */
+static bool_t np2m_revalidate_one(struct p2m_domain *p2m, struct np2m_src *src,
+                                  const uint64_t *table)
+{
+    unsigned int i, order = 9 * (src->level - 1);
+    bool_t ok = 1;
+    uint64_t hash;
+
+    if ( !table )
+    {
+        /* Gone from under L1: drop all it mapped */
+        if ( src->copy )
+            memset(src->copy, 0, PAGE_SIZE);
+        src->hash = 0;
+        return np2m_drop(p2m, src->base, order + 9);
+    }
+
+    if ( !src->copy )
+    {
+        hash = np2m_hash_table(table);
+        if ( hash != src->hash )
+        {
+            ok = np2m_drop(p2m, src->base, order + 9);
+            src->hash = hash;
+        }
+        return ok;
+    }
+
+    for ( i = 0; ok && i < NP2M_ENTRIES; i++ )
+    {
+        if ( src->copy[i] == table[i] )
+            continue;
+        /* Nothing can have been made from an entry that wasn't present. */
+        if ( np2m_entry_present(src->copy[i]) )
+            ok = np2m_drop(p2m, src->base + ((unsigned long)i << order),
+                           order);
+        src->copy[i] = table[i];
+    }
+
+    return ok;
+}
+
+bool_t nestedp2m_revalidate(struct p2m_domain *p2m)
+{
+    struct domain *d = p2m->domain;
+    struct np2m_src *src;
+    struct page_info *page = NULL;
+    const uint64_t *table;
+    unsigned long gfn;
+    unsigned int i, level;
+    bool_t ok = 1;
+
+    if ( p2m->np2m_src_lost )
+        return 0;
+    if ( !p2m->np2m_src || !p2m->np2m_src_nr )
+        return 1;
+
+    for ( i = 0; ok && i < NP2M_SRC_SLOTS; i++ )
+    {
+        src = &p2m->np2m_src[i];
+        level = src->level;
+        if ( !level )
+            continue;
+        smp_rmb();
+        gfn = src->gfn;
+
+        /* Map with no lock held: this goes through the host p2m, whose
+         * lock may not be taken inside a nested p2m's. */
+        table = np2m_map_table(d, gfn, &page);
+
+        p2m_lock(p2m);
+        if ( p2m->np2m_src_lost )
+            ok = 0;
+        else if ( src->level == level && src->gfn == gfn )
+            ok = np2m_revalidate_one(p2m, src, table);
+        p2m_unlock(p2m);
+
+        np2m_unmap_table(table, page);
+    }
+
+    if ( ok )
+        perfc_incr(np2m_revalidate);
+
+    return ok;
+}
+
 /********************************************/
 /*          NESTED VIRT FUNCTIONS           */
 /********************************************/
 static void
 nestedhap_fix_p2m(struct vcpu *v, struct p2m_domain *p2m, 
                   paddr_t L2_gpa, paddr_t L0_gpa,
-                  unsigned int page_order, p2m_type_t p2mt, p2m_access_t p2ma)
+                  unsigned int page_order, p2m_type_t p2mt, p2m_access_t p2ma,
+                  struct np2m_src *srcs, int nr_srcs)
 {
     int rc = 0;
     ASSERT(p2m);
@@ -125,6 +425,8 @@ nestedhap_fix_p2m(struct vcpu *v, struct p2m_domain *p2m,
         mfn = _mfn((L0_gpa >> PAGE_SHIFT) & mask);
 
         rc = p2m_set_entry(p2m, gfn, mfn, page_order, p2mt, p2ma);
+        if ( !rc )
+            nestedhap_add_sources(p2m, srcs, nr_srcs);
     }
 
     p2m_unlock(p2m);
@@ -213,6 +515,8 @@ nestedhvm_hap_nested_page_fault(struct vcpu *v, paddr_t *L2_gpa,
     p2m_type_t p2mt_10;
     p2m_access_t p2ma_10 = p2m_access_rwx;
     uint8_t p2ma_21 = p2m_access_rwx;
+    struct np2m_src srcs[4];
+    int nr_srcs;
 
     p2m = p2m_get_hostp2m(d); /* L0 p2m */
     nested_p2m = p2m_get_nestedp2m(v, nhvm_vcpu_p2m_base(v));
@@ -280,9 +584,14 @@ nestedhvm_hap_nested_page_fault(struct vcpu *v, paddr_t *L2_gpa,
     /* Use minimal permission for nested p2m. */
     p2ma_10 &= (p2m_access_t)p2ma_21;
 
+    nr_srcs = nestedhap_walk_sources(v, nested_p2m, *L2_gpa, srcs);
+
     /* fix p2m_get_pagetable(nested_p2m) */
     nestedhap_fix_p2m(v, nested_p2m, *L2_gpa, L0_gpa, page_order_20,
-        p2mt_10, p2ma_10);
+        p2mt_10, p2ma_10, srcs, nr_srcs);
+
+    while ( nr_srcs-- > 0 )
+        xfree(srcs[nr_srcs].copy);
 
     return NESTEDHVM_PAGEFAULT_DONE;
 }
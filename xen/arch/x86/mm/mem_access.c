@@ -52,7 +52,8 @@ int mem_access_memop(unsigned long cmd,
         goto out;
 
     rc = -ENODEV;
-    if ( unlikely(!d->mem_event->access.ring_page) )
+    if ( unlikely(!d->mem_event->access.ring_page) &&
+         unlikely(!d->mem_event->access_port) )
         goto out;
 
     switch ( mao.op )
@@ -114,11 +115,12 @@ int mem_access_memop(unsigned long cmd,
 
 int mem_access_send_req(struct domain *d, mem_event_request_t *req)
 {
-    int rc = mem_event_claim_slot(d, &d->mem_event->access);
+    struct mem_event_domain *med = mem_access_ring(d);
+    int rc = mem_event_claim_slot(d, med);
     if ( rc < 0 )
         return rc;
 
-    mem_event_put_request(d, &d->mem_event->access, req);
+    mem_event_put_request(d, med, req);
 
     return 0;
 } 
@@ -40,6 +40,21 @@
 #define mem_event_ring_lock(_med)       spin_lock(&(_med)->ring_lock)
 #define mem_event_ring_unlock(_med)     spin_unlock(&(_med)->ring_lock)
 
+/* Called with the ring mapped and locked */
+static void mem_event_ring_init(struct mem_event_domain *med, int pause_flag)
+{
+    /* Prepare ring buffer */
+    FRONT_RING_INIT(&med->front_ring,
+                    (mem_event_sring_t *)med->ring_page,
+                    PAGE_SIZE);
+
+    /* Save the pause flag for this particular ring. */
+    med->pause_flag = pause_flag;
+
+    /* Initialize the last-chance wait queue. */
+    init_waitqueue_head(&med->wq);
+}
+
 static int mem_event_enable(
     struct domain *d,
     xen_domctl_mem_event_op_t *mec,
@@ -82,16 +97,7 @@ static int mem_event_enable(
 
     med->xen_port = mec->port = rc;
 
-    /* Prepare ring buffer */
-    FRONT_RING_INIT(&med->front_ring,
-                    (mem_event_sring_t *)med->ring_page,
-                    PAGE_SIZE);
-
-    /* Save the pause flag for this particular ring. */
-    med->pause_flag = pause_flag;
-
-    /* Initialize the last-chance wait queue. */
-    init_waitqueue_head(&med->wq);
+    mem_event_ring_init(med, pause_flag);
 
     mem_event_ring_unlock(med);
     return 0;
@@ -104,6 +110,70 @@ static int mem_event_enable(
     return rc;
 }
 
+/*
+ * Set up the access ring of the vcpu mec->vcpu, on the same page as the
+ * single ring would be.  The event channel is allocated with the first
+ * ring, and shared by all of them.
+ */
+static int mem_access_enable_vcpu(
+    struct domain *d,
+    xen_domctl_mem_event_op_t *mec,
+    xen_event_channel_notification_t notification_fn)
+{
+    struct mem_event_per_domain *mep = d->mem_event;
+    unsigned long ring_gfn = d->arch.hvm_domain.params[HVM_PARAM_ACCESS_RING_PFN];
+    struct mem_event_domain *med;
+    int rc;
+
+    if ( mec->vcpu >= d->max_vcpus || d->vcpu[mec->vcpu] == NULL )
+        return -EINVAL;
+
+    if ( mep->access.ring_page )
+        return -EBUSY;
+
+    if ( ring_gfn == 0 )
+        return -ENOSYS;
+
+    if ( !mep->access_vcpu )
+    {
+        mep->access_vcpu = xzalloc_array(struct mem_event_domain,
+                                         d->max_vcpus);
+        if ( !mep->access_vcpu )
+            return -ENOMEM;
+    }
+
+    med = &mep->access_vcpu[mec->vcpu];
+    if ( med->ring_page )
+        return -EBUSY;
+
+    if ( !mep->access_port )
+    {
+        rc = alloc_unbound_xen_event_channel(d->vcpu[0],
+                                             current->domain->domain_id,
+                                             notification_fn);
+        if ( rc < 0 )
+            return rc;
+        mep->access_port = rc;
+    }
+
+    mem_event_ring_lock_init(med);
+    mem_event_ring_lock(med);
+
+    rc = prepare_ring_for_helper(d, ring_gfn, &med->ring_pg_struct,
+                                 &med->ring_page);
+    if ( rc == 0 )
+    {
+        med->blocked = 0;
+        med->xen_port = mec->port = mep->access_port;
+        med->vcpu = d->vcpu[mec->vcpu];
+        mem_event_ring_init(med, _VPF_mem_access);
+    }
+
+    mem_event_ring_unlock(med);
+
+    return rc;
+}
+
 static unsigned int mem_event_ring_available(struct mem_event_domain *med)
 {
     int avail_req = RING_FREE_REQUESTS(&med->front_ring);
@@ -130,6 +200,17 @@ static void mem_event_wake_blocked(struct domain *d, struct mem_event_domain *me
     if ( avail_req == 0 || med->blocked == 0 )
         return;
 
+    /* Only its own vcpu puts requests on a per-vCPU ring */
+    if ( med->vcpu )
+    {
+        if ( test_and_clear_bit(med->pause_flag, &med->vcpu->pause_flags) )
+        {
+            vcpu_unpause(med->vcpu);
+            med->blocked--;
+        }
+        return;
+    }
+
     /*
      * We ensure that we only have vCPUs online if there are enough free slots
      * for their memory events to be processed.  This will ensure that no
@@ -214,11 +295,14 @@ static int mem_event_disable(struct domain *d, struct mem_event_domain *med)
         }
 
         /* Free domU's event channel and leave the other one unbound */
-        free_xen_event_channel(d->vcpu[0], med->xen_port);
+        if ( !med->vcpu )
+            free_xen_event_channel(d->vcpu[0], med->xen_port);
 
         /* Unblock all vCPUs */
         for_each_vcpu ( d, v )
         {
+            if ( med->vcpu && v != med->vcpu )
+                continue;
             if ( test_and_clear_bit(med->pause_flag, &v->pause_flags) )
             {
                 vcpu_unpause(v);
@@ -234,6 +318,26 @@ static int mem_event_disable(struct domain *d, struct mem_event_domain *med)
     return 0;
 }
 
+/* Tear down all the per-vCPU access rings, and their event channel */
+static int mem_access_disable_vcpus(struct domain *d)
+{
+    struct mem_event_per_domain *mep = d->mem_event;
+    unsigned int i;
+    int rc;
+
+    for ( i = 0; i < d->max_vcpus; i++ )
+    {
+        rc = mem_event_disable(d, &mep->access_vcpu[i]);
+        if ( rc )
+            return rc;
+    }
+
+    free_xen_event_channel(d->vcpu[0], mep->access_port);
+    mep->access_port = 0;
+
+    return 0;
+}
+
 static inline void mem_event_release_slot(struct domain *d,
                                           struct mem_event_domain *med)
 {
@@ -304,7 +408,7 @@ void mem_event_put_request(struct domain *d,
      * See the comments above wake_blocked() for more information
      * on how this mechanism works to avoid waiting. */
     avail_req = mem_event_ring_available(med);
-    if( current->domain == d && avail_req < d->max_vcpus )
+    if( current->domain == d && avail_req < (med->vcpu ? 1 : d->max_vcpus) )
         mem_event_mark_and_pause(current, med);
 
     mem_event_ring_unlock(med);
@@ -312,37 +416,53 @@ void mem_event_put_request(struct domain *d,
     notify_via_xen_event_channel(d, med->xen_port);
 }
 
-int mem_event_get_response(struct domain *d, struct mem_event_domain *med, mem_event_response_t *rsp)
+int mem_event_get_responses(struct domain *d, struct mem_event_domain *med,
+                            mem_event_response_t *rsp, unsigned int nr)
 {
     mem_event_front_ring_t *front_ring;
     RING_IDX rsp_cons;
+    unsigned int i;
 
     mem_event_ring_lock(med);
 
+    if ( !med->ring_page )
+    {
+        mem_event_ring_unlock(med);
+        return 0;
+    }
+
     front_ring = &med->front_ring;
     rsp_cons = front_ring->rsp_cons;
 
-    if ( !RING_HAS_UNCONSUMED_RESPONSES(front_ring) )
+    /* Copy responses */
+    for ( i = 0; i < nr && RING_HAS_UNCONSUMED_RESPONSES(front_ring); i++ )
+    {
+        memcpy(&rsp[i], RING_GET_RESPONSE(front_ring, rsp_cons),
+               sizeof(*rsp));
+        front_ring->rsp_cons = ++rsp_cons;
+    }
+
+    if ( i == 0 )
     {
         mem_event_ring_unlock(med);
         return 0;
     }
 
-    /* Copy response */
-    memcpy(rsp, RING_GET_RESPONSE(front_ring, rsp_cons), sizeof(*rsp));
-    rsp_cons++;
-
     /* Update ring */
-    front_ring->rsp_cons = rsp_cons;
     front_ring->sring->rsp_event = rsp_cons + 1;
 
-    /* Kick any waiters -- since we've just consumed an event,
+    /* Kick any waiters -- since we've just consumed events,
      * there may be additional space available in the ring. */
     mem_event_wake(d, med);
 
     mem_event_ring_unlock(med);
 
-    return 1;
+    return i;
+}
+
+int mem_event_get_response(struct domain *d, struct mem_event_domain *med, mem_event_response_t *rsp)
+{
+    return mem_event_get_responses(d, med, rsp, 1);
 }
 
 void mem_event_cancel_slot(struct domain *d, struct mem_event_domain *med)
@@ -398,6 +518,16 @@ bool_t mem_event_check_ring(struct mem_event_domain *med)
     return (med->ring_page != NULL);
 }
 
+struct mem_event_domain *mem_access_ring(struct domain *d)
+{
+    struct mem_event_per_domain *mep = d->mem_event;
+
+    if ( mep->access_vcpu && current->domain == d )
+        return &mep->access_vcpu[current->vcpu_id];
+
+    return &mep->access;
+}
+
 /*
  * Determines whether or not the current vCPU belongs to the target domain,
  * and calls the appropriate wait function.  If it is a guest vCPU, then we
@@ -429,7 +559,8 @@ static void mem_paging_notification(struct vcpu *v, unsigned int port)
 /* Registered with Xen-bound event channel for incoming notifications. */
 static void mem_access_notification(struct vcpu *v, unsigned int port)
 {
-    if ( likely(v->domain->mem_event->access.ring_page != NULL) )
+    if ( likely(v->domain->mem_event->access.ring_page != NULL) ||
+         likely(v->domain->mem_event->access_port) )
         p2m_mem_access_resume(v->domain);
 }
 
@@ -488,6 +619,17 @@ void mem_event_cleanup(struct domain *d)
         destroy_waitqueue_head(&d->mem_event->access.wq);
         (void)mem_event_disable(d, &d->mem_event->access);
     }
+    if ( d->mem_event->access_vcpu ) {
+        unsigned int i;
+
+        for ( i = 0; i < d->max_vcpus; i++ )
+            if ( d->mem_event->access_vcpu[i].ring_page )
+                destroy_waitqueue_head(&d->mem_event->access_vcpu[i].wq);
+        if ( d->mem_event->access_port )
+            (void)mem_access_disable_vcpus(d);
+        xfree(d->mem_event->access_vcpu);
+        d->mem_event->access_vcpu = NULL;
+    }
     if ( d->mem_event->share.ring_page ) {
         destroy_waitqueue_head(&d->mem_event->share.wq);
         (void)mem_event_disable(d, &d->mem_event->share);
@@ -597,16 +739,37 @@ int mem_event_domctl(struct domain *d, xen_domctl_mem_event_op_t *mec,
             if ( !cpu_has_vmx )
                 break;
 
+            rc = -EBUSY;
+            if ( d->mem_event->access_port )
+                break;
+
             rc = mem_event_enable(d, mec, med, _VPF_mem_access, 
                                     HVM_PARAM_ACCESS_RING_PFN,
                                     mem_access_notification);
         }
         break;
 
+        case XEN_DOMCTL_MEM_EVENT_OP_ACCESS_ENABLE_VCPU:
+        {
+            rc = -ENODEV;
+            /* Only HAP is supported */
+            if ( !hap_enabled(d) )
+                break;
+
+            /* Currently only EPT is supported */
+            if ( !cpu_has_vmx )
+                break;
+
+            rc = mem_access_enable_vcpu(d, mec, mem_access_notification);
+        }
+        break;
+
         case XEN_DOMCTL_MEM_EVENT_OP_ACCESS_DISABLE:
         {
             if ( med->ring_page )
                 rc = mem_event_disable(d, med);
+            else if ( d->mem_event->access_port )
+                rc = mem_access_disable_vcpus(d);
         }
         break;
 
@@ -26,6 +26,7 @@
 #include <xen/spinlock.h>
 #include <xen/mm.h>
 #include <xen/grant_table.h>
+#include <xen/guest_access.h>
 #include <xen/sched.h>
 #include <asm/page.h>
 #include <asm/string.h>
@@ -1308,6 +1309,205 @@ int relinquish_shared_pages(struct domain *d)
     return rc;
 }
 
+/*
+ * Page fingerprints: the CRC32C of the even and of the odd words of a page,
+ * two independent chains for the CRC32 instruction of SSE4.2 (which only
+ * uses general purpose registers).  The table is the same CRC done a byte
+ * at a time, for the CPUs without it.
+ */
+static uint32_t crc32c_table[256];
+
+static int __init mem_sharing_hash_init(void)
+{
+    unsigned int i, j;
+    uint32_t crc;
+
+    for ( i = 0; i < 256; i++ )
+    {
+        for ( crc = i, j = 0; j < 8; j++ )
+            crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78 : 0);
+        crc32c_table[i] = crc;
+    }
+
+    return 0;
+}
+__initcall(mem_sharing_hash_init);
+
+static inline uint64_t crc32c_u64(uint64_t crc, uint64_t v)
+{
+    unsigned int i;
+
+    for ( i = 0; i < 8; i++, v >>= 8 )
+        crc = crc32c_table[(crc ^ v) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+static uint64_t mem_sharing_hash_page(const uint64_t *p)
+{
+    uint64_t lo = ~0u, hi = ~0u;
+    unsigned int i;
+
+    if ( cpu_has_sse4_2 )
+        for ( i = 0; i < PAGE_SIZE / sizeof(*p); i += 2 )
+            asm ( "crc32q %2, %0; crc32q %3, %1"
+                  : "+r" (lo), "+r" (hi) : "rm" (p[i]), "rm" (p[i + 1]) );
+    else
+        for ( i = 0; i < PAGE_SIZE / sizeof(*p); i += 2 )
+        {
+            lo = crc32c_u64(lo, p[i]);
+            hi = crc32c_u64(hi, p[i + 1]);
+        }
+
+    return ((uint64_t)(uint32_t)~hi << 32) | (uint32_t)~lo;
+}
+
+/* Hash the gfns of a range from h->done on, -ERESTART every so often */
+static int mem_sharing_hash_range(struct domain *d,
+                                  struct mem_sharing_op_hash *h)
+{
+    struct page_info *page;
+    p2m_type_t p2mt;
+    unsigned long gfn;
+    uint64_t hash;
+    void *map;
+
+    if ( h->done > h->nr || h->first_gfn + h->nr < h->first_gfn )
+        return -EINVAL;
+
+    while ( h->done < h->nr )
+    {
+        gfn = h->first_gfn + h->done;
+        hash = XENMEM_SHARING_HASH_INVALID;
+
+        /* A query: PoD and paged out gfns are left alone */
+        page = get_page_from_gfn(d, gfn, &p2mt, 0);
+        if ( page )
+        {
+            if ( p2m_is_ram(p2mt) )
+            {
+                map = __map_domain_page(page);
+                hash = mem_sharing_hash_page(map);
+                unmap_domain_page(map);
+            }
+            put_page(page);
+        }
+
+        if ( copy_to_guest_offset(h->hashes, h->done, &hash, 1) )
+            return -EFAULT;
+
+        /* Preempt every 64 pages - arbitrary. */
+        if ( !(++h->done & 0x3f) && h->done < h->nr &&
+             hypercall_preempt_check() )
+            return -ERESTART;
+    }
+
+    return 0;
+}
+
+/* Lock the client domain of a batch entry, unless it is the last one's */
+static int mem_sharing_batch_client(struct domain *d, domid_t domid,
+                                    struct domain **cd)
+{
+    int rc;
+
+    if ( *cd && (*cd)->domain_id == domid )
+        return 0;
+
+    if ( *cd )
+        rcu_unlock_domain(*cd);
+    *cd = NULL;
+
+    rc = rcu_lock_live_remote_domain_by_id(domid, cd);
+    if ( rc )
+    {
+        *cd = NULL;
+        return rc;
+    }
+
+    rc = xsm_mem_sharing_op(XSM_DM_PRIV, d, *cd, XENMEM_sharing_op_share);
+    if ( !rc && !mem_sharing_enabled(*cd) )
+        rc = -EINVAL;
+    if ( rc )
+    {
+        rcu_unlock_domain(*cd);
+        *cd = NULL;
+    }
+
+    return rc;
+}
+
+/*
+ * Share the entries of a batch from b->done on, -ERESTART every so often.
+ * The result of each is in the entry, only failing to access the entries
+ * fails the op.
+ */
+static int mem_sharing_share_batch(struct domain *d,
+                                   struct mem_sharing_op_share_batch *b)
+{
+    xen_mem_sharing_batch_entry_t e;
+    struct domain *cd = NULL;
+    shr_handle_t handle;
+    int rc = 0;
+
+    if ( b->done > b->nr )
+        return -EINVAL;
+
+    while ( b->done < b->nr )
+    {
+        if ( copy_from_guest_offset(&e, b->entries, b->done, 1) )
+        {
+            rc = -EFAULT;
+            break;
+        }
+
+        e.rc = mem_sharing_batch_client(d, e.client_domain, &cd);
+        if ( !e.rc && (e.flags & ~XENMEM_SHARING_BATCH_ADD_PHYSMAP) )
+            e.rc = -EINVAL;
+        if ( !e.rc && !e.source_handle )
+        {
+            e.rc = mem_sharing_nominate_page(d, e.source_gfn, 0, &handle);
+            e.source_handle = e.rc ? 0 : handle;
+        }
+        if ( !e.rc && (e.flags & XENMEM_SHARING_BATCH_ADD_PHYSMAP) )
+            e.rc = mem_sharing_add_to_physmap(d, e.source_gfn,
+                                              e.source_handle,
+                                              cd, e.client_gfn);
+        else if ( !e.rc )
+        {
+            if ( !e.client_handle )
+            {
+                e.rc = mem_sharing_nominate_page(cd, e.client_gfn, 0,
+                                                 &handle);
+                e.client_handle = e.rc ? 0 : handle;
+            }
+            if ( !e.rc )
+                e.rc = mem_sharing_share_pages(d, e.source_gfn,
+                                               e.source_handle,
+                                               cd, e.client_gfn,
+                                               e.client_handle);
+        }
+
+        if ( copy_to_guest_offset(b->entries, b->done, &e, 1) )
+        {
+            rc = -EFAULT;
+            break;
+        }
+
+        /* Preempt every 32 entries - arbitrary. */
+        if ( !(++b->done & 0x1f) && b->done < b->nr &&
+             hypercall_preempt_check() )
+        {
+            rc = -ERESTART;
+            break;
+        }
+    }
+
+    if ( cd )
+        rcu_unlock_domain(cd);
+
+    return rc;
+}
+
 int mem_sharing_memop(struct domain *d, xen_mem_sharing_op_t *mec)
 {
     int rc = 0;
@@ -1474,6 +1674,16 @@ int mem_sharing_memop(struct domain *d, xen_mem_sharing_op_t *mec)
         }
         break;
 
+        case XENMEM_sharing_op_hash:
+            rc = mem_sharing_hash_range(d, &mec->u.hash);
+            break;
+
+        case XENMEM_sharing_op_share_batch:
+            if ( !mem_sharing_enabled(d) )
+                return -EINVAL;
+            rc = mem_sharing_share_batch(d, &mec->u.share_batch);
+            break;
+
         default:
             rc = -ENOSYS;
             break;
@@ -31,9 +31,21 @@
 #include <asm/hvm/cacheattr.h>
 #include <xen/keyhandler.h>
 #include <xen/softirq.h>
+#include <xen/event.h>
 
 #include "mm-locks.h"
 
+/*
+ * Resolve the entries a type or memory type change misconfigured in the
+ * background, from tasklets, rather than on the EPT_MISCONFIG exits of the
+ * guest touching them.
+ */
+static bool_t __read_mostly opt_ept_prefetch_recalc;
+boolean_param("ept_prefetch_recalc", opt_ept_prefetch_recalc);
+
+/* Leaf tables, 2MB of gfns each, the tasklet resolves per run. */
+#define EPT_RECALC_BATCH 32
+
 #define atomic_read_ept_entry(__pepte)                              \
     ( (ept_entry_t) { .epte = read_atomic(&(__pepte)->epte) } )
 
@@ -102,7 +114,8 @@ static int atomic_write_ept_entry(ept_entry_t *entryptr, ept_entry_t new,
     return rc;
 }
 
-static void ept_p2m_type_to_flags(ept_entry_t *entry, p2m_type_t type, p2m_access_t access)
+static void ept_p2m_type_to_flags(struct p2m_domain *p2m, ept_entry_t *entry,
+                                  p2m_type_t type, p2m_access_t access)
 {
     /* First apply type permissions */
     switch(type)
@@ -125,6 +138,16 @@ static void ept_p2m_type_to_flags(ept_entry_t *entry, p2m_type_t type, p2m_acces
                                                     entry->mfn);
             break;
         case p2m_ram_logdirty:
+            entry->r = entry->x = 1;
+            /*
+             * With PML, a 4k page only needs its dirty bit clear for the
+             * CPU to log the first write to it, see p2m_mark_logged_dirty().
+             * Superpages are still write protected, to be split on the
+             * first write.
+             */
+            entry->w = vmx_domain_pml_enabled(p2m->domain) &&
+                       !p2m_is_nestedp2m(p2m) && !is_epte_superpage(entry);
+            break;
         case p2m_ram_ro:
         case p2m_ram_shared:
             entry->r = entry->x = 1;
@@ -171,7 +194,13 @@ static void ept_p2m_type_to_flags(ept_entry_t *entry, p2m_type_t type, p2m_acces
         case p2m_access_rwx:
             break;
     }
-    
+
+    /*
+     * The CPU needn't set the accessed and dirty bits when they are in
+     * use, the only dirty bit it is left to set is that of a logged page.
+     */
+    entry->a = 1;
+    entry->d = entry->w && type != p2m_ram_logdirty;
 }
 
 #define GUEST_TABLE_MAP_FAILED  0
@@ -193,6 +222,7 @@ static int ept_set_middle_entry(struct p2m_domain *p2m, ept_entry_t *ept_entry)
     ept_entry->access = p2m->default_access;
 
     ept_entry->r = ept_entry->w = ept_entry->x = 1;
+    ept_entry->a = 1;
 
     return 1;
 }
@@ -205,6 +235,9 @@ static void ept_free_entry(struct p2m_domain *p2m, ept_entry_t *ept_entry, int l
          is_epte_superpage(ept_entry) )
         return;
 
+    /* The hardware mustn't be left walking the tables freed below. */
+    p2m_tlb_flush_sync(p2m);
+
     if ( level > 1 )
     {
         ept_entry_t *epte = map_domain_page(ept_entry->mfn);
@@ -243,10 +276,9 @@ static int ept_split_super_page(struct p2m_domain *p2m, ept_entry_t *ept_entry,
         epte->sp = (level > 1);
         epte->mfn += i * trunk;
         epte->snp = (iommu_enabled && iommu_snoop);
-        ASSERT(!epte->rsvd1);
         ASSERT(!epte->avail3);
 
-        ept_p2m_type_to_flags(epte, epte->sa_p2mt, epte->access);
+        ept_p2m_type_to_flags(p2m, epte, epte->sa_p2mt, epte->access);
 
         if ( (level - 1) == target )
             continue;
@@ -488,7 +520,7 @@ static int resolve_misconfig(struct p2m_domain *p2m, unsigned long gfn)
                     {
                          e.sa_p2mt = p2m_is_logdirty_range(p2m, gfn + i, gfn + i)
                                      ? p2m_ram_logdirty : p2m_ram_rw;
-                         ept_p2m_type_to_flags(&e, e.sa_p2mt, e.access);
+                         ept_p2m_type_to_flags(p2m, &e, e.sa_p2mt, e.access);
                     }
                     e.recalc = 0;
                     wrc = atomic_write_ept_entry(&epte[i], e, level);
@@ -540,7 +572,7 @@ static int resolve_misconfig(struct p2m_domain *p2m, unsigned long gfn)
                 e.ipat = ipat;
                 e.recalc = 0;
                 if ( recalc && p2m_is_changeable(e.sa_p2mt) )
-                    ept_p2m_type_to_flags(&e, e.sa_p2mt, e.access);
+                    ept_p2m_type_to_flags(p2m, &e, e.sa_p2mt, e.access);
                 wrc = atomic_write_ept_entry(&epte[i], e, level);
                 ASSERT(wrc == 0);
             }
@@ -751,7 +783,7 @@ ept_set_entry(struct p2m_domain *p2m, unsigned long gfn, mfn_t mfn,
         if ( ept_entry->mfn == new_entry.mfn )
              need_modify_vtd_table = 0;
 
-        ept_p2m_type_to_flags(&new_entry, p2mt, p2ma);
+        ept_p2m_type_to_flags(p2m, &new_entry, p2mt, p2ma);
     }
 
     rc = atomic_write_ept_entry(ept_entry, new_entry, target);
@@ -766,7 +798,12 @@ out:
     unmap_domain_page(table);
 
     if ( needs_sync != sync_off )
-        ept_sync_domain(p2m);
+    {
+        if ( p2m->defer_flush )
+            p2m->need_flush = 1;
+        else
+            ept_sync_domain(p2m);
+    }
 
     /* For non-nested p2m, may need to change VT-d page table.*/
     if ( rc == 0 && !p2m_is_nestedp2m(p2m) && need_iommu(d) &&
@@ -779,11 +816,9 @@ out:
             unsigned int flags = p2m_get_iommu_flags(p2mt);
 
             if ( flags != 0 )
-                for ( i = 0; i < (1 << order); i++ )
-                    iommu_map_page(d, gfn + i, mfn_x(mfn) + i, flags);
+                iommu_map_pages(d, gfn, mfn_x(mfn), 1UL << order, flags);
             else
-                for ( i = 0; i < (1 << order); i++ )
-                    iommu_unmap_page(d, gfn + i);
+                iommu_unmap_pages(d, gfn, 1UL << order);
         }
     }
 
@@ -953,6 +988,70 @@ out:
     return;
 }
 
+/* Run the recalc tasklet on a CPU the domain doesn't run on, if there is one. */
+static void ept_recalc_schedule(struct p2m_domain *p2m)
+{
+    struct domain *d = p2m->domain;
+    unsigned int i, cpu = smp_processor_id();
+
+    for ( i = num_online_cpus(); i; i-- )
+    {
+        cpu = cpumask_cycle(cpu, &cpu_online_map);
+        if ( !cpumask_test_cpu(cpu, d->domain_dirty_cpumask) )
+            break;
+    }
+
+    tasklet_schedule_on_cpu(&p2m->ept.recalc_tasklet, cpu);
+}
+
+static void ept_recalc_tasklet(unsigned long data)
+{
+    struct p2m_domain *p2m = (struct p2m_domain *)data;
+    struct ept_data *ept = &p2m->ept;
+    unsigned int n;
+    int rc, changed = 0;
+
+    p2m_lock(p2m);
+
+    for ( n = 0; n < EPT_RECALC_BATCH; n++ )
+    {
+        if ( ept->recalc_gfn > p2m->max_mapped_pfn )
+            break;
+        rc = resolve_misconfig(p2m, ept->recalc_gfn);
+        if ( rc < 0 )
+        {
+            /* Leave the rest to EPT_MISCONFIG exits. */
+            ept->recalc_gfn = ~0UL;
+            break;
+        }
+        changed |= rc;
+        ept->recalc_gfn += 1UL << EPT_TABLE_ORDER;
+    }
+
+    if ( changed )
+        ept_sync_domain(p2m);
+
+    if ( ept->recalc_gfn > p2m->max_mapped_pfn )
+        ept->recalc_gfn = ~0UL;
+    else
+        ept_recalc_schedule(p2m);
+
+    p2m_unlock(p2m);
+}
+
+/* Entries from first_gfn on were just misconfigured. */
+static void ept_recalc_prefetch(struct p2m_domain *p2m, unsigned long first_gfn)
+{
+    struct ept_data *ept = &p2m->ept;
+
+    if ( !opt_ept_prefetch_recalc || p2m_is_nestedp2m(p2m) )
+        return;
+
+    if ( first_gfn < ept->recalc_gfn )
+        ept->recalc_gfn = first_gfn & ~((1UL << EPT_TABLE_ORDER) - 1);
+    ept_recalc_schedule(p2m);
+}
+
 static void ept_change_entry_type_global(struct p2m_domain *p2m,
                                          p2m_type_t ot, p2m_type_t nt)
 {
@@ -962,7 +1061,10 @@ static void ept_change_entry_type_global(struct p2m_domain *p2m,
         return;
 
     if ( ept_invalidate_emt(_mfn(mfn), 1, ept_get_wl(&p2m->ept)) )
+    {
         ept_sync_domain(p2m);
+        ept_recalc_prefetch(p2m, 0);
+    }
 }
 
 static int ept_change_entry_type_range(struct p2m_domain *p2m,
@@ -971,7 +1073,7 @@ static int ept_change_entry_type_range(struct p2m_domain *p2m,
                                        unsigned long last_gfn)
 {
     unsigned int i, wl = ept_get_wl(&p2m->ept);
-    unsigned long mask = (1 << EPT_TABLE_ORDER) - 1;
+    unsigned long mask = (1 << EPT_TABLE_ORDER) - 1, range_start = first_gfn;
     int rc = 0, sync = 0;
 
     if ( !ept_get_asr(&p2m->ept) )
@@ -1007,11 +1109,143 @@ static int ept_change_entry_type_range(struct p2m_domain *p2m,
     }
 
     if ( sync )
+    {
         ept_sync_domain(p2m);
+        ept_recalc_prefetch(p2m, range_start);
+    }
 
     return rc < 0 ? rc : 0;
 }
 
+/*
+ * Whether the 512 entries of the table behind the level 'level' entry
+ * at gfn map naturally aligned, contiguous ram the same way, so that a
+ * superpage can replace them.  On success *sp is that superpage.
+ */
+static bool_t ept_can_coalesce(struct p2m_domain *p2m, ept_entry_t *table,
+                               unsigned int level, unsigned long gfn,
+                               ept_entry_t *sp)
+{
+    unsigned int i, order = (level - 1) * EPT_TABLE_ORDER;
+    ept_entry_t e = table[0];
+    uint8_t ipat = 0;
+
+    if ( !is_epte_present(&e) || (level > 1 && !is_epte_superpage(&e)) ||
+         e.recalc || e.sa_p2mt != p2m_ram_rw ||
+         (e.mfn & ((1UL << (level * EPT_TABLE_ORDER)) - 1)) )
+        return 0;
+
+    for ( i = 1; i < EPT_PAGETABLE_ENTRIES; i++ )
+    {
+        e.mfn += 1UL << order;
+        if ( table[i].epte != e.epte )
+            return 0;
+    }
+
+    *sp = table[0];
+    if ( epte_get_entry_emt(p2m->domain, gfn, _mfn(sp->mfn),
+                            level * EPT_TABLE_ORDER, &ipat, 0) != sp->emt ||
+         ipat != sp->ipat )
+        return 0;
+    sp->sp = 1;
+
+    return 1;
+}
+
+/*
+ * Coalesce what can be under the non-leaf level 'level' entry at gfn,
+ * its children first, then the entry itself if level <= max_level.
+ * Entries ending before *next were done by an earlier, preempted call.
+ */
+static int ept_coalesce_entry(struct p2m_domain *p2m, ept_entry_t *entry,
+                              unsigned int level, unsigned int max_level,
+                              unsigned long gfn, unsigned long *next,
+                              unsigned long nr[2])
+{
+    struct domain *d = p2m->domain;
+    unsigned int i, order = (level - 1) * EPT_TABLE_ORDER;
+    unsigned long child_gfn;
+    ept_entry_t *table, old, sp;
+    bool_t collapse;
+    int rc;
+
+    table = map_domain_page(entry->mfn);
+
+    for ( i = 0; level > 1 && i < EPT_PAGETABLE_ENTRIES; i++ )
+    {
+        child_gfn = gfn + ((unsigned long)i << order);
+        if ( child_gfn + (1UL << order) <= *next ||
+             !is_epte_present(table + i) || is_epte_superpage(table + i) )
+            continue;
+
+        rc = ept_coalesce_entry(p2m, table + i, level - 1, max_level,
+                                child_gfn, next, nr);
+        if ( rc )
+        {
+            unmap_domain_page(table);
+            return rc;
+        }
+
+        *next = child_gfn + (1UL << order);
+        if ( hypercall_preempt_check() )
+        {
+            unmap_domain_page(table);
+            return -ERESTART;
+        }
+    }
+
+    collapse = level <= max_level &&
+               ept_can_coalesce(p2m, table, level, gfn, &sp);
+    unmap_domain_page(table);
+    if ( !collapse )
+        return 0;
+
+    old = *entry;
+    atomic_write_ept_entry(entry, sp, level);
+    if ( need_iommu(d) && iommu_hap_pt_share )
+        iommu_pte_flush(d, gfn, &entry->epte, level * EPT_TABLE_ORDER, 1);
+
+    /* Flushes before the table goes. */
+    p2m->need_flush = 1;
+    ept_free_entry(p2m, &old, level);
+
+    nr[level - 1]++;
+
+    return 0;
+}
+
+static int ept_coalesce(struct p2m_domain *p2m, unsigned int max_level,
+                        unsigned long *next, unsigned long nr[2])
+{
+    struct ept_data *ept = &p2m->ept;
+    unsigned int i, wl = ept_get_wl(ept);
+    unsigned int order = wl * EPT_TABLE_ORDER;
+    unsigned long gfn;
+    ept_entry_t *table;
+    int rc = 0;
+
+    if ( !ept_get_asr(ept) )
+        return -EINVAL;
+
+    table = map_domain_page(ept_get_asr(ept));
+    for ( i = 0; i < EPT_PAGETABLE_ENTRIES; i++ )
+    {
+        gfn = (unsigned long)i << order;
+        if ( gfn > p2m->max_mapped_pfn )
+            break;
+        if ( gfn + (1UL << order) <= *next || !is_epte_present(table + i) )
+            continue;
+
+        rc = ept_coalesce_entry(p2m, table + i, wl, max_level, gfn, next, nr);
+        if ( rc )
+            break;
+        *next = gfn + (1UL << order);
+    }
+    unmap_domain_page(table);
+
+    return rc;
+}
+
 static void ept_memory_type_changed(struct p2m_domain *p2m)
 {
     unsigned long mfn = ept_get_asr(&p2m->ept);
@@ -1020,7 +1254,10 @@ static void ept_memory_type_changed(struct p2m_domain *p2m)
         return;
 
     if ( ept_invalidate_emt(_mfn(mfn), 0, ept_get_wl(&p2m->ept)) )
+    {
         ept_sync_domain(p2m);
+        ept_recalc_prefetch(p2m, 0);
+    }
 }
 
 static void __ept_sync_domain(void *info)
@@ -1053,6 +1290,21 @@ void ept_sync_domain(struct p2m_domain *p2m)
                      __ept_sync_domain, p2m, 1);
 }
 
+static int ept_enable_pml(struct p2m_domain *p2m)
+{
+    return vmx_domain_enable_pml(p2m->domain);
+}
+
+static void ept_disable_pml(struct p2m_domain *p2m)
+{
+    vmx_domain_disable_pml(p2m->domain);
+}
+
+static void ept_flush_pml_buffers(struct p2m_domain *p2m)
+{
+    vmx_domain_flush_pml_buffers(p2m->domain);
+}
+
 int ept_p2m_init(struct p2m_domain *p2m)
 {
     struct ept_data *ept = &p2m->ept;
@@ -1063,6 +1315,8 @@ int ept_p2m_init(struct p2m_domain *p2m)
     p2m->change_entry_type_range = ept_change_entry_type_range;
     p2m->memory_type_changed = ept_memory_type_changed;
     p2m->audit_p2m = NULL;
+    p2m->tlb_flush = ept_sync_domain;
+    p2m->coalesce = ept_coalesce;
 
     /* Set the memory type used when accessing EPT paging structures. */
     ept->ept_mt = EPT_DEFAULT_MT;
@@ -1070,9 +1324,21 @@ int ept_p2m_init(struct p2m_domain *p2m)
     /* set EPT page-walk length, now it's actual walk length - 1, i.e. 3 */
     ept->ept_wl = 3;
 
+    if ( cpu_has_vmx_pml )
+    {
+        /* PML logs the updates of the EPT dirty bits. */
+        ept->ept_ad = 1;
+        p2m->enable_hardware_log_dirty = ept_enable_pml;
+        p2m->disable_hardware_log_dirty = ept_disable_pml;
+        p2m->flush_hardware_cached_dirty = ept_flush_pml_buffers;
+    }
+
     if ( !zalloc_cpumask_var(&ept->synced_mask) )
         return -ENOMEM;
 
+    tasklet_init(&ept->recalc_tasklet, ept_recalc_tasklet, (unsigned long)p2m);
+    ept->recalc_gfn = ~0UL;
+
     on_each_cpu(__ept_sync_domain, p2m, 1);
 
     return 0;
@@ -1081,6 +1347,8 @@ int ept_p2m_init(struct p2m_domain *p2m)
 void ept_p2m_uninit(struct p2m_domain *p2m)
 {
     struct ept_data *ept = &p2m->ept;
+
+    tasklet_kill(&ept->recalc_tasklet);
     free_cpumask_var(ept->synced_mask);
 }
 
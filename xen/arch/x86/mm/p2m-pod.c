@@ -102,6 +102,9 @@ p2m_pod_cache_add(struct p2m_domain *p2m,
 
     ASSERT(pod_locked_by_me(p2m));
 
+    /* Pages to find again, for the reclaim tasklet */
+    p2m->pod.reclaim_idle = 0;
+
     /*
      * Pages from domain_alloc and returned by the balloon driver aren't
      * guaranteed to be zero; but by reclaiming zero pages, we implicitly
@@ -384,6 +387,7 @@ p2m_pod_empty_cache(struct domain *d)
 
     /* After this barrier no new PoD activities can happen. */
     BUG_ON(!d->is_dying);
+    tasklet_kill(&p2m->pod.reclaim_tasklet);
     spin_barrier(&p2m->pod.lock.lock);
 
     lock_page_alloc(p2m);
@@ -644,6 +648,27 @@ void p2m_pod_dump_data(struct domain *d)
 }
 
 
+/* Quick zero-check of the first (cache line of) words of a page, and the
+ * full one */
+#define POD_QUICK_CHECK_WORDS 16
+#define POD_PAGE_WORDS (PAGE_SIZE / sizeof(unsigned long))
+
+/* Whether the first nr words of map are zero.  Xen runs without the FPU,
+ * so rather than SIMD the words are or'd a cache line at a time, leaving
+ * the loads independent of each other and a branch per line. */
+static bool_t
+p2m_pod_words_zero(const unsigned long *map, unsigned int nr)
+{
+    unsigned int i;
+
+    for ( i = 0; i < nr; i += 8 )
+        if ( map[i] | map[i + 1] | map[i + 2] | map[i + 3] |
+             map[i + 4] | map[i + 5] | map[i + 6] | map[i + 7] )
+            return 0;
+
+    return 1;
+}
+
 /* Search for all-zero superpages to be reclaimed as superpages for the
  * PoD cache. Must be called w/ pod lock held, must lock the superpage
  * in the p2m */
@@ -654,7 +679,7 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, unsigned long gfn)
     p2m_type_t type, type0 = 0;
     unsigned long * map = NULL;
     int ret=0, reset = 0;
-    int i, j;
+    int i;
     int max_ref = 1;
     struct domain *d = p2m->domain;
 
@@ -712,14 +737,15 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, unsigned long gfn)
         /* Quick zero-check */
         map = map_domain_page(mfn_x(mfn0) + i);
 
-        for ( j=0; j<16; j++ )
-            if( *(map+j) != 0 )
-                break;
+        reset = !p2m_pod_words_zero(map, POD_QUICK_CHECK_WORDS);
 
         unmap_domain_page(map);
 
-        if ( j < 16 )
+        if ( reset )
+        {
+            reset = 0;
             goto out;
+        }
 
     }
 
@@ -745,12 +771,7 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, unsigned long gfn)
     {
         map = map_domain_page(mfn_x(mfn0) + i);
 
-        for ( j=0; j<PAGE_SIZE/sizeof(*map); j++ )
-            if( *(map+j) != 0 )
-            {
-                reset = 1;
-                break;
-            }
+        reset = !p2m_pod_words_zero(map, POD_PAGE_WORDS);
 
         unmap_domain_page(map);
 
@@ -796,8 +817,9 @@ p2m_pod_zero_check(struct p2m_domain *p2m, unsigned long *gfns, int count)
     p2m_type_t types[count];
     unsigned long * map[count];
     struct domain *d = p2m->domain;
+    bool_t zero;
 
-    int i, j;
+    int i;
     int max_ref = 1;
 
     /* Allow an extra refcount for one shadow pt mapping in shadowed domains */
@@ -828,11 +850,7 @@ p2m_pod_zero_check(struct p2m_domain *p2m, unsigned long *gfns, int count)
             continue;
 
         /* Quick zero-check */
-        for ( j=0; j<16; j++ )
-            if( *(map[i]+j) != 0 )
-                break;
-
-        if ( j < 16 )
+        if ( !p2m_pod_words_zero(map[i], POD_QUICK_CHECK_WORDS) )
         {
             unmap_domain_page(map[i]);
             map[i] = NULL;
@@ -863,15 +881,13 @@ p2m_pod_zero_check(struct p2m_domain *p2m, unsigned long *gfns, int count)
         if(!map[i])
             continue;
 
-        for ( j=0; j<PAGE_SIZE/sizeof(*map[i]); j++ )
-            if( *(map[i]+j) != 0 )
-                break;
+        zero = p2m_pod_words_zero(map[i], POD_PAGE_WORDS);
 
         unmap_domain_page(map[i]);
 
         /* See comment in p2m_pod_zero_check_superpage() re gnttab
          * check timing.  */
-        if ( j < PAGE_SIZE/sizeof(*map[i]) )
+        if ( !zero )
         {
             p2m_set_entry(p2m, gfns[i], mfns[i], PAGE_ORDER_4K,
                 types[i], p2m->default_access);
@@ -976,6 +992,62 @@ p2m_pod_emergency_sweep(struct p2m_domain *p2m)
 
 }
 
+/* Below POD_RECLAIM_LOW cached pages a fault schedules the reclaim tasklet,
+ * which sweeps until there are POD_RECLAIM_HIGH, so that faults rarely find
+ * the cache empty and sweep themselves.  It only sweeps while the domain
+ * has more PoD entries than cached pages, and stops after a pass over the
+ * guest found nothing, until pages are added to the cache again. */
+#define POD_RECLAIM_LOW   512
+#define POD_RECLAIM_HIGH  2048
+
+static bool_t
+p2m_pod_reclaim_wanted(struct p2m_domain *p2m, long target)
+{
+    return ( !p2m->domain->is_dying
+             && p2m->pod.count < target
+             && p2m->pod.entry_count > p2m->pod.count
+             && p2m->pod.reclaim_idle <= p2m->pod.max_guest );
+}
+
+/* A tasklet, so that it runs in idle vcpu context and may take the p2m
+ * lock; one sweep of POD_SWEEP_LIMIT gfns per run. */
+static void
+p2m_pod_reclaim(unsigned long data)
+{
+    struct p2m_domain *p2m = (struct p2m_domain *)data;
+    long count;
+    int again;
+
+    /* The p2m lock first, as the sweep takes it again under the pod lock */
+    p2m_lock(p2m);
+    pod_lock(p2m);
+
+    if ( p2m_pod_reclaim_wanted(p2m, POD_RECLAIM_HIGH) )
+    {
+        count = p2m->pod.count;
+        p2m_pod_emergency_sweep(p2m);
+        if ( p2m->pod.count == count )
+            p2m->pod.reclaim_idle += POD_SWEEP_LIMIT;
+    }
+
+    again = p2m_pod_reclaim_wanted(p2m, POD_RECLAIM_HIGH);
+
+    pod_unlock(p2m);
+    p2m_unlock(p2m);
+
+    if ( again )
+        tasklet_schedule(&p2m->pod.reclaim_tasklet);
+}
+
+void
+p2m_pod_init(struct p2m_domain *p2m)
+{
+    INIT_PAGE_LIST_HEAD(&p2m->pod.super);
+    INIT_PAGE_LIST_HEAD(&p2m->pod.single);
+    tasklet_init(&p2m->pod.reclaim_tasklet, p2m_pod_reclaim,
+                 (unsigned long)p2m);
+}
+
 int
 p2m_pod_demand_populate(struct p2m_domain *p2m, unsigned long gfn,
                         unsigned int order,
@@ -1073,6 +1145,10 @@ p2m_pod_demand_populate(struct p2m_domain *p2m, unsigned long gfn,
          && (q & P2M_ALLOC) )
         p2m_pod_check_last_super(p2m, gfn_aligned);
 
+    /* Top the cache up before the next faults find it empty */
+    if ( p2m_pod_reclaim_wanted(p2m, POD_RECLAIM_LOW) )
+        tasklet_schedule(&p2m->pod.reclaim_tasklet);
+
     pod_unlock(p2m);
     return 0;
 out_of_memory:
@@ -66,10 +66,8 @@ static int p2m_initialise(struct domain *d, struct p2m_domain *p2m)
     mm_lock_init(&p2m->pod.lock);
     INIT_LIST_HEAD(&p2m->np2m_list);
     INIT_PAGE_LIST_HEAD(&p2m->pages);
-    INIT_PAGE_LIST_HEAD(&p2m->pod.super);
-    INIT_PAGE_LIST_HEAD(&p2m->pod.single);
-
     p2m->domain = d;
+    p2m_pod_init(p2m);
     p2m->default_access = p2m_access_rwx;
 
     p2m->np2m_base = P2M_BASE_EADDR;
@@ -176,6 +174,8 @@ static void p2m_teardown_nestedp2m(struct domain *d)
             continue;
         p2m = d->arch.nested_p2m[i];
         list_del(&p2m->np2m_list);
+        nestedp2m_forget_sources(p2m);
+        xfree(p2m->np2m_src);
         p2m_free_one(p2m);
         d->arch.nested_p2m[i] = NULL;
     }
@@ -362,6 +362,8 @@ int p2m_set_entry(struct p2m_domain *p2m, unsigned long gfn, mfn_t mfn,
 
     ASSERT(gfn_locked_by_me(p2m, gfn));
 
+    p2m_defer_flush_begin(p2m);
+
     while ( todo )
     {
         if ( hap_enabled(d) )
@@ -382,6 +384,66 @@ int p2m_set_entry(struct p2m_domain *p2m, unsigned long gfn, mfn_t mfn,
         todo -= 1ul << order;
     }
 
+    p2m_defer_flush_end(p2m);
+
+    return rc;
+}
+
+void p2m_defer_flush_begin(struct p2m_domain *p2m)
+{
+    ASSERT(p2m_locked_by_me(p2m));
+    p2m->defer_flush++;
+}
+
+void p2m_tlb_flush_sync(struct p2m_domain *p2m)
+{
+    if ( p2m->need_flush )
+    {
+        p2m->need_flush = 0;
+        p2m->tlb_flush(p2m);
+    }
+}
+
+void p2m_defer_flush_end(struct p2m_domain *p2m)
+{
+    ASSERT(p2m->defer_flush);
+    if ( !--p2m->defer_flush )
+        p2m_tlb_flush_sync(p2m);
+}
+
+int p2m_coalesce(struct domain *d, struct xen_domctl_p2m_coalesce *op)
+{
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    unsigned long next = op->next_gfn, nr[2] = { 0, 0 };
+    unsigned int max_level = 0;
+    int rc;
+
+    if ( !hap_enabled(d) || !p2m->coalesce )
+        return -EOPNOTSUPP;
+
+    /* The superpages would only be split again. */
+    if ( paging_mode_log_dirty(d) )
+        return -EBUSY;
+
+    if ( hvm_hap_has_2mb(d) && opt_hap_2mb )
+    {
+        max_level = 1;
+        if ( hvm_hap_has_1gb(d) && opt_hap_1gb )
+            max_level = 2;
+    }
+    if ( !max_level )
+        return 0;
+
+    p2m_lock(p2m);
+    p2m_defer_flush_begin(p2m);
+    rc = p2m->coalesce(p2m, max_level, &next, nr);
+    p2m_defer_flush_end(p2m);
+    p2m_unlock(p2m);
+
+    op->next_gfn = next;
+    op->nr_2mb += nr[0];
+    op->nr_1gb += nr[1];
+
     return rc;
 }
 
@@ -524,8 +586,7 @@ p2m_remove_page(struct p2m_domain *p2m, unsigned long gfn, unsigned long mfn,
     if ( !paging_mode_translate(p2m->domain) )
     {
         if ( need_iommu(p2m->domain) )
-            for ( i = 0; i < (1 << page_order); i++ )
-                iommu_unmap_page(p2m->domain, mfn + i);
+            iommu_unmap_pages(p2m->domain, mfn, 1UL << page_order);
         return 0;
     }
 
@@ -572,19 +633,8 @@ guest_physmap_add_entry(struct domain *d, unsigned long gfn,
     if ( !paging_mode_translate(d) )
     {
         if ( need_iommu(d) && t == p2m_ram_rw )
-        {
-            for ( i = 0; i < (1 << page_order); i++ )
-            {
-                rc = iommu_map_page(
-                    d, mfn + i, mfn + i, IOMMUF_readable|IOMMUF_writable);
-                if ( rc != 0 )
-                {
-                    while ( i-- > 0 )
-                        iommu_unmap_page(d, mfn + i);
-                    return rc;
-                }
-            }
-        }
+            return iommu_map_pages(d, mfn, mfn, 1UL << page_order,
+                                   IOMMUF_readable|IOMMUF_writable);
         return 0;
     }
 
@@ -749,6 +799,57 @@ int p2m_change_type_one(struct domain *d, unsigned long gfn,
     return rc;
 }
 
+int p2m_enable_hardware_log_dirty(struct domain *d)
+{
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+
+    return p2m->enable_hardware_log_dirty ?
+           p2m->enable_hardware_log_dirty(p2m) : 0;
+}
+
+void p2m_disable_hardware_log_dirty(struct domain *d)
+{
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+
+    if ( p2m->disable_hardware_log_dirty )
+        p2m->disable_hardware_log_dirty(p2m);
+}
+
+void p2m_flush_hardware_cached_dirty(struct domain *d)
+{
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+
+    if ( p2m->flush_hardware_cached_dirty )
+        p2m->flush_hardware_cached_dirty(p2m);
+}
+
+void p2m_mark_logged_dirty(struct domain *d, const uint64_t *gpa,
+                           unsigned int nr)
+{
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    unsigned int i;
+
+    /* One flush for the whole batch rather than one per page. */
+    p2m_lock(p2m);
+    p2m_defer_flush_begin(p2m);
+
+    for ( i = 0; i < nr; i++ )
+    {
+        unsigned long gfn = gpa[i] >> PAGE_SHIFT;
+
+        /*
+         * hap_track_dirty_vram() looks at the types rather than the
+         * bitmap.  Pages whose type changed under our feet are marked
+         * all the same, the write did happen.
+         */
+        p2m_change_type_one(d, gfn, p2m_ram_logdirty, p2m_ram_rw);
+        paging_mark_gfn_dirty(d, gfn);
+    }
+
+    p2m_defer_flush_end(p2m);
+    p2m_unlock(p2m);
+}
+
 /* Modify the p2m type of a range of gfns from ot to nt. */
 void p2m_change_type_range(struct domain *d, 
                            unsigned long start, unsigned long end,
@@ -1061,6 +1162,45 @@ int p2m_mem_paging_evict(struct domain *d, unsigned long gfn)
     return ret;
 }
 
+/**
+ * p2m_mem_paging_absent - Mark a never populated guest page as paged-out
+ * @d: guest domain
+ * @gfn: guest page to mark
+ *
+ * Returns 0 for success or negative errno values if the gfn is backed.
+ *
+ * p2m_mem_paging_absent() is called by a pager which holds the contents of a
+ * gfn the guest has no page for yet, such as the destination of a post-copy
+ * migration for the pages still at the source.  The gfn becomes paged-out
+ * without anything to free: the first access of the guest populates it like
+ * an evicted gfn, and the pager loads it with p2m_mem_paging_prep().
+ */
+int p2m_mem_paging_absent(struct domain *d, unsigned long gfn)
+{
+    p2m_type_t p2mt;
+    p2m_access_t a;
+    mfn_t mfn;
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    int ret = -EBUSY;
+
+    gfn_lock(p2m, gfn, 0);
+
+    mfn = p2m->get_entry(p2m, gfn, &p2mt, &a, 0, NULL);
+
+    /* Only gfns with nothing at all behind them */
+    if ( mfn_valid(mfn) || (p2mt != p2m_invalid && p2mt != p2m_mmio_dm) )
+        goto out;
+
+    ret = p2m_set_entry(p2m, gfn, _mfn(INVALID_MFN), PAGE_ORDER_4K,
+                        p2m_ram_paged, p2m->default_access);
+    if ( !ret )
+        atomic_inc(&d->paged_pages);
+
+ out:
+    gfn_unlock(p2m, gfn, 0);
+    return ret;
+}
+
 /**
  * p2m_mem_paging_drop_page - Tell pager to drop its reference to a paged page
  * @d: guest domain
@@ -1351,7 +1491,7 @@ bool_t p2m_mem_access_check(paddr_t gpa, bool_t gla_valid, unsigned long gla,
     gfn_unlock(p2m, gfn, 0);
 
     /* Otherwise, check if there is a memory event listener, and send the message along */
-    if ( !mem_event_check_ring(&d->mem_event->access) || !req_ptr ) 
+    if ( !mem_event_check_ring(mem_access_ring(d)) || !req_ptr ) 
     {
         /* No listener */
         if ( p2m->access_required ) 
@@ -1411,19 +1551,38 @@ bool_t p2m_mem_access_check(paddr_t gpa, bool_t gla_valid, unsigned long gla,
     return (p2ma == p2m_access_n2rwx);
 }
 
+static void p2m_mem_access_resume_ring(struct domain *d,
+                                       struct mem_event_domain *med)
+{
+    mem_event_response_t rsp[8];
+    unsigned int i, nr;
+
+    /* Pull all responses off the ring, a batch at a time */
+    while( (nr = mem_event_get_responses(d, med, rsp, ARRAY_SIZE(rsp))) )
+    {
+        for ( i = 0; i < nr; i++ )
+        {
+            if ( rsp[i].flags & MEM_EVENT_FLAG_DUMMY )
+                continue;
+            /* Unpause domain */
+            if ( rsp[i].flags & MEM_EVENT_FLAG_VCPU_PAUSED )
+                vcpu_unpause(d->vcpu[rsp[i].vcpu_id]);
+        }
+    }
+}
+
 void p2m_mem_access_resume(struct domain *d)
 {
-    mem_event_response_t rsp;
+    unsigned int i;
 
-    /* Pull all responses off the ring */
-    while( mem_event_get_response(d, &d->mem_event->access, &rsp) )
+    if ( !d->mem_event->access_vcpu )
     {
-        if ( rsp.flags & MEM_EVENT_FLAG_DUMMY )
-            continue;
-        /* Unpause domain */
-        if ( rsp.flags & MEM_EVENT_FLAG_VCPU_PAUSED )
-            vcpu_unpause(d->vcpu[rsp.vcpu_id]);
+        p2m_mem_access_resume_ring(d, &d->mem_event->access);
+        return;
     }
+
+    for ( i = 0; i < d->max_vcpus; i++ )
+        p2m_mem_access_resume_ring(d, &d->mem_event->access_vcpu[i]);
 }
 
 /* Set access type for a region of pfns.
@@ -1472,6 +1631,7 @@ long p2m_set_mem_access(struct domain *d, unsigned long pfn, uint32_t nr,
     }
 
     p2m_lock(p2m);
+    p2m_defer_flush_begin(p2m);
     for ( pfn += start; nr > start; ++pfn )
     {
         mfn = p2m->get_entry(p2m, pfn, &t, &_a, 0, NULL);
@@ -1486,6 +1646,7 @@ long p2m_set_mem_access(struct domain *d, unsigned long pfn, uint32_t nr,
             break;
         }
     }
+    p2m_defer_flush_end(p2m);
     p2m_unlock(p2m);
     return rc;
 }
@@ -1570,6 +1731,9 @@ p2m_flush_table(struct p2m_domain *p2m)
 
     /* This is no longer a valid nested p2m for any address space */
     p2m->np2m_base = P2M_BASE_EADDR;
+
+    /* Nor is it made from any L1 tables */
+    nestedp2m_forget_sources(p2m);
     
     /* Zap the top level of the trie */
     top = mfn_to_page(pagetable_get_mfn(p2m_get_pagetable(p2m)));
@@ -1661,6 +1825,26 @@ p2m_get_nestedp2m(struct vcpu *v, uint64_t np2m_base)
     return p2m;
 }
 
+struct p2m_domain *
+p2m_find_nestedp2m(struct domain *d, uint64_t np2m_base)
+{
+    struct p2m_domain *p2m = NULL;
+    int i;
+
+    np2m_base &= ~(0xfffull);
+
+    nestedp2m_lock(d);
+    for ( i = 0; i < MAX_NESTEDP2M; i++ )
+        if ( d->arch.nested_p2m[i]->np2m_base == np2m_base )
+        {
+            p2m = d->arch.nested_p2m[i];
+            break;
+        }
+    nestedp2m_unlock(d);
+
+    return p2m;
+}
+
 struct p2m_domain *
 p2m_get_p2m(struct vcpu *v)
 {
@@ -202,32 +202,15 @@ int paging_log_dirty_disable(struct domain *d)
 }
 
 /* Mark a page as dirty */
-void paging_mark_dirty(struct domain *d, unsigned long guest_mfn)
+/* Mark a page of the guest's pseudo-physical memory map as dirty */
+void paging_mark_gfn_dirty(struct domain *d, unsigned long pfn)
 {
-    unsigned long pfn;
-    mfn_t gmfn;
     int changed;
     mfn_t mfn, *l4, *l3, *l2;
     unsigned long *l1;
     int i1, i2, i3, i4;
 
-    gmfn = _mfn(guest_mfn);
-
-    if ( !paging_mode_log_dirty(d) || !mfn_valid(gmfn) ||
-         page_get_owner(mfn_to_page(gmfn)) != d )
-        return;
-
-    /* We /really/ mean PFN here, even for non-translated guests. */
-    pfn = get_gpfn_from_mfn(mfn_x(gmfn));
-    /* Shared MFNs should NEVER be marked dirty */
-    BUG_ON(SHARED_M2P(pfn));
-
-    /*
-     * Values with the MSB set denote MFNs that aren't really part of the
-     * domain's pseudo-physical memory map (e.g., the shared info frame).
-     * Nothing to do here...
-     */
-    if ( unlikely(!VALID_M2P(pfn)) )
+    if ( !paging_mode_log_dirty(d) )
         return;
 
     i1 = L1_LOGDIRTY_IDX(pfn);
@@ -274,9 +257,8 @@ void paging_mark_dirty(struct domain *d, unsigned long guest_mfn)
     unmap_domain_page(l1);
     if ( changed )
     {
-        PAGING_DEBUG(LOGDIRTY, 
-                     "marked mfn %" PRI_mfn " (pfn=%lx), dom %d\n",
-                     mfn_x(gmfn), pfn, d->domain_id);
+        PAGING_DEBUG(LOGDIRTY, "marked pfn %lx, dom %d\n",
+                     pfn, d->domain_id);
         d->arch.paging.log_dirty.dirty_count++;
     }
 
@@ -286,6 +268,33 @@ out:
     return;
 }
 
+void paging_mark_dirty(struct domain *d, unsigned long guest_mfn)
+{
+    unsigned long pfn;
+    mfn_t gmfn;
+
+    gmfn = _mfn(guest_mfn);
+
+    if ( !paging_mode_log_dirty(d) || !mfn_valid(gmfn) ||
+         page_get_owner(mfn_to_page(gmfn)) != d )
+        return;
+
+    /* We /really/ mean PFN here, even for non-translated guests. */
+    pfn = get_gpfn_from_mfn(mfn_x(gmfn));
+    /* Shared MFNs should NEVER be marked dirty */
+    BUG_ON(SHARED_M2P(pfn));
+
+    /*
+     * Values with the MSB set denote MFNs that aren't really part of the
+     * domain's pseudo-physical memory map (e.g., the shared info frame).
+     * Nothing to do here...
+     */
+    if ( unlikely(!VALID_M2P(pfn)) )
+        return;
+
+    paging_mark_gfn_dirty(d, pfn);
+}
+
 
 /* Is this guest page dirty? */
 int paging_mfn_is_dirty(struct domain *d, mfn_t gmfn)
@@ -344,6 +353,10 @@ int paging_log_dirty_op(struct domain *d, struct xen_domctl_shadow_op *sc)
     int i4, i3, i2;
 
     domain_pause(d);
+
+    /* The writes the CPU logged but didn't report yet belong in the bitmap. */
+    p2m_flush_hardware_cached_dirty(d);
+
     paging_lock(d);
 
     clean = (sc->op == XEN_DOMCTL_SHADOW_OP_CLEAN);
@@ -456,6 +469,180 @@ int paging_log_dirty_op(struct domain *d, struct xen_domctl_shadow_op *sc)
     return rv;
 }
 
+/* pfns a leaf of the log-dirty trie covers, and the whole trie */
+#define LOGDIRTY_LEAF_ORDER (PAGE_SHIFT + 3)
+#define LOGDIRTY_LEAF_PFNS  (1UL << LOGDIRTY_LEAF_ORDER)
+#define LOGDIRTY_PFN_LIMIT  (LOGDIRTY_LEAF_PFNS << (PAGETABLE_ORDER * 3))
+
+/*
+ * The leaf of the log-dirty trie for pfn, which may not have been
+ * allocated.  *order is that of the pfns the leaf, or the missing node
+ * above it, would cover.
+ */
+static mfn_t paging_log_dirty_leaf(mfn_t *l4, unsigned long pfn,
+                                   unsigned int *order)
+{
+    mfn_t mfn, *node;
+
+    *order = LOGDIRTY_LEAF_ORDER + PAGETABLE_ORDER * 2;
+    mfn = l4[L4_LOGDIRTY_IDX(pfn)];
+    if ( !mfn_valid(mfn) )
+        return mfn;
+
+    *order -= PAGETABLE_ORDER;
+    node = map_domain_page(mfn_x(mfn));
+    mfn = node[L3_LOGDIRTY_IDX(pfn)];
+    unmap_domain_page(node);
+    if ( !mfn_valid(mfn) )
+        return mfn;
+
+    *order -= PAGETABLE_ORDER;
+    node = map_domain_page(mfn_x(mfn));
+    mfn = node[L2_LOGDIRTY_IDX(pfn)];
+    unmap_domain_page(node);
+
+    return mfn;
+}
+
+/* XEN_DOMCTL_log_dirty_extents: see public/domctl.h */
+int paging_log_dirty_extents(struct domain *d,
+                             struct xen_domctl_log_dirty_extents *op)
+{
+    struct xen_domctl_dirty_extent ext = { .nr_pfns = 0 };
+    unsigned long pfn = op->start_pfn, base;
+    unsigned int nr = 0, order, bit, end;
+    bool_t clean = !!(op->flags & XEN_DOMCTL_LOG_DIRTY_CLEAN), cleared = 0;
+    bool_t full = 0;
+    unsigned long *l1;
+    mfn_t *l4, mfn;
+    int rc;
+
+    if ( (op->flags & ~XEN_DOMCTL_LOG_DIRTY_CLEAN) || !op->nr_extents )
+        return -EINVAL;
+
+    rc = xsm_shadow_control(XSM_HOOK, d,
+                            clean ? XEN_DOMCTL_SHADOW_OP_CLEAN
+                                  : XEN_DOMCTL_SHADOW_OP_PEEK);
+    if ( rc )
+        return rc;
+
+    if ( op->start_pfn >= LOGDIRTY_PFN_LIMIT )
+    {
+        op->start_pfn = XEN_DOMCTL_LOG_DIRTY_END;
+        op->nr_extents = 0;
+        return 0;
+    }
+
+    domain_pause(d);
+
+    /* The writes the CPU logged but didn't report yet belong in the bitmap. */
+    p2m_flush_hardware_cached_dirty(d);
+
+    paging_lock(d);
+
+    if ( unlikely(d->arch.paging.log_dirty.failed_allocs) )
+    {
+        rc = -ENOMEM;
+        goto out;
+    }
+
+    if ( pfn == 0 )
+    {
+        op->stats.fault_count = d->arch.paging.log_dirty.fault_count;
+        op->stats.dirty_count = d->arch.paging.log_dirty.dirty_count;
+        if ( clean )
+        {
+            d->arch.paging.log_dirty.fault_count = 0;
+            d->arch.paging.log_dirty.dirty_count = 0;
+        }
+    }
+
+    l4 = paging_map_log_dirty_bitmap(d);
+
+    while ( l4 && !full && !rc && pfn < LOGDIRTY_PFN_LIMIT )
+    {
+        mfn = paging_log_dirty_leaf(l4, pfn, &order);
+        if ( !mfn_valid(mfn) )
+        {
+            pfn = ((pfn >> order) + 1) << order;
+            continue;
+        }
+
+        base = pfn & ~(LOGDIRTY_LEAF_PFNS - 1);
+        l1 = map_domain_page(mfn_x(mfn));
+
+        for ( bit = find_next_bit(l1, LOGDIRTY_LEAF_PFNS, pfn - base);
+              bit < LOGDIRTY_LEAF_PFNS;
+              bit = find_next_bit(l1, LOGDIRTY_LEAF_PFNS, end) )
+        {
+            end = find_next_zero_bit(l1, LOGDIRTY_LEAF_PFNS, bit);
+
+            /* Runs carry on across leaves. */
+            if ( ext.nr_pfns && ext.first_pfn + ext.nr_pfns == base + bit )
+                ext.nr_pfns += end - bit;
+            else
+            {
+                if ( ext.nr_pfns )
+                {
+                    if ( copy_to_guest_offset(op->extents, nr, &ext, 1) )
+                    {
+                        rc = -EFAULT;
+                        break;
+                    }
+                    ext.nr_pfns = 0;
+                    if ( ++nr == op->nr_extents )
+                    {
+                        /* This run is for the next call. */
+                        pfn = base + bit;
+                        full = 1;
+                        break;
+                    }
+                }
+                ext.first_pfn = base + bit;
+                ext.nr_pfns = end - bit;
+            }
+
+            if ( clean )
+            {
+                for ( ; bit < end; bit++ )
+                    __clear_bit(bit, l1);
+                cleared = 1;
+            }
+        }
+
+        unmap_domain_page(l1);
+
+        if ( !full )
+            pfn = base + LOGDIRTY_LEAF_PFNS;
+    }
+
+    if ( l4 )
+        unmap_domain_page(l4);
+
+    /* There is room for the run in hand. */
+    if ( !rc && ext.nr_pfns )
+    {
+        if ( copy_to_guest_offset(op->extents, nr, &ext, 1) )
+            rc = -EFAULT;
+        else
+            nr++;
+    }
+
+    op->start_pfn = full ? pfn : XEN_DOMCTL_LOG_DIRTY_END;
+    op->nr_extents = nr;
+
+ out:
+    paging_unlock(d);
+
+    /* Write protect the pages reported again, the domain is still paused. */
+    if ( cleared )
+        d->arch.paging.log_dirty.clean_dirty_bitmap(d);
+
+    domain_unpause(d);
+
+    return rc;
+}
+
 void paging_log_dirty_range(struct domain *d,
                            unsigned long begin_pfn,
                            unsigned long nr,
@@ -67,18 +67,7 @@ void shadow_domain_init(struct domain *d, unsigned int domcr_flags)
  */
 void shadow_vcpu_init(struct vcpu *v)
 {
-#if (SHADOW_OPTIMIZATIONS & SHOPT_OUT_OF_SYNC)
-    int i, j;
-
-    for ( i = 0; i < SHADOW_OOS_PAGES; i++ )
-    {
-        v->arch.paging.shadow.oos[i] = _mfn(INVALID_MFN);
-        v->arch.paging.shadow.oos_snapshot[i] = _mfn(INVALID_MFN);
-        for ( j = 0; j < SHADOW_OOS_FIXUPS; j++ )
-            v->arch.paging.shadow.oos_fixup[i].smfn[j] = _mfn(INVALID_MFN);
-    }
-#endif
-
+    /* The out-of-sync tables are allocated by sh_update_paging_modes(). */
     v->arch.paging.mode = &SHADOW_INTERNAL_NAME(sh_paging_mode, 3);
 }
 
@@ -489,14 +478,16 @@ static void sh_oos_audit(struct domain *d)
     
     for_each_vcpu(d, v) 
     {
-        for ( idx = 0; idx < SHADOW_OOS_PAGES; idx++ )
+        unsigned int nr = v->arch.paging.shadow.oos_nr;
+
+        for ( idx = 0; idx < nr; idx++ )
         {
             mfn_t *oos = v->arch.paging.shadow.oos;
             if ( !mfn_valid(oos[idx]) )
                 continue;
             
-            expected_idx = mfn_x(oos[idx]) % SHADOW_OOS_PAGES;
-            expected_idx_alt = ((expected_idx + 1) % SHADOW_OOS_PAGES);
+            expected_idx = mfn_x(oos[idx]) % nr;
+            expected_idx_alt = ((expected_idx + 1) % nr);
             if ( idx != expected_idx && idx != expected_idx_alt )
             {
                 printk("%s: idx %d contains gmfn %lx, expected at %d or %d.\n",
@@ -528,25 +519,34 @@ static void sh_oos_audit(struct domain *d)
 }
 #endif
 
+/* Find gmfn in this vcpu's out-of-sync table: it lives either in the
+ * slot it hashes to or in the next one.  Returns the slot, or -1. */
+static int oos_hash_find(struct vcpu *v, mfn_t gmfn)
+{
+    unsigned int nr = v->arch.paging.shadow.oos_nr;
+    mfn_t *oos = v->arch.paging.shadow.oos;
+    int idx;
+
+    if ( nr == 0 )
+        return -1;
+
+    idx = mfn_x(gmfn) % nr;
+    if ( mfn_x(oos[idx]) != mfn_x(gmfn) )
+        idx = (idx + 1) % nr;
+
+    return mfn_x(oos[idx]) == mfn_x(gmfn) ? idx : -1;
+}
+
 #if SHADOW_AUDIT & SHADOW_AUDIT_ENTRIES
 void oos_audit_hash_is_present(struct domain *d, mfn_t gmfn) 
 {
-    int idx;
     struct vcpu *v;
-    mfn_t *oos;
 
     ASSERT(mfn_is_out_of_sync(gmfn));
     
     for_each_vcpu(d, v) 
-    {
-        oos = v->arch.paging.shadow.oos;
-        idx = mfn_x(gmfn) % SHADOW_OOS_PAGES;
-        if ( mfn_x(oos[idx]) != mfn_x(gmfn) )
-            idx = (idx + 1) % SHADOW_OOS_PAGES;
-        
-        if ( mfn_x(oos[idx]) == mfn_x(gmfn) )
+        if ( oos_hash_find(v, gmfn) >= 0 )
             return;
-    }
 
     SHADOW_ERROR("gmfn %lx marked OOS but not in hash table\n", mfn_x(gmfn));
     BUG();
@@ -600,7 +600,6 @@ void oos_fixup_add(struct vcpu *v, mfn_t gmfn,
                    mfn_t smfn,  unsigned long off)
 {
     int idx, next;
-    mfn_t *oos;
     struct oos_fixup *oos_fixup;
     struct domain *d = v->domain;
 
@@ -608,12 +607,9 @@ void oos_fixup_add(struct vcpu *v, mfn_t gmfn,
     
     for_each_vcpu(d, v) 
     {
-        oos = v->arch.paging.shadow.oos;
         oos_fixup = v->arch.paging.shadow.oos_fixup;
-        idx = mfn_x(gmfn) % SHADOW_OOS_PAGES;
-        if ( mfn_x(oos[idx]) != mfn_x(gmfn) )
-            idx = (idx + 1) % SHADOW_OOS_PAGES;
-        if ( mfn_x(oos[idx]) == mfn_x(gmfn) )
+        idx = oos_hash_find(v, gmfn);
+        if ( idx >= 0 )
         {
             int i;
             for ( i = 0; i < SHADOW_OOS_FIXUPS; i++ )
@@ -744,27 +740,30 @@ static void oos_hash_add(struct vcpu *v, mfn_t gmfn)
     mfn_t *oos_snapshot = v->arch.paging.shadow.oos_snapshot;
     struct oos_fixup *oos_fixup = v->arch.paging.shadow.oos_fixup;
     struct oos_fixup fixup = { .next = 0 };
+    unsigned int nr = v->arch.paging.shadow.oos_nr;
     
     for (i = 0; i < SHADOW_OOS_FIXUPS; i++ )
         fixup.smfn[i] = _mfn(INVALID_MFN);
 
-    idx = mfn_x(gmfn) % SHADOW_OOS_PAGES;
+    idx = mfn_x(gmfn) % nr;
     oidx = idx;
 
     if ( mfn_valid(oos[idx]) 
-         && (mfn_x(oos[idx]) % SHADOW_OOS_PAGES) == idx )
+         && (mfn_x(oos[idx]) % nr) == idx )
     {
         /* Punt the current occupant into the next slot */
         SWAP(oos[idx], gmfn);
         SWAP(oos_fixup[idx], fixup);
         swap = 1;
-        idx = (idx + 1) % SHADOW_OOS_PAGES;
+        idx = (idx + 1) % nr;
     }
     if ( mfn_valid(oos[idx]) )
    {
         /* Crush the current occupant. */
         _sh_resync(v, oos[idx], &oos_fixup[idx], oos_snapshot[idx]);
         perfc_incr(shadow_unsync_evict);
+        TRACE_SHADOW_PATH_FLAG(TRCE_SFLAG_OOS_EVICT);
+        v->arch.paging.shadow.oos_evicts++;
     }
     oos[idx] = gmfn;
     oos_fixup[idx] = fixup;
@@ -783,20 +782,16 @@ static void oos_hash_add(struct vcpu *v, mfn_t gmfn)
 static void oos_hash_remove(struct vcpu *v, mfn_t gmfn)
 {
     int idx;
-    mfn_t *oos;
     struct domain *d = v->domain;
 
     SHADOW_PRINTK("%pv gmfn %lx\n", v, mfn_x(gmfn));
 
     for_each_vcpu(d, v) 
     {
-        oos = v->arch.paging.shadow.oos;
-        idx = mfn_x(gmfn) % SHADOW_OOS_PAGES;
-        if ( mfn_x(oos[idx]) != mfn_x(gmfn) )
-            idx = (idx + 1) % SHADOW_OOS_PAGES;
-        if ( mfn_x(oos[idx]) == mfn_x(gmfn) )
+        idx = oos_hash_find(v, gmfn);
+        if ( idx >= 0 )
         {
-            oos[idx] = _mfn(INVALID_MFN);
+            v->arch.paging.shadow.oos[idx] = _mfn(INVALID_MFN);
             return;
         }
     }
@@ -808,21 +803,13 @@ static void oos_hash_remove(struct vcpu *v, mfn_t gmfn)
 mfn_t oos_snapshot_lookup(struct vcpu *v, mfn_t gmfn)
 {
     int idx;
-    mfn_t *oos;
-    mfn_t *oos_snapshot;
     struct domain *d = v->domain;
     
     for_each_vcpu(d, v) 
     {
-        oos = v->arch.paging.shadow.oos;
-        oos_snapshot = v->arch.paging.shadow.oos_snapshot;
-        idx = mfn_x(gmfn) % SHADOW_OOS_PAGES;
-        if ( mfn_x(oos[idx]) != mfn_x(gmfn) )
-            idx = (idx + 1) % SHADOW_OOS_PAGES;
-        if ( mfn_x(oos[idx]) == mfn_x(gmfn) )
-        {
-            return oos_snapshot[idx];
-        }
+        idx = oos_hash_find(v, gmfn);
+        if ( idx >= 0 )
+            return v->arch.paging.shadow.oos_snapshot[idx];
     }
 
     SHADOW_ERROR("gmfn %lx was OOS but not in hash table\n", mfn_x(gmfn));
@@ -834,24 +821,18 @@ mfn_t oos_snapshot_lookup(struct vcpu *v, mfn_t gmfn)
 void sh_resync(struct vcpu *v, mfn_t gmfn)
 {
     int idx;
-    mfn_t *oos;
-    mfn_t *oos_snapshot;
-    struct oos_fixup *oos_fixup;
     struct domain *d = v->domain;
 
+    perfc_incr(shadow_resync_one);
+
     for_each_vcpu(d, v) 
     {
-        oos = v->arch.paging.shadow.oos;
-        oos_fixup = v->arch.paging.shadow.oos_fixup;
-        oos_snapshot = v->arch.paging.shadow.oos_snapshot;
-        idx = mfn_x(gmfn) % SHADOW_OOS_PAGES;
-        if ( mfn_x(oos[idx]) != mfn_x(gmfn) )
-            idx = (idx + 1) % SHADOW_OOS_PAGES;
-        
-        if ( mfn_x(oos[idx]) == mfn_x(gmfn) )
+        idx = oos_hash_find(v, gmfn);
+        if ( idx >= 0 )
         {
-            _sh_resync(v, gmfn, &oos_fixup[idx], oos_snapshot[idx]);
-            oos[idx] = _mfn(INVALID_MFN);
+            _sh_resync(v, gmfn, &v->arch.paging.shadow.oos_fixup[idx],
+                       v->arch.paging.shadow.oos_snapshot[idx]);
+            v->arch.paging.shadow.oos[idx] = _mfn(INVALID_MFN);
             return;
         }
     }
@@ -898,9 +879,10 @@ void sh_resync_all(struct vcpu *v, int skip, int this, int others)
         goto resync_others;
 
     /* First: resync all of this vcpu's oos pages */
-    for ( idx = 0; idx < SHADOW_OOS_PAGES; idx++ ) 
+    for ( idx = 0; idx < v->arch.paging.shadow.oos_nr; idx++ ) 
         if ( mfn_valid(oos[idx]) )
         {
+            perfc_incr(shadow_resync_all);
             /* Write-protect and sync contents */
             _sh_resync(v, oos[idx], &oos_fixup[idx], oos_snapshot[idx]);
             oos[idx] = _mfn(INVALID_MFN);
@@ -920,7 +902,7 @@ void sh_resync_all(struct vcpu *v, int skip, int this, int others)
         oos_fixup = other->arch.paging.shadow.oos_fixup;
         oos_snapshot = other->arch.paging.shadow.oos_snapshot;
 
-        for ( idx = 0; idx < SHADOW_OOS_PAGES; idx++ ) 
+        for ( idx = 0; idx < other->arch.paging.shadow.oos_nr; idx++ ) 
         {
             if ( !mfn_valid(oos[idx]) )
                 continue;
@@ -935,6 +917,7 @@ void sh_resync_all(struct vcpu *v, int skip, int this, int others)
             }
             else
             {
+                perfc_incr(shadow_resync_all);
                 /* Write-protect and sync contents */
                 _sh_resync(other, oos[idx], &oos_fixup[idx], oos_snapshot[idx]);
                 oos[idx] = _mfn(INVALID_MFN);
@@ -943,6 +926,63 @@ void sh_resync_all(struct vcpu *v, int skip, int this, int others)
     }
 }
 
+/* Look at growing the out-of-sync table after this many unsyncs... */
+#define SHADOW_OOS_WINDOW 64
+/* ...and do it if at least one in this many of them evicted another page */
+#define SHADOW_OOS_EVICT_RATIO 4
+
+static const unsigned int oos_sizes[] = { SHADOW_OOS_PAGES, 7, 13,
+                                          SHADOW_OOS_PAGES_MAX };
+
+/* Give this vcpu more out-of-sync slots.  Entries hash to different slots
+ * at the new size, so everything it has out of sync is resynced first. */
+static void oos_hash_grow(struct vcpu *v)
+{
+    struct domain *d = v->domain;
+    struct shadow_vcpu *sv = &v->arch.paging.shadow;
+    unsigned int nr = sv->oos_nr, new_nr, i;
+
+    for ( i = 0; i < ARRAY_SIZE(oos_sizes) - 1; i++ )
+        if ( oos_sizes[i] == nr )
+            break;
+    if ( i == ARRAY_SIZE(oos_sizes) - 1 )
+        return;
+    new_nr = oos_sizes[i + 1];
+
+    /* We are in the middle of a fault, with the shadows it needs already
+     * made: the snapshots (a page each) must come from free pages, not by
+     * unshadowing. */
+    if ( d->arch.paging.shadow.free_pages < new_nr - nr )
+        return;
+
+    for ( i = 0; i < nr; i++ )
+        if ( mfn_valid(sv->oos[i]) )
+        {
+            _sh_resync(v, sv->oos[i], &sv->oos_fixup[i], sv->oos_snapshot[i]);
+            sv->oos[i] = _mfn(INVALID_MFN);
+            perfc_incr(shadow_resync_grow);
+        }
+
+    for ( i = nr; i < new_nr; i++ )
+    {
+        sv->oos_snapshot[i] = shadow_alloc(d, SH_type_oos_snapshot, 0);
+        sv->oos[i] = _mfn(INVALID_MFN);
+    }
+    sv->oos_nr = new_nr;
+
+    perfc_incr(shadow_oos_grow);
+    TRACE_SHADOW_PATH_FLAG(TRCE_SFLAG_OOS_GROW);
+    if ( tb_init_done )
+    {
+        struct {
+            u16 vcpu, domain;
+            u32 old_nr, new_nr;
+        } t = { v->vcpu_id, d->domain_id, nr, new_nr };
+
+        __trace_var(TRC_SHADOW_OOS_GROW, 0/*!tsc*/, sizeof(t), &t);
+    }
+}
+
 /* Allow a shadowed page to go out of sync. Unsyncs are traced in
  * multi.c:sh_page_fault() */
 int sh_unsync(struct vcpu *v, mfn_t gmfn)
@@ -966,6 +1006,15 @@ int sh_unsync(struct vcpu *v, mfn_t gmfn)
          || !v->domain->arch.paging.shadow.oos_active )
         return 0;
 
+    if ( ++v->arch.paging.shadow.oos_unsyncs >= SHADOW_OOS_WINDOW )
+    {
+        if ( v->arch.paging.shadow.oos_evicts * SHADOW_OOS_EVICT_RATIO >=
+             v->arch.paging.shadow.oos_unsyncs )
+            oos_hash_grow(v);
+        v->arch.paging.shadow.oos_unsyncs = 0;
+        v->arch.paging.shadow.oos_evicts = 0;
+    }
+
     pg->shadow_flags |= SHF_out_of_sync|SHF_oos_may_write;
     oos_hash_add(v, gmfn);
     perfc_incr(shadow_unsync);
@@ -2728,10 +2777,44 @@ static void sh_update_paging_modes(struct vcpu *v)
 #endif /* (SHADOW_OPTIMIZATIONS & SHOPT_VIRTUAL_TLB) */
 
 #if (SHADOW_OPTIMIZATIONS & SHOPT_OUT_OF_SYNC) 
+    if ( v->arch.paging.shadow.oos == NULL )
+    {
+        int i, j;
+
+        v->arch.paging.shadow.oos =
+            xmalloc_array(mfn_t, SHADOW_OOS_PAGES_MAX);
+        v->arch.paging.shadow.oos_snapshot =
+            xmalloc_array(mfn_t, SHADOW_OOS_PAGES_MAX);
+        v->arch.paging.shadow.oos_fixup =
+            xmalloc_array(struct oos_fixup, SHADOW_OOS_PAGES_MAX);
+        if ( v->arch.paging.shadow.oos == NULL ||
+             v->arch.paging.shadow.oos_snapshot == NULL ||
+             v->arch.paging.shadow.oos_fixup == NULL )
+        {
+            SHADOW_ERROR("Could not allocate OOS space for dom %u vcpu %u\n",
+                         d->domain_id, v->vcpu_id);
+            xfree(v->arch.paging.shadow.oos);
+            xfree(v->arch.paging.shadow.oos_snapshot);
+            xfree(v->arch.paging.shadow.oos_fixup);
+            v->arch.paging.shadow.oos = NULL;
+            v->arch.paging.shadow.oos_snapshot = NULL;
+            v->arch.paging.shadow.oos_fixup = NULL;
+            domain_crash(v->domain);
+            return;
+        }
+        for ( i = 0; i < SHADOW_OOS_PAGES_MAX; i++ )
+        {
+            v->arch.paging.shadow.oos[i] = _mfn(INVALID_MFN);
+            v->arch.paging.shadow.oos_snapshot[i] = _mfn(INVALID_MFN);
+            for ( j = 0; j < SHADOW_OOS_FIXUPS; j++ )
+                v->arch.paging.shadow.oos_fixup[i].smfn[j] = _mfn(INVALID_MFN);
+        }
+        v->arch.paging.shadow.oos_nr = SHADOW_OOS_PAGES;
+    }
     if ( mfn_x(v->arch.paging.shadow.oos_snapshot[0]) == INVALID_MFN )
     {
         int i;
-        for(i = 0; i < SHADOW_OOS_PAGES; i++)
+        for(i = 0; i < v->arch.paging.shadow.oos_nr; i++)
         {
             shadow_prealloc(d, SH_type_oos_snapshot, 1);
             v->arch.paging.shadow.oos_snapshot[i] =
@@ -3077,7 +3160,7 @@ void shadow_teardown(struct domain *d)
         {
             int i;
             mfn_t *oos_snapshot = v->arch.paging.shadow.oos_snapshot;
-            for ( i = 0; i < SHADOW_OOS_PAGES; i++ )
+            for ( i = 0; i < v->arch.paging.shadow.oos_nr; i++ )
                 if ( mfn_valid(oos_snapshot[i]) )
                 {
                     shadow_free(d, oos_snapshot[i]);
@@ -3147,6 +3230,10 @@ void shadow_teardown(struct domain *d)
 void shadow_final_teardown(struct domain *d)
 /* Called by arch_domain_destroy(), when it's safe to pull down the p2m map. */
 {
+#if (SHADOW_OPTIMIZATIONS & SHOPT_OUT_OF_SYNC)
+    struct vcpu *v;
+#endif
+
     SHADOW_PRINTK("dom %u final teardown starts."
                    "  Shadow pages total = %u, free = %u, p2m=%u\n",
                    d->domain_id,
@@ -3165,6 +3252,19 @@ void shadow_final_teardown(struct domain *d)
     /* Free any shadow memory that the p2m teardown released */
     paging_lock(d);
     sh_set_allocation(d, 0, NULL);
+#if (SHADOW_OPTIMIZATIONS & SHOPT_OUT_OF_SYNC)
+    /* No shadows are left to be out of sync */
+    for_each_vcpu(d, v)
+    {
+        xfree(v->arch.paging.shadow.oos);
+        xfree(v->arch.paging.shadow.oos_snapshot);
+        xfree(v->arch.paging.shadow.oos_fixup);
+        v->arch.paging.shadow.oos = NULL;
+        v->arch.paging.shadow.oos_snapshot = NULL;
+        v->arch.paging.shadow.oos_fixup = NULL;
+        v->arch.paging.shadow.oos_nr = 0;
+    }
+#endif
     SHADOW_PRINTK("dom %u final teardown done."
                    "  Shadow pages total = %u, free = %u, p2m=%u\n",
                    d->domain_id,
@@ -3250,7 +3350,7 @@ static int shadow_one_bit_disable(struct domain *d, u32 mode)
             {
                 int i;
                 mfn_t *oos_snapshot = v->arch.paging.shadow.oos_snapshot;
-                for ( i = 0; i < SHADOW_OOS_PAGES; i++ )
+                for ( i = 0; i < v->arch.paging.shadow.oos_nr; i++ )
                     if ( mfn_valid(oos_snapshot[i]) )
                     {
                         shadow_free(d, oos_snapshot[i]);
@@ -128,6 +128,8 @@ enum {
     TRCE_SFLAG_UNSYNC,
     TRCE_SFLAG_OOS_FIXUP_ADD,
     TRCE_SFLAG_OOS_FIXUP_EVICT,
+    TRCE_SFLAG_OOS_EVICT,
+    TRCE_SFLAG_OOS_GROW,
 };
 
 
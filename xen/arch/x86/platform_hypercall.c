@@ -57,10 +57,6 @@ static long cpu_frequency_change_helper(void *data)
 long cpu_up_helper(void *data);
 long cpu_down_helper(void *data);
 
-/* from core_parking.c */
-long core_parking_helper(void *data);
-uint32_t get_cur_idle_nums(void);
-
 ret_t do_platform_op(XEN_GUEST_HANDLE_PARAM(xen_platform_op_t) u_xenpf_op)
 {
     ret_t ret = 0;
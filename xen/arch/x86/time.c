@@ -73,6 +73,10 @@ static DEFINE_PER_CPU(struct cpu_time, cpu_time);
 #define EPOCH MILLISECS(1000)
 static struct timer calibration_timer;
 
+/* Gather all CPUs for calibration even with TSCs that are in sync. */
+static bool_t __read_mostly opt_calibration_rendezvous;
+boolean_param("time_calibration_rendezvous", opt_calibration_rendezvous);
+
 /*
  * We simulate a 32-bit platform timer from the 16-bit PIT ch2 counter.
  * Otherwise overflow happens too quickly (~50ms) for us to guarantee that
@@ -958,6 +962,40 @@ struct cpu_calibration {
 };
 static DEFINE_PER_CPU(struct cpu_calibration, cpu_calibration);
 
+/*
+ * With reliable TSCs (constant rate and in sync on all CPUs), CPU0 takes
+ * the platform time and its TSC together, and each CPU calibrates against
+ * that one stamp on its own, without the rendezvous of all of them.  A CPU
+ * finding its TSC behind the stamp has drifted: all CPUs are then brought
+ * back to a rendezvous, with the TSCs written in sync again.
+ */
+static struct {
+    unsigned int seq;           /* odd while being written */
+    u64 tsc_stamp;
+    s_time_t master_stime;
+} calibration_stamp;
+static bool_t calibration_local, calibration_drift;
+
+static void local_calibration_stamp(struct cpu_calibration *c)
+{
+    unsigned int seq;
+    u64 tsc;
+
+    do {
+        seq = read_atomic(&calibration_stamp.seq);
+        smp_rmb();
+        c->local_tsc_stamp = calibration_stamp.tsc_stamp;
+        c->stime_master_stamp = calibration_stamp.master_stime;
+        smp_rmb();
+    } while ( (seq & 1) || seq != read_atomic(&calibration_stamp.seq) );
+    c->stime_local_stamp = c->stime_master_stamp;
+
+    /* The stamp was taken before this softirq was raised. */
+    rdtscll(tsc);
+    if ( (s64)(tsc - c->local_tsc_stamp) < 0 )
+        calibration_drift = 1;
+}
+
 /* Softirq handler for per-CPU time calibration. */
 static void local_time_calibration(void)
 {
@@ -997,6 +1035,16 @@ static void local_time_calibration(void)
     {
         /* Atomically read cpu_calibration struct and write cpu_time struct. */
         local_irq_disable();
+        if ( calibration_local )
+        {
+            local_calibration_stamp(c);
+            if ( calibration_drift )
+            {
+                /* Keep extrapolating from the last stamps until then. */
+                local_irq_enable();
+                goto out;
+            }
+        }
         t->local_tsc_stamp    = c->local_tsc_stamp;
         t->stime_local_stamp  = c->stime_master_stamp;
         t->stime_master_stamp = c->stime_master_stamp;
@@ -1320,6 +1368,31 @@ static void time_calibration(void *unused)
         .semaphore = ATOMIC_INIT(0)
     };
 
+    if ( calibration_drift && calibration_local )
+    {
+        printk(XENLOG_WARNING
+               "TSC drift detected, calibrating in a rendezvous again\n");
+        time_calibration_rendezvous_fn = time_calibration_tsc_rendezvous;
+    }
+
+    calibration_local = !opt_calibration_rendezvous && !calibration_drift &&
+                        boot_cpu_has(X86_FEATURE_CONSTANT_TSC) &&
+                        boot_cpu_has(X86_FEATURE_TSC_RELIABLE);
+    if ( calibration_local )
+    {
+        local_irq_disable();
+        calibration_stamp.seq++;
+        smp_wmb();
+        calibration_stamp.master_stime = read_platform_stime();
+        rdtscll(calibration_stamp.tsc_stamp);
+        smp_wmb();
+        calibration_stamp.seq++;
+        local_irq_enable();
+
+        cpumask_raise_softirq(&cpu_online_map, TIME_CALIBRATE_SOFTIRQ);
+        return;
+    }
+
     cpumask_copy(&r.cpu_calibration_map, &cpu_online_map);
 
     /* @wait=1 because we must wait for all cpus before freeing @r. */
@@ -93,6 +93,96 @@ __copy_from_user_ll(void *to, const void __user *from, unsigned n)
     return __n;
 }
 
+/*
+ * As __copy_from_user_ll(), but the words in the middle are written with
+ * non-temporal stores: for bulk copies into memory another cpu is going
+ * to read, which are better not pulled into our cache.
+ */
+unsigned long
+__copy_from_user_nt(void *to, const void __user *from, unsigned n)
+{
+    unsigned long __d0, __d1, __d2, __n = n;
+
+    stac();
+    asm volatile (
+        "    cmp  $"STR(2*BYTES_PER_LONG-1)",%0\n"
+        "    jbe  1f\n"
+        "    mov  %1,%0\n"
+        "    neg  %0\n"
+        "    and  $"STR(BYTES_PER_LONG-1)",%0\n"
+        "    sub  %0,%3\n"
+        "4:  rep; movsb\n" /* make 'to' address aligned */
+        "    mov  %3,%0\n"
+        "    shr  $"STR(LONG_BYTEORDER)",%0\n"
+        "    and  $"STR(BYTES_PER_LONG-1)",%3\n"
+        "    .align 2,0x90\n"
+        "0:  mov  (%2),%%"__OP"ax\n" /* as many words as possible... */
+        "    movnti %%"__OP"ax,(%1)\n"
+        "    lea  "STR(BYTES_PER_LONG)"(%2),%2\n"
+        "    lea  "STR(BYTES_PER_LONG)"(%1),%1\n"
+        "    dec  %0\n"
+        "    jnz  0b\n"
+        "    mov  %3,%0\n"
+        "1:  rep; movsb\n" /* ...remainder copied as bytes */
+        "2:  sfence\n" /* the stores are weakly ordered */
+        ".section .fixup,\"ax\"\n"
+        "5:  add %3,%0\n"
+        "    jmp 6f\n"
+        "3:  lea 0(%3,%0,"STR(BYTES_PER_LONG)"),%0\n"
+        "6:  push %0\n"
+        "    xor  %%eax,%%eax\n"
+        "    rep; stosb\n"
+        "    pop  %0\n"
+        "    jmp 2b\n"
+        ".previous\n"
+        _ASM_EXTABLE(4b, 5b)
+        _ASM_EXTABLE(0b, 3b)
+        _ASM_EXTABLE(1b, 6b)
+        : "=&c" (__n), "=&D" (__d0), "=&S" (__d1), "=&r" (__d2)
+        : "0" (__n), "1" (to), "2" (from), "3" (__n)
+        : "memory", "rax" );
+    clac();
+
+    return __n;
+}
+
+/*
+ * As __copy_from_user_ll(), for large copies. On cpus with enhanced rep
+ * movsb (ERMS) a single rep movsb is at least as fast as the aligned word
+ * copy and doesn't need its head and tail. Which one is used is patched
+ * in at boot, there is no feature test on the copy path.
+ */
+unsigned long
+__copy_from_user_large(void *to, const void __user *from, unsigned n)
+{
+    unsigned long __d0, __d1, __n = n;
+    unsigned int erms;
+
+    asm ( ALTERNATIVE("mov $0,%k0", "mov $1,%k0", X86_FEATURE_ERMS)
+          : "=r" (erms) );
+    if ( !erms )
+        return __copy_from_user_ll(to, from, n);
+
+    stac();
+    asm volatile (
+        "0:  rep; movsb\n"
+        "1:\n"
+        ".section .fixup,\"ax\"\n"
+        "2:  push %0\n"
+        "    xor  %%eax,%%eax\n"
+        "    rep; stosb\n"
+        "    pop  %0\n"
+        "    jmp 1b\n"
+        ".previous\n"
+        _ASM_EXTABLE(0b, 2b)
+        : "=&c" (__n), "=&D" (__d0), "=&S" (__d1)
+        : "0" (__n), "1" (to), "2" (from)
+        : "memory", "rax" );
+    clac();
+
+    return __n;
+}
+
 /**
  * copy_to_user: - Copy a block of data into user space.
  * @to:   Destination address, in user space.
@@ -210,6 +210,14 @@ int compat_arch_memory_op(unsigned long cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
         if ( mso.op == XENMEM_sharing_op_audit )
             return mem_sharing_audit(); 
         rc = do_mem_event_op(op, mso.domain, (void *) &mso);
+        if ( rc == -ERESTART )
+        {
+            /* The progress is in the op */
+            if ( __copy_to_guest(arg, &mso, 1) )
+                return -EFAULT;
+            return hypercall_create_continuation(__HYPERVISOR_memory_op,
+                                                 "lh", op, arg);
+        }
         if ( !rc && __copy_to_guest(arg, &mso, 1) )
             return -EFAULT;
         break;
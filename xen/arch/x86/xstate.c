@@ -49,11 +49,22 @@ static inline bool_t xsetbv(u32 index, u64 xfeatures)
     return lo != 0;
 }
 
+/*
+ * XSETBV is serialising and far from cheap, while saving and restoring a
+ * vcpu's state switches XCR0 back and forth: only write it when it really
+ * changes.
+ */
 bool_t set_xcr0(u64 xfeatures)
 {
-    if ( !xsetbv(XCR_XFEATURE_ENABLED_MASK, xfeatures) )
-        return 0;
-    this_cpu(xcr0) = xfeatures;
+    uint64_t *this_xcr0 = &this_cpu(xcr0);
+
+    if ( *this_xcr0 != xfeatures )
+    {
+        if ( !xsetbv(XCR_XFEATURE_ENABLED_MASK, xfeatures) )
+            return 0;
+        *this_xcr0 = xfeatures;
+    }
+
     return 1;
 }
 
@@ -62,6 +73,13 @@ uint64_t get_xcr0(void)
     return this_cpu(xcr0);
 }
 
+/* The processor reset XCR0 (S3 resume), so that set_xcr0() must write it. */
+void invalidate_xcr0(void)
+{
+    /* Never a valid value, FP is always set */
+    this_cpu(xcr0) = 0;
+}
+
 void xsave(struct vcpu *v, uint64_t mask)
 {
     struct xsave_struct *ptr = v->arch.xsave_area;
@@ -300,6 +318,7 @@ void xstate_init(bool_t bsp)
      * Set CR4_OSXSAVE and run "cpuid" to get xsave_cntxt_size.
      */
     set_in_cr4(X86_CR4_OSXSAVE);
+    invalidate_xcr0();
     if ( !set_xcr0(feature_mask) )
         BUG();
 
@@ -14,6 +14,7 @@ CHECK_TYPE(domid);
 #undef xen_domid_t
 
 CHECK_mem_access_op;
+CHECK_populate_physmap_range;
 
 int compat_memory_op(unsigned int cmd, XEN_GUEST_HANDLE_PARAM(void) compat)
 {
@@ -190,6 +191,8 @@ int compat_memory_op(unsigned int cmd, XEN_GUEST_HANDLE_PARAM(void) compat)
         case XENMEM_maximum_reservation:
         case XENMEM_maximum_gpfn:
         case XENMEM_maximum_ram_page:
+        case XENMEM_populate_physmap_range:
+        case XENMEM_get_vnumainfo: /* handles are 64 bits wide */
             nat.hnd = compat;
             break;
 
@@ -391,6 +394,8 @@ int compat_memory_op(unsigned int cmd, XEN_GUEST_HANDLE_PARAM(void) compat)
         case XENMEM_maximum_gpfn:
         case XENMEM_add_to_physmap:
         case XENMEM_remove_from_physmap:
+        case XENMEM_populate_physmap_range:
+        case XENMEM_get_vnumainfo:
             break;
 
         default:
@@ -13,6 +13,10 @@
 CHECK_oprof_init;
 #undef xen_oprof_init
 
+#define xen_oprof_get_pcpu_buffer xenoprof_get_pcpu_buffer
+CHECK_oprof_get_pcpu_buffer;
+#undef xen_oprof_get_pcpu_buffer
+
 #define xenoprof_get_buffer compat_oprof_get_buffer
 #define xenoprof_op_get_buffer compat_oprof_op_get_buffer
 #define xenoprof_arch_counter compat_oprof_arch_counter
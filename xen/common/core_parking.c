@@ -19,6 +19,9 @@
 #include <xen/cpu.h>
 #include <xen/init.h>
 #include <xen/cpumask.h>
+#include <xen/sched.h>
+#include <xen/sched-if.h>
+#include <xen/pmstat.h>
 #include <asm/percpu.h>
 #include <asm/smp.h>
 
@@ -27,18 +30,22 @@
 
 static unsigned int core_parking_power(unsigned int event);
 static unsigned int core_parking_performance(unsigned int event);
+static unsigned int core_parking_topology(unsigned int event);
 
 static uint32_t cur_idle_nums;
+static uint32_t requested_idle_nums;
 static unsigned int core_parking_cpunum[NR_CPUS] = {[0 ... NR_CPUS-1] = -1};
 
 static struct core_parking_policy {
     char name[30];
+    unsigned int id;        /* XEN_CORE_PARKING_POLICY_* */
     unsigned int (*next)(unsigned int event);
 } *core_parking_policy;
 
 static enum core_parking_controller {
     POWER_FIRST,
-    PERFORMANCE_FIRST
+    PERFORMANCE_FIRST,
+    TOPOLOGY_FIRST
 } core_parking_controller = POWER_FIRST;
 
 static void __init setup_core_parking_option(char *str)
@@ -47,11 +54,23 @@ static void __init setup_core_parking_option(char *str)
         core_parking_controller = POWER_FIRST;
     else if ( !strcmp(str, "performance") )
         core_parking_controller = PERFORMANCE_FIRST;
+    else if ( !strcmp(str, "topology") )
+        core_parking_controller = TOPOLOGY_FIRST;
     else
         return;
 }
 custom_param("core_parking", setup_core_parking_option);
 
+/*
+ * The cpus that may be parked: cpu_down() refuses those of any pool but
+ * cpupool0 (cpupool_cpu_remove()), and cpu 0 never goes.
+ */
+static void core_parking_candidates(cpumask_t *mask)
+{
+    cpumask_and(mask, &cpu_online_map, cpupool0->cpu_valid);
+    cpumask_clear_cpu(0, mask);
+}
+
 static unsigned int core_parking_performance(unsigned int event)
 {
     unsigned int cpu = -1;
@@ -62,15 +81,13 @@ static unsigned int core_parking_performance(unsigned int event)
     {
         int core_tmp, core_weight = -1;
         int sibling_tmp, sibling_weight = -1;
-        cpumask_t core_candidate_map, sibling_candidate_map;
+        cpumask_t core_candidate_map, sibling_candidate_map, candidates;
         cpumask_clear(&core_candidate_map);
         cpumask_clear(&sibling_candidate_map);
+        core_parking_candidates(&candidates);
 
-        for_each_cpu(cpu, &cpu_online_map)
+        for_each_cpu(cpu, &candidates)
         {
-            if ( cpu == 0 )
-                continue;
-
             core_tmp = cpumask_weight(per_cpu(cpu_core_mask, cpu));
             if ( core_weight < core_tmp )
             {
@@ -122,15 +139,13 @@ static unsigned int core_parking_power(unsigned int event)
     {
         int core_tmp, core_weight = NR_CPUS + 1;
         int sibling_tmp, sibling_weight = NR_CPUS + 1;
-        cpumask_t core_candidate_map, sibling_candidate_map;
+        cpumask_t core_candidate_map, sibling_candidate_map, candidates;
         cpumask_clear(&core_candidate_map);
         cpumask_clear(&sibling_candidate_map);
+        core_parking_candidates(&candidates);
 
-        for_each_cpu(cpu, &cpu_online_map)
+        for_each_cpu(cpu, &candidates)
         {
-            if ( cpu == 0 )
-                continue;
-
             core_tmp = cpumask_weight(per_cpu(cpu_core_mask, cpu));
             if ( core_weight > core_tmp )
             {
@@ -172,6 +187,64 @@ static unsigned int core_parking_power(unsigned int event)
     return cpu;
 }
 
+/*
+ * Online cpus of mask, plus a penalty if any of them can't be parked: a
+ * socket or core shared with cpu 0 or another cpupool can never be
+ * emptied, so it only comes last.
+ */
+static unsigned int topology_weight(const cpumask_t *mask,
+                                    const cpumask_t *candidates)
+{
+    return cpumask_weight(mask) +
+           (cpumask_subset(mask, candidates) ? 0 : NR_CPUS);
+}
+
+/*
+ * Park whole sockets, then whole cores: take from the socket with the
+ * fewest online cpus left, on it from the core with the fewest online
+ * siblings left, the highest numbered cpu of ties.
+ */
+static unsigned int core_parking_topology(unsigned int event)
+{
+    unsigned int cpu = -1;
+
+    switch ( event )
+    {
+    case CORE_PARKING_INCREMENT:
+    {
+        unsigned int sw, cw, best = -1;
+        unsigned int best_socket = UINT_MAX, best_core = UINT_MAX;
+        cpumask_t candidates;
+
+        core_parking_candidates(&candidates);
+        for_each_cpu(cpu, &candidates)
+        {
+            sw = topology_weight(per_cpu(cpu_core_mask, cpu), &candidates);
+            cw = topology_weight(per_cpu(cpu_sibling_mask, cpu), &candidates);
+            if ( sw > best_socket || (sw == best_socket && cw > best_core) )
+                continue;
+            best_socket = sw;
+            best_core = cw;
+            best = cpu;
+        }
+
+        cpu = best;
+    }
+    break;
+
+    case CORE_PARKING_DECREMENT:
+    {
+        cpu = core_parking_cpunum[cur_idle_nums -1];
+    }
+    break;
+
+    default:
+        break;
+    }
+
+    return cpu;
+}
+
 long core_parking_helper(void *data)
 {
     uint32_t idle_nums = (unsigned long)data;
@@ -181,9 +254,13 @@ long core_parking_helper(void *data)
     if ( !core_parking_policy )
         return -EINVAL;
 
+    requested_idle_nums = idle_nums;
+
     while ( cur_idle_nums < idle_nums )
     {
         cpu = core_parking_policy->next(CORE_PARKING_INCREMENT);
+        if ( cpu >= nr_cpu_ids )
+            return -EBUSY;
         ret = cpu_down(cpu);
         if ( ret )
             return ret;
@@ -207,16 +284,29 @@ uint32_t get_cur_idle_nums(void)
     return cur_idle_nums;
 }
 
+uint32_t get_requested_idle_nums(void)
+{
+    return requested_idle_nums;
+}
+
 static struct core_parking_policy power_first = {
     .name = "power",
+    .id = XEN_CORE_PARKING_POLICY_POWER,
     .next = core_parking_power,
 };
 
 static struct core_parking_policy performance_first = {
     .name = "performance",
+    .id = XEN_CORE_PARKING_POLICY_PERFORMANCE,
     .next = core_parking_performance,
 };
 
+static struct core_parking_policy topology_first = {
+    .name = "topology",
+    .id = XEN_CORE_PARKING_POLICY_TOPOLOGY,
+    .next = core_parking_topology,
+};
+
 static int register_core_parking_policy(struct core_parking_policy *policy)
 {
     if ( !policy || !policy->next )
@@ -226,12 +316,38 @@ static int register_core_parking_policy(struct core_parking_policy *policy)
     return 0;
 }
 
+unsigned int core_parking_get_policy(void)
+{
+    return core_parking_policy ? core_parking_policy->id : -1;
+}
+
+/*
+ * All policies unpark last in, first out, so the policy may change while
+ * cpus are parked: only the cpus parked from now on follow the new one.
+ */
+int core_parking_set_policy(unsigned int id)
+{
+    switch ( id )
+    {
+    case XEN_CORE_PARKING_POLICY_POWER:
+        return register_core_parking_policy(&power_first);
+    case XEN_CORE_PARKING_POLICY_PERFORMANCE:
+        return register_core_parking_policy(&performance_first);
+    case XEN_CORE_PARKING_POLICY_TOPOLOGY:
+        return register_core_parking_policy(&topology_first);
+    }
+
+    return -EINVAL;
+}
+
 static int __init core_parking_init(void)
 {
     int ret = 0;
 
     if ( core_parking_controller == PERFORMANCE_FIRST )
         ret = register_core_parking_policy(&performance_first);
+    else if ( core_parking_controller == TOPOLOGY_FIRST )
+        ret = register_core_parking_policy(&topology_first);
     else
         ret = register_core_parking_policy(&power_first);
 
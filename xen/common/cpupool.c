@@ -581,6 +581,8 @@ int cpupool_do_sysctl(struct xen_sysctl_cpupool_op *op)
     case XEN_SYSCTL_CPUPOOL_OP_MOVEDOMAIN:
     {
         struct domain *d;
+        struct cpupool *old;
+        struct sched_move_data move;
 
         ret = rcu_lock_remote_domain_by_id(op->domid, &d);
         if ( ret )
@@ -600,18 +602,41 @@ int cpupool_do_sysctl(struct xen_sysctl_cpupool_op *op)
         cpupool_dprintk("cpupool move_domain(dom=%d)->pool=%d\n",
                         d->domain_id, op->cpupool_id);
         ret = -ENOENT;
+        c = cpupool_get_by_id(op->cpupool_id);
+        if ( c == NULL )
+        {
+            rcu_unlock_domain(d);
+            break;
+        }
+        /* Scheduler data is allocated and freed without cpupool_lock. */
+        ret = sched_move_domain_alloc(d, c, &move);
+        if ( ret )
+        {
+            cpupool_put(c);
+            rcu_unlock_domain(d);
+            break;
+        }
+        ret = -ENOENT;
+        old = NULL;
         spin_lock(&cpupool_lock);
-        c = cpupool_find_by_id(op->cpupool_id);
-        if ( (c != NULL) && cpumask_weight(c->cpu_valid) )
+        if ( (cpupool_find_by_id(op->cpupool_id) == c) &&
+             cpumask_weight(c->cpu_valid) )
         {
-            d->cpupool->n_dom--;
-            ret = sched_move_domain(d, c);
+            /* Keep the old pool's scheduler until its data is freed. */
+            old = d->cpupool;
+            atomic_inc(&old->refcnt);
+            old->n_dom--;
+            ret = sched_move_domain_commit(d, c, &move);
             if ( ret )
-                d->cpupool->n_dom++;
+                old->n_dom++;
             else
                 c->n_dom++;
         }
         spin_unlock(&cpupool_lock);
+        sched_move_domain_free(&move);
+        if ( old != NULL )
+            cpupool_put(old);
+        cpupool_put(c);
         cpupool_dprintk("cpupool move_domain(dom=%d)->pool=%d ret %d\n",
                         d->domain_id, op->cpupool_id, ret);
         rcu_unlock_domain(d);
@@ -125,6 +125,8 @@ struct vcpu *alloc_vcpu(
 
     tasklet_init(&v->continue_hypercall_tasklet, NULL, 0);
 
+    grant_table_init_vcpu(v);
+
     if ( !zalloc_cpumask_var(&v->cpu_hard_affinity) ||
          !zalloc_cpumask_var(&v->cpu_hard_affinity_tmp) ||
          !zalloc_cpumask_var(&v->cpu_hard_affinity_saved) ||
@@ -275,6 +277,7 @@ struct domain *domain_create(
     spin_lock_init(&d->node_affinity_lock);
     d->node_affinity = NODE_MASK_ALL;
     d->auto_node_affinity = 1;
+    rwlock_init(&d->vnuma_rwlock);
 
     spin_lock_init(&d->shutdown_lock);
     d->shutdown_code = -1;
@@ -511,6 +514,18 @@ out:
     return 0;
 }
 
+void vnuma_destroy(struct vnuma_info *vnuma)
+{
+    if ( vnuma )
+    {
+        xfree(vnuma->vmemrange);
+        xfree(vnuma->vcpu_to_vnode);
+        xfree(vnuma->vdistance);
+        xfree(vnuma->vnode_to_pnode);
+        xfree(vnuma);
+    }
+}
+
 
 struct domain *get_domain_by_id(domid_t dom)
 {
@@ -812,6 +827,7 @@ static void complete_domain_destroy(struct rcu_head *head)
 
     xfree(d->mem_event);
     xfree(d->pbuf);
+    vnuma_destroy(d->vnuma);
 
     for ( i = d->max_vcpus - 1; i >= 0; i-- )
         if ( (v = d->vcpu[i]) != NULL )
@@ -898,6 +914,12 @@ void domain_pause(struct domain *d)
 
     atomic_inc(&d->pause_count);
 
+    /*
+     * Get all vcpus off their pcpus first, so that waiting for them to
+     * be descheduled overlaps rather than costing a round trip per vcpu.
+     */
+    for_each_vcpu( d, v )
+        vcpu_sleep_nosync(v);
     for_each_vcpu( d, v )
         vcpu_sleep_sync(v);
 }
@@ -24,6 +24,7 @@
 #include <xen/bitmap.h>
 #include <xen/paging.h>
 #include <xen/hypercall.h>
+#include <xen/v4v.h>
 #include <asm/current.h>
 #include <asm/irq.h>
 #include <asm/page.h>
@@ -287,6 +288,71 @@ void domctl_lock_release(void)
     spin_unlock(&current->domain->hypercall_deadlock_mutex);
 }
 
+/* Copy in and check a virtual NUMA topology for d */
+static struct vnuma_info *vnuma_init(const struct xen_domctl_vnuma *uinfo,
+                                     const struct domain *d)
+{
+    unsigned int i, nr_vnodes = uinfo->nr_vnodes;
+    unsigned int nr_ranges = uinfo->nr_vmemranges;
+    struct vnuma_info *info;
+    int ret = -EINVAL;
+
+    /* Each node has memory, a couple of ranges each is plenty */
+    if ( nr_vnodes == 0 || nr_vnodes > MAX_NUMNODES ||
+         nr_ranges < nr_vnodes || nr_ranges > nr_vnodes * 4 ||
+         uinfo->nr_vcpus != d->max_vcpus || uinfo->pad )
+        return ERR_PTR(-EINVAL);
+
+    info = xzalloc(struct vnuma_info);
+    if ( !info )
+        return ERR_PTR(-ENOMEM);
+
+    info->nr_vnodes = nr_vnodes;
+    info->nr_vmemranges = nr_ranges;
+    info->vdistance = xmalloc_array(unsigned int, nr_vnodes * nr_vnodes);
+    info->vcpu_to_vnode = xmalloc_array(unsigned int, d->max_vcpus);
+    info->vnode_to_pnode = xmalloc_array(unsigned int, nr_vnodes);
+    info->vmemrange = xmalloc_array(struct xen_vmemrange, nr_ranges);
+    if ( !info->vdistance || !info->vcpu_to_vnode ||
+         !info->vnode_to_pnode || !info->vmemrange )
+    {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    if ( copy_from_guest(info->vdistance, uinfo->vdistance,
+                         nr_vnodes * nr_vnodes) ||
+         copy_from_guest(info->vcpu_to_vnode, uinfo->vcpu_to_vnode,
+                         d->max_vcpus) ||
+         copy_from_guest(info->vnode_to_pnode, uinfo->vnode_to_pnode,
+                         nr_vnodes) ||
+         copy_from_guest(info->vmemrange, uinfo->vmemrange, nr_ranges) )
+    {
+        ret = -EFAULT;
+        goto fail;
+    }
+
+    for ( i = 0; i < d->max_vcpus; i++ )
+        if ( info->vcpu_to_vnode[i] >= nr_vnodes )
+            goto fail;
+
+    for ( i = 0; i < nr_vnodes; i++ )
+        if ( info->vnode_to_pnode[i] >= MAX_NUMNODES )
+            info->vnode_to_pnode[i] = NUMA_NO_NODE;
+
+    for ( i = 0; i < nr_ranges; i++ )
+        if ( info->vmemrange[i].start >= info->vmemrange[i].end ||
+             info->vmemrange[i].nid >= nr_vnodes ||
+             info->vmemrange[i].flags )
+            goto fail;
+
+    return info;
+
+ fail:
+    vnuma_destroy(info);
+    return ERR_PTR(ret);
+}
+
 static inline
 int vcpuaffinity_params_invalid(const xen_domctl_vcpuaffinity_t *vcpuaff)
 {
@@ -709,6 +775,67 @@ long do_domctl(XEN_GUEST_HANDLE_PARAM(xen_domctl_t) u_domctl)
     }
     break;
 
+    case XEN_DOMCTL_setvcpuaffinity_bulk:
+    {
+        xen_domctl_vcpuaffinity_bulk_t *bulk = &op->u.vcpuaffinity_bulk;
+        cpumask_var_t hard, soft;
+        unsigned int nr;
+
+        ret = -EINVAL;
+        if ( bulk->flags == 0 ||
+             (bulk->flags & ~(XEN_VCPUAFFINITY_HARD | XEN_VCPUAFFINITY_SOFT)) ||
+             ((bulk->flags & XEN_VCPUAFFINITY_HARD) &&
+              guest_handle_is_null(bulk->cpumap_hard.bitmap)) ||
+             ((bulk->flags & XEN_VCPUAFFINITY_SOFT) &&
+              guest_handle_is_null(bulk->cpumap_soft.bitmap)) )
+            break;
+
+        if ( !alloc_cpumask_var(&hard) )
+        {
+            ret = -ENOMEM;
+            break;
+        }
+        if ( !alloc_cpumask_var(&soft) )
+        {
+            free_cpumask_var(hard);
+            ret = -ENOMEM;
+            break;
+        }
+
+        ret = 0;
+        if ( bulk->flags & XEN_VCPUAFFINITY_HARD )
+            ret = xenctl_bitmap_to_bitmap(cpumask_bits(hard),
+                                          &bulk->cpumap_hard, nr_cpu_ids);
+        if ( !ret && (bulk->flags & XEN_VCPUAFFINITY_SOFT) )
+            ret = xenctl_bitmap_to_bitmap(cpumask_bits(soft),
+                                          &bulk->cpumap_soft, nr_cpu_ids);
+
+        while ( !ret && bulk->nr_vcpus )
+        {
+            /* Check for preemption every few dozen vcpus. */
+            nr = min(bulk->nr_vcpus, 32U);
+            ret = vcpu_set_affinity_bulk(
+                d, bulk->first_vcpu, nr,
+                (bulk->flags & XEN_VCPUAFFINITY_HARD) ? hard : NULL,
+                (bulk->flags & XEN_VCPUAFFINITY_SOFT) ? soft : NULL);
+            if ( ret )
+                break;
+            bulk->first_vcpu += nr;
+            bulk->nr_vcpus -= nr;
+            if ( bulk->nr_vcpus && hypercall_preempt_check() )
+            {
+                ret = hypercall_create_continuation(
+                    __HYPERVISOR_domctl, "h", u_domctl);
+                copyback = 1;
+                break;
+            }
+        }
+
+        free_cpumask_var(soft);
+        free_cpumask_var(hard);
+    }
+    break;
+
     case XEN_DOMCTL_scheduler_op:
     {
         ret = sched_adjust(d, &op->u.scheduler_op);
@@ -967,6 +1094,52 @@ long do_domctl(XEN_GUEST_HANDLE_PARAM(xen_domctl_t) u_domctl)
     }
     break;
 
+    case XEN_DOMCTL_set_latency_hint:
+        ret = -EINVAL;
+        if ( op->u.latency_hint.flags & ~XEN_DOMCTL_LATENCY_SENSITIVE )
+            break;
+        d->latency_sensitive =
+            !!(op->u.latency_hint.flags & XEN_DOMCTL_LATENCY_SENSITIVE);
+        ret = 0;
+        break;
+
+    case XEN_DOMCTL_v4v_rings:
+    {
+        ret = -EINVAL;
+        if ( d == current->domain ) /* no domain_pause() */
+            break;
+
+        ret = v4v_rings_op(d, &op->u.v4v_rings);
+        if ( ret == -ERESTART )
+            ret = hypercall_create_continuation(
+                __HYPERVISOR_domctl, "h", u_domctl);
+        copyback = 1;
+    }
+    break;
+
+    case XEN_DOMCTL_v4v_set_quota:
+        ret = v4v_set_quota(d, &op->u.v4v_set_quota);
+        break;
+
+    case XEN_DOMCTL_setvnumainfo:
+    {
+        struct vnuma_info *vnuma = vnuma_init(&op->u.vnuma, d), *old;
+
+        if ( IS_ERR(vnuma) )
+        {
+            ret = PTR_ERR(vnuma);
+            break;
+        }
+
+        write_lock(&d->vnuma_rwlock);
+        old = d->vnuma;
+        d->vnuma = vnuma;
+        write_unlock(&d->vnuma_rwlock);
+        vnuma_destroy(old);
+        ret = 0;
+        break;
+    }
+
     default:
         ret = arch_do_domctl(op, d, u_domctl);
         break;
@@ -31,6 +31,7 @@
 
 #include <public/xen.h>
 #include <public/event_channel.h>
+#include <public/sysctl.h>
 #include <xsm/xsm.h>
 
 #define ERROR_EXIT(_errno)                                          \
@@ -149,6 +150,7 @@ static struct evtchn *alloc_evtchn_bucket(struct domain *d, unsigned int port)
             return NULL;
         }
         chn[i].port = port + i;
+        spin_lock_init(&chn[i].lock);
     }
     return chn;
 }
@@ -186,22 +188,59 @@ static int get_free_port(struct domain *d)
     if ( port == d->max_evtchns || port > d->max_evtchn_port )
         return -ENOSPC;
 
+    /* Senders look the port up without the event lock: publish it last. */
     if ( !group_from_port(d, port) )
     {
         grp = xzalloc_array(struct evtchn *, BUCKETS_PER_GROUP);
         if ( !grp )
             return -ENOMEM;
+        smp_wmb();
         group_from_port(d, port) = grp;
     }
 
     chn = alloc_evtchn_bucket(d, port);
     if ( !chn )
         return -ENOMEM;
+    smp_wmb();
     bucket_from_port(d, port) = chn;
 
     return port;
 }
 
+static void evtchn_free(struct domain *d, struct evtchn *chn)
+{
+    /* Clear pending event to avoid unexpected behavior on re-bind. */
+    evtchn_port_clear_pending(d, chn);
+
+    /* Reset binding to vcpu0 when the channel is freed. */
+    chn->state          = ECS_FREE;
+    chn->notify_vcpu_id = 0;
+
+    xsm_evtchn_close_post(chn);
+}
+
+static void double_evtchn_lock(struct evtchn *lchn, struct evtchn *rchn)
+{
+    if ( lchn < rchn )
+    {
+        spin_lock(&lchn->lock);
+        spin_lock(&rchn->lock);
+    }
+    else
+    {
+        if ( lchn != rchn )
+            spin_lock(&rchn->lock);
+        spin_lock(&lchn->lock);
+    }
+}
+
+static void double_evtchn_unlock(struct evtchn *lchn, struct evtchn *rchn)
+{
+    spin_unlock(&lchn->lock);
+    if ( lchn != rchn )
+        spin_unlock(&rchn->lock);
+}
+
 
 static long evtchn_alloc_unbound(evtchn_alloc_unbound_t *alloc)
 {
@@ -242,11 +281,15 @@ int evtchn_alloc_unbound_domain(struct domain *d, evtchn_port_t *port,
             goto out;
     }
 
+    spin_lock(&chn->lock);
+
     chn->state = ECS_UNBOUND;
     if ( (chn->u.unbound.remote_domid = remote_domid) == DOMID_SELF )
         chn->u.unbound.remote_domid = current->domain->domain_id;
     evtchn_port_init(d, chn);
 
+    spin_unlock(&chn->lock);
+
     *port = free_port;
     /* Everything is fine, returns 0 */
     rc = 0;
@@ -299,6 +342,8 @@ static long evtchn_bind_interdomain(evtchn_bind_interdomain_t *bind)
     if ( rc )
         goto out;
 
+    double_evtchn_lock(lchn, rchn);
+
     lchn->u.interdomain.remote_dom  = rd;
     lchn->u.interdomain.remote_port = rport;
     lchn->state                     = ECS_INTERDOMAIN;
@@ -314,6 +359,8 @@ static long evtchn_bind_interdomain(evtchn_bind_interdomain_t *bind)
      */
     evtchn_set_pending(ld->vcpu[lchn->notify_vcpu_id], lport);
 
+    double_evtchn_unlock(lchn, rchn);
+
     bind->local_port = lport;
 
  out:
@@ -354,11 +401,16 @@ static long evtchn_bind_virq(evtchn_bind_virq_t *bind)
         ERROR_EXIT(port);
 
     chn = evtchn_from_port(d, port);
+
+    spin_lock(&chn->lock);
+
     chn->state          = ECS_VIRQ;
     chn->notify_vcpu_id = vcpu;
     chn->u.virq         = virq;
     evtchn_port_init(d, chn);
 
+    spin_unlock(&chn->lock);
+
     v->virq_to_evtchn[virq] = bind->port = port;
 
  out:
@@ -385,10 +437,15 @@ static long evtchn_bind_ipi(evtchn_bind_ipi_t *bind)
         ERROR_EXIT(port);
 
     chn = evtchn_from_port(d, port);
+
+    spin_lock(&chn->lock);
+
     chn->state          = ECS_IPI;
     chn->notify_vcpu_id = vcpu;
     evtchn_port_init(d, chn);
 
+    spin_unlock(&chn->lock);
+
     bind->port = port;
 
  out:
@@ -463,11 +520,15 @@ static long evtchn_bind_pirq(evtchn_bind_pirq_t *bind)
         goto out;
     }
 
+    spin_lock(&chn->lock);
+
     chn->state  = ECS_PIRQ;
     chn->u.pirq.irq = pirq;
     link_pirq_port(port, chn, v);
     evtchn_port_init(d, chn);
 
+    spin_unlock(&chn->lock);
+
     bind->port = port;
 
 #ifdef CONFIG_X86
@@ -588,22 +649,24 @@ static long __evtchn_close(struct domain *d1, int port1)
         BUG_ON(chn2->state != ECS_INTERDOMAIN);
         BUG_ON(chn2->u.interdomain.remote_dom != d1);
 
+        double_evtchn_lock(chn1, chn2);
+
+        evtchn_free(d1, chn1);
+
         chn2->state = ECS_UNBOUND;
         chn2->u.unbound.remote_domid = d1->domain_id;
-        break;
+
+        double_evtchn_unlock(chn1, chn2);
+
+        goto out;
 
     default:
         BUG();
     }
 
-    /* Clear pending event to avoid unexpected behavior on re-bind. */
-    evtchn_port_clear_pending(d1, chn1);
-
-    /* Reset binding to vcpu0 when the channel is freed. */
-    chn1->state          = ECS_FREE;
-    chn1->notify_vcpu_id = 0;
-
-    xsm_evtchn_close_post(chn1);
+    spin_lock(&chn1->lock);
+    evtchn_free(d1, chn1);
+    spin_unlock(&chn1->lock);
 
  out:
     if ( d2 != NULL )
@@ -624,6 +687,10 @@ static long evtchn_close(evtchn_close_t *close)
     return __evtchn_close(current->domain, close->port);
 }
 
+/*
+ * Only the channel's lock is taken: binding and closing take it, and
+ * that of the remote channel, so neither end changes under us.
+ */
 int evtchn_send(struct domain *d, unsigned int lport)
 {
     struct evtchn *lchn, *rchn;
@@ -631,21 +698,18 @@ int evtchn_send(struct domain *d, unsigned int lport)
     struct vcpu   *rvcpu;
     int            rport, ret = 0;
 
-    spin_lock(&ld->event_lock);
-
     if ( unlikely(!port_is_valid(ld, lport)) )
-    {
-        spin_unlock(&ld->event_lock);
         return -EINVAL;
-    }
 
     lchn = evtchn_from_port(ld, lport);
 
+    spin_lock(&lchn->lock);
+
     /* Guest cannot send via a Xen-attached event channel. */
     if ( unlikely(consumer_is_xen(lchn)) )
     {
-        spin_unlock(&ld->event_lock);
-        return -EINVAL;
+        ret = -EINVAL;
+        goto out;
     }
 
     ret = xsm_evtchn_send(XSM_HOOK, ld, lchn);
@@ -678,12 +742,41 @@ int evtchn_send(struct domain *d, unsigned int lport)
         ret = -EINVAL;
     }
 
-out:
-    spin_unlock(&ld->event_lock);
+ out:
+    spin_unlock(&lchn->lock);
 
     return ret;
 }
 
+/*
+ * Setting an event pending only kicks its vcpu if the vcpu had nothing
+ * pending yet, so a vcpu many of the ports notify is still kicked once.
+ */
+static long evtchn_send_batch(struct evtchn_send_batch *batch)
+{
+    struct domain *d = current->domain;
+    unsigned int i, j;
+    long rc = 0;
+
+    if ( batch->nr_ports > EVTCHN_SEND_BATCH_MAX )
+        return -EINVAL;
+
+    for ( i = 0; i < batch->nr_ports; i++ )
+    {
+        for ( j = 0; j < i; j++ )
+            if ( batch->ports[j] == batch->ports[i] )
+                break;
+        if ( j < i )
+            continue;
+
+        rc = evtchn_send(d, batch->ports[i]);
+        if ( rc )
+            break;
+    }
+
+    return rc;
+}
+
 static void evtchn_set_pending(struct vcpu *v, int port)
 {
     evtchn_port_set_pending(v, evtchn_from_port(v->domain, port));
@@ -1088,6 +1181,14 @@ long do_event_channel_op(int cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
         break;
     }
 
+    case EVTCHNOP_send_batch: {
+        struct evtchn_send_batch batch;
+        if ( copy_from_guest(&batch, arg, 1) != 0 )
+            return -EFAULT;
+        rc = evtchn_send_batch(&batch);
+        break;
+    }
+
     case EVTCHNOP_status: {
         struct evtchn_status status;
         if ( copy_from_guest(&status, arg, 1) != 0 )
@@ -1218,18 +1319,15 @@ void notify_via_xen_event_channel(struct domain *ld, int lport)
     struct domain *rd;
     int            rport;
 
-    spin_lock(&ld->event_lock);
-
     if ( unlikely(ld->is_dying) )
-    {
-        spin_unlock(&ld->event_lock);
         return;
-    }
 
     ASSERT(port_is_valid(ld, lport));
     lchn = evtchn_from_port(ld, lport);
     ASSERT(consumer_is_xen(lchn));
 
+    spin_lock(&lchn->lock);
+
     if ( likely(lchn->state == ECS_INTERDOMAIN) )
     {
         rd    = lchn->u.interdomain.remote_dom;
@@ -1238,7 +1336,7 @@ void notify_via_xen_event_channel(struct domain *ld, int lport)
         evtchn_set_pending(rd->vcpu[rchn->notify_vcpu_id], rport);
     }
 
-    spin_unlock(&ld->event_lock);
+    spin_unlock(&lchn->lock);
 }
 
 void evtchn_check_pollers(struct domain *d, unsigned int port)
@@ -1265,6 +1363,83 @@ void evtchn_check_pollers(struct domain *d, unsigned int port)
     }
 }
 
+#ifdef EVTCHN_STATS
+static const uint8_t evtchn_stat_of_state[] = {
+    [ECS_FREE]        = EVTCHNSTAT_closed,
+    [ECS_RESERVED]    = EVTCHNSTAT_closed,
+    [ECS_UNBOUND]     = EVTCHNSTAT_unbound,
+    [ECS_INTERDOMAIN] = EVTCHNSTAT_interdomain,
+    [ECS_PIRQ]        = EVTCHNSTAT_pirq,
+    [ECS_VIRQ]        = EVTCHNSTAT_virq,
+    [ECS_IPI]         = EVTCHNSTAT_ipi,
+};
+
+int evtchn_hotports(struct domain *d, struct xen_sysctl_evtchn_hotports *op)
+{
+    struct xen_sysctl_evtchn_hotport *hot;
+    struct evtchn *chn;
+    unsigned int port, nr = 0, max = op->nr_ports, i;
+    s_time_t now;
+    u64 interval;
+    u32 sends;
+    int rc = 0;
+
+    if ( max > XEN_SYSCTL_EVTCHN_HOTPORTS_MAX )
+        max = XEN_SYSCTL_EVTCHN_HOTPORTS_MAX;
+
+    hot = max ? xmalloc_array(struct xen_sysctl_evtchn_hotport, max) : NULL;
+    if ( max && !hot )
+        return -ENOMEM;
+
+    spin_lock(&d->event_lock);
+
+    now = NOW();
+    interval = now - d->evtchn_stats_stamp;
+    d->evtchn_stats_stamp = now;
+
+    for ( port = 1; port_is_valid(d, port); port++ )
+    {
+        chn = evtchn_from_port(d, port);
+        sends = chn->sends - chn->last_sends;
+        chn->last_sends = chn->sends;
+        if ( !sends || !max )
+            continue;
+
+        /* Keep hot[] sorted busiest first, insert in place. */
+        if ( nr == max )
+        {
+            if ( sends <= hot[nr - 1].sends )
+                continue;
+            nr--;
+        }
+        for ( i = nr; i && (hot[i - 1].sends < sends); i-- )
+            hot[i] = hot[i - 1];
+        hot[i].port = port;
+        hot[i].vcpu = chn->notify_vcpu_id;
+        hot[i].state = evtchn_stat_of_state[chn->state];
+        hot[i].pad = 0;
+        hot[i].sends = sends;
+        nr++;
+    }
+
+    spin_unlock(&d->event_lock);
+
+    for ( i = 0; i < nr; i++ )
+        hot[i].rate = interval ? ((u64)hot[i].sends * SECONDS(1)) / interval
+                               : hot[i].sends;
+
+    if ( nr && copy_to_guest(op->ports, hot, nr) )
+        rc = -EFAULT;
+
+    op->nr_ports = nr;
+    op->interval_ns = interval;
+
+    xfree(hot);
+
+    return rc;
+}
+#endif
+
 int evtchn_init(struct domain *d)
 {
     evtchn_2l_init(d);
@@ -1281,6 +1456,9 @@ int evtchn_init(struct domain *d)
         return -EINVAL;
     }
     evtchn_from_port(d, 0)->state = ECS_RESERVED;
+#ifdef EVTCHN_STATS
+    d->evtchn_stats_stamp = NOW();
+#endif
 
 #if MAX_VIRT_CPUS > BITS_PER_LONG
     d->poll_mask = xmalloc_array(unsigned long, BITS_TO_LONGS(MAX_VIRT_CPUS));
@@ -1298,7 +1476,7 @@ int evtchn_init(struct domain *d)
 
 void evtchn_destroy(struct domain *d)
 {
-    unsigned int i, j;
+    unsigned int i;
 
     /* After this barrier no new event-channel allocations can occur. */
     BUG_ON(!d->is_dying);
@@ -1311,8 +1489,20 @@ void evtchn_destroy(struct domain *d)
         (void)__evtchn_close(d, i);
     }
 
-    /* Free all event-channel buckets. */
-    spin_lock(&d->event_lock);
+    clear_global_virq_handlers(d);
+
+    evtchn_fifo_destroy(d);
+}
+
+
+void evtchn_destroy_final(struct domain *d)
+{
+    unsigned int i, j;
+
+    /*
+     * Senders holding a reference may still look the ports up without the
+     * event lock: the buckets go only once the last reference has.
+     */
     for ( i = 0; i < NR_EVTCHN_GROUPS; i++ )
     {
         if ( !d->evtchn_group[i] )
@@ -1324,16 +1514,7 @@ void evtchn_destroy(struct domain *d)
     }
     free_evtchn_bucket(d, d->evtchn);
     d->evtchn = NULL;
-    spin_unlock(&d->event_lock);
 
-    clear_global_virq_handlers(d);
-
-    evtchn_fifo_destroy(d);
-}
-
-
-void evtchn_destroy_final(struct domain *d)
-{
 #if MAX_VIRT_CPUS > BITS_PER_LONG
     xfree(d->poll_mask);
     d->poll_mask = NULL;
@@ -148,7 +148,7 @@ static void evtchn_fifo_set_pending(struct vcpu *v, struct evtchn *evtchn)
 {
     struct domain *d = v->domain;
     unsigned int port;
-    event_word_t *word;
+    event_word_t *word, w;
     unsigned long flags;
     bool_t was_pending;
 
@@ -165,6 +165,19 @@ static void evtchn_fifo_set_pending(struct vcpu *v, struct evtchn *evtchn)
         return;
     }
 
+    /*
+     * Fast path: an event already pending and either linked or masked
+     * has nothing left to do, the guest has yet to see it. Don't take
+     * the event word's cache line away from the guest for that, but
+     * order what the sender wrote before the check as
+     * test_and_set_bit() would.
+     */
+    smp_mb();
+    w = read_atomic(word);
+    if ( (w & (1u << EVTCHN_FIFO_PENDING)) &&
+         (w & ((1u << EVTCHN_FIFO_LINKED) | (1u << EVTCHN_FIFO_MASKED))) )
+        return;
+
     was_pending = test_and_set_bit(EVTCHN_FIFO_PENDING, word);
 
     /*
@@ -37,6 +37,8 @@
 #include <xen/iommu.h>
 #include <xen/paging.h>
 #include <xen/keyhandler.h>
+#include <xen/perfc.h>
+#include <xen/random.h>
 #include <xsm/xsm.h>
 #include <asm/flushtlb.h>
 
@@ -76,6 +78,7 @@ struct gnttab_unmap_common {
 
     /* Shared state beteen *_unmap and *_unmap_complete */
     u16 flags;
+    bool_t put_handle;
     unsigned long frame;
     struct grant_mapping *map;
     struct domain *rd;
@@ -84,6 +87,13 @@ struct gnttab_unmap_common {
 /* Number of unmap operations that are done between each tlb flush */
 #define GNTTAB_UNMAP_BATCH_SIZE 32
 
+/*
+ * GNTTABOP_unmap_deferred unmaps wait for a flush for no more than this,
+ * and no more than this many of them.
+ */
+#define GNTTAB_UNMAP_DEFER_TIMEOUT MILLISECS(1)
+#define GNTTAB_UNMAP_DEFER_MAX     128
+
 
 #define PIN_FAIL(_lbl, _rc, _f, _a...)          \
     do {                                        \
@@ -131,6 +141,7 @@ shared_entry_header(struct grant_table *t, grant_ref_t ref)
 /* Active grant entry - used for shadowing GTF_permit_access grants. */
 struct active_grant_entry {
     u32           pin;    /* Reference count information.             */
+    spinlock_t    lock;   /* Protects the entry, see below.           */
     domid_t       domid;  /* Domain being granted access.             */
     struct domain *trans_domain;
     uint32_t      trans_gref;
@@ -144,9 +155,72 @@ struct active_grant_entry {
 };
 
 #define ACGNT_PER_PAGE (PAGE_SIZE / sizeof(struct active_grant_entry))
-#define active_entry(t, e) \
+#define _active_entry(t, e) \
     ((t)->active[(e)/ACGNT_PER_PAGE][(e)%ACGNT_PER_PAGE])
 
+/*
+ * The time current waited for the grant table locks map, unmap and copy
+ * take, for XEN_SYSCTL_gnttab_domstats.
+ */
+static inline void gnttab_lock_contended(s_time_t start)
+{
+    current->gnttab_stats.lock_contended++;
+    current->gnttab_stats.lock_wait_ns += NOW() - start;
+}
+
+static inline void gnttab_read_lock(struct grant_table *gt)
+{
+    s_time_t start;
+
+    if ( likely(read_trylock(&gt->lock)) )
+        return;
+
+    start = NOW();
+    read_lock(&gt->lock);
+    gnttab_lock_contended(start);
+}
+
+/*
+ * An active entry is only looked at or changed with its lock held, which
+ * is taken with the grant table lock held for reading, so that the many
+ * map, unmap and copy operations a backend issues on one domain's table
+ * only serialise when they are on the same grant. Holding the table lock
+ * for writing excludes them all.
+ */
+static inline struct active_grant_entry *
+active_entry_acquire(struct grant_table *t, grant_ref_t e)
+{
+    struct active_grant_entry *act;
+
+    ASSERT(rw_is_locked(&t->lock));
+
+    act = &_active_entry(t, e);
+    if ( unlikely(!spin_trylock(&act->lock)) )
+    {
+        s_time_t start = NOW();
+
+        spin_lock(&act->lock);
+        gnttab_lock_contended(start);
+    }
+
+    return act;
+}
+
+static inline void active_entry_release(struct active_grant_entry *act)
+{
+    spin_unlock(&act->lock);
+}
+
+static void
+active_entries_init(struct active_grant_entry *act)
+{
+    unsigned int i;
+
+    clear_page(act);
+    for ( i = 0; i < ACGNT_PER_PAGE; i++ )
+        spin_lock_init(&act[i].lock);
+}
+
 static inline void gnttab_flush_tlb(const struct domain *d)
 {
     if ( !paging_mode_external(d) )
@@ -212,90 +286,189 @@ static int __get_paged_frame(unsigned long gfn, unsigned long *frame, struct pag
     return rc;
 }
 
+/*
+ * Only needed when the IOMMU mappings of ld follow its grant mappings:
+ * mapcount() walks the whole of lgt's maptrack and reads active entries
+ * of rgt without their locks, both tables are locked for writing.
+ */
 static inline void
 double_gt_lock(struct grant_table *lgt, struct grant_table *rgt)
 {
     if ( lgt < rgt )
     {
-        spin_lock(&lgt->lock);
-        spin_lock(&rgt->lock);
+        write_lock(&lgt->lock);
+        write_lock(&rgt->lock);
     }
     else
     {
         if ( lgt != rgt )
-            spin_lock(&rgt->lock);
-        spin_lock(&lgt->lock);
+            write_lock(&rgt->lock);
+        write_lock(&lgt->lock);
     }
 }
 
 static inline void
 double_gt_unlock(struct grant_table *lgt, struct grant_table *rgt)
 {
-    spin_unlock(&lgt->lock);
+    write_unlock(&lgt->lock);
     if ( lgt != rgt )
-        spin_unlock(&rgt->lock);
+        write_unlock(&rgt->lock);
 }
 
+/*
+ * The free maptrack entries of a grant table are on per-vcpu lists, so
+ * that mapping doesn't take a lock: a vcpu takes entries from the head
+ * of its own list, and an entry is given back to the tail of the list
+ * of the vcpu that took it, by whichever vcpu unmaps it. A list always
+ * keeps its last entry, which is where entries are appended. The
+ * maptrack lock is only taken to add a maptrack frame.
+ */
 static inline int
 __get_maptrack_handle(
-    struct grant_table *t)
+    struct grant_table *t,
+    struct vcpu *v)
 {
-    unsigned int h;
-    if ( unlikely((h = t->maptrack_head) == MAPTRACK_TAIL) )
-        return -1;
-    t->maptrack_head = maptrack_entry(t, h).ref;
-    return h;
+    unsigned int head, next, prev_head;
+
+    head = read_atomic(&v->maptrack_head);
+    do {
+        /* No maptrack pages allocated for this VCPU yet? */
+        if ( unlikely(head == MAPTRACK_TAIL) )
+            return -1;
+
+        next = read_atomic(&maptrack_entry(t, head).ref);
+        if ( unlikely(next == MAPTRACK_TAIL) )
+            return -1;
+
+        /* another vcpu may be stealing from this list */
+        prev_head = head;
+        head = cmpxchg(&v->maptrack_head, prev_head, next);
+    } while ( head != prev_head );
+
+    return head;
+}
+
+/*
+ * With the domain out of maptrack frames, take a free entry of another
+ * of its vcpus.
+ */
+static int
+steal_maptrack_handle(
+    struct grant_table *t, struct vcpu *curr)
+{
+    struct domain *currd = curr->domain;
+    unsigned int first, i;
+    int handle;
+
+    first = i = get_random() % currd->max_vcpus;
+    do {
+        if ( currd->vcpu[i] && (currd->vcpu[i] != curr) )
+        {
+            handle = __get_maptrack_handle(t, currd->vcpu[i]);
+            if ( handle != -1 )
+            {
+                maptrack_entry(t, handle).vcpu = curr->vcpu_id;
+                curr->gnttab_stats.maptrack_steals++;
+                perfc_incr(maptrack_steal);
+                return handle;
+            }
+        }
+
+        if ( ++i == currd->max_vcpus )
+            i = 0;
+    } while ( i != first );
+
+    perfc_incr(maptrack_steal_failed);
+    return -1;
 }
 
 static inline void
 put_maptrack_handle(
-    struct grant_table *t, int handle)
+    struct domain *d, int handle)
 {
-    spin_lock(&t->lock);
-    maptrack_entry(t, handle).ref = t->maptrack_head;
-    t->maptrack_head = handle;
-    spin_unlock(&t->lock);
+    struct grant_table *t = d->grant_table;
+    struct vcpu *v;
+    unsigned int prev_tail, cur_tail;
+
+    /* 1. Make the entry the new tail. */
+    maptrack_entry(t, handle).ref = MAPTRACK_TAIL;
+
+    /* 2. Append it to the list of the vcpu which took it. */
+    v = d->vcpu[maptrack_entry(t, handle).vcpu];
+    cur_tail = read_atomic(&v->maptrack_tail);
+    do {
+        prev_tail = cur_tail;
+        cur_tail = cmpxchg(&v->maptrack_tail, prev_tail, handle);
+    } while ( cur_tail != prev_tail );
+
+    /* 3. Link the old tail to it. */
+    write_atomic(&maptrack_entry(t, prev_tail).ref, handle);
 }
 
 static inline int
 get_maptrack_handle(
     struct grant_table *lgt)
 {
-    int                   i;
-    grant_handle_t        handle;
+    struct vcpu          *curr = current;
+    unsigned int          i, nr_frames, head, prev_head;
+    int                   handle;
     struct grant_mapping *new_mt;
-    unsigned int          new_mt_limit, nr_frames;
 
-    spin_lock(&lgt->lock);
+    handle = __get_maptrack_handle(lgt, curr);
+    if ( likely(handle != -1) )
+        return handle;
+
+    perfc_incr(maptrack_slow);
+    spin_lock(&lgt->maptrack_lock);
 
-    while ( unlikely((handle = __get_maptrack_handle(lgt)) == -1) )
+    nr_frames = nr_maptrack_frames(lgt);
+    if ( nr_frames >= max_nr_maptrack_frames() )
     {
-        nr_frames = nr_maptrack_frames(lgt);
-        if ( nr_frames >= max_nr_maptrack_frames() )
-            break;
+        spin_unlock(&lgt->maptrack_lock);
+        return steal_maptrack_handle(lgt, curr);
+    }
 
-        new_mt = alloc_xenheap_page();
-        if ( !new_mt )
-            break;
+    new_mt = alloc_xenheap_page();
+    if ( !new_mt )
+    {
+        spin_unlock(&lgt->maptrack_lock);
+        return -1;
+    }
+    clear_page(new_mt);
 
-        clear_page(new_mt);
+    /*
+     * Use the first new entry and put the others at the head of our
+     * list, in front of what is left of it.
+     */
+    handle = lgt->maptrack_limit;
+
+    for ( i = 0; i < MAPTRACK_PER_PAGE; i++ )
+    {
+        new_mt[i].ref = handle + i + 1;
+        new_mt[i].vcpu = curr->vcpu_id;
+    }
 
-        new_mt_limit = lgt->maptrack_limit + MAPTRACK_PER_PAGE;
+    /* Set the tail directly if this is the first page for this VCPU. */
+    if ( curr->maptrack_tail == MAPTRACK_TAIL )
+        curr->maptrack_tail = handle + MAPTRACK_PER_PAGE - 1;
 
-        for ( i = 1; i < MAPTRACK_PER_PAGE; i++ )
-            new_mt[i - 1].ref = lgt->maptrack_limit + i;
-        new_mt[i - 1].ref = lgt->maptrack_head;
-        lgt->maptrack_head = lgt->maptrack_limit;
+    lgt->maptrack[nr_frames] = new_mt;
+    smp_wmb();
+    lgt->maptrack_limit += MAPTRACK_PER_PAGE;
 
-        lgt->maptrack[nr_frames] = new_mt;
+    /* the entry left may be stolen meanwhile, see __get_maptrack_handle() */
+    head = read_atomic(&curr->maptrack_head);
+    do {
+        new_mt[MAPTRACK_PER_PAGE - 1].ref = head;
         smp_wmb();
-        lgt->maptrack_limit      = new_mt_limit;
+        prev_head = head;
+        head = cmpxchg(&curr->maptrack_head, prev_head, handle + 1);
+    } while ( head != prev_head );
 
-        gdprintk(XENLOG_INFO, "Increased maptrack size to %u frames\n",
-                 nr_frames + 1);
-    }
+    spin_unlock(&lgt->maptrack_lock);
 
-    spin_unlock(&lgt->lock);
+    gdprintk(XENLOG_INFO, "Increased maptrack size to %u frames\n",
+             nr_frames + 1);
 
     return handle;
 }
@@ -493,13 +666,17 @@ static void mapcount(
 
     *wrc = *rdc = 0;
 
+    /* see double_gt_lock() */
+    ASSERT(rw_is_write_locked(&lgt->lock));
+    ASSERT(rw_is_write_locked(&rd->grant_table->lock));
+
     for ( handle = 0; handle < lgt->maptrack_limit; handle++ )
     {
         map = &maptrack_entry(lgt, handle);
         if ( !(map->flags & (GNTMAP_device_map|GNTMAP_host_map)) ||
              map->domid != rd->domain_id )
             continue;
-        if ( active_entry(rd->grant_table, map->ref).frame == mfn )
+        if ( _active_entry(rd->grant_table, map->ref).frame == mfn )
             (map->flags & GNTMAP_readonly) ? (*rdc)++ : (*wrc)++;
     }
 }
@@ -525,6 +702,7 @@ __gnttab_map_grant_ref(
     u32            old_pin;
     u32            act_pin;
     unsigned int   cache_flags;
+    bool_t         need_iommu;
     struct active_grant_entry *act = NULL;
     struct grant_mapping *mt;
     grant_entry_v1_t *sha1;
@@ -534,6 +712,7 @@ __gnttab_map_grant_ref(
 
     led = current;
     ld = led->domain;
+    led->gnttab_stats.map_ops++;
 
     if ( unlikely((op->flags & (GNTMAP_device_map|GNTMAP_host_map)) == 0) )
     {
@@ -576,7 +755,7 @@ __gnttab_map_grant_ref(
     }
 
     rgt = rd->grant_table;
-    spin_lock(&rgt->lock);
+    gnttab_read_lock(rgt);
 
     if ( rgt->gt_version == 0 )
         PIN_FAIL(unlock_out, GNTST_general_error,
@@ -586,7 +765,7 @@ __gnttab_map_grant_ref(
     if ( unlikely(op->ref >= nr_grant_entries(rgt)))
         PIN_FAIL(unlock_out, GNTST_bad_gntref, "Bad ref (%d).\n", op->ref);
 
-    act = &active_entry(rgt, op->ref);
+    act = active_entry_acquire(rgt, op->ref);
     shah = shared_entry_header(rgt, op->ref);
     if (rgt->gt_version == 1) {
         sha1 = &shared_entry_v1(rgt, op->ref);
@@ -603,7 +782,7 @@ __gnttab_map_grant_ref(
          ((act->domid != ld->domain_id) ||
           (act->pin & 0x80808080U) != 0 ||
           (act->is_sub_page)) )
-        PIN_FAIL(unlock_out, GNTST_general_error,
+        PIN_FAIL(act_release_out, GNTST_general_error,
                  "Bad domain (%d != %d), or risk of counter overflow %08x, or subpage %d\n",
                  act->domid, ld->domain_id, act->pin, act->is_sub_page);
 
@@ -614,7 +793,7 @@ __gnttab_map_grant_ref(
         if ( (rc = _set_status(rgt->gt_version, ld->domain_id,
                                op->flags & GNTMAP_readonly,
                                1, shah, act, status) ) != GNTST_okay )
-             goto unlock_out;
+             goto act_release_out;
 
         if ( !act->pin )
         {
@@ -649,7 +828,8 @@ __gnttab_map_grant_ref(
 
     cache_flags = (shah->flags & (GTF_PAT | GTF_PWT | GTF_PCD) );
 
-    spin_unlock(&rgt->lock);
+    active_entry_release(act);
+    read_unlock(&rgt->lock);
 
     /* pg may be set, with a refcount included, from __get_paged_frame */
     if ( !pg )
@@ -725,12 +905,14 @@ __gnttab_map_grant_ref(
         goto undo_out;
     }
 
-    double_gt_lock(lgt, rgt);
-
-    if ( gnttab_need_iommu_mapping(ld) )
+    need_iommu = gnttab_need_iommu_mapping(ld);
+    if ( need_iommu )
     {
         unsigned int wrc, rdc;
         int err = 0;
+
+        double_gt_lock(lgt, rgt);
+
         /* We're not translated, so we know that gmfns and mfns are
            the same things, so the IOMMU entry is always 1-to-1. */
         mapcount(lgt, rd, frame, &wrc, &rdc);
@@ -756,12 +938,19 @@ __gnttab_map_grant_ref(
 
     TRACE_1D(TRC_MEM_PAGE_GRANT_MAP, op->dom);
 
+    /*
+     * Whoever looks at a maptrack entry checks its flags first, they are
+     * written last. Under the write locks if mapcount() can be walking
+     * the table.
+     */
     mt = &maptrack_entry(lgt, handle);
     mt->domid = op->dom;
     mt->ref   = op->ref;
-    mt->flags = op->flags;
+    smp_wmb();
+    write_atomic(&mt->flags, op->flags);
 
-    double_gt_unlock(lgt, rgt);
+    if ( need_iommu )
+        double_gt_unlock(lgt, rgt);
 
     op->dev_bus_addr = (u64)frame << PAGE_SHIFT;
     op->handle       = handle;
@@ -784,9 +973,9 @@ __gnttab_map_grant_ref(
         put_page(pg);
     }
 
-    spin_lock(&rgt->lock);
+    gnttab_read_lock(rgt);
 
-    act = &active_entry(rgt, op->ref);
+    act = active_entry_acquire(rgt, op->ref);
 
     if ( op->flags & GNTMAP_device_map )
         act->pin -= (op->flags & GNTMAP_readonly) ?
@@ -803,10 +992,13 @@ __gnttab_map_grant_ref(
     if ( !act->pin )
         gnttab_clear_flag(_GTF_reading, status);
 
+ act_release_out:
+    active_entry_release(act);
+
  unlock_out:
-    spin_unlock(&rgt->lock);
+    read_unlock(&rgt->lock);
     op->status = rc;
-    put_maptrack_handle(lgt, handle);
+    put_maptrack_handle(ld, handle);
     rcu_unlock_domain(rd);
 }
 
@@ -839,11 +1031,14 @@ __gnttab_unmap_common(
     struct domain   *ld, *rd;
     struct grant_table *lgt, *rgt;
     struct active_grant_entry *act;
+    bool_t           unmapped = 0;
     s16              rc = 0;
 
     ld = current->domain;
     lgt = ld->grant_table;
+    current->gnttab_stats.unmap_ops++;
 
+    op->put_handle = 0;
     op->frame = (unsigned long)(op->dev_bus_addr >> PAGE_SHIFT);
 
     if ( unlikely(op->handle >= lgt->maptrack_limit) )
@@ -854,18 +1049,18 @@ __gnttab_unmap_common(
     }
 
     op->map = &maptrack_entry(lgt, op->handle);
-    spin_lock(&lgt->lock);
+    gnttab_read_lock(lgt);
 
-    if ( unlikely(!op->map->flags) )
+    if ( unlikely(!read_atomic(&op->map->flags)) )
     {
-        spin_unlock(&lgt->lock);
+        read_unlock(&lgt->lock);
         gdprintk(XENLOG_INFO, "Zero flags for handle (%d).\n", op->handle);
         op->status = GNTST_bad_handle;
         return;
     }
 
     dom = op->map->domid;
-    spin_unlock(&lgt->lock);
+    read_unlock(&lgt->lock);
 
     if ( unlikely((rd = rcu_lock_domain_by_id(dom)) == NULL) )
     {
@@ -886,9 +1081,9 @@ __gnttab_unmap_common(
     TRACE_1D(TRC_MEM_PAGE_GRANT_UNMAP, dom);
 
     rgt = rd->grant_table;
-    double_gt_lock(lgt, rgt);
+    gnttab_read_lock(rgt);
 
-    op->flags = op->map->flags;
+    op->flags = read_atomic(&op->map->flags);
     if ( unlikely(!op->flags) || unlikely(op->map->domid != dom) )
     {
         gdprintk(XENLOG_WARNING, "Unstable handle %u\n", op->handle);
@@ -897,7 +1092,7 @@ __gnttab_unmap_common(
     }
 
     op->rd = rd;
-    act = &active_entry(rgt, op->map->ref);
+    act = active_entry_acquire(rgt, op->map->ref);
 
     if ( op->frame == 0 )
     {
@@ -906,7 +1101,7 @@ __gnttab_unmap_common(
     else
     {
         if ( unlikely(op->frame != act->frame) )
-            PIN_FAIL(unmap_out, GNTST_general_error,
+            PIN_FAIL(act_release_out, GNTST_general_error,
                      "Bad frame number doesn't match gntref. (%lx != %lx)\n",
                      op->frame, act->frame);
         if ( op->flags & GNTMAP_device_map )
@@ -917,6 +1112,7 @@ __gnttab_unmap_common(
                 act->pin -= GNTPIN_devr_inc;
             else
                 act->pin -= GNTPIN_devw_inc;
+            unmapped = 1;
         }
     }
 
@@ -925,7 +1121,7 @@ __gnttab_unmap_common(
         if ( (rc = replace_grant_host_mapping(op->host_addr,
                                               op->frame, op->new_addr, 
                                               op->flags)) < 0 )
-            goto unmap_out;
+            goto act_release_out;
 
         ASSERT(act->pin & (GNTPIN_hstw_mask | GNTPIN_hstr_mask));
         op->map->flags &= ~GNTMAP_host_map;
@@ -933,44 +1129,59 @@ __gnttab_unmap_common(
             act->pin -= GNTPIN_hstr_inc;
         else
             act->pin -= GNTPIN_hstw_inc;
+        unmapped = 1;
     }
 
-    if ( gnttab_need_iommu_mapping(ld) )
+    /*
+     * Of concurrent unmaps of the handle's host and device mappings, the
+     * one which removes the last of them frees the handle on completion.
+     */
+    if ( unmapped &&
+         !(op->map->flags & (GNTMAP_device_map|GNTMAP_host_map)) )
+        op->put_handle = 1;
+
+ act_release_out:
+    active_entry_release(act);
+ unmap_out:
+    read_unlock(&rgt->lock);
+
+    if ( rc == GNTST_okay && gnttab_need_iommu_mapping(ld) )
     {
         unsigned int wrc, rdc;
         int err = 0;
+
+        double_gt_lock(lgt, rgt);
+
         mapcount(lgt, rd, op->frame, &wrc, &rdc);
         if ( (wrc + rdc) == 0 )
             err = iommu_unmap_page(ld, op->frame);
         else if ( wrc == 0 )
             err = iommu_map_page(ld, op->frame, op->frame, IOMMUF_readable);
+
+        double_gt_unlock(lgt, rgt);
+
         if ( err )
-        {
             rc = GNTST_general_error;
-            goto unmap_out;
-        }
     }
 
     /* If just unmapped a writable mapping, mark as dirtied */
-    if ( !(op->flags & GNTMAP_readonly) )
+    if ( rc == GNTST_okay && !(op->flags & GNTMAP_readonly) )
          gnttab_mark_dirty(rd, op->frame);
 
- unmap_out:
-    double_gt_unlock(lgt, rgt);
     op->status = rc;
     rcu_unlock_domain(rd);
 }
 
 static void
-__gnttab_unmap_common_complete(struct gnttab_unmap_common *op)
+__gnttab_unmap_common_complete(
+    struct domain *ld, struct gnttab_unmap_common *op)
 {
-    struct domain *ld, *rd = op->rd;
+    struct domain *rd = op->rd;
     struct grant_table *rgt;
     struct active_grant_entry *act;
     grant_entry_header_t *sha;
     struct page_info *pg;
     uint16_t *status;
-    bool_t put_handle = 0;
 
     if ( rd == NULL )
     { 
@@ -982,16 +1193,14 @@ __gnttab_unmap_common_complete(struct gnttab_unmap_common *op)
         return;
     }
 
-    ld = current->domain;
-
     rcu_lock_domain(rd);
     rgt = rd->grant_table;
-    spin_lock(&rgt->lock);
+    gnttab_read_lock(rgt);
 
     if ( rgt->gt_version == 0 )
-        goto unmap_out;
+        goto unlock_out;
 
-    act = &active_entry(rgt, op->map->ref);
+    act = active_entry_acquire(rgt, op->map->ref);
     sha = shared_entry_header(rgt, op->map->ref);
 
     if ( rgt->gt_version == 1 )
@@ -1005,7 +1214,7 @@ __gnttab_unmap_common_complete(struct gnttab_unmap_common *op)
          * Suggests that __gntab_unmap_common failed early and so
          * nothing further to do
          */
-        goto unmap_out;
+        goto act_release_out;
     }
 
     pg = mfn_to_page(op->frame);
@@ -1029,7 +1238,7 @@ __gnttab_unmap_common_complete(struct gnttab_unmap_common *op)
              * Suggests that __gntab_unmap_common failed in
              * replace_grant_host_mapping() so nothing further to do
              */
-            goto unmap_out;
+            goto act_release_out;
         }
 
         if ( !is_iomem_page(op->frame) ) 
@@ -1040,9 +1249,6 @@ __gnttab_unmap_common_complete(struct gnttab_unmap_common *op)
         }
     }
 
-    if ( (op->map->flags & (GNTMAP_device_map|GNTMAP_host_map)) == 0 )
-        put_handle = 1;
-
     if ( ((act->pin & (GNTPIN_devw_mask|GNTPIN_hstw_mask)) == 0) &&
          !(op->flags & GNTMAP_readonly) )
         gnttab_clear_flag(_GTF_writing, status);
@@ -1050,16 +1256,102 @@ __gnttab_unmap_common_complete(struct gnttab_unmap_common *op)
     if ( act->pin == 0 )
         gnttab_clear_flag(_GTF_reading, status);
 
- unmap_out:
-    spin_unlock(&rgt->lock);
-    if ( put_handle )
+ act_release_out:
+    active_entry_release(act);
+ unlock_out:
+    read_unlock(&rgt->lock);
+    if ( op->put_handle )
     {
-        op->map->flags = 0;
-        put_maptrack_handle(ld->grant_table, op->handle);
+        write_atomic(&op->map->flags, 0);
+        put_maptrack_handle(ld, op->handle);
     }
     rcu_unlock_domain(rd);
 }
 
+/*
+ * Flush the TLBs that the deferred unmaps of ld may still be cached in
+ * and complete them. The CPUs which flushed their TLB since the last of
+ * the PTEs was cleared, as after a flush for another batch, are not
+ * flushed again.
+ */
+static void
+__gnttab_flush_deferred(struct domain *ld)
+{
+    struct grant_table *lgt = ld->grant_table;
+    cpumask_t mask;
+    unsigned int i;
+
+    ASSERT(spin_is_locked(&lgt->deferred_lock));
+
+    if ( !lgt->nr_deferred )
+        return;
+
+    cpumask_copy(&mask, ld->domain_dirty_cpumask);
+    tlbflush_filter(mask, lgt->deferred_stamp);
+    if ( !cpumask_empty(&mask) )
+        flush_tlb_mask(&mask);
+
+    for ( i = 0; i < lgt->nr_deferred; i++ )
+    {
+        __gnttab_unmap_common_complete(ld, &lgt->deferred[i]);
+        put_domain(lgt->deferred[i].rd);
+    }
+    lgt->nr_deferred = 0;
+
+    stop_timer(&lgt->deferred_timer);
+}
+
+static void
+gnttab_flush_deferred(struct domain *ld)
+{
+    struct grant_table *lgt = ld->grant_table;
+
+    if ( !read_atomic(&lgt->nr_deferred) )
+        return;
+
+    spin_lock(&lgt->deferred_lock);
+    __gnttab_flush_deferred(ld);
+    spin_unlock(&lgt->deferred_lock);
+}
+
+static void
+gnttab_deferred_timer_fn(void *data)
+{
+    gnttab_flush_deferred(data);
+}
+
+/*
+ * Queue an unmap whose PTE is gone, until the TLBs are flushed: its
+ * grant stays in use and the frame referenced in the meantime, so the
+ * granting domain can't reuse it yet.
+ */
+static void
+__gnttab_defer_unmap(
+    struct domain *ld, struct gnttab_unmap_common *op)
+{
+    struct grant_table *lgt = ld->grant_table;
+
+    /* Not while the granting domain is on its way out. */
+    if ( unlikely(!get_domain(op->rd)) )
+    {
+        gnttab_flush_tlb(ld);
+        __gnttab_unmap_common_complete(ld, op);
+        return;
+    }
+
+    spin_lock(&lgt->deferred_lock);
+
+    lgt->deferred[lgt->nr_deferred] = *op;
+    lgt->deferred_stamp = tlbflush_current_time();
+    if ( ++lgt->nr_deferred == GNTTAB_UNMAP_DEFER_MAX )
+        __gnttab_flush_deferred(ld);
+    else if ( lgt->nr_deferred == 1 )
+        set_timer(&lgt->deferred_timer,
+                  NOW() + GNTTAB_UNMAP_DEFER_TIMEOUT);
+
+    spin_unlock(&lgt->deferred_lock);
+}
+
 static void
 __gnttab_unmap_grant_ref(
     struct gnttab_unmap_grant_ref *op,
@@ -1105,7 +1397,9 @@ gnttab_unmap_grant_ref(
         gnttab_flush_tlb(current->domain);
 
         for ( i = 0; i < partial_done; i++ )
-            __gnttab_unmap_common_complete(&(common[i]));
+            __gnttab_unmap_common_complete(current->domain, &(common[i]));
+
+        gnttab_flush_deferred(current->domain);
 
         count -= c;
         done += c;
@@ -1120,10 +1414,65 @@ fault:
     gnttab_flush_tlb(current->domain);
 
     for ( i = 0; i < partial_done; i++ )
-        __gnttab_unmap_common_complete(&(common[i]));
+        __gnttab_unmap_common_complete(current->domain, &(common[i]));
     return -EFAULT;
 }
 
+static long
+gnttab_unmap_deferred(
+    XEN_GUEST_HANDLE_PARAM(gnttab_unmap_grant_ref_t) uop, unsigned int count)
+{
+    struct domain *ld = current->domain;
+    struct grant_table *lgt = ld->grant_table;
+    struct gnttab_unmap_grant_ref op;
+    struct gnttab_unmap_common common;
+    struct gnttab_unmap_common *deferred;
+    unsigned int i;
+
+    if ( !count )
+    {
+        gnttab_flush_deferred(ld);
+        return 0;
+    }
+
+    /* Without a TLB flush to save, there is no point in waiting. */
+    if ( paging_mode_external(ld) )
+        return gnttab_unmap_grant_ref(uop, count);
+
+    if ( unlikely(!lgt->deferred) )
+    {
+        deferred = xmalloc_array(struct gnttab_unmap_common,
+                                 GNTTAB_UNMAP_DEFER_MAX);
+        spin_lock(&lgt->deferred_lock);
+        if ( !lgt->deferred )
+        {
+            lgt->deferred = deferred;
+            deferred = NULL;
+        }
+        spin_unlock(&lgt->deferred_lock);
+        xfree(deferred);
+
+        if ( !lgt->deferred )
+            return gnttab_unmap_grant_ref(uop, count);
+    }
+
+    for ( i = 0; i < count; i++ )
+    {
+        if ( i && hypercall_preempt_check() )
+            return i;
+        if ( unlikely(__copy_from_guest(&op, uop, 1)) )
+            return -EFAULT;
+        __gnttab_unmap_grant_ref(&op, &common);
+        if ( common.rd )
+            __gnttab_defer_unmap(ld, &common);
+        if ( unlikely(__copy_field_to_guest(uop, &op, status)) )
+            return -EFAULT;
+        guest_handle_add_offset(uop, 1);
+    }
+
+    return 0;
+}
+
 static void
 __gnttab_unmap_and_replace(
     struct gnttab_unmap_and_replace *op,
@@ -1168,7 +1517,9 @@ gnttab_unmap_and_replace(
         gnttab_flush_tlb(current->domain);
         
         for ( i = 0; i < partial_done; i++ )
-            __gnttab_unmap_common_complete(&(common[i]));
+            __gnttab_unmap_common_complete(current->domain, &(common[i]));
+
+        gnttab_flush_deferred(current->domain);
 
         count -= c;
         done += c;
@@ -1183,7 +1534,7 @@ fault:
     gnttab_flush_tlb(current->domain);
 
     for ( i = 0; i < partial_done; i++ )
-        __gnttab_unmap_common_complete(&(common[i]));
+        __gnttab_unmap_common_complete(current->domain, &(common[i]));
     return -EFAULT;    
 }
 
@@ -1240,11 +1591,12 @@ gnttab_unpopulate_status_frames(struct domain *d, struct grant_table *gt)
 int
 gnttab_grow_table(struct domain *d, unsigned int req_nr_frames)
 {
-    /* d's grant table lock must be held by the caller */
+    /* d's grant table write lock must be held by the caller */
 
     struct grant_table *gt = d->grant_table;
     unsigned int i;
 
+    ASSERT(rw_is_write_locked(&gt->lock));
     ASSERT(req_nr_frames <= max_nr_grant_frames);
 
     gdprintk(XENLOG_INFO,
@@ -1257,7 +1609,7 @@ gnttab_grow_table(struct domain *d, unsigned int req_nr_frames)
     {
         if ( (gt->active[i] = alloc_xenheap_page()) == NULL )
             goto active_alloc_failed;
-        clear_page(gt->active[i]);
+        active_entries_init(gt->active[i]);
     }
 
     /* Shared */
@@ -1345,7 +1697,7 @@ gnttab_setup_table(
     }
 
     gt = d->grant_table;
-    spin_lock(&gt->lock);
+    write_lock(&gt->lock);
 
     if ( gt->gt_version == 0 )
         gt->gt_version = 1;
@@ -1373,7 +1725,7 @@ gnttab_setup_table(
     }
 
  out3:
-    spin_unlock(&gt->lock);
+    write_unlock(&gt->lock);
  out2:
     rcu_unlock_domain(d);
  out1:
@@ -1415,13 +1767,13 @@ gnttab_query_size(
         goto query_out_unlock;
     }
 
-    spin_lock(&d->grant_table->lock);
+    read_lock(&d->grant_table->lock);
 
     op.nr_frames     = nr_grant_frames(d->grant_table);
     op.max_nr_frames = max_nr_grant_frames;
     op.status        = GNTST_okay;
 
-    spin_unlock(&d->grant_table->lock);
+    read_unlock(&d->grant_table->lock);
 
  
  query_out_unlock:
@@ -1447,7 +1799,7 @@ gnttab_prepare_for_transfer(
     union grant_combo   scombo, prev_scombo, new_scombo;
     int                 retries = 0;
 
-    spin_lock(&rgt->lock);
+    read_lock(&rgt->lock);
 
     if ( rgt->gt_version == 0 )
     {
@@ -1498,11 +1850,11 @@ gnttab_prepare_for_transfer(
         scombo = prev_scombo;
     }
 
-    spin_unlock(&rgt->lock);
+    read_unlock(&rgt->lock);
     return 1;
 
  fail:
-    spin_unlock(&rgt->lock);
+    read_unlock(&rgt->lock);
     return 0;
 }
 
@@ -1517,6 +1869,7 @@ gnttab_transfer(
     struct gnttab_transfer gop;
     unsigned long mfn;
     unsigned int max_bitsize;
+    struct active_grant_entry *act;
 
     for ( i = 0; i < count; i++ )
     {
@@ -1694,7 +2047,8 @@ gnttab_transfer(
         TRACE_1D(TRC_MEM_PAGE_GRANT_TRANSFER, e->domain_id);
 
         /* Tell the guest about its new page frame. */
-        spin_lock(&e->grant_table->lock);
+        read_lock(&e->grant_table->lock);
+        act = active_entry_acquire(e->grant_table, gop.ref);
 
         if ( e->grant_table->gt_version == 1 )
         {
@@ -1712,7 +2066,8 @@ gnttab_transfer(
         shared_entry_header(e->grant_table, gop.ref)->flags |=
             GTF_transfer_completed;
 
-        spin_unlock(&e->grant_table->lock);
+        active_entry_release(act);
+        read_unlock(&e->grant_table->lock);
 
         rcu_unlock_domain(e);
 
@@ -1750,9 +2105,9 @@ __release_grant_for_copy(
     released_read = 0;
     released_write = 0;
 
-    spin_lock(&rgt->lock);
+    gnttab_read_lock(rgt);
 
-    act = &active_entry(rgt, gref);
+    act = active_entry_acquire(rgt, gref);
     sha = shared_entry_header(rgt, gref);
     r_frame = act->frame;
 
@@ -1791,7 +2146,8 @@ __release_grant_for_copy(
         released_read = 1;
     }
 
-    spin_unlock(&rgt->lock);
+    active_entry_release(act);
+    read_unlock(&rgt->lock);
 
     if ( td != rd )
     {
@@ -1808,7 +2164,7 @@ __release_grant_for_copy(
 
 /* The status for a grant indicates that we're taking more access than
    the pin requires.  Fix up the status to match the pin.  Called
-   under the domain's grant table lock. */
+   under the active entry lock. */
 /* Only safe on transitive grants.  Even then, note that we don't
    attempt to drop any pin on the referent grant. */
 static void __fixup_status_for_copy_pin(const struct active_grant_entry *act,
@@ -1849,17 +2205,17 @@ __acquire_grant_for_copy(
 
     *page = NULL;
 
-    spin_lock(&rgt->lock);
+    gnttab_read_lock(rgt);
 
     if ( rgt->gt_version == 0 )
-        PIN_FAIL(unlock_out, GNTST_general_error,
+        PIN_FAIL(gt_unlock_out, GNTST_general_error,
                  "remote grant table not ready\n");
 
     if ( unlikely(gref >= nr_grant_entries(rgt)) )
-        PIN_FAIL(unlock_out, GNTST_bad_gntref,
+        PIN_FAIL(gt_unlock_out, GNTST_bad_gntref,
                  "Bad grant reference %ld\n", gref);
 
-    act = &active_entry(rgt, gref);
+    act = active_entry_acquire(rgt, gref);
     shah = shared_entry_header(rgt, gref);
     if ( rgt->gt_version == 1 )
     {
@@ -1918,17 +2274,20 @@ __acquire_grant_for_copy(
                 PIN_FAIL(unlock_out_clear, GNTST_general_error,
                          "transitive grant referenced bad domain %d\n",
                          trans_domid);
-            spin_unlock(&rgt->lock);
+            active_entry_release(act);
+            read_unlock(&rgt->lock);
 
             rc = __acquire_grant_for_copy(td, trans_gref, rd->domain_id,
                                           readonly, &grant_frame, page,
                                           &trans_page_off, &trans_length, 0);
 
-            spin_lock(&rgt->lock);
+            gnttab_read_lock(rgt);
+            act = active_entry_acquire(rgt, gref);
             if ( rc != GNTST_okay ) {
                 __fixup_status_for_copy_pin(act, status);
                 rcu_unlock_domain(td);
-                spin_unlock(&rgt->lock);
+                active_entry_release(act);
+                read_unlock(&rgt->lock);
                 return rc;
             }
 
@@ -1940,7 +2299,8 @@ __acquire_grant_for_copy(
             {
                 __fixup_status_for_copy_pin(act, status);
                 rcu_unlock_domain(td);
-                spin_unlock(&rgt->lock);
+                active_entry_release(act);
+                read_unlock(&rgt->lock);
                 put_page(*page);
                 return __acquire_grant_for_copy(rd, gref, ldom, readonly,
                                                 frame, page, page_off, length,
@@ -2008,7 +2368,8 @@ __acquire_grant_for_copy(
     *length = act->length;
     *frame = act->frame;
 
-    spin_unlock(&rgt->lock);
+    active_entry_release(act);
+    read_unlock(&rgt->lock);
     return rc;
  
  unlock_out_clear:
@@ -2020,156 +2381,308 @@ __acquire_grant_for_copy(
         gnttab_clear_flag(_GTF_reading, status);
 
  unlock_out:
-    spin_unlock(&rgt->lock);
+    active_entry_release(act);
+
+ gt_unlock_out:
+    read_unlock(&rgt->lock);
     return rc;
 }
 
-static void
-__gnttab_copy(
-    struct gnttab_copy *op)
-{
-    struct domain *sd = NULL, *dd = NULL;
-    unsigned long s_frame, d_frame;
-    struct page_info *s_pg = NULL, *d_pg = NULL;
-    char *sp, *dp;
-    s16 rc = GNTST_okay;
-    int have_d_grant = 0, have_s_grant = 0;
-    int src_is_gref, dest_is_gref;
+/*
+ * One side of a grant copy. It is kept acquired and mapped from one op
+ * of a batch to the next, so that a run of copies from or to the same
+ * grant or frame, as netback issues them, acquires and maps it once.
+ */
+struct gnttab_copy_buf {
+    /* The op it was claimed for. */
+    domid_t domid;
+    grant_ref_t ref;
+    xen_pfn_t gmfn;
 
-    if ( ((op->source.offset + op->len) > PAGE_SIZE) ||
-         ((op->dest.offset + op->len) > PAGE_SIZE) )
-        PIN_FAIL(error_out, GNTST_bad_copy_arg, "copy beyond page area.\n");
+    struct domain *domain;
+    unsigned long frame;
+    struct page_info *page;
+    void *virt;
+    unsigned int start, len;
+    bool_t read_only;
+    bool_t have_grant;
+    bool_t have_type;
+};
 
-    src_is_gref = op->flags & GNTCOPY_source_gref;
-    dest_is_gref = op->flags & GNTCOPY_dest_gref;
+static int
+gnttab_copy_lock_domain(
+    domid_t domid, unsigned int gref_flag, struct gnttab_copy_buf *buf)
+{
+    int rc = GNTST_okay;
 
-    if ( (op->source.domid != DOMID_SELF && !src_is_gref ) ||
-         (op->dest.domid   != DOMID_SELF && !dest_is_gref)   )
-        PIN_FAIL(error_out, GNTST_permission_denied,
+    if ( domid != DOMID_SELF && !gref_flag )
+        PIN_FAIL(out, GNTST_permission_denied,
                  "only allow copy-by-mfn for DOMID_SELF.\n");
 
-    if ( op->source.domid == DOMID_SELF )
-        sd = rcu_lock_current_domain();
-    else if ( (sd = rcu_lock_domain_by_id(op->source.domid)) == NULL )
-        PIN_FAIL(error_out, GNTST_bad_domain,
-                 "couldn't find %d\n", op->source.domid);
+    if ( domid == DOMID_SELF )
+        buf->domain = rcu_lock_current_domain();
+    else if ( (buf->domain = rcu_lock_domain_by_id(domid)) == NULL )
+        PIN_FAIL(out, GNTST_bad_domain, "couldn't find %d\n", domid);
 
-    if ( op->dest.domid == DOMID_SELF )
-        dd = rcu_lock_current_domain();
-    else if ( (dd = rcu_lock_domain_by_id(op->dest.domid)) == NULL )
-        PIN_FAIL(error_out, GNTST_bad_domain,
-                 "couldn't find %d\n", op->dest.domid);
+    buf->domid = domid;
+ out:
+    return rc;
+}
 
-    rc = xsm_grant_copy(XSM_HOOK, sd, dd);
-    if ( rc )
+static void
+gnttab_copy_unlock_domains(
+    struct gnttab_copy_buf *src, struct gnttab_copy_buf *dest)
+{
+    if ( src->domain )
+    {
+        rcu_unlock_domain(src->domain);
+        src->domain = NULL;
+    }
+    if ( dest->domain )
+    {
+        rcu_unlock_domain(dest->domain);
+        dest->domain = NULL;
+    }
+}
+
+static int
+gnttab_copy_lock_domains(
+    const struct gnttab_copy *op,
+    struct gnttab_copy_buf *src, struct gnttab_copy_buf *dest)
+{
+    int rc;
+
+    rc = gnttab_copy_lock_domain(op->source.domid,
+                                 op->flags & GNTCOPY_source_gref, src);
+    if ( rc != GNTST_okay )
+        goto error;
+    rc = gnttab_copy_lock_domain(op->dest.domid,
+                                 op->flags & GNTCOPY_dest_gref, dest);
+    if ( rc != GNTST_okay )
+        goto error;
+
+    if ( xsm_grant_copy(XSM_HOOK, src->domain, dest->domain) )
     {
         rc = GNTST_permission_denied;
-        goto error_out;
+        goto error;
     }
+    return GNTST_okay;
+
+ error:
+    gnttab_copy_unlock_domains(src, dest);
+    return rc;
+}
 
-    if ( src_is_gref )
+static void
+gnttab_copy_release_buf(struct gnttab_copy_buf *buf)
+{
+    if ( buf->virt )
     {
-        unsigned source_off, source_len;
-        rc = __acquire_grant_for_copy(sd, op->source.u.ref,
-                                      current->domain->domain_id, 1,
-                                      &s_frame, &s_pg,
-                                      &source_off, &source_len, 1);
-        if ( rc != GNTST_okay )
-            goto error_out;
-        have_s_grant = 1;
-        if ( op->source.offset < source_off ||
-             op->len > source_len )
-            PIN_FAIL(error_out, GNTST_general_error,
-                     "copy source out of bounds: %d < %d || %d > %d\n",
-                     op->source.offset, source_off,
-                     op->len, source_len);
+        unmap_domain_page(buf->virt);
+        buf->virt = NULL;
     }
-    else
+    if ( buf->have_type )
     {
-        rc = __get_paged_frame(op->source.u.gmfn, &s_frame, &s_pg, 1, sd);
-        if ( rc != GNTST_okay )
-            PIN_FAIL(error_out, rc,
-                     "source frame %lx invalid.\n", s_frame);
+        put_page_type(buf->page);
+        buf->have_type = 0;
     }
+    if ( buf->page )
+    {
+        put_page(buf->page);
+        buf->page = NULL;
+    }
+    if ( buf->have_grant )
+    {
+        __release_grant_for_copy(buf->domain, buf->ref, buf->read_only);
+        buf->have_grant = 0;
+    }
+}
 
-    if ( dest_is_gref )
+static int
+gnttab_copy_claim_buf(
+    const struct gnttab_copy *op, grant_ref_t ref, xen_pfn_t gmfn,
+    struct gnttab_copy_buf *buf, unsigned int gref_flag)
+{
+    int rc;
+
+    buf->read_only = (gref_flag == GNTCOPY_source_gref);
+
+    if ( op->flags & gref_flag )
     {
-        unsigned dest_off, dest_len;
-        rc = __acquire_grant_for_copy(dd, op->dest.u.ref,
-                                      current->domain->domain_id, 0,
-                                      &d_frame, &d_pg, &dest_off, &dest_len, 1);
+        rc = __acquire_grant_for_copy(buf->domain, ref,
+                                      current->domain->domain_id,
+                                      buf->read_only,
+                                      &buf->frame, &buf->page,
+                                      &buf->start, &buf->len, 1);
         if ( rc != GNTST_okay )
-            goto error_out;
-        have_d_grant = 1;
-        if ( op->dest.offset < dest_off ||
-             op->len > dest_len )
-            PIN_FAIL(error_out, GNTST_general_error,
-                     "copy dest out of bounds: %d < %d || %d > %d\n",
-                     op->dest.offset, dest_off,
-                     op->len, dest_len);
+            goto out;
+        buf->ref = ref;
+        buf->have_grant = 1;
     }
     else
     {
-        rc = __get_paged_frame(op->dest.u.gmfn, &d_frame, &d_pg, 0, dd);
+        rc = __get_paged_frame(gmfn, &buf->frame, &buf->page,
+                               buf->read_only, buf->domain);
         if ( rc != GNTST_okay )
-            PIN_FAIL(error_out, rc,
-                     "destination frame %lx invalid.\n", d_frame);
+            PIN_FAIL(out, rc, "%s frame %lx invalid.\n",
+                     buf->read_only ? "source" : "destination", gmfn);
+        buf->gmfn = gmfn;
+        buf->start = 0;
+        buf->len = PAGE_SIZE;
     }
 
-    if ( !get_page_type(d_pg, PGT_writable_page) )
+    if ( !buf->read_only )
     {
-        if ( !dd->is_dying )
-            gdprintk(XENLOG_WARNING, "Could not get dst frame %lx\n", d_frame);
-        rc = GNTST_general_error;
-        goto error_out;
+        if ( !get_page_type(buf->page, PGT_writable_page) )
+        {
+            if ( !buf->domain->is_dying )
+                gdprintk(XENLOG_WARNING, "Could not get dst frame %lx\n",
+                         buf->frame);
+            rc = GNTST_general_error;
+            goto out;
+        }
+        buf->have_type = 1;
     }
 
-    sp = map_domain_page(s_frame);
-    dp = map_domain_page(d_frame);
+    buf->virt = map_domain_page(buf->frame);
+    rc = GNTST_okay;
 
-    memcpy(dp + op->dest.offset, sp + op->source.offset, op->len);
+ out:
+    return rc;
+}
 
-    unmap_domain_page(dp);
-    unmap_domain_page(sp);
+static bool_t
+gnttab_copy_buf_valid(
+    const struct gnttab_copy_buf *buf, grant_ref_t ref, xen_pfn_t gmfn,
+    bool_t is_gref)
+{
+    if ( !buf->virt )
+        return 0;
+    if ( is_gref )
+        return buf->have_grant && (buf->ref == ref);
+    return !buf->have_grant && (buf->gmfn == gmfn);
+}
 
-    gnttab_mark_dirty(dd, d_frame);
+static int
+gnttab_copy_buf(
+    const struct gnttab_copy *op,
+    struct gnttab_copy_buf *dest, const struct gnttab_copy_buf *src)
+{
+    int rc = GNTST_okay;
 
-    put_page_type(d_pg);
- error_out:
-    if ( d_pg )
-        put_page(d_pg);
-    if ( s_pg )
-        put_page(s_pg);
-    if ( have_s_grant )
-        __release_grant_for_copy(sd, op->source.u.ref, 1);
-    if ( have_d_grant )
-        __release_grant_for_copy(dd, op->dest.u.ref, 0);
-    if ( sd )
-        rcu_unlock_domain(sd);
-    if ( dd )
-        rcu_unlock_domain(dd);
-    op->status = rc;
+    if ( (op->source.offset < src->start) ||
+         ((op->source.offset + op->len) > (src->start + src->len)) )
+        PIN_FAIL(out, GNTST_general_error,
+                 "copy source out of bounds: %d < %d || %d > %d\n",
+                 op->source.offset, src->start, op->len, src->len);
+
+    if ( (op->dest.offset < dest->start) ||
+         ((op->dest.offset + op->len) > (dest->start + dest->len)) )
+        PIN_FAIL(out, GNTST_general_error,
+                 "copy dest out of bounds: %d < %d || %d > %d\n",
+                 op->dest.offset, dest->start, op->len, dest->len);
+
+    memcpy((char *)dest->virt + op->dest.offset,
+           (char *)src->virt + op->source.offset, op->len);
+    gnttab_mark_dirty(dest->domain, dest->frame);
+    current->gnttab_stats.copy_bytes += op->len;
+ out:
+    return rc;
+}
+
+static int
+__gnttab_copy(
+    const struct gnttab_copy *op,
+    struct gnttab_copy_buf *src, struct gnttab_copy_buf *dest)
+{
+    int rc;
+
+    current->gnttab_stats.copy_ops++;
+
+    if ( ((op->source.offset + op->len) > PAGE_SIZE) ||
+         ((op->dest.offset + op->len) > PAGE_SIZE) )
+        PIN_FAIL(out, GNTST_bad_copy_arg, "copy beyond page area.\n");
+
+    if ( !src->domain || (op->source.domid != src->domid) ||
+         !dest->domain || (op->dest.domid != dest->domid) )
+    {
+        gnttab_copy_release_buf(src);
+        gnttab_copy_release_buf(dest);
+        gnttab_copy_unlock_domains(src, dest);
+
+        rc = gnttab_copy_lock_domains(op, src, dest);
+        if ( rc != GNTST_okay )
+            goto out;
+    }
+
+    if ( !gnttab_copy_buf_valid(src, op->source.u.ref, op->source.u.gmfn,
+                                !!(op->flags & GNTCOPY_source_gref)) )
+    {
+        gnttab_copy_release_buf(src);
+        rc = gnttab_copy_claim_buf(op, op->source.u.ref, op->source.u.gmfn,
+                                   src, GNTCOPY_source_gref);
+        if ( rc != GNTST_okay )
+            goto out;
+    }
+
+    if ( !gnttab_copy_buf_valid(dest, op->dest.u.ref, op->dest.u.gmfn,
+                                !!(op->flags & GNTCOPY_dest_gref)) )
+    {
+        gnttab_copy_release_buf(dest);
+        rc = gnttab_copy_claim_buf(op, op->dest.u.ref, op->dest.u.gmfn,
+                                   dest, GNTCOPY_dest_gref);
+        if ( rc != GNTST_okay )
+            goto out;
+    }
+
+    rc = gnttab_copy_buf(op, dest, src);
+ out:
+    return rc;
 }
 
 static long
 gnttab_copy(
     XEN_GUEST_HANDLE_PARAM(gnttab_copy_t) uop, unsigned int count)
 {
-    int i;
+    unsigned int i;
     struct gnttab_copy op;
+    struct gnttab_copy_buf src = {}, dest = {};
+    long rc = 0;
 
     for ( i = 0; i < count; i++ )
     {
-        if (i && hypercall_preempt_check())
-            return i;
+        if ( i && hypercall_preempt_check() )
+        {
+            rc = i;
+            break;
+        }
         if ( unlikely(__copy_from_guest(&op, uop, 1)) )
-            return -EFAULT;
-        __gnttab_copy(&op);
+        {
+            rc = -EFAULT;
+            break;
+        }
+
+        op.status = __gnttab_copy(&op, &src, &dest);
+        /* Don't keep anything a failed op may have left half claimed. */
+        if ( op.status != GNTST_okay )
+        {
+            gnttab_copy_release_buf(&src);
+            gnttab_copy_release_buf(&dest);
+        }
+
         if ( unlikely(__copy_field_to_guest(uop, &op, status)) )
-            return -EFAULT;
+        {
+            rc = -EFAULT;
+            break;
+        }
         guest_handle_add_offset(uop, 1);
     }
-    return 0;
+
+    gnttab_copy_release_buf(&src);
+    gnttab_copy_release_buf(&dest);
+    gnttab_copy_unlock_domains(&src, &dest);
+
+    return rc;
 }
 
 static long
@@ -2194,7 +2707,7 @@ gnttab_set_version(XEN_GUEST_HANDLE_PARAM(gnttab_set_version_t) uop)
     if ( gt->gt_version == op.version )
         goto out;
 
-    spin_lock(&gt->lock);
+    write_lock(&gt->lock);
     /* Make sure that the grant table isn't currently in use when we
        change the version number, except for the first 8 entries which
        are allowed to be in use (xenstore/xenconsole keeps them mapped).
@@ -2203,7 +2716,8 @@ gnttab_set_version(XEN_GUEST_HANDLE_PARAM(gnttab_set_version_t) uop)
     {
         for ( i = GNTTAB_NR_RESERVED_ENTRIES; i < nr_grant_entries(gt); i++ )
         {
-            act = &active_entry(gt, i);
+            /* nobody holds an active entry lock with the write lock held */
+            act = &_active_entry(gt, i);
             if ( act->pin != 0 )
             {
                 gdprintk(XENLOG_WARNING,
@@ -2280,7 +2794,7 @@ gnttab_set_version(XEN_GUEST_HANDLE_PARAM(gnttab_set_version_t) uop)
     gt->gt_version = op.version;
 
 out_unlock:
-    spin_unlock(&gt->lock);
+    write_unlock(&gt->lock);
 
 out:
     op.version = gt->gt_version;
@@ -2326,18 +2840,18 @@ gnttab_get_status_frames(XEN_GUEST_HANDLE_PARAM(gnttab_get_status_frames_t) uop,
 
     gt = d->grant_table;
 
+    read_lock(&gt->lock);
+
     if ( unlikely(op.nr_frames > nr_status_frames(gt)) ) {
         gdprintk(XENLOG_INFO, "Guest requested addresses for %d grant status "
                  "frames, but only %d are available.\n",
                  op.nr_frames, nr_status_frames(gt));
         op.status = GNTST_general_error;
-        goto out2;
+        goto unlock;
     }
 
     op.status = GNTST_okay;
 
-    spin_lock(&gt->lock);
-
     for ( i = 0; i < op.nr_frames; i++ )
     {
         gmfn = gnttab_status_gmfn(d, gt, i);
@@ -2345,7 +2859,8 @@ gnttab_get_status_frames(XEN_GUEST_HANDLE_PARAM(gnttab_get_status_frames_t) uop,
             op.status = GNTST_bad_virt_addr;
     }
 
-    spin_unlock(&gt->lock);
+unlock:
+    read_unlock(&gt->lock);
 out2:
     rcu_unlock_domain(d);
 out1:
@@ -2394,7 +2909,8 @@ __gnttab_swap_grant_ref(grant_ref_t ref_a, grant_ref_t ref_b)
     struct active_grant_entry *act;
     s16 rc = GNTST_okay;
 
-    spin_lock(&gt->lock);
+    /* rare enough not to bother with the active entry locks */
+    write_lock(&gt->lock);
 
     /* Bounds check on the grant refs */
     if ( unlikely(ref_a >= nr_grant_entries(d->grant_table)))
@@ -2402,11 +2918,11 @@ __gnttab_swap_grant_ref(grant_ref_t ref_a, grant_ref_t ref_b)
     if ( unlikely(ref_b >= nr_grant_entries(d->grant_table)))
         PIN_FAIL(out, GNTST_bad_gntref, "Bad ref-b (%d).\n", ref_b);
 
-    act = &active_entry(gt, ref_a);
+    act = &_active_entry(gt, ref_a);
     if ( act->pin )
         PIN_FAIL(out, GNTST_eagain, "ref a %ld busy\n", (long)ref_a);
 
-    act = &active_entry(gt, ref_b);
+    act = &_active_entry(gt, ref_b);
     if ( act->pin )
         PIN_FAIL(out, GNTST_eagain, "ref b %ld busy\n", (long)ref_b);
 
@@ -2434,13 +2950,49 @@ __gnttab_swap_grant_ref(grant_ref_t ref_a, grant_ref_t ref_b)
     }
 
 out:
-    spin_unlock(&gt->lock);
+    write_unlock(&gt->lock);
 
     rcu_unlock_domain(d);
 
     return rc;
 }
 
+/*
+ * Check that grant ref of d currently permits domid to access a frame,
+ * and to write to it unless readonly. This is only a snapshot: d can
+ * revoke or change the grant at any time afterwards.
+ */
+int
+gnttab_check_grant(struct domain *d, grant_ref_t ref, domid_t domid,
+                   int readonly)
+{
+    struct grant_table *gt = d->grant_table;
+    grant_entry_header_t *sha;
+    uint16_t flags;
+    int rc = -EINVAL;
+
+    read_lock(&gt->lock);
+
+    if ( unlikely(gt->gt_version == 0) ||
+         unlikely(ref >= nr_grant_entries(gt)) )
+        goto out;
+
+    sha = shared_entry_header(gt, ref);
+    flags = read_atomic(&sha->flags);
+
+    rc = -EPERM;
+    if ( ((flags & GTF_type_mask) != GTF_permit_access) ||
+         (read_atomic(&sha->domid) != domid) ||
+         (!readonly && (flags & GTF_readonly)) )
+        goto out;
+
+    rc = 0;
+
+ out:
+    read_unlock(&gt->lock);
+    return rc;
+}
+
 static long
 gnttab_swap_grant_ref(XEN_GUEST_HANDLE_PARAM(gnttab_swap_grant_ref_t) uop,
                       unsigned int count)
@@ -2502,6 +3054,20 @@ do_grant_table_op(
         }
         break;
     }
+    case GNTTABOP_unmap_deferred:
+    {
+        XEN_GUEST_HANDLE_PARAM(gnttab_unmap_grant_ref_t) unmap =
+            guest_handle_cast(uop, gnttab_unmap_grant_ref_t);
+        if ( unlikely(!guest_handle_okay(unmap, count)) )
+            goto out;
+        rc = gnttab_unmap_deferred(unmap, count);
+        if ( rc > 0 )
+        {
+            guest_handle_add_offset(unmap, rc);
+            uop = guest_handle_cast(unmap, void);
+        }
+        break;
+    }
     case GNTTABOP_unmap_and_replace:
     {
         XEN_GUEST_HANDLE_PARAM(gnttab_unmap_and_replace_t) unmap =
@@ -2622,7 +3188,9 @@ grant_table_create(
         goto no_mem_0;
 
     /* Simple stuff. */
-    spin_lock_init(&t->lock);
+    rwlock_init(&t->lock);
+    spin_lock_init(&t->maptrack_lock);
+    spin_lock_init(&t->deferred_lock);
     t->nr_grant_frames = INITIAL_NR_GRANT_FRAMES;
 
     /* Active grant table. */
@@ -2634,20 +3202,16 @@ grant_table_create(
     {
         if ( (t->active[i] = alloc_xenheap_page()) == NULL )
             goto no_mem_2;
-        clear_page(t->active[i]);
+        active_entries_init(t->active[i]);
     }
 
-    /* Tracking of mapped foreign frames table */
+    /*
+     * Tracking of mapped foreign frames table, frames are added on
+     * demand by each vcpu, see get_maptrack_handle().
+     */
     if ( (t->maptrack = xzalloc_array(struct grant_mapping *,
                                       max_nr_maptrack_frames())) == NULL )
         goto no_mem_2;
-    if ( (t->maptrack[0] = alloc_xenheap_page()) == NULL )
-        goto no_mem_3;
-    clear_page(t->maptrack[0]);
-    t->maptrack_limit = MAPTRACK_PER_PAGE;
-    for ( i = 1; i < MAPTRACK_PER_PAGE; i++ )
-        t->maptrack[0][i - 1].ref = i;
-    t->maptrack[0][i - 1].ref = MAPTRACK_TAIL;
 
     /* Shared grant table. */
     if ( (t->shared_raw = xzalloc_array(void *, max_nr_grant_frames)) == NULL )
@@ -2670,6 +3234,9 @@ grant_table_create(
 
     t->nr_status_frames = 0;
 
+    init_timer(&t->deferred_timer, gnttab_deferred_timer_fn, d,
+               smp_processor_id());
+
     /* Okay, install the structure. */
     d->grant_table = t;
     return 0;
@@ -2679,7 +3246,6 @@ grant_table_create(
         free_xenheap_page(t->shared_raw[i]);
     xfree(t->shared_raw);
  no_mem_3:
-    free_xenheap_page(t->maptrack[0]);
     xfree(t->maptrack);
  no_mem_2:
     for ( i = 0;
@@ -2708,6 +3274,9 @@ gnttab_release_mappings(
 
     BUG_ON(!d->is_dying);
 
+    kill_timer(&gt->deferred_timer);
+    gnttab_flush_deferred(d);
+
     for ( handle = 0; handle < gt->maptrack_limit; handle++ )
     {
         map = &maptrack_entry(gt, handle);
@@ -2729,9 +3298,9 @@ gnttab_release_mappings(
         }
 
         rgt = rd->grant_table;
-        spin_lock(&rgt->lock);
+        read_lock(&rgt->lock);
 
-        act = &active_entry(rgt, ref);
+        act = active_entry_acquire(rgt, ref);
         sha = shared_entry_header(rgt, ref);
         if (rgt->gt_version == 1)
             status = &sha->flags;
@@ -2789,7 +3358,8 @@ gnttab_release_mappings(
         if ( act->pin == 0 )
             gnttab_clear_flag(_GTF_reading, status);
 
-        spin_unlock(&rgt->lock);
+        active_entry_release(act);
+        read_unlock(&rgt->lock);
 
         rcu_unlock_domain(rd);
 
@@ -2807,7 +3377,10 @@ grant_table_destroy(
 
     if ( t == NULL )
         return;
-    
+
+    kill_timer(&t->deferred_timer);
+    xfree(t->deferred);
+
     for ( i = 0; i < nr_grant_frames(t); i++ )
         free_xenheap_page(t->shared_raw[i]);
     xfree(t->shared_raw);
@@ -2828,6 +3401,56 @@ grant_table_destroy(
     d->grant_table = NULL;
 }
 
+void grant_table_init_vcpu(struct vcpu *v)
+{
+    v->maptrack_head = MAPTRACK_TAIL;
+    v->maptrack_tail = MAPTRACK_TAIL;
+}
+
+/*
+ * The vcpus' counters are read while they may be updated, a sysctl can
+ * live with a torn read.
+ */
+int gnttab_domstats(struct domain *d, struct xen_sysctl_gnttab_domstats *st)
+{
+    struct grant_table *gt = d->grant_table;
+    struct vcpu *v;
+    unsigned int handle, limit;
+
+    if ( !gt )
+        return -ENODEV;
+
+    read_lock(&gt->lock);
+    st->nr_grant_frames = nr_grant_frames(gt);
+    read_unlock(&gt->lock);
+    st->max_grant_frames = max_nr_grant_frames;
+
+    /* The frames are there before the limit says so. */
+    limit = read_atomic(&gt->maptrack_limit);
+    smp_rmb();
+    st->maptrack_frames = limit / MAPTRACK_PER_PAGE;
+    st->max_maptrack_frames = max_nr_maptrack_frames();
+    st->maptrack_in_use = 0;
+    for ( handle = 0; handle < limit; handle++ )
+        if ( read_atomic(&maptrack_entry(gt, handle).flags) )
+            st->maptrack_in_use++;
+
+    st->map_ops = st->unmap_ops = st->copy_ops = st->copy_bytes = 0;
+    st->lock_contended = st->lock_wait_ns = st->maptrack_steals = 0;
+    for_each_vcpu ( d, v )
+    {
+        st->map_ops += v->gnttab_stats.map_ops;
+        st->unmap_ops += v->gnttab_stats.unmap_ops;
+        st->copy_ops += v->gnttab_stats.copy_ops;
+        st->copy_bytes += v->gnttab_stats.copy_bytes;
+        st->lock_contended += v->gnttab_stats.lock_contended;
+        st->lock_wait_ns += v->gnttab_stats.lock_wait_ns;
+        st->maptrack_steals += v->gnttab_stats.maptrack_steals;
+    }
+
+    return 0;
+}
+
 static void gnttab_usage_print(struct domain *rd)
 {
     int first = 1;
@@ -2837,7 +3460,7 @@ static void gnttab_usage_print(struct domain *rd)
     printk("      -------- active --------       -------- shared --------\n");
     printk("[ref] localdom mfn      pin          localdom gmfn     flags\n");
 
-    spin_lock(&gt->lock);
+    read_lock(&gt->lock);
 
     if ( gt->gt_version == 0 )
         goto out;
@@ -2851,9 +3474,12 @@ static void gnttab_usage_print(struct domain *rd)
         uint16_t status;
         uint64_t frame;
 
-        act = &active_entry(gt, ref);
+        act = active_entry_acquire(gt, ref);
         if ( !act->pin )
+        {
+            active_entry_release(act);
             continue;
+        }
 
         sha = shared_entry_header(gt, ref);
 
@@ -2883,10 +3509,11 @@ static void gnttab_usage_print(struct domain *rd)
         printk("[%3d]    %5d 0x%06lx 0x%08x      %5d 0x%06"PRIx64" 0x%02x\n",
                ref, act->domid, act->frame, act->pin,
                sha->domid, frame, status);
+        active_entry_release(act);
     }
 
  out:
-    spin_unlock(&gt->lock);
+    read_unlock(&gt->lock);
 
     if ( first )
         printk("grant-table for remote domain:%5d ... "
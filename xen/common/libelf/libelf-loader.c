@@ -185,7 +185,7 @@ void elf_parse_bsdsyms(struct elf_binary *elf, uint64_t pstart)
     elf->bsd_symtab_pend   = pstart + sz;
 }
 
-static void elf_load_bsdsyms(struct elf_binary *elf)
+void elf_load_bsdsyms(struct elf_binary *elf)
 {
     ELF_HANDLE_DECL(elf_ehdr) sym_ehdr;
     unsigned long sz;
@@ -293,52 +293,73 @@ void elf_parse_binary(struct elf_binary *elf)
             __FUNCTION__, elf->pstart, elf->pend);
 }
 
-elf_errorstatus elf_load_binary(struct elf_binary *elf)
+void elf_load_start(struct elf_binary *elf, struct elf_load_cursor *cur)
 {
-    ELF_HANDLE_DECL(elf_phdr) phdr;
-    uint64_t i, count, paddr, offset, filesz, memsz;
-    elf_ptrval dest;
+    cur->index = 0;
     /*
      * Let bizarre ELFs write the output image up to twice; this
      * calculation is just to ensure our copying loop is no worse than
      * O(domain_size).
      */
-    uint64_t remain_allow_copy = (uint64_t)elf->dest_size * 2;
+    cur->remain_allow_copy = (uint64_t)elf->dest_size * 2;
+}
+
+bool elf_load_next(struct elf_binary *elf, struct elf_load_cursor *cur,
+                   struct elf_segment *seg)
+{
+    ELF_HANDLE_DECL(elf_phdr) phdr;
+    uint64_t count, offset;
 
     count = elf_uval(elf, elf->ehdr, e_phnum);
-    for ( i = 0; i < count; i++ )
+    for ( ; cur->index < count; cur->index++ )
     {
-        phdr = elf_phdr_by_index(elf, i);
+        phdr = elf_phdr_by_index(elf, cur->index);
         if ( !elf_access_ok(elf, ELF_HANDLE_PTRVAL(phdr), 1) )
             /* input has an insane program header count field */
             break;
         if ( !elf_phdr_is_loadable(elf, phdr) )
             continue;
-        paddr = elf_uval(elf, phdr, p_paddr);
         offset = elf_uval(elf, phdr, p_offset);
-        filesz = elf_uval(elf, phdr, p_filesz);
-        memsz = elf_uval(elf, phdr, p_memsz);
-        dest = elf_get_ptr(elf, paddr);
+        seg->filesz = elf_uval(elf, phdr, p_filesz);
+        seg->memsz = elf_uval(elf, phdr, p_memsz);
+        seg->dest = elf_get_ptr(elf, elf_uval(elf, phdr, p_paddr));
+        seg->src = ELF_IMAGE_BASE(elf) + offset;
 
         /*
          * We need to check that the input image doesn't have us copy
          * the whole image zillions of times, as that could lead to
          * O(n^2) time behaviour and possible DoS by a malicous ELF.
          */
-        if ( remain_allow_copy < memsz )
+        if ( cur->remain_allow_copy < seg->memsz )
         {
             elf_mark_broken(elf, "program segments total to more"
                             " than the input image size");
             break;
         }
-        remain_allow_copy -= memsz;
+        cur->remain_allow_copy -= seg->memsz;
 
         elf_msg(elf, "%s: phdr %" PRIu64 " at 0x%"ELF_PRPTRVAL" -> 0x%"ELF_PRPTRVAL"\n",
-                __func__, i, dest, (elf_ptrval)(dest + filesz));
-        if ( elf_load_image(elf, dest, ELF_IMAGE_BASE(elf) + offset, filesz, memsz) != 0 )
-            return -1;
+                __func__, cur->index, seg->dest,
+                (elf_ptrval)(seg->dest + seg->filesz));
+        cur->index++;
+        return 1;
     }
 
+    cur->index = count;
+    return 0;
+}
+
+elf_errorstatus elf_load_binary(struct elf_binary *elf)
+{
+    struct elf_load_cursor cur;
+    struct elf_segment seg;
+
+    elf_load_start(elf, &cur);
+    while ( elf_load_next(elf, &cur, &seg) )
+        if ( elf_load_image(elf, seg.dest, seg.src,
+                            seg.filesz, seg.memsz) != 0 )
+            return -1;
+
     elf_load_bsdsyms(elf);
     return 0;
 }
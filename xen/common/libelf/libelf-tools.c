@@ -31,8 +31,8 @@ const char *elf_check_broken(const struct elf_binary *elf)
     return elf->broken;
 }
 
-static bool elf_ptrval_in_range(elf_ptrval ptrval, uint64_t size,
-                               const void *region, uint64_t regionsize)
+bool elf_ptrval_in_range(elf_ptrval ptrval, uint64_t size,
+                        const void *region, uint64_t regionsize)
     /*
      * Returns true if the putative memory area [ptrval,ptrval+size>
      * is completely inside the region [region,region+regionsize>.
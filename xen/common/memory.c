@@ -178,6 +178,60 @@ out:
     a->nr_done = i;
 }
 
+/*
+ * XENMEM_populate_physmap_range: orders tried for an extent, largest
+ * first.  An order failing to allocate caps the rest of the range.
+ */
+#define POPULATE_SUPERPAGE_ORDER 9 /* 2MB */
+
+static unsigned int populate_next_order(unsigned int order)
+{
+    return (order > POPULATE_SUPERPAGE_ORDER) ? POPULATE_SUPERPAGE_ORDER : 0;
+}
+
+static int populate_physmap_range(struct domain *d,
+                                  struct xen_populate_physmap_range *r,
+                                  unsigned int memflags)
+{
+    struct page_info *page;
+    unsigned long left, mfn;
+    xen_pfn_t gfn;
+    unsigned int order, done = 0;
+
+    while ( (left = r->nr_pages - r->nr_done) != 0 )
+    {
+        if ( done++ && hypercall_preempt_check() )
+            return -ERESTART;
+
+        gfn = r->first_gfn + r->nr_done;
+
+        /* The largest extent the alignment of gfn and the range allow. */
+        for ( order = r->max_order;
+              order && ((gfn & ((1UL << order) - 1)) || (left >> order) == 0);
+              order = populate_next_order(order) )
+            continue;
+
+        while ( (page = alloc_domheap_pages(d, order, memflags)) == NULL )
+        {
+            if ( order == 0 )
+            {
+                gdprintk(XENLOG_INFO, "Could not populate gfn %#"PRI_xen_pfn
+                         ": id=%d memflags=%x\n", gfn, d->domain_id, memflags);
+                return -ENOMEM;
+            }
+            order = populate_next_order(order);
+            r->max_order = order;
+        }
+
+        mfn = page_to_mfn(page);
+        guest_physmap_add_page(d, gfn, mfn, order);
+
+        r->nr_done += 1UL << order;
+    }
+
+    return 0;
+}
+
 int guest_remove_page(struct domain *d, unsigned long gmfn)
 {
     struct page_info *page;
@@ -695,6 +749,72 @@ out:
     return rc;
 }
 
+/*
+ * The arrays are copied out of the lock: the topology may be replaced
+ * meanwhile, the guest gets one or the other.
+ */
+static int get_vnumainfo(struct domain *d, struct xen_vnuma_topology_info *topo)
+{
+    struct vnuma_info tmp = { 0 };
+    unsigned int nr_vcpus = d->max_vcpus;
+    int rc = 0;
+
+    read_lock(&d->vnuma_rwlock);
+
+    if ( !d->vnuma )
+    {
+        read_unlock(&d->vnuma_rwlock);
+        return -EOPNOTSUPP;
+    }
+
+    if ( topo->nr_vnodes < d->vnuma->nr_vnodes ||
+         topo->nr_vcpus < nr_vcpus ||
+         topo->nr_vmemranges < d->vnuma->nr_vmemranges )
+        rc = -ENOBUFS;
+    else
+    {
+        tmp.nr_vnodes = d->vnuma->nr_vnodes;
+        tmp.nr_vmemranges = d->vnuma->nr_vmemranges;
+        tmp.vdistance = xmalloc_array(unsigned int,
+                                      tmp.nr_vnodes * tmp.nr_vnodes);
+        tmp.vcpu_to_vnode = xmalloc_array(unsigned int, nr_vcpus);
+        tmp.vmemrange = xmalloc_array(struct xen_vmemrange,
+                                      tmp.nr_vmemranges);
+        if ( !tmp.vdistance || !tmp.vcpu_to_vnode || !tmp.vmemrange )
+            rc = -ENOMEM;
+        else
+        {
+            memcpy(tmp.vdistance, d->vnuma->vdistance,
+                   tmp.nr_vnodes * tmp.nr_vnodes * sizeof(*tmp.vdistance));
+            memcpy(tmp.vcpu_to_vnode, d->vnuma->vcpu_to_vnode,
+                   nr_vcpus * sizeof(*tmp.vcpu_to_vnode));
+            memcpy(tmp.vmemrange, d->vnuma->vmemrange,
+                   tmp.nr_vmemranges * sizeof(*tmp.vmemrange));
+        }
+    }
+
+    topo->nr_vnodes = d->vnuma->nr_vnodes;
+    topo->nr_vcpus = nr_vcpus;
+    topo->nr_vmemranges = d->vnuma->nr_vmemranges;
+
+    read_unlock(&d->vnuma_rwlock);
+
+    if ( !rc &&
+         (copy_to_guest(topo->vdistance.h, tmp.vdistance,
+                        tmp.nr_vnodes * tmp.nr_vnodes) ||
+          copy_to_guest(topo->vcpu_to_vnode.h, tmp.vcpu_to_vnode,
+                        nr_vcpus) ||
+          copy_to_guest(topo->vmemrange.h, tmp.vmemrange,
+                        tmp.nr_vmemranges)) )
+        rc = -EFAULT;
+
+    xfree(tmp.vdistance);
+    xfree(tmp.vcpu_to_vnode);
+    xfree(tmp.vmemrange);
+
+    return rc;
+}
+
 long do_memory_op(unsigned long cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
 {
     struct domain *d;
@@ -943,6 +1063,70 @@ long do_memory_op(unsigned long cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
         break;
     }
 
+    case XENMEM_populate_physmap_range:
+    {
+        struct xen_populate_physmap_range r;
+
+        if ( start_extent )
+            return -ENOSYS;
+
+        if ( copy_from_guest(&r, arg, 1) )
+            return -EFAULT;
+
+        if ( (r.mem_flags & XENMEMF_populate_on_demand) ||
+             (r.nr_done > r.nr_pages) || (r.max_order > MAX_ORDER) ||
+             (r.first_gfn + r.nr_pages < r.first_gfn) )
+            return -EINVAL;
+
+        address_bits = XENMEMF_get_address_bits(r.mem_flags);
+        args.memflags = 0;
+        if ( (address_bits != 0) &&
+             (address_bits < (get_order_from_pages(max_page) + PAGE_SHIFT)) )
+        {
+            if ( address_bits <= PAGE_SHIFT )
+                return -EINVAL;
+            args.memflags = MEMF_bits(address_bits);
+        }
+
+        args.memflags |= MEMF_node(XENMEMF_get_node(r.mem_flags));
+        if ( r.mem_flags & XENMEMF_exact_node_request )
+            args.memflags |= MEMF_exact_node;
+
+        d = rcu_lock_domain_by_any_id(r.domid);
+        if ( d == NULL )
+            return -ESRCH;
+
+        rc = xsm_memory_adjust_reservation(XSM_TARGET, current->domain, d);
+        if ( rc )
+        {
+            rcu_unlock_domain(d);
+            return rc;
+        }
+
+        if ( !paging_mode_translate(d) || is_domain_direct_mapped(d) )
+        {
+            rcu_unlock_domain(d);
+            return -EOPNOTSUPP;
+        }
+
+        while ( r.max_order &&
+                !multipage_allocation_permitted(current->domain, r.max_order) )
+            r.max_order = populate_next_order(r.max_order);
+
+        rc = populate_physmap_range(d, &r, args.memflags);
+
+        rcu_unlock_domain(d);
+
+        if ( __copy_to_guest(arg, &r, 1) )
+            return -EFAULT;
+
+        if ( rc == -ERESTART )
+            rc = hypercall_create_continuation(
+                    __HYPERVISOR_memory_op, "lh", op, arg);
+
+        break;
+    }
+
     case XENMEM_claim_pages:
         if ( copy_from_guest(&reservation, arg, 1) )
             return -EFAULT;
@@ -969,6 +1153,29 @@ long do_memory_op(unsigned long cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
 
         break;
 
+    case XENMEM_get_vnumainfo:
+    {
+        struct xen_vnuma_topology_info topo;
+
+        if ( copy_from_guest(&topo, arg, 1) )
+            return -EFAULT;
+
+        d = rcu_lock_domain_by_any_id(topo.domid);
+        if ( d == NULL )
+            return -ESRCH;
+
+        rc = xsm_memory_stat_reservation(XSM_TARGET, current->domain, d);
+        if ( !rc )
+            rc = get_vnumainfo(d, &topo);
+
+        rcu_unlock_domain(d);
+
+        if ( (!rc || rc == -ENOBUFS) && __copy_to_guest(arg, &topo, 1) )
+            rc = -EFAULT;
+
+        break;
+    }
+
     default:
         rc = arch_memory_op(cmd, arg);
         break;
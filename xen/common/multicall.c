@@ -12,8 +12,10 @@
 #include <xen/guest_access.h>
 #include <xen/perfc.h>
 #include <xen/trace.h>
+#include <xen/softirq.h>
 #include <asm/current.h>
 #include <asm/hardirq.h>
+#include <asm/time.h>
 
 #ifndef COMPAT
 typedef long ret_t;
@@ -33,6 +35,42 @@ static void trace_multicall_call(multicall_entry_t *call)
     __trace_multicall_call(call);
 }
 
+/* What each sub-call cost, in perf counters and the trace. */
+static void account_multicall_call(multicall_entry_t *call, cycles_t cycles)
+{
+    perfc_incra(multicall_subcalls, call->op);
+    perfc_adda(multicall_subcall_kcycles, call->op, cycles >> 10);
+
+    if ( tb_init_done )
+    {
+        struct {
+            uint32_t op, result, cycles;
+        } d = { call->op, call->result, min_t(cycles_t, cycles, ~0u) };
+
+        __trace_var(TRC_PV_HYPERCALL_SUBCALL_DONE, 1, sizeof(d), &d);
+    }
+}
+
+/*
+ * Must the rest of the batch wait for the guest to come back? Only to
+ * schedule, or for the guest to take its events: other softirqs run
+ * just as well here, between sub-calls and without locks held, as on
+ * the way out, and then the batch carries on in the same trap.
+ */
+static bool_t multicall_preempt_check(void)
+{
+    if ( !hypercall_preempt_check() )
+        return 0;
+
+    if ( local_events_need_delivery() ||
+         test_bit(SCHEDULE_SOFTIRQ, &softirq_pending(smp_processor_id())) )
+        return 1;
+
+    perfc_incr(multicall_softirqs);
+    process_pending_softirqs();
+    return hypercall_preempt_check();
+}
+
 ret_t
 do_multicall(
     XEN_GUEST_HANDLE_PARAM(multicall_entry_t) call_list, uint32_t nr_calls)
@@ -40,6 +78,7 @@ do_multicall(
     struct mc_state *mcs = &current->mc_state;
     uint32_t         i;
     int              rc = 0;
+    cycles_t         start;
 
     if ( unlikely(__test_and_set_bit(_MCSF_in_multicall, &mcs->flags)) )
     {
@@ -52,7 +91,7 @@ do_multicall(
 
     for ( i = 0; !rc && i < nr_calls; i++ )
     {
-        if ( i && hypercall_preempt_check() )
+        if ( i && multicall_preempt_check() )
             goto preempted;
 
         if ( unlikely(__copy_from_guest(&mcs->call, call_list, 1)) )
@@ -63,7 +102,9 @@ do_multicall(
 
         trace_multicall_call(&mcs->call);
 
+        start = get_cycles();
         do_multicall_call(&mcs->call);
+        account_multicall_call(&mcs->call, get_cycles() - start);
 
 #ifndef NDEBUG
         {
@@ -99,6 +140,7 @@ do_multicall(
     return rc;
 
  preempted:
+    perfc_incr(multicall_preempted);
     perfc_add(calls_from_multicall, i);
     mcs->flags = 0;
     return hypercall_create_continuation(
@@ -23,6 +23,7 @@
 
 #include <xen/config.h>
 #include <xen/init.h>
+#include <xen/cpu.h>
 #include <xen/types.h>
 #include <xen/lib.h>
 #include <xen/sched.h>
@@ -64,6 +65,13 @@ string_param("badpage", opt_badpage);
 static bool_t opt_bootscrub __initdata = 1;
 boolean_param("bootscrub", opt_bootscrub);
 
+/*
+ * bootscrub_idle -> Free pages are zeroed by idle cpus once boot is over,
+ * or when they are allocated, rather than during boot.
+ */
+static bool_t __read_mostly opt_bootscrub_idle;
+boolean_param("bootscrub_idle", opt_bootscrub_idle);
+
 /*
  * bootscrub_chunk -> Amount of bytes to scrub lockstep on non-SMT CPUs
  * on all NUMA nodes.
@@ -287,6 +295,9 @@ static heap_by_zone_and_order_t *_heap[MAX_NUMNODES];
 static unsigned long *avail[MAX_NUMNODES];
 static long total_avail_pages;
 
+/* Free pages of each node with PGC_need_scrub set, see scrub_free_pages(). */
+static unsigned long node_need_scrub[MAX_NUMNODES];
+
 /* TMEM: Reserve a fraction of memory for mid-size (0<order<9) allocations.*/
 static long midsize_alloc_zone_pages;
 #define MIDSIZE_ALLOC_FRAC 128
@@ -574,6 +585,303 @@ static void check_low_mem_virq(void)
     }
 }
 
+/*
+ * Free pages which need scrubbing have PGC_need_scrub set, and the head of
+ * each chunk records from which page on it may contain some. Clean chunks
+ * are at the head of their free list and the others at the tail, so that
+ * allocations take clean pages while there are, and idle cpus find the
+ * pages to scrub without walking the lists.
+ */
+static void page_list_add_scrub(
+    struct page_info *pg, unsigned int node, unsigned int zone,
+    unsigned int order, unsigned int first_dirty)
+{
+    PFN_ORDER(pg) = order;
+    pg->u.free.first_dirty = first_dirty;
+    if ( first_dirty == INVALID_DIRTY_IDX )
+        page_list_add(pg, &heap(node, zone, order));
+    else
+        page_list_add_tail(pg, &heap(node, zone, order));
+}
+
+/*
+ * Take a free chunk of at least 2^@order pages of the given node and zone
+ * off its list, a clean one if there is. Its order goes in @chunk_order.
+ */
+static struct page_info *take_free_chunk(
+    unsigned int node, unsigned int zone, unsigned int order,
+    unsigned int *chunk_order)
+{
+    struct page_info *pg;
+    unsigned int j;
+    bool_t dirty_ok = 0;
+
+    for ( ; ; )
+    {
+        for ( j = order; j <= MAX_ORDER; j++ )
+        {
+            if ( page_list_empty(&heap(node, zone, j)) )
+                continue;
+            pg = page_list_first(&heap(node, zone, j));
+            if ( dirty_ok || (pg->u.free.first_dirty == INVALID_DIRTY_IDX) )
+            {
+                page_list_del(pg, &heap(node, zone, j));
+                *chunk_order = j;
+                return pg;
+            }
+        }
+
+        if ( dirty_ok )
+            return NULL;
+        dirty_ok = 1;
+    }
+}
+
+/*
+ * Halve the free chunk @pg of order @j, off its list, until it is of order
+ * @order, giving the lower halves back to the heap. Returns the last 2^@order
+ * pages, and in @first_dirty the index of the first of those which may need
+ * scrubbing.
+ */
+static struct page_info *split_free_chunk(
+    struct page_info *pg, unsigned int node, unsigned int zone,
+    unsigned int j, unsigned int order, unsigned int *first_dirty)
+{
+    unsigned int fd = pg->u.free.first_dirty;
+
+    while ( j != order )
+    {
+        unsigned int half = 1U << --j;
+
+        page_list_add_scrub(pg, node, zone, j,
+                            (fd < half) ? fd : INVALID_DIRTY_IDX);
+        pg += half;
+        if ( fd != INVALID_DIRTY_IDX )
+            fd = (fd >= half) ? fd - half : 0;
+    }
+
+    *first_dirty = fd;
+    return pg;
+}
+
+/*
+ * Per-cpu caches of order-0 pages of the cpu's node, in front of heap_lock.
+ * Pages move between a cache and the heap PCP_BATCH at a time, under one
+ * acquisition of heap_lock, and a cache keeps at most PCP_HIGH pages.
+ *
+ * Cached pages are accounted as allocated, and are in state inuse with no
+ * owner, so that the buddy allocator never merges with them. A cached page
+ * offline_page() marks offlining goes back to the heap instead of being
+ * handed out. The caches are only looked at from the cpu they belong to,
+ * never from irq context, as allocations can't be made there.
+ */
+#define PCP_BATCH 16
+#define PCP_HIGH  (4 * PCP_BATCH)
+
+struct page_cache {
+    struct page_list_head list;
+    unsigned int count;
+};
+
+static DEFINE_PER_CPU(struct page_cache, page_cache);
+
+/* Not before boot is over: pages freed until then still get scrubbed. */
+#define page_cache_ready() (system_state == SYS_STATE_active)
+
+static void merge_free_pages(
+    struct page_info *pg, unsigned int order, bool_t tainted,
+    unsigned int first_dirty);
+
+/* Give a cached page, or one no longer in the cache, back to the heap. */
+static void pcp_release_page(struct page_info *pg)
+{
+    ASSERT(spin_is_locked(&heap_lock));
+
+    pg->count_info = (pg->count_info & PGC_broken) |
+                     (page_state_is(pg, offlining) ? PGC_state_offlined
+                                                   : PGC_state_free);
+    merge_free_pages(pg, 0, page_state_is(pg, offlined), INVALID_DIRTY_IDX);
+}
+
+static void pcp_drain(struct page_cache *pc, unsigned int nr)
+{
+    struct page_info *pg;
+
+    spin_lock(&heap_lock);
+    while ( nr-- && (pg = page_list_remove_head(&pc->list)) != NULL )
+    {
+        pc->count--;
+        pcp_release_page(pg);
+    }
+    spin_unlock(&heap_lock);
+}
+
+/* Move up to PCP_BATCH order-0 pages of the zones given from the heap. */
+static unsigned int pcp_refill(
+    struct page_cache *pc, unsigned int node,
+    unsigned int zone_lo, unsigned int zone_hi)
+{
+    struct page_info *pg;
+    unsigned int n, zone, j, first_dirty;
+
+    spin_lock(&heap_lock);
+
+    for ( n = 0; !outstanding_claims && (n < PCP_BATCH); n++ )
+    {
+        zone = zone_hi;
+        do {
+            if ( !avail[node] || !avail[node][zone] )
+                continue;
+            if ( (pg = take_free_chunk(node, zone, 0, &j)) != NULL )
+                goto found;
+        } while ( zone-- > zone_lo ); /* careful: unsigned zone may wrap */
+        break;
+
+    found:
+        pg = split_free_chunk(pg, node, zone, j, 0, &first_dirty);
+
+        avail[node][zone]--;
+        total_avail_pages--;
+        ASSERT(total_avail_pages >= 0);
+
+        /* Only a handful of pages, when no clean ones are left. */
+        if ( pg->count_info & PGC_need_scrub )
+        {
+            scrub_one_page(pg);
+            pg->count_info &= ~PGC_need_scrub;
+            node_need_scrub[node]--;
+        }
+
+        /* Reference count must continuously be zero for free pages. */
+        BUG_ON(pg->count_info != PGC_state_free);
+        pg->count_info = PGC_state_inuse;
+        page_list_add_tail(pg, &pc->list);
+    }
+
+    pc->count += n;
+    if ( n )
+        check_low_mem_virq();
+
+    spin_unlock(&heap_lock);
+
+    return n;
+}
+
+/* A page of the zones given from the cache of this cpu, NULL if none. */
+static struct page_info *pcp_alloc_page(
+    unsigned int node, unsigned int zone_lo, unsigned int zone_hi)
+{
+    struct page_cache *pc = &this_cpu(page_cache);
+    struct page_info *pg;
+    unsigned int zone;
+
+    ASSERT(!in_irq());
+
+    for ( ; ; )
+    {
+        if ( !pc->count && !pcp_refill(pc, node, zone_lo, zone_hi) )
+            return NULL;
+
+        pg = page_list_first(&pc->list);
+        zone = page_to_zone(pg);
+        if ( (zone < zone_lo) || (zone > zone_hi) )
+            return NULL;
+
+        page_list_del(pg, &pc->list);
+        pc->count--;
+
+        if ( likely(pg->count_info == PGC_state_inuse) )
+            return pg;
+
+        /* Marked offlining or broken while in the cache. */
+        spin_lock(&heap_lock);
+        pcp_release_page(pg);
+        spin_unlock(&heap_lock);
+    }
+}
+
+/* Put a page being freed in the cache of this cpu if it fits there. */
+static bool_t pcp_free_page(struct page_info *pg)
+{
+    struct page_cache *pc = &this_cpu(page_cache);
+    unsigned long x, y = pg->count_info;
+
+    ASSERT(!in_irq());
+
+    if ( !page_cache_ready() || is_xen_heap_page(pg) ||
+         (phys_to_nid(page_to_maddr(pg)) != cpu_to_node(smp_processor_id())) )
+        return 0;
+
+    /* Offlining pages, and broken ones, need free_heap_pages(). */
+    do {
+        x = y;
+        if ( (x & PGC_broken) || ((x & PGC_state) != PGC_state_inuse) )
+            return 0;
+    } while ( (y = cmpxchg(&pg->count_info, x, PGC_state_inuse)) != x );
+
+    /* As free_heap_pages() does it. */
+    pg->u.free.need_tlbflush = (page_get_owner(pg) != NULL);
+    if ( pg->u.free.need_tlbflush )
+        pg->tlbflush_timestamp = tlbflush_current_time();
+    page_set_owner(pg, NULL);
+    set_gpfn_from_mfn(page_to_mfn(pg), INVALID_M2P_ENTRY);
+
+    page_list_add(pg, &pc->list);
+    if ( ++pc->count > PCP_HIGH )
+        pcp_drain(pc, PCP_BATCH);
+
+    return 1;
+}
+
+static unsigned long pcp_total_pages(void)
+{
+    unsigned long total = 0;
+    unsigned int cpu;
+
+    for_each_online_cpu ( cpu )
+        total += per_cpu(page_cache, cpu).count;
+
+    return total;
+}
+
+static int pcp_cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct page_cache *pc = &per_cpu(page_cache, cpu);
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        INIT_PAGE_LIST_HEAD(&pc->list);
+        pc->count = 0;
+        break;
+    case CPU_UP_CANCELED:
+    case CPU_DEAD:
+        pcp_drain(pc, pc->count);
+        break;
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block pcp_cpu_nfb = {
+    .notifier_call = pcp_cpu_callback
+};
+
+static int __init page_cache_init(void)
+{
+    void *cpu = (void *)(long)smp_processor_id();
+
+    pcp_cpu_callback(&pcp_cpu_nfb, CPU_UP_PREPARE, cpu);
+    register_cpu_notifier(&pcp_cpu_nfb);
+
+    return 0;
+}
+presmp_initcall(page_cache_init);
+
 /* Allocate 2^@order contiguous pages. */
 static struct page_info *alloc_heap_pages(
     unsigned int zone_lo, unsigned int zone_hi,
@@ -587,6 +895,8 @@ static struct page_info *alloc_heap_pages(
     nodemask_t nodemask = (d != NULL ) ? d->node_affinity : node_online_map;
     bool_t need_tlbflush = 0;
     uint32_t tlbflush_timestamp = 0;
+    unsigned int first_dirty;
+    unsigned long dirty = 0;
 
     if ( node == NUMA_NO_NODE )
     {
@@ -609,6 +919,26 @@ static struct page_info *alloc_heap_pages(
     if ( unlikely(order > MAX_ORDER) )
         return NULL;
 
+    /*
+     * Single pages of the local node come from the cpu's cache, unless
+     * claims or tmem want a say in the allocation.
+     */
+    if ( (order == 0) && page_cache_ready() && !opt_tmem &&
+         !outstanding_claims && (node == cpu_to_node(smp_processor_id())) &&
+         ((pg = pcp_alloc_page(node, zone_lo, zone_hi)) != NULL) )
+    {
+        if ( d != NULL )
+            d->last_alloc_node = node;
+
+        need_tlbflush = pg->u.free.need_tlbflush &&
+                        (pg->tlbflush_timestamp <= tlbflush_current_time());
+        tlbflush_timestamp = pg->tlbflush_timestamp;
+
+        pg->u.inuse.type_info = 0;
+        flush_page_to_ram(page_to_mfn(pg));
+        goto flush;
+    }
+
     spin_lock(&heap_lock);
 
     /*
@@ -645,9 +975,8 @@ static struct page_info *alloc_heap_pages(
                 continue;
 
             /* Find smallest order which can satisfy the request. */
-            for ( j = order; j <= MAX_ORDER; j++ )
-                if ( (pg = page_list_remove_head(&heap(node, zone, j))) )
-                    goto found;
+            if ( (pg = take_free_chunk(node, zone, order, &j)) != NULL )
+                goto found;
         } while ( zone-- > zone_lo ); /* careful: unsigned zone may wrap */
 
         if ( memflags & MEMF_exact_node )
@@ -692,12 +1021,7 @@ static struct page_info *alloc_heap_pages(
 
  found: 
     /* We may have to halve the chunk a number of times. */
-    while ( j != order )
-    {
-        PFN_ORDER(pg) = --j;
-        page_list_add_tail(pg, &heap(node, zone, j));
-        pg += 1 << j;
-    }
+    pg = split_free_chunk(pg, node, zone, j, order, &first_dirty);
 
     ASSERT(avail[node][zone] >= request);
     avail[node][zone] -= request;
@@ -712,8 +1036,12 @@ static struct page_info *alloc_heap_pages(
     for ( i = 0; i < (1 << order); i++ )
     {
         /* Reference count must continuously be zero for free pages. */
-        BUG_ON(pg[i].count_info != PGC_state_free);
-        pg[i].count_info = PGC_state_inuse;
+        BUG_ON((pg[i].count_info & ~PGC_need_scrub) != PGC_state_free);
+        if ( pg[i].count_info & PGC_need_scrub )
+            dirty++;
+        /* PGC_need_scrub stays until the page is scrubbed, below. */
+        pg[i].count_info = PGC_state_inuse |
+                           (pg[i].count_info & PGC_need_scrub);
 
         if ( pg[i].u.free.need_tlbflush &&
              (pg[i].tlbflush_timestamp <= tlbflush_current_time()) &&
@@ -734,8 +1062,22 @@ static struct page_info *alloc_heap_pages(
         flush_page_to_ram(page_to_mfn(&pg[i]));
     }
 
+    node_need_scrub[node] -= dirty;
+
     spin_unlock(&heap_lock);
 
+    /* No clean chunk would do: scrub what the idle cpus haven't yet. */
+    for ( i = first_dirty; dirty && (i < (1U << order)); i++ )
+    {
+        if ( !test_bit(_PGC_need_scrub, &pg[i].count_info) )
+            continue;
+        scrub_one_page(&pg[i]);
+        flush_page_to_ram(page_to_mfn(&pg[i]));
+        clear_bit(_PGC_need_scrub, &pg[i].count_info);
+        dirty--;
+    }
+
+ flush:
     if ( need_tlbflush )
     {
         cpumask_t mask = cpu_online_map;
@@ -755,6 +1097,7 @@ static int reserve_offlined_page(struct page_info *head)
 {
     unsigned int node = phys_to_nid(page_to_maddr(head));
     int zone = page_to_zone(head), i, head_order = PFN_ORDER(head), count = 0;
+    unsigned int first_dirty = head->u.free.first_dirty, off, fd;
     struct page_info *cur_head;
     int cur_order;
 
@@ -798,8 +1141,16 @@ static int reserve_offlined_page(struct page_info *head)
             {
             merge:
                 /* We don't consider merging outside the head_order. */
-                page_list_add_tail(cur_head, &heap(node, zone, cur_order));
-                PFN_ORDER(cur_head) = cur_order;
+                off = cur_head - head;
+                if ( first_dirty == INVALID_DIRTY_IDX )
+                    fd = INVALID_DIRTY_IDX;
+                else if ( first_dirty <= off )
+                    fd = 0;
+                else if ( first_dirty - off < (1U << cur_order) )
+                    fd = first_dirty - off;
+                else
+                    fd = INVALID_DIRTY_IDX;
+                page_list_add_scrub(cur_head, node, zone, cur_order, fd);
                 cur_head += (1 << cur_order);
                 break;
             }
@@ -814,6 +1165,8 @@ static int reserve_offlined_page(struct page_info *head)
         avail[node][zone]--;
         total_avail_pages--;
         ASSERT(total_avail_pages >= 0);
+        if ( cur_head->count_info & PGC_need_scrub )
+            node_need_scrub[node]--;
 
         page_list_add_tail(cur_head,
                            test_bit(_PGC_broken, &cur_head->count_info) ?
@@ -825,50 +1178,23 @@ static int reserve_offlined_page(struct page_info *head)
     return count;
 }
 
-/* Free 2^@order set of pages. */
-static void free_heap_pages(
-    struct page_info *pg, unsigned int order)
+/*
+ * Put 2^@order pages, already marked free (or offlined if @tainted), back
+ * in the heap, merging chunks as far as possible. @first_dirty is the index
+ * of the first of them which may have PGC_need_scrub set.
+ */
+static void merge_free_pages(
+    struct page_info *pg, unsigned int order, bool_t tainted,
+    unsigned int first_dirty)
 {
-    unsigned long mask, mfn = page_to_mfn(pg);
-    unsigned int i, node = phys_to_nid(page_to_maddr(pg)), tainted = 0;
+    unsigned long mask;
+    unsigned int node = phys_to_nid(page_to_maddr(pg));
     unsigned int zone = page_to_zone(pg);
+    unsigned int buddy_dirty;
 
-    ASSERT(order <= MAX_ORDER);
+    ASSERT(spin_is_locked(&heap_lock));
     ASSERT(node >= 0);
 
-    spin_lock(&heap_lock);
-
-    for ( i = 0; i < (1 << order); i++ )
-    {
-        /*
-         * Cannot assume that count_info == 0, as there are some corner cases
-         * where it isn't the case and yet it isn't a bug:
-         *  1. page_get_owner() is NULL
-         *  2. page_get_owner() is a domain that was never accessible by
-         *     its domid (e.g., failed to fully construct the domain).
-         *  3. page was never addressable by the guest (e.g., it's an
-         *     auto-translate-physmap guest and the page was never included
-         *     in its pseudophysical address space).
-         * In all the above cases there can be no guest mappings of this page.
-         */
-        ASSERT(!page_state_is(&pg[i], offlined));
-        pg[i].count_info =
-            ((pg[i].count_info & PGC_broken) |
-             (page_state_is(&pg[i], offlining)
-              ? PGC_state_offlined : PGC_state_free));
-        if ( page_state_is(&pg[i], offlined) )
-            tainted = 1;
-
-        /* If a page has no owner it will need no safety TLB flush. */
-        pg[i].u.free.need_tlbflush = (page_get_owner(&pg[i]) != NULL);
-        if ( pg[i].u.free.need_tlbflush )
-            pg[i].tlbflush_timestamp = tlbflush_current_time();
-
-        /* This page is not a guest frame any more. */
-        page_set_owner(&pg[i], NULL); /* set_gpfn_from_mfn snoops pg owner */
-        set_gpfn_from_mfn(mfn + i, INVALID_M2P_ENTRY);
-    }
-
     avail[node][zone] += 1 << order;
     total_avail_pages += 1 << order;
 
@@ -891,6 +1217,11 @@ static void free_heap_pages(
                 break;
             pg -= mask;
             page_list_del(pg, &heap(node, zone, order));
+            buddy_dirty = pg->u.free.first_dirty;
+            if ( buddy_dirty != INVALID_DIRTY_IDX )
+                first_dirty = buddy_dirty;
+            else if ( first_dirty != INVALID_DIRTY_IDX )
+                first_dirty += mask;
         }
         else
         {
@@ -901,16 +1232,73 @@ static void free_heap_pages(
                  (phys_to_nid(page_to_maddr(pg+mask)) != node) )
                 break;
             page_list_del(pg + mask, &heap(node, zone, order));
+            buddy_dirty = (pg + mask)->u.free.first_dirty;
+            if ( (first_dirty == INVALID_DIRTY_IDX) &&
+                 (buddy_dirty != INVALID_DIRTY_IDX) )
+                first_dirty = mask + buddy_dirty;
         }
 
         order++;
     }
 
-    PFN_ORDER(pg) = order;
-    page_list_add_tail(pg, &heap(node, zone, order));
+    page_list_add_scrub(pg, node, zone, order, first_dirty);
 
     if ( tainted )
         reserve_offlined_page(pg);
+}
+
+/*
+ * Free 2^@order set of pages. With @need_scrub, their contents are erased
+ * before they are handed out again: by an idle cpu, or by the allocation.
+ */
+static void free_heap_pages(
+    struct page_info *pg, unsigned int order, bool_t need_scrub)
+{
+    unsigned long mfn = page_to_mfn(pg);
+    unsigned int i, tainted = 0;
+
+    ASSERT(order <= MAX_ORDER);
+
+    if ( (order == 0) && !need_scrub && pcp_free_page(pg) )
+        return;
+
+    spin_lock(&heap_lock);
+
+    for ( i = 0; i < (1 << order); i++ )
+    {
+        /*
+         * Cannot assume that count_info == 0, as there are some corner cases
+         * where it isn't the case and yet it isn't a bug:
+         *  1. page_get_owner() is NULL
+         *  2. page_get_owner() is a domain that was never accessible by
+         *     its domid (e.g., failed to fully construct the domain).
+         *  3. page was never addressable by the guest (e.g., it's an
+         *     auto-translate-physmap guest and the page was never included
+         *     in its pseudophysical address space).
+         * In all the above cases there can be no guest mappings of this page.
+         */
+        ASSERT(!page_state_is(&pg[i], offlined));
+        pg[i].count_info =
+            ((pg[i].count_info & PGC_broken) |
+             (need_scrub ? PGC_need_scrub : 0) |
+             (page_state_is(&pg[i], offlining)
+              ? PGC_state_offlined : PGC_state_free));
+        if ( page_state_is(&pg[i], offlined) )
+            tainted = 1;
+
+        /* If a page has no owner it will need no safety TLB flush. */
+        pg[i].u.free.need_tlbflush = (page_get_owner(&pg[i]) != NULL);
+        if ( pg[i].u.free.need_tlbflush )
+            pg[i].tlbflush_timestamp = tlbflush_current_time();
+
+        /* This page is not a guest frame any more. */
+        page_set_owner(&pg[i], NULL); /* set_gpfn_from_mfn snoops pg owner */
+        set_gpfn_from_mfn(mfn + i, INVALID_M2P_ENTRY);
+    }
+
+    if ( need_scrub )
+        node_need_scrub[phys_to_nid(page_to_maddr(pg))] += 1 << order;
+    merge_free_pages(pg, order, tainted, need_scrub ? 0 : INVALID_DIRTY_IDX);
 
     spin_unlock(&heap_lock);
 }
@@ -1132,7 +1520,7 @@ unsigned int online_page(unsigned long mfn, uint32_t *status)
     spin_unlock(&heap_lock);
 
     if ( (y & PGC_state) == PGC_state_offlined )
-        free_heap_pages(pg, 0);
+        free_heap_pages(pg, 0, !!(y & PGC_need_scrub));
 
     return ret;
 }
@@ -1174,6 +1562,8 @@ static void init_heap_pages(
     struct page_info *pg, unsigned long nr_pages)
 {
     unsigned long i;
+    bool_t need_scrub = (system_state < SYS_STATE_active) && opt_bootscrub &&
+                        opt_bootscrub_idle;
 
     for ( i = 0; i < nr_pages; i++ )
     {
@@ -1201,7 +1591,7 @@ static void init_heap_pages(
             nr_pages -= n;
         }
 
-        free_heap_pages(pg+i, 0);
+        free_heap_pages(pg+i, 0, need_scrub);
     }
 }
 
@@ -1355,8 +1745,10 @@ void __init scrub_heap_pages(void)
     unsigned long rem = 0;
     int last_distance, best_node;
     int cpus;
+    s_time_t t;
 
-    if ( !opt_bootscrub )
+    /* With bootscrub_idle, init_heap_pages() left that to idle cpus. */
+    if ( !opt_bootscrub || opt_bootscrub_idle )
         return;
 
     cpumask_clear(&all_worker_cpus);
@@ -1398,6 +1790,7 @@ void __init scrub_heap_pages(void)
 
     printk("Scrubbing Free RAM on %d nodes using %d CPUs\n", num_online_nodes(),
            cpumask_weight(&all_worker_cpus));
+    t = NOW();
 
     /* Round: #1 - do NUMA nodes with CPUs. */
     for ( offset = 0; offset < max_per_cpu_sz; offset += chunk_size )
@@ -1472,13 +1865,128 @@ void __init scrub_heap_pages(void)
         }
     }
 
-    printk("done.\n");
+    printk("done (%"PRI_stime"ms).\n", (NOW() - t) / MILLISECS(1));
 
     /* Now that the heap is initialized, run checks and set bounds
      * for the low mem virq algorithm. */
     setup_low_mem_virq();
 }
 
+/*
+ * Idle cpus scrub the free pages freed with need_scrub, taking chunks of
+ * at most 2^SCRUB_CHUNK_ORDER pages off the heap to work on them without
+ * heap_lock. While off its list, the head of such a chunk has order
+ * SCRUB_CHUNK_BUSY so that no buddy merges with it.
+ */
+#define SCRUB_CHUNK_ORDER 9
+#define SCRUB_CHUNK_BUSY  (MAX_ORDER + 1)
+
+static struct page_info *get_dirty_chunk(
+    unsigned int node, unsigned int *pzone, unsigned int *porder,
+    unsigned int *first_dirty)
+{
+    struct page_info *pg;
+    unsigned int zone, order, fd, half;
+
+    for ( zone = 0; zone < NR_ZONES; zone++ )
+        for ( order = 0; order <= MAX_ORDER; order++ )
+        {
+            if ( page_list_empty(&heap(node, zone, order)) )
+                continue;
+            /* Dirty chunks are at the tail, see page_list_add_scrub(). */
+            pg = page_list_last(&heap(node, zone, order));
+            if ( pg->u.free.first_dirty != INVALID_DIRTY_IDX )
+                goto found;
+        }
+
+    return NULL;
+
+ found:
+    page_list_del(pg, &heap(node, zone, order));
+    fd = pg->u.free.first_dirty;
+
+    /* Keep the part holding the first dirty page, give the rest back. */
+    while ( order > SCRUB_CHUNK_ORDER )
+    {
+        half = 1U << --order;
+        if ( fd >= half )
+        {
+            page_list_add_scrub(pg, node, zone, order, INVALID_DIRTY_IDX);
+            pg += half;
+            fd -= half;
+        }
+        else
+            page_list_add_scrub(pg + half, node, zone, order, 0);
+    }
+
+    PFN_ORDER(pg) = SCRUB_CHUNK_BUSY;
+    *pzone = zone;
+    *porder = order;
+    *first_dirty = fd;
+
+    return pg;
+}
+
+bool_t scrub_free_pages(void)
+{
+    unsigned int cpu = smp_processor_id(), node, zone, order, fd, i;
+    unsigned long scrubbed = 0;
+    struct page_info *pg;
+    bool_t tainted = 0;
+
+    if ( !cpu_is_haltable(cpu) )
+        return 0;
+
+    /* This cpu's node first, then whichever node still has some. */
+    node = cpu_to_node(cpu);
+    if ( (node >= MAX_NUMNODES) || !node_need_scrub[node] )
+    {
+        for_each_online_node ( node )
+            if ( node_need_scrub[node] )
+                break;
+        if ( node >= MAX_NUMNODES )
+            return 0;
+    }
+
+    spin_lock(&heap_lock);
+    pg = avail[node] ? get_dirty_chunk(node, &zone, &order, &fd) : NULL;
+    spin_unlock(&heap_lock);
+
+    if ( pg == NULL )
+        return 0;
+
+    for ( i = fd; i < (1U << order); i++ )
+    {
+        if ( softirq_pending(cpu) )
+            break;
+        if ( !test_bit(_PGC_need_scrub, &pg[i].count_info) )
+            continue;
+        scrub_one_page(&pg[i]);
+        /* offline_page() can be at the other bits of count_info. */
+        clear_bit(_PGC_need_scrub, &pg[i].count_info);
+        scrubbed++;
+    }
+
+    spin_lock(&heap_lock);
+
+    node_need_scrub[node] -= scrubbed;
+
+    /* reserve_heap_page() can't have found pages offlined meanwhile. */
+    for ( fd = 0; fd < (1U << order); fd++ )
+        if ( page_state_is(&pg[fd], offlined) )
+            tainted = 1;
+
+    /* merge_free_pages() accounts them as freed, they never were taken. */
+    avail[node][zone] -= 1U << order;
+    total_avail_pages -= 1U << order;
+    merge_free_pages(pg, order, tainted,
+                     (i < (1U << order)) ? i : INVALID_DIRTY_IDX);
+
+    spin_unlock(&heap_lock);
+
+    return 1;
+}
+
 
 
 /*************************
@@ -1535,7 +2043,7 @@ void free_xenheap_pages(void *v, unsigned int order)
 
     memguard_guard_range(v, 1 << (order + PAGE_SHIFT));
 
-    free_heap_pages(virt_to_page(v), order);
+    free_heap_pages(virt_to_page(v), order, 0);
 }
 
 #else
@@ -1587,12 +2095,9 @@ void free_xenheap_pages(void *v, unsigned int order)
     pg = virt_to_page(v);
 
     for ( i = 0; i < (1u << order); i++ )
-    {
-        scrub_one_page(&pg[i]);
         pg[i].count_info &= ~PGC_xen_heap;
-    }
 
-    free_heap_pages(pg, order);
+    free_heap_pages(pg, order, 1);
 }
 
 #endif
@@ -1696,7 +2201,7 @@ struct page_info *alloc_domheap_pages(
 
     if ( (d != NULL) && assign_pages(d, pg, order, memflags) )
     {
-        free_heap_pages(pg, order);
+        free_heap_pages(pg, order, 0);
         return NULL;
     }
     
@@ -1764,11 +2269,7 @@ void free_domheap_pages(struct page_info *pg, unsigned int order)
             scrub = 1;
         }
 
-        if ( unlikely(scrub) )
-            for ( i = 0; i < (1 << order); i++ )
-                scrub_one_page(&pg[i]);
-
-        free_heap_pages(pg, order);
+        free_heap_pages(pg, order, scrub);
     }
 
     if ( drop_dom_ref )
@@ -1804,8 +2305,8 @@ unsigned long avail_node_heap_pages(unsigned int nodeid)
 
 static void pagealloc_info(unsigned char key)
 {
-    unsigned int zone = MEMZONE_XEN;
-    unsigned long n, total = 0;
+    unsigned int zone = MEMZONE_XEN, i;
+    unsigned long n, total = 0, dirty = 0;
 
     printk("Physical memory information:\n");
     printk("    Xen heap: %lukB free\n",
@@ -1827,6 +2328,12 @@ static void pagealloc_info(unsigned char key)
     }
 
     printk("    Dom heap: %lukB free\n", total << (PAGE_SHIFT-10));
+    printk("    Per-cpu caches: %lukB\n",
+           pcp_total_pages() << (PAGE_SHIFT-10));
+
+    for_each_online_node ( i )
+        dirty += node_need_scrub[i];
+    printk("    Free, to be scrubbed: %lukB\n", dirty << (PAGE_SHIFT-10));
 }
 
 static struct keyhandler pagealloc_info_keyhandler = {
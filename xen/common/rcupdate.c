@@ -45,6 +45,9 @@
 #include <xen/softirq.h>
 #include <xen/cpu.h>
 #include <xen/stop_machine.h>
+#include <xen/numa.h>
+#include <xen/nodemask.h>
+#include <xen/keyhandler.h>
 
 /* Global control variables for rcupdate callback mechanism. */
 static struct rcu_ctrlblk {
@@ -53,14 +56,30 @@ static struct rcu_ctrlblk {
     int  next_pending;  /* Is the next batch already waiting?         */
 
     spinlock_t  lock __cacheline_aligned;
-    cpumask_t   cpumask; /* CPUs that need to switch in order    */
-    /* for current batch to proceed.        */
+    nodemask_t  nodemask; /* Nodes with CPUs that need to switch in   */
+    /* order for current batch to proceed.  */
+    unsigned long grace_periods;  /* Completed since boot */
 } __cacheline_aligned rcu_ctrlblk = {
     .cur = -300,
     .completed = -300,
     .lock = SPIN_LOCK_UNLOCKED,
 };
 
+/*
+ * Quiescent states are first combined per node: a cpu only takes the lock
+ * of its node, and the last cpu of a node to pass through a quiescent
+ * state clears the node in rcu_ctrlblk.nodemask.  rcu_ctrlblk.lock is
+ * taken before a node's lock, never while holding one.
+ */
+static struct rcu_node {
+    spinlock_t lock;
+    long       cur;     /* Batch qsmask was set up for */
+    cpumask_t  qsmask;  /* CPUs of the node that need to switch */
+    cpumask_t  cpus;    /* CPUs of the node, online or coming up */
+} __cacheline_aligned rcu_nodes[MAX_NUMNODES] = {
+    [0 ... MAX_NUMNODES - 1] = { .lock = SPIN_LOCK_UNLOCKED },
+};
+
 /*
  * Per-CPU data for Read-Copy Update.
  * nxtlist - new callbacks are added here
@@ -84,6 +103,16 @@ struct rcu_data {
     int cpu;
     struct rcu_head barrier;
     long            last_rs_qlen;     /* qlen during the last resched */
+    unsigned int    node;             /* rcu_nodes[] the cpu is in */
+
+    /* 3) statistics */
+    long            nxtlen;           /* # of callbacks on nxtlist */
+    long            curlen;           /* # of callbacks on curlist */
+    unsigned long   nr_queued;        /* callbacks ever queued */
+    unsigned long   nr_invoked;       /* callbacks ever invoked */
+    unsigned long   nr_batches;       /* batches whose grace period ended */
+    long            max_batch;        /* most callbacks in one batch */
+    unsigned long   nr_forced;        /* force_quiescent_state() calls */
 };
 
 static DEFINE_PER_CPU(struct rcu_data, rcu_data);
@@ -152,14 +181,21 @@ static void force_quiescent_state(struct rcu_data *rdp,
                                   struct rcu_ctrlblk *rcp)
 {
     cpumask_t cpumask;
+    unsigned int node;
+
+    rdp->nr_forced++;
     raise_softirq(SCHEDULE_SOFTIRQ);
     if (unlikely(rdp->qlen - rdp->last_rs_qlen > rsinterval)) {
         rdp->last_rs_qlen = rdp->qlen;
+        /* Unlocked: a cpu too many or too few only costs an IPI. */
+        cpumask_clear(&cpumask);
+        for_each_node_mask(node, rcp->nodemask)
+            cpumask_or(&cpumask, &cpumask, &rcu_nodes[node].qsmask);
         /*
          * Don't send IPI to itself. With irqs disabled,
          * rdp->cpu is the current cpu.
          */
-        cpumask_andnot(&cpumask, &rcp->cpumask, cpumask_of(rdp->cpu));
+        cpumask_clear_cpu(rdp->cpu, &cpumask);
         cpumask_raise_softirq(&cpumask, SCHEDULE_SOFTIRQ);
     }
 }
@@ -187,6 +223,8 @@ void call_rcu(struct rcu_head *head,
     rdp = &__get_cpu_var(rcu_data);
     *rdp->nxttail = head;
     rdp->nxttail = &head->next;
+    rdp->nxtlen++;
+    rdp->nr_queued++;
     if (unlikely(++rdp->qlen > qhimark)) {
         rdp->blimit = INT_MAX;
         force_quiescent_state(rdp, &rcu_ctrlblk);
@@ -209,6 +247,7 @@ static void rcu_do_batch(struct rcu_data *rdp)
         list->func(list);
         list = next;
         rdp->qlen--;
+        rdp->nr_invoked++;
         if (++count >= rdp->blimit)
             break;
     }
@@ -227,14 +266,15 @@ static void rcu_do_batch(struct rcu_data *rdp)
  *   This is done by rcu_start_batch. The start is not broadcasted to
  *   all cpus, they must pick this up by comparing rcp->cur with
  *   rdp->quiescbatch. All cpus are recorded  in the
- *   rcu_ctrlblk.cpumask bitmap.
+ *   rcu_nodes[].qsmask bitmaps, and their nodes in rcu_ctrlblk.nodemask.
  * - All cpus must go through a quiescent state.
  *   Since the start of the grace period is not broadcasted, at least two
  *   calls to rcu_check_quiescent_state are required:
  *   The first call just notices that a new grace period is running. The
  *   following calls check if there was a quiescent state since the beginning
- *   of the grace period. If so, it updates rcu_ctrlblk.cpumask. If
- *   the bitmap is empty, then the grace period is completed.
+ *   of the grace period. If so, it updates the qsmask of its node, and
+ *   the last cpu of the node rcu_ctrlblk.nodemask. If that bitmap is
+ *   empty, then the grace period is completed.
  *   rcu_check_quiescent_state calls rcu_start_batch(0) to start the next grace
  *   period (if necessary).
  */
@@ -245,33 +285,73 @@ static void rcu_do_batch(struct rcu_data *rdp)
  */
 static void rcu_start_batch(struct rcu_ctrlblk *rcp)
 {
+    struct rcu_node *rnp;
+    unsigned int node;
+
     if (rcp->next_pending &&
         rcp->completed == rcp->cur) {
         rcp->next_pending = 0;
+
+        /* The nodes are set up before any cpu can see the new cur. */
+        nodes_clear(rcp->nodemask);
+        for (node = 0; node < MAX_NUMNODES; node++) {
+            rnp = &rcu_nodes[node];
+            if (cpumask_empty(&rnp->cpus))
+                continue;
+            spin_lock(&rnp->lock);
+            rnp->cur = rcp->cur + 1;
+            cpumask_and(&rnp->qsmask, &rnp->cpus, &cpu_online_map);
+            if (!cpumask_empty(&rnp->qsmask))
+                node_set(node, rcp->nodemask);
+            spin_unlock(&rnp->lock);
+        }
+
         /*
          * next_pending == 0 must be visible in
          * __rcu_process_callbacks() before it can see new value of cur.
          */
         smp_wmb();
         rcp->cur++;
-
-        cpumask_copy(&rcp->cpumask, &cpu_online_map);
     }
 }
 
 /*
- * cpu went through a quiescent state since the beginning of the grace period.
- * Clear it from the cpu mask and complete the grace period if it was the last
- * cpu. Start another grace period if someone has further entries pending
+ * cpu went through a quiescent state since the beginning of grace period
+ * batch. Clear it from its node's mask, and the node from the node mask if
+ * it was the node's last cpu. Complete the grace period if that was the
+ * last node, and start another if someone has further entries pending.
+ * Called without rcu_ctrlblk.lock held.
  */
-static void cpu_quiet(int cpu, struct rcu_ctrlblk *rcp)
+static void cpu_quiet(int cpu, long batch, struct rcu_ctrlblk *rcp)
 {
-    cpumask_clear_cpu(cpu, &rcp->cpumask);
-    if (cpumask_empty(&rcp->cpumask)) {
-        /* batch completed ! */
-        rcp->completed = rcp->cur;
-        rcu_start_batch(rcp);
+    unsigned int node = per_cpu(rcu_data, cpu).node;
+    struct rcu_node *rnp = &rcu_nodes[node];
+    int node_done;
+
+    /*
+     * The batch and the cpu bitmap can come out of sync during cpu
+     * startup. Ignore the quiescent state then.
+     */
+    spin_lock(&rnp->lock);
+    node_done = (rnp->cur == batch) &&
+                cpumask_test_and_clear_cpu(cpu, &rnp->qsmask) &&
+                cpumask_empty(&rnp->qsmask);
+    spin_unlock(&rnp->lock);
+
+    if (!node_done)
+        return;
+
+    spin_lock(&rcp->lock);
+    if (likely(rcp->cur == batch) && node_isset(node, rcp->nodemask)) {
+        node_clear(node, rcp->nodemask);
+        if (nodes_empty(rcp->nodemask)) {
+            /* batch completed ! */
+            rcp->completed = rcp->cur;
+            rcp->grace_periods++;
+            rcu_start_batch(rcp);
+        }
     }
+    spin_unlock(&rcp->lock);
 }
 
 /*
@@ -298,15 +378,7 @@ static void rcu_check_quiescent_state(struct rcu_ctrlblk *rcp,
 
     rdp->qs_pending = 0;
 
-    spin_lock(&rcp->lock);
-    /*
-     * rdp->quiescbatch/rcp->cur and the cpu bitmap can come out of sync
-     * during cpu startup. Ignore the quiescent state.
-     */
-    if (likely(rdp->quiescbatch == rcp->cur))
-        cpu_quiet(rdp->cpu, rcp);
-
-    spin_unlock(&rcp->lock);
+    cpu_quiet(rdp->cpu, rdp->quiescbatch, rcp);
 }
 
 
@@ -321,14 +393,19 @@ static void __rcu_process_callbacks(struct rcu_ctrlblk *rcp,
         rdp->donetail = rdp->curtail;
         rdp->curlist = NULL;
         rdp->curtail = &rdp->curlist;
+        rdp->nr_batches++;
+        if (rdp->curlen > rdp->max_batch)
+            rdp->max_batch = rdp->curlen;
     }
 
     local_irq_disable();
     if (rdp->nxtlist && !rdp->curlist) {
         rdp->curlist = rdp->nxtlist;
         rdp->curtail = rdp->nxttail;
+        rdp->curlen = rdp->nxtlen;
         rdp->nxtlist = NULL;
         rdp->nxttail = &rdp->nxtlist;
+        rdp->nxtlen = 0;
         local_irq_enable();
 
         /*
@@ -422,20 +499,28 @@ static void rcu_move_batch(struct rcu_data *this_rdp, struct rcu_head *list,
 static void rcu_offline_cpu(struct rcu_data *this_rdp,
                             struct rcu_ctrlblk *rcp, struct rcu_data *rdp)
 {
+    long batch;
+    int pending;
+
     /* If the cpu going offline owns the grace period we can block
      * indefinitely waiting for it, so flush it here.
      */
     spin_lock(&rcp->lock);
-    if (rcp->cur != rcp->completed)
-        cpu_quiet(rdp->cpu, rcp);
+    cpumask_clear_cpu(rdp->cpu, &rcu_nodes[rdp->node].cpus);
+    batch = rcp->cur;
+    pending = (rcp->cur != rcp->completed);
     spin_unlock(&rcp->lock);
 
+    if (pending)
+        cpu_quiet(rdp->cpu, batch, rcp);
+
     rcu_move_batch(this_rdp, rdp->donelist, rdp->donetail);
     rcu_move_batch(this_rdp, rdp->curlist, rdp->curtail);
     rcu_move_batch(this_rdp, rdp->nxtlist, rdp->nxttail);
 
     local_irq_disable();
     this_rdp->qlen += rdp->qlen;
+    this_rdp->nxtlen += rdp->qlen;
     local_irq_enable();
 }
 
@@ -450,6 +535,10 @@ static void rcu_init_percpu_data(int cpu, struct rcu_ctrlblk *rcp,
     rdp->qs_pending = 0;
     rdp->cpu = cpu;
     rdp->blimit = blimit;
+    rdp->node = cpu_to_node(cpu) < MAX_NUMNODES ? cpu_to_node(cpu) : 0;
+
+    /* Not online yet: rcu_start_batch() doesn't wait for it. */
+    cpumask_set_cpu(cpu, &rcu_nodes[rdp->node].cpus);
 }
 
 static int cpu_callback(
@@ -478,10 +567,40 @@ static struct notifier_block cpu_nfb = {
     .notifier_call = cpu_callback
 };
 
+static void rcu_dump_stats(unsigned char key)
+{
+    struct rcu_ctrlblk *rcp = &rcu_ctrlblk;
+    struct rcu_data *rdp;
+    unsigned int cpu, node;
+
+    printk("RCU: batch %ld, completed %ld, %lu grace periods, waiting on",
+           rcp->cur, rcp->completed, rcp->grace_periods);
+    for_each_node_mask(node, rcp->nodemask)
+        printk(" %u", node);
+    printk("\n");
+
+    for_each_online_cpu(cpu) {
+        rdp = &per_cpu(rcu_data, cpu);
+        printk("CPU%u: node %u qlen %ld queued %lu invoked %lu"
+               " batches %lu (avg %lu max %ld) forced %lu\n",
+               cpu, rdp->node, rdp->qlen, rdp->nr_queued, rdp->nr_invoked,
+               rdp->nr_batches,
+               rdp->nr_batches ? rdp->nr_invoked / rdp->nr_batches : 0,
+               rdp->max_batch, rdp->nr_forced);
+    }
+}
+
+static struct keyhandler rcu_stats_keyhandler = {
+    .diagnostic = 1,
+    .u.fn = rcu_dump_stats,
+    .desc = "dump RCU statistics"
+};
+
 void __init rcu_init(void)
 {
     void *cpu = (void *)(long)smp_processor_id();
     cpu_callback(&cpu_nfb, CPU_UP_PREPARE, cpu);
     register_cpu_notifier(&cpu_nfb);
     open_softirq(RCU_SOFTIRQ, rcu_process_callbacks);
+    register_keyhandler('G', &rcu_stats_keyhandler);
 }
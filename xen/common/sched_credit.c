@@ -49,6 +49,7 @@
  */
 #define CSCHED_FLAG_VCPU_PARKED    0x0  /* VCPU over capped credits */
 #define CSCHED_FLAG_VCPU_YIELD     0x1  /* VCPU yielding */
+#define CSCHED_FLAG_VCPU_ACCT_STOP 0x2  /* VCPU earned enough to go inactive */
 
 
 /*
@@ -136,6 +137,9 @@
  */
 static int __read_mostly sched_credit_tslice_ms = CSCHED_DEFAULT_TSLICE_MS;
 integer_param("sched_credit_tslice_ms", sched_credit_tslice_ms);
+/* VCPUs of uncapped domains csched_acct() itself looks at per period */
+static unsigned int __read_mostly sched_credit_acct_batch = 256;
+integer_param("sched_credit_acct_batch", sched_credit_acct_batch);
 
 /*
  * Physical CPU
@@ -172,6 +176,8 @@ struct csched_vcpu {
     s_time_t start_time;   /* When we were scheduled (used for credit) */
     unsigned flags;
     int16_t pri;
+    uint32_t acct_epoch;   /* Last accounting period applied to credit */
+    int acct_credit;       /* credit as last added to prv->credit_sum */
 #ifdef CSCHED_STATS
     struct {
         int credit_last;
@@ -195,6 +201,9 @@ struct csched_dom {
     uint16_t active_vcpu_count;
     uint16_t weight;
     uint16_t cap;
+    /* Per-VCPU credit increment and cap of the last accounting period */
+    uint32_t acct_fair;
+    int acct_cap;
 };
 
 /*
@@ -212,6 +221,8 @@ struct csched_private {
     uint32_t weight;
     uint32_t credit;
     int credit_balance;
+    atomic_t credit_sum;   /* acct_credit of the active VCPUs */
+    uint32_t acct_epoch;   /* Accounting periods so far */
     uint32_t runq_sort;
     unsigned ratelimit_us;
     /* Period of master and tick in milliseconds */
@@ -778,6 +789,11 @@ __csched_vcpu_acct_start(struct csched_private *prv, struct csched_vcpu *svc)
         list_add(&svc->active_vcpu_elem, &sdom->active_vcpu);
         /* Make weight per-vcpu */
         prv->weight += sdom->weight;
+        /* It earns from the next accounting period on */
+        svc->acct_epoch = prv->acct_epoch;
+        svc->acct_credit = atomic_read(&svc->credit);
+        atomic_add(svc->acct_credit, &prv->credit_sum);
+        clear_bit(CSCHED_FLAG_VCPU_ACCT_STOP, &svc->flags);
         if ( list_empty(&sdom->active_sdom_elem) )
         {
             list_add(&sdom->active_sdom_elem, &prv->active_sdom);
@@ -805,6 +821,8 @@ __csched_vcpu_acct_stop_locked(struct csched_private *prv,
     sdom->active_vcpu_count--;
     list_del_init(&svc->active_vcpu_elem);
     prv->weight -= sdom->weight;
+    atomic_sub(svc->acct_credit, &prv->credit_sum);
+    clear_bit(CSCHED_FLAG_VCPU_ACCT_STOP, &svc->flags);
     if ( list_empty(&sdom->active_vcpu) )
     {
         list_del_init(&sdom->active_sdom_elem);
@@ -814,6 +832,118 @@ __csched_vcpu_acct_stop_locked(struct csched_private *prv,
              svc->vcpu->vcpu_id, sdom->active_vcpu_count);
 }
 
+/*
+ * Apply the accounting periods svc missed to its credit and priority.
+ *
+ * csched_acct() only works out, per domain, what each of its active VCPUs
+ * earns in a period, and leaves applying it to whoever next looks at the
+ * VCPU: the tick of the PCPU it runs on, the runq sort of the PCPU it
+ * waits on, its wakeup, and, for those nobody looked at, such as the
+ * blocked ones, a slice of the active VCPUs csched_acct() goes through
+ * every period. VCPUs of capped domains are only ever accounted by
+ * csched_acct(), as parking and unparking them is done there.
+ *
+ * Returns 1 if svc earned enough to become inactive, which takes
+ * prv->lock and is left to the caller.
+ */
+static int
+csched_vcpu_acct_sync(struct csched_private *prv, struct csched_vcpu *svc,
+                      bool_t master)
+{
+    struct csched_dom * const sdom = svc->sdom;
+    uint32_t epoch = read_atomic(&prv->acct_epoch);
+    uint32_t old = svc->acct_epoch, credit_fair;
+    int credit = 0, credit_cap;
+
+    if ( likely(old == epoch) || (sdom->cap != 0U && !master) )
+        return test_bit(CSCHED_FLAG_VCPU_ACCT_STOP, &svc->flags);
+
+    /* Whoever moves acct_epoch applies the periods in between */
+    if ( cmpxchg(&svc->acct_epoch, old, epoch) != old )
+        return 0;
+
+    if ( list_empty(&svc->active_vcpu_elem) ||
+         test_bit(CSCHED_FLAG_VCPU_ACCT_STOP, &svc->flags) )
+        return test_bit(CSCHED_FLAG_VCPU_ACCT_STOP, &svc->flags);
+
+    /* Pairs with the smp_wmb() in csched_acct() */
+    smp_rmb();
+    credit_fair = sdom->acct_fair;
+    credit_cap = sdom->acct_cap;
+
+    /* A period at a time, as if csched_acct() had been through each */
+    for ( ; old != epoch; old++ )
+    {
+        /* Increment credit */
+        atomic_add(credit_fair, &svc->credit);
+        credit = atomic_read(&svc->credit);
+
+        /*
+         * Recompute priority or, if VCPU is idling, mark it to be removed
+         * from the active list.
+         */
+        if ( credit < 0 )
+        {
+            svc->pri = CSCHED_PRI_TS_OVER;
+
+            /* Park running VCPUs of capped-out domains */
+            if ( sdom->cap != 0U &&
+                 credit < -credit_cap &&
+                 !test_and_set_bit(CSCHED_FLAG_VCPU_PARKED, &svc->flags) )
+            {
+                SCHED_STAT_CRANK(vcpu_park);
+                vcpu_pause_nosync(svc->vcpu);
+            }
+
+            /* Lower bound on credits */
+            if ( credit < -prv->credits_per_tslice )
+            {
+                SCHED_STAT_CRANK(acct_min_credit);
+                credit = -prv->credits_per_tslice;
+                atomic_set(&svc->credit, credit);
+            }
+        }
+        else
+        {
+            svc->pri = CSCHED_PRI_TS_UNDER;
+
+            /* Unpark any capped domains whose credits go positive */
+            if ( test_and_clear_bit(CSCHED_FLAG_VCPU_PARKED, &svc->flags) )
+            {
+                /*
+                 * It's important to unset the flag AFTER the unpause()
+                 * call to make sure the VCPU's priority is not boosted
+                 * if it is woken up here.
+                 */
+                SCHED_STAT_CRANK(vcpu_unpark);
+                vcpu_unpause(svc->vcpu);
+            }
+
+            /* Upper bound on credits means VCPU stops earning */
+            if ( credit > prv->credits_per_tslice )
+            {
+                set_bit(CSCHED_FLAG_VCPU_ACCT_STOP, &svc->flags);
+                /* Divide credits in half, so that when it starts
+                 * accounting again, it starts a little bit "ahead" */
+                credit /= 2;
+                atomic_set(&svc->credit, credit);
+                break;
+            }
+        }
+
+        /* Nothing more to earn, the rest would change nothing */
+        if ( credit_fair == 0 )
+            break;
+    }
+
+    SCHED_VCPU_STAT_SET(svc, credit_last, credit);
+    SCHED_VCPU_STAT_SET(svc, credit_incr, credit_fair);
+    atomic_add(credit - svc->acct_credit, &prv->credit_sum);
+    svc->acct_credit = credit;
+
+    return test_bit(CSCHED_FLAG_VCPU_ACCT_STOP, &svc->flags);
+}
+
 static void
 csched_vcpu_acct(struct csched_private *prv, unsigned int cpu)
 {
@@ -837,6 +967,15 @@ csched_vcpu_acct(struct csched_private *prv, unsigned int cpu)
     if ( !is_idle_vcpu(svc->vcpu) )
         burn_credits(svc, NOW());
 
+    /*
+     * Catch up with the accounting periods. A VCPU which earned enough to
+     * become inactive but is running would be back on the active list
+     * right away: keep it there, the halving of its credits is all that
+     * is left of going through being inactive.
+     */
+    if ( csched_vcpu_acct_sync(prv, svc, 0) )
+        clear_bit(CSCHED_FLAG_VCPU_ACCT_STOP, &svc->flags);
+
     /*
      * Put this VCPU and domain back on the active list if it was
      * idling.
@@ -962,6 +1101,9 @@ csched_vcpu_wake(const struct scheduler *ops, struct vcpu *vc)
         return;
     }
 
+    /* Blocked VCPUs are behind with their accounting, see to it first */
+    csched_vcpu_acct_sync(CSCHED_PRIV(ops), svc, 0);
+
     if ( likely(vcpu_runnable(vc)) )
         SCHED_STAT_CRANK(vcpu_wake_runnable);
     else
@@ -1173,6 +1315,10 @@ csched_runq_sort(struct csched_private *prv, unsigned int cpu)
         next = elem->next;
         svc_elem = __runq_elem(elem);
 
+        /* Apply the new accounting period before sorting by priority */
+        if ( !is_idle_vcpu(svc_elem->vcpu) )
+            csched_vcpu_acct_sync(prv, svc_elem, 0);
+
         if ( svc_elem->pri >= CSCHED_PRI_TS_UNDER )
         {
             /* does elem need to move up the runq? */
@@ -1195,7 +1341,6 @@ csched_acct(void* dummy)
 {
     struct csched_private *prv = dummy;
     unsigned long flags;
-    struct list_head *iter_vcpu, *next_vcpu;
     struct list_head *iter_sdom, *next_sdom;
     struct csched_vcpu *svc;
     struct csched_dom *sdom;
@@ -1205,9 +1350,8 @@ csched_acct(void* dummy)
     uint32_t credit_fair;
     uint32_t credit_peak;
     uint32_t credit_cap;
-    int credit_balance;
+    unsigned int nr_sdom, slice;
     int credit_xtra;
-    int credit;
 
 
     spin_lock_irqsave(&prv->lock, flags);
@@ -1215,6 +1359,9 @@ csched_acct(void* dummy)
     weight_total = prv->weight;
     credit_total = prv->credit;
 
+    /* The credits of the active VCPUs, as of their last accounting */
+    prv->credit_balance = atomic_read(&prv->credit_sum);
+
     /* Converge balance towards 0 when it drops negative */
     if ( prv->credit_balance < 0 )
     {
@@ -1233,9 +1380,9 @@ csched_acct(void* dummy)
     SCHED_STAT_CRANK(acct_run);
 
     weight_left = weight_total;
-    credit_balance = 0;
     credit_xtra = 0;
     credit_cap = 0U;
+    nr_sdom = 0;
 
     list_for_each_safe( iter_sdom, next_sdom, &prv->active_sdom )
     {
@@ -1317,76 +1464,47 @@ csched_acct(void* dummy)
         credit_fair = ( credit_fair + ( sdom->active_vcpu_count - 1 )
                       ) / sdom->active_vcpu_count;
 
+        sdom->acct_fair = credit_fair;
+        sdom->acct_cap = sdom->cap != 0U ? credit_cap : 0;
+        nr_sdom++;
+    }
 
-        list_for_each_safe( iter_vcpu, next_vcpu, &sdom->active_vcpu )
-        {
-            svc = list_entry(iter_vcpu, struct csched_vcpu, active_vcpu_elem);
-            BUG_ON( sdom != svc->sdom );
+    /*
+     * The VCPUs pick it up from here, see csched_vcpu_acct_sync(). Those
+     * of capped domains are all accounted now. Of the others, look at a
+     * slice of each domain's, a different one every period, for those
+     * which were not looked at since, blocked ones included.
+     */
+    smp_wmb();
+    prv->acct_epoch++;
 
-            /* Increment credit */
-            atomic_add(credit_fair, &svc->credit);
-            credit = atomic_read(&svc->credit);
+    slice = nr_sdom ? sched_credit_acct_batch / nr_sdom : 0;
+    if ( slice == 0 )
+        slice = 1;
 
-            /*
-             * Recompute priority or, if VCPU is idling, remove it from
-             * the active list.
-             */
-            if ( credit < 0 )
-            {
-                svc->pri = CSCHED_PRI_TS_OVER;
+    list_for_each_safe( iter_sdom, next_sdom, &prv->active_sdom )
+    {
+        unsigned int n;
 
-                /* Park running VCPUs of capped-out domains */
-                if ( sdom->cap != 0U &&
-                     credit < -credit_cap &&
-                     !test_and_set_bit(CSCHED_FLAG_VCPU_PARKED, &svc->flags) )
-                {
-                    SCHED_STAT_CRANK(vcpu_park);
-                    vcpu_pause_nosync(svc->vcpu);
-                }
+        sdom = list_entry(iter_sdom, struct csched_dom, active_sdom_elem);
 
-                /* Lower bound on credits */
-                if ( credit < -prv->credits_per_tslice )
-                {
-                    SCHED_STAT_CRANK(acct_min_credit);
-                    credit = -prv->credits_per_tslice;
-                    atomic_set(&svc->credit, credit);
-                }
-            }
-            else
-            {
-                svc->pri = CSCHED_PRI_TS_UNDER;
+        n = sdom->active_vcpu_count;
+        if ( sdom->cap == 0U && n > slice )
+            n = slice;
 
-                /* Unpark any capped domains whose credits go positive */
-                if ( test_and_clear_bit(CSCHED_FLAG_VCPU_PARKED, &svc->flags) )
-                {
-                    /*
-                     * It's important to unset the flag AFTER the unpause()
-                     * call to make sure the VCPU's priority is not boosted
-                     * if it is woken up here.
-                     */
-                    SCHED_STAT_CRANK(vcpu_unpark);
-                    vcpu_unpause(svc->vcpu);
-                }
+        while ( n-- && !list_empty(&sdom->active_vcpu) )
+        {
+            svc = list_entry(sdom->active_vcpu.next, struct csched_vcpu,
+                             active_vcpu_elem);
+            BUG_ON( sdom != svc->sdom );
 
-                /* Upper bound on credits means VCPU stops earning */
-                if ( credit > prv->credits_per_tslice )
-                {
-                    __csched_vcpu_acct_stop_locked(prv, svc);
-                    /* Divide credits in half, so that when it starts
-                     * accounting again, it starts a little bit "ahead" */
-                    credit /= 2;
-                    atomic_set(&svc->credit, credit);
-                }
-            }
+            list_move_tail(&svc->active_vcpu_elem, &sdom->active_vcpu);
 
-            SCHED_VCPU_STAT_SET(svc, credit_last, credit);
-            SCHED_VCPU_STAT_SET(svc, credit_incr, credit_fair);
-            credit_balance += credit;
+            if ( csched_vcpu_acct_sync(prv, svc, 1) )
+                __csched_vcpu_acct_stop_locked(prv, svc);
         }
     }
 
-    prv->credit_balance = credit_balance;
-
     spin_unlock_irqrestore(&prv->lock, flags);
 
     /* Inform each CPU that its runq needs to be sorted */
@@ -1907,6 +2025,11 @@ csched_deinit(const struct scheduler *ops)
     }
 }
 
+static int csched_runq_waiting(const struct scheduler *ops, unsigned int cpu)
+{
+    return !IS_RUNQ_IDLE(cpu);
+}
+
 static void csched_tick_suspend(const struct scheduler *ops, unsigned int cpu)
 {
     struct csched_pcpu *spc;
@@ -1967,4 +2090,5 @@ const struct scheduler sched_credit_def = {
 
     .tick_suspend   = csched_tick_suspend,
     .tick_resume    = csched_tick_resume,
+    .runq_waiting   = csched_runq_waiting,
 };
@@ -193,6 +193,49 @@ int opt_underload_balance_tolerance=0;
 integer_param("credit2_balance_under", opt_underload_balance_tolerance);
 int opt_overload_balance_tolerance=-3;
 integer_param("credit2_balance_over", opt_overload_balance_tolerance);
+/*
+ * Vcpus of each runqueue balance_load() looks at for a push, pull or
+ * swap, a different window of them every time, rather than all the
+ * pairs. 0 considers them all.
+ */
+int opt_balance_sample=8;
+integer_param("credit2_balance_sample", opt_balance_sample);
+
+/*
+ * Runqueue granularity: which pcpus share a runqueue, and so its lock.
+ * A runqueue per socket by default, finer ones mean less contention on
+ * the lock, at the price of more balancing between the runqueues.
+ */
+#define OPT_RUNQUEUE_CPU    0
+#define OPT_RUNQUEUE_CORE   1
+#define OPT_RUNQUEUE_SOCKET 2
+#define OPT_RUNQUEUE_NODE   3
+#define OPT_RUNQUEUE_ALL    4
+static const char *const opt_runqueue_str[] = {
+    [OPT_RUNQUEUE_CPU]    = "cpu",
+    [OPT_RUNQUEUE_CORE]   = "core",
+    [OPT_RUNQUEUE_SOCKET] = "socket",
+    [OPT_RUNQUEUE_NODE]   = "node",
+    [OPT_RUNQUEUE_ALL]    = "all"
+};
+int opt_runqueue=OPT_RUNQUEUE_SOCKET;
+
+static void __init parse_credit2_runqueue(const char *s)
+{
+    unsigned int i;
+
+    for ( i = 0; i < ARRAY_SIZE(opt_runqueue_str); i++ )
+    {
+        if ( !strcmp(s, opt_runqueue_str[i]) )
+        {
+            opt_runqueue = i;
+            return;
+        }
+    }
+
+    printk("WARNING: unrecognized value of credit2_runqueue option!\n");
+}
+custom_param("credit2_runqueue", parse_credit2_runqueue);
 
 /*
  * Per-runqueue data
@@ -213,6 +256,11 @@ struct csched2_runqueue_data {
     s_time_t load_last_update;  /* Last time average was updated */
     s_time_t avgload;           /* Decaying queue load */
     s_time_t b_avgload;         /* Decaying queue load modified by balancing */
+    unsigned int node;          /* NUMA node of the cpus of the queue */
+
+    /* Credit resets so far, in CSCHED2_CREDIT_INIT units: see credit_sync() */
+    unsigned long credit_epoch;
+    s_time_t credit_reset_time; /* When the last one happened */
 };
 
 /*
@@ -229,6 +277,8 @@ struct csched2_private {
     struct csched2_runqueue_data rqd[NR_CPUS];
 
     int load_window_shift;
+
+    unsigned int nr_cosched; /* Domains with XEN_SCHED_CREDIT2_COSCHED */
 };
 
 /*
@@ -248,6 +298,7 @@ struct csched2_vcpu {
     unsigned int residual;
 
     int credit;
+    unsigned long credit_epoch; /* rqd->credit_epoch credit is up to date with */
     s_time_t start_time; /* When we were scheduled (used for credit) */
     unsigned flags;      /* 16 bits doesn't seem to play well with clear_bit() */
 
@@ -267,6 +318,7 @@ struct csched2_dom {
     struct domain *dom;
     uint16_t weight;
     uint16_t nr_vcpus;
+    bool_t cosched;
 };
 
 
@@ -292,6 +344,65 @@ static s_time_t c2t(struct csched2_runqueue_data *rqd, s_time_t credit, struct c
     return credit * svc->weight / rqd->max_weight;
 }
 
+/*
+ * Credit resets are epoch based: reset_credit() only advances the
+ * runqueue's credit_epoch, and every vcpu of the runqueue catches up
+ * with it the next time its credit is looked at, under the same
+ * runqueue lock. Catching up with several resets at once is the same
+ * as going through them one by one, as credit is only ever clipped to
+ * the same maximum on its way up.
+ */
+static void credit_sync(struct csched2_vcpu *svc)
+{
+    struct csched2_runqueue_data *rqd = svc->rqd;
+    unsigned long m;
+    int start_credit;
+
+    if ( rqd == NULL || likely(svc->credit_epoch == rqd->credit_epoch) )
+        return;
+
+    BUG_ON( is_idle_vcpu(svc->vcpu) );
+
+    m = rqd->credit_epoch - svc->credit_epoch;
+    svc->credit_epoch = rqd->credit_epoch;
+
+    start_credit = svc->credit;
+
+    /* And add INIT * m, avoiding integer multiplication in the
+     * common case, and overflow in the rare one. */
+    if ( likely(m==1) )
+        svc->credit += CSCHED2_CREDIT_INIT;
+    else if ( m > (CSCHED2_CREDIT_INIT + CSCHED2_CARRYOVER_MAX - svc->credit)
+                  / CSCHED2_CREDIT_INIT )
+        svc->credit = CSCHED2_CREDIT_INIT + CSCHED2_CARRYOVER_MAX;
+    else
+        svc->credit += m * CSCHED2_CREDIT_INIT;
+
+    /* "Clip" credits to max carryover */
+    if ( svc->credit > CSCHED2_CREDIT_INIT + CSCHED2_CARRYOVER_MAX )
+        svc->credit = CSCHED2_CREDIT_INIT + CSCHED2_CARRYOVER_MAX;
+
+    /* Time run before the reset isn't charged, as if it had set it then */
+    if ( svc->start_time < rqd->credit_reset_time )
+        svc->start_time = rqd->credit_reset_time;
+
+    /* TRACE */ {
+        struct {
+            unsigned dom:16,vcpu:16;
+            unsigned credit_start, credit_end;
+            unsigned multiplier;
+        } d;
+        d.dom = svc->vcpu->domain->domain_id;
+        d.vcpu = svc->vcpu->vcpu_id;
+        d.credit_start = start_credit;
+        d.credit_end = svc->credit;
+        d.multiplier = m;
+        trace_var(TRC_CSCHED2_CREDIT_RESET, 1,
+                  sizeof(d),
+                  (unsigned char *)&d);
+    }
+}
+
 /*
  * Runqueue related code
  */
@@ -421,10 +532,13 @@ __runq_insert(struct list_head *runq, struct csched2_vcpu *svc)
     BUG_ON(svc->vcpu->is_running);
     BUG_ON(test_bit(__CSFLAG_scheduled, &svc->flags));
 
+    credit_sync(svc);
+
     list_for_each( iter, runq )
     {
         struct csched2_vcpu * iter_svc = __runq_elem(iter);
 
+        credit_sync(iter_svc);
         if ( svc->credit > iter_svc->credit )
         {
             d2printk(" p%d %pv\n", pos, iter_svc->vcpu);
@@ -476,6 +590,80 @@ __runq_remove(struct csched2_vcpu *svc)
 
 void burn_credits(struct csched2_runqueue_data *rqd, struct csched2_vcpu *, s_time_t);
 
+/*
+ * Co-scheduling: while a vcpu of a domain with XEN_SCHED_CREDIT2_COSCHED
+ * runs on a pcpu, the SMT siblings of that pcpu only run vcpus of the
+ * same domain, or stay idle. The vcpus a sibling runs are read under the
+ * runqueue lock, so this is only enforced between siblings in the same
+ * runqueue, which they are unless credit2_runqueue=cpu. When a vcpu takes
+ * a core over, the siblings running something else are tickled, and
+ * drop it at their next schedule.
+ */
+
+/* The co-scheduled domain running on a sibling of cpu, if any */
+static struct domain *
+cosched_owner(const struct scheduler *ops, struct csched2_runqueue_data *rqd,
+              int cpu)
+{
+    struct vcpu *v;
+    int sib;
+
+    if ( likely(!CSCHED2_PRIV(ops)->nr_cosched) )
+        return NULL;
+
+    for_each_cpu ( sib, per_cpu(cpu_sibling_mask, cpu) )
+    {
+        if ( sib == cpu || !cpumask_test_cpu(sib, &rqd->active) )
+            continue;
+        v = per_cpu(schedule_data, sib).curr;
+        if ( !is_idle_vcpu(v) && CSCHED2_DOM(v->domain)->cosched )
+            return v->domain;
+    }
+
+    return NULL;
+}
+
+/* cpu switched from scurr to snext, let its siblings follow */
+static void
+cosched_tickle(const struct scheduler *ops, struct csched2_runqueue_data *rqd,
+               int cpu, struct csched2_vcpu *scurr, struct csched2_vcpu *snext)
+{
+    struct domain *old = is_idle_vcpu(scurr->vcpu) ? NULL : scurr->vcpu->domain;
+    struct domain *new = is_idle_vcpu(snext->vcpu) ? NULL : snext->vcpu->domain;
+    struct vcpu *v;
+    int sib;
+
+    if ( likely(!CSCHED2_PRIV(ops)->nr_cosched) || old == new )
+        return;
+
+    for_each_cpu ( sib, per_cpu(cpu_sibling_mask, cpu) )
+    {
+        if ( sib == cpu || !cpumask_test_cpu(sib, &rqd->active) )
+            continue;
+        v = per_cpu(schedule_data, sib).curr;
+
+        /* Taking the core over: others off the siblings */
+        if ( new && CSCHED2_DOM(new)->cosched )
+        {
+            if ( !is_idle_vcpu(v) && v->domain == new )
+                continue;
+        }
+        /* Maybe giving it back: the idle siblings may run anything again */
+        else if ( !old || !CSCHED2_DOM(old)->cosched || !is_idle_vcpu(v) )
+            continue;
+
+        cpumask_set_cpu(sib, &rqd->tickled);
+        cpu_raise_softirq(sib, SCHEDULE_SOFTIRQ);
+    }
+}
+
+/* Can svc run on cpu, with owner running on one of its siblings? */
+static inline bool_t
+cosched_allowed(struct domain *owner, struct csched2_vcpu *svc)
+{
+    return !owner || (svc->vcpu->domain == owner);
+}
+
 /* Check to see if the item on the runqueue is higher priority than what's
  * currently running; if so, wake up the processor */
 static /*inline*/ void
@@ -492,6 +680,8 @@ runq_tickle(const struct scheduler *ops, unsigned int cpu, struct csched2_vcpu *
     BUG_ON(new->vcpu->processor != cpu);
     BUG_ON(new->rqd != rqd);
 
+    credit_sync(new);
+
     /* Look at the cpu it's running on first */
     cur = CSCHED2_VCPU(per_cpu(schedule_data, cpu).curr);
     burn_credits(rqd, cur, now);
@@ -504,6 +694,12 @@ runq_tickle(const struct scheduler *ops, unsigned int cpu, struct csched2_vcpu *
     
     /* Get a mask of idle, but not tickled */
     cpumask_andnot(&mask, &rqd->idle, &rqd->tickled);
+
+    /* Leaving out those on a core co-scheduled for another domain */
+    if ( unlikely(CSCHED2_PRIV(ops)->nr_cosched) )
+        for_each_cpu ( i, &mask )
+            if ( !cosched_allowed(cosched_owner(ops, rqd, i), new) )
+                cpumask_clear_cpu(i, &mask);
     
     /* If it's not empty, choose one */
     i = cpumask_cycle(cpu, &mask);
@@ -584,7 +780,6 @@ static void reset_credit(const struct scheduler *ops, int cpu, s_time_t now,
                          struct csched2_vcpu *snext)
 {
     struct csched2_runqueue_data *rqd = RQD(ops, cpu);
-    struct list_head *iter;
     int m;
 
     /*
@@ -608,47 +803,13 @@ static void reset_credit(const struct scheduler *ops, int cpu, s_time_t now,
     if ( snext->credit < -CSCHED2_CREDIT_INIT )
         m += (-snext->credit) / CSCHED2_CREDIT_INIT;
 
-    list_for_each( iter, &rqd->svc )
-    {
-        struct csched2_vcpu * svc;
-        int start_credit;
-
-        svc = list_entry(iter, struct csched2_vcpu, rqd_elem);
-
-        BUG_ON( is_idle_vcpu(svc->vcpu) );
-        BUG_ON( svc->rqd != rqd );
-
-        start_credit = svc->credit;
-
-        /* And add INIT * m, avoiding integer multiplication in the
-         * common case. */
-        if ( likely(m==1) )
-            svc->credit += CSCHED2_CREDIT_INIT;
-        else
-            svc->credit += m * CSCHED2_CREDIT_INIT;
-
-        /* "Clip" credits to max carryover */
-        if ( svc->credit > CSCHED2_CREDIT_INIT + CSCHED2_CARRYOVER_MAX )
-            svc->credit = CSCHED2_CREDIT_INIT + CSCHED2_CARRYOVER_MAX;
-
-        svc->start_time = now;
-
-        /* TRACE */ {
-            struct {
-                unsigned dom:16,vcpu:16;
-                unsigned credit_start, credit_end;
-                unsigned multiplier;
-            } d;
-            d.dom = svc->vcpu->domain->domain_id;
-            d.vcpu = svc->vcpu->vcpu_id;
-            d.credit_start = start_credit;
-            d.credit_end = svc->credit;
-            d.multiplier = m;
-            trace_var(TRC_CSCHED2_CREDIT_RESET, 1,
-                      sizeof(d),
-                      (unsigned char *)&d);
-        }
-    }
+    /*
+     * Rather than walking all the vcpus of the runqueue with its lock
+     * held, let each catch up with the reset when next looked at.
+     */
+    rqd->credit_epoch += m;
+    rqd->credit_reset_time = now;
+    credit_sync(snext);
 
     /* No need to resort runqueue, as everyone's order should be the same. */
 }
@@ -666,6 +827,8 @@ void burn_credits(struct csched2_runqueue_data *rqd, struct csched2_vcpu *svc, s
         return;
     }
 
+    credit_sync(svc);
+
     delta = now - svc->start_time;
 
     if ( delta > 0 ) {
@@ -798,6 +961,7 @@ __runq_assign(struct csched2_vcpu *svc, struct csched2_runqueue_data *rqd)
 {
 
     svc->rqd = rqd;
+    svc->credit_epoch = rqd->credit_epoch;
     list_add_tail(&svc->rqd_elem, &svc->rqd->svc);
 
     update_max_weight(svc->rqd, svc->weight, 0);
@@ -837,6 +1001,7 @@ __runq_deassign(struct csched2_vcpu *svc)
     BUG_ON(__vcpu_on_runq(svc));
     BUG_ON(test_bit(__CSFLAG_scheduled, &svc->flags));
 
+    credit_sync(svc);
     list_del_init(&svc->rqd_elem);
     update_max_weight(svc->rqd, 0, svc->weight);
 
@@ -1220,90 +1385,157 @@ static void migrate(const struct scheduler *ops,
 }
 
 
+/*
+ * b_avgload of rqd as __update_runq_load() would make it now, read
+ * without the runqueue lock: good enough to choose whom to balance with.
+ * The values are not read atomically and may be a little off, the
+ * balancing itself is done on the ones updated under the lock.
+ */
+static s_time_t
+runq_load_estimate(const struct scheduler *ops,
+                   const struct csched2_runqueue_data *rqd, s_time_t now)
+{
+    struct csched2_private *prv = CSCHED2_PRIV(ops);
+    s_time_t last = rqd->load_last_update, b_avgload = rqd->b_avgload;
+    s_time_t load = (unsigned long long)rqd->load << prv->load_window_shift;
+    s_time_t delta;
+
+    now >>= LOADAVG_GRANULARITY_SHIFT;
+
+    if ( last + (1ULL<<prv->load_window_shift) < now )
+        return load;
+
+    delta = now - last;
+    if ( delta < 0 )
+        return b_avgload;
+
+    return ( ( delta * load )
+             + ( ((1ULL<<prv->load_window_shift) - delta) * b_avgload ) )
+           >> prv->load_window_shift;
+}
+
+/*
+ * Whether a load difference of load_delta between two runqueues is worth
+ * moving vcpus for: if we're under 100% capacity, only shift if the load
+ * difference is > 1, otherwise shift if under 12.5%.
+ */
+static int
+balance_worthwhile(const struct scheduler *ops,
+                   const struct csched2_runqueue_data *lrqd, s_time_t l_load,
+                   const struct csched2_runqueue_data *orqd, s_time_t o_load,
+                   s_time_t load_delta)
+{
+    struct csched2_private *prv = CSCHED2_PRIV(ops);
+    s_time_t load_max;
+    int cpus_max, i;
+
+    load_max = l_load;
+    if ( o_load > load_max )
+        load_max = o_load;
+
+    cpus_max = cpumask_weight(&lrqd->active);
+    i = cpumask_weight(&orqd->active);
+    if ( i > cpus_max )
+        cpus_max = i;
+
+    if ( load_max < (1ULL<<(prv->load_window_shift))*cpus_max )
+        return load_delta >= (1ULL<<(prv->load_window_shift+opt_underload_balance_tolerance));
+
+    return load_delta >= (1ULL<<(prv->load_window_shift+opt_overload_balance_tolerance));
+}
+
+/* Make pos the first vcpu of the list, so that sampling starts there next. */
+static void
+runq_svc_rotate(struct list_head *head, struct list_head *pos)
+{
+    if ( pos == head )
+        return;
+    list_del(head);
+    list_add_tail(head, pos);
+}
+
 static void balance_load(const struct scheduler *ops, int cpu, s_time_t now)
 {
     struct csched2_private *prv = CSCHED2_PRIV(ops);
-    int i, max_delta_rqi = -1;
-    struct list_head *push_iter, *pull_iter;
+    int i, max_delta_rqi, near_rqi, far_rqi, n, m;
+    s_time_t l_load, near_load = 0, far_load = 0, near_delta, far_delta;
+    struct list_head *push_iter, *pull_iter, *push_end, *pull_end;
 
     balance_state_t st = { .best_push_svc = NULL, .best_pull_svc = NULL };
     
     /*
      * Basic algorithm: Push, pull, or swap.
-     * - Find the runqueue with the furthest load distance
-     * - Find a pair that makes the difference the least (where one
-     * on either side may be empty).
+     * - Find the runqueue with the furthest load distance, among those
+     * of our NUMA node first: only look further if none of them is far
+     * enough to be worth balancing with.
+     * - Find a pair among a sample of the vcpus of either runqueue that
+     * makes the difference the least (where one on either side may be
+     * empty).
      */
 
     /* Locking:
      * - pcpu schedule lock should be already locked
+     * - the other runqueues' loads are compared without their lock
      */
     st.lrqd = RQD(ops, cpu);
 
     __update_runq_load(ops, st.lrqd, 0, now);
+    l_load = st.lrqd->b_avgload;
 
 retry:
     if ( !spin_trylock(&prv->lock) )
         return;
 
-    st.load_delta = 0;
+    near_rqi = far_rqi = -1;
+    near_delta = far_delta = 0;
 
     for_each_cpu(i, &prv->active_queues)
     {
-        s_time_t delta;
+        s_time_t o_load, delta;
         
         st.orqd = prv->rqd + i;
 
-        if ( st.orqd == st.lrqd
-             || !spin_trylock(&st.orqd->lock) )
+        if ( st.orqd == st.lrqd )
             continue;
 
-        __update_runq_load(ops, st.orqd, 0, now);
-    
-        delta = st.lrqd->b_avgload - st.orqd->b_avgload;
+        o_load = runq_load_estimate(ops, st.orqd, now);
+        delta = l_load - o_load;
         if ( delta < 0 )
             delta = -delta;
 
-        if ( delta > st.load_delta )
+        if ( st.orqd->node == st.lrqd->node )
         {
-            st.load_delta = delta;
-            max_delta_rqi = i;
+            if ( delta > near_delta )
+            {
+                near_delta = delta;
+                near_load = o_load;
+                near_rqi = i;
+            }
+        }
+        else if ( delta > far_delta )
+        {
+            far_delta = delta;
+            far_load = o_load;
+            far_rqi = i;
         }
-
-        spin_unlock(&st.orqd->lock);
     }
 
+    if ( near_rqi != -1 &&
+         balance_worthwhile(ops, st.lrqd, l_load, prv->rqd + near_rqi,
+                            near_load, near_delta) )
+        max_delta_rqi = near_rqi;
+    else if ( far_rqi != -1 &&
+              balance_worthwhile(ops, st.lrqd, l_load, prv->rqd + far_rqi,
+                                 far_load, far_delta) )
+        max_delta_rqi = far_rqi;
+    else
+        max_delta_rqi = -1;
+
     /* Minimize holding the big lock */
     spin_unlock(&prv->lock);
     if ( max_delta_rqi == -1 )
         goto out;
 
-    {
-        s_time_t load_max;
-        int cpus_max;
-
-        
-        load_max = st.lrqd->b_avgload;
-        if ( st.orqd->b_avgload > load_max )
-            load_max = st.orqd->b_avgload;
-
-        cpus_max = cpumask_weight(&st.lrqd->active);
-        i = cpumask_weight(&st.orqd->active);
-        if ( i > cpus_max )
-            cpus_max = i;
-
-        /* If we're under 100% capacaty, only shift if load difference
-         * is > 1.  otherwise, shift if under 12.5% */
-        if ( load_max < (1ULL<<(prv->load_window_shift))*cpus_max )
-        {
-            if ( st.load_delta < (1ULL<<(prv->load_window_shift+opt_underload_balance_tolerance) ) )
-                 goto out;
-        }
-        else
-            if ( st.load_delta < (1ULL<<(prv->load_window_shift+opt_overload_balance_tolerance)) )
-                goto out;
-    }
-             
     /* Try to grab the other runqueue lock; if it's been taken in the
      * meantime, try the process over again.  This can't deadlock
      * because if it doesn't get any other rqd locks, it will simply
@@ -1316,25 +1548,39 @@ retry:
     if ( unlikely(st.orqd->id < 0) )
         goto out_up;
 
-    /* Look for "swap" which gives the best load average
-     * FIXME: O(n^2)! */
+    /* The difference to reduce, now that we can look at it for real */
+    __update_runq_load(ops, st.orqd, 0, now);
+    st.load_delta = st.lrqd->b_avgload - st.orqd->b_avgload;
+    if ( st.load_delta < 0 )
+        st.load_delta = -st.load_delta;
+
+    /* Look for "swap" which gives the best load average, among at most
+     * opt_balance_sample vcpus of each side. */
 
     /* Reuse load delta (as we're trying to minimize it) */
+    n = 0;
     list_for_each( push_iter, &st.lrqd->svc )
     {
         int inner_load_updated = 0;
         struct csched2_vcpu * push_svc = list_entry(push_iter, struct csched2_vcpu, rqd_elem);
 
+        if ( opt_balance_sample && n++ == opt_balance_sample )
+            break;
+
         __update_svc_load(ops, push_svc, 0, now);
 
         /* Skip this one if it's already been flagged to migrate */
         if ( test_bit(__CSFLAG_runq_migrate_request, &push_svc->flags) )
             continue;
 
+        m = 0;
         list_for_each( pull_iter, &st.orqd->svc )
         {
             struct csched2_vcpu * pull_svc = list_entry(pull_iter, struct csched2_vcpu, rqd_elem);
             
+            if ( opt_balance_sample && m++ == opt_balance_sample )
+                break;
+
             if ( ! inner_load_updated )
             {
                 __update_svc_load(ops, pull_svc, 0, now);
@@ -1352,11 +1598,16 @@ retry:
         /* Consider push only */
         consider(&st, push_svc, NULL);
     }
+    push_end = push_iter;
 
+    m = 0;
     list_for_each( pull_iter, &st.orqd->svc )
     {
         struct csched2_vcpu * pull_svc = list_entry(pull_iter, struct csched2_vcpu, rqd_elem);
         
+        if ( opt_balance_sample && m++ == opt_balance_sample )
+            break;
+
         /* Skip this one if it's already been flagged to migrate */
         if ( test_bit(__CSFLAG_runq_migrate_request, &pull_svc->flags) )
             continue;
@@ -1364,6 +1615,11 @@ retry:
         /* Consider pull only */
         consider(&st, NULL, pull_svc);
     }
+    pull_end = pull_iter;
+
+    /* Next time, sample the vcpus which weren't looked at this time */
+    runq_svc_rotate(&st.lrqd->svc, push_end);
+    runq_svc_rotate(&st.orqd->svc, pull_end);
 
     /* OK, now we have some candidates; do the moving */
     if ( st.best_push_svc )
@@ -1421,11 +1677,29 @@ csched2_dom_cntl(
     if ( op->cmd == XEN_DOMCTL_SCHEDOP_getinfo )
     {
         op->u.credit2.weight = sdom->weight;
+        op->u.credit2.flags = sdom->cosched ? XEN_SCHED_CREDIT2_COSCHED : 0;
     }
     else
     {
         ASSERT(op->cmd == XEN_DOMCTL_SCHEDOP_putinfo);
 
+        if ( op->u.credit2.flags & ~XEN_SCHED_CREDIT2_COSCHED )
+        {
+            spin_unlock_irqrestore(&prv->lock, flags);
+            return -EINVAL;
+        }
+
+        /* Takes effect at the next schedule of the siblings */
+        if ( !!(op->u.credit2.flags & XEN_SCHED_CREDIT2_COSCHED) !=
+             sdom->cosched )
+        {
+            sdom->cosched = !sdom->cosched;
+            if ( sdom->cosched )
+                prv->nr_cosched++;
+            else
+                prv->nr_cosched--;
+        }
+
         if ( op->u.credit2.weight != 0 )
         {
             struct list_head *iter;
@@ -1515,6 +1789,8 @@ csched2_free_domdata(const struct scheduler *ops, void *data)
     spin_lock_irqsave(&CSCHED2_PRIV(ops)->lock, flags);
 
     list_del_init(&sdom->sdom_elem);
+    if ( sdom->cosched )
+        CSCHED2_PRIV(ops)->nr_cosched--;
 
     spin_unlock_irqrestore(&CSCHED2_PRIV(ops)->lock, flags);
 
@@ -1559,6 +1835,7 @@ csched2_runtime(const struct scheduler *ops, int cpu, struct csched2_vcpu *snext
     {
         struct csched2_vcpu *swait = __runq_elem(runq->next);
 
+        credit_sync(swait);
         if ( ! is_idle_vcpu(swait->vcpu)
              && swait->credit > 0 )
         {
@@ -1594,15 +1871,17 @@ void __dump_execstate(void *unused);
  * Find a candidate.
  */
 static struct csched2_vcpu *
-runq_candidate(struct csched2_runqueue_data *rqd,
+runq_candidate(const struct scheduler *ops,
+               struct csched2_runqueue_data *rqd,
                struct csched2_vcpu *scurr,
                int cpu, s_time_t now)
 {
     struct list_head *iter;
     struct csched2_vcpu *snext = NULL;
+    struct domain *owner = cosched_owner(ops, rqd, cpu);
 
     /* Default to current if runnable, idle otherwise */
-    if ( vcpu_runnable(scurr->vcpu) )
+    if ( vcpu_runnable(scurr->vcpu) && cosched_allowed(owner, scurr) )
         snext = scurr;
     else
         snext = CSCHED2_VCPU(idle_vcpu[cpu]);
@@ -1611,6 +1890,12 @@ runq_candidate(struct csched2_runqueue_data *rqd,
     {
         struct csched2_vcpu * svc = list_entry(iter, struct csched2_vcpu, runq_elem);
 
+        /* A sibling runs a co-scheduled domain, only it may run here */
+        if ( !cosched_allowed(owner, svc) )
+            continue;
+
+        credit_sync(svc);
+
         /* If this is on a different processor, don't pull it unless
          * its credit is at least CSCHED2_MIGRATE_RESIST higher. */
         if ( svc->vcpu->processor != cpu
@@ -1713,7 +1998,7 @@ csched2_schedule(
         snext = CSCHED2_VCPU(idle_vcpu[cpu]);
     }
     else
-        snext=runq_candidate(rqd, scurr, cpu, now);
+        snext=runq_candidate(ops, rqd, scurr, cpu, now);
 
     /* If switching from a non-idle runnable vcpu, put it
      * back on the runqueue. */
@@ -1724,6 +2009,8 @@ csched2_schedule(
 
     ret.migrated = 0;
 
+    cosched_tickle(ops, rqd, cpu, scurr, snext);
+
     /* Accounting for non-idle tasks */
     if ( !is_idle_vcpu(snext->vcpu) )
     {
@@ -1793,10 +2080,22 @@ csched2_dump_vcpu(struct csched2_vcpu *svc)
             svc->vcpu->processor);
 
     printk(" credit=%" PRIi32" [w=%u]", svc->credit, svc->weight);
+    if ( svc->rqd && svc->credit_epoch != svc->rqd->credit_epoch )
+        printk(" resets=%lu", svc->rqd->credit_epoch - svc->credit_epoch);
 
     printk("\n");
 }
 
+static int
+csched2_runq_waiting(const struct scheduler *ops, unsigned int cpu)
+{
+    if ( !cpumask_test_cpu(cpu, &CSCHED2_PRIV(ops)->initialized) )
+        return 0;
+
+    /* The runqueue is shared: a waiting vcpu may run on any of its cpus. */
+    return !list_empty(&RQD(ops, cpu)->runq);
+}
+
 static void
 csched2_dump_pcpu(const struct scheduler *ops, int cpu)
 {
@@ -1872,10 +2171,11 @@ csched2_dump(const struct scheduler *ops)
         struct csched2_dom *sdom;
         sdom = list_entry(iter_sdom, struct csched2_dom, sdom_elem);
 
-       printk("\tDomain: %d w %d v %d\n\t", 
+       printk("\tDomain: %d w %d v %d%s\n\t", 
               sdom->dom->domain_id, 
               sdom->weight, 
-              sdom->nr_vcpus);
+              sdom->nr_vcpus,
+              sdom->cosched ? " cosched" : "");
 
         list_for_each( iter_svc, &sdom->vcpu )
         {
@@ -1918,6 +2218,24 @@ static void deactivate_runqueue(struct csched2_private *prv, int rqi)
     cpumask_clear_cpu(rqi, &prv->active_queues);
 }
 
+/* The runqueue cpu goes to, as chosen by credit2_runqueue */
+static int cpu_to_runqueue(int cpu)
+{
+    switch ( opt_runqueue )
+    {
+    case OPT_RUNQUEUE_CPU:
+        return cpu;
+    case OPT_RUNQUEUE_CORE:
+        return cpumask_first(per_cpu(cpu_sibling_mask, cpu));
+    case OPT_RUNQUEUE_NODE:
+        return cpu_to_node(cpu);
+    case OPT_RUNQUEUE_ALL:
+        return 0;
+    default:
+        return cpu_to_socket(cpu);
+    }
+}
+
 static void init_pcpu(const struct scheduler *ops, int cpu)
 {
     int rqi;
@@ -1935,19 +2253,16 @@ static void init_pcpu(const struct scheduler *ops, int cpu)
         return;
     }
 
-    /* Figure out which runqueue to put it in */
-    rqi = 0;
-
     /* Figure out which runqueue to put it in */
     /* NB: cpu 0 doesn't get a STARTING callback, so we hard-code it to runqueue 0. */
     if ( cpu == 0 )
         rqi = 0;
     else
-        rqi = cpu_to_socket(cpu);
+        rqi = cpu_to_runqueue(cpu);
 
     if ( rqi < 0 )
     {
-        printk("%s: cpu_to_socket(%d) returned %d!\n",
+        printk("%s: cpu_to_runqueue(%d) returned %d!\n",
                __func__, cpu, rqi);
         BUG();
     }
@@ -1959,6 +2274,7 @@ static void init_pcpu(const struct scheduler *ops, int cpu)
     {
         printk(" First cpu on runqueue, activating\n");
         activate_runqueue(prv, rqi);
+        rqd->node = cpu_to_node(cpu);
     }
     
     /* IRQs already disabled */
@@ -2101,6 +2417,7 @@ csched2_init(struct scheduler *ops)
     printk(" load_window_shift: %d\n", opt_load_window_shift);
     printk(" underload_balance_tolerance: %d\n", opt_underload_balance_tolerance);
     printk(" overload_balance_tolerance: %d\n", opt_overload_balance_tolerance);
+    printk(" runqueues: %s\n", opt_runqueue_str[opt_runqueue]);
 
     if ( opt_load_window_shift < LOADAVG_WINDOW_SHIFT_MIN )
     {
@@ -2178,4 +2495,5 @@ const struct scheduler sched_credit2_def = {
     .free_pdata     = csched2_free_pdata,
     .alloc_domdata  = csched2_alloc_domdata,
     .free_domdata   = csched2_free_domdata,
+    .runq_waiting   = csched2_runq_waiting,
 };
@@ -0,0 +1,789 @@
+/****************************************************************************
+ *        File: common/sched_rt.c
+ *
+ * Description: Real-time deferrable server (RTDS) CPU scheduler
+ *
+ * A global EDF scheduler: every vcpu is given a budget to run for in each
+ * of its periods, and the runnable vcpu with the earliest deadline (the end
+ * of its current period) runs on any pcpu of the pool. All the pcpus of a
+ * pool share one lock and two queues, both rbtrees ordered by deadline:
+ *  - the runq, of the runnable vcpus with budget left which are not running;
+ *  - the depletedq, of the runnable vcpus which used up their budget, and
+ *    which are replenished at their deadline by one timer for the pool.
+ * A vcpu that blocks keeps neither its place nor a replenishment: its
+ * deadline and budget are brought up to date when it wakes.
+ */
+
+#include <xen/config.h>
+#include <xen/init.h>
+#include <xen/lib.h>
+#include <xen/sched.h>
+#include <xen/domain.h>
+#include <xen/time.h>
+#include <xen/timer.h>
+#include <xen/perfc.h>
+#include <xen/sched-if.h>
+#include <xen/softirq.h>
+#include <xen/errno.h>
+#include <xen/trace.h>
+#include <xen/rbtree.h>
+
+#define TRC_RTDS_TICKLE     TRC_SCHED_CLASS_EVT(RTDS, 1)
+#define TRC_RTDS_REPLENISH  TRC_SCHED_CLASS_EVT(RTDS, 2)
+#define TRC_RTDS_SCHEDULE   TRC_SCHED_CLASS_EVT(RTDS, 3)
+
+/* Default parameters of a domain, in microseconds */
+#define RTDS_DEFAULT_PERIOD     10000
+#define RTDS_DEFAULT_BUDGET     4000
+/* Limits of the parameters, in microseconds */
+#define RTDS_MIN_BUDGET         10
+#define RTDS_MAX_PERIOD         (1000 * 1000 * 10)
+
+/* Flags */
+/*
+ * Set while the vcpu runs, until its context is saved: it may not go
+ * back on a queue before then.
+ */
+#define __RTDS_scheduled            1
+#define RTDS_scheduled (1<<__RTDS_scheduled)
+/* Go back on a queue once the context is saved */
+#define __RTDS_delayed_runq_add     2
+#define RTDS_delayed_runq_add (1<<__RTDS_delayed_runq_add)
+
+#define RTDS_PRIV(_ops)  ((struct rt_private *)((_ops)->sched_data))
+#define RTDS_VCPU(_vcpu) ((struct rt_vcpu *) (_vcpu)->sched_priv)
+#define RTDS_DOM(_dom)   ((struct rt_dom *) (_dom)->sched_priv)
+
+/*
+ * System-wide private data, the lock protecting all of it is the schedule
+ * lock of every pcpu of the pool.
+ */
+struct rt_private {
+    spinlock_t lock;
+    struct list_head sdom;      /* domains of the pool */
+    struct rb_root runq;
+    struct rb_root depletedq;
+    cpumask_t cpus;             /* pcpus with alloc_pdata() done */
+    cpumask_t tickled;          /* pcpus asked to reschedule, not yet done */
+    struct timer repl_timer;    /* replenishes the head of the depletedq */
+    bool_t repl_timer_init;
+};
+
+/* Virtual CPU */
+struct rt_vcpu {
+    struct vcpu *vcpu;
+    struct rt_dom *sdom;
+    struct list_head sdom_elem; /* on the domain's list */
+
+    struct rb_node q_elem;
+    struct rb_root *q;          /* the runq, the depletedq or NULL */
+
+    s_time_t period;
+    s_time_t budget;
+
+    s_time_t cur_budget;        /* left in this period */
+    s_time_t cur_deadline;      /* end of this period */
+    s_time_t last_start;        /* when it last started running */
+
+    unsigned flags;
+};
+
+/* Domain */
+struct rt_dom {
+    struct list_head vcpu;      /* the domain's rt_vcpus */
+    struct list_head sdom_elem; /* on the pool's list */
+    struct domain *dom;
+    s_time_t period;
+    s_time_t budget;
+};
+
+static inline int
+__vcpu_on_q(const struct rt_vcpu *svc)
+{
+    return svc->q != NULL;
+}
+
+static void
+__q_insert(struct rb_root *root, struct rt_vcpu *svc)
+{
+    struct rb_node **node = &root->rb_node, *parent = NULL;
+
+    ASSERT(!__vcpu_on_q(svc));
+
+    /* Equal deadlines go right: first come, first served among them */
+    while ( *node )
+    {
+        struct rt_vcpu *entry;
+
+        parent = *node;
+        entry = rb_entry(parent, struct rt_vcpu, q_elem);
+        if ( svc->cur_deadline < entry->cur_deadline )
+            node = &parent->rb_left;
+        else
+            node = &parent->rb_right;
+    }
+
+    rb_link_node(&svc->q_elem, parent, node);
+    rb_insert_color(&svc->q_elem, root);
+    svc->q = root;
+}
+
+static void
+__q_remove(struct rt_vcpu *svc)
+{
+    ASSERT(__vcpu_on_q(svc));
+
+    rb_erase(&svc->q_elem, svc->q);
+    svc->q = NULL;
+}
+
+static inline struct rt_vcpu *
+__q_first(struct rb_root *root)
+{
+    struct rb_node *node = rb_first(root);
+
+    return node ? rb_entry(node, struct rt_vcpu, q_elem) : NULL;
+}
+
+/* Move svc to the period now is in, with a full budget, if it is past its own */
+static void
+rt_update_deadline(struct rt_vcpu *svc, s_time_t now)
+{
+    s_time_t missed;
+
+    if ( now < svc->cur_deadline )
+        return;
+
+    missed = (now - svc->cur_deadline) / svc->period + 1;
+    svc->cur_deadline += missed * svc->period;
+    svc->cur_budget = svc->budget;
+}
+
+/*
+ * Ask a pcpu that svc may run on to reschedule, if it is idle or runs a
+ * vcpu with a later deadline than svc's. The one with the latest deadline
+ * is preempted, pcpus already asked are left alone.
+ */
+static void
+runq_tickle(const struct scheduler *ops, struct rt_vcpu *svc)
+{
+    struct rt_private *prv = RTDS_PRIV(ops);
+    struct rt_vcpu *latest = NULL;
+    cpumask_t mask;
+    unsigned int cpu, target = nr_cpu_ids;
+
+    cpumask_and(&mask, cpupool_scheduler_cpumask(svc->vcpu->domain->cpupool),
+                svc->vcpu->cpu_hard_affinity);
+    cpumask_and(&mask, &mask, &prv->cpus);
+    cpumask_andnot(&mask, &mask, &prv->tickled);
+
+    for_each_cpu ( cpu, &mask )
+    {
+        struct vcpu *curr = curr_on_cpu(cpu);
+        struct rt_vcpu *scurr = RTDS_VCPU(curr);
+
+        if ( is_idle_vcpu(curr) )
+        {
+            target = cpu;
+            break;
+        }
+        if ( latest == NULL || scurr->cur_deadline > latest->cur_deadline )
+        {
+            latest = scurr;
+            target = cpu;
+        }
+    }
+
+    if ( target >= nr_cpu_ids ||
+         (latest != NULL && latest->cur_deadline <= svc->cur_deadline) )
+        return;
+
+    TRACE_3D(TRC_RTDS_TICKLE, svc->vcpu->domain->domain_id,
+             svc->vcpu->vcpu_id, target);
+    cpumask_set_cpu(target, &prv->tickled);
+    cpu_raise_softirq(target, SCHEDULE_SOFTIRQ);
+}
+
+/* Queue a runnable svc which is not running: on the runq if it has budget */
+static void
+rt_queue(const struct scheduler *ops, struct rt_vcpu *svc)
+{
+    struct rt_private *prv = RTDS_PRIV(ops);
+
+    if ( svc->cur_budget > 0 )
+    {
+        __q_insert(&prv->runq, svc);
+        runq_tickle(ops, svc);
+        return;
+    }
+
+    __q_insert(&prv->depletedq, svc);
+    if ( __q_first(&prv->depletedq) == svc )
+        set_timer(&prv->repl_timer, svc->cur_deadline);
+}
+
+/* Replenish the vcpus whose deadline passed, and run them */
+static void
+repl_timer_fn(void *data)
+{
+    const struct scheduler *ops = data;
+    struct rt_private *prv = RTDS_PRIV(ops);
+    struct rt_vcpu *svc;
+    s_time_t now;
+
+    spin_lock_irq(&prv->lock);
+
+    now = NOW();
+    while ( (svc = __q_first(&prv->depletedq)) != NULL )
+    {
+        if ( svc->cur_deadline > now )
+        {
+            set_timer(&prv->repl_timer, svc->cur_deadline);
+            break;
+        }
+
+        __q_remove(svc);
+        rt_update_deadline(svc, now);
+        TRACE_2D(TRC_RTDS_REPLENISH, svc->vcpu->domain->domain_id,
+                 svc->vcpu->vcpu_id);
+        rt_queue(ops, svc);
+    }
+
+    spin_unlock_irq(&prv->lock);
+}
+
+static void *
+rt_alloc_vdata(const struct scheduler *ops, struct vcpu *vc, void *dd)
+{
+    struct rt_vcpu *svc;
+    struct rt_dom *sdom = dd;
+
+    svc = xzalloc(struct rt_vcpu);
+    if ( svc == NULL )
+        return NULL;
+
+    INIT_LIST_HEAD(&svc->sdom_elem);
+    svc->sdom = sdom;
+    svc->vcpu = vc;
+
+    if ( !is_idle_vcpu(vc) )
+    {
+        BUG_ON(sdom == NULL);
+        svc->period = sdom->period;
+        svc->budget = sdom->budget;
+        svc->cur_deadline = NOW() + svc->period;
+        svc->cur_budget = svc->budget;
+    }
+
+    SCHED_STAT_CRANK(vcpu_init);
+
+    return svc;
+}
+
+static void
+rt_free_vdata(const struct scheduler *ops, void *priv)
+{
+    xfree(priv);
+}
+
+static void
+rt_vcpu_insert(const struct scheduler *ops, struct vcpu *vc)
+{
+    struct rt_vcpu *svc = RTDS_VCPU(vc);
+    spinlock_t *lock;
+
+    /* Idle vcpus are inserted before alloc_pdata() is done for their cpu */
+    if ( is_idle_vcpu(vc) )
+        return;
+
+    lock = vcpu_schedule_lock_irq(vc);
+
+    list_add_tail(&svc->sdom_elem, &svc->sdom->vcpu);
+    if ( vcpu_runnable(vc) && !vc->is_running )
+    {
+        rt_update_deadline(svc, NOW());
+        rt_queue(ops, svc);
+    }
+
+    vcpu_schedule_unlock_irq(lock, vc);
+}
+
+static void
+rt_vcpu_remove(const struct scheduler *ops, struct vcpu *vc)
+{
+    struct rt_vcpu *svc = RTDS_VCPU(vc);
+    spinlock_t *lock;
+
+    if ( is_idle_vcpu(vc) )
+        return;
+
+    SCHED_STAT_CRANK(vcpu_destroy);
+
+    lock = vcpu_schedule_lock_irq(vc);
+
+    if ( __vcpu_on_q(svc) )
+        __q_remove(svc);
+    svc->flags &= ~RTDS_delayed_runq_add;
+    list_del_init(&svc->sdom_elem);
+
+    vcpu_schedule_unlock_irq(lock, vc);
+}
+
+static void
+rt_vcpu_sleep(const struct scheduler *ops, struct vcpu *vc)
+{
+    struct rt_vcpu *svc = RTDS_VCPU(vc);
+
+    BUG_ON(is_idle_vcpu(vc));
+
+    if ( curr_on_cpu(vc->processor) == vc )
+        cpu_raise_softirq(vc->processor, SCHEDULE_SOFTIRQ);
+    else if ( __vcpu_on_q(svc) )
+        __q_remove(svc);
+    else
+        svc->flags &= ~RTDS_delayed_runq_add;
+}
+
+static void
+rt_vcpu_wake(const struct scheduler *ops, struct vcpu *vc)
+{
+    struct rt_vcpu *svc = RTDS_VCPU(vc);
+
+    BUG_ON(is_idle_vcpu(vc));
+
+    if ( unlikely(curr_on_cpu(vc->processor) == vc) || __vcpu_on_q(svc) )
+        return;
+
+    rt_update_deadline(svc, NOW());
+
+    /* Not before its context is saved, see rt_context_saved() */
+    if ( unlikely(svc->flags & RTDS_scheduled) )
+    {
+        svc->flags |= RTDS_delayed_runq_add;
+        return;
+    }
+
+    rt_queue(ops, svc);
+}
+
+static void
+rt_context_saved(const struct scheduler *ops, struct vcpu *vc)
+{
+    struct rt_vcpu *svc = RTDS_VCPU(vc);
+    spinlock_t *lock;
+
+    if ( is_idle_vcpu(vc) )
+        return;
+
+    lock = vcpu_schedule_lock_irq(vc);
+
+    if ( (svc->flags & RTDS_delayed_runq_add) && likely(vcpu_runnable(vc)) )
+    {
+        rt_update_deadline(svc, NOW());
+        rt_queue(ops, svc);
+    }
+    svc->flags &= ~(RTDS_scheduled | RTDS_delayed_runq_add);
+
+    vcpu_schedule_unlock_irq(lock, vc);
+}
+
+static int
+rt_cpu_pick(const struct scheduler *ops, struct vcpu *vc)
+{
+    cpumask_t cpus;
+    unsigned int cpu;
+
+    cpumask_and(&cpus, cpupool_scheduler_cpumask(vc->domain->cpupool),
+                vc->cpu_hard_affinity);
+    cpumask_and(&cpus, &cpus, &RTDS_PRIV(ops)->cpus);
+
+    /* The queues are global, the pcpu only matters for the lock and timers */
+    cpu = vc->processor;
+    if ( cpumask_test_cpu(cpu, &cpus) )
+        return cpu;
+    cpu = cpumask_any(&cpus);
+    return (cpu < nr_cpu_ids) ? cpu : vc->processor;
+}
+
+/* Account the time scurr ran for since it was last picked */
+static void
+burn_budget(struct rt_vcpu *scurr, s_time_t now)
+{
+    if ( is_idle_vcpu(scurr->vcpu) )
+        return;
+
+    scurr->cur_budget -= now - scurr->last_start;
+    scurr->last_start = now;
+    rt_update_deadline(scurr, now);
+}
+
+/* The earliest deadline on the runq allowed to run on cpu, or NULL */
+static struct rt_vcpu *
+runq_pick(struct rt_private *prv, unsigned int cpu)
+{
+    struct rb_node *node;
+
+    for ( node = rb_first(&prv->runq); node; node = rb_next(node) )
+    {
+        struct rt_vcpu *svc = rb_entry(node, struct rt_vcpu, q_elem);
+
+        if ( cpumask_test_cpu(cpu, svc->vcpu->cpu_hard_affinity) &&
+             cpumask_test_cpu(cpu, cpupool_scheduler_cpumask(
+                                       svc->vcpu->domain->cpupool)) )
+            return svc;
+    }
+
+    return NULL;
+}
+
+static struct task_slice
+rt_schedule(const struct scheduler *ops, s_time_t now,
+            bool_t tasklet_work_scheduled)
+{
+    const unsigned int cpu = smp_processor_id();
+    struct rt_private *prv = RTDS_PRIV(ops);
+    struct rt_vcpu *const scurr = RTDS_VCPU(current);
+    struct rt_vcpu *snext = NULL;
+    struct task_slice ret = { .migrated = 0 };
+
+    SCHED_STAT_CRANK(schedule);
+
+    cpumask_clear_cpu(cpu, &prv->tickled);
+
+    burn_budget(scurr, now);
+
+    if ( tasklet_work_scheduled )
+        snext = RTDS_VCPU(idle_vcpu[cpu]);
+    else
+    {
+        snext = runq_pick(prv, cpu);
+        /* Keep running scurr unless someone has an earlier deadline */
+        if ( !is_idle_vcpu(current) && vcpu_runnable(current) &&
+             scurr->cur_budget > 0 &&
+             (snext == NULL || scurr->cur_deadline <= snext->cur_deadline) )
+            snext = scurr;
+        if ( snext == NULL )
+            snext = RTDS_VCPU(idle_vcpu[cpu]);
+    }
+
+    if ( snext != scurr && !is_idle_vcpu(current) && vcpu_runnable(current) )
+        scurr->flags |= RTDS_delayed_runq_add;
+
+    if ( !is_idle_vcpu(snext->vcpu) )
+    {
+        if ( snext != scurr )
+        {
+            __q_remove(snext);
+            snext->flags |= RTDS_scheduled;
+            rt_update_deadline(snext, now);
+        }
+        snext->last_start = now;
+
+        /* Safe, all the pcpus of the pool share one lock */
+        if ( snext->vcpu->processor != cpu )
+        {
+            snext->vcpu->processor = cpu;
+            ret.migrated = 1;
+        }
+
+        /* Until the budget runs out, or the period ends and it is refilled */
+        ret.time = min(snext->cur_budget, snext->cur_deadline - now);
+    }
+    else
+        ret.time = -1;
+
+    TRACE_3D(TRC_RTDS_SCHEDULE, cpu, snext->vcpu->domain->domain_id,
+             snext->vcpu->vcpu_id);
+
+    ret.task = snext->vcpu;
+    return ret;
+}
+
+static int
+rt_dom_cntl(const struct scheduler *ops, struct domain *d,
+            struct xen_domctl_scheduler_op *op)
+{
+    struct rt_private *prv = RTDS_PRIV(ops);
+    struct rt_dom *const sdom = RTDS_DOM(d);
+    struct rt_vcpu *svc;
+    s_time_t period, budget;
+    unsigned long flags;
+
+    if ( op->cmd == XEN_DOMCTL_SCHEDOP_getinfo )
+    {
+        spin_lock_irqsave(&prv->lock, flags);
+        op->u.rtds.period = sdom->period / MICROSECS(1);
+        op->u.rtds.budget = sdom->budget / MICROSECS(1);
+        spin_unlock_irqrestore(&prv->lock, flags);
+        return 0;
+    }
+
+    ASSERT(op->cmd == XEN_DOMCTL_SCHEDOP_putinfo);
+
+    if ( op->u.rtds.period > RTDS_MAX_PERIOD ||
+         op->u.rtds.budget < RTDS_MIN_BUDGET ||
+         op->u.rtds.budget > op->u.rtds.period )
+        return -EINVAL;
+
+    period = MICROSECS(op->u.rtds.period);
+    budget = MICROSECS(op->u.rtds.budget);
+
+    /*
+     * The queues are ordered by deadline, which is left alone: the new
+     * period starts at the next replenishment.
+     */
+    spin_lock_irqsave(&prv->lock, flags);
+    sdom->period = period;
+    sdom->budget = budget;
+    list_for_each_entry ( svc, &sdom->vcpu, sdom_elem )
+    {
+        svc->period = period;
+        svc->budget = budget;
+        if ( svc->cur_budget > budget )
+            svc->cur_budget = budget;
+    }
+    spin_unlock_irqrestore(&prv->lock, flags);
+
+    return 0;
+}
+
+static void *
+rt_alloc_domdata(const struct scheduler *ops, struct domain *dom)
+{
+    struct rt_private *prv = RTDS_PRIV(ops);
+    struct rt_dom *sdom;
+    unsigned long flags;
+
+    sdom = xzalloc(struct rt_dom);
+    if ( sdom == NULL )
+        return NULL;
+
+    INIT_LIST_HEAD(&sdom->vcpu);
+    INIT_LIST_HEAD(&sdom->sdom_elem);
+    sdom->dom = dom;
+    sdom->period = MICROSECS(RTDS_DEFAULT_PERIOD);
+    sdom->budget = MICROSECS(RTDS_DEFAULT_BUDGET);
+
+    spin_lock_irqsave(&prv->lock, flags);
+    list_add_tail(&sdom->sdom_elem, &prv->sdom);
+    spin_unlock_irqrestore(&prv->lock, flags);
+
+    return sdom;
+}
+
+static void
+rt_free_domdata(const struct scheduler *ops, void *data)
+{
+    struct rt_private *prv = RTDS_PRIV(ops);
+    struct rt_dom *sdom = data;
+    unsigned long flags;
+
+    spin_lock_irqsave(&prv->lock, flags);
+    list_del_init(&sdom->sdom_elem);
+    spin_unlock_irqrestore(&prv->lock, flags);
+
+    xfree(data);
+}
+
+static int
+rt_dom_init(const struct scheduler *ops, struct domain *dom)
+{
+    struct rt_dom *sdom;
+
+    if ( is_idle_domain(dom) )
+        return 0;
+
+    sdom = rt_alloc_domdata(ops, dom);
+    if ( sdom == NULL )
+        return -ENOMEM;
+
+    dom->sched_priv = sdom;
+
+    return 0;
+}
+
+static void
+rt_dom_destroy(const struct scheduler *ops, struct domain *dom)
+{
+    BUG_ON(!list_empty(&RTDS_DOM(dom)->vcpu));
+
+    rt_free_domdata(ops, RTDS_DOM(dom));
+}
+
+static void *
+rt_alloc_pdata(const struct scheduler *ops, int cpu)
+{
+    struct rt_private *prv = RTDS_PRIV(ops);
+    spinlock_t *old_lock;
+    unsigned long flags;
+
+    spin_lock_irqsave(&prv->lock, flags);
+
+    /* The first pcpu of the pool runs the replenishment timer */
+    if ( !prv->repl_timer_init )
+    {
+        init_timer(&prv->repl_timer, repl_timer_fn, (void *)ops, cpu);
+        prv->repl_timer_init = 1;
+    }
+
+    /* IRQs already disabled */
+    old_lock = pcpu_schedule_lock(cpu);
+
+    /* Move spinlock to the pool's lock */
+    per_cpu(schedule_data, cpu).schedule_lock = &prv->lock;
+    cpumask_set_cpu(cpu, &prv->cpus);
+
+    /* _Not_ pcpu_schedule_unlock(): per_cpu().schedule_lock changed! */
+    spin_unlock(old_lock);
+
+    spin_unlock_irqrestore(&prv->lock, flags);
+
+    return (void *)1;
+}
+
+static void
+rt_free_pdata(const struct scheduler *ops, void *pcpu, int cpu)
+{
+    struct rt_private *prv = RTDS_PRIV(ops);
+    struct schedule_data *sd = &per_cpu(schedule_data, cpu);
+    unsigned int new_cpu;
+    unsigned long flags;
+
+    spin_lock_irqsave(&prv->lock, flags);
+
+    /* Move spinlock to the original lock */
+    ASSERT(sd->schedule_lock == &prv->lock);
+    ASSERT(!spin_is_locked(&sd->_lock));
+    sd->schedule_lock = &sd->_lock;
+    cpumask_clear_cpu(cpu, &prv->cpus);
+    cpumask_clear_cpu(cpu, &prv->tickled);
+    new_cpu = cpumask_any(&prv->cpus);
+
+    spin_unlock_irqrestore(&prv->lock, flags);
+
+    /* Not under the lock, the timer function may be waiting for it */
+    if ( !prv->repl_timer_init || prv->repl_timer.cpu != cpu )
+        return;
+    if ( new_cpu < nr_cpu_ids )
+        migrate_timer(&prv->repl_timer, new_cpu);
+    else
+    {
+        kill_timer(&prv->repl_timer);
+        prv->repl_timer_init = 0;
+    }
+}
+
+static int
+rt_runq_waiting(const struct scheduler *ops, unsigned int cpu)
+{
+    /* The runq is global: a waiting vcpu may run on any pcpu of the pool. */
+    return !RB_EMPTY_ROOT(&RTDS_PRIV(ops)->runq);
+}
+
+static void
+rt_dump_vcpu(const struct rt_vcpu *svc, s_time_t now)
+{
+    printk("[%i.%i] flags=%x cpu=%i period=%"PRI_stime" budget=%"PRI_stime
+           " cur_b=%"PRI_stime" cur_d=%+"PRI_stime"\n",
+           svc->vcpu->domain->domain_id, svc->vcpu->vcpu_id, svc->flags,
+           svc->vcpu->processor, svc->period, svc->budget,
+           svc->cur_budget, svc->cur_deadline - now);
+}
+
+static void
+rt_dump_pcpu(const struct scheduler *ops, int cpu)
+{
+    struct vcpu *curr = curr_on_cpu(cpu);
+
+    printk("tickled=%d ", cpumask_test_cpu(cpu, &RTDS_PRIV(ops)->tickled));
+    if ( is_idle_vcpu(curr) )
+        printk("idle\n");
+    else
+        rt_dump_vcpu(RTDS_VCPU(curr), NOW());
+}
+
+static void
+rt_dump(const struct scheduler *ops)
+{
+    struct rt_private *prv = RTDS_PRIV(ops);
+    struct rb_node *node;
+    s_time_t now = NOW();
+    unsigned long flags;
+
+    spin_lock_irqsave(&prv->lock, flags);
+
+    printk("Runqueue:\n");
+    for ( node = rb_first(&prv->runq); node; node = rb_next(node) )
+        rt_dump_vcpu(rb_entry(node, struct rt_vcpu, q_elem), now);
+    printk("Depleted queue:\n");
+    for ( node = rb_first(&prv->depletedq); node; node = rb_next(node) )
+        rt_dump_vcpu(rb_entry(node, struct rt_vcpu, q_elem), now);
+
+    spin_unlock_irqrestore(&prv->lock, flags);
+}
+
+static int
+rt_init(struct scheduler *ops)
+{
+    struct rt_private *prv;
+
+    prv = xzalloc(struct rt_private);
+    if ( prv == NULL )
+        return -ENOMEM;
+
+    spin_lock_init(&prv->lock);
+    INIT_LIST_HEAD(&prv->sdom);
+    prv->runq = RB_ROOT;
+    prv->depletedq = RB_ROOT;
+    ops->sched_data = prv;
+
+    return 0;
+}
+
+static void
+rt_deinit(const struct scheduler *ops)
+{
+    struct rt_private *prv = RTDS_PRIV(ops);
+
+    if ( prv == NULL )
+        return;
+    if ( prv->repl_timer_init )
+        kill_timer(&prv->repl_timer);
+    xfree(prv);
+}
+
+static struct rt_private _rt_priv;
+
+const struct scheduler sched_rtds_def = {
+    .name           = "SMP RTDS Scheduler",
+    .opt_name       = "rtds",
+    .sched_id       = XEN_SCHEDULER_RTDS,
+    .sched_data     = &_rt_priv,
+
+    .init_domain    = rt_dom_init,
+    .destroy_domain = rt_dom_destroy,
+
+    .insert_vcpu    = rt_vcpu_insert,
+    .remove_vcpu    = rt_vcpu_remove,
+
+    .sleep          = rt_vcpu_sleep,
+    .wake           = rt_vcpu_wake,
+
+    .adjust         = rt_dom_cntl,
+
+    .pick_cpu       = rt_cpu_pick,
+    .do_schedule    = rt_schedule,
+    .context_saved  = rt_context_saved,
+
+    .dump_cpu_state = rt_dump_pcpu,
+    .dump_settings  = rt_dump,
+    .init           = rt_init,
+    .deinit         = rt_deinit,
+    .alloc_vdata    = rt_alloc_vdata,
+    .free_vdata     = rt_free_vdata,
+    .alloc_pdata    = rt_alloc_pdata,
+    .free_pdata     = rt_free_pdata,
+    .alloc_domdata  = rt_alloc_domdata,
+    .free_domdata   = rt_free_domdata,
+    .runq_waiting   = rt_runq_waiting,
+};
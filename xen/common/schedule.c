@@ -69,6 +69,7 @@ static const struct scheduler *schedulers[] = {
     &sched_credit_def,
     &sched_credit2_def,
     &sched_arinc653_def,
+    &sched_rtds_def,
 };
 
 static struct scheduler __read_mostly ops;
@@ -137,6 +138,42 @@ static inline void vcpu_urgent_count_update(struct vcpu *v)
     }
 }
 
+/*
+ * Every runstate change goes through here with the schedule lock of the
+ * vcpu held, so its sched_stats need neither atomics nor a lock of their
+ * own, and they are only ever written by the pcpu the vcpu is on.
+ */
+static inline void vcpu_sched_stats_update(
+    struct vcpu *v, int new_state, s_time_t delta)
+{
+    uint64_t us;
+
+    switch ( new_state )
+    {
+    case RUNSTATE_runnable:
+        if ( v->runstate.state == RUNSTATE_running )
+            v->sched_stats.preemptions++;
+        else
+            v->sched_stats.wakeups++;
+        break;
+
+    case RUNSTATE_running:
+        if ( v->runstate.state != RUNSTATE_runnable )
+            break;
+        if ( delta < 0 )
+            delta = 0;
+        v->sched_stats.waits++;
+        v->sched_stats.wait_ns += delta;
+        if ( delta > v->sched_stats.wait_max_ns )
+            v->sched_stats.wait_max_ns = delta;
+        us = (uint64_t)delta >> 10;
+        v->sched_stats.wait_hist[
+            (us >> (XEN_SYSCTL_SCHED_WAIT_BUCKETS - 2)) ?
+            XEN_SYSCTL_SCHED_WAIT_BUCKETS - 1 : fls(us)]++;
+        break;
+    }
+}
+
 static inline void vcpu_runstate_change(
     struct vcpu *v, int new_state, s_time_t new_entry_time)
 {
@@ -150,6 +187,7 @@ static inline void vcpu_runstate_change(
     trace_runstate_change(v, new_state);
 
     delta = new_entry_time - v->runstate.state_entry_time;
+    vcpu_sched_stats_update(v, new_state, delta);
     if ( delta > 0 )
     {
         v->runstate.time[v->runstate.state] += delta;
@@ -226,43 +264,90 @@ int sched_init_vcpu(struct vcpu *v, unsigned int processor)
     return 0;
 }
 
-int sched_move_domain(struct domain *d, struct cpupool *c)
+/*
+ * Moving a domain to another cpupool is done in three steps, so that the
+ * scheduler data of the new pool is allocated, and the data of the old one
+ * freed, with the domain still running and without cpupool_lock held (see
+ * XEN_SYSCTL_CPUPOOL_OP_MOVEDOMAIN).  Only sched_move_domain_commit() pauses
+ * the domain; on success it leaves the old pool's data in *m, for
+ * sched_move_domain_free() to release.
+ */
+int sched_move_domain_alloc(struct domain *d, struct cpupool *c,
+                            struct sched_move_data *m)
 {
     struct vcpu *v;
-    unsigned int new_p;
-    void **vcpu_priv;
-    void *domdata;
-    void *vcpudata;
-    struct scheduler *old_ops;
-    void *old_domdata;
 
-    domdata = SCHED_OP(c->sched, alloc_domdata, d);
-    if ( domdata == NULL )
+    m->ops = c->sched;
+    m->nr_vcpus = d->max_vcpus;
+    m->domdata = SCHED_OP(m->ops, alloc_domdata, d);
+    if ( m->domdata == NULL )
         return -ENOMEM;
 
-    vcpu_priv = xzalloc_array(void *, d->max_vcpus);
-    if ( vcpu_priv == NULL )
+    m->vcpu_priv = xzalloc_array(void *, m->nr_vcpus);
+    if ( m->vcpu_priv == NULL )
     {
-        SCHED_OP(c->sched, free_domdata, domdata);
+        SCHED_OP(m->ops, free_domdata, m->domdata);
         return -ENOMEM;
     }
 
     for_each_vcpu ( d, v )
     {
-        vcpu_priv[v->vcpu_id] = SCHED_OP(c->sched, alloc_vdata, v, domdata);
-        if ( vcpu_priv[v->vcpu_id] == NULL )
+        m->vcpu_priv[v->vcpu_id] = SCHED_OP(m->ops, alloc_vdata, v,
+                                            m->domdata);
+        if ( m->vcpu_priv[v->vcpu_id] == NULL )
         {
-            for_each_vcpu ( d, v )
-            {
-                if ( vcpu_priv[v->vcpu_id] != NULL )
-                    xfree(vcpu_priv[v->vcpu_id]);
-            }
-            xfree(vcpu_priv);
-            SCHED_OP(c->sched, free_domdata, domdata);
+            sched_move_domain_free(m);
             return -ENOMEM;
         }
     }
 
+    return 0;
+}
+
+void sched_move_domain_free(struct sched_move_data *m)
+{
+    unsigned int i;
+
+    for ( i = 0; i < m->nr_vcpus; i++ )
+        if ( m->vcpu_priv[i] != NULL )
+            SCHED_OP(m->ops, free_vdata, m->vcpu_priv[i]);
+    xfree(m->vcpu_priv);
+    SCHED_OP(m->ops, free_domdata, m->domdata);
+}
+
+int sched_move_domain_commit(struct domain *d, struct cpupool *c,
+                             struct sched_move_data *m)
+{
+    struct vcpu *v;
+    unsigned int new_p;
+    void *vcpudata;
+    struct scheduler *old_ops;
+    void *old_domdata;
+
+    ASSERT(m->ops == c->sched);
+
+    /* Catch up with vcpus brought up since sched_move_domain_alloc(). */
+    if ( d->max_vcpus > m->nr_vcpus )
+    {
+        void **vcpu_priv = xzalloc_array(void *, d->max_vcpus);
+
+        if ( vcpu_priv == NULL )
+            return -ENOMEM;
+        memcpy(vcpu_priv, m->vcpu_priv, m->nr_vcpus * sizeof(*vcpu_priv));
+        xfree(m->vcpu_priv);
+        m->vcpu_priv = vcpu_priv;
+        m->nr_vcpus = d->max_vcpus;
+    }
+    for_each_vcpu ( d, v )
+    {
+        if ( m->vcpu_priv[v->vcpu_id] != NULL )
+            continue;
+        m->vcpu_priv[v->vcpu_id] = SCHED_OP(m->ops, alloc_vdata, v,
+                                            m->domdata);
+        if ( m->vcpu_priv[v->vcpu_id] == NULL )
+            return -ENOMEM;
+    }
+
     domain_pause(d);
 
     old_ops = DOM2OP(d);
@@ -274,7 +359,7 @@ int sched_move_domain(struct domain *d, struct cpupool *c)
     }
 
     d->cpupool = c;
-    d->sched_priv = domdata;
+    d->sched_priv = m->domdata;
 
     new_p = cpumask_first(c->cpu_valid);
     for_each_vcpu ( d, v )
@@ -299,15 +384,14 @@ int sched_move_domain(struct domain *d, struct cpupool *c)
          */
         spin_unlock_irq(lock);
 
-        v->sched_priv = vcpu_priv[v->vcpu_id];
+        v->sched_priv = m->vcpu_priv[v->vcpu_id];
+        m->vcpu_priv[v->vcpu_id] = vcpudata;
         if ( !d->is_dying )
             evtchn_move_pirqs(v);
 
         new_p = cpumask_cycle(new_p, c->cpu_valid);
 
         SCHED_OP(c->sched, insert_vcpu, v);
-
-        SCHED_OP(old_ops, free_vdata, vcpudata);
     }
 
     /* Do we have vcpus already? If not, no need to update node-affinity */
@@ -316,13 +400,28 @@ int sched_move_domain(struct domain *d, struct cpupool *c)
 
     domain_unpause(d);
 
-    SCHED_OP(old_ops, free_domdata, old_domdata);
-
-    xfree(vcpu_priv);
+    /* The old pool's data is freed with the domain running again. */
+    m->ops = old_ops;
+    m->domdata = old_domdata;
 
     return 0;
 }
 
+int sched_move_domain(struct domain *d, struct cpupool *c)
+{
+    struct sched_move_data m;
+    int ret;
+
+    ret = sched_move_domain_alloc(d, c, &m);
+    if ( ret )
+        return ret;
+
+    ret = sched_move_domain_commit(d, c, &m);
+    sched_move_domain_free(&m);
+
+    return ret;
+}
+
 void sched_destroy_vcpu(struct vcpu *v)
 {
     kill_timer(&v->periodic_timer);
@@ -393,6 +492,8 @@ void vcpu_wake(struct vcpu *v)
 
     vcpu_schedule_unlock_irqrestore(lock, flags, v);
 
+    cpufreq_wakeup_boost(v->processor, v->domain->latency_sensitive);
+
     TRACE_2D(TRC_SCHED_WAKE, v->domain->domain_id, v->vcpu_id);
 }
 
@@ -522,6 +623,9 @@ static void vcpu_migrate(struct vcpu *v)
     else
         v->processor = new_cpu;
 
+    if ( old_cpu != new_cpu )
+        v->sched_stats.migrations++;
+
 
     if ( old_lock != new_lock )
         spin_unlock(new_lock);
@@ -697,6 +801,73 @@ int vcpu_set_soft_affinity(struct vcpu *v, const cpumask_t *affinity)
     return vcpu_set_affinity(v, affinity, v->cpu_soft_affinity);
 }
 
+/*
+ * Give vcpus [first, first + nr) of d the same hard and/or soft affinity
+ * (NULL leaves that one alone).  Unlike one vcpu_set_*_affinity() call per
+ * vcpu, node affinity is worked out once for the lot, and vcpus already
+ * using the requested masks are not migrated.
+ */
+int vcpu_set_affinity_bulk(struct domain *d, unsigned int first,
+                           unsigned int nr, const cpumask_t *hard,
+                           const cpumask_t *soft)
+{
+    struct vcpu *v;
+    spinlock_t *lock;
+    cpumask_t online_affinity;
+    unsigned int i;
+    bool_t changed = 0;
+
+    if ( (nr > d->max_vcpus) || (first > d->max_vcpus - nr) )
+        return -EINVAL;
+    for ( i = first; i < first + nr; i++ )
+        if ( d->vcpu[i] == NULL )
+            return -ESRCH;
+
+    if ( hard != NULL )
+    {
+        if ( d->is_pinned )
+            return -EINVAL;
+        /* All vcpus of a domain are in the same cpupool. */
+        cpumask_and(&online_affinity, hard, VCPU2ONLINE(d->vcpu[first]));
+        if ( cpumask_empty(&online_affinity) )
+            return -EINVAL;
+    }
+
+    for ( i = first; i < first + nr; i++ )
+    {
+        v = d->vcpu[i];
+        lock = vcpu_schedule_lock_irq(v);
+        if ( (hard != NULL && !cpumask_equal(v->cpu_hard_affinity, hard)) ||
+             (soft != NULL && !cpumask_equal(v->cpu_soft_affinity, soft)) )
+        {
+            if ( hard != NULL )
+                cpumask_copy(v->cpu_hard_affinity, hard);
+            if ( soft != NULL )
+                cpumask_copy(v->cpu_soft_affinity, soft);
+            set_bit(_VPF_migrating, &v->pause_flags);
+            changed = 1;
+        }
+        vcpu_schedule_unlock_irq(lock, v);
+    }
+
+    if ( !changed )
+        return 0;
+
+    domain_update_node_affinity(d);
+
+    for ( i = first; i < first + nr; i++ )
+    {
+        v = d->vcpu[i];
+        if ( test_bit(_VPF_migrating, &v->pause_flags) )
+        {
+            vcpu_sleep_nosync(v);
+            vcpu_migrate(v);
+        }
+    }
+
+    return 0;
+}
+
 /* Block the currently-executing domain until a pertinent event occurs. */
 void vcpu_block(void)
 {
@@ -1128,6 +1299,72 @@ long sched_adjust_global(struct xen_sysctl_scheduler_op *op)
     return rc;
 }
 
+/* A snapshot of the vcpu, taken as its counters are updated */
+static void sched_vcpustat(struct vcpu *v, struct xen_sysctl_sched_vcpustat *stat)
+{
+    spinlock_t *lock = vcpu_schedule_lock_irq(v);
+
+    stat->vcpu_id = v->vcpu_id;
+    stat->wakeups = v->sched_stats.wakeups;
+    stat->preemptions = v->sched_stats.preemptions;
+    stat->migrations = v->sched_stats.migrations;
+    stat->waits = v->sched_stats.waits;
+    stat->wait_ns = v->sched_stats.wait_ns;
+    stat->wait_max_ns = v->sched_stats.wait_max_ns;
+    memcpy(stat->wait_hist, v->sched_stats.wait_hist,
+           sizeof(stat->wait_hist));
+    vcpu_schedule_unlock_irq(lock, v);
+}
+
+int sched_vcpustats(struct domain *d, struct xen_sysctl_sched_vcpustats *op)
+{
+    struct xen_sysctl_sched_vcpustat stat;
+    struct vcpu *v;
+    unsigned int i = 0;
+
+    memset(&stat, 0, sizeof(stat));
+
+    for_each_vcpu ( d, v )
+    {
+        if ( i < op->nr_vcpus )
+        {
+            sched_vcpustat(v, &stat);
+            if ( copy_to_guest_offset(op->stats, i, &stat, 1) )
+                return -EFAULT;
+        }
+        i++;
+    }
+
+    op->nr_vcpus = i;
+
+    return 0;
+}
+
+/* The counters of all the vcpus of d in one, for XEN_SYSCTL_domstats. */
+void sched_domstats(struct domain *d, struct xen_sysctl_sched_vcpustat *sum)
+{
+    struct xen_sysctl_sched_vcpustat stat;
+    struct vcpu *v;
+    unsigned int i;
+
+    memset(sum, 0, sizeof(*sum));
+
+    for_each_vcpu ( d, v )
+    {
+        sched_vcpustat(v, &stat);
+        sum->vcpu_id++;
+        sum->wakeups += stat.wakeups;
+        sum->preemptions += stat.preemptions;
+        sum->migrations += stat.migrations;
+        sum->waits += stat.waits;
+        sum->wait_ns += stat.wait_ns;
+        if ( stat.wait_max_ns > sum->wait_max_ns )
+            sum->wait_max_ns = stat.wait_max_ns;
+        for ( i = 0; i < XEN_SYSCTL_SCHED_WAIT_BUCKETS; i++ )
+            sum->wait_hist[i] += stat.wait_hist[i];
+    }
+}
+
 static void vcpu_periodic_timer_work(struct vcpu *v)
 {
     s_time_t now = NOW();
@@ -1235,6 +1472,8 @@ static void schedule(void)
 
     ASSERT(next->runstate.state != RUNSTATE_running);
     vcpu_runstate_change(next, RUNSTATE_running, now);
+    if ( next_slice.migrated )
+        next->sched_stats.migrations++;
 
     /*
      * NB. Don't add any trace records from here until the actual context
@@ -1527,6 +1766,17 @@ void schedule_dump(struct cpupool *c)
     }
 }
 
+int sched_runq_waiting(unsigned int cpu)
+{
+    unsigned long flags;
+    spinlock_t *lock = pcpu_schedule_lock_irqsave(cpu, &flags);
+    int rc = SCHED_OP(per_cpu(scheduler, cpu), runq_waiting, cpu);
+
+    pcpu_schedule_unlock_irqrestore(lock, flags, cpu);
+
+    return rc;
+}
+
 void sched_tick_suspend(void)
 {
     struct scheduler *sched;
@@ -1,5 +1,6 @@
 #include <xen/lib.h>
 #include <xen/config.h>
+#include <xen/init.h>
 #include <xen/irq.h>
 #include <xen/smp.h>
 #include <xen/time.h>
@@ -87,24 +88,66 @@ void spin_debug_disable(void)
 
 #ifdef LOCK_PROFILE
 
-#define LOCK_PROFILE_REL                                                     \
-    if (lock->profile)                                                       \
-    {                                                                        \
-        lock->profile->time_hold += NOW() - lock->profile->time_locked;      \
-        lock->profile->lock_cnt++;                                           \
+static bool_t __read_mostly lock_profile_enabled = 1;
+boolean_param("lock_profile", lock_profile_enabled);
+
+static void lock_profile_wait(struct lock_profile *prof, s_time_t wait)
+{
+    unsigned int bucket = LOCKPROF_HIST_N - 1;
+
+    if ( wait < (256LL << (LOCKPROF_HIST_N - 2)) )
+        bucket = fls((unsigned int)(wait >> 8));
+
+    prof->time_block += wait;
+    prof->block_cnt++;
+    prof->block_hist[bucket]++;
+}
+
+static void lock_profile_got(struct lock_profile *prof, s_time_t block,
+                             void *site)
+{
+    prof->time_locked = NOW();
+    prof->lock_site = site;
+    if ( block )
+        lock_profile_wait(prof, prof->time_locked - block);
+}
+
+/* Readers don't own the lock alone, so only their waits are timed */
+static void lock_profile_got_read(struct lock_profile *prof, s_time_t block)
+{
+    prof->lock_cnt++;
+    if ( block )
+        lock_profile_wait(prof, NOW() - block);
+}
+
+static void lock_profile_rel(struct lock_profile *prof)
+{
+    s_time_t hold = NOW() - prof->time_locked;
+
+    prof->time_hold += hold;
+    prof->lock_cnt++;
+    if ( hold > prof->hold_max )
+    {
+        prof->hold_max = hold;
+        prof->hold_max_site = prof->lock_site;
     }
+    prof->time_locked = 0;
+}
+
+/* A lock taken while profiling was stopped isn't accounted */
+#define LOCK_PROFILE_REL                                                     \
+    if ( lock->profile && lock->profile->time_locked )                       \
+        lock_profile_rel(lock->profile);
 #define LOCK_PROFILE_VAR    s_time_t block = 0
-#define LOCK_PROFILE_BLOCK  block = block ? : NOW();
+#define LOCK_PROFILE_BLOCK                                                   \
+    if ( !block && lock_profile_enabled )                                    \
+        block = NOW();
 #define LOCK_PROFILE_GOT                                                     \
-    if (lock->profile)                                                       \
-    {                                                                        \
-        lock->profile->time_locked = NOW();                                  \
-        if (block)                                                           \
-        {                                                                    \
-            lock->profile->time_block += lock->profile->time_locked - block; \
-            lock->profile->block_cnt++;                                      \
-        }                                                                    \
-    }
+    if ( lock->profile && lock_profile_enabled )                             \
+        lock_profile_got(lock->profile, block, __builtin_return_address(0));
+#define LOCK_PROFILE_GOT_READ                                                \
+    if ( lock->profile && lock_profile_enabled )                             \
+        lock_profile_got_read(lock->profile, block);
 
 #else
 
@@ -112,6 +155,7 @@ void spin_debug_disable(void)
 #define LOCK_PROFILE_VAR
 #define LOCK_PROFILE_BLOCK
 #define LOCK_PROFILE_GOT
+#define LOCK_PROFILE_GOT_READ
 
 #endif
 
@@ -204,8 +248,8 @@ int _spin_trylock(spinlock_t *lock)
     if ( !_raw_spin_trylock(&lock->raw) )
         return 0;
 #ifdef LOCK_PROFILE
-    if (lock->profile)
-        lock->profile->time_locked = NOW();
+    if ( lock->profile && lock_profile_enabled )
+        lock_profile_got(lock->profile, 0, __builtin_return_address(0));
 #endif
     preempt_disable();
     return 1;
@@ -219,11 +263,8 @@ void _spin_barrier(spinlock_t *lock)
 
     check_barrier(&lock->debug);
     do { smp_mb(); loop++;} while ( _raw_spin_is_locked(&lock->raw) );
-    if ((loop > 1) && lock->profile)
-    {
-        lock->profile->time_block += NOW() - block;
-        lock->profile->block_cnt++;
-    }
+    if ( (loop > 1) && lock->profile && lock_profile_enabled )
+        lock_profile_wait(lock->profile, NOW() - block);
 #else
     check_barrier(&lock->debug);
     do { smp_mb(); } while ( _raw_spin_is_locked(&lock->raw) );
@@ -271,42 +312,54 @@ void _spin_unlock_recursive(spinlock_t *lock)
 
 void _read_lock(rwlock_t *lock)
 {
+    LOCK_PROFILE_VAR;
+
     check_lock(&lock->debug);
     while ( unlikely(!_raw_read_trylock(&lock->raw)) )
     {
+        LOCK_PROFILE_BLOCK;
         while ( likely(_raw_rw_is_write_locked(&lock->raw)) )
             cpu_relax();
     }
+    LOCK_PROFILE_GOT_READ;
     preempt_disable();
 }
 
 void _read_lock_irq(rwlock_t *lock)
 {
+    LOCK_PROFILE_VAR;
+
     ASSERT(local_irq_is_enabled());
     local_irq_disable();
     check_lock(&lock->debug);
     while ( unlikely(!_raw_read_trylock(&lock->raw)) )
     {
+        LOCK_PROFILE_BLOCK;
         local_irq_enable();
         while ( likely(_raw_rw_is_write_locked(&lock->raw)) )
             cpu_relax();
         local_irq_disable();
     }
+    LOCK_PROFILE_GOT_READ;
     preempt_disable();
 }
 
 unsigned long _read_lock_irqsave(rwlock_t *lock)
 {
     unsigned long flags;
+    LOCK_PROFILE_VAR;
+
     local_irq_save(flags);
     check_lock(&lock->debug);
     while ( unlikely(!_raw_read_trylock(&lock->raw)) )
     {
+        LOCK_PROFILE_BLOCK;
         local_irq_restore(flags);
         while ( likely(_raw_rw_is_write_locked(&lock->raw)) )
             cpu_relax();
         local_irq_save(flags);
     }
+    LOCK_PROFILE_GOT_READ;
     preempt_disable();
     return flags;
 }
@@ -316,6 +369,10 @@ int _read_trylock(rwlock_t *lock)
     check_lock(&lock->debug);
     if ( !_raw_read_trylock(&lock->raw) )
         return 0;
+#ifdef LOCK_PROFILE
+    if ( lock->profile && lock_profile_enabled )
+        lock_profile_got_read(lock->profile, 0);
+#endif
     preempt_disable();
     return 1;
 }
@@ -342,42 +399,54 @@ void _read_unlock_irqrestore(rwlock_t *lock, unsigned long flags)
 
 void _write_lock(rwlock_t *lock)
 {
+    LOCK_PROFILE_VAR;
+
     check_lock(&lock->debug);
     while ( unlikely(!_raw_write_trylock(&lock->raw)) )
     {
+        LOCK_PROFILE_BLOCK;
         while ( likely(_raw_rw_is_locked(&lock->raw)) )
             cpu_relax();
     }
+    LOCK_PROFILE_GOT;
     preempt_disable();
 }
 
 void _write_lock_irq(rwlock_t *lock)
 {
+    LOCK_PROFILE_VAR;
+
     ASSERT(local_irq_is_enabled());
     local_irq_disable();
     check_lock(&lock->debug);
     while ( unlikely(!_raw_write_trylock(&lock->raw)) )
     {
+        LOCK_PROFILE_BLOCK;
         local_irq_enable();
         while ( likely(_raw_rw_is_locked(&lock->raw)) )
             cpu_relax();
         local_irq_disable();
     }
+    LOCK_PROFILE_GOT;
     preempt_disable();
 }
 
 unsigned long _write_lock_irqsave(rwlock_t *lock)
 {
     unsigned long flags;
+    LOCK_PROFILE_VAR;
+
     local_irq_save(flags);
     check_lock(&lock->debug);
     while ( unlikely(!_raw_write_trylock(&lock->raw)) )
     {
+        LOCK_PROFILE_BLOCK;
         local_irq_restore(flags);
         while ( likely(_raw_rw_is_locked(&lock->raw)) )
             cpu_relax();
         local_irq_save(flags);
     }
+    LOCK_PROFILE_GOT;
     preempt_disable();
     return flags;
 }
@@ -387,6 +456,10 @@ int _write_trylock(rwlock_t *lock)
     check_lock(&lock->debug);
     if ( !_raw_write_trylock(&lock->raw) )
         return 0;
+#ifdef LOCK_PROFILE
+    if ( lock->profile && lock_profile_enabled )
+        lock_profile_got(lock->profile, 0, __builtin_return_address(0));
+#endif
     preempt_disable();
     return 1;
 }
@@ -394,12 +467,14 @@ int _write_trylock(rwlock_t *lock)
 void _write_unlock(rwlock_t *lock)
 {
     preempt_enable();
+    LOCK_PROFILE_REL;
     _raw_write_unlock(&lock->raw);
 }
 
 void _write_unlock_irq(rwlock_t *lock)
 {
     preempt_enable();
+    LOCK_PROFILE_REL;
     _raw_write_unlock(&lock->raw);
     local_irq_enable();
 }
@@ -407,6 +482,7 @@ void _write_unlock_irq(rwlock_t *lock)
 void _write_unlock_irqrestore(rwlock_t *lock, unsigned long flags)
 {
     preempt_enable();
+    LOCK_PROFILE_REL;
     _raw_write_unlock(&lock->raw);
     local_irq_restore(flags);
 }
@@ -466,6 +542,9 @@ static void spinlock_profile_print_elem(struct lock_profile *data,
            data->lock_cnt, (u32)(data->time_hold >> 32), (u32)data->time_hold,
            data->block_cnt, (u32)(data->time_block >> 32),
            (u32)data->time_block);
+    if ( data->hold_max )
+        printk("  longest hold:%"PRId64"ns at %pS\n",
+               data->hold_max, data->hold_max_site);
 }
 
 void spinlock_profile_printall(unsigned char key)
@@ -475,8 +554,8 @@ void spinlock_profile_printall(unsigned char key)
 
     diff = now - lock_profile_start;
     printk("Xen lock profile info SHOW  (now = %08X:%08X, "
-        "total = %08X:%08X)\n", (u32)(now>>32), (u32)now,
-        (u32)(diff>>32), (u32)diff);
+        "total = %08X:%08X)%s\n", (u32)(now>>32), (u32)now,
+        (u32)(diff>>32), (u32)diff, lock_profile_enabled ? "" : " stopped");
     spinlock_profile_iterate(spinlock_profile_print_elem, NULL);
 }
 
@@ -487,6 +566,9 @@ static void spinlock_profile_reset_elem(struct lock_profile *data,
     data->block_cnt = 0;
     data->time_hold = 0;
     data->time_block = 0;
+    data->hold_max = 0;
+    data->hold_max_site = NULL;
+    memset(data->block_hist, 0, sizeof(data->block_hist));
 }
 
 void spinlock_profile_reset(unsigned char key)
@@ -516,6 +598,7 @@ static void spinlock_profile_ucopy_elem(struct lock_profile *data,
 
     if ( p->pc->nr_elem < p->pc->max_elem )
     {
+        memset(&elem, 0, sizeof(elem));
         safe_strcpy(elem.name, data->name);
         elem.type = type;
         elem.idx = idx;
@@ -523,6 +606,10 @@ static void spinlock_profile_ucopy_elem(struct lock_profile *data,
         elem.block_cnt = data->block_cnt;
         elem.lock_time = data->time_hold;
         elem.block_time = data->time_block;
+        memcpy(elem.block_hist, data->block_hist, sizeof(elem.block_hist));
+        elem.hold_max = data->hold_max;
+        elem.hold_max_site = (unsigned long)data->hold_max_site;
+        elem.flags = data->is_rw ? LOCKPROF_FLAG_RW : 0;
         if ( copy_to_guest_offset(p->pc->data, p->pc->nr_elem, &elem, 1) )
             p->rc = -EFAULT;
     }
@@ -548,8 +635,15 @@ int spinlock_profile_control(xen_sysctl_lockprof_op_t *pc)
         par.pc = pc;
         spinlock_profile_iterate(spinlock_profile_ucopy_elem, &par);
         pc->time = NOW() - lock_profile_start;
+        pc->stopped = !lock_profile_enabled;
         rc = par.rc;
         break;
+    case XEN_SYSCTL_LOCKPROF_start:
+        lock_profile_enabled = 1;
+        break;
+    case XEN_SYSCTL_LOCKPROF_stop:
+        lock_profile_enabled = 0;
+        break;
     default:
         rc = -EINVAL;
         break;
@@ -594,7 +688,10 @@ static int __init lock_prof_init(void)
     {
         (*q)->next = lock_profile_glb_q.elem_q;
         lock_profile_glb_q.elem_q = *q;
-        (*q)->lock->profile = *q;
+        if ( (*q)->is_rw )
+            (*q)->u.rwlock->profile = *q;
+        else
+            (*q)->u.lock->profile = *q;
     }
 
     _lock_profile_register_struct(
@@ -27,6 +27,8 @@
 #include <xsm/xsm.h>
 #include <xen/pmstat.h>
 #include <xen/gcov.h>
+#include <xen/v4v.h>
+#include <xen/grant_table.h>
 
 long do_sysctl(XEN_GUEST_HANDLE_PARAM(xen_sysctl_t) u_sysctl)
 {
@@ -356,6 +358,127 @@ long do_sysctl(XEN_GUEST_HANDLE_PARAM(xen_sysctl_t) u_sysctl)
     }
     break;
 
+    case XEN_SYSCTL_v4v_domstats:
+    {
+        struct domain *d;
+
+        ret = -ESRCH;
+        d = rcu_lock_domain_by_id(op->u.v4v_domstats.domid);
+        if ( d == NULL )
+            break;
+
+        ret = xsm_getdomaininfo(XSM_HOOK, d);
+        if ( !ret )
+            ret = v4v_domstats(d, &op->u.v4v_domstats);
+        rcu_unlock_domain(d);
+        if ( !ret )
+            copyback = 1;
+    }
+    break;
+
+    case XEN_SYSCTL_gnttab_domstats:
+    {
+        struct domain *d;
+
+        ret = -ESRCH;
+        d = rcu_lock_domain_by_id(op->u.gnttab_domstats.domid);
+        if ( d == NULL )
+            break;
+
+        ret = xsm_getdomaininfo(XSM_HOOK, d);
+        if ( !ret )
+            ret = gnttab_domstats(d, &op->u.gnttab_domstats);
+        rcu_unlock_domain(d);
+        if ( !ret )
+            copyback = 1;
+    }
+    break;
+
+#ifdef EVTCHN_STATS
+    case XEN_SYSCTL_evtchn_hotports:
+    {
+        struct domain *d;
+
+        ret = -ESRCH;
+        d = rcu_lock_domain_by_id(op->u.evtchn_hotports.domid);
+        if ( d == NULL )
+            break;
+
+        ret = xsm_getdomaininfo(XSM_HOOK, d);
+        if ( !ret )
+            ret = evtchn_hotports(d, &op->u.evtchn_hotports);
+        rcu_unlock_domain(d);
+        if ( !ret )
+            copyback = 1;
+    }
+    break;
+#endif
+
+    case XEN_SYSCTL_sched_vcpustats:
+    {
+        struct domain *d;
+
+        ret = -ESRCH;
+        d = rcu_lock_domain_by_id(op->u.sched_vcpustats.domid);
+        if ( d == NULL )
+            break;
+
+        ret = xsm_getdomaininfo(XSM_HOOK, d);
+        if ( !ret )
+            ret = sched_vcpustats(d, &op->u.sched_vcpustats);
+        rcu_unlock_domain(d);
+        if ( !ret )
+            copyback = 1;
+    }
+    break;
+
+    case XEN_SYSCTL_domstats:
+    {
+        struct domain *d;
+        struct xen_sysctl_domstats_ent ent;
+        uint32_t num_domains = 0;
+
+        ret = 0;
+        rcu_read_lock(&domlist_read_lock);
+
+        for_each_domain ( d )
+        {
+            if ( d->domain_id < op->u.domstats.first_domain )
+                continue;
+            if ( num_domains == op->u.domstats.max_domains )
+                break;
+
+            if ( xsm_getdomaininfo(XSM_HOOK, d) )
+                continue;
+
+            memset(&ent, 0, sizeof(ent));
+            getdomaininfo(d, &ent.info);
+            ent.v4v.domid = ent.gnttab.domid = d->domain_id;
+            if ( !v4v_domstats(d, &ent.v4v) )
+                ent.flags |= XEN_SYSCTL_DOMSTATS_V4V;
+            if ( !gnttab_domstats(d, &ent.gnttab) )
+                ent.flags |= XEN_SYSCTL_DOMSTATS_GNTTAB;
+            sched_domstats(d, &ent.sched);
+
+            if ( copy_to_guest_offset(op->u.domstats.buffer,
+                                      num_domains, &ent, 1) )
+            {
+                ret = -EFAULT;
+                break;
+            }
+
+            num_domains++;
+        }
+
+        rcu_read_unlock(&domlist_read_lock);
+
+        if ( ret != 0 )
+            break;
+
+        op->u.domstats.num_domains = num_domains;
+    }
+    break;
+
 #ifdef TEST_COVERAGE
     case XEN_SYSCTL_coverage_op:
         ret = sysctl_coverage_op(&op->u.coverage_op);
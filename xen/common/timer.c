@@ -29,10 +29,33 @@
 static unsigned int timer_slop __read_mostly = 50000; /* 50 us */
 integer_param("timer_slop", timer_slop);
 
+/* Keep the timers which aren't due soon on a timer wheel. */
+static bool_t __read_mostly opt_timer_wheel;
+boolean_param("timer_wheel", opt_timer_wheel);
+
+#define WHEEL_LEVELS       4
+#define WHEEL_SLOT_BITS    6
+#define WHEEL_SLOTS        (1u << WHEEL_SLOT_BITS)
+/* Slots of level 0 span 2^20ns (~1ms), those of level 1 2^26ns, &c. */
+#define WHEEL_SHIFT(l)     (20 + (l) * WHEEL_SLOT_BITS)
+#define WHEEL_SPAN(l)      ((s_time_t)1 << WHEEL_SHIFT(l))
+#define WHEEL_POS(l, s)    (((l) << WHEEL_SLOT_BITS) | (s))
+#define WHEEL_POS_LEVEL(p) ((p) >> WHEEL_SLOT_BITS)
+#define WHEEL_POS_SLOT(p)  ((p) & (WHEEL_SLOTS - 1))
+
+struct timer_wheel {
+    /* Timers due before clk + WHEEL_SPAN(0) are on the heap, or list. */
+    s_time_t         clk;
+    unsigned int     nr;
+    unsigned long    pending[WHEEL_LEVELS][BITS_TO_LONGS(WHEEL_SLOTS)];
+    struct list_head slot[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
 struct timers {
     spinlock_t     lock;
     struct timer **heap;
     struct timer  *list;
+    struct timer_wheel *wheel;
     struct timer  *running;
     struct list_head inactive;
 } __cacheline_aligned;
@@ -167,6 +190,140 @@ static int add_to_list(struct timer **pprev, struct timer *t)
 }
 
 
+/****************************************************************************
+ * TIMER WHEEL OPERATIONS.
+ *
+ * With timer_wheel, a timer due at least a level 0 slot after the clock
+ * of the wheel goes in the slot of the lowest level which spans its
+ * expiry, in O(1), and comes out of it in O(1) when stopped before
+ * expiry, as most are. When the clock reaches a slot its timers are
+ * moved down a level, or to the heap from level 0, which so only holds
+ * the timers due within a millisecond or two. The hardware is programmed
+ * for the start of the earliest slot holding timers, if before the top
+ * of the heap, so that they get there in time.
+ */
+
+/* Add @t to @w, unless it is due too soon. Return TRUE if added. */
+static int add_to_wheel(struct timer_wheel *w, struct timer *t,
+                        s_time_t *start)
+{
+    s_time_t idx, clk_idx = 0;
+    unsigned int l, slot;
+
+    if ( t->expires < w->clk + WHEEL_SPAN(0) )
+        return 0;
+
+    for ( l = 0; l < WHEEL_LEVELS; l++ )
+    {
+        idx = t->expires >> WHEEL_SHIFT(l);
+        clk_idx = w->clk >> WHEEL_SHIFT(l);
+        if ( idx - clk_idx < WHEEL_SLOTS )
+            break;
+    }
+
+    /* Beyond the wheel: wait in its last slot, and be placed from there. */
+    if ( l == WHEEL_LEVELS )
+    {
+        l = WHEEL_LEVELS - 1;
+        idx = clk_idx + WHEEL_SLOTS - 1;
+    }
+
+    slot = idx & (WHEEL_SLOTS - 1);
+    list_add_tail(&t->wheel, &w->slot[l][slot]);
+    __set_bit(slot, w->pending[l]);
+    t->wheel_pos = WHEEL_POS(l, slot);
+    w->nr++;
+
+    *start = idx << WHEEL_SHIFT(l);
+    return 1;
+}
+
+static void remove_from_wheel(struct timer_wheel *w, struct timer *t)
+{
+    unsigned int l = WHEEL_POS_LEVEL(t->wheel_pos);
+    unsigned int slot = WHEEL_POS_SLOT(t->wheel_pos);
+
+    list_del(&t->wheel);
+    if ( list_empty(&w->slot[l][slot]) )
+        __clear_bit(slot, w->pending[l]);
+    w->nr--;
+}
+
+/* Start of the earliest slot of @w holding timers, STIME_MAX if none. */
+static s_time_t wheel_next_event(struct timer_wheel *w)
+{
+    s_time_t start, next = STIME_MAX;
+    unsigned int l, cur, slot;
+
+    if ( w->nr == 0 )
+        return STIME_MAX;
+
+    for ( l = 0; l < WHEEL_LEVELS; l++ )
+    {
+        cur = (w->clk >> WHEEL_SHIFT(l)) & (WHEEL_SLOTS - 1);
+        slot = find_next_bit(w->pending[l], WHEEL_SLOTS, cur);
+        if ( slot >= WHEEL_SLOTS )
+            slot = find_first_bit(w->pending[l], WHEEL_SLOTS);
+        if ( slot >= WHEEL_SLOTS )
+            continue;
+
+        start = ((w->clk >> WHEEL_SHIFT(l)) +
+                 ((slot - cur) & (WHEEL_SLOTS - 1))) << WHEEL_SHIFT(l);
+        if ( start < next )
+            next = start;
+    }
+
+    return next;
+}
+
+static int add_entry(struct timer *t);
+
+/* Move the clock of @ts's wheel up to @now, emptying the slots it meets. */
+static void wheel_advance(struct timers *ts, s_time_t now)
+{
+    struct timer_wheel *w = ts->wheel;
+    struct timer *t;
+    LIST_HEAD(due);
+    unsigned int slot;
+    s_time_t next;
+    int l;
+
+    while ( w->clk + WHEEL_SPAN(0) <= now )
+    {
+        /* Skip the empty slots at once, idle cpus have lots of them. */
+        next = wheel_next_event(w);
+        if ( next > now )
+        {
+            w->clk = now & ~(WHEEL_SPAN(0) - 1);
+            break;
+        }
+        ASSERT(next > w->clk);
+        w->clk = next;
+
+        /* Higher levels first, their timers may land in the level 0 slot. */
+        for ( l = WHEEL_LEVELS - 1; l >= 0; l-- )
+        {
+            if ( w->clk & (WHEEL_SPAN(l) - 1) )
+                continue;
+            slot = (w->clk >> WHEEL_SHIFT(l)) & (WHEEL_SLOTS - 1);
+            if ( !test_bit(slot, w->pending[l]) )
+                continue;
+
+            list_splice_init(&w->slot[l][slot], &due);
+            __clear_bit(slot, w->pending[l]);
+            while ( !list_empty(&due) )
+            {
+                t = list_entry(due.next, struct timer, wheel);
+                list_del(&t->wheel);
+                w->nr--;
+                t->status = TIMER_STATUS_invalid;
+                add_entry(t);
+            }
+        }
+    }
+}
+
+
 /****************************************************************************
  * TIMER OPERATIONS.
  */
@@ -184,6 +341,11 @@ static int remove_entry(struct timer *t)
     case TIMER_STATUS_in_list:
         rc = remove_from_list(&timers->list, t);
         break;
+    case TIMER_STATUS_in_wheel:
+        /* The hardware may fire early for it, which is harmless. */
+        remove_from_wheel(timers->wheel, t);
+        rc = 0;
+        break;
     default:
         rc = 0;
         BUG();
@@ -196,10 +358,19 @@ static int remove_entry(struct timer *t)
 static int add_entry(struct timer *t)
 {
     struct timers *timers = &per_cpu(timers, t->cpu);
+    s_time_t start, deadline;
     int rc;
 
     ASSERT(t->status == TIMER_STATUS_invalid);
 
+    /* Not due soon: onto the wheel, if the cpu has one. */
+    if ( (timers->wheel != NULL) && add_to_wheel(timers->wheel, t, &start) )
+    {
+        t->status = TIMER_STATUS_in_wheel;
+        deadline = per_cpu(timer_deadline, t->cpu);
+        return (deadline == 0) || (start < deadline);
+    }
+
     /* Try to add to heap. t->heap_offset indicates whether we succeed. */
     t->heap_offset = 0;
     t->status = TIMER_STATUS_in_heap;
@@ -277,7 +448,7 @@ static inline void timer_unlock(struct timer *timer)
 static bool_t active_timer(struct timer *timer)
 {
     ASSERT(timer->status >= TIMER_STATUS_inactive);
-    ASSERT(timer->status <= TIMER_STATUS_in_list);
+    ASSERT(timer->status <= TIMER_STATUS_in_wheel);
     return (timer->status >= TIMER_STATUS_in_heap);
 }
 
@@ -461,6 +632,10 @@ static void timer_softirq_action(void)
 
     now = NOW();
 
+    /* Bring the timers of the wheel due soon to the heap. */
+    if ( ts->wheel != NULL )
+        wheel_advance(ts, now);
+
     /* Execute ready heap timers. */
     while ( (GET_HEAP_SIZE(heap) != 0) &&
             ((t = heap[1])->expires < now) )
@@ -492,6 +667,8 @@ static void timer_softirq_action(void)
         deadline = heap[1]->expires;
     if ( (ts->list != NULL) && (ts->list->expires < deadline) )
         deadline = ts->list->expires;
+    if ( ts->wheel != NULL )
+        deadline = min(deadline, wheel_next_event(ts->wheel));
     now = NOW();
     this_cpu(timer_deadline) =
         (deadline == STIME_MAX) ? 0 : MAX(deadline, now + timer_slop);
@@ -522,7 +699,7 @@ static void dump_timerq(unsigned char key)
     struct timers *ts;
     unsigned long  flags;
     s_time_t       now = NOW();
-    int            i, j;
+    int            i, j, l;
 
     printk("Dumping timer queues:\n");
 
@@ -536,6 +713,14 @@ static void dump_timerq(unsigned char key)
             dump_timer(ts->heap[j], now);
         for ( t = ts->list, j = 0; t != NULL; t = t->list_next, j++ )
             dump_timer(t, now);
+        if ( ts->wheel != NULL )
+        {
+            printk(" wheel: %u timers\n", ts->wheel->nr);
+            for ( l = 0; l < WHEEL_LEVELS; l++ )
+                for ( j = 0; j < WHEEL_SLOTS; j++ )
+                    list_for_each_entry ( t, &ts->wheel->slot[l][j], wheel )
+                        dump_timer(t, now);
+        }
         spin_unlock_irqrestore(&ts->lock, flags);
     }
 }
@@ -552,6 +737,7 @@ static void migrate_timers_from_cpu(unsigned int old_cpu)
     struct timers *old_ts, *new_ts;
     struct timer *t;
     bool_t notify = 0;
+    unsigned int l, slot;
 
     ASSERT(!cpu_online(old_cpu) && cpu_online(new_cpu));
 
@@ -577,6 +763,17 @@ static void migrate_timers_from_cpu(unsigned int old_cpu)
         notify |= add_entry(t);
     }
 
+    for ( l = 0; old_ts->wheel && old_ts->wheel->nr && l < WHEEL_LEVELS; l++ )
+        for ( slot = 0; slot < WHEEL_SLOTS; slot++ )
+            while ( !list_empty(&old_ts->wheel->slot[l][slot]) )
+            {
+                t = list_entry(old_ts->wheel->slot[l][slot].next,
+                               struct timer, wheel);
+                remove_entry(t);
+                write_atomic(&t->cpu, new_cpu);
+                notify |= add_entry(t);
+            }
+
     while ( !list_empty(&old_ts->inactive) )
     {
         t = list_entry(old_ts->inactive.next, struct timer, inactive);
@@ -594,6 +791,28 @@ static void migrate_timers_from_cpu(unsigned int old_cpu)
 
 static struct timer *dummy_heap;
 
+/* Without one, the cpu just keeps all its timers on the heap. */
+static void alloc_wheel(struct timers *ts)
+{
+    struct timer_wheel *w = ts->wheel;
+    unsigned int l, slot;
+
+    if ( w == NULL )
+    {
+        w = xzalloc(struct timer_wheel);
+        if ( w == NULL )
+            return;
+        for ( l = 0; l < WHEEL_LEVELS; l++ )
+            for ( slot = 0; slot < WHEEL_SLOTS; slot++ )
+                INIT_LIST_HEAD(&w->slot[l][slot]);
+    }
+
+    /* Empty, as left by migrate_timers_from_cpu() if it was used before. */
+    ASSERT(w->nr == 0);
+    w->clk = NOW() & ~(WHEEL_SPAN(0) - 1);
+    ts->wheel = w;
+}
+
 static int cpu_callback(
     struct notifier_block *nfb, unsigned long action, void *hcpu)
 {
@@ -606,6 +825,8 @@ static int cpu_callback(
         INIT_LIST_HEAD(&ts->inactive);
         spin_lock_init(&ts->lock);
         ts->heap = &dummy_heap;
+        if ( opt_timer_wheel )
+            alloc_wheel(ts);
         break;
     case CPU_UP_CANCELED:
     case CPU_DEAD:
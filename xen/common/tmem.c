@@ -188,6 +188,7 @@ struct tmem_page_content_descriptor {
     struct list_head pgp_list;
     struct rb_node pcd_rb_tree_node;
     uint32_t pgp_ref_count;
+    uint32_t fingerprint; /* tmem_crc32c() of the data, tree sorted on it first */
     pagesize_t size; /* if compression_enabled -> 0<size<PAGE_SIZE (*cdata)
                      * else if tze, 0<=size<PAGE_SIZE, rounded up to mult of 8
                      * else PAGE_SIZE -> *pfp */
@@ -466,6 +467,7 @@ static int pcd_associate(struct tmem_page_descriptor *pgp, char *cdata, pagesize
     int cmp;
     pagesize_t pfp_size = 0;
     uint8_t firstbyte = (cdata == NULL) ? tmem_get_first_byte(pgp->pfp) : *cdata;
+    uint32_t fingerprint;
     int ret = 0;
 
     if ( !tmem_dedup_enabled() )
@@ -485,7 +487,10 @@ static int pcd_associate(struct tmem_page_descriptor *pgp, char *cdata, pagesize
         }
         ASSERT(pfp_size <= PAGE_SIZE);
         ASSERT(!(pfp_size & (sizeof(uint64_t)-1)));
+        fingerprint = tmem_pfp_fingerprint(pgp->pfp, pfp_size);
     }
+    else
+        fingerprint = tmem_crc32c(~0U, cdata, csize);
     write_lock(&pcd_tree_rwlocks[firstbyte]);
 
     /* look for page match */
@@ -496,7 +501,10 @@ static int pcd_associate(struct tmem_page_descriptor *pgp, char *cdata, pagesize
         pcd = container_of(*new, struct tmem_page_content_descriptor, pcd_rb_tree_node);
         parent = *new;
         /* compare new entry and rbtree entry, set cmp accordingly */
-        if ( cdata != NULL )
+        if ( fingerprint != pcd->fingerprint )
+            /* differing fingerprints, no need to look at the data */
+            cmp = (fingerprint < pcd->fingerprint) ? -1 : 1;
+        else if ( cdata != NULL )
         {
             if ( pcd->size < PAGE_SIZE )
                 /* both new entry and rbtree entry are compressed */
@@ -554,6 +562,7 @@ static int pcd_associate(struct tmem_page_descriptor *pgp, char *cdata, pagesize
     RB_CLEAR_NODE(&pcd->pcd_rb_tree_node);  /* is this necessary */
     INIT_LIST_HEAD(&pcd->pgp_list);  /* is this necessary */
     pcd->pgp_ref_count = 0;
+    pcd->fingerprint = fingerprint;
     if ( cdata != NULL )
     {
         memcpy(pcd->cdata,cdata,csize);
@@ -2618,16 +2627,68 @@ static int do_tmem_control(struct tmem_op *op)
 
 /************ EXPORTed FUNCTIONS **************************************/
 
+static bool_t tmem_is_page_op(uint32_t cmd)
+{
+    switch ( cmd )
+    {
+    case TMEM_CONTROL:
+    case TMEM_AUTH:
+    case TMEM_RESTORE_NEW:
+    case TMEM_NEW_POOL:
+    case TMEM_DESTROY_POOL:
+        return 0;
+    }
+    return 1;
+}
+
+/* operations on the pages of one of client's pools, tmem_rwlock held */
+static int do_tmem_page_op(struct client *client, struct tmem_op *op)
+{
+    struct tmem_pool *pool;
+    struct oid *oidp;
+    int rc;
+
+    if ( ((uint32_t)op->pool_id >= MAX_POOLS_PER_DOMAIN) ||
+         ((pool = client->pools[op->pool_id]) == NULL) )
+    {
+        tmem_client_err("tmem: operation requested on uncreated pool\n");
+        return -ENODEV;
+    }
+
+    oidp = (struct oid *)&op->u.gen.oid[0];
+    switch ( op->cmd )
+    {
+    case TMEM_PUT_PAGE:
+        if (tmem_ensure_avail_pages())
+            rc = do_tmem_put(pool, oidp, op->u.gen.index, op->u.gen.cmfn,
+                        tmem_cli_buf_null);
+        else
+            rc = -ENOMEM;
+        break;
+    case TMEM_GET_PAGE:
+        rc = do_tmem_get(pool, oidp, op->u.gen.index, op->u.gen.cmfn,
+                        tmem_cli_buf_null);
+        break;
+    case TMEM_FLUSH_PAGE:
+        rc = do_tmem_flush_page(pool, oidp, op->u.gen.index);
+        break;
+    case TMEM_FLUSH_OBJECT:
+        rc = do_tmem_flush_object(pool, oidp);
+        break;
+    default:
+        tmem_client_warn("tmem: op %d not implemented\n", op->cmd);
+        rc = -ENOSYS;
+        break;
+    }
+
+    return rc;
+}
+
 long do_tmem_op(tmem_cli_op_t uops)
 {
     struct tmem_op op;
     struct client *client = current->domain->tmem_client;
-    struct tmem_pool *pool = NULL;
-    struct oid *oidp;
     int rc = 0;
-    bool_t succ_get = 0, succ_put = 0;
-    bool_t non_succ_get = 0, non_succ_put = 0;
-    bool_t flush = 0, flush_obj = 0;
 
     if ( !tmem_initialized )
         return -ENODEV;
@@ -2650,7 +2711,22 @@ long do_tmem_op(tmem_cli_op_t uops)
         return -EFAULT;
     }
 
-    /* Acquire wirte lock for all command at first */
+    /*
+     * Page operations only need the read lock, pools are created and
+     * destroyed under the write lock.  Readers run concurrently, under the
+     * locks of the pool and object they use.
+     */
+    if ( client != NULL && tmem_is_page_op(op.cmd) )
+    {
+        read_lock(&tmem_rwlock);
+        rc = do_tmem_page_op(client, &op);
+        read_unlock(&tmem_rwlock);
+        if ( rc < 0 )
+            errored_tmem_ops++;
+        return rc;
+    }
+
+    /* Acquire write lock for the other commands */
     write_lock(&tmem_rwlock);
 
     if ( op.cmd == TMEM_CONTROL )
@@ -2683,67 +2759,14 @@ long do_tmem_op(tmem_cli_op_t uops)
             }
         }
 
-        if ( op.cmd == TMEM_NEW_POOL || op.cmd == TMEM_DESTROY_POOL )
-        {
-            if ( op.cmd == TMEM_NEW_POOL )
-                rc = do_tmem_new_pool(TMEM_CLI_ID_NULL, 0, op.u.creat.flags,
-                                op.u.creat.uuid[0], op.u.creat.uuid[1]);
-	        else
-                rc = do_tmem_destroy_pool(op.pool_id);
-        }
+        if ( op.cmd == TMEM_NEW_POOL )
+            rc = do_tmem_new_pool(TMEM_CLI_ID_NULL, 0, op.u.creat.flags,
+                            op.u.creat.uuid[0], op.u.creat.uuid[1]);
+        else if ( op.cmd == TMEM_DESTROY_POOL )
+            rc = do_tmem_destroy_pool(op.pool_id);
         else
-        {
-            if ( ((uint32_t)op.pool_id >= MAX_POOLS_PER_DOMAIN) ||
-                 ((pool = client->pools[op.pool_id]) == NULL) )
-            {
-                tmem_client_err("tmem: operation requested on uncreated pool\n");
-                rc = -ENODEV;
-                goto out;
-            }
-            /* Commands only need read lock */
-            write_unlock(&tmem_rwlock);
-            read_lock(&tmem_rwlock);
-
-            oidp = (struct oid *)&op.u.gen.oid[0];
-            switch ( op.cmd )
-            {
-            case TMEM_NEW_POOL:
-            case TMEM_DESTROY_POOL:
-                BUG(); /* Done earlier. */
-                break;
-            case TMEM_PUT_PAGE:
-                if (tmem_ensure_avail_pages())
-                    rc = do_tmem_put(pool, oidp, op.u.gen.index, op.u.gen.cmfn,
-                                tmem_cli_buf_null);
-                else
-                    rc = -ENOMEM;
-                if (rc == 1) succ_put = 1;
-                else non_succ_put = 1;
-                break;
-            case TMEM_GET_PAGE:
-                rc = do_tmem_get(pool, oidp, op.u.gen.index, op.u.gen.cmfn,
-                                tmem_cli_buf_null);
-                if (rc == 1) succ_get = 1;
-                else non_succ_get = 1;
-                break;
-            case TMEM_FLUSH_PAGE:
-                flush = 1;
-                rc = do_tmem_flush_page(pool, oidp, op.u.gen.index);
-                break;
-            case TMEM_FLUSH_OBJECT:
-                rc = do_tmem_flush_object(pool, oidp);
-                flush_obj = 1;
-                break;
-            default:
-                tmem_client_warn("tmem: op %d not implemented\n", op.cmd);
-                rc = -ENOSYS;
-                break;
-            }
-            read_unlock(&tmem_rwlock);
-            if ( rc < 0 )
-                errored_tmem_ops++;
-            return rc;
-        }
+            /* a client just created has no pool yet */
+            rc = do_tmem_page_op(client, &op);
     }
 out:
     write_unlock(&tmem_rwlock);
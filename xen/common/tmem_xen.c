@@ -238,6 +238,55 @@ int tmem_copy_tze_to_client(xen_pfn_t cmfn, void *tmem_va,
     return 1;
 }
 
+/*
+ * CRC32C, slicing by 8: the first table is the bytewise one, entry i of the
+ * next ones is that of i followed by 1...7 zero bytes.
+ */
+#define CRC32C_POLY 0x82f63b78 /* reflected */
+static uint32_t crc32c_table[8][256];
+
+static void __init crc32c_init(void)
+{
+    uint32_t crc;
+    unsigned int i, j;
+
+    for ( i = 0; i < 256; i++ )
+    {
+        crc = i;
+        for ( j = 0; j < 8; j++ )
+            crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+        crc32c_table[0][i] = crc;
+    }
+    for ( i = 0; i < 256; i++ )
+        for ( j = 1; j < 8; j++ )
+            crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^
+                                 crc32c_table[0][crc32c_table[j - 1][i] & 0xff];
+}
+
+uint32_t tmem_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    uint64_t v;
+
+    for ( ; len >= sizeof(v); len -= sizeof(v), p += sizeof(v) )
+    {
+        memcpy(&v, p, sizeof(v));
+        v ^= crc;
+        crc = crc32c_table[7][v & 0xff] ^
+              crc32c_table[6][(v >> 8) & 0xff] ^
+              crc32c_table[5][(v >> 16) & 0xff] ^
+              crc32c_table[4][(v >> 24) & 0xff] ^
+              crc32c_table[3][(v >> 32) & 0xff] ^
+              crc32c_table[2][(v >> 40) & 0xff] ^
+              crc32c_table[1][(v >> 48) & 0xff] ^
+              crc32c_table[0][v >> 56];
+    }
+    for ( ; len; len--, p++ )
+        crc = crc32c_table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
 /******************  XEN-SPECIFIC HOST INITIALIZATION ********************/
 static int dstmem_order, workmem_order;
 
@@ -291,6 +340,8 @@ int __init tmem_init(void)
 {
     unsigned int cpu;
 
+    crc32c_init();
+
     dstmem_order = get_order_from_pages(LZO_DSTMEM_PAGES);
     workmem_order = get_order_from_bytes(LZO1X_1_MEM_COMPRESS);
 
@@ -53,13 +53,18 @@ integer_param("tevt_mask", opt_tevt_mask);
 static struct t_info *t_info;
 static unsigned int t_info_pages;
 
+/*
+ * A CPU only writes its own buffer, with interrupts disabled: nothing
+ * else produces into it, and the consumer only moves cons.
+ */
 static DEFINE_PER_CPU_READ_MOSTLY(struct t_buf *, t_bufs);
-static DEFINE_PER_CPU_READ_MOSTLY(spinlock_t, t_lock);
 static u32 data_size __read_mostly;
 
 /* High water mark for trace buffers; */
 /* Send virtual interrupt when buffer level reaches this point */
 static u32 t_buf_highwater;
+/* ... given as a percentage of the buffer size */
+static unsigned int t_buf_highwater_pct = 50;
 
 /* Number of records lost due to per-CPU trace buffer being full. */
 static DEFINE_PER_CPU(unsigned long, lost_records);
@@ -75,25 +80,15 @@ static cpumask_t tb_cpu_mask;
 /* which tracing events are enabled */
 static u32 tb_event_mask = TRC_ALL;
 
+/* Record 1 in tb_sample[c] events of class bit c, all if 0 or 1. */
+#define TRC_NR_CLASSES 12
+static unsigned int tb_sample[TRC_NR_CLASSES];
+static DEFINE_PER_CPU(unsigned int[TRC_NR_CLASSES], tb_sample_count);
+
 /* Return the number of elements _type necessary to store at least _x bytes of data
  * i.e., sizeof(_type) * ans >= _x. */
 #define fit_to_type(_type, _x) (((_x)+sizeof(_type)-1) / sizeof(_type))
 
-static int cpu_callback(
-    struct notifier_block *nfb, unsigned long action, void *hcpu)
-{
-    unsigned int cpu = (unsigned long)hcpu;
-
-    if ( action == CPU_UP_PREPARE )
-        spin_lock_init(&per_cpu(t_lock, cpu));
-
-    return NOTIFY_DONE;
-}
-
-static struct notifier_block cpu_nfb = {
-    .notifier_call = cpu_callback
-};
-
 static uint32_t calc_tinfo_first_offset(void)
 {
     int offset_in_bytes = offsetof(struct t_info, mfn_offset[NR_CPUS]);
@@ -168,7 +163,7 @@ static int calculate_tbuf_size(unsigned int pages, uint16_t t_info_first_offset)
  */
 static int alloc_trace_bufs(unsigned int pages)
 {
-    int i, cpu;
+    int i, cpu, nr = 0;
     /* Start after a fixed-size array of NR_CPUS */
     uint32_t *t_info_mfn_list;
     uint16_t t_info_first_offset;
@@ -201,7 +196,11 @@ static int alloc_trace_bufs(unsigned int pages)
      */
     for_each_online_cpu(cpu)
     {
-        offset = t_info_first_offset + (cpu * pages);
+        /*
+         * Packed in the order of the online cpus, which is what
+         * calculate_tbuf_size() sized t_info and the offsets for.
+         */
+        offset = t_info_first_offset + (nr++ * pages);
         t_info->mfn_offset[cpu] = offset;
 
         for ( i = 0; i < pages; i++ )
@@ -226,8 +225,6 @@ static int alloc_trace_bufs(unsigned int pages)
         struct t_buf *buf;
         struct page_info *pg;
 
-        spin_lock_init(&per_cpu(t_lock, cpu));
-
         offset = t_info->mfn_offset[cpu];
 
         /* Initialize the buffer metadata */
@@ -251,7 +248,7 @@ static int alloc_trace_bufs(unsigned int pages)
             virt_to_page(t_info) + i, XENSHARE_readonly);
 
     data_size  = (pages * PAGE_SIZE - sizeof(struct t_buf));
-    t_buf_highwater = data_size >> 1; /* 50% high water */
+    t_buf_highwater = data_size / 100 * t_buf_highwater_pct;
     opt_tbuf_size = pages;
 
     printk("xentrace: initialised\n");
@@ -342,7 +339,6 @@ int trace_will_trace_event(u32 event)
 void __init init_trace_bufs(void)
 {
     cpumask_setall(&tb_cpu_mask);
-    register_cpu_notifier(&cpu_nfb);
 
     if ( opt_tbuf_size )
     {
@@ -362,6 +358,11 @@ void __init init_trace_bufs(void)
     }
 }
 
+static void clear_lost_records(void *unused)
+{
+    this_cpu(lost_records) = 0;
+}
+
 /**
  * tb_control - sysctl operations on trace buffers.
  * @tbc: a pointer to a xen_sysctl_tbuf_op_t to be filled out
@@ -398,6 +399,27 @@ int tb_control(xen_sysctl_tbuf_op_t *tbc)
     case XEN_SYSCTL_TBUFOP_set_size:
         rc = tb_set_size(tbc->size);
         break;
+    case XEN_SYSCTL_TBUFOP_set_highwater:
+        if ( tbc->size == 0 || tbc->size > 100 )
+        {
+            rc = -EINVAL;
+            break;
+        }
+        t_buf_highwater_pct = tbc->size;
+        t_buf_highwater = data_size / 100 * t_buf_highwater_pct;
+        break;
+    case XEN_SYSCTL_TBUFOP_set_sample:
+    {
+        unsigned int i, cpu;
+
+        for ( i = 0; i < TRC_NR_CLASSES; i++ )
+            if ( tbc->evt_mask & (1u << (TRC_CLS_SHIFT + i)) )
+                tb_sample[i] = tbc->size;
+        for_each_possible_cpu(cpu)
+            memset(per_cpu(tb_sample_count, cpu), 0,
+                   sizeof(per_cpu(tb_sample_count, cpu)));
+        break;
+    }
     case XEN_SYSCTL_TBUFOP_enable:
         /* Enable trace buffers. Check buffers are already allocated. */
         if ( opt_tbuf_size == 0 ) 
@@ -411,20 +433,13 @@ int tb_control(xen_sysctl_tbuf_op_t *tbc)
          * Disable trace buffers. Just stops new records from being written,
          * does not deallocate any memory.
          */
-        int i;
-
         tb_init_done = 0;
         smp_wmb();
         /* Clear any lost-record info so we don't get phantom lost records next time we
-         * start tracing.  Grab the lock to make sure we're not racing anyone.  After this
+         * start tracing.  Each CPU does its own, with interrupts disabled, so
+         * that a record being placed there is done with.  After this
          * hypercall returns, no more records should be placed into the buffers. */
-        for_each_online_cpu(i)
-        {
-            unsigned long flags;
-            spin_lock_irqsave(&per_cpu(t_lock, i), flags);
-            per_cpu(lost_records, i)=0;
-            spin_unlock_irqrestore(&per_cpu(t_lock, i), flags);
-        }
+        on_each_cpu(clear_lost_records, NULL, 1);
     }
         break;
     default:
@@ -658,6 +673,28 @@ static inline void insert_lost_records(struct t_buf *buf)
                     LOST_REC_SIZE, &ed);
 }
 
+/*
+ * Whether to record this one of the events of its class: 1 in every
+ * tb_sample[] of them on each CPU. Skipped ones are not lost records.
+ */
+static inline bool_t trace_sampled(u32 event)
+{
+    unsigned int cls = (event >> TRC_CLS_SHIFT) & ((1u << TRC_NR_CLASSES) - 1);
+    unsigned int *count;
+
+    if ( !cls )
+        return 1;
+    cls = ffs(cls) - 1;
+    if ( tb_sample[cls] <= 1 )
+        return 1;
+
+    count = &this_cpu(tb_sample_count)[cls];
+    if ( ++*count < tb_sample[cls] )
+        return 0;
+    *count = 0;
+    return 1;
+}
+
 /*
  * Notification is performed in qtasklet to avoid deadlocks with contexts
  * which __trace_var() may be called from (e.g., scheduler critical regions).
@@ -720,7 +757,13 @@ void __trace_var(u32 event, bool_t cycles, unsigned int extra,
     /* Read tb_init_done /before/ t_bufs. */
     smp_rmb();
 
-    spin_lock_irqsave(&this_cpu(t_lock), flags);
+    local_irq_save(flags);
+
+    if ( !trace_sampled(event) )
+    {
+        local_irq_restore(flags);
+        return;
+    }
 
     buf = this_cpu(t_bufs);
 
@@ -807,7 +850,7 @@ void __trace_var(u32 event, bool_t cycles, unsigned int extra,
     __insert_record(buf, event, extra, cycles, rec_size, extra_data);
 
 unlock:
-    spin_unlock_irqrestore(&this_cpu(t_lock), flags);
+    local_irq_restore(flags);
 
     /* Notify trace buffer consumer that we've crossed the high water mark. */
     if ( likely(buf!=NULL)
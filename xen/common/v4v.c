@@ -29,15 +29,33 @@
 #include <asm/paging.h>
 #include <asm/p2m.h>
 #include <xen/keyhandler.h>
+#include <xen/vmap.h>
+#include <xen/rcupdate.h>
+#include <xen/hash.h>
+#include <xen/grant_table.h>
+#include <xen/trace.h>
+#include <xen/tasklet.h>
+#include <xen/numa.h>
+#include <xsm/xsm.h>
+#include <public/sysctl.h>
+#include <public/domctl.h>
 #include <asm/types.h>
 
 DEFINE_XEN_GUEST_HANDLE(v4v_iov_t);
 DEFINE_XEN_GUEST_HANDLE(v4v_addr_t);
 DEFINE_XEN_GUEST_HANDLE(v4v_send_addr_t);
+DEFINE_XEN_GUEST_HANDLE(v4v_send_batch_ent_t);
+DEFINE_XEN_GUEST_HANDLE(v4v_multicast_t);
+DEFINE_XEN_GUEST_HANDLE(v4v_ring_batch_ent_t);
+DEFINE_XEN_GUEST_HANDLE(v4v_connect_t);
+DEFINE_XEN_GUEST_HANDLE(v4v_recv_ent_t);
+DEFINE_XEN_GUEST_HANDLE(v4v_grant_desc_t);
+DEFINE_XEN_GUEST_HANDLE(v4v_ring_id_t);
 DEFINE_XEN_GUEST_HANDLE(v4v_ring_t);
 DEFINE_XEN_GUEST_HANDLE(v4v_ring_data_ent_t);
 DEFINE_XEN_GUEST_HANDLE(v4v_ring_data_t);
 DEFINE_XEN_GUEST_HANDLE(v4v_info_t);
+DEFINE_XEN_GUEST_HANDLE(v4v_stats_t);
 DEFINE_XEN_GUEST_HANDLE(v4v_pfn_t);
 DEFINE_XEN_GUEST_HANDLE(v4vtables_rule_t);
 DEFINE_XEN_GUEST_HANDLE(v4vtables_list_t);
@@ -47,9 +65,70 @@ struct v4v_pending_ent
 {
     struct hlist_node node;
     domid_t id;
+    /* from the owning domain's pending_pool rather than xmalloc() */
+    bool_t pooled;
     uint32_t len;
+    /* when the sender first got -EAGAIN, only with opt_v4v_stats */
+    s_time_t queued;
+    /* set once it fits: the ring and its space, for v4v_peer_wake() */
+    v4v_addr_t ring;
+    uint32_t space;
+};
+
+/*
+ * A message being copied into a ring, see v4v_ringbuf_reserve(). Slots
+ * are used in reservation order, the oldest one is resv[resv_head %
+ * V4V_RING_RESV_SLOTS].
+ */
+#define V4V_RING_RESV_SLOTS     8
+struct v4v_ring_resv
+{
+    /* tx_ptr once this message is published */
+    uint32_t end;
+    /* the copy is over, successfully or not */
+    bool_t done;
+};
+
+/*
+ * Credit of a sender to a ring registered with one, see
+ * v4v_ring_credit_take(). Slot 0 of the ring's credits is shared by the
+ * senders that didn't get one of their own, the others are free while
+ * their weight is 0.
+ */
+struct v4v_ring_credit
+{
+    domid_t id;
+    uint16_t weight;
+    /* bytes the sender may still queue, negative once it overdrew */
+    int64_t balance;
+};
+
+/*
+ * Messages with at least this much data are copied with L3 dropped,
+ * below it retaking the lock costs more than it saves.
+ */
+#define V4V_RESV_UNLOCKED_MIN   1024
+
+/*
+ * A run of physically contiguous pages of a ring, pages first to
+ * first + npage - 1 of the ring are mfn to mfn + npage - 1.
+ */
+struct v4v_ring_extent
+{
+    mfn_t mfn;
+    /* frame the domain registered for the first page, see v4v_rings_save() */
+    v4v_pfn_t pfn;
+    uint32_t first;
+    uint32_t npage;
 };
 
+/*
+ * Superpage size for the persistent mapping, 2M with 4k pages on both
+ * x86 and arm.
+ */
+#define V4V_SUPERPAGE_ORDER     9
+#define V4V_SUPERPAGE_PAGES     (1U << V4V_SUPERPAGE_ORDER)
+
 typedef struct v4vtables_rule_node
 {
     struct list_head list;
@@ -58,10 +137,44 @@ typedef struct v4vtables_rule_node
 
 struct v4v_ring_info
 {
-    /* next node in the hash, protected by L2  */
-    struct hlist_node node;
+    /*
+     * next node in the hash, protected by L2, read under RCU.
+     * The hash table in use chains node[table->slot], the other one
+     * is used to build its replacement when the table grows.
+     */
+    struct hlist_node node[2];
+    /* deferred free once RCU readers are done with the ring */
+    struct rcu_head rcu;
     /* this ring's id, protected by L2 */
     v4v_ring_id_t id;
+    /* size of the group of sub-rings, 1 for a plain ring, set before insert */
+    uint16_t nshard;
+    /* spread senders by source domain rather than by vcpu, set before insert */
+    bool_t shard_by_source;
+    /* port to signal for this ring, 0 for the domain's, set before insert */
+    evtchn_port_t evtchn_port;
+    /* alignment of the messages, V4V_RING_MSG_ALIGN(), set before insert */
+    uint32_t align;
+    /* copy large messages with non-temporal stores, set before insert */
+    bool_t nt_copy;
+    /* V4V_RING_F_STREAM, bytes rather than messages, set before insert */
+    bool_t stream;
+    /* bytes of credit per unit of weight, 0 if off, set before insert */
+    uint32_t credit;
+    /* V4V_CREDIT_SENDERS + 1 slots if credit, L3 */
+    struct v4v_ring_credit *credits;
+    /* rx_ptr the credits were last given back at, L3 */
+    uint32_t credit_rx;
+    /* V4VOP_ring_sources, NULL if anyone may send: set under L3, read RCU */
+    struct v4v_ring_sources *sources;
+    /*
+     * hold_len bytes of free space are held for sender hold_id, until
+     * hold_until once it was notified (0 while it waits), see
+     * v4v_ring_held(). L3
+     */
+    uint32_t hold_len;
+    domid_t hold_id;
+    s_time_t hold_until;
     /* L3 */
     spinlock_t lock;
     /* cached length of the ring (from ring->len), protected by L3 */
@@ -69,29 +182,214 @@ struct v4v_ring_info
     uint32_t npage;
     /* cached tx pointer location, protected by L3 */
     uint32_t tx_ptr;
+    /* end of the last reservation, tx_ptr if there is none, L3 */
+    uint32_t resv_ptr;
+    /* messages being copied, between resv_head and resv_tail, L3 */
+    struct v4v_ring_resv resv[V4V_RING_RESV_SLOTS];
+    unsigned int resv_head, resv_tail;
+    /* set by v4v_ring_unhook(), no new reservations, L3 */
+    bool_t removing;
+    /* v4v_destroy(): unhooked rings whose pages are still to be released */
+    struct v4v_ring_info *release_next;
+    /* being saved, see v4v_rings_save(): senders get -EAGAIN, L3 */
+    bool_t frozen;
     /* guest ring, protected by L3 */
     XEN_GUEST_HANDLE(v4v_ring_t) ring;
-    /* mapped ring pages protected by L3*/
+    /* mapped ring pages protected by L3, only without ring_mapping */
     uint8_t **mfn_mapping;
-    /* list of mfns of guest ring */
-    mfn_t *mfns;
+    /* whole ring mapped once for its lifetime (NULL if not), L3 */
+    uint8_t *ring_mapping;
+    /* extents of the guest ring, NULL once the ring is removed (L3) */
+    struct v4v_ring_extent *extents;
+    uint32_t nextent;
+    /* NUMA node of the extents, NUMA_NO_NODE if several, set with them */
+    unsigned int numa_node;
     /* list of struct v4v_pending_ent for this ring, L3 */
     struct hlist_head pending;
+    /* counters, L3 */
+    v4v_ring_stats_t stats;
+    /*
+     * on the owner's waiters list (or on the private list of the
+     * V4VOP_notify walking it), L3. The ring may stay there for a while
+     * after pending becomes empty, it is dropped on the next notify.
+     */
+    bool_t waiting;
+    /* linkage in waiters, protected by the domain's waiters_lock */
+    struct list_head waiter;
+};
+
+/* The senders allowed to a ring, replaced as a whole */
+struct v4v_ring_sources
+{
+    struct rcu_head rcu;
+    uint32_t nsrc;
+    v4v_addr_t src[0];
+};
+
+/*
+ * Per domain ring hash table. It starts with 2^V4V_HTABLE_MIN_ORDER
+ * buckets and doubles whenever there are more than
+ * V4V_HTABLE_LOAD_FACTOR rings per bucket.
+ */
+#define V4V_HTABLE_MIN_ORDER    5
+#define V4V_HTABLE_MAX_ORDER    14
+#define V4V_HTABLE_LOAD_FACTOR  2
+struct v4v_ring_hash
+{
+    struct rcu_head rcu;
+    struct v4v_domain *owner;
+    unsigned int order;
+    /* which of v4v_ring_info->node[] this table chains */
+    unsigned int slot;
+    struct hlist_head bucket[0];
+};
+
+/*
+ * Pending entries are taken from a per domain pool preallocated by
+ * v4v_init() so that backpressure doesn't go through xmalloc() under L3.
+ * Only once the pool is exhausted do we fall back to the heap.
+ */
+#define V4V_PENDING_POOL_SIZE  128
+
+/*
+ * Per source domain cache of recent v4vtables_check() verdicts, direct
+ * mapped on (src, dst). An entry is only valid while its generation
+ * matches v4vtables_generation; generation 0 is never used.
+ */
+#define V4V_VCACHE_ORDER       6
+#define V4V_VCACHE_SIZE        (1U << V4V_VCACHE_ORDER)
+struct v4v_verdict_ent
+{
+    v4v_addr_t src;
+    v4v_addr_t dst;
+    uint32_t generation;
+    uint32_t verdict;
 };
 
 /*
  * The value of the v4v element in a struct domain is
- * protected by the global lock L1
+ * protected by the global lock L1 for writers and by RCU for readers
  */
-#define V4V_HTABLE_SIZE 32
 struct v4v_domain
 {
     /* L2 */
     rwlock_t lock;
     /* event channel */
     evtchn_port_t evtchn_port;
-    /* protected by L2 */
-    struct hlist_head ring_hash[V4V_HTABLE_SIZE];
+    /* protected by L2, read under RCU */
+    struct v4v_ring_hash *ring_hash;
+    /* number of rings in ring_hash, L2 */
+    unsigned int nring;
+    /* pages pinned by the rings in ring_hash, L2 */
+    uint64_t npage;
+    /* limits of XEN_DOMCTL_v4v_set_quota on nring and npage, L2 */
+    unsigned int max_rings;
+    uint64_t max_pages;
+    /*
+     * the table replaced by the last resize hasn't been freed yet, so
+     * RCU readers may still walk node[!ring_hash->slot]: atomic
+     */
+    bool_t resizing;
+    /* deferred free once RCU readers are done with d->v4v */
+    struct rcu_head rcu;
+    /*
+     * rings that may have pending entries, so that V4VOP_notify only
+     * visits those. Lock order is L3 then waiters_lock.
+     */
+    spinlock_t waiters_lock;
+    struct list_head waiters;
+    /* free entries of pending_pool, protected by pending_lock */
+    spinlock_t pending_lock;
+    struct hlist_head pending_free;
+    struct v4v_pending_ent *pending_pool;
+    /* verdicts for messages sent by this domain, protected by vcache_lock */
+    spinlock_t vcache_lock;
+    struct v4v_verdict_ent vcache[V4V_VCACHE_SIZE];
+    /*
+     * ring registration (or V4VOP_ring_resize if reg_resize) preempted
+     * after reg_done of its reg_npage pages, resumed by its continuation.
+     * Only used by the domain itself, under domain_lock().
+     */
+    struct v4v_ring_info *reg_ring;
+    XEN_GUEST_HANDLE(v4v_ring_t) reg_hnd;
+    uint32_t reg_npage, reg_done;
+    bool_t reg_resize;
+    /* messages sent by the domain, under domain_lock() as reg_ring */
+    uint64_t tx_messages, tx_bytes, tx_eagain;
+    /* counters of the rings unregistered so far, L2 */
+    v4v_ring_stats_t rx_removed;
+    /* asynchronous send queue, under domain_lock() as reg_ring */
+    struct v4v_async *async;
+    /* V4V_CONNECT_MAX connections once one is made, as reg_ring */
+    struct v4v_conn *conns;
+    /* V4VOP_peer_space_setup page, set as reg_ring, read under RCU */
+    struct v4v_peer *peer;
+    /* bumped when a ring is added or removed, see v4v_conn_resolve() */
+    uint32_t ring_gen;
+    struct lock_profile_qhead profile_head;
+};
+
+/*
+ * A connection of V4VOP_connect. What V4VOP_sendv looks up for every
+ * message is kept with the generations it was looked up at: the
+ * destination domain, with a reference, the verdict of the rules, and
+ * the ring unless the destination picks a sub-ring per vcpu. Under
+ * domain_lock() of the sender.
+ */
+struct v4v_conn
+{
+    bool_t used;
+    bool_t prio;
+    bool_t refused;
+    v4v_addr_t src;
+    v4v_addr_t dst;
+    uint32_t message_type;
+    struct domain *dst_d;
+    /* ring_info is dst_v4v's, read under RCU */
+    struct v4v_domain *dst_v4v;
+    struct v4v_ring_info *ring_info;
+    uint32_t ring_gen;
+    uint32_t rules_gen;
+};
+
+/*
+ * The asynchronous send queue of a domain, see V4VOP_async_setup. The
+ * whole queue is mapped at q for as long as it is set up. The sizes and
+ * the data area are snapshots of what was checked at setup, sq_cons and
+ * cq_prod are ours: the domain can write them in q.
+ */
+struct v4v_async
+{
+    struct domain *d;
+    struct tasklet tasklet;
+    v4v_async_queue_t *q;
+    v4v_async_sqe_t *sq;
+    v4v_async_cqe_t *cq;
+    uint8_t *data;
+    uint32_t sq_size, cq_size, data_len;
+    uint32_t sq_cons, cq_prod;
+    /* port completions are signalled on, 0 for the v4v one */
+    evtchn_port_t evtchn;
+    unsigned long *mfns;
+    uint32_t npage;
+};
+
+/*
+ * The peer space page of a domain, see V4VOP_peer_space_setup. Xen
+ * only ever writes the page, what the entries are for is kept here:
+ * used has a bit for each entry of a connection with a ring, whose
+ * destination is in dst. The lock is taken last, under L3 or not, by
+ * the domain updating its entries and by the receivers waking it up;
+ * page is NULL once it is torn down.
+ */
+struct v4v_peer
+{
+    struct rcu_head rcu;
+    spinlock_t lock;
+    v4v_peer_space_t *page;
+    unsigned long mfn;
+    uint64_t used;
+    v4v_addr_t dst[V4V_CONNECT_MAX];
 };
 
 /*
@@ -102,30 +400,66 @@ struct v4v_domain
  */
 #define V4V_ROUNDUP(a) (((a) +0xf ) & ~0xf)
 
+/* Messages of rings registered with V4V_RING_F_CACHELINE on 64 bytes */
+#define v4v_ring_roundup(ring_info, a) \
+    (((a) + (ring_info)->align - 1) & ~((ring_info)->align - 1))
+
+/*
+ * Copies into a V4V_RING_F_NONTEMPORAL ring of at least this many bytes
+ * bypass the cache, smaller ones are likely to still be in it anyway.
+ */
+#define V4V_COPY_NT_MIN 2048
+
+/*
+ * From this many bytes copies into rings use __copy_from_guest_large(),
+ * below the setup of the faster copy isn't worth it.
+ */
+#define V4V_COPY_LARGE_MIN 256
+
 /*
  * Helper functions
  */
 
-static inline uint16_t
-v4v_hash_fn(v4v_ring_id_t *id)
+/*
+ * Rings are matched on (addr.port, addr.domain, shard) only, the partner
+ * is not part of the key, so one probe finds the ring for any sender.
+ */
+static inline unsigned int
+v4v_hash_fn(v4v_ring_id_t *id, unsigned int order)
 {
-    uint16_t ret;
-    ret = (uint16_t)(id->addr.port >> 16);
-    ret ^= (uint16_t)id->addr.port;
-    ret ^= id->addr.domain;
-    //ret ^= id->partner;
-
-    ret &= (V4V_HTABLE_SIZE - 1);
+    /* unsigned long is 32bit on arm32, mix the domain in separately */
+    return hash_long(hash_long(id->addr.port, BITS_PER_LONG) ^
+                     (((uint32_t)id->shard << 16) | id->addr.domain), order);
+}
 
-    return ret;
+static inline struct v4v_ring_info *
+v4v_ring_hash_entry(struct hlist_node *pos, unsigned int slot)
+{
+    return (struct v4v_ring_info *)
+        ((char *)(pos - slot) - offsetof(struct v4v_ring_info, node));
 }
 
+/*
+ * Walk every ring of a hash table. Safe against v4v_ring_remove_info()
+ * of the current ring since ring_info is only freed after a grace period.
+ * Caller holds L2 or is in an RCU read section.
+ */
+#define v4v_ring_hash_for_each(ring_info, pos, tbl, i)                       \
+    for ( (i) = 0; (i) < (1u << (tbl)->order); ++(i) )                     \
+        for ( (pos) = rcu_dereference((tbl)->bucket[i].first);             \
+              (pos) &&                                                     \
+              (((ring_info) = v4v_ring_hash_entry(pos, (tbl)->slot)), 1);  \
+              (pos) = rcu_dereference((pos)->next) )
+
 static struct v4v_ring_info *v4v_ring_find_info(struct domain *d,
                                                 v4v_ring_id_t *id);
 
 static struct v4v_ring_info *v4v_ring_find_info_by_addr(struct domain *d,
                                                         struct v4v_addr *a,
-                                                        domid_t p);
+                                                        domid_t p,
+                                                        bool_t prio);
+
+static void v4v_ring_wake(struct domain *d, struct v4v_ring_info *ring_info);
 
 struct list_head v4vtables_rules = LIST_HEAD_INIT(v4vtables_rules);
 
@@ -148,9 +482,21 @@ struct list_head v4vtables_rules = LIST_HEAD_INIT(v4vtables_rules);
 
 static DEFINE_RWLOCK(v4v_lock); /* L1 */
 
+/*
+ * The hot paths (sendv, notify, ring data queries) don't take L1 or L2:
+ * they run in an RCU read-side critical section on v4v_rcu_lock instead.
+ * Writers still serialize on W(L1)/W(L2) and publish with the _rcu list
+ * primitives and rcu_assign_pointer(). A struct v4v_domain or
+ * v4v_ring_info is only freed after a grace period, and a ring that has
+ * been removed has its extents cleared under L3, so a reader that found it
+ * before the removal must check v4v_ring_is_dead() once it holds L3.
+ */
+static DEFINE_RCU_READ_LOCK(v4v_rcu_lock);
+
 /*
  * the lock d->v4v->lock: L2:  Read on protects the hash table and
- * the elements in the hash_table d->v4v->ring_hash, and
+ * the elements in the hash_table d->v4v->ring_hash (and the pointer
+ * itself, which changes when the table grows), and
  * the node and id fields in struct v4v_ring_info in the
  * hash table. Write on L2 protects all of the elements of
  * struct v4v_ring_info. To take L2 you must already have R(L1)
@@ -160,6 +506,10 @@ static DEFINE_RWLOCK(v4v_lock); /* L1 */
  * protects len,tx_ptr the guest ring, the
  * guest ring_data and the pending list. To take L3 you must
  * already have R(L2). W(L2) implies L3
+ *
+ * Senders reserve room for their message under L3 and may copy it in
+ * with L3 dropped, see v4v_ringbuf_reserve(). tx_ptr only moves past
+ * messages that are completely copied, in reservation order.
  */
 
 /*
@@ -170,6 +520,78 @@ static DEFINE_RWLOCK(v4v_lock); /* L1 */
  */
 static DEFINE_RWLOCK(v4vtables_rules_lock);
 
+/*
+ * Bumped every time the rules change, invalidating the per domain
+ * verdict caches. Written under W(v4vtables_rules_lock), read atomically.
+ */
+static uint32_t v4vtables_generation = 1;
+
+/* Invalidate every cached verdict, skipping generation 0 */
+static void
+v4vtables_generation_bump(void)
+{
+    uint32_t gen, next;
+
+    do {
+        gen = read_atomic(&v4vtables_generation);
+        next = gen + 1 ? gen + 1 : 1;
+    } while ( cmpxchg(&v4vtables_generation, gen, next) != gen );
+}
+
+/*
+ * The verdicts cache what xsm_v4v_send() said as well, called by XSM
+ * once it may say something else.
+ */
+void
+v4v_policy_changed(void)
+{
+    smp_wmb();
+    v4vtables_generation_bump();
+}
+
+/* domains with a peer space page, v4v_peer_wake() has nothing to do if 0 */
+static atomic_t v4v_peer_users = ATOMIC_INIT(0);
+
+/*
+ * Map every ring contiguously with vmap() at registration time instead
+ * of mapping and unmapping each page on every copy.
+ */
+static bool_t __read_mostly opt_v4v_ring_vmap = 1;
+boolean_param("v4v_ring_vmap", opt_v4v_ring_vmap);
+
+/*
+ * Statistics and message time stamps, only when booted with v4v_stats.
+ * Ring counters are kept under L3, latency histograms per CPU and summed
+ * when read.
+ */
+static bool_t __read_mostly opt_v4v_stats;
+boolean_param("v4v_stats", opt_v4v_stats);
+
+enum {
+    V4V_HIST_SEND_INSERT,
+    V4V_HIST_INSERT_SIGNAL,
+    V4V_HIST_EAGAIN_NOTIFY,
+    V4V_NR_HISTS
+};
+
+static DEFINE_PER_CPU(uint64_t[V4V_NR_HISTS][V4V_STATS_NR_BUCKETS], v4v_hist);
+/* when the last message sent from this CPU went into its ring */
+static DEFINE_PER_CPU(s_time_t, v4v_insert_time);
+
+/* account the time elapsed since start in histogram hist */
+static void
+v4v_stats_record(unsigned int hist, s_time_t start)
+{
+    s_time_t delta = NOW() - start;
+    unsigned int bucket;
+
+    if ( delta >= (1LL << (V4V_STATS_NR_BUCKETS - 1)) )
+        bucket = V4V_STATS_NR_BUCKETS - 1;
+    else
+        bucket = (delta > 0) ? fls((uint32_t)delta) - 1 : 0;
+
+    this_cpu(v4v_hist)[hist][bucket]++;
+}
 
 
 //#define V4V_ANANOS_DEBUG
@@ -246,18 +668,101 @@ v4v_hexdump(void *_p, int len)
  * Event channel
  */
 
+/*
+ * Is d's v4v port already pending? Then d will look at its rings anyway,
+ * and there is no need for evtchn_send() and the channel lock it takes.
+ * The port was allocated for d to bind to itself, so both ends are in
+ * d. This runs without the event lock: a port being rebound may be
+ * missed, but a guest binding its port looks at its rings once bound.
+ */
+static bool_t
+v4v_port_pending(struct domain *d, evtchn_port_t port)
+{
+    struct evtchn *lchn;
+    evtchn_port_t rport;
+
+    if ( !port_is_valid(d, port) )
+        return 0;
+
+    lchn = evtchn_from_port(d, port);
+    if ( (read_atomic(&lchn->state) != ECS_INTERDOMAIN) ||
+         (lchn->u.interdomain.remote_dom != d) )
+        return 0;
+
+    rport = read_atomic(&lchn->u.interdomain.remote_port);
+    if ( !port_is_valid(d, rport) )
+        return 0;
+
+    return evtchn_port_is_pending(d, evtchn_from_port(d, rport));
+}
+
 static void
-v4v_signal_domain(struct domain *d)
+v4v_signal_port(struct domain *d, evtchn_port_t port)
 {
     int ret = 234;
     v4v_dprintk_in();
     //v4v_dprintk("send guest VIRQ_V4V domid:%d\n", d->domain_id);
 
-    ret = evtchn_send(d, d->v4v->evtchn_port);
+    /* order our ring updates before looking at the pending bit */
+    smp_mb();
+    if ( v4v_port_pending(d, port) )
+        return;
+
+    ret = evtchn_send(d, port);
     //v4v_dprintk("ret = %d\n", ret);
     v4v_dprintk_out();
 }
 
+static void
+v4v_signal_domain(struct domain *d)
+{
+    struct v4v_domain *v4v = rcu_dereference(d->v4v);
+
+    if ( !v4v )
+        return;
+
+    v4v_signal_port(d, v4v->evtchn_port);
+}
+
+/*
+ * A ring with a port of its own is signalled right away, *signal is
+ * cleared so that the caller doesn't signal the domain's port too.
+ */
+static void
+v4v_signal_ring(struct domain *d, evtchn_port_t port, bool_t *signal)
+{
+    if ( !*signal || !port )
+        return;
+
+    v4v_signal_port(d, port);
+    if ( unlikely(opt_v4v_stats) )
+        v4v_stats_record(V4V_HIST_INSERT_SIGNAL, this_cpu(v4v_insert_time));
+    *signal = 0;
+}
+
+/*
+ * Is port of d one v4v can signal a ring on: bound by d to another of
+ * its ports?
+ */
+static int
+v4v_check_ring_evtchn(struct domain *d, evtchn_port_t port)
+{
+    struct evtchn *chn;
+    int ret = -EINVAL;
+
+    spin_lock(&d->event_lock);
+    if ( port_is_valid(d, port) )
+    {
+        chn = evtchn_from_port(d, port);
+        if ( (chn->state == ECS_INTERDOMAIN) &&
+             (chn->u.interdomain.remote_dom == d) )
+            ret = 0;
+    }
+    spin_unlock(&d->event_lock);
+
+    return ret;
+}
+
 static void
 v4v_signal_domid(domid_t id)
 {
@@ -275,6 +780,14 @@ v4v_signal_domid(domid_t id)
  * ring buffer
  */
 
+/* has the ring been removed since the caller looked it up? L3 */
+static inline int
+v4v_ring_is_dead(struct v4v_ring_info *ring_info)
+{
+    ASSERT(spin_is_locked(&ring_info->lock));
+    return !ring_info->extents || ring_info->removing;
+}
+
 static void
 v4v_ring_unmap(struct v4v_ring_info *ring_info)
 {
@@ -283,21 +796,111 @@ v4v_ring_unmap(struct v4v_ring_info *ring_info)
     v4v_dprintk_in();
     ASSERT(spin_is_locked(&ring_info->lock));
 
+    if ( ring_info->ring_mapping )
+        goto out;
+
     for ( i = 0; i < ring_info->npage; ++i )
     {
         if ( !ring_info->mfn_mapping[i] )
             continue;
-        //v4v_dprintk("unmapping page %p from %p\n",
-        //            (void*)mfn_x(ring_info->mfns[i]),
-        //            ring_info->mfn_mapping[i]);
-
         unmap_domain_page(ring_info->mfn_mapping[i]);
         ring_info->mfn_mapping[i] = NULL;
     }
 
+out:
     v4v_dprintk_out();
 }
 
+/* Drop a transient mapping made by v4v_ring_map_page(), L3 */
+static void
+v4v_ring_unmap_page(struct v4v_ring_info *ring_info, int i)
+{
+    ASSERT(spin_is_locked(&ring_info->lock));
+
+    if ( ring_info->ring_mapping || !ring_info->mfn_mapping[i] )
+        return;
+
+    unmap_domain_page(ring_info->mfn_mapping[i]);
+    ring_info->mfn_mapping[i] = NULL;
+}
+
+/* mfn of page i of the ring, L3 */
+static unsigned long
+v4v_ring_mfn(struct v4v_ring_info *ring_info, uint32_t i)
+{
+    uint32_t lo = 0, hi = ring_info->nextent;
+
+    /* extents are sorted by first and cover the whole ring */
+    while ( (hi - lo) > 1 )
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if ( ring_info->extents[mid].first <= i )
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return mfn_x(ring_info->extents[lo].mfn) +
+           (i - ring_info->extents[lo].first);
+}
+
+/*
+ * Map the whole ring contiguously, called once at registration. Each
+ * extent is mapped in one go so that map_pages_to_xen() can use
+ * superpages where the extent and the mapping are suitably aligned.
+ * Failure is not fatal: the copy paths fall back to per-page mappings.
+ */
+static void
+v4v_ring_map_persistent(struct v4v_ring_info *ring_info)
+{
+    struct v4v_ring_extent *ext = ring_info->extents;
+    unsigned long va;
+    unsigned int align = 1;
+    uint32_t i;
+
+    ring_info->ring_mapping = NULL;
+    if ( !opt_v4v_ring_vmap || !ring_info->npage )
+        return;
+
+    if ( (ring_info->npage >= V4V_SUPERPAGE_PAGES) &&
+         !(mfn_x(ext[0].mfn) & (V4V_SUPERPAGE_PAGES - 1)) )
+        align = V4V_SUPERPAGE_PAGES;
+
+    ring_info->ring_mapping = vm_alloc(ring_info->npage, align);
+    if ( !ring_info->ring_mapping )
+        goto fail;
+
+    va = (unsigned long)ring_info->ring_mapping;
+    for ( i = 0; i < ring_info->nextent; ++i )
+    {
+        if ( map_pages_to_xen(va + ((unsigned long)ext[i].first << PAGE_SHIFT),
+                              mfn_x(ext[i].mfn), ext[i].npage,
+                              PAGE_HYPERVISOR) )
+        {
+            vunmap(ring_info->ring_mapping);
+            ring_info->ring_mapping = NULL;
+            goto fail;
+        }
+    }
+
+    return;
+
+fail:
+    printk(KERN_INFO "v4v: failed to map %u page ring, using per-page maps\n",
+           ring_info->npage);
+}
+
+static void
+v4v_ring_unmap_persistent(struct v4v_ring_info *ring_info)
+{
+    if ( !ring_info->ring_mapping )
+        return;
+
+    vunmap(ring_info->ring_mapping);
+    ring_info->ring_mapping = NULL;
+}
+
 static uint8_t *
 v4v_ring_map_page(struct v4v_ring_info *ring_info, int i)
 {
@@ -308,28 +911,78 @@ v4v_ring_map_page(struct v4v_ring_info *ring_info, int i)
 	printk("%s: %d\n", __func__, i);
         return NULL;
 	}
+    if ( ring_info->ring_mapping )
+        return ring_info->ring_mapping + ((unsigned long)i << PAGE_SHIFT);
     if ( ring_info->mfn_mapping[i] )
         return ring_info->mfn_mapping[i];
-    ring_info->mfn_mapping[i] = map_domain_page(mfn_x(ring_info->mfns[i]));
+    ring_info->mfn_mapping[i] = map_domain_page(v4v_ring_mfn(ring_info, i));
 
     v4v_dprintk("mapping page %p to %p\n",
-                (void *)mfn_x(ring_info->mfns[i]),
+                (void *)v4v_ring_mfn(ring_info, i),
                 ring_info->mfn_mapping[i]);
     v4v_dprintk_out();
     return ring_info->mfn_mapping[i];
 }
 
 static int
-v4v_memcpy_from_guest_ring(void *_dst, struct v4v_ring_info *ring_info,
-                           uint32_t offset, uint32_t len)
+v4v_copy_to_guest_maybe(void *dst, XEN_GUEST_HANDLE(uint8_t) dst_hnd,
+                        void *src, uint32_t len)
+{
+    if ( dst )
+    {
+        memcpy(dst, src, len);
+        return 0;
+    }
+
+    return __copy_to_guest(dst_hnd, (uint8_t *)src, len) ? -EFAULT : 0;
+}
+
+/*
+ * Copy len bytes at offset in the ring to dst, or if dst is NULL to the
+ * guest buffer dst_hnd, which the caller checked with guest_handle_okay().
+ */
+static int
+v4v_memcpy_from_ring(void *_dst, XEN_GUEST_HANDLE(uint8_t) dst_hnd,
+                     struct v4v_ring_info *ring_info,
+                     uint32_t offset, uint32_t len)
 {
     int page = offset >> PAGE_SHIFT;
     
     uint8_t *src;
     uint8_t *dst = _dst;
+    int ret;
 
     v4v_dprintk_in();
     ASSERT(spin_is_locked(&ring_info->lock));
+
+    if ( ring_info->ring_mapping )
+    {
+        uint32_t size = ring_info->npage << PAGE_SHIFT;
+
+        if ( (offset >= size) || (len > size) )
+            return -EFAULT;
+
+        /* With the ring mapped linearly we wrap at most once */
+        if ( (offset + len) > size )
+        {
+            if ( (ret = v4v_copy_to_guest_maybe(dst, dst_hnd,
+                                                ring_info->ring_mapping + offset,
+                                                size - offset)) )
+                return ret;
+            if ( dst )
+                dst += size - offset;
+            else
+                guest_handle_add_offset(dst_hnd, size - offset);
+            len -= size - offset;
+            offset = 0;
+        }
+        ret = v4v_copy_to_guest_maybe(dst, dst_hnd,
+                                      ring_info->ring_mapping + offset, len);
+
+        v4v_dprintk_out();
+        return ret;
+    }
+
     offset &= PAGE_SIZE - 1;
 
     while ( (offset + len) > PAGE_SIZE )
@@ -340,16 +993,19 @@ v4v_memcpy_from_guest_ring(void *_dst, struct v4v_ring_info *ring_info,
             return -EFAULT;
 
         v4v_aprintk("dst:%p, src:%p, offset:%#x, len:%#lx\n", dst, src, offset, PAGE_SIZE-offset);
-        memcpy(dst, src + offset, PAGE_SIZE - offset);
+        ret = v4v_copy_to_guest_maybe(dst, dst_hnd, src + offset,
+                                      PAGE_SIZE - offset);
 
-        /*jo mod*/
-        unmap_domain_page(ring_info->mfn_mapping[page]);
-        ring_info->mfn_mapping[page] = NULL;
-        /*jo mod end*/
+        v4v_ring_unmap_page(ring_info, page);
+        if ( ret )
+            return ret;
         page++;
         page = page % (int)ring_info->npage;
         len -= PAGE_SIZE - offset;
-        dst += PAGE_SIZE - offset;
+        if ( dst )
+            dst += PAGE_SIZE - offset;
+        else
+            guest_handle_add_offset(dst_hnd, PAGE_SIZE - offset);
         offset = 0;
     }
 
@@ -358,63 +1014,77 @@ v4v_memcpy_from_guest_ring(void *_dst, struct v4v_ring_info *ring_info,
         return -EFAULT;
 
     v4v_aprintk("dst:%p, src:%p, offset:%#x, len:%#x\n", dst, src, offset, len);
-    memcpy(dst, src + offset, len);
-    /*jo mod*/
-    unmap_domain_page(ring_info->mfn_mapping[page]);
-    ring_info->mfn_mapping[page] = NULL;
-    /*jo mod end*/
+    ret = v4v_copy_to_guest_maybe(dst, dst_hnd, src + offset, len);
+    v4v_ring_unmap_page(ring_info, page);
 
     v4v_dprintk_out();
-    return 0;
+    return ret;
 }
 
-/*jo magic*/
-#ifdef JO_MAGIC
 static int
-v4v_update_rx_ptr(struct v4v_ring_info *ring_info, uint32_t rx_ptr)
+v4v_memcpy_from_guest_ring(void *dst, struct v4v_ring_info *ring_info,
+                           uint32_t offset, uint32_t len)
 {
-    uint8_t *dst = v4v_ring_map_page(ring_info, 0);
-    uint32_t *p = (uint32_t *)(dst + offsetof(v4v_ring_t, rx_ptr));
-    int ret = 0;
+    XEN_GUEST_HANDLE(uint8_t) empty_hnd = { 0 };
 
-    v4v_dprintk_in();
-    ASSERT(spin_is_locked(&ring_info->lock));
+    return v4v_memcpy_from_ring(dst, empty_hnd, ring_info, offset, len);
+}
 
-    if ( !dst ) {
-        //v4v_dprintk("%s: PROBLHMA !dist\n",__func__);
-        ret = -EFAULT;
-	goto out;
-    }
-    write_atomic(p, rx_ptr);
-    wmb();
+/*
+ * The header of the ring in the guest's page 0, which the guest keeps
+ * writing to: only ever read or write single fields of it. The page
+ * stays mapped with the ring or, for per-page mappings, until
+ * v4v_ring_unmap(). L3
+ */
+static v4v_ring_t *
+v4v_ring_header(struct v4v_ring_info *ring_info)
+{
+    if ( ring_info->ring_mapping )
+        return (v4v_ring_t *)ring_info->ring_mapping;
 
-out:
-    v4v_dprintk_out();
-    return ret;
+    return (v4v_ring_t *)v4v_ring_map_page(ring_info, 0);
 }
-#endif
 
+/*
+ * Hand the space before rx_ptr back to the senders. The caller is done
+ * reading it and has a barrier for this. L3
+ */
 static int
-v4v_update_tx_ptr(struct v4v_ring_info *ring_info, uint32_t tx_ptr)
+v4v_update_rx_ptr(struct v4v_ring_info *ring_info, uint32_t rx_ptr)
 {
-    uint8_t *dst = v4v_ring_map_page(ring_info, 0);
-    uint32_t *p = (uint32_t *)(dst + offsetof(v4v_ring_t, tx_ptr));
-    int ret = 0;
+    v4v_ring_t *ringp;
 
-    v4v_dprintk_in();
     ASSERT(spin_is_locked(&ring_info->lock));
 
-    if ( !dst ) {
-	printk(KERN_ERR "%s: PROBLHMA !dist\n",__func__);
-        ret = -EFAULT;
-        goto out;
-    }
-    write_atomic(p, tx_ptr);
-    wmb();
+    ringp = v4v_ring_header(ring_info);
+    if ( !ringp )
+        return -EFAULT;
+    write_atomic(&ringp->rx_ptr, rx_ptr);
 
-out:
-    v4v_dprintk_out();
-    return ret;
+    return 0;
+}
+
+/*
+ * Publish the messages before tx_ptr to the receiver. The caller has
+ * written them and made them visible with wmb(), which also takes care
+ * of non-temporal stores. L3
+ */
+static int
+v4v_update_tx_ptr(struct v4v_ring_info *ring_info, uint32_t tx_ptr)
+{
+    v4v_ring_t *ringp;
+
+    ASSERT(spin_is_locked(&ring_info->lock));
+
+    ringp = v4v_ring_header(ring_info);
+    if ( !ringp )
+    {
+        printk(KERN_ERR "%s: ring %p has no header\n", __func__, ring_info);
+        return -EFAULT;
+    }
+    write_atomic(&ringp->tx_ptr, tx_ptr);
+
+    return 0;
 }
 
 static int
@@ -427,6 +1097,8 @@ v4v_copy_from_guest_maybe(void *dst, void *src,
     v4v_dprintk_in();
     if ( src )
         memcpy(dst, src, len);
+    else if ( len >= V4V_COPY_LARGE_MIN )
+        rc = __copy_from_guest_large(dst, src_hnd, len);
     else
         rc = __copy_from_guest(dst, src_hnd, len);
 
@@ -448,7 +1120,30 @@ v4v_memcpy_to_guest_ring(struct v4v_ring_info *ring_info,
     int ret = 0;
     
     v4v_dprintk_in();
-    ASSERT(spin_is_locked(&ring_info->lock));
+    /* without L3 only with a reservation, see v4v_ringbuf_reserve() */
+    ASSERT(spin_is_locked(&ring_info->lock) || ring_info->ring_mapping);
+
+    if ( ring_info->ring_mapping )
+    {
+        /* callers split the copy at the end of the ring */
+        if ( (offset + len) > (ring_info->npage << PAGE_SHIFT) )
+        {
+            printk(KERN_ERR "%s: copy past end of ring, offset=%#x len=%#x\n",
+                   __func__, offset, len);
+            ret = -EFAULT;
+            goto out;
+        }
+        if ( !src && ring_info->nt_copy && (len >= V4V_COPY_NT_MIN) )
+        {
+            if ( __copy_from_guest_nt(ring_info->ring_mapping + offset,
+                                      src_hnd, len) )
+                ret = -EFAULT;
+        }
+        else if ( v4v_copy_from_guest_maybe(ring_info->ring_mapping + offset,
+                                            src, src_hnd, len) )
+            ret = -EFAULT;
+        goto out;
+    }
 
     //page = page % (int)ring_info->npage;
     offset &= PAGE_SIZE - 1;
@@ -470,10 +1165,7 @@ v4v_memcpy_to_guest_ring(struct v4v_ring_info *ring_info,
             ret = -EFAULT;
             goto out;
 	    }
-        /*jo mod*/
-        unmap_domain_page(ring_info->mfn_mapping[page]);
-        ring_info->mfn_mapping[page] = NULL;
-        /*jo mod end*/
+        v4v_ring_unmap_page(ring_info, page);
         page++;
         //page = page % (int)ring_info->npage;
         len -= PAGE_SIZE - offset;
@@ -502,10 +1194,7 @@ v4v_memcpy_to_guest_ring(struct v4v_ring_info *ring_info,
     if (len < 0x100) {
         //v4v_hexdump(dst+offset, len);
     }
-    /*jo mod*/
-    unmap_domain_page(ring_info->mfn_mapping[page]);
-    ring_info->mfn_mapping[page] = NULL;
-    /*jo mod end*/
+    v4v_ring_unmap_page(ring_info, page);
 
 out:
     v4v_dprintk_out();
@@ -525,17 +1214,22 @@ v4v_ringbuf_get_rx_ptr(struct domain *d, struct v4v_ring_info *ring_info,
         goto out;
     }
 
-    ringp = map_domain_page(mfn_x(ring_info->mfns[0]));
+    if ( ring_info->ring_mapping )
+        ringp = (v4v_ring_t *)ring_info->ring_mapping;
+    else
+        ringp = map_domain_page(mfn_x(ring_info->extents[0].mfn));
 
     if ( !ringp ) {
         ret = -1;
         goto out;
     }
 
-    write_atomic(rx_ptr, ringp->rx_ptr);
-    wmb();
+    /* the receiver is done with what is before rx_ptr: acquire */
+    *rx_ptr = read_atomic(&ringp->rx_ptr);
+    smp_rmb();
 
-    unmap_domain_page(ringp);
+    if ( !ring_info->ring_mapping )
+        unmap_domain_page(ringp);
 out:
     v4v_dprintk_out();
     return ret;
@@ -548,7 +1242,8 @@ v4v_ringbuf_payload_space(struct domain * d, struct v4v_ring_info * ring_info)
     int32_t ret;
 
     v4v_dprintk_in();
-    ring.tx_ptr = ring_info->tx_ptr;
+    /* room reserved by senders still copying isn't free */
+    ring.tx_ptr = ring_info->resv_ptr;
     ring.len = ring_info->len;
 
     if ( v4v_ringbuf_get_rx_ptr(d, ring_info, &ring.rx_ptr) ) {
@@ -556,6 +1251,15 @@ v4v_ringbuf_payload_space(struct domain * d, struct v4v_ring_info * ring_info)
         goto out;
      }
 
+    /* a byte is left free so that a full stream isn't an empty one */
+    if ( ring_info->stream )
+    {
+        ret = ring.rx_ptr - ring.tx_ptr - 1;
+        if ( ret < 0 )
+            ret += ring.len;
+        goto out;
+    }
+
     if ( ring.rx_ptr == ring.tx_ptr ) {
         ret = ring.len - sizeof (struct v4v_ring_message_header);
         goto out;
@@ -566,1351 +1270,5831 @@ v4v_ringbuf_payload_space(struct domain * d, struct v4v_ring_info * ring_info)
         ret += ring.len;
 
     ret -= sizeof (struct v4v_ring_message_header);
-    ret -= V4V_ROUNDUP(1);
+    ret -= ring_info->align;
 
 out:
     v4v_dprintk_out();
     return (ret < 0) ? 0 : ret;
 }
 
+/*
+ * Snapshot of the iovs of the message being sent, so that the guest's
+ * iov array is read once, and checked once. Hypercalls aren't preempted
+ * so a per CPU buffer is enough.
+ */
+static DEFINE_PER_CPU(v4v_iov_t[V4V_MAXIOV], v4v_iov_snapshot);
+
+/*
+ * Copy niov iovs from the guest into this CPU's snapshot, check them and
+ * return the length of the message or a negative error.
+ */
 static long
-v4v_iov_count(XEN_GUEST_HANDLE(v4v_iov_t) iovs, int niov)
+v4v_iov_snapshot(XEN_GUEST_HANDLE(v4v_iov_t) iovs, uint32_t niov,
+                 v4v_iov_t **snap)
 {
-    v4v_iov_t iov;
-    size_t ret = 0, niovs = 0;
+    v4v_iov_t *iov = this_cpu(v4v_iov_snapshot);
+    XEN_GUEST_HANDLE(uint8_t) buf_hnd;
+    size_t len = 0;
+    uint32_t i;
+    long ret;
 
     v4v_dprintk_in();
-    while ( niov-- )
+    if ( niov > V4V_MAXIOV )
+    {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if ( copy_from_guest(iov, iovs, niov) )
+    {
+        printk(KERN_ERR "%s: failed to copy %u iovs\n", __func__, niov);
+        ret = -EFAULT;
+        goto out;
+    }
+
+    for ( i = 0; i < niov; i++ )
     {
-        if ( (ret = copy_from_guest(&iov, iovs, 1)) ) {
-	    printk(KERN_ERR "%s: failed, ret= %d\n", __func__, (int)ret);
+        buf_hnd.p = (uint8_t *)iov[i].iov_base; //FIXME
+        if ( unlikely(!guest_handle_okay(buf_hnd, iov[i].iov_len)) )
+        {
             ret = -EFAULT;
             goto out;
-	}
-	ret = 0;
+        }
 
-        niovs += iov.iov_len;
-        ret = niovs;
+        len += iov[i].iov_len;
 
         /* message bigger than 2G can't be sent */
-        if (niovs > 2L * 1024 * 1024 * 1024) {
+        if ( len > 2L * 1024 * 1024 * 1024 )
+        {
             ret = -EMSGSIZE;
             goto out;
         }
-
-        guest_handle_add_offset(iovs, 1);
     }
 
+    *snap = iov;
+    ret = len;
+
 out:
     v4v_dprintk_out();
     return ret;
 }
 
-static long
-v4v_ringbuf_insertv(struct domain *d,
-                    struct v4v_ring_info *ring_info,
-                    v4v_ring_id_t *src_id, uint32_t proto,
-                    XEN_GUEST_HANDLE(v4v_iov_t) iovs, uint32_t niov,
-                    size_t len)
+/*
+ * Should the receiver be signalled now that tx_ptr moved from old_tx to
+ * new_tx? Not while it is busy-polling the ring, and otherwise only if
+ * it didn't ask for suppression or if tx_ptr went past the notify_ptr it
+ * published. These are re-read after tx_ptr is published so that a
+ * receiver re-arming concurrently is not missed.
+ */
+static bool_t
+v4v_ringbuf_need_signal(struct v4v_ring_info *ring_info,
+                        uint32_t old_tx, uint32_t new_tx)
 {
-    v4v_ring_t ring;
-    struct v4v_ring_message_header mh = { 0 };
-    int32_t sp;
-    long happy_ret;
-    int32_t ret = 0;
-    XEN_GUEST_HANDLE(uint8_t) empty_hnd = { 0 };
+    v4v_ring_t *ringp;
+    uint32_t flags, notify_ptr;
 
     ASSERT(spin_is_locked(&ring_info->lock));
 
-    v4v_dprintk_in();
-    happy_ret = len;
-
-    v4v_aprintk("rounduplen: %#lx, sizeof(ring_msg_hdr):%#lx, ring_info->len:%#x\n",
-                V4V_ROUNDUP(len), sizeof (struct v4v_ring_message_header), ring_info->len);
-
-    if ( (V4V_ROUNDUP(len) + sizeof (struct v4v_ring_message_header) ) >=
-            ring_info->len) {
-        ret = -EMSGSIZE;
-        goto out;
-    }
-
-    do
-    {
-        v4v_aprintk("ring_info: %p, ring:%p, sizeof(ring):%#lx\n",
-                    ring_info, &ring, sizeof(ring));
-        if ( (ret = v4v_memcpy_from_guest_ring(&ring, ring_info, 0,
-                                               sizeof (ring))) )
-            break;
+    smp_mb();
+    if ( !(ringp = v4v_ring_header(ring_info)) )
+        return 1;
+    flags = read_atomic(&ringp->flags);
 
-        ring.tx_ptr = ring_info->tx_ptr;
-        ring.len = ring_info->len;
-
-        v4v_aprintk("ring->tx_ptr: %#x, ring->rx_ptr:%#x\n", ring.tx_ptr, ring.rx_ptr);
-        if ( ring.rx_ptr == ring.tx_ptr ) {
-            sp = ring_info->len;
-#ifdef JO_MAGIC
-	    /*jo magic*/
-	    if ( ring.tx_ptr != 0 ) {
-		ring.rx_ptr = 0;
-		ring.tx_ptr = 0;
-		ring_info->tx_ptr = 0;
-		if( (ret = v4v_update_tx_ptr(ring_info, ring.tx_ptr)) ) {
-	            printk("%s : failed to update tx_ptr\n",__func__);
-		    v4v_ring_unmap(ring_info);
-                    goto out;
-		}
-		if( (ret = v4v_update_rx_ptr(ring_info, ring.rx_ptr)) ) {
-		    v4v_dprintk("%s : failed to update rx_ptr\n",__func__);
-		    v4v_ring_unmap(ring_info);
-                    goto out;
-		}
-		v4v_dprintk("%s : rx_ptr, tx_ptr modified!!!\n", __func__);
-	    }
-            /*jo magic end*/
-#endif
-        }
-        else
-        {
-            sp = ring.rx_ptr - ring.tx_ptr;
-            if ( sp < 0 )
-                sp += ring.len;
-        }
-        v4v_aprintk("space:%#x\n", sp);
+    if ( flags & V4V_RING_F_POLLING )
+        return 0;
 
+    if ( !(flags & V4V_RING_F_NOTIFY_PTR) )
+        return 1;
 
-        if ( (V4V_ROUNDUP(len) + sizeof (struct v4v_ring_message_header)) >= sp )
-        {
-            //printk(KERN_ERR "%s: EAGAIN len+header:%#lx\n", __func__, (V4V_ROUNDUP(len) + sizeof (struct v4v_ring_message_header)));
-            ret = -EAGAIN;
-            break;
-        }
+    notify_ptr = read_atomic(&ringp->notify_ptr);
+    if ( notify_ptr >= ring_info->len )
+        return 1;
 
-        mh.len = len + sizeof (struct v4v_ring_message_header);
-        mh.source = src_id->addr;
-        mh.message_type = proto;
+    /* did [old_tx, new_tx) cover notify_ptr, modulo the ring length? */
+    return ((notify_ptr + ring_info->len - old_tx) % ring_info->len) <
+           ((new_tx + ring_info->len - old_tx) % ring_info->len);
+}
 
-        v4v_aprintk("ring->tx_ptr: %#x\n", ring.tx_ptr);
-        if ( (ret = v4v_memcpy_to_guest_ring(ring_info,
-                                             ring.tx_ptr + sizeof (v4v_ring_t),
-                                             &mh, empty_hnd,
-                                             sizeof (mh))) )
-            break;
+/*
+ * Copy len bytes of xen memory to the ring at *tx_ptr and advance it,
+ * wrapping at most once. Caller holds L3 or a reservation on a ring
+ * with a persistent mapping.
+ */
+static int
+v4v_ringbuf_copy_in(struct v4v_ring_info *ring_info, uint32_t *tx_ptr,
+                    void *buf, uint32_t len)
+{
+    XEN_GUEST_HANDLE(uint8_t) empty_hnd = { 0 };
+    uint32_t chunk = min_t(uint32_t, len, ring_info->len - *tx_ptr);
+    int ret;
+
+    ret = v4v_memcpy_to_guest_ring(ring_info, *tx_ptr + sizeof (v4v_ring_t),
+                                   buf, empty_hnd, chunk);
+    if ( !ret && (len > chunk) )
+        ret = v4v_memcpy_to_guest_ring(ring_info, sizeof (v4v_ring_t),
+                                       (uint8_t *)buf + chunk, empty_hnd,
+                                       len - chunk);
+    if ( ret )
+        return ret;
+
+    *tx_ptr += len;
+    if ( *tx_ptr >= ring_info->len )
+        *tx_ptr -= ring_info->len;
 
-        ring.tx_ptr += sizeof (mh);
-        if ( ring.tx_ptr >= ring_info->len ) {
-            ring.tx_ptr -= ring_info->len;
-	    }
+    return 0;
+}
 
-        v4v_aprintk("going to parse niovs: ring->tx_ptr: %#x, \n", ring.tx_ptr);
-        while ( niov-- )
-        {
-            XEN_GUEST_HANDLE(uint8_t) buf_hnd;
-            v4v_iov_t iov;
+/*
+ * Copy len bytes of the ring at *rx_ptr to dst (or the guest buffer
+ * dst_hnd if dst is NULL) and advance it, wrapping at most once. L3
+ */
+static int
+v4v_ringbuf_copy_out(struct v4v_ring_info *ring_info, uint32_t *rx_ptr,
+                     void *dst, XEN_GUEST_HANDLE(uint8_t) dst_hnd,
+                     uint32_t len)
+{
+    uint32_t chunk = min_t(uint32_t, len, ring_info->len - *rx_ptr);
+    int ret;
 
-            if ( (ret = copy_from_guest(&iov, iovs, 1)) )
-            {
-                printk(KERN_ERR "%s:, ret = %d\n", __func__, ret);
-                ret = -EFAULT;
-                break;
-            }
-            ret = 0;
-	    
-            v4v_aprintk("iov[%d].{base:%p, len:%#x\n", niov + 1, (char*)iov.iov_base, iov.iov_len);
-            buf_hnd.p = (uint8_t *)iov.iov_base; //FIXME
-            len = iov.iov_len;
+    ret = v4v_memcpy_from_ring(dst, dst_hnd, ring_info,
+                               *rx_ptr + sizeof (v4v_ring_t), chunk);
+    if ( !ret && (len > chunk) )
+    {
+        if ( dst )
+            dst = (uint8_t *)dst + chunk;
+        else
+            guest_handle_add_offset(dst_hnd, chunk);
+        ret = v4v_memcpy_from_ring(dst, dst_hnd, ring_info,
+                                   sizeof (v4v_ring_t), len - chunk);
+    }
+    if ( ret )
+        return ret;
 
-            if ( unlikely(!guest_handle_okay(buf_hnd, len)) )
-            {
-                printk(KERN_ERR "%s: PROBLHMA guest_handle_okay\n", __func__);
-                ret = -EFAULT;
-                break;
-            }
+    *rx_ptr += len;
+    if ( *rx_ptr >= ring_info->len )
+        *rx_ptr -= ring_info->len;
 
-            //sp = ring.len - (ring.tx_ptr + sizeof(v4v_ring_t));
-            sp = ring.len - ring.tx_ptr;
-            v4v_aprintk("space (len - tx_ptr):%#x, len:%#lx, len-sp:%#lx\n", sp, len, len-sp);
+    return 0;
+}
 
-            if ( len > sp )
-            {
-                v4v_aprintk("ring->tx_ptr: %#x, buf_hnd:%p, sp:%#x\n", ring.tx_ptr, buf_hnd.p, sp);
-                ret = v4v_memcpy_to_guest_ring(ring_info,
-                        ring.tx_ptr + sizeof (v4v_ring_t),
-                        NULL, buf_hnd, sp);
-                if ( ret ) {
-                    v4v_dprintk("INSERTV :PROBLHMA v4v_memcpy (len>sp)\n");
-                    break;
-                }
-                ring.tx_ptr = 0;
+/* Length of the time stamp to put in front of messages sent to ring */
+static inline uint32_t
+v4v_ringbuf_stamp_len(v4v_ring_t *ring)
+{
+    if ( likely(!opt_v4v_stats) || !(ring->flags & V4V_RING_F_TIMESTAMP) )
+        return 0;
 
-#if 0
-                if ( ring.tx_ptr >= ring_info->len )
-                    ring.tx_ptr -= ring_info->len;
-#endif
-                len -= sp;
-                guest_handle_add_offset(buf_hnd, sp);
-                v4v_aprintk("len:%#lx, buf:%p, ring->tx_ptr: %#x\n", len, buf_hnd.p, ring.tx_ptr);
-            }
+    return sizeof (uint64_t);
+}
 
-            v4v_aprintk("ring->tx_ptr: %#x, buf_hnd:%p, sp:%#x\n", ring.tx_ptr, buf_hnd.p, sp);
-            ret = v4v_memcpy_to_guest_ring(ring_info,
-                    ring.tx_ptr + sizeof (v4v_ring_t),
-                    NULL, buf_hnd, len);
-            if ( ret ) {
-                printk(KERN_ERR "%s:, ret = %d\n", __func__, ret);
-                break;
-            }
-            ring.tx_ptr += len;
+/*
+ * The credit of sender src to ring_info. src gets a free slot if alloc
+ * and there is one, otherwise it shares slot 0. L3
+ */
+static struct v4v_ring_credit *
+v4v_ring_credit_find(struct v4v_ring_info *ring_info, domid_t src,
+                     bool_t alloc)
+{
+    struct v4v_ring_credit *c, *free = NULL;
+    unsigned int i;
 
-            if ( ring.tx_ptr == ring_info->len )
-                ring.tx_ptr = 0;
+    for ( i = 1; i <= V4V_CREDIT_SENDERS; i++ )
+    {
+        c = &ring_info->credits[i];
+        if ( !c->weight )
+            free = free ?: c;
+        else if ( c->id == src )
+            return c;
+    }
 
-            v4v_aprintk("len:%#lx, buf:%p, ring->tx_ptr: %#x\n", len, buf_hnd.p, ring.tx_ptr);
-            guest_handle_add_offset(iovs, 1);
-        }
-        if ( ret ) {
-            printk(KERN_ERR "%s: :PROBLHMA after while niov\n", __func__);
-            break;
-        }
-        ring.tx_ptr = V4V_ROUNDUP(ring.tx_ptr);
+    if ( !alloc || !free )
+        return &ring_info->credits[0];
 
-        if ( ring.tx_ptr >= ring_info->len )
-            ring.tx_ptr -= ring_info->len;
+    free->id = src;
+    free->weight = 1;
+    free->balance = ring_info->credit;
+    return free;
+}
 
-        v4v_aprintk("ring->tx_ptr: %#x\n", ring.tx_ptr);
+/*
+ * Give the senders back the space the receiver consumed since the last
+ * time, shared out by weight, up to credit * weight each. L3
+ */
+static void
+v4v_ring_credit_refill(struct v4v_ring_info *ring_info, uint32_t rx_ptr)
+{
+    struct v4v_ring_credit *c;
+    uint32_t consumed, weights = 0;
+    uint64_t share;
+    int64_t cap;
+    unsigned int i;
+
+    /* the receiver can write rx_ptr, the reserve path checks it */
+    if ( rx_ptr >= ring_info->len )
+        return;
 
-        wmb();
-        ring_info->tx_ptr = ring.tx_ptr;
-        if ( (ret = v4v_update_tx_ptr(ring_info, ring.tx_ptr)) ) {
-            printk(KERN_ERR "%s:PROBLHMA v4v_update_tx_ptr\n", __func__);
-            break;
-        }
-    } while ( 0 );
+    consumed = rx_ptr - ring_info->credit_rx;
+    if ( rx_ptr < ring_info->credit_rx )
+        consumed += ring_info->len;
+    ring_info->credit_rx = rx_ptr;
+    if ( !consumed )
+        return;
 
-    v4v_ring_unmap(ring_info);
+    for ( i = 0; i <= V4V_CREDIT_SENDERS; i++ )
+        weights += ring_info->credits[i].weight;
 
-out:
-    v4v_dprintk_out();
-    return ret ? ret : happy_ret;
+    for ( i = 0; i <= V4V_CREDIT_SENDERS; i++ )
+    {
+        c = &ring_info->credits[i];
+        if ( !c->weight )
+            continue;
+        share = (uint64_t)consumed * c->weight / weights;
+        cap = (int64_t)ring_info->credit * c->weight;
+        c->balance = min_t(int64_t, c->balance + (int64_t)share, cap);
+    }
 }
 
-/* pending */
-static void
-v4v_pending_remove_ent(struct v4v_pending_ent *ent)
+/*
+ * Admission of a message taking need bytes of the ring from src, with
+ * space bytes free. Once it would leave less than half the ring free src
+ * needs the credit for it, or its full credit for a message larger than
+ * that. The credit is spent either way. L3
+ */
+static int
+v4v_ring_credit_take(struct v4v_ring_info *ring_info, domid_t src,
+                     uint32_t rx_ptr, uint32_t need, uint32_t space)
 {
-    v4v_dprintk_in();
-    hlist_del(&ent->node);
-    xfree(ent);
-    v4v_dprintk_out();
-}
+    struct v4v_ring_credit *c;
+    int64_t cap;
 
-static void
-v4v_pending_remove_all(struct v4v_ring_info *info)
-{
-    struct hlist_node *node, *next;
-    struct v4v_pending_ent *pending_ent;
+    v4v_ring_credit_refill(ring_info, rx_ptr);
+    c = v4v_ring_credit_find(ring_info, src, 1);
+    cap = (int64_t)ring_info->credit * c->weight;
 
-    v4v_dprintk_in();
-    ASSERT(spin_is_locked(&info->lock));
-    hlist_for_each_entry_safe(pending_ent, node, next, &info->pending,
-            node) v4v_pending_remove_ent(pending_ent);
-    v4v_dprintk_out();
+    if ( ((space - need) < (ring_info->len / 2)) &&
+         (c->balance < min_t(int64_t, need, cap)) )
+        return -EAGAIN;
+
+    /* at most one round of debt */
+    c->balance = max_t(int64_t, c->balance - need, -cap);
+    return 0;
 }
 
-static void
-v4v_pending_notify(struct domain *caller_d, struct hlist_head *to_notify)
-{
-    struct hlist_node *node, *next;
-    struct v4v_pending_ent *pending_ent;
+/*
+ * Space freed for a large sender waiting on a ring is held for it, so
+ * that smaller senders slipping in can't keep it from ever fitting. Once
+ * notified it has V4V_HOLD_TIMEOUT to come and take it, a sender waits
+ * for more than 1 / (1 << V4V_HOLD_MIN_SHIFT) of the ring to be large.
+ */
+#define V4V_HOLD_TIMEOUT        MILLISECS(10)
+#define V4V_HOLD_MIN_SHIFT      2
 
-    v4v_dprintk_in();
-    ASSERT(rw_is_locked(&v4v_lock));
+/* Bytes of ring_info's free space src can't have, held for another. L3 */
+static uint32_t
+v4v_ring_held(struct v4v_ring_info *ring_info, domid_t src)
+{
+    if ( !ring_info->hold_len || (src == ring_info->hold_id) )
+        return 0;
 
-    hlist_for_each_entry_safe(pending_ent, node, next, to_notify, node)
+    if ( ring_info->hold_until && (NOW() > ring_info->hold_until) )
     {
-        hlist_del(&pending_ent->node);
-        v4v_signal_domid(pending_ent->id);
-        xfree(pending_ent);
+        ring_info->hold_len = 0;
+        return 0;
     }
 
-    v4v_dprintk_out();
+    return ring_info->hold_len + sizeof (struct v4v_ring_message_header) +
+           ring_info->align;
 }
 
-static void
-v4v_pending_find(struct domain *d, struct v4v_ring_info *ring_info,
-                 uint32_t payload_space, struct hlist_head *to_notify)
+/*
+ * Reserve room at resv_ptr for a message with len bytes of data, setting
+ * *stamp_len, the offset *tx_ptr of its header and its slot *resv. Once
+ * it has a reservation the sender can copy its message in without L3,
+ * provided the ring has a persistent mapping, then hands it over with
+ * v4v_ringbuf_publish(). If all the slots are taken we wait for one,
+ * dropping L3. src is the sending domain, for rings with a credit. L3
+ */
+static int
+v4v_ringbuf_reserve(struct v4v_ring_info *ring_info, domid_t src,
+                    uint32_t len, uint32_t *stamp_len, uint32_t *tx_ptr,
+                    unsigned int *resv)
 {
-    struct hlist_node *node, *next;
-    struct v4v_pending_ent *ent;
+    v4v_ring_t *ringp;
+    struct v4v_ring_resv *slot;
+    uint32_t need, rx_ptr;
+    int32_t sp;
+    int ret;
 
-    v4v_dprintk_in();
-    ASSERT(rw_is_locked(&d->v4v->lock));
+    ASSERT(spin_is_locked(&ring_info->lock));
 
-    spin_lock(&ring_info->lock);
-    hlist_for_each_entry_safe(ent, node, next, &ring_info->pending, node)
+    /* only V4VOP_sendv writes to a stream, see v4v_ringbuf_insert_stream() */
+    if ( ring_info->stream )
+        return -EPROTOTYPE;
+
+    while ( (ring_info->resv_tail - ring_info->resv_head) ==
+            V4V_RING_RESV_SLOTS )
     {
-        if ( payload_space >= ent->len )
-        {
-            hlist_del(&ent->node);
-            hlist_add_head(&ent->node, to_notify);
-        }
+        spin_unlock(&ring_info->lock);
+        cpu_relax();
+        spin_lock(&ring_info->lock);
+        if ( v4v_ring_is_dead(ring_info) )
+            return -ECONNREFUSED;
     }
-    spin_unlock(&ring_info->lock);
-    v4v_dprintk_out();
-}
 
-/*caller must have L3 */
-static int
-v4v_pending_queue(struct v4v_ring_info *ring_info, domid_t src_id, int len)
-{
-    struct v4v_pending_ent *ent = xmalloc(struct v4v_pending_ent);
-    int ret = 0;
-    v4v_dprintk_in();
+    if ( ring_info->frozen )
+        return -EAGAIN;
 
-    if ( !ent )
+    /* only rx_ptr and the flags are needed, the rest is ring_info's */
+    if ( !(ringp = v4v_ring_header(ring_info)) )
+        return -EFAULT;
+    rx_ptr = read_atomic(&ringp->rx_ptr);
+    smp_rmb();
+
+    *stamp_len = v4v_ringbuf_stamp_len(ringp);
+    need = v4v_ring_roundup(ring_info, sizeof (struct v4v_ring_message_header) +
+                            *stamp_len + len);
+    if ( need >= ring_info->len )
+        return -EMSGSIZE;
+
+    v4v_aprintk("ring->resv_ptr: %#x, ring->rx_ptr:%#x\n",
+                ring_info->resv_ptr, rx_ptr);
+    if ( rx_ptr == ring_info->resv_ptr )
+        sp = ring_info->len;
+    else
     {
-        v4v_dprintk("ENOMEM\n");
-        ret = -ENOMEM;
-        goto out;
+        sp = rx_ptr - ring_info->resv_ptr;
+        if ( sp < 0 )
+            sp += ring_info->len;
     }
 
-    ent->len = len;
-    ent->id = src_id;
+    if ( (need + v4v_ring_held(ring_info, src)) >= sp )
+        return -EAGAIN;
 
-    hlist_add_head(&ent->node, &ring_info->pending);
+    if ( ring_info->credits &&
+         (ret = v4v_ring_credit_take(ring_info, src, rx_ptr, need, sp)) )
+        return ret;
+
+    /* the holder took what was held for it */
+    if ( ring_info->hold_len && (src == ring_info->hold_id) )
+        ring_info->hold_len = 0;
+
+    *tx_ptr = ring_info->resv_ptr;
+    ring_info->resv_ptr =
+        v4v_ring_roundup(ring_info, (*tx_ptr + need) % ring_info->len);
+    if ( ring_info->resv_ptr >= ring_info->len )
+        ring_info->resv_ptr -= ring_info->len;
+
+    *resv = ring_info->resv_tail++;
+    slot = &ring_info->resv[*resv % V4V_RING_RESV_SLOTS];
+    slot->end = ring_info->resv_ptr;
+    slot->done = 0;
 
-out:
-    v4v_dprintk_out();
     return 0;
 }
 
-/* L3 */
-static int
-v4v_pending_requeue(struct v4v_ring_info *ring_info, domid_t src_id, int len)
+/*
+ * The copy of the message with header mh at tx_ptr into slot resv is
+ * over, ret is its result. Move tx_ptr past every message that is
+ * completely copied and not behind one that is still being copied, and
+ * return whether the receiver should be signalled. A message that failed
+ * is given back if nobody reserved after it, otherwise it is published
+ * with V4V_MSG_F_DISCARD so that the receiver skips it. L3
+ */
+static bool_t
+v4v_ringbuf_publish(struct v4v_ring_info *ring_info, unsigned int resv,
+                    uint32_t tx_ptr, struct v4v_ring_message_header *mh,
+                    int ret)
 {
-    struct hlist_node *node;
-    struct v4v_pending_ent *ent;
-    int ret = 0;
+    struct v4v_ring_resv *slot;
+    uint32_t old_tx_ptr = ring_info->tx_ptr;
 
-    v4v_dprintk_in();
-    //printk("pending requeue\n");
-    hlist_for_each_entry(ent, node, &ring_info->pending, node)
+    ASSERT(spin_is_locked(&ring_info->lock));
+
+    if ( ret && (resv == (ring_info->resv_tail - 1)) )
     {
-        if ( ent->id == src_id )
+        ring_info->resv_tail--;
+        ring_info->resv_ptr = tx_ptr;
+    }
+    else
+    {
+        if ( ret )
         {
-            if ( ent->len < len )
-                ent->len = len;
-            ret = 0;
-            goto out;
+            mh->flags = V4V_MSG_F_DISCARD;
+            if ( v4v_ringbuf_copy_in(ring_info, &tx_ptr, mh, sizeof (*mh)) )
+                printk(KERN_ERR "%s: failed to discard message at %#x\n",
+                       __func__, tx_ptr);
         }
+        ring_info->resv[resv % V4V_RING_RESV_SLOTS].done = 1;
     }
 
-    ret = v4v_pending_queue(ring_info, src_id, len);
-out:
-    v4v_dprintk_out();
-    return ret;
-}
+    while ( ring_info->resv_head != ring_info->resv_tail )
+    {
+        slot = &ring_info->resv[ring_info->resv_head % V4V_RING_RESV_SLOTS];
+        if ( !slot->done )
+            break;
+        ring_info->tx_ptr = slot->end;
+        ring_info->resv_head++;
+    }
 
+    if ( ring_info->tx_ptr == old_tx_ptr )
+        return 0;
 
-/* L3 */
-static void
-v4v_pending_cancel(struct v4v_ring_info *ring_info, domid_t src_id)
-{
-    struct hlist_node *node, *next;
-    struct v4v_pending_ent *ent;
+    v4v_aprintk("ring->tx_ptr: %#x\n", ring_info->tx_ptr);
 
-    v4v_dprintk_in();
-    hlist_for_each_entry_safe(ent, node, next, &ring_info->pending, node)
+    wmb();
+    if ( v4v_update_tx_ptr(ring_info, ring_info->tx_ptr) )
     {
-        if ( ent->id == src_id)
-        {
-            hlist_del(&ent->node);
-            xfree(ent);
-        }
+        printk(KERN_ERR "%s:PROBLHMA v4v_update_tx_ptr\n", __func__);
+        return 0;
     }
-    v4v_dprintk_out();
+
+    return v4v_ringbuf_need_signal(ring_info, old_tx_ptr, ring_info->tx_ptr);
 }
 
 /*
- * ring data
+ * Append the len bytes of the niov iovs to the stream ring ring_info, as
+ * many of them as fit, and return how many. The copy is short rather
+ * than failing with -EAGAIN unless the ring is full. L3
  */
-
-/*Caller should hold R(L1)*/
-static int
-v4v_fill_ring_data(struct domain *src_d,
-                   XEN_GUEST_HANDLE(v4v_ring_data_ent_t) data_ent_hnd)
+static long
+v4v_ringbuf_insert_stream(struct v4v_ring_info *ring_info,
+                          const v4v_iov_t *iovs, uint32_t niov,
+                          size_t len, bool_t *signal)
 {
-    v4v_ring_data_ent_t ent;
-    struct domain *dst_d;
-    struct v4v_ring_info *ring_info;
-    int ret = 0;
+    v4v_ring_t *ringp;
+    uint32_t rx_ptr, tx_ptr = ring_info->tx_ptr, old_tx_ptr = tx_ptr;
+    size_t left;
+    int32_t sp;
+    int ret;
+
+    ASSERT(spin_is_locked(&ring_info->lock));
 
     v4v_dprintk_in();
-    if ( (ret = copy_from_guest(&ent, data_ent_hnd, 1)) )
+    *signal = 0;
+
+    if ( ring_info->frozen )
     {
-        printk("%s: ret=%d\n", __func__, ret);
-        ret = -EFAULT;
+        ret = -EAGAIN;
         goto out;
     }
 
-    v4v_aprintk("v4v_fill_ring_data: ent.ring.domain=%d,ent.ring.port=%u\n",
-                (int)ent.ring.domain, (int)ent.ring.port);
-
-    ent.flags = 0;
+    if ( !(ringp = v4v_ring_header(ring_info)) )
+    {
+        ret = -EFAULT;
+        goto out;
+    }
+    rx_ptr = read_atomic(&ringp->rx_ptr);
+    smp_rmb();
 
-    dst_d = get_domain_by_id(ent.ring.domain);
+    if ( rx_ptr >= ring_info->len )
+    {
+        ret = -EINVAL;
+        goto out;
+    }
 
-    if ( dst_d && dst_d->v4v )
+    sp = rx_ptr - tx_ptr - 1;
+    if ( sp < 0 )
+        sp += ring_info->len;
+    if ( !sp && len )
     {
-        read_lock(&dst_d->v4v->lock);
-        ring_info = v4v_ring_find_info_by_addr(dst_d, &ent.ring,
-                                               src_d->domain_id);
+        ret = -EAGAIN;
+        goto out;
+    }
 
-        if ( ring_info )
+    left = len = min_t(size_t, len, sp);
+    for ( ; left && niov; niov--, iovs++ )
+    {
+        XEN_GUEST_HANDLE(uint8_t) buf_hnd;
+        uint32_t chunk = min_t(size_t, left, iovs->iov_len);
+        uint32_t part = min_t(uint32_t, chunk, ring_info->len - tx_ptr);
+
+        /* checked by v4v_iov_snapshot() */
+        buf_hnd.p = (uint8_t *)iovs->iov_base; //FIXME
+        ret = v4v_memcpy_to_guest_ring(ring_info,
+                                       tx_ptr + sizeof (v4v_ring_t),
+                                       NULL, buf_hnd, part);
+        if ( !ret && (chunk > part) )
         {
-            uint32_t space_avail;
-
-            ent.flags |= V4V_RING_DATA_F_EXISTS;
-            ent.max_message_size =
-                ring_info->len - sizeof (struct v4v_ring_message_header) -
-                V4V_ROUNDUP(1);
-            spin_lock(&ring_info->lock);
-
-            space_avail = v4v_ringbuf_payload_space(dst_d, ring_info);
-
-            if ( space_avail >= ent.space_required )
-            {
-                v4v_pending_cancel(ring_info, src_d->domain_id);
-                ent.flags |= V4V_RING_DATA_F_SUFFICIENT;
-            }
-            else
-            {
-                v4v_pending_requeue(ring_info, src_d->domain_id,
-                        ent.space_required);
-                ent.flags |= V4V_RING_DATA_F_PENDING;
-	        v4v_dprintk("space_available= %#x, req: %#x\n", space_avail, ent.space_required);
-            }
-
-            spin_unlock(&ring_info->lock);
-
-            if ( space_avail == ent.max_message_size )
-                ent.flags |= V4V_RING_DATA_F_EMPTY;
-
+            guest_handle_add_offset(buf_hnd, part);
+            ret = v4v_memcpy_to_guest_ring(ring_info, sizeof (v4v_ring_t),
+                                           NULL, buf_hnd, chunk - part);
         }
-        read_unlock(&dst_d->v4v->lock);
+        if ( ret )
+            goto out;
+
+        tx_ptr += chunk;
+        if ( tx_ptr >= ring_info->len )
+            tx_ptr -= ring_info->len;
+        left -= chunk;
     }
 
-    if ( dst_d )
-        put_domain(dst_d);
+    if ( tx_ptr == old_tx_ptr )
+        goto out;
 
-    if ( (ret = copy_field_to_guest(data_ent_hnd, &ent, flags)) )
-    {
-        //v4v_dprintk("EFAULT\n");
-        printk("%s: ret=%d\n", __func__, ret);
-        ret = -EFAULT;
+    /* the bytes are there before tx_ptr says so */
+    wmb();
+    ring_info->tx_ptr = ring_info->resv_ptr = tx_ptr;
+    if ( (ret = v4v_update_tx_ptr(ring_info, tx_ptr)) )
         goto out;
-    }
+
+    *signal = v4v_ringbuf_need_signal(ring_info, old_tx_ptr, tx_ptr);
+
 out:
+    v4v_ring_unmap(ring_info);
     v4v_dprintk_out();
-    return ret;
+    return ret ? ret : len;
 }
 
-/*Called should hold no more than R(L1) */
-static int
-v4v_fill_ring_datas(struct domain *d, int nent,
-                     XEN_GUEST_HANDLE(v4v_ring_data_ent_t) data_ent_hnd)
+static long
+v4v_ringbuf_insertv(struct domain *d,
+                    struct v4v_ring_info *ring_info,
+                    v4v_ring_id_t *src_id, uint32_t proto, uint32_t flags,
+                    void *table, uint32_t table_len,
+                    const v4v_iov_t *iovs, uint32_t niov,
+                    size_t len, bool_t *signal)
 {
-    int ret = 0;
+    struct v4v_ring_message_header mh = { 0 };
+    uint32_t tx_ptr, mh_ptr, stamp_len;
+    unsigned int resv;
+    bool_t unlocked;
+    int32_t sp;
+    long happy_ret;
+    int32_t ret = 0;
+
+    ASSERT(spin_is_locked(&ring_info->lock));
 
     v4v_dprintk_in();
-    read_lock(&v4v_lock);
-    while ( !ret && nent-- )
-    {
-        ret = v4v_fill_ring_data(d, data_ent_hnd);
-        guest_handle_add_offset(data_ent_hnd, 1);
-    }
-    read_unlock(&v4v_lock);
-    v4v_dprintk_out();
-    return ret;
-}
+    happy_ret = len;
+    *signal = 0;
 
-/*
- * ring
- */
-static int
-v4v_find_ring_mfns(struct domain *d, struct v4v_ring_info *ring_info,
-                   uint32_t npage, XEN_GUEST_HANDLE(v4v_pfn_t) pfn_hnd)
-{
-    int i,j;
-    mfn_t *mfns;
-    uint8_t **mfn_mapping;
-    unsigned long mfn;
-    struct page_info *page;
-    int ret = 0;
+    v4v_aprintk("rounduplen: %#lx, sizeof(ring_msg_hdr):%#lx, ring_info->len:%#x\n",
+                V4V_ROUNDUP(len), sizeof (struct v4v_ring_message_header), ring_info->len);
 
-    v4v_dprintk_in();
-    if ( (npage << PAGE_SHIFT) < ring_info->len )
-    {
-        v4v_dprintk("EINVAL\n");
-        ret = -EINVAL;
+    if ( v4v_ring_roundup(ring_info,
+                          len + table_len +
+                          sizeof (struct v4v_ring_message_header)) >=
+            ring_info->len) {
+        ret = -EMSGSIZE;
         goto out;
     }
 
-    mfns = xmalloc_array(mfn_t, npage);
-    if ( !mfns )
-    {
-        v4v_dprintk("ENOMEM\n");
-        ret = -ENOMEM;
+    if ( (ret = v4v_ringbuf_reserve(ring_info, src_id->addr.domain,
+                                    len + table_len, &stamp_len, &tx_ptr,
+                                    &resv)) )
         goto out;
-    }
 
-    mfn_mapping = xmalloc_array(uint8_t *, npage);
-    if ( !mfn_mapping )
-    {
-        xfree(mfns);
-        ret = -ENOMEM;
-        goto out;
-    }
+    mh.len = len + table_len + stamp_len +
+             sizeof (struct v4v_ring_message_header);
+    mh.source = src_id->addr;
+    mh.message_type = proto;
+    mh.flags = flags;
+    if ( stamp_len )
+        mh.flags |= V4V_MSG_F_TSTAMP;
+    mh_ptr = tx_ptr;
+
+    /*
+     * Large messages are copied with L3 dropped so that other senders
+     * can reserve and copy behind us. The per-page mappings are L3's, so
+     * only when the whole ring is mapped. The ring can't be removed
+     * until we are done, see v4v_ring_remove_info().
+     */
+    unlocked = ring_info->ring_mapping && (len >= V4V_RESV_UNLOCKED_MIN);
+    if ( unlocked )
+        spin_unlock(&ring_info->lock);
 
-    for ( i = 0; i < npage; ++i )
+    do
     {
-        unsigned long pfn;
-        p2m_type_t p2mt;
+        v4v_aprintk("ring->tx_ptr: %#x\n", tx_ptr);
+        if ( (ret = v4v_ringbuf_copy_in(ring_info, &tx_ptr, &mh,
+                                        sizeof (mh))) )
+            break;
 
-        if ( copy_from_guest_offset(&pfn, pfn_hnd, i, 1) )
+        if ( stamp_len )
         {
-            ret = -EFAULT;
-            v4v_dprintk("EFAULT\n");
-            break;
+            uint64_t stamp = NOW();
+
+            if ( (ret = v4v_ringbuf_copy_in(ring_info, &tx_ptr, &stamp,
+                                            stamp_len)) )
+                break;
         }
 
-        mfn = mfn_x(get_gfn(d, pfn, &p2mt));
-        if ( !mfn_valid(mfn) )
-        {
-            printk(KERN_ERR "v4v domain %d passed invalid mfn %"PRI_mfn" ring %p seq %d\n",
-                    d->domain_id, mfn, ring_info, i);
-            ret = -EINVAL;
+        if ( table_len &&
+             (ret = v4v_ringbuf_copy_in(ring_info, &tx_ptr, table,
+                                        table_len)) )
             break;
-        }
-        page = mfn_to_page(mfn);
-        if ( !get_page_and_type(page, d, PGT_writable_page) )
+
+        v4v_aprintk("going to parse niovs: ring->tx_ptr: %#x, \n", tx_ptr);
+        while ( niov-- )
         {
-            printk(KERN_ERR "v4v domain %d passed wrong type mfn %"PRI_mfn" ring %p seq %d\n",
-                    d->domain_id, mfn, ring_info, i);
-            ret = -EINVAL;
-            break;
+            XEN_GUEST_HANDLE(uint8_t) buf_hnd;
+            const v4v_iov_t *iov = iovs++;
+
+            /* checked by v4v_iov_snapshot() */
+            v4v_aprintk("iov[%d].{base:%p, len:%#x\n", niov + 1, (char*)iov->iov_base, iov->iov_len);
+            buf_hnd.p = (uint8_t *)iov->iov_base; //FIXME
+            len = iov->iov_len;
+
+            sp = ring_info->len - tx_ptr;
+            v4v_aprintk("space (len - tx_ptr):%#x, len:%#lx, len-sp:%#lx\n", sp, len, len-sp);
+
+            if ( len > sp )
+            {
+                v4v_aprintk("ring->tx_ptr: %#x, buf_hnd:%p, sp:%#x\n", tx_ptr, buf_hnd.p, sp);
+                ret = v4v_memcpy_to_guest_ring(ring_info,
+                        tx_ptr + sizeof (v4v_ring_t),
+                        NULL, buf_hnd, sp);
+                if ( ret ) {
+                    v4v_dprintk("INSERTV :PROBLHMA v4v_memcpy (len>sp)\n");
+                    break;
+                }
+                tx_ptr = 0;
+
+                len -= sp;
+                guest_handle_add_offset(buf_hnd, sp);
+                v4v_aprintk("len:%#lx, buf:%p, ring->tx_ptr: %#x\n", len, buf_hnd.p, tx_ptr);
+            }
+
+            v4v_aprintk("ring->tx_ptr: %#x, buf_hnd:%p, sp:%#x\n", tx_ptr, buf_hnd.p, sp);
+            ret = v4v_memcpy_to_guest_ring(ring_info,
+                    tx_ptr + sizeof (v4v_ring_t),
+                    NULL, buf_hnd, len);
+            if ( ret ) {
+                printk(KERN_ERR "%s:, ret = %d\n", __func__, ret);
+                break;
+            }
+            tx_ptr += len;
+
+            if ( tx_ptr == ring_info->len )
+                tx_ptr = 0;
+
+            v4v_aprintk("len:%#lx, buf:%p, ring->tx_ptr: %#x\n", len, buf_hnd.p, tx_ptr);
         }
-        mfns[i] = _mfn(mfn);
-        v4v_dprintk("v4v_find_ring_mfns: %d: %lx -> %lx\n",
-                    i, (unsigned long)pfn, (unsigned long)mfn_x(mfns[i]));
-        mfn_mapping[i] = NULL;
-        put_gfn(d, pfn);
-    }
+        if ( ret )
+            printk(KERN_ERR "%s: :PROBLHMA after while niov\n", __func__);
+    } while ( 0 );
 
-    if ( !ret )
-    {
-        ring_info->npage = npage;
-        ring_info->mfns = mfns;
-        ring_info->mfn_mapping = mfn_mapping;
-    }
-    else
-    {
-        j = i;
-        for ( i = 0; i < j; ++i )
-            if ( mfn_x(mfns[i]) != 0 )
-                put_page_and_type(mfn_to_page(mfn_x(mfns[i])));
-        xfree(mfn_mapping);
-        xfree(mfns);
-    }
+    if ( unlocked )
+        spin_lock(&ring_info->lock);
+
+    *signal = v4v_ringbuf_publish(ring_info, resv, mh_ptr, &mh, ret);
+
+    v4v_ring_unmap(ring_info);
 
 out:
     v4v_dprintk_out();
-    return ret;
+    return ret ? ret : happy_ret;
 }
 
+/*
+ * A fragment of a V4VOP_sendv with V4V_SENDV_F_FRAGMENT is only queued
+ * with room for 1 / (1 << V4V_FRAGMENT_MIN_SHIFT) of the ring.
+ */
+#define V4V_FRAGMENT_MIN_SHIFT  3
 
-static struct v4v_ring_info *
-v4v_ring_find_info(struct domain *d, v4v_ring_id_t *id)
+/*
+ * Queue the head of a message that doesn't fit as a fragment with
+ * V4V_MSG_F_MORE, as long as the ring has room for enough of it, and
+ * return its length. The niov iovs are trimmed to it. L3
+ */
+static long
+v4v_ringbuf_insert_fragment(struct domain *d,
+                            struct v4v_ring_info *ring_info,
+                            v4v_ring_id_t *src_id, uint32_t proto,
+                            v4v_iov_t *iovs, uint32_t niov, bool_t *signal)
 {
-    uint16_t hash;
-    struct hlist_node *node;
-    struct v4v_ring_info *ring_info;
-    struct v4v_ring_info * ret = NULL;
-
-    v4v_dprintk_in();
-    ASSERT(rw_is_locked(&d->v4v->lock));
-
-    hash = v4v_hash_fn(id);
-
-    v4v_dprintk("ring_find_info: d->v4v=%p, d->v4v->ring_hash[%d]=%p id=%p\n",
-                d->v4v, (int)hash, d->v4v->ring_hash[hash].first, id);
-    v4v_dprintk("ring_find_info: id.addr.port=%d id.addr.domain=%d id.addr.partner=%d\n",
-                id->addr.port, id->addr.domain, id->partner);
-
-    hlist_for_each_entry(ring_info, node, &d->v4v->ring_hash[hash], node)
+    int32_t space = v4v_ringbuf_payload_space(d, ring_info);
+    int32_t frag;
+    uint32_t i, left;
+
+    *signal = 0;
+    space -= v4v_ring_held(ring_info, src_id->addr.domain);
+    if ( space < (int32_t)(ring_info->len >> V4V_FRAGMENT_MIN_SHIFT) )
+        return -EAGAIN;
+
+    /* leave room for the rounding and a time stamp */
+    frag = (space & ~(ring_info->align - 1)) - ring_info->align -
+           sizeof (uint64_t);
+    if ( frag <= 0 )
+        return -EAGAIN;
+
+    for ( i = 0, left = frag; i < niov; i++ )
     {
-        v4v_ring_id_t *cmpid = &ring_info->id;
-
-        //v4v_dprintk("ring_find_info: ring_info=%p, port=%u, domain=%d\n", cmpid, cmpid->addr.port, cmpid->addr.domain);
-        if ( cmpid->addr.port == id->addr.port &&
-             cmpid->addr.domain == id->addr.domain) //&&
-             //cmpid->partner == id->partner)
+        if ( iovs[i].iov_len >= left )
         {
-            //v4v_dprintk("ring_find_info: ring_info=%p\n", ring_info);
-            ret = ring_info;
-            goto out;
+            iovs[i].iov_len = left;
+            niov = i + 1;
+            break;
         }
+        left -= iovs[i].iov_len;
     }
-    //v4v_dprintk("ring_find_info: no ring_info found\n");
-out:
-    v4v_dprintk_out();
-    return ret;
+
+    return v4v_ringbuf_insertv(d, ring_info, src_id, proto, V4V_MSG_F_MORE,
+                               NULL, 0, iovs, niov, frag, signal);
 }
 
-static struct v4v_ring_info *
-v4v_ring_find_info_by_addr(struct domain *d, struct v4v_addr *a, domid_t p)
+/*
+ * As v4v_ringbuf_insertv() for a message whose data is in xen memory
+ * rather than guest iovs: len bytes at buf followed by len2 bytes at
+ * buf2. flags are stored in the message header.
+ */
+static long
+v4v_ringbuf_insert_buf(struct domain *d, struct v4v_ring_info *ring_info,
+                       v4v_ring_id_t *src_id, uint32_t proto, uint32_t flags,
+                       void *buf, uint32_t len, void *buf2, uint32_t len2,
+                       bool_t *signal)
 {
-    v4v_ring_id_t id;
-    struct v4v_ring_info *ret;
+    struct v4v_ring_message_header mh = { 0 };
+    uint32_t tx_ptr, mh_ptr, stamp_len;
+    unsigned int resv;
+    bool_t unlocked;
+    int ret;
+
+    ASSERT(spin_is_locked(&ring_info->lock));
 
     v4v_dprintk_in();
-    ASSERT(rw_is_locked(&d->v4v->lock));
+    *signal = 0;
 
-    if ( !a ) {
-        ret = NULL;
+    if ( (ret = v4v_ringbuf_reserve(ring_info, src_id->addr.domain,
+                                    len + len2, &stamp_len, &tx_ptr,
+                                    &resv)) )
         goto out;
-    }
 
-    id.addr.port = a->port;
-    id.addr.domain = d->domain_id;
-    //id.partner = p;
+    mh.len = len + len2 + stamp_len + sizeof (mh);
+    mh.flags = flags | (stamp_len ? V4V_MSG_F_TSTAMP : 0);
+    mh.source = src_id->addr;
+    mh.message_type = proto;
+    mh_ptr = tx_ptr;
 
-    ret = v4v_ring_find_info(d, &id);
-    if ( ret ) {
-        goto out;
+    /* as in v4v_ringbuf_insertv(), buf must stay put meanwhile */
+    unlocked = ring_info->ring_mapping &&
+               ((len + len2) >= V4V_RESV_UNLOCKED_MIN);
+    if ( unlocked )
+        spin_unlock(&ring_info->lock);
+
+    ret = v4v_ringbuf_copy_in(ring_info, &tx_ptr, &mh, sizeof (mh));
+    if ( !ret && stamp_len )
+    {
+        uint64_t stamp = NOW();
+
+        ret = v4v_ringbuf_copy_in(ring_info, &tx_ptr, &stamp, stamp_len);
     }
+    if ( !ret )
+        ret = v4v_ringbuf_copy_in(ring_info, &tx_ptr, buf, len);
+    if ( !ret && len2 )
+        ret = v4v_ringbuf_copy_in(ring_info, &tx_ptr, buf2, len2);
 
-    id.partner = V4V_DOMID_ANY;
+    if ( unlocked )
+        spin_lock(&ring_info->lock);
+
+    *signal = v4v_ringbuf_publish(ring_info, resv, mh_ptr, &mh, ret);
 
-    ret = v4v_ring_find_info(d, &id);
 out:
+    v4v_ring_unmap(ring_info);
     v4v_dprintk_out();
-    return ret;
+    return ret ? ret : len + len2;
 }
 
-static void v4v_ring_remove_mfns(struct domain *d, struct v4v_ring_info *ring_info)
+/* pending */
+
+/* L3, d owns ring_info */
+static void
+v4v_ring_add_waiter(struct domain *d, struct v4v_ring_info *ring_info)
 {
-    int i;
+    struct v4v_domain *v4v = rcu_dereference(d->v4v);
 
-    v4v_dprintk_in();
-    ASSERT(rw_is_write_locked(&d->v4v->lock));
+    ASSERT(spin_is_locked(&ring_info->lock));
 
-    if ( ring_info->mfns )
-    {
-        for ( i = 0; i < ring_info->npage; ++i )
-            if ( mfn_x(ring_info->mfns[i]) != 0 )
-                put_page_and_type(mfn_to_page(mfn_x(ring_info->mfns[i])));
-        xfree(ring_info->mfns);
-    }
-    if ( ring_info->mfn_mapping )
-        xfree(ring_info->mfn_mapping);
-    ring_info->mfns = NULL;
+    if ( ring_info->waiting )
+        return;
 
-    v4v_dprintk_out();
+    ring_info->waiting = 1;
+    spin_lock(&v4v->waiters_lock);
+    list_add_tail(&ring_info->waiter, &v4v->waiters);
+    spin_unlock(&v4v->waiters_lock);
 }
 
+/* L3, ring_info is on d's waiters list (not on a notifier's) */
 static void
-v4v_ring_remove_info(struct domain *d, struct v4v_ring_info *ring_info)
+v4v_ring_del_waiter(struct domain *d, struct v4v_ring_info *ring_info)
 {
-    v4v_dprintk_in();
-    ASSERT(rw_is_write_locked(&d->v4v->lock));
+    struct v4v_domain *v4v = rcu_dereference(d->v4v);
 
-    spin_lock(&ring_info->lock);
-
-    v4v_pending_remove_all(ring_info);
-    hlist_del(&ring_info->node);
-    v4v_ring_remove_mfns(d, ring_info);
+    ASSERT(spin_is_locked(&ring_info->lock));
 
-    spin_unlock(&ring_info->lock);
+    if ( !ring_info->waiting )
+        return;
 
-    xfree(ring_info);
-    v4v_dprintk_out();
+    spin_lock(&v4v->waiters_lock);
+    list_del(&ring_info->waiter);
+    spin_unlock(&v4v->waiters_lock);
+    ring_info->waiting = 0;
 }
 
-/* Call from guest to unpublish a ring */
-static long
-v4v_ring_remove(struct domain *d, XEN_GUEST_HANDLE(v4v_ring_t) ring_hnd)
+/*
+ * d owns the ring the entry is for. Caller is in an RCU read section or
+ * holds L2 on d, and d->v4v is still there.
+ */
+static struct v4v_pending_ent *
+v4v_pending_alloc(struct domain *d)
 {
-    struct v4v_ring ring;
-    struct v4v_ring_info *ring_info;
-    int ret = 0;
+    struct v4v_domain *v4v = rcu_dereference(d->v4v);
+    struct v4v_pending_ent *ent = NULL;
 
-    v4v_dprintk_in();
-    read_lock(&v4v_lock);
-
-    do
+    spin_lock(&v4v->pending_lock);
+    if ( !hlist_empty(&v4v->pending_free) )
     {
-        if ( !d->v4v )
-        {
-            v4v_dprintk("EINVAL\n");
-            ret = -EINVAL;
-            break;
-        }
-
-        if ( copy_from_guest(&ring, ring_hnd, 1) )
-        {
-            v4v_dprintk("EFAULT\n");
-            ret = -EFAULT;
-            break;
-        }
+        ent = hlist_entry(v4v->pending_free.first, struct v4v_pending_ent,
+                          node);
+        hlist_del(&ent->node);
+    }
+    spin_unlock(&v4v->pending_lock);
 
-        if ( ring.magic != V4V_RING_MAGIC )
-        {
-            v4v_dprintk("ring.magic(%"PRIx64") != V4V_RING_MAGIC(%"PRIx64"), EINVAL\n",
-                    ring.magic, V4V_RING_MAGIC);
-            ret = -EINVAL;
-            break;
-        }
+    if ( !ent )
+    {
+        ent = xmalloc(struct v4v_pending_ent);
+        if ( ent )
+            ent->pooled = 0;
+    }
 
-        ring.id.addr.domain = d->domain_id;
+    return ent;
+}
 
-        write_lock(&d->v4v->lock);
-        ring_info = v4v_ring_find_info(d, &ring.id);
+static void
+v4v_pending_free(struct domain *d, struct v4v_pending_ent *ent)
+{
+    struct v4v_domain *v4v = rcu_dereference(d->v4v);
 
-        if ( ring_info )
-            v4v_ring_remove_info(d, ring_info);
+    if ( !ent->pooled )
+    {
+        xfree(ent);
+        return;
+    }
 
-        write_unlock(&d->v4v->lock);
+    spin_lock(&v4v->pending_lock);
+    hlist_add_head(&ent->node, &v4v->pending_free);
+    spin_unlock(&v4v->pending_lock);
+}
 
-        if ( !ring_info )
-        {
-            v4v_dprintk("ENOENT\n");
-            ret = -ENOENT;
-            break;
-        }
+static void
+v4v_pending_remove_ent(struct domain *d, struct v4v_pending_ent *ent)
+{
+    v4v_dprintk_in();
+    hlist_del(&ent->node);
+    v4v_pending_free(d, ent);
+    v4v_dprintk_out();
+}
 
-    }
-    while ( 0 );
+static void
+v4v_pending_remove_all(struct domain *d, struct v4v_ring_info *info)
+{
+    struct hlist_node *node, *next;
+    struct v4v_pending_ent *pending_ent;
 
-    read_unlock(&v4v_lock);
+    v4v_dprintk_in();
+    ASSERT(spin_is_locked(&info->lock));
+    hlist_for_each_entry_safe(pending_ent, node, next, &info->pending,
+            node) v4v_pending_remove_ent(d, pending_ent);
+    v4v_ring_del_waiter(d, info);
     v4v_dprintk_out();
-    return ret;
 }
 
-/* call from guest to publish a ring */
-static long
-v4v_ring_add(struct domain *d, XEN_GUEST_HANDLE(v4v_ring_t) ring_hnd,
-             uint32_t npage, XEN_GUEST_HANDLE(v4v_pfn_t) pfn_hnd)
+/*
+ * Update entry slot of the peer space page of p: flags 0 forgets the
+ * connection.
+ */
+static void
+v4v_peer_publish(struct v4v_peer *p, unsigned int slot, v4v_addr_t *dst,
+                 uint16_t flags, uint32_t space)
 {
-    struct v4v_ring ring;
-    struct v4v_ring_info *ring_info;
-    int need_to_insert = 0;
-    int ret = 0;
+    v4v_peer_ent_t *ent;
 
-    v4v_dprintk_in();
-    if ( (long)ring_hnd.p & (PAGE_SIZE - 1) )
+    spin_lock(&p->lock);
+    if ( flags )
     {
-        //v4v_dprintk("EINVAL\n");
-        ret = -EINVAL;
-        goto out;
+        p->used |= 1ULL << slot;
+        p->dst[slot] = *dst;
     }
+    else
+        p->used &= ~(1ULL << slot);
 
-    read_lock(&v4v_lock);
-    do
+    if ( p->page )
     {
-        if ( !d->v4v )
-        {
-            v4v_dprintk(" !d->v4v, EINVAL\n");
-            ret = -EINVAL;
-            break;
-        }
-
-        if ( copy_from_guest(&ring, ring_hnd, 1) )
-        {
-            v4v_dprintk(" copy_from_guest failed, EFAULT\n");
-            ret = -EFAULT;
-            break;
-        }
-
-        if ( ring.magic != V4V_RING_MAGIC )
-        {
-            v4v_dprintk("ring.magic(%lx) != V4V_RING_MAGIC(%lx), EINVAL\n",
-                        ring.magic, V4V_RING_MAGIC);
-            ret = -EINVAL;
-            break;
-        }
-
-        if ( (ring.len <
-                    (sizeof (struct v4v_ring_message_header) + V4V_ROUNDUP(1) +
-                     V4V_ROUNDUP(1))) || (V4V_ROUNDUP(ring.len) != ring.len) )
-        {
-            v4v_dprintk("EINVAL\n");
-            ret = -EINVAL;
-            break;
-        }
-
-        ring.id.addr.domain = d->domain_id;
-        if ( copy_field_to_guest(ring_hnd, &ring, id) )
-        {
-            v4v_dprintk("EFAULT\n");
-            ret = -EFAULT;
-            break;
-        }
-
-        /*
-         * no need for a lock yet, because only we know about this
-         * set the tx pointer if it looks bogus (we don't reset it
-         * because this might be a re-register after S4)
-         */
-        if ( (ring.tx_ptr >= ring.len)
-                || (V4V_ROUNDUP(ring.tx_ptr) != ring.tx_ptr) )
-        {
-            ring.tx_ptr = ring.rx_ptr;
-        }
-        copy_field_to_guest(ring_hnd, &ring, tx_ptr);
-
-        read_lock(&d->v4v->lock);
-        ring_info = v4v_ring_find_info(d, &ring.id);
+        ent = &p->page->ent[slot];
+        ent->dst = *dst;
+        write_atomic(&ent->space, space);
+        smp_wmb();
+        write_atomic(&ent->flags, flags);
+    }
+    spin_unlock(&p->lock);
+}
 
-        if ( !ring_info )
-        {
-            read_unlock(&d->v4v->lock);
-            ring_info = xmalloc(struct v4v_ring_info);
-            if ( !ring_info )
-            {
-                //v4v_dprintk("ENOMEM\n");
-                ret = -ENOMEM;
-                break;
-            }
-            need_to_insert++;
-            spin_lock_init(&ring_info->lock);
-            INIT_HLIST_HEAD(&ring_info->pending);
-            ring_info->mfns = NULL;
+/*
+ * The receiver freed the space ent waited for in the ring ent->ring:
+ * update the entries of the sender's connections to it. Caller is in an
+ * RCU read section.
+ */
+static void
+v4v_peer_wake(struct v4v_pending_ent *ent)
+{
+    struct domain *d;
+    struct v4v_domain *v4v;
+    struct v4v_peer *p;
+    v4v_peer_ent_t *pent;
+    unsigned int i;
 
-        }
-        else
-        {
-            /*
-             * Ring info already existed.
-             */
-            printk(KERN_INFO "v4v: dom%d ring already registered\n",
-                    current->domain->domain_id);
-            ret = -EEXIST;
-            break;
-        }
+    if ( !atomic_read(&v4v_peer_users) || (ent->ring.domain == DOMID_INVALID) )
+        return;
 
-        spin_lock(&ring_info->lock);
-        ring_info->id = ring.id;
-        ring_info->len = ring.len;
-        ring_info->tx_ptr = ring.tx_ptr;
-        ring_info->ring = ring_hnd;
-        if ( ring_info->mfns )
-            xfree(ring_info->mfns);
-        ret = v4v_find_ring_mfns(d, ring_info, npage, pfn_hnd);
-        spin_unlock(&ring_info->lock);
-        if ( ret )
-            break;
+    d = get_domain_by_id(ent->id);
+    if ( !d )
+        return;
 
-        if ( !need_to_insert )
-        {
-            read_unlock(&d->v4v->lock);
-        }
-        else
+    v4v = rcu_dereference(d->v4v);
+    p = v4v ? rcu_dereference(v4v->peer) : NULL;
+    if ( p )
+    {
+        spin_lock(&p->lock);
+        for ( i = 0; p->page && (i < V4V_CONNECT_MAX); i++ )
         {
-            uint16_t hash = v4v_hash_fn(&ring.id);
-            write_lock(&d->v4v->lock);
-            hlist_add_head(&ring_info->node, &d->v4v->ring_hash[hash]);
-            write_unlock(&d->v4v->lock);
+            if ( !(p->used & (1ULL << i)) ||
+                 (p->dst[i].port != ent->ring.port) ||
+                 (p->dst[i].domain != ent->ring.domain) )
+                continue;
+            pent = &p->page->ent[i];
+            write_atomic(&pent->space, ent->space);
+            smp_wmb();
+            write_atomic(&pent->flags, V4V_PEER_F_EXISTS);
         }
+        spin_unlock(&p->lock);
     }
-    while ( 0 );
 
-    read_unlock(&v4v_lock);
-out:
-    v4v_dprintk_out();
-    return ret;
+    put_domain(d);
 }
 
-
-/*
- * io
- */
-
 static void
-v4v_notify_ring(struct domain *d, struct v4v_ring_info *ring_info,
-                struct hlist_head *to_notify)
+v4v_pending_notify(struct domain *caller_d, struct hlist_head *to_notify)
 {
-    uint32_t space;
+    struct hlist_node *node, *next;
+    struct v4v_pending_ent *pending_ent;
+    domid_t last = DOMID_INVALID;
 
     v4v_dprintk_in();
-    ASSERT(rw_is_locked(&v4v_lock));
-    ASSERT(rw_is_locked(&d->v4v->lock));
 
-    spin_lock(&ring_info->lock);
-    space = v4v_ringbuf_payload_space(d, ring_info);
-    spin_unlock(&ring_info->lock);
+    hlist_for_each_entry_safe(pending_ent, node, next, to_notify, node)
+    {
+        hlist_del(&pending_ent->node);
+        TRACE_2D(TRC_V4V_WAKEUP, (caller_d->domain_id << 16) | pending_ent->id,
+                 pending_ent->len);
+        /* a sender waiting on several rings only needs one event */
+        v4v_peer_wake(pending_ent);
+        if ( pending_ent->id != last )
+            v4v_signal_domid(pending_ent->id);
+        last = pending_ent->id;
+        if ( unlikely(opt_v4v_stats) )
+            v4v_stats_record(V4V_HIST_EAGAIN_NOTIFY, pending_ent->queued);
+        v4v_pending_free(caller_d, pending_ent);
+    }
 
-    v4v_pending_find(d, ring_info, space, to_notify);
     v4v_dprintk_out();
 }
 
-/*notify hypercall*/
-static long
-v4v_notify(struct domain *d,
-           XEN_GUEST_HANDLE(v4v_ring_data_t) ring_data_hnd)
+/*caller must have L3 */
+static int
+v4v_pending_queue(struct domain *d, struct v4v_ring_info *ring_info,
+                  domid_t src_id, int len)
 {
-    v4v_ring_data_t ring_data;
-    HLIST_HEAD(to_notify);
-    int i;
+    struct v4v_pending_ent *ent = v4v_pending_alloc(d);
+    struct hlist_node *node, *last = NULL;
     int ret = 0;
-
     v4v_dprintk_in();
-    read_lock(&v4v_lock);
 
-    if ( !d->v4v )
+    if ( !ent )
     {
-        read_unlock(&v4v_lock);
-        v4v_dprintk("!d->v4v, ENODEV\n");
-        ret = -ENODEV;
+        v4v_dprintk("ENOMEM\n");
+        ret = -ENOMEM;
         goto out;
     }
 
-    read_lock(&d->v4v->lock);
-    for ( i = 0; i < V4V_HTABLE_SIZE; ++i )
-    {
-        struct hlist_node *node, *next;
-        struct v4v_ring_info *ring_info;
+    ent->len = len;
+    ent->id = src_id;
+    ent->ring.domain = DOMID_INVALID;
+    if ( unlikely(opt_v4v_stats) )
+        ent->queued = NOW();
+
+    /* oldest first, the order v4v_notify_ring() wakes them in */
+    hlist_for_each(node, &ring_info->pending)
+        last = node;
+    if ( last )
+        hlist_add_after(last, &ent->node);
+    else
+        hlist_add_head(&ent->node, &ring_info->pending);
+    v4v_ring_add_waiter(d, ring_info);
 
-        hlist_for_each_entry_safe(ring_info, node,
-                next, &d->v4v->ring_hash[i],
-                node)
-        {
-            v4v_notify_ring(d, ring_info, &to_notify);
-        }
+out:
+    v4v_dprintk_out();
+    return ret;
+}
+
+/* L3 */
+static int
+v4v_pending_requeue(struct domain *d, struct v4v_ring_info *ring_info,
+                    domid_t src_id, int len)
+{
+    struct hlist_node *node;
+    struct v4v_pending_ent *ent;
+    int ret = 0;
+
+    v4v_dprintk_in();
+    //printk("pending requeue\n");
+    hlist_for_each_entry(ent, node, &ring_info->pending, node)
+    {
+        if ( ent->id == src_id )
+        {
+            if ( ent->len < len )
+                ent->len = len;
+            ret = 0;
+            goto out;
+        }
     }
-    read_unlock(&d->v4v->lock);
 
-    if ( !hlist_empty(&to_notify) )
-        v4v_pending_notify(d, &to_notify);
+    ret = v4v_pending_queue(d, ring_info, src_id, len);
+out:
+    /* hold the space for a large sender, one at a time */
+    if ( !ret && !ring_info->credits &&
+         ((uint32_t)len > (ring_info->len >> V4V_HOLD_MIN_SHIFT)) &&
+         !v4v_ring_held(ring_info, src_id) )
+    {
+        ring_info->hold_id = src_id;
+        ring_info->hold_len = len;
+        ring_info->hold_until = 0;
+    }
+    TRACE_3D(TRC_V4V_PENDING, (d->domain_id << 16) | src_id,
+             ring_info->id.addr.port, len);
+    v4v_dprintk_out();
+    return ret;
+}
 
-    do
+
+/* L3 */
+static void
+v4v_pending_cancel(struct domain *d, struct v4v_ring_info *ring_info,
+                   domid_t src_id)
+{
+    struct hlist_node *node, *next;
+    struct v4v_pending_ent *ent;
+
+    v4v_dprintk_in();
+    hlist_for_each_entry_safe(ent, node, next, &ring_info->pending, node)
     {
-        if ( !guest_handle_is_null(ring_data_hnd) )
+        if ( ent->id == src_id)
+            v4v_pending_remove_ent(d, ent);
+    }
+
+    /* it was told the space is there, it has to come and take it */
+    if ( ring_info->hold_len && (ring_info->hold_id == src_id) &&
+         !ring_info->hold_until )
+        ring_info->hold_until = NOW() + V4V_HOLD_TIMEOUT;
+    v4v_dprintk_out();
+}
+
+/*
+ * ring data
+ */
+
+/*
+ * Fill in ent, an entry of a V4VOP_notify for a ring of dst_d (NULL if
+ * there isn't such a domain). Caller should be in an RCU read section.
+ */
+static int
+v4v_fill_ring_data(struct domain *src_d, struct domain *dst_d,
+                   v4v_ring_data_ent_t *ent)
+{
+    struct v4v_ring_info *ring_info;
+    int ret = 0;
+
+    v4v_dprintk_in();
+    v4v_aprintk("v4v_fill_ring_data: ent.ring.domain=%d,ent.ring.port=%u\n",
+                (int)ent->ring.domain, (int)ent->ring.port);
+
+    ent->flags = 0;
+    ent->node = V4V_NODE_NONE;
+
+    if ( dst_d && rcu_dereference(dst_d->v4v) )
+    {
+        ring_info = v4v_ring_find_info_by_addr(dst_d, &ent->ring,
+                                               src_d->domain_id, 0);
+
+        if ( ring_info )
+            spin_lock(&ring_info->lock);
+        if ( ring_info && v4v_ring_is_dead(ring_info) )
         {
-            /* Quick sanity check on ring_data_hnd */
-            if ( copy_field_from_guest(&ring_data, ring_data_hnd, magic) )
-            {
-                v4v_dprintk("copy_field_from_guest failed\n");
-                ret = -EFAULT;
-                break;
-            }
+            spin_unlock(&ring_info->lock);
+            ring_info = NULL;
+        }
 
-            if ( ring_data.magic != V4V_RING_DATA_MAGIC )
+        if ( ring_info )
+        {
+            uint32_t space_avail;
+
+            ent->flags |= V4V_RING_DATA_F_EXISTS;
+            ent->max_message_size = ring_info->stream ? ring_info->len - 1 :
+                ring_info->len - sizeof (struct v4v_ring_message_header) -
+                ring_info->align;
+            if ( ring_info->numa_node != NUMA_NO_NODE )
+                ent->node = ring_info->numa_node;
+
+            space_avail = v4v_ringbuf_payload_space(dst_d, ring_info);
+
+            if ( space_avail >= ent->space_required )
             {
-                v4v_dprintk("ring.magic(%lx) != V4V_RING_MAGIC(%lx), EINVAL\n",
-                        ring_data.magic, V4V_RING_MAGIC);
-                ret = -EINVAL;
-                break;
+                v4v_pending_cancel(dst_d, ring_info, src_d->domain_id);
+                ent->flags |= V4V_RING_DATA_F_SUFFICIENT;
             }
-
-            if ( copy_from_guest(&ring_data, ring_data_hnd, 1) )
+            else
             {
-                v4v_dprintk("copy_from_guest failed\n");
-                ret = -EFAULT;
-                break;
+                /* no wake up was scheduled, don't let the caller wait for one */
+                if ( v4v_pending_requeue(dst_d, ring_info, src_d->domain_id,
+                                         ent->space_required) )
+                    ret = -ENOMEM;
+                else
+                    ent->flags |= V4V_RING_DATA_F_PENDING;
+                v4v_dprintk("space_available= %#x, req: %#x\n", space_avail,
+                            ent->space_required);
             }
 
+            spin_unlock(&ring_info->lock);
+
+            if ( space_avail == ent->max_message_size )
+                ent->flags |= V4V_RING_DATA_F_EMPTY;
+        }
+    }
+
+    v4v_dprintk_out();
+    return ret;
+}
+
+/*
+ * The entries of a V4VOP_notify are read from the guest and written back
+ * a chunk at a time, into this CPU's buffer as the pfn lists are.
+ */
+#define V4V_RING_DATA_CHUNK     32
+static DEFINE_PER_CPU(v4v_ring_data_ent_t[V4V_RING_DATA_CHUNK],
+                      v4v_ring_data_chunk);
+
+/*
+ * Fill in the nent entries at data_ent_hnd. Each chunk is walked in
+ * destination domain order, so that the entries for one domain share
+ * its lookup. Caller should be in an RCU read section.
+ */
+static int
+v4v_fill_ring_datas(struct domain *d, int nent,
+                     XEN_GUEST_HANDLE(v4v_ring_data_ent_t) data_ent_hnd)
+{
+    v4v_ring_data_ent_t *ents = this_cpu(v4v_ring_data_chunk);
+    uint8_t order[V4V_RING_DATA_CHUNK];
+    struct domain *dst_d = NULL;
+    domid_t dst_id = DOMID_INVALID;
+    unsigned int i, j, n;
+    int rc, ret = 0;
+
+    v4v_dprintk_in();
+    while ( !ret && (nent > 0) )
+    {
+        n = min_t(unsigned int, nent, V4V_RING_DATA_CHUNK);
+        if ( copy_from_guest(ents, data_ent_hnd, n) )
+        {
+            ret = -EFAULT;
+            break;
+        }
+
+        for ( i = 0; i < n; i++ )
+        {
+            for ( j = i; j && (ents[order[j - 1]].ring.domain >
+                               ents[i].ring.domain); j-- )
+                order[j] = order[j - 1];
+            order[j] = i;
+        }
+
+        for ( i = 0; i < n; i++ )
+        {
+            v4v_ring_data_ent_t *ent = &ents[order[i]];
+
+            if ( ent->ring.domain != dst_id )
             {
-                XEN_GUEST_HANDLE(v4v_ring_data_ent_t) ring_data_ent_hnd;
-                //v4v_dprintk("notifying: %p\n",(void*) &ring_data.data[0]); 
-                ring_data_ent_hnd =
-                    guest_handle_for_field(ring_data_hnd, v4v_ring_data_ent_t, data[0]);
-                ret = v4v_fill_ring_datas(d, ring_data.nent, ring_data_ent_hnd);
+                if ( dst_d )
+                    put_domain(dst_d);
+                dst_id = ent->ring.domain;
+                dst_d = get_domain_by_id(dst_id);
             }
+
+            rc = v4v_fill_ring_data(d, dst_d, ent);
+            if ( !ret )
+                ret = rc;
         }
-    }
-    while ( 0 );
 
-    read_unlock(&v4v_lock);
+        if ( copy_to_guest(data_ent_hnd, ents, n) )
+        {
+            ret = -EFAULT;
+            break;
+        }
+        guest_handle_add_offset(data_ent_hnd, n);
+        nent -= n;
+    }
 
-out:
+    if ( dst_d )
+        put_domain(dst_d);
     v4v_dprintk_out();
     return ret;
 }
 
-#ifdef V4V_DEBUG
-void
-v4vtables_print_rule(struct v4vtables_rule_node *node)
+/*
+ * ring
+ */
+/* Drop the page references held by a ring's extents */
+static void
+v4v_ring_put_extents(struct v4v_ring_extent *ext, uint32_t nextent)
 {
-    v4vtables_rule_t *rule;
+    uint32_t i, j;
 
-    if ( node == NULL )
+    for ( i = 0; i < nextent; ++i )
+        for ( j = 0; j < ext[i].npage; ++j )
+            put_page_and_type(mfn_to_page(mfn_x(ext[i].mfn) + j));
+}
+
+/* the pfn list is read a page worth at a time into this CPU's buffer */
+#define V4V_PFN_CHUNK   (PAGE_SIZE / sizeof (v4v_pfn_t))
+static DEFINE_PER_CPU(v4v_pfn_t[V4V_PFN_CHUNK], v4v_pfn_chunk);
+
+/* The NUMA node all of the extents are on, NUMA_NO_NODE if several */
+static unsigned int
+v4v_ring_node(struct v4v_ring_extent *ext, uint32_t nextent)
+{
+    unsigned int node = NUMA_NO_NODE;
+    uint32_t i, j;
+
+    for ( i = 0; i < nextent; ++i )
+        for ( j = 0; j < ext[i].npage; j += V4V_SUPERPAGE_PAGES )
+        {
+            unsigned int n = phys_to_nid(pfn_to_paddr(mfn_x(ext[i].mfn) + j));
+
+            if ( node == NUMA_NO_NODE )
+                node = n;
+            else if ( n != node )
+                return NUMA_NO_NODE;
+        }
+
+    return node;
+}
+
+/*
+ * Take a reference on each page of the ring and record the ring as runs
+ * of contiguous mfns. A guest backed by superpages, or which allocated a
+ * large ring in one go, usually ends up with very few of them.
+ * Starts at page *done, and returns -ERESTART with *done updated and the
+ * extents so far in ring_info if preempted, for the caller to resume.
+ */
+static int
+v4v_find_ring_mfns(struct domain *d, struct v4v_ring_info *ring_info,
+                   uint32_t npage, XEN_GUEST_HANDLE(v4v_pfn_t) pfn_hnd,
+                   uint32_t *done)
+{
+    v4v_pfn_t *pfns = this_cpu(v4v_pfn_chunk);
+    struct v4v_ring_extent *ext, *exts;
+    uint32_t i, nextent;
+    unsigned long mfn;
+    struct page_info *page;
+    int ret = 0;
+
+    v4v_dprintk_in();
+    if ( (npage << PAGE_SHIFT) < ring_info->len )
     {
-        printk("(null)\n");
-        return;
+        v4v_dprintk("EINVAL\n");
+        ret = -EINVAL;
+        goto out;
     }
 
-    rule = &node->rule;
-
-    if ( rule->accept == 1 )
-        printk("ACCEPT");
+    if ( *done )
+    {
+        exts = ring_info->extents;
+        nextent = ring_info->nextent;
+    }
     else
-        printk("REJECT");
+    {
+        /* worst case, trimmed once we know how many there are */
+        exts = xmalloc_array(struct v4v_ring_extent, npage);
+        if ( !exts )
+        {
+            v4v_dprintk("ENOMEM\n");
+            ret = -ENOMEM;
+            goto out;
+        }
+        nextent = 0;
+    }
 
-    printk(" ");
+    for ( i = *done; i < npage; ++i )
+    {
+        v4v_pfn_t pfn;
+        p2m_type_t p2mt;
 
-    if ( rule->src.domain == V4V_DOMID_ANY )
-        printk("*");
-    else
-        printk("%i", rule->src.domain);
+        if ( !((i - *done) % V4V_PFN_CHUNK) )
+        {
+            if ( (i != *done) && hypercall_preempt_check() )
+            {
+                ring_info->extents = exts;
+                ring_info->nextent = nextent;
+                *done = i;
+                ret = -ERESTART;
+                goto out;
+            }
 
-    printk(":");
+            if ( copy_from_guest_offset(pfns, pfn_hnd, i,
+                                        min_t(uint32_t, npage - i,
+                                              V4V_PFN_CHUNK)) )
+            {
+                ret = -EFAULT;
+                v4v_dprintk("EFAULT\n");
+                break;
+            }
+        }
+        pfn = pfns[(i - *done) % V4V_PFN_CHUNK];
 
-    if ( rule->src.port == -1 )
-        printk("*");
-    else
-        printk("%i", rule->src.port);
+        mfn = mfn_x(get_gfn(d, pfn, &p2mt));
+        if ( !mfn_valid(mfn) )
+        {
+            printk(KERN_ERR "v4v domain %d passed invalid mfn %"PRI_mfn" ring %p seq %d\n",
+                    d->domain_id, mfn, ring_info, i);
+            put_gfn(d, pfn);
+            ret = -EINVAL;
+            break;
+        }
+        page = mfn_to_page(mfn);
+        if ( !get_page_and_type(page, d, PGT_writable_page) )
+        {
+            printk(KERN_ERR "v4v domain %d passed wrong type mfn %"PRI_mfn" ring %p seq %d\n",
+                    d->domain_id, mfn, ring_info, i);
+            put_gfn(d, pfn);
+            ret = -EINVAL;
+            break;
+        }
+        put_gfn(d, pfn);
+        v4v_dprintk("v4v_find_ring_mfns: %d: %lx -> %lx\n",
+                    i, (unsigned long)pfn, mfn);
 
-    printk(" -> ");
+        ext = nextent ? &exts[nextent - 1] : NULL;
+        if ( ext && (mfn == (mfn_x(ext->mfn) + ext->npage)) &&
+             (pfn == (ext->pfn + ext->npage)) )
+            ext->npage++;
+        else
+        {
+            ext = &exts[nextent++];
+            ext->mfn = _mfn(mfn);
+            ext->pfn = pfn;
+            ext->first = i;
+            ext->npage = 1;
+        }
+    }
 
-    if ( rule->dst.domain == V4V_DOMID_ANY )
-        printk("*");
-    else
-        printk("%i", rule->dst.domain);
+    if ( ret )
+    {
+        v4v_ring_put_extents(exts, nextent);
+        xfree(exts);
+        ring_info->extents = NULL;
+        ring_info->nextent = 0;
+        goto out;
+    }
 
-    printk(":");
+    if ( nextent < npage )
+    {
+        ext = xmalloc_array(struct v4v_ring_extent, nextent);
+        if ( ext )
+        {
+            memcpy(ext, exts, nextent * sizeof (*ext));
+            xfree(exts);
+            exts = ext;
+        }
+    }
 
-    if ( rule->dst.port == -1 )
-        printk("*");
-    else
-        printk("%i", rule->dst.port);
+    ring_info->npage = npage;
+    ring_info->extents = exts;
+    ring_info->nextent = nextent;
+    ring_info->mfn_mapping = NULL;
+    v4v_ring_map_persistent(ring_info);
 
-    printk("\n");
-}
-#endif /* V4V_DEBUG */
+    /* the per-page mappings are only needed without the persistent one */
+    if ( !ring_info->ring_mapping )
+    {
+        ring_info->mfn_mapping = xzalloc_array(uint8_t *, npage);
+        if ( !ring_info->mfn_mapping )
+        {
+            v4v_ring_put_extents(exts, nextent);
+            xfree(exts);
+            ring_info->extents = NULL;
+            ring_info->nextent = 0;
+            ring_info->npage = 0;
+            ret = -ENOMEM;
+            goto out;
+        }
+    }
+
+    ring_info->numa_node = v4v_ring_node(exts, nextent);
+    v4v_dprintk("ring %p: %u pages in %u extents, node %u\n", ring_info,
+                npage, nextent, ring_info->numa_node);
+
+out:
+    v4v_dprintk_out();
+    return ret;
+}
+
+
+/* Caller holds L2 or is in an RCU read section */
+static struct v4v_ring_info *
+v4v_ring_find_info(struct domain *d, v4v_ring_id_t *id)
+{
+    unsigned int hash;
+    struct hlist_node *node;
+    struct v4v_ring_info *ring_info;
+    struct v4v_ring_info * ret = NULL;
+    struct v4v_domain *v4v = rcu_dereference(d->v4v);
+    struct v4v_ring_hash *tbl;
+
+    v4v_dprintk_in();
+    if ( !v4v )
+        goto out;
+
+    tbl = rcu_dereference(v4v->ring_hash);
+    hash = v4v_hash_fn(id, tbl->order);
+
+    v4v_dprintk("ring_find_info: d->v4v=%p, d->v4v->ring_hash[%d]=%p id=%p\n",
+                v4v, (int)hash, tbl->bucket[hash].first, id);
+    v4v_dprintk("ring_find_info: id.addr.port=%d id.addr.domain=%d id.addr.partner=%d\n",
+                id->addr.port, id->addr.domain, id->partner);
+
+    for ( node = rcu_dereference(tbl->bucket[hash].first); node;
+          node = rcu_dereference(node->next) )
+    {
+        v4v_ring_id_t *cmpid;
+
+        ring_info = v4v_ring_hash_entry(node, tbl->slot);
+        cmpid = &ring_info->id;
+
+        //v4v_dprintk("ring_find_info: ring_info=%p, port=%u, domain=%d\n", cmpid, cmpid->addr.port, cmpid->addr.domain);
+        if ( cmpid->addr.port == id->addr.port &&
+             cmpid->addr.domain == id->addr.domain &&
+             cmpid->shard == id->shard ) //&&
+             //cmpid->partner == id->partner)
+        {
+            //v4v_dprintk("ring_find_info: ring_info=%p\n", ring_info);
+            ret = ring_info;
+            goto out;
+        }
+    }
+    //v4v_dprintk("ring_find_info: no ring_info found\n");
+out:
+    v4v_dprintk_out();
+    return ret;
+}
+
+/*
+ * The ring a message from p to a goes to. With prio, a's priority lane
+ * if it has one.
+ */
+static struct v4v_ring_info *
+v4v_ring_find_info_by_addr(struct domain *d, struct v4v_addr *a, domid_t p,
+                           bool_t prio)
+{
+    v4v_ring_id_t id;
+    struct v4v_ring_info *ret;
+
+    v4v_dprintk_in();
+
+    if ( !a ) {
+        ret = NULL;
+        goto out;
+    }
+
+    id.addr.port = a->port;
+    id.addr.domain = d->domain_id;
+    /*
+     * The partner isn't part of the ring key (see v4v_hash_fn), a ring
+     * registered for p and one registered for V4V_DOMID_ANY on the same
+     * port are the same entry: a single lookup is enough.
+     */
+    id.partner = p;
+
+    if ( prio )
+    {
+        id.shard = V4V_RING_SHARD_PRIORITY;
+        if ( (ret = v4v_ring_find_info(d, &id)) )
+            goto out;
+    }
+
+    id.shard = 0;
+    ret = v4v_ring_find_info(d, &id);
+
+    /* pick the sub-ring for this sender, shard 0 if it isn't there */
+    if ( ret && (ret->nshard > 1) )
+    {
+        struct v4v_ring_info *shard;
+
+        if ( ret->shard_by_source )
+            id.shard = hash_long(p, BITS_PER_LONG) % ret->nshard;
+        else
+            id.shard = current->vcpu_id % ret->nshard;
+
+        if ( id.shard && (shard = v4v_ring_find_info(d, &id)) )
+            ret = shard;
+    }
+out:
+    v4v_dprintk_out();
+    return ret;
+}
+
+/* L3, or the ring is unreachable */
+static void v4v_ring_release_mfns(struct v4v_ring_info *ring_info)
+{
+    v4v_dprintk_in();
+
+    v4v_ring_unmap_persistent(ring_info);
+
+    if ( ring_info->extents )
+    {
+        v4v_ring_put_extents(ring_info->extents, ring_info->nextent);
+        xfree(ring_info->extents);
+    }
+    if ( ring_info->mfn_mapping )
+        xfree(ring_info->mfn_mapping);
+    ring_info->extents = NULL;
+    ring_info->nextent = 0;
+    ring_info->mfn_mapping = NULL;
+    ring_info->npage = 0;
+
+    v4v_dprintk_out();
+}
+
+static void v4v_ring_remove_mfns(struct domain *d, struct v4v_ring_info *ring_info)
+{
+    ASSERT(rw_is_write_locked(&d->v4v->lock));
+    v4v_ring_release_mfns(ring_info);
+}
+
+static void
+v4v_ring_free_rcu(struct rcu_head *head)
+{
+    struct v4v_ring_info *ring_info =
+        container_of(head, struct v4v_ring_info, rcu);
+
+    xfree(ring_info->credits);
+    xfree(ring_info->sources);
+    xfree(ring_info);
+}
+
+/*
+ * Take the ring out of the domain's hash, keeping its pages: no sender
+ * will touch them once this returns. W(L2)
+ */
+static void
+v4v_ring_unhook(struct domain *d, struct v4v_ring_info *ring_info)
+{
+    ASSERT(rw_is_write_locked(&d->v4v->lock));
+
+    spin_lock(&ring_info->lock);
+
+    /*
+     * Senders copying with L3 dropped still use the ring mapping and
+     * pages, let them publish their messages before taking them away.
+     */
+    ring_info->removing = 1;
+    while ( ring_info->resv_head != ring_info->resv_tail )
+    {
+        spin_unlock(&ring_info->lock);
+        cpu_relax();
+        spin_lock(&ring_info->lock);
+    }
+
+    v4v_pending_remove_all(d, ring_info);
+    hlist_del_rcu(&ring_info->node[d->v4v->ring_hash->slot]);
+    d->v4v->nring--;
+    d->v4v->npage -= ring_info->npage;
+    /* connections must not use ring_info past the grace period */
+    write_atomic(&d->v4v->ring_gen, d->v4v->ring_gen + 1);
+    smp_wmb();
+    d->v4v->rx_removed.messages += ring_info->stats.messages;
+    d->v4v->rx_removed.bytes += ring_info->stats.bytes;
+    d->v4v->rx_removed.eagain += ring_info->stats.eagain;
+    d->v4v->rx_removed.signals += ring_info->stats.signals;
+    d->v4v->rx_removed.remote += ring_info->stats.remote;
+
+    spin_unlock(&ring_info->lock);
+}
+
+static void
+v4v_ring_remove_info(struct domain *d, struct v4v_ring_info *ring_info)
+{
+    v4v_dprintk_in();
+
+    v4v_ring_unhook(d, ring_info);
+
+    spin_lock(&ring_info->lock);
+    v4v_ring_remove_mfns(d, ring_info);
+    spin_unlock(&ring_info->lock);
+
+    /* RCU readers may still hold ring_info, they will find it dead */
+    call_rcu(&ring_info->rcu, v4v_ring_free_rcu);
+    v4v_dprintk_out();
+}
+
+static struct v4v_ring_hash *
+v4v_ring_hash_alloc(struct v4v_domain *v4v, unsigned int order,
+                    unsigned int slot)
+{
+    struct v4v_ring_hash *tbl;
+    unsigned int i;
+
+    tbl = xmalloc_bytes(offsetof(struct v4v_ring_hash, bucket) +
+                        (sizeof (struct hlist_head) << order));
+    if ( !tbl )
+        return NULL;
+
+    tbl->owner = v4v;
+    tbl->order = order;
+    tbl->slot = slot;
+    for ( i = 0; i < (1u << order); ++i )
+        INIT_HLIST_HEAD(&tbl->bucket[i]);
+
+    return tbl;
+}
+
+static void
+v4v_ring_hash_free_rcu(struct rcu_head *head)
+{
+    struct v4v_ring_hash *tbl = container_of(head, struct v4v_ring_hash, rcu);
+
+    /* the owner can't go away before this, see v4v_domain_free_rcu() */
+    write_atomic(&tbl->owner->resizing, 0);
+    xfree(tbl);
+}
+
+/*
+ * Double the hash table. The new table chains the node[] slot the current
+ * one doesn't use, so RCU readers can keep walking the old chains; the
+ * old table is released after a grace period, until then we can't grow
+ * again. W(L2)
+ */
+static void
+v4v_ring_hash_grow(struct v4v_domain *v4v)
+{
+    struct v4v_ring_hash *old = v4v->ring_hash, *tbl;
+    struct v4v_ring_info *ring_info;
+    struct hlist_node *pos;
+    unsigned int i;
+
+    ASSERT(rw_is_write_locked(&v4v->lock));
+
+    if ( (old->order >= V4V_HTABLE_MAX_ORDER) ||
+         (v4v->nring <= (V4V_HTABLE_LOAD_FACTOR << old->order)) ||
+         read_atomic(&v4v->resizing) )
+        return;
+
+    tbl = v4v_ring_hash_alloc(v4v, old->order + 1, !old->slot);
+    if ( !tbl )
+        return;
+
+    v4v_ring_hash_for_each(ring_info, pos, old, i)
+        hlist_add_head_rcu(&ring_info->node[tbl->slot],
+                           &tbl->bucket[v4v_hash_fn(&ring_info->id,
+                                                    tbl->order)]);
+
+    write_atomic(&v4v->resizing, 1);
+    rcu_assign_pointer(v4v->ring_hash, tbl);
+    call_rcu(&old->rcu, v4v_ring_hash_free_rcu);
+}
+
+/* W(L2) */
+static void
+v4v_ring_hash_insert(struct v4v_domain *v4v, struct v4v_ring_info *ring_info)
+{
+    struct v4v_ring_hash *tbl = v4v->ring_hash;
+
+    ASSERT(rw_is_write_locked(&v4v->lock));
+
+    hlist_add_head_rcu(&ring_info->node[tbl->slot],
+                       &tbl->bucket[v4v_hash_fn(&ring_info->id, tbl->order)]);
+    v4v->nring++;
+    v4v->npage += ring_info->npage;
+    write_atomic(&v4v->ring_gen, v4v->ring_gen + 1);
+
+    v4v_ring_hash_grow(v4v);
+}
+
+/* Call from guest to unpublish a ring */
+static long
+v4v_ring_remove(struct domain *d, XEN_GUEST_HANDLE(v4v_ring_t) ring_hnd)
+{
+    struct v4v_ring ring;
+    struct v4v_ring_info *ring_info;
+    int ret = 0;
+
+    v4v_dprintk_in();
+    read_lock(&v4v_lock);
+
+    do
+    {
+        if ( !d->v4v )
+        {
+            v4v_dprintk("EINVAL\n");
+            ret = -EINVAL;
+            break;
+        }
+
+        if ( copy_from_guest(&ring, ring_hnd, 1) )
+        {
+            v4v_dprintk("EFAULT\n");
+            ret = -EFAULT;
+            break;
+        }
+
+        if ( ring.magic != V4V_RING_MAGIC )
+        {
+            v4v_dprintk("ring.magic(%"PRIx64") != V4V_RING_MAGIC(%"PRIx64"), EINVAL\n",
+                    ring.magic, V4V_RING_MAGIC);
+            ret = -EINVAL;
+            break;
+        }
+
+        ring.id.addr.domain = d->domain_id;
+        if ( (ring.nshard <= 1) && (ring.id.shard != V4V_RING_SHARD_PRIORITY) )
+            ring.id.shard = 0;
+
+        write_lock(&d->v4v->lock);
+        ring_info = v4v_ring_find_info(d, &ring.id);
+
+        if ( ring_info )
+            v4v_ring_remove_info(d, ring_info);
+
+        write_unlock(&d->v4v->lock);
+
+        if ( !ring_info )
+        {
+            v4v_dprintk("ENOENT\n");
+            ret = -ENOENT;
+            break;
+        }
+
+        TRACE_3D(TRC_V4V_UNREGISTER, d->domain_id, ring.id.addr.port,
+                 ring.id.partner);
+    }
+    while ( 0 );
+
+    read_unlock(&v4v_lock);
+    v4v_dprintk_out();
+    return ret;
+}
+
+/*
+ * Drop a registration that was preempted and never resumed, the domain
+ * registered something else in the meantime or is going away.
+ */
+static void
+v4v_ring_reg_abort(struct domain *d)
+{
+    struct v4v_ring_info *ring_info = d->v4v->reg_ring;
+
+    if ( !ring_info )
+        return;
+
+    v4v_ring_put_extents(ring_info->extents, ring_info->nextent);
+    xfree(ring_info->extents);
+    xfree(ring_info->credits);
+    xfree(ring_info);
+    d->v4v->reg_ring = NULL;
+}
+
+/*
+ * The ring_info of the preempted registration (or resize) of ring_hnd if
+ * this is its continuation, with *done set to the pages already done.
+ * Any other preempted registration is dropped.
+ */
+static struct v4v_ring_info *
+v4v_ring_reg_resume(struct domain *d, XEN_GUEST_HANDLE(v4v_ring_t) ring_hnd,
+                    uint32_t npage, bool_t resize, uint32_t *done)
+{
+    struct v4v_ring_info *ring_info = d->v4v->reg_ring;
+
+    if ( !ring_info )
+        return NULL;
+
+    if ( (d->v4v->reg_hnd.p != ring_hnd.p) || (d->v4v->reg_npage != npage) ||
+         (d->v4v->reg_resize != resize) )
+    {
+        v4v_ring_reg_abort(d);
+        return NULL;
+    }
+
+    *done = d->v4v->reg_done;
+    d->v4v->reg_ring = NULL;
+    return ring_info;
+}
+
+/*
+ * Check the header of a ring d registers, fixing up what it may leave
+ * out. *align is the alignment of its messages. The event channel is
+ * the caller's to check.
+ */
+static int
+v4v_ring_check(struct domain *d, struct v4v_ring *ring, uint32_t *align)
+{
+    if ( ring->magic != V4V_RING_MAGIC )
+    {
+        v4v_dprintk("ring.magic(%lx) != V4V_RING_MAGIC(%lx), EINVAL\n",
+                    ring->magic, V4V_RING_MAGIC);
+        return -EINVAL;
+    }
+
+    if ( (ring->flags & V4V_RING_F_STREAM) &&
+         ((ring->id.partner == V4V_DOMID_ANY) || (ring->nshard > 1) ||
+          (ring->flags & V4V_RING_F_PRIORITY) || ring->credit) )
+    {
+        v4v_dprintk("stream ring flags %#x, EINVAL\n", ring->flags);
+        return -EINVAL;
+    }
+
+    /* a stream is made of bytes */
+    *align = (ring->flags & V4V_RING_F_STREAM) ? 1 :
+             V4V_RING_MSG_ALIGN(ring->flags);
+    if ( (ring->len <
+                (sizeof (struct v4v_ring_message_header) + *align +
+                 *align)) || (ring->len & (*align - 1)) )
+    {
+        v4v_dprintk("EINVAL\n");
+        return -EINVAL;
+    }
+
+    if ( ring->nshard > V4V_RING_MAX_SHARDS )
+    {
+        v4v_dprintk("nshard %u, EINVAL\n", ring->nshard);
+        return -EINVAL;
+    }
+    if ( ring->flags & V4V_RING_F_PRIORITY )
+    {
+        /* a lane of its own, never part of a group */
+        if ( ring->nshard > 1 )
+        {
+            v4v_dprintk("priority lane with nshard %u, EINVAL\n",
+                        ring->nshard);
+            return -EINVAL;
+        }
+        ring->nshard = 1;
+        ring->id.shard = V4V_RING_SHARD_PRIORITY;
+    }
+    else if ( ring->nshard <= 1 )
+    {
+        ring->nshard = 1;
+        ring->id.shard = 0;
+    }
+    else if ( ring->id.shard >= ring->nshard )
+    {
+        v4v_dprintk("shard %u >= nshard %u, EINVAL\n", ring->id.shard,
+                    ring->nshard);
+        return -EINVAL;
+    }
+
+    ring->id.addr.domain = d->domain_id;
+
+    /*
+     * set the tx pointer if it looks bogus (we don't reset it
+     * because this might be a re-register after S4)
+     */
+    if ( (ring->tx_ptr >= ring->len)
+            || (ring->tx_ptr & (*align - 1)) )
+    {
+        ring->tx_ptr = ring->rx_ptr;
+    }
+
+    return 0;
+}
+
+/* Whether XSM lets d register ring */
+static int
+v4v_ring_xsm_check(struct domain *d, struct v4v_ring *ring)
+{
+    struct domain *partner = NULL;
+    int ret;
+
+    if ( ring->id.partner != V4V_DOMID_ANY )
+        partner = rcu_lock_domain_by_id(ring->id.partner);
+
+    ret = xsm_v4v_register(XSM_HOOK, d, partner);
+    if ( partner )
+        rcu_unlock_domain(partner);
+    if ( ret )
+        v4v_dprintk("XSM refused the ring, %d\n", ret);
+
+    return ret;
+}
+
+/* The credit of ring, before ring_info is published */
+static int
+v4v_ring_info_credit_init(struct v4v_ring_info *ring_info,
+                          struct v4v_ring *ring)
+{
+    ring_info->credit = min(ring->credit, ring->len);
+    ring_info->credits = NULL;
+    ring_info->credit_rx = ring->rx_ptr;
+    if ( !ring_info->credit )
+        return 0;
+
+    ring_info->credits =
+        xzalloc_array(struct v4v_ring_credit, V4V_CREDIT_SENDERS + 1);
+    if ( !ring_info->credits )
+        return -ENOMEM;
+    ring_info->credits[0].id = V4V_DOMID_ANY;
+    ring_info->credits[0].weight = 1;
+    ring_info->credits[0].balance = ring_info->credit;
+
+    return 0;
+}
+
+/* A ring_info for ring, without its pages */
+static struct v4v_ring_info *
+v4v_ring_info_alloc(struct v4v_ring *ring)
+{
+    struct v4v_ring_info *ring_info = xmalloc(struct v4v_ring_info);
+
+    if ( !ring_info )
+        return NULL;
+
+    spin_lock_init(&ring_info->lock);
+    INIT_HLIST_HEAD(&ring_info->pending);
+    ring_info->waiting = 0;
+    memset(&ring_info->stats, 0, sizeof (ring_info->stats));
+    ring_info->extents = NULL;
+    ring_info->nextent = 0;
+    ring_info->npage = 0;
+    ring_info->mfn_mapping = NULL;
+    ring_info->ring_mapping = NULL;
+    ring_info->resv_head = ring_info->resv_tail = 0;
+    ring_info->removing = 0;
+    ring_info->frozen = 0;
+    ring_info->hold_len = 0;
+    ring_info->sources = NULL;
+    if ( v4v_ring_info_credit_init(ring_info, ring) )
+    {
+        xfree(ring_info);
+        return NULL;
+    }
+
+    return ring_info;
+}
+
+/* Take the checked settings of ring at ring_hnd, L3 */
+static void
+v4v_ring_info_set(struct v4v_ring_info *ring_info, struct v4v_ring *ring,
+                  uint32_t align, XEN_GUEST_HANDLE(v4v_ring_t) ring_hnd)
+{
+    ASSERT(spin_is_locked(&ring_info->lock));
+
+    ring_info->id = ring->id;
+    ring_info->nshard = ring->nshard;
+    ring_info->shard_by_source = !!(ring->flags & V4V_RING_F_SHARD_BY_SOURCE);
+    ring_info->evtchn_port = ring->evtchn;
+    ring_info->align = align;
+    ring_info->nt_copy = !!(ring->flags & V4V_RING_F_NONTEMPORAL);
+    ring_info->stream = !!(ring->flags & V4V_RING_F_STREAM);
+    ring_info->len = ring->len;
+    ring_info->tx_ptr = ring->tx_ptr;
+    ring_info->resv_ptr = ring->tx_ptr;
+    ring_info->ring = ring_hnd;
+}
+
+/*
+ * Whether one more ring of npage pages fits in the quota of v4v. Only
+ * the domain itself registers rings, under domain_lock(), or the
+ * toolstack while it is being restored, so nothing gets in between
+ * this and v4v_ring_hash_insert().
+ */
+static int
+v4v_ring_quota_check(struct v4v_domain *v4v, uint32_t npage)
+{
+    int ret = 0;
+
+    read_lock(&v4v->lock);
+    if ( (v4v->nring >= v4v->max_rings) ||
+         ((v4v->npage + npage) > v4v->max_pages) )
+    {
+        v4v_dprintk("%u rings %"PRIu64" pages, quota %u %"PRIu64"\n",
+                    v4v->nring, v4v->npage, v4v->max_rings, v4v->max_pages);
+        ret = -ENOSPC;
+    }
+    read_unlock(&v4v->lock);
+
+    return ret;
+}
+
+/* call from guest to publish a ring */
+static long
+v4v_ring_add(struct domain *d, XEN_GUEST_HANDLE(v4v_ring_t) ring_hnd,
+             uint32_t npage, XEN_GUEST_HANDLE(v4v_pfn_t) pfn_hnd)
+{
+    struct v4v_ring ring;
+    struct v4v_ring_info *ring_info;
+    uint32_t done = 0, align;
+    int ret = 0;
+
+    v4v_dprintk_in();
+    if ( (long)ring_hnd.p & (PAGE_SIZE - 1) )
+    {
+        //v4v_dprintk("EINVAL\n");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    read_lock(&v4v_lock);
+    do
+    {
+        if ( !d->v4v )
+        {
+            v4v_dprintk(" !d->v4v, EINVAL\n");
+            ret = -EINVAL;
+            break;
+        }
+
+        if ( copy_from_guest(&ring, ring_hnd, 1) )
+        {
+            v4v_dprintk(" copy_from_guest failed, EFAULT\n");
+            ret = -EFAULT;
+            break;
+        }
+
+        if ( (ret = v4v_ring_check(d, &ring, &align)) )
+            break;
+
+        if ( (ret = v4v_ring_xsm_check(d, &ring)) )
+            break;
+
+        if ( ring.evtchn && (ret = v4v_check_ring_evtchn(d, ring.evtchn)) )
+        {
+            v4v_dprintk("evtchn %u, EINVAL\n", ring.evtchn);
+            break;
+        }
+
+        if ( copy_field_to_guest(ring_hnd, &ring, id) )
+        {
+            v4v_dprintk("EFAULT\n");
+            ret = -EFAULT;
+            break;
+        }
+
+        /* no need for a lock yet, because only we know about this */
+        copy_field_to_guest(ring_hnd, &ring, tx_ptr);
+
+        read_lock(&d->v4v->lock);
+        ring_info = v4v_ring_find_info(d, &ring.id);
+        read_unlock(&d->v4v->lock);
+
+        if ( ring_info )
+        {
+            /*
+             * Ring info already existed.
+             */
+            printk(KERN_INFO "v4v: dom%d ring already registered\n",
+                    current->domain->domain_id);
+            ret = -EEXIST;
+            v4v_ring_reg_abort(d);
+            break;
+        }
+
+        ring_info = v4v_ring_reg_resume(d, ring_hnd, npage, 0, &done);
+        if ( !ring_info )
+        {
+            if ( (ret = v4v_ring_quota_check(d->v4v, npage)) )
+                break;
+
+            ring_info = v4v_ring_info_alloc(&ring);
+            if ( !ring_info )
+            {
+                //v4v_dprintk("ENOMEM\n");
+                ret = -ENOMEM;
+                break;
+            }
+        }
+
+        spin_lock(&ring_info->lock);
+        v4v_ring_info_set(ring_info, &ring, align, ring_hnd);
+        ret = v4v_find_ring_mfns(d, ring_info, npage, pfn_hnd, &done);
+        spin_unlock(&ring_info->lock);
+        if ( ret == -ERESTART )
+        {
+            /* do_v4v_op() makes a continuation which comes back here */
+            d->v4v->reg_ring = ring_info;
+            d->v4v->reg_hnd = ring_hnd;
+            d->v4v->reg_npage = npage;
+            d->v4v->reg_done = done;
+            d->v4v->reg_resize = 0;
+            break;
+        }
+        if ( ret )
+        {
+            xfree(ring_info->credits);
+            xfree(ring_info);
+            break;
+        }
+
+        write_lock(&d->v4v->lock);
+        v4v_ring_hash_insert(d->v4v, ring_info);
+        write_unlock(&d->v4v->lock);
+
+        TRACE_4D(TRC_V4V_REGISTER, d->domain_id, ring.id.addr.port,
+                 ring.id.partner, npage);
+    }
+    while ( 0 );
+
+    read_unlock(&v4v_lock);
+out:
+    v4v_dprintk_out();
+    return ret;
+}
+
+/*
+ * V4VOP_register_rings (reg) or V4VOP_unregister_rings, from entry
+ * *start on. Returns -ERESTART with *start set to the entry to carry on
+ * from when preempted.
+ */
+static long
+v4v_ring_batch(struct domain *d, bool_t reg,
+               XEN_GUEST_HANDLE(v4v_ring_batch_ent_t) ent_hnd, uint32_t nent,
+               uint32_t *start)
+{
+    XEN_GUEST_HANDLE(v4v_ring_t) ring_hnd;
+    XEN_GUEST_HANDLE(v4v_pfn_t) pfn_hnd;
+    XEN_GUEST_HANDLE(v4v_ring_batch_ent_t) status_hnd;
+    v4v_ring_batch_ent_t ent;
+    uint32_t i;
+    long ret;
+
+    for ( i = *start; i < nent; i++ )
+    {
+        if ( (i != *start) && hypercall_preempt_check() )
+        {
+            *start = i;
+            return -ERESTART;
+        }
+
+        if ( copy_from_guest_offset(&ent, ent_hnd, i, 1) )
+            return -EFAULT;
+
+        ring_hnd.p = (v4v_ring_t *)(unsigned long)ent.ring; //FIXME
+        if ( !reg )
+            ret = v4v_ring_remove(d, ring_hnd);
+        else
+        {
+            pfn_hnd.p = (v4v_pfn_t *)(unsigned long)ent.pfns; //FIXME
+            if ( unlikely(!guest_handle_okay(pfn_hnd, ent.npage)) )
+                ret = -EFAULT;
+            else
+                ret = v4v_ring_add(d, ring_hnd, ent.npage, pfn_hnd);
+            /* a large ring, carry on with it */
+            if ( ret == -ERESTART )
+            {
+                *start = i;
+                return ret;
+            }
+        }
+
+        ent.status = ret;
+        status_hnd = ent_hnd;
+        guest_handle_add_offset(status_hnd, i);
+        if ( __copy_field_to_guest(status_hnd, &ent, status) )
+            return -EFAULT;
+    }
+
+    return 0;
+}
+
+/*
+ * Move the ring of ring_info to the pages of new, which has them and
+ * the settings of its ring but isn't published, copying what the
+ * receiver hasn't read yet to the start of it. The senders copying to
+ * the old pages are let finish first. What ring_info had is left in
+ * new for the caller to free.
+ */
+static int
+v4v_ring_swap(struct v4v_ring_info *ring_info, struct v4v_ring_info *new)
+{
+    XEN_GUEST_HANDLE(uint8_t) empty_hnd = { 0 };
+    uint8_t *buf = (uint8_t *)this_cpu(v4v_pfn_chunk);
+    struct v4v_ring_extent *extents;
+    uint8_t **mfn_mapping;
+    uint8_t *ring_mapping;
+    XEN_GUEST_HANDLE(v4v_ring_t) ring_hnd;
+    uint32_t nextent, npage, len, rx_ptr, off, n;
+    unsigned int numa_node;
+    int32_t used;
+    v4v_ring_t *ringp;
+    int ret = 0;
+
+    spin_lock(&ring_info->lock);
+    if ( v4v_ring_is_dead(ring_info) || ring_info->frozen )
+    {
+        ret = -EBUSY;
+        goto unlock;
+    }
+
+    /* as v4v_ring_remove_info(), the frozen ring keeps new senders out */
+    ring_info->frozen = 1;
+    while ( ring_info->resv_head != ring_info->resv_tail )
+    {
+        spin_unlock(&ring_info->lock);
+        cpu_relax();
+        spin_lock(&ring_info->lock);
+    }
+
+    ret = -EFAULT;
+    if ( !(ringp = v4v_ring_header(ring_info)) )
+        goto thaw;
+    rx_ptr = read_atomic(&ringp->rx_ptr);
+    smp_rmb();
+
+    ret = -EINVAL;
+    if ( (rx_ptr >= ring_info->len) || (rx_ptr & (ring_info->align - 1)) )
+        goto thaw;
+    used = ring_info->tx_ptr - rx_ptr;
+    if ( used < 0 )
+        used += ring_info->len;
+
+    ret = -ENOSPC;
+    if ( used >= new->len )
+        goto thaw;
+
+    spin_lock(&new->lock);
+    for ( off = 0; off < used; off += n )
+    {
+        uint32_t from = (rx_ptr + off) % ring_info->len;
+
+        n = min_t(uint32_t, used - off, PAGE_SIZE);
+        n = min(n, ring_info->len - from);
+        if ( (ret = v4v_memcpy_from_guest_ring(buf, ring_info,
+                                               from + sizeof (v4v_ring_t),
+                                               n)) ||
+             (ret = v4v_memcpy_to_guest_ring(new, off + sizeof (v4v_ring_t),
+                                             buf, empty_hnd, n)) )
+            break;
+    }
+    if ( !ret )
+    {
+        ret = -EFAULT;
+        if ( (ringp = v4v_ring_header(new)) )
+        {
+            write_atomic(&ringp->rx_ptr, 0);
+            wmb();
+            write_atomic(&ringp->tx_ptr, used);
+            ret = 0;
+        }
+    }
+    v4v_ring_unmap(new);
+    spin_unlock(&new->lock);
+    if ( ret )
+        goto thaw;
+
+    v4v_ring_unmap(ring_info);
+
+    extents = ring_info->extents;
+    nextent = ring_info->nextent;
+    npage = ring_info->npage;
+    mfn_mapping = ring_info->mfn_mapping;
+    ring_mapping = ring_info->ring_mapping;
+    numa_node = ring_info->numa_node;
+    len = ring_info->len;
+    ring_hnd = ring_info->ring;
+
+    ring_info->extents = new->extents;
+    ring_info->nextent = new->nextent;
+    ring_info->npage = new->npage;
+    ring_info->mfn_mapping = new->mfn_mapping;
+    ring_info->ring_mapping = new->ring_mapping;
+    ring_info->numa_node = new->numa_node;
+    ring_info->len = new->len;
+    ring_info->ring = new->ring;
+    ring_info->tx_ptr = ring_info->resv_ptr = used;
+    ring_info->credit_rx = 0;
+
+    new->extents = extents;
+    new->nextent = nextent;
+    new->npage = npage;
+    new->mfn_mapping = mfn_mapping;
+    new->ring_mapping = ring_mapping;
+    new->numa_node = numa_node;
+    new->len = len;
+    new->ring = ring_hnd;
+
+thaw:
+    ring_info->frozen = 0;
+unlock:
+    spin_unlock(&ring_info->lock);
+    return ret;
+}
+
+/*
+ * Start ring_info over at offset 0 of its pages, which it only can when
+ * the receiver has read everything.
+ */
+static int
+v4v_ring_reset(struct v4v_ring_info *ring_info)
+{
+    v4v_ring_t *ringp;
+    int ret = -EBUSY;
+
+    spin_lock(&ring_info->lock);
+    if ( v4v_ring_is_dead(ring_info) || ring_info->frozen ||
+         (ring_info->resv_ptr != ring_info->tx_ptr) )
+        goto out;
+
+    ret = -EFAULT;
+    if ( !(ringp = v4v_ring_header(ring_info)) )
+        goto out;
+
+    ret = -EBUSY;
+    if ( read_atomic(&ringp->rx_ptr) != ring_info->tx_ptr )
+        goto out;
+
+    write_atomic(&ringp->tx_ptr, 0);
+    write_atomic(&ringp->rx_ptr, 0);
+    ring_info->tx_ptr = ring_info->resv_ptr = 0;
+    ring_info->credit_rx = 0;
+    ret = 0;
+
+out:
+    spin_unlock(&ring_info->lock);
+    return ret;
+}
+
+/* V4VOP_ring_resize */
+static long
+v4v_ring_resize(struct domain *d, XEN_GUEST_HANDLE(v4v_ring_t) ring_hnd,
+                uint32_t npage, XEN_GUEST_HANDLE(v4v_pfn_t) pfn_hnd)
+{
+    struct v4v_ring ring;
+    struct v4v_ring_info *ring_info, *new;
+    uint32_t done = 0, align;
+    int ret = 0;
+
+    v4v_dprintk_in();
+    if ( (long)ring_hnd.p & (PAGE_SIZE - 1) )
+    {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    read_lock(&v4v_lock);
+    do
+    {
+        if ( !d->v4v )
+        {
+            v4v_dprintk(" !d->v4v, EINVAL\n");
+            ret = -EINVAL;
+            break;
+        }
+
+        if ( copy_from_guest(&ring, ring_hnd, 1) )
+        {
+            ret = -EFAULT;
+            break;
+        }
+
+        if ( (ret = v4v_ring_check(d, &ring, &align)) )
+            break;
+
+        read_lock(&d->v4v->lock);
+        ring_info = v4v_ring_find_info(d, &ring.id);
+        read_unlock(&d->v4v->lock);
+        if ( !ring_info )
+        {
+            v4v_dprintk("ENOENT\n");
+            ret = -ENOENT;
+            break;
+        }
+
+        /* only the size and the pages change */
+        if ( (align != ring_info->align) ||
+             (!!(ring.flags & V4V_RING_F_STREAM) != ring_info->stream) )
+        {
+            v4v_dprintk("flags %#x differ, EINVAL\n", ring.flags);
+            ret = -EINVAL;
+            break;
+        }
+
+        if ( !npage )
+        {
+            ret = v4v_ring_reset(ring_info);
+            break;
+        }
+
+        new = v4v_ring_reg_resume(d, ring_hnd, npage, 1, &done);
+        if ( !new )
+        {
+            read_lock(&d->v4v->lock);
+            if ( (d->v4v->npage - ring_info->npage + npage) >
+                 d->v4v->max_pages )
+                ret = -ENOSPC;
+            read_unlock(&d->v4v->lock);
+            if ( ret )
+                break;
+
+            /* the credits stay with ring_info */
+            ring.credit = 0;
+            new = v4v_ring_info_alloc(&ring);
+            if ( !new )
+            {
+                ret = -ENOMEM;
+                break;
+            }
+        }
+
+        spin_lock(&new->lock);
+        v4v_ring_info_set(new, &ring, align, ring_hnd);
+        ret = v4v_find_ring_mfns(d, new, npage, pfn_hnd, &done);
+        spin_unlock(&new->lock);
+        if ( ret == -ERESTART )
+        {
+            d->v4v->reg_ring = new;
+            d->v4v->reg_hnd = ring_hnd;
+            d->v4v->reg_npage = npage;
+            d->v4v->reg_done = done;
+            d->v4v->reg_resize = 1;
+            break;
+        }
+        if ( ret )
+        {
+            xfree(new);
+            break;
+        }
+
+        ret = v4v_ring_swap(ring_info, new);
+
+        /* new has the pages ring_info is done with, or didn't take */
+        write_lock(&d->v4v->lock);
+        if ( !ret )
+            d->v4v->npage += (int64_t)ring_info->npage - new->npage;
+        v4v_ring_remove_mfns(d, new);
+        write_unlock(&d->v4v->lock);
+        xfree(new);
+
+        /* the waiters may fit now */
+        if ( !ret )
+        {
+            rcu_read_lock(&v4v_rcu_lock);
+            v4v_ring_wake(d, ring_info);
+            rcu_read_unlock(&v4v_rcu_lock);
+        }
+    }
+    while ( 0 );
+
+    read_unlock(&v4v_lock);
+out:
+    v4v_dprintk_out();
+    return ret;
+}
+
+/*
+ * io
+ */
+
+/*
+ * The loop of v4v_notify_ring() for a ring with a credit: the sender
+ * with the most credit first, then the next one, as long as what they
+ * are waiting for fits in what is left of space. L3
+ */
+static void
+v4v_ring_credit_notify(struct domain *d, struct v4v_ring_info *ring_info,
+                       uint32_t space, struct hlist_head *to_notify)
+{
+    struct hlist_node *node;
+    struct v4v_pending_ent *ent, *best;
+    struct v4v_ring_credit *c;
+    int64_t balance = 0;
+    uint32_t rx_ptr;
+
+    if ( !v4v_ringbuf_get_rx_ptr(d, ring_info, &rx_ptr) )
+        v4v_ring_credit_refill(ring_info, rx_ptr);
+
+    do
+    {
+        best = NULL;
+        hlist_for_each_entry(ent, node, &ring_info->pending, node)
+        {
+            if ( ent->len > space )
+                continue;
+            c = v4v_ring_credit_find(ring_info, ent->id, 0);
+            if ( !best || (c->balance > balance) )
+            {
+                best = ent;
+                balance = c->balance;
+            }
+        }
+
+        if ( best )
+        {
+            hlist_del(&best->node);
+            hlist_add_head(&best->node, to_notify);
+            space -= best->len;
+        }
+    } while ( best );
+}
+
+/*
+ * Move the pending entries of ring_info that now fit to to_notify.
+ * ring_info has been taken off d's waiters list by the caller and goes
+ * back on it if it still has pending entries.
+ */
+static void
+v4v_notify_ring(struct domain *d, struct v4v_ring_info *ring_info,
+                struct hlist_head *to_notify)
+{
+    struct v4v_domain *v4v = rcu_dereference(d->v4v);
+    struct hlist_node *node, *next, *old = to_notify->first;
+    struct v4v_pending_ent *ent;
+    uint32_t space, want = 0;
+
+    v4v_dprintk_in();
+
+    spin_lock(&ring_info->lock);
+    ASSERT(ring_info->waiting);
+    if ( v4v_ring_is_dead(ring_info) || hlist_empty(&ring_info->pending) )
+    {
+        ring_info->waiting = 0;
+        goto out;
+    }
+
+    space = v4v_ringbuf_payload_space(d, ring_info);
+    if ( ring_info->credits )
+        v4v_ring_credit_notify(d, ring_info, space, to_notify);
+    else
+        /*
+         * Oldest first, and only as many as the space covers between
+         * them: the others would find it taken and queue again. The first
+         * one that doesn't fit stops the walk, so that small senders
+         * can't keep a large one waiting for ever.
+         */
+        hlist_for_each_entry_safe(ent, node, next, &ring_info->pending, node)
+        {
+            if ( (want + ent->len + v4v_ring_held(ring_info, ent->id)) >
+                 space )
+                break;
+            want += ent->len;
+            if ( ring_info->hold_len && (ring_info->hold_id == ent->id) )
+                ring_info->hold_until = NOW() + V4V_HOLD_TIMEOUT;
+            hlist_del(&ent->node);
+            hlist_add_head(&ent->node, to_notify);
+        }
+
+    /* the entries that fit went on the head of to_notify */
+    for ( node = to_notify->first; node != old; node = node->next )
+    {
+        ent = hlist_entry(node, struct v4v_pending_ent, node);
+        ent->ring = ring_info->id.addr;
+        ent->space = space;
+    }
+
+    if ( hlist_empty(&ring_info->pending) )
+        ring_info->waiting = 0;
+    else
+    {
+        spin_lock(&v4v->waiters_lock);
+        list_add_tail(&ring_info->waiter, &v4v->waiters);
+        spin_unlock(&v4v->waiters_lock);
+    }
+
+out:
+    spin_unlock(&ring_info->lock);
+    v4v_dprintk_out();
+}
+
+
+/*
+ * Wake up the senders waiting for space in ring_info that now fits,
+ * after the receiver consumed some of it. Caller is in an RCU read
+ * section and holds domain_lock(d), so that no V4VOP_notify is walking
+ * the waiters list.
+ */
+static void
+v4v_ring_wake(struct domain *d, struct v4v_ring_info *ring_info)
+{
+    struct v4v_domain *v4v = rcu_dereference(d->v4v);
+    HLIST_HEAD(to_notify);
+    bool_t waiting;
+
+    spin_lock(&ring_info->lock);
+    waiting = ring_info->waiting;
+    if ( waiting )
+    {
+        spin_lock(&v4v->waiters_lock);
+        list_del(&ring_info->waiter);
+        spin_unlock(&v4v->waiters_lock);
+    }
+    spin_unlock(&ring_info->lock);
+
+    if ( waiting )
+        v4v_notify_ring(d, ring_info, &to_notify);
+
+    if ( !hlist_empty(&to_notify) )
+        v4v_pending_notify(d, &to_notify);
+}
+
+/*
+ * Copy the data of the message with header mh at *rx_ptr to the iovs
+ * of ent, truncating it if they are too short. L3
+ */
+static int
+v4v_recv_one(struct v4v_ring_info *ring_info, uint32_t *rx_ptr,
+             struct v4v_ring_message_header *mh, v4v_recv_ent_t *ent)
+{
+    XEN_GUEST_HANDLE(v4v_iov_t) iovs;
+    v4v_iov_t *iov;
+    uint32_t left = mh->len - sizeof (*mh);
+    uint32_t i;
+    long len;
+    int ret = 0;
+
+    iovs.p = (v4v_iov_t *)(unsigned long)ent->iov; //FIXME
+    len = v4v_iov_snapshot(iovs, ent->niov, &iov);
+    if ( len < 0 )
+        return len;
+
+    ent->source = mh->source;
+    ent->message_type = mh->message_type;
+    ent->len = left;
+    ent->flags = mh->flags;
+
+    for ( i = 0; (i < ent->niov) && left; i++ )
+    {
+        XEN_GUEST_HANDLE(uint8_t) buf_hnd;
+        uint32_t chunk = min_t(uint32_t, left, iov[i].iov_len);
+
+        /* checked by v4v_iov_snapshot() */
+        buf_hnd.p = (uint8_t *)iov[i].iov_base; //FIXME
+        if ( (ret = v4v_ringbuf_copy_out(ring_info, rx_ptr, NULL, buf_hnd,
+                                         chunk)) )
+            break;
+        left -= chunk;
+    }
+
+    return ret;
+}
+
+/*
+ * Receive hypercall: dequeue up to nent messages of the caller's ring at
+ * ring_hnd into the iovs described by ent[].
+ */
+static long
+v4v_recvv(struct domain *d, XEN_GUEST_HANDLE(v4v_ring_t) ring_hnd,
+          XEN_GUEST_HANDLE(v4v_recv_ent_t) ent_hnd, uint32_t nent)
+{
+    struct v4v_ring_message_header mh;
+    struct v4v_ring_info *ring_info;
+    v4v_ring_t ring;
+    v4v_recv_ent_t ent;
+    uint32_t rx_ptr = 0, start = 0, tx_ptr, ptr, avail;
+    unsigned int n = 0;
+    long ret = 0;
+
+    v4v_dprintk_in();
+    if ( nent > V4V_RECVV_MAX )
+    {
+        ret = -E2BIG;
+        goto out;
+    }
+
+    if ( copy_field_from_guest(&ring, ring_hnd, id) )
+    {
+        ret = -EFAULT;
+        goto out;
+    }
+    ring.id.addr.domain = d->domain_id;
+
+    rcu_read_lock(&v4v_rcu_lock);
+    if ( !rcu_dereference(d->v4v) )
+    {
+        rcu_read_unlock(&v4v_rcu_lock);
+        v4v_dprintk("!d->v4v, ENODEV\n");
+        ret = -ENODEV;
+        goto out;
+    }
+
+    ring_info = v4v_ring_find_info(d, &ring.id);
+    if ( !ring_info || (ring_info->ring.p != ring_hnd.p) )
+    {
+        rcu_read_unlock(&v4v_rcu_lock);
+        ret = -ENOENT;
+        goto out;
+    }
+
+    if ( ring_info->stream )
+    {
+        rcu_read_unlock(&v4v_rcu_lock);
+        ret = -EPROTOTYPE;
+        goto out;
+    }
+
+    spin_lock(&ring_info->lock);
+    if ( v4v_ring_is_dead(ring_info) )
+    {
+        ret = -ENOENT;
+        goto unlock;
+    }
+
+    if ( (ret = v4v_memcpy_from_guest_ring(&rx_ptr, ring_info,
+                                           offsetof(v4v_ring_t, rx_ptr),
+                                           sizeof (rx_ptr))) )
+        goto unlock;
+
+    start = rx_ptr;
+    if ( (rx_ptr >= ring_info->len) ||
+         (v4v_ring_roundup(ring_info, rx_ptr) != rx_ptr) )
+    {
+        ret = -EINVAL;
+        goto unlock;
+    }
+
+    tx_ptr = ring_info->tx_ptr;
+    while ( (n < nent) && (rx_ptr != tx_ptr) )
+    {
+        XEN_GUEST_HANDLE(uint8_t) empty_hnd = { 0 };
+
+        avail = tx_ptr - rx_ptr;
+        if ( tx_ptr < rx_ptr )
+            avail += ring_info->len;
+
+        ptr = rx_ptr;
+        if ( (avail < sizeof (mh)) ||
+             (ret = v4v_ringbuf_copy_out(ring_info, &ptr, &mh, empty_hnd,
+                                         sizeof (mh))) )
+        {
+            ret = ret ?: -EINVAL;
+            break;
+        }
+
+        /* the receiver can write its ring, don't trust what is in it */
+        if ( (mh.len < sizeof (mh)) ||
+             (v4v_ring_roundup(ring_info, mh.len) > avail) )
+        {
+            v4v_dprintk("bad message at %#x len %#x\n", rx_ptr, mh.len);
+            ret = -EINVAL;
+            break;
+        }
+
+        if ( !(mh.flags & V4V_MSG_F_DISCARD) )
+        {
+            if ( copy_from_guest_offset(&ent, ent_hnd, n, 1) )
+            {
+                ret = -EFAULT;
+                break;
+            }
+
+            if ( (ret = v4v_recv_one(ring_info, &ptr, &mh, &ent)) )
+                break;
+
+            if ( copy_to_guest_offset(ent_hnd, n, &ent, 1) )
+            {
+                ret = -EFAULT;
+                break;
+            }
+            n++;
+        }
+
+        rx_ptr += v4v_ring_roundup(ring_info, mh.len);
+        if ( rx_ptr >= ring_info->len )
+            rx_ptr -= ring_info->len;
+    }
+
+    if ( rx_ptr != start )
+    {
+        /* we are done reading the messages before giving their space back */
+        mb();
+        if ( v4v_update_rx_ptr(ring_info, rx_ptr) && !ret )
+            ret = -EFAULT;
+    }
+
+unlock:
+    v4v_ring_unmap(ring_info);
+    spin_unlock(&ring_info->lock);
+
+    if ( rx_ptr != start )
+        v4v_ring_wake(d, ring_info);
+    rcu_read_unlock(&v4v_rcu_lock);
+
+out:
+    v4v_dprintk_out();
+    return n ? n : ret;
+}
+
+/*
+ * Set the weight of sender domid to the caller's ring at ring_hnd, see
+ * V4VOP_ring_credit.
+ */
+static long
+v4v_ring_credit_set(struct domain *d, XEN_GUEST_HANDLE(v4v_ring_t) ring_hnd,
+                    domid_t domid, uint32_t weight)
+{
+    struct v4v_ring_info *ring_info;
+    struct v4v_ring_credit *c = NULL;
+    v4v_ring_t ring;
+    long ret = 0;
+
+    v4v_dprintk_in();
+    if ( (weight > V4V_CREDIT_WEIGHT_MAX) ||
+         (!weight && (domid == V4V_DOMID_ANY)) )
+    {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if ( copy_field_from_guest(&ring, ring_hnd, id) )
+    {
+        ret = -EFAULT;
+        goto out;
+    }
+    ring.id.addr.domain = d->domain_id;
+
+    rcu_read_lock(&v4v_rcu_lock);
+    if ( !rcu_dereference(d->v4v) )
+    {
+        rcu_read_unlock(&v4v_rcu_lock);
+        v4v_dprintk("!d->v4v, ENODEV\n");
+        ret = -ENODEV;
+        goto out;
+    }
+
+    ring_info = v4v_ring_find_info(d, &ring.id);
+    if ( !ring_info || (ring_info->ring.p != ring_hnd.p) )
+    {
+        rcu_read_unlock(&v4v_rcu_lock);
+        ret = -ENOENT;
+        goto out;
+    }
+
+    spin_lock(&ring_info->lock);
+    if ( v4v_ring_is_dead(ring_info) )
+        ret = -ENOENT;
+    else if ( !ring_info->credits )
+        ret = -EINVAL;
+    else if ( domid == V4V_DOMID_ANY )
+        c = &ring_info->credits[0];
+    else
+    {
+        c = v4v_ring_credit_find(ring_info, domid, !!weight);
+        if ( c == &ring_info->credits[0] )
+        {
+            /* nothing to forget, or no slot left */
+            c = NULL;
+            ret = weight ? -ENOSPC : 0;
+        }
+    }
+
+    if ( !ret && c )
+    {
+        c->weight = weight;
+        c->balance = min_t(int64_t, c->balance,
+                           (int64_t)ring_info->credit * weight);
+    }
+    spin_unlock(&ring_info->lock);
+    rcu_read_unlock(&v4v_rcu_lock);
+
+out:
+    v4v_dprintk_out();
+    return ret;
+}
+
+static void
+v4v_ring_sources_free_rcu(struct rcu_head *head)
+{
+    xfree(container_of(head, struct v4v_ring_sources, rcu));
+}
+
+/*
+ * Replace the senders allowed to the caller's ring at ring_hnd with the
+ * nsrc at src_hnd, see V4VOP_ring_sources.
+ */
+static long
+v4v_ring_sources_set(struct domain *d, XEN_GUEST_HANDLE(v4v_ring_t) ring_hnd,
+                     XEN_GUEST_HANDLE(v4v_addr_t) src_hnd, uint32_t nsrc)
+{
+    struct v4v_ring_info *ring_info;
+    struct v4v_ring_sources *sources = NULL, *old = NULL;
+    v4v_ring_t ring;
+    uint32_t i;
+    long ret = 0;
+
+    v4v_dprintk_in();
+    if ( nsrc > V4V_RING_SOURCES_MAX )
+    {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if ( copy_field_from_guest(&ring, ring_hnd, id) )
+    {
+        ret = -EFAULT;
+        goto out;
+    }
+    ring.id.addr.domain = d->domain_id;
+
+    if ( nsrc )
+    {
+        sources = xmalloc_bytes(sizeof(*sources) +
+                                nsrc * sizeof(sources->src[0]));
+        if ( !sources )
+        {
+            ret = -ENOMEM;
+            goto out;
+        }
+        if ( copy_from_guest(sources->src, src_hnd, nsrc) )
+        {
+            ret = -EFAULT;
+            goto out;
+        }
+        for ( i = 0; i < nsrc; i++ )
+            if ( sources->src[i].domain == V4V_DOMID_ANY )
+            {
+                ret = -EINVAL;
+                goto out;
+            }
+        sources->nsrc = nsrc;
+    }
+
+    rcu_read_lock(&v4v_rcu_lock);
+    if ( !rcu_dereference(d->v4v) )
+    {
+        rcu_read_unlock(&v4v_rcu_lock);
+        v4v_dprintk("!d->v4v, ENODEV\n");
+        ret = -ENODEV;
+        goto out;
+    }
+
+    ring_info = v4v_ring_find_info(d, &ring.id);
+    if ( !ring_info || (ring_info->ring.p != ring_hnd.p) )
+    {
+        rcu_read_unlock(&v4v_rcu_lock);
+        ret = -ENOENT;
+        goto out;
+    }
+
+    spin_lock(&ring_info->lock);
+    if ( v4v_ring_is_dead(ring_info) )
+        ret = -ENOENT;
+    else
+    {
+        old = ring_info->sources;
+        rcu_assign_pointer(ring_info->sources, sources);
+        sources = NULL;
+    }
+    spin_unlock(&ring_info->lock);
+    rcu_read_unlock(&v4v_rcu_lock);
+
+    if ( old )
+        call_rcu(&old->rcu, v4v_ring_sources_free_rcu);
+
+out:
+    xfree(sources);
+    v4v_dprintk_out();
+    return ret;
+}
+
+
+/*notify hypercall*/
+static long
+v4v_notify(struct domain *d,
+           XEN_GUEST_HANDLE(v4v_ring_data_t) ring_data_hnd,
+           XEN_GUEST_HANDLE(v4v_ring_id_t) ring_id_hnd)
+{
+    v4v_ring_data_t ring_data;
+    struct v4v_domain *v4v;
+    struct v4v_ring_info *ring_info, *next;
+    HLIST_HEAD(to_notify);
+    LIST_HEAD(waiters);
+    int ret = 0;
+
+    v4v_dprintk_in();
+    rcu_read_lock(&v4v_rcu_lock);
+
+    v4v = rcu_dereference(d->v4v);
+    if ( !v4v )
+    {
+        rcu_read_unlock(&v4v_rcu_lock);
+        v4v_dprintk("!d->v4v, ENODEV\n");
+        ret = -ENODEV;
+        goto out;
+    }
+
+    /*
+     * Rings can't be removed under our feet, unregistering them takes
+     * domain_lock(d) as we do. Senders queueing on a ring we took see it
+     * still flagged waiting and leave it to v4v_notify_ring().
+     */
+    if ( !guest_handle_is_null(ring_id_hnd) )
+    {
+        v4v_ring_id_t id;
+
+        if ( copy_from_guest(&id, ring_id_hnd, 1) )
+        {
+            rcu_read_unlock(&v4v_rcu_lock);
+            ret = -EFAULT;
+            goto out;
+        }
+        id.addr.domain = d->domain_id;
+
+        ring_info = v4v_ring_find_info(d, &id);
+        if ( !ring_info )
+        {
+            rcu_read_unlock(&v4v_rcu_lock);
+            ret = -ENOENT;
+            goto out;
+        }
+
+        spin_lock(&ring_info->lock);
+        if ( ring_info->waiting )
+        {
+            spin_lock(&v4v->waiters_lock);
+            list_move_tail(&ring_info->waiter, &waiters);
+            spin_unlock(&v4v->waiters_lock);
+        }
+        spin_unlock(&ring_info->lock);
+    }
+    else
+    {
+        spin_lock(&v4v->waiters_lock);
+        list_splice_init(&v4v->waiters, &waiters);
+        spin_unlock(&v4v->waiters_lock);
+    }
+
+    list_for_each_entry_safe(ring_info, next, &waiters, waiter)
+    {
+        list_del(&ring_info->waiter);
+        v4v_notify_ring(d, ring_info, &to_notify);
+    }
+
+    if ( !hlist_empty(&to_notify) )
+        v4v_pending_notify(d, &to_notify);
+
+    do
+    {
+        if ( !guest_handle_is_null(ring_data_hnd) )
+        {
+            /* Quick sanity check on ring_data_hnd */
+            if ( copy_field_from_guest(&ring_data, ring_data_hnd, magic) )
+            {
+                v4v_dprintk("copy_field_from_guest failed\n");
+                ret = -EFAULT;
+                break;
+            }
+
+            if ( ring_data.magic != V4V_RING_DATA_MAGIC )
+            {
+                v4v_dprintk("ring.magic(%lx) != V4V_RING_MAGIC(%lx), EINVAL\n",
+                        ring_data.magic, V4V_RING_MAGIC);
+                ret = -EINVAL;
+                break;
+            }
+
+            if ( copy_from_guest(&ring_data, ring_data_hnd, 1) )
+            {
+                v4v_dprintk("copy_from_guest failed\n");
+                ret = -EFAULT;
+                break;
+            }
+
+            {
+                XEN_GUEST_HANDLE(v4v_ring_data_ent_t) ring_data_ent_hnd;
+                //v4v_dprintk("notifying: %p\n",(void*) &ring_data.data[0]); 
+                ring_data_ent_hnd =
+                    guest_handle_for_field(ring_data_hnd, v4v_ring_data_ent_t, data[0]);
+                ret = v4v_fill_ring_datas(d, ring_data.nent, ring_data_ent_hnd);
+            }
+        }
+    }
+    while ( 0 );
+
+    rcu_read_unlock(&v4v_rcu_lock);
+
+out:
+    v4v_dprintk_out();
+    return ret;
+}
+
+/*
+ * Compiled form of v4vtables_rules, rebuilt by v4vtables_add/del and
+ * published with RCU so that v4vtables_check() doesn't walk the list.
+ *
+ * Each rule belongs to one of 16 wildcard classes depending on which of
+ * its four fields are not wildcards. Rules are stored in an open
+ * addressing hash keyed by (class, non wildcard fields); for a given key
+ * only the first rule of the list is kept together with its position. A
+ * lookup probes each class that has rules and keeps the match with the
+ * lowest position, which is what the walk of the list would have found.
+ */
+#define V4VTABLES_F_SRC_DOMAIN  (1U << 0)
+#define V4VTABLES_F_SRC_PORT    (1U << 1)
+#define V4VTABLES_F_DST_DOMAIN  (1U << 2)
+#define V4VTABLES_F_DST_PORT    (1U << 3)
+#define V4VTABLES_NR_CLASSES    16
+#define V4VTABLES_CLASS_EMPTY   0xff
+
+struct v4vtables_compiled_ent
+{
+    uint32_t src_port;
+    uint32_t dst_port;
+    domid_t src_domain;
+    domid_t dst_domain;
+    uint8_t class;
+    uint8_t accept;
+    uint32_t position;
+};
+
+struct v4vtables_compiled
+{
+    struct rcu_head rcu;
+    /* bitmap of the classes that have at least one rule */
+    uint32_t classes;
+    unsigned int order;
+    struct v4vtables_compiled_ent ent[0];
+};
+
+/*
+ * NULL if the rules haven't been compiled (or compiling them failed),
+ * v4vtables_check() then falls back to walking the list.
+ */
+static struct v4vtables_compiled *v4vtables_compiled;
+static DEFINE_RCU_READ_LOCK(v4vtables_rcu_lock);
+
+static inline void
+v4vtables_compiled_key(struct v4vtables_compiled_ent *key, unsigned int class,
+                       v4v_addr_t *src, v4v_addr_t *dst)
+{
+    key->class = class;
+    key->src_domain = (class & V4VTABLES_F_SRC_DOMAIN) ? src->domain
+                                                        : V4V_DOMID_ANY;
+    key->src_port = (class & V4VTABLES_F_SRC_PORT) ? src->port : V4V_PORT_ANY;
+    key->dst_domain = (class & V4VTABLES_F_DST_DOMAIN) ? dst->domain
+                                                        : V4V_DOMID_ANY;
+    key->dst_port = (class & V4VTABLES_F_DST_PORT) ? dst->port : V4V_PORT_ANY;
+}
+
+static inline unsigned int
+v4vtables_compiled_hash(struct v4vtables_compiled_ent *key, unsigned int order)
+{
+    unsigned long k;
+
+    /* mix one 32bit word at a time, unsigned long is 32bit on arm32 */
+    k = hash_long(key->src_port, BITS_PER_LONG) ^ key->dst_port;
+    k = hash_long(k, BITS_PER_LONG) ^
+        (((uint32_t)key->src_domain << 16) | key->dst_domain);
+    k = hash_long(k, BITS_PER_LONG) ^ key->class;
+
+    return hash_long(k, order);
+}
+
+static inline int
+v4vtables_compiled_match(struct v4vtables_compiled_ent *ent,
+                         struct v4vtables_compiled_ent *key)
+{
+    return (ent->class == key->class) &&
+           (ent->src_domain == key->src_domain) &&
+           (ent->src_port == key->src_port) &&
+           (ent->dst_domain == key->dst_domain) &&
+           (ent->dst_port == key->dst_port);
+}
+
+static struct v4vtables_compiled_ent *
+v4vtables_compiled_find(struct v4vtables_compiled *c,
+                        struct v4vtables_compiled_ent *key)
+{
+    unsigned int mask = (1u << c->order) - 1;
+    unsigned int i = v4vtables_compiled_hash(key, c->order);
+
+    for ( ; c->ent[i].class != V4VTABLES_CLASS_EMPTY; i = (i + 1) & mask )
+        if ( v4vtables_compiled_match(&c->ent[i], key) )
+            return &c->ent[i];
+
+    return NULL;
+}
+
+static void
+v4vtables_compiled_free_rcu(struct rcu_head *head)
+{
+    xfree(container_of(head, struct v4vtables_compiled, rcu));
+}
+
+/* Rebuild the compiled rules, caller holds W(v4vtables_rules_lock) */
+static void
+v4vtables_compile(void)
+{
+    struct v4vtables_compiled *c, *old = v4vtables_compiled;
+    struct v4vtables_rule_node *node;
+    struct list_head *ptr;
+    unsigned int nrules = 0, order = 1, position = 0, i;
+
+    ASSERT(rw_is_write_locked(&v4vtables_rules_lock));
+
+    list_for_each(ptr, &v4vtables_rules)
+        nrules++;
+
+    /* keep the table at most half full so that probe chains stay short */
+    while ( (1u << order) < (2 * nrules) )
+        order++;
+
+    c = xmalloc_bytes(offsetof(struct v4vtables_compiled, ent) +
+                      (sizeof (struct v4vtables_compiled_ent) << order));
+    if ( c )
+    {
+        c->classes = 0;
+        c->order = order;
+        for ( i = 0; i < (1u << order); ++i )
+            c->ent[i].class = V4VTABLES_CLASS_EMPTY;
+
+        list_for_each(ptr, &v4vtables_rules)
+        {
+            struct v4vtables_compiled_ent key, *ent;
+            unsigned int class = 0;
+
+            node = list_entry(ptr, struct v4vtables_rule_node, list);
+            if ( node->rule.src.domain != V4V_DOMID_ANY )
+                class |= V4VTABLES_F_SRC_DOMAIN;
+            if ( node->rule.src.port != V4V_PORT_ANY )
+                class |= V4VTABLES_F_SRC_PORT;
+            if ( node->rule.dst.domain != V4V_DOMID_ANY )
+                class |= V4VTABLES_F_DST_DOMAIN;
+            if ( node->rule.dst.port != V4V_PORT_ANY )
+                class |= V4VTABLES_F_DST_PORT;
+
+            v4vtables_compiled_key(&key, class, &node->rule.src,
+                                   &node->rule.dst);
+            /* a duplicate key is shadowed by the earlier rule */
+            if ( !v4vtables_compiled_find(c, &key) )
+            {
+                i = v4vtables_compiled_hash(&key, order);
+                while ( c->ent[i].class != V4VTABLES_CLASS_EMPTY )
+                    i = (i + 1) & ((1u << order) - 1);
+                ent = &c->ent[i];
+                *ent = key;
+                ent->accept = !!node->rule.accept;
+                ent->position = position;
+                c->classes |= 1u << class;
+            }
+            position++;
+        }
+    }
+    else
+        printk(KERN_ERR "v4vtables: failed to compile %u rules\n", nrules);
+
+    rcu_assign_pointer(v4vtables_compiled, c);
+    if ( old )
+        call_rcu(&old->rcu, v4vtables_compiled_free_rcu);
+
+    /*
+     * Invalidate cached verdicts only once the new rules are visible, so
+     * that a verdict cached under the new generation was computed with
+     * them.
+     */
+    smp_wmb();
+    v4vtables_generation_bump();
+}
+
+/*
+ * Lookup in the compiled rules, returns 1 for REJECT, 0 for ACCEPT.
+ * Caller is in an RCU read section on v4vtables_rcu_lock.
+ */
+static size_t
+v4vtables_compiled_check(struct v4vtables_compiled *c,
+                         v4v_addr_t *src, v4v_addr_t *dst)
+{
+    struct v4vtables_compiled_ent key, *ent, *best = NULL;
+    unsigned int class;
+
+    for ( class = 0; class < V4VTABLES_NR_CLASSES; ++class )
+    {
+        if ( !(c->classes & (1u << class)) )
+            continue;
+
+        v4vtables_compiled_key(&key, class, src, dst);
+        ent = v4vtables_compiled_find(c, &key);
+        if ( ent && (!best || (ent->position < best->position)) )
+            best = ent;
+    }
+
+    return best ? !best->accept : 0; /* Defaulting to ACCEPT */
+}
+
+#ifdef V4V_DEBUG
+void
+v4vtables_print_rule(struct v4vtables_rule_node *node)
+{
+    v4vtables_rule_t *rule;
+
+    if ( node == NULL )
+    {
+        printk("(null)\n");
+        return;
+    }
+
+    rule = &node->rule;
+
+    if ( rule->accept == 1 )
+        printk("ACCEPT");
+    else
+        printk("REJECT");
+
+    printk(" ");
+
+    if ( rule->src.domain == V4V_DOMID_ANY )
+        printk("*");
+    else
+        printk("%i", rule->src.domain);
+
+    printk(":");
+
+    if ( rule->src.port == -1 )
+        printk("*");
+    else
+        printk("%i", rule->src.port);
+
+    printk(" -> ");
+
+    if ( rule->dst.domain == V4V_DOMID_ANY )
+        printk("*");
+    else
+        printk("%i", rule->dst.domain);
+
+    printk(":");
+
+    if ( rule->dst.port == -1 )
+        printk("*");
+    else
+        printk("%i", rule->dst.port);
+
+    printk("\n");
+}
+#endif /* V4V_DEBUG */
+
+int
+v4vtables_add(struct domain *src_d,
+              XEN_GUEST_HANDLE(v4vtables_rule_t) rule,
+              int32_t position)
+{
+    struct v4vtables_rule_node* new = NULL;
+    struct list_head* tmp;
+
+    ASSERT(rw_is_write_locked(&v4vtables_rules_lock));
+
+    /* First rule is n.1 */
+    position--;
+
+    new = xmalloc(struct v4vtables_rule_node);
+    if ( new == NULL )
+        return -ENOMEM;
+
+    if ( copy_from_guest(&new->rule, rule, 1) )
+    {
+        xfree(new);
+        return -EFAULT;
+    }
+
+#ifdef V4V_DEBUG
+    printk(KERN_ERR "VIPTables: ");
+    v4vtables_print_rule(new);
+#endif /* V4V_DEBUG */
+
+    tmp = &v4vtables_rules;
+    while ( position != 0 && tmp->next != &v4vtables_rules)
+    {
+        tmp = tmp->next;
+        position--;
+    }
+    list_add(&new->list, tmp);
+    v4vtables_compile();
+
+    return 0;
+}
+
+int
+v4vtables_del(struct domain *src_d,
+              XEN_GUEST_HANDLE(v4vtables_rule_t) rule_hnd,
+              int32_t position)
+{
+    struct list_head *tmp = NULL;
+    struct list_head *to_delete = NULL;
+    struct list_head *next = NULL;
+    struct v4vtables_rule_node *node;
+
+    ASSERT(rw_is_write_locked(&v4vtables_rules_lock));
+
+    //v4v_dprintk("v4vtables_del position:%d\n", position);
+
+    if ( position != -1 )
+    {
+        /* We want to delete the rule number <position> */
+        list_for_each(tmp, &v4vtables_rules)
+        {
+            to_delete = tmp;
+            if (position == 0)
+                break;
+            position--;
+        }
+        /* Can't find the position */
+        if (position != 0)
+            to_delete = NULL;
+    }
+    else if ( !guest_handle_is_null(rule_hnd) )
+    {
+        struct v4vtables_rule r;
+
+        if ( copy_from_guest(&r, rule_hnd, 1) )
+            return -EFAULT;
+
+        list_for_each(tmp, &v4vtables_rules)
+        {
+            node = list_entry(tmp, struct v4vtables_rule_node, list);
+
+            if ( (node->rule.src.domain == r.src.domain) &&
+                 (node->rule.src.port   == r.src.port)   &&
+                 (node->rule.dst.domain == r.dst.domain) &&
+                 (node->rule.dst.port   == r.dst.port))
+            {
+                to_delete = tmp;
+                break;
+            }
+        }
+    }
+    else
+    {
+        /* We want to flush the rules! */
+        printk(KERN_ERR "VIPTables: flushing rules\n");
+        list_for_each_safe(tmp, next, &v4vtables_rules)
+        {
+            node = list_entry(tmp, struct v4vtables_rule_node, list);
+            list_del(tmp);
+            xfree(node);
+        }
+    }
+
+    if ( to_delete )
+    {
+        node = list_entry(to_delete, struct v4vtables_rule_node, list);
+#ifdef V4V_DEBUG
+        printk(KERN_ERR "VIPTables: deleting rule: ");
+        v4vtables_print_rule(node);
+#endif /* V4V_DEBUG */
+        list_del(to_delete);
+        xfree(node);
+    }
+    v4vtables_compile();
+
+    return 0;
+}
+
+static size_t
+v4vtables_list(struct domain *src_d,
+               XEN_GUEST_HANDLE(v4vtables_list_t) list_hnd)
+{
+    struct list_head *ptr;
+    struct v4vtables_rule_node *node;
+    struct v4vtables_list rules_list;
+    uint32_t nbrules;
+    XEN_GUEST_HANDLE(v4vtables_rule_t) guest_rules;
+
+    ASSERT(rw_is_locked(&v4vtables_rules_lock));
+
+    memset(&rules_list, 0, sizeof (rules_list));
+    if ( copy_from_guest(&rules_list, list_hnd, 1) )
+        return -EFAULT;
+
+    ptr = v4vtables_rules.next;
+    while ( rules_list.start_rule != 0 && ptr->next != &v4vtables_rules )
+    {
+        ptr = ptr->next;
+        rules_list.start_rule--;
+    }
+
+    if ( rules_list.nb_rules == 0 )
+        return -EINVAL;
+
+    guest_rules = guest_handle_for_field(list_hnd, v4vtables_rule_t, rules[0]);
+
+    nbrules = 0;
+    while ( nbrules < rules_list.nb_rules && ptr != &v4vtables_rules )
+    {
+        node = list_entry(ptr, struct v4vtables_rule_node, list);
+
+        if ( copy_to_guest(guest_rules, &node->rule, 1) )
+            break;
+
+        guest_handle_add_offset(guest_rules, 1);
+
+        nbrules++;
+        ptr = ptr->next;
+    }
+
+    rules_list.nb_rules = nbrules;
+    if ( copy_field_to_guest(list_hnd, &rules_list, nb_rules) )
+        return -EFAULT;
+
+    return 0;
+}
+
+static size_t
+v4vtables_check(v4v_addr_t * src, v4v_addr_t * dst)
+{
+    struct list_head *ptr;
+    struct v4vtables_rule_node *node;
+    struct v4vtables_compiled *c;
+    size_t ret = 0; /* Defaulting to ACCEPT */
+
+    rcu_read_lock(&v4vtables_rcu_lock);
+    c = rcu_dereference(v4vtables_compiled);
+    if ( c )
+        ret = v4vtables_compiled_check(c, src, dst);
+    rcu_read_unlock(&v4vtables_rcu_lock);
+    if ( c )
+        return ret;
+
+    read_lock(&v4vtables_rules_lock);
+
+    list_for_each(ptr, &v4vtables_rules)
+    {
+        node = list_entry(ptr, struct v4vtables_rule_node, list);
+
+        if ( (node->rule.src.domain == V4V_DOMID_ANY ||
+              node->rule.src.domain == src->domain) &&
+             (node->rule.src.port == V4V_PORT_ANY ||
+              node->rule.src.port == src->port) &&
+             (node->rule.dst.domain == V4V_DOMID_ANY ||
+              node->rule.dst.domain == dst->domain) &&
+             (node->rule.dst.port == V4V_PORT_ANY ||
+              node->rule.dst.port == dst->port) )
+        {
+            ret = !node->rule.accept;
+            break;
+        }
+    }
+
+    read_unlock(&v4vtables_rules_lock);
+    return ret;
+}
+
+static inline unsigned int
+v4vtables_vcache_hash(v4v_addr_t *src, v4v_addr_t *dst)
+{
+    unsigned long k;
+
+    k = hash_long(src->port, BITS_PER_LONG) ^ dst->port;
+    k = hash_long(k, BITS_PER_LONG) ^
+        (((uint32_t)src->domain << 16) | dst->domain);
+
+    return hash_long(k, V4V_VCACHE_ORDER);
+}
+
+static inline int
+v4v_addr_equal(v4v_addr_t *a, v4v_addr_t *b)
+{
+    return (a->port == b->port) && (a->domain == b->domain);
+}
+
+/* v4vtables_check() and then XSM, 1 for REJECT, 0 for ACCEPT */
+static size_t
+v4vtables_check_xsm(struct domain *src_d, struct domain *dst_d,
+                    v4v_addr_t *src, v4v_addr_t *dst)
+{
+    if ( v4vtables_check(src, dst) )
+        return 1;
+
+    return xsm_v4v_send(XSM_HOOK, src_d, dst_d) ? 1 : 0;
+}
+
+/*
+ * v4vtables_check_xsm() through src_d's verdict cache, returns 1 for
+ * REJECT, 0 for ACCEPT. Caller is in an RCU read section.
+ */
+static size_t
+v4vtables_check_cached(struct domain *src_d, struct domain *dst_d,
+                       v4v_addr_t *src, v4v_addr_t *dst)
+{
+    struct v4v_domain *v4v = rcu_dereference(src_d->v4v);
+    struct v4v_verdict_ent *ent;
+    uint32_t generation;
+    size_t ret;
+
+    if ( !v4v )
+        return v4vtables_check_xsm(src_d, dst_d, src, dst);
+
+    generation = read_atomic(&v4vtables_generation);
+    smp_rmb();
+
+    ent = &v4v->vcache[v4vtables_vcache_hash(src, dst)];
+
+    spin_lock(&v4v->vcache_lock);
+    if ( (ent->generation == generation) &&
+         v4v_addr_equal(&ent->src, src) && v4v_addr_equal(&ent->dst, dst) )
+    {
+        ret = ent->verdict;
+        spin_unlock(&v4v->vcache_lock);
+        return ret;
+    }
+    spin_unlock(&v4v->vcache_lock);
+
+    ret = v4vtables_check_xsm(src_d, dst_d, src, dst);
+
+    spin_lock(&v4v->vcache_lock);
+    ent->src = *src;
+    ent->dst = *dst;
+    ent->generation = generation;
+    ent->verdict = ret;
+    spin_unlock(&v4v->vcache_lock);
+
+    return ret;
+}
+
+/*
+ * Account the outcome ret of a send of len bytes from src_d to ring_info
+ * that started at start. Caller holds L3 and domain_lock(src_d).
+ */
+static void
+v4v_ring_stats_sent(struct domain *src_d, struct v4v_ring_info *ring_info,
+                    long ret, size_t len, s_time_t start, bool_t signal)
+{
+    struct v4v_domain *v4v = rcu_dereference(src_d->v4v);
+
+    ASSERT(spin_is_locked(&ring_info->lock));
+
+    if ( ret == -EAGAIN )
+    {
+        ring_info->stats.eagain++;
+        v4v->tx_eagain++;
+    }
+    if ( ret < 0 )
+        return;
+
+    ring_info->stats.messages++;
+    ring_info->stats.bytes += len;
+    v4v->tx_messages++;
+    v4v->tx_bytes += len;
+    if ( cpu_to_node(smp_processor_id()) != ring_info->numa_node )
+        ring_info->stats.remote++;
+    if ( signal )
+        ring_info->stats.signals++;
+
+    if ( unlikely(opt_v4v_stats) )
+    {
+        v4v_stats_record(V4V_HIST_SEND_INSERT, start);
+        this_cpu(v4v_insert_time) = NOW();
+    }
+}
+
+/*
+ * May port of src_d send to ring_info, see V4VOP_ring_sources? Looked at
+ * before L3, so that the senders it doesn't allow never take it. Caller
+ * is in an RCU read section.
+ */
+static bool_t
+v4v_ring_source_allowed(struct v4v_ring_info *ring_info,
+                        struct domain *src_d, uint32_t port)
+{
+    struct v4v_ring_sources *sources = rcu_dereference(ring_info->sources);
+    uint32_t i;
+
+    if ( likely(!sources) )
+        return 1;
+
+    for ( i = 0; i < sources->nsrc; i++ )
+        if ( (sources->src[i].domain == src_d->domain_id) &&
+             ((sources->src[i].port == V4V_PORT_ANY) ||
+              (sources->src[i].port == port)) )
+            return 1;
+
+    return 0;
+}
+
+/*
+ * Apply the filtering rules and find the ring a message from src_addr to
+ * dst_addr is delivered to, its priority lane if prio and there is one.
+ * Caller is in an RCU read section and holds a reference on dst_d.
+ */
+static int
+v4v_sendv_find_ring(struct domain *src_d, struct domain *dst_d,
+                    v4v_addr_t *src_addr, v4v_addr_t *dst_addr, bool_t prio,
+                    struct v4v_ring_info **ring_info)
+{
+    if ( v4vtables_check_cached(src_d, dst_d, src_addr, dst_addr) != 0 )
+    {
+        gdprintk(XENLOG_WARNING,
+                 "V4V: VIPTables REJECTED %i:%i -> %i:%i\n",
+                 src_addr->domain, src_addr->port,
+                 dst_addr->domain, dst_addr->port);
+        return -ECONNREFUSED;
+    }
+
+    if ( !rcu_dereference(dst_d->v4v) )
+    {
+        v4v_dprintk("dst_d->v4v, ECONNREFUSED\n");
+        return -ECONNREFUSED;
+    }
+
+    *ring_info = v4v_ring_find_info_by_addr(dst_d, dst_addr, src_addr->domain,
+                                            prio);
+    if ( !*ring_info )
+    {
+        v4v_dprintk(" !ring_info, ECONNREFUSED\n");
+        return -ECONNREFUSED;
+    }
+
+    if ( !v4v_ring_source_allowed(*ring_info, src_d, src_addr->port) )
+    {
+        v4v_dprintk("source not allowed, ECONNREFUSED\n");
+        return -ECONNREFUSED;
+    }
+
+    return 0;
+}
+
+/*
+ * Send one message to ring_info of dst_d, or to the ring the filtering
+ * rules and v4v_sendv_find_ring() give if ring_info is NULL. Caller is
+ * in an RCU read section and holds a reference on dst_d. niov may have
+ * V4V_SENDV_F_PRIORITY, V4V_SENDV_F_FRAGMENT and V4V_SENDV_F_PACK set.
+ * Does not signal dst_d, *signal is set if the caller should.
+ */
+static long
+v4v_sendv_ring(struct domain *src_d, struct domain *dst_d,
+               struct v4v_ring_info *ring_info,
+               v4v_addr_t * src_addr, v4v_addr_t * dst_addr, uint32_t proto,
+               XEN_GUEST_HANDLE(v4v_iov_t) iovs, size_t niov, bool_t *signal)
+{
+    v4v_ring_id_t src_id;
+    v4v_iov_t *iov;
+    s_time_t start = unlikely(opt_v4v_stats) ? NOW() : 0;
+    bool_t prio = !!(niov & V4V_SENDV_F_PRIORITY);
+    bool_t frag = !!(niov & V4V_SENDV_F_FRAGMENT);
+    bool_t pack = !!(niov & V4V_SENDV_F_PACK);
+    uint16_t table[V4V_PACKED_HDR_LEN(V4V_MAXIOV) / sizeof (uint16_t)];
+    uint32_t i, table_len = 0;
+    long len = 0;
+    int ret = 0;
+
+    *signal = 0;
+    niov &= ~(V4V_SENDV_F_MASK | V4V_SENDV_F_PACK);
+    if ( pack && (frag || !niov) )
+    {
+        ret = -EINVAL;
+        goto out;
+    }
+    src_id.addr.port = src_addr->port;
+    src_id.addr.domain = src_d->domain_id;
+    src_id.partner = dst_addr->domain;
+
+    if ( !ring_info &&
+         (ret = v4v_sendv_find_ring(src_d, dst_d, src_addr, dst_addr, prio,
+                                    &ring_info)) )
+        goto out;
+
+    len = v4v_iov_snapshot(iovs, niov, &iov);
+    if ( len < 0 )
+    {
+        ret = len;
+        len = 0;
+        goto out;
+    }
+
+    if ( pack )
+    {
+        struct v4v_packed_header *ph = (struct v4v_packed_header *)table;
+
+        table_len = V4V_PACKED_HDR_LEN(niov);
+        memset(table, 0, table_len);
+        ph->count = niov;
+        for ( i = 0; i < niov; i++ )
+        {
+            if ( iov[i].iov_len > V4V_PACKED_DGRAM_MAX )
+            {
+                ret = -EMSGSIZE;
+                len = 0;
+                goto out;
+            }
+            ph->len[i] = iov[i].iov_len;
+        }
+    }
+
+    spin_lock(&ring_info->lock);
+    if ( v4v_ring_is_dead(ring_info) )
+    {
+        spin_unlock(&ring_info->lock);
+        ret = -ECONNREFUSED;
+        goto out;
+    }
+    v4v_aprintk("niov:%#lx, len:%#lx\n", niov, len);
+    if ( !ring_info->stream )
+    {
+        ret = v4v_ringbuf_insertv(dst_d, ring_info, &src_id, proto,
+                                  pack ? V4V_MSG_F_PACKED : 0, table,
+                                  table_len, iov, niov, len, signal);
+        if ( frag && ((ret == -EAGAIN) || (ret == -EMSGSIZE)) )
+            ret = v4v_ringbuf_insert_fragment(dst_d, ring_info, &src_id,
+                                              proto, iov, niov, signal);
+    }
+    else if ( ring_info->id.partner != src_d->domain_id )
+        ret = -ECONNREFUSED;
+    else if ( (proto == V4V_MESSAGE_STREAM) && !pack )
+        ret = v4v_ringbuf_insert_stream(ring_info, iov, niov, len, signal);
+    else
+        ret = -EPROTOTYPE;
+    /* a stream or a fragment may only take part of it */
+    if ( ret >= 0 )
+        len = ret;
+    v4v_ring_stats_sent(src_d, ring_info, ret, len, start, *signal);
+    if ( ret == -EAGAIN )
+    {
+        /*
+         * Schedule a wake up on the event channel when space is there,
+         * any of it for a stream and enough for a fragment
+         */
+        if ( ring_info->stream )
+            len = 1;
+        else if ( frag )
+            len = min_t(long, len,
+                        ring_info->len >> V4V_FRAGMENT_MIN_SHIFT);
+        else
+            len += table_len;
+        if ( v4v_pending_requeue(dst_d, ring_info, src_d->domain_id, len) )
+        {
+            printk(KERN_ERR "%s:v4v_pending_requeue failed, ENOMEM\n", __func__);
+            ret = -ENOMEM;
+        }
+    }
+    spin_unlock(&ring_info->lock);
+
+    v4v_signal_ring(dst_d, ring_info->evtchn_port, signal);
+
+out:
+    TRACE_5D(TRC_V4V_SENDV, (src_d->domain_id << 16) | dst_d->domain_id,
+             src_addr->port, dst_addr->port, len, ret);
+    return ret;
+}
+
+/* Send one message to dst_d, as v4v_sendv_ring() looking the ring up */
+static inline long
+v4v_sendv_dst(struct domain *src_d, struct domain *dst_d,
+              v4v_addr_t * src_addr, v4v_addr_t * dst_addr, uint32_t proto,
+              XEN_GUEST_HANDLE(v4v_iov_t) iovs, size_t niov, bool_t *signal)
+{
+    return v4v_sendv_ring(src_d, dst_d, NULL, src_addr, dst_addr, proto,
+                          iovs, niov, signal);
+}
+
+/*
+ * As v4v_sendv_dst() for a message whose data is the len bytes of the
+ * xen buffer buf, sent to the priority lane if prio.
+ */
+static long
+v4v_sendv_buf_dst(struct domain *src_d, struct domain *dst_d,
+                  v4v_addr_t *src_addr, v4v_addr_t *dst_addr, uint32_t proto,
+                  bool_t prio, void *buf, uint32_t len, bool_t *signal)
+{
+    v4v_ring_id_t src_id;
+    struct v4v_ring_info *ring_info;
+    s_time_t start = unlikely(opt_v4v_stats) ? NOW() : 0;
+    long ret;
+
+    *signal = 0;
+    src_id.addr.port = src_addr->port;
+    src_id.addr.domain = src_d->domain_id;
+    src_id.partner = dst_addr->domain;
+
+    ret = v4v_sendv_find_ring(src_d, dst_d, src_addr, dst_addr, prio,
+                              &ring_info);
+    if ( ret )
+        goto out;
+
+    spin_lock(&ring_info->lock);
+    if ( v4v_ring_is_dead(ring_info) )
+        ret = -ECONNREFUSED;
+    else
+    {
+        ret = v4v_ringbuf_insert_buf(dst_d, ring_info, &src_id, proto, 0,
+                                     buf, len, NULL, 0, signal);
+        v4v_ring_stats_sent(src_d, ring_info, ret, len, start, *signal);
+        if ( (ret == -EAGAIN) &&
+             v4v_pending_requeue(dst_d, ring_info, src_d->domain_id, len) )
+            ret = -ENOMEM;
+    }
+    spin_unlock(&ring_info->lock);
+
+    v4v_signal_ring(dst_d, ring_info->evtchn_port, signal);
+
+out:
+    TRACE_5D(TRC_V4V_SENDV, (src_d->domain_id << 16) | dst_d->domain_id,
+             src_addr->port, dst_addr->port, len, ret);
+    return ret;
+}
+
+/*
+ * The domain a vcpu last sent to is kept in v->v4v_dst with a reference,
+ * so that a vcpu sending to the same domain again neither looks it up
+ * nor touches its refcount. The vcpu takes the entry for the length of
+ * the send with xchg(), v4v_destroy() of either domain takes it away.
+ */
+static struct domain *
+v4v_dst_get(domid_t id)
+{
+    struct vcpu *v = current;
+    struct domain *d = xchg(&v->v4v_dst, NULL);
+
+    if ( d && (d->domain_id == id) && !d->is_dying )
+        return d;
+
+    if ( d )
+        put_domain(d);
+    return get_domain_by_id(id);
+}
+
+/* Done with the reference of v4v_dst_get(), keep it for the next send */
+static void
+v4v_dst_put(struct domain *d)
+{
+    struct vcpu *v = current;
+
+    if ( d->is_dying || v->domain->is_dying )
+    {
+        put_domain(d);
+        return;
+    }
+
+    d = xchg(&v->v4v_dst, d);
+    ASSERT(!d);
+
+    /* v4v_destroy() may have looked at the entry before we put it back */
+    smp_mb();
+    if ( (v->v4v_dst->is_dying || v->domain->is_dying) &&
+         (d = xchg(&v->v4v_dst, NULL)) )
+        put_domain(d);
+}
+
+/*
+ * Drop the references the vcpus of d and those of other domains to d
+ * hold, d is dying.
+ */
+static void
+v4v_dst_flush(struct domain *d)
+{
+    struct domain *sd, *old;
+    struct vcpu *v;
+
+    /* whoever puts d back after this sees it dying, see v4v_dst_put() */
+    smp_mb();
+
+    /* the plain read is a hint, the xchg() decides */
+    rcu_read_lock(&domlist_read_lock);
+    for_each_domain ( sd )
+        for_each_vcpu ( sd, v )
+            if ( ((sd == d) || (v->v4v_dst == d)) &&
+                 (old = xchg(&v->v4v_dst, NULL)) )
+                put_domain(old);
+    rcu_read_unlock(&domlist_read_lock);
+}
+
+/*
+ * Hypercall to do the send
+ */
+static long
+v4v_sendv(struct domain *src_d, v4v_addr_t * src_addr,
+          v4v_addr_t * dst_addr, uint32_t proto,
+          XEN_GUEST_HANDLE(v4v_iov_t) iovs, size_t niov)
+{
+    struct domain *dst_d;
+    bool_t signal;
+    int ret = 0;
+
+    v4v_dprintk_in();
+    if ( !dst_addr )
+    {
+        v4v_dprintk("!dst_addr, EINVAL\n");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    rcu_read_lock(&v4v_rcu_lock);
+    if ( !rcu_dereference(src_d->v4v) )
+    {
+        rcu_read_unlock(&v4v_rcu_lock);
+        v4v_dprintk("!src_d->v4v, EINVAL\n");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    //v4v_dprintk("port:%#lx, domain:%#lx, partner:%#lx\n", (unsigned long)src_id.addr.port, (unsigned long)src_id.addr.domain, (unsigned long)src_id.partner);
+    dst_d = v4v_dst_get(dst_addr->domain);
+    if ( !dst_d )
+    {
+        rcu_read_unlock(&v4v_rcu_lock);
+        v4v_dprintk("!dst_d, ECONNREFUSED\n");
+        ret = -ECONNREFUSED;
+        goto out;
+    }
+
+    ret = v4v_sendv_dst(src_d, dst_d, src_addr, dst_addr, proto, iovs, niov,
+                        &signal);
+    if ( signal )
+    {
+        //printk(KERN_INFO ":%d->%d:signal domain\n", src_d->domain_id, dst_d->domain_id);
+        v4v_signal_domain(dst_d);
+        if ( unlikely(opt_v4v_stats) )
+            v4v_stats_record(V4V_HIST_INSERT_SIGNAL,
+                             this_cpu(v4v_insert_time));
+    }
+
+    v4v_dst_put(dst_d);
+    rcu_read_unlock(&v4v_rcu_lock);
+out:
+    v4v_dprintk_out();
+    return ret;
+}
+
+/* Drop what c looked up, caller holds domain_lock() of c's owner */
+static void
+v4v_conn_release(struct v4v_conn *c)
+{
+    if ( c->dst_d )
+        put_domain(c->dst_d);
+    c->dst_d = NULL;
+    c->dst_v4v = NULL;
+    c->ring_info = NULL;
+}
+
+/*
+ * Bring c up to date and set *ring_info to the ring its next message
+ * goes to. The destination domain, the verdict and the ring are only
+ * looked up again once they may have changed. Caller is in an RCU read
+ * section and holds domain_lock(src_d).
+ */
+static int
+v4v_conn_resolve(struct domain *src_d, struct v4v_conn *c,
+                 struct v4v_ring_info **ring_info)
+{
+    struct v4v_domain *dst_v4v;
+    uint32_t gen;
+
+    if ( c->dst_d && c->dst_d->is_dying )
+        v4v_conn_release(c);
+
+    if ( !c->dst_d )
+    {
+        c->dst_d = get_domain_by_id(c->dst.domain);
+        if ( !c->dst_d )
+        {
+            v4v_dprintk("!dst_d, ECONNREFUSED\n");
+            return -ECONNREFUSED;
+        }
+    }
+
+    gen = read_atomic(&v4vtables_generation);
+    if ( gen != c->rules_gen )
+    {
+        c->refused =
+            (v4vtables_check_cached(src_d, c->dst_d, &c->src, &c->dst) != 0);
+        c->rules_gen = gen;
+    }
+    if ( c->refused )
+    {
+        v4v_dprintk("rejected by the rules, ECONNREFUSED\n");
+        return -ECONNREFUSED;
+    }
+
+    dst_v4v = rcu_dereference(c->dst_d->v4v);
+    if ( !dst_v4v )
+    {
+        v4v_dprintk("dst_d->v4v, ECONNREFUSED\n");
+        return -ECONNREFUSED;
+    }
+
+    gen = read_atomic(&dst_v4v->ring_gen);
+    if ( c->ring_info && (c->dst_v4v == dst_v4v) && (c->ring_gen == gen) )
+    {
+        *ring_info = c->ring_info;
+        goto allowed;
+    }
+    smp_rmb();
+
+    c->ring_info = NULL;
+    *ring_info = v4v_ring_find_info_by_addr(c->dst_d, &c->dst,
+                                            src_d->domain_id, c->prio);
+    if ( !*ring_info )
+    {
+        v4v_dprintk(" !ring_info, ECONNREFUSED\n");
+        return -ECONNREFUSED;
+    }
+
+    /* the sub-ring of a sharded ring depends on the sending vcpu */
+    if ( (*ring_info)->nshard <= 1 )
+    {
+        c->ring_info = *ring_info;
+        c->dst_v4v = dst_v4v;
+        c->ring_gen = gen;
+    }
+
+allowed:
+    /* the ring's senders may change at any time, not bumping ring_gen */
+    if ( !v4v_ring_source_allowed(*ring_info, src_d, c->src.port) )
+    {
+        v4v_dprintk("source not allowed, ECONNREFUSED\n");
+        return -ECONNREFUSED;
+    }
+
+    return 0;
+}
+
+/*
+ * Drop the connections of d and those of other domains to d, d is
+ * dying.
+ */
+static void
+v4v_conn_flush(struct domain *d)
+{
+    struct v4v_domain *v4v;
+    struct domain *sd;
+    unsigned int i;
+
+    rcu_read_lock(&domlist_read_lock);
+    rcu_read_lock(&v4v_rcu_lock);
+    for_each_domain ( sd )
+    {
+        domain_lock(sd);
+        v4v = rcu_dereference(sd->v4v);
+        if ( v4v && v4v->conns )
+            for ( i = 0; i < V4V_CONNECT_MAX; i++ )
+                if ( (sd == d) || (v4v->conns[i].dst_d == d) )
+                    v4v_conn_release(&v4v->conns[i]);
+        domain_unlock(sd);
+    }
+    rcu_read_unlock(&v4v_rcu_lock);
+    rcu_read_unlock(&domlist_read_lock);
+}
+
+/* Space on ring_info of dst_d for a message, 0 if it went away */
+static uint32_t
+v4v_peer_ring_space(struct domain *dst_d, struct v4v_ring_info *ring_info)
+{
+    uint32_t space = 0;
+
+    spin_lock(&ring_info->lock);
+    if ( !v4v_ring_is_dead(ring_info) )
+        space = v4v_ringbuf_payload_space(dst_d, ring_info);
+    spin_unlock(&ring_info->lock);
+
+    return space;
+}
+
+/*
+ * Update the peer space entry of connection handle of v4v, if it has a
+ * peer space page. Caller is in an RCU read section and holds
+ * domain_lock() of v4v's domain.
+ */
+static void
+v4v_peer_update(struct v4v_domain *v4v, uint32_t handle, uint16_t flags,
+                struct v4v_ring_info *ring_info)
+{
+    struct v4v_peer *p = v4v->peer;
+    struct v4v_conn *c = &v4v->conns[handle];
+    uint32_t space = 0;
+
+    if ( !p )
+        return;
+    if ( flags && ring_info )
+        space = v4v_peer_ring_space(c->dst_d, ring_info);
+    v4v_peer_publish(p, handle, &c->dst, flags, space);
+}
+
+/*
+ * V4VOP_connect: bind the source port and the destination at conn_hnd
+ * to a free connection of d.
+ */
+static long
+v4v_connect(struct domain *d, XEN_GUEST_HANDLE(v4v_connect_t) conn_hnd)
+{
+    struct v4v_domain *v4v;
+    struct v4v_ring_info *ring_info;
+    struct v4v_conn *c;
+    v4v_connect_t conn;
+    unsigned int i;
+    long ret;
+
+    v4v_dprintk_in();
+    if ( copy_from_guest(&conn, conn_hnd, 1) )
+    {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    if ( conn.flags & ~V4V_SENDV_F_PRIORITY )
+    {
+        v4v_dprintk("flags %#x, EINVAL\n", conn.flags);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    rcu_read_lock(&v4v_rcu_lock);
+    v4v = rcu_dereference(d->v4v);
+    if ( !v4v )
+    {
+        v4v_dprintk("!d->v4v, EINVAL\n");
+        ret = -EINVAL;
+        goto unlock;
+    }
+
+    if ( !v4v->conns )
+    {
+        v4v->conns = xzalloc_array(struct v4v_conn, V4V_CONNECT_MAX);
+        if ( !v4v->conns )
+        {
+            ret = -ENOMEM;
+            goto unlock;
+        }
+    }
+
+    for ( i = 0; (i < V4V_CONNECT_MAX) && v4v->conns[i].used; i++ )
+        ;
+    if ( i == V4V_CONNECT_MAX )
+    {
+        ret = -ENOSPC;
+        goto unlock;
+    }
+
+    c = &v4v->conns[i];
+    memset(c, 0, sizeof (*c));
+    c->src.domain = d->domain_id;
+    c->src.port = conn.addr.src.port;
+    c->dst = conn.addr.dst;
+    c->message_type = conn.message_type;
+    c->prio = !!(conn.flags & V4V_SENDV_F_PRIORITY);
+
+    ret = v4v_conn_resolve(d, c, &ring_info);
+    if ( !ret )
+    {
+        conn.handle = i;
+        if ( copy_field_to_guest(conn_hnd, &conn, handle) )
+            ret = -EFAULT;
+    }
+
+    if ( ret )
+        v4v_conn_release(c);
+    else
+    {
+        c->used = 1;
+        v4v_peer_update(v4v, i, V4V_PEER_F_EXISTS, ring_info);
+    }
+
+unlock:
+    rcu_read_unlock(&v4v_rcu_lock);
+out:
+    v4v_dprintk_out();
+    return ret;
+}
+
+/* V4VOP_disconnect */
+static long
+v4v_disconnect(struct domain *d, uint32_t handle)
+{
+    struct v4v_domain *v4v;
+    long ret = 0;
+
+    rcu_read_lock(&v4v_rcu_lock);
+    v4v = rcu_dereference(d->v4v);
+    if ( !v4v || !v4v->conns || (handle >= V4V_CONNECT_MAX) ||
+         !v4v->conns[handle].used )
+        ret = -EBADF;
+    else
+    {
+        v4v_peer_update(v4v, handle, 0, NULL);
+        v4v_conn_release(&v4v->conns[handle]);
+        v4v->conns[handle].used = 0;
+    }
+    rcu_read_unlock(&v4v_rcu_lock);
+
+    return ret;
+}
+
+/*
+ * V4VOP_sendv_connected: as v4v_sendv() with what connection handle of
+ * src_d looked up.
+ */
+static long
+v4v_sendv_connected(struct domain *src_d, uint32_t handle,
+                    XEN_GUEST_HANDLE(v4v_iov_t) iovs, uint32_t niov)
+{
+    struct v4v_domain *v4v;
+    struct v4v_ring_info *ring_info;
+    struct v4v_conn *c;
+    bool_t signal;
+    long ret;
+
+    v4v_dprintk_in();
+    rcu_read_lock(&v4v_rcu_lock);
+    v4v = rcu_dereference(src_d->v4v);
+    if ( !v4v || !v4v->conns || (handle >= V4V_CONNECT_MAX) ||
+         !v4v->conns[handle].used )
+    {
+        ret = -EBADF;
+        goto unlock;
+    }
+    c = &v4v->conns[handle];
+
+    if ( (ret = v4v_conn_resolve(src_d, c, &ring_info)) )
+    {
+        if ( ret == -ECONNREFUSED )
+            v4v_peer_update(v4v, handle, 0, NULL);
+        goto unlock;
+    }
+
+    /* the lane was picked at V4VOP_connect */
+    ret = v4v_sendv_ring(src_d, c->dst_d, ring_info, &c->src, &c->dst,
+                         c->message_type, iovs, niov & ~V4V_SENDV_F_PRIORITY,
+                         &signal);
+    if ( signal )
+    {
+        v4v_signal_domain(c->dst_d);
+        if ( unlikely(opt_v4v_stats) )
+            v4v_stats_record(V4V_HIST_INSERT_SIGNAL,
+                             this_cpu(v4v_insert_time));
+    }
+
+    /* a full ring is waited on, v4v_peer_wake() says when it has room */
+    if ( ret == -EAGAIN )
+        v4v_peer_update(v4v, handle, V4V_PEER_F_EXISTS | V4V_PEER_F_WAITING,
+                        NULL);
+    else if ( ret == -ECONNREFUSED )
+        v4v_peer_update(v4v, handle, 0, NULL);
+    else if ( ret >= 0 )
+        v4v_peer_update(v4v, handle, V4V_PEER_F_EXISTS, ring_info);
+
+unlock:
+    rcu_read_unlock(&v4v_rcu_lock);
+    v4v_dprintk_out();
+    return ret;
+}
+
+static void
+v4v_peer_free_rcu(struct rcu_head *head)
+{
+    xfree(container_of(head, struct v4v_peer, rcu));
+}
+
+/*
+ * Tear down the peer space page of v4v's domain, if it has one. Caller
+ * holds domain_lock(), receivers may still be looking at it under RCU.
+ */
+static void
+v4v_peer_teardown(struct v4v_domain *v4v)
+{
+    struct v4v_peer *p = v4v->peer;
+    v4v_peer_space_t *page;
+
+    if ( !p )
+        return;
+
+    rcu_assign_pointer(v4v->peer, NULL);
+    spin_lock(&p->lock);
+    page = p->page;
+    p->page = NULL;
+    spin_unlock(&p->lock);
+
+    unmap_domain_page_global(page);
+    put_page_and_type(mfn_to_page(p->mfn));
+    atomic_dec(&v4v_peer_users);
+    call_rcu(&p->rcu, v4v_peer_free_rcu);
+}
+
+/*
+ * Set up (or with npage 0, tear down) the caller's peer space page at
+ * pfn_hnd, see V4VOP_peer_space_setup.
+ */
+static long
+v4v_peer_setup(struct domain *d, XEN_GUEST_HANDLE(v4v_pfn_t) pfn_hnd,
+               uint32_t npage)
+{
+    struct v4v_domain *v4v;
+    struct v4v_ring_info *ring_info;
+    struct v4v_peer *p;
+    struct page_info *page;
+    p2m_type_t p2mt;
+    unsigned long mfn;
+    v4v_pfn_t pfn;
+    unsigned int i;
+    long ret = 0;
+
+    BUILD_BUG_ON(V4V_CONNECT_MAX > 64);
+    BUILD_BUG_ON(sizeof (v4v_peer_space_t) > PAGE_SIZE);
+
+    v4v_dprintk_in();
+    rcu_read_lock(&v4v_rcu_lock);
+    v4v = rcu_dereference(d->v4v);
+    if ( !v4v )
+    {
+        ret = -ENODEV;
+        goto out;
+    }
+
+    v4v_peer_teardown(v4v);
+    if ( !npage )
+        goto out;
+
+    if ( npage > 1 )
+    {
+        ret = -E2BIG;
+        goto out;
+    }
+
+    if ( copy_from_guest(&pfn, pfn_hnd, 1) )
+    {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    mfn = mfn_x(get_gfn(d, pfn, &p2mt));
+    page = mfn_valid(mfn) ? mfn_to_page(mfn) : NULL;
+    if ( !page || !get_page_and_type(page, d, PGT_writable_page) )
+    {
+        v4v_dprintk("bad peer space pfn %"PRIx64"\n", pfn);
+        put_gfn(d, pfn);
+        ret = -EINVAL;
+        goto out;
+    }
+    put_gfn(d, pfn);
+
+    p = xzalloc(struct v4v_peer);
+    if ( !p )
+    {
+        put_page_and_type(page);
+        ret = -ENOMEM;
+        goto out;
+    }
+    spin_lock_init(&p->lock);
+    p->mfn = mfn;
+    p->page = __map_domain_page_global(page);
+    if ( !p->page )
+    {
+        put_page_and_type(page);
+        xfree(p);
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    clear_page(p->page);
+    p->page->nent = V4V_CONNECT_MAX;
+    smp_wmb();
+    p->page->magic = V4V_PEER_SPACE_MAGIC;
+
+    atomic_inc(&v4v_peer_users);
+    rcu_assign_pointer(v4v->peer, p);
+
+    /* what is connected already */
+    if ( v4v->conns )
+        for ( i = 0; i < V4V_CONNECT_MAX; i++ )
+            if ( v4v->conns[i].used &&
+                 !v4v_conn_resolve(d, &v4v->conns[i], &ring_info) )
+                v4v_peer_update(v4v, i, V4V_PEER_F_EXISTS, ring_info);
+
+out:
+    rcu_read_unlock(&v4v_rcu_lock);
+    v4v_dprintk_out();
+    return ret;
+}
+
+/*
+ * Send a message describing ndesc blocks of src_d's memory granted to the
+ * destination, see V4VOP_sendv_grants.
+ */
+static long
+v4v_sendv_grants(struct domain *src_d, v4v_addr_t * src_addr,
+                 v4v_addr_t * dst_addr, uint32_t proto,
+                 XEN_GUEST_HANDLE(v4v_grant_desc_t) desc_hnd, uint32_t ndesc)
+{
+    struct domain *dst_d = NULL;
+    struct v4v_ring_info *ring_info;
+    v4v_grant_desc_t *desc = NULL;
+    v4v_ring_id_t src_id;
+    s_time_t start = unlikely(opt_v4v_stats) ? NOW() : 0;
+    bool_t prio = !!(ndesc & V4V_SENDV_F_PRIORITY);
+    uint32_t i, len;
+    long total = 0;
+    bool_t signal = 0;
+    long ret;
+
+    v4v_dprintk_in();
+    ndesc &= ~V4V_SENDV_F_PRIORITY;
+    len = ndesc * sizeof (*desc);
+    ret = -EINVAL;
+    if ( !ndesc )
+        goto out_free;
+    ret = -E2BIG;
+    if ( ndesc > V4V_GRANT_DESC_MAX )
+        goto out_free;
+
+    /* work on a snapshot, the guest can't change what gets validated */
+    ret = -ENOMEM;
+    desc = xmalloc_array(v4v_grant_desc_t, ndesc);
+    if ( !desc )
+        goto out_free;
+    if ( copy_from_guest(desc, desc_hnd, ndesc) )
+    {
+        ret = -EFAULT;
+        goto out_free;
+    }
+
+    rcu_read_lock(&v4v_rcu_lock);
+    if ( !rcu_dereference(src_d->v4v) )
+    {
+        v4v_dprintk("!src_d->v4v, EINVAL\n");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    dst_d = get_domain_by_id(dst_addr->domain);
+    if ( !dst_d )
+    {
+        v4v_dprintk("!dst_d, ECONNREFUSED\n");
+        ret = -ECONNREFUSED;
+        goto out;
+    }
+
+    ret = v4v_sendv_find_ring(src_d, dst_d, src_addr, dst_addr, prio,
+                              &ring_info);
+    if ( ret )
+        goto out;
+
+    for ( i = 0; i < ndesc; i++ )
+    {
+        if ( (desc[i].flags & ~V4V_GRANT_DESC_F_WRITABLE) ||
+             !desc[i].len || (desc[i].offset >= PAGE_SIZE) ||
+             (desc[i].len > (PAGE_SIZE - desc[i].offset)) )
+        {
+            ret = -EINVAL;
+            goto out;
+        }
+
+        ret = gnttab_check_grant(src_d, desc[i].gref, dst_d->domain_id,
+                                 !(desc[i].flags & V4V_GRANT_DESC_F_WRITABLE));
+        if ( ret )
+        {
+            v4v_dprintk("gref %u not granted to %d\n", desc[i].gref,
+                        dst_d->domain_id);
+            goto out;
+        }
+        total += desc[i].len;
+    }
+
+    src_id.addr.port = src_addr->port;
+    src_id.addr.domain = src_d->domain_id;
+    src_id.partner = dst_addr->domain;
+
+    spin_lock(&ring_info->lock);
+    if ( v4v_ring_is_dead(ring_info) )
+        ret = -ECONNREFUSED;
+    else
+    {
+        ret = v4v_ringbuf_insert_buf(dst_d, ring_info, &src_id, proto,
+                                     V4V_MSG_F_GRANTS, desc, len, NULL, 0,
+                                     &signal);
+        v4v_ring_stats_sent(src_d, ring_info, ret, len, start, signal);
+        if ( (ret == -EAGAIN) &&
+             v4v_pending_requeue(dst_d, ring_info, src_d->domain_id, len) )
+            ret = -ENOMEM;
+    }
+    spin_unlock(&ring_info->lock);
+
+    v4v_signal_ring(dst_d, ring_info->evtchn_port, &signal);
+
+    if ( ret >= 0 )
+        ret = total;
+    TRACE_5D(TRC_V4V_SENDV, (src_d->domain_id << 16) | dst_d->domain_id,
+             src_addr->port, dst_addr->port, total, ret);
+    if ( signal )
+    {
+        v4v_signal_domain(dst_d);
+        if ( unlikely(opt_v4v_stats) )
+            v4v_stats_record(V4V_HIST_INSERT_SIGNAL,
+                             this_cpu(v4v_insert_time));
+    }
+
+out:
+    if ( dst_d )
+        put_domain(dst_d);
+    rcu_read_unlock(&v4v_rcu_lock);
+out_free:
+    xfree(desc);
+    v4v_dprintk_out();
+    return ret;
+}
+
+/*
+ * Asynchronous sends, see V4VOP_async_setup. Completions of a batch are
+ * posted before the domain is signalled, then the tasklet comes back for
+ * the next batch.
+ */
+#define V4V_ASYNC_BATCH         32
+
+/* Send the message of sqe from a's data area, as V4VOP_sendv would */
+static long
+v4v_async_send(struct domain *d, struct v4v_async *a, v4v_async_sqe_t *sqe)
+{
+    struct domain *dst_d;
+    bool_t signal;
+    long ret;
+
+    if ( (sqe->flags & ~V4V_SENDV_F_PRIORITY) ||
+         (sqe->offset > a->data_len) ||
+         (sqe->len > (a->data_len - sqe->offset)) )
+        return -EINVAL;
+
+    dst_d = get_domain_by_id(sqe->addr.dst.domain);
+    if ( !dst_d )
+        return -ECONNREFUSED;
+
+    ret = v4v_sendv_buf_dst(d, dst_d, &sqe->addr.src, &sqe->addr.dst,
+                            sqe->message_type,
+                            !!(sqe->flags & V4V_SENDV_F_PRIORITY),
+                            a->data + sqe->offset, sqe->len, &signal);
+    if ( signal )
+    {
+        v4v_signal_domain(dst_d);
+        if ( unlikely(opt_v4v_stats) )
+            v4v_stats_record(V4V_HIST_INSERT_SIGNAL,
+                             this_cpu(v4v_insert_time));
+    }
+
+    put_domain(dst_d);
+    return ret;
+}
+
+/*
+ * The tasklet of a's queue. The sends need domain_lock(d), as those of
+ * the hypercalls, and d may be in one of them holding it: rather than
+ * spinning here, try again later.
+ */
+static void
+v4v_async_run(unsigned long data)
+{
+    struct v4v_async *a = (struct v4v_async *)data;
+    struct domain *d = a->d;
+    v4v_async_sqe_t sqe;
+    v4v_async_cqe_t cqe;
+    unsigned int n = 0;
+
+    if ( !spin_trylock_recursive(&d->domain_lock) )
+    {
+        tasklet_schedule(&a->tasklet);
+        return;
+    }
+
+    rcu_read_lock(&v4v_rcu_lock);
+    while ( n < V4V_ASYNC_BATCH )
+    {
+        if ( a->sq_cons == read_atomic(&a->q->sq_prod) )
+            break;
+        if ( (a->cq_prod - read_atomic(&a->q->cq_cons)) >= a->cq_size )
+            break;
+
+        /* read the entry once sq_prod said it is there */
+        smp_rmb();
+        sqe = a->sq[a->sq_cons & (a->sq_size - 1)];
+        a->sq_cons++;
+
+        cqe.cookie = sqe.cookie;
+        cqe.status = v4v_async_send(d, a, &sqe);
+        cqe.pad = 0;
+        a->cq[a->cq_prod & (a->cq_size - 1)] = cqe;
+
+        /* and the completion before cq_prod says so */
+        smp_wmb();
+        a->cq_prod++;
+        write_atomic(&a->q->sq_cons, a->sq_cons);
+        write_atomic(&a->q->cq_prod, a->cq_prod);
+        n++;
+    }
+
+    if ( n && a->evtchn )
+        v4v_signal_port(d, a->evtchn);
+    else if ( n )
+        v4v_signal_domain(d);
+    rcu_read_unlock(&v4v_rcu_lock);
+    spin_unlock_recursive(&d->domain_lock);
+
+    if ( n == V4V_ASYNC_BATCH )
+        tasklet_schedule(&a->tasklet);
+}
+
+/*
+ * Tear down the asynchronous send queue of v4v's domain, if it has one.
+ * Caller holds domain_lock(), the tasklet only tries to take it.
+ */
+static void
+v4v_async_teardown(struct v4v_domain *v4v)
+{
+    struct v4v_async *a = v4v->async;
+    uint32_t i;
+
+    if ( !a )
+        return;
+
+    v4v->async = NULL;
+    tasklet_kill(&a->tasklet);
+    vunmap(a->q);
+    for ( i = 0; i < a->npage; i++ )
+        put_page_and_type(mfn_to_page(a->mfns[i]));
+    xfree(a->mfns);
+    xfree(a);
+}
+
+/*
+ * Set up (or with npage 0, tear down) the caller's asynchronous send
+ * queue in the npage pages of pfn_hnd, see V4VOP_async_setup.
+ */
+static long
+v4v_async_setup(struct domain *d, XEN_GUEST_HANDLE(v4v_pfn_t) pfn_hnd,
+                uint32_t npage, evtchn_port_t evtchn)
+{
+    struct v4v_domain *v4v;
+    struct v4v_async *a = NULL;
+    v4v_async_queue_t *q;
+    struct page_info *page;
+    uint64_t end;
+    uint32_t i = 0;
+    long ret = 0;
+
+    v4v_dprintk_in();
+    rcu_read_lock(&v4v_rcu_lock);
+    v4v = rcu_dereference(d->v4v);
+    if ( !v4v )
+    {
+        ret = -ENODEV;
+        goto out;
+    }
+
+    v4v_async_teardown(v4v);
+    if ( !npage )
+        goto out;
+
+    if ( npage > V4V_ASYNC_MAX_PAGES )
+    {
+        ret = -E2BIG;
+        goto out;
+    }
+
+    if ( evtchn && (ret = v4v_check_ring_evtchn(d, evtchn)) )
+        goto out;
+
+    ret = -ENOMEM;
+    a = xzalloc(struct v4v_async);
+    if ( !a )
+        goto out;
+    a->mfns = xmalloc_array(unsigned long, npage);
+    if ( !a->mfns )
+        goto out;
+
+    for ( i = 0; i < npage; i++ )
+    {
+        v4v_pfn_t pfn;
+        p2m_type_t p2mt;
+        unsigned long mfn;
+
+        if ( copy_from_guest_offset(&pfn, pfn_hnd, i, 1) )
+        {
+            ret = -EFAULT;
+            goto out;
+        }
+
+        mfn = mfn_x(get_gfn(d, pfn, &p2mt));
+        page = mfn_valid(mfn) ? mfn_to_page(mfn) : NULL;
+        if ( !page || !get_page_and_type(page, d, PGT_writable_page) )
+        {
+            v4v_dprintk("bad async queue pfn %"PRIx64"\n", pfn);
+            put_gfn(d, pfn);
+            ret = -EINVAL;
+            goto out;
+        }
+        put_gfn(d, pfn);
+        a->mfns[i] = mfn;
+    }
+    a->npage = npage;
+
+    q = vmap(a->mfns, npage);
+    if ( !q )
+        goto out;
+    a->q = q;
+
+    /* the domain can write the header, work on what we checked */
+    a->sq_size = read_atomic(&q->sq_size);
+    a->cq_size = read_atomic(&q->cq_size);
+    a->data_len = read_atomic(&q->data_len);
+    a->data = (uint8_t *)q + read_atomic(&q->data_offset);
+    end = V4V_ASYNC_SQ_OFFSET +
+          (uint64_t)a->sq_size * sizeof (v4v_async_sqe_t) +
+          (uint64_t)a->cq_size * sizeof (v4v_async_cqe_t);
+
+    ret = -EINVAL;
+    if ( (q->magic != V4V_ASYNC_MAGIC) ||
+         !a->sq_size || (a->sq_size & (a->sq_size - 1)) ||
+         (a->sq_size > V4V_ASYNC_MAX_ENTRIES) ||
+         !a->cq_size || (a->cq_size & (a->cq_size - 1)) ||
+         (a->cq_size > V4V_ASYNC_MAX_ENTRIES) ||
+         ((a->data - (uint8_t *)q) < end) ||
+         ((a->data - (uint8_t *)q) + (uint64_t)a->data_len >
+          ((uint64_t)npage << PAGE_SHIFT)) )
+        goto out;
+
+    a->d = d;
+    a->sq = (v4v_async_sqe_t *)((uint8_t *)q + V4V_ASYNC_SQ_OFFSET);
+    a->cq = (v4v_async_cqe_t *)(a->sq + a->sq_size);
+    a->sq_cons = read_atomic(&q->sq_cons);
+    a->cq_prod = read_atomic(&q->cq_prod);
+    a->evtchn = evtchn;
+    tasklet_init(&a->tasklet, v4v_async_run, (unsigned long)a);
+
+    v4v->async = a;
+    a = NULL;
+    ret = 0;
+
+out:
+    rcu_read_unlock(&v4v_rcu_lock);
+    if ( a )
+    {
+        if ( a->q )
+            vunmap(a->q);
+        while ( i-- )
+            put_page_and_type(mfn_to_page(a->mfns[i]));
+        xfree(a->mfns);
+        xfree(a);
+    }
+    v4v_dprintk_out();
+    return ret;
+}
+
+/* V4VOP_async_submit: have the tasklet look at the caller's queue */
+static long
+v4v_async_submit(struct domain *d)
+{
+    struct v4v_domain *v4v;
+    long ret = -ENOENT;
+
+    rcu_read_lock(&v4v_rcu_lock);
+    v4v = rcu_dereference(d->v4v);
+    if ( v4v && v4v->async )
+    {
+        tasklet_schedule(&v4v->async->tasklet);
+        ret = 0;
+    }
+    rcu_read_unlock(&v4v_rcu_lock);
+
+    return ret;
+}
+
+/*
+ * Hypercall to move up to nmsg messages from the head of the caller's
+ * ring at ring_hnd to the ring dst_addr is delivered to, stopping once
+ * nbytes (if not 0) of data were moved. The data is copied from one
+ * persistent mapping to the other. Messages are filtered and stamped as
+ * sent by src_addr->port of the caller, and their data and message_type
+ * are kept.
+ *
+ * The source L3 is dropped while a message is copied out: the two L3
+ * are never held together, a splice the other way round can't deadlock
+ * us. The source ring can't go meanwhile, removing it needs
+ * domain_lock(d), which we hold.
+ */
+static long
+v4v_splice(struct domain *d, XEN_GUEST_HANDLE(v4v_ring_t) ring_hnd,
+           v4v_addr_t *src_addr, v4v_addr_t *dst_addr, uint32_t nmsg,
+           uint32_t nbytes)
+{
+    struct v4v_ring_message_header mh;
+    struct v4v_ring_info *ring_info, *dst_ring;
+    struct domain *dst_d = NULL;
+    v4v_ring_id_t src_id;
+    v4v_ring_t ring;
+    uint32_t rx_ptr = 0, start = 0, tx_ptr, ptr, avail, len, len1;
+    uint64_t moved = 0;
+    unsigned int n = 0;
+    bool_t signal = 0;
+    long ret = 0;
+
+    v4v_dprintk_in();
+    if ( nmsg > V4V_SPLICE_MAX )
+    {
+        ret = -E2BIG;
+        goto out;
+    }
+
+    if ( copy_field_from_guest(&ring, ring_hnd, id) )
+    {
+        ret = -EFAULT;
+        goto out;
+    }
+    ring.id.addr.domain = d->domain_id;
+    src_addr->domain = d->domain_id;
+
+    rcu_read_lock(&v4v_rcu_lock);
+    if ( !rcu_dereference(d->v4v) )
+    {
+        v4v_dprintk("!d->v4v, ENODEV\n");
+        ret = -ENODEV;
+        goto unlock;
+    }
+
+    ring_info = v4v_ring_find_info(d, &ring.id);
+    if ( !ring_info || (ring_info->ring.p != ring_hnd.p) )
+    {
+        ret = -ENOENT;
+        goto unlock;
+    }
+
+    if ( ring_info->stream )
+    {
+        ret = -EPROTOTYPE;
+        goto unlock;
+    }
+
+    /* we copy straight out of the ring, it must be mapped as a whole */
+    if ( !ring_info->ring_mapping )
+    {
+        ret = -EOPNOTSUPP;
+        goto unlock;
+    }
+
+    dst_d = get_domain_by_id(dst_addr->domain);
+    if ( !dst_d )
+    {
+        v4v_dprintk("!dst_d, ECONNREFUSED\n");
+        ret = -ECONNREFUSED;
+        goto unlock;
+    }
+
+    ret = v4v_sendv_find_ring(d, dst_d, src_addr, dst_addr, 0, &dst_ring);
+    if ( ret )
+        goto unlock;
+
+    src_id.addr.port = src_addr->port;
+    src_id.addr.domain = d->domain_id;
+    src_id.partner = dst_addr->domain;
+
+    spin_lock(&ring_info->lock);
+    if ( v4v_ring_is_dead(ring_info) )
+    {
+        spin_unlock(&ring_info->lock);
+        ret = -ENOENT;
+        goto unlock;
+    }
+
+    if ( !(ret = v4v_memcpy_from_guest_ring(&rx_ptr, ring_info,
+                                            offsetof(v4v_ring_t, rx_ptr),
+                                            sizeof (rx_ptr))) &&
+         ((rx_ptr >= ring_info->len) ||
+          (v4v_ring_roundup(ring_info, rx_ptr) != rx_ptr)) )
+        ret = -EINVAL;
+    start = rx_ptr;
+
+    while ( !ret && (n < nmsg) && (!nbytes || (moved < nbytes)) )
+    {
+        XEN_GUEST_HANDLE(uint8_t) empty_hnd = { 0 };
+        s_time_t stamp = unlikely(opt_v4v_stats) ? NOW() : 0;
+        bool_t sig;
+
+        tx_ptr = ring_info->tx_ptr;
+        if ( rx_ptr == tx_ptr )
+            break;
+
+        avail = tx_ptr - rx_ptr;
+        if ( tx_ptr < rx_ptr )
+            avail += ring_info->len;
+
+        ptr = rx_ptr;
+        if ( (avail < sizeof (mh)) ||
+             (ret = v4v_ringbuf_copy_out(ring_info, &ptr, &mh, empty_hnd,
+                                         sizeof (mh))) )
+        {
+            ret = ret ?: -EINVAL;
+            break;
+        }
+
+        /* as in v4v_recvv(), the receiver can write its ring */
+        if ( (mh.len < sizeof (mh)) ||
+             (v4v_ring_roundup(ring_info, mh.len) > avail) )
+        {
+            v4v_dprintk("bad message at %#x len %#x\n", rx_ptr, mh.len);
+            ret = -EINVAL;
+            break;
+        }
+
+        /* grant descriptors only make sense to the domain they came to */
+        if ( mh.flags & V4V_MSG_F_GRANTS )
+        {
+            if ( !n )
+                ret = -EINVAL;
+            break;
+        }
+
+        len = mh.len - sizeof (mh);
+        if ( !(mh.flags & V4V_MSG_F_DISCARD) )
+        {
+            if ( (mh.flags & V4V_MSG_F_TSTAMP) && (len >= sizeof (uint64_t)) )
+            {
+                ptr += sizeof (uint64_t);
+                len -= sizeof (uint64_t);
+            }
+            if ( ptr >= ring_info->len )
+                ptr -= ring_info->len;
+            len1 = min_t(uint32_t, len, ring_info->len - ptr);
+
+            spin_unlock(&ring_info->lock);
+
+            spin_lock(&dst_ring->lock);
+            if ( v4v_ring_is_dead(dst_ring) )
+                ret = -ECONNREFUSED;
+            else
+            {
+                ret = v4v_ringbuf_insert_buf(dst_d, dst_ring, &src_id,
+                        mh.message_type, 0,
+                        ring_info->ring_mapping + sizeof (v4v_ring_t) + ptr,
+                        len1,
+                        ring_info->ring_mapping + sizeof (v4v_ring_t),
+                        len - len1, &sig);
+                v4v_ring_stats_sent(d, dst_ring, ret, len, stamp, sig);
+                if ( (ret == -EAGAIN) &&
+                     v4v_pending_requeue(dst_d, dst_ring, d->domain_id, len) )
+                    ret = -ENOMEM;
+            }
+            spin_unlock(&dst_ring->lock);
+
+            if ( ret >= 0 )
+            {
+                v4v_signal_ring(dst_d, dst_ring->evtchn_port, &sig);
+                signal |= sig;
+            }
+            TRACE_5D(TRC_V4V_SENDV, (d->domain_id << 16) | dst_d->domain_id,
+                     src_addr->port, dst_addr->port, len, ret);
+
+            spin_lock(&ring_info->lock);
+            if ( ret < 0 )
+                break;
+            ret = 0;
+            moved += len;
+            n++;
+        }
+
+        rx_ptr += v4v_ring_roundup(ring_info, mh.len);
+        if ( rx_ptr >= ring_info->len )
+            rx_ptr -= ring_info->len;
+    }
+
+    if ( rx_ptr != start )
+    {
+        /* the messages are all in the destination ring */
+        mb();
+        if ( v4v_update_rx_ptr(ring_info, rx_ptr) && !ret )
+            ret = -EFAULT;
+    }
+    v4v_ring_unmap(ring_info);
+    spin_unlock(&ring_info->lock);
+
+    if ( rx_ptr != start )
+        v4v_ring_wake(d, ring_info);
+
+    if ( signal )
+    {
+        v4v_signal_domain(dst_d);
+        if ( unlikely(opt_v4v_stats) )
+            v4v_stats_record(V4V_HIST_INSERT_SIGNAL,
+                             this_cpu(v4v_insert_time));
+    }
+
+unlock:
+    if ( dst_d )
+        put_domain(dst_d);
+    rcu_read_unlock(&v4v_rcu_lock);
+out:
+    v4v_dprintk_out();
+    return n ? n : ret;
+}
+
+/*
+ * Hypercall to send a batch of messages: one RCU read section covers the
+ * whole batch, consecutive entries to the same domain share the domain
+ * lookup and each destination domain is signalled only once.
+ */
+static long
+v4v_sendv_batch(struct domain *src_d,
+                XEN_GUEST_HANDLE(v4v_send_batch_ent_t) ent_hnd,
+                XEN_GUEST_HANDLE(v4v_iov_t) iovs, uint32_t nent)
+{
+    struct domain *signal_d[V4V_SENDV_BATCH_MAX];
+    struct domain *dst_d = NULL;
+    v4v_send_batch_ent_t ent;
+    bool_t signal;
+    unsigned int i, j, nsignal = 0;
+    long ret = 0;
+
+    v4v_dprintk_in();
+    if ( nent > V4V_SENDV_BATCH_MAX )
+    {
+        ret = -E2BIG;
+        goto out;
+    }
+
+    rcu_read_lock(&v4v_rcu_lock);
+    if ( !rcu_dereference(src_d->v4v) )
+    {
+        rcu_read_unlock(&v4v_rcu_lock);
+        v4v_dprintk("!src_d->v4v, EINVAL\n");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    for ( i = 0; i < nent; ++i, guest_handle_add_offset(ent_hnd, 1) )
+    {
+        XEN_GUEST_HANDLE(v4v_iov_t) ent_iovs = iovs;
+
+        if ( copy_from_guest(&ent, ent_hnd, 1) )
+        {
+            ret = -EFAULT;
+            break;
+        }
+
+        if ( !dst_d || (dst_d->domain_id != ent.addr.dst.domain) )
+        {
+            if ( dst_d )
+                put_domain(dst_d);
+            dst_d = get_domain_by_id(ent.addr.dst.domain);
+        }
+
+        signal = 0;
+        if ( !dst_d )
+            ent.status = -ECONNREFUSED;
+        else
+        {
+            guest_handle_add_offset(ent_iovs, ent.iov_start);
+            ent.status = v4v_sendv_dst(src_d, dst_d, &ent.addr.src,
+                                       &ent.addr.dst, ent.message_type,
+                                       ent_iovs, ent.niov, &signal);
+        }
 
-int
-v4vtables_add(struct domain *src_d,
-              XEN_GUEST_HANDLE(v4vtables_rule_t) rule,
-              int32_t position)
-{
-    struct v4vtables_rule_node* new = NULL;
-    struct list_head* tmp;
+        if ( ent.status >= 0 )
+            ret++;
 
-    ASSERT(rw_is_write_locked(&v4vtables_rules_lock));
+        if ( signal )
+        {
+            for ( j = 0; j < nsignal; ++j )
+                if ( signal_d[j] == dst_d )
+                    break;
+            if ( (j == nsignal) && get_domain(dst_d) )
+                signal_d[nsignal++] = dst_d;
+        }
 
-    /* First rule is n.1 */
-    position--;
+        if ( copy_field_to_guest(ent_hnd, &ent, status) )
+        {
+            ret = -EFAULT;
+            break;
+        }
+    }
 
-    new = xmalloc(struct v4vtables_rule_node);
-    if ( new == NULL )
-        return -ENOMEM;
+    if ( dst_d )
+        put_domain(dst_d);
 
-    if ( copy_from_guest(&new->rule, rule, 1) )
+    for ( j = 0; j < nsignal; ++j )
     {
-        xfree(new);
-        return -EFAULT;
+        v4v_signal_domain(signal_d[j]);
+        /* measured from the last message of the batch */
+        if ( unlikely(opt_v4v_stats) )
+            v4v_stats_record(V4V_HIST_INSERT_SIGNAL,
+                             this_cpu(v4v_insert_time));
+        put_domain(signal_d[j]);
     }
 
-#ifdef V4V_DEBUG
-    printk(KERN_ERR "VIPTables: ");
-    v4vtables_print_rule(new);
-#endif /* V4V_DEBUG */
+    rcu_read_unlock(&v4v_rcu_lock);
+out:
+    v4v_dprintk_out();
+    return ret;
+}
 
-    tmp = &v4vtables_rules;
-    while ( position != 0 && tmp->next != &v4vtables_rules)
+/* Done with the destinations in dst_d, signal it if they need it */
+static void
+v4v_multicast_put(struct domain *dst_d, bool_t signal)
+{
+    if ( signal )
     {
-        tmp = tmp->next;
-        position--;
+        v4v_signal_domain(dst_d);
+        if ( unlikely(opt_v4v_stats) )
+            v4v_stats_record(V4V_HIST_INSERT_SIGNAL,
+                             this_cpu(v4v_insert_time));
     }
-    list_add(&new->list, tmp);
-
-    return 0;
+    put_domain(dst_d);
 }
 
-int
-v4vtables_del(struct domain *src_d,
-              XEN_GUEST_HANDLE(v4vtables_rule_t) rule_hnd,
-              int32_t position)
+/*
+ * Hypercall to send one message to each destination of the v4v_multicast
+ * at mc_hnd. A small message is read from the guest once into a bounce
+ * buffer. Consecutive destinations in the same domain share its lookup
+ * and it is signalled once for them.
+ */
+static long
+v4v_sendv_multicast(struct domain *src_d,
+                    XEN_GUEST_HANDLE(v4v_multicast_t) mc_hnd,
+                    XEN_GUEST_HANDLE(v4v_iov_t) iovs, uint32_t niov,
+                    uint32_t proto)
 {
-    struct list_head *tmp = NULL;
-    struct list_head *to_delete = NULL;
-    struct list_head *next = NULL;
-    struct v4vtables_rule_node *node;
+    XEN_GUEST_HANDLE(v4v_addr_t) dst_hnd;
+    XEN_GUEST_HANDLE(uint8_t) status_hnd;
+    struct domain *dst_d = NULL;
+    v4v_multicast_t mc;
+    v4v_addr_t dst;
+    v4v_iov_t *iov;
+    uint8_t *buf = NULL;
+    uint8_t status = 0;
+    bool_t prio = !!(niov & V4V_SENDV_F_PRIORITY);
+    bool_t signal, dst_signal = 0;
+    uint32_t i, off;
+    long len, rc, ret = 0;
 
-    ASSERT(rw_is_write_locked(&v4vtables_rules_lock));
+    v4v_dprintk_in();
+    if ( copy_from_guest(&mc, mc_hnd, 1) )
+    {
+        ret = -EFAULT;
+        goto out;
+    }
 
-    //v4v_dprintk("v4vtables_del position:%d\n", position);
+    if ( mc.ndst > V4V_MULTICAST_MAX )
+    {
+        ret = -E2BIG;
+        goto out;
+    }
 
-    if ( position != -1 )
+    dst_hnd.p = (v4v_addr_t *)(unsigned long)mc.dst; //FIXME
+    status_hnd.p = (uint8_t *)(unsigned long)mc.status; //FIXME
+    if ( !guest_handle_okay(status_hnd, (mc.ndst + 7) / 8) )
     {
-        /* We want to delete the rule number <position> */
-        list_for_each(tmp, &v4vtables_rules)
-        {
-            to_delete = tmp;
-            if (position == 0)
-                break;
-            position--;
-        }
-        /* Can't find the position */
-        if (position != 0)
-            to_delete = NULL;
+        ret = -EFAULT;
+        goto out;
     }
-    else if ( !guest_handle_is_null(rule_hnd) )
+
+    rcu_read_lock(&v4v_rcu_lock);
+    if ( !rcu_dereference(src_d->v4v) )
     {
-        struct v4vtables_rule r;
+        v4v_dprintk("!src_d->v4v, EINVAL\n");
+        ret = -EINVAL;
+        goto unlock;
+    }
 
-        if ( copy_from_guest(&r, rule_hnd, 1) )
-            return -EFAULT;
+    len = v4v_iov_snapshot(iovs, niov & ~V4V_SENDV_F_MASK, &iov);
+    if ( len < 0 )
+    {
+        ret = len;
+        goto unlock;
+    }
 
-        list_for_each(tmp, &v4vtables_rules)
+    if ( len <= V4V_MULTICAST_BOUNCE_MAX )
+    {
+        buf = xmalloc_bytes(len ? len : 1);
+        if ( !buf )
         {
-            node = list_entry(tmp, struct v4vtables_rule_node, list);
+            ret = -ENOMEM;
+            goto unlock;
+        }
 
-            if ( (node->rule.src.domain == r.src.domain) &&
-                 (node->rule.src.port   == r.src.port)   &&
-                 (node->rule.dst.domain == r.dst.domain) &&
-                 (node->rule.dst.port   == r.dst.port))
+        for ( i = off = 0; i < (niov & ~V4V_SENDV_F_MASK); i++ )
+        {
+            XEN_GUEST_HANDLE(uint8_t) buf_hnd;
+
+            /* checked by v4v_iov_snapshot() */
+            buf_hnd.p = (uint8_t *)iov[i].iov_base; //FIXME
+            if ( __copy_from_guest(buf + off, buf_hnd, iov[i].iov_len) )
             {
-                to_delete = tmp;
-                break;
+                ret = -EFAULT;
+                goto unlock;
             }
+            off += iov[i].iov_len;
         }
     }
-    else
+
+    for ( i = 0; i < mc.ndst; i++ )
     {
-        /* We want to flush the rules! */
-        printk(KERN_ERR "VIPTables: flushing rules\n");
-        list_for_each_safe(tmp, next, &v4vtables_rules)
+        if ( copy_from_guest_offset(&dst, dst_hnd, i, 1) )
         {
-            node = list_entry(tmp, struct v4vtables_rule_node, list);
-            list_del(tmp);
-            xfree(node);
+            ret = -EFAULT;
+            break;
         }
-    }
 
-    if ( to_delete )
-    {
-        node = list_entry(to_delete, struct v4vtables_rule_node, list);
-#ifdef V4V_DEBUG
-        printk(KERN_ERR "VIPTables: deleting rule: ");
-        v4vtables_print_rule(node);
-#endif /* V4V_DEBUG */
-        list_del(to_delete);
-        xfree(node);
+        if ( !dst_d || (dst_d->domain_id != dst.domain) )
+        {
+            if ( dst_d )
+                v4v_multicast_put(dst_d, dst_signal);
+            dst_d = get_domain_by_id(dst.domain);
+            dst_signal = 0;
+        }
+
+        signal = 0;
+        if ( !dst_d )
+            rc = -ECONNREFUSED;
+        else if ( buf )
+            rc = v4v_sendv_buf_dst(src_d, dst_d, &mc.src, &dst, proto, prio,
+                                   buf, len, &signal);
+        else
+            rc = v4v_sendv_dst(src_d, dst_d, &mc.src, &dst, proto, iovs,
+                               niov, &signal);
+        dst_signal |= signal;
+
+        if ( rc >= 0 )
+        {
+            status |= 1U << (i & 7);
+            ret++;
+        }
+
+        if ( ((i & 7) == 7) || (i == (mc.ndst - 1)) )
+        {
+            if ( __copy_to_guest_offset(status_hnd, i / 8, &status, 1) )
+            {
+                ret = -EFAULT;
+                break;
+            }
+            status = 0;
+        }
     }
 
-    return 0;
+    if ( dst_d )
+        v4v_multicast_put(dst_d, dst_signal);
+
+unlock:
+    rcu_read_unlock(&v4v_rcu_lock);
+    xfree(buf);
+out:
+    v4v_dprintk_out();
+    return ret;
 }
 
-static size_t
-v4vtables_list(struct domain *src_d,
-               XEN_GUEST_HANDLE(v4vtables_list_t) list_hnd)
+/* Sum the latency histograms of all CPUs into stats */
+static void
+v4v_stats_sum(v4v_stats_t *stats)
 {
-    struct list_head *ptr;
-    struct v4vtables_rule_node *node;
-    struct v4vtables_list rules_list;
-    uint32_t nbrules;
-    XEN_GUEST_HANDLE(v4vtables_rule_t) guest_rules;
-
-    ASSERT(rw_is_locked(&v4vtables_rules_lock));
-
-    memset(&rules_list, 0, sizeof (rules_list));
-    if ( copy_from_guest(&rules_list, list_hnd, 1) )
-        return -EFAULT;
+    unsigned int cpu, i;
 
-    ptr = v4vtables_rules.next;
-    while ( rules_list.start_rule != 0 && ptr->next != &v4vtables_rules )
+    for_each_online_cpu ( cpu )
     {
-        ptr = ptr->next;
-        rules_list.start_rule--;
+        uint64_t (*hist)[V4V_STATS_NR_BUCKETS] = per_cpu(v4v_hist, cpu);
+
+        for ( i = 0; i < V4V_STATS_NR_BUCKETS; i++ )
+        {
+            stats->send_to_insert[i] += hist[V4V_HIST_SEND_INSERT][i];
+            stats->insert_to_signal[i] += hist[V4V_HIST_INSERT_SIGNAL][i];
+            stats->eagain_to_notify[i] += hist[V4V_HIST_EAGAIN_NOTIFY][i];
+        }
     }
+}
 
-    if ( rules_list.nb_rules == 0 )
-        return -EINVAL;
+static long
+v4v_stats(struct domain *d, XEN_GUEST_HANDLE(v4v_stats_t) stats_hnd,
+          XEN_GUEST_HANDLE(v4v_ring_id_t) ring_id_hnd)
+{
+    v4v_stats_t stats;
+    v4v_ring_id_t id;
+    struct v4v_ring_info *ring_info;
+    long ret = 0;
 
-    guest_rules = guest_handle_for_field(list_hnd, v4vtables_rule_t, rules[0]);
+    v4v_dprintk_in();
+    memset(&stats, 0, sizeof (stats));
 
-    nbrules = 0;
-    while ( nbrules < rules_list.nb_rules && ptr != &v4vtables_rules )
+    if ( opt_v4v_stats )
     {
-        node = list_entry(ptr, struct v4vtables_rule_node, list);
+        stats.flags |= V4V_STATS_F_ENABLED;
+        v4v_stats_sum(&stats);
+    }
 
-        if ( copy_to_guest(guest_rules, &node->rule, 1) )
-            break;
+    if ( !guest_handle_is_null(ring_id_hnd) )
+    {
+        if ( copy_from_guest(&id, ring_id_hnd, 1) )
+        {
+            ret = -EFAULT;
+            goto out;
+        }
+        id.addr.domain = d->domain_id;
 
-        guest_handle_add_offset(guest_rules, 1);
+        rcu_read_lock(&v4v_rcu_lock);
+        ring_info = v4v_ring_find_info(d, &id);
+        if ( ring_info )
+        {
+            spin_lock(&ring_info->lock);
+            stats.ring = ring_info->stats;
+            spin_unlock(&ring_info->lock);
+            stats.flags |= V4V_STATS_F_RING;
+        }
+        rcu_read_unlock(&v4v_rcu_lock);
 
-        nbrules++;
-        ptr = ptr->next;
+        if ( !ring_info )
+        {
+            ret = -ENOENT;
+            goto out;
+        }
     }
 
-    rules_list.nb_rules = nbrules;
-    if ( copy_field_to_guest(list_hnd, &rules_list, nb_rules) )
-        return -EFAULT;
+    if ( copy_to_guest(stats_hnd, &stats, 1) )
+        ret = -EFAULT;
 
-    return 0;
+out:
+    v4v_dprintk_out();
+    return ret;
 }
 
-static size_t
-v4vtables_check(v4v_addr_t * src, v4v_addr_t * dst)
+static void
+v4v_info(struct domain *d, v4v_info_t *info)
 {
-    struct list_head *ptr;
-    struct v4vtables_rule_node *node;
-    size_t ret = 0; /* Defaulting to ACCEPT */
+    v4v_dprintk_in();
+    read_lock(&d->v4v->lock);
+    info->ring_magic = V4V_RING_MAGIC;
+    info->data_magic = V4V_RING_DATA_MAGIC;
+    info->evtchn = d->v4v->evtchn_port;
+    info->node = (domain_to_node(d) == NUMA_NO_NODE) ? V4V_NODE_NONE
+                                                      : domain_to_node(d);
+    info->pad = 0;
+    read_unlock(&d->v4v->lock);
+    v4v_dprintk_out();
+}
 
-    read_lock(&v4vtables_rules_lock);
+/*
+ * XEN_SYSCTL_v4v_domstats: caller holds a reference on d. The tx
+ * counters are read without domain_lock(d), a sysctl can live with a
+ * torn read.
+ */
+int
+v4v_domstats(struct domain *d, struct xen_sysctl_v4v_domstats *st)
+{
+    struct v4v_domain *v4v;
+    struct v4v_ring_info *ring_info;
+    struct v4v_pending_ent *ent;
+    struct hlist_node *node, *pnode;
+    uint32_t rx_ptr, used;
+    unsigned int i;
+    int ret = 0;
 
-    list_for_each(ptr, &v4vtables_rules)
+    v4v_dprintk_in();
+    rcu_read_lock(&v4v_rcu_lock);
+    v4v = rcu_dereference(d->v4v);
+    if ( !v4v )
     {
-        node = list_entry(ptr, struct v4vtables_rule_node, list);
+        ret = -ENODEV;
+        goto out;
+    }
 
-        if ( (node->rule.src.domain == V4V_DOMID_ANY ||
-              node->rule.src.domain == src->domain) &&
-             (node->rule.src.port == V4V_PORT_ANY ||
-              node->rule.src.port == src->port) &&
-             (node->rule.dst.domain == V4V_DOMID_ANY ||
-              node->rule.dst.domain == dst->domain) &&
-             (node->rule.dst.port == V4V_PORT_ANY ||
-              node->rule.dst.port == dst->port) )
+    read_lock(&v4v->lock);
+    st->nr_rings = v4v->nring;
+    st->nr_pages = v4v->npage;
+    st->max_rings = v4v->max_rings;
+    st->max_pages = v4v->max_pages;
+    st->nr_pending = 0;
+    st->max_fill = 0;
+    st->ring_bytes = st->ring_used = 0;
+    st->tx_messages = v4v->tx_messages;
+    st->tx_bytes = v4v->tx_bytes;
+    st->tx_eagain = v4v->tx_eagain;
+    st->rx_messages = v4v->rx_removed.messages;
+    st->rx_bytes = v4v->rx_removed.bytes;
+    st->rx_eagain = v4v->rx_removed.eagain;
+
+    v4v_ring_hash_for_each(ring_info, node, v4v->ring_hash, i)
+    {
+        spin_lock(&ring_info->lock);
+        st->rx_messages += ring_info->stats.messages;
+        st->rx_bytes += ring_info->stats.bytes;
+        st->rx_eagain += ring_info->stats.eagain;
+        hlist_for_each_entry(ent, pnode, &ring_info->pending, node)
+            st->nr_pending++;
+
+        st->ring_bytes += ring_info->len;
+        if ( !v4v_ring_is_dead(ring_info) &&
+             !v4v_ringbuf_get_rx_ptr(d, ring_info, &rx_ptr) &&
+             (rx_ptr < ring_info->len) )
         {
-            ret = !node->rule.accept;
-            break;
+            used = ring_info->tx_ptr - rx_ptr;
+            if ( ring_info->tx_ptr < rx_ptr )
+                used += ring_info->len;
+            st->ring_used += used;
+            if ( ((uint64_t)used * 100 / ring_info->len) > st->max_fill )
+                st->max_fill = (uint64_t)used * 100 / ring_info->len;
         }
+        spin_unlock(&ring_info->lock);
     }
+    read_unlock(&v4v->lock);
 
-    read_unlock(&v4vtables_rules_lock);
+out:
+    rcu_read_unlock(&v4v_rcu_lock);
+    v4v_dprintk_out();
     return ret;
 }
 
 /*
- * Hypercall to do the send
+ * Register on behalf of d the ring at its address ring_hnd, whose npage
+ * frames are at pfn_hnd, as if d did it again. ring_hnd is d's address
+ * and not ours, the header is read from the ring pages instead. An
+ * event channel that no longer checks out is dropped, d binds its ports
+ * again once it runs.
  */
-static long
-v4v_sendv(struct domain *src_d, v4v_addr_t * src_addr,
-          v4v_addr_t * dst_addr, uint32_t proto,
-          XEN_GUEST_HANDLE(v4v_iov_t) iovs, size_t niov)
+static int
+v4v_ring_restore(struct domain *d, XEN_GUEST_HANDLE(v4v_ring_t) ring_hnd,
+                 uint32_t npage, XEN_GUEST_HANDLE(v4v_pfn_t) pfn_hnd)
 {
-    struct domain *dst_d;
-    v4v_ring_id_t src_id;
+    struct v4v_ring ring = { 0 };
     struct v4v_ring_info *ring_info;
-    int ret = 0;
+    XEN_GUEST_HANDLE(uint8_t) empty_hnd = { 0 };
+    uint32_t done = 0, align;
+    int ret;
 
     v4v_dprintk_in();
-    if ( !dst_addr )
+    if ( ((unsigned long)ring_hnd.p & (PAGE_SIZE - 1)) || !npage )
     {
-        v4v_dprintk("!dst_addr, EINVAL\n");
         ret = -EINVAL;
         goto out;
     }
 
     read_lock(&v4v_lock);
-    if ( !src_d->v4v )
+    if ( !d->v4v )
     {
-        read_unlock(&v4v_lock);
-        v4v_dprintk("!src_d->v4v, EINVAL\n");
-        ret = -EINVAL;
-        goto out;
+        ret = -ENODEV;
+        goto unlock;
     }
 
-    src_id.addr.port = src_addr->port;
-    src_id.addr.domain = src_d->domain_id;
-    src_id.partner = dst_addr->domain;
+    if ( (ret = v4v_ring_quota_check(d->v4v, npage)) )
+        goto unlock;
 
-    //v4v_dprintk("port:%#lx, domain:%#lx, partner:%#lx\n", (unsigned long)src_id.addr.port, (unsigned long)src_id.addr.domain, (unsigned long)src_id.partner);
-    dst_d = get_domain_by_id(dst_addr->domain);
-    if ( !dst_d )
+    /* no credit yet, the header isn't known */
+    ring_info = v4v_ring_info_alloc(&ring);
+    if ( !ring_info )
     {
-        read_unlock(&v4v_lock);
-        v4v_dprintk("!dst_d, ECONNREFUSED\n");
-        ret = -ECONNREFUSED;
-        goto out;
+        ret = -ENOMEM;
+        goto unlock;
     }
+    ring_info->len = sizeof (ring);
 
-    if ( v4vtables_check(src_addr, dst_addr) != 0 )
+    spin_lock(&ring_info->lock);
+    do
+        ret = v4v_find_ring_mfns(d, ring_info, npage, pfn_hnd, &done);
+    while ( ret == -ERESTART );
+    if ( ret )
     {
-        read_unlock(&v4v_lock);
-        gdprintk(XENLOG_WARNING,
-                 "V4V: VIPTables REJECTED %i:%i -> %i:%i\n",
-                 src_addr->domain, src_addr->port,
-                 dst_addr->domain, dst_addr->port);
-        ret = -ECONNREFUSED;
-        goto out;
+        spin_unlock(&ring_info->lock);
+        xfree(ring_info);
+        goto unlock;
     }
 
-    do
+    if ( !(ret = v4v_memcpy_from_guest_ring(&ring, ring_info, 0,
+                                            sizeof (ring))) &&
+         !(ret = v4v_ring_check(d, &ring, &align)) &&
+         ((npage << PAGE_SHIFT) < ring.len) )
+        ret = -EINVAL;
+    if ( !ret )
+    {
+        if ( ring.evtchn && v4v_check_ring_evtchn(d, ring.evtchn) )
+            ring.evtchn = 0;
+        v4v_ring_info_set(ring_info, &ring, align, ring_hnd);
+        ret = v4v_memcpy_to_guest_ring(ring_info, offsetof(v4v_ring_t, id),
+                                       &ring.id, empty_hnd,
+                                       sizeof (ring.id)) ?:
+              v4v_memcpy_to_guest_ring(ring_info,
+                                       offsetof(v4v_ring_t, tx_ptr),
+                                       &ring.tx_ptr, empty_hnd,
+                                       sizeof (ring.tx_ptr));
+    }
+    v4v_ring_unmap(ring_info);
+    spin_unlock(&ring_info->lock);
+
+    if ( !ret )
+        ret = v4v_ring_info_credit_init(ring_info, &ring);
+
+    write_lock(&d->v4v->lock);
+    if ( !ret && v4v_ring_find_info(d, &ring.id) )
+        ret = -EEXIST;
+    if ( !ret )
+        v4v_ring_hash_insert(d->v4v, ring_info);
+    else
+    {
+        v4v_ring_remove_mfns(d, ring_info);
+        xfree(ring_info->credits);
+        xfree(ring_info);
+    }
+    write_unlock(&d->v4v->lock);
+
+    if ( !ret )
+        TRACE_4D(TRC_V4V_REGISTER, d->domain_id, ring.id.addr.port,
+                 ring.id.partner, npage);
+
+unlock:
+    read_unlock(&v4v_lock);
+out:
+    v4v_dprintk_out();
+    return ret;
+}
+
+/*
+ * XEN_DOMCTL_V4V_RINGS_SAVE, d is paused. The copies under way into a
+ * ring are let finish once it is frozen, so that its pages are
+ * consistent with its header when they are sent.
+ */
+static int
+v4v_rings_save(struct domain *d, struct xen_domctl_v4v_rings *r)
+{
+    struct v4v_domain *v4v = rcu_dereference(d->v4v);
+    struct v4v_ring_info *ring_info;
+    struct v4v_ring_extent *ext;
+    struct hlist_node *node;
+    xen_domctl_v4v_ring_t ent;
+    uint32_t nr_rings = 0, nr_pfns = 0, i, j, k;
+    bool_t copy = !guest_handle_is_null(r->rings);
+    v4v_pfn_t pfn;
+    int ret = 0;
+
+    read_lock(&v4v->lock);
+    v4v_ring_hash_for_each(ring_info, node, v4v->ring_hash, i)
     {
-        if ( !dst_d->v4v )
+        spin_lock(&ring_info->lock);
+        ring_info->frozen = 1;
+        while ( ring_info->resv_head != ring_info->resv_tail )
         {
-            v4v_dprintk("dst_d->v4v, ECONNREFUSED\n");
-            ret = -ECONNREFUSED;
-            break;
+            spin_unlock(&ring_info->lock);
+            cpu_relax();
+            spin_lock(&ring_info->lock);
         }
+        spin_unlock(&ring_info->lock);
 
-        read_lock(&dst_d->v4v->lock);
-        ring_info =
-            v4v_ring_find_info_by_addr(dst_d, dst_addr, src_addr->domain);
+        /* the extents only go with W(L2) */
+        if ( !ring_info->extents )
+            continue;
 
-        if ( !ring_info )
+#ifdef CONFIG_X86
+        for ( k = 0; k < ring_info->nextent; k++ )
         {
-            ret = -ECONNREFUSED;
-            v4v_dprintk(" !ring_info, ECONNREFUSED\n");
+            ext = &ring_info->extents[k];
+            for ( j = 0; j < ext->npage; j++ )
+                paging_mark_dirty(d, mfn_x(ext->mfn) + j);
         }
-        else
-        {
-            long len = v4v_iov_count(iovs, niov);
+#endif
 
-            if ( len < 0 )
+        if ( copy && !ret )
+        {
+            if ( (nr_rings >= r->nr_rings) ||
+                 (ring_info->npage > (r->nr_pfns - nr_pfns)) )
+                ret = -ENOBUFS;
+            else
             {
-                ret = len;
-                break;
+                ent.ring = (unsigned long)ring_info->ring.p;
+                ent.npage = ring_info->npage;
+                ent.pfn = nr_pfns;
+                if ( copy_to_guest_offset(r->rings, nr_rings, &ent, 1) )
+                    ret = -EFAULT;
             }
 
-            spin_lock(&ring_info->lock);
-    	    v4v_aprintk("niov:%#lx, len:%#lx\n", niov, len);
-            ret =
-                v4v_ringbuf_insertv(dst_d, ring_info, &src_id, proto, iovs,
-                        niov, len);
-            if ( ret == -EAGAIN )
+            for ( k = 0; !ret && (k < ring_info->nextent); k++ )
             {
-                //printk(KERN_ERR "%s: v4v_ringbuf_insertv failed, EAGAIN\n", __func__);
-                /* Schedule a wake up on the event channel when space is there */
-                if ( v4v_pending_requeue(ring_info, src_d->domain_id, len) )
+                ext = &ring_info->extents[k];
+                for ( j = 0; !ret && (j < ext->npage); j++ )
                 {
-                    printk(KERN_ERR "%s:v4v_pending_requeue failed, ENOMEM\n", __func__);
-                    ret = -ENOMEM;
+                    pfn = ext->pfn + j;
+                    if ( copy_to_guest_offset(r->pfns,
+                                              nr_pfns + ext->first + j,
+                                              &pfn, 1) )
+                        ret = -EFAULT;
                 }
             }
-            spin_unlock(&ring_info->lock);
-
-            if ( ret >= 0 )
-            {
-		//printk(KERN_INFO ":%d->%d:signal domain\n", src_d->domain_id, dst_d->domain_id);
-                v4v_signal_domain(dst_d);
-            }
-
         }
-        read_unlock(&dst_d->v4v->lock);
 
+        nr_rings++;
+        nr_pfns += ring_info->npage;
     }
-    while ( 0 );
+    read_unlock(&v4v->lock);
 
-    put_domain(dst_d);
-    read_unlock(&v4v_lock);
-out:
-    v4v_dprintk_out();
+    r->nr_rings = nr_rings;
+    r->nr_pfns = nr_pfns;
     return ret;
 }
 
-static void
-v4v_info(struct domain *d, v4v_info_t *info)
+/*
+ * XEN_DOMCTL_V4V_RINGS_THAW: the senders that got -EAGAIN from a frozen
+ * ring are notified as if the receiver made room.
+ */
+static int
+v4v_rings_thaw(struct domain *d)
+{
+    struct v4v_domain *v4v = rcu_dereference(d->v4v);
+    struct v4v_ring_info *ring_info;
+    struct hlist_node *node;
+    bool_t frozen;
+    unsigned int i;
+
+    domain_lock(d);
+    v4v_ring_hash_for_each(ring_info, node, v4v->ring_hash, i)
+    {
+        spin_lock(&ring_info->lock);
+        frozen = ring_info->frozen;
+        ring_info->frozen = 0;
+        spin_unlock(&ring_info->lock);
+
+        if ( frozen )
+            v4v_ring_wake(d, ring_info);
+    }
+    domain_unlock(d);
+
+    return 0;
+}
+
+/* XEN_DOMCTL_V4V_RINGS_RESTORE, from ring r->done on */
+static int
+v4v_rings_restore(struct domain *d, struct xen_domctl_v4v_rings *r)
+{
+    XEN_GUEST_HANDLE(v4v_ring_t) ring_hnd;
+    XEN_GUEST_HANDLE(v4v_pfn_t) pfn_hnd;
+    xen_domctl_v4v_ring_t ent;
+    uint32_t start = r->done;
+    int ret;
+
+    for ( ; r->done < r->nr_rings; r->done++ )
+    {
+        if ( (r->done != start) && hypercall_preempt_check() )
+            return -ERESTART;
+
+        if ( copy_from_guest_offset(&ent, r->rings, r->done, 1) )
+            return -EFAULT;
+
+        if ( (ent.pfn > r->nr_pfns) || (ent.npage > (r->nr_pfns - ent.pfn)) )
+            return -EINVAL;
+
+        ring_hnd.p = (v4v_ring_t *)(unsigned long)ent.ring;
+        pfn_hnd.p = (v4v_pfn_t *)r->pfns.p + ent.pfn;
+        if ( (ret = v4v_ring_restore(d, ring_hnd, ent.npage, pfn_hnd)) )
+            return ret;
+    }
+
+    return 0;
+}
+
+/*
+ * XEN_DOMCTL_v4v_rings: caller holds a reference on d, which isn't
+ * itself. -ERESTART asks for a continuation, r->done is where it goes
+ * on from.
+ */
+int
+v4v_rings_op(struct domain *d, struct xen_domctl_v4v_rings *r)
 {
+    int ret;
+
     v4v_dprintk_in();
-    read_lock(&d->v4v->lock);
-    info->ring_magic = V4V_RING_MAGIC;
-    info->data_magic = V4V_RING_DATA_MAGIC;
-    info->evtchn = d->v4v->evtchn_port;
-    read_unlock(&d->v4v->lock);
+    if ( r->op == XEN_DOMCTL_V4V_RINGS_SAVE )
+        domain_pause(d);
+
+    rcu_read_lock(&v4v_rcu_lock);
+    if ( !rcu_dereference(d->v4v) )
+        ret = -ENODEV;
+    else
+    {
+        switch ( r->op )
+        {
+        case XEN_DOMCTL_V4V_RINGS_SAVE:
+            ret = v4v_rings_save(d, r);
+            break;
+        case XEN_DOMCTL_V4V_RINGS_THAW:
+            ret = v4v_rings_thaw(d);
+            break;
+        case XEN_DOMCTL_V4V_RINGS_RESTORE:
+            ret = v4v_rings_restore(d, r);
+            break;
+        default:
+            ret = -EINVAL;
+            break;
+        }
+    }
+    rcu_read_unlock(&v4v_rcu_lock);
+
+    if ( r->op == XEN_DOMCTL_V4V_RINGS_SAVE )
+        domain_unpause(d);
     v4v_dprintk_out();
+    return ret;
+}
+
+/* XEN_DOMCTL_v4v_set_quota */
+int
+v4v_set_quota(struct domain *d, struct xen_domctl_v4v_set_quota *q)
+{
+    struct v4v_domain *v4v;
+    int ret = 0;
+
+    rcu_read_lock(&v4v_rcu_lock);
+    v4v = rcu_dereference(d->v4v);
+    if ( !v4v )
+        ret = -ENODEV;
+    else
+    {
+        write_lock(&v4v->lock);
+        v4v->max_rings = q->max_rings;
+        v4v->max_pages = q->max_pages;
+        write_unlock(&v4v->lock);
+    }
+    rcu_read_unlock(&v4v_rcu_lock);
+
+    return ret;
 }
 
 /*
@@ -1941,6 +7125,26 @@ do_v4v_op(int cmd, XEN_GUEST_HANDLE(void) arg1,
                 if ( unlikely(!guest_handle_okay(pfn_hnd, npage)) )
                     goto out;
                 rc = v4v_ring_add(d, ring_hnd, npage, pfn_hnd);
+                if ( rc == -ERESTART )
+                    rc = hypercall_create_continuation(__HYPERVISOR_v4v_op,
+                                                       "ihhii", cmd, arg1,
+                                                       arg2, arg3, arg4);
+                break;
+            }
+        case V4VOP_ring_resize:
+            {
+                XEN_GUEST_HANDLE(v4v_ring_t) ring_hnd =
+                    guest_handle_cast(arg1, v4v_ring_t);
+                XEN_GUEST_HANDLE(v4v_pfn_t) pfn_hnd =
+                    guest_handle_cast(arg2, v4v_pfn_t);
+                uint32_t npage = arg3;
+                if ( unlikely(!guest_handle_okay(pfn_hnd, npage)) )
+                    goto out;
+                rc = v4v_ring_resize(d, ring_hnd, npage, pfn_hnd);
+                if ( rc == -ERESTART )
+                    rc = hypercall_create_continuation(__HYPERVISOR_v4v_op,
+                                                       "ihhii", cmd, arg1,
+                                                       arg2, arg3, arg4);
                 break;
             }
         case V4VOP_unregister_ring:
@@ -1965,11 +7169,141 @@ do_v4v_op(int cmd, XEN_GUEST_HANDLE(void) arg1,
                         guest_handle_cast(arg2, v4v_iov_t), niov);
                 break;
             }
+        case V4VOP_sendv_grants:
+            {
+                uint32_t ndesc = arg3;
+                uint32_t message_type = arg4;
+                XEN_GUEST_HANDLE(v4v_send_addr_t) addr_hnd =
+                    guest_handle_cast(arg1, v4v_send_addr_t);
+                v4v_send_addr_t addr;
+
+                if ( copy_from_guest(&addr, addr_hnd, 1) )
+                    goto out;
+
+                rc = v4v_sendv_grants(d, &addr.src, &addr.dst, message_type,
+                        guest_handle_cast(arg2, v4v_grant_desc_t), ndesc);
+                break;
+            }
+        case V4VOP_sendv_multicast:
+            {
+                uint32_t niov = arg3;
+                uint32_t message_type = arg4;
+
+                rc = v4v_sendv_multicast(d,
+                        guest_handle_cast(arg1, v4v_multicast_t),
+                        guest_handle_cast(arg2, v4v_iov_t), niov,
+                        message_type);
+                break;
+            }
+        case V4VOP_connect:
+            rc = v4v_connect(d, guest_handle_cast(arg1, v4v_connect_t));
+            break;
+        case V4VOP_disconnect:
+            rc = v4v_disconnect(d, arg3);
+            break;
+        case V4VOP_sendv_connected:
+            {
+                uint32_t niov = arg3;
+                uint32_t handle = arg4;
+
+                rc = v4v_sendv_connected(d, handle,
+                        guest_handle_cast(arg1, v4v_iov_t), niov);
+                break;
+            }
+        case V4VOP_sendv_batch:
+            {
+                uint32_t nent = arg3;
+                XEN_GUEST_HANDLE(v4v_send_batch_ent_t) ent_hnd =
+                    guest_handle_cast(arg1, v4v_send_batch_ent_t);
+
+                rc = v4v_sendv_batch(d, ent_hnd,
+                        guest_handle_cast(arg2, v4v_iov_t), nent);
+                break;
+            }
+        case V4VOP_recvv:
+            {
+                uint32_t nent = arg3;
+                XEN_GUEST_HANDLE(v4v_ring_t) ring_hnd =
+                    guest_handle_cast(arg1, v4v_ring_t);
+
+                rc = v4v_recvv(d, ring_hnd,
+                        guest_handle_cast(arg2, v4v_recv_ent_t), nent);
+                break;
+            }
+        case V4VOP_splice:
+            {
+                uint32_t nmsg = arg3;
+                uint32_t nbytes = arg4;
+                XEN_GUEST_HANDLE(v4v_send_addr_t) addr_hnd =
+                    guest_handle_cast(arg2, v4v_send_addr_t);
+                v4v_send_addr_t addr;
+
+                if ( copy_from_guest(&addr, addr_hnd, 1) )
+                    goto out;
+
+                rc = v4v_splice(d, guest_handle_cast(arg1, v4v_ring_t),
+                        &addr.src, &addr.dst, nmsg, nbytes);
+                break;
+            }
+        case V4VOP_ring_credit:
+            {
+                domid_t domid = arg3;
+                uint32_t weight = arg4;
+
+                rc = v4v_ring_credit_set(d,
+                        guest_handle_cast(arg1, v4v_ring_t), domid, weight);
+                break;
+            }
+        case V4VOP_register_rings:
+        case V4VOP_unregister_rings:
+            {
+                uint32_t nent = arg3;
+                uint32_t start = arg4;
+
+                rc = v4v_ring_batch(d, cmd == V4VOP_register_rings,
+                        guest_handle_cast(arg1, v4v_ring_batch_ent_t),
+                        nent, &start);
+                if ( rc == -ERESTART )
+                    rc = hypercall_create_continuation(__HYPERVISOR_v4v_op,
+                                                       "ihhii", cmd, arg1,
+                                                       arg2, arg3, start);
+                break;
+            }
+        case V4VOP_ring_sources:
+            {
+                uint32_t nsrc = arg3;
+
+                rc = v4v_ring_sources_set(d,
+                        guest_handle_cast(arg1, v4v_ring_t),
+                        guest_handle_cast(arg2, v4v_addr_t), nsrc);
+                break;
+            }
+        case V4VOP_async_setup:
+            {
+                uint32_t npage = arg3;
+                evtchn_port_t evtchn = arg4;
+
+                rc = v4v_async_setup(d, guest_handle_cast(arg1, v4v_pfn_t),
+                        npage, evtchn);
+                break;
+            }
+        case V4VOP_peer_space_setup:
+            {
+                uint32_t npage = arg3;
+
+                rc = v4v_peer_setup(d, guest_handle_cast(arg1, v4v_pfn_t),
+                        npage);
+                break;
+            }
+        case V4VOP_async_submit:
+            rc = v4v_async_submit(d);
+            break;
         case V4VOP_notify:
             {
                 XEN_GUEST_HANDLE(v4v_ring_data_t) ring_data_hnd =
                     guest_handle_cast(arg1, v4v_ring_data_t);
-                rc = v4v_notify(d, ring_data_hnd);
+                rc = v4v_notify(d, ring_data_hnd,
+                        guest_handle_cast(arg2, v4v_ring_id_t));
                 break;
             }
         case V4VOP_tables_add:
@@ -2021,6 +7355,15 @@ do_v4v_op(int cmd, XEN_GUEST_HANDLE(void) arg1,
                 rc = 0;
                 break;
             }
+        case V4VOP_stats:
+            {
+                XEN_GUEST_HANDLE(v4v_stats_t) stats_hnd =
+                    guest_handle_cast(arg1, v4v_stats_t);
+
+                rc = v4v_stats(d, stats_hnd,
+                        guest_handle_cast(arg2, v4v_ring_id_t));
+                break;
+            }
         default:
             rc = -ENOSYS;
             break;
@@ -2036,34 +7379,91 @@ out:
  * init
  */
 
+static void
+v4v_domain_free_rcu(struct rcu_head *head)
+{
+    struct v4v_domain *v4v = container_of(head, struct v4v_domain, rcu);
+
+    /* a table replaced by a resize still points at us, wait for it */
+    if ( read_atomic(&v4v->resizing) )
+    {
+        call_rcu(&v4v->rcu, v4v_domain_free_rcu);
+        return;
+    }
+
+    xfree(v4v->conns);
+    xfree(v4v->pending_pool);
+    xfree(v4v->ring_hash);
+    xfree(v4v);
+}
+
 void
 v4v_destroy(struct domain *d)
 {
-    int i;
+    struct v4v_ring_info *ring_info, *release = NULL;
+    struct hlist_node *node;
+    unsigned int i;
 
     v4v_dprintk_in();
     BUG_ON(!d->is_dying);
-    write_lock(&v4v_lock);
+
+    v4v_dst_flush(d);
+    v4v_conn_flush(d);
+
+    /* the tasklet must be done with us before we go */
+    if ( d->v4v )
+    {
+        domain_lock(d);
+        v4v_async_teardown(d->v4v);
+        v4v_peer_teardown(d->v4v);
+        domain_unlock(d);
+    }
+
+    /*
+     * Unhooking the rings under R(L1) keeps out everyone who'd look them
+     * up; releasing thousands of rings' pages can wait until we hold no
+     * lock, and W(L1) is only needed to take d->v4v away.
+     */
+    read_lock(&v4v_lock);
 
     v4v_dprintk("d->v=%p\n", d->v4v);
 
     if ( d->v4v )
     {
-        for ( i = 0; i < V4V_HTABLE_SIZE; ++i )
+        write_lock(&d->v4v->lock);
+        v4v_ring_hash_for_each(ring_info, node, d->v4v->ring_hash, i)
         {
-            struct hlist_node *node, *next;
-            struct v4v_ring_info *ring_info;
-
-            hlist_for_each_entry_safe(ring_info, node,
-                    next, &d->v4v->ring_hash[i],
-                    node)
-            {
-                v4v_ring_remove_info(d, ring_info);
-            }
+            v4v_ring_unhook(d, ring_info);
+            ring_info->release_next = release;
+            release = ring_info;
         }
+        v4v_ring_reg_abort(d);
+        write_unlock(&d->v4v->lock);
+    }
+
+    read_unlock(&v4v_lock);
+
+    while ( (ring_info = release) != NULL )
+    {
+        release = ring_info->release_next;
+
+        spin_lock(&ring_info->lock);
+        v4v_ring_release_mfns(ring_info);
+        spin_unlock(&ring_info->lock);
+
+        /* RCU readers may still hold ring_info, they will find it dead */
+        call_rcu(&ring_info->rcu, v4v_ring_free_rcu);
+    }
+
+    write_lock(&v4v_lock);
+
+    if ( d->v4v )
+    {
+        lock_profile_deregister_struct(LOCKPROF_TYPE_PERDOM, d->v4v);
+        call_rcu(&d->v4v->rcu, v4v_domain_free_rcu);
     }
 
-    d->v4v = NULL;
+    rcu_assign_pointer(d->v4v, NULL);
     write_unlock(&v4v_lock);
     v4v_dprintk_out();
 }
@@ -2073,9 +7473,13 @@ v4v_init(struct domain *d)
 {
     struct v4v_domain *v4v;
     evtchn_port_t port;
-    int i;
+    unsigned int i;
     int rc = 0;
 
+    BUILD_BUG_ON(offsetof(v4v_ring_t, tx_ptr) != V4V_RING_CACHELINE);
+    BUILD_BUG_ON(sizeof (v4v_ring_t) != (2 * V4V_RING_CACHELINE));
+    BUILD_BUG_ON(sizeof (v4v_async_queue_t) != V4V_ASYNC_SQ_OFFSET);
+
     v4v_dprintk_in();
     v4v = xmalloc(struct v4v_domain);
     if ( !v4v ) {
@@ -2083,20 +7487,66 @@ v4v_init(struct domain *d)
         goto out;
     }
 
+    v4v->ring_hash = v4v_ring_hash_alloc(v4v, V4V_HTABLE_MIN_ORDER, 0);
+    if ( !v4v->ring_hash ) {
+        xfree(v4v);
+        rc = -ENOMEM;
+        goto out;
+    }
+
+    v4v->pending_pool = xmalloc_array(struct v4v_pending_ent,
+                                      V4V_PENDING_POOL_SIZE);
+    if ( !v4v->pending_pool ) {
+        xfree(v4v->ring_hash);
+        xfree(v4v);
+        rc = -ENOMEM;
+        goto out;
+    }
+
     rc = evtchn_alloc_unbound_domain(d, &port, d->domain_id, 0);
-    if ( rc ) 
+    if ( rc ) {
+        xfree(v4v->pending_pool);
+        xfree(v4v->ring_hash);
+        xfree(v4v);
         goto out;
+    }
 
-    rwlock_init(&v4v->lock);
+    rwlock_init_prof(v4v, lock);
+    lock_profile_register_struct(LOCKPROF_TYPE_PERDOM, v4v, d->domain_id,
+                                 "Domain");
+    spin_lock_init(&v4v->waiters_lock);
+    INIT_LIST_HEAD(&v4v->waiters);
+    spin_lock_init(&v4v->pending_lock);
+    INIT_HLIST_HEAD(&v4v->pending_free);
+    for ( i = 0; i < V4V_PENDING_POOL_SIZE; i++ )
+    {
+        v4v->pending_pool[i].pooled = 1;
+        hlist_add_head(&v4v->pending_pool[i].node, &v4v->pending_free);
+    }
+    spin_lock_init(&v4v->vcache_lock);
+    memset(v4v->vcache, 0, sizeof (v4v->vcache));
 
     v4v->evtchn_port = port;
-    for ( i = 0; i < V4V_HTABLE_SIZE; ++i )
-        INIT_HLIST_HEAD(&v4v->ring_hash[i]);
+    v4v->nring = 0;
+    v4v->npage = 0;
+    v4v->max_rings = XEN_DOMCTL_V4V_NO_QUOTA;
+    v4v->max_pages = XEN_DOMCTL_V4V_NO_QUOTA;
+    v4v->resizing = 0;
+    v4v->reg_ring = NULL;
+    v4v->async = NULL;
+    v4v->conns = NULL;
+    v4v->peer = NULL;
+    v4v->ring_gen = 0;
+    v4v->tx_messages = v4v->tx_bytes = v4v->tx_eagain = 0;
+    memset(&v4v->rx_removed, 0, sizeof (v4v->rx_removed));
 
     write_lock(&v4v_lock);
-    d->v4v = v4v;
+    rcu_assign_pointer(d->v4v, v4v);
     write_unlock(&v4v_lock);
 
+    /* verdicts cached for an earlier domain with this id are not ours */
+    v4v_policy_changed();
+
 out:
     v4v_dprintk_out();
     return rc;
@@ -2107,57 +7557,294 @@ out:
  * debug
  */
 
+/*
+ * What the '4' and '6' keys print of a ring. It is copied with the locks
+ * held only for as long as that takes, printing to a serial console can
+ * take seconds and would otherwise hold up ring registration and domain
+ * teardown behind it.
+ */
+struct v4v_ring_snap
+{
+    domid_t domid;
+    v4v_ring_id_t id;
+    uint16_t nshard;
+    bool_t mapped, rx_ok;
+    evtchn_port_t evtchn_port;
+    int node;
+    uint32_t npage, nextent, len, tx_ptr, rx_ptr;
+    /* per mille of the ring in use, and of the sends that got -EAGAIN */
+    unsigned int fill, eagain_rate;
+    v4v_ring_stats_t stats;
+};
+
+/* rings kept by the '6' key in each of its lists */
+#define V4V_DUMP_TOP 16
+
+/* R(L2) */
 static void
-dump_domain_ring(struct domain *d, struct v4v_ring_info *ring_info)
+dump_ring_snap(struct domain *d, struct v4v_ring_info *ring_info,
+               struct v4v_ring_snap *snap)
 {
-    uint32_t rx_ptr;
-    int page;
+    uint64_t tries;
+    uint32_t used;
+
+    snap->domid = d->domain_id;
+    snap->id = ring_info->id;
+    snap->nshard = ring_info->nshard;
+    snap->evtchn_port = ring_info->evtchn_port;
 
-    printk(KERN_ERR "  ring: domid=%d port=0x%08x partner=%d npage=%d\n",
-           (int)d->domain_id, (int)ring_info->id.addr.port,
-           (int)ring_info->id.partner, (int)ring_info->npage);
+    spin_lock(&ring_info->lock);
+
+    snap->npage = ring_info->npage;
+    snap->nextent = ring_info->nextent;
+    snap->len = ring_info->len;
+    snap->tx_ptr = ring_info->tx_ptr;
+    snap->mapped = !!ring_info->ring_mapping;
+    snap->node = (ring_info->numa_node == NUMA_NO_NODE) ? -1
+                                                        : ring_info->numa_node;
+    snap->stats = ring_info->stats;
+    snap->rx_ok = !v4v_ringbuf_get_rx_ptr(d, ring_info, &snap->rx_ptr);
+
+    spin_unlock(&ring_info->lock);
 
-    if ( v4v_ringbuf_get_rx_ptr(d, ring_info, &rx_ptr) )
+    snap->fill = 0;
+    if ( snap->rx_ok && snap->len && (snap->rx_ptr < snap->len) &&
+         (snap->tx_ptr < snap->len) )
     {
-        printk(KERN_ERR "   Failed to read rx_ptr\n");
-        return;
+        used = (snap->tx_ptr >= snap->rx_ptr) ?
+               snap->tx_ptr - snap->rx_ptr :
+               snap->len - (snap->rx_ptr - snap->tx_ptr);
+        snap->fill = ((uint64_t)used * 1000) / snap->len;
     }
 
+    tries = snap->stats.messages + snap->stats.eagain;
+    snap->eagain_rate = tries ? (snap->stats.eagain * 1000) / tries : 0;
+}
 
-    printk(KERN_ERR "   tx_ptr=%d rx_ptr=%d len=%d\n",
-           (int)ring_info->tx_ptr, (int)rx_ptr, (int)ring_info->len);
-    spin_lock(&ring_info->lock);
-    for (page=0; page < ring_info->npage; page++) {
-        uint8_t *ring_data = v4v_ring_map_page(ring_info, page);
-        v4v_hexdump(ring_data, PAGE_SIZE);
-        unmap_domain_page(ring_info->mfn_mapping[page]);
+static void
+dump_ring_print(const struct v4v_ring_snap *snap)
+{
+    printk(KERN_ERR "  ring: domid=%d port=0x%08x partner=%d npage=%d"
+           " shard=%d/%d\n",
+           (int)snap->domid, (int)snap->id.addr.port,
+           (int)snap->id.partner, (int)snap->npage,
+           (int)snap->id.shard, (int)snap->nshard);
+
+    if ( !snap->rx_ok )
+    {
+        printk(KERN_ERR "   Failed to read rx_ptr\n");
+        return;
     }
-    spin_unlock(&ring_info->lock);
+
+    printk(KERN_ERR "   tx_ptr=%d rx_ptr=%d len=%d fill=%u.%u%%\n",
+           (int)snap->tx_ptr, (int)snap->rx_ptr, (int)snap->len,
+           snap->fill / 10, snap->fill % 10);
+    printk(KERN_ERR "   npage=%u extents=%u %s node=%d\n", snap->npage,
+           snap->nextent, snap->mapped ? "mapped" : "per-page", snap->node);
+    if ( snap->evtchn_port )
+        printk(KERN_ERR "   event channel: %u\n", snap->evtchn_port);
+    if ( opt_v4v_stats )
+        printk(KERN_ERR "   messages=%"PRIu64" bytes=%"PRIu64
+               " eagain=%"PRIu64" signals=%"PRIu64" remote=%"PRIu64"\n",
+               snap->stats.messages, snap->stats.bytes,
+               snap->stats.eagain, snap->stats.signals,
+               snap->stats.remote);
 }
 
 static void
 dump_domain(struct domain *d)
 {
-    int i;
+    struct hlist_node *node;
+    struct v4v_ring_info *ring_info;
+    struct v4v_ring_snap *snap = NULL;
+    unsigned int i, n = 0, max = 0, nring = 0, nbucket = 0, max_rings = 0;
+    uint64_t npage = 0, max_pages = 0;
+    int evtchn_port = 0;
 
-    printk(KERN_ERR " domain %d:\n", (int)d->domain_id);
+    /* size the buffer first, we won't allocate with the locks held */
+    read_lock(&v4v_lock);
+    if ( d->v4v )
+    {
+        read_lock(&d->v4v->lock);
+        max = d->v4v->nring;
+        read_unlock(&d->v4v->lock);
+    }
+    read_unlock(&v4v_lock);
 
-    read_lock(&d->v4v->lock);
+    if ( max )
+        snap = xmalloc_array(struct v4v_ring_snap, max);
 
-    for ( i = 0; i < V4V_HTABLE_SIZE; ++i )
+    read_lock(&v4v_lock);
+    if ( !d->v4v )
     {
-        struct hlist_node *node;
-        struct v4v_ring_info *ring_info;
-
-        hlist_for_each_entry(ring_info, node, &d->v4v->ring_hash[i], node)
-            dump_domain_ring(d, ring_info);
+        read_unlock(&v4v_lock);
+        xfree(snap);
+        return;
     }
 
-    printk(KERN_ERR "  event channel: %d\n",  d->v4v->evtchn_port);
+    read_lock(&d->v4v->lock);
+
+    nring = d->v4v->nring;
+    nbucket = 1u << d->v4v->ring_hash->order;
+    npage = d->v4v->npage;
+    max_rings = d->v4v->max_rings;
+    max_pages = d->v4v->max_pages;
+    evtchn_port = d->v4v->evtchn_port;
+    if ( snap )
+        v4v_ring_hash_for_each(ring_info, node, d->v4v->ring_hash, i)
+        {
+            if ( n == max )
+                goto copied;
+            dump_ring_snap(d, ring_info, &snap[n++]);
+        }
+copied:
     read_unlock(&d->v4v->lock);
+    read_unlock(&v4v_lock);
+
+    printk(KERN_ERR " domain %d:\n", (int)d->domain_id);
+    printk(KERN_ERR "  %u rings, %u hash buckets\n", nring, nbucket);
+    printk(KERN_ERR "  %"PRIu64" pages pinned, quota %u rings %"PRIu64" pages\n",
+           npage, max_rings, max_pages);
+    for ( i = 0; i < n; i++ )
+        dump_ring_print(&snap[i]);
+    if ( n < nring )
+        printk(KERN_ERR "  (%u rings not shown%s)\n", nring - n,
+               snap ? "" : ", out of memory");
+
+    printk(KERN_ERR "  event channel: %d\n",  evtchn_port);
 
     printk(KERN_ERR "\n");
     v4v_signal_domain(d);
+
+    xfree(snap);
+}
+
+/*
+ * Keep snap in top[], the *n highest of by_eagain ? eagain_rate : fill so
+ * far, highest first.
+ */
+static void
+dump_top_insert(struct v4v_ring_snap *top, unsigned int *n,
+                const struct v4v_ring_snap *snap, bool_t by_eagain)
+{
+    unsigned int key = by_eagain ? snap->eagain_rate : snap->fill;
+    unsigned int i;
+
+    if ( !key )
+        return;
+
+    for ( i = *n; i > 0; i-- )
+    {
+        if ( (by_eagain ? top[i - 1].eagain_rate : top[i - 1].fill) >= key )
+            break;
+        if ( i < V4V_DUMP_TOP )
+            top[i] = top[i - 1];
+    }
+    if ( i == V4V_DUMP_TOP )
+        return;
+
+    top[i] = *snap;
+    if ( *n < V4V_DUMP_TOP )
+        (*n)++;
+}
+
+static void
+dump_summary(unsigned char key)
+{
+    struct domain *d;
+    struct hlist_node *node;
+    struct v4v_ring_info *ring_info;
+    struct v4v_ring_snap *full, *busy, snap;
+    unsigned int i, nfull = 0, nbusy = 0, ndom = 0, nring = 0, nhigh = 0;
+    uint64_t npage = 0;
+
+    full = xmalloc_array(struct v4v_ring_snap, 2 * V4V_DUMP_TOP);
+    if ( !full )
+    {
+        printk(KERN_ERR "V4V summary: out of memory\n");
+        return;
+    }
+    busy = full + V4V_DUMP_TOP;
+
+    rcu_read_lock(&domlist_read_lock);
+
+    for_each_domain(d)
+    {
+        read_lock(&v4v_lock);
+        if ( d->v4v )
+        {
+            read_lock(&d->v4v->lock);
+            ndom++;
+            nring += d->v4v->nring;
+            npage += d->v4v->npage;
+            v4v_ring_hash_for_each(ring_info, node, d->v4v->ring_hash, i)
+            {
+                dump_ring_snap(d, ring_info, &snap);
+                if ( snap.fill >= 750 )
+                    nhigh++;
+                dump_top_insert(full, &nfull, &snap, 0);
+                dump_top_insert(busy, &nbusy, &snap, 1);
+            }
+            read_unlock(&d->v4v->lock);
+        }
+        read_unlock(&v4v_lock);
+    }
+
+    rcu_read_unlock(&domlist_read_lock);
+
+    printk(KERN_ERR "\n\nV4V summary: %u domains, %u rings, %"PRIu64
+           " pages pinned, %u rings at least 75%% full\n",
+           ndom, nring, npage, nhigh);
+
+    printk(KERN_ERR " fullest rings:\n");
+    for ( i = 0; i < nfull; i++ )
+        printk(KERN_ERR "  d%d port=0x%08x partner=%d shard=%d  fill=%u.%u%%"
+               " len=%u\n", (int)full[i].domid, (int)full[i].id.addr.port,
+               (int)full[i].id.partner, (int)full[i].id.shard,
+               full[i].fill / 10, full[i].fill % 10, full[i].len);
+
+    printk(KERN_ERR " rings refusing the most sends:\n");
+    for ( i = 0; i < nbusy; i++ )
+        printk(KERN_ERR "  d%d port=0x%08x partner=%d shard=%d  eagain=%u.%u%%"
+               " (%"PRIu64" of %"PRIu64")\n", (int)busy[i].domid,
+               (int)busy[i].id.addr.port, (int)busy[i].id.partner,
+               (int)busy[i].id.shard, busy[i].eagain_rate / 10,
+               busy[i].eagain_rate % 10, busy[i].stats.eagain,
+               busy[i].stats.messages + busy[i].stats.eagain);
+
+    xfree(full);
+}
+
+static struct keyhandler v4v_summary_keyhandler =
+{
+    .diagnostic = 1,
+    .u.fn = dump_summary,
+    .desc = "dump v4v summary, fullest and busiest rings"
+};
+
+static void
+dump_hist(const char *name, uint64_t *hist)
+{
+    unsigned int i;
+
+    printk(KERN_ERR " %s (log2 ns):", name);
+    for ( i = 0; i < V4V_STATS_NR_BUCKETS; i++ )
+        if ( hist[i] )
+            printk(" %u:%"PRIu64, i, hist[i]);
+    printk("\n");
+}
+
+static void
+dump_stats(void)
+{
+    v4v_stats_t stats;
+
+    memset(&stats, 0, sizeof (stats));
+    v4v_stats_sum(&stats);
+
+    dump_hist("send->insert", stats.send_to_insert);
+    dump_hist("insert->signal", stats.insert_to_signal);
+    dump_hist("EAGAIN->notify", stats.eagain_to_notify);
 }
 
 static void
@@ -2166,8 +7853,8 @@ dump_state(unsigned char key)
     struct domain *d;
 
     printk(KERN_ERR "\n\nV4V:\n");
-    read_lock(&v4v_lock);
 
+    /* dump_domain() takes L1 and L2 for each domain, never while printing */
     rcu_read_lock(&domlist_read_lock);
 
     for_each_domain(d)
@@ -2175,7 +7862,8 @@ dump_state(unsigned char key)
 
     rcu_read_unlock(&domlist_read_lock);
 
-    read_unlock(&v4v_lock);
+    if ( opt_v4v_stats )
+        dump_stats();
 }
 
 struct keyhandler v4v_info_keyhandler =
@@ -2185,10 +7873,304 @@ struct keyhandler v4v_info_keyhandler =
     .desc = "dump v4v states and interupt"
 };
 
+/*
+ * Self test of the ring copy paths, from the '5' key or at boot with
+ * v4v_selftest. Messages of various sizes are inserted at positions that
+ * wrap the header or the data around the end of the ring, or straddle
+ * page boundaries, into a ring made of xen pages, first with the ring
+ * mapped persistently then with per-page mappings. Each one is read back
+ * and checked, and the cycles the insertion took are reported per size,
+ * with the cost of each page crossing of the copy.
+ */
+static bool_t __initdata opt_v4v_selftest;
+boolean_param("v4v_selftest", opt_v4v_selftest);
+
+#define V4V_SELFTEST_ORDER      2
+#define V4V_SELFTEST_ROUNDS     256
+/* ring[] doesn't end on a page boundary */
+#define V4V_SELFTEST_SLACK      48
+
+static const uint32_t v4v_selftest_sizes[] = {
+    1, 15, 16, 17, 64, 1000, 1024, PAGE_SIZE - 1, PAGE_SIZE, PAGE_SIZE + 1,
+    2 * PAGE_SIZE + 3
+};
+
+struct v4v_selftest_stats
+{
+    uint64_t flat_cycles, cross_cycles;
+    unsigned int flat, cross, crossings;
+};
+
+static struct v4v_ring_info *
+v4v_selftest_ring(struct page_info *pg, bool_t vmap)
+{
+    struct v4v_ring_info *ring_info = xzalloc(struct v4v_ring_info);
+
+    if ( !ring_info )
+        return NULL;
+
+    ring_info->extents = xmalloc(struct v4v_ring_extent);
+    if ( !ring_info->extents )
+    {
+        xfree(ring_info);
+        return NULL;
+    }
+
+    spin_lock_init(&ring_info->lock);
+    INIT_HLIST_HEAD(&ring_info->pending);
+    ring_info->nshard = 1;
+    ring_info->align = V4V_RING_MSG_ALIGN(0);
+    ring_info->npage = 1U << V4V_SELFTEST_ORDER;
+    ring_info->len = (ring_info->npage << PAGE_SHIFT) - sizeof (v4v_ring_t) -
+                     V4V_SELFTEST_SLACK;
+    ring_info->extents->mfn = _mfn(page_to_mfn(pg));
+    ring_info->extents->first = 0;
+    ring_info->extents->npage = ring_info->npage;
+    ring_info->nextent = 1;
+    ring_info->numa_node = NUMA_NO_NODE;
+
+    if ( vmap )
+        v4v_ring_map_persistent(ring_info);
+    if ( !ring_info->ring_mapping )
+    {
+        ring_info->mfn_mapping = xzalloc_array(uint8_t *, ring_info->npage);
+        if ( !ring_info->mfn_mapping )
+        {
+            xfree(ring_info->extents);
+            xfree(ring_info);
+            return NULL;
+        }
+    }
+
+    return ring_info;
+}
+
+static void
+v4v_selftest_ring_free(struct v4v_ring_info *ring_info)
+{
+    v4v_ring_unmap_persistent(ring_info);
+    xfree(ring_info->mfn_mapping);
+    xfree(ring_info->extents);
+    xfree(ring_info);
+}
+
+/* Page boundaries crossed copying a message of size bytes at pos */
+static unsigned int
+v4v_selftest_crossings(struct v4v_ring_info *ring_info, uint32_t pos,
+                       uint32_t size)
+{
+    uint32_t start = sizeof (v4v_ring_t) + pos;
+    uint32_t n = sizeof (struct v4v_ring_message_header) + size;
+    uint32_t chunk = min(n, ring_info->len - pos);
+    unsigned int crossings;
+
+    crossings = ((start + chunk - 1) >> PAGE_SHIFT) - (start >> PAGE_SHIFT);
+    if ( n > chunk )
+        crossings += ((sizeof (v4v_ring_t) + n - chunk - 1) >> PAGE_SHIFT) -
+                     (sizeof (v4v_ring_t) >> PAGE_SHIFT);
+
+    return crossings;
+}
+
+/*
+ * Insert a message of size bytes from buf at pos of an empty ring, check
+ * what ends up there against it and account for the insertion in st.
+ */
+static int
+v4v_selftest_one(struct v4v_ring_info *ring_info, uint32_t pos,
+                 uint8_t *buf, uint8_t *out, uint32_t size,
+                 struct v4v_selftest_stats *st)
+{
+    XEN_GUEST_HANDLE(uint8_t) empty_hnd = { 0 };
+    struct v4v_ring_message_header mh;
+    v4v_ring_id_t src_id = { { 0 } };
+    v4v_ring_t *ring;
+    unsigned int crossings;
+    uint32_t i, ptr, tx_ptr;
+    cycles_t cycles;
+    bool_t signal;
+    long ret = -EFAULT;
+
+    for ( i = 0; i < size; i++ )
+        buf[i] = (uint8_t)(i * 7 + size + pos);
+    src_id.addr.port = pos;
+    src_id.addr.domain = DOMID_XEN;
+
+    spin_lock(&ring_info->lock);
+
+    ring = (v4v_ring_t *)v4v_ring_map_page(ring_info, 0);
+    if ( !ring )
+        goto out;
+    memset(ring, 0, sizeof (*ring));
+    ring->magic = V4V_RING_MAGIC;
+    ring->len = ring_info->len;
+    ring->rx_ptr = ring->tx_ptr = pos;
+    ring_info->tx_ptr = ring_info->resv_ptr = pos;
+
+    cycles = get_cycles();
+    ret = v4v_ringbuf_insert_buf(NULL, ring_info, &src_id, V4V_MESSAGE_DGRAM,
+                                 0, buf, size, NULL, 0, &signal);
+    cycles = get_cycles() - cycles;
+    if ( ret != size )
+    {
+        ret = (ret < 0) ? ret : -EIO;
+        goto out;
+    }
+
+    ret = -EIO;
+    tx_ptr = pos + v4v_ring_roundup(ring_info, sizeof (mh) + size);
+    if ( tx_ptr >= ring_info->len )
+        tx_ptr -= ring_info->len;
+    if ( ring_info->tx_ptr != tx_ptr )
+        goto out;
+
+    ptr = pos;
+    if ( v4v_ringbuf_copy_out(ring_info, &ptr, &mh, empty_hnd, sizeof (mh)) ||
+         (mh.len != (sizeof (mh) + size)) || mh.flags ||
+         (mh.message_type != V4V_MESSAGE_DGRAM) ||
+         (mh.source.port != pos) || (mh.source.domain != DOMID_XEN) )
+        goto out;
+    if ( v4v_ringbuf_copy_out(ring_info, &ptr, out, empty_hnd, size) ||
+         memcmp(out, buf, size) )
+        goto out;
+
+    ret = 0;
+    crossings = v4v_selftest_crossings(ring_info, pos, size);
+    if ( crossings )
+    {
+        st->cross_cycles += cycles;
+        st->cross++;
+        st->crossings += crossings;
+    }
+    else
+    {
+        st->flat_cycles += cycles;
+        st->flat++;
+    }
+
+out:
+    v4v_ring_unmap(ring_info);
+    spin_unlock(&ring_info->lock);
+    return ret;
+}
+
+static void
+v4v_selftest_report(const char *mode, uint32_t size,
+                    struct v4v_selftest_stats *st)
+{
+    unsigned int n = st->flat + st->cross;
+    uint64_t cycles = st->flat_cycles + st->cross_cycles;
+    uint64_t per_byte = cycles * 100 / ((uint64_t)n * size);
+
+    printk(KERN_INFO "v4v selftest %s: %5u bytes, %u msgs, %"PRIu64
+           " cycles/msg, %"PRIu64".%02u cycles/byte", mode, size, n,
+           cycles / n, per_byte / 100, (unsigned int)(per_byte % 100));
+    if ( st->flat && st->cross )
+    {
+        int64_t extra = st->cross_cycles -
+                        st->flat_cycles / st->flat * st->cross;
+
+        printk(", %"PRId64" cycles/page crossing",
+               extra / (int64_t)st->crossings);
+    }
+    printk("\n");
+}
+
+/* Every size at the wrap and page boundary edges, then all around */
+static int
+v4v_selftest_mode(struct page_info *pg, bool_t vmap, uint8_t *buf,
+                  uint8_t *out)
+{
+    struct v4v_ring_info *ring_info = v4v_selftest_ring(pg, vmap);
+    const char *mode;
+    unsigned int i, j;
+    int ret = 0;
+
+    if ( !ring_info )
+        return -ENOMEM;
+    mode = ring_info->ring_mapping ? "vmap" : "per-page";
+
+    for ( i = 0; !ret && (i < ARRAY_SIZE(v4v_selftest_sizes)); i++ )
+    {
+        uint32_t size = v4v_selftest_sizes[i];
+        uint32_t need = v4v_ring_roundup(ring_info,
+                            sizeof (struct v4v_ring_message_header) + size);
+        uint32_t len = ring_info->len;
+        uint32_t edges[] = {
+            0, 16, len - 16, len - 32, len - need, len - need + 16,
+            PAGE_SIZE - sizeof (v4v_ring_t) - 16,
+            PAGE_SIZE - sizeof (v4v_ring_t),
+        };
+        struct v4v_selftest_stats st = { 0 };
+        uint32_t pos = 0;
+
+        for ( j = 0; !ret && (j < ARRAY_SIZE(edges)); j++ )
+        {
+            pos = edges[j] % len;
+            ret = v4v_selftest_one(ring_info, pos, buf, out, size, &st);
+        }
+        for ( j = 0; !ret && (j < V4V_SELFTEST_ROUNDS); j++ )
+        {
+            pos = (pos + need + 16) % len;
+            ret = v4v_selftest_one(ring_info, pos, buf, out, size, &st);
+        }
+
+        if ( ret )
+            printk(KERN_ERR "v4v selftest %s: %u bytes failed at %#x: %d\n",
+                   mode, size, pos, ret);
+        else
+            v4v_selftest_report(mode, size, &st);
+
+        process_pending_softirqs();
+    }
+
+    v4v_selftest_ring_free(ring_info);
+    return ret;
+}
+
+static void
+v4v_selftest(unsigned char key)
+{
+    uint32_t max = v4v_selftest_sizes[ARRAY_SIZE(v4v_selftest_sizes) - 1];
+    struct page_info *pg;
+    uint8_t *buf, *out;
+    int ret = -ENOMEM;
+
+    pg = alloc_domheap_pages(NULL, V4V_SELFTEST_ORDER, 0);
+    buf = xmalloc_array(uint8_t, max);
+    out = xmalloc_array(uint8_t, max);
+    if ( pg && buf && out )
+    {
+        ret = 0;
+        if ( opt_v4v_ring_vmap )
+            ret = v4v_selftest_mode(pg, 1, buf, out);
+        if ( !ret )
+            ret = v4v_selftest_mode(pg, 0, buf, out);
+    }
+
+    printk(KERN_INFO "v4v selftest: %s (%d)\n", ret ? "FAILED" : "passed",
+           ret);
+
+    xfree(out);
+    xfree(buf);
+    if ( pg )
+        free_domheap_pages(pg, V4V_SELFTEST_ORDER);
+}
+
+static struct keyhandler v4v_selftest_keyhandler =
+{
+    .u.fn = v4v_selftest,
+    .desc = "run the v4v ring copy self test"
+};
+
 static int __init
 setup_dump_rings(void)
 {
     register_keyhandler('4', &v4v_info_keyhandler);
+    register_keyhandler('5', &v4v_selftest_keyhandler);
+    register_keyhandler('6', &v4v_summary_keyhandler);
+    if ( opt_v4v_selftest )
+        v4v_selftest('5');
     return 0;
 }
 
@@ -21,6 +21,8 @@
 
 /* Limit amount of pages used for shared buffer (per domain) */
 #define MAX_OPROF_SHARED_PAGES 32
+/* Limit amount of pages used for system-wide buffers (per pCPU) */
+#define MAX_OPROF_PCPU_PAGES 16
 
 /* Lock protecting the following global state */
 static DEFINE_SPINLOCK(xenoprof_lock);
@@ -41,6 +43,16 @@ static struct domain *xenoprof_primary_profiler;
 static int xenoprof_state = XENOPROF_IDLE;
 static unsigned long backtrace_depth;
 
+/* System-wide buffers, one per pCPU, see XENOPROF_get_pcpu_buffer. */
+static char *pcpu_rawbuf;
+static unsigned int pcpu_npages;
+static unsigned int pcpu_bufsize;
+static unsigned int pcpu_event_size;
+static bool_t pcpu_shared;
+
+#define pcpu_buffer(cpu) \
+    ((struct xenoprof_pcpu_buf *)&pcpu_rawbuf[(cpu) * pcpu_bufsize])
+
 static u64 total_samples;
 static u64 invalid_buffer_samples;
 static u64 corrupted_buffer_samples;
@@ -158,10 +170,10 @@ share_xenoprof_page_with_guest(struct domain *d, unsigned long mfn, int npages)
 }
 
 static void
-unshare_xenoprof_page_with_guest(struct xenoprof *x)
+unshare_xenoprof_page_with_guest(char *rawbuf, int npages)
 {
-    int i, npages = x->npages;
-    unsigned long mfn = virt_to_mfn(x->rawbuf);
+    int i;
+    unsigned long mfn = virt_to_mfn(rawbuf);
 
     for ( i = 0; i < npages; i++ )
     {
@@ -359,7 +371,7 @@ static void reset_passive(struct domain *d)
     if ( x == NULL )
         return;
 
-    unshare_xenoprof_page_with_guest(x);
+    unshare_xenoprof_page_with_guest(x->rawbuf, x->npages);
     x->domain_type = XENOPROF_DOMAIN_IGNORED;
 }
 
@@ -375,10 +387,23 @@ static void reset_active_list(void)
     activated = 0;
 }
 
+static void reset_pcpu_buffers(void)
+{
+    if ( !pcpu_shared )
+        return;
+
+    /* The pages stay with Xen, so a sample still being logged is harmless. */
+    pcpu_shared = 0;
+    smp_wmb();
+    unshare_xenoprof_page_with_guest(pcpu_rawbuf, pcpu_npages);
+}
+
 static void reset_passive_list(void)
 {
     int i;
 
+    reset_pcpu_buffers();
+
     for ( i = 0; i < pdomains; i++ )
     {
         reset_passive(passive_domains[i]);
@@ -464,6 +489,78 @@ static int add_passive_list(XEN_GUEST_HANDLE_PARAM(void) arg)
     return ret;
 }
 
+static int get_pcpu_buffer(XEN_GUEST_HANDLE_PARAM(void) arg)
+{
+    struct xenoprof_get_pcpu_buffer pcpu;
+    struct domain *d = current->domain;
+    struct xenoprof_pcpu_buf *buf;
+    unsigned int cpu, max_samples, max_max_samples, bufsize, npages;
+    int ret;
+
+    if ( copy_from_guest(&pcpu, arg, 1) )
+        return -EFAULT;
+
+    if ( pcpu_shared )
+        return -EBUSY;
+
+    if ( pcpu.max_samples <= 0 )
+        return -EINVAL;
+
+    /*
+     * As for domains, the buffers are sized and allocated the first time,
+     * then kept: there is no telling when the profiler's mappings go away.
+     */
+    if ( pcpu_rawbuf == NULL )
+    {
+        bufsize = sizeof(struct xenoprof_pcpu_buf);
+        max_max_samples = ((MAX_OPROF_PCPU_PAGES * PAGE_SIZE - bufsize) /
+                           sizeof(struct pcpu_event_log)) + 1;
+        max_samples = min_t(unsigned int, pcpu.max_samples, max_max_samples);
+        bufsize += (max_samples - 1) * sizeof(struct pcpu_event_log);
+        npages = (nr_cpu_ids * bufsize - 1) / PAGE_SIZE + 1;
+
+        pcpu_rawbuf = alloc_xenheap_pages(get_order_from_pages(npages), 0);
+        if ( pcpu_rawbuf == NULL )
+            return -ENOMEM;
+
+        pcpu_npages = npages;
+        pcpu_bufsize = bufsize;
+        pcpu_event_size = max_samples;
+    }
+
+    ret = share_xenoprof_page_with_guest(
+        d, virt_to_mfn(pcpu_rawbuf), pcpu_npages);
+    if ( ret < 0 )
+        return ret;
+
+    for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+    {
+        buf = pcpu_buffer(cpu);
+        memset(buf, 0, offsetof(struct xenoprof_pcpu_buf, event_log));
+        buf->event_size = pcpu_event_size;
+        buf->cpu_id = cpu;
+    }
+
+    pcpu.nbuf = nr_cpu_ids;
+    pcpu.bufsize = pcpu_bufsize;
+    if ( !paging_mode_translate(d) )
+        pcpu.buf_gmaddr = __pa(pcpu_rawbuf);
+    else
+        xenoprof_shared_gmfn_with_guest(
+            d, __pa(pcpu_rawbuf), pcpu.buf_gmaddr, pcpu_npages);
+
+    if ( __copy_to_guest(arg, &pcpu, 1) )
+    {
+        unshare_xenoprof_page_with_guest(pcpu_rawbuf, pcpu_npages);
+        return -EFAULT;
+    }
+
+    smp_wmb();
+    pcpu_shared = 1;
+
+    return 0;
+}
+
 
 /* Get space in the buffer */
 static int xenoprof_buf_space(struct domain *d, xenoprof_buf_t * buf, int size)
@@ -514,10 +611,101 @@ static int xenoprof_add_sample(struct domain *d, xenoprof_buf_t *buf,
     return 1;
 }
 
+/* Get space in this pCPU's system-wide buffer */
+static int xenoprof_pcpu_space(struct xenoprof_pcpu_buf *buf)
+{
+    int head = buf->event_head, tail = buf->event_tail;
+
+    return ((tail > head) ? 0 : pcpu_event_size) + tail - head - 1;
+}
+
+/* As xenoprof_add_sample(), for the system-wide buffers. */
+static int xenoprof_add_pcpu_sample(struct vcpu *vcpu,
+                                    uint64_t eip, int mode, int event)
+{
+    struct xenoprof_pcpu_buf *buf = pcpu_buffer(smp_processor_id());
+    struct pcpu_event_log *log;
+    uint32_t head, tail;
+
+    head = buf->event_head;
+    tail = buf->event_tail;
+
+    /* make sure indexes in shared buffer are sane */
+    if ( (head >= pcpu_event_size) || (tail >= pcpu_event_size) )
+    {
+        corrupted_buffer_samples++;
+        return 0;
+    }
+
+    if ( xenoprof_pcpu_space(buf) <= 0 )
+    {
+        buf->lost_samples++;
+        lost_samples++;
+        return 0;
+    }
+
+    log = &buf->event_log[head];
+    log->eip = eip;
+    log->domain_id = vcpu->domain->domain_id;
+    log->vcpu_id = vcpu->vcpu_id;
+    log->mode = mode;
+    log->event = event;
+    log->pad = 0;
+
+    /* The profiler must see the record before the head moves past it. */
+    smp_wmb();
+    if ( ++head >= pcpu_event_size )
+        head = 0;
+    buf->event_head = head;
+
+    return 1;
+}
+
+static void xenoprof_log_pcpu_event(struct vcpu *vcpu,
+                                    const struct cpu_user_regs *regs,
+                                    uint64_t pc, int mode, int event)
+{
+    struct xenoprof_pcpu_buf *buf = pcpu_buffer(smp_processor_id());
+
+    /* Provide backtrace if requested. */
+    if ( backtrace_depth > 0 )
+    {
+        if ( (xenoprof_pcpu_space(buf) < 2) ||
+             !xenoprof_add_pcpu_sample(vcpu, XENOPROF_ESCAPE_CODE, mode,
+                                       XENOPROF_TRACE_BEGIN) )
+        {
+            buf->lost_samples++;
+            lost_samples++;
+            return;
+        }
+    }
+
+    if ( xenoprof_add_pcpu_sample(vcpu, pc, mode, event) )
+    {
+        if ( is_idle_vcpu(vcpu) )
+            idle_samples++;
+        else if ( is_active(vcpu->domain) )
+            active_samples++;
+        else if ( is_passive(vcpu->domain) )
+            passive_samples++;
+        else
+            others_samples++;
+        if ( mode == 0 )
+            buf->user_samples++;
+        else if ( mode == 1 )
+            buf->kernel_samples++;
+        else
+            buf->xen_samples++;
+    }
+
+    if ( backtrace_depth > 0 )
+        xenoprof_backtrace(vcpu, regs, backtrace_depth, mode);
+}
+
 int xenoprof_add_trace(struct vcpu *vcpu, uint64_t pc, int mode)
 {
     struct domain *d = vcpu->domain;
-    xenoprof_buf_t *buf = d->xenoprof->vcpu[vcpu->vcpu_id].buffer;
+    xenoprof_buf_t *buf;
 
     /* Do not accidentally write an escape code due to a broken frame. */
     if ( pc == XENOPROF_ESCAPE_CODE )
@@ -526,6 +714,11 @@ int xenoprof_add_trace(struct vcpu *vcpu, uint64_t pc, int mode)
         return 0;
     }
 
+    if ( pcpu_shared )
+        return xenoprof_add_pcpu_sample(vcpu, pc, mode, 0);
+
+    buf = d->xenoprof->vcpu[vcpu->vcpu_id].buffer;
+
     return xenoprof_add_sample(d, buf, pc, mode, 0);
 }
 
@@ -538,6 +731,13 @@ void xenoprof_log_event(struct vcpu *vcpu, const struct cpu_user_regs *regs,
 
     total_samples++;
 
+    /* System-wide sampling takes everything, wherever it was running. */
+    if ( pcpu_shared )
+    {
+        xenoprof_log_pcpu_event(vcpu, regs, pc, mode, event);
+        return;
+    }
+
     /* Ignore samples of un-monitored domains. */
     if ( !is_profiled(d) )
     {
@@ -746,6 +946,15 @@ ret_t do_xenoprof_op(int op, XEN_GUEST_HANDLE_PARAM(void) arg)
         ret = add_passive_list(arg);
         break;
 
+    case XENOPROF_get_pcpu_buffer:
+        if ( xenoprof_state != XENOPROF_INITIALIZED )
+        {
+            ret = -EPERM;
+            break;
+        }
+        ret = get_pcpu_buffer(arg);
+        break;
+
     case XENOPROF_reserve_counters:
         if ( xenoprof_state != XENOPROF_INITIALIZED )
         {
@@ -846,7 +1055,7 @@ ret_t do_xenoprof_op(int op, XEN_GUEST_HANDLE_PARAM(void) arg)
         if ( (ret = reset_active(current->domain)) != 0 )
             break;
         x = current->domain->xenoprof;
-        unshare_xenoprof_page_with_guest(x);
+        unshare_xenoprof_page_with_guest(x->rawbuf, x->npages);
         release_pmu_ownship(PMU_OWNER_XENOPROF);
         break;
     }
@@ -24,8 +24,12 @@
  */
 
 #include <xen/config.h>
+#include <xen/cpu.h>
+#include <xen/init.h>
 #include <xen/irq.h>
 #include <xen/mm.h>
+#include <xen/percpu.h>
+#include <xen/perfc.h>
 #include <xen/pfn.h>
 #include <asm/time.h>
 
@@ -375,11 +379,53 @@ void xmem_pool_destroy(struct xmem_pool *pool)
     free_xenheap_pages(pool,pool_order);
 }
 
+/* Take a block of (mapped) size off the free lists, pool->lock held */
+static void *pool_alloc_locked(struct xmem_pool *pool, unsigned long size,
+                               int fl, int sl)
+{
+    struct bhdr *b, *b2, *next_b;
+    unsigned long tmp_size;
+
+    /* Searching a free block */
+    if ( !(b = FIND_SUITABLE_BLOCK(pool, &fl, &sl)) )
+        return NULL;
+    EXTRACT_BLOCK_HDR(b, pool, fl, sl);
+
+    /*-- found: */
+    next_b = GET_NEXT_BLOCK(b->ptr.buffer, b->size & BLOCK_SIZE_MASK);
+    /* Should the block be split? */
+    tmp_size = (b->size & BLOCK_SIZE_MASK) - size;
+    if ( tmp_size >= sizeof(struct bhdr) )
+    {
+        tmp_size -= BHDR_OVERHEAD;
+        b2 = GET_NEXT_BLOCK(b->ptr.buffer, size);
+
+        b2->size = tmp_size | FREE_BLOCK | PREV_USED;
+        b2->prev_hdr = b;
+
+        next_b->prev_hdr = b2;
+
+        MAPPING_INSERT(tmp_size, &fl, &sl);
+        INSERT_BLOCK(b2, pool, fl, sl);
+
+        b->size = size | (b->size & PREV_STATE);
+    }
+    else
+    {
+        next_b->size &= (~PREV_FREE);
+        b->size &= (~FREE_BLOCK); /* Now it's used */
+    }
+
+    pool->used_size += (b->size & BLOCK_SIZE_MASK) + BHDR_OVERHEAD;
+
+    return (void *)b->ptr.buffer;
+}
+
 void *xmem_pool_alloc(unsigned long size, struct xmem_pool *pool)
 {
-    struct bhdr *b, *b2, *next_b, *region;
+    struct bhdr *region;
+    void *ptr;
     int fl, sl;
-    unsigned long tmp_size;
 
     if ( pool->init_region == NULL )
     {
@@ -396,8 +442,7 @@ void *xmem_pool_alloc(unsigned long size, struct xmem_pool *pool)
  retry_find:
     MAPPING_SEARCH(&size, &fl, &sl);
 
-    /* Searching a free block */
-    if ( !(b = FIND_SUITABLE_BLOCK(pool, &fl, &sl)) )
+    if ( !(ptr = pool_alloc_locked(pool, size, fl, sl)) )
     {
         /* Not found */
         if ( size > (pool->grow_size - 2 * BHDR_OVERHEAD) )
@@ -413,37 +458,9 @@ void *xmem_pool_alloc(unsigned long size, struct xmem_pool *pool)
         ADD_REGION(region, pool->grow_size, pool);
         goto retry_find;
     }
-    EXTRACT_BLOCK_HDR(b, pool, fl, sl);
-
-    /*-- found: */
-    next_b = GET_NEXT_BLOCK(b->ptr.buffer, b->size & BLOCK_SIZE_MASK);
-    /* Should the block be split? */
-    tmp_size = (b->size & BLOCK_SIZE_MASK) - size;
-    if ( tmp_size >= sizeof(struct bhdr) )
-    {
-        tmp_size -= BHDR_OVERHEAD;
-        b2 = GET_NEXT_BLOCK(b->ptr.buffer, size);
-
-        b2->size = tmp_size | FREE_BLOCK | PREV_USED;
-        b2->prev_hdr = b;
-
-        next_b->prev_hdr = b2;
-
-        MAPPING_INSERT(tmp_size, &fl, &sl);
-        INSERT_BLOCK(b2, pool, fl, sl);
-
-        b->size = size | (b->size & PREV_STATE);
-    }
-    else
-    {
-        next_b->size &= (~PREV_FREE);
-        b->size &= (~FREE_BLOCK); /* Now it's used */
-    }
-
-    pool->used_size += (b->size & BLOCK_SIZE_MASK) + BHDR_OVERHEAD;
 
     spin_unlock(&pool->lock);
-    return (void *)b->ptr.buffer;
+    return ptr;
 
     /* Failed alloc */
  out_locked:
@@ -453,17 +470,14 @@ void *xmem_pool_alloc(unsigned long size, struct xmem_pool *pool)
     return NULL;
 }
 
-void xmem_pool_free(void *ptr, struct xmem_pool *pool)
+/* Return a used block to the free lists, pool->lock held */
+static void pool_free_locked(void *ptr, struct xmem_pool *pool)
 {
     struct bhdr *b, *tmp_b;
     int fl = 0, sl = 0;
 
-    if ( unlikely(ptr == NULL) )
-        return;
-
     b = (struct bhdr *)((char *) ptr - BHDR_OVERHEAD);
 
-    spin_lock(&pool->lock);
     b->size |= FREE_BLOCK;
     pool->used_size -= (b->size & BLOCK_SIZE_MASK) + BHDR_OVERHEAD;
     b->ptr.free_ptr = (struct free_ptr) { NULL, NULL};
@@ -492,14 +506,22 @@ void xmem_pool_free(void *ptr, struct xmem_pool *pool)
         pool->put_mem(b);
         pool->num_regions--;
         pool->used_size -= BHDR_OVERHEAD; /* sentinel block header */
-        goto out;
+        return;
     }
 
     INSERT_BLOCK(b, pool, fl, sl);
 
     tmp_b->size |= PREV_FREE;
     tmp_b->prev_hdr = b;
- out:
+}
+
+void xmem_pool_free(void *ptr, struct xmem_pool *pool)
+{
+    if ( unlikely(ptr == NULL) )
+        return;
+
+    spin_lock(&pool->lock);
+    pool_free_locked(ptr, pool);
     spin_unlock(&pool->lock);
 }
 
@@ -550,6 +572,140 @@ static void *xmalloc_whole_pages(unsigned long size, unsigned long align)
     return res;
 }
 
+/*
+ * Per-CPU magazines of free blocks in front of the pool, for the small
+ * sizes allocated most often: a hit takes no lock, and refilling or
+ * flushing a magazine takes the pool lock once for half of its blocks.
+ * A block is cached by its size, so that it can be freed on any CPU.
+ */
+#define XMALLOC_MAG_CLASSES 5   /* Matches the perfc arrays */
+#define XMALLOC_MAG_SIZE    16
+#define XMALLOC_MAG_BATCH   (XMALLOC_MAG_SIZE / 2)
+
+static const unsigned int xmalloc_mag_size[XMALLOC_MAG_CLASSES] = {
+    32, 64, 128, 256, 512
+};
+
+struct xmalloc_magazines {
+    struct {
+        unsigned int nr;
+        void *ptr[XMALLOC_MAG_SIZE];
+    } class[XMALLOC_MAG_CLASSES];
+};
+
+static DEFINE_PER_CPU(struct xmalloc_magazines, xmalloc_mags);
+
+/* The class serving a request of size, XMALLOC_MAG_CLASSES if none */
+static unsigned int xmalloc_mag_class(unsigned long size)
+{
+    unsigned int class;
+
+    for ( class = 0; class < XMALLOC_MAG_CLASSES; class++ )
+        if ( size <= xmalloc_mag_size[class] )
+            break;
+
+    return class;
+}
+
+static void *xmalloc_mag_alloc(unsigned int class)
+{
+    typeof(this_cpu(xmalloc_mags).class[0]) *mag =
+        &this_cpu(xmalloc_mags).class[class];
+    unsigned long size = xmalloc_mag_size[class];
+    int fl, sl;
+
+    if ( mag->nr )
+    {
+        perfc_incra(xmalloc_mag_hit, class);
+        return mag->ptr[--mag->nr];
+    }
+
+    /* Refill from the free lists, growing the pool is left to the slow path */
+    perfc_incra(xmalloc_mag_refill, class);
+    if ( xenpool->init_region )
+    {
+        spin_lock(&xenpool->lock);
+        MAPPING_SEARCH(&size, &fl, &sl);
+        while ( mag->nr < XMALLOC_MAG_BATCH &&
+                (mag->ptr[mag->nr] = pool_alloc_locked(xenpool, size,
+                                                       fl, sl)) != NULL )
+            mag->nr++;
+        spin_unlock(&xenpool->lock);
+    }
+
+    if ( mag->nr )
+        return mag->ptr[--mag->nr];
+
+    return xmem_pool_alloc(xmalloc_mag_size[class], xenpool);
+}
+
+static void xmalloc_mag_flush(struct xmalloc_magazines *mags,
+                              unsigned int class, unsigned int nr)
+{
+    typeof(mags->class[0]) *mag = &mags->class[class];
+
+    perfc_incra(xmalloc_mag_flush, class);
+    spin_lock(&xenpool->lock);
+    while ( nr-- )
+        pool_free_locked(mag->ptr[--mag->nr], xenpool);
+    spin_unlock(&xenpool->lock);
+}
+
+/* Returns 0 if the block doesn't belong in any magazine */
+static bool_t xmalloc_mag_free(void *p)
+{
+    struct xmalloc_magazines *mags = &this_cpu(xmalloc_mags);
+    struct bhdr *b = (struct bhdr *)((char *)p - BHDR_OVERHEAD);
+    unsigned long size = b->size & BLOCK_SIZE_MASK;
+    unsigned int class = XMALLOC_MAG_CLASSES;
+
+    /* The largest class it can serve, unless it is much larger still */
+    while ( class-- )
+        if ( size >= xmalloc_mag_size[class] )
+            break;
+    if ( class >= XMALLOC_MAG_CLASSES ||
+         size >= 2 * xmalloc_mag_size[class] )
+        return 0;
+
+    if ( mags->class[class].nr == XMALLOC_MAG_SIZE )
+        xmalloc_mag_flush(mags, class, XMALLOC_MAG_BATCH);
+    mags->class[class].ptr[mags->class[class].nr++] = p;
+
+    return 1;
+}
+
+static int cpu_xmalloc_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct xmalloc_magazines *mags = &per_cpu(xmalloc_mags, cpu);
+    unsigned int class;
+
+    switch ( action )
+    {
+    case CPU_DEAD:
+        for ( class = 0; class < XMALLOC_MAG_CLASSES; class++ )
+            if ( mags->class[class].nr )
+                xmalloc_mag_flush(mags, class, mags->class[class].nr);
+        break;
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block cpu_xmalloc_nfb = {
+    .notifier_call = cpu_xmalloc_callback
+};
+
+static int __init xmalloc_presmp_init(void)
+{
+    register_cpu_notifier(&cpu_xmalloc_nfb);
+    return 0;
+}
+presmp_initcall(xmalloc_presmp_init);
+
 static void tlsf_init(void)
 {
     INIT_LIST_HEAD(&pool_list_head);
@@ -572,6 +728,7 @@ static void tlsf_init(void)
 void *_xmalloc(unsigned long size, unsigned long align)
 {
     void *p = NULL;
+    unsigned int class;
     u32 pad;
 
     ASSERT(!in_irq());
@@ -587,7 +744,12 @@ void *_xmalloc(unsigned long size, unsigned long align)
     if ( !xenpool )
         tlsf_init();
 
-    if ( size < PAGE_SIZE )
+    class = (align == MEM_ALIGN) ? xmalloc_mag_class(size)
+                                 : XMALLOC_MAG_CLASSES;
+
+    if ( class < XMALLOC_MAG_CLASSES )
+        p = xmalloc_mag_alloc(class);
+    else if ( size < PAGE_SIZE )
         p = xmem_pool_alloc(size, xenpool);
     if ( p == NULL )
         return xmalloc_whole_pages(size - align + MEM_ALIGN, align);
@@ -649,5 +811,6 @@ void xfree(void *p)
         ASSERT(!(b->size & 1));
     }
 
-    xmem_pool_free(p, xenpool);
+    if ( !xmalloc_mag_free(p) )
+        xmem_pool_free(p, xenpool);
 }
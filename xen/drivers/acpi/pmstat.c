@@ -487,6 +487,20 @@ int do_pm_op(struct xen_sysctl_pm_op *op)
         break;
     }
 
+    case XEN_SYSCTL_pm_op_get_core_parking:
+    {
+        op->u.get_core_parking.policy = core_parking_get_policy();
+        op->u.get_core_parking.idle_nums = get_cur_idle_nums();
+        op->u.get_core_parking.requested = get_requested_idle_nums();
+        break;
+    }
+
+    case XEN_SYSCTL_pm_op_set_core_parking_policy:
+    {
+        ret = core_parking_set_policy(op->u.set_core_parking_policy);
+        break;
+    }
+
     default:
         printk("not defined sub-hypercall @ do_pm_op\n");
         ret = -ENOSYS;
@@ -57,6 +57,10 @@ static struct dbs_tuners {
 
 static DEFINE_PER_CPU(struct timer, dbs_timer);
 
+/* Which wakeups raise the frequency: none, of latency sensitive domains, all */
+enum {WAKEUP_BOOST_NONE, WAKEUP_BOOST_HINTED, WAKEUP_BOOST_ALL};
+static unsigned int __read_mostly wakeup_boost = WAKEUP_BOOST_HINTED;
+
 int write_ondemand_sampling_rate(unsigned int sampling_rate)
 {
     if ( (sampling_rate > MAX_SAMPLING_RATE / MICROSECS(1)) ||
@@ -113,6 +117,15 @@ static void dbs_check_cpu(struct cpu_dbs_info_s *this_dbs_info)
         return;
     }
 
+    /* A wakeup asked for max, keep it for a sampling period at least. */
+    if (this_dbs_info->boost) {
+        this_dbs_info->boost = 0;
+        this_dbs_info->boost_until = NOW() + dbs_tuners_ins.sampling_rate;
+        if (policy->cur != max)
+            __cpufreq_driver_target(policy, max, CPUFREQ_RELATION_H);
+        return;
+    }
+
     cur_ns = NOW();
     total_ns = cur_ns - this_dbs_info->prev_cpu_wall;
     this_dbs_info->prev_cpu_wall = NOW();
@@ -135,6 +148,9 @@ static void dbs_check_cpu(struct cpu_dbs_info_s *this_dbs_info)
             continue;
 
         load = 100 * (total_ns - idle_ns) / total_ns;
+        /* vcpus queued for it: not enough cycles, whatever the idle time */
+        if (sched_runq_waiting(j))
+            load = 100;
 
         freq_avg = cpufreq_driver_getavg(j, GOV_GETAVG);
 
@@ -157,6 +173,9 @@ static void dbs_check_cpu(struct cpu_dbs_info_s *this_dbs_info)
     if (policy->cur == policy->min)
         return;
 
+    if (NOW() < this_dbs_info->boost_until)
+        return;
+
     /*
      * The optimal frequency is the frequency that is the lowest that
      * can support the current CPU usage without triggering the up
@@ -172,6 +191,30 @@ static void dbs_check_cpu(struct cpu_dbs_info_s *this_dbs_info)
     }
 }
 
+/*
+ * Called on vcpu wakeups, possibly in irq context: the frequency is
+ * changed from the policy's timer, made to fire at once.
+ */
+void cpufreq_wakeup_boost(unsigned int cpu, bool_t latency_sensitive)
+{
+    struct cpufreq_policy *policy;
+    struct cpu_dbs_info_s *dbs_info;
+
+    if (wakeup_boost == WAKEUP_BOOST_NONE ||
+        (wakeup_boost == WAKEUP_BOOST_HINTED && !latency_sensitive))
+        return;
+
+    policy = per_cpu(cpu_dbs_info, cpu).cur_policy;
+    if (!policy)
+        return;
+    dbs_info = &per_cpu(cpu_dbs_info, policy->cpu);
+    if (!dbs_info->enable || dbs_info->boost || policy->cur == policy->max)
+        return;
+
+    dbs_info->boost = 1;
+    set_timer(&per_cpu(dbs_timer, policy->cpu), NOW());
+}
+
 static void do_dbs_timer(void *dbs)
 {
     struct cpu_dbs_info_s *dbs_info = (struct cpu_dbs_info_s *)dbs;
@@ -322,6 +365,18 @@ static bool_t __init cpufreq_dbs_handle_option(const char *name, const char *val
         }
         dbs_tuners_ins.up_threshold = tmp;
     }
+    else if ( !strcmp(name, "wakeup_boost") && val )
+    {
+        if ( !strcmp(val, "none") )
+            wakeup_boost = WAKEUP_BOOST_NONE;
+        else if ( !strcmp(val, "hinted") )
+            wakeup_boost = WAKEUP_BOOST_HINTED;
+        else if ( !strcmp(val, "all") )
+            wakeup_boost = WAKEUP_BOOST_ALL;
+        else
+            printk(XENLOG_WARNING "cpufreq/ondemand: "
+                   "unknown wakeup_boost '%s'\n", val);
+    }
     else if ( !strcmp(name, "bias") && val )
     {
         unsigned long tmp = simple_strtoul(val, NULL, 0);
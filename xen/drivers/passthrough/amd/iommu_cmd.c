@@ -380,6 +380,26 @@ void amd_iommu_flush_pages(struct domain *d,
     _amd_iommu_flush_pages(d, (uint64_t) gfn << PAGE_SHIFT, order);
 }
 
+/* Flush page_count pages in one command, of the 4K, 2M or 1G covering them */
+void amd_iommu_iotlb_flush(struct domain *d, unsigned long gfn,
+                           unsigned int page_count)
+{
+    unsigned long last = gfn + page_count - 1;
+    unsigned int order;
+
+    if ( !page_count )
+        return;
+
+    for ( order = 0; order <= 18; order += 9 )
+        if ( (gfn >> order) == (last >> order) )
+        {
+            amd_iommu_flush_pages(d, gfn & ~((1UL << order) - 1), order);
+            return;
+        }
+
+    amd_iommu_flush_all_pages(d);
+}
+
 void amd_iommu_flush_device(struct amd_iommu *iommu, uint16_t bdf)
 {
     ASSERT( spin_is_locked(&iommu->lock) );
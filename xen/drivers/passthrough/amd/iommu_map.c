@@ -680,7 +680,7 @@ int amd_iommu_map_page(struct domain *d, unsigned long gfn, unsigned long mfn,
 
     /* 4K mapping for PV guests never changes, 
      * no need to flush if we trust non-present bits */
-    if ( is_hvm_domain(d) )
+    if ( is_hvm_domain(d) && !this_cpu(iommu_dont_flush_iotlb) )
         amd_iommu_flush_pages(d, gfn, 0);
 
     for ( merge_level = IOMMU_PAGING_MODE_LEVEL_2;
@@ -621,5 +621,7 @@ const struct iommu_ops amd_iommu_ops = {
     .resume = amd_iommu_resume,
     .share_p2m = amd_iommu_share_p2m,
     .crash_shutdown = amd_iommu_suspend,
+    .iotlb_flush = amd_iommu_iotlb_flush,
+    .iotlb_flush_all = amd_iommu_flush_all_pages,
     .dump_p2m_table = amd_dump_p2m_table,
 };
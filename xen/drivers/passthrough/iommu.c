@@ -187,6 +187,12 @@ void iommu_teardown(struct domain *d)
     tasklet_schedule(&iommu_pt_cleanup_tasklet);
 }
 
+/* Free the page tables queued on iommu_pt_cleanup_list */
+void iommu_pt_cleanup(void)
+{
+    tasklet_schedule(&iommu_pt_cleanup_tasklet);
+}
+
 void iommu_domain_destroy(struct domain *d)
 {
     struct hvm_iommu *hd = domain_hvm_iommu(d);
@@ -221,6 +227,87 @@ int iommu_unmap_page(struct domain *d, unsigned long gfn)
     return hd->platform_ops->unmap_page(d, gfn);
 }
 
+/* The superpage sizes tried for a range, largest first */
+static const unsigned int iommu_superpage_orders[] = { 18, 9 };
+
+/*
+ * Map count contiguous pages, flushing the IOTLB once for all of them
+ * rather than per page, unless the caller defers the flush itself.  The
+ * aligned 1G and 2M parts of the range get superpage leaves where the
+ * IOMMU supports them.  On failure the pages mapped so far are unmapped
+ * again.
+ */
+int iommu_map_pages(struct domain *d, unsigned long gfn, unsigned long mfn,
+                    unsigned long count, unsigned int flags)
+{
+    struct hvm_iommu *hd = domain_hvm_iommu(d);
+    bool_t dont_flush = this_cpu(iommu_dont_flush_iotlb);
+    unsigned long i;
+    unsigned int j, order = 0;
+    int rc = 0;
+
+    if ( !iommu_enabled || !hd->platform_ops )
+        return 0;
+
+    this_cpu(iommu_dont_flush_iotlb) = 1;
+    for ( i = 0; i < count; i += 1UL << order )
+    {
+        rc = -EOPNOTSUPP;
+        for ( j = 0; rc == -EOPNOTSUPP && hd->platform_ops->map_superpage &&
+                     j < ARRAY_SIZE(iommu_superpage_orders); j++ )
+        {
+            order = iommu_superpage_orders[j];
+            if ( !(((gfn + i) | (mfn + i)) & ((1UL << order) - 1)) &&
+                 count - i >= (1UL << order) )
+                rc = hd->platform_ops->map_superpage(d, gfn + i, mfn + i,
+                                                     order, flags);
+        }
+        if ( rc == -EOPNOTSUPP )
+        {
+            order = 0;
+            rc = hd->platform_ops->map_page(d, gfn + i, mfn + i, flags);
+        }
+        if ( rc )
+        {
+            while ( i-- > 0 )
+                hd->platform_ops->unmap_page(d, gfn + i);
+            break;
+        }
+    }
+    this_cpu(iommu_dont_flush_iotlb) = dont_flush;
+
+    if ( !dont_flush && count )
+        iommu_iotlb_flush(d, gfn, count);
+
+    return rc;
+}
+
+/* Unmap count contiguous pages, with one IOTLB flush as above */
+int iommu_unmap_pages(struct domain *d, unsigned long gfn, unsigned long count)
+{
+    struct hvm_iommu *hd = domain_hvm_iommu(d);
+    bool_t dont_flush = this_cpu(iommu_dont_flush_iotlb);
+    unsigned long i;
+    int rc = 0, ret;
+
+    if ( !iommu_enabled || !hd->platform_ops )
+        return 0;
+
+    this_cpu(iommu_dont_flush_iotlb) = 1;
+    for ( i = 0; i < count; i++ )
+    {
+        ret = hd->platform_ops->unmap_page(d, gfn + i);
+        if ( !rc )
+            rc = ret;
+    }
+    this_cpu(iommu_dont_flush_iotlb) = dont_flush;
+
+    if ( !dont_flush && count )
+        iommu_iotlb_flush(d, gfn, count);
+
+    return rc;
+}
+
 static void iommu_free_pagetables(unsigned long unused)
 {
     do {
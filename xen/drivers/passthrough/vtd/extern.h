@@ -62,6 +62,9 @@ int dev_invalidate_iotlb(struct iommu *iommu, u16 did,
 
 int qinval_device_iotlb(struct iommu *iommu,
                         u32 max_invs_pend, u16 sid, u16 size, u64 addr);
+int qinval_iotlb_range(struct iommu *iommu, u16 did, u64 addr,
+                       unsigned long count, unsigned int max_am,
+                       int flush_dev_iotlb);
 
 unsigned int get_cache_line_size(void);
 void cacheline_flush(char *);
@@ -53,6 +53,9 @@ bool_t __read_mostly untrusted_msi;
 
 int nr_iommus;
 
+/* The levels all IOMMUs take superpage leaves at, bit 2 for 2M, 3 for 1G */
+static unsigned int __read_mostly vtd_superpage_levels = (1 << 2) | (1 << 3);
+
 static struct tasklet vtd_fault_tasklet;
 
 static int setup_hwdom_device(u8 devfn, struct pci_dev *);
@@ -248,7 +251,53 @@ static u64 bus_to_context_maddr(struct iommu *iommu, u8 bus)
     return maddr;
 }
 
-static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr, int alloc)
+/*
+ * Replace the superpage leaf *pte at level by a table of the next level
+ * mapping the same range, and return the table's address.  The mapping
+ * does not change, so nothing needs flushing until one of its entries
+ * does.
+ */
+static u64 dma_split_superpage(struct domain *domain, struct dma_pte *pte,
+                               int level)
+{
+    struct acpi_drhd_unit *drhd;
+    struct pci_dev *pdev;
+    struct dma_pte *table, entry = *pte;
+    u64 maddr, step = (u64)1 << level_to_offset_bits(level - 1);
+    unsigned int i;
+
+    pdev = pci_get_pdev_by_domain(domain, -1, -1, -1);
+    drhd = acpi_find_matched_drhd_unit(pdev);
+    maddr = alloc_pgtable_maddr(drhd, 1);
+    if ( !maddr )
+        return 0;
+
+    if ( level == 2 )
+        entry.val &= ~DMA_PTE_SP;
+    table = (struct dma_pte *)map_vtd_domain_page(maddr);
+    for ( i = 0; i < PTE_NUM; i++ )
+    {
+        table[i] = entry;
+        entry.val += step;
+    }
+    iommu_flush_cache_page(table, 1);
+    unmap_vtd_domain_page(table);
+
+    dma_clear_pte(*pte);
+    dma_set_pte_addr(*pte, maddr);
+    dma_set_pte_readable(*pte);
+    dma_set_pte_writable(*pte);
+    iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
+
+    return maddr;
+}
+
+/*
+ * Return the address of the table of the given level addr is mapped in,
+ * splitting any superpage above it.
+ */
+static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr,
+                                  int target, int alloc)
 {
     struct acpi_drhd_unit *drhd;
     struct pci_dev *pdev;
@@ -275,12 +324,19 @@ static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr, int alloc)
     }
 
     parent = (struct dma_pte *)map_vtd_domain_page(hd->arch.pgd_maddr);
-    while ( level > 1 )
+    while ( level > target )
     {
         offset = address_level_offset(addr, level);
         pte = &parent[offset];
 
-        if ( dma_pte_addr(*pte) == 0 )
+        if ( dma_pte_superpage(*pte) )
+        {
+            maddr = dma_split_superpage(domain, pte, level);
+            if ( !maddr )
+                break;
+            vaddr = map_vtd_domain_page(maddr);
+        }
+        else if ( dma_pte_addr(*pte) == 0 )
         {
             if ( !alloc )
                 break;
@@ -307,7 +363,7 @@ static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr, int alloc)
             vaddr = map_vtd_domain_page(pte->val);
         }
 
-        if ( level == 2 )
+        if ( level == target + 1 )
         {
             pte_maddr = pte->val & PAGE_MASK_4K;
             unmap_vtd_domain_page(vaddr);
@@ -551,6 +607,37 @@ static int iommu_flush_iotlb_psi(
     return status;
 }
 
+/* Most page selective invalidations queued for a range, or else DSI */
+#define IOTLB_RANGE_MAX_PSI 64
+
+/*
+ * Flush count pages from addr with page selective invalidations, waiting
+ * once for all of them.  Returns non-zero if that is not possible, the
+ * range then needs a domain selective flush.
+ */
+static int iommu_flush_iotlb_range(
+    struct iommu *iommu, u16 did, u64 addr, unsigned long count,
+    int flush_dev_iotlb)
+{
+    unsigned int max_am = cap_max_amask_val(iommu->cap);
+    int status;
+
+    if ( !cap_pgsel_inv(iommu->cap) ||
+         (count >> max_am) > IOTLB_RANGE_MAX_PSI )
+        return -EOPNOTSUPP;
+
+    /* apply platform specific errata workarounds */
+    vtd_ops_preamble_quirk(iommu);
+
+    status = qinval_iotlb_range(iommu, did, addr, count, max_am,
+                                flush_dev_iotlb);
+
+    /* undo platform specific errata workarounds */
+    vtd_ops_postamble_quirk(iommu);
+
+    return status;
+}
+
 static void iommu_flush_all(void)
 {
     struct acpi_drhd_unit *drhd;
@@ -594,6 +681,11 @@ static void __intel_iommu_iotlb_flush(struct domain *d, unsigned long gfn,
 
         if ( page_count > 1 || gfn == -1 )
         {
+            if ( gfn != -1 && dma_old_pte_present &&
+                 !iommu_flush_iotlb_range(iommu, iommu_domid,
+                        (paddr_t)gfn << PAGE_SHIFT_4K, page_count,
+                        flush_dev_iotlb) )
+                continue;
             if ( iommu_flush_iotlb_dsi(iommu, iommu_domid,
                         0, flush_dev_iotlb) )
                 iommu_flush_write_buffer(iommu);
@@ -627,7 +719,7 @@ static void dma_pte_clear_one(struct domain *domain, u64 addr)
 
     spin_lock(&hd->arch.mapping_lock);
     /* get last level pte */
-    pg_maddr = addr_to_dma_page_maddr(domain, addr, 0);
+    pg_maddr = addr_to_dma_page_maddr(domain, addr, 1, 0);
     if ( pg_maddr == 0 )
     {
         spin_unlock(&hd->arch.mapping_lock);
@@ -682,7 +774,7 @@ static void iommu_free_page_table(struct page_info *pg)
         if ( !dma_pte_present(*pte) )
             continue;
 
-        if ( next_level >= 1 )
+        if ( next_level >= 1 && !dma_pte_superpage(*pte) )
             iommu_free_pagetable(dma_pte_addr(*pte), next_level);
 
         dma_clear_pte(*pte);
@@ -1338,7 +1430,7 @@ int domain_context_mapping_one(
         /* Ensure we have pagetables allocated down to leaf PTE. */
         if ( hd->arch.pgd_maddr == 0 )
         {
-            addr_to_dma_page_maddr(domain, 0, 1);
+            addr_to_dma_page_maddr(domain, 0, 1, 1);
             if ( hd->arch.pgd_maddr == 0 )
             {
             nomem:
@@ -1730,7 +1822,7 @@ static int intel_iommu_map_page(
 
     spin_lock(&hd->arch.mapping_lock);
 
-    pg_maddr = addr_to_dma_page_maddr(d, (paddr_t)gfn << PAGE_SHIFT_4K, 1);
+    pg_maddr = addr_to_dma_page_maddr(d, (paddr_t)gfn << PAGE_SHIFT_4K, 1, 1);
     if ( pg_maddr == 0 )
     {
         spin_unlock(&hd->arch.mapping_lock);
@@ -1766,6 +1858,76 @@ static int intel_iommu_map_page(
     return 0;
 }
 
+/*
+ * Map 2^order pages with one superpage leaf, if all the IOMMUs can.  The
+ * table the leaf replaces, if any, is freed once the IOTLB no longer
+ * refers to it.
+ */
+static int intel_iommu_map_superpage(
+    struct domain *d, unsigned long gfn, unsigned long mfn,
+    unsigned int order, unsigned int flags)
+{
+    struct hvm_iommu *hd = domain_hvm_iommu(d);
+    struct dma_pte *page = NULL, *pte = NULL, old, new = { 0 };
+    int level = order / LEVEL_STRIDE + 1;
+    u64 pg_maddr;
+
+    if ( (order % LEVEL_STRIDE) || !(vtd_superpage_levels & (1 << level)) )
+        return -EOPNOTSUPP;
+
+    /* Do nothing if VT-d shares EPT page table */
+    if ( iommu_use_hap_pt(d) )
+        return 0;
+
+    /* do nothing if dom0 and iommu supports pass thru */
+    if ( iommu_passthrough && is_hardware_domain(d) )
+        return 0;
+
+    spin_lock(&hd->arch.mapping_lock);
+
+    pg_maddr = addr_to_dma_page_maddr(d, (paddr_t)gfn << PAGE_SHIFT_4K,
+                                      level, 1);
+    if ( pg_maddr == 0 )
+    {
+        spin_unlock(&hd->arch.mapping_lock);
+        return -ENOMEM;
+    }
+    page = (struct dma_pte *)map_vtd_domain_page(pg_maddr);
+    pte = page + address_level_offset((paddr_t)gfn << PAGE_SHIFT_4K, level);
+    old = *pte;
+    dma_set_pte_addr(new, (paddr_t)mfn << PAGE_SHIFT_4K);
+    dma_set_pte_prot(new,
+                     ((flags & IOMMUF_readable) ? DMA_PTE_READ  : 0) |
+                     ((flags & IOMMUF_writable) ? DMA_PTE_WRITE : 0));
+    dma_set_pte_superpage(new);
+
+    if ( iommu_snoop )
+        dma_set_pte_snp(new);
+
+    if ( old.val == new.val )
+    {
+        spin_unlock(&hd->arch.mapping_lock);
+        unmap_vtd_domain_page(page);
+        return 0;
+    }
+    *pte = new;
+
+    iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
+    spin_unlock(&hd->arch.mapping_lock);
+    unmap_vtd_domain_page(page);
+
+    if ( dma_pte_present(old) && !dma_pte_superpage(old) )
+    {
+        __intel_iommu_iotlb_flush(d, gfn, 1, 1U << order);
+        iommu_free_pagetable(dma_pte_addr(old), level - 1);
+        iommu_pt_cleanup();
+    }
+    else if ( !this_cpu(iommu_dont_flush_iotlb) )
+        __intel_iommu_iotlb_flush(d, gfn, dma_pte_present(old), 1U << order);
+
+    return 0;
+}
+
 static int intel_iommu_unmap_page(struct domain *d, unsigned long gfn)
 {
     /* Do nothing if dom0 and iommu supports pass thru. */
@@ -2214,6 +2376,11 @@ int __init intel_vtd_setup(void)
         if ( !vtd_ept_page_compatible(iommu) )
             iommu_hap_pt_share = 0;
 
+        if ( !cap_sps_2mb(iommu->cap) )
+            vtd_superpage_levels &= ~(1 << 2);
+        if ( !cap_sps_1gb(iommu->cap) )
+            vtd_superpage_levels &= ~(1 << 3);
+
         ret = iommu_set_interrupt(drhd);
         if ( ret )
         {
@@ -2436,14 +2603,15 @@ static void vtd_dump_p2m_table_level(paddr_t pt_maddr, int level, paddr_t gpa,
             continue;
 
         address = gpa + offset_level_address(i, level);
-        if ( next_level >= 1 ) 
+        if ( next_level >= 1 && !dma_pte_superpage(*pte) )
             vtd_dump_p2m_table_level(dma_pte_addr(*pte), next_level, 
                                      address, indent + 1);
         else
-            printk("%*sgfn: %08lx mfn: %08lx\n",
+            printk("%*sgfn: %08lx mfn: %08lx order: %d\n",
                    indent, "",
                    (unsigned long)(address >> PAGE_SHIFT_4K),
-                   (unsigned long)(pte->val >> PAGE_SHIFT_4K));
+                   (unsigned long)(dma_pte_addr(*pte) >> PAGE_SHIFT_4K),
+                   (level - 1) * LEVEL_STRIDE);
     }
 
     unmap_vtd_domain_page(pt_vaddr);
@@ -2470,6 +2638,7 @@ const struct iommu_ops intel_iommu_ops = {
     .assign_device  = intel_iommu_assign_device,
     .teardown = iommu_domain_teardown,
     .map_page = intel_iommu_map_page,
+    .map_superpage = intel_iommu_map_superpage,
     .unmap_page = intel_iommu_unmap_page,
     .free_page_table = iommu_free_page_table,
     .reassign_device = reassign_device_ownership,
@@ -352,6 +352,50 @@ static int flush_iotlb_qi(
     return ret;
 }
 
+/*
+ * Page selective invalidation of count pages from addr, as naturally
+ * aligned chunks of up to 2^max_am pages queued back to back, with a
+ * single wait for all of them.
+ */
+int qinval_iotlb_range(struct iommu *iommu, u16 did, u64 addr,
+                       unsigned long count, unsigned int max_am,
+                       int flush_dev_iotlb)
+{
+    u8 dr = 0, dw = 0;
+    unsigned long pfn = addr >> PAGE_SHIFT_4K, end = pfn + count;
+    unsigned int am;
+    int ret = 0, rc;
+
+    if ( !iommu_qi_ctrl(iommu)->qinval_maddr )
+        return -EOPNOTSUPP;
+
+    if ( cap_write_drain(iommu->cap) )
+        dw = 1;
+    if ( cap_read_drain(iommu->cap) )
+        dr = 1;
+
+    while ( pfn < end )
+    {
+        for ( am = 0; am < max_am && !(pfn & ((2UL << am) - 1)) &&
+                      pfn + (2UL << am) <= end; am++ )
+            ;
+
+        queue_invalidate_iotlb(iommu,
+                               DMA_TLB_PSI_FLUSH >> DMA_TLB_FLUSH_GRANU_OFFSET,
+                               dr, dw, did, am, 0, (u64)pfn << PAGE_SHIFT_4K);
+        if ( flush_dev_iotlb && !ret )
+            ret = dev_invalidate_iotlb(iommu, did, (u64)pfn << PAGE_SHIFT_4K,
+                                       am, DMA_TLB_PSI_FLUSH);
+
+        pfn += 1UL << am;
+    }
+
+    rc = invalidate_sync(iommu);
+    if ( !ret )
+        ret = rc;
+    return ret;
+}
+
 int enable_qinval(struct iommu *iommu)
 {
     struct acpi_drhd_unit *drhd;
@@ -240,6 +240,8 @@ struct cpu_dbs_info_s {
     unsigned int enable:1;
     unsigned int stoppable:1;
     unsigned int turbo_enabled:1;
+    bool_t boost;               /* set from cpufreq_wakeup_boost() */
+    s_time_t boost_until;       /* no decrease before */
 };
 
 int cpufreq_governor_dbs(struct cpufreq_policy *policy, unsigned int event);
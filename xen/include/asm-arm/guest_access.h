@@ -18,6 +18,8 @@ unsigned long raw_clear_guest(void *to, unsigned len);
 
 #define __raw_copy_to_guest raw_copy_to_guest
 #define __raw_copy_from_guest raw_copy_from_guest
+#define __raw_copy_from_guest_nt raw_copy_from_guest
+#define __raw_copy_from_guest_large raw_copy_from_guest
 #define __raw_clear_guest raw_clear_guest
 
 /* Remainder copied from x86 -- could be common? */
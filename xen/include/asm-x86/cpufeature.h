@@ -198,6 +198,8 @@
 
 #define cpu_has_x2apic          boot_cpu_has(X86_FEATURE_X2APIC)
 
+#define cpu_has_sse4_2          boot_cpu_has(X86_FEATURE_SSE4_2)
+
 #define cpu_has_pcid            boot_cpu_has(X86_FEATURE_PCID)
 
 #define cpu_has_xsave           boot_cpu_has(X86_FEATURE_XSAVE)
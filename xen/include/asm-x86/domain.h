@@ -37,19 +37,30 @@ struct trap_bounce {
     unsigned long eip;
 };
 
+/* Two-way set associative: an mfn goes in either entry of its set. */
 #define MAPHASH_ENTRIES 8
-#define MAPHASH_HASHFN(pfn) ((pfn) & (MAPHASH_ENTRIES-1))
+#define MAPHASH_HASHFN(pfn) (((pfn) & (MAPHASH_ENTRIES/2-1)) * 2)
 #define MAPHASHENT_NOTINUSE ((u32)~0U)
 struct mapcache_vcpu {
     /* Shadow of mapcache_domain.epoch. */
     unsigned int shadow_epoch;
 
+    /* Bit n set if the second entry of set n was used last. */
+    unsigned int hash_mru;
+
     /* Lock-free per-VCPU hash of recently-used mappings. */
     struct vcpu_maphash_entry {
         unsigned long mfn;
         uint32_t      idx;
         uint32_t      refcnt;
     } hash[MAPHASH_ENTRIES];
+
+#ifdef PERF_COUNTERS
+    /* Maps found in the hash, maps given a new entry, and TLB flushes. */
+    struct {
+        unsigned long hits, misses, flushes;
+    } stats;
+#endif
 };
 
 struct mapcache_domain {
@@ -72,6 +83,7 @@ struct mapcache_domain {
 int mapcache_domain_init(struct domain *);
 int mapcache_vcpu_init(struct vcpu *);
 void mapcache_override_current(struct vcpu *);
+void mapcache_dump_vcpu(struct vcpu *);
 
 /* x86/64: toggle guest between kernel and user modes. */
 void toggle_guest_mode(struct vcpu *);
@@ -133,14 +145,19 @@ struct shadow_vcpu {
     /* Last MFN that we emulated a write successfully */
     unsigned long last_emulated_mfn;
 
-    /* Shadow out-of-sync: pages that this vcpu has let go out of sync */
-    mfn_t oos[SHADOW_OOS_PAGES];
-    mfn_t oos_snapshot[SHADOW_OOS_PAGES];
+    /* Shadow out-of-sync: pages that this vcpu has let go out of sync.
+     * The arrays hold SHADOW_OOS_PAGES_MAX entries, of which oos_nr are
+     * in use; the table grows when unsyncs keep evicting each other. */
+    mfn_t *oos;
+    mfn_t *oos_snapshot;
     struct oos_fixup {
         int next;
         mfn_t smfn[SHADOW_OOS_FIXUPS];
         unsigned long off[SHADOW_OOS_FIXUPS];
-    } oos_fixup[SHADOW_OOS_PAGES];
+    } *oos_fixup;
+    unsigned int oos_nr;
+    unsigned int oos_unsyncs;      /* since the last look at growing */
+    unsigned int oos_evicts;       /* ditto */
 
     bool_t pagetable_dying;
 };
@@ -283,6 +300,10 @@ struct arch_domain
         RELMEM_done,
     } relmem;
     struct page_list_head relmem_list;
+    /* Batches of relmem_list being put by other cpus. */
+    struct relmem_worker *relmem_workers;
+    unsigned int relmem_nr_workers;
+    atomic_t relmem_inflight;
 
     cpuid_input_t *cpuids;
 
@@ -37,6 +37,16 @@
     (has_hvm_container_vcpu(current) ?                     \
      clear_user_hvm((dst), (len)) :             \
      clear_user((dst), (len)))
+/* As __raw_copy_from_guest(), bypassing the cache for PV guests */
+#define __raw_copy_from_guest_nt(dst, src, len) \
+    (has_hvm_container_vcpu(current) ?                     \
+     copy_from_user_hvm((dst), (src), (len)) :  \
+     __copy_from_user_nt((dst), (src), (len)))
+/* As __raw_copy_from_guest(), with the fastest copy for large lengths */
+#define __raw_copy_from_guest_large(dst, src, len) \
+    (has_hvm_container_vcpu(current) ?                     \
+     copy_from_user_hvm((dst), (src), (len)) :  \
+     __copy_from_user_large((dst), (src), (len)))
 
 /* Is the guest handle a NULL reference? */
 #define guest_handle_is_null(hnd)        ((hnd).p == NULL)
@@ -48,7 +48,7 @@ struct hvm_ioreq_vcpu {
     evtchn_port_t    ioreq_evtchn;
 };
 
-#define NR_IO_RANGE_TYPES (HVMOP_IO_RANGE_PCI + 1)
+#define NR_IO_RANGE_TYPES (HVMOP_IO_RANGE_POSTED + 1)
 #define MAX_NR_IO_RANGES  256
 
 struct hvm_ioreq_server {
@@ -84,6 +84,8 @@ struct hvm_domain {
         spinlock_t       lock;
         ioservid_t       id;
         struct list_head list;
+        /* Bumped on any change to which server an access goes to */
+        unsigned int     generation;
     } ioreq_server;
     struct hvm_ioreq_server *default_ioreq_server;
 
@@ -127,6 +129,9 @@ struct hvm_domain {
     /* hypervisor intercepted msix table */
     struct list_head       msixtbl_list;
     spinlock_t             msixtbl_list_lock;
+    /* All the tables are in [start, end); gen changes at each removal. */
+    unsigned long          msixtbl_start, msixtbl_end;
+    unsigned int           msixtbl_gen;
 
     struct viridian_domain viridian;
 
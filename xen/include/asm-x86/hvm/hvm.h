@@ -233,6 +233,7 @@ int prepare_ring_for_helper(struct domain *d, unsigned long gmfn,
 void destroy_ring_for_helper(void **_va, struct page_info *page);
 
 bool_t hvm_send_assist_req(ioreq_t *p);
+bool_t hvm_posted_io_send(ioreq_t *p);
 void hvm_broadcast_assist_req(ioreq_t *p);
 
 void hvm_get_guest_pat(struct vcpu *v, u64 *guest_pat);
@@ -301,6 +302,10 @@ hvm_update_host_cr3(struct vcpu *v)
         hvm_funcs.update_host_cr3(v);
 }
 
+/* Drop the hypercall's cached translations: all of them, or those of va. */
+void hvm_gtlb_flush(struct vcpu *v);
+void hvm_gtlb_invlpg(struct vcpu *v, unsigned long va);
+
 static inline void hvm_update_guest_cr(struct vcpu *v, unsigned int cr)
 {
     hvm_funcs.update_guest_cr(v, cr);
@@ -54,9 +54,21 @@ struct io_handler {
     } action;
 };
 
+#define MAX_MMIO_HANDLER           8
+
+/* An MMIO range a domain has handled in Xen, see register_mmio_handler() */
+struct hvm_mmio_range {
+    unsigned long       addr;
+    unsigned long       size;
+    hvm_mmio_read_t     read;
+    hvm_mmio_write_t    write;
+};
+
 struct hvm_io_handler {
     int     num_slot;
     struct  io_handler hdl_list[MAX_IO_HANDLER];
+    int     num_mmio;
+    struct  hvm_mmio_range mmio_list[MAX_MMIO_HANDLER];
 };
 
 struct hvm_mmio_handler {
@@ -92,6 +104,9 @@ static inline int hvm_buffered_io_intercept(ioreq_t *p)
 }
 
 int hvm_mmio_intercept(ioreq_t *p);
+int register_mmio_handler(
+    struct domain *d, unsigned long addr, unsigned long size,
+    hvm_mmio_read_t read, hvm_mmio_write_t write);
 int hvm_buffered_io_send(ioreq_t *p);
 
 static inline void register_portio_handler(
@@ -119,6 +134,7 @@ void send_timeoffset_req(unsigned long timeoff);
 void send_invalidate_req(void);
 int handle_mmio(void);
 int handle_mmio_with_translation(unsigned long gva, unsigned long gpfn);
+int handle_mmio_with_gpa(paddr_t gpa);
 int handle_pio(uint16_t port, unsigned int size, int dir);
 void hvm_interrupt_post(struct vcpu *v, int vector, int type);
 void hvm_io_assist(ioreq_t *p);
@@ -136,10 +152,20 @@ struct hvm_hw_stdvga {
     uint32_t latch;
     struct page_info *vram_page[64];  /* shadow of 0xa0000-0xaffff */
     spinlock_t lock;
+    /* Direct mapping of the window, see HVMOP_track_dirty_stdvga. */
+    bool_t direct;                    /* allowed by the device model */
+    bool_t direct_owned;              /* low vram pages belong to the domain */
+    uint8_t direct_first;             /* first window page mapped */
+    uint8_t direct_nr;                /* number of window pages mapped */
+    uint32_t direct_dirty;            /* vram pages written, not yet collected */
+    spinlock_t direct_lock;           /* serialises p2m updates, taken first */
 };
 
 void stdvga_init(struct domain *d);
+void stdvga_relinquish(struct domain *d);
 void stdvga_deinit(struct domain *d);
+int stdvga_track_dirty(struct domain *d, bool_t enable, uint32_t *dirty,
+                       XEN_GUEST_HANDLE_64(uint8) vram);
 
 extern void hvm_dpci_msi_eoi(struct domain *d, int vector);
 #endif /* __ASM_X86_HVM_IO_H__ */
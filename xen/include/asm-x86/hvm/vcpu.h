@@ -44,6 +44,33 @@ struct hvm_vcpu_asid {
     uint32_t asid;
 };
 
+/*
+ * A simple MMIO move: a MOV between a register or immediate and memory,
+ * decoded once and repeated from the same instruction without going
+ * through the emulator, see hvm_emulate_one_cached().
+ */
+struct hvm_mmio_insn {
+    unsigned long cr3, rip;
+    paddr_t gpa;
+    uint32_t imm;
+    uint8_t len, bytes, reg, flags;
+    uint8_t insn[15];
+};
+
+#define HVM_MMIO_INSN_WRITE 0x01  /* To memory */
+#define HVM_MMIO_INSN_IMM   0x02  /* From the immediate */
+#define HVM_MMIO_INSN_HIGH8 0x04  /* Byte register AH..BH */
+#define HVM_MMIO_INSN_LONG  0x08  /* Decoded in 64-bit mode */
+
+#define HVM_MMIO_INSN_CACHE 4
+
+struct hvm_ioreq_server_hit {
+    struct hvm_ioreq_server *server;
+    uint64_t addr, end;
+    unsigned int generation;
+    uint8_t type;
+};
+
 struct hvm_vcpu_io {
     /* I/O request in flight to device model. */
     enum hvm_io_state   io_state;
@@ -59,6 +86,16 @@ struct hvm_vcpu_io {
     unsigned long       mmio_gva;
     unsigned long       mmio_gpfn;
 
+    /* Guest physical address of the access, if the exit gave it. */
+    paddr_t             mmio_gpa;
+    bool_t              mmio_gpa_valid;
+    /* MMIO accesses made emulating the current instruction, the last. */
+    unsigned int        mmio_accesses;
+    paddr_t             mmio_access_pa;
+    /* Simple MMIO moves recently emulated, replaced round robin. */
+    struct hvm_mmio_insn mmio_insn_cache[HVM_MMIO_INSN_CACHE];
+    unsigned int        mmio_insn_next;
+
     /* We may read up to m256 as a number of device-model transactions. */
     paddr_t mmio_large_read_pa;
     uint8_t mmio_large_read[32];
@@ -76,6 +113,13 @@ struct hvm_vcpu_io {
     bool_t mmio_retry, mmio_retrying;
 
     unsigned long msix_unmask_address;
+
+    /* The MSI-X table last accessed, while msixtbl_gen is the domain's. */
+    struct msixtbl_entry *msixtbl_last;
+    unsigned int msixtbl_gen;
+
+    /* The access hvm_select_ioreq_server() last picked a server for. */
+    struct hvm_ioreq_server_hit ioreq_server_hit;
 };
 
 #define VMCX_EADDR    (~0ULL)
@@ -99,6 +143,17 @@ struct nestedvcpu {
     bool_t nv_flushp2m; /* True, when p2m table must be flushed */
     struct p2m_domain *nv_p2m; /* used p2m table for this vcpu */
 
+    /* The L1 p2m table entries read by the last walk of the L1 p2m,
+     * top level first, so that the nested p2m can tell when the tables
+     * its entries were made from change.  Only the EPT walker fills these
+     * in; nv_walk_levels is 0 otherwise. */
+    struct {
+        unsigned long gfn;
+        unsigned int idx;
+        uint64_t entry;
+    } nv_walk[4];
+    unsigned int nv_walk_levels;
+
     struct hvm_vcpu_asid nv_n2asid;
 
     bool_t nv_vmentry_pending;
@@ -117,6 +172,18 @@ struct nestedvcpu {
 
 #define vcpu_nestedhvm(v) ((v)->arch.hvm_vcpu.nvcpu)
 
+/*
+ * Guest linear to frame translations made by the hypercall in progress, so
+ * that its copies to and from the same guest buffers walk the guest page
+ * tables once per page. Empty outside of a hypercall.
+ */
+#define HVM_GTLB_ENTRIES 4
+struct hvm_gtlb_entry {
+    unsigned long vpn;          /* linear address >> PAGE_SHIFT */
+    unsigned long gfn;
+    uint32_t pfec;              /* access the walk was made for */
+};
+
 struct hvm_vcpu {
     /* Guest control-register and EFER values, just as the guest sees them. */
     unsigned long       guest_cr[5];
@@ -144,6 +211,9 @@ struct hvm_vcpu {
 
     bool_t              hcall_preempted;
     bool_t              hcall_64bit;
+    bool_t              gtlb_active;
+    unsigned int        gtlb_nr, gtlb_next;
+    struct hvm_gtlb_entry gtlb[HVM_GTLB_ENTRIES];
 
     struct hvm_vcpu_asid n1asid;
 
@@ -9,6 +9,8 @@
 #ifndef __ASM_X86_HVM_VIRIDIAN_H__
 #define __ASM_X86_HVM_VIRIDIAN_H__
 
+#include <xen/timer.h>
+
 union viridian_apic_assist
 {   uint64_t raw;
     struct
@@ -19,9 +21,77 @@ union viridian_apic_assist
     } fields;
 };
 
+/* Layout of the MSRs giving the guest frame of an overlay page. */
+union viridian_page_msr
+{   uint64_t raw;
+    struct
+    {
+        uint64_t enabled:1;
+        uint64_t reserved_preserved:11;
+        uint64_t pfn:48;
+    } fields;
+};
+
+union viridian_sint_msr
+{   uint64_t raw;
+    struct
+    {
+        uint64_t vector:8;
+        uint64_t reserved_preserved1:8;
+        uint64_t mask:1;
+        uint64_t auto_eoi:1;
+        uint64_t polling:1;
+        uint64_t reserved_preserved2:45;
+    } fields;
+};
+
+union viridian_stimer_config_msr
+{   uint64_t raw;
+    struct
+    {
+        uint64_t enabled:1;
+        uint64_t periodic:1;
+        uint64_t lazy:1;
+        uint64_t auto_enable:1;
+        uint64_t vector:8;
+        uint64_t direct_mode:1;
+        uint64_t reserved_zero1:3;
+        uint64_t sintx:4;
+        uint64_t reserved_zero2:44;
+    } fields;
+};
+
+#define VIRIDIAN_SINT_COUNT     16
+#define VIRIDIAN_STIMER_COUNT   4
+
+struct viridian_stimer
+{
+    struct vcpu *v;
+    unsigned int index;
+    struct timer timer;
+    union viridian_stimer_config_msr config;
+    uint64_t count;
+    uint64_t expiration;    /* in reference time */
+    uint64_t expired;       /* expiration of the message to deliver */
+};
+
+/* Synthetic interrupt controller, just as much as stimers need. */
+struct viridian_synic
+{
+    uint64_t scontrol;
+    union viridian_page_msr siefp;
+    union viridian_page_msr simp;
+    union viridian_sint_msr sint[VIRIDIAN_SINT_COUNT];
+
+    struct viridian_stimer stimer[VIRIDIAN_STIMER_COUNT];
+    unsigned long stimer_pending;       /* expired, set from timer context */
+    unsigned long stimer_msg_pending;   /* waiting for the message slot */
+};
+
 struct viridian_vcpu
 {
     union viridian_apic_assist apic_assist;
+    struct viridian_synic *synic;
 };
 
 union viridian_guest_os_id
@@ -52,6 +122,7 @@ struct viridian_domain
 {
     union viridian_guest_os_id guest_os_id;
     union viridian_hypercall_gpa hypercall_gpa;
+    union viridian_page_msr reference_tsc;
 };
 
 int
@@ -75,4 +146,21 @@ rdmsr_viridian_regs(
 int
 viridian_hypercall(struct cpu_user_regs *regs);
 
+int
+viridian_vcpu_init(struct vcpu *v);
+
+void
+viridian_vcpu_deinit(struct vcpu *v);
+
+void
+viridian_migrate_timers(struct vcpu *v);
+
+/* Deliver the expired synthetic timers of current. */
+void
+viridian_poll_timers(struct vcpu *v);
+
+/* Is vector that of an auto-EOI synthetic interrupt of v? */
+bool_t
+viridian_sint_auto_eoi(struct vcpu *v, uint8_t vector);
+
 #endif /* __ASM_X86_HVM_VIRIDIAN_H__ */
@@ -98,6 +98,7 @@ bool_t is_vlapic_lvtpc_enabled(struct vlapic *vlapic);
 
 void vlapic_set_irq(struct vlapic *vlapic, uint8_t vec, uint8_t trig);
 
+int vlapic_virtual_intr_delivery_enabled(void);
 int vlapic_has_pending_irq(struct vcpu *v);
 int vlapic_ack_pending_irq(struct vcpu *v, int vector, bool_t force_ack);
 
@@ -44,6 +44,7 @@ struct periodic_time {
     bool_t do_not_freeze;
     bool_t irq_issued;
     bool_t warned_timeout_too_short;
+    bool_t merged;              /* ticked by the PIT's timer, not its own */
 #define PTSRC_isa    1 /* ISA time source */
 #define PTSRC_lapic  2 /* LAPIC time source */
     u8 source;                  /* PTSRC_ */
@@ -95,6 +96,8 @@ typedef struct HPETState {
     uint64_t hpet_to_ns_scale; /* hpet ticks to ns (multiplied by 2^10) */
     uint64_t hpet_to_ns_limit; /* max hpet ticks convertable to ns      */
     uint64_t mc_offset;
+    /* Odd while config's enable bit, mc_offset or mc64 change, see hpet.c */
+    uint32_t mc_seq;
     struct periodic_time pt[HPET_TIMER_NUM];
     spinlock_t lock;
 } HPETState;
@@ -137,9 +140,8 @@ struct pl_time {    /* platform time */
     struct PMTState  vpmt;
     /* guest_time = Xen sys time + stime_offset */
     int64_t stime_offset;
-    /* Ensures monotonicity in appropriate timer modes. */
+    /* Ensures monotonicity in appropriate timer modes (cmpxchg'd). */
     uint64_t last_guest_time;
-    spinlock_t pl_time_lock;
 };
 
 void pt_save_timer(struct vcpu *v);
@@ -39,6 +39,11 @@ struct arch_irq_desc {
         vmask_t *used_vectors;
         u8 move_in_progress : 1;
         s8 used;
+        u8 balance_hold;             /* rounds before irq_balance may move it */
+        s16 balance_home;            /* CPU the owner wants, -1 for none */
+        s16 balance_cpu;             /* CPU irq_balance moved it to, or -1 */
+        unsigned int balance_count;  /* interrupts taken ... */
+        unsigned int balance_seen;   /* ... as of the last balancing round */
 };
 
 /* For use with irq_desc.arch.used */
@@ -27,6 +27,10 @@
 /* Returns whether a ring has been set up */
 bool_t mem_event_check_ring(struct mem_event_domain *med);
 
+/* The access ring the current vcpu puts the events of d on: its own if
+ * there is one per vCPU, or the single one */
+struct mem_event_domain *mem_access_ring(struct domain *d);
+
 /* Returns 0 on success, -ENOSYS if there is no ring, -EBUSY if there is no
  * available space and the caller is a foreign domain. If the guest itself
  * is the caller, -EBUSY is avoided by sleeping on a wait queue to ensure
@@ -62,6 +66,10 @@ void mem_event_put_request(struct domain *d, struct mem_event_domain *med,
 int mem_event_get_response(struct domain *d, struct mem_event_domain *med,
                            mem_event_response_t *rsp);
 
+/* Pulls up to nr responses off the ring at once, returns how many */
+int mem_event_get_responses(struct domain *d, struct mem_event_domain *med,
+                            mem_event_response_t *rsp, unsigned int nr);
+
 int do_mem_event_op(int op, uint32_t domain, void *arg);
 int mem_event_domctl(struct domain *d, xen_domctl_mem_event_op_t *mec,
                      XEN_GUEST_HANDLE_PARAM(void) u_domctl);
@@ -32,4 +32,11 @@ struct ucode_cpu_info {
 DECLARE_PER_CPU(struct ucode_cpu_info, ucode_cpu_info);
 extern const struct microcode_ops *microcode_ops;
 
+/*
+ * Set while apply_microcode() runs in the parallel rendezvous: a single
+ * thread of each core with interrupts off, so it doesn't need the update
+ * lock, and all cores at once, so it isn't to print for each.
+ */
+extern bool_t microcode_rendezvous;
+
 #endif /* ASM_X86__MICROCODE_H */
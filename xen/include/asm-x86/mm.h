@@ -83,7 +83,13 @@ struct page_info
         /* Page is on a free list: ((count_info & PGC_count_mask) == 0). */
         struct {
             /* Do TLBs need flushing for safety before next page use? */
-            bool_t need_tlbflush;
+            unsigned long need_tlbflush:1;
+            /*
+             * Of the chunk this page heads, index of the first page which
+             * may have PGC_need_scrub set, INVALID_DIRTY_IDX if none has.
+             */
+#define INVALID_DIRTY_IDX ((1UL << (MAX_ORDER + 1)) - 1)
+            unsigned long first_dirty:MAX_ORDER + 1;
         } free;
 
     } u;
@@ -204,6 +210,12 @@ struct page_info
  /* Cleared when the owning guest 'frees' this page. */
 #define _PGC_allocated    PG_shift(1)
 #define PGC_allocated     PG_mask(1, 1)
+ /*
+  * Free page that needs scrubbing before it is handed out. Only ever set
+  * on free (or offlined) pages, so PGC_allocated's bit can be reused.
+  */
+#define _PGC_need_scrub   _PGC_allocated
+#define PGC_need_scrub    PGC_allocated
  /* Page is Xen heap? */
 #define _PGC_xen_heap     PG_shift(2)
 #define PGC_xen_heap      PG_mask(1, 2)
@@ -252,8 +264,10 @@ struct spage_info
 
 #define PRtype_info "016lx"/* should only be used for printk's */
 
-/* The number of out-of-sync shadows we allow per vcpu (prime, please) */
+/* The number of out-of-sync shadows we allow per vcpu to start with, and
+ * how far that may grow (prime, please) */
 #define SHADOW_OOS_PAGES 3
+#define SHADOW_OOS_PAGES_MAX 31
 
 /* OOS fixup entries */
 #define SHADOW_OOS_FIXUPS 2
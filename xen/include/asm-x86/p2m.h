@@ -29,6 +29,7 @@
 
 #include <xen/config.h>
 #include <xen/paging.h>
+#include <xen/tasklet.h>
 #include <asm/mem_sharing.h>
 #include <asm/page.h>    /* for pagetable_t */
 
@@ -220,6 +221,23 @@ struct p2m_domain {
      * threaded on in LRU order. */
     struct list_head   np2m_list;
 
+    /* Nested p2ms only: the L1 p2m table pages this p2m's entries were
+     * made from, and what each held then, so that an L1 TLB flush need
+     * only drop what has changed.  np2m_src_lost is set when an entry
+     * could not be accounted for: the next flush then drops all.
+     * Updated under the per-p2m lock; emptied by p2m_flush_table().
+     * An open-addressed hash on gfn; level 0 marks a free slot. */
+#define NP2M_SRC_SLOTS     512
+    struct np2m_src {
+        unsigned long  gfn;          /* L1 gfn of the table page */
+        unsigned long  base;         /* first L2 gfn it maps */
+        uint64_t       hash;         /* leaf tables: of the contents */
+        uint64_t      *copy;         /* upper tables: the contents */
+        unsigned int   level;        /* 1 maps 4k pages, 2 maps 2M, ... */
+    } *np2m_src;
+    unsigned int       np2m_src_nr;
+    bool_t             np2m_src_lost;
+
     /* Host p2m: Log-dirty ranges registered for the domain. */
     struct rangeset   *logdirty_ranges;
 
@@ -232,6 +250,14 @@ struct p2m_domain {
      * host p2m's lock. */
     int                defer_nested_flush;
 
+    /* While defer_flush is non-zero, changes which would have flushed the
+     * translations the hardware caches only set need_flush, and
+     * p2m_defer_flush_end() does a single tlb_flush for all of them.
+     * Used for range updates, under the p2m lock. */
+    unsigned int       defer_flush;
+    bool_t             need_flush;
+    void               (*tlb_flush)(struct p2m_domain *p2m);
+
     /* Pages used to construct the p2m */
     struct page_list_head pages;
 
@@ -259,6 +285,16 @@ struct p2m_domain {
                                           unsigned long gfn, l1_pgentry_t *p,
                                           l1_pgentry_t new, unsigned int level);
     long               (*audit_p2m)(struct p2m_domain *p2m);
+    /* Superpages of levels up to max_level back where possible, from
+     * *next on, see p2m_coalesce() */
+    int                (*coalesce)(struct p2m_domain *p2m,
+                                   unsigned int max_level,
+                                   unsigned long *next,
+                                   unsigned long nr[2]);
+    /* Log-dirty tracking done by the CPU (PML), left NULL without it */
+    int                (*enable_hardware_log_dirty)(struct p2m_domain *p2m);
+    void               (*disable_hardware_log_dirty)(struct p2m_domain *p2m);
+    void               (*flush_hardware_cached_dirty)(struct p2m_domain *p2m);
 
     /* Default P2M access type for each page in the the domain: new pages,
      * swapped in pages, cleared pages, and pages that are ambiquously
@@ -294,6 +330,9 @@ struct p2m_domain {
         /* gpfn of last guest superpage demand-populated */
         unsigned long    last_populated[POD_HISTORY_MAX]; 
         unsigned int     last_populated_index;
+        /* Sweeps for zeroed pages ahead of demand when the cache runs low */
+        struct tasklet   reclaim_tasklet;
+        unsigned long    reclaim_idle; /* # of gfns swept without a find    */
         mm_lock_t        lock;         /* Locking of private pod structs,   *
                                         * not relying on the p2m lock.      */
     } pod;
@@ -529,6 +568,16 @@ int p2m_change_type_one(struct domain *d, unsigned long gfn,
 /* Report a change affecting memory types. */
 void p2m_memory_type_changed(struct domain *d);
 
+/* Hardware assisted log-dirty, no-ops where the p2m has none */
+int p2m_enable_hardware_log_dirty(struct domain *d);
+void p2m_disable_hardware_log_dirty(struct domain *d);
+void p2m_flush_hardware_cached_dirty(struct domain *d);
+
+/* The CPU logged writes to the nr guest physical addresses at gpa: they
+ * are dirty, and their p2m_ram_logdirty pages p2m_ram_rw */
+void p2m_mark_logged_dirty(struct domain *d, const uint64_t *gpa,
+                           unsigned int nr);
+
 int p2m_is_logdirty_range(struct p2m_domain *, unsigned long start,
                           unsigned long end);
 
@@ -544,6 +593,9 @@ int p2m_add_foreign(struct domain *tdom, unsigned long fgfn,
  * Populate-on-demand
  */
 
+/* Init the PoD state of a p2m */
+void p2m_pod_init(struct p2m_domain *p2m);
+
 /* Dump PoD information about the domain */
 void p2m_pod_dump_data(struct domain *d);
 
@@ -582,6 +634,8 @@ int set_shared_p2m_entry(struct domain *d, unsigned long gfn, mfn_t mfn);
 int p2m_mem_paging_nominate(struct domain *d, unsigned long gfn);
 /* Evict a frame */
 int p2m_mem_paging_evict(struct domain *d, unsigned long gfn);
+/* Mark a gfn without a frame as paged out */
+int p2m_mem_paging_absent(struct domain *d, unsigned long gfn);
 /* Tell xenpaging to drop a paged out frame */
 void p2m_mem_paging_drop_page(struct domain *d, unsigned long gfn, 
                                 p2m_type_t p2mt);
@@ -684,9 +738,26 @@ int p2m_pt_handle_deferred_changes(uint64_t gpa);
  */
 
 /* Flushes specified p2m table */
+/* Batch the hardware flushes of a range of p2m changes, see defer_flush */
+void p2m_defer_flush_begin(struct p2m_domain *p2m);
+void p2m_defer_flush_end(struct p2m_domain *p2m);
+/* Do the flush deferred so far, e.g. before p2m pages are freed */
+void p2m_tlb_flush_sync(struct p2m_domain *p2m);
+
+/* XEN_DOMCTL_p2m_coalesce: rebuild the superpages of the host p2m */
+int p2m_coalesce(struct domain *d, struct xen_domctl_p2m_coalesce *op);
+
 void p2m_flush(struct vcpu *v, struct p2m_domain *p2m);
 /* Flushes all nested p2m tables */
 void p2m_flush_nestedp2m(struct domain *d);
+/* The nested p2m shadowing np2m_base, if there is one; doesn't make one */
+struct p2m_domain *p2m_find_nestedp2m(struct domain *d, uint64_t np2m_base);
+/* An L1 TLB flush covers p2m: drop the entries made from L1 p2m tables
+ * that have changed since.  Returns 0 if the whole p2m must be flushed
+ * instead. */
+bool_t nestedp2m_revalidate(struct p2m_domain *p2m);
+/* Empty the record of what p2m was made from, under the p2m lock */
+void nestedp2m_forget_sources(struct p2m_domain *p2m);
 
 void nestedp2m_write_p2m_entry(struct p2m_domain *p2m, unsigned long gfn,
     l1_pgentry_t *p, l1_pgentry_t new, unsigned int level);
@@ -141,6 +141,10 @@ void paging_log_dirty_range(struct domain *d,
                             unsigned long nr,
                             uint8_t *dirty_bitmap);
 
+/* XEN_DOMCTL_log_dirty_extents */
+int paging_log_dirty_extents(struct domain *d,
+                             struct xen_domctl_log_dirty_extents *op);
+
 /* enable log dirty */
 int paging_log_dirty_enable(struct domain *d, bool_t log_global);
 
@@ -156,6 +160,7 @@ void paging_log_dirty_init(struct domain *d,
 
 /* mark a page as dirty */
 void paging_mark_dirty(struct domain *d, unsigned long guest_mfn);
+void paging_mark_gfn_dirty(struct domain *d, unsigned long pfn);
 
 /* is this guest page dirty? 
  * This is called from inside paging code, with the paging lock held. */
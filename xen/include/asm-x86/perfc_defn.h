@@ -18,12 +18,17 @@ PERFCOUNTER(seg_fixups,             "segmentation fixups")
 PERFCOUNTER(apic_timer,             "apic timer interrupts")
 
 PERFCOUNTER(domain_page_tlb_flush,  "domain page tlb flushes")
+PERFCOUNTER(hvm_gtlb_hit,           "hvm hypercall gva->gfn hits")
+PERFCOUNTER(hvm_gtlb_miss,          "hvm hypercall gva->gfn walks")
+PERFCOUNTER(domain_page_hash_hit,   "domain page maphash hits")
+PERFCOUNTER(domain_page_hash_evict, "domain page maphash evictions")
 
 PERFCOUNTER(calls_to_mmuext_op,         "calls to mmuext_op")
 PERFCOUNTER(num_mmuext_ops,             "mmuext ops")
 PERFCOUNTER(calls_to_mmu_update,        "calls to mmu_update")
 PERFCOUNTER(num_page_updates,           "page updates")
 PERFCOUNTER(writable_mmu_updates,       "mmu_updates of writable pages")
+PERFCOUNTER(mmu_update_l1_run,          "mmu_updates to a held L1 table")
 PERFCOUNTER(calls_to_update_va,         "calls to update_va_map")
 PERFCOUNTER(page_faults,            "page faults")
 PERFCOUNTER(copy_user_faults,       "copy_user faults")
@@ -110,6 +115,10 @@ PERFCOUNTER(shadow_oos_fixup_evict,"shadow OOS fixup evictions")
 PERFCOUNTER(shadow_unsync,         "shadow OOS unsyncs")
 PERFCOUNTER(shadow_unsync_evict,   "shadow OOS evictions")
 PERFCOUNTER(shadow_resync,         "shadow OOS resyncs")
+PERFCOUNTER(shadow_resync_one,     "shadow OOS resyncs of one page")
+PERFCOUNTER(shadow_resync_all,     "shadow OOS resyncs of all pages")
+PERFCOUNTER(shadow_resync_grow,    "shadow OOS resyncs to grow the table")
+PERFCOUNTER(shadow_oos_grow,       "shadow OOS table grows")
 
 PERFCOUNTER(mshv_call_sw_addr_space,    "MS Hv Switch Address Space")
 PERFCOUNTER(mshv_call_flush_tlb_list,   "MS Hv Flush TLB list")
@@ -124,6 +133,10 @@ PERFCOUNTER(mshv_rdmsr_icr,             "MS Hv rdmsr icr")
 PERFCOUNTER(mshv_rdmsr_tpr,             "MS Hv rdmsr tpr")
 PERFCOUNTER(mshv_rdmsr_apic_assist,     "MS Hv rdmsr APIC assist")
 PERFCOUNTER(mshv_rdmsr_apic_msr,        "MS Hv rdmsr APIC msr")
+PERFCOUNTER(mshv_rdmsr_time_ref_count,  "MS Hv rdmsr time ref count")
+PERFCOUNTER(mshv_rdmsr_reference_tsc,   "MS Hv rdmsr reference TSC")
+PERFCOUNTER(mshv_rdmsr_synic,           "MS Hv rdmsr SynIC")
+PERFCOUNTER(mshv_rdmsr_stimer,          "MS Hv rdmsr stimer")
 PERFCOUNTER(mshv_wrmsr_osid,            "MS Hv wrmsr Guest OS ID")
 PERFCOUNTER(mshv_wrmsr_hc_page,         "MS Hv wrmsr hypercall page")
 PERFCOUNTER(mshv_wrmsr_vp_index,        "MS Hv wrmsr vp index")
@@ -132,10 +145,17 @@ PERFCOUNTER(mshv_wrmsr_tpr,             "MS Hv wrmsr tpr")
 PERFCOUNTER(mshv_wrmsr_eoi,             "MS Hv wrmsr eoi")
 PERFCOUNTER(mshv_wrmsr_apic_assist,     "MS Hv wrmsr APIC assist")
 PERFCOUNTER(mshv_wrmsr_apic_msr,        "MS Hv wrmsr APIC msr")
+PERFCOUNTER(mshv_wrmsr_reference_tsc,   "MS Hv wrmsr reference TSC")
+PERFCOUNTER(mshv_wrmsr_synic,           "MS Hv wrmsr SynIC")
+PERFCOUNTER(mshv_wrmsr_stimer,          "MS Hv wrmsr stimer")
+PERFCOUNTER(mshv_stimer_expired,        "MS Hv stimer expired")
 
 PERFCOUNTER(realmode_emulations, "realmode instructions emulated")
 PERFCOUNTER(realmode_exits,      "vmexits from realmode")
 
 PERFCOUNTER(pauseloop_exits, "vmexits from Pause-Loop Detection")
 
+PERFCOUNTER(np2m_revalidate,      "nested p2m kept over L1 TLB flush")
+PERFCOUNTER(np2m_revalidate_drop, "nested p2m ranges dropped on L1 TLB flush")
+
 /*#endif*/ /* __XEN_PERFC_DEFN_H__ */
@@ -17,6 +17,8 @@ unsigned long copy_from_user(void *to, const void *from, unsigned len);
 /* Handles exceptions in both to and from, but doesn't do access_ok */
 unsigned long __copy_to_user_ll(void *to, const void *from, unsigned n);
 unsigned long __copy_from_user_ll(void *to, const void *from, unsigned n);
+unsigned long __copy_from_user_nt(void *to, const void *from, unsigned n);
+unsigned long __copy_from_user_large(void *to, const void *from, unsigned n);
 
 extern long __get_user_bad(void);
 extern void __put_user_bad(void);
@@ -34,9 +34,10 @@
 
 #include "xen.h"
 #include "grant_table.h"
+#include "memory.h"
 #include "hvm/save.h"
 
-#define XEN_DOMCTL_INTERFACE_VERSION 0x0000000a
+#define XEN_DOMCTL_INTERFACE_VERSION 0x0000000b
 
 /*
  * NB. xen_domctl.domain is an IN/OUT parameter for this operation.
@@ -331,6 +332,26 @@ struct xen_domctl_vcpuaffinity {
 typedef struct xen_domctl_vcpuaffinity xen_domctl_vcpuaffinity_t;
 DEFINE_XEN_GUEST_HANDLE(xen_domctl_vcpuaffinity_t);
 
+/*
+ * XEN_DOMCTL_setvcpuaffinity_bulk
+ *
+ * Give vcpus [first_vcpu, first_vcpu + nr_vcpus) the same hard and/or soft
+ * affinity, as XEN_DOMCTL_setvcpuaffinity would one at a time.  The maps
+ * are IN only: the effective affinity is not reported back.  The operation
+ * is preemptible, first_vcpu and nr_vcpus being updated as it progresses.
+ */
+struct xen_domctl_vcpuaffinity_bulk {
+    /* IN variables. */
+    uint32_t  first_vcpu;
+    uint32_t  nr_vcpus;
+    uint32_t  flags;            /* XEN_VCPUAFFINITY_{HARD,SOFT} */
+    uint32_t  pad;
+    struct xenctl_bitmap cpumap_hard;
+    struct xenctl_bitmap cpumap_soft;
+};
+typedef struct xen_domctl_vcpuaffinity_bulk xen_domctl_vcpuaffinity_bulk_t;
+DEFINE_XEN_GUEST_HANDLE(xen_domctl_vcpuaffinity_bulk_t);
+
 
 /* XEN_DOMCTL_max_vcpus */
 struct xen_domctl_max_vcpus {
@@ -346,6 +367,7 @@ DEFINE_XEN_GUEST_HANDLE(xen_domctl_max_vcpus_t);
 #define XEN_SCHEDULER_CREDIT   5
 #define XEN_SCHEDULER_CREDIT2  6
 #define XEN_SCHEDULER_ARINC653 7
+#define XEN_SCHEDULER_RTDS     8
 /* Set or get info? */
 #define XEN_DOMCTL_SCHEDOP_putinfo 0
 #define XEN_DOMCTL_SCHEDOP_getinfo 1
@@ -366,7 +388,19 @@ struct xen_domctl_scheduler_op {
         } credit;
         struct xen_domctl_sched_credit2 {
             uint16_t weight;
+            uint16_t flags;
+/*
+ * Only run vcpus of the domain on the SMT siblings of a pcpu running one
+ * of its vcpus, or leave them idle.
+ */
+#define _XEN_SCHED_CREDIT2_COSCHED  0
+#define XEN_SCHED_CREDIT2_COSCHED   (1U << _XEN_SCHED_CREDIT2_COSCHED)
         } credit2;
+        /* Each vcpu of the domain runs for budget in every period, in us */
+        struct xen_domctl_sched_rtds {
+            uint32_t period;
+            uint32_t budget;
+        } rtds;
     } u;
 };
 typedef struct xen_domctl_scheduler_op xen_domctl_scheduler_op_t;
@@ -776,6 +810,15 @@ struct xen_domctl_gdbsx_domstatus {
 
 #define XEN_DOMCTL_MEM_EVENT_OP_ACCESS_ENABLE     0
 #define XEN_DOMCTL_MEM_EVENT_OP_ACCESS_DISABLE    1
+/*
+ * Set up the ring of one vCPU instead: that vCPU's events go on its own
+ * ring, so that the vCPUs don't contend for the slots of one.  The ring
+ * page is HVM_PARAM_ACCESS_RING_PFN as for the single ring, and all the
+ * rings of a domain share the event channel returned.  The single ring
+ * and the per-vCPU rings are exclusive, ACCESS_DISABLE tears all of them
+ * down.
+ */
+#define XEN_DOMCTL_MEM_EVENT_OP_ACCESS_ENABLE_VCPU 2
 
 /*
  * Sharing ENOMEM helper.
@@ -802,6 +845,7 @@ struct xen_domctl_mem_event_op {
     uint32_t       mode;         /* XEN_DOMCTL_MEM_EVENT_OP_* */
 
     uint32_t port;              /* OUT: event channel for ring */
+    uint32_t vcpu;              /* IN: vCPU of the ring (ACCESS_ENABLE_VCPU) */
 };
 typedef struct xen_domctl_mem_event_op xen_domctl_mem_event_op_t;
 DEFINE_XEN_GUEST_HANDLE(xen_domctl_mem_event_op_t);
@@ -936,6 +980,146 @@ typedef struct xen_domctl_vcpu_msrs xen_domctl_vcpu_msrs_t;
 DEFINE_XEN_GUEST_HANDLE(xen_domctl_vcpu_msrs_t);
 #endif
 
+/*
+ * XEN_DOMCTL_v4v_rings: the v4v rings of a domain, for save/restore.
+ *
+ * XEN_DOMCTL_V4V_RINGS_SAVE stops the rings taking messages, senders get
+ * -EAGAIN and are notified as usual once the rings take them again. The
+ * ring pages are marked dirty, so that the pass of a live migration
+ * after this one sends them as the senders left them. Returns the rings
+ * in rings and their frames, as the domain registered them, in pfns.
+ * The counts are always returned, with -ENOBUFS if either array is too
+ * small; with a NULL rings only the counts are.
+ *
+ * XEN_DOMCTL_V4V_RINGS_THAW lets the rings take messages again, for a
+ * domain that runs on after its save failed.
+ *
+ * XEN_DOMCTL_V4V_RINGS_RESTORE registers the rings of a restored domain
+ * as if it did it itself, reading their headers from its memory, which
+ * must be restored already. done is the number of rings registered so
+ * far and starts at 0.
+ */
+struct xen_domctl_v4v_ring {
+    uint64_aligned_t ring;  /* guest address of the v4v_ring_t */
+    uint32_t npage;
+    uint32_t pfn;           /* index of its first frame in pfns */
+};
+typedef struct xen_domctl_v4v_ring xen_domctl_v4v_ring_t;
+DEFINE_XEN_GUEST_HANDLE(xen_domctl_v4v_ring_t);
+
+struct xen_domctl_v4v_rings {
+#define XEN_DOMCTL_V4V_RINGS_SAVE       0
+#define XEN_DOMCTL_V4V_RINGS_THAW       1
+#define XEN_DOMCTL_V4V_RINGS_RESTORE    2
+    uint32_t op;                                        /* IN     */
+    uint32_t nr_rings;                                  /* IN/OUT */
+    uint32_t nr_pfns;                                   /* IN/OUT */
+    uint32_t done;                                      /* IN/OUT */
+    XEN_GUEST_HANDLE_64(xen_domctl_v4v_ring_t) rings;   /* IN/OUT */
+    XEN_GUEST_HANDLE_64(uint64) pfns;                   /* IN/OUT */
+};
+typedef struct xen_domctl_v4v_rings xen_domctl_v4v_rings_t;
+DEFINE_XEN_GUEST_HANDLE(xen_domctl_v4v_rings_t);
+
+/*
+ * XEN_DOMCTL_v4v_set_quota: limits the number of v4v rings the domain
+ * may register and the number of its pages they may pin, rings and
+ * pages already registered are left alone. XEN_DOMCTL_V4V_NO_QUOTA
+ * lifts a limit, which is the default. XEN_SYSCTL_v4v_domstats reports
+ * the usage.
+ */
+struct xen_domctl_v4v_set_quota {
+#define XEN_DOMCTL_V4V_NO_QUOTA (~0U)
+    uint32_t max_rings;
+    uint32_t pad;
+    uint64_aligned_t max_pages;
+};
+typedef struct xen_domctl_v4v_set_quota xen_domctl_v4v_set_quota_t;
+DEFINE_XEN_GUEST_HANDLE(xen_domctl_v4v_set_quota_t);
+
+/*
+ * XEN_DOMCTL_p2m_coalesce: put back superpages in the p2m of an HAP
+ * domain where the 4kB (or 2MB) entries of a table map contiguous,
+ * suitably aligned ram all the same way, as they do again once e.g.
+ * log-dirty mode is over.  x86 EPT only.
+ *
+ * next_gfn is where to start, 0 for the whole p2m, and is written back
+ * as the op goes; the counts are added to, the caller zeroes them.
+ */
+struct xen_domctl_p2m_coalesce {
+    uint64_aligned_t next_gfn;      /* IN/OUT */
+    uint64_aligned_t nr_2mb;        /* IN/OUT: 2MB superpages made */
+    uint64_aligned_t nr_1gb;        /* IN/OUT: 1GB superpages made */
+};
+typedef struct xen_domctl_p2m_coalesce xen_domctl_p2m_coalesce_t;
+DEFINE_XEN_GUEST_HANDLE(xen_domctl_p2m_coalesce_t);
+
+/*
+ * XEN_DOMCTL_log_dirty_extents: the dirty pages of a domain in log-dirty
+ * mode as runs of consecutive pfns, without the copy of the whole bitmap
+ * XEN_DOMCTL_SHADOW_OP_PEEK/CLEAN make.  Only the parts of the bitmap
+ * something was ever logged in are looked at.  x86 only.
+ *
+ * The walk starts at start_pfn and ends with the bitmap, or once
+ * nr_extents runs were written.  start_pfn is then where to go on from,
+ * XEN_DOMCTL_LOG_DIRTY_END when the walk is over, and nr_extents the
+ * number of runs written.  With XEN_DOMCTL_LOG_DIRTY_CLEAN, the pages
+ * reported are clean again, as after XEN_DOMCTL_SHADOW_OP_CLEAN.
+ * The fault and dirty counts are reported, and reset with
+ * XEN_DOMCTL_LOG_DIRTY_CLEAN, by the call with start_pfn 0 only.
+ */
+struct xen_domctl_dirty_extent {
+    uint64_aligned_t first_pfn;
+    uint64_aligned_t nr_pfns;
+};
+typedef struct xen_domctl_dirty_extent xen_domctl_dirty_extent_t;
+DEFINE_XEN_GUEST_HANDLE(xen_domctl_dirty_extent_t);
+
+struct xen_domctl_log_dirty_extents {
+#define XEN_DOMCTL_LOG_DIRTY_CLEAN  (1U << 0)
+    uint32_t flags;                 /* IN */
+    uint32_t nr_extents;            /* IN/OUT */
+#define XEN_DOMCTL_LOG_DIRTY_END    (~0ULL)
+    uint64_aligned_t start_pfn;     /* IN/OUT */
+    XEN_GUEST_HANDLE_64(xen_domctl_dirty_extent_t) extents; /* OUT */
+    struct xen_domctl_shadow_op_stats stats;                /* OUT */
+};
+typedef struct xen_domctl_log_dirty_extents xen_domctl_log_dirty_extents_t;
+DEFINE_XEN_GUEST_HANDLE(xen_domctl_log_dirty_extents_t);
+
+/*
+ * XEN_DOMCTL_set_latency_hint: with XEN_DOMCTL_LATENCY_SENSITIVE, a
+ * wakeup of one of the domain's vcpus has the ondemand cpufreq governor
+ * of the pcpu it wakes on go to the highest frequency right away, rather
+ * than at its next sample.
+ */
+struct xen_domctl_latency_hint {
+#define XEN_DOMCTL_LATENCY_SENSITIVE (1U << 0)
+    uint32_t flags;                 /* IN */
+};
+typedef struct xen_domctl_latency_hint xen_domctl_latency_hint_t;
+DEFINE_XEN_GUEST_HANDLE(xen_domctl_latency_hint_t);
+
+/*
+ * XEN_DOMCTL_setvnumainfo: the virtual NUMA topology the domain gets
+ * with XENMEM_get_vnumainfo, replacing any set before.  nr_vcpus must be
+ * the domain's max_vcpus.  vnode_to_pnode gives the physical node of
+ * each virtual one, or ~0 for none; Xen does not hold the domain's
+ * memory to it.
+ */
+struct xen_domctl_vnuma {
+    uint32_t nr_vnodes;                             /* IN */
+    uint32_t nr_vmemranges;                         /* IN */
+    uint32_t nr_vcpus;                              /* IN */
+    uint32_t pad;
+    XEN_GUEST_HANDLE_64(uint) vdistance;            /* IN: nodes * nodes */
+    XEN_GUEST_HANDLE_64(uint) vcpu_to_vnode;        /* IN */
+    XEN_GUEST_HANDLE_64(uint) vnode_to_pnode;       /* IN */
+    XEN_GUEST_HANDLE_64(xen_vmemrange_t) vmemrange; /* IN */
+};
+typedef struct xen_domctl_vnuma xen_domctl_vnuma_t;
+DEFINE_XEN_GUEST_HANDLE(xen_domctl_vnuma_t);
+
 struct xen_domctl {
     uint32_t cmd;
 #define XEN_DOMCTL_createdomain                   1
@@ -1008,6 +1192,13 @@ struct xen_domctl {
 #define XEN_DOMCTL_cacheflush                    71
 #define XEN_DOMCTL_get_vcpu_msrs                 72
 #define XEN_DOMCTL_set_vcpu_msrs                 73
+#define XEN_DOMCTL_v4v_rings                     74
+#define XEN_DOMCTL_v4v_set_quota                 75
+#define XEN_DOMCTL_p2m_coalesce                  76
+#define XEN_DOMCTL_log_dirty_extents             77
+#define XEN_DOMCTL_set_latency_hint              78
+#define XEN_DOMCTL_setvnumainfo                  79
+#define XEN_DOMCTL_setvcpuaffinity_bulk          80
 #define XEN_DOMCTL_gdbsx_guestmemio            1000
 #define XEN_DOMCTL_gdbsx_pausevcpu             1001
 #define XEN_DOMCTL_gdbsx_unpausevcpu           1002
@@ -1023,6 +1214,7 @@ struct xen_domctl {
         struct xen_domctl_getpageframeinfo3 getpageframeinfo3;
         struct xen_domctl_nodeaffinity      nodeaffinity;
         struct xen_domctl_vcpuaffinity      vcpuaffinity;
+        struct xen_domctl_vcpuaffinity_bulk vcpuaffinity_bulk;
         struct xen_domctl_shadow_op         shadow_op;
         struct xen_domctl_max_mem           max_mem;
         struct xen_domctl_vcpucontext       vcpucontext;
@@ -1066,6 +1258,12 @@ struct xen_domctl {
         struct xen_domctl_gdbsx_memio       gdbsx_guest_memio;
         struct xen_domctl_set_broken_page_p2m set_broken_page_p2m;
         struct xen_domctl_cacheflush        cacheflush;
+        struct xen_domctl_v4v_rings         v4v_rings;
+        struct xen_domctl_v4v_set_quota     v4v_set_quota;
+        struct xen_domctl_p2m_coalesce      p2m_coalesce;
+        struct xen_domctl_log_dirty_extents log_dirty_extents;
+        struct xen_domctl_latency_hint      latency_hint;
+        struct xen_domctl_vnuma             vnuma;
         struct xen_domctl_gdbsx_pauseunp_vcpu gdbsx_pauseunp_vcpu;
         struct xen_domctl_gdbsx_domstatus   gdbsx_domstatus;
         uint8_t                             pad[128];
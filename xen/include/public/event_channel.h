@@ -74,6 +74,7 @@
 #define EVTCHNOP_init_control    11
 #define EVTCHNOP_expand_array    12
 #define EVTCHNOP_set_priority    13
+#define EVTCHNOP_send_batch      14
 /* ` } */
 
 typedef uint32_t evtchn_port_t;
@@ -195,6 +196,23 @@ struct evtchn_send {
 };
 typedef struct evtchn_send evtchn_send_t;
 
+/*
+ * EVTCHNOP_send_batch: EVTCHNOP_send to each of the first <nr_ports>
+ * <ports>, in one hypercall. A port listed more than once is sent to once.
+ * NOTES:
+ *  1. The whole structure is read, <nr_ports> must be at most
+ *     EVTCHN_SEND_BATCH_MAX.
+ *  2. The ports are sent to in order, up to the first one EVTCHNOP_send
+ *     would fail for, whose error is returned.
+ */
+#define EVTCHN_SEND_BATCH_MAX 64
+struct evtchn_send_batch {
+    /* IN parameters. */
+    uint32_t nr_ports;
+    evtchn_port_t ports[EVTCHN_SEND_BATCH_MAX];
+};
+typedef struct evtchn_send_batch evtchn_send_batch_t;
+
 /*
  * EVTCHNOP_status: Get the current status of the communication channel which
  * has an endpoint at <dom, port>.
@@ -309,6 +309,7 @@ typedef uint16_t grant_status_t;
 #define GNTTABOP_get_status_frames    9
 #define GNTTABOP_get_version          10
 #define GNTTABOP_swap_grant_ref	      11
+#define GNTTABOP_unmap_deferred       12
 #endif /* __XEN_INTERFACE_VERSION__ */
 /* ` } */
 
@@ -370,6 +371,27 @@ struct gnttab_unmap_grant_ref {
 typedef struct gnttab_unmap_grant_ref gnttab_unmap_grant_ref_t;
 DEFINE_XEN_GUEST_HANDLE(gnttab_unmap_grant_ref_t);
 
+#if __XEN_INTERFACE_VERSION__ >= 0x0003020a
+/*
+ * GNTTABOP_unmap_deferred: As GNTTABOP_unmap_grant_ref, but the host TLBs
+ * are not flushed before the call returns. The mappings are removed, and
+ * the handles can't be used any more, but each grant stays in use (its
+ * GTF_reading/GTF_writing flags set) until the TLBs have been flushed,
+ * which happens no later than:
+ *  - the next GNTTABOP_unmap_grant_ref or GNTTABOP_unmap_and_replace
+ *    of the calling domain,
+ *  - a GNTTABOP_unmap_deferred with <count> 0,
+ *  - a short while after the unmap, or once a number of unmaps are
+ *    waiting.
+ * Unmaps by a domain whose TLBs need not be flushed for them are done as
+ * GNTTABOP_unmap_grant_ref does.
+ * NOTES:
+ *  1. Until then, stale TLB entries may still point at the unmapped frames:
+ *     an address that is mapped again may not show the new mapping before
+ *     a GNTTABOP_unmap_deferred with <count> 0.
+ */
+#endif /* __XEN_INTERFACE_VERSION__ */
+
 /*
  * GNTTABOP_setup_table: Set up a grant table for <dom> comprising at least
  * <nr_frames> pages. The frame addresses are written to the <frame_list>.
@@ -311,6 +311,12 @@ DEFINE_XEN_GUEST_HANDLE(xen_hvm_get_ioreq_server_info_t);
  * PCI config space ranges are specified by segment/bus/device/function values
  * which should be encoded using the HVMOP_PCI_SBDF helper macro below.
  *
+ * Writes to ports in a posted range are queued on the buffered ioreq ring
+ * without the vcpu waiting for them to be emulated, as for doorbells;
+ * reads are synchronous as for other port ranges.  Only servers handling
+ * buffered ioreqs can map posted ranges, and they should drain the ring
+ * before handling a synchronous request, which may depend on the writes.
+ *
  * NOTE: unless an emulation request falls entirely within a range mapped
  * by a secondary emulator, it will not be passed to that emulator.
  */
@@ -323,6 +329,7 @@ struct xen_hvm_io_range {
 # define HVMOP_IO_RANGE_PORT   0 /* I/O port range */
 # define HVMOP_IO_RANGE_MEMORY 1 /* MMIO range */
 # define HVMOP_IO_RANGE_PCI    2 /* PCI segment/bus/dev/func range */
+# define HVMOP_IO_RANGE_POSTED 3 /* I/O port range, writes posted */
     uint64_aligned_t start, end; /* IN - inclusive start and end of range */
 };
 typedef struct xen_hvm_io_range xen_hvm_io_range_t;
@@ -367,6 +374,34 @@ struct xen_hvm_set_ioreq_server_state {
 typedef struct xen_hvm_set_ioreq_server_state xen_hvm_set_ioreq_server_state_t;
 DEFINE_XEN_GUEST_HANDLE(xen_hvm_set_ioreq_server_state_t);
 
+/*
+ * HVMOP_track_dirty_stdvga: Let Xen map the legacy VGA window straight onto
+ *                           its copy of the VRAM while the guest is in a
+ *                           chain-4 mode, and collect what the guest wrote.
+ *
+ * While enabled and while Xen emulates the standard VGA, guest accesses to
+ * the window in chain-4 mode with all planes writable no longer reach the
+ * device model at all.  Each call returns (and clears) the set of 4kB VRAM
+ * pages written since the previous call and, if <vram> is not NULL, copies
+ * their contents to the same offsets in that 128kB buffer.  The device model
+ * must call this often enough to refresh the display, and before it services
+ * a VGA register write or a legacy window access itself, so that its own VRAM
+ * is current whenever Xen goes back to trapping.
+ *
+ * Only available for HAP domains.  Calling with <enable> clear unmaps the
+ * window and returns the final set of dirty pages.
+ */
+#define HVMOP_track_dirty_stdvga 23
+struct xen_hvm_track_dirty_stdvga {
+    domid_t  domid;  /* IN - domain to be serviced */
+    uint8_t  enable; /* IN - allow direct mapping? */
+    uint8_t  pad;
+    uint32_t dirty;  /* OUT - bit n: VRAM page n was written */
+    XEN_GUEST_HANDLE_64(uint8) vram; /* OUT - contents of dirty pages */
+};
+typedef struct xen_hvm_track_dirty_stdvga xen_hvm_track_dirty_stdvga_t;
+DEFINE_XEN_GUEST_HANDLE(xen_hvm_track_dirty_stdvga_t);
+
 #endif /* defined(__XEN__) || defined(__XEN_TOOLS__) */
 
 #endif /* __XEN_PUBLIC_HVM_HVM_OP_H__ */
@@ -151,6 +151,12 @@
 /* Location of the VM Generation ID in guest physical address space. */
 #define HVM_PARAM_VM_GENERATION_ID_ADDR 34
 
-#define HVM_NR_PARAMS          35
+/*
+ * Boolean: deliver the ticks of a periodic RTC from the timer of a
+ * periodic PIT on the same vcpu, rather than from a timer of its own.
+ */
+#define HVM_PARAM_VPT_MERGE 35
+
+#define HVM_NR_PARAMS          36
 
 #endif /* __XEN_PUBLIC_HVM_PARAMS_H__ */
@@ -95,3 +95,20 @@ struct vchan_interface {
 	uint32_t grants[0];
 };
 
+/**
+ * vchan_notify_threshold: optional, directly after the grant list (at
+ * grants[n], n the number of grants of both rings) when it fits there
+ * before any in-page ring. All zero when the page is shared.
+ *
+ * The side setting a notification bit may first store how much it wants:
+ * the bytes of data ready (VCHAN_NOTIFY_WRITE) or of free space
+ * (VCHAN_NOTIFY_READ) in the ring, capped at the ring size. The other side
+ * then leaves the bit set and does not notify until its update reaches
+ * that much. 0 means any change, as when the thresholds are not used.
+ * cli_* are for the client's notifications, so set by the server.
+ */
+struct vchan_notify_threshold {
+	uint32_t cli_write, cli_read;
+	uint32_t srv_write, srv_read;
+};
+
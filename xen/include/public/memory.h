@@ -371,6 +371,8 @@ typedef struct xen_pod_target xen_pod_target_t;
 #define XENMEM_paging_op_nominate           0
 #define XENMEM_paging_op_evict              1
 #define XENMEM_paging_op_prep               2
+/* Mark a gfn with no page behind it as paged out, e.g. for post-copy */
+#define XENMEM_paging_op_absent             3
 
 struct xen_mem_event_op {
     uint8_t     op;         /* XENMEM_*_op_* */
@@ -445,10 +447,15 @@ DEFINE_XEN_GUEST_HANDLE(xen_mem_access_op_t);
 #define XENMEM_sharing_op_debug_gref        6
 #define XENMEM_sharing_op_add_physmap       7
 #define XENMEM_sharing_op_audit             8
+#define XENMEM_sharing_op_hash              9
+#define XENMEM_sharing_op_share_batch       10
 
 #define XENMEM_SHARING_OP_S_HANDLE_INVALID  (-10)
 #define XENMEM_SHARING_OP_C_HANDLE_INVALID  (-9)
 
+/* The hash of a gfn without a RAM page, OP_HASH */
+#define XENMEM_SHARING_HASH_INVALID         (~0ULL)
+
 /* The following allows sharing of grant refs. This is useful
  * for sharing utilities sitting as "filters" in IO backends
  * (e.g. memshr + blktap(2)). The IO backend is only exposed 
@@ -462,6 +469,27 @@ DEFINE_XEN_GUEST_HANDLE(xen_mem_access_op_t);
 #define XENMEM_SHARING_OP_FIELD_GET_GREF(field)        \
     ((field) & (~XENMEM_SHARING_OP_FIELD_IS_GREF_FLAG))
 
+/*
+ * An entry of OP_SHARE_BATCH, sharing client_gfn of client_domain with
+ * source_gfn of the domain of the op.  A zero handle has the gfn nominated
+ * first, the handle it gets is returned.  Grant references are not
+ * supported.
+ * With XENMEM_SHARING_BATCH_ADD_PHYSMAP, client_gfn is a hole the source
+ * page is added at, as of OP_ADD_PHYSMAP, and client_handle is not used.
+ */
+struct xen_mem_sharing_batch_entry {
+    uint64_aligned_t source_gfn;    /* IN */
+    uint64_aligned_t source_handle; /* IN/OUT */
+    uint64_aligned_t client_gfn;    /* IN */
+    uint64_aligned_t client_handle; /* IN/OUT */
+    domid_t          client_domain; /* IN */
+    int16_t          rc;            /* OUT: as of OP_NOMINATE_GFN/OP_SHARE */
+#define XENMEM_SHARING_BATCH_ADD_PHYSMAP (1U << 0)
+    uint32_t         flags;         /* IN */
+};
+typedef struct xen_mem_sharing_batch_entry xen_mem_sharing_batch_entry_t;
+DEFINE_XEN_GUEST_HANDLE(xen_mem_sharing_batch_entry_t);
+
 struct xen_mem_sharing_op {
     uint8_t     op;     /* XENMEM_sharing_op_* */
     domid_t     domain;
@@ -488,6 +516,24 @@ struct xen_mem_sharing_op {
                 uint32_t gref;     /* IN: gref to debug         */
             } u;
         } debug;
+        /*
+         * Fingerprints of the pages of a range of gfns, to find candidates
+         * for sharing: pages with the same contents have the same hash, but
+         * the toolstack has to compare them before sharing.  The hashes are
+         * only comparable with those of the same host.
+         */
+        struct mem_sharing_op_hash {      /* OP_HASH */
+            uint64_aligned_t first_gfn;   /* IN: first gfn of the range */
+            uint32_t nr;                  /* IN: number of gfns */
+            uint32_t done;                /* IN/OUT: gfns done, 0 at first */
+            XEN_GUEST_HANDLE_64(uint64) hashes; /* OUT: nr hashes */
+        } hash;
+        struct mem_sharing_op_share_batch { /* OP_SHARE_BATCH */
+            /* IN/OUT: nr entries, each with its own result */
+            XEN_GUEST_HANDLE_64(xen_mem_sharing_batch_entry_t) entries;
+            uint32_t nr;                  /* IN: number of entries */
+            uint32_t done;                /* IN/OUT: entries done, 0 at first */
+        } share_batch;
     } u;
 };
 typedef struct xen_mem_sharing_op xen_mem_sharing_op_t;
@@ -521,9 +567,88 @@ DEFINE_XEN_GUEST_HANDLE(xen_mem_sharing_op_t);
  * The zero value is appropiate.
  */
 
+/*
+ * Populate the nr_pages guest frames from first_gfn of a translated
+ * domain with fresh memory, using the largest extents possible: each
+ * extent is of max_order if the gfn it starts at is aligned to it and
+ * the range is long enough, of order 9 (2MB) otherwise and of order 0
+ * as a last resort.  Allocating an extent of some order failing caps the
+ * order of the rest of the range, and max_order is lowered accordingly.
+ *
+ * nr_done counts the frames populated so far and must be 0 on the first
+ * call.  Both are written back to the caller's structure as the
+ * hypercall goes, so that it can be preempted and restarted without a
+ * limit on nr_pages.
+ *
+ * mem_flags are XENMEMF_* as for XENMEM_populate_physmap, but for
+ * XENMEMF_populate_on_demand which isn't supported.
+ *
+ * Returns 0 once the whole range is populated, -ENOMEM if even an order 0
+ * extent can't be allocated; nr_done says how far the call got either way.
+ */
+#define XENMEM_populate_physmap_range       26
+struct xen_populate_physmap_range {
+    domid_t domid;
+    uint16_t pad;
+    uint32_t mem_flags;         /* IN: XENMEMF_*         */
+    uint64_aligned_t first_gfn; /* IN                    */
+    uint64_aligned_t nr_pages;  /* IN                    */
+    uint64_aligned_t nr_done;   /* IN/OUT                */
+    uint32_t max_order;         /* IN/OUT                */
+    uint32_t pad2;
+};
+typedef struct xen_populate_physmap_range xen_populate_physmap_range_t;
+DEFINE_XEN_GUEST_HANDLE(xen_populate_physmap_range_t);
+
 #endif /* defined(__XEN__) || defined(__XEN_TOOLS__) */
 
-/* Next available subop number is 26 */
+/*
+ * The virtual NUMA topology of a domain, as set by the toolstack with
+ * XEN_DOMCTL_setvnumainfo.  Guest memory [start, end) is on virtual
+ * node nid; a virtual node can have several ranges, e.g. around the MMIO
+ * hole.
+ */
+struct xen_vmemrange {
+    uint64_t start, end;
+    uint32_t flags;                 /* none yet, 0 */
+    uint32_t nid;
+};
+typedef struct xen_vmemrange xen_vmemrange_t;
+DEFINE_XEN_GUEST_HANDLE(xen_vmemrange_t);
+
+/*
+ * XENMEM_get_vnumainfo: the domain's virtual NUMA topology.  nr_vnodes,
+ * nr_vcpus and nr_vmemranges give the sizes of the arrays passed in and
+ * are set to those of the topology.  vdistance is nr_vnodes * nr_vnodes,
+ * vcpu_to_vnode nr_vcpus long.
+ *
+ * Returns -EOPNOTSUPP if the domain has no virtual NUMA topology and
+ * -ENOBUFS if an array is too short, nothing being copied but the sizes.
+ */
+#define XENMEM_get_vnumainfo                27
+struct xen_vnuma_topology_info {
+    domid_t domid;                  /* IN */
+    uint16_t pad;
+    uint32_t nr_vnodes;             /* IN/OUT */
+    uint32_t nr_vcpus;              /* IN/OUT */
+    uint32_t nr_vmemranges;         /* IN/OUT */
+    union {
+        XEN_GUEST_HANDLE(uint) h;
+        uint64_t pad;
+    } vdistance;                    /* OUT */
+    union {
+        XEN_GUEST_HANDLE(uint) h;
+        uint64_t pad;
+    } vcpu_to_vnode;                /* OUT */
+    union {
+        XEN_GUEST_HANDLE(xen_vmemrange_t) h;
+        uint64_t pad;
+    } vmemrange;                    /* OUT */
+};
+typedef struct xen_vnuma_topology_info xen_vnuma_topology_info_t;
+DEFINE_XEN_GUEST_HANDLE(xen_vnuma_topology_info_t);
+
+/* Next available subop number is 28 */
 
 #endif /* __XEN_PUBLIC_MEMORY_H__ */
 
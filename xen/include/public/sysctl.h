@@ -34,7 +34,7 @@
 #include "xen.h"
 #include "domctl.h"
 
-#define XEN_SYSCTL_INTERFACE_VERSION 0x0000000B
+#define XEN_SYSCTL_INTERFACE_VERSION 0x0000000C
 
 /*
  * Read console content from Xen buffer ring.
@@ -69,6 +69,13 @@ struct xen_sysctl_tbuf_op {
 #define XEN_SYSCTL_TBUFOP_set_size     3
 #define XEN_SYSCTL_TBUFOP_enable       4
 #define XEN_SYSCTL_TBUFOP_disable      5
+/* Notify VIRQ_TBUF when a buffer is size percent full, rather than 50 */
+#define XEN_SYSCTL_TBUFOP_set_highwater 6
+/*
+ * Record only 1 in size events of each class in evt_mask (the TRC_* class
+ * bits, TRC_HVM etc.), counted on each CPU: 0 or 1 records all of them.
+ */
+#define XEN_SYSCTL_TBUFOP_set_sample   7
     uint32_t cmd;
     /* IN/OUT variables */
     struct xenctl_bitmap cpu_mask;
@@ -341,6 +348,16 @@ struct xen_set_cpufreq_para {
     uint32_t ctrl_value;
 };
 
+#define XEN_CORE_PARKING_POLICY_POWER        0
+#define XEN_CORE_PARKING_POLICY_PERFORMANCE  1
+#define XEN_CORE_PARKING_POLICY_TOPOLOGY     2
+
+struct xen_get_core_parking {
+    uint32_t policy;        /* XEN_CORE_PARKING_POLICY_* */
+    uint32_t idle_nums;     /* cpus parked */
+    uint32_t requested;     /* cpus last asked to be parked */
+};
+
 struct xen_sysctl_pm_op {
     #define PM_PARA_CATEGORY_MASK      0xf0
     #define CPUFREQ_PARA               0x10
@@ -366,6 +383,10 @@ struct xen_sysctl_pm_op {
     #define XEN_SYSCTL_pm_op_enable_turbo               0x26
     #define XEN_SYSCTL_pm_op_disable_turbo              0x27
 
+    /* core parking (XENPF_core_parking) state and policy */
+    #define XEN_SYSCTL_pm_op_get_core_parking           0x28
+    #define XEN_SYSCTL_pm_op_set_core_parking_policy    0x29
+
     uint32_t cmd;
     uint32_t cpuid;
     union {
@@ -378,6 +399,8 @@ struct xen_sysctl_pm_op {
         uint32_t                    set_max_cstate;
         uint32_t                    get_vcpu_migration_delay;
         uint32_t                    set_vcpu_migration_delay;
+        struct xen_get_core_parking get_core_parking;
+        uint32_t                    set_core_parking_policy;
     } u;
 };
 
@@ -434,18 +457,32 @@ struct xen_sysctl_page_offline_op {
 /* Sub-operations: */
 #define XEN_SYSCTL_LOCKPROF_reset 1   /* Reset all profile data to zero. */
 #define XEN_SYSCTL_LOCKPROF_query 2   /* Get lock profile information. */
+#define XEN_SYSCTL_LOCKPROF_start 3   /* Resume profiling (the default). */
+#define XEN_SYSCTL_LOCKPROF_stop  4   /* Pause profiling, keeping the data. */
 /* Record-type: */
 #define LOCKPROF_TYPE_GLOBAL      0   /* global lock, idx meaningless */
 #define LOCKPROF_TYPE_PERDOM      1   /* per-domain lock, idx is domid */
 #define LOCKPROF_TYPE_N           2   /* number of types */
+/*
+ * Waits for a lock by duration: bucket 0 counts those shorter than 256ns,
+ * bucket i those in [128ns << i, 256ns << i), the last one all longer ones.
+ */
+#define LOCKPROF_HIST_N           16
+/* Read-write locks: */
+#define LOCKPROF_FLAG_RW          (1u << 0)
 struct xen_sysctl_lockprof_data {
     char     name[40];     /* lock name (may include up to 2 %d specifiers) */
     int32_t  type;         /* LOCKPROF_TYPE_??? */
     int32_t  idx;          /* index (e.g. domain id) */
     uint64_aligned_t lock_cnt;     /* # of locking succeeded */
     uint64_aligned_t block_cnt;    /* # of wait for lock */
-    uint64_aligned_t lock_time;    /* nsecs lock held */
+    uint64_aligned_t lock_time;    /* nsecs lock held (not as reader) */
     uint64_aligned_t block_time;   /* nsecs waited for lock */
+    uint64_aligned_t block_hist[LOCKPROF_HIST_N]; /* waits by duration */
+    uint64_aligned_t hold_max;     /* nsecs of the longest hold */
+    uint64_aligned_t hold_max_site; /* where that hold was taken (address) */
+    uint32_t flags;        /* LOCKPROF_FLAG_??? */
+    uint32_t pad;
 };
 typedef struct xen_sysctl_lockprof_data xen_sysctl_lockprof_data_t;
 DEFINE_XEN_GUEST_HANDLE(xen_sysctl_lockprof_data_t);
@@ -455,6 +492,7 @@ struct xen_sysctl_lockprof_op {
     uint32_t       max_elem;          /* size of output buffer */
     /* OUT variables (query only). */
     uint32_t       nr_elem;           /* number of elements available */
+    uint32_t       stopped;           /* profiling is stopped */
     uint64_aligned_t time;            /* nsecs of profile measurement */
     /* profile information (or NULL) */
     XEN_GUEST_HANDLE_64(xen_sysctl_lockprof_data_t) data;
@@ -636,6 +674,170 @@ struct xen_sysctl_coverage_op {
 typedef struct xen_sysctl_coverage_op xen_sysctl_coverage_op_t;
 DEFINE_XEN_GUEST_HANDLE(xen_sysctl_coverage_op_t);
 
+/* XEN_SYSCTL_v4v_domstats */
+/*
+ * v4v counters of a domain. tx_* count what it sent, rx_* what was sent
+ * to its rings (including rings since unregistered). ring_used is what
+ * is queued in its rings right now, max_fill how full (in %) the
+ * fullest of them is, nr_pending how many senders wait for space.
+ * nr_pages is how many of its pages the rings pin, max_rings and
+ * max_pages the limits of XEN_DOMCTL_v4v_set_quota.
+ */
+struct xen_sysctl_v4v_domstats {
+    domid_t domid;                  /* IN */
+    uint16_t pad;
+    uint32_t nr_rings;              /* OUT */
+    uint32_t nr_pending;            /* OUT */
+    uint32_t max_fill;              /* OUT */
+    uint64_aligned_t ring_bytes;    /* OUT: total size of the rings */
+    uint64_aligned_t ring_used;     /* OUT */
+    uint64_aligned_t tx_messages;   /* OUT */
+    uint64_aligned_t tx_bytes;      /* OUT */
+    uint64_aligned_t tx_eagain;     /* OUT: sends refused, ring full */
+    uint64_aligned_t rx_messages;   /* OUT */
+    uint64_aligned_t rx_bytes;      /* OUT */
+    uint64_aligned_t rx_eagain;     /* OUT: sends to it refused, ring full */
+    uint64_aligned_t nr_pages;      /* OUT */
+    uint64_aligned_t max_pages;     /* OUT */
+    uint32_t max_rings;             /* OUT */
+    uint32_t pad2;
+};
+typedef struct xen_sysctl_v4v_domstats xen_sysctl_v4v_domstats_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_v4v_domstats_t);
+
+/* XEN_SYSCTL_gnttab_domstats */
+/*
+ * Grant table counters of a domain. The *_ops count the grant operations
+ * it issued, copy_bytes what its GNTTABOP_copy copied. lock_contended is
+ * how many times these found a grant table or active entry lock taken,
+ * lock_wait_ns how long they waited for them in all. maptrack_frames is
+ * the size its maptrack table grew to, which is also how many times it
+ * grew as it never shrinks, maptrack_in_use how many of its entries are
+ * mappings right now, maptrack_steals how many times a vcpu out of free
+ * entries took one from another vcpu.
+ */
+struct xen_sysctl_gnttab_domstats {
+    domid_t domid;                      /* IN */
+    uint16_t pad;
+    uint32_t nr_grant_frames;           /* OUT */
+    uint32_t max_grant_frames;          /* OUT */
+    uint32_t maptrack_frames;           /* OUT */
+    uint32_t max_maptrack_frames;       /* OUT */
+    uint32_t maptrack_in_use;           /* OUT */
+    uint64_aligned_t map_ops;           /* OUT */
+    uint64_aligned_t unmap_ops;         /* OUT */
+    uint64_aligned_t copy_ops;          /* OUT */
+    uint64_aligned_t copy_bytes;        /* OUT */
+    uint64_aligned_t lock_contended;    /* OUT */
+    uint64_aligned_t lock_wait_ns;      /* OUT */
+    uint64_aligned_t maptrack_steals;   /* OUT */
+};
+typedef struct xen_sysctl_gnttab_domstats xen_sysctl_gnttab_domstats_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_gnttab_domstats_t);
+
+/* XEN_SYSCTL_evtchn_hotports */
+/*
+ * The ports of a domain which were set pending the most since the
+ * previous query of that domain, at most nr_ports of them, busiest
+ * first. sends is how many times the port was set pending over that
+ * interval, rate the same per second, vcpu the one it notifies. Every
+ * query starts a new interval, interval_ns is the length of the one it
+ * ends. Only available in a hypervisor built with evtchn_stats=y.
+ */
+#define XEN_SYSCTL_EVTCHN_HOTPORTS_MAX  256
+struct xen_sysctl_evtchn_hotport {
+    uint32_t port;
+    uint16_t vcpu;
+    uint8_t state;                      /* EVTCHNSTAT_* */
+    uint8_t pad;
+    uint32_t sends;
+    uint32_t rate;
+};
+typedef struct xen_sysctl_evtchn_hotport xen_sysctl_evtchn_hotport_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_evtchn_hotport_t);
+
+struct xen_sysctl_evtchn_hotports {
+    domid_t domid;                      /* IN */
+    uint16_t pad;
+    uint32_t nr_ports;                  /* IN: size of ports, OUT: filled */
+    uint64_aligned_t interval_ns;       /* OUT */
+    XEN_GUEST_HANDLE_64(xen_sysctl_evtchn_hotport_t) ports; /* OUT */
+};
+typedef struct xen_sysctl_evtchn_hotports xen_sysctl_evtchn_hotports_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_evtchn_hotports_t);
+
+/* XEN_SYSCTL_sched_vcpustats */
+/*
+ * Scheduling latency of the vcpus of a domain, since they were created.
+ * waits is how many times a vcpu went from runnable to running, wait_ns
+ * the time it spent runnable before that in all, wait_max_ns the longest
+ * of these waits, wait_hist[] their distribution: bucket 0 counts the
+ * waits under 2^10ns, bucket i those of [2^(i+9), 2^(i+10))ns and the
+ * last one all those of 2^(XEN_SYSCTL_SCHED_WAIT_BUCKETS+8)ns or more.
+ * wakeups is how many times the vcpu became runnable from blocked or
+ * offline, preemptions how many times it was descheduled while still
+ * runnable, yields included, migrations how many times it was moved to
+ * another pcpu. nr_vcpus is the size of stats on entry, and on return
+ * the number of vcpus of the domain, of which the first nr_vcpus IN
+ * were filled.
+ */
+#define XEN_SYSCTL_SCHED_WAIT_BUCKETS  16
+struct xen_sysctl_sched_vcpustat {
+    uint32_t vcpu_id;
+    uint32_t pad;
+    uint64_aligned_t wakeups;
+    uint64_aligned_t preemptions;
+    uint64_aligned_t migrations;
+    uint64_aligned_t waits;
+    uint64_aligned_t wait_ns;
+    uint64_aligned_t wait_max_ns;
+    uint64_aligned_t wait_hist[XEN_SYSCTL_SCHED_WAIT_BUCKETS];
+};
+typedef struct xen_sysctl_sched_vcpustat xen_sysctl_sched_vcpustat_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_sched_vcpustat_t);
+
+struct xen_sysctl_sched_vcpustats {
+    domid_t domid;                      /* IN */
+    uint16_t pad;
+    uint32_t nr_vcpus;                  /* IN/OUT */
+    XEN_GUEST_HANDLE_64(xen_sysctl_sched_vcpustat_t) stats; /* OUT */
+};
+typedef struct xen_sysctl_sched_vcpustats xen_sysctl_sched_vcpustats_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_sched_vcpustats_t);
+
+/* XEN_SYSCTL_domstats */
+/*
+ * What XEN_SYSCTL_getdomaininfolist, XEN_SYSCTL_v4v_domstats,
+ * XEN_SYSCTL_gnttab_domstats and XEN_SYSCTL_sched_vcpustats tell of a
+ * domain, for up to max_domains domains from first_domain on, in one
+ * call. flags says which of v4v and gnttab were filled, a domain without
+ * v4v or a grant table has them zeroed but for their domid. sched holds
+ * the sums of the counters of the vcpus of the domain, wait_max_ns the
+ * largest of theirs and vcpu_id their number.
+ */
+#define XEN_SYSCTL_DOMSTATS_V4V         (1u << 0)
+#define XEN_SYSCTL_DOMSTATS_GNTTAB      (1u << 1)
+struct xen_sysctl_domstats_ent {
+    xen_domctl_getdomaininfo_t info;
+    uint32_t flags;                     /* XEN_SYSCTL_DOMSTATS_* */
+    uint32_t pad;
+    xen_sysctl_v4v_domstats_t v4v;
+    xen_sysctl_gnttab_domstats_t gnttab;
+    xen_sysctl_sched_vcpustat_t sched;
+};
+typedef struct xen_sysctl_domstats_ent xen_sysctl_domstats_ent_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_domstats_ent_t);
+
+struct xen_sysctl_domstats {
+    domid_t first_domain;               /* IN */
+    uint16_t pad;
+    uint32_t max_domains;               /* IN */
+    XEN_GUEST_HANDLE_64(xen_sysctl_domstats_ent_t) buffer; /* OUT */
+    uint32_t num_domains;               /* OUT */
+    uint32_t pad2;
+};
+typedef struct xen_sysctl_domstats xen_sysctl_domstats_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_domstats_t);
 
 struct xen_sysctl {
     uint32_t cmd;
@@ -658,6 +860,11 @@ struct xen_sysctl {
 #define XEN_SYSCTL_cpupool_op                    18
 #define XEN_SYSCTL_scheduler_op                  19
 #define XEN_SYSCTL_coverage_op                   20
+#define XEN_SYSCTL_v4v_domstats                  21
+#define XEN_SYSCTL_gnttab_domstats               22
+#define XEN_SYSCTL_evtchn_hotports               23
+#define XEN_SYSCTL_sched_vcpustats               24
+#define XEN_SYSCTL_domstats                      25
     uint32_t interface_version; /* XEN_SYSCTL_INTERFACE_VERSION */
     union {
         struct xen_sysctl_readconsole       readconsole;
@@ -679,6 +886,11 @@ struct xen_sysctl {
         struct xen_sysctl_cpupool_op        cpupool_op;
         struct xen_sysctl_scheduler_op      scheduler_op;
         struct xen_sysctl_coverage_op       coverage_op;
+        struct xen_sysctl_v4v_domstats      v4v_domstats;
+        struct xen_sysctl_gnttab_domstats   gnttab_domstats;
+        struct xen_sysctl_evtchn_hotports   evtchn_hotports;
+        struct xen_sysctl_sched_vcpustats   sched_vcpustats;
+        struct xen_sysctl_domstats          domstats;
         uint8_t                             pad[128];
     } u;
 };
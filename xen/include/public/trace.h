@@ -39,6 +39,7 @@
 #define TRC_PV       0x0020f000    /* Xen PV traces            */
 #define TRC_SHADOW   0x0040f000    /* Xen shadow tracing       */
 #define TRC_HW       0x0080f000    /* Xen hardware-related traces */
+#define TRC_V4V      0x0100f000    /* Xen v4v inter-domain messaging */
 #define TRC_GUEST    0x0800f000    /* Guest-generated traces   */
 #define TRC_ALL      0x0ffff000
 #define TRC_HD_TO_EVENT(x) ((x)&0x0fffffff)
@@ -77,6 +78,7 @@
 #define TRC_SCHED_CSCHED2  1
 #define TRC_SCHED_SEDF     2
 #define TRC_SCHED_ARINC653 3
+#define TRC_SCHED_RTDS     4
 
 /* Per-scheduler tracing */
 #define TRC_SCHED_CLASS_EVT(_c, _e) \
@@ -137,6 +139,7 @@
 #define TRC_PV_PTWR_EMULATION_PAE    (TRC_PV_ENTRY + 12)
 #define TRC_PV_HYPERCALL_V2          (TRC_PV_ENTRY + 13)
 #define TRC_PV_HYPERCALL_SUBCALL     (TRC_PV_SUBCALL + 14)
+#define TRC_PV_HYPERCALL_SUBCALL_DONE (TRC_PV_SUBCALL + 15) /* op, result, cycles */
 
 /*
  * TRC_PV_HYPERCALL_V2 format
@@ -182,6 +185,7 @@
 #define TRC_SHADOW_PREALLOC_UNPIN             (TRC_SHADOW + 13)
 #define TRC_SHADOW_RESYNC_FULL                (TRC_SHADOW + 14)
 #define TRC_SHADOW_RESYNC_ONLY                (TRC_SHADOW + 15)
+#define TRC_SHADOW_OOS_GROW                   (TRC_SHADOW + 16)
 
 /* trace events per subclass */
 #define TRC_HVM_NESTEDFLAG      (0x400)
@@ -254,6 +258,22 @@
 #define TRC_PM_IDLE_ENTRY       (TRC_HW_PM + 0x02)
 #define TRC_PM_IDLE_EXIT        (TRC_HW_PM + 0x03)
 
+/*
+ * Trace events for v4v, domain ids are packed two to a word as
+ * (first << 16) | second.
+ *
+ * SENDV:      src:dst domain, src port, dst port, length, result
+ * REGISTER:   domain, port, partner, npage
+ * UNREGISTER: domain, port, partner
+ * PENDING:    ring domain:sender domain, ring port, space wanted
+ * WAKEUP:     ring domain:sender domain, space wanted
+ */
+#define TRC_V4V_SENDV           (TRC_V4V + 0x01)
+#define TRC_V4V_REGISTER        (TRC_V4V + 0x02)
+#define TRC_V4V_UNREGISTER      (TRC_V4V + 0x03)
+#define TRC_V4V_PENDING         (TRC_V4V + 0x04)
+#define TRC_V4V_WAKEUP          (TRC_V4V + 0x05)
+
 /* Trace events for IRQs */
 #define TRC_HW_IRQ_MOVE_CLEANUP_DELAY (TRC_HW_IRQ + 0x1)
 #define TRC_HW_IRQ_MOVE_CLEANUP       (TRC_HW_IRQ + 0x2)
@@ -25,7 +25,7 @@
  * Structure definitions
  */
 
-#define V4V_RING_MAGIC          0xa822f72bb0b9d8ccUL
+#define V4V_RING_MAGIC          0xa822f72bb0b9d8cdUL
 #define V4V_RING_DATA_MAGIC	0x45fe852220b801d4UL
 
 #define V4V_MESSAGE_DGRAM       0x3c2c1db8
@@ -43,6 +43,9 @@ typedef struct v4v_iov
     uint32_t pad;
 } v4v_iov_t;
 
+/* most iovs a single message can be made of */
+#define V4V_MAXIOV      256
+
 typedef struct v4v_addr
 {
     uint32_t port;
@@ -50,11 +53,15 @@ typedef struct v4v_addr
     uint16_t pad;
 } v4v_addr_t;
 
+/*
+ * shard: index of the ring in its group of sub-rings, see v4v_ring.
+ *     0 for a ring that isn't part of a group.
+ */
 typedef struct v4v_ring_id
 {
     v4v_addr_t addr;
     domid_t partner;
-    uint16_t pad;
+    uint16_t shard;
 } v4v_ring_id_t;
 
 typedef struct
@@ -63,22 +70,329 @@ typedef struct
     v4v_addr_t dst;
 } v4v_send_addr_t;
 
+/*
+ * v4v_send_batch_ent
+ * one message of a V4VOP_sendv_batch: the message is made of the niov
+ * iovs starting at index iov_start of the iov array passed to the batch.
+ * status: written by xen, the return value V4VOP_sendv would have given
+ */
+typedef struct v4v_send_batch_ent
+{
+    v4v_send_addr_t addr;
+    uint32_t message_type;
+    uint32_t iov_start;
+    uint32_t niov;
+    int32_t status;
+} v4v_send_batch_ent_t;
+
+#define V4V_SENDV_BATCH_MAX     64
+
+/* in niov (or ndesc), send to the priority lane, see V4VOP_sendv */
+#define V4V_SENDV_F_PRIORITY    (1U << 31)
+/* in niov, queue the head of a message that doesn't fit, see V4VOP_sendv */
+#define V4V_SENDV_F_FRAGMENT    (1U << 30)
+#define V4V_SENDV_F_MASK        (V4V_SENDV_F_PRIORITY | V4V_SENDV_F_FRAGMENT)
+/* in niov, each iov is a datagram of its own, see V4VOP_sendv */
+#define V4V_SENDV_F_PACK        (1U << 29)
+
+/*
+ * v4v_recv_ent
+ * one message of a V4VOP_recvv: its data is copied to the niov iovs of
+ * the array at guest address iov, and truncated to their total length.
+ * source, message_type, len (the length of the data, as sent) and flags
+ * (V4V_MSG_F_*): written by xen
+ */
+typedef struct v4v_recv_ent
+{
+    uint64_t iov;
+    uint32_t niov;
+    uint32_t message_type;
+    v4v_addr_t source;
+    uint32_t len;
+    uint32_t flags;
+} v4v_recv_ent_t;
+
+/*
+ * v4v_multicast
+ * the destinations of a V4VOP_sendv_multicast: ndst v4v_addr_t at guest
+ * address dst, the message is sent from port src.port of the caller to
+ * each of them. status: guest address of a bitmap of (ndst + 7) / 8
+ * bytes, xen sets bit i % 8 of byte i / 8 if the message was queued to
+ * destination i and clears it otherwise.
+ */
+typedef struct v4v_multicast
+{
+    v4v_addr_t src;
+    uint32_t ndst;
+    uint32_t pad;
+    uint64_t dst;
+    uint64_t status;
+} v4v_multicast_t;
+
+#define V4V_MULTICAST_MAX           256
+#define V4V_MULTICAST_BOUNCE_MAX    4096
+
+/*
+ * v4v_ring_batch_ent
+ * one ring of a V4VOP_register_rings or V4VOP_unregister_rings: ring is
+ * the guest address of its v4v_ring_t, pfns that of its npage v4v_pfn_t
+ * (both only looked at to register). status: written by xen, what
+ * V4VOP_register_ring or V4VOP_unregister_ring would have returned.
+ */
+typedef struct v4v_ring_batch_ent
+{
+    uint64_t ring;
+    uint64_t pfns;
+    uint32_t npage;
+    int32_t status;
+} v4v_ring_batch_ent_t;
+
+/*
+ * v4v_connect
+ * a connection of V4VOP_connect: messages sent on it go from port
+ * addr.src.port of the caller to addr.dst with message_type. flags:
+ * V4V_SENDV_F_PRIORITY to send to the priority ring of addr.dst.
+ * handle is written by xen.
+ */
+typedef struct v4v_connect
+{
+    v4v_send_addr_t addr;
+    uint32_t message_type;
+    uint32_t flags;
+    uint32_t handle;
+    uint32_t pad;
+} v4v_connect_t;
+
+#define V4V_CONNECT_MAX             64
+
+/*
+ * v4v_peer_space
+ * the page of V4VOP_peer_space_setup: ent[handle] is what xen last saw
+ * of the destination ring of the connection handle, so that the domain
+ * can tell whether a V4VOP_sendv_connected is worth making without a
+ * V4VOP_notify. Only xen writes it; the domain must only read it.
+ *
+ * v4v_peer_ent
+ * dst: the destination of the connection
+ * space: the largest message that fitted in the ring when xen last
+ *     looked at it, at a V4VOP_connect or V4VOP_sendv_connected of the
+ *     domain, or when the receiver freed the space a V4VOP_sendv_connected
+ *     that got -EAGAIN waited for. Other senders may have used it since,
+ *     or the receiver freed more.
+ * flags: V4V_PEER_F_EXISTS if the connection had a ring then, with
+ *     V4V_PEER_F_WAITING while the domain waits for space in it: xen
+ *     sends the V4V interrupt and updates space once there is enough of
+ *     it, the domain need not ask. flags is written after space.
+ */
+#define V4V_PEER_SPACE_MAGIC        0x5e12a77c0b4f9d36ULL
+
+#define V4V_PEER_F_EXISTS           (1U << 0)
+#define V4V_PEER_F_WAITING          (1U << 1)
+
+typedef struct v4v_peer_ent
+{
+    v4v_addr_t dst;
+    uint32_t space;
+    uint16_t flags;
+    uint16_t pad;
+} v4v_peer_ent_t;
+
+typedef struct v4v_peer_space
+{
+    uint64_t magic;
+    uint32_t nent;
+    uint32_t pad;
+    v4v_peer_ent_t ent[V4V_CONNECT_MAX];
+} v4v_peer_space_t;
+
+#define V4V_RECVV_MAX           64
+#define V4V_SPLICE_MAX          64
+#define V4V_CREDIT_WEIGHT_MAX   255
+#define V4V_CREDIT_SENDERS      16
+
+/*
+ * v4v_grant_desc
+ * one block of a V4VOP_sendv_grants message: len bytes at offset in the
+ * frame the sender granted to the destination domain with gref (a
+ * grant_ref_t in the sender's grant table). The block must not cross
+ * the end of the frame.
+ * V4V_GRANT_DESC_F_WRITABLE: the grant must allow the receiver to write
+ * the block (e.g. to read data into the sender's buffer).
+ */
+#define V4V_GRANT_DESC_F_WRITABLE   (1U << 0)
+
+typedef struct v4v_grant_desc
+{
+    uint32_t gref;
+    uint32_t offset;
+    uint32_t len;
+    uint32_t flags;
+} v4v_grant_desc_t;
+
+#define V4V_GRANT_DESC_MAX      512
+
+/*
+ * v4v_async_queue
+ * the shared queue of V4VOP_async_setup, npage pages of the domain that
+ * start with this header. It is followed at V4V_ASYNC_SQ_OFFSET by the
+ * submission ring, sq_size v4v_async_sqe, then by the completion ring,
+ * cq_size v4v_async_cqe, and the messages' data is in the data_len bytes
+ * at data_offset. sq_size and cq_size are powers of 2, the producer and
+ * consumer indices run freely and entry i is at i & (size - 1).
+ * magic, sizes, data area, sq_prod and cq_cons: written by the domain
+ * sq_cons and cq_prod: written by xen
+ *
+ * v4v_async_sqe
+ * one message to send from the data area: len bytes at offset, to addr,
+ * V4V_SENDV_F_PRIORITY in flags as in the niov of V4VOP_sendv. The data
+ * must be left alone until the completion for cookie is posted.
+ *
+ * v4v_async_cqe
+ * status: the return value V4VOP_sendv would have given for the
+ * submission of cookie
+ */
+#define V4V_ASYNC_MAGIC         0x1c8a7f3d5e62b490ULL
+#define V4V_ASYNC_SQ_OFFSET     64
+#define V4V_ASYNC_MAX_PAGES     1024
+#define V4V_ASYNC_MAX_ENTRIES   4096
+
+typedef struct v4v_async_queue
+{
+    uint64_t magic;
+    uint32_t sq_size;
+    uint32_t cq_size;
+    uint32_t data_offset;
+    uint32_t data_len;
+    uint32_t sq_prod;
+    uint32_t sq_cons;
+    uint32_t cq_prod;
+    uint32_t cq_cons;
+    uint8_t reserved[24];
+} v4v_async_queue_t;
+
+typedef struct v4v_async_sqe
+{
+    uint64_t cookie;
+    v4v_send_addr_t addr;
+    uint32_t message_type;
+    uint32_t flags;
+    uint32_t offset;
+    uint32_t len;
+} v4v_async_sqe_t;
+
+typedef struct v4v_async_cqe
+{
+    uint64_t cookie;
+    int32_t status;
+    uint32_t pad;
+} v4v_async_cqe_t;
+
 /*
  * v4v_ring
  * id: xen only looks at this during register/unregister
  *     and will fill in id.addr.domain
  * rx_ptr: rx pointer, modified by domain
  * tx_ptr: tx pointer, modified by xen
+ * notify_ptr: modified by domain, only used with V4V_RING_F_NOTIFY_PTR.
+ *     xen only signals the domain after a send if tx_ptr moved past
+ *     notify_ptr (as virtio's used_event). A receiver that has drained
+ *     the ring sets notify_ptr = rx_ptr, then checks tx_ptr once more.
+ * flags: V4V_RING_F_*, modified by domain
+ * nshard: xen only looks at this during register/unregister. A domain
+ *     can register up to V4V_RING_MAX_SHARDS sub-rings for one address,
+ *     each with the same nshard and its own id.shard < nshard, so that
+ *     concurrent senders copy into different rings in parallel. Shard 0
+ *     must be registered. Each message goes to a single sub-ring, picked
+ *     by the sending vcpu, or with V4V_RING_F_SHARD_BY_SOURCE (read from
+ *     shard 0) by the sending domain; messages are ordered per sub-ring
+ *     only. 0 or 1 for a plain ring, in which case xen sets id.shard to 0.
+ *     With V4V_RING_F_TIMESTAMP, and if xen was booted with v4v_stats,
+ *     messages are queued with V4V_MSG_F_TSTAMP and their data starts
+ *     with the uint64_t xen system time (ns) at which they were queued.
+ *     While V4V_RING_F_POLLING is set xen doesn't signal the domain
+ *     after sending to the ring, the receiver spins on tx_ptr instead,
+ *     see V4V_RING_POLL().
+ * evtchn: xen only looks at this during register. 0 to be signalled on
+ *     the domain's v4v port (see v4v_info). Otherwise a port of the
+ *     domain bound to another of its own ports (EVTCHNOP_alloc_unbound
+ *     and EVTCHNOP_bind_interdomain with DOMID_SELF), on which xen
+ *     signals messages sent to this ring only. The other end can then be
+ *     bound to the vcpu that owns the ring.
+ *     V4V_RING_F_CACHELINE and V4V_RING_F_NONTEMPORAL are only looked at
+ *     during register. With the former each message starts on a
+ *     V4V_RING_CACHELINE boundary of ring[] rather than a 16 byte one,
+ *     len must be a multiple of V4V_RING_CACHELINE and the receiver
+ *     advances rx_ptr by V4V_RING_MSG_ALIGN(flags). With the latter xen
+ *     copies large messages in with non-temporal stores where it can,
+ *     for rings read on another socket.
+ *     V4V_RING_F_PRIORITY is only looked at during register too: the
+ *     ring is then the priority lane of the (plain) ring with the same
+ *     addr and partner, and xen sets id.shard to V4V_RING_SHARD_PRIORITY.
+ *     It is usually much smaller than the main ring. Messages sent with
+ *     V4V_SENDV_F_PRIORITY go to the lane, or to the main ring if there
+ *     is none, and are ordered with the other messages of the lane only.
+ *     The receiver drains the lane before the main ring each time it is
+ *     signalled, so that control messages don't wait behind bulk data.
+ * credit: xen only looks at this during register. 0 for a plain ring.
+ *     Otherwise once the ring is more than half full each sender may
+ *     only queue as many bytes as its credit allows, and gets -EAGAIN
+ *     (and is notified as usual) when it has run out, so that a bulk
+ *     sender can't keep the ring full ahead of a latency sensitive one.
+ *     A sender's credit is at most credit * its weight (see
+ *     V4VOP_ring_credit), it is spent by the messages it queues and
+ *     given back as the receiver consumes the ring, shared out between
+ *     the senders by weight. Waiting senders are notified in order of
+ *     credit, as long as what they want fits.
+ *     V4V_RING_F_STREAM is only looked at during register: the ring then
+ *     carries a stream of bytes from partner, which must be a domain,
+ *     rather than messages. They are packed one after the other in
+ *     ring[], without message headers or padding, so tx_ptr and rx_ptr
+ *     are byte offsets and the ring is full when tx_ptr is one byte
+ *     behind rx_ptr. Other domains can't send to it. A stream ring
+ *     can't be sharded, be a priority lane or have a credit. A V4VOP_sendv (or V4VOP_sendv_batch entry) to it
+ *     must have message_type V4V_MESSAGE_STREAM, gives no source port,
+ *     queues as many of the bytes as fit and returns how many. It only
+ *     fails with -EAGAIN (and the sender is notified as usual) when the
+ *     ring is full. The other ways of sending fail with -EPROTOTYPE, and
+ *     the receiver reads the ring directly rather than with V4VOP_recvv.
  *
+ * The fields the domain writes and tx_ptr, which xen writes, are on
+ * different cache lines and ring[] starts on one, as long as the ring
+ * is page aligned.
  */
+#define V4V_RING_F_NOTIFY_PTR   (1U << 0) /* honour notify_ptr */
+#define V4V_RING_F_TIMESTAMP    (1U << 1) /* stamp messages, see below */
+#define V4V_RING_F_SHARD_BY_SOURCE (1U << 2) /* see nshard */
+#define V4V_RING_F_POLLING      (1U << 3) /* receiver is busy-polling */
+#define V4V_RING_F_CACHELINE    (1U << 4) /* cache line aligned messages */
+#define V4V_RING_F_NONTEMPORAL  (1U << 5) /* bypass the cache, see above */
+#define V4V_RING_F_PRIORITY     (1U << 6) /* priority lane, see above */
+#define V4V_RING_F_STREAM       (1U << 7) /* byte stream, see above */
+
+#define V4V_RING_SHARD_PRIORITY 0xffffU
+
+#define V4V_RING_CACHELINE      64
+#define V4V_RING_MSG_ALIGN(_flags)                                      \
+    (((_flags) & V4V_RING_F_CACHELINE) ? V4V_RING_CACHELINE : 16)
+
+#define V4V_RING_MAX_SHARDS     64
+
 struct v4v_ring
 {
     uint64_t magic;
     v4v_ring_id_t id;
     uint32_t len;
     uint32_t rx_ptr;
+    uint32_t notify_ptr;
+    uint32_t flags;
+    uint16_t nshard;
+    uint16_t pad;
+    uint32_t evtchn;
+    uint32_t credit;
+    uint8_t reserved[16];
+    /* V4V_RING_CACHELINE bytes in */
     uint32_t tx_ptr;
-    uint8_t reserved[32];
+    uint8_t reserved2[60];
 #if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L
     uint8_t ring[];
 #elif defined(__GNUC__)
@@ -87,6 +401,53 @@ struct v4v_ring
 };
 typedef struct v4v_ring v4v_ring_t;
 
+/*
+ * Busy-polling receive, for receivers that can't afford the event
+ * channel latency. V4V_RING_POLL(r, budget, relax, ready) sets
+ * V4V_RING_F_POLLING and spins on r->tx_ptr for at most budget rounds,
+ * calling relax() in between. If data arrived ready is set and the ring
+ * is left in polling mode for the next call. Otherwise the flag is
+ * cleared and tx_ptr looked at once more, as a message sent just before
+ * that wasn't signalled: if ready is still 0 the caller can block on
+ * the event channel.
+ *
+ * V4V_RING_POLL_ADAPT(budget, ready, min, max) doubles budget (up to
+ * max) after a poll that found data and halves it (down to min) after
+ * one that didn't, so that idle rings stop burning cycles.
+ *
+ * As io/ring.h, these use the xen_mb()/xen_rmb() the user provides.
+ */
+#define V4V_RING_HAS_DATA(_r)                                           \
+    (*(volatile uint32_t *)&(_r)->tx_ptr != (_r)->rx_ptr)
+
+#define V4V_RING_POLL(_r, _budget, _relax, _ready) do {                 \
+    unsigned long __i;                                                  \
+    (_r)->flags |= V4V_RING_F_POLLING;                                  \
+    xen_mb();                                                           \
+    (_ready) = 0;                                                       \
+    for ( __i = 0; __i < (_budget); __i++ ) {                           \
+        if ( V4V_RING_HAS_DATA(_r) ) {                                  \
+            (_ready) = 1;                                               \
+            break;                                                      \
+        }                                                               \
+        _relax();                                                       \
+    }                                                                   \
+    if ( !(_ready) ) {                                                  \
+        (_r)->flags &= ~V4V_RING_F_POLLING;                             \
+        xen_mb(); /* clear the flag before looking at tx_ptr */         \
+        (_ready) = V4V_RING_HAS_DATA(_r);                               \
+    }                                                                   \
+    if ( _ready )                                                       \
+        xen_rmb(); /* read tx_ptr before the messages */                \
+} while ( 0 )
+
+#define V4V_RING_POLL_ADAPT(_budget, _ready, _min, _max) do {           \
+    if ( _ready )                                                       \
+        (_budget) = ((_budget) * 2 > (_max)) ? (_max) : (_budget) * 2;  \
+    else                                                                \
+        (_budget) = ((_budget) / 2 < (_min)) ? (_min) : (_budget) / 2;  \
+} while ( 0 )
+
 #define V4V_RING_DATA_F_EMPTY       (1U << 0) /* Ring is empty */
 #define V4V_RING_DATA_F_EXISTS      (1U << 1) /* Ring exists */
 #define V4V_RING_DATA_F_PENDING     (1U << 2) /* Pending interrupt exists - do not
@@ -95,11 +456,17 @@ typedef struct v4v_ring v4v_ring_t;
 #define V4V_RING_DATA_F_SUFFICIENT  (1U << 3) /* Sufficient space to queue
                                                * space_required bytes exists */
 
+/*
+ * node: written by xen, the NUMA node the ring's memory is on, or
+ *     V4V_NODE_NONE if it spans several nodes or isn't known
+ */
+#define V4V_NODE_NONE               0xffffU
+
 typedef struct v4v_ring_data_ent
 {
     v4v_addr_t ring;
     uint16_t flags;
-    uint16_t pad;
+    uint16_t node;
     uint32_t space_required;
     uint32_t max_message_size;
 } v4v_ring_data_ent_t;
@@ -117,12 +484,19 @@ typedef struct v4v_ring_data
 #endif
 } v4v_ring_data_t;
 
+/*
+ * v4v_info
+ * node: the NUMA node xen places the domain's memory on by default (that
+ *     of its first vcpu), V4V_NODE_NONE if none. Rings allocated on it
+ *     are copied into without crossing nodes by vcpus running there.
+ */
 struct v4v_info
 {
     uint64_t ring_magic;
     uint64_t data_magic;
     evtchn_port_t evtchn;
-    uint32_t pad;
+    uint16_t node;
+    uint16_t pad;
 };
 typedef struct v4v_info v4v_info_t;
 
@@ -139,10 +513,34 @@ struct v4v_stream_header
     uint32_t conid;
 };
 
+#define V4V_MSG_F_GRANTS	(1U << 0) /* data is a v4v_grant_desc_t array */
+#define V4V_MSG_F_TSTAMP	(1U << 1) /* data starts with a uint64_t stamp */
+#define V4V_MSG_F_DISCARD	(1U << 2) /* copy failed, skip the message */
+#define V4V_MSG_F_MORE		(1U << 3) /* fragment, the next one follows */
+#define V4V_MSG_F_PACKED	(1U << 4) /* data is a v4v_packed_header */
+
+/*
+ * Data of a V4V_MSG_F_PACKED message, after the stamp if there is one:
+ * the lengths of its count datagrams, taking V4V_PACKED_HDR_LEN(count)
+ * bytes, then the datagrams back to back with no padding between them.
+ */
+struct v4v_packed_header
+{
+    uint16_t count;
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L
+    uint16_t len[];
+#elif defined(__GNUC__)
+    uint16_t len[0];
+#endif
+};
+
+#define V4V_PACKED_HDR_LEN(count)   ((2 * ((count) + 1) + 7) & ~7)
+#define V4V_PACKED_DGRAM_MAX        0xffff
+
 struct v4v_ring_message_header
 {
     uint32_t len;
-    uint32_t pad0;
+    uint32_t flags; /* V4V_MSG_F_*, set by xen */
     v4v_addr_t source;
     uint32_t message_type;
 #if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L
@@ -152,6 +550,40 @@ struct v4v_ring_message_header
 #endif
 };
 
+/*
+ * v4v_stats
+ * latency histograms, bucket i counts the events that took between 2^i
+ * and 2^(i+1) - 1 ns (bucket 0 also counts 0ns, the last one everything
+ * longer), summed over all the messages sent in the system.
+ * ring: the counters of the ring named in V4VOP_stats
+ */
+#define V4V_STATS_NR_BUCKETS    32
+
+#define V4V_STATS_F_ENABLED     (1U << 0) /* xen collects statistics */
+#define V4V_STATS_F_RING        (1U << 1) /* ring is valid */
+
+typedef struct v4v_ring_stats
+{
+    uint64_t messages;  /* messages queued */
+    uint64_t bytes;     /* payload bytes queued */
+    uint64_t eagain;    /* sends that failed for lack of space */
+    uint64_t signals;   /* times the receiver was signalled after a send */
+    uint64_t remote;    /* messages copied in by a cpu of another node */
+} v4v_ring_stats_t;
+
+typedef struct v4v_stats
+{
+    uint32_t flags;
+    uint32_t pad;
+    v4v_ring_stats_t ring;
+    /* from the send hypercall to the message being in the ring */
+    uint64_t send_to_insert[V4V_STATS_NR_BUCKETS];
+    /* from the message being in the ring to the receiver being signalled */
+    uint64_t insert_to_signal[V4V_STATS_NR_BUCKETS];
+    /* from a sender getting -EAGAIN to it being woken up */
+    uint64_t eagain_to_notify[V4V_STATS_NR_BUCKETS];
+} v4v_stats_t;
+
 typedef struct v4vtables_rule
 {
     v4v_addr_t src;
@@ -178,7 +610,10 @@ typedef struct v4vtables_list
  * V4VOP_register_ring
  *
  * Registers a ring with Xen. If a ring with the same v4v_ring_id exists,
- * the hypercall will return -EEXIST.
+ * the hypercall will return -EEXIST. Registering a large ring is
+ * preemptible, the pfn list must not change until the hypercall returns.
+ * If the ring would take the domain over the number of rings or of ring
+ * pages the toolstack allows it, the hypercall returns -ENOSPC.
  *
  * do_v4v_op(V4VOP_register_ring,
  *           XEN_GUEST_HANDLE(v4v_ring_t), XEN_GUEST_HANDLE(v4v_pfn_t),
@@ -219,9 +654,15 @@ typedef struct v4vtables_list
  * V4V_RING_DATA_F_SUFFICIENT	sufficient space for space_required is there
  * V4V_RING_DATA_F_EXISTS	ring exists
  *
+ * Xen also wakes up the domains waiting for space in the caller's rings
+ * that now have enough of it. If ring_id is not NULL only the caller's
+ * ring with that id (id.addr.domain is ignored) is looked at, which is
+ * cheaper when the caller knows which ring it just consumed from; the
+ * call fails with -ENOENT if there is no such ring.
+ *
  * do_v4v_op(V4VOP_notify,
  *           XEN_GUEST_HANDLE(v4v_ring_data_ent_t) ent,
- *           NULL, 0, 0)
+ *           XEN_GUEST_HANDLE(v4v_ring_id_t) ring_id, 0, 0)
  */
 #define V4VOP_notify 		4
 
@@ -239,6 +680,35 @@ typedef struct v4vtables_list
  * most likely V4V_MESSAGE_DGRAM or V4V_MESSAGE_STREAM. If insufficient space exists
  * it will return -EAGAIN and xen will twing the V4V_INTERRUPT when
  * sufficient space becomes available
+ * niov must not exceed V4V_MAXIOV. With V4V_SENDV_F_PRIORITY or'ed into
+ * niov the message goes to the priority lane of the destination ring if
+ * it has one (see v4v_ring), as it does when set in the niov of a
+ * v4v_send_batch_ent or the ndesc of V4VOP_sendv_grants.
+ *
+ * With V4V_SENDV_F_FRAGMENT or'ed into niov a datagram that doesn't fit
+ * isn't refused outright: as long as there is room for at least an
+ * eighth of the ring, xen queues the head of the message as a fragment
+ * with V4V_MSG_F_MORE set and returns its length, and the sender sends
+ * the rest the same way. The receiver appends the data of
+ * the messages with V4V_MSG_F_MORE from one source to the next message
+ * from that source. -EAGAIN is then only returned when there isn't room
+ * for a fragment, and the sender is notified once there is. Fragments
+ * are ordered as any messages of the sender, they should not be sent to
+ * a group of sub-rings spread by vcpu.
+ *
+ * With V4V_SENDV_F_PACK or'ed into niov each of the niov iovs is a
+ * datagram of its own, of at most V4V_PACKED_DGRAM_MAX bytes: they are
+ * queued together as one message with V4V_MSG_F_PACKED set, behind a
+ * table of their lengths (see v4v_packed_header), and the receiver
+ * takes them apart. Tiny datagrams then share one header and rounding,
+ * and are sent and published at once. The message goes or is refused
+ * as a whole. It can't be combined with V4V_SENDV_F_FRAGMENT, and
+ * multicast and stream rings don't take it.
+ *
+ * A sender waiting for more than a quarter of a ring without a credit
+ * gets the space held for it as it is freed, other senders can't use it
+ * and are only notified once there is room beyond it. It has 10ms once
+ * notified to take it.
  *
  * do_v4v_op(V4VOP_sendv,
  *           XEN_GUEST_HANDLE(v4v_send_addr_t) addr,
@@ -295,6 +765,308 @@ typedef struct v4vtables_list
  */
 #define V4VOP_info              9
 
+/*
+ * V4VOP_sendv_batch
+ *
+ * Sends up to V4V_SENDV_BATCH_MAX messages, possibly to different
+ * destinations, in one hypercall. Each entry is handled as V4VOP_sendv
+ * would handle it and its result is stored in ent[i].status. Destination
+ * domains are signalled once per batch however many messages they got.
+ *
+ * Returns the number of messages sent, or a negative error if the batch
+ * itself could not be processed (in which case statuses are undefined).
+ *
+ * do_v4v_op(V4VOP_sendv_batch,
+ *           XEN_GUEST_HANDLE(v4v_send_batch_ent_t) ent,
+ *           XEN_GUEST_HANDLE(v4v_iov_t) iov,
+ *           uint32_t nent, 0)
+ */
+#define V4VOP_sendv_batch       10
+
+/*
+ * V4VOP_sendv_grants
+ *
+ * Sends a message describing ndesc (at most V4V_GRANT_DESC_MAX) blocks
+ * of the sender's memory by grant reference instead of copying them.
+ * Xen checks that each gref currently grants the destination domain
+ * access to a frame (write access for V4V_GRANT_DESC_F_WRITABLE) and
+ * queues a message whose data is the v4v_grant_desc_t array and whose
+ * header has V4V_MSG_F_GRANTS set. The receiver copies or maps the
+ * blocks on demand with GNTTABOP_copy/GNTTABOP_map_grant_ref using
+ * source.domain from the message header. The sender must keep the
+ * grants in place until the receiver is done with them.
+ *
+ * Ring addressing, filtering and -EAGAIN handling are as for
+ * V4VOP_sendv (the space used in the ring is that of the descriptors).
+ * Returns the total length of the blocks described.
+ *
+ * do_v4v_op(V4VOP_sendv_grants,
+ *           XEN_GUEST_HANDLE(v4v_send_addr_t) addr,
+ *           XEN_GUEST_HANDLE(v4v_grant_desc_t) desc,
+ *           uint32_t ndesc,
+ *           uint32_t message_type)
+ */
+#define V4VOP_sendv_grants      11
+
+/*
+ * V4VOP_stats
+ *
+ * Returns the latency histograms and, if ring_id is not NULL, the
+ * counters of the caller's ring with that id (id.addr.domain is
+ * ignored). Nothing is collected unless xen was booted with v4v_stats,
+ * otherwise V4V_STATS_F_ENABLED is clear and everything reads as 0.
+ *
+ * do_v4v_op(V4VOP_stats,
+ *           XEN_GUEST_HANDLE(v4v_stats_t) stats,
+ *           XEN_GUEST_HANDLE(v4v_ring_id_t) ring_id, 0, 0)
+ */
+#define V4VOP_stats             12
+
+/*
+ * V4VOP_recvv
+ *
+ * Dequeues up to nent (at most V4V_RECVV_MAX) messages from the caller's
+ * ring registered at ring, copying the data of the i-th one straight
+ * into the iovs of ent[i], and advances rx_ptr past them. Messages
+ * queued with V4V_MSG_F_DISCARD are skipped. Senders waiting for space
+ * in the ring are woken up as V4VOP_notify would.
+ *
+ * Returns the number of messages received, 0 if the ring is empty, or
+ * a negative error if none could be received. A message that could not
+ * be copied out is left in the ring.
+ *
+ * do_v4v_op(V4VOP_recvv,
+ *           XEN_GUEST_HANDLE(v4v_ring_t) ring,
+ *           XEN_GUEST_HANDLE(v4v_recv_ent_t) ent,
+ *           uint32_t nent, 0)
+ */
+#define V4VOP_recvv             13
+
+/*
+ * V4VOP_splice
+ *
+ * Moves up to nmsg (at most V4V_SPLICE_MAX) messages from the head of
+ * the caller's ring registered at ring to the ring addr.dst is
+ * delivered to, as if the caller had received them and sent them again
+ * from addr.src.port, without copying them through the caller. Stops
+ * once nbytes of data were moved, unless nbytes is 0. The v4vtables
+ * rules apply as for V4VOP_sendv, the messages keep their message_type
+ * and data. The ring must be mapped as a whole by xen.
+ *
+ * Stops at the first message that can't be moved: a V4V_MSG_F_GRANTS
+ * one, or one the destination has no space for, in which case the
+ * caller is notified as for V4VOP_sendv once it has. Returns the number
+ * of messages moved or a negative error if none were, -EOPNOTSUPP if
+ * the ring is not mapped.
+ *
+ * do_v4v_op(V4VOP_splice,
+ *           XEN_GUEST_HANDLE(v4v_ring_t) ring,
+ *           XEN_GUEST_HANDLE(v4v_send_addr_t) addr,
+ *           uint32_t nmsg, uint32_t nbytes)
+ */
+#define V4VOP_splice            14
+
+/*
+ * V4VOP_ring_credit
+ *
+ * Sets the weight of domain domid among the senders to the caller's
+ * ring registered at ring, which must have been registered with a
+ * credit. weight is from 1 to V4V_CREDIT_WEIGHT_MAX, senders that were
+ * never given one have a weight of 1. V4V_DOMID_ANY sets the weight
+ * shared by the senders that don't have a credit of their own, once
+ * V4V_CREDIT_SENDERS of them do. A weight of 0 forgets domid.
+ *
+ * do_v4v_op(V4VOP_ring_credit,
+ *           XEN_GUEST_HANDLE(v4v_ring_t) ring,
+ *           NULL,
+ *           domid_t domid, uint32_t weight)
+ */
+#define V4VOP_ring_credit       15
+
+/*
+ * V4VOP_async_setup
+ *
+ * Sets up the caller's asynchronous send queue in the npage pages of
+ * pfn_list, which must start with a v4v_async_queue whose magic, sizes
+ * and data area are filled in, npage at most V4V_ASYNC_MAX_PAGES and
+ * each ring at most V4V_ASYNC_MAX_ENTRIES long. Xen keeps the pages
+ * mapped and sends the messages submitted to it, without the domain
+ * waiting, in the order they were submitted. When completions were
+ * posted it signals evtchn, a port bound by the caller to another of its
+ * ports, or the v4v interrupt if evtchn is 0. Once the completion ring
+ * is full xen stops taking submissions until the next
+ * V4VOP_async_submit. An npage of 0 tears the queue down, messages not
+ * sent yet are dropped without a completion.
+ *
+ * do_v4v_op(V4VOP_async_setup,
+ *           XEN_GUEST_HANDLE(v4v_pfn_t) pfn_list,
+ *           NULL,
+ *           uint32_t npage, uint32_t evtchn)
+ */
+#define V4VOP_async_setup       16
+
+/*
+ * V4VOP_async_submit
+ *
+ * Tells xen that sq_prod of the caller's queue moved. It returns right
+ * away, the messages are sent later.
+ *
+ * do_v4v_op(V4VOP_async_submit,
+ *           NULL, NULL, 0, 0)
+ */
+#define V4VOP_async_submit      17
+
+/*
+ * V4VOP_sendv_multicast
+ *
+ * Sends the same message to each of the (at most V4V_MULTICAST_MAX)
+ * destinations of the v4v_multicast at mc. A message of up to
+ * V4V_MULTICAST_BOUNCE_MAX bytes is read from the iovs once and copied
+ * from xen to every destination ring, a larger one is read again for
+ * each of them. Each destination is filtered, handled and signalled as
+ * by V4VOP_sendv, niov and V4V_SENDV_F_PRIORITY are as for V4VOP_sendv,
+ * and a destination without space is sent the V4V interrupt when space
+ * becomes available. Returns the number of destinations the message was
+ * queued to, the status bitmap of mc says which.
+ *
+ * do_v4v_op(V4VOP_sendv_multicast,
+ *           XEN_GUEST_HANDLE(v4v_multicast_t) mc,
+ *           XEN_GUEST_HANDLE(v4v_iov_t) iov,
+ *           uint32_t niov,
+ *           uint32_t message_type)
+ */
+#define V4VOP_sendv_multicast   18
+
+/*
+ * V4VOP_connect
+ *
+ * Binds the source port and destination of the v4v_connect at conn to a
+ * handle, at most V4V_CONNECT_MAX per domain, which is written to
+ * conn->handle. The destination is filtered and its ring looked up
+ * once, V4VOP_sendv_connected only does it again after the rules or the
+ * destination's rings changed. Returns -ECONNREFUSED if there is no
+ * such ring or the rules refuse it, as V4VOP_sendv would.
+ *
+ * do_v4v_op(V4VOP_connect,
+ *           XEN_GUEST_HANDLE(v4v_connect_t) conn,
+ *           NULL, 0, 0)
+ */
+#define V4VOP_connect           19
+
+/*
+ * V4VOP_disconnect
+ *
+ * Releases the handle of V4VOP_connect.
+ *
+ * do_v4v_op(V4VOP_disconnect,
+ *           NULL, NULL,
+ *           uint32_t handle, 0)
+ */
+#define V4VOP_disconnect        20
+
+/*
+ * V4VOP_sendv_connected
+ *
+ * As V4VOP_sendv to the destination of handle, niov may have
+ * V4V_SENDV_F_FRAGMENT set, the ring is the one chosen at
+ * V4VOP_connect. Returns -EBADF if handle isn't connected.
+ *
+ * do_v4v_op(V4VOP_sendv_connected,
+ *           XEN_GUEST_HANDLE(v4v_iov_t) iov,
+ *           NULL,
+ *           uint32_t niov,
+ *           uint32_t handle)
+ */
+#define V4VOP_sendv_connected   21
+
+/*
+ * V4VOP_peer_space_setup
+ *
+ * Has xen keep the v4v_peer_space of the caller's connections in the
+ * page of the single pfn at pfn_hnd, which xen clears and fills in with
+ * what it knows of the connections made so far. An npage of 0 stops
+ * it; setting up another page replaces the previous one.
+ *
+ * do_v4v_op(V4VOP_peer_space_setup,
+ *           XEN_GUEST_HANDLE(v4v_pfn_t) pfn_hnd,
+ *           NULL,
+ *           uint32_t npage, 0)
+ */
+#define V4VOP_peer_space_setup  22
+
+/*
+ * V4VOP_ring_resize
+ *
+ * Moves the registered ring with the id of the ring at ring_hnd to it
+ * and its npage pages, as V4VOP_register_ring would register it, without
+ * unregistering it: senders never see it go away, and those waiting for
+ * space keep waiting on it. Only len may differ from the ring it
+ * replaces, the other settings stay. Xen copies what wasn't read yet to
+ * the start of the new ring and sets its rx_ptr to 0 and its tx_ptr
+ * after it, the old ring is the caller's again once this returns. The
+ * caller must not read the old ring meanwhile. Fails with -ENOSPC if
+ * what wasn't read doesn't fit.
+ *
+ * With npage 0 the ring isn't moved, its rx_ptr and tx_ptr are both
+ * set back to 0 if the caller read everything, otherwise the call
+ * fails with -EBUSY.
+ *
+ * do_v4v_op(V4VOP_ring_resize,
+ *           XEN_GUEST_HANDLE(v4v_ring_t) ring,
+ *           XEN_GUEST_HANDLE(v4v_pfn_t) pfn_hnd,
+ *           uint32_t npage, 0)
+ */
+#define V4VOP_ring_resize       23
+
+/*
+ * V4VOP_ring_sources
+ *
+ * Restricts the senders to the caller's ring registered at ring to the
+ * nsrc v4v_addr_t at src_hnd, at most V4V_RING_SOURCES_MAX: a domain
+ * and a port, V4V_PORT_ANY for any port of that domain. Anyone else
+ * gets -ECONNREFUSED before the ring is looked at, on top of what the
+ * v4vtables rules allow. Each sub-ring of a sharded ring, and a
+ * priority lane, has its own list. An nsrc of 0 lets anyone send again.
+ *
+ * do_v4v_op(V4VOP_ring_sources,
+ *           XEN_GUEST_HANDLE(v4v_ring_t) ring,
+ *           XEN_GUEST_HANDLE(v4v_addr_t) src_hnd,
+ *           uint32_t nsrc, 0)
+ */
+#define V4VOP_ring_sources      24
+
+#define V4V_RING_SOURCES_MAX    64
+
+/*
+ * V4VOP_register_rings
+ *
+ * Registers the nent rings of the v4v_ring_batch_ent_t array at ent_hnd,
+ * each as V4VOP_register_ring would, and sets the status of each. One
+ * failing doesn't stop the others. The hypercall is preempted between
+ * rings and within a large one: the last argument must be 0, xen keeps
+ * its progress there. Returns 0 once all are done, or -EFAULT if the
+ * array can't be read or written.
+ *
+ * do_v4v_op(V4VOP_register_rings,
+ *           XEN_GUEST_HANDLE(v4v_ring_batch_ent_t) ent_hnd,
+ *           NULL,
+ *           uint32_t nent, 0)
+ */
+#define V4VOP_register_rings    25
+
+/*
+ * V4VOP_unregister_rings
+ *
+ * As V4VOP_register_rings, each ring as V4VOP_unregister_ring would
+ * unregister it. Only ring is looked at.
+ *
+ * do_v4v_op(V4VOP_unregister_rings,
+ *           XEN_GUEST_HANDLE(v4v_ring_batch_ent_t) ent_hnd,
+ *           NULL,
+ *           uint32_t nent, 0)
+ */
+#define V4VOP_unregister_rings  26
+
 #endif /* __XEN_PUBLIC_V4V_H__ */
 
 /*
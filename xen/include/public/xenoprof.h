@@ -54,7 +54,10 @@
 /* AMD IBS support */
 #define XENOPROF_get_ibs_caps       16
 #define XENOPROF_ibs_counter        17
-#define XENOPROF_last_op            17
+
+/* System-wide sampling into per-pCPU buffers */
+#define XENOPROF_get_pcpu_buffer    18
+#define XENOPROF_last_op            18
 
 #define MAX_OPROF_EVENTS    32
 #define MAX_OPROF_DOMAINS   25
@@ -89,6 +92,39 @@ typedef struct xenoprof_buf xenoprof_buf_t;
 DEFINE_XEN_GUEST_HANDLE(xenoprof_buf_t);
 #endif
 
+/*
+ * System-wide sample.  Unlike the per-VCPU buffers, every record says where
+ * it was taken, so samples of all domains, of the idle VCPUs and of Xen
+ * itself can share one buffer per physical CPU.  Call chains follow the
+ * same layout as in the per-VCPU buffers: an XENOPROF_ESCAPE_CODE record
+ * with event XENOPROF_TRACE_BEGIN, the sample, then one record per frame.
+ */
+struct pcpu_event_log {
+    uint64_t eip;
+    uint16_t domain_id;  /* DOMID_IDLE for the idle VCPUs */
+    uint16_t vcpu_id;
+    uint8_t mode;        /* 0: user, 1: kernel, 2: Xen */
+    uint8_t event;
+    uint16_t pad;
+};
+
+/* Xenoprof buffer shared between Xen and the primary profiler - 1 per pCPU */
+struct xenoprof_pcpu_buf {
+    uint32_t event_head;
+    uint32_t event_tail;
+    uint32_t event_size;
+    uint32_t cpu_id;
+    uint64_t xen_samples;
+    uint64_t kernel_samples;
+    uint64_t user_samples;
+    uint64_t lost_samples;
+    struct pcpu_event_log event_log[1];
+};
+#ifndef __XEN__
+typedef struct xenoprof_pcpu_buf xenoprof_pcpu_buf_t;
+DEFINE_XEN_GUEST_HANDLE(xenoprof_pcpu_buf_t);
+#endif
+
 struct xenoprof_init {
     int32_t  num_events;
     int32_t  is_primary;
@@ -106,6 +142,25 @@ struct xenoprof_get_buffer {
 typedef struct xenoprof_get_buffer xenoprof_get_buffer_t;
 DEFINE_XEN_GUEST_HANDLE(xenoprof_get_buffer_t);
 
+/*
+ * XENOPROF_get_pcpu_buffer: map one buffer per physical CPU into the
+ * primary profiler, and send every sample there instead of the per-VCPU
+ * buffers until the passive list is next reset.  Only valid after
+ * XENOPROF_init and before XENOPROF_reserve_counters, like
+ * XENOPROF_set_passive.  <nbuf> buffers of <bufsize> bytes each are laid out
+ * back to back, indexed by CPU number.  The layout is the same for 32 and
+ * 64-bit callers.
+ */
+struct xenoprof_get_pcpu_buffer {
+    int32_t  max_samples; /* IN - per physical CPU */
+    int32_t  nbuf;        /* OUT */
+    int32_t  bufsize;     /* OUT */
+    int32_t  pad;
+    uint64_t buf_gmaddr;  /* IN/OUT - as for XENOPROF_get_buffer */
+};
+typedef struct xenoprof_get_pcpu_buffer xenoprof_get_pcpu_buffer_t;
+DEFINE_XEN_GUEST_HANDLE(xenoprof_get_pcpu_buffer_t);
+
 struct xenoprof_counter {
     uint32_t ind;
     uint64_t count;
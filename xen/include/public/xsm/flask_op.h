@@ -128,6 +128,22 @@ struct xen_flask_cache_stats {
     uint32_t frees;
 };
 
+#define XEN_FLASK_AVC_HIST_BUCKETS 5
+
+struct xen_flask_avc_histogram {
+    /* IN */
+    uint32_t cpu;
+    uint32_t type;
+/* Position of the entry found: 0 for the per-CPU lookaside, else in its chain */
+#define FLASK_AVC_HIST_HIT      0
+/* Length of the hash chain searched in vain */
+#define FLASK_AVC_HIST_MISS     1
+/* Hash slots scanned by each reclaim */
+#define FLASK_AVC_HIST_RECLAIM  2
+    /* OUT: number of events at 0, 1, 2-3, 4-7 and 8 or more */
+    uint32_t buckets[XEN_FLASK_AVC_HIST_BUCKETS];
+};
+
 struct xen_flask_ocontext {
     /* IN */
     uint32_t ocon;
@@ -174,6 +190,7 @@ struct xen_flask_op {
 #define FLASK_DEL_OCONTEXT      22
 #define FLASK_GET_PEER_SID      23
 #define FLASK_RELABEL_DOMAIN    24
+#define FLASK_AVC_HISTOGRAM     25
     uint32_t interface_version; /* XEN_FLASK_INTERFACE_VERSION */
     union {
         struct xen_flask_load load;
@@ -189,6 +206,7 @@ struct xen_flask_op {
         struct xen_flask_setavc_threshold setavc_threshold;
         struct xen_flask_hash_stats hash_stats;
         struct xen_flask_cache_stats cache_stats;
+        struct xen_flask_avc_histogram avc_histogram;
         /* FLASK_ADD_OCONTEXT, FLASK_DEL_OCONTEXT */
         struct xen_flask_ocontext ocontext;
         struct xen_flask_peersid peersid;
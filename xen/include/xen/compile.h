@@ -0,0 +1,15 @@
+#define XEN_COMPILE_DATE	"Wed Oct 14 12:46:47 UTC 2026"
+#define XEN_COMPILE_TIME	"12:46:47"
+#define XEN_COMPILE_BY		""
+#define XEN_COMPILE_DOMAIN	""
+#define XEN_COMPILE_HOST	"vm"
+#define XEN_COMPILER		"gcc (Debian 12.2.0-14+deb12u1) 12.2.0"
+
+#define XEN_VERSION		4
+#define XEN_SUBVERSION		5
+#define XEN_EXTRAVERSION	"-unstable"
+
+#define XEN_CHANGESET		"Wed Oct 14 12:44:29 2026 +0000 git:9d23f95-dirty"
+#define XEN_BANNER		\
+"\040\130\145\156\040\064\056\065\055\165\156\163\164\141\142\154\145\012" \
+""
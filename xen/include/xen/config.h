@@ -12,6 +12,13 @@
 #endif
 #include <asm/config.h>
 
+/* Largest chunk of the page allocator, also the width of page_info fields. */
+#ifdef CONFIG_PAGEALLOC_MAX_ORDER
+#define MAX_ORDER CONFIG_PAGEALLOC_MAX_ORDER
+#else
+#define MAX_ORDER 20 /* 2^20 contiguous pages */
+#endif
+
 #define EXPORT_SYMBOL(var)
 #define EXPORT_SYMBOL_GPL(var)
 
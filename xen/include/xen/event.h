@@ -129,6 +129,10 @@ static inline struct evtchn *evtchn_from_port(struct domain *d, unsigned int p)
 
 void evtchn_check_pollers(struct domain *d, unsigned int port);
 
+/* XEN_SYSCTL_evtchn_hotports: caller holds a reference on d. */
+struct xen_sysctl_evtchn_hotports;
+int evtchn_hotports(struct domain *d, struct xen_sysctl_evtchn_hotports *op);
+
 void evtchn_2l_init(struct domain *d);
 
 /*
@@ -155,6 +159,10 @@ static inline void evtchn_port_init(struct domain *d, struct evtchn *evtchn)
 static inline void evtchn_port_set_pending(struct vcpu *v,
                                            struct evtchn *evtchn)
 {
+#ifdef EVTCHN_STATS
+    /* Not atomic: concurrent senders may lose a count, good enough to rank. */
+    evtchn->sends++;
+#endif
     v->domain->evtchn_port_ops->set_pending(v, evtchn);
 }
 
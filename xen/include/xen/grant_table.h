@@ -24,7 +24,9 @@
 #ifndef __XEN_GRANT_TABLE_H__
 #define __XEN_GRANT_TABLE_H__
 
+#include <xen/timer.h>
 #include <public/grant_table.h>
+#include <public/sysctl.h>
 #include <asm/page.h>
 #include <asm/grant_table.h>
 
@@ -62,6 +64,8 @@ struct grant_mapping {
     u32      ref;           /* grant ref */
     u16      flags;         /* 0-4: GNTMAP_* ; 5-15: unused */
     domid_t  domid;         /* granting domain */
+    u32      vcpu;          /* vcpu which created the grant mapping */
+    u32      pad;           /* round size to a power of 2 */
 };
 
 /* Per-domain grant information. */
@@ -80,15 +84,30 @@ struct grant_table {
     grant_status_t       **status;
     /* Active grant table. */
     struct active_grant_entry **active;
-    /* Mapping tracking table. */
+    /* Mapping tracking table, its free entries are on per-vcpu lists. */
     struct grant_mapping **maptrack;
-    unsigned int          maptrack_head;
     unsigned int          maptrack_limit;
-    /* Lock protecting updates to active and shared grant tables. */
-    spinlock_t            lock;
+    /* Lock protecting the maptrack frames and limit. */
+    spinlock_t            maptrack_lock;
+    /*
+     * Lock protecting the grant table state (version, size, frames): it
+     * is taken for reading to use the table, and each active entry has a
+     * lock of its own. See docs/misc/grant-tables.txt.
+     */
+    rwlock_t              lock;
     /* The defined versions are 1 and 2.  Set to 0 if we don't know
        what version to use yet. */
     unsigned              gt_version;
+    /*
+     * GNTTABOP_unmap_deferred unmaps waiting for a TLB flush, the time
+     * the last of them was queued at on the TLB flush clock, and the
+     * timer which bounds the wait.
+     */
+    spinlock_t            deferred_lock;
+    struct gnttab_unmap_common *deferred;
+    unsigned int          nr_deferred;
+    u32                   deferred_stamp;
+    struct timer          deferred_timer;
 };
 
 /* Create/destroy per-domain grant table context. */
@@ -96,6 +115,10 @@ int grant_table_create(
     struct domain *d);
 void grant_table_destroy(
     struct domain *d);
+void grant_table_init_vcpu(struct vcpu *v);
+
+/* XEN_SYSCTL_gnttab_domstats: caller holds a reference on d. */
+int gnttab_domstats(struct domain *d, struct xen_sysctl_gnttab_domstats *st);
 
 /* Domain death release of granted mappings of other domains' memory. */
 void
@@ -103,11 +126,16 @@ gnttab_release_mappings(
     struct domain *d);
 
 /* Increase the size of a domain's grant table.
- * Caller must hold d's grant table lock.
+ * Caller must hold d's grant table write lock.
  */
 int
 gnttab_grow_table(struct domain *d, unsigned int req_nr_frames);
 
+/* Check that ref of d currently grants domid (write) access to a frame. */
+int
+gnttab_check_grant(struct domain *d, grant_ref_t ref, domid_t domid,
+                   int readonly);
+
 /* Number of grant table frames. Caller must hold d's grant table lock. */
 static inline unsigned int nr_grant_frames(struct grant_table *gt)
 {
@@ -27,4 +27,24 @@
 #define __clear_guest(hnd, nr)                          \
     __clear_guest_offset(hnd, 0, nr)
 
+/*
+ * As __copy_from_guest(), for bulk copies read by another cpu: where the
+ * arch can the destination is written with non-temporal stores.
+ */
+#define __copy_from_guest_nt(ptr, hnd, nr) ({           \
+    const typeof(*(ptr)) *_s = (hnd).p;                 \
+    typeof(*(ptr)) *_d = (ptr);                         \
+    __raw_copy_from_guest_nt(_d, _s, sizeof(*_d)*(nr)); \
+})
+
+/*
+ * As __copy_from_guest(), for copies of more than a few cache lines:
+ * where the arch can with a copy that is faster for those.
+ */
+#define __copy_from_guest_large(ptr, hnd, nr) ({           \
+    const typeof(*(ptr)) *_s = (hnd).p;                    \
+    typeof(*(ptr)) *_d = (ptr);                            \
+    __raw_copy_from_guest_large(_d, _s, sizeof(*_d)*(nr)); \
+})
+
 #endif /* __XEN_GUEST_ACCESS_H__ */
@@ -75,6 +75,10 @@ void iommu_teardown(struct domain *d);
 int iommu_map_page(struct domain *d, unsigned long gfn, unsigned long mfn,
                    unsigned int flags);
 int iommu_unmap_page(struct domain *d, unsigned long gfn);
+/* The same for count contiguous pages, with one IOTLB flush for them all */
+int iommu_map_pages(struct domain *d, unsigned long gfn, unsigned long mfn,
+                    unsigned long count, unsigned int flags);
+int iommu_unmap_pages(struct domain *d, unsigned long gfn, unsigned long count);
 
 enum iommu_feature
 {
@@ -144,6 +148,10 @@ struct iommu_ops {
     int (*map_page)(struct domain *d, unsigned long gfn, unsigned long mfn,
                     unsigned int flags);
     int (*unmap_page)(struct domain *d, unsigned long gfn);
+    /* Optional, -EOPNOTSUPP for an order the IOMMU cannot map at once */
+    int (*map_superpage)(struct domain *d, unsigned long gfn,
+                         unsigned long mfn, unsigned int order,
+                         unsigned int flags);
     void (*free_page_table)(struct page_info *);
 #ifdef CONFIG_X86
     void (*update_ire_from_apic)(unsigned int apic, unsigned int reg, unsigned int value);
@@ -190,5 +198,6 @@ DECLARE_PER_CPU(bool_t, iommu_dont_flush_iotlb);
 
 extern struct spinlock iommu_pt_cleanup_lock;
 extern struct page_list_head iommu_pt_cleanup_list;
+void iommu_pt_cleanup(void);
 
 #endif /* _IOMMU_H_ */
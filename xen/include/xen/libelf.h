@@ -289,6 +289,9 @@ void elf_memset_safe(struct elf_binary*, elf_ptrval dst, int c, size_t);
 
 bool elf_access_ok(struct elf_binary * elf,
                    uint64_t ptrval, size_t size);
+bool elf_ptrval_in_range(elf_ptrval ptrval, uint64_t size,
+                         const void *region, uint64_t regionsize);
+  /* the check behind elf_access_ok(), without marking elf broken */
 
 #define elf_store_val(elf, type, ptr, val)                              \
     ({                                                                  \
@@ -369,6 +372,29 @@ void elf_set_log(struct elf_binary *elf, elf_log_callback*,
 void elf_parse_binary(struct elf_binary *elf);
 elf_errorstatus elf_load_binary(struct elf_binary *elf);
 
+struct elf_segment {
+    elf_ptrval dest;
+    elf_ptrval src;
+    uint64_t filesz, memsz;
+};
+
+struct elf_load_cursor {
+    uint64_t index;
+    uint64_t remain_allow_copy;
+};
+
+void elf_load_start(struct elf_binary *elf, struct elf_load_cursor *cur);
+bool elf_load_next(struct elf_binary *elf, struct elf_load_cursor *cur,
+                   struct elf_segment *seg);
+void elf_load_bsdsyms(struct elf_binary *elf);
+  /*
+   * elf_load_binary() is elf_load_next() over every loadable segment,
+   * copying each one in, followed by elf_load_bsdsyms().  Callers
+   * which copy the segments themselves must check the ranges (the
+   * cursor only enforces the overall copy limit) and then call
+   * elf_load_bsdsyms().
+   */
+
 elf_ptrval elf_get_ptr(struct elf_binary *elf, unsigned long addr);
 uint64_t elf_lookup_addr(struct elf_binary *elf, const char *symbol);
 
@@ -78,6 +78,7 @@ int query_page_offline(unsigned long mfn, uint32_t *status);
 unsigned long total_free_pages(void);
 
 void scrub_heap_pages(void);
+bool_t scrub_free_pages(void);
 
 int assign_pages(
     struct domain *d,
@@ -104,12 +105,6 @@ void arch_dump_shared_mem_info(void);
 #define _MEMF_bits        24
 #define  MEMF_bits(n)     ((n)<<_MEMF_bits)
 
-#ifdef CONFIG_PAGEALLOC_MAX_ORDER
-#define MAX_ORDER CONFIG_PAGEALLOC_MAX_ORDER
-#else
-#define MAX_ORDER 20 /* 2^20 contiguous pages */
-#endif
-
 #define page_list_entry list_head
 
 #include <asm/mm.h>
@@ -151,6 +146,11 @@ page_list_first(const struct page_list_head *head)
     return head->next;
 }
 static inline struct page_info *
+page_list_last(const struct page_list_head *head)
+{
+    return head->tail;
+}
+static inline struct page_info *
 page_list_next(const struct page_info *page,
                const struct page_list_head *head)
 {
@@ -310,6 +310,8 @@ page_list_splice(struct page_list_head *list, struct page_list_head *head)
 # define page_list_empty                 list_empty
 # define page_list_first(hd)             list_entry((hd)->next, \
                                                     struct page_info, list)
+# define page_list_last(hd)              list_entry((hd)->prev, \
+                                                    struct page_info, list)
 # define page_list_next(pg, hd)          list_entry((pg)->list.next, \
                                                     struct page_info, list)
 # define page_list_add(pg, hd)           list_add(&(pg)->list, hd)
@@ -8,6 +8,10 @@ PERFCOUNTER_ARRAY(hypercalls,           "hypercalls", NR_hypercalls)
 
 PERFCOUNTER(calls_to_multicall,         "calls to multicall")
 PERFCOUNTER(calls_from_multicall,       "calls from multicall")
+PERFCOUNTER_ARRAY(multicall_subcalls,   "multicall subcalls", NR_hypercalls)
+PERFCOUNTER_ARRAY(multicall_subcall_kcycles, "multicall subcall kcycles", NR_hypercalls)
+PERFCOUNTER(multicall_preempted,        "multicall preemptions")
+PERFCOUNTER(multicall_softirqs,         "multicall softirqs run in place")
 
 PERFCOUNTER(irqs,                   "#interrupts")
 PERFCOUNTER(ipis,                   "#IPIs")
@@ -53,4 +57,13 @@ PERFCOUNTER(vcpu_hot,               "csched: vcpu_hot")
 
 PERFCOUNTER(need_flush_tlb_flush,   "PG_need_flush tlb flushes")
 
+PERFCOUNTER(maptrack_slow,          "gnttab: maptrack vcpu list empty")
+PERFCOUNTER(maptrack_steal,         "gnttab: maptrack entries stolen")
+PERFCOUNTER(maptrack_steal_failed,  "gnttab: maptrack steals failed")
+
+/* One per xmalloc magazine size class */
+PERFCOUNTER_ARRAY(xmalloc_mag_hit,    "xmalloc: magazine hits", 5)
+PERFCOUNTER_ARRAY(xmalloc_mag_refill, "xmalloc: magazine refills", 5)
+PERFCOUNTER_ARRAY(xmalloc_mag_flush,  "xmalloc: magazine flushes", 5)
+
 /*#endif*/ /* __XEN_PERFC_DEFN_H__ */
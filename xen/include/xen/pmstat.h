@@ -14,4 +14,11 @@ int pmstat_reset_cx_stat(uint32_t cpuid);
 int do_get_pm_info(struct xen_sysctl_get_pmstat *op);
 int do_pm_op(struct xen_sysctl_pm_op *op);
 
+/* common/core_parking.c */
+long core_parking_helper(void *data);
+uint32_t get_cur_idle_nums(void);
+uint32_t get_requested_idle_nums(void);
+unsigned int core_parking_get_policy(void);
+int core_parking_set_policy(unsigned int id);
+
 #endif /* __XEN_PMSTAT_H_ */
@@ -163,12 +163,16 @@ struct scheduler {
 
     void         (*tick_suspend)    (const struct scheduler *, unsigned int);
     void         (*tick_resume)     (const struct scheduler *, unsigned int);
+
+    /* Any vcpu waiting to run on the cpu? Called with its lock held. */
+    int          (*runq_waiting)    (const struct scheduler *, unsigned int);
 };
 
 extern const struct scheduler sched_sedf_def;
 extern const struct scheduler sched_credit_def;
 extern const struct scheduler sched_credit2_def;
 extern const struct scheduler sched_arinc653_def;
+extern const struct scheduler sched_rtds_def;
 
 
 struct cpupool
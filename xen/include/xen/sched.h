@@ -80,6 +80,11 @@ extern domid_t hardware_domid;
 
 struct evtchn
 {
+    /*
+     * Sending takes only this lock. State changes take it as well as the
+     * domain's event_lock, and the remote channel's too when bound.
+     */
+    spinlock_t lock;
 #define ECS_FREE         0 /* Channel is available for use.                  */
 #define ECS_RESERVED     1 /* Channel is reserved.                           */
 #define ECS_UNBOUND      2 /* Channel is waiting to bind to a remote domain. */
@@ -110,6 +115,11 @@ struct evtchn
     u8 priority;
     u8 last_priority;
     u16 last_vcpu_id;
+#ifdef EVTCHN_STATS
+    /* Times the port was set pending, see XEN_SYSCTL_evtchn_hotports. */
+    u32 sends;
+    u32 last_sends;        /* ->sends at the previous query */
+#endif
 #ifdef XSM_ENABLE
     union {
 #ifdef XSM_NEED_GENERIC_EVTCHN_SSID
@@ -245,6 +255,25 @@ struct vcpu
 
     struct evtchn_fifo_vcpu *evtchn_fifo;
 
+    /* Free maptrack entries of the domain's grant table for this VCPU. */
+    unsigned int     maptrack_head;
+    unsigned int     maptrack_tail;
+    /* Grant table ops issued by the VCPU, see XEN_SYSCTL_gnttab_domstats. */
+    struct {
+        uint64_t     map_ops, unmap_ops, copy_ops, copy_bytes;
+        uint64_t     lock_contended, lock_wait_ns;
+        uint64_t     maptrack_steals;
+    } gnttab_stats;
+    /* Scheduling latency, see XEN_SYSCTL_sched_vcpustats. */
+    struct {
+        uint64_t     wakeups, preemptions, migrations;
+        uint64_t     waits, wait_ns, wait_max_ns;
+        uint64_t     wait_hist[XEN_SYSCTL_SCHED_WAIT_BUCKETS];
+    } sched_stats;
+
+    /* v4v: the domain last sent to, with a reference, see v4v_dst_get() */
+    struct domain   *v4v_dst;
+
     struct arch_vcpu arch;
 };
 
@@ -276,6 +305,8 @@ struct mem_event_domain
     unsigned int blocked;
     /* The last vcpu woken up */
     unsigned int last_vcpu_wake_up;
+    /* the only vcpu putting requests on a per-vCPU ring */
+    struct vcpu *vcpu;
 };
 
 struct mem_event_per_domain
@@ -286,6 +317,9 @@ struct mem_event_per_domain
     struct mem_event_domain paging;
     /* Memory access support */
     struct mem_event_domain access;
+    /* Memory access support, one ring per vCPU sharing access_port */
+    struct mem_event_domain *access_vcpu;
+    int access_port;
 };
 
 struct evtchn_port_ops;
@@ -336,6 +370,9 @@ struct domain
     spinlock_t       event_lock;
     const struct evtchn_port_ops *evtchn_port_ops;
     struct evtchn_fifo_domain *evtchn_fifo;
+#ifdef EVTCHN_STATS
+    s_time_t         evtchn_stats_stamp; /* previous hotports query */
+#endif
 
     struct grant_table *grant_table;
 
@@ -370,6 +407,8 @@ struct domain
     int              controller_pause_count;
     /* Domain's VCPUs are pinned 1:1 to physical CPUs? */
     bool_t           is_pinned;
+    /* Wakeups raise the pCPU's frequency? (XEN_DOMCTL_set_latency_hint) */
+    bool_t           latency_sensitive;
 
     /* Are any VCPUs polling event channels (SCHEDOP_poll)? */
 #if MAX_VIRT_CPUS <= BITS_PER_LONG
@@ -449,6 +488,10 @@ struct domain
     unsigned int last_alloc_node;
     spinlock_t node_affinity_lock;
 
+    /* Virtual NUMA topology, as seen by the guest; NULL for none. */
+    struct vnuma_info *vnuma;
+    rwlock_t vnuma_rwlock;
+
     /* v4v */
     struct v4v_domain *v4v;
 };
@@ -632,12 +675,36 @@ void sched_destroy_vcpu(struct vcpu *v);
 int  sched_init_domain(struct domain *d);
 void sched_destroy_domain(struct domain *d);
 int sched_move_domain(struct domain *d, struct cpupool *c);
+/* Scheduler data for a domain changing cpupool, see sched_move_domain() */
+struct sched_move_data {
+    struct scheduler *ops;
+    void *domdata;
+    void **vcpu_priv;
+    unsigned int nr_vcpus;
+};
+int sched_move_domain_alloc(struct domain *d, struct cpupool *c,
+                            struct sched_move_data *m);
+int sched_move_domain_commit(struct domain *d, struct cpupool *c,
+                             struct sched_move_data *m);
+void sched_move_domain_free(struct sched_move_data *m);
 long sched_adjust(struct domain *, struct xen_domctl_scheduler_op *);
 long sched_adjust_global(struct xen_sysctl_scheduler_op *);
+int  sched_vcpustats(struct domain *, struct xen_sysctl_sched_vcpustats *);
+void sched_domstats(struct domain *, struct xen_sysctl_sched_vcpustat *);
 int  sched_id(void);
 void sched_tick_suspend(void);
 void sched_tick_resume(void);
 void vcpu_wake(struct vcpu *v);
+/* Are vcpus waiting for cpu, according to its scheduler? */
+int sched_runq_waiting(unsigned int cpu);
+
+#ifdef HAS_CPUFREQ
+/* A vcpu woke up on cpu, see XEN_DOMCTL_set_latency_hint */
+void cpufreq_wakeup_boost(unsigned int cpu, bool_t latency_sensitive);
+#else
+static inline void cpufreq_wakeup_boost(unsigned int cpu,
+                                        bool_t latency_sensitive) {}
+#endif
 void vcpu_sleep_nosync(struct vcpu *v);
 void vcpu_sleep_sync(struct vcpu *v);
 
@@ -796,6 +863,9 @@ void vcpu_force_reschedule(struct vcpu *v);
 int cpu_disable_scheduler(unsigned int cpu);
 int vcpu_set_hard_affinity(struct vcpu *v, const cpumask_t *affinity);
 int vcpu_set_soft_affinity(struct vcpu *v, const cpumask_t *affinity);
+int vcpu_set_affinity_bulk(struct domain *d, unsigned int first,
+                           unsigned int nr, const cpumask_t *hard,
+                           const cpumask_t *soft);
 void restore_vcpu_affinity(struct domain *d);
 
 void vcpu_runstate_get(struct vcpu *v, struct vcpu_runstate_info *runstate);
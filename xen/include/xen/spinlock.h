@@ -54,19 +54,36 @@ struct lock_debug { };
     - removing of a structure is done via
 
       lock_profile_deregister_struct(type, ptr);
+
+    Read-write locks are covered the same way, through DEFINE_RWLOCK and
+    rwlock_init_prof(ptr, lock).  Only their writers are accounted hold
+    times; with readers racing to update them, their counts are
+    approximate.
+
+    Profiling can be stopped and started again at run time, through
+    XEN_SYSCTL_lockprof_op or the "lock_profile" boot parameter.
 */
 
 struct spinlock;
+struct rwlock;
 
 struct lock_profile {
     struct lock_profile *next;       /* forward link */
     char                *name;       /* lock name */
-    struct spinlock     *lock;       /* the lock itself */
+    union {
+        struct spinlock *lock;       /* the lock itself */
+        struct rwlock   *rwlock;     /* or, if is_rw, the rwlock */
+    } u;
+    bool_t              is_rw;
     u64                 lock_cnt;    /* # of complete locking ops */
     u64                 block_cnt;   /* # of complete wait for lock */
     s64                 time_hold;   /* cumulated lock time */
     s64                 time_block;  /* cumulated wait time */
-    s64                 time_locked; /* system time of last locking */
+    s64                 time_locked; /* system time of last locking, or 0 */
+    void                *lock_site;  /* caller of the last locking */
+    s64                 hold_max;    /* longest hold */
+    void                *hold_max_site; /* and the caller that took it */
+    u64                 block_hist[LOCKPROF_HIST_N]; /* waits by duration */
 };
 
 struct lock_profile_qhead {
@@ -75,7 +92,8 @@ struct lock_profile_qhead {
     int32_t                   idx;     /* index for printout */
 };
 
-#define _LOCK_PROFILE(name) { 0, #name, &name, 0, 0, 0, 0, 0 }
+#define _LOCK_PROFILE(l) { .name = #l, .u.lock = &l }
+#define _RW_LOCK_PROFILE(l) { .name = #l, .u.rwlock = &l, .is_rw = 1 }
 #define _LOCK_PROFILE_PTR(name)                                               \
     static struct lock_profile *__lock_profile_##name                         \
     __used_section(".lockprofile.data") =                                     \
@@ -92,14 +110,40 @@ struct lock_profile_qhead {
     do {                                                                      \
         struct lock_profile *prof;                                            \
         prof = xzalloc(struct lock_profile);                                  \
-        if (!prof) break;                                                     \
+        if (!prof) {                                                          \
+            spin_lock_init(&(s)->l);                                          \
+            break;                                                            \
+        }                                                                     \
         prof->name = #l;                                                      \
-        prof->lock = &(s)->l;                                                 \
+        prof->u.lock = &(s)->l;                                               \
         (s)->l = (spinlock_t)_SPIN_LOCK_UNLOCKED(prof);                       \
         prof->next = (s)->profile_head.elem_q;                                \
         (s)->profile_head.elem_q = prof;                                      \
     } while(0)
 
+#define _RW_LOCK_UNLOCKED(x) { _RAW_RW_LOCK_UNLOCKED, _LOCK_DEBUG, x }
+#define RW_LOCK_UNLOCKED _RW_LOCK_UNLOCKED(NULL)
+#define DEFINE_RWLOCK(l)                                                      \
+    rwlock_t l = _RW_LOCK_UNLOCKED(NULL);                                     \
+    static struct lock_profile __lock_profile_data_##l = _RW_LOCK_PROFILE(l); \
+    _LOCK_PROFILE_PTR(l)
+
+#define rwlock_init_prof(s, l)                                                \
+    do {                                                                      \
+        struct lock_profile *prof;                                            \
+        prof = xzalloc(struct lock_profile);                                  \
+        if (!prof) {                                                          \
+            rwlock_init(&(s)->l);                                             \
+            break;                                                            \
+        }                                                                     \
+        prof->name = #l;                                                      \
+        prof->u.rwlock = &(s)->l;                                             \
+        prof->is_rw = 1;                                                      \
+        (s)->l = (rwlock_t)_RW_LOCK_UNLOCKED(prof);                           \
+        prof->next = (s)->profile_head.elem_q;                                \
+        (s)->profile_head.elem_q = prof;                                      \
+    } while(0)
+
 void _lock_profile_register_struct(
     int32_t, struct lock_profile_qhead *, int32_t, char *);
 void _lock_profile_deregister_struct(int32_t, struct lock_profile_qhead *);
@@ -122,6 +166,9 @@ struct lock_profile_qhead { };
 #define DEFINE_SPINLOCK(l) spinlock_t l = SPIN_LOCK_UNLOCKED
 
 #define spin_lock_init_prof(s, l) spin_lock_init(&((s)->l))
+#define RW_LOCK_UNLOCKED { _RAW_RW_LOCK_UNLOCKED, _LOCK_DEBUG }
+#define DEFINE_RWLOCK(l) rwlock_t l = RW_LOCK_UNLOCKED
+#define rwlock_init_prof(s, l) rwlock_init(&((s)->l))
 #define lock_profile_register_struct(type, ptr, idx, print)
 #define lock_profile_deregister_struct(type, ptr)
 
@@ -140,13 +187,14 @@ typedef struct spinlock {
 
 #define spin_lock_init(l) (*(l) = (spinlock_t)SPIN_LOCK_UNLOCKED)
 
-typedef struct {
+typedef struct rwlock {
     raw_rwlock_t raw;
     struct lock_debug debug;
+#ifdef LOCK_PROFILE
+    struct lock_profile *profile;
+#endif
 } rwlock_t;
 
-#define RW_LOCK_UNLOCKED { _RAW_RW_LOCK_UNLOCKED, _LOCK_DEBUG }
-#define DEFINE_RWLOCK(l) rwlock_t l = RW_LOCK_UNLOCKED
 #define rwlock_init(l) (*(l) = (rwlock_t)RW_LOCK_UNLOCKED)
 
 void _spin_lock(spinlock_t *lock);
@@ -198,6 +198,20 @@ static inline int tmem_page_cmp(struct page_info *pfp1, struct page_info *pfp2)
     return rc;
 }
 
+/* Fingerprint of dedup candidates, so that pages mostly differ without
+ * comparing them */
+extern uint32_t tmem_crc32c(uint32_t crc, const void *buf, size_t len);
+
+static inline uint32_t tmem_pfp_fingerprint(struct page_info *pfp, pagesize_t len)
+{
+    const void *p = __map_domain_page(pfp);
+    uint32_t crc = tmem_crc32c(~0U, p, len);
+
+    unmap_domain_page(p);
+
+    return crc;
+}
+
 static inline int tmem_pcd_cmp(void *va1, pagesize_t len1, void *va2, pagesize_t len2)
 {
     const char *p1 = (char *)va1;
@@ -30,6 +30,14 @@ struct v4v_domain;
 
 void v4v_destroy(struct domain *d);
 int v4v_init(struct domain *d);
+struct xen_sysctl_v4v_domstats;
+int v4v_domstats(struct domain *d, struct xen_sysctl_v4v_domstats *st);
+struct xen_domctl_v4v_rings;
+int v4v_rings_op(struct domain *d, struct xen_domctl_v4v_rings *r);
+struct xen_domctl_v4v_set_quota;
+int v4v_set_quota(struct domain *d, struct xen_domctl_v4v_set_quota *q);
+/* the XSM policy changed, forget what it let v4v senders do */
+void v4v_policy_changed(void);
 long do_v4v_op (int cmd,
                 XEN_GUEST_HANDLE (void) arg1,
                 XEN_GUEST_HANDLE (void) arg2,
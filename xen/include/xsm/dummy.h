@@ -187,6 +187,20 @@ static XSM_INLINE int xsm_grant_query_size(XSM_DEFAULT_ARG struct domain *d1, st
     return xsm_default_action(action, d1, d2);
 }
 
+static XSM_INLINE int xsm_v4v_register(XSM_DEFAULT_ARG struct domain *d,
+                                       struct domain *partner)
+{
+    XSM_ASSERT_ACTION(XSM_HOOK);
+    return xsm_default_action(action, d, partner);
+}
+
+static XSM_INLINE int xsm_v4v_send(XSM_DEFAULT_ARG struct domain *src,
+                                   struct domain *dst)
+{
+    XSM_ASSERT_ACTION(XSM_HOOK);
+    return xsm_default_action(action, src, dst);
+}
+
 static XSM_INLINE int xsm_memory_exchange(XSM_DEFAULT_ARG struct domain *d)
 {
     XSM_ASSERT_ACTION(XSM_TARGET);
@@ -77,6 +77,9 @@ struct xsm_operations {
     int (*grant_copy) (struct domain *d1, struct domain *d2);
     int (*grant_query_size) (struct domain *d1, struct domain *d2);
 
+    int (*v4v_register) (struct domain *d, struct domain *partner);
+    int (*v4v_send) (struct domain *src, struct domain *dst);
+
     int (*alloc_security_domain) (struct domain *d);
     void (*free_security_domain) (struct domain *d);
     int (*alloc_security_evtchn) (struct evtchn *chn);
@@ -287,6 +290,18 @@ static inline int xsm_grant_query_size (xsm_default_t def, struct domain *d1, st
     return xsm_ops->grant_query_size(d1, d2);
 }
 
+static inline int xsm_v4v_register (xsm_default_t def, struct domain *d,
+                                    struct domain *partner)
+{
+    return xsm_ops->v4v_register(d, partner);
+}
+
+static inline int xsm_v4v_send (xsm_default_t def, struct domain *src,
+                                struct domain *dst)
+{
+    return xsm_ops->v4v_send(src, dst);
+}
+
 static inline int xsm_alloc_security_domain (struct domain *d)
 {
     return xsm_ops->alloc_security_domain(d);
@@ -53,6 +53,9 @@ void xsm_fixup_ops (struct xsm_operations *ops)
     set_to_dummy_if_null(ops, grant_copy);
     set_to_dummy_if_null(ops, grant_query_size);
 
+    set_to_dummy_if_null(ops, v4v_register);
+    set_to_dummy_if_null(ops, v4v_send);
+
     set_to_dummy_if_null(ops, alloc_security_domain);
     set_to_dummy_if_null(ops, free_security_domain);
     set_to_dummy_if_null(ops, alloc_security_evtchn);
@@ -52,17 +52,23 @@ const struct selinux_class_perm selinux_class_perm = {
     .cts_len = ARRAY_SIZE(class_to_string),
 };
 
-#define AVC_CACHE_SLOTS            512
-#define AVC_DEF_CACHE_THRESHOLD        512
+#define AVC_DEF_CACHE_SLOTS        512
+#define AVC_MAX_CACHE_SLOTS        65536
 #define AVC_CACHE_RECLAIM        16
+#define AVC_LOOKASIDE_SLOTS        8
 
 #ifdef FLASK_AVC_STATS
 #define avc_cache_stats_incr(field)                 \
 do {                                \
     __get_cpu_var(avc_cache_stats).field++;        \
 } while (0)
+#define avc_hist_incr(hist, n)                      \
+do {                                \
+    __get_cpu_var(avc_cache_hist).hist[avc_hist_bucket(n)]++;  \
+} while (0)
 #else
 #define avc_cache_stats_incr(field)    do {} while (0)
+#define avc_hist_incr(hist, n)         do {} while (0)
 #endif
 
 struct avc_entry {
@@ -79,13 +85,30 @@ struct avc_node {
 };
 
 struct avc_cache {
-    struct hlist_head    slots[AVC_CACHE_SLOTS]; /* head for avc_node->list */
-    spinlock_t        slots_lock[AVC_CACHE_SLOTS]; /* lock for writes */
+    struct hlist_head    *slots; /* head for avc_node->list */
+    spinlock_t        *slots_lock; /* lock for writes */
     atomic_t        lru_hint;    /* LRU hint for reclaim scan */
     atomic_t        active_nodes;
+    atomic_t        generation;    /* bumped when a decision changes */
     u32            latest_notif;    /* latest revocation notification */
 };
 
+/*
+ * The last few decisions made on each CPU, in front of the shared cache.
+ * An entry is only good while the cache generation it was taken at is
+ * current: replacing or updating a node, and resetting the cache, move
+ * the generation on.  Nodes dropped by reclaim leave their decisions
+ * valid, so reclaim does not.
+ */
+struct avc_lookaside {
+    bool_t            valid;
+    u16            tclass;
+    u32            ssid;
+    u32            tsid;
+    u32            generation;
+    struct av_decision    avd;
+};
+
 struct avc_callback_node {
     int (*callback) (u32 event, u32 ssid, u32 tsid,
                      u16 tclass, u32 perms,
@@ -98,23 +121,39 @@ struct avc_callback_node {
     struct avc_callback_node *next;
 };
 
-/* Exported via Flask hypercall */
-unsigned int avc_cache_threshold = AVC_DEF_CACHE_THRESHOLD;
+/* Number of hash slots, rounded down to a power of two. */
+static unsigned int __initdata opt_avc_slots = AVC_DEF_CACHE_SLOTS;
+integer_param("flask_avc_slots", opt_avc_slots);
+static unsigned int avc_cache_slots;
+
+/* Exported via Flask hypercall; defaults to the number of slots. */
+unsigned int avc_cache_threshold;
+integer_param("flask_avc_threshold", avc_cache_threshold);
 
 #ifdef FLASK_AVC_STATS
 DEFINE_PER_CPU(struct avc_cache_stats, avc_cache_stats);
+DEFINE_PER_CPU(struct avc_cache_hist, avc_cache_hist);
 #endif
 
 static struct avc_cache avc_cache;
 static struct avc_callback_node *avc_callbacks;
+static DEFINE_PER_CPU(struct avc_lookaside, avc_lookaside[AVC_LOOKASIDE_SLOTS]);
 
 static DEFINE_RCU_READ_LOCK(avc_rcu_lock);
 
 static inline int avc_hash(u32 ssid, u32 tsid, u16 tclass)
 {
-    return (ssid ^ (tsid<<2) ^ (tclass<<4)) & (AVC_CACHE_SLOTS - 1);
+    return (ssid ^ (tsid<<2) ^ (tclass<<4)) & (avc_cache_slots - 1);
 }
 
+#ifdef FLASK_AVC_STATS
+/* Buckets for 0, 1, 2-3, 4-7 and 8 or more. */
+static inline unsigned int avc_hist_bucket(unsigned int n)
+{
+    return n < 2 ? n : min_t(unsigned int, fls(n), AVC_HIST_BUCKETS - 1);
+}
+#endif
+
 /* no use making this larger than the printk buffer */
 #define AVC_BUF_SIZE 1024
 static DEFINE_SPINLOCK(avc_emerg_lock);
@@ -244,15 +283,29 @@ void __init avc_init(void)
 {
     int i;
 
-    for ( i = 0; i < AVC_CACHE_SLOTS; i++ )
+    avc_cache_slots = min_t(unsigned int, opt_avc_slots, AVC_MAX_CACHE_SLOTS);
+    if ( avc_cache_slots == 0 )
+        avc_cache_slots = AVC_DEF_CACHE_SLOTS;
+    avc_cache_slots = 1U << (fls(avc_cache_slots) - 1);
+    if ( avc_cache_threshold == 0 )
+        avc_cache_threshold = avc_cache_slots;
+
+    avc_cache.slots = xmalloc_array(struct hlist_head, avc_cache_slots);
+    avc_cache.slots_lock = xmalloc_array(spinlock_t, avc_cache_slots);
+    if ( !avc_cache.slots || !avc_cache.slots_lock )
+        panic("AVC: cannot allocate %u hash slots\n", avc_cache_slots);
+
+    for ( i = 0; i < avc_cache_slots; i++ )
     {
         INIT_HLIST_HEAD(&avc_cache.slots[i]);
         spin_lock_init(&avc_cache.slots_lock[i]);
     }
     atomic_set(&avc_cache.active_nodes, 0);
     atomic_set(&avc_cache.lru_hint, 0);
+    atomic_set(&avc_cache.generation, 0);
 
-    printk("AVC INITIALIZED\n");
+    printk("AVC INITIALIZED: %u slots, threshold %u\n",
+           avc_cache_slots, avc_cache_threshold);
 }
 
 int avc_get_hash_stats(struct xen_flask_hash_stats *arg)
@@ -265,7 +318,7 @@ int avc_get_hash_stats(struct xen_flask_hash_stats *arg)
 
     slots_used = 0;
     max_chain_len = 0;
-    for ( i = 0; i < AVC_CACHE_SLOTS; i++ )
+    for ( i = 0; i < avc_cache_slots; i++ )
     {
         head = &avc_cache.slots[i];
         if ( !hlist_empty(head) )
@@ -285,7 +338,7 @@ int avc_get_hash_stats(struct xen_flask_hash_stats *arg)
     
     arg->entries = atomic_read(&avc_cache.active_nodes);
     arg->buckets_used = slots_used;
-    arg->buckets_total = AVC_CACHE_SLOTS;
+    arg->buckets_total = avc_cache_slots;
     arg->max_chain_len = max_chain_len;
 
     return 0;
@@ -317,6 +370,8 @@ static void avc_node_replace(struct avc_node *new, struct avc_node *old)
     hlist_replace_rcu(&old->list, &new->list);
     call_rcu(&old->rhead, avc_node_free);
     atomic_dec(&avc_cache.active_nodes);
+    /* After the replacement, see avc_lookaside_fill(). */
+    atomic_inc(&avc_cache.generation);
 }
 
 static inline int avc_reclaim_node(void)
@@ -328,10 +383,10 @@ static inline int avc_reclaim_node(void)
     struct hlist_node *next;
     spinlock_t *lock;
 
-    for ( try = 0, ecx = 0; try < AVC_CACHE_SLOTS; try++ )
+    for ( try = 0, ecx = 0; try < avc_cache_slots; try++ )
     {
         atomic_inc(&avc_cache.lru_hint);
-        hvalue =  atomic_read(&avc_cache.lru_hint) & (AVC_CACHE_SLOTS - 1);
+        hvalue =  atomic_read(&avc_cache.lru_hint) & (avc_cache_slots - 1);
         head = &avc_cache.slots[hvalue];
         lock = &avc_cache.slots_lock[hvalue];
 
@@ -353,6 +408,7 @@ static inline int avc_reclaim_node(void)
         spin_unlock_irqrestore(lock, flags);
     }    
  out:
+    avc_hist_incr(reclaim, try + 1);
     return ecx;
 }
 
@@ -385,17 +441,20 @@ static void avc_node_populate(struct avc_node *node, u32 ssid, u32 tsid,
     memcpy(&node->ae.avd, avd, sizeof(node->ae.avd));
 }
 
-static inline struct avc_node *avc_search_node(u32 ssid, u32 tsid, u16 tclass)
+static inline struct avc_node *avc_search_node(u32 ssid, u32 tsid, u16 tclass,
+                                               unsigned int *depth)
 {
     struct avc_node *node, *ret = NULL;
     int hvalue;
     struct hlist_head *head;
     struct hlist_node *next;
 
+    *depth = 0;
     hvalue = avc_hash(ssid, tsid, tclass);
     head = &avc_cache.slots[hvalue];
     hlist_for_each_entry_rcu(node, next, head, list)
     {
+        ++*depth;
         if ( ssid == node->ae.ssid &&
              tclass == node->ae.tclass &&
              tsid == node->ae.tsid )
@@ -425,18 +484,77 @@ static inline struct avc_node *avc_search_node(u32 ssid, u32 tsid, u16 tclass)
 static struct avc_node *avc_lookup(u32 ssid, u32 tsid, u16 tclass)
 {
     struct avc_node *node;
+    unsigned int depth;
 
     avc_cache_stats_incr(lookups);
-    node = avc_search_node(ssid, tsid, tclass);
+    node = avc_search_node(ssid, tsid, tclass, &depth);
 
     if ( node )
+    {
         avc_cache_stats_incr(hits);
+        avc_hist_incr(hit, depth);
+    }
     else
+    {
         avc_cache_stats_incr(misses);
+        avc_hist_incr(miss, depth);
+    }
 
     return node;
 }
 
+static inline struct avc_lookaside *avc_lookaside_slot(u32 ssid, u32 tsid,
+                                                       u16 tclass)
+{
+    return &this_cpu(avc_lookaside)[(ssid ^ tsid ^ tclass) &
+                                    (AVC_LOOKASIDE_SLOTS - 1)];
+}
+
+/*
+ * Copy the decision for (@ssid, @tsid, @tclass) into @avd if this CPU
+ * made it recently.  Entries are only written by their own CPU; valid
+ * brackets the update in case of a check from an interrupt handler.
+ */
+static int avc_lookaside_lookup(u32 ssid, u32 tsid, u16 tclass, u32 gen,
+                                struct av_decision *avd)
+{
+    struct avc_lookaside *la = avc_lookaside_slot(ssid, tsid, tclass);
+
+    if ( !la->valid || la->generation != gen || la->ssid != ssid ||
+         la->tsid != tsid || la->tclass != tclass )
+        return 0;
+    *avd = la->avd;
+    barrier();
+    if ( !la->valid )
+        return 0;
+
+    avc_cache_stats_incr(lookups);
+    avc_cache_stats_incr(hits);
+    avc_hist_incr(hit, 0);
+    return 1;
+}
+
+/*
+ * @gen must have been read before the decision was looked up or computed:
+ * writers move the generation on after changing the cache, so a decision
+ * that is stale by now is recorded under an old generation.
+ */
+static void avc_lookaside_fill(u32 ssid, u32 tsid, u16 tclass, u32 gen,
+                               const struct av_decision *avd)
+{
+    struct avc_lookaside *la = avc_lookaside_slot(ssid, tsid, tclass);
+
+    la->valid = 0;
+    barrier();
+    la->ssid = ssid;
+    la->tsid = tsid;
+    la->tclass = tclass;
+    la->generation = gen;
+    la->avd = *avd;
+    barrier();
+    la->valid = 1;
+}
+
 static int avc_latest_notif_update(int seqno, int is_insert)
 {
     int ret = 0;
@@ -757,7 +875,7 @@ int avc_ss_reset(u32 seqno)
     struct hlist_node *next;
     spinlock_t *lock;
 
-    for ( i = 0; i < AVC_CACHE_SLOTS; i++ )
+    for ( i = 0; i < avc_cache_slots; i++ )
     {
         head = &avc_cache.slots[i];
         lock = &avc_cache.slots_lock[i];
@@ -769,6 +887,7 @@ int avc_ss_reset(u32 seqno)
         rcu_read_unlock(&avc_rcu_lock);
         spin_unlock_irqrestore(lock, flag);
     }
+    atomic_inc(&avc_cache.generation);
     
     for ( c = avc_callbacks; c; c = c->next )
     {
@@ -812,33 +931,37 @@ int avc_has_perm_noaudit(u32 ssid, u32 tsid, u16 tclass, u32 requested,
     struct avc_node *node;
     struct av_decision avd_entry, *avd;
     int rc = 0;
-    u32 denied;
+    u32 denied, gen;
 
     BUG_ON(!requested);
 
+    avd = in_avd ? in_avd : &avd_entry;
+
+    gen = atomic_read(&avc_cache.generation);
+    smp_rmb();
+
     rcu_read_lock(&avc_rcu_lock);
 
+    if ( avc_lookaside_lookup(ssid, tsid, tclass, gen, avd) )
+        goto decided;
+
     node = avc_lookup(ssid, tsid, tclass);
     if ( !node )
     {
         rcu_read_unlock(&avc_rcu_lock);
 
-        if ( in_avd )
-            avd = in_avd;
-        else
-            avd = &avd_entry;
-
         rc = security_compute_av(ssid,tsid,tclass,requested,avd);
         if ( rc )
             goto out;
         rcu_read_lock(&avc_rcu_lock);
         node = avc_insert(ssid,tsid,tclass,avd);
-    } else {
-        if ( in_avd )
-            memcpy(in_avd, &node->ae.avd, sizeof(*in_avd));
-        avd = &node->ae.avd;
-    }
+    } else
+        memcpy(avd, &node->ae.avd, sizeof(*avd));
+
+    if ( node )
+        avc_lookaside_fill(ssid, tsid, tclass, gen, avd);
 
+ decided:
     denied = requested & ~(avd->allowed);
 
     if ( denied )
@@ -12,6 +12,7 @@
 #include <xen/event.h>
 #include <xsm/xsm.h>
 #include <xen/guest_access.h>
+#include <xen/v4v.h>
 
 #include <public/xsm/flask_op.h>
 
@@ -48,6 +49,7 @@ integer_param("flask_enabled", flask_enabled);
         1UL<<FLASK_SETBOOL | \
         1UL<<FLASK_AVC_HASHSTATS | \
         1UL<<FLASK_AVC_CACHESTATS | \
+        1UL<<FLASK_AVC_HISTOGRAM | \
         1UL<<FLASK_MEMBER | \
         1UL<<FLASK_GET_PEER_SID | \
    0)
@@ -212,6 +214,8 @@ static int flask_security_setenforce(struct xen_flask_setenforce *arg)
 
     if ( flask_enforcing )
         avc_ss_reset(0);
+    /* what permissive mode let through or not is cached by v4v */
+    v4v_policy_changed();
 
     return 0;
 }
@@ -499,6 +503,40 @@ static int flask_security_avc_cachestats(struct xen_flask_cache_stats *arg)
     return 0;
 }
 
+static int flask_security_avc_histogram(struct xen_flask_avc_histogram *arg)
+{
+    struct avc_cache_hist *h;
+    const unsigned int *buckets;
+
+    BUILD_BUG_ON(AVC_HIST_BUCKETS != XEN_FLASK_AVC_HIST_BUCKETS);
+
+    if ( arg->cpu >= nr_cpu_ids )
+        return -ENOENT;
+    if ( !cpu_online(arg->cpu) )
+        return -ENOENT;
+
+    h = &per_cpu(avc_cache_hist, arg->cpu);
+
+    switch ( arg->type )
+    {
+    case FLASK_AVC_HIST_HIT:
+        buckets = h->hit;
+        break;
+    case FLASK_AVC_HIST_MISS:
+        buckets = h->miss;
+        break;
+    case FLASK_AVC_HIST_RECLAIM:
+        buckets = h->reclaim;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    memcpy(arg->buckets, buckets, sizeof(arg->buckets));
+
+    return 0;
+}
+
 #endif
 #endif /* COMPAT */
 
@@ -649,6 +687,7 @@ static int flask_relabel_domain(struct xen_flask_relabel *arg)
         security_transition_sid(tsec->sid, dsec->sid, SECCLASS_DOMAIN,
                                 &dsec->target_sid);
     }
+    v4v_policy_changed();
 
  out:
     rcu_unlock_domain(d);
@@ -746,6 +785,10 @@ ret_t do_flask_op(XEN_GUEST_HANDLE_PARAM(xsm_op_t) u_flask_op)
     case FLASK_AVC_CACHESTATS:
         rv = flask_security_avc_cachestats(&op.u.cache_stats);
         break;
+
+    case FLASK_AVC_HISTOGRAM:
+        rv = flask_security_avc_histogram(&op.u.avc_histogram);
+        break;
 #endif
 
     case FLASK_MEMBER:
@@ -795,6 +838,7 @@ ret_t do_flask_op(XEN_GUEST_HANDLE_PARAM(xsm_op_t) u_flask_op)
 #include <compat/xsm/flask_op.h>
 
 CHECK_flask_access;
+CHECK_flask_avc_histogram;
 CHECK_flask_cache_stats;
 CHECK_flask_hash_stats;
 CHECK_flask_ocontext;
@@ -20,6 +20,7 @@
 #include <xen/errno.h>
 #include <xen/guest_access.h>
 #include <xen/xenoprof.h>
+#include <xen/v4v.h>
 #ifdef HAS_PCI
 #include <asm/msi.h>
 #endif
@@ -368,6 +369,28 @@ static int flask_grant_query_size(struct domain *d1, struct domain *d2)
     return domain_has_perm(d1, d2, SECCLASS_GRANT, GRANT__QUERY);
 }
 
+static int flask_v4v_register(struct domain *d, struct domain *partner)
+{
+    /* a ring any domain may send to, or one for a domain not there yet */
+    if ( !partner )
+        return domain_has_perm(d, d, SECCLASS_V4V, V4V__REGISTER_ANY);
+
+    return domain_has_perm(d, partner, SECCLASS_V4V, V4V__REGISTER);
+}
+
+static int flask_v4v_send(struct domain *src, struct domain *dst)
+{
+    return domain_has_perm(src, dst, SECCLASS_V4V, V4V__SEND);
+}
+
+/* v4v caches what v4v_send allowed, it must look again */
+static int flask_v4v_avc_reset(u32 event, u32 ssid, u32 tsid, u16 tclass,
+                               u32 perms, u32 *out_retained)
+{
+    v4v_policy_changed();
+    return 0;
+}
+
 static int flask_get_pod_target(struct domain *d)
 {
     return current_has_perm(d, SECCLASS_DOMAIN, DOMAIN__GETPODTARGET);
@@ -574,6 +597,7 @@ static int flask_domctl(struct domain *d, int cmd)
 #ifdef CONFIG_X86
     /* These have individual XSM hooks (arch/x86/domctl.c) */
     case XEN_DOMCTL_shadow_op:
+    case XEN_DOMCTL_log_dirty_extents:
     case XEN_DOMCTL_ioport_permission:
     case XEN_DOMCTL_bind_pt_irq:
     case XEN_DOMCTL_unbind_pt_irq:
@@ -598,6 +622,7 @@ static int flask_domctl(struct domain *d, int cmd)
         return current_has_perm(d, SECCLASS_DOMAIN, DOMAIN__UNPAUSE);
 
     case XEN_DOMCTL_setvcpuaffinity:
+    case XEN_DOMCTL_setvcpuaffinity_bulk:
     case XEN_DOMCTL_setnodeaffinity:
         return current_has_perm(d, SECCLASS_DOMAIN, DOMAIN__SETAFFINITY);
 
@@ -709,12 +734,27 @@ static int flask_domctl(struct domain *d, int cmd)
     case XEN_DOMCTL_audit_p2m:
         return current_has_perm(d, SECCLASS_HVM, HVM__AUDIT_P2M);
 
+    case XEN_DOMCTL_p2m_coalesce:
+        return current_has_perm(d, SECCLASS_HVM, HVM__P2M_COALESCE);
+
+    case XEN_DOMCTL_set_latency_hint:
+        return current_has_perm(d, SECCLASS_DOMAIN2, DOMAIN2__SETSCHEDULER);
+
+    case XEN_DOMCTL_setvnumainfo:
+        return current_has_perm(d, SECCLASS_DOMAIN2, DOMAIN2__SET_VNUMAINFO);
+
     case XEN_DOMCTL_set_max_evtchn:
         return current_has_perm(d, SECCLASS_DOMAIN2, DOMAIN2__SET_MAX_EVTCHN);
 
     case XEN_DOMCTL_cacheflush:
         return current_has_perm(d, SECCLASS_DOMAIN2, DOMAIN2__CACHEFLUSH);
 
+    case XEN_DOMCTL_v4v_rings:
+        return current_has_perm(d, SECCLASS_DOMAIN2, DOMAIN2__V4V_RINGS);
+
+    case XEN_DOMCTL_v4v_set_quota:
+        return current_has_perm(d, SECCLASS_DOMAIN2, DOMAIN2__V4V_SET_QUOTA);
+
     default:
         printk("flask_domctl: Unknown op %d\n", cmd);
         return -EPERM;
@@ -730,6 +770,11 @@ static int flask_sysctl(int cmd)
     case XEN_SYSCTL_getdomaininfolist:
     case XEN_SYSCTL_page_offline_op:
     case XEN_SYSCTL_scheduler_op:
+    case XEN_SYSCTL_v4v_domstats:
+    case XEN_SYSCTL_gnttab_domstats:
+    case XEN_SYSCTL_sched_vcpustats:
+    case XEN_SYSCTL_evtchn_hotports:
+    case XEN_SYSCTL_domstats:
 #ifdef CONFIG_X86
     case XEN_SYSCTL_cpu_hotplug:
 #endif
@@ -1101,6 +1146,7 @@ static int flask_hvm_param(struct domain *d, unsigned long op)
         perm = HVM__GETPARAM;
         break;
     case HVMOP_track_dirty_vram:
+    case HVMOP_track_dirty_stdvga:
         perm = HVM__TRACKDIRTYVRAM;
         break;
     default:
@@ -1503,6 +1549,9 @@ static struct xsm_operations flask_ops = {
     .grant_copy = flask_grant_copy,
     .grant_query_size = flask_grant_query_size,
 
+    .v4v_register = flask_v4v_register,
+    .v4v_send = flask_v4v_send,
+
     .alloc_security_domain = flask_domain_alloc_security,
     .free_security_domain = flask_domain_free_security,
     .alloc_security_evtchn = flask_alloc_security_evtchn,
@@ -1606,6 +1655,10 @@ static __init int flask_init(void)
     printk("Flask:  Initializing.\n");
 
     avc_init();
+    if ( avc_add_callback(flask_v4v_avc_reset, AVC_CALLBACK_RESET,
+                          SECSID_WILD, SECSID_WILD, SECCLASS_V4V,
+                          V4V__SEND) )
+        panic("Flask: Unable to register the v4v AVC callback");
 
     original_ops = xsm_ops;
     if ( register_xsm(&flask_ops) )
@@ -0,0 +1,169 @@
+/* This file is automatically generated.  Do not edit. */
+#define XEN__SETTIME                              0x00000001UL
+#define XEN__TBUFCONTROL                          0x00000002UL
+#define XEN__READCONSOLE                          0x00000004UL
+#define XEN__CLEARCONSOLE                         0x00000008UL
+#define XEN__PERFCONTROL                          0x00000010UL
+#define XEN__MTRR_ADD                             0x00000020UL
+#define XEN__MTRR_DEL                             0x00000040UL
+#define XEN__MTRR_READ                            0x00000080UL
+#define XEN__MICROCODE                            0x00000100UL
+#define XEN__PHYSINFO                             0x00000200UL
+#define XEN__QUIRK                                0x00000400UL
+#define XEN__WRITECONSOLE                         0x00000800UL
+#define XEN__READAPIC                             0x00001000UL
+#define XEN__WRITEAPIC                            0x00002000UL
+#define XEN__PRIVPROFILE                          0x00004000UL
+#define XEN__NONPRIVPROFILE                       0x00008000UL
+#define XEN__KEXEC                                0x00010000UL
+#define XEN__FIRMWARE                             0x00020000UL
+#define XEN__SLEEP                                0x00040000UL
+#define XEN__FREQUENCY                            0x00080000UL
+#define XEN__GETIDLE                              0x00100000UL
+#define XEN__DEBUG                                0x00200000UL
+#define XEN__GETCPUINFO                           0x00400000UL
+#define XEN__HEAP                                 0x00800000UL
+#define XEN__PM_OP                                0x01000000UL
+#define XEN__MCA_OP                               0x02000000UL
+#define XEN__LOCKPROF                             0x04000000UL
+#define XEN__CPUPOOL_OP                           0x08000000UL
+#define XEN__TMEM_OP                              0x10000000UL
+#define XEN__TMEM_CONTROL                         0x20000000UL
+#define XEN__GETSCHEDULER                         0x40000000UL
+#define XEN__SETSCHEDULER                         0x80000000UL
+
+#define DOMAIN__SETVCPUCONTEXT                    0x00000001UL
+#define DOMAIN__PAUSE                             0x00000002UL
+#define DOMAIN__UNPAUSE                           0x00000004UL
+#define DOMAIN__RESUME                            0x00000008UL
+#define DOMAIN__CREATE                            0x00000010UL
+#define DOMAIN__TRANSITION                        0x00000020UL
+#define DOMAIN__MAX_VCPUS                         0x00000040UL
+#define DOMAIN__DESTROY                           0x00000080UL
+#define DOMAIN__SETAFFINITY                       0x00000100UL
+#define DOMAIN__GETAFFINITY                       0x00000200UL
+#define DOMAIN__GETSCHEDULER                      0x00000400UL
+#define DOMAIN__GETDOMAININFO                     0x00000800UL
+#define DOMAIN__GETVCPUINFO                       0x00001000UL
+#define DOMAIN__GETVCPUCONTEXT                    0x00002000UL
+#define DOMAIN__SETDOMAINMAXMEM                   0x00004000UL
+#define DOMAIN__SETDOMAINHANDLE                   0x00008000UL
+#define DOMAIN__SETDEBUGGING                      0x00010000UL
+#define DOMAIN__HYPERCALL                         0x00020000UL
+#define DOMAIN__SETTIME                           0x00040000UL
+#define DOMAIN__SET_TARGET                        0x00080000UL
+#define DOMAIN__SHUTDOWN                          0x00100000UL
+#define DOMAIN__SETADDRSIZE                       0x00200000UL
+#define DOMAIN__GETADDRSIZE                       0x00400000UL
+#define DOMAIN__TRIGGER                           0x00800000UL
+#define DOMAIN__GETEXTVCPUCONTEXT                 0x01000000UL
+#define DOMAIN__SETEXTVCPUCONTEXT                 0x02000000UL
+#define DOMAIN__GETVCPUEXTSTATE                   0x04000000UL
+#define DOMAIN__SETVCPUEXTSTATE                   0x08000000UL
+#define DOMAIN__GETPODTARGET                      0x10000000UL
+#define DOMAIN__SETPODTARGET                      0x20000000UL
+#define DOMAIN__SET_MISC_INFO                     0x40000000UL
+#define DOMAIN__SET_VIRQ_HANDLER                  0x80000000UL
+
+#define DOMAIN2__RELABELFROM                      0x00000001UL
+#define DOMAIN2__RELABELTO                        0x00000002UL
+#define DOMAIN2__RELABELSELF                      0x00000004UL
+#define DOMAIN2__MAKE_PRIV_FOR                    0x00000008UL
+#define DOMAIN2__SET_AS_TARGET                    0x00000010UL
+#define DOMAIN2__SET_CPUID                        0x00000020UL
+#define DOMAIN2__GETTSC                           0x00000040UL
+#define DOMAIN2__SETTSC                           0x00000080UL
+#define DOMAIN2__SETSCHEDULER                     0x00000100UL
+#define DOMAIN2__SETCLAIM                         0x00000200UL
+#define DOMAIN2__SET_MAX_EVTCHN                   0x00000400UL
+#define DOMAIN2__CACHEFLUSH                       0x00000800UL
+#define DOMAIN2__V4V_RINGS                        0x00001000UL
+#define DOMAIN2__V4V_SET_QUOTA                    0x00002000UL
+#define DOMAIN2__SET_VNUMAINFO                    0x00004000UL
+#define DOMAIN2__CREATE_HARDWARE_DOMAIN           0x00008000UL
+
+#define HVM__SETHVMC                              0x00000001UL
+#define HVM__GETHVMC                              0x00000002UL
+#define HVM__SETPARAM                             0x00000004UL
+#define HVM__GETPARAM                             0x00000008UL
+#define HVM__PCILEVEL                             0x00000010UL
+#define HVM__IRQLEVEL                             0x00000020UL
+#define HVM__PCIROUTE                             0x00000040UL
+#define HVM__BIND_IRQ                             0x00000080UL
+#define HVM__CACHEATTR                            0x00000100UL
+#define HVM__TRACKDIRTYVRAM                       0x00000200UL
+#define HVM__HVMCTL                               0x00000400UL
+#define HVM__MEM_EVENT                            0x00000800UL
+#define HVM__MEM_SHARING                          0x00001000UL
+#define HVM__AUDIT_P2M                            0x00002000UL
+#define HVM__SEND_IRQ                             0x00004000UL
+#define HVM__SHARE_MEM                            0x00008000UL
+#define HVM__NESTED                               0x00010000UL
+#define HVM__P2M_COALESCE                         0x00020000UL
+
+#define EVENT__BIND                               0x00000001UL
+#define EVENT__SEND                               0x00000002UL
+#define EVENT__STATUS                             0x00000004UL
+#define EVENT__CREATE                             0x00000008UL
+#define EVENT__RESET                              0x00000010UL
+
+#define GRANT__MAP_READ                           0x00000001UL
+#define GRANT__MAP_WRITE                          0x00000002UL
+#define GRANT__UNMAP                              0x00000004UL
+#define GRANT__TRANSFER                           0x00000008UL
+#define GRANT__SETUP                              0x00000010UL
+#define GRANT__COPY                               0x00000020UL
+#define GRANT__QUERY                              0x00000040UL
+
+#define MMU__MAP_READ                             0x00000001UL
+#define MMU__MAP_WRITE                            0x00000002UL
+#define MMU__PAGEINFO                             0x00000004UL
+#define MMU__PAGELIST                             0x00000008UL
+#define MMU__ADJUST                               0x00000010UL
+#define MMU__STAT                                 0x00000020UL
+#define MMU__UPDATEMP                             0x00000040UL
+#define MMU__PHYSMAP                              0x00000080UL
+#define MMU__PINPAGE                              0x00000100UL
+#define MMU__MEMORYMAP                            0x00000200UL
+#define MMU__REMOTE_REMAP                         0x00000400UL
+#define MMU__MMUEXT_OP                            0x00000800UL
+#define MMU__EXCHANGE                             0x00001000UL
+#define MMU__TARGET_HACK                          0x00002000UL
+
+#define SHADOW__DISABLE                           0x00000001UL
+#define SHADOW__ENABLE                            0x00000002UL
+#define SHADOW__LOGDIRTY                          0x00000004UL
+
+#define RESOURCE__ADD                             0x00000001UL
+#define RESOURCE__REMOVE                          0x00000002UL
+#define RESOURCE__USE                             0x00000004UL
+#define RESOURCE__ADD_IRQ                         0x00000008UL
+#define RESOURCE__REMOVE_IRQ                      0x00000010UL
+#define RESOURCE__ADD_IOPORT                      0x00000020UL
+#define RESOURCE__REMOVE_IOPORT                   0x00000040UL
+#define RESOURCE__ADD_IOMEM                       0x00000080UL
+#define RESOURCE__REMOVE_IOMEM                    0x00000100UL
+#define RESOURCE__STAT_DEVICE                     0x00000200UL
+#define RESOURCE__ADD_DEVICE                      0x00000400UL
+#define RESOURCE__REMOVE_DEVICE                   0x00000800UL
+#define RESOURCE__PLUG                            0x00001000UL
+#define RESOURCE__UNPLUG                          0x00002000UL
+#define RESOURCE__SETUP                           0x00004000UL
+
+#define SECURITY__COMPUTE_AV                      0x00000001UL
+#define SECURITY__COMPUTE_CREATE                  0x00000002UL
+#define SECURITY__COMPUTE_MEMBER                  0x00000004UL
+#define SECURITY__CHECK_CONTEXT                   0x00000008UL
+#define SECURITY__LOAD_POLICY                     0x00000010UL
+#define SECURITY__COMPUTE_RELABEL                 0x00000020UL
+#define SECURITY__COMPUTE_USER                    0x00000040UL
+#define SECURITY__SETENFORCE                      0x00000080UL
+#define SECURITY__SETBOOL                         0x00000100UL
+#define SECURITY__SETSECPARAM                     0x00000200UL
+#define SECURITY__ADD_OCONTEXT                    0x00000400UL
+#define SECURITY__DEL_OCONTEXT                    0x00000800UL
+
+#define V4V__REGISTER                             0x00000001UL
+#define V4V__REGISTER_ANY                         0x00000002UL
+#define V4V__SEND                                 0x00000004UL
+
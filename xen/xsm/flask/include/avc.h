@@ -77,6 +77,16 @@ struct avc_cache_stats
     unsigned int frees;
 };
 
+/* Buckets of 0, 1, 2-3, 4-7 and 8+, as reported by FLASK_AVC_HISTOGRAM */
+#define AVC_HIST_BUCKETS 5
+
+struct avc_cache_hist
+{
+    unsigned int hit[AVC_HIST_BUCKETS];
+    unsigned int miss[AVC_HIST_BUCKETS];
+    unsigned int reclaim[AVC_HIST_BUCKETS];
+};
+
 /*
  * AVC operations
  */
@@ -112,6 +122,7 @@ extern unsigned int avc_cache_threshold;
 
 #ifdef FLASK_AVC_STATS
 DECLARE_PER_CPU(struct avc_cache_stats, avc_cache_stats);
+DECLARE_PER_CPU(struct avc_cache_hist, avc_cache_hist);
 #endif
 
 #endif /* _FLASK_AVC_H_ */